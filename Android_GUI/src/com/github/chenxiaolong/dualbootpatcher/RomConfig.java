@@ -49,6 +49,7 @@ public class RomConfig {
     private String mName;
     private boolean mIndivAppSharing;
     private HashMap<String, SharedItems> mSharedPkgs = new HashMap<>();
+    private boolean mBootReadahead;
 
     public static class SharedItems {
         public boolean sharedData;
@@ -127,6 +128,14 @@ public class RomConfig {
         mIndivAppSharing = enabled;
     }
 
+    public boolean isBootReadaheadEnabled() {
+        return mBootReadahead;
+    }
+
+    public void setBootReadaheadEnabled(boolean enabled) {
+        mBootReadahead = enabled;
+    }
+
     @NonNull
     public HashMap<String, SharedItems> getIndivAppSharingPackages() {
         HashMap<String, SharedItems> result = new HashMap<>();
@@ -148,6 +157,7 @@ public class RomConfig {
 
         root.id = mId;
         root.name = mName;
+        root.bootReadahead = mBootReadahead;
 
         root.appSharing = new RawAppSharing();
         root.appSharing.individual = mIndivAppSharing;
@@ -175,6 +185,7 @@ public class RomConfig {
 
         mId = root.id;
         mName = root.name;
+        mBootReadahead = root.bootReadahead;
 
         if (root.appSharing != null) {
             mIndivAppSharing = root.appSharing.individual;
@@ -198,6 +209,8 @@ public class RomConfig {
         String name;
         @SerializedName("app_sharing")
         RawAppSharing appSharing;
+        @SerializedName("boot_readahead")
+        boolean bootReadahead;
     }
 
     private static class RawAppSharing {
@@ -27,6 +27,7 @@ import com.github.chenxiaolong.dualbootpatcher.nativelib.LibMbPatcher.CWrapper.C
 import com.github.chenxiaolong.dualbootpatcher.nativelib.LibMbPatcher.CWrapper.CFileInfo;
 import com.github.chenxiaolong.dualbootpatcher.nativelib.LibMbPatcher.CWrapper.CPatcher;
 import com.github.chenxiaolong.dualbootpatcher.nativelib.LibMbPatcher.CWrapper.CPatcherConfig;
+import com.github.chenxiaolong.dualbootpatcher.nativelib.LibMbPatcher.CWrapper.CPatcherProgress;
 import com.github.chenxiaolong.dualbootpatcher.nativelib.libmiscstuff.LibMiscStuff;
 import com.sun.jna.Callback;
 import com.sun.jna.Native;
@@ -57,6 +58,8 @@ public class LibMbPatcher {
 
         public static class CPatcher extends PointerType {}
         public static class CAutoPatcher extends PointerType {}
+
+        public static class CPatcherProgress extends PointerType {}
         // END: ctypes.h
 
         // BEGIN: cfileinfo.h
@@ -78,8 +81,10 @@ public class LibMbPatcher {
         static native /* ErrorCode */ int mbpatcher_config_error(CPatcherConfig pc);
         static native Pointer mbpatcher_config_data_directory(CPatcherConfig pc);
         static native Pointer mbpatcher_config_temp_directory(CPatcherConfig pc);
+        static native Pointer mbpatcher_config_cache_directory(CPatcherConfig pc);
         static native void mbpatcher_config_set_data_directory(CPatcherConfig pc, String path);
         static native void mbpatcher_config_set_temp_directory(CPatcherConfig pc, String path);
+        static native void mbpatcher_config_set_cache_directory(CPatcherConfig pc, String path);
         static native Pointer mbpatcher_config_patchers(CPatcherConfig pc);
         static native Pointer mbpatcher_config_autopatchers(CPatcherConfig pc);
         static native CPatcher mbpatcher_config_create_patcher(CPatcherConfig pc, String id);
@@ -105,8 +110,13 @@ public class LibMbPatcher {
         static native Pointer mbpatcher_patcher_id(CPatcher patcher);
         static native void mbpatcher_patcher_set_fileinfo(CPatcher patcher, CFileInfo info);
         static native boolean mbpatcher_patcher_patch_file(CPatcher patcher, ProgressUpdatedCallback progressCb, FilesUpdatedCallback filesCb, DetailsUpdatedCallback detailsCb, Pointer userData);
+        static native boolean mbpatcher_patcher_patch_file_polled(CPatcher patcher, CPatcherProgress progress, DetailsUpdatedCallback detailsCb, Pointer userData);
         static native void mbpatcher_patcher_cancel_patching(CPatcher patcher);
 
+        static native CPatcherProgress mbpatcher_progress_create();
+        static native void mbpatcher_progress_destroy(CPatcherProgress progress);
+        static native void mbpatcher_progress_get(CPatcherProgress progress, long[] values);
+
         static native /* ErrorCode */ int mbpatcher_autopatcher_error(CAutoPatcher patcher);
         static native Pointer mbpatcher_autopatcher_id(CAutoPatcher patcher);
         static native Pointer mbpatcher_autopatcher_new_files(CAutoPatcher patcher);
@@ -437,6 +447,12 @@ public class LibMbPatcher {
             return LibC.getStringAndFree(p);
         }
 
+        public String getCacheDirectory() {
+            validate(mCPatcherConfig, PatcherConfig.class, "getCacheDirectory");
+            Pointer p = CWrapper.mbpatcher_config_cache_directory(mCPatcherConfig);
+            return LibC.getStringAndFree(p);
+        }
+
         public void setDataDirectory(String path) {
             validate(mCPatcherConfig, PatcherConfig.class, "setDataDirectory", path);
             ensureNotNull(path);
@@ -451,6 +467,13 @@ public class LibMbPatcher {
             CWrapper.mbpatcher_config_set_temp_directory(mCPatcherConfig, path);
         }
 
+        public void setCacheDirectory(String path) {
+            validate(mCPatcherConfig, PatcherConfig.class, "setCacheDirectory", path);
+            ensureNotNull(path);
+
+            CWrapper.mbpatcher_config_set_cache_directory(mCPatcherConfig, path);
+        }
+
         public String[] getPatchers() {
             validate(mCPatcherConfig, PatcherConfig.class, "getPatchers");
             Pointer p = CWrapper.mbpatcher_config_patchers(mCPatcherConfig);
@@ -567,35 +590,31 @@ public class LibMbPatcher {
 
         public boolean patchFile(final ProgressListener listener) {
             validate(mCPatcher, Patcher.class, "patchFile", listener);
-            CWrapper.ProgressUpdatedCallback progressCb = null;
-            CWrapper.FilesUpdatedCallback filesCb = null;
-            CWrapper.DetailsUpdatedCallback detailsCb = null;
-
-            if (listener != null) {
-                progressCb = new CWrapper.ProgressUpdatedCallback() {
-                    @Override
-                    public void invoke(long bytes, long maxBytes, Pointer userData) {
-                        listener.onProgressUpdated(bytes, maxBytes);
-                    }
-                };
 
-                filesCb = new CWrapper.FilesUpdatedCallback() {
-                    @Override
-                    public void invoke(long files, long maxFiles, Pointer userData) {
-                        listener.onFilesUpdated(files, maxFiles);
-                    }
-                };
-
-                detailsCb = new CWrapper.DetailsUpdatedCallback() {
-                    @Override
-                    public void invoke(String text, Pointer userData) {
-                        listener.onDetailsUpdated(text);
-                    }
-                };
+            if (listener == null) {
+                return CWrapper.mbpatcher_patcher_patch_file(mCPatcher, null, null, null, null);
             }
 
-            return CWrapper.mbpatcher_patcher_patch_file(mCPatcher,
-                    progressCb, filesCb, detailsCb, null);
+            // Progress is updated far more often than it can be shown, so it is polled from the
+            // shared native counters instead of calling into Java for every update
+            CWrapper.DetailsUpdatedCallback detailsCb = new CWrapper.DetailsUpdatedCallback() {
+                @Override
+                public void invoke(String text, Pointer userData) {
+                    listener.onDetailsUpdated(text);
+                }
+            };
+
+            CPatcherProgress progress = CWrapper.mbpatcher_progress_create();
+            ProgressPoller poller = new ProgressPoller(progress, listener);
+            poller.start();
+
+            try {
+                return CWrapper.mbpatcher_patcher_patch_file_polled(mCPatcher, progress,
+                        detailsCb, null);
+            } finally {
+                poller.finish();
+                CWrapper.mbpatcher_progress_destroy(progress);
+            }
         }
 
         public void cancelPatching() {
@@ -610,6 +629,70 @@ public class LibMbPatcher {
 
             void onDetailsUpdated(String text);
         }
+
+        private static class ProgressPoller extends Thread {
+            private static final long POLL_INTERVAL_MS = 100;
+
+            private final CPatcherProgress mProgress;
+            private final ProgressListener mListener;
+            private final long[] mValues = new long[4];
+            private final long[] mLastValues = new long[4];
+            private volatile boolean mStop;
+
+            ProgressPoller(CPatcherProgress progress, ProgressListener listener) {
+                super("PatcherProgressPoller");
+                mProgress = progress;
+                mListener = listener;
+            }
+
+            @Override
+            public void run() {
+                while (!mStop) {
+                    poll();
+
+                    try {
+                        Thread.sleep(POLL_INTERVAL_MS);
+                    } catch (InterruptedException e) {
+                        break;
+                    }
+                }
+            }
+
+            /** Stop polling and report the final values on the calling thread */
+            void finish() {
+                mStop = true;
+                interrupt();
+
+                boolean interrupted = false;
+                while (true) {
+                    try {
+                        join();
+                        break;
+                    } catch (InterruptedException e) {
+                        interrupted = true;
+                    }
+                }
+
+                poll();
+
+                if (interrupted) {
+                    Thread.currentThread().interrupt();
+                }
+            }
+
+            private void poll() {
+                CWrapper.mbpatcher_progress_get(mProgress, mValues);
+
+                if (mValues[0] != mLastValues[0] || mValues[1] != mLastValues[1]) {
+                    mListener.onProgressUpdated(mValues[0], mValues[1]);
+                }
+                if (mValues[2] != mLastValues[2] || mValues[3] != mLastValues[3]) {
+                    mListener.onFilesUpdated(mValues[2], mValues[3]);
+                }
+
+                System.arraycopy(mValues, 0, mLastValues, 0, mValues.length);
+            }
+        }
     }
 
     public static class AutoPatcher implements Parcelable {
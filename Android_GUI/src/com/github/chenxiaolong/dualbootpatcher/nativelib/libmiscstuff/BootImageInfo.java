@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+package com.github.chenxiaolong.dualbootpatcher.nativelib.libmiscstuff;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.Charset;
+
+/**
+ * Boot image header and entry metadata, read with a single native call.
+ */
+public final class BootImageInfo {
+    // Large enough for all common boot images, so only one native call is needed
+    private static final int INITIAL_BUFFER_SIZE = 4096;
+
+    private static final Charset UTF_8 = Charset.forName("UTF-8");
+
+    public int format;
+    public long supportedFields;
+
+    public int pageSize;
+    public int kernelAddress;
+    public int ramdiskAddress;
+    public int secondbootAddress;
+    public int kernelTagsAddress;
+    public int sonyIplAddress;
+    public int sonyRpmAddress;
+    public int sonyAppsblAddress;
+    public int entrypointAddress;
+
+    public String boardName;
+    public String kernelCmdline;
+
+    public int[] entryTypes;
+    /** Size of each entry or -1 if unknown */
+    public long[] entrySizes;
+
+    private BootImageInfo() {
+    }
+
+    public static BootImageInfo read(String filename) throws IOException {
+        ByteBuffer buf = ByteBuffer.allocateDirect(INITIAL_BUFFER_SIZE);
+        int size = LibMiscStuff.getBootImageInfo(filename, buf);
+
+        if (size > buf.capacity()) {
+            buf = ByteBuffer.allocateDirect(size);
+            size = LibMiscStuff.getBootImageInfo(filename, buf);
+        }
+
+        buf.order(ByteOrder.nativeOrder());
+        buf.limit(size);
+
+        BootImageInfo info = new BootImageInfo();
+        info.format = buf.getInt();
+        int count = buf.getInt();
+        info.supportedFields = buf.getLong();
+
+        info.pageSize = buf.getInt();
+        info.kernelAddress = buf.getInt();
+        info.ramdiskAddress = buf.getInt();
+        info.secondbootAddress = buf.getInt();
+        info.kernelTagsAddress = buf.getInt();
+        info.sonyIplAddress = buf.getInt();
+        info.sonyRpmAddress = buf.getInt();
+        info.sonyAppsblAddress = buf.getInt();
+        info.entrypointAddress = buf.getInt();
+
+        info.boardName = getString(buf);
+        info.kernelCmdline = getString(buf);
+
+        info.entryTypes = new int[count];
+        info.entrySizes = new long[count];
+        for (int i = 0; i < count; i++) {
+            info.entryTypes[i] = buf.getInt();
+            info.entrySizes[i] = buf.getLong();
+        }
+
+        return info;
+    }
+
+    private static String getString(ByteBuffer buf) {
+        byte[] data = new byte[buf.getInt()];
+        buf.get(data);
+        return new String(data, UTF_8);
+    }
+}
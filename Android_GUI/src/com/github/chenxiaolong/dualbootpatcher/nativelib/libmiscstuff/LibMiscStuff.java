@@ -18,6 +18,7 @@
 package com.github.chenxiaolong.dualbootpatcher.nativelib.libmiscstuff;
 
 import java.io.IOException;
+import java.nio.ByteBuffer;
 
 @SuppressWarnings("JniMissingFunction")
 public final class LibMiscStuff {
@@ -32,6 +33,16 @@ public final class LibMiscStuff {
 
     public static native boolean bootImagesEqual(String filename1, String filename2) throws IOException;
 
+    /**
+     * Write the header and entry metadata of a boot image into a direct buffer.
+     *
+     * Use {@link BootImageInfo#read(String)} instead of calling this directly.
+     *
+     * @return Number of bytes required. If this is larger than the buffer's capacity, the call
+     *         should be retried with a larger buffer.
+     */
+    static native int getBootImageInfo(String filename, ByteBuffer buf) throws IOException;
+
     static {
         System.loadLibrary("miscstuff-jni");
     }
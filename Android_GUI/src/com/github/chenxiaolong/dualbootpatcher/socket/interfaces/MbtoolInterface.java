@@ -25,6 +25,7 @@ import com.github.chenxiaolong.dualbootpatcher.Version;
 import com.github.chenxiaolong.dualbootpatcher.socket.exceptions.MbtoolCommandException;
 import com.github.chenxiaolong.dualbootpatcher.socket.exceptions.MbtoolException;
 
+import java.io.FileDescriptor;
 import java.io.IOException;
 import java.nio.ByteBuffer;
 
@@ -70,6 +71,25 @@ public interface MbtoolInterface {
     int fileOpen(String path, short[] flags, int perms) throws IOException, MbtoolException,
             MbtoolCommandException;
 
+    /**
+     * Open a file and receive its file descriptor from the daemon
+     *
+     * The returned file descriptor is owned by the caller and can be read from and written to
+     * directly, which avoids copying the data through the daemon socket.
+     *
+     * @param path Path to file
+     * @param flags Flags (see {@link FileOpenFlag})
+     * @param perms File mode (ignored unless {@link FileOpenFlag#CREAT} is provided)
+     * @return File descriptor
+     * @throws IOException
+     * @throws MbtoolException
+     * @throws MbtoolCommandException If the file could not be opened or the daemon does not
+     *                                support sending file descriptors
+     */
+    @NonNull
+    FileDescriptor fileOpenFd(String path, short[] flags, int perms) throws IOException,
+            MbtoolException, MbtoolCommandException;
+
     /**
      * Read data from an opened file
      *
@@ -18,6 +18,7 @@
 package com.github.chenxiaolong.dualbootpatcher.socket.interfaces;
 
 import android.content.Context;
+import android.net.LocalSocket;
 import android.support.annotation.NonNull;
 import android.util.Log;
 
@@ -33,6 +34,7 @@ import com.github.chenxiaolong.dualbootpatcher.switcher.SwitcherUtils;
 import com.google.flatbuffers.FlatBufferBuilder;
 import com.google.flatbuffers.Table;
 
+import java.io.FileDescriptor;
 import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
@@ -134,8 +136,10 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
 
     private InputStream mIS;
     private OutputStream mOS;
+    private LocalSocket mSocket;
 
-    public MbtoolInterfaceV3(InputStream is, OutputStream os) {
+    public MbtoolInterfaceV3(LocalSocket socket, InputStream is, OutputStream os) {
+        mSocket = socket;
         mIS = is;
         mOS = os;
     }
@@ -349,6 +353,54 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
         return response.id();
     }
 
+    @NonNull
+    public synchronized FileDescriptor fileOpenFd(String path, short[] flags, int perms)
+            throws IOException, MbtoolException, MbtoolCommandException {
+        // Create request
+        FlatBufferBuilder builder = new FlatBufferBuilder(FBB_SIZE);
+
+        int fbPath = builder.createString(path);
+        int fbFlags = FileOpenRequest.createFlagsVector(builder, flags);
+
+        FileOpenRequest.startFileOpenRequest(builder);
+        FileOpenRequest.addPath(builder, fbPath);
+        FileOpenRequest.addFlags(builder, fbFlags);
+        FileOpenRequest.addPerms(builder, perms);
+        FileOpenRequest.addSendFd(builder, true);
+        int fbRequest = FileOpenRequest.endFileOpenRequest(builder);
+
+        // Send request
+        FileOpenResponse response = (FileOpenResponse)
+                sendRequest(builder, fbRequest, RequestType.FileOpenRequest,
+                        ResponseType.FileOpenResponse);
+
+        FileOpenError error = response.error();
+        if (error != null) {
+            throw new MbtoolCommandException(
+                    error.errnoValue(), "[" + path + "]: open failed: " + error.msg());
+        }
+
+        if (!response.fdSent()) {
+            // Older versions of mbtool ignore the send_fd field
+            fileClose(response.id());
+            throw new MbtoolCommandException(
+                    "[" + path + "]: daemon does not support sending file descriptors");
+        }
+
+        // The file descriptor is attached to a single byte following the response
+        if (mIS.read() < 0) {
+            throw new IOException("Unexpected EOF when receiving file descriptor");
+        }
+
+        FileDescriptor[] fds = mSocket.getAncillaryFileDescriptors();
+        if (fds == null || fds.length != 1) {
+            throw new MbtoolException(Reason.PROTOCOL_ERROR,
+                    "[" + path + "]: expected one file descriptor from daemon");
+        }
+
+        return fds[0];
+    }
+
     @NonNull
     public synchronized ByteBuffer fileRead(int id, long size) throws IOException, MbtoolException,
             MbtoolCommandException {
@@ -404,7 +404,9 @@ public class InAppFlashingFragment extends Fragment implements FirstUseDialogLis
         }
 
         for (DocumentFile file : files) {
-            if (file.isDirectory()) {
+            // Hidden directories, like the incremental backup chunk store, are
+            // not backups
+            if (file.isDirectory() && !file.getName().startsWith(".")) {
                 filenames.add(file.getName());
             }
         }
@@ -134,7 +134,8 @@ public final class MbtoolTask extends BaseServiceTask implements SignedExecOutpu
         }
     }
 
-    private boolean performRomInstallation(RomInstallerParams params, MbtoolInterface iface)
+    private boolean performRomInstallation(RomInstallerParams params, MbtoolInterface iface,
+                                           boolean keepChrootTemplate)
             throws IOException, MbtoolCommandException, MbtoolException {
         printSeparator();
 
@@ -215,6 +216,9 @@ public final class MbtoolTask extends BaseServiceTask implements SignedExecOutpu
             if (params.getAllowOverwrite()) {
                 argsList.add("--allow-overwrite");
             }
+            if (keepChrootTemplate) {
+                argsList.add("--chroot-template");
+            }
 
             String[] args = argsList.toArray(new String[argsList.size()]);
 
@@ -385,14 +389,24 @@ public final class MbtoolTask extends BaseServiceTask implements SignedExecOutpu
 
             printBoldText(Color.YELLOW, " connected\n");
 
-            for (MbtoolAction action : mActions) {
+            // Let mbtool reuse the chroot environment for all but the last installation
+            int lastRomInstaller = -1;
+            for (int i = 0; i < mActions.length; i++) {
+                if (mActions[i].getType() == MbtoolAction.Type.ROM_INSTALLER) {
+                    lastRomInstaller = i;
+                }
+            }
+
+            for (int i = 0; i < mActions.length; i++) {
+                MbtoolAction action = mActions[i];
                 attempted++;
 
                 boolean result;
 
                 switch (action.getType()) {
                 case ROM_INSTALLER:
-                    result = performRomInstallation(action.getRomInstallerParams(), iface);
+                    result = performRomInstallation(action.getRomInstallerParams(), iface,
+                            i < lastRomInstaller);
                     break;
                 case BACKUP_RESTORE:
                     result = performBackupRestore(action.getBackupRestoreParams(), iface);
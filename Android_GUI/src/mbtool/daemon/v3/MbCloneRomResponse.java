@@ -0,0 +1,38 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbCloneRomResponse extends Table {
+  public static MbCloneRomResponse getRootAsMbCloneRomResponse(ByteBuffer _bb) { return getRootAsMbCloneRomResponse(_bb, new MbCloneRomResponse()); }
+  public static MbCloneRomResponse getRootAsMbCloneRomResponse(ByteBuffer _bb, MbCloneRomResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbCloneRomResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public String romId() { int o = __offset(6); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer romIdAsByteBuffer() { return __vector_as_bytebuffer(6, 1); }
+
+  public static int createMbCloneRomResponse(FlatBufferBuilder builder,
+      boolean success,
+      int rom_idOffset) {
+    builder.startObject(2);
+    MbCloneRomResponse.addRomId(builder, rom_idOffset);
+    MbCloneRomResponse.addSuccess(builder, success);
+    return MbCloneRomResponse.endMbCloneRomResponse(builder);
+  }
+
+  public static void startMbCloneRomResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static void addRomId(FlatBufferBuilder builder, int romIdOffset) { builder.addOffset(1, romIdOffset, 0); }
+  public static int endMbCloneRomResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,45 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbGetStatsResponse extends Table {
+  public static MbGetStatsResponse getRootAsMbGetStatsResponse(ByteBuffer _bb) { return getRootAsMbGetStatsResponse(_bb, new MbGetStatsResponse()); }
+  public static MbGetStatsResponse getRootAsMbGetStatsResponse(ByteBuffer _bb, MbGetStatsResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbGetStatsResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public MbRequestStats requests(int j) { return requests(new MbRequestStats(), j); }
+  public MbRequestStats requests(MbRequestStats obj, int j) { int o = __offset(4); return o != 0 ? obj.__assign(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int requestsLength() { int o = __offset(4); return o != 0 ? __vector_len(o) : 0; }
+  public MbMetric metrics(int j) { return metrics(new MbMetric(), j); }
+  public MbMetric metrics(MbMetric obj, int j) { int o = __offset(6); return o != 0 ? obj.__assign(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int metricsLength() { int o = __offset(6); return o != 0 ? __vector_len(o) : 0; }
+
+  public static int createMbGetStatsResponse(FlatBufferBuilder builder,
+      int requestsOffset,
+      int metricsOffset) {
+    builder.startObject(2);
+    MbGetStatsResponse.addMetrics(builder, metricsOffset);
+    MbGetStatsResponse.addRequests(builder, requestsOffset);
+    return MbGetStatsResponse.endMbGetStatsResponse(builder);
+  }
+
+  public static void startMbGetStatsResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addRequests(FlatBufferBuilder builder, int requestsOffset) { builder.addOffset(0, requestsOffset, 0); }
+  public static int createRequestsVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startRequestsVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static void addMetrics(FlatBufferBuilder builder, int metricsOffset) { builder.addOffset(1, metricsOffset, 0); }
+  public static int createMetricsVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startMetricsVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static int endMbGetStatsResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,70 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbMetric extends Table {
+  public static MbMetric getRootAsMbMetric(ByteBuffer _bb) { return getRootAsMbMetric(_bb, new MbMetric()); }
+  public static MbMetric getRootAsMbMetric(ByteBuffer _bb, MbMetric obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbMetric __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String name() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer nameAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public int type() { int o = __offset(6); return o != 0 ? bb.get(o + bb_pos) & 0xFF : 0; }
+  public long value() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long count() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long sum() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long min() { int o = __offset(14); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long max() { int o = __offset(16); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long p50() { int o = __offset(18); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long p90() { int o = __offset(20); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long p99() { int o = __offset(22); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createMbMetric(FlatBufferBuilder builder,
+      int nameOffset,
+      int type,
+      long value,
+      long count,
+      long sum,
+      long min,
+      long max,
+      long p50,
+      long p90,
+      long p99) {
+    builder.startObject(10);
+    MbMetric.addP99(builder, p99);
+    MbMetric.addP90(builder, p90);
+    MbMetric.addP50(builder, p50);
+    MbMetric.addMax(builder, max);
+    MbMetric.addMin(builder, min);
+    MbMetric.addSum(builder, sum);
+    MbMetric.addCount(builder, count);
+    MbMetric.addValue(builder, value);
+    MbMetric.addName(builder, nameOffset);
+    MbMetric.addType(builder, type);
+    return MbMetric.endMbMetric(builder);
+  }
+
+  public static void startMbMetric(FlatBufferBuilder builder) { builder.startObject(10); }
+  public static void addName(FlatBufferBuilder builder, int nameOffset) { builder.addOffset(0, nameOffset, 0); }
+  public static void addType(FlatBufferBuilder builder, int type) { builder.addByte(1, (byte)type, (byte)0); }
+  public static void addValue(FlatBufferBuilder builder, long value) { builder.addLong(2, value, 0L); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(3, count, 0L); }
+  public static void addSum(FlatBufferBuilder builder, long sum) { builder.addLong(4, sum, 0L); }
+  public static void addMin(FlatBufferBuilder builder, long min) { builder.addLong(5, min, 0L); }
+  public static void addMax(FlatBufferBuilder builder, long max) { builder.addLong(6, max, 0L); }
+  public static void addP50(FlatBufferBuilder builder, long p50) { builder.addLong(7, p50, 0L); }
+  public static void addP90(FlatBufferBuilder builder, long p90) { builder.addLong(8, p90, 0L); }
+  public static void addP99(FlatBufferBuilder builder, long p99) { builder.addLong(9, p99, 0L); }
+  public static int endMbMetric(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
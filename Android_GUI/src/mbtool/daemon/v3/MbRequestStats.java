@@ -0,0 +1,45 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbRequestStats extends Table {
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb) { return getRootAsMbRequestStats(_bb, new MbRequestStats()); }
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb, MbRequestStats obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbRequestStats __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public int requestType() { int o = __offset(4); return o != 0 ? bb.get(o + bb_pos) & 0xFF : 0; }
+  public long count() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long totalTimeNs() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long maxTimeNs() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createMbRequestStats(FlatBufferBuilder builder,
+      int request_type,
+      long count,
+      long total_time_ns,
+      long max_time_ns) {
+    builder.startObject(4);
+    MbRequestStats.addMaxTimeNs(builder, max_time_ns);
+    MbRequestStats.addTotalTimeNs(builder, total_time_ns);
+    MbRequestStats.addCount(builder, count);
+    MbRequestStats.addRequestType(builder, request_type);
+    return MbRequestStats.endMbRequestStats(builder);
+  }
+
+  public static void startMbRequestStats(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void addRequestType(FlatBufferBuilder builder, int requestType) { builder.addByte(0, (byte)requestType, (byte)0); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(1, count, 0L); }
+  public static void addTotalTimeNs(FlatBufferBuilder builder, long totalTimeNs) { builder.addLong(2, totalTimeNs, 0L); }
+  public static void addMaxTimeNs(FlatBufferBuilder builder, long maxTimeNs) { builder.addLong(3, maxTimeNs, 0L); }
+  public static int endMbRequestStats(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -17,13 +17,20 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <cassert>
+#include <cinttypes>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
@@ -32,9 +39,20 @@
 
 #include <getopt.h>
 
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
 // libmbcommon
 #include <mbcommon/common.h>
 #include <mbcommon/libc/stdio.h>
+#include <mbcommon/string.h>
+#ifndef _WIN32
+#  include <mbcommon/file/mmap.h>
+#endif
 
 // libmbbootimg
 #include <mbbootimg/entry.h>
@@ -72,6 +90,9 @@
 #define IMAGE_RPM                       "rpm"
 #define IMAGE_APPSBL                    "appsbl"
 
+// Maximum number of bytes to copy per copy_file_range()/sendfile() call
+#define KERNEL_COPY_CHUNK_SIZE          (1024 * 1024 * 1024)
+
 
 typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
@@ -119,6 +140,7 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "Available commands:\n" \
     "  unpack         Unpack a boot image\n" \
     "  pack           Assemble boot image from unpacked files\n" \
+    "  batch          Unpack or pack many boot images at once\n" \
     "\n" \
     "Pass -h/--help as a argument to a command to see it's available options.\n"
 
@@ -137,6 +159,8 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "                  (one of: android, bump, loki, mtk, sonyelf)\n" \
     "  --output-<item> <item path>\n" \
     "                  Custom path for a particular item\n" \
+    "  --offsets-only  Print the location of each image in the boot image\n" \
+    "                  instead of extracting anything\n" \
     "\n" \
     "The following items are extracted from the boot image.\n" \
     "\n" \
@@ -163,6 +187,10 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "If the --output-<item>=<item path> option is specified, then that particular\n" \
     "item is unpacked to the specified <item path>.\n" \
     "\n" \
+    "If --offsets-only is specified, a \"<image> <offset> <size>\" line is printed\n" \
+    "for each image instead, where <offset> is the absolute byte offset of the\n" \
+    "image data in the boot image.\n" \
+    "\n" \
     "Examples:\n" \
     "\n" \
     "1. Unpack a boot image to the current directory\n" \
@@ -227,6 +255,48 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "        bootimgtool pack boot.img -i /tmp/android --input-kernel /tmp/newkernel\n" \
     "\n"
 
+#define HELP_BATCH_USAGE \
+    "Usage: bootimgtool batch [<option>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -m, --manifest <manifest file>\n" \
+    "                  Run the jobs listed in a manifest file\n" \
+    "  -d, --directory <input directory>\n" \
+    "                  Unpack every file in a directory\n" \
+    "  -o, --output <output directory>\n" \
+    "                  Output directory for --directory (current directory if\n" \
+    "                  unspecified)\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of images to process at once (number of CPUs if\n" \
+    "                  unspecified)\n" \
+    "\n" \
+    "Each worker thread has its own reader or writer and processes one image at\n" \
+    "a time, so at most <count> images are open at once. After all of the jobs\n" \
+    "have run, a summary of the timings for each boot image format is printed.\n" \
+    "\n" \
+    "Manifest format:\n" \
+    "\n" \
+    "The manifest is a list of jobs, one per line. Lines that are empty or begin\n" \
+    "with '#' are ignored. The fields of a job are separated by tabs:\n" \
+    "\n" \
+    "    unpack<TAB><input file><TAB><output directory>[<TAB><type>]\n" \
+    "    pack<TAB><output file><TAB><input directory>[<TAB><type>]\n" \
+    "\n" \
+    "The items are named like they are with the unpack and pack commands when no\n" \
+    "prefix is specified (ie. \"<file>-<item>\"). If <type> is omitted, unpack\n" \
+    "autodetects the format and pack creates a plain Android boot image.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Unpack every boot image in images/ to extracted/ using 4 threads\n" \
+    "\n" \
+    "        bootimgtool batch -d images -o extracted -j 4\n" \
+    "\n" \
+    "2. Run the jobs listed in jobs.txt\n" \
+    "\n" \
+    "        bootimgtool batch -m jobs.txt\n" \
+    "\n"
+
 template <typename F>
 class Finally {
 public:
@@ -463,7 +533,7 @@ static bool read_header(const std::string &path, MbBiHeader *header)
         char *ptr = line;
 
         // Skip leading whitespace
-        while (*ptr && isspace(*ptr)) {
+        while (*ptr && isspace(static_cast<unsigned char>(*ptr))) {
             ++ptr;
         }
 
@@ -737,7 +807,95 @@ static bool write_data_file_to_entry(const std::string &path, MbBiWriter *biw)
     return true;
 }
 
-static bool write_data_entry_to_file(const std::string &path, MbBiReader *bir)
+/*!
+ * \brief Open boot image for unpacking
+ *
+ * The image is memory mapped where possible so that entries can be written out
+ * without copying the data through the reader.
+ */
+static int open_input_file(MbBiReader *bir, const std::string &path)
+{
+#ifndef _WIN32
+    std::unique_ptr<mb::MmapFile> file(new(std::nothrow) mb::MmapFile(path));
+    if (file && file->is_open()) {
+        return mb_bi_reader_open(bir, file.release(), true);
+    }
+#endif
+
+    return mb_bi_reader_open_filename(bir, path.c_str());
+}
+
+#ifdef __linux__
+static bool is_copy_unsupported_error(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL
+            || error == EOPNOTSUPP;
+}
+
+/*!
+ * \brief Copy a byte range of the input image to a file in the kernel
+ *
+ * \return 1 if the data was copied, 0 if the kernel cannot copy between the
+ *         files and nothing was written, or -1 if an error occurs
+ */
+static int copy_range_to_fd(int fd_in, uint64_t offset, uint64_t size,
+                            int fd_out)
+{
+    off_t in_offset = static_cast<off_t>(offset);
+    uint64_t remain = size;
+#ifdef __NR_copy_file_range
+    bool use_copy_file_range = true;
+#endif
+
+    while (remain > 0) {
+        size_t chunk = std::min<uint64_t>(remain, KERNEL_COPY_CHUNK_SIZE);
+        ssize_t n;
+
+#ifdef __NR_copy_file_range
+        if (use_copy_file_range) {
+            loff_t off = in_offset;
+            n = syscall(__NR_copy_file_range, fd_in, &off, fd_out, nullptr,
+                        chunk, 0);
+            if (n < 0 && is_copy_unsupported_error(errno)) {
+                // Try sendfile() instead
+                use_copy_file_range = false;
+                continue;
+            }
+        } else
+#endif
+        {
+            off_t off = in_offset;
+            n = sendfile(fd_out, fd_in, &off, chunk);
+        }
+
+        if (n < 0) {
+            if (remain == size && is_copy_unsupported_error(errno)) {
+                return 0;
+            }
+            return -1;
+        } else if (n == 0) {
+            // Image is shorter than the range
+            errno = EIO;
+            return -1;
+        }
+
+        in_offset += n;
+        remain -= static_cast<uint64_t>(n);
+    }
+
+    return 1;
+}
+#endif
+
+/*!
+ * \brief Write the current entry's data to \p path
+ *
+ * If \p image_fd is a valid file descriptor for the boot image and the format
+ * reports where the entry is stored, the data is copied straight from the image
+ * by the kernel.
+ */
+static bool write_data_entry_to_file(const std::string &path, MbBiReader *bir,
+                                     int image_fd)
 {
     ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
     if (!fp) {
@@ -748,17 +906,54 @@ static bool write_data_entry_to_file(const std::string &path, MbBiReader *bir)
 
     int ret;
     char buf[10240];
+    const void *ptr;
     size_t n;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
-            == MB_BI_OK) {
-        if (fwrite(buf, 1, n, fp.get()) != n) {
+#ifdef __linux__
+    uint64_t offset;
+    uint64_t size;
+
+    if (image_fd >= 0
+            && mb_bi_reader_entry_range(bir, &offset, &size) == MB_BI_OK) {
+        int copied = copy_range_to_fd(image_fd, offset, size,
+                                      fileno(fp.get()));
+        if (copied < 0) {
+            fprintf(stderr, "%s: Failed to copy data: %s\n",
+                    path.c_str(), strerror(errno));
+            return false;
+        } else if (copied > 0) {
+            if (fclose(fp.release()) < 0) {
+                fprintf(stderr, "%s: Failed to close file: %s\n",
+                        path.c_str(), strerror(errno));
+                return false;
+            }
+            return true;
+        }
+    }
+#else
+    (void) image_fd;
+#endif
+
+    // Write straight from the mapped image if possible
+    while ((ret = mb_bi_reader_read_data_view(bir, &ptr, &n)) == MB_BI_OK) {
+        if (fwrite(ptr, 1, n, fp.get()) != n) {
             fprintf(stderr, "%s: Failed to write data: %s\n",
                     path.c_str(), strerror(errno));
             return false;
         }
     }
 
+    if (ret == MB_BI_UNSUPPORTED) {
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+                == MB_BI_OK) {
+            if (fwrite(buf, 1, n, fp.get()) != n) {
+                fprintf(stderr, "%s: Failed to write data: %s\n",
+                        path.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
+
     if (ret != MB_BI_EOF) {
         fprintf(stderr, "Failed to read entry data: %s\n",
                 mb_bi_reader_error_string(bir));
@@ -830,7 +1025,7 @@ static bool write_file_to_entry(const Paths &paths, MbBiWriter *biw,
 }
 
 static bool write_entry_to_file(const Paths &paths, MbBiReader *bir,
-                                MbBiEntry *entry)
+                                MbBiEntry *entry, int image_fd)
 {
     std::string path;
 
@@ -875,13 +1070,225 @@ static bool write_entry_to_file(const Paths &paths, MbBiReader *bir,
         return false;
     }
 
-    return write_data_entry_to_file(path, bir);
+    return write_data_entry_to_file(path, bir, image_fd);
+}
+
+static const char * entry_type_name(int type)
+{
+    switch (type) {
+    case MB_BI_ENTRY_KERNEL:             return IMAGE_KERNEL;
+    case MB_BI_ENTRY_RAMDISK:            return IMAGE_RAMDISK;
+    case MB_BI_ENTRY_SECONDBOOT:         return IMAGE_SECOND;
+    case MB_BI_ENTRY_DEVICE_TREE:        return IMAGE_DT;
+    case MB_BI_ENTRY_ABOOT:              return IMAGE_ABOOT;
+    case MB_BI_ENTRY_MTK_KERNEL_HEADER:  return IMAGE_KERNEL_MTKHDR;
+    case MB_BI_ENTRY_MTK_RAMDISK_HEADER: return IMAGE_RAMDISK_MTKHDR;
+    case MB_BI_ENTRY_SONY_IPL:           return IMAGE_IPL;
+    case MB_BI_ENTRY_SONY_RPM:           return IMAGE_RPM;
+    case MB_BI_ENTRY_SONY_APPSBL:        return IMAGE_APPSBL;
+    default:                             return nullptr;
+    }
+}
+
+static bool print_entry_range(MbBiReader *bir, MbBiEntry *entry)
+{
+    const char *name = entry_type_name(mb_bi_entry_type(entry));
+    uint64_t offset;
+    uint64_t size;
+
+    if (!name) {
+        fprintf(stderr, "Unknown entry type: %d\n", mb_bi_entry_type(entry));
+        return false;
+    }
+
+    if (mb_bi_reader_entry_range(bir, &offset, &size) != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to get image location: %s\n",
+                name, mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    printf("%s %" PRIu64 " %" PRIu64 "\n", name, offset, size);
+    return true;
+}
+
+/*!
+ * \brief Unpack a boot image to the paths in \a paths
+ *
+ * \param input_file Boot image to unpack
+ * \param paths Output paths
+ * \param type Format of the boot image or nullptr to autodetect
+ * \param offsets_only Print the location of each entry instead of writing
+ *                     anything to \a paths
+ * \param format_out If not nullptr, the name of the detected format is stored
+ *                   here once it is known
+ */
+static bool unpack_image(const std::string &input_file, const Paths &paths,
+                         const char *type, bool offsets_only,
+                         std::string *format_out)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!bir) {
+        fprintf(stderr, "Failed to allocate reader: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (type) {
+        ret = mb_bi_reader_enable_format_by_name(bir.get(), type);
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "Failed to enable format '%s': %s\n",
+                    type, mb_bi_reader_error_string(bir.get()));
+            return false;
+        }
+    } else {
+        ret = mb_bi_reader_enable_format_all(bir.get());
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "Failed to enable all formats: %s\n",
+                    mb_bi_reader_error_string(bir.get()));
+            return false;
+        }
+    }
+
+    ret = open_input_file(bir.get(), input_file);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (format_out) {
+        const char *name = mb_bi_reader_format_name(bir.get());
+        *format_out = name ? name : "";
+    }
+
+    ret = mb_bi_reader_read_header(bir.get(), &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to read header: %s\n",
+                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (offsets_only) {
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+            if (!print_entry_range(bir.get(), entry)) {
+                return false;
+            }
+        }
+    } else {
+        if (!write_header(paths.header, header)) {
+            return false;
+        }
+
+        // Second handle for copying entries without going through the reader
+        int image_fd = -1;
+#ifdef __linux__
+        image_fd = open(input_file.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+        auto close_image_fd = finally([&]{
+#ifdef __linux__
+            if (image_fd >= 0) {
+                close(image_fd);
+            }
+#endif
+        });
+
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+            if (!write_entry_to_file(paths, bir.get(), entry, image_fd)) {
+                return false;
+            }
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "Failed to read entry: %s\n",
+                mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Build a boot image from the paths in \a paths
+ *
+ * \param output_file Boot image to create
+ * \param paths Input paths
+ * \param type Format of the boot image
+ */
+static bool pack_image(const std::string &output_file, const Paths &paths,
+                       const char *type)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        fprintf(stderr, "Failed to allocate writer: %s\n", strerror(errno));
+        return false;
+    }
+
+    ret = mb_bi_writer_set_format_by_name(biw.get(), type);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "Invalid boot image type: %s\n", type);
+        return false;
+    }
+
+    ret = mb_bi_writer_open_filename(biw.get(), output_file.c_str());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_get_header(biw.get(), &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "Failed to get header instance: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    if (!read_header(paths.header, header)) {
+        return false;
+    }
+
+    ret = mb_bi_writer_write_header(biw.get(), header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to read header: %s\n",
+                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        if (!write_file_to_entry(paths, biw.get(), entry)) {
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "Failed to get next entry: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "Failed to close boot image: %s\n",
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    return true;
 }
 
 bool unpack_main(int argc, char *argv[])
 {
     int opt;
     bool no_prefix = false;
+    bool offsets_only = false;
     std::string input_file;
     std::string output_dir;
     std::string prefix;
@@ -901,6 +1308,7 @@ bool unpack_main(int argc, char *argv[])
         OPT_OUTPUT_IPL            = 10000 + 8,
         OPT_OUTPUT_RPM            = 10000 + 9,
         OPT_OUTPUT_APPSBL         = 10000 + 10,
+        OPT_OFFSETS_ONLY          = 10000 + 11,
     };
 
     static const char short_options[] = "o:p:n" "h";
@@ -922,6 +1330,7 @@ bool unpack_main(int argc, char *argv[])
         {"output-ipl",            required_argument, 0, OPT_OUTPUT_IPL},
         {"output-rpm",            required_argument, 0, OPT_OUTPUT_RPM},
         {"output-appsbl",         required_argument, 0, OPT_OUTPUT_APPSBL},
+        {"offsets-only",          no_argument,       0, OPT_OFFSETS_ONLY},
         // Misc
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -946,6 +1355,7 @@ bool unpack_main(int argc, char *argv[])
         case OPT_OUTPUT_IPL:            paths.ipl = optarg;            break;
         case OPT_OUTPUT_RPM:            paths.rpm = optarg;            break;
         case OPT_OUTPUT_APPSBL:         paths.appsbl = optarg;         break;
+        case OPT_OFFSETS_ONLY:          offsets_only = true;           break;
 
         case 'h':
             fputs(HELP_UNPACK_USAGE, stdout);
@@ -976,6 +1386,10 @@ bool unpack_main(int argc, char *argv[])
         output_dir = ".";
     }
 
+    if (offsets_only) {
+        return unpack_image(input_file, paths, type, true, nullptr);
+    }
+
     prepend_if_empty(paths, output_dir, prefix);
 
     if (!io::createDirectories(output_dir)) {
@@ -984,64 +1398,7 @@ bool unpack_main(int argc, char *argv[])
         return false;
     }
 
-    // Load the boot image
-    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
-    MbBiHeader *header;
-    MbBiEntry *entry;
-    int ret;
-
-    if (!bir) {
-        fprintf(stderr, "Failed to allocate reader: %s\n", strerror(errno));
-        return false;
-    }
-
-    if (type) {
-        ret = mb_bi_reader_enable_format_by_name(bir.get(), type);
-        if (ret != MB_BI_OK) {
-            fprintf(stderr, "Failed to enable format '%s': %s\n",
-                    type, mb_bi_reader_error_string(bir.get()));
-            return false;
-        }
-    } else {
-        ret = mb_bi_reader_enable_format_all(bir.get());
-        if (ret != MB_BI_OK) {
-            fprintf(stderr, "Failed to enable all formats: %s\n",
-                    mb_bi_reader_error_string(bir.get()));
-            return false;
-        }
-    }
-
-    ret = mb_bi_reader_open_filename(bir.get(), input_file.c_str());
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to open for reading: %s\n",
-                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
-        return false;
-    }
-
-    ret = mb_bi_reader_read_header(bir.get(), &header);
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to read header: %s\n",
-                input_file.c_str(), mb_bi_reader_error_string(bir.get()));
-        return false;
-    }
-
-    if (!write_header(paths.header, header)) {
-        return false;
-    }
-
-    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
-        if (!write_entry_to_file(paths, bir.get(), entry)) {
-            return false;
-        }
-    }
-
-    if (ret != MB_BI_EOF) {
-        fprintf(stderr, "Failed to read entry: %s\n",
-                mb_bi_reader_error_string(bir.get()));
-        return false;
-    }
-
-    return true;
+    return unpack_image(input_file, paths, type, false, nullptr);
 }
 
 bool pack_main(int argc, char *argv[])
@@ -1148,68 +1505,308 @@ bool pack_main(int argc, char *argv[])
 
     prepend_if_empty(paths, input_dir, prefix);
 
-    // Load the boot image
-    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
-    MbBiHeader *header;
-    MbBiEntry *entry;
-    int ret;
+    return pack_image(output_file, paths, type);
+}
 
-    if (!biw) {
-        fprintf(stderr, "Failed to allocate writer: %s\n", strerror(errno));
+struct BatchJob
+{
+    // Whether to pack instead of unpack
+    bool pack;
+    // Boot image
+    std::string file;
+    // Directory containing the items
+    std::string dir;
+    // Boot image type (empty if unspecified)
+    std::string type;
+};
+
+struct BatchResult
+{
+    bool success;
+    // Name of the boot image format (empty if unknown)
+    std::string format;
+    double seconds;
+};
+
+static bool read_batch_manifest(const std::string &path,
+                                std::vector<BatchJob> &jobs)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                path.c_str(), strerror(errno));
         return false;
     }
 
-    ret = mb_bi_writer_set_format_by_name(biw.get(), type);
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "Invalid boot image type: %s\n", type);
-        return false;
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+    size_t line_num = 0;
+
+    auto free_line = finally([&]{
+        free(line);
+    });
+
+    while ((read = mb_getline(&line, &len, fp.get())) >= 0) {
+        ++line_num;
+
+        // Strip newline
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+            line[--read] = '\0';
+        }
+
+        char *ptr = line;
+
+        // Skip leading whitespace
+        while (*ptr && isspace(static_cast<unsigned char>(*ptr))) {
+            ++ptr;
+        }
+
+        // Skip empty and commented lines
+        if (*ptr == '\0' || *ptr == '#') {
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        for (char *field = ptr; field;) {
+            char *tab = strchr(field, '\t');
+            if (tab) {
+                *tab = '\0';
+            }
+            fields.push_back(field);
+            field = tab ? tab + 1 : nullptr;
+        }
+
+        BatchJob job;
+
+        if (fields[0] == "unpack") {
+            job.pack = false;
+        } else if (fields[0] == "pack") {
+            job.pack = true;
+        } else {
+            fprintf(stderr, "%s:%" MB_PRIzu ": Invalid command: '%s'\n",
+                    path.c_str(), line_num, fields[0].c_str());
+            return false;
+        }
+
+        if (fields.size() < 3 || fields.size() > 4
+                || fields[1].empty() || fields[2].empty()) {
+            fprintf(stderr, "%s:%" MB_PRIzu ": Invalid job: %s\n",
+                    path.c_str(), line_num, ptr);
+            return false;
+        }
+
+        job.file = fields[1];
+        job.dir = fields[2];
+        if (fields.size() == 4) {
+            job.type = fields[3];
+        }
+
+        jobs.push_back(std::move(job));
     }
 
-    ret = mb_bi_writer_open_filename(biw.get(), output_file.c_str());
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to open for writing: %s\n",
-                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
-        return false;
+    return true;
+}
+
+static void run_batch_job(const BatchJob &job, BatchResult &result)
+{
+    Paths paths;
+
+    prepend_if_empty(paths, job.dir, io::baseName(job.file) + "-");
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (job.pack) {
+        result.format = job.type.empty()
+                ? MB_BI_FORMAT_NAME_ANDROID : job.type;
+        result.success = pack_image(job.file, paths, result.format.c_str());
+    } else if (!io::createDirectories(job.dir)) {
+        fprintf(stderr, "%s: Failed to create directory: %s\n",
+                job.dir.c_str(), io::lastErrorString().c_str());
+        result.success = false;
+    } else {
+        result.success = unpack_image(
+                job.file, paths, job.type.empty() ? nullptr : job.type.c_str(),
+                false, &result.format);
     }
 
-    ret = mb_bi_writer_get_header(biw.get(), &header);
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "Failed to get header instance: %s\n",
-                mb_bi_writer_error_string(biw.get()));
-        return false;
+    auto end = std::chrono::steady_clock::now();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+}
+
+static void print_batch_summary(const std::vector<BatchJob> &jobs,
+                                const std::vector<BatchResult> &results,
+                                unsigned int threads, double seconds)
+{
+    struct Stats
+    {
+        size_t count = 0;
+        size_t failed = 0;
+        double total = 0;
+        double max = 0;
+    };
+
+    std::map<std::string, Stats> stats;
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        std::string key(jobs[i].pack ? "pack " : "unpack ");
+        key += results[i].format.empty() ? "(unknown)" : results[i].format;
+
+        Stats &s = stats[key];
+        ++s.count;
+        if (!results[i].success) {
+            ++s.failed;
+        }
+        s.total += results[i].seconds;
+        s.max = std::max(s.max, results[i].seconds);
     }
 
-    if (!read_header(paths.header, header)) {
-        return false;
+    printf("%-20s %8s %8s %12s %12s %12s\n",
+           "Format", "Images", "Failed", "Total (s)", "Mean (ms)", "Max (ms)");
+
+    for (auto const &item : stats) {
+        const Stats &s = item.second;
+        printf("%-20s %8" MB_PRIzu " %8" MB_PRIzu " %12.3f %12.3f %12.3f\n",
+               item.first.c_str(), s.count, s.failed, s.total,
+               s.total * 1000 / s.count, s.max * 1000);
     }
 
-    ret = mb_bi_writer_write_header(biw.get(), header);
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "%s: Failed to read header: %s\n",
-                output_file.c_str(), mb_bi_writer_error_string(biw.get()));
-        return false;
+    printf("\nProcessed %" MB_PRIzu " images in %.3f seconds"
+           " (worker threads: %u)\n", jobs.size(), seconds, threads);
+}
+
+static bool run_batch(const std::vector<BatchJob> &jobs, unsigned int threads)
+{
+    std::vector<BatchResult> results(jobs.size());
+    std::atomic<size_t> next(0);
+    std::atomic<bool> success(true);
+
+    threads = static_cast<unsigned int>(
+            std::max<size_t>(1, std::min<size_t>(threads, jobs.size())));
+
+    auto worker = [&]{
+        size_t i;
+
+        while ((i = next++) < jobs.size()) {
+            run_batch_job(jobs[i], results[i]);
+
+            if (!results[i].success) {
+                fprintf(stderr, "%s: Failed to %s boot image\n",
+                        jobs[i].file.c_str(),
+                        jobs[i].pack ? "pack" : "unpack");
+                success = false;
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (auto &t : workers) {
+        t.join();
     }
 
-    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
-        if (!write_file_to_entry(paths, biw.get(), entry)) {
+    auto end = std::chrono::steady_clock::now();
+
+    print_batch_summary(jobs, results, threads,
+                        std::chrono::duration<double>(end - start).count());
+
+    return success;
+}
+
+bool batch_main(int argc, char *argv[])
+{
+    int opt;
+    std::string manifest;
+    std::string input_dir;
+    std::string output_dir;
+    unsigned int threads = 0;
+
+    static const char short_options[] = "m:d:o:j:" "h";
+
+    static struct option long_options[] = {
+        {"manifest",  required_argument, 0, 'm'},
+        {"directory", required_argument, 0, 'd'},
+        {"output",    required_argument, 0, 'o'},
+        {"jobs",      required_argument, 0, 'j'},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'm': manifest = optarg;   break;
+        case 'd': input_dir = optarg;  break;
+        case 'o': output_dir = optarg; break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &threads) || threads == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return false;
+            }
+            break;
+
+        case 'h':
+            fputs(HELP_BATCH_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_BATCH_USAGE, stderr);
             return false;
         }
     }
 
-    if (ret != MB_BI_EOF) {
-        fprintf(stderr, "Failed to get next entry: %s\n",
-                mb_bi_writer_error_string(biw.get()));
+    // There should be no other arguments and exactly one job source
+    if (argc - optind != 0 || manifest.empty() == input_dir.empty()) {
+        fputs(HELP_BATCH_USAGE, stderr);
         return false;
     }
 
-    ret = mb_bi_writer_close(biw.get());
-    if (ret != MB_BI_OK) {
-        fprintf(stderr, "Failed to close boot image: %s\n",
-                mb_bi_writer_error_string(biw.get()));
+    std::vector<BatchJob> jobs;
+
+    if (!manifest.empty()) {
+        if (!read_batch_manifest(manifest, jobs)) {
+            return false;
+        }
+    } else {
+        std::vector<std::string> names;
+
+        if (!io::listFiles(input_dir, names)) {
+            fprintf(stderr, "%s: Failed to list files: %s\n",
+                    input_dir.c_str(), io::lastErrorString().c_str());
+            return false;
+        }
+
+        if (output_dir.empty()) {
+            output_dir = ".";
+        }
+
+        for (auto const &name : names) {
+            BatchJob job;
+            job.pack = false;
+            job.file = io::pathJoin({input_dir, name});
+            job.dir = output_dir;
+            jobs.push_back(std::move(job));
+        }
+    }
+
+    if (jobs.empty()) {
+        fprintf(stderr, "No boot images to process\n");
         return false;
     }
 
-    return true;
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    return run_batch(jobs, threads);
 }
 
 int main(int argc, char *argv[])
@@ -1226,6 +1823,8 @@ int main(int argc, char *argv[])
         ret = unpack_main(--argc, ++argv);
     } else if (command == "pack") {
         ret = pack_main(--argc, ++argv);
+    } else if (command == "batch") {
+        ret = batch_main(--argc, ++argv);
     } else {
         fputs(HELP_MAIN_USAGE, stderr);
         return EXIT_FAILURE;
@@ -25,6 +25,7 @@
 
 #include <rapidjson/filewritestream.h>
 #include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 #include <yaml-cpp/yaml.h>
 
@@ -174,7 +175,8 @@ static void usage(FILE *stream)
             "  -o, --output <file>\n"
             "                   Output file (outputs to stdout if omitted)\n"
             "  -h, --help       Display this help message\n"
-            "  --styled         Output in human-readable format\n");
+            "  --styled         Output in human-readable format\n"
+            "  --binary         Output binary device database\n");
 }
 
 int main(int argc, char *argv[])
@@ -183,12 +185,14 @@ int main(int argc, char *argv[])
 
     enum Options {
         OPT_STYLED             = 1000,
+        OPT_BINARY             = 1001,
     };
 
     static const char short_options[] = "o:h";
 
     static struct option long_options[] = {
         {"styled", no_argument, 0, OPT_STYLED},
+        {"binary", no_argument, 0, OPT_BINARY},
         {"output", required_argument, 0, 'o'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
@@ -198,6 +202,7 @@ int main(int argc, char *argv[])
 
     const char *output_file = nullptr;
     bool styled = false;
+    bool binary = false;
 
     while ((opt = getopt_long(argc, argv, short_options,
                               long_options, &long_index)) != -1) {
@@ -206,6 +211,10 @@ int main(int argc, char *argv[])
             styled = true;
             break;
 
+        case OPT_BINARY:
+            binary = true;
+            break;
+
         case 'o':
             output_file = optarg;
             break;
@@ -223,7 +232,7 @@ int main(int argc, char *argv[])
     FILE *fp = stdout;
 
     if (output_file) {
-        fp = fopen(output_file, "w");
+        fp = fopen(output_file, "wb");
         if (!fp) {
             fprintf(stderr, "%s: Failed to open file: %s\n",
                     output_file, strerror(errno));
@@ -249,7 +258,28 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (styled) {
+    if (binary) {
+        StringBuffer sb;
+        Writer<StringBuffer> writer(sb);
+        ret = validate_and_write(d, *sd, writer);
+
+        if (ret) {
+            // Already validated above
+            DeviceDatabase db;
+            JsonError error;
+            std::string data;
+
+            ret = db.load({sb.GetString(), sb.GetSize()}, false, error)
+                    && db.to_binary(data);
+            if (!ret) {
+                fprintf(stderr, "Failed to create binary database\n");
+            } else if (fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+                fprintf(stderr, "Failed to write binary database: %s\n",
+                        strerror(errno));
+                ret = false;
+            }
+        }
+    } else if (styled) {
         PrettyWriter<FileWriteStream> writer(os);
         ret = validate_and_write(d, *sd, writer);
     } else {
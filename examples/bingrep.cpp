@@ -19,8 +19,15 @@
 
 #include "mbcommon/file_util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -33,21 +40,92 @@
 
 #include "mbcommon/file/standard.h"
 #include "mbcommon/file/posix.h"
+#include "mbcommon/string.h"
+#ifndef _WIN32
+#  include "mbcommon/file/mmap.h"
+#endif
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Engine
+{
+    // mmap for regular files if available, otherwise read
+    Auto,
+    // Read into buffers with file_search*()
+    Read,
+    // Search the mapped file contents directly
+    Mmap,
+};
+
+struct Pattern
+{
+    // Pattern as given on the command line
+    std::string label;
+    std::vector<unsigned char> data;
+};
+
+struct Match
+{
+    uint64_t offset;
+    size_t pattern;
+};
+
+struct SearchOptions
+{
+    std::vector<Pattern> patterns;
+    int64_t start = -1;
+    int64_t end = -1;
+    size_t bsize = 0;
+    int64_t max_matches = -1;
+    // Only report the first match of each pattern
+    bool first = false;
+    Engine engine = Engine::Auto;
+};
+
+enum class OutputMode
+{
+    Matches,
+    OffsetsOnly,
+    Count,
+};
+
+struct SearchResult
+{
+    std::vector<Match> matches;
+    // Number of bytes in the search range (0 if unknown)
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    const char *engine = "read";
+    std::string error;
+    bool ok = false;
+};
 
 static void usage(FILE *stream, const char *prog_name)
 {
-    fprintf(stream, "Usage: %s {-p <hex> | -t <text>} [option...] [<file>...]\n"
+    fprintf(stream, "Usage: %s {-p <hex> | -t <text>}... [option...] [<file>...]\n"
                     "\n"
                     "Options:\n"
                     "  -p, --hex <hex pattern>\n"
-                    "                  Search file for hex pattern\n"
+                    "                  Search file for hex pattern (repeatable)\n"
                     "  -t, --text <text pattern>\n"
-                    "                  Search file for text pattern\n"
+                    "                  Search file for text pattern (repeatable)\n"
                     "  -n, --num-matches\n"
-                    "                  Maximum number of matches\n"
+                    "                  Maximum number of matches per file\n"
+                    "  -c, --count     Only print the number of matches\n"
+                    "  -1, --first     Only report the first match of each pattern\n"
+                    "  -o, --offsets-only\n"
+                    "                  Only print the offsets of matches\n"
+                    "  -j, --threads <threads>\n"
+                    "                  Number of threads to use (0 = number of CPUs).\n"
+                    "                  Multiple files are searched concurrently and\n"
+                    "                  large files are split between threads.\n"
                     "  --start-offset  Starting boundary offset for search\n"
                     "  --end-offset    Ending boundary offset for search\n"
-                    "  --buffer-size   Buffer size\n",
+                    "  --buffer-size   Buffer size\n"
+                    "  --engine <auto|read|mmap>\n"
+                    "                  Search engine to use (default: auto)\n"
+                    "  --benchmark     Print timing and throughput to stderr\n"
+                    "  --repeat <n>    Search each file n times (for --benchmark)\n",
                     prog_name);
 }
 
@@ -112,108 +190,385 @@ static int ascii_to_hex(char c)
     }
 }
 
-static bool hex_to_binary(const char *hex, void **data, size_t *data_size)
+static bool hex_to_binary(const char *hex, std::vector<unsigned char> &data)
 {
     size_t size = strlen(hex);
-    unsigned char *buf;
 
-    if (size & 1) {
+    if (size == 0 || (size & 1)) {
         errno = EINVAL;
         return false;
     }
 
-    buf = static_cast<unsigned char *>(malloc(size / 2));
-    if (!buf) {
-        return false;
-    }
+    data.resize(size / 2);
 
     for (size_t i = 0; i < size; i += 2) {
         int hi = ascii_to_hex(hex[i]);
         int lo = ascii_to_hex(hex[i + 1]);
 
         if (hi < 0 || lo < 0) {
-            free(buf);
             errno = EINVAL;
             return false;
         }
 
-        buf[i / 2] = (hi << 4) | lo;
+        data[i / 2] = (hi << 4) | lo;
     }
 
-    *data = buf;
-    *data_size = size / 2;
-
     return true;
 }
 
-static mb::FileSearchAction search_result_cb(mb::File &file, void *userdata,
+/*!
+ * \brief Collects matches from the file_search*() callbacks
+ */
+struct MatchCollector
+{
+    const SearchOptions *options;
+    std::vector<Match> *matches;
+    // Patterns that have matched at least once (only used for --first)
+    std::vector<bool> seen;
+    size_t seen_count = 0;
+
+    MatchCollector(const SearchOptions &o, std::vector<Match> &m)
+        : options(&o), matches(&m), seen(o.patterns.size())
+    {
+    }
+
+    mb::FileSearchAction add(size_t pattern, uint64_t offset)
+    {
+        if (options->first) {
+            if (seen[pattern]) {
+                return mb::FileSearchAction::Continue;
+            }
+            seen[pattern] = true;
+            ++seen_count;
+        }
+
+        matches->push_back({ offset, pattern });
+
+        if (options->first && seen_count == seen.size()) {
+            return mb::FileSearchAction::Stop;
+        }
+        return mb::FileSearchAction::Continue;
+    }
+};
+
+static mb::FileSearchAction single_result_cb(mb::File &file, void *userdata,
                                              uint64_t offset)
 {
     (void) file;
-    const char *name = static_cast<char *>(userdata);
-    printf("%s: 0x%016" PRIx64 "\n", name, offset);
-    return mb::FileSearchAction::Continue;
+    return static_cast<MatchCollector *>(userdata)->add(0, offset);
+}
+
+static mb::FileSearchAction multi_result_cb(mb::File &file, void *userdata,
+                                            size_t pattern_id,
+                                            uint64_t offset)
+{
+    (void) file;
+    return static_cast<MatchCollector *>(userdata)->add(pattern_id, offset);
 }
 
-static bool search(const char *name, mb::File &file,
-                   int64_t start, int64_t end,
-                   size_t bsize, const void *pattern,
-                   size_t pattern_size, int64_t max_matches)
+static int64_t effective_max_matches(const SearchOptions &options)
 {
-    if (!mb::file_search(file, start, end, bsize, pattern, pattern_size,
-                         max_matches, &search_result_cb,
-                         const_cast<char *>(name))) {
-        fprintf(stderr, "%s: Search failed: %s\n",
-                name, file.error_string().c_str());
+    // With one pattern, --first is the same as a limit of one match
+    if (options.first && options.patterns.size() == 1 && options.max_matches != 0) {
+        return 1;
+    }
+    return options.max_matches;
+}
+
+/*!
+ * \brief Search with the buffered file_search*() engines
+ *
+ * A single pattern is searched with file_search_parallel() and multiple
+ * patterns are searched in one pass with file_search_multi().
+ */
+static bool search_read(mb::File &file, const SearchOptions &options,
+                        unsigned int threads, SearchResult &result)
+{
+    MatchCollector collector(options, result.matches);
+    int64_t max_matches = effective_max_matches(options);
+    bool ret;
+
+    // The size is only needed for the throughput statistics
+    uint64_t size;
+    if (file.seek(0, SEEK_END, &size) && file.seek(0, SEEK_SET, nullptr)) {
+        uint64_t begin = options.start >= 0
+                ? static_cast<uint64_t>(options.start) : 0;
+        if (options.end >= 0 && static_cast<uint64_t>(options.end) < size) {
+            size = static_cast<uint64_t>(options.end);
+        }
+        result.bytes = size > begin ? size - begin : 0;
+    } else {
+        // Not seekable (eg. stdin)
+        threads = 1;
+    }
+
+    if (options.patterns.size() == 1) {
+        auto const &p = options.patterns[0];
+        ret = mb::file_search_parallel(file, options.start, options.end,
+                                       options.bsize, threads, p.data.data(),
+                                       p.data.size(), max_matches,
+                                       &single_result_cb, &collector);
+    } else {
+        std::vector<mb::FileSearchPattern> patterns;
+        for (auto const &p : options.patterns) {
+            patterns.push_back({ p.data.data(), p.data.size() });
+        }
+        ret = mb::file_search_multi(file, options.start, options.end,
+                                    options.bsize, patterns.data(),
+                                    patterns.size(), max_matches,
+                                    &multi_result_cb, &collector);
+    }
+
+    if (!ret) {
+        result.error = file.error_string();
+    }
+    return ret;
+}
+
+#ifndef _WIN32
+/*!
+ * \brief Find all non-overlapping matches in a memory range
+ *
+ * Only matches that start before \p limit are reported, but they may extend
+ * up to \p size bytes.
+ */
+static void find_in_memory(const mb::FileSearcher &searcher,
+                           const unsigned char *base, size_t begin,
+                           size_t limit, size_t size, int64_t max_matches,
+                           std::vector<uint64_t> &offsets)
+{
+    size_t pos = begin;
+
+    while (pos < limit && max_matches != 0) {
+        auto match = static_cast<const unsigned char *>(
+                searcher.find(base + pos, size - pos));
+        if (!match || static_cast<size_t>(match - base) >= limit) {
+            break;
+        }
+
+        offsets.push_back(match - base);
+        pos = match - base + searcher.pattern_size();
+
+        if (max_matches > 0) {
+            --max_matches;
+        }
+    }
+}
+
+/*!
+ * \brief Search the mapped file contents without copying them
+ *
+ * A single pattern is searched in place with FileSearcher::find(). If more
+ * than one thread is used, the range is split into chunks, each extended by
+ * `pattern_size - 1` bytes, and the matches are merged so that the results are
+ * identical to a sequential search. Multiple patterns still go through
+ * file_search_multi(), which reads from the mapping without any syscalls.
+ */
+static bool search_mmap(mb::MmapFile &file, const SearchOptions &options,
+                        unsigned int threads, SearchResult &result)
+{
+    const void *data;
+    size_t size;
+
+    if (!file.mapped_data(data, size)) {
+        result.error = file.error_string();
+        return false;
+    }
+
+    size_t begin = options.start >= 0
+            ? std::min<uint64_t>(options.start, size) : 0;
+    size_t end = options.end >= 0
+            ? std::min<uint64_t>(options.end, size) : size;
+    if (end < begin) {
+        result.error = "End offset < start offset";
         return false;
     }
+    result.bytes = end - begin;
+
+    if (options.patterns.size() != 1) {
+        return search_read(file, options, threads, result);
+    }
+
+    auto const &p = options.patterns[0];
+    mb::FileSearcher searcher(p.data.data(), p.data.size());
+    auto base = static_cast<const unsigned char *>(data);
+    int64_t max_matches = effective_max_matches(options);
+    std::vector<uint64_t> offsets;
+
+    size_t chunk_size = options.bsize != 0 ? options.bsize : 8 * 1024 * 1024;
+    size_t chunks = (end - begin + chunk_size - 1) / chunk_size;
+
+    if (threads <= 1 || chunks <= 1) {
+        find_in_memory(searcher, base, begin, end, end, max_matches, offsets);
+    } else {
+        std::vector<std::vector<uint64_t>> chunk_offsets(chunks);
+        std::atomic<size_t> next(0);
+
+        auto worker = [&]() {
+            size_t i;
+            while ((i = next++) < chunks) {
+                size_t chunk_begin = begin + i * chunk_size;
+                size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+                size_t chunk_limit = std::min(
+                        end, chunk_end + searcher.pattern_size() - 1);
+                find_in_memory(searcher, base, chunk_begin, chunk_end,
+                               chunk_limit, -1, chunk_offsets[i]);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < std::min<size_t>(threads, chunks); ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto &t : workers) {
+            t.join();
+        }
+
+        // Drop matches that overlap the previous one, like a sequential search
+        uint64_t min_offset = 0;
+        for (auto const &v : chunk_offsets) {
+            for (uint64_t offset : v) {
+                if (offset < min_offset) {
+                    continue;
+                } else if (max_matches >= 0
+                        && offsets.size() >= static_cast<uint64_t>(max_matches)) {
+                    break;
+                }
+                offsets.push_back(offset);
+                min_offset = offset + searcher.pattern_size();
+            }
+        }
+    }
+
+    for (uint64_t offset : offsets) {
+        result.matches.push_back({ offset, 0 });
+    }
+
     return true;
 }
+#endif
 
-static bool search_stdin(int64_t start, int64_t end,
-                         size_t bsize, const void *pattern,
-                         size_t pattern_size, int64_t max_matches)
+static void search_path(const char *path, const SearchOptions &options,
+                        unsigned int threads, SearchResult &result)
 {
+    auto start = Clock::now();
+
+#ifndef _WIN32
+    if (options.engine != Engine::Read) {
+        mb::MmapFile file;
+
+        if (file.open(path)) {
+            result.engine = "mmap";
+            result.ok = search_mmap(file, options, threads, result);
+            result.seconds = std::chrono::duration<double>(
+                    Clock::now() - start).count();
+            return;
+        } else if (options.engine == Engine::Mmap) {
+            result.error = file.error_string();
+            return;
+        }
+
+        // Not mappable (eg. a pipe or an empty file), so fall back to reading
+    }
+#else
+    // Win32File emulates positional reads with seeks, which is not thread-safe
+    threads = 1;
+#endif
+
+    mb::StandardFile file;
+
+    if (!file.open(path, mb::FileOpenMode::READ_ONLY)) {
+        result.error = file.error_string();
+        return;
+    }
+
+    result.engine = "read";
+    result.ok = search_read(file, options, threads, result);
+    result.seconds = std::chrono::duration<double>(
+            Clock::now() - start).count();
+}
+
+static void search_stdin(const SearchOptions &options, SearchResult &result)
+{
+    auto start = Clock::now();
+
     mb::PosixFile file(stdin, false);
 
     if (!file.is_open()) {
-        fprintf(stderr, "Failed to open stdin: %s\n",
-                file.error_string().c_str());
-        return false;
+        result.error = "Failed to open stdin: " + file.error_string();
+        return;
     }
 
-    return search("stdin", file, start, end, bsize, pattern, pattern_size,
-                  max_matches);
+    // Reading stdin is not thread-safe
+    result.ok = search_read(file, options, 1, result);
+    result.seconds = std::chrono::duration<double>(
+            Clock::now() - start).count();
 }
 
-static bool search_file(const char *path, int64_t start, int64_t end,
-                        size_t bsize, const void *pattern,
-                        size_t pattern_size, int64_t max_matches)
+static void print_result(const char *name, const SearchOptions &options,
+                         OutputMode mode, const SearchResult &result)
 {
-    mb::StandardFile file(path, mb::FileOpenMode::READ_ONLY);
+    if (!result.ok) {
+        fprintf(stderr, "%s: Search failed: %s\n", name, result.error.c_str());
+        return;
+    }
 
-    if (!file.is_open()) {
-        fprintf(stderr, "%s: Failed to open file: %s\n",
-                path, file.error_string().c_str());
-        return false;
+    bool multi = options.patterns.size() > 1;
+
+    switch (mode) {
+    case OutputMode::Count:
+        if (multi) {
+            std::vector<uint64_t> counts(options.patterns.size());
+            for (auto const &m : result.matches) {
+                ++counts[m.pattern];
+            }
+            for (size_t i = 0; i < counts.size(); ++i) {
+                printf("%s: %s: %" PRIu64 "\n", name,
+                       options.patterns[i].label.c_str(), counts[i]);
+            }
+        } else {
+            printf("%s: %" MB_PRIzu "\n", name, result.matches.size());
+        }
+        break;
+
+    case OutputMode::OffsetsOnly:
+        for (auto const &m : result.matches) {
+            printf("0x%016" PRIx64 "\n", m.offset);
+        }
+        break;
+
+    case OutputMode::Matches:
+        for (auto const &m : result.matches) {
+            if (multi) {
+                printf("%s: 0x%016" PRIx64 ": %s\n", name, m.offset,
+                       options.patterns[m.pattern].label.c_str());
+            } else {
+                printf("%s: 0x%016" PRIx64 "\n", name, m.offset);
+            }
+        }
+        break;
     }
+}
+
+static void print_benchmark(const char *name, const SearchResult &result,
+                            unsigned int repeat)
+{
+    double seconds = result.seconds / repeat;
 
-    return search(path, file, start, end, bsize, pattern, pattern_size,
-                  max_matches);
+    fprintf(stderr, "%s: engine=%s bytes=%" PRIu64 " time=%.6fs"
+            " throughput=%.2f MiB/s\n", name, result.engine, result.bytes,
+            seconds, seconds > 0.0
+                    ? result.bytes / seconds / 1024.0 / 1024.0 : 0.0);
 }
 
 int main(int argc, char *argv[])
 {
-    int64_t start = -1;
-    int64_t end = -1;
-    size_t bsize = 0;
-    int64_t max_matches = -1;
-
-    const char *text_pattern = nullptr;
-    const char *hex_pattern = nullptr;
-    void *pattern = nullptr;
-    size_t pattern_size = 0;
-    bool pattern_needs_free = false;
+    SearchOptions options;
+    OutputMode mode = OutputMode::Matches;
+    unsigned int threads = 1;
+    unsigned int repeat = 1;
+    bool benchmark = false;
 
     int opt;
 
@@ -223,20 +578,30 @@ int main(int argc, char *argv[])
         OPT_START_OFFSET         = CHAR_MAX + 1,
         OPT_END_OFFSET           = CHAR_MAX + 2,
         OPT_BUFFER_SIZE          = CHAR_MAX + 3,
+        OPT_ENGINE               = CHAR_MAX + 4,
+        OPT_BENCHMARK            = CHAR_MAX + 5,
+        OPT_REPEAT               = CHAR_MAX + 6,
     };
 
-    static const char short_options[] = "hn:p:t:";
+    static const char short_options[] = "1chj:n:op:t:";
 
     static struct option long_options[] = {
         // Arguments with short versions
+        {"first",        no_argument,       0, '1'},
+        {"count",        no_argument,       0, 'c'},
         {"help",         no_argument,       0, 'h'},
+        {"threads",      required_argument, 0, 'j'},
         {"num-matches",  required_argument, 0, 'n'},
+        {"offsets-only", no_argument,       0, 'o'},
         {"hex",          required_argument, 0, 'p'},
         {"text",         required_argument, 0, 't'},
         // Arguments without short versions
         {"start-offset", required_argument, 0, OPT_START_OFFSET},
         {"end-offset",   required_argument, 0, OPT_END_OFFSET},
         {"buffer-size",  required_argument, 0, OPT_BUFFER_SIZE},
+        {"engine",       required_argument, 0, OPT_ENGINE},
+        {"benchmark",    no_argument,       0, OPT_BENCHMARK},
+        {"repeat",       required_argument, 0, OPT_REPEAT},
         {0, 0, 0, 0}
     };
 
@@ -245,24 +610,60 @@ int main(int argc, char *argv[])
     while ((opt = getopt_long(argc, argv, short_options,
                               long_options, &long_index)) != -1) {
         switch (opt) {
+        case '1':
+            options.first = true;
+            break;
+
+        case 'c':
+            mode = OutputMode::Count;
+            break;
+
+        case 'o':
+            mode = OutputMode::OffsetsOnly;
+            break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &threads)) {
+                fprintf(stderr, "Invalid value for -j/--threads: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         case 'n':
-            if (!str_to_snum(optarg, 10, &max_matches)) {
+            if (!str_to_snum(optarg, 10, &options.max_matches)) {
                 fprintf(stderr, "Invalid value for -n/--num-matches: %s\n",
                         optarg);
                 return EXIT_FAILURE;
             }
             break;
 
-        case 'p':
-            hex_pattern = optarg;
+        case 'p': {
+            Pattern pattern;
+            pattern.label = optarg;
+            if (!hex_to_binary(optarg, pattern.data)) {
+                fprintf(stderr, "Invalid hex pattern: %s: %s\n",
+                        optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            options.patterns.push_back(std::move(pattern));
             break;
+        }
 
-        case 't':
-            text_pattern = optarg;
+        case 't': {
+            Pattern pattern;
+            pattern.label = optarg;
+            pattern.data.assign(optarg, optarg + strlen(optarg));
+            if (pattern.data.empty()) {
+                fprintf(stderr, "Text pattern cannot be empty\n");
+                return EXIT_FAILURE;
+            }
+            options.patterns.push_back(std::move(pattern));
             break;
+        }
 
         case OPT_START_OFFSET:
-            if (!str_to_snum(optarg, 0, &start)) {
+            if (!str_to_snum(optarg, 0, &options.start)) {
                 fprintf(stderr, "Invalid value for --start-offset: %s\n",
                         optarg);
                 return EXIT_FAILURE;
@@ -270,7 +671,7 @@ int main(int argc, char *argv[])
             break;
 
         case OPT_END_OFFSET:
-            if (!str_to_snum(optarg, 0, &end)) {
+            if (!str_to_snum(optarg, 0, &options.end)) {
                 fprintf(stderr, "Invalid value for --end-offset: %s\n",
                         optarg);
                 return EXIT_FAILURE;
@@ -278,13 +679,39 @@ int main(int argc, char *argv[])
             break;
 
         case OPT_BUFFER_SIZE:
-            if (!str_to_unum(optarg, 10, &bsize)) {
+            if (!str_to_unum(optarg, 10, &options.bsize)) {
                 fprintf(stderr, "Invalid value for --buffer-size: %s\n",
                         optarg);
                 return EXIT_FAILURE;
             }
             break;
 
+        case OPT_ENGINE:
+            if (strcmp(optarg, "auto") == 0) {
+                options.engine = Engine::Auto;
+            } else if (strcmp(optarg, "read") == 0) {
+                options.engine = Engine::Read;
+#ifndef _WIN32
+            } else if (strcmp(optarg, "mmap") == 0) {
+                options.engine = Engine::Mmap;
+#endif
+            } else {
+                fprintf(stderr, "Invalid value for --engine: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_BENCHMARK:
+            benchmark = true;
+            break;
+
+        case OPT_REPEAT:
+            if (!str_to_unum(optarg, 10, &repeat) || repeat == 0) {
+                fprintf(stderr, "Invalid value for --repeat: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         case 'h':
             usage(stdout, argv[0]);
             return EXIT_SUCCESS;
@@ -295,37 +722,99 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!hex_pattern && !text_pattern) {
+    if (options.patterns.empty()) {
         fprintf(stderr, "No pattern provided\n");
         return EXIT_FAILURE;
-    } else if (hex_pattern) {
-        if (!hex_to_binary(hex_pattern, &pattern, &pattern_size)) {
-            fprintf(stderr, "Invalid hex pattern: %s\n", strerror(errno));
-            return EXIT_FAILURE;
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    if (optind == argc) {
+        SearchResult result;
+        search_stdin(options, result);
+        print_result("stdin", options, mode, result);
+        if (benchmark && result.ok) {
+            print_benchmark("stdin", result, 1);
         }
-        pattern_needs_free = true;
-    } else if (text_pattern) {
-        pattern = const_cast<char *>(text_pattern);
-        pattern_size = strlen(text_pattern);
+        return result.ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
+    // Files are handed out to the workers in order. Any threads left over are
+    // used to split up the individual files.
+    size_t count = argc - optind;
+    unsigned int file_workers = std::min<size_t>(threads, count);
+    unsigned int file_threads = std::max(1u, threads / file_workers);
+
+    std::vector<SearchResult> results(count);
+    std::vector<bool> done(count);
+    std::atomic<size_t> next(0);
+    std::mutex output_lock;
+    size_t next_output = 0;
     bool ret = true;
 
-    if (optind == argc) {
-        ret = search_stdin(start, end, bsize, pattern, pattern_size,
-                           max_matches);
-    } else {
-        for (int i = optind; i < argc; ++i) {
-            bool ret2 = search_file(argv[i], start, end, bsize, pattern,
-                                    pattern_size, max_matches);
-            if (!ret2) {
-                ret = false;
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < count) {
+            const char *path = argv[optind + i];
+            SearchResult &result = results[i];
+            double seconds = 0.0;
+
+            for (unsigned int r = 0; r < repeat; ++r) {
+                result = SearchResult();
+                search_path(path, options, file_threads, result);
+                seconds += result.seconds;
+                if (!result.ok) {
+                    break;
+                }
+            }
+            result.seconds = seconds;
+
+            // Print results in the order the files were given
+            std::lock_guard<std::mutex> lock(output_lock);
+            done[i] = true;
+            for (; next_output < count && done[next_output]; ++next_output) {
+                const char *name = argv[optind + next_output];
+                SearchResult &r = results[next_output];
+
+                print_result(name, options, mode, r);
+                if (benchmark && r.ok) {
+                    print_benchmark(name, r, repeat);
+                }
+                if (!r.ok) {
+                    ret = false;
+                }
+
+                // Free the matches of files that have been printed
+                std::vector<Match>().swap(r.matches);
             }
         }
+    };
+
+    auto start = Clock::now();
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < file_workers; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : workers) {
+        t.join();
     }
 
-    if (pattern_needs_free) {
-        free(pattern);
+    if (benchmark) {
+        double seconds = std::chrono::duration<double>(
+                Clock::now() - start).count();
+        uint64_t bytes = 0;
+        for (auto const &r : results) {
+            bytes += r.bytes * repeat;
+        }
+
+        fprintf(stderr, "total: files=%" MB_PRIzu " threads=%u bytes=%" PRIu64
+                " time=%.6fs throughput=%.2f MiB/s\n", count, threads, bytes,
+                seconds, seconds > 0.0
+                        ? bytes / seconds / 1024.0 / 1024.0 : 0.0);
     }
 
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -17,28 +17,85 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <memory>
 #include <string>
 
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstdio>
 
-#include "mbcommon/file/standard.h"
-#include "mbsparse/sparse.h"
+#include <getopt.h>
+
+#include "mbcommon/file/fd.h"
+#include "mbsparse/expand.h"
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream,
+            "Usage: %s [-j <threads>] <input file> <output file>\n"
+            "\n"
+            "Options:\n"
+            "  -j, --threads <threads>\n"
+            "                   Number of threads (default: number of CPUs)\n"
+            "  -h, --help       Display this help message\n",
+            prog_name);
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
-        std::fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+    mb::sparse::ExpandOptions options;
+
+    int opt;
+
+    static const char short_options[] = "j:h";
+
+    static struct option long_options[] = {
+        {"threads", required_argument, nullptr, 'j'},
+        {"help",    no_argument,       nullptr, 'h'},
+        {nullptr,   0,                 nullptr, 0},
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'j': {
+            char *end;
+            errno = 0;
+            unsigned long n = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || errno != 0 || n == 0
+                    || n > UINT_MAX) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            options.threads = static_cast<unsigned int>(n);
+            break;
+        }
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(stderr, argv[0]);
         return EXIT_FAILURE;
     }
 
-    const char *input_path = argv[1];
-    const char *output_path = argv[2];
+    const char *input_path = argv[optind];
+    const char *output_path = argv[optind + 1];
 
-    mb::StandardFile input_file;
-    mb::StandardFile output_file;
-    mb::sparse::SparseFile sparse_file;
+    // Both files need native positional I/O since the chunks are expanded on
+    // several threads
+    mb::FdFile input_file;
+    mb::FdFile output_file;
+    std::string error;
 
     if (!input_file.open(input_path, mb::FileOpenMode::READ_ONLY)) {
         fprintf(stderr, "%s: Failed to open for reading: %s\n",
@@ -46,39 +103,14 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!sparse_file.open(&input_file)) {
-        fprintf(stderr, "%s: %s\n",
-                input_path, sparse_file.error_string().c_str());
-        return EXIT_FAILURE;
-    }
-
     if (!output_file.open(output_path, mb::FileOpenMode::WRITE_ONLY)) {
         fprintf(stderr, "%s: Failed to open for writing: %s\n",
                 output_path, output_file.error_string().c_str());
         return EXIT_FAILURE;
     }
 
-    size_t n_read;
-    char buf[10240];
-    bool ret;
-    while ((ret = sparse_file.read(buf, sizeof(buf), n_read)) && n_read > 0) {
-        char *ptr = buf;
-        size_t n_written;
-
-        while (n_read > 0) {
-            if (!output_file.write(buf, n_read, n_written)) {
-                fprintf(stderr, "%s: Failed to write file: %s\n",
-                        output_path, output_file.error_string().c_str());
-                return EXIT_FAILURE;
-            }
-            n_read -= n_written;
-            ptr += n_written;
-        }
-    }
-
-    if (!ret) {
-        fprintf(stderr, "%s: Failed to read file: %s\n",
-                input_path, sparse_file.error_string().c_str());
+    if (!mb::sparse::expand_parallel(input_file, output_file, options, error)) {
+        fprintf(stderr, "%s: %s\n", input_path, error.c_str());
         return EXIT_FAILURE;
     }
 
@@ -38,6 +38,8 @@ int main(int argc, char *argv[])
 
     mb::patcher::PatcherConfig pc;
     pc.set_data_directory(a.applicationDirPath().toStdString() + "/" + DATA_DIR);
+    // Shared by all of the patching threads
+    pc.freeze();
 
     MainWindow w(&pc);
     w.show();
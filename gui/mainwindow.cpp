@@ -37,6 +37,11 @@ const int patcherPtrTypeId = qRegisterMetaType<PatcherPtr>("PatcherPtr");
 const int fileInfoPtrTypeId = qRegisterMetaType<FileInfoPtr>("FileInfoPtr");
 const int uint64TypeId = qRegisterMetaType<uint64_t>("uint64_t");
 
+// Upper bound on the number of files that are patched at the same time. Most
+// of the work is reading and writing large archives, so going beyond this just
+// makes the jobs fight over the disk.
+static const int MAX_CONCURRENT_JOBS = 4;
+
 MainWindowPrivate::MainWindowPrivate()
     : settings(qApp->applicationDirPath() % QStringLiteral("/settings.ini"),
                QSettings::IniFormat)
@@ -54,10 +59,10 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
     // If we're passed an argument, switch to automatic mode
     if (qApp->arguments().size() > 2) {
         d->autoMode = true;
-        d->fileName = qApp->arguments().at(1);
+        d->fileNames << qApp->arguments().at(1);
     } else {
         d->autoMode = false;
-        d->fileName.clear();
+        d->fileNames.clear();
     }
 
     d->pc = pc;
@@ -77,40 +82,30 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
         }
     }
 
-    // Create thread
-    d->thread = new QThread(this);
-    d->task = new PatcherTask();
-    d->task->moveToThread(d->thread);
-
-    connect(d->thread, &QThread::finished,
-            d->task, &QObject::deleteLater);
-    connect(this, &MainWindow::runThread,
-            d->task, &PatcherTask::patch);
-    connect(d->task, &PatcherTask::finished,
-            this, &MainWindow::onPatchingFinished);
-    connect(d->task, &PatcherTask::progressUpdated,
-            this, &MainWindow::onProgressUpdated);
-    connect(d->task, &PatcherTask::filesUpdated,
-            this, &MainWindow::onFilesUpdated);
-    connect(d->task, &PatcherTask::detailsUpdated,
-            this, &MainWindow::onDetailsUpdated);
-
-    d->thread->start();
 }
 
 MainWindow::~MainWindow()
 {
     Q_D(MainWindow);
 
-    if (d->patcher) {
-        d->patcher->cancel_patching();
-        d->pc->destroy_patcher(d->patcher);
-        d->patcher = nullptr;
+    // Stop the running jobs before the threads are joined. The patchers can
+    // only be destroyed once their tasks have returned.
+    for (PatchJob &job : d->jobs) {
+        if (job.patcher) {
+            job.patcher->cancel_patching();
+        }
+    }
+
+    for (QThread *thread : d->threads) {
+        thread->quit();
+        thread->wait();
     }
 
-    if (d->thread != nullptr) {
-        d->thread->quit();
-        d->thread->wait();
+    for (PatchJob &job : d->jobs) {
+        if (job.patcher) {
+            d->pc->destroy_patcher(job.patcher);
+            job.patcher = nullptr;
+        }
     }
 }
 
@@ -211,75 +206,146 @@ void MainWindow::onChooseFileItemClicked(QAction *action)
     }
 }
 
-void MainWindow::onProgressUpdated(uint64_t bytes, uint64_t maxBytes)
+void MainWindow::onCancelClicked()
 {
     Q_D(MainWindow);
 
-    // Normalize values to 1000000
-    static const int normalize = 1000000;
+    d->cancelled = true;
+    d->cancelBtn->setEnabled(false);
 
-    int value;
-    int max;
-    if (maxBytes == 0) {
-        value = 0;
-        max = 0;
-    } else {
-        value = (double) bytes / maxBytes * normalize;
-        max = normalize;
+    for (PatchJob &job : d->jobs) {
+        if (job.state == PatchJob::Pending) {
+            job.state = PatchJob::Cancelled;
+        } else if (job.state == PatchJob::Running && job.patcher) {
+            job.patcher->cancel_patching();
+        }
     }
+}
+
+void MainWindow::onProgressUpdated(int job, uint64_t bytes, uint64_t maxBytes)
+{
+    Q_D(MainWindow);
 
-    d->progressBar->setMaximum(max);
-    d->progressBar->setValue(value);
-    d->bytes = bytes;
-    d->maxBytes = maxBytes;
+    d->jobs[job].bytes = bytes;
+    d->jobs[job].maxBytes = maxBytes;
 
-    updateProgressText();
+    updateProgress();
 }
 
-void MainWindow::onFilesUpdated(uint64_t files, uint64_t maxFiles)
+void MainWindow::onFilesUpdated(int job, uint64_t files, uint64_t maxFiles)
 {
     Q_D(MainWindow);
 
-    d->files = files;
-    d->maxFiles = maxFiles;
+    d->jobs[job].files = files;
+    d->jobs[job].maxFiles = maxFiles;
 
-    updateProgressText();
+    updateProgress();
 }
 
-void MainWindow::onDetailsUpdated(const QString &text)
+void MainWindow::onDetailsUpdated(int job, const QString &text)
 {
     Q_D(MainWindow);
 
-    d->detailsLbl->setText(text);
+    d->jobs[job].details = text;
+
+    updateDetailsText();
 }
 
-void MainWindow::onPatchingFinished(const QString &newFile, bool failed,
+void MainWindow::onPatchingFinished(int job, const QString &newFile,
+                                    bool failed, bool cancelled,
                                     const QString &errorMessage)
 {
     Q_D(MainWindow);
 
-    d->pc->destroy_patcher(d->patcher);
-    d->patcher = nullptr;
+    PatchJob &j = d->jobs[job];
 
-    d->patcherNewFile = newFile;
-    d->patcherFailed = failed;
-    d->patcherError = errorMessage;
+    d->pc->destroy_patcher(j.patcher);
+    j.patcher = nullptr;
 
-    d->state = MainWindowPrivate::FinishedPatching;
-    updateWidgetsVisibility();
+    if (cancelled) {
+        j.state = PatchJob::Cancelled;
+    } else if (failed) {
+        j.state = PatchJob::Failed;
+    } else {
+        j.state = PatchJob::Succeeded;
+    }
+    j.newFile = newFile;
+    j.error = errorMessage;
+    j.details.clear();
+
+    // The task is free to take the next job
+    PatcherTask *task = qobject_cast<PatcherTask *>(sender());
+    if (task) {
+        d->idleTasks << task;
+    }
+
+    startPendingJobs();
+    updateProgress();
+    updateDetailsText();
+}
+
+void MainWindow::updateProgress()
+{
+    Q_D(MainWindow);
+
+    // Normalize values to 1000000
+    static const int normalize = 1000000;
+
+    // Finished jobs count as complete and running jobs contribute the
+    // fraction of bytes they have processed so far
+    double progress = 0.0;
+    int finished = 0;
+
+    for (const PatchJob &job : d->jobs) {
+        if (job.state == PatchJob::Running) {
+            if (job.maxBytes != 0) {
+                progress += (double) job.bytes / job.maxBytes;
+            }
+        } else if (job.state != PatchJob::Pending) {
+            progress += 1.0;
+            ++finished;
+        }
+    }
+
+    if (!d->jobs.empty()) {
+        progress /= d->jobs.size();
+    }
+
+    d->progressBar->setMaximum(normalize);
+    d->progressBar->setValue(progress * normalize);
+
+    if (d->jobs.size() == 1) {
+        const PatchJob &job = d->jobs[0];
+        d->progressBar->setFormat(tr("%1% - %2 / %3 files")
+                .arg(100.0 * progress, 0, 'f', 2)
+                .arg(job.files).arg(job.maxFiles));
+    } else {
+        d->progressBar->setFormat(tr("%1% - %2 / %3 ROMs")
+                .arg(100.0 * progress, 0, 'f', 2)
+                .arg(finished).arg(d->jobs.size()));
+    }
 }
 
-void MainWindow::updateProgressText()
+void MainWindow::updateDetailsText()
 {
     Q_D(MainWindow);
 
-    double percentage = 0.0;
-    if (d->maxBytes != 0) {
-        percentage = 100.0 * d->bytes / d->maxBytes;
+    if (d->jobs.size() == 1) {
+        d->detailsLbl->setText(d->jobs[0].details);
+        return;
+    }
+
+    QStringList lines;
+
+    for (const PatchJob &job : d->jobs) {
+        if (job.state == PatchJob::Running) {
+            lines << QStringLiteral("%1: %2")
+                    .arg(QFileInfo(job.fileName).fileName())
+                    .arg(job.details);
+        }
     }
 
-    d->progressBar->setFormat(tr("%1% - %2 / %3 files")
-            .arg(percentage, 0, 'f', 2).arg(d->files).arg(d->maxFiles));
+    d->detailsLbl->setText(lines.join(QLatin1Char('\n')));
 }
 
 void MainWindow::addWidgets()
@@ -379,10 +445,17 @@ void MainWindow::addWidgets()
     d->progressBar->setMinimum(0);
     d->progressBar->setValue(0);
 
+    d->cancelBtn = new QPushButton(tr("Cancel"), d->progressContainer);
+
+    QDialogButtonBox *progressButtons =
+            new QDialogButtonBox(d->progressContainer);
+    progressButtons->addButton(d->cancelBtn, QDialogButtonBox::RejectRole);
+
     progressLayout->addWidget(detailsBox);
     //progressLayout->addStretch(1);
     progressLayout->addWidget(newHorizLine(d->progressContainer));
     progressLayout->addWidget(d->progressBar);
+    progressLayout->addWidget(progressButtons);
     d->progressContainer->setLayout(progressLayout);
 
 
@@ -413,6 +486,8 @@ void MainWindow::setWidgetActions()
     // Buttons
     connect(d->buttons, &QDialogButtonBox::clicked,
             this, &MainWindow::onButtonClicked);
+    connect(d->cancelBtn, &QPushButton::clicked,
+            this, &MainWindow::onCancelClicked);
 
     // Choose file button menu
     connect(d->chooseFileMenu, &QMenu::triggered,
@@ -498,19 +573,19 @@ void MainWindow::chooseFile(const QString &patterns)
 {
     Q_D(MainWindow);
 
-    QString fileName = QFileDialog::getOpenFileName(this, QString(),
+    QStringList fileNames = QFileDialog::getOpenFileNames(this, QString(),
             d->settings.value(QStringLiteral("last_dir")).toString(),
             patterns);
-    if (fileName.isNull()) {
+    if (fileNames.isEmpty()) {
         return;
     }
 
     d->settings.setValue(QStringLiteral("last_dir"),
-                         QFileInfo(fileName).dir().absolutePath());
+                         QFileInfo(fileNames.first()).dir().absolutePath());
 
     d->state = MainWindowPrivate::ChoseFile;
 
-    d->fileName = fileName;
+    d->fileNames = fileNames;
 
     updateWidgetsVisibility();
 }
@@ -537,63 +612,73 @@ void MainWindow::updateWidgetsVisibility()
     }
 
     if (d->state == MainWindowPrivate::ChoseFile) {
-        d->messageLbl->setText(tr("File: %1").arg(d->fileName));
+        if (d->fileNames.size() == 1) {
+            d->messageLbl->setText(tr("File: %1").arg(d->fileNames.first()));
+        } else {
+            d->messageLbl->setText(tr("Files:\n%1")
+                    .arg(d->fileNames.join(QLatin1Char('\n'))));
+        }
     } else if (d->state == MainWindowPrivate::FinishedPatching) {
         QString message;
 
-        if (d->patcherFailed) {
-            message.append(tr("Failed to patch file: %1\n\n").arg(d->fileName));
-            message.append(d->patcherError);
+        if (d->jobs.size() == 1) {
+            const PatchJob &job = d->jobs[0];
+
+            if (job.state == PatchJob::Succeeded) {
+                message.append(tr("New file: %1\n\n").arg(job.newFile));
+                message.append(tr("Successfully patched file"));
+            } else {
+                message.append(tr("Failed to patch file: %1\n\n")
+                        .arg(job.fileName));
+                message.append(job.state == PatchJob::Cancelled
+                        ? tr("Patching was cancelled") : job.error);
+            }
         } else {
-            message.append(tr("New file: %1\n\n").arg(d->patcherNewFile));
-            message.append(tr("Successfully patched file"));
+            int succeeded = 0;
+
+            for (const PatchJob &job : d->jobs) {
+                switch (job.state) {
+                case PatchJob::Succeeded:
+                    ++succeeded;
+                    message.append(tr("New file: %1\n").arg(job.newFile));
+                    break;
+                case PatchJob::Failed:
+                    message.append(tr("Failed to patch file: %1 (%2)\n")
+                            .arg(job.fileName).arg(job.error));
+                    break;
+                case PatchJob::Cancelled:
+                    message.append(tr("Cancelled: %1\n").arg(job.fileName));
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            message.append(tr("\nSuccessfully patched %1 of %2 files")
+                    .arg(succeeded).arg(d->jobs.size()));
         }
 
         d->messageLbl->setText(message);
     }
 }
 
-void MainWindow::startPatching()
+QString MainWindow::outputPathFor(const QString &fileName, const QString &romId)
 {
-    Q_D(MainWindow);
-
-    d->bytes = 0;
-    d->maxBytes = 0;
-    d->files = 0;
-    d->maxFiles = 0;
-
-    d->progressBar->setMaximum(0);
-    d->progressBar->setValue(0);
-    d->detailsLbl->clear();
-
-    d->state = MainWindowPrivate::Patching;
-    updateWidgetsVisibility();
-
-    QString romId;
-    if (d->instLocSel->currentIndex() == d->instLocs.size()) {
-        romId = QStringLiteral("data-slot-%1").arg(d->instLocLe->text());
-    } else if (d->instLocSel->currentIndex() == d->instLocs.size() + 1) {
-        romId = QStringLiteral("extsd-slot-%1").arg(d->instLocLe->text());
-    } else {
-        romId = d->instLocs[d->instLocSel->currentIndex()].id;
-    }
-
-
     QStringList suffixes;
     suffixes << QStringLiteral(".tar.md5");
     suffixes << QStringLiteral(".tar.md5.gz");
     suffixes << QStringLiteral(".tar.md5.xz");
     suffixes << QStringLiteral(".zip");
 
-    QFileInfo qFileInfo(d->fileName);
-    QString suffix;
+    QFileInfo qFileInfo(fileName);
     QString outputName;
 
     for (const QString &suffix : suffixes) {
-        if (d->fileName.endsWith(suffix)) {
+        if (fileName.endsWith(suffix)) {
             // Input name: <parent path>/<base name>.<suffix>
             // Output name: <parent path>/<base name>_<rom id>.zip
-            outputName = d->fileName.left(d->fileName.size() - suffix.size())
+            outputName = qFileInfo.fileName().left(
+                    qFileInfo.fileName().size() - suffix.size())
                     % QStringLiteral("_")
                     % romId
                     % QStringLiteral(".zip");
@@ -608,19 +693,129 @@ void MainWindow::startPatching()
                 % qFileInfo.suffix();
     }
 
-    QString inputPath(QDir::toNativeSeparators(qFileInfo.filePath()));
-    QString outputPath(QDir::toNativeSeparators(
-            qFileInfo.dir().filePath(outputName)));
+    return QDir::toNativeSeparators(qFileInfo.dir().filePath(outputName));
+}
+
+void MainWindow::startPatching()
+{
+    Q_D(MainWindow);
+
+    d->progressBar->setMaximum(0);
+    d->progressBar->setValue(0);
+    d->detailsLbl->clear();
+    d->cancelBtn->setEnabled(true);
+    d->cancelled = false;
 
-    FileInfoPtr fileInfo = new mb::patcher::FileInfo();
-    fileInfo->set_input_path(inputPath.toUtf8().constData());
-    fileInfo->set_output_path(outputPath.toUtf8().constData());
-    fileInfo->set_device(*d->device);
-    fileInfo->set_rom_id(romId.toUtf8().constData());
+    d->state = MainWindowPrivate::Patching;
+    updateWidgetsVisibility();
 
-    d->patcher = d->pc->create_patcher(d->patcherId.toStdString());
+    if (d->instLocSel->currentIndex() == d->instLocs.size()) {
+        d->romId = QStringLiteral("data-slot-%1").arg(d->instLocLe->text());
+    } else if (d->instLocSel->currentIndex() == d->instLocs.size() + 1) {
+        d->romId = QStringLiteral("extsd-slot-%1").arg(d->instLocLe->text());
+    } else {
+        d->romId = d->instLocs[d->instLocSel->currentIndex()].id;
+    }
+
+    d->jobs.clear();
+    d->jobs.resize(d->fileNames.size());
+    for (int i = 0; i < d->fileNames.size(); ++i) {
+        d->jobs[i].fileName = d->fileNames[i];
+    }
 
-    emit runThread(d->patcher, fileInfo);
+    int workers = qBound(1, QThread::idealThreadCount(), MAX_CONCURRENT_JOBS);
+    startWorkers(qMin(workers, d->fileNames.size()));
+
+    startPendingJobs();
+    updateProgress();
+}
+
+/*!
+ * \brief Make sure at least \p count worker threads exist
+ *
+ * Workers are kept around after patching so that they can be reused for the
+ * next batch of files.
+ */
+void MainWindow::startWorkers(int count)
+{
+    Q_D(MainWindow);
+
+    while (d->threads.size() < count) {
+        QThread *thread = new QThread(this);
+        PatcherTask *task = new PatcherTask();
+        task->moveToThread(thread);
+
+        connect(thread, &QThread::finished,
+                task, &QObject::deleteLater);
+        connect(task, &PatcherTask::finished,
+                this, &MainWindow::onPatchingFinished);
+        connect(task, &PatcherTask::progressUpdated,
+                this, &MainWindow::onProgressUpdated);
+        connect(task, &PatcherTask::filesUpdated,
+                this, &MainWindow::onFilesUpdated);
+        connect(task, &PatcherTask::detailsUpdated,
+                this, &MainWindow::onDetailsUpdated);
+
+        thread->start();
+
+        d->threads << thread;
+        d->idleTasks << task;
+    }
+}
+
+/*!
+ * \brief Hand pending jobs to idle workers
+ *
+ * Each job gets its own Patcher instance. Patchers are not thread safe, so
+ * they are never shared between jobs.
+ */
+void MainWindow::startPendingJobs()
+{
+    Q_D(MainWindow);
+
+    for (size_t i = 0; i < d->jobs.size() && !d->idleTasks.isEmpty()
+            && !d->cancelled; ++i) {
+        PatchJob &job = d->jobs[i];
+        if (job.state != PatchJob::Pending) {
+            continue;
+        }
+
+        PatcherPtr patcher = d->pc->create_patcher(d->patcherId.toStdString());
+        if (!patcher) {
+            job.state = PatchJob::Failed;
+            job.error = tr("Failed to create patcher");
+            continue;
+        }
+
+        QString inputPath(QDir::toNativeSeparators(
+                QFileInfo(job.fileName).filePath()));
+        QString outputPath(outputPathFor(job.fileName, d->romId));
+
+        FileInfoPtr fileInfo = new mb::patcher::FileInfo();
+        fileInfo->set_input_path(inputPath.toUtf8().constData());
+        fileInfo->set_output_path(outputPath.toUtf8().constData());
+        fileInfo->set_device(*d->device);
+        fileInfo->set_rom_id(d->romId.toUtf8().constData());
+
+        job.patcher = patcher;
+        job.state = PatchJob::Running;
+
+        PatcherTask *task = d->idleTasks.takeFirst();
+        QMetaObject::invokeMethod(task, "patch", Qt::QueuedConnection,
+                                  Q_ARG(int, static_cast<int>(i)),
+                                  Q_ARG(PatcherPtr, patcher),
+                                  Q_ARG(FileInfoPtr, fileInfo));
+    }
+
+    for (const PatchJob &job : d->jobs) {
+        if (job.state == PatchJob::Pending || job.state == PatchJob::Running) {
+            return;
+        }
+    }
+
+    // Nothing is left to run
+    d->state = MainWindowPrivate::FinishedPatching;
+    updateWidgetsVisibility();
 }
 
 QWidget * MainWindow::newHorizLine(QWidget *parent)
@@ -661,6 +856,8 @@ static QString errorToString(const mb::patcher::ErrorCode &error) {
         return QObject::tr("Failed to read archive data for file");
     case mb::patcher::ErrorCode::ArchiveReadHeaderError:
         return QObject::tr("Failed to read archive entry header");
+    case mb::patcher::ErrorCode::ArchiveChecksumError:
+        return QObject::tr("Archive checksum does not match");
     case mb::patcher::ErrorCode::ArchiveWriteOpenError:
         return QObject::tr("Failed to open archive for writing");
     case mb::patcher::ErrorCode::ArchiveWriteDataError:
@@ -706,8 +903,10 @@ static void detailsUpdatedCbWrapper(const std::string &text, void *userData)
     task->detailsUpdatedCb(text);
 }
 
-void PatcherTask::patch(PatcherPtr patcher, FileInfoPtr info)
+void PatcherTask::patch(int job, PatcherPtr patcher, FileInfoPtr info)
 {
+    _job = job;
+
     patcher->set_file_info(info);
 
     bool ret = patcher->patch_file(&progressUpdatedCbWrapper,
@@ -720,24 +919,29 @@ void PatcherTask::patch(PatcherPtr patcher, FileInfoPtr info)
     patcher->set_file_info(nullptr);
     delete info;
 
+    _job = -1;
+
     if (!ret) {
-        emit finished(QString(), true, errorToString(patcher->error()));
+        bool cancelled = patcher->error()
+                == mb::patcher::ErrorCode::PatchingCancelled;
+        emit finished(job, QString(), true, cancelled,
+                      errorToString(patcher->error()));
     } else {
-        emit finished(newFile, false, QString());
+        emit finished(job, newFile, false, false, QString());
     }
 }
 
 void PatcherTask::progressUpdatedCb(uint64_t bytes, uint64_t maxBytes)
 {
-    emit progressUpdated(bytes, maxBytes);
+    emit progressUpdated(_job, bytes, maxBytes);
 }
 
 void PatcherTask::filesUpdatedCb(uint64_t files, uint64_t maxFiles)
 {
-    emit filesUpdated(files, maxFiles);
+    emit filesUpdated(_job, files, maxFiles);
 }
 
 void PatcherTask::detailsUpdatedCb(const std::string &text)
 {
-    emit detailsUpdated(QString::fromStdString(text));
+    emit detailsUpdated(_job, QString::fromStdString(text));
 }
@@ -44,29 +44,28 @@ public:
     MainWindow(mb::patcher::PatcherConfig *pc, QWidget* parent = 0);
     ~MainWindow();
 
-signals:
-    void runThread(PatcherPtr patcher, FileInfoPtr info);
-
 private slots:
     void onDeviceSelected(int index);
     void onInstallationLocationSelected(int index);
     void onInstallationLocationIdChanged(const QString &text);
     void onButtonClicked(QAbstractButton *button);
     void onChooseFileItemClicked(QAction *action);
+    void onCancelClicked();
 
     // Progress
-    void onProgressUpdated(uint64_t bytes, uint64_t maxBytes);
-    void onFilesUpdated(uint64_t files, uint64_t maxFiles);
-    void onDetailsUpdated(const QString &text);
+    void onProgressUpdated(int job, uint64_t bytes, uint64_t maxBytes);
+    void onFilesUpdated(int job, uint64_t files, uint64_t maxFiles);
+    void onDetailsUpdated(int job, const QString &text);
 
-    void onPatchingFinished(const QString &newFile, bool failed,
-                            const QString &errorMessage);
+    void onPatchingFinished(int job, const QString &newFile, bool failed,
+                            bool cancelled, const QString &errorMessage);
 
 private:
     virtual void closeEvent(QCloseEvent *event) override;
 
     void updateRomIdDescText(const QString &text);
-    void updateProgressText();
+    void updateProgress();
+    void updateDetailsText();
 
     void addWidgets();
     void setWidgetActions();
@@ -74,7 +73,10 @@ private:
     void populateInstallationLocations();
 
     void chooseFile(const QString &patterns);
+    QString outputPathFor(const QString &fileName, const QString &romId);
     void startPatching();
+    void startWorkers(int count);
+    void startPendingJobs();
 
     void updateWidgetsVisibility();
 
@@ -93,18 +95,22 @@ class PatcherTask : public QObject
 public:
     PatcherTask(QWidget *parent = 0);
 
-    void patch(PatcherPtr patcher, FileInfoPtr info);
+    Q_INVOKABLE void patch(int job, PatcherPtr patcher, FileInfoPtr info);
 
     void progressUpdatedCb(uint64_t bytes, uint64_t maxBytes);
     void filesUpdatedCb(uint64_t files, uint64_t maxFiles);
     void detailsUpdatedCb(const std::string &text);
 
 signals:
-    void finished(const QString &newFile, bool failed,
-                  const QString &errorMessage);
-    void progressUpdated(uint64_t bytes, uint64_t maxBytes);
-    void filesUpdated(uint64_t files, uint64_t maxFiles);
-    void detailsUpdated(const QString &text);
+    void finished(int job, const QString &newFile, bool failed,
+                  bool cancelled, const QString &errorMessage);
+    void progressUpdated(int job, uint64_t bytes, uint64_t maxBytes);
+    void filesUpdated(int job, uint64_t files, uint64_t maxFiles);
+    void detailsUpdated(int job, const QString &text);
+
+private:
+    // Job that is currently being patched
+    int _job = -1;
 };
 
 #endif // MAINWINDOW_H
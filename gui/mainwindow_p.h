@@ -30,6 +30,7 @@
 #include <vector>
 
 #include <QtCore/QSettings>
+#include <QtCore/QStringList>
 #include <QtCore/QThread>
 #include <QtWidgets/QCheckBox>
 #include <QtWidgets/QComboBox>
@@ -50,6 +51,32 @@ public:
     QString description;
 };
 
+class PatchJob
+{
+public:
+    enum State {
+        Pending,
+        Running,
+        Succeeded,
+        Failed,
+        Cancelled,
+    };
+
+    QString fileName;
+    QString newFile;
+    QString error;
+    QString details;
+    State state = Pending;
+
+    // Only set while the job is running
+    mb::patcher::Patcher *patcher = nullptr;
+
+    uint64_t bytes = 0;
+    uint64_t maxBytes = 0;
+    uint64_t files = 0;
+    uint64_t maxFiles = 0;
+};
+
 class MainWindowPrivate
 {
 public:
@@ -62,35 +89,27 @@ public:
 
     MainWindowPrivate();
 
-    uint64_t bytes;
-    uint64_t maxBytes;
-    uint64_t files;
-    uint64_t maxFiles;
-
     QSettings settings;
 
     // Current state of the patcher
     State state = FirstRun;
 
-    // Selected file
+    // Selected files
     QString patcherId;
-    QString fileName;
+    QStringList fileNames;
     bool autoMode;
 
     mb::patcher::PatcherConfig *pc = nullptr;
     std::vector<mb::device::Device> devices;
 
-    // Selected patcher
-    mb::patcher::Patcher *patcher = nullptr;
-
-    // Patcher finish status and error message
-    QString patcherNewFile;
-    bool patcherFailed;
-    QString patcherError;
+    // Patch queue. Every job gets its own Patcher instance while it runs.
+    std::vector<PatchJob> jobs;
+    QString romId;
+    bool cancelled = false;
 
-    // Threads
-    QThread *thread;
-    PatcherTask *task;
+    // Worker threads. Each one runs one PatcherTask at a time.
+    QList<QThread *> threads;
+    QList<PatcherTask *> idleTasks;
 
     // Selected device
     mb::device::Device *device = nullptr;
@@ -116,6 +135,7 @@ public:
     // Progress
     QLabel *detailsLbl;
     QProgressBar *progressBar;
+    QPushButton *cancelBtn;
 
     // Menus
     QMenu *chooseFileMenu;
@@ -0,0 +1,752 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reader/writer throughput benchmarks for every boot image format.
+//
+// Usage: mbbootimg_benchmarks [--kernel-size <KiB>] [--ramdisk-size <KiB>]
+//                             [--iterations <n>] [--filter <substring>]
+//                             [--json <path>]
+//
+// An image of each format is synthesized with the writer. The reader and
+// writer are then timed against both MemoryFile and FdFile. Results are
+// written as JSON to stdout (or to the --json path) and a human-readable
+// summary is printed to stderr.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
+
+#include "mbbootimg/defs.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+#include "mbbootimg/format/mtk_defs.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+// Allocation counting. With glibc, the malloc family is interposed so that
+// allocations made by the C-style format code are counted along with those
+// made through operator new (which is implemented on top of malloc).
+// Elsewhere, only operator new is counted.
+
+static std::atomic<uint64_t> g_allocations(0);
+
+#ifdef __GLIBC__
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t nmemb, size_t size);
+extern "C" void * __libc_realloc(void *ptr, size_t size);
+
+extern "C" void * malloc(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t nmemb, size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void * realloc(void *ptr, size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+#else
+void * operator new(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    // Exceptions may be disabled
+    abort();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+#endif
+
+enum class Backend
+{
+    Memory,
+    Fd,
+};
+
+static const Backend backends[] = {
+    Backend::Memory,
+    Backend::Fd,
+};
+
+struct Format
+{
+    const char *name;
+    int (*set_writer)(MbBiWriter *biw);
+    int (*enable_reader)(MbBiReader *bir);
+};
+
+static const Format formats[] = {
+    { MB_BI_FORMAT_NAME_ANDROID,
+      &mb_bi_writer_set_format_android,
+      &mb_bi_reader_enable_format_android },
+    { MB_BI_FORMAT_NAME_BUMP,
+      &mb_bi_writer_set_format_bump,
+      &mb_bi_reader_enable_format_bump },
+    { MB_BI_FORMAT_NAME_LOKI,
+      &mb_bi_writer_set_format_loki,
+      &mb_bi_reader_enable_format_loki },
+    { MB_BI_FORMAT_NAME_MTK,
+      &mb_bi_writer_set_format_mtk,
+      &mb_bi_reader_enable_format_mtk },
+    { MB_BI_FORMAT_NAME_SONY_ELF,
+      &mb_bi_writer_set_format_sony_elf,
+      &mb_bi_reader_enable_format_sony_elf },
+};
+
+struct Options
+{
+    size_t kernel_size = 8 * 1024 * 1024;
+    size_t ramdisk_size = 4 * 1024 * 1024;
+    unsigned int iterations = 5;
+    std::string filter;
+    std::string json_path;
+};
+
+struct Result
+{
+    std::string name;
+    std::string format;
+    std::string backend;
+    std::string op;
+    uint64_t bytes;
+    unsigned int iterations;
+    uint64_t min_ns;
+    uint64_t mean_ns;
+    uint64_t allocations;
+};
+
+// Entry payloads shared by all formats. Only the Loki writer asks for the
+// aboot image and only the MTK writer asks for the MTK headers.
+struct Payload
+{
+    std::string kernel;
+    std::string ramdisk;
+    std::string aboot;
+    std::string mtk_kernel_header;
+    std::string mtk_ramdisk_header;
+};
+
+// Backing storage for one format. The synthesized image is kept in memory and
+// in a temporary file.
+struct Fixture
+{
+    const Format *format;
+    std::string path;
+    std::string image;
+    // Total size of the entries as seen by the reader
+    uint64_t entries_size = 0;
+    void *mem_buf = nullptr;
+    size_t mem_size = 0;
+};
+
+static const char * backend_name(Backend backend)
+{
+    switch (backend) {
+    case Backend::Memory:
+        return "MemoryFile";
+    case Backend::Fd:
+        return "FdFile";
+    }
+    return "unknown";
+}
+
+static void fill_random(std::string &data, size_t size, uint32_t seed)
+{
+    data.resize(size);
+    for (auto &c : data) {
+        seed = seed * 1103515245 + 12345;
+        c = static_cast<char>(seed >> 16);
+    }
+}
+
+// Build an aboot image that the Loki patcher accepts. The signature checking
+// function pattern is placed so that its address matches the first entry in
+// the Loki target table (Samsung Galaxy S4 on AT&T).
+static void build_aboot(std::string &aboot)
+{
+    static const uint32_t check_sigs = 0x88e0ff98;
+    static const size_t func_offset = 0x100;
+    uint32_t base_field = mb_htole32(check_sigs - func_offset + 0x28);
+
+    aboot.assign(0x2000, '\0');
+    memcpy(&aboot[12], &base_field, sizeof(base_field));
+    memcpy(&aboot[func_offset], "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7", 8);
+}
+
+// Build an MTK header. The writer fills in the size field.
+static void build_mtk_header(std::string &header, const char *type)
+{
+    header.assign(512, '\0');
+    memcpy(&header[0], MTK_MAGIC, MTK_MAGIC_SIZE);
+    strncpy(&header[8], type, MTK_TYPE_SIZE - 1);
+}
+
+static bool open_file(Backend backend, Fixture &fixture, bool write,
+                      std::unique_ptr<mb::File> &out)
+{
+    switch (backend) {
+    case Backend::Memory:
+        if (write) {
+            free(fixture.mem_buf);
+            fixture.mem_buf = nullptr;
+            fixture.mem_size = 0;
+            out.reset(new mb::MemoryFile(&fixture.mem_buf,
+                                         &fixture.mem_size));
+        } else {
+            out.reset(new mb::MemoryFile(fixture.image.data(),
+                                         fixture.image.size()));
+        }
+        break;
+    case Backend::Fd:
+        out.reset(new mb::FdFile(fixture.path, write
+                ? mb::FileOpenMode::READ_WRITE_TRUNC
+                : mb::FileOpenMode::READ_ONLY));
+        break;
+    }
+
+    if (!out->is_open()) {
+        fprintf(stderr, "%s: Failed to open %s: %s\n", fixture.format->name,
+                backend_name(backend), out->error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Fill in the header fields that the format supports
+static bool set_up_header(MbBiHeader *header)
+{
+    uint64_t fields = mb_bi_header_supported_fields(header);
+
+    return (!(fields & MB_BI_HEADER_FIELD_PAGE_SIZE)
+                    || mb_bi_header_set_page_size(header, 2048) == MB_BI_OK)
+            && (!(fields & MB_BI_HEADER_FIELD_KERNEL_ADDRESS)
+                    || mb_bi_header_set_kernel_address(
+                            header, 0x10008000) == MB_BI_OK)
+            && (!(fields & MB_BI_HEADER_FIELD_RAMDISK_ADDRESS)
+                    || mb_bi_header_set_ramdisk_address(
+                            header, 0x11000000) == MB_BI_OK)
+            && (!(fields & MB_BI_HEADER_FIELD_ENTRYPOINT)
+                    || mb_bi_header_set_entrypoint_address(
+                            header, 0x10008000) == MB_BI_OK)
+            && (!(fields & MB_BI_HEADER_FIELD_KERNEL_CMDLINE)
+                    || mb_bi_header_set_kernel_cmdline(
+                            header, "console=null") == MB_BI_OK);
+}
+
+static bool write_image(const Format &format, const Payload &payload,
+                        mb::File &file)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    size_t n;
+
+    if (!biw) {
+        fprintf(stderr, "Failed to allocate writer\n");
+        return false;
+    }
+
+    if (format.set_writer(biw.get()) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), &file, false) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK
+            || !set_up_header(header)
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        goto error;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        const std::string *data = nullptr;
+
+        switch (mb_bi_entry_type(entry)) {
+        case MB_BI_ENTRY_KERNEL:
+            data = &payload.kernel;
+            break;
+        case MB_BI_ENTRY_RAMDISK:
+            data = &payload.ramdisk;
+            break;
+        case MB_BI_ENTRY_ABOOT:
+            data = &payload.aboot;
+            break;
+        case MB_BI_ENTRY_MTK_KERNEL_HEADER:
+            data = &payload.mtk_kernel_header;
+            break;
+        case MB_BI_ENTRY_MTK_RAMDISK_HEADER:
+            data = &payload.mtk_ramdisk_header;
+            break;
+        }
+
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK) {
+            goto error;
+        }
+
+        if (data && (mb_bi_writer_write_data(biw.get(), data->data(),
+                                             data->size(), &n) != MB_BI_OK
+                || n != data->size())) {
+            goto error;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        goto error;
+    }
+
+    return true;
+
+error:
+    fprintf(stderr, "%s: Failed to write image: %s\n", format.name,
+            mb_bi_writer_error_string(biw.get()));
+    return false;
+}
+
+// Read every entry to the end, either through read_data() or through
+// read_data_view()
+static bool read_entries(MbBiReader *bir, bool view, uint64_t &total)
+{
+    std::vector<unsigned char> buf(view ? 0 : 64 * 1024);
+    MbBiEntry *entry;
+    int ret;
+
+    total = 0;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        if (view) {
+            const void *ptr;
+            size_t n;
+
+            while ((ret = mb_bi_reader_read_data_view(bir, &ptr, &n))
+                    == MB_BI_OK) {
+                total += n;
+            }
+        } else {
+            size_t n;
+
+            while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(),
+                                                 &n)) == MB_BI_OK) {
+                total += n;
+            }
+        }
+
+        if (ret != MB_BI_EOF) {
+            return false;
+        }
+    }
+
+    return ret == MB_BI_EOF;
+}
+
+typedef std::function<bool()> BenchmarkFn;
+
+// Run a benchmark. `setup` is called before every iteration and is not timed.
+static bool run_benchmark(const Options &options, const Fixture &fixture,
+                          Backend backend, const char *op, uint64_t bytes,
+                          const BenchmarkFn &setup, const BenchmarkFn &fn,
+                          std::vector<Result> &results)
+{
+    Result result;
+    result.format = fixture.format->name;
+    result.backend = backend_name(backend);
+    result.op = op;
+    result.bytes = bytes;
+    result.iterations = options.iterations;
+    result.name = result.op + "/" + result.format + "/" + result.backend;
+
+    if (!options.filter.empty()
+            && result.name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    uint64_t total_ns = 0;
+    uint64_t min_ns = UINT64_MAX;
+    uint64_t total_allocations = 0;
+
+    for (unsigned int i = 0; i < options.iterations; ++i) {
+        if (!setup()) {
+            return false;
+        }
+
+        uint64_t allocations = g_allocations.load();
+        auto start = std::chrono::steady_clock::now();
+
+        if (!fn()) {
+            fprintf(stderr, "%s: Benchmark failed\n", result.name.c_str());
+            return false;
+        }
+
+        auto elapsed = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+
+        total_allocations += g_allocations.load() - allocations;
+        total_ns += elapsed;
+        min_ns = std::min(min_ns, elapsed);
+    }
+
+    result.min_ns = min_ns;
+    result.mean_ns = total_ns / options.iterations;
+    result.allocations = total_allocations / options.iterations;
+
+    fprintf(stderr, "%-40s %10.3f ms %10.1f MiB/s %8" PRIu64 " allocs\n",
+            result.name.c_str(),
+            static_cast<double>(result.min_ns) / 1e6,
+            result.min_ns > 0 ? static_cast<double>(bytes) / 1048576.0
+                    / (static_cast<double>(result.min_ns) / 1e9) : 0.0,
+            result.allocations);
+
+    results.push_back(std::move(result));
+    return true;
+}
+
+static bool run_format(const Options &options, const Payload &payload,
+                       Fixture &fixture, std::vector<Result> &results)
+{
+    const Format &format = *fixture.format;
+    const uint64_t image_size = fixture.image.size();
+    const uint64_t entries_size = fixture.entries_size;
+
+    for (Backend backend : backends) {
+        std::unique_ptr<mb::File> file;
+        ScopedReader bir(nullptr, mb_bi_reader_free);
+        MbBiHeader *header;
+        uint64_t total;
+
+        // Opens a reader with every format enabled, so the whole bidding
+        // process is exercised
+        auto open_reader = [&]() {
+            bir.reset();
+            if (!open_file(backend, fixture, false, file)) {
+                return false;
+            }
+            bir.reset(mb_bi_reader_new());
+            return bir && mb_bi_reader_enable_format_all(bir.get()) == MB_BI_OK
+                    && mb_bi_reader_open(bir.get(), file.get(), false)
+                            == MB_BI_OK;
+        };
+        auto open_reader_with_header = [&]() {
+            return open_reader() && mb_bi_reader_read_header(
+                    bir.get(), &header) == MB_BI_OK;
+        };
+        auto open_input = [&]() {
+            bir.reset();
+            return open_file(backend, fixture, false, file);
+        };
+        auto open_output = [&]() {
+            bir.reset();
+            return open_file(backend, fixture, true, file);
+        };
+
+        if (!run_benchmark(options, fixture, backend, "reader_open",
+                           image_size, open_input, [&]() {
+            bir.reset(mb_bi_reader_new());
+            return bir && mb_bi_reader_enable_format_all(bir.get()) == MB_BI_OK
+                    && mb_bi_reader_open(bir.get(), file.get(), false)
+                            == MB_BI_OK
+                    && strcmp(mb_bi_reader_format_name(bir.get()),
+                              format.name) == 0;
+        }, results)) {
+            return false;
+        }
+
+        if (!run_benchmark(options, fixture, backend, "read_header",
+                           image_size, open_reader, [&]() {
+            return mb_bi_reader_read_header(bir.get(), &header) == MB_BI_OK;
+        }, results)) {
+            return false;
+        }
+
+        if (!run_benchmark(options, fixture, backend, "read_entries",
+                           entries_size, open_reader_with_header, [&]() {
+            return read_entries(bir.get(), false, total)
+                    && total == entries_size;
+        }, results)) {
+            return false;
+        }
+
+        // Zero-copy views are only available for memory-backed files
+        if (backend == Backend::Memory && !run_benchmark(
+                options, fixture, backend, "read_entries_view", entries_size,
+                open_reader_with_header, [&]() {
+            return read_entries(bir.get(), true, total)
+                    && total == entries_size;
+        }, results)) {
+            return false;
+        }
+
+        if (!run_benchmark(options, fixture, backend, "write",
+                           image_size, open_output, [&]() {
+            return write_image(format, payload, *file);
+        }, results)) {
+            return false;
+        }
+
+        // Write the image and read it back in full through the same file
+        if (!run_benchmark(options, fixture, backend, "roundtrip",
+                           image_size + entries_size, open_output, [&]() {
+            if (!write_image(format, payload, *file)
+                    || !file->seek(0, SEEK_SET, nullptr)) {
+                return false;
+            }
+            bir.reset(mb_bi_reader_new());
+            return bir && format.enable_reader(bir.get()) == MB_BI_OK
+                    && mb_bi_reader_open(bir.get(), file.get(), false)
+                            == MB_BI_OK
+                    && mb_bi_reader_read_header(bir.get(), &header) == MB_BI_OK
+                    && read_entries(bir.get(), false, total)
+                    && total == entries_size;
+        }, results)) {
+            return false;
+        }
+
+        bir.reset();
+        file.reset();
+    }
+
+    return true;
+}
+
+// Synthesize the image for a format and store it in both backends
+static bool create_fixture(const Payload &payload, Fixture &fixture)
+{
+    {
+        mb::MemoryFile file(&fixture.mem_buf, &fixture.mem_size);
+        if (!file.is_open() || !write_image(*fixture.format, payload, file)
+                || !file.close()) {
+            return false;
+        }
+    }
+
+    fixture.image.assign(static_cast<char *>(fixture.mem_buf),
+                         fixture.mem_size);
+    free(fixture.mem_buf);
+    fixture.mem_buf = nullptr;
+    fixture.mem_size = 0;
+
+    // Read the image back once to check that the format is detected and to
+    // find the size of the entries
+    {
+        mb::MemoryFile file(fixture.image.data(), fixture.image.size());
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        MbBiHeader *header;
+
+        if (!file.is_open() || !bir
+                || mb_bi_reader_enable_format_all(bir.get()) != MB_BI_OK
+                || mb_bi_reader_open(bir.get(), &file, false) != MB_BI_OK
+                || strcmp(mb_bi_reader_format_name(bir.get()),
+                          fixture.format->name) != 0
+                || mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK
+                || !read_entries(bir.get(), false, fixture.entries_size)) {
+            fprintf(stderr, "%s: Failed to read synthesized image: %s\n",
+                    fixture.format->name,
+                    bir ? mb_bi_reader_error_string(bir.get()) : "");
+            return false;
+        }
+    }
+
+    mb::FdFile file(fixture.path, mb::FileOpenMode::WRITE_ONLY);
+    size_t n;
+
+    if (!file.is_open() || !file.truncate(0) || !mb::file_write_fully(
+            file, fixture.image.data(), fixture.image.size(), n)
+            || n != fixture.image.size() || !file.close()) {
+        fprintf(stderr, "%s: Failed to write fixture\n", fixture.path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void write_json(FILE *fp, const Options &options,
+                       const std::vector<Result> &results)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"context\": {\n");
+    fprintf(fp, "    \"library\": \"mbbootimg\",\n");
+    fprintf(fp, "    \"version\": \"%s\",\n", mb::version());
+    fprintf(fp, "    \"kernel_size\": %" MB_PRIzu ",\n", options.kernel_size);
+    fprintf(fp, "    \"ramdisk_size\": %" MB_PRIzu ",\n", options.ramdisk_size);
+    fprintf(fp, "    \"iterations\": %u\n", options.iterations);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"benchmarks\": [");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto const &r = results[i];
+        double seconds = static_cast<double>(r.min_ns) / 1e9;
+
+        fprintf(fp, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(fp, "      \"name\": \"%s\",\n", r.name.c_str());
+        fprintf(fp, "      \"format\": \"%s\",\n", r.format.c_str());
+        fprintf(fp, "      \"backend\": \"%s\",\n", r.backend.c_str());
+        fprintf(fp, "      \"op\": \"%s\",\n", r.op.c_str());
+        fprintf(fp, "      \"bytes\": %" PRIu64 ",\n", r.bytes);
+        fprintf(fp, "      \"iterations\": %u,\n", r.iterations);
+        fprintf(fp, "      \"min_ns\": %" PRIu64 ",\n", r.min_ns);
+        fprintf(fp, "      \"mean_ns\": %" PRIu64 ",\n", r.mean_ns);
+        fprintf(fp, "      \"bytes_per_second\": %.0f,\n",
+                seconds > 0 ? static_cast<double>(r.bytes) / seconds : 0.0);
+        fprintf(fp, "      \"allocations\": %" PRIu64 "\n", r.allocations);
+        fprintf(fp, "    }");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream,
+            "Usage: %s [--kernel-size <KiB>] [--ramdisk-size <KiB>]"
+            " [--iterations <n>]\n"
+            "       %*s [--filter <str>] [--json <path>]\n",
+            prog_name, static_cast<int>(strlen(prog_name)), "");
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        } else if (i + 1 >= argc) {
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        } else if (arg == "--kernel-size") {
+            options.kernel_size = strtoul(argv[++i], nullptr, 10) * 1024;
+        } else if (arg == "--ramdisk-size") {
+            options.ramdisk_size = strtoul(argv[++i], nullptr, 10) * 1024;
+        } else if (arg == "--iterations") {
+            options.iterations = static_cast<unsigned int>(
+                    strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--filter") {
+            options.filter = argv[++i];
+        } else if (arg == "--json") {
+            options.json_path = argv[++i];
+        } else {
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.kernel_size == 0 || options.ramdisk_size == 0
+            || options.iterations == 0) {
+        fprintf(stderr, "Sizes and iterations must be non-zero\n");
+        return EXIT_FAILURE;
+    }
+
+    Payload payload;
+    fill_random(payload.kernel, options.kernel_size, 0x12345678);
+    fill_random(payload.ramdisk, options.ramdisk_size, 0x87654321);
+    build_aboot(payload.aboot);
+    build_mtk_header(payload.mtk_kernel_header, "KERNEL");
+    build_mtk_header(payload.mtk_ramdisk_header, "ROOTFS");
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path_template = std::string(tmpdir ? tmpdir : "/tmp")
+            + "/mbbootimg_benchmark_XXXXXX";
+    std::vector<char> path(path_template.begin(), path_template.end());
+    path.push_back('\0');
+
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        fprintf(stderr, "%s: Failed to create temporary file: %s\n",
+                path.data(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    std::vector<Result> results;
+    bool ret = true;
+
+    for (const Format &format : formats) {
+        Fixture fixture;
+        fixture.format = &format;
+        fixture.path = path.data();
+
+        ret = create_fixture(payload, fixture)
+                && run_format(options, payload, fixture, results);
+        free(fixture.mem_buf);
+
+        if (!ret) {
+            break;
+        }
+    }
+
+    unlink(path.data());
+
+    if (!ret) {
+        return EXIT_FAILURE;
+    }
+
+    if (options.json_path.empty()) {
+        write_json(stdout, options, results);
+    } else {
+        FILE *fp = fopen(options.json_path.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                    options.json_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+        write_json(fp, options, results);
+        if (fclose(fp) != 0) {
+            fprintf(stderr, "%s: Failed to close file: %s\n",
+                    options.json_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
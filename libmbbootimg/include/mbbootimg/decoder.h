@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <cstddef>
+#else
+#  include <stddef.h>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+// Compression formats
+
+#define MB_BI_COMPRESSION_NONE          0
+#define MB_BI_COMPRESSION_GZIP          1
+#define MB_BI_COMPRESSION_LZ4_LEGACY    2
+#define MB_BI_COMPRESSION_LZMA          3
+#define MB_BI_COMPRESSION_XZ            4
+
+// Number of bytes needed to detect any of the compression formats
+#define MB_BI_COMPRESSION_MAGIC_SIZE    13
+
+MB_BEGIN_C_DECLS
+
+struct MbBiReader;
+
+namespace mb
+{
+class File;
+}
+
+MB_EXPORT int mb_bi_detect_compression(const void *data, size_t size);
+MB_EXPORT const char * mb_bi_compression_name(int compression);
+
+MB_EXPORT int mb_bi_reader_open_entry_decoded(struct MbBiReader *bir,
+                                              int entry_type,
+                                              mb::File **file,
+                                              int *compression);
+
+MB_END_C_DECLS
@@ -34,6 +34,14 @@
 #define MB_BI_FORMAT_NAME_MTK           "mtk"
 #define MB_BI_FORMAT_NAME_SONY_ELF      "sony_elf"
 
+// Digest algorithms
+
+#define MB_BI_DIGEST_SHA1               1
+#define MB_BI_DIGEST_SHA256             2
+
+#define MB_BI_DIGEST_SHA1_SIZE          20
+#define MB_BI_DIGEST_SHA256_SIZE        32
+
 // Return values
 
 #define MB_BI_EOF                       1
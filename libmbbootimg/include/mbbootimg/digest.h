@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+#define MB_BI_IMAGE_DIGEST_SIZE         MB_BI_DIGEST_SHA256_SIZE
+
+MB_BEGIN_C_DECLS
+
+struct MbBiReader;
+
+MB_EXPORT int mb_bi_image_digest(struct MbBiReader *bir,
+                                 unsigned char *digest);
+MB_EXPORT int mb_bi_image_digest_parallel(struct MbBiReader *bir,
+                                          unsigned char *digest);
+
+MB_EXPORT int mb_bi_image_digest_load_cache(const char *filename,
+                                            unsigned char *digest);
+MB_EXPORT int mb_bi_image_digest_save_cache(const char *filename,
+                                            const unsigned char *digest);
+
+MB_END_C_DECLS
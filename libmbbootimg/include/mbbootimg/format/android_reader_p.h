@@ -71,6 +71,14 @@ int android_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int android_reader_read_data(struct MbBiReader *bir, void *userdata,
                              void *buf, size_t buf_size,
                              size_t &bytes_read);
+int android_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                                  const void *&ptr, size_t &size);
+int android_reader_entry_range(struct MbBiReader *bir, void *userdata,
+                               uint64_t &offset, uint64_t &size);
+int android_reader_entry_location(struct MbBiReader *bir, void *userdata,
+                                  int entry_type, uint64_t &offset,
+                                  uint64_t &size, bool &can_truncate);
+int android_reader_reset(struct MbBiReader *bir, void *userdata);
 int android_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
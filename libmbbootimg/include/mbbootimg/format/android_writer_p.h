@@ -23,6 +23,8 @@
 
 #include <openssl/sha.h>
 
+#include "mbcommon/file/memory.h"
+
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_p.h"
 #include "mbbootimg/format/segment_writer_p.h"
@@ -32,6 +34,14 @@
 
 MB_BEGIN_C_DECLS
 
+struct AndroidEntryDigest
+{
+    int type;
+    bool valid;
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
 struct AndroidWriterCtx
 {
     // Header values
@@ -42,9 +52,24 @@ struct AndroidWriterCtx
 
     bool is_bump;
 
+    // Whether an existing image was patched with android_writer_patch_entry()
+    bool patched;
+
     SHA_CTX sha_ctx;
 
+    // Digests of the individual entries, indexed like the segment writer's
+    // entries
+    SHA_CTX entry_sha1_ctx;
+    SHA256_CTX entry_sha256_ctx;
+    struct AndroidEntryDigest digests[SEGMENT_WRITER_MAX_ENTRIES];
+
     struct SegmentWriterCtx segctx;
+
+    // In-memory copy of the image used when the output file cannot seek. The
+    // header can then be filled in before anything is written to the output.
+    mb::MemoryFile *spool;
+    void *spool_buf;
+    size_t spool_size;
 };
 
 int android_writer_get_header(struct MbBiWriter *biw, void *userdata,
@@ -59,7 +84,13 @@ int android_writer_write_data(struct MbBiWriter *biw, void *userdata,
                               const void *buf, size_t buf_size,
                               size_t &bytes_written);
 int android_writer_finish_entry(struct MbBiWriter *biw, void *userdata);
+int android_writer_get_entry_digest(struct MbBiWriter *biw, void *userdata,
+                                    int entry_type, int algorithm,
+                                    unsigned char *digest, size_t &digest_size);
+int android_writer_patch_entry(struct MbBiWriter *biw, void *userdata,
+                               int entry_type, const void *data, size_t size);
 int android_writer_close(struct MbBiWriter *biw, void *userdata);
+int android_writer_reset(struct MbBiWriter *biw, void *userdata);
 int android_writer_free(struct MbBiWriter *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -54,6 +54,8 @@ static inline void loki_fix_header_byte_order(struct LokiHeader *header)
     header->ramdisk_addr = mb_le32toh(header->ramdisk_addr);
 }
 
+bool _loki_find_aboot_func(const unsigned char *aboot, size_t aboot_size,
+                           size_t *offset_out);
 int _loki_patch_file(struct MbBiWriter *biw, mb::File *file,
                      const void *aboot, size_t aboot_size);
 
@@ -84,6 +84,14 @@ int loki_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int loki_reader_read_data(struct MbBiReader *bir, void *userdata,
                           void *buf, size_t buf_size,
                           size_t &bytes_read);
+int loki_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                               const void *&ptr, size_t &size);
+int loki_reader_entry_range(struct MbBiReader *bir, void *userdata,
+                            uint64_t &offset, uint64_t &size);
+int loki_reader_entry_location(struct MbBiReader *bir, void *userdata,
+                               int entry_type, uint64_t &offset,
+                               uint64_t &size, bool &can_truncate);
+int loki_reader_reset(struct MbBiReader *bir, void *userdata);
 int loki_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -61,6 +61,7 @@ int loki_writer_write_data(struct MbBiWriter *biw, void *userdata,
                            size_t &bytes_written);
 int loki_writer_finish_entry(struct MbBiWriter *biw, void *userdata);
 int loki_writer_close(struct MbBiWriter *biw, void *userdata);
+int loki_writer_reset(struct MbBiWriter *biw, void *userdata);
 int loki_writer_free(struct MbBiWriter *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -46,6 +46,15 @@ struct MtkReaderCtx
     struct SegmentReaderCtx segctx;
 };
 
+int read_mtk_header(struct MbBiReader *bir, mb::File *file,
+                    uint64_t offset, struct MtkHeader *mtkhdr_out);
+int find_mtk_headers(struct MbBiReader *bir, mb::File *file,
+                     struct AndroidHeader *hdr,
+                     struct MtkHeader *kernel_mtkhdr_out,
+                     uint64_t *kernel_offset_out,
+                     struct MtkHeader *ramdisk_mtkhdr_out,
+                     uint64_t *ramdisk_offset_out);
+
 int mtk_reader_bid(struct MbBiReader *bir, void *userdata, int best_bid);
 int mtk_reader_set_option(struct MbBiReader *bir, void *userdata,
                           const char *key, const char *value);
@@ -58,6 +67,14 @@ int mtk_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int mtk_reader_read_data(struct MbBiReader *bir, void *userdata,
                          void *buf, size_t buf_size,
                          size_t &bytes_read);
+int mtk_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                              const void *&ptr, size_t &size);
+int mtk_reader_entry_range(struct MbBiReader *bir, void *userdata,
+                           uint64_t &offset, uint64_t &size);
+int mtk_reader_entry_location(struct MbBiReader *bir, void *userdata,
+                              int entry_type, uint64_t &offset,
+                              uint64_t &size, bool &can_truncate);
+int mtk_reader_reset(struct MbBiReader *bir, void *userdata);
 int mtk_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -57,6 +57,7 @@ int mtk_writer_write_data(struct MbBiWriter *biw, void *userdata,
                           size_t &bytes_written);
 int mtk_writer_finish_entry(struct MbBiWriter *biw, void *userdata);
 int mtk_writer_close(struct MbBiWriter *biw, void *userdata);
+int mtk_writer_reset(struct MbBiWriter *biw, void *userdata);
 int mtk_writer_free(struct MbBiWriter *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -30,6 +30,8 @@
 #include "mbbootimg/reader.h"
 
 #define SEGMENT_READER_MAX_ENTRIES      10
+// Entry types are single-bit flags, so there is one slot per bit
+#define SEGMENT_READER_MAX_TYPES        32
 
 enum
 #ifdef __cplusplus
@@ -58,6 +60,10 @@ struct SegmentReaderCtx
     size_t entries_len;
     struct SegmentReaderEntry *entry;
 
+    // Index into entries (plus one) for each entry type bit. Zero means that
+    // there is no entry of that type.
+    unsigned char type_index[SEGMENT_READER_MAX_TYPES];
+
     uint64_t read_start_offset;
     uint64_t read_end_offset;
     uint64_t read_cur_offset;
@@ -90,3 +96,12 @@ int _segment_reader_go_to_entry(struct SegmentReaderCtx *ctx, mb::File *file,
 int _segment_reader_read_data(struct SegmentReaderCtx *ctx, mb::File *file,
                               void *buf, size_t buf_size, size_t &bytes_read,
                               struct MbBiReader *bir);
+int _segment_reader_read_data_view(struct SegmentReaderCtx *ctx, mb::File *file,
+                                   const void *&ptr, size_t &size,
+                                   struct MbBiReader *bir);
+int _segment_reader_entry_range(struct SegmentReaderCtx *ctx, mb::File *file,
+                                uint64_t &offset, uint64_t &size,
+                                struct MbBiReader *bir);
+int _segment_reader_entry_location(struct SegmentReaderCtx *ctx,
+                                   int entry_type, uint64_t &offset,
+                                   uint64_t &size, bool &can_truncate);
@@ -51,6 +51,14 @@ int sony_elf_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int sony_elf_reader_read_data(struct MbBiReader *bir, void *userdata,
                               void *buf, size_t buf_size,
                               size_t &bytes_read);
+int sony_elf_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                                   const void *&ptr, size_t &size);
+int sony_elf_reader_entry_range(struct MbBiReader *bir, void *userdata,
+                                uint64_t &offset, uint64_t &size);
+int sony_elf_reader_entry_location(struct MbBiReader *bir, void *userdata,
+                                   int entry_type, uint64_t &offset,
+                                   uint64_t &size, bool &can_truncate);
+int sony_elf_reader_reset(struct MbBiReader *bir, void *userdata);
 int sony_elf_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
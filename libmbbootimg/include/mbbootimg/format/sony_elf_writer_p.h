@@ -65,6 +65,7 @@ int sony_elf_writer_write_data(struct MbBiWriter *biw, void *userdata,
                                size_t &bytes_written);
 int sony_elf_writer_finish_entry(struct MbBiWriter *biw, void *userdata);
 int sony_elf_writer_close(struct MbBiWriter *biw, void *userdata);
+int sony_elf_writer_reset(struct MbBiWriter *biw, void *userdata);
 int sony_elf_writer_free(struct MbBiWriter *bir, void *userdata);
 
 MB_END_C_DECLS
@@ -78,6 +78,7 @@ MB_EXPORT struct MbBiHeader * mb_bi_header_new();
 MB_EXPORT void mb_bi_header_free(struct MbBiHeader *header);
 MB_EXPORT void mb_bi_header_clear(struct MbBiHeader *header);
 MB_EXPORT struct MbBiHeader * mb_bi_header_clone(struct MbBiHeader *header);
+MB_EXPORT int mb_bi_header_equals(struct MbBiHeader *a, struct MbBiHeader *b);
 
 // Supported fields
 MB_EXPORT uint64_t mb_bi_header_supported_fields(struct MbBiHeader *header);
@@ -21,7 +21,101 @@
 
 #include "mbbootimg/guard_p.h"
 
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "mbbootimg/format/android_defs.h"
+
+/*!
+ * \brief String field with inline storage
+ *
+ * Values shorter than \p N bytes (including the NUL terminator) are stored in
+ * the struct itself. Longer values, which only some formats allow (eg. Sony
+ * ELF cmdlines), are stored on the heap. A zero-filled instance is a valid
+ * unset value, so the containing header can still be allocated with calloc()
+ * and cleared with memset() after calling reset().
+ */
+template<size_t N>
+struct MbBiHeaderString
+{
+    // Heap copy of the value if it doesn't fit in buf
+    char *heap;
+    // Length of the value, excluding the NUL terminator
+    size_t size;
+    bool set;
+    char buf[N];
+
+    const char * get() const
+    {
+        return set ? (heap ? heap : buf) : nullptr;
+    }
+
+    bool assign(const char *value);
+    bool assign(const MbBiHeaderString &other);
+    void reset();
+    bool equals(const MbBiHeaderString &other) const;
+};
+
+template<size_t N>
+bool MbBiHeaderString<N>::assign(const char *value)
+{
+    if (!value) {
+        reset();
+        return true;
+    }
+
+    size_t len = strlen(value);
+    char *dup = nullptr;
+
+    if (len >= N) {
+        dup = static_cast<char *>(malloc(len + 1));
+        if (!dup) {
+            return false;
+        }
+        memcpy(dup, value, len + 1);
+    } else {
+        // The value may point into buf
+        memmove(buf, value, len + 1);
+    }
+
+    free(heap);
+    heap = dup;
+    size = len;
+    set = true;
+    return true;
+}
+
+template<size_t N>
+bool MbBiHeaderString<N>::assign(const MbBiHeaderString &other)
+{
+    if (this == &other) {
+        return true;
+    }
+    return assign(other.get());
+}
+
+template<size_t N>
+void MbBiHeaderString<N>::reset()
+{
+    free(heap);
+    heap = nullptr;
+    size = 0;
+    set = false;
+    buf[0] = '\0';
+}
+
+template<size_t N>
+bool MbBiHeaderString<N>::equals(const MbBiHeaderString &other) const
+{
+    if (set != other.set) {
+        return false;
+    } else if (!set) {
+        return true;
+    }
+    return size == other.size && memcmp(get(), other.get(), size) == 0;
+}
 
 struct MbBiHeader
 {
@@ -41,8 +135,10 @@ struct MbBiHeader
         uint32_t rpm_addr;          // |         |      |      |     | X    |
         uint32_t appsbl_addr;       // |         |      |      |     | X    |
         uint32_t page_size;         // | X       | X    | X    | X   |      |
-        char *board_name;           // | X       | X    | X    | X   |      |
-        char *cmdline;              // | X       | X    | X    | X   |      |
+        MbBiHeaderString<ANDROID_BOOT_NAME_SIZE + 1>
+                board_name;         // | X       | X    | X    | X   |      |
+        MbBiHeaderString<ANDROID_BOOT_ARGS_SIZE + 1>
+                cmdline;            // | X       | X    | X    | X   |      |
         // Raw header values           |---------|------|------|-----|------|
 
         // TODO TODO TODO
@@ -59,3 +59,15 @@
             UNSET_FIELD(STRUCT, FLAG, FIELD, nullptr); \
         } \
     } while (0)
+
+#define SET_INLINE_STRING_FIELD(STRUCT, FLAG, FIELD, VALUE) \
+    do { \
+        if (!(STRUCT)->field.FIELD.assign(VALUE)) { \
+            return MB_BI_FAILED; \
+        } \
+        if (VALUE) { \
+            (STRUCT)->fields_set |= (FLAG); \
+        } else { \
+            (STRUCT)->fields_set &= ~(FLAG); \
+        } \
+    } while (0)
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbbootimg/guard_p.h"
+
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbcommon/file.h"
+
+// Size of the windows read from the head and tail of the file while opening
+#define PROBE_HEAD_SIZE         (64 * 1024)
+#define PROBE_TAIL_SIZE         (64 * 1024)
+
+/*!
+ * \brief Read-only File that serves the head and tail of another File from
+ *        memory
+ *
+ * The windows are read once when the ProbeFile is opened. Reads and seeks that
+ * fall within them never touch the underlying File, so the format bidders can
+ * inspect the image as often as they like. Everything else is passed through
+ * to the underlying File, which only needs to support seeking if the caller
+ * moves backwards outside of the windows.
+ */
+class ProbeFile : public mb::File
+{
+public:
+    ProbeFile();
+    virtual ~ProbeFile();
+
+    bool open(mb::File *file, size_t head_size, size_t tail_size);
+
+    void set_window_only(bool window_only);
+
+    mb::File * file() const;
+
+protected:
+    bool on_open() override;
+    bool on_close() override;
+    bool on_read(void *buf, size_t size, size_t &bytes_read) override;
+    bool on_seek(int64_t offset, int whence, uint64_t &new_offset) override;
+    bool on_peek(const void *&buf, size_t &size) override;
+    bool on_consume(size_t size) override;
+
+private:
+    bool window(const unsigned char *&buf, size_t &size) const;
+    bool sync_position();
+    void copy_error(const char *action);
+
+    mb::File *_file;
+    size_t _head_max;
+    size_t _tail_max;
+
+    std::vector<unsigned char> _head;
+    std::vector<unsigned char> _tail;
+    uint64_t _tail_offset;
+
+    bool _size_known;
+    uint64_t _size;
+
+    // Logical position and position of the underlying file
+    uint64_t _pos;
+    uint64_t _file_pos;
+    bool _file_pos_known;
+
+    bool _seekable;
+    bool _window_only;
+
+    // Whether the underlying file supports File::peek() and whether the last
+    // peeked buffer came from it
+    bool _file_lends;
+    bool _lent_from_file;
+};
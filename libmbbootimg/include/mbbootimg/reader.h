@@ -22,10 +22,12 @@
 #ifdef __cplusplus
 #  include <cstdarg>
 #  include <cstddef>
+#  include <cstdint>
 #  include <cwchar>
 #else
 #  include <stdarg.h>
 #  include <stddef.h>
+#  include <stdint.h>
 #  include <wchar.h>
 #endif
 
@@ -36,6 +38,7 @@
 MB_BEGIN_C_DECLS
 
 struct MbBiReader;
+struct MbBiEntryReader;
 struct MbBiEntry;
 struct MbBiHeader;
 
@@ -47,6 +50,7 @@ class File;
 // Construction/destruction
 MB_EXPORT struct MbBiReader * mb_bi_reader_new(void);
 MB_EXPORT int mb_bi_reader_free(struct MbBiReader *bir);
+MB_EXPORT int mb_bi_reader_reset(struct MbBiReader *bir);
 
 // Open/close
 MB_EXPORT int mb_bi_reader_open_filename(struct MbBiReader *bir,
@@ -74,6 +78,22 @@ MB_EXPORT int mb_bi_reader_go_to_entry2(struct MbBiReader *bir,
                                         int entry_type);
 MB_EXPORT int mb_bi_reader_read_data(struct MbBiReader *bir, void *buf,
                                      size_t size, size_t *bytes_read);
+MB_EXPORT int mb_bi_reader_read_data_view(struct MbBiReader *bir,
+                                          const void **ptr, size_t *size);
+MB_EXPORT int mb_bi_reader_entry_range(struct MbBiReader *bir,
+                                       uint64_t *offset, uint64_t *size);
+
+// Entry handles
+MB_EXPORT int mb_bi_reader_open_entry(struct MbBiReader *bir, int entry_type,
+                                      struct MbBiEntryReader **handle);
+MB_EXPORT void mb_bi_entry_reader_free(struct MbBiEntryReader *handle);
+MB_EXPORT uint64_t mb_bi_entry_reader_size(struct MbBiEntryReader *handle);
+MB_EXPORT int mb_bi_entry_reader_read(struct MbBiEntryReader *handle,
+                                      void *buf, size_t size,
+                                      size_t *bytes_read);
+MB_EXPORT int mb_bi_entry_reader_error(struct MbBiEntryReader *handle);
+MB_EXPORT const char * mb_bi_entry_reader_error_string(
+        struct MbBiEntryReader *handle);
 
 // Format operations
 MB_EXPORT int mb_bi_reader_format_code(struct MbBiReader *bir);
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbbootimg/reader.h"
+
+typedef int (*MbBiReaderFormatEnabler)(struct MbBiReader *bir);
+
+/*!
+ * \brief Set of boot image formats chosen at compile time
+ *
+ * enable() calls each of the listed `mb_bi_reader_enable_format_*()` functions
+ * directly. Unlike mb_bi_reader_enable_format_all() and the by-name and by-code
+ * functions, this does not go through the table of all formats, so a statically
+ * linked program only contains the format readers that it lists.
+ *
+ * Example usage:
+ *
+ * \code{.cpp}
+ * typedef MbBiReaderFormats<mb_bi_reader_enable_format_android> BootFormats;
+ *
+ * if (BootFormats::enable(bir) != MB_BI_OK) {
+ *     // Handle error
+ * }
+ * \endcode
+ */
+template<MbBiReaderFormatEnabler First, MbBiReaderFormatEnabler... Rest>
+struct MbBiReaderFormats
+{
+    static int enable(MbBiReader *bir)
+    {
+        const MbBiReaderFormatEnabler enablers[] = { First, Rest... };
+
+        for (auto enabler : enablers) {
+            int ret = enabler(bir);
+            if (ret != MB_BI_OK && ret != MB_BI_WARN) {
+                return ret;
+            }
+        }
+
+        return MB_BI_OK;
+    }
+};
+
+//! All formats supported by libmbbootimg, in bidding order
+typedef MbBiReaderFormats<
+    mb_bi_reader_enable_format_android,
+    mb_bi_reader_enable_format_bump,
+    mb_bi_reader_enable_format_loki,
+    mb_bi_reader_enable_format_mtk,
+    mb_bi_reader_enable_format_sony_elf
+> MbBiAllReaderFormats;
@@ -32,6 +32,8 @@
 #include "mbcommon/common.h"
 #include "mbcommon/file.h"
 
+#include "mbbootimg/probe_file_p.h"
+
 #define READER_ENSURE_STATE(INSTANCE, STATES) \
     do { \
         if (!((INSTANCE)->state & (STATES))) { \
@@ -80,6 +82,15 @@ typedef int (*FormatReaderGoToEntry)(struct MbBiReader *bir, void *userdata,
 typedef int (*FormatReaderReadData)(struct MbBiReader *bir, void *userdata,
                                     void *buf, size_t buf_size,
                                     size_t &bytes_read);
+typedef int (*FormatReaderReadDataView)(struct MbBiReader *bir, void *userdata,
+                                        const void *&ptr, size_t &size);
+typedef int (*FormatReaderEntryRange)(struct MbBiReader *bir, void *userdata,
+                                      uint64_t &offset, uint64_t &size);
+typedef int (*FormatReaderEntryLocation)(struct MbBiReader *bir,
+                                         void *userdata, int entry_type,
+                                         uint64_t &offset, uint64_t &size,
+                                         bool &can_truncate);
+typedef int (*FormatReaderReset)(struct MbBiReader *bir, void *userdata);
 typedef int (*FormatReaderFree)(struct MbBiReader *bir, void *userdata);
 
 struct FormatReader
@@ -94,6 +105,10 @@ struct FormatReader
     FormatReaderReadEntry read_entry_cb;
     FormatReaderGoToEntry go_to_entry_cb;
     FormatReaderReadData read_data_cb;
+    FormatReaderReadDataView read_data_view_cb;
+    FormatReaderEntryRange entry_range_cb;
+    FormatReaderEntryLocation entry_location_cb;
+    FormatReaderReset reset_cb;
     FormatReaderFree free_cb;
     void *userdata;
 };
@@ -120,6 +135,10 @@ struct MbBiReader
     mb::File *file;
     bool file_owned;
 
+    // Head and tail windows of the opened file. While the reader is open,
+    // `file` points to this and `probe_file.file()` is the caller's handle.
+    ProbeFile probe_file;
+
     // Error
     int error_code;
     std::string error_string;
@@ -127,11 +146,29 @@ struct MbBiReader
     struct FormatReader formats[MAX_FORMATS];
     size_t formats_len;
     struct FormatReader *format;
+    // Whether `format` was forced instead of chosen by bidding
+    bool format_forced;
 
     struct MbBiHeader *header;
     struct MbBiEntry *entry;
 };
 
+// Independent cursor over one entry's data. It only uses positional reads on
+// the caller's File handle, so handles can be used from different threads.
+struct MbBiEntryReader
+{
+    mb::File *file;
+
+    int type;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t pos;
+    bool can_truncate;
+
+    int error_code;
+    std::string error_string;
+};
+
 int _mb_bi_reader_register_format(struct MbBiReader *bir,
                                   void *userdata,
                                   int type,
@@ -142,6 +179,10 @@ int _mb_bi_reader_register_format(struct MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
+                                  FormatReaderEntryRange entry_range_cb,
+                                  FormatReaderEntryLocation entry_location_cb,
+                                  FormatReaderReset reset_cb,
                                   FormatReaderFree free_cb);
 
 int _mb_bi_reader_free_format(struct MbBiReader *bir,
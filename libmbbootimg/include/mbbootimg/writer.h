@@ -47,6 +47,7 @@ class File;
 // Construction/destruction
 MB_EXPORT struct MbBiWriter * mb_bi_writer_new(void);
 MB_EXPORT int mb_bi_writer_free(struct MbBiWriter *biw);
+MB_EXPORT int mb_bi_writer_reset(struct MbBiWriter *biw);
 
 // Open/close
 MB_EXPORT int mb_bi_writer_open_filename(struct MbBiWriter *biw,
@@ -72,6 +73,12 @@ MB_EXPORT int mb_bi_writer_write_entry(struct MbBiWriter *biw,
                                        struct MbBiEntry *entry);
 MB_EXPORT int mb_bi_writer_write_data(struct MbBiWriter *biw, const void *buf,
                                       size_t size, size_t *bytes_written);
+MB_EXPORT int mb_bi_writer_get_entry_digest(struct MbBiWriter *biw,
+                                            int entry_type, int algorithm,
+                                            unsigned char *digest,
+                                            size_t *digest_size);
+MB_EXPORT int mb_bi_writer_patch_entry(struct MbBiWriter *biw, int entry_type,
+                                       const void *data, size_t size);
 
 // Format operations
 MB_EXPORT int mb_bi_writer_format_code(struct MbBiWriter *biw);
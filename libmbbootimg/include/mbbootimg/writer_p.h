@@ -80,7 +80,15 @@ typedef int (*FormatWriterWriteData)(struct MbBiWriter *biw, void *userdata,
                                      const void *buf, size_t buf_size,
                                      size_t &bytes_written);
 typedef int (*FormatWriterFinishEntry)(struct MbBiWriter *biw, void *userdata);
+typedef int (*FormatWriterGetEntryDigest)(struct MbBiWriter *biw,
+                                          void *userdata, int entry_type,
+                                          int algorithm, unsigned char *digest,
+                                          size_t &digest_size);
+typedef int (*FormatWriterPatchEntry)(struct MbBiWriter *biw, void *userdata,
+                                      int entry_type, const void *data,
+                                      size_t size);
 typedef int (*FormatWriterClose)(struct MbBiWriter *biw, void *userdata);
+typedef int (*FormatWriterReset)(struct MbBiWriter *biw, void *userdata);
 typedef int (*FormatWriterFree)(struct MbBiWriter *biw, void *userdata);
 
 struct FormatWriter
@@ -96,7 +104,10 @@ struct FormatWriter
     FormatWriterWriteEntry write_entry_cb;
     FormatWriterWriteData write_data_cb;
     FormatWriterFinishEntry finish_entry_cb;
+    FormatWriterGetEntryDigest get_entry_digest_cb;
+    FormatWriterPatchEntry patch_entry_cb;
     FormatWriterClose close_cb;
+    FormatWriterReset reset_cb;
     FormatWriterFree free_cb;
     void *userdata;
 };
@@ -145,7 +156,10 @@ int _mb_bi_writer_register_format(struct MbBiWriter *biw,
                                   FormatWriterWriteEntry write_entry_cb,
                                   FormatWriterWriteData write_data_cb,
                                   FormatWriterFinishEntry finish_entry_cb,
+                                  FormatWriterGetEntryDigest get_entry_digest_cb,
+                                  FormatWriterPatchEntry patch_entry_cb,
                                   FormatWriterClose close_cb,
+                                  FormatWriterReset reset_cb,
                                   FormatWriterFree free_cb);
 
 int _mb_bi_writer_free_format(struct MbBiWriter *biw,
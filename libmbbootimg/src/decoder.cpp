@@ -0,0 +1,753 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/decoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#include <lz4.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbbootimg/reader.h"
+
+/*!
+ * \file mbbootimg/decoder.h
+ * \brief Decompression of boot image entries
+ */
+
+#define INPUT_BUFFER_SIZE               (64 * 1024)
+
+// lz4 -l compresses the input in independent 8 MiB blocks
+#define LZ4_LEGACY_MAGIC                0x184c2102u
+#define LZ4_LEGACY_BLOCK_SIZE           (8 * 1024 * 1024)
+
+// Maximum number of lz4 blocks to decompress at the same time
+#define LZ4_LEGACY_MAX_BATCH            4
+
+// Fallback memory limit for multithreaded xz decoding when the amount of
+// physical memory is unknown
+#define XZ_DEFAULT_MEMLIMIT_THREADING   (64 * 1024 * 1024)
+
+namespace
+{
+
+/*!
+ * \brief Buffered input from an entry handle
+ */
+class EntryInput
+{
+public:
+    explicit EntryInput(MbBiEntryReader *handle)
+        : _handle(handle)
+        , _buf(INPUT_BUFFER_SIZE)
+        , _pos(0)
+        , _len(0)
+        , _eof(false)
+    {
+    }
+
+    ~EntryInput()
+    {
+        mb_bi_entry_reader_free(_handle);
+    }
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(EntryInput)
+
+    // Refill the buffer if it is empty. At EOF, the buffer stays empty.
+    bool fill(mb::File &file)
+    {
+        if (_pos < _len || _eof) {
+            return true;
+        }
+
+        size_t n;
+        int ret = mb_bi_entry_reader_read(_handle, _buf.data(), _buf.size(),
+                                          &n);
+        if (ret == MB_BI_EOF) {
+            _eof = true;
+            _pos = _len = 0;
+            return true;
+        } else if (ret != MB_BI_OK) {
+            file.set_error(std::make_error_code(std::errc::io_error),
+                           "%s", mb_bi_entry_reader_error_string(_handle));
+            return false;
+        }
+
+        _pos = 0;
+        _len = n;
+        return true;
+    }
+
+    // Read up to \p size bytes. Fewer bytes are only returned at EOF.
+    bool read(mb::File &file, void *buf, size_t size, size_t &bytes_read)
+    {
+        size_t total = 0;
+
+        while (total < size) {
+            if (!fill(file)) {
+                return false;
+            } else if (available() == 0) {
+                break;
+            }
+
+            size_t n = std::min(size - total, available());
+            memcpy(static_cast<char *>(buf) + total, data(), n);
+            consume(n);
+            total += n;
+        }
+
+        bytes_read = total;
+        return true;
+    }
+
+    const unsigned char * data() const
+    {
+        return _buf.data() + _pos;
+    }
+
+    size_t available() const
+    {
+        return _len - _pos;
+    }
+
+    void consume(size_t n)
+    {
+        _pos += n;
+    }
+
+private:
+    MbBiEntryReader *_handle;
+    std::vector<unsigned char> _buf;
+    size_t _pos;
+    size_t _len;
+    bool _eof;
+};
+
+/*!
+ * \brief Streaming decompressor
+ *
+ * decode() returns at least one byte unless the end of the stream has been
+ * reached.
+ */
+class Decoder
+{
+public:
+    virtual ~Decoder() = default;
+
+    virtual bool init(mb::File &file, EntryInput &in) = 0;
+    virtual bool decode(mb::File &file, EntryInput &in,
+                        void *buf, size_t size, size_t &bytes_read) = 0;
+};
+
+class PassthroughDecoder : public Decoder
+{
+public:
+    bool init(mb::File &file, EntryInput &in) override
+    {
+        (void) file;
+        (void) in;
+        return true;
+    }
+
+    bool decode(mb::File &file, EntryInput &in,
+                void *buf, size_t size, size_t &bytes_read) override
+    {
+        return in.read(file, buf, size, bytes_read);
+    }
+};
+
+class GzipDecoder : public Decoder
+{
+public:
+    GzipDecoder() : _initialized(false), _done(false)
+    {
+        memset(&_z, 0, sizeof(_z));
+    }
+
+    ~GzipDecoder()
+    {
+        if (_initialized) {
+            inflateEnd(&_z);
+        }
+    }
+
+    bool init(mb::File &file, EntryInput &in) override
+    {
+        (void) in;
+
+        // 16 + MAX_WBITS only accepts gzip streams
+        int ret = inflateInit2(&_z, 16 + MAX_WBITS);
+        if (ret != Z_OK) {
+            file.set_error(make_error_code(mb::FileError::InvalidState),
+                           "Failed to initialize zlib: %d", ret);
+            return false;
+        }
+
+        _initialized = true;
+        return true;
+    }
+
+    bool decode(mb::File &file, EntryInput &in,
+                void *buf, size_t size, size_t &bytes_read) override
+    {
+        uInt out_size = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+
+        _z.next_out = static_cast<Bytef *>(buf);
+        _z.avail_out = out_size;
+
+        while (!_done && _z.avail_out == out_size) {
+            if (!in.fill(file)) {
+                return false;
+            } else if (in.available() == 0) {
+                file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                               "Unexpected end of gzip data");
+                return false;
+            }
+
+            size_t avail = std::min<size_t>(in.available(), UINT_MAX);
+            _z.next_in = const_cast<Bytef *>(in.data());
+            _z.avail_in = static_cast<uInt>(avail);
+
+            int ret = inflate(&_z, Z_NO_FLUSH);
+            in.consume(avail - _z.avail_in);
+
+            if (ret == Z_STREAM_END) {
+                // pigz and friends produce multiple members. Anything else
+                // after the first member is padding.
+                if (!in.fill(file)) {
+                    return false;
+                }
+
+                if (in.available() >= 2 && in.data()[0] == 0x1f
+                        && in.data()[1] == 0x8b) {
+                    inflateReset(&_z);
+                } else {
+                    _done = true;
+                }
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                               "Failed to decompress gzip data: %s",
+                               _z.msg ? _z.msg : "Unknown error");
+                return false;
+            }
+        }
+
+        bytes_read = out_size - _z.avail_out;
+        return true;
+    }
+
+private:
+    z_stream _z;
+    bool _initialized;
+    bool _done;
+};
+
+class LzmaDecoder : public Decoder
+{
+public:
+    explicit LzmaDecoder(bool xz)
+        : _s(LZMA_STREAM_INIT)
+        , _xz(xz)
+        , _done(false)
+    {
+    }
+
+    ~LzmaDecoder()
+    {
+        lzma_end(&_s);
+    }
+
+    bool init(mb::File &file, EntryInput &in) override
+    {
+        (void) in;
+        lzma_ret ret;
+
+        if (_xz) {
+#if LZMA_VERSION >= UINT32_C(50040002)
+            // Only xz files with multiple blocks (eg. from xz -T) can be
+            // decoded in parallel. Others are decoded on a single thread.
+            lzma_mt mt;
+            memset(&mt, 0, sizeof(mt));
+            mt.threads = mb::ThreadPool::online_cpus();
+            mt.memlimit_threading = lzma_physmem() / 4;
+            if (mt.memlimit_threading == 0) {
+                mt.memlimit_threading = XZ_DEFAULT_MEMLIMIT_THREADING;
+            }
+            mt.memlimit_stop = UINT64_MAX;
+
+            ret = lzma_stream_decoder_mt(&_s, &mt);
+#else
+            ret = lzma_stream_decoder(&_s, UINT64_MAX, 0);
+#endif
+        } else {
+            ret = lzma_alone_decoder(&_s, UINT64_MAX);
+        }
+
+        if (ret != LZMA_OK) {
+            file.set_error(make_error_code(mb::FileError::InvalidState),
+                           "Failed to initialize liblzma: %d", ret);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool decode(mb::File &file, EntryInput &in,
+                void *buf, size_t size, size_t &bytes_read) override
+    {
+        _s.next_out = static_cast<uint8_t *>(buf);
+        _s.avail_out = size;
+
+        while (!_done && _s.avail_out == size) {
+            if (!in.fill(file)) {
+                return false;
+            }
+
+            // The multithreaded decoder may still have output buffered
+            // after the input has been consumed
+            lzma_action action = in.available() == 0
+                    ? LZMA_FINISH : LZMA_RUN;
+            size_t avail = in.available();
+
+            _s.next_in = in.data();
+            _s.avail_in = avail;
+
+            lzma_ret ret = lzma_code(&_s, action);
+            in.consume(avail - _s.avail_in);
+
+            if (ret == LZMA_STREAM_END) {
+                _done = true;
+            } else if (ret == LZMA_BUF_ERROR && action == LZMA_FINISH) {
+                file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                               "Unexpected end of %s data",
+                               _xz ? "xz" : "lzma");
+                return false;
+            } else if (ret != LZMA_OK) {
+                file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                               "Failed to decompress %s data: %d",
+                               _xz ? "xz" : "lzma", ret);
+                return false;
+            }
+        }
+
+        bytes_read = size - _s.avail_out;
+        return true;
+    }
+
+private:
+    lzma_stream _s;
+    bool _xz;
+    bool _done;
+};
+
+/*!
+ * \brief Decoder for the lz4 legacy format used by the kernel
+ *
+ * The blocks are independent, so a batch of them is read and then
+ * decompressed in parallel on the global thread pool.
+ */
+class Lz4LegacyDecoder : public Decoder
+{
+public:
+    Lz4LegacyDecoder()
+        : _count(0)
+        , _cur(0)
+        , _cur_pos(0)
+        , _done(false)
+    {
+    }
+
+    bool init(mb::File &file, EntryInput &in) override
+    {
+        unsigned char magic[4];
+        size_t n;
+
+        if (!in.read(file, magic, sizeof(magic), n)) {
+            return false;
+        }
+
+        size_t batch = std::min<size_t>(
+                LZ4_LEGACY_MAX_BATCH,
+                mb::ThreadPool::global().thread_count());
+        batch = std::max<size_t>(batch, 1);
+
+        _in.resize(batch);
+        _out.resize(batch);
+        _out_size.resize(batch);
+
+        return true;
+    }
+
+    bool decode(mb::File &file, EntryInput &in,
+                void *buf, size_t size, size_t &bytes_read) override
+    {
+        while (_cur == _count) {
+            if (_done) {
+                bytes_read = 0;
+                return true;
+            } else if (!next_batch(file, in)) {
+                return false;
+            }
+        }
+
+        size_t n = std::min(size, _out_size[_cur] - _cur_pos);
+        memcpy(buf, _out[_cur].data() + _cur_pos, n);
+        _cur_pos += n;
+
+        if (_cur_pos == _out_size[_cur]) {
+            ++_cur;
+            _cur_pos = 0;
+        }
+
+        bytes_read = n;
+        return true;
+    }
+
+private:
+    bool next_batch(mb::File &file, EntryInput &in)
+    {
+        _count = 0;
+        _cur = 0;
+        _cur_pos = 0;
+
+        // Read the compressed blocks
+        while (_count < _in.size()) {
+            unsigned char header[4];
+            size_t n;
+
+            if (!in.read(file, header, sizeof(header), n)) {
+                return false;
+            } else if (n < sizeof(header)) {
+                _done = true;
+                break;
+            }
+
+            uint32_t block_size;
+            memcpy(&block_size, header, sizeof(block_size));
+            block_size = mb_le32toh(block_size);
+
+            if (block_size == LZ4_LEGACY_MAGIC) {
+                // Concatenated stream
+                continue;
+            } else if (block_size == 0 || block_size
+                    > static_cast<uint32_t>(
+                            LZ4_compressBound(LZ4_LEGACY_BLOCK_SIZE))) {
+                // Same as the lz4 tool: anything that cannot be a block size
+                // ends the stream (eg. padding)
+                _done = true;
+                break;
+            }
+
+            _in[_count].resize(block_size);
+            if (!in.read(file, _in[_count].data(), block_size, n)) {
+                return false;
+            } else if (n != block_size) {
+                file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                               "Unexpected end of lz4 data");
+                return false;
+            }
+
+            ++_count;
+        }
+
+        // Decompress them
+        std::atomic<size_t> failed_block(SIZE_MAX);
+
+        mb::ThreadPool::global().parallel_for(
+                0, _count, 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                _out[i].resize(LZ4_LEGACY_BLOCK_SIZE);
+
+                int ret = LZ4_decompress_safe(
+                        _in[i].data(), _out[i].data(),
+                        static_cast<int>(_in[i].size()),
+                        LZ4_LEGACY_BLOCK_SIZE);
+                if (ret < 0) {
+                    failed_block = i;
+                    return false;
+                }
+
+                _out_size[i] = static_cast<size_t>(ret);
+            }
+            return true;
+        });
+
+        if (failed_block != SIZE_MAX) {
+            file.set_error(make_error_code(mb::FileError::BadFileFormat),
+                           "Failed to decompress lz4 block");
+            return false;
+        }
+
+        // Skip empty blocks
+        while (_cur < _count && _out_size[_cur] == 0) {
+            ++_cur;
+        }
+
+        return true;
+    }
+
+    std::vector<std::vector<char>> _in;
+    std::vector<std::vector<char>> _out;
+    std::vector<size_t> _out_size;
+
+    size_t _count;
+    size_t _cur;
+    size_t _cur_pos;
+    bool _done;
+};
+
+/*!
+ * \brief Read-only File that decompresses an entry handle
+ */
+class DecodedEntryFile : public mb::File
+{
+public:
+    explicit DecodedEntryFile(MbBiEntryReader *handle)
+        : _input(handle)
+        , _compression(MB_BI_COMPRESSION_NONE)
+    {
+    }
+
+    virtual ~DecodedEntryFile()
+    {
+        close();
+    }
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(DecodedEntryFile)
+
+    bool open()
+    {
+        return File::open();
+    }
+
+    int compression() const
+    {
+        return _compression;
+    }
+
+protected:
+    bool on_open() override
+    {
+        if (!_input.fill(*this)) {
+            return false;
+        }
+
+        _compression = mb_bi_detect_compression(_input.data(),
+                                                _input.available());
+
+        switch (_compression) {
+        case MB_BI_COMPRESSION_GZIP:
+            _decoder.reset(new GzipDecoder());
+            break;
+        case MB_BI_COMPRESSION_LZ4_LEGACY:
+            _decoder.reset(new Lz4LegacyDecoder());
+            break;
+        case MB_BI_COMPRESSION_LZMA:
+            _decoder.reset(new LzmaDecoder(false));
+            break;
+        case MB_BI_COMPRESSION_XZ:
+            _decoder.reset(new LzmaDecoder(true));
+            break;
+        default:
+            _decoder.reset(new PassthroughDecoder());
+            break;
+        }
+
+        return _decoder->init(*this, _input);
+    }
+
+    bool on_close() override
+    {
+        _decoder.reset();
+        return true;
+    }
+
+    bool on_read(void *buf, size_t size, size_t &bytes_read) override
+    {
+        return _decoder->decode(*this, _input, buf, size, bytes_read);
+    }
+
+private:
+    EntryInput _input;
+    std::unique_ptr<Decoder> _decoder;
+    int _compression;
+};
+
+}
+
+// The legacy .lzma header has no magic. Accept the properties that every
+// encoder uses by default (lc=3, lp=0, pb=2), a dictionary size of 2^n or
+// 2^n + 2^(n-1), and a sane or unknown uncompressed size.
+static bool _is_lzma_alone(const unsigned char *data, size_t size)
+{
+    if (size < 13 || data[0] != 0x5d) {
+        return false;
+    }
+
+    uint32_t dict_size;
+    memcpy(&dict_size, data + 1, sizeof(dict_size));
+    dict_size = mb_le32toh(dict_size);
+
+    if (dict_size < 4096) {
+        return false;
+    }
+
+    uint32_t d = dict_size;
+    while ((d & 1) == 0) {
+        d >>= 1;
+    }
+    if (d != 1 && d != 3) {
+        return false;
+    }
+
+    uint64_t uncomp_size;
+    memcpy(&uncomp_size, data + 5, sizeof(uncomp_size));
+    uncomp_size = mb_le64toh(uncomp_size);
+
+    return uncomp_size == UINT64_MAX || uncomp_size < (UINT64_C(1) << 40);
+}
+
+/*!
+ * \brief Detect the compression format of some data.
+ *
+ * \param data Start of the data
+ * \param size Size of \p data. At least #MB_BI_COMPRESSION_MAGIC_SIZE bytes
+ *             are needed to detect every format.
+ *
+ * \return One of the `MB_BI_COMPRESSION_*` constants. Unrecognized data is
+ *         reported as #MB_BI_COMPRESSION_NONE.
+ */
+int mb_bi_detect_compression(const void *data, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+
+    if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return MB_BI_COMPRESSION_GZIP;
+    } else if (size >= 4 && memcmp(p, "\x02\x21\x4c\x18", 4) == 0) {
+        return MB_BI_COMPRESSION_LZ4_LEGACY;
+    } else if (size >= 6 && memcmp(p, "\xfd" "7zXZ\x00", 6) == 0) {
+        return MB_BI_COMPRESSION_XZ;
+    } else if (_is_lzma_alone(p, size)) {
+        return MB_BI_COMPRESSION_LZMA;
+    } else {
+        return MB_BI_COMPRESSION_NONE;
+    }
+}
+
+/*!
+ * \brief Get the name of a compression format.
+ *
+ * \param compression One of the `MB_BI_COMPRESSION_*` constants
+ *
+ * \return Name of the format or nullptr if \p compression is invalid
+ */
+const char * mb_bi_compression_name(int compression)
+{
+    switch (compression) {
+    case MB_BI_COMPRESSION_NONE:
+        return "none";
+    case MB_BI_COMPRESSION_GZIP:
+        return "gzip";
+    case MB_BI_COMPRESSION_LZ4_LEGACY:
+        return "lz4_legacy";
+    case MB_BI_COMPRESSION_LZMA:
+        return "lzma";
+    case MB_BI_COMPRESSION_XZ:
+        return "xz";
+    default:
+        return nullptr;
+    }
+}
+
+/*!
+ * \brief Open a decompressed view of an entry's data.
+ *
+ * The compression format is detected from the entry's data. gzip, lz4 legacy,
+ * lzma, and xz are supported. Data in any other format is returned as is. The
+ * returned File is read-only and cannot be seeked.
+ *
+ * Like mb_bi_reader_open_entry(), this does not change the reader's position
+ * and the File can be used from a different thread than the reader. lz4
+ * blocks and multi-block xz files are decompressed on multiple threads.
+ *
+ * \note The File must be deleted before the reader is closed, reset, or freed.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] entry_type Entry type to open (0 for the first entry)
+ * \param[out] file Pointer to store the new File
+ * \param[out] compression Pointer to store the detected compression format
+ *                         (may be nullptr)
+ *
+ * \return
+ *   * #MB_BI_OK if the entry is successfully opened
+ *   * #MB_BI_EOF if there is no entry of type \p entry_type
+ *   * #MB_BI_UNSUPPORTED if the format does not store entries contiguously
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_reader_open_entry_decoded(MbBiReader *bir, int entry_type,
+                                    mb::File **file, int *compression)
+{
+    MbBiEntryReader *handle;
+    int ret;
+
+    ret = mb_bi_reader_open_entry(bir, entry_type, &handle);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    std::unique_ptr<DecodedEntryFile> decoded(
+            new(std::nothrow) DecodedEntryFile(handle));
+    if (!decoded) {
+        mb_bi_entry_reader_free(handle);
+        mb_bi_reader_set_error(bir, -errno, "%s", strerror(errno));
+        return MB_BI_FAILED;
+    }
+
+    if (!decoded->open()) {
+        mb_bi_reader_set_error(bir, decoded->error()
+                                       == mb::FileError::BadFileFormat
+                                   ? MB_BI_ERROR_FILE_FORMAT
+                                   : MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to open entry decoder: %s",
+                               decoded->error_string().c_str());
+        return MB_BI_FAILED;
+    }
+
+    if (compression) {
+        *compression = decoded->compression();
+    }
+
+    *file = decoded.release();
+    return MB_BI_OK;
+}
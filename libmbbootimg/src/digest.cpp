@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/digest.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cctype>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <sys/stat.h>
+#endif
+
+#include <openssl/sha.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+
+/*!
+ * \file mbbootimg/digest.h
+ * \brief Content digests of boot images
+ */
+
+// Bump this if the digested data changes so that stale caches are ignored
+#define DIGEST_VERSION          "mbbootimg-digest-v1"
+
+#define CACHE_SUFFIX            ".digest"
+
+struct EntryDigest
+{
+    int type;
+    uint64_t size;
+    unsigned char sha256[SHA256_DIGEST_LENGTH];
+};
+
+typedef std::unique_ptr<MbBiEntryReader, decltype(mb_bi_entry_reader_free) *>
+        ScopedEntryReader;
+
+// Entry that is hashed on the thread pool through its own handle
+struct EntryTask
+{
+    ScopedEntryReader handle;
+    // Index into the list of entry digests
+    size_t index;
+    int ret;
+    int error_code;
+    std::string error_string;
+};
+
+static bool _update_u32(SHA256_CTX *ctx, uint32_t value)
+{
+    value = mb_htole32(value);
+    return SHA256_Update(ctx, &value, sizeof(value));
+}
+
+static bool _update_u64(SHA256_CTX *ctx, uint64_t value)
+{
+    value = mb_htole64(value);
+    return SHA256_Update(ctx, &value, sizeof(value));
+}
+
+static bool _update_field(SHA256_CTX *ctx, bool is_set, uint32_t value)
+{
+    unsigned char present = is_set;
+    return SHA256_Update(ctx, &present, sizeof(present))
+            && (!is_set || _update_u32(ctx, value));
+}
+
+static bool _update_string(SHA256_CTX *ctx, const char *str)
+{
+    unsigned char present = !!str;
+    size_t len = str ? strlen(str) : 0;
+
+    return SHA256_Update(ctx, &present, sizeof(present))
+            && (!str || (_update_u32(ctx, static_cast<uint32_t>(len))
+                    && SHA256_Update(ctx, str, len)));
+}
+
+static bool _update_header(SHA256_CTX *ctx, MbBiHeader *header)
+{
+#define FIELD(NAME) \
+    _update_field(ctx, mb_bi_header_##NAME##_is_set(header), \
+                  mb_bi_header_##NAME(header))
+
+    return _update_string(ctx, mb_bi_header_board_name(header))
+            && _update_string(ctx, mb_bi_header_kernel_cmdline(header))
+            && FIELD(page_size)
+            && FIELD(kernel_address)
+            && FIELD(ramdisk_address)
+            && FIELD(secondboot_address)
+            && FIELD(kernel_tags_address)
+            && FIELD(sony_ipl_address)
+            && FIELD(sony_rpm_address)
+            && FIELD(sony_appsbl_address)
+            && FIELD(entrypoint_address);
+
+#undef FIELD
+}
+
+static int _digest_entry_data(MbBiReader *bir, EntryDigest &digest)
+{
+    SHA256_CTX ctx;
+    unsigned char buf[10240];
+    const void *ptr;
+    size_t n;
+    int ret;
+
+    if (!SHA256_Init(&ctx)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA256_CTX");
+        return MB_BI_FAILED;
+    }
+
+    digest.size = 0;
+
+    // Hash straight from the mapped image if possible
+    while ((ret = mb_bi_reader_read_data_view(bir, &ptr, &n)) == MB_BI_OK) {
+        if (!SHA256_Update(&ctx, ptr, n)) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to update SHA256 hash");
+            return MB_BI_FAILED;
+        }
+        digest.size += n;
+    }
+
+    if (ret == MB_BI_UNSUPPORTED) {
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+                == MB_BI_OK) {
+            if (!SHA256_Update(&ctx, buf, n)) {
+                mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                                       "Failed to update SHA256 hash");
+                return MB_BI_FAILED;
+            }
+            digest.size += n;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return ret;
+    }
+
+    if (!SHA256_Final(digest.sha256, &ctx)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to finalize SHA256 hash");
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _digest_entry_handle(EntryTask &task, EntryDigest &digest)
+{
+    SHA256_CTX ctx;
+    unsigned char buf[10240];
+    size_t n;
+    int ret;
+
+    if (!SHA256_Init(&ctx)) {
+        task.error_code = MB_BI_ERROR_INTERNAL_ERROR;
+        task.error_string = "Failed to initialize SHA256_CTX";
+        return MB_BI_FAILED;
+    }
+
+    digest.size = 0;
+
+    while ((ret = mb_bi_entry_reader_read(task.handle.get(), buf, sizeof(buf),
+                                          &n)) == MB_BI_OK) {
+        if (!SHA256_Update(&ctx, buf, n)) {
+            task.error_code = MB_BI_ERROR_INTERNAL_ERROR;
+            task.error_string = "Failed to update SHA256 hash";
+            return MB_BI_FAILED;
+        }
+        digest.size += n;
+    }
+
+    if (ret != MB_BI_EOF) {
+        task.error_code = mb_bi_entry_reader_error(task.handle.get());
+        task.error_string =
+                mb_bi_entry_reader_error_string(task.handle.get());
+        return ret;
+    }
+
+    if (!SHA256_Final(digest.sha256, &ctx)) {
+        task.error_code = MB_BI_ERROR_INTERNAL_ERROR;
+        task.error_string = "Failed to finalize SHA256 hash";
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+static int _image_digest(MbBiReader *bir, unsigned char *digest,
+                         bool parallel)
+{
+    std::vector<EntryDigest> entries;
+    std::vector<EntryTask> tasks;
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    SHA256_CTX ctx;
+    int ret;
+
+    if (!SHA256_Init(&ctx)
+            || !SHA256_Update(&ctx, DIGEST_VERSION, strlen(DIGEST_VERSION))) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA256_CTX");
+        return MB_BI_FAILED;
+    }
+
+    ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    if (!_update_header(&ctx, header)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to update SHA256 hash");
+        return MB_BI_FAILED;
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        EntryDigest entry_digest;
+        entry_digest.type = mb_bi_entry_type(entry);
+
+        if (parallel) {
+            MbBiEntryReader *handle;
+
+            ret = mb_bi_reader_open_entry(bir, entry_digest.type, &handle);
+            if (ret == MB_BI_OK) {
+                // Hashed once all of the entries have been found
+                tasks.push_back({ ScopedEntryReader(handle,
+                                                    mb_bi_entry_reader_free),
+                                  entries.size(), MB_BI_OK, 0, {} });
+                entries.push_back(entry_digest);
+                continue;
+            } else if (ret != MB_BI_UNSUPPORTED) {
+                return ret;
+            }
+
+            // The format does not store entries contiguously
+            parallel = false;
+        }
+
+        ret = _digest_entry_data(bir, entry_digest);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        entries.push_back(entry_digest);
+    }
+
+    if (ret != MB_BI_EOF) {
+        return ret;
+    }
+
+    if (!tasks.empty()) {
+        mb::TaskGroup group(mb::ThreadPool::global());
+
+        for (auto &task : tasks) {
+            EntryTask *task_ptr = &task;
+            EntryDigest *digest_ptr = &entries[task.index];
+
+            group.submit([task_ptr, digest_ptr] {
+                task_ptr->ret = _digest_entry_handle(*task_ptr, *digest_ptr);
+            });
+        }
+
+        group.wait();
+
+        for (auto const &task : tasks) {
+            if (task.ret != MB_BI_OK) {
+                mb_bi_reader_set_error(bir, task.error_code, "%s",
+                                       task.error_string.c_str());
+                return task.ret;
+            }
+        }
+    }
+
+    // Entries are matched by type, not by position
+    std::sort(entries.begin(), entries.end(),
+              [](const EntryDigest &a, const EntryDigest &b) {
+        return a.type < b.type;
+    });
+
+    bool ok = _update_u32(&ctx, static_cast<uint32_t>(entries.size()));
+
+    for (auto it = entries.begin(); ok && it != entries.end(); ++it) {
+        ok = _update_u32(&ctx, static_cast<uint32_t>(it->type))
+                && _update_u64(&ctx, it->size)
+                && SHA256_Update(&ctx, it->sha256, sizeof(it->sha256));
+    }
+
+    if (!ok || !SHA256_Final(digest, &ctx)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to finalize SHA256 hash");
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Compute canonical digest of a boot image
+ *
+ * The digest covers the header fields and the type, size, and data of every
+ * entry. It does not depend on the boot image format or on the order of the
+ * entries, so two boot images have the same digest if and only if they have
+ * the same header values and the same entries. Comparing digests is therefore
+ * equivalent to comparing the headers and the data of each entry.
+ *
+ * This function must be called right after the boot image is opened. It reads
+ * the header and all of the entries, so no further operations besides
+ * closing are possible afterwards.
+ *
+ * \param[in] bir MbBiReader
+ * \param[out] digest Output buffer of size #MB_BI_IMAGE_DIGEST_SIZE
+ *
+ * \return
+ *   * #MB_BI_OK if the digest is successfully computed
+ *   * \<= #MB_BI_WARN if an error occurs while reading the boot image. The
+ *     error string is set on \p bir.
+ */
+int mb_bi_image_digest(MbBiReader *bir, unsigned char *digest)
+{
+    return _image_digest(bir, digest, false);
+}
+
+/*!
+ * \brief Compute canonical digest of a boot image, hashing entries in parallel
+ *
+ * This computes the same digest as mb_bi_image_digest(). Entries are hashed on
+ * the global thread pool through handles from mb_bi_reader_open_entry(). If
+ * the format does not support entry handles, the entries are hashed one after
+ * another instead.
+ *
+ * \warning The File passed to mb_bi_reader_open() must support concurrent
+ *          calls to File::read_at() (see mb_bi_reader_open_entry()).
+ *
+ * \param[in] bir MbBiReader
+ * \param[out] digest Output buffer of size #MB_BI_IMAGE_DIGEST_SIZE
+ *
+ * \return
+ *   * #MB_BI_OK if the digest is successfully computed
+ *   * \<= #MB_BI_WARN if an error occurs while reading the boot image. The
+ *     error string is set on \p bir.
+ */
+int mb_bi_image_digest_parallel(MbBiReader *bir, unsigned char *digest)
+{
+    return _image_digest(bir, digest, true);
+}
+
+#ifndef _WIN32
+static std::string _cache_key(const struct stat &sb)
+{
+#ifdef __APPLE__
+    const struct timespec &mtime = sb.st_mtimespec;
+#else
+    const struct timespec &mtime = sb.st_mtim;
+#endif
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%" PRIu64 " %" PRId64 " %ld",
+             static_cast<uint64_t>(sb.st_size),
+             static_cast<int64_t>(mtime.tv_sec),
+             static_cast<long>(mtime.tv_nsec));
+    return buf;
+}
+#endif
+
+/*!
+ * \brief Load cached digest of a boot image
+ *
+ * The cache is stored in a `<filename>.digest` sidecar file written by
+ * mb_bi_image_digest_save_cache(). It is only used if the size and
+ * modification time of the boot image have not changed since then.
+ *
+ * \note Caching is not supported on Windows.
+ *
+ * \param[in] filename Path to boot image
+ * \param[out] digest Output buffer of size #MB_BI_IMAGE_DIGEST_SIZE
+ *
+ * \return
+ *   * #MB_BI_OK if a valid cached digest was loaded
+ *   * #MB_BI_WARN if there is no cached digest or if it is stale
+ *   * #MB_BI_UNSUPPORTED if caching is not supported on this platform
+ */
+int mb_bi_image_digest_load_cache(const char *filename, unsigned char *digest)
+{
+#ifdef _WIN32
+    (void) filename;
+    (void) digest;
+    return MB_BI_UNSUPPORTED;
+#else
+    std::string cache_path(filename);
+    cache_path += CACHE_SUFFIX;
+    struct stat sb;
+
+    if (stat(filename, &sb) < 0) {
+        return MB_BI_WARN;
+    }
+
+    FILE *fp = fopen(cache_path.c_str(), "rb");
+    if (!fp) {
+        return MB_BI_WARN;
+    }
+
+    char buf[256];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    // Format: "<version> <size> <mtime sec> <mtime nsec> <hex digest>\n"
+    std::string expected(DIGEST_VERSION);
+    expected += ' ';
+    expected += _cache_key(sb);
+    expected += ' ';
+
+    if (n != expected.size() + MB_BI_IMAGE_DIGEST_SIZE * 2 + 1
+            || memcmp(buf, expected.data(), expected.size()) != 0
+            || buf[n - 1] != '\n') {
+        return MB_BI_WARN;
+    }
+
+    const char *hex = buf + expected.size();
+    for (size_t i = 0; i < MB_BI_IMAGE_DIGEST_SIZE; ++i) {
+        unsigned int byte;
+        if (!isxdigit(static_cast<unsigned char>(hex[i * 2]))
+                || !isxdigit(static_cast<unsigned char>(hex[i * 2 + 1]))
+                || sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return MB_BI_WARN;
+        }
+        digest[i] = static_cast<unsigned char>(byte);
+    }
+
+    return MB_BI_OK;
+#endif
+}
+
+/*!
+ * \brief Save digest of a boot image to its cache
+ *
+ * The digest must have been computed from the current contents of the boot
+ * image. The write is not atomic, but a partially written cache is detected
+ * and ignored by mb_bi_image_digest_load_cache().
+ *
+ * \note Caching is not supported on Windows.
+ *
+ * \param filename Path to boot image
+ * \param digest Digest returned by mb_bi_image_digest()
+ *
+ * \return
+ *   * #MB_BI_OK if the digest was cached
+ *   * #MB_BI_UNSUPPORTED if caching is not supported on this platform
+ *   * #MB_BI_FAILED if the cache could not be written
+ */
+int mb_bi_image_digest_save_cache(const char *filename,
+                                  const unsigned char *digest)
+{
+#ifdef _WIN32
+    (void) filename;
+    (void) digest;
+    return MB_BI_UNSUPPORTED;
+#else
+    std::string cache_path(filename);
+    cache_path += CACHE_SUFFIX;
+    struct stat sb;
+
+    if (stat(filename, &sb) < 0) {
+        return MB_BI_FAILED;
+    }
+
+    std::string data(DIGEST_VERSION);
+    data += ' ';
+    data += _cache_key(sb);
+    data += ' ';
+    for (size_t i = 0; i < MB_BI_IMAGE_DIGEST_SIZE; ++i) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", digest[i]);
+        data += hex;
+    }
+    data += '\n';
+
+    FILE *fp = fopen(cache_path.c_str(), "wb");
+    if (!fp) {
+        return MB_BI_FAILED;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+
+    if (fclose(fp) < 0 || !ok) {
+        remove(cache_path.c_str());
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+#endif
+}
@@ -545,6 +545,54 @@ int android_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int android_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                  const void *&ptr, size_t &size)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, ptr, size,
+                                          bir);
+}
+
+int android_reader_entry_range(MbBiReader *bir, void *userdata,
+                               uint64_t &offset, uint64_t &size)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    return _segment_reader_entry_range(&ctx->segctx, bir->file, offset, size,
+                                       bir);
+}
+
+int android_reader_entry_location(MbBiReader *bir, void *userdata,
+                                  int entry_type, uint64_t &offset,
+                                  uint64_t &size, bool &can_truncate)
+{
+    (void) bir;
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    return _segment_reader_entry_location(&ctx->segctx, entry_type, offset,
+                                          size, can_truncate);
+}
+
+int android_reader_reset(MbBiReader *bir, void *userdata)
+{
+    (void) bir;
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    // Keep the options and the format variant
+    bool allow_truncated_dt = ctx->allow_truncated_dt;
+    bool is_bump = ctx->is_bump;
+
+    _segment_reader_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_reader_init(&ctx->segctx);
+
+    ctx->allow_truncated_dt = allow_truncated_dt;
+    ctx->is_bump = is_bump;
+
+    return MB_BI_OK;
+}
+
 int android_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -590,6 +638,10 @@ int mb_bi_reader_enable_format_android(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
+                                         &android_reader_entry_range,
+                                         &android_reader_entry_location,
+                                         &android_reader_reset,
                                          &android_reader_free);
 }
 
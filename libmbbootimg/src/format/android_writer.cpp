@@ -20,6 +20,8 @@
 #include "mbbootimg/format/android_writer_p.h"
 
 #include <algorithm>
+#include <new>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -30,6 +32,7 @@
 
 #include "mbcommon/endian.h"
 #include "mbcommon/file.h"
+#include "mbcommon/file_error.h"
 #include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
@@ -43,6 +46,93 @@
 
 MB_BEGIN_C_DECLS
 
+/*!
+ * \brief Get the file that the entries are written to
+ *
+ * This is the spool if the output file cannot seek and the output file
+ * otherwise.
+ */
+static mb::File * android_writer_file(MbBiWriter *biw, AndroidWriterCtx *ctx)
+{
+    return ctx->spool ? static_cast<mb::File *>(ctx->spool) : biw->file;
+}
+
+/*!
+ * \brief Start spooling the image to memory
+ *
+ * Used when the output file does not support seeking, eg. pipes and sockets.
+ * The image is written out sequentially once it is complete.
+ */
+static int android_writer_start_spool(MbBiWriter *biw, AndroidWriterCtx *ctx)
+{
+    if (ctx->spool) {
+        return MB_BI_OK;
+    }
+
+    ctx->spool = new(std::nothrow) mb::MemoryFile(&ctx->spool_buf,
+                                                  &ctx->spool_size);
+    if (!ctx->spool) {
+        mb_bi_writer_set_error(biw, -errno,
+                               "Failed to allocate spool: %s",
+                               strerror(errno));
+        return MB_BI_FAILED;
+    } else if (!ctx->spool->is_open()) {
+        mb_bi_writer_set_error(biw, ctx->spool->error().value() /* TODO */,
+                               "Failed to open spool: %s",
+                               ctx->spool->error_string().c_str());
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Write spooled image to the output file
+ */
+static int android_writer_flush_spool(MbBiWriter *biw, AndroidWriterCtx *ctx)
+{
+    size_t n;
+
+    if (!mb::file_write_fully(*biw->file, ctx->spool_buf, ctx->spool_size, n)
+            || n != ctx->spool_size) {
+        mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                               "Failed to write spooled image: %s",
+                               biw->file->error_string().c_str());
+        // Part of the image may have been written already and the output file
+        // cannot seek back to retry
+        return MB_BI_FATAL;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Update the image hash and the current entry's digests
+ */
+static bool android_writer_update_hashes(AndroidWriterCtx *ctx,
+                                         const void *buf, size_t size)
+{
+    return SHA1_Update(&ctx->sha_ctx, buf, size)
+            && SHA1_Update(&ctx->entry_sha1_ctx, buf, size)
+            && SHA256_Update(&ctx->entry_sha256_ctx, buf, size);
+}
+
+static bool android_writer_is_valid_page_size(uint32_t page_size)
+{
+    switch (page_size) {
+    case 2048:
+    case 4096:
+    case 8192:
+    case 16384:
+    case 32768:
+    case 65536:
+    case 131072:
+        return true;
+    default:
+        return false;
+    }
+}
+
 int android_writer_get_header(MbBiWriter *biw, void *userdata,
                               MbBiHeader *header)
 {
@@ -60,6 +150,12 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     int ret;
 
+    if (ctx->patched) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "Cannot write new image after patching entries");
+        return MB_BI_FAILED;
+    }
+
     // Construct header
     memset(&ctx->hdr, 0, sizeof(ctx->hdr));
     memcpy(ctx->hdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
@@ -79,21 +175,13 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
     if (mb_bi_header_page_size_is_set(header)) {
         uint32_t page_size = mb_bi_header_page_size(header);
 
-        switch (mb_bi_header_page_size(header)) {
-        case 2048:
-        case 4096:
-        case 8192:
-        case 16384:
-        case 32768:
-        case 65536:
-        case 131072:
-            ctx->hdr.page_size = page_size;
-            break;
-        default:
+        if (!android_writer_is_valid_page_size(page_size)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
                                    "Invalid page size: %" PRIu32, page_size);
             return MB_BI_FAILED;
         }
+
+        ctx->hdr.page_size = page_size;
     } else {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
                                "Page size field is required");
@@ -132,6 +220,7 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
     // Clear existing entries (none should exist unless this function fails and
     // the user reattempts to call it)
     _segment_writer_entries_clear(&ctx->segctx);
+    memset(ctx->digests, 0, sizeof(ctx->digests));
 
     ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_KERNEL,
                                       0, false, ctx->hdr.page_size, biw);
@@ -149,12 +238,29 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
                                       0, false, ctx->hdr.page_size, biw);
     if (ret != MB_BI_OK) return ret;
 
-    // Start writing after first page
-    if (!biw->file->seek(ctx->hdr.page_size, SEEK_SET, nullptr)) {
-        mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+    // Start writing after first page. If the output file cannot seek, then
+    // the image is spooled to memory instead so that the header can be written
+    // first.
+    if (!ctx->spool && !biw->file->seek(ctx->hdr.page_size, SEEK_SET,
+                                        nullptr)) {
+        if (biw->file->is_fatal()
+                || biw->file->error() != mb::FileError::UnsupportedSeek) {
+            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                                   "Failed to seek to first page: %s",
+                                   biw->file->error_string().c_str());
+            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        ret = android_writer_start_spool(biw, ctx);
+        if (ret != MB_BI_OK) return ret;
+    }
+
+    if (ctx->spool && !ctx->spool->seek(ctx->hdr.page_size, SEEK_SET,
+                                        nullptr)) {
+        mb_bi_writer_set_error(biw, ctx->spool->error().value() /* TODO */,
                                "Failed to seek to first page: %s",
-                               biw->file->error_string().c_str());
-        return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                               ctx->spool->error_string().c_str());
+        return MB_BI_FAILED;
     }
 
     return MB_BI_OK;
@@ -164,8 +270,22 @@ int android_writer_get_entry(MbBiWriter *biw, void *userdata,
                              MbBiEntry *entry)
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+    int ret;
 
-    return _segment_writer_get_entry(&ctx->segctx, biw->file, entry, biw);
+    ret = _segment_writer_get_entry(&ctx->segctx,
+                                    android_writer_file(biw, ctx), entry, biw);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    if (!SHA1_Init(&ctx->entry_sha1_ctx)
+            || !SHA256_Init(&ctx->entry_sha256_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize entry digests");
+        return MB_BI_FATAL;
+    }
+
+    return MB_BI_OK;
 }
 
 int android_writer_write_entry(MbBiWriter *biw, void *userdata,
@@ -173,7 +293,9 @@ int android_writer_write_entry(MbBiWriter *biw, void *userdata,
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
 
-    return _segment_writer_write_entry(&ctx->segctx, biw->file, entry, biw);
+    return _segment_writer_write_entry(&ctx->segctx,
+                                       android_writer_file(biw, ctx), entry,
+                                       biw);
 }
 
 int android_writer_write_data(MbBiWriter *biw, void *userdata,
@@ -181,9 +303,10 @@ int android_writer_write_data(MbBiWriter *biw, void *userdata,
                               size_t &bytes_written)
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+    mb::File *file = android_writer_file(biw, ctx);
     int ret;
 
-    ret = _segment_writer_write_data(&ctx->segctx, biw->file, buf, buf_size,
+    ret = _segment_writer_write_data(&ctx->segctx, file, buf, buf_size,
                                      bytes_written, biw);
     if (ret != MB_BI_OK) {
         return ret;
@@ -191,7 +314,7 @@ int android_writer_write_data(MbBiWriter *biw, void *userdata,
 
     // We always include the image in the hash. The size is sometimes included
     // and is handled in android_writer_finish_entry().
-    if (!SHA1_Update(&ctx->sha_ctx, buf, buf_size)) {
+    if (!android_writer_update_hashes(ctx, buf, buf_size)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         // This must be fatal as the write already happened and cannot be
@@ -208,7 +331,8 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
     SegmentWriterEntry *swentry;
     int ret;
 
-    ret = _segment_writer_finish_entry(&ctx->segctx, biw->file, biw);
+    ret = _segment_writer_finish_entry(&ctx->segctx,
+                                       android_writer_file(biw, ctx), biw);
     if (ret != MB_BI_OK) {
         return ret;
     }
@@ -226,6 +350,18 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
         return MB_BI_FATAL;
     }
 
+    AndroidEntryDigest *digest = &ctx->digests[swentry - ctx->segctx.entries];
+
+    if (!SHA1_Final(digest->sha1, &ctx->entry_sha1_ctx)
+            || !SHA256_Final(digest->sha256, &ctx->entry_sha256_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to finalize entry digests");
+        return MB_BI_FATAL;
+    }
+
+    digest->type = swentry->type;
+    digest->valid = true;
+
     switch (swentry->type) {
     case MB_BI_ENTRY_KERNEL:
         ctx->hdr.kernel_size = swentry->size;
@@ -244,25 +380,370 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
     return MB_BI_OK;
 }
 
+int android_writer_get_entry_digest(MbBiWriter *biw, void *userdata,
+                                    int entry_type, int algorithm,
+                                    unsigned char *digest, size_t &digest_size)
+{
+    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+    const unsigned char *data;
+    size_t size;
+
+    switch (algorithm) {
+    case MB_BI_DIGEST_SHA1:
+        size = SHA_DIGEST_LENGTH;
+        break;
+    case MB_BI_DIGEST_SHA256:
+        size = SHA256_DIGEST_LENGTH;
+        break;
+    default:
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                               "Unsupported digest algorithm: %d", algorithm);
+        return MB_BI_UNSUPPORTED;
+    }
+
+    if (digest_size < size) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Digest buffer too small: %" MB_PRIzu
+                               " < %" MB_PRIzu, digest_size, size);
+        return MB_BI_FAILED;
+    }
+
+    for (size_t i = 0; i < _segment_writer_entries_size(&ctx->segctx); ++i) {
+        AndroidEntryDigest *entry_digest = &ctx->digests[i];
+
+        if (entry_digest->valid && entry_digest->type == entry_type) {
+            data = algorithm == MB_BI_DIGEST_SHA1
+                    ? entry_digest->sha1 : entry_digest->sha256;
+            memcpy(digest, data, size);
+            digest_size = size;
+            return MB_BI_OK;
+        }
+    }
+
+    mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                           "Entry type %d has not been written", entry_type);
+    return MB_BI_WARN;
+}
+
+/*!
+ * \brief Add a range of the file to the image hash
+ */
+static int android_writer_hash_file_range(MbBiWriter *biw, SHA_CTX *sha_ctx,
+                                          uint64_t offset, uint64_t size)
+{
+    mb::File *file = biw->file;
+    unsigned char buf[10240];
+    size_t n;
+
+    if (!file->seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to seek to entry: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    while (size > 0) {
+        size_t to_read = std::min<uint64_t>(size, sizeof(buf));
+
+        if (!mb::file_read_fully(*file, buf, to_read, n)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to read entry: %s",
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        } else if (n != to_read) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                                   "Entry is truncated");
+            return MB_BI_FAILED;
+        }
+
+        if (!SHA1_Update(sha_ctx, buf, n)) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to update SHA1 hash");
+            return MB_BI_FAILED;
+        }
+
+        size -= n;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Write zeros to pad an entry to a page boundary
+ */
+static int android_writer_write_padding(MbBiWriter *biw, uint64_t size)
+{
+    static const unsigned char zeros[4096] = {};
+    mb::File *file = biw->file;
+    size_t n;
+
+    while (size > 0) {
+        size_t to_write = std::min<uint64_t>(size, sizeof(zeros));
+
+        if (!mb::file_write_fully(*file, zeros, to_write, n)
+                || n != to_write) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to write padding: %s",
+                                   file->error_string().c_str());
+            return MB_BI_FATAL;
+        }
+
+        size -= n;
+    }
+
+    return MB_BI_OK;
+}
+
+int android_writer_patch_entry(MbBiWriter *biw, void *userdata,
+                               int entry_type, const void *data, size_t size)
+{
+    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+    mb::File *file = biw->file;
+    AndroidHeader hdr;
+    uint64_t file_size;
+    size_t n;
+    int ret;
+
+    if (size > UINT32_MAX) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Invalid entry size: %" MB_PRIzu, size);
+        return MB_BI_FAILED;
+    }
+
+    // The header is always at the beginning of images created by this writer
+    if (!file->seek(0, SEEK_SET, nullptr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to seek to beginning: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    if (!mb::file_read_fully(*file, &hdr, sizeof(hdr), n)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to read header: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    } else if (n != sizeof(hdr)
+            || memcmp(hdr.magic, ANDROID_BOOT_MAGIC,
+                      ANDROID_BOOT_MAGIC_SIZE) != 0) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Android header not found at beginning of file");
+        return MB_BI_WARN;
+    }
+
+    android_fix_header_byte_order(&hdr);
+
+    if (!android_writer_is_valid_page_size(hdr.page_size)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Invalid page size: %" PRIu32, hdr.page_size);
+        return MB_BI_WARN;
+    }
+
+    if (!file->seek(0, SEEK_END, &file_size)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to get file size: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    // Same order and alignment as the entries that are added to the segment
+    // writer in android_writer_write_header()
+    struct {
+        int type;
+        uint32_t *size;
+    } entries[] = {
+        { MB_BI_ENTRY_KERNEL,      &hdr.kernel_size },
+        { MB_BI_ENTRY_RAMDISK,     &hdr.ramdisk_size },
+        { MB_BI_ENTRY_SECONDBOOT,  &hdr.second_size },
+        { MB_BI_ENTRY_DEVICE_TREE, &hdr.dt_size },
+    };
+    size_t entries_len = sizeof(entries) / sizeof(entries[0]);
+    uint64_t offset = 0;
+    uint64_t old_end = 0;
+    uint64_t pos = hdr.page_size;
+    size_t index = entries_len;
+
+    for (size_t i = 0; i < entries_len; ++i) {
+        if (entries[i].type == entry_type) {
+            index = i;
+            offset = pos;
+        }
+
+        pos += *entries[i].size;
+        pos += align_page_size<uint64_t>(pos, hdr.page_size);
+
+        if (i == index) {
+            old_end = pos;
+        }
+    }
+
+    if (index == entries_len) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                               "Cannot patch entry type %d", entry_type);
+        return MB_BI_UNSUPPORTED;
+    } else if (pos > file_size) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_FILE_FORMAT,
+                               "Image is truncated");
+        return MB_BI_WARN;
+    }
+
+    uint64_t new_end = offset + size
+            + align_page_size<uint64_t>(offset + size, hdr.page_size);
+    std::vector<unsigned char> tail;
+
+    // If the aligned size changes, the following entries and anything else
+    // after them, like the SEAndroid or Bump magic, need to be moved
+    if (new_end != old_end) {
+        tail.resize(file_size - old_end);
+
+        if (!file->seek(static_cast<int64_t>(old_end), SEEK_SET, nullptr)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to seek to next entry: %s",
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        if (!mb::file_read_fully(*file, tail.data(), tail.size(), n)
+                || n != tail.size()) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to read following entries: %s",
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+    }
+
+    if (!file->seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to seek to entry: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    // The image is inconsistent from here on, so all errors are fatal
+
+    if (!mb::file_write_fully(*file, data, size, n) || n != size) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to write entry: %s",
+                               file->error_string().c_str());
+        return MB_BI_FATAL;
+    }
+
+    ret = android_writer_write_padding(biw, new_end - offset - size);
+    if (ret != MB_BI_OK) return MB_BI_FATAL;
+
+    if (new_end != old_end) {
+        if (!mb::file_write_fully(*file, tail.data(), tail.size(), n)
+                || n != tail.size()) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to write following entries: %s",
+                                   file->error_string().c_str());
+            return MB_BI_FATAL;
+        }
+
+        if (new_end < old_end && !file->truncate(new_end + tail.size())) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                                   "Failed to truncate file: %s",
+                                   file->error_string().c_str());
+            return MB_BI_FATAL;
+        }
+    }
+
+    *entries[index].size = static_cast<uint32_t>(size);
+
+    // Recompute ID the same way as when writing a new image
+    SHA_CTX sha_ctx;
+
+    if (!SHA1_Init(&sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        return MB_BI_FATAL;
+    }
+
+    pos = hdr.page_size;
+
+    for (size_t i = 0; i < entries_len; ++i) {
+        uint32_t entry_size = *entries[i].size;
+        uint32_t le32_size = mb_htole32(entry_size);
+
+        if (i == index) {
+            if (!SHA1_Update(&sha_ctx, data, size)) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                       "Failed to update SHA1 hash");
+                return MB_BI_FATAL;
+            }
+        } else {
+            ret = android_writer_hash_file_range(biw, &sha_ctx, pos,
+                                                 entry_size);
+            if (ret != MB_BI_OK) return MB_BI_FATAL;
+        }
+
+        if ((entries[i].type != MB_BI_ENTRY_DEVICE_TREE || entry_size > 0)
+                && !SHA1_Update(&sha_ctx, &le32_size, sizeof(le32_size))) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to update SHA1 hash");
+            return MB_BI_FATAL;
+        }
+
+        pos += entry_size;
+        pos += align_page_size<uint64_t>(pos, hdr.page_size);
+    }
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    if (!SHA1_Final(digest, &sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to update SHA1 hash");
+        return MB_BI_FATAL;
+    }
+    memset(hdr.id, 0, sizeof(hdr.id));
+    memcpy(hdr.id, digest, SHA_DIGEST_LENGTH);
+
+    android_fix_header_byte_order(&hdr);
+
+    if (!file->seek(0, SEEK_SET, nullptr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to seek to beginning: %s",
+                               file->error_string().c_str());
+        return MB_BI_FATAL;
+    }
+
+    if (!mb::file_write_fully(*file, &hdr, sizeof(hdr), n)
+            || n != sizeof(hdr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to write header: %s",
+                               file->error_string().c_str());
+        return MB_BI_FATAL;
+    }
+
+    ctx->patched = true;
+
+    return MB_BI_OK;
+}
+
 int android_writer_close(MbBiWriter *biw, void *userdata)
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+    mb::File *file = android_writer_file(biw, ctx);
     SegmentWriterEntry *swentry;
     size_t n;
 
+    // Nothing to finish up if an existing image was patched
+    if (ctx->patched) {
+        return MB_BI_OK;
+    }
+
     if (ctx->have_file_size) {
-        if (!biw->file->seek(ctx->file_size, SEEK_SET, nullptr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(ctx->file_size, SEEK_SET, nullptr)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to seek to end of file: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
     } else {
-        if (!biw->file->seek(0, SEEK_CUR, &ctx->file_size)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(0, SEEK_CUR, &ctx->file_size)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to get file offset: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
         ctx->have_file_size = true;
@@ -275,22 +756,22 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
         // Write bump magic if we're outputting a bump'd image. Otherwise, write
         // the Samsung SEAndroid magic.
         if (ctx->is_bump) {
-            if (!mb::file_write_fully(*biw->file, BUMP_MAGIC,
+            if (!mb::file_write_fully(*file, BUMP_MAGIC,
                                       BUMP_MAGIC_SIZE, n)
                     || n != BUMP_MAGIC_SIZE) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                        "Failed to write Bump magic: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                       file->error_string().c_str());
+                return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
             }
         } else {
-            if (!mb::file_write_fully(*biw->file, SAMSUNG_SEANDROID_MAGIC,
+            if (!mb::file_write_fully(*file, SAMSUNG_SEANDROID_MAGIC,
                                       SAMSUNG_SEANDROID_MAGIC_SIZE, n)
                     || n != SAMSUNG_SEANDROID_MAGIC_SIZE) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                        "Failed to write SEAndroid magic: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                       file->error_string().c_str());
+                return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
             }
         }
 
@@ -308,31 +789,63 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
         android_fix_header_byte_order(&hdr);
 
         // Seek back to beginning to write header
-        if (!biw->file->seek(0, SEEK_SET, nullptr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(0, SEEK_SET, nullptr)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to seek to beginning: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
         // Write header
-        if (!mb::file_write_fully(*biw->file, &hdr, sizeof(hdr), n)
+        if (!mb::file_write_fully(*file, &hdr, sizeof(hdr), n)
                 || n != sizeof(hdr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to write header: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        if (ctx->spool) {
+            return android_writer_flush_spool(biw, ctx);
         }
     }
 
     return MB_BI_OK;
 }
 
+int android_writer_reset(MbBiWriter *biw, void *userdata)
+{
+    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+
+    // Keep the format variant
+    bool is_bump = ctx->is_bump;
+
+    // The spool is only used for outputs that cannot seek
+    delete ctx->spool;
+    free(ctx->spool_buf);
+
+    _segment_writer_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_writer_init(&ctx->segctx);
+
+    ctx->is_bump = is_bump;
+
+    if (!SHA1_Init(&ctx->sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
 int android_writer_free(MbBiWriter *bir, void *userdata)
 {
     (void) bir;
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     _segment_writer_deinit(&ctx->segctx);
+    delete ctx->spool;
+    free(ctx->spool_buf);
     free(ctx);
     return MB_BI_OK;
 }
@@ -378,7 +891,10 @@ int mb_bi_writer_set_format_android(MbBiWriter *biw)
                                          &android_writer_write_entry,
                                          &android_writer_write_data,
                                          &android_writer_finish_entry,
+                                         &android_writer_get_entry_digest,
+                                         &android_writer_patch_entry,
                                          &android_writer_close,
+                                         &android_writer_reset,
                                          &android_writer_free);
 }
 
@@ -62,6 +62,10 @@ int mb_bi_reader_enable_format_bump(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
+                                         &android_reader_entry_range,
+                                         &android_reader_entry_location,
+                                         &android_reader_reset,
                                          &android_reader_free);
 }
 
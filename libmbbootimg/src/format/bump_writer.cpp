@@ -70,7 +70,10 @@ int mb_bi_writer_set_format_bump(MbBiWriter *biw)
                                          &android_writer_write_entry,
                                          &android_writer_write_data,
                                          &android_writer_finish_entry,
+                                         &android_writer_get_entry_digest,
+                                         &android_writer_patch_entry,
                                          &android_writer_close,
+                                         &android_writer_reset,
                                          &android_writer_free);
 }
 
@@ -114,6 +114,70 @@ static LokiTarget targets[] = {
 #define ABOOT_PATTERN_SIZE          8
 #define MIN_ABOOT_SIZE              (ABOOT_SEARCH_LIMIT + ABOOT_PATTERN_SIZE)
 
+// Patterns that are searched for in the first pass. PATTERN6 is only searched
+// for if none of these are found.
+static const char *const first_pass_patterns[] = {
+    PATTERN1,
+    PATTERN2,
+    PATTERN3,
+    PATTERN4,
+    PATTERN5,
+};
+
+static const char *const second_pass_patterns[] = {
+    PATTERN6,
+};
+
+/*!
+ * \brief Precomputed table for scanning for a set of aboot patterns
+ *
+ * Each pattern is stored as a single 8-byte word, so that a candidate position
+ * can be checked with one comparison per pattern. Positions whose first byte
+ * does not start any of the patterns are skipped with a single lookup.
+ */
+struct AbootPatternTable
+{
+    uint64_t words[8];
+    size_t words_len;
+    bool lead[256];
+};
+
+static void _init_pattern_table(AbootPatternTable *table,
+                                const char *const *patterns,
+                                size_t patterns_len)
+{
+    memset(table, 0, sizeof(*table));
+
+    for (size_t i = 0; i < patterns_len
+            && i < sizeof(table->words) / sizeof(table->words[0]); ++i) {
+        memcpy(&table->words[i], patterns[i], ABOOT_PATTERN_SIZE);
+        table->lead[static_cast<unsigned char>(patterns[i][0])] = true;
+        ++table->words_len;
+    }
+}
+
+static const unsigned char * _find_pattern(const AbootPatternTable *table,
+                                           const unsigned char *begin,
+                                           const unsigned char *end)
+{
+    for (const unsigned char *ptr = begin; ptr < end; ++ptr) {
+        if (!table->lead[*ptr]) {
+            continue;
+        }
+
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+
+        for (size_t i = 0; i < table->words_len; ++i) {
+            if (word == table->words[i]) {
+                return ptr;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
 
 MB_BEGIN_C_DECLS
 
@@ -316,6 +380,50 @@ static int _loki_write_shellcode(MbBiWriter *biw, mb::File *file,
     return MB_BI_OK;
 }
 
+/*!
+ * \brief Find the signature checking function in an aboot image
+ *
+ * \param[in] aboot aboot image
+ * \param[in] aboot_size Size of aboot image
+ * \param[out] offset_out Pointer to store offset of function in \p aboot
+ *
+ * \return Whether the function was found
+ */
+bool _loki_find_aboot_func(const unsigned char *aboot, size_t aboot_size,
+                           size_t *offset_out)
+{
+    AbootPatternTable first_pass;
+    AbootPatternTable second_pass;
+
+    if (aboot_size < MIN_ABOOT_SIZE) {
+        return false;
+    }
+
+    _init_pattern_table(&first_pass, first_pass_patterns,
+                        sizeof(first_pass_patterns)
+                        / sizeof(first_pass_patterns[0]));
+    _init_pattern_table(&second_pass, second_pass_patterns,
+                        sizeof(second_pass_patterns)
+                        / sizeof(second_pass_patterns[0]));
+
+    const unsigned char *end = aboot + aboot_size - ABOOT_SEARCH_LIMIT;
+    const unsigned char *ptr = _find_pattern(&first_pass, aboot, end);
+
+    // Do a second pass for the second LG pattern. This is necessary because
+    // apparently some LG models have both LG patterns, which throws off the
+    // fingerprinting.
+    if (!ptr) {
+        ptr = _find_pattern(&second_pass, aboot, end);
+    }
+
+    if (!ptr) {
+        return false;
+    }
+
+    *offset_out = static_cast<size_t>(ptr - aboot);
+    return true;
+}
+
 /*!
  * \brief Patch Android boot image with Loki exploit in-place
  *
@@ -337,6 +445,7 @@ int _loki_patch_file(MbBiWriter *biw, mb::File *file,
     unsigned char patch[] = LOKI_SHELLCODE;
     uint32_t target = 0;
     uint32_t aboot_base;
+    size_t aboot_func;
     int offset;
     int fake_size;
     size_t aboot_func_offset;
@@ -356,30 +465,8 @@ int _loki_patch_file(MbBiWriter *biw, mb::File *file,
             aboot_ptr + 12)) - 0x28;
 
     // Find the signature checking function via pattern matching
-    for (const unsigned char *ptr = aboot_ptr;
-            ptr < aboot_ptr + aboot_size - ABOOT_SEARCH_LIMIT; ++ptr) {
-        if (memcmp(ptr, PATTERN1, ABOOT_PATTERN_SIZE) == 0
-                || memcmp(ptr, PATTERN2, ABOOT_PATTERN_SIZE) == 0
-                || memcmp(ptr, PATTERN3, ABOOT_PATTERN_SIZE) == 0
-                || memcmp(ptr, PATTERN4, ABOOT_PATTERN_SIZE) == 0
-                || memcmp(ptr, PATTERN5, ABOOT_PATTERN_SIZE) == 0) {
-            target = static_cast<uint32_t>(ptr - aboot_ptr + aboot_base);
-            break;
-        }
-    }
-
-    // Do a second pass for the second LG pattern. This is necessary because
-    // apparently some LG models have both LG patterns, which throws off the
-    // fingerprinting.
-
-    if (target == 0) {
-        for (const unsigned char *ptr = aboot_ptr;
-                ptr < aboot_ptr + aboot_size - ABOOT_SEARCH_LIMIT; ++ptr) {
-            if (memcmp(ptr, PATTERN6, ABOOT_PATTERN_SIZE) == 0) {
-                target = static_cast<uint32_t>(ptr - aboot_ptr + aboot_base);
-                break;
-            }
-        }
+    if (_loki_find_aboot_func(aboot_ptr, aboot_size, &aboot_func)) {
+        target = static_cast<uint32_t>(aboot_func + aboot_base);
     }
 
     if (target == 0) {
@@ -141,8 +141,11 @@ int loki_find_ramdisk_address(MbBiReader *bir, mb::File *file,
             return mb::FileSearchAction::Continue;
         };
 
-        if (!mb::file_search(*file, -1, -1, 0, LOKI_SHELLCODE,
-                             LOKI_SHELLCODE_SIZE - 9, 1, result_cb, &offset)) {
+        // Search tables only need to be computed once
+        static const mb::FileSearcher searcher(LOKI_SHELLCODE,
+                                               LOKI_SHELLCODE_SIZE - 9);
+
+        if (!searcher.search(*file, -1, -1, 0, 1, result_cb, &offset)) {
             mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                    "Failed to search for Loki shellcode: %s",
                                    file->error_string().c_str());
@@ -863,6 +866,47 @@ int loki_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int loki_reader_read_data_view(MbBiReader *bir, void *userdata,
+                               const void *&ptr, size_t &size)
+{
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, ptr, size,
+                                          bir);
+}
+
+int loki_reader_entry_range(MbBiReader *bir, void *userdata,
+                            uint64_t &offset, uint64_t &size)
+{
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    return _segment_reader_entry_range(&ctx->segctx, bir->file, offset, size,
+                                       bir);
+}
+
+int loki_reader_entry_location(MbBiReader *bir, void *userdata,
+                               int entry_type, uint64_t &offset,
+                               uint64_t &size, bool &can_truncate)
+{
+    (void) bir;
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    return _segment_reader_entry_location(&ctx->segctx, entry_type, offset,
+                                          size, can_truncate);
+}
+
+int loki_reader_reset(MbBiReader *bir, void *userdata)
+{
+    (void) bir;
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    _segment_reader_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_reader_init(&ctx->segctx);
+
+    return MB_BI_OK;
+}
+
 int loki_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -905,6 +949,10 @@ int mb_bi_reader_enable_format_loki(MbBiReader *bir)
                                          &loki_reader_read_entry,
                                          &loki_reader_go_to_entry,
                                          &loki_reader_read_data,
+                                         &loki_reader_read_data_view,
+                                         &loki_reader_entry_range,
+                                         &loki_reader_entry_location,
+                                         &loki_reader_reset,
                                          &loki_reader_free);
 }
 
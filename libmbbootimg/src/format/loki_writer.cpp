@@ -359,6 +359,25 @@ int loki_writer_close(MbBiWriter *biw, void *userdata)
     return MB_BI_OK;
 }
 
+int loki_writer_reset(MbBiWriter *biw, void *userdata)
+{
+    LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(userdata);
+
+    free(ctx->aboot);
+
+    _segment_writer_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_writer_init(&ctx->segctx);
+
+    if (!SHA1_Init(&ctx->sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        return MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
 int loki_writer_free(MbBiWriter *bir, void *userdata)
 {
     (void) bir;
@@ -410,7 +429,10 @@ int mb_bi_writer_set_format_loki(MbBiWriter *biw)
                                          &loki_writer_write_entry,
                                          &loki_writer_write_data,
                                          &loki_writer_finish_entry,
+                                         nullptr,
+                                         nullptr,
                                          &loki_writer_close,
+                                         &loki_writer_reset,
                                          &loki_writer_free);
 }
 
@@ -113,9 +113,16 @@ int read_mtk_header(MbBiReader *bir, mb::File *file,
  *                                (in host byte order)
  * \param[out] ramdisk_offset_out Pointer to store offset of ramdisk image
  *
+ * The kernel MTK header immediately follows the Android header, so it is
+ * normally served from the probe window. It is checked against the Android
+ * header before the ramdisk MTK header, which usually lies outside of the
+ * window, is read. Images that are not MTK images are therefore rejected
+ * without reading past the beginning of the file.
+ *
  * \return
  *   * #MB_BI_OK if both the kernel and ramdisk headers are found
- *   * #MB_BI_WARN if the kernel or ramdisk header is not found
+ *   * #MB_BI_WARN if the kernel or ramdisk header is not found or does not
+ *     match the Android header
  *   * #MB_BI_FAILED if any file operation fails non-fatally
  *   * #MB_BI_FATAL if any file operation fails fatally
  */
@@ -131,6 +138,14 @@ int find_mtk_headers(MbBiReader *bir, mb::File *file,
     int ret;
     uint64_t pos = 0;
 
+    // Both images are prefixed with an MTK header
+    if (hdr->kernel_size < sizeof(MtkHeader)
+            || hdr->ramdisk_size < sizeof(MtkHeader)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "Kernel or ramdisk too small for MTK header");
+        return MB_BI_WARN;
+    }
+
     // Header
     pos += hdr->page_size;
 
@@ -151,6 +166,14 @@ int find_mtk_headers(MbBiReader *bir, mb::File *file,
         return ret;
     }
 
+    if (hdr->kernel_size != static_cast<uint64_t>(
+            kernel_mtkhdr_out->size) + sizeof(MtkHeader)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "Mismatched kernel size in Android and "
+                               "MTK headers");
+        return MB_BI_WARN;
+    }
+
     ret = read_mtk_header(bir, file, ramdisk_offset, ramdisk_mtkhdr_out);
     if (ret == MB_BI_OK) {
         *ramdisk_offset_out = ramdisk_offset + sizeof(MtkHeader);
@@ -235,14 +258,8 @@ int mtk_reader_read_header(MbBiReader *bir, void *userdata,
         ctx->have_mtkhdr_offsets = true;
     }
 
-    // Validate that the kernel and ramdisk sizes are consistent
-    if (ctx->hdr.kernel_size != static_cast<uint64_t>(
-            ctx->mtk_kernel_hdr.size) + sizeof(MtkHeader)) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
-                               "Mismatched kernel size in Android and "
-                               "MTK headers");
-        return MB_BI_FAILED;
-    }
+    // Validate that the ramdisk sizes are consistent. The kernel size was
+    // already checked while searching for the MTK headers.
     if (ctx->hdr.ramdisk_size != static_cast<uint64_t>(
             ctx->mtk_ramdisk_hdr.size) + sizeof(MtkHeader)) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
@@ -364,6 +381,47 @@ int mtk_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int mtk_reader_read_data_view(MbBiReader *bir, void *userdata,
+                              const void *&ptr, size_t &size)
+{
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, ptr, size,
+                                          bir);
+}
+
+int mtk_reader_entry_range(MbBiReader *bir, void *userdata,
+                           uint64_t &offset, uint64_t &size)
+{
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    return _segment_reader_entry_range(&ctx->segctx, bir->file, offset, size,
+                                       bir);
+}
+
+int mtk_reader_entry_location(MbBiReader *bir, void *userdata,
+                              int entry_type, uint64_t &offset,
+                              uint64_t &size, bool &can_truncate)
+{
+    (void) bir;
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    return _segment_reader_entry_location(&ctx->segctx, entry_type, offset,
+                                          size, can_truncate);
+}
+
+int mtk_reader_reset(MbBiReader *bir, void *userdata)
+{
+    (void) bir;
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    _segment_reader_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_reader_init(&ctx->segctx);
+
+    return MB_BI_OK;
+}
+
 int mtk_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -406,6 +464,10 @@ int mb_bi_reader_enable_format_mtk(MbBiReader *bir)
                                          &mtk_reader_read_entry,
                                          &mtk_reader_go_to_entry,
                                          &mtk_reader_read_data,
+                                         &mtk_reader_read_data_view,
+                                         &mtk_reader_entry_range,
+                                         &mtk_reader_entry_location,
+                                         &mtk_reader_reset,
                                          &mtk_reader_free);
 }
 
@@ -459,6 +459,18 @@ int mtk_writer_close(MbBiWriter *biw, void *userdata)
     return MB_BI_OK;
 }
 
+int mtk_writer_reset(MbBiWriter *biw, void *userdata)
+{
+    (void) biw;
+    MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(userdata);
+
+    _segment_writer_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_writer_init(&ctx->segctx);
+
+    return MB_BI_OK;
+}
+
 int mtk_writer_free(MbBiWriter *bir, void *userdata)
 {
     (void) bir;
@@ -502,7 +514,10 @@ int mb_bi_writer_set_format_mtk(MbBiWriter *biw)
                                          &mtk_writer_write_entry,
                                          &mtk_writer_write_data,
                                          &mtk_writer_finish_entry,
+                                         nullptr,
+                                         nullptr,
                                          &mtk_writer_close,
+                                         &mtk_writer_reset,
                                          &mtk_writer_free);
 }
 
@@ -31,6 +31,31 @@
 
 #include "mbbootimg/entry.h"
 
+/*!
+ * \brief Get bit position of a single-bit entry type
+ *
+ * \return Bit position or -1 if \p type is not a single-bit flag
+ */
+static int entry_type_bit(int type)
+{
+    unsigned int value = static_cast<unsigned int>(type);
+
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(value);
+#else
+    int bit = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
 int _segment_reader_init(SegmentReaderCtx *ctx)
 {
     memset(ctx, 0, sizeof(*ctx));
@@ -55,6 +80,7 @@ void _segment_reader_entries_clear(SegmentReaderCtx *ctx)
 {
     ctx->entries_len = 0;
     ctx->entry = nullptr;
+    memset(ctx->type_index, 0, sizeof(ctx->type_index));
 }
 
 int _segment_reader_entries_add(SegmentReaderCtx *ctx,
@@ -81,6 +107,12 @@ int _segment_reader_entries_add(SegmentReaderCtx *ctx,
 
     ++ctx->entries_len;
 
+    // As with a linear search, the first entry of each type wins
+    int bit = entry_type_bit(type);
+    if (bit >= 0 && ctx->type_index[bit] == 0) {
+        ctx->type_index[bit] = static_cast<unsigned char>(ctx->entries_len);
+    }
+
     return MB_BI_OK;
 }
 
@@ -123,6 +155,12 @@ SegmentReaderEntry * _segment_reader_find_entry(SegmentReaderCtx *ctx,
             return ctx->entries;
         }
     } else {
+        int bit = entry_type_bit(entry_type);
+        if (bit >= 0) {
+            size_t index = ctx->type_index[bit];
+            return index > 0 ? &ctx->entries[index - 1] : nullptr;
+        }
+
         for (size_t i = 0; i < ctx->entries_len; ++i) {
             if (ctx->entries[i].type == entry_type) {
                 return &ctx->entries[i];
@@ -237,3 +275,109 @@ int _segment_reader_read_data(SegmentReaderCtx *ctx, mb::File *file,
 
     return bytes_read == 0 ? MB_BI_EOF : MB_BI_OK;
 }
+
+int _segment_reader_read_data_view(SegmentReaderCtx *ctx, mb::File *file,
+                                   const void *&ptr, size_t &size,
+                                   MbBiReader *bir)
+{
+    const void *buf;
+    size_t n;
+
+    if (ctx->read_cur_offset == ctx->read_end_offset) {
+        size = 0;
+        return MB_BI_EOF;
+    }
+
+    if (!file->peek(buf, n)) {
+        if (file->error() == mb::FileError::UnsupportedRead) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                                   "File does not support data views: %s",
+                                   file->error_string().c_str());
+            return MB_BI_UNSUPPORTED;
+        }
+
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to read data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    // Fail if we reach EOF early
+    if (n == 0) {
+        if (!ctx->entry->can_truncate) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                                   "Entry is truncated "
+                                   "(expected %" PRIu64 " more bytes)",
+                                   ctx->read_end_offset - ctx->read_cur_offset);
+            return MB_BI_FATAL;
+        }
+
+        size = 0;
+        return MB_BI_EOF;
+    }
+
+    n = std::min<uint64_t>(n, ctx->read_end_offset - ctx->read_cur_offset);
+
+    if (!file->consume(n)) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to consume data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    ctx->read_cur_offset += n;
+    ptr = buf;
+    size = n;
+
+    return MB_BI_OK;
+}
+
+int _segment_reader_entry_range(SegmentReaderCtx *ctx, mb::File *file,
+                                uint64_t &offset, uint64_t &size,
+                                MbBiReader *bir)
+{
+    uint64_t end = ctx->read_end_offset;
+
+    // The data of truncatable entries may stop at the end of the file
+    if (ctx->entry->can_truncate) {
+        uint64_t file_size;
+
+        if (!file->seek(0, SEEK_END, &file_size)) {
+            mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                                   "Failed to get file size: %s",
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        if (!file->seek(static_cast<int64_t>(ctx->read_cur_offset), SEEK_SET,
+                        nullptr)) {
+            mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                                   "Failed to seek to entry data: %s",
+                                   file->error_string().c_str());
+            return MB_BI_FATAL;
+        }
+
+        end = std::min(end, std::max(file_size, ctx->read_cur_offset));
+    }
+
+    offset = ctx->read_cur_offset;
+    size = end - ctx->read_cur_offset;
+
+    return MB_BI_OK;
+}
+
+int _segment_reader_entry_location(SegmentReaderCtx *ctx, int entry_type,
+                                   uint64_t &offset, uint64_t &size,
+                                   bool &can_truncate)
+{
+    SegmentReaderEntry *srentry = _segment_reader_find_entry(ctx, entry_type);
+    if (!srentry) {
+        return MB_BI_EOF;
+    }
+
+    offset = srentry->offset;
+    size = srentry->size;
+    can_truncate = srentry->can_truncate;
+
+    return MB_BI_OK;
+}
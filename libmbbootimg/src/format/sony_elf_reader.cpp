@@ -324,6 +324,47 @@ int sony_elf_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int sony_elf_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                   const void *&ptr, size_t &size)
+{
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, ptr, size,
+                                          bir);
+}
+
+int sony_elf_reader_entry_range(MbBiReader *bir, void *userdata,
+                                uint64_t &offset, uint64_t &size)
+{
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    return _segment_reader_entry_range(&ctx->segctx, bir->file, offset, size,
+                                       bir);
+}
+
+int sony_elf_reader_entry_location(MbBiReader *bir, void *userdata,
+                                   int entry_type, uint64_t &offset,
+                                   uint64_t &size, bool &can_truncate)
+{
+    (void) bir;
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    return _segment_reader_entry_location(&ctx->segctx, entry_type, offset,
+                                          size, can_truncate);
+}
+
+int sony_elf_reader_reset(MbBiReader *bir, void *userdata)
+{
+    (void) bir;
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    _segment_reader_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_reader_init(&ctx->segctx);
+
+    return MB_BI_OK;
+}
+
 int sony_elf_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -366,6 +407,10 @@ int mb_bi_reader_enable_format_sony_elf(MbBiReader *bir)
                                          &sony_elf_reader_read_entry,
                                          &sony_elf_reader_go_to_entry,
                                          &sony_elf_reader_read_data,
+                                         &sony_elf_reader_read_data_view,
+                                         &sony_elf_reader_entry_range,
+                                         &sony_elf_reader_entry_location,
+                                         &sony_elf_reader_reset,
                                          &sony_elf_reader_free);
 }
 
@@ -390,6 +390,20 @@ int sony_elf_writer_close(MbBiWriter *biw, void *userdata)
     return MB_BI_OK;
 }
 
+int sony_elf_writer_reset(MbBiWriter *biw, void *userdata)
+{
+    (void) biw;
+    SonyElfWriterCtx *const ctx = static_cast<SonyElfWriterCtx *>(userdata);
+
+    free(ctx->cmdline);
+
+    _segment_writer_deinit(&ctx->segctx);
+    memset(ctx, 0, sizeof(*ctx));
+    _segment_writer_init(&ctx->segctx);
+
+    return MB_BI_OK;
+}
+
 int sony_elf_writer_free(MbBiWriter *bir, void *userdata)
 {
     (void) bir;
@@ -434,7 +448,10 @@ int mb_bi_writer_set_format_sony_elf(MbBiWriter *biw)
                                          &sony_elf_writer_write_entry,
                                          &sony_elf_writer_write_data,
                                          &sony_elf_writer_finish_entry,
+                                         nullptr,
+                                         nullptr,
                                          &sony_elf_writer_close,
+                                         &sony_elf_writer_reset,
                                          &sony_elf_writer_free);
 }
 
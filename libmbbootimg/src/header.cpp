@@ -49,8 +49,8 @@ void mb_bi_header_clear(MbBiHeader *header)
 {
     if (header) {
         uint64_t supported = header->fields_supported;
-        free(header->field.board_name);
-        free(header->field.cmdline);
+        header->field.board_name.reset();
+        header->field.cmdline.reset();
         memset(header, 0, sizeof(*header));
         header->fields_supported = supported;
     }
@@ -87,14 +87,9 @@ MbBiHeader * mb_bi_header_clone(MbBiHeader *header)
            sizeof(header->field.hdr_id));
     dup->field.hdr_entrypoint = header->field.hdr_entrypoint;
 
-    // Deep copy strings
-    bool deep_copy_error =
-            (header->field.board_name
-                    && !(dup->field.board_name = strdup(header->field.board_name)))
-            || (header->field.cmdline
-                    && !(dup->field.cmdline = strdup(header->field.cmdline)));
-
-    if (deep_copy_error) {
+    // Copy strings. This only allocates for values that don't fit inline.
+    if (!dup->field.board_name.assign(header->field.board_name)
+            || !dup->field.cmdline.assign(header->field.cmdline)) {
         mb_bi_header_free(dup);
         return nullptr;
     }
@@ -102,6 +97,42 @@ MbBiHeader * mb_bi_header_clone(MbBiHeader *header)
     return dup;
 }
 
+/*!
+ * \brief Check if two headers are equal
+ *
+ * The headers are equal if they support and set the same fields and all of
+ * their field values match. This does not allocate memory.
+ *
+ * \return Non-zero if the headers are equal, otherwise zero
+ */
+int mb_bi_header_equals(MbBiHeader *a, MbBiHeader *b)
+{
+    if (a == b) {
+        return 1;
+    }
+
+    return a->fields_supported == b->fields_supported
+            && a->fields_set == b->fields_set
+            && a->field.kernel_addr == b->field.kernel_addr
+            && a->field.ramdisk_addr == b->field.ramdisk_addr
+            && a->field.second_addr == b->field.second_addr
+            && a->field.tags_addr == b->field.tags_addr
+            && a->field.ipl_addr == b->field.ipl_addr
+            && a->field.rpm_addr == b->field.rpm_addr
+            && a->field.appsbl_addr == b->field.appsbl_addr
+            && a->field.page_size == b->field.page_size
+            && a->field.board_name.equals(b->field.board_name)
+            && a->field.cmdline.equals(b->field.cmdline)
+            && a->field.hdr_kernel_size == b->field.hdr_kernel_size
+            && a->field.hdr_ramdisk_size == b->field.hdr_ramdisk_size
+            && a->field.hdr_second_size == b->field.hdr_second_size
+            && a->field.hdr_dt_size == b->field.hdr_dt_size
+            && a->field.hdr_unused == b->field.hdr_unused
+            && memcmp(a->field.hdr_id, b->field.hdr_id,
+                      sizeof(a->field.hdr_id)) == 0
+            && a->field.hdr_entrypoint == b->field.hdr_entrypoint;
+}
+
 uint64_t mb_bi_header_supported_fields(MbBiHeader *header)
 {
     return header->fields_supported;
@@ -116,26 +147,27 @@ void mb_bi_header_set_supported_fields(MbBiHeader *header, uint64_t fields)
 
 const char * mb_bi_header_board_name(MbBiHeader *header)
 {
-    return header->field.board_name;
+    return header->field.board_name.get();
 }
 
 int mb_bi_header_set_board_name(MbBiHeader *header, const char *name)
 {
     ENSURE_SUPPORTED(header, MB_BI_HEADER_FIELD_BOARD_NAME);
-    SET_STRING_FIELD(header, MB_BI_HEADER_FIELD_BOARD_NAME, board_name, name);
+    SET_INLINE_STRING_FIELD(header, MB_BI_HEADER_FIELD_BOARD_NAME,
+                            board_name, name);
     return MB_BI_OK;
 }
 
 const char * mb_bi_header_kernel_cmdline(MbBiHeader *header)
 {
-    return header->field.cmdline;
+    return header->field.cmdline.get();
 }
 
 int mb_bi_header_set_kernel_cmdline(MbBiHeader *header, const char *cmdline)
 {
     ENSURE_SUPPORTED(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    SET_STRING_FIELD(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE,
-                     cmdline, cmdline);
+    SET_INLINE_STRING_FIELD(header, MB_BI_HEADER_FIELD_KERNEL_CMDLINE,
+                            cmdline, cmdline);
     return MB_BI_OK;
 }
 
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/probe_file_p.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file_error.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+/*!
+ * \file mbbootimg/probe_file_p.h
+ * \brief Probe window over the head and tail of a File
+ */
+
+ProbeFile::ProbeFile()
+    : _file(nullptr)
+    , _head_max(0)
+    , _tail_max(0)
+    , _tail_offset(0)
+    , _size_known(false)
+    , _size(0)
+    , _pos(0)
+    , _file_pos(0)
+    , _file_pos_known(false)
+    , _seekable(true)
+    , _window_only(false)
+    , _file_lends(false)
+    , _lent_from_file(false)
+{
+}
+
+ProbeFile::~ProbeFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open probe window over another File handle
+ *
+ * The underlying File handle must be positioned at the beginning of the file.
+ * It is not closed when the ProbeFile is closed.
+ *
+ * \param file Underlying File handle
+ * \param head_size Number of bytes to read from the beginning of the file
+ * \param tail_size Number of bytes to read from the end of the file. The tail
+ *                  is skipped if the underlying file is not seekable.
+ *
+ * \return Whether the windows were successfully read
+ */
+bool ProbeFile::open(mb::File *file, size_t head_size, size_t tail_size)
+{
+    _file = file;
+    _head_max = head_size;
+    _tail_max = tail_size;
+    return File::open();
+}
+
+/*!
+ * \brief Limit reads to the windows if the underlying file cannot seek
+ *
+ * Reading outside of the windows of a file that cannot seek consumes the data
+ * for good. When enabled, such reads return EOF instead. This allows callers to
+ * inspect the file without making it unusable for the actual reading that
+ * follows.
+ *
+ * \param window_only Whether to limit reads to the windows
+ */
+void ProbeFile::set_window_only(bool window_only)
+{
+    _window_only = window_only;
+}
+
+/*!
+ * \brief Get underlying File handle
+ */
+mb::File * ProbeFile::file() const
+{
+    return _file;
+}
+
+void ProbeFile::copy_error(const char *action)
+{
+    set_error(_file->error(), "%s: %s", action, _file->error_string().c_str());
+    if (_file->is_fatal()) {
+        set_fatal(true);
+    }
+}
+
+bool ProbeFile::on_open()
+{
+    const void *buf;
+    size_t n;
+    bool lent;
+
+    // Remember whether the underlying file can lend its own buffers
+    _file_lends = mb::file_peek_if_supported(*_file, buf, n, lent) && lent;
+
+    _head.resize(_head_max);
+
+    if (!mb::file_read_fully(*_file, _head.data(), _head.size(), n)) {
+        copy_error("Failed to read file head");
+        return false;
+    }
+
+    _head.resize(n);
+    _file_pos = n;
+    _file_pos_known = true;
+
+    if (n < _head_max) {
+        // The whole file fits in the head window
+        _size_known = true;
+        _size = n;
+    } else if (_tail_max > 0) {
+        uint64_t size;
+
+        if (!_file->seek(0, SEEK_END, &size)) {
+            if (_file->is_fatal()) {
+                copy_error("Failed to seek to end of file");
+                return false;
+            }
+
+            // Not seekable, so only the head is available. A failed seek does
+            // not move the file position.
+            _seekable = false;
+            return true;
+        }
+
+        _size_known = true;
+        _size = size;
+        _file_pos = size;
+
+        uint64_t tail_offset = std::max<uint64_t>(
+                size - std::min<uint64_t>(size, _tail_max), _head.size());
+
+        if (tail_offset < size) {
+            _tail.resize(static_cast<size_t>(size - tail_offset));
+
+            if (!_file->seek(static_cast<int64_t>(tail_offset), SEEK_SET,
+                             nullptr)) {
+                copy_error("Failed to seek to file tail");
+                return false;
+            }
+
+            if (!mb::file_read_fully(*_file, _tail.data(), _tail.size(), n)) {
+                copy_error("Failed to read file tail");
+                _file_pos_known = false;
+                return false;
+            }
+
+            _tail.resize(n);
+            _tail_offset = tail_offset;
+            _file_pos = tail_offset + n;
+        }
+    }
+
+    return true;
+}
+
+bool ProbeFile::on_close()
+{
+    _file = nullptr;
+    _head_max = 0;
+    _tail_max = 0;
+    std::vector<unsigned char>().swap(_head);
+    std::vector<unsigned char>().swap(_tail);
+    _tail_offset = 0;
+    _size_known = false;
+    _size = 0;
+    _pos = 0;
+    _file_pos = 0;
+    _file_pos_known = false;
+    _seekable = true;
+    _window_only = false;
+    _file_lends = false;
+    _lent_from_file = false;
+
+    return true;
+}
+
+/*!
+ * \brief Get the portion of a window at the current position
+ *
+ * \return Whether the current position is within the head or tail window
+ */
+bool ProbeFile::window(const unsigned char *&buf, size_t &size) const
+{
+    if (_pos < _head.size()) {
+        buf = _head.data() + _pos;
+        size = _head.size() - static_cast<size_t>(_pos);
+        return true;
+    } else if (_pos >= _tail_offset && _pos - _tail_offset < _tail.size()) {
+        size_t offset = static_cast<size_t>(_pos - _tail_offset);
+        buf = _tail.data() + offset;
+        size = _tail.size() - offset;
+        return true;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Move the underlying file to the logical position
+ *
+ * If the underlying file cannot seek, forward movement is done by discarding
+ * data.
+ */
+bool ProbeFile::sync_position()
+{
+    if (_file_pos_known && _file_pos == _pos) {
+        return true;
+    }
+
+    if (_file->seek(static_cast<int64_t>(_pos), SEEK_SET, nullptr)) {
+        _file_pos = _pos;
+        _file_pos_known = true;
+        return true;
+    }
+
+    if (_file->is_fatal() || !_file_pos_known || _pos < _file_pos
+            || _file->error() != mb::FileError::UnsupportedSeek) {
+        copy_error("Failed to seek underlying file");
+        return false;
+    }
+
+    uint64_t discarded;
+
+    if (!mb::file_read_discard(*_file, _pos - _file_pos, discarded)) {
+        copy_error("Failed to skip data in underlying file");
+        _file_pos_known = false;
+        return false;
+    }
+
+    // Anything short of the target is EOF
+    _file_pos += discarded;
+    if (_file_pos != _pos) {
+        _size_known = true;
+        _size = _file_pos;
+    }
+
+    return true;
+}
+
+bool ProbeFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    const unsigned char *data;
+    size_t data_size;
+
+    _lent_from_file = false;
+
+    if (window(data, data_size)) {
+        size_t n = std::min(size, data_size);
+        memcpy(buf, data, n);
+        _pos += n;
+        bytes_read = n;
+        return true;
+    }
+
+    if ((_size_known && _pos >= _size) || (_window_only && !_seekable)) {
+        bytes_read = 0;
+        return true;
+    }
+
+    if (!sync_position()) {
+        return false;
+    } else if (_file_pos != _pos) {
+        // Reached EOF while skipping forward
+        bytes_read = 0;
+        return true;
+    }
+
+    size_t n;
+
+    if (!_file->read(buf, size, n)) {
+        copy_error("Failed to read underlying file");
+        _file_pos_known = false;
+        return false;
+    }
+
+    _pos += n;
+    _file_pos += n;
+    bytes_read = n;
+
+    return true;
+}
+
+bool ProbeFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    _lent_from_file = false;
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0) {
+            set_error(make_error_code(mb::FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        _pos = static_cast<uint64_t>(offset);
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > _pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > INT64_MAX - _pos)) {
+            set_error(make_error_code(mb::FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" PRIu64, offset, _pos);
+            return false;
+        }
+        _pos += offset;
+        break;
+    case SEEK_END:
+        if (!_size_known) {
+            // Only the underlying file knows its size
+            uint64_t pos;
+
+            if (!_file->seek(offset, SEEK_END, &pos)) {
+                copy_error("Failed to seek underlying file");
+                return false;
+            }
+
+            _pos = pos;
+            _file_pos = pos;
+            _file_pos_known = true;
+            break;
+        }
+
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > _size)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > INT64_MAX - _size)) {
+            set_error(make_error_code(mb::FileError::InvalidArgument),
+                      "Invalid SEEK_END offset %" PRId64
+                      " for file of size %" PRIu64, offset, _size);
+            return false;
+        }
+        _pos = _size + offset;
+        break;
+    default:
+        set_error(make_error_code(mb::FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    new_offset = _pos;
+    return true;
+}
+
+bool ProbeFile::on_peek(const void *&buf, size_t &size)
+{
+    const unsigned char *data;
+    size_t data_size;
+    bool in_window = window(data, data_size);
+
+    _lent_from_file = false;
+
+    if (!in_window && ((_size_known && _pos >= _size)
+            || (_window_only && !_seekable))) {
+        buf = nullptr;
+        size = 0;
+        return true;
+    }
+
+    // Prefer the underlying file's own buffer. For memory-backed files, this
+    // points into the original data instead of into the windows.
+    if (!in_window || (_file_lends && _seekable)) {
+        bool lent;
+
+        if (!sync_position()) {
+            if (!in_window) {
+                return false;
+            }
+        } else if (!mb::file_peek_if_supported(*_file, buf, size, lent)) {
+            if (!in_window) {
+                copy_error("Failed to peek underlying file");
+                return false;
+            }
+        } else if (lent) {
+            _lent_from_file = true;
+            return true;
+        } else if (!in_window) {
+            return mb::File::on_peek(buf, size);
+        }
+    }
+
+    buf = data;
+    size = data_size;
+    return true;
+}
+
+bool ProbeFile::on_consume(size_t size)
+{
+    const unsigned char *data;
+    size_t data_size;
+
+    if (_lent_from_file) {
+        if (!_file->consume(size)) {
+            copy_error("Failed to consume from underlying file");
+            return false;
+        }
+
+        _pos += size;
+        _file_pos += size;
+        return true;
+    } else if (!window(data, data_size) || size > data_size) {
+        set_error(make_error_code(mb::FileError::InvalidArgument),
+                  "Cannot consume more than the available %" MB_PRIzu
+                  " bytes", window(data, data_size) ? data_size : 0);
+        return false;
+    }
+
+    _pos += size;
+    return true;
+}
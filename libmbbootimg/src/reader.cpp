@@ -19,11 +19,15 @@
 
 #include "mbbootimg/reader.h"
 
+#include <algorithm>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include "mbcommon/alloc_profiler.h"
 #include "mbcommon/file.h"
 #include "mbcommon/file/standard.h"
 #include "mbcommon/string.h"
@@ -156,6 +160,47 @@
  *   * Return \<= #MB_BI_WARN if an error occurs
  */
 
+/*!
+ * \typedef FormatReaderReadDataView
+ * \ingroup MB_BI_READER_FORMAT_CALLBACKS
+ *
+ * \brief Format reader callback to get a pointer to entry data
+ *
+ * \note This function *may* return less than the remaining entry data, but
+ *       *must* return more than 0 bytes unless EOF is reached.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] userdata User callback data
+ * \param[out] ptr Output pointer to the data
+ * \param[out] size Output number of bytes available at \p ptr
+ *
+ * \return
+ *   * Return #MB_BI_OK if a pointer to the data is returned
+ *   * Return #MB_BI_EOF if the end of the curent entry has been reached
+ *   * Return #MB_BI_UNSUPPORTED if the data cannot be accessed without copying
+ *   * Return \<= #MB_BI_WARN if an error occurs
+ */
+
+/*!
+ * \typedef FormatReaderReset
+ * \ingroup MB_BI_READER_FORMAT_CALLBACKS
+ *
+ * \brief Format reader callback to reset state
+ *
+ * This function will be called during a call to mb_bi_reader_reset(), after
+ * the reader has been closed. It should clear all state related to the
+ * previously opened boot image so that the format reader can be reused. Options
+ * set with the set option callback and allocations that can be reused should be
+ * kept.
+ *
+ * \param bir MbBiReader
+ * \param userdata User callback data
+ *
+ * \return
+ *   * Return #MB_BI_OK if the state is successfully reset
+ *   * Return \<= #MB_BI_FAILED if an error occurs
+ */
+
 /*!
  * \typedef FormatReaderFree
  * \ingroup MB_BI_READER_FORMAT_CALLBACKS
@@ -178,39 +223,6 @@
 
 MB_BEGIN_C_DECLS
 
-static struct
-{
-    int code;
-    const char *name;
-    int (*func)(MbBiReader *);
-} reader_formats[] = {
-    {
-        MB_BI_FORMAT_ANDROID,
-        MB_BI_FORMAT_NAME_ANDROID,
-        mb_bi_reader_enable_format_android
-    }, {
-        MB_BI_FORMAT_BUMP,
-        MB_BI_FORMAT_NAME_BUMP,
-        mb_bi_reader_enable_format_bump
-    }, {
-        MB_BI_FORMAT_LOKI,
-        MB_BI_FORMAT_NAME_LOKI,
-        mb_bi_reader_enable_format_loki
-    }, {
-        MB_BI_FORMAT_MTK,
-        MB_BI_FORMAT_NAME_MTK,
-        mb_bi_reader_enable_format_mtk
-    }, {
-        MB_BI_FORMAT_SONY_ELF,
-        MB_BI_FORMAT_NAME_SONY_ELF,
-        mb_bi_reader_enable_format_sony_elf
-    }, {
-        0,
-        nullptr,
-        nullptr
-    },
-};
-
 /*!
  * \brief Register a format reader
  *
@@ -231,6 +243,10 @@ static struct
  * \param read_entry_cb Read entry callback (required)
  * \param go_to_entry_cb Go to entry callback (optional)
  * \param read_data_cb Read data callback (required)
+ * \param read_data_view_cb Read data view callback (optional)
+ * \param entry_range_cb Entry range callback (optional)
+ * \param entry_location_cb Entry location callback (optional)
+ * \param reset_cb Reset callback (optional)
  * \param free_cb Free callback (optional)
  *
  * \return
@@ -248,6 +264,10 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
+                                  FormatReaderEntryRange entry_range_cb,
+                                  FormatReaderEntryLocation entry_location_cb,
+                                  FormatReaderReset reset_cb,
                                   FormatReaderFree free_cb)
 {
     int ret;
@@ -265,6 +285,10 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     format.read_entry_cb = read_entry_cb;
     format.go_to_entry_cb = go_to_entry_cb;
     format.read_data_cb = read_data_cb;
+    format.read_data_view_cb = read_data_view_cb;
+    format.entry_range_cb = entry_range_cb;
+    format.entry_location_cb = entry_location_cb;
+    format.reset_cb = reset_cb;
     format.free_cb = free_cb;
     format.userdata = userdata;
 
@@ -359,7 +383,7 @@ MbBiReader * mb_bi_reader_new()
         if (!bir->header || !bir->entry) {
             mb_bi_header_free(bir->header);
             mb_bi_entry_free(bir->entry);
-            free(bir);
+            delete bir;
             bir = nullptr;
         }
     }
@@ -405,6 +429,60 @@ int mb_bi_reader_free(MbBiReader *bir)
     return ret;
 }
 
+/*!
+ * \brief Reset an MbBiReader so that it can be reused.
+ *
+ * If the reader has not been closed, it will be closed and the result of
+ * mb_bi_reader_close() will be returned. The reader is then returned to the
+ * state it was in before mb_bi_reader_open() was called. The enabled formats,
+ * their options, and the format forced with mb_bi_reader_set_format_by_code()
+ * or mb_bi_reader_set_format_by_name() are kept, along with any memory that the
+ * formats have allocated. This avoids reallocating everything when many boot
+ * images are read in a row.
+ *
+ * \param bir MbBiReader
+ * \return
+ *   * #MB_BI_OK if the reader is successfully reset
+ *   * #MB_BI_FAILED if an error occurs while closing the reader (though the
+ *     reader will still be reset)
+ *   * #MB_BI_FATAL if a format cannot reset its state. The reader can only be
+ *     freed in this case.
+ */
+int mb_bi_reader_reset(MbBiReader *bir)
+{
+    int ret = MB_BI_OK, ret2;
+
+    if (bir->state != ReaderState::CLOSED) {
+        ret = mb_bi_reader_close(bir);
+    }
+
+    for (size_t i = 0; i < bir->formats_len; ++i) {
+        FormatReader *format = &bir->formats[i];
+
+        if (format->reset_cb) {
+            ret2 = format->reset_cb(bir, format->userdata);
+            if (ret2 != MB_BI_OK) {
+                bir->state = ReaderState::FATAL;
+                return MB_BI_FATAL;
+            }
+        }
+    }
+
+    if (!bir->format_forced) {
+        bir->format = nullptr;
+    }
+
+    mb_bi_header_clear(bir->header);
+    mb_bi_entry_clear(bir->entry);
+
+    bir->error_code = 0;
+    bir->error_string.clear();
+
+    bir->state = ReaderState::NEW;
+
+    return ret;
+}
+
 /*!
  * \brief Open boot image from filename (MBS).
  *
@@ -506,10 +584,41 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
         goto done;
     }
 
+    // Seek to beginning. Files that cannot seek are assumed to be positioned
+    // at the beginning already.
+    if (!file->seek(0, SEEK_SET, nullptr) && (file->is_fatal()
+            || file->error() != mb::FileError::UnsupportedSeek)) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to seek file: %s",
+                               file->error_string().c_str());
+        ret = file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        goto done;
+    }
+
+    // The bidders repeatedly read small structures near the beginning and the
+    // end of the file. Read both windows once so that bidding and header
+    // parsing are served from memory regardless of the number of enabled
+    // formats. The tail is only needed for bidding.
+    if (!bir->probe_file.open(file, PROBE_HEAD_SIZE,
+                              forced_format ? 0 : PROBE_TAIL_SIZE)) {
+        mb_bi_reader_set_error(bir,
+                               bir->probe_file.error().value() /* TODO */,
+                               "Failed to read file: %s",
+                               bir->probe_file.error_string().c_str());
+        ret = bir->probe_file.is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        goto done;
+    }
+
+    bir->file = &bir->probe_file;
+
     // Perform bid if a format wasn't explicitly chosen
     if (!bir->format) {
         FormatReader *format = nullptr, *cur;
 
+        // Bidders must not consume data from files that cannot seek
+        bir->probe_file.set_window_only(true);
+        ret = MB_BI_OK;
+
         for (size_t i = 0; i < bir->formats_len; ++i) {
             cur = &bir->formats[i];
 
@@ -520,7 +629,7 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
                                            "Failed to seek file: %s",
                                            bir->file->error_string().c_str());
                     ret = bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-                    goto done;
+                    break;
                 }
 
                 // Call bidder
@@ -531,12 +640,16 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
                 } else if (ret == MB_BI_WARN) {
                     continue;
                 } else if (ret < 0) {
-                    goto done;
+                    break;
                 }
             }
         }
 
-        if (format) {
+        bir->probe_file.set_window_only(false);
+
+        if (ret < 0 && ret != MB_BI_WARN) {
+            goto done;
+        } else if (format) {
             bir->format = format;
         } else {
             mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
@@ -552,6 +665,8 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
 
 done:
     if (ret != MB_BI_OK) {
+        bir->probe_file.close();
+
         if (owned) {
             delete file;
         }
@@ -586,14 +701,18 @@ int mb_bi_reader_close(MbBiReader *bir)
 
     // Avoid double-closing or closing nothing
     if (!(bir->state & (ReaderState::CLOSED | ReaderState::NEW))) {
-        if (bir->file && bir->file_owned) {
-            if (!bir->file->close()) {
+        mb::File *file = bir->probe_file.file();
+
+        bir->probe_file.close();
+
+        if (file && bir->file_owned) {
+            if (!file->close()) {
                 if (MB_BI_FAILED < ret) {
                     ret = MB_BI_FAILED;
                 }
             }
 
-            delete bir->file;
+            delete file;
         }
 
         bir->file = nullptr;
@@ -654,6 +773,8 @@ int mb_bi_reader_read_header(MbBiReader *bir, MbBiHeader **header)
  */
 int mb_bi_reader_read_header2(MbBiReader *bir, MbBiHeader *header)
 {
+    MB_ALLOC_SCOPE("bootimg.header");
+
     READER_ENSURE_STATE(bir, ReaderState::HEADER);
     int ret;
 
@@ -864,218 +985,324 @@ int mb_bi_reader_read_data(MbBiReader *bir, void *buf, size_t size,
 }
 
 /*!
- * \brief Get detected or forced boot image format code.
+ * \brief Get a pointer to the current boot image entry data.
  *
- * * If mb_bi_reader_enable_format_*() was used, then the detected boot image
- *   format code is returned.
- * * If mb_bi_reader_set_format_*() was used, then the forced boot image format
- *   code is returned.
+ * If the underlying File handle is backed by memory, such as a MemoryFile or an
+ * MmapFile, this function returns a pointer straight into the image instead of
+ * copying the data like mb_bi_reader_read_data() does. The data is consumed as
+ * if it had been read. The pointer remains valid until the next operation on
+ * the MbBiReader.
  *
- * \note The return value is meaningful only after the boot image has been
- *       successfully opened. Otherwise, an error will be returned.
+ * Example usage:
  *
- * \param bir MbBiReader
+ * \code{.cpp}
+ * const void *ptr;
+ * size_t size;
+ * int ret;
  *
- * \return Boot image format code or -1 if the boot image is not open
+ * while ((ret = mb_bi_reader_read_data_view(bir, &ptr, &size)) == MB_BI_OK) {
+ *     fwrite(ptr, 1, size, stdout);
+ * }
+ *
+ * if (ret == MB_BI_UNSUPPORTED) {
+ *     // Fall back to mb_bi_reader_read_data() for the remaining data
+ * }
+ * \endcode
+ *
+ * \note mb_bi_reader_read_data() and this function can be mixed freely. The
+ *       view may become unsupported partway through an entry, for example once
+ *       the data is no longer served from the header probe window.
+ *
+ * \param[in] bir MbBiReader
+ * \param[out] ptr Pointer to store pointer to the data
+ * \param[out] size Pointer to store number of bytes available at \p ptr
+ *
+ * \return
+ *   * #MB_BI_OK if a pointer to the data is returned
+ *   * #MB_BI_EOF if EOF is reached for the current entry
+ *   * #MB_BI_UNSUPPORTED if the data cannot be accessed without copying
+ *   * \<= #MB_BI_WARN if an error occurs
  */
-int mb_bi_reader_format_code(MbBiReader *bir)
+int mb_bi_reader_read_data_view(MbBiReader *bir, const void **ptr,
+                                size_t *size)
 {
-    if (!bir->format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                               "No format selected");
-        return -1;
+    READER_ENSURE_STATE(bir, ReaderState::DATA);
+    int ret;
+
+    if (!bir->format->read_data_view_cb) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support data views");
+        return MB_BI_UNSUPPORTED;
     }
 
-    return bir->format->type;
+    ret = bir->format->read_data_view_cb(bir, bir->format->userdata, *ptr,
+                                         *size);
+    if (ret == MB_BI_OK) {
+        // Do not alter state. Stay in ReaderState::DATA
+    } else if (ret <= MB_BI_FATAL) {
+        bir->state = ReaderState::FATAL;
+    }
+
+    return ret;
 }
 
 /*!
- * \brief Get detected or forced boot image format name.
+ * \brief Get the location of the current entry's data in the boot image.
  *
- * * If mb_bi_reader_enable_format_*() was used, then the detected boot image
- *   format name is returned.
- * * If mb_bi_reader_set_format_*() was used, then the forced boot image format
- *   name is returned.
+ * For formats that store the entry data contiguously and uncompressed, this
+ * returns the absolute byte range in the underlying File handle that holds the
+ * data that has not been read yet. This allows the caller to copy the data
+ * directly from the file (eg. with `copy_file_range()`) without going through
+ * mb_bi_reader_read_data().
  *
- * \note The return value is meaningful only after the boot image has been
- *       successfully opened. Otherwise, an error will be returned.
+ * If the format allows the entry to be truncated, the range is clamped to the
+ * size of the file.
  *
- * \param bir MbBiReader
+ * \note This does not consume any data. The reader's position is unchanged.
  *
- * \return Boot image format name or NULL if the boot image is not open
+ * \param[in] bir MbBiReader
+ * \param[out] offset Pointer to store absolute offset of the data
+ * \param[out] size Pointer to store size of the data
+ *
+ * \return
+ *   * #MB_BI_OK if the range is returned
+ *   * #MB_BI_UNSUPPORTED if the entry data is not stored contiguously
+ *   * \<= #MB_BI_WARN if an error occurs
  */
-const char * mb_bi_reader_format_name(MbBiReader *bir)
+int mb_bi_reader_entry_range(MbBiReader *bir, uint64_t *offset, uint64_t *size)
 {
-    if (!bir->format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                               "No format selected");
-        return NULL;
+    READER_ENSURE_STATE(bir, ReaderState::DATA);
+    int ret;
+
+    if (!bir->format->entry_range_cb) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support entry ranges");
+        return MB_BI_UNSUPPORTED;
     }
 
-    return bir->format->name;
+    ret = bir->format->entry_range_cb(bir, bir->format->userdata, *offset,
+                                      *size);
+    if (ret <= MB_BI_FATAL) {
+        bir->state = ReaderState::FATAL;
+    }
+
+    return ret;
 }
 
 /*!
- * \brief Force support for a boot image format by its code.
+ * \brief Open an independent handle for reading an entry's data.
  *
- * Calling this function causes the bidding process to be skipped. The chosen
- * format will be used regardless of which formats are enabled.
+ * Unlike mb_bi_reader_read_data(), which reads the current entry, each handle
+ * has its own position and only uses File::read_at() on the File handle that
+ * was passed to mb_bi_reader_open(). The reader's position is not changed.
+ * This allows multiple entries to be read at the same time, for example, to
+ * decompress the ramdisk on one thread while hashing the kernel on another.
  *
- * \param bir MbBiReader
- * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
+ * Handles can be used concurrently from different threads, as long as each
+ * handle is only used by one thread at a time and the underlying File supports
+ * concurrent positional reads. FdFile, PosixFile, MmapFile, and MemoryFile do
+ * when I/O statistics are disabled.
+ *
+ * \note The handle must be freed with mb_bi_entry_reader_free() before the
+ *       reader is closed, reset, or freed.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] entry_type Entry type to open (0 for the first entry)
+ * \param[out] handle Pointer to store the new handle
  *
  * \return
- *   * #MB_BI_OK if the format is successfully enabled
+ *   * #MB_BI_OK if the handle is successfully opened
+ *   * #MB_BI_EOF if there is no entry of type \p entry_type
+ *   * #MB_BI_UNSUPPORTED if the format does not store entries contiguously
  *   * \<= #MB_BI_WARN if an error occurs
  */
-int mb_bi_reader_set_format_by_code(MbBiReader *bir, int code)
+int mb_bi_reader_open_entry(MbBiReader *bir, int entry_type,
+                            MbBiEntryReader **handle)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
+    READER_ENSURE_STATE(bir, ReaderState::ENTRY | ReaderState::DATA);
+    uint64_t offset;
+    uint64_t size;
+    bool can_truncate;
     int ret;
-    FormatReader *format = nullptr;
 
-    ret = mb_bi_reader_enable_format_by_code(bir, code);
-    if (ret < 0 && ret != MB_BI_WARN) {
-        return ret;
+    if (!bir->format->entry_location_cb) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support entry handles");
+        return MB_BI_UNSUPPORTED;
     }
 
-    for (size_t i = 0; i < bir->formats_len; ++i) {
-        if ((MB_BI_FORMAT_BASE_MASK & bir->formats[i].type & code)
-                == (MB_BI_FORMAT_BASE_MASK & code)) {
-            format = &bir->formats[i];
-            break;
+    ret = bir->format->entry_location_cb(bir, bir->format->userdata,
+                                         entry_type, offset, size,
+                                         can_truncate);
+    if (ret != MB_BI_OK) {
+        if (ret <= MB_BI_FATAL) {
+            bir->state = ReaderState::FATAL;
         }
+        return ret;
     }
 
-    if (!format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Enabled format not found");
-        bir->state = ReaderState::FATAL;
-        return MB_BI_FATAL;
+    MbBiEntryReader *ber = new(std::nothrow) MbBiEntryReader();
+    if (!ber) {
+        mb_bi_reader_set_error(bir, -errno, "%s", strerror(errno));
+        return MB_BI_FAILED;
     }
 
-    bir->format = format;
+    ber->file = bir->probe_file.file();
+    ber->type = entry_type;
+    ber->offset = offset;
+    ber->size = size;
+    ber->pos = 0;
+    ber->can_truncate = can_truncate;
+    ber->error_code = 0;
 
+    *handle = ber;
     return MB_BI_OK;
 }
 
 /*!
- * \brief Force support for a boot image format by its name.
+ * \brief Free a handle returned by mb_bi_reader_open_entry().
  *
- * Calling this function causes the bidding process to be skipped. The chosen
- * format will be used regardless of which formats are enabled.
+ * \param handle Entry handle (may be nullptr)
+ */
+void mb_bi_entry_reader_free(MbBiEntryReader *handle)
+{
+    delete handle;
+}
+
+/*!
+ * \brief Get the size of the entry's data.
  *
- * \param bir MbBiReader
- * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
+ * If the format allows the entry to be truncated, the size is reduced once the
+ * end of the file is reached.
+ */
+uint64_t mb_bi_entry_reader_size(MbBiEntryReader *handle)
+{
+    return handle->size;
+}
+
+/*!
+ * \brief Read the entry's data using a handle.
+ *
+ * \param[in] handle Entry handle
+ * \param[out] buf Output buffer
+ * \param[in] size Size of output buffer
+ * \param[out] bytes_read Pointer to store number of bytes read
  *
  * \return
- *   * #MB_BI_OK if the format is successfully set
+ *   * #MB_BI_OK if data is successfully read
+ *   * #MB_BI_EOF if EOF is reached
  *   * \<= #MB_BI_WARN if an error occurs
  */
-int mb_bi_reader_set_format_by_name(MbBiReader *bir, const char *name)
+int mb_bi_entry_reader_read(MbBiEntryReader *handle, void *buf, size_t size,
+                            size_t *bytes_read)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-    int ret;
-    FormatReader *format = nullptr;
-
-    ret = mb_bi_reader_enable_format_by_name(bir, name);
-    if (ret < 0 && ret != MB_BI_WARN) {
-        return ret;
-    }
+    size_t to_read = std::min<uint64_t>(size, handle->size - handle->pos);
+    size_t total = 0;
+
+    while (total < to_read) {
+        size_t n;
+
+        if (!handle->file->read_at(handle->offset + handle->pos + total,
+                                   static_cast<char *>(buf) + total,
+                                   to_read - total, n)) {
+            handle->error_code = handle->file->error().value() /* TODO */;
+            mb::format(handle->error_string, "Failed to read data: %s",
+                       handle->file->error_string().c_str());
+            return MB_BI_FAILED;
+        } else if (n == 0) {
+            if (!handle->can_truncate) {
+                handle->error_code = MB_BI_ERROR_FILE_FORMAT;
+                mb::format(handle->error_string,
+                           "Entry is truncated (expected %" PRIu64
+                           " more bytes)",
+                           handle->size - handle->pos - total);
+                return MB_BI_FAILED;
+            }
 
-    for (size_t i = 0; i < bir->formats_len; ++i) {
-        if (strcmp(name, bir->formats[i].name) == 0) {
-            format = &bir->formats[i];
+            // Remaining data is past the end of the file
+            handle->size = handle->pos + total;
             break;
         }
-    }
 
-    if (!format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Enabled format not found");
-        bir->state = ReaderState::FATAL;
-        return MB_BI_FATAL;
+        total += n;
     }
 
-    bir->format = format;
+    handle->pos += total;
+    *bytes_read = total;
 
-    return MB_BI_OK;
+    return total == 0 ? MB_BI_EOF : MB_BI_OK;
 }
 
 /*!
- * \brief Enable support for all boot image formats.
+ * \brief Get error code for the last failed operation on an entry handle.
  *
- * \param bir MbBiReader
+ * \note The return value is undefined if an operation did not fail.
  *
- * \return
- *   * #MB_BI_OK if all formats are successfully enabled
- *   * \<= #MB_BI_FAILED if an error occurs while enabling a format
+ * \sa mb_bi_reader_error()
  */
-int mb_bi_reader_enable_format_all(MbBiReader *bir)
+int mb_bi_entry_reader_error(MbBiEntryReader *handle)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        int ret = it->func(bir);
-        if (ret != MB_BI_OK && ret != MB_BI_WARN) {
-            return ret;
-        }
-    }
+    return handle->error_code;
+}
 
-    return MB_BI_OK;
+/*!
+ * \brief Get error string for the last failed operation on an entry handle.
+ */
+const char * mb_bi_entry_reader_error_string(MbBiEntryReader *handle)
+{
+    return handle->error_string.c_str();
 }
 
 /*!
- * \brief Enable support for a boot image format by its code.
+ * \brief Get detected or forced boot image format code.
+ *
+ * * If mb_bi_reader_enable_format_*() was used, then the detected boot image
+ *   format code is returned.
+ * * If mb_bi_reader_set_format_*() was used, then the forced boot image format
+ *   code is returned.
+ *
+ * \note The return value is meaningful only after the boot image has been
+ *       successfully opened. Otherwise, an error will be returned.
  *
  * \param bir MbBiReader
- * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
  *
- * \return
- *   * #MB_BI_OK if the format is successfully enabled
- *   * #MB_BI_WARN if the format is already enabled
- *   * \<= #MB_BI_FAILED if an error occurs
+ * \return Boot image format code or -1 if the boot image is not open
  */
-int mb_bi_reader_enable_format_by_code(MbBiReader *bir, int code)
+int mb_bi_reader_format_code(MbBiReader *bir)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        if ((code & MB_BI_FORMAT_BASE_MASK)
-                == (it->code & MB_BI_FORMAT_BASE_MASK)) {
-            return it->func(bir);
-        }
+    if (!bir->format) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "No format selected");
+        return -1;
     }
 
-    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format code: %d", code);
-    return MB_BI_FAILED;
+    return bir->format->type;
 }
 
 /*!
- * \brief Enable support for a boot image format by its name.
+ * \brief Get detected or forced boot image format name.
+ *
+ * * If mb_bi_reader_enable_format_*() was used, then the detected boot image
+ *   format name is returned.
+ * * If mb_bi_reader_set_format_*() was used, then the forced boot image format
+ *   name is returned.
+ *
+ * \note The return value is meaningful only after the boot image has been
+ *       successfully opened. Otherwise, an error will be returned.
  *
  * \param bir MbBiReader
- * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
  *
- * \return
- *   * #MB_BI_OK if the format was successfully enabled
- *   * #MB_BI_WARN if the format is already enabled
- *   * \<= #MB_BI_FAILED if an error occurs
+ * \return Boot image format name or NULL if the boot image is not open
  */
-int mb_bi_reader_enable_format_by_name(MbBiReader *bir, const char *name)
+const char * mb_bi_reader_format_name(MbBiReader *bir)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        if (strcmp(name, it->name) == 0) {
-            return it->func(bir);
-        }
+    if (!bir->format) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "No format selected");
+        return NULL;
     }
 
-    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format name: %s", name);
-    return MB_BI_FAILED;
+    return bir->format->name;
 }
 
 /*!
@@ -157,6 +157,46 @@
  *   * Return \<= #MB_BI_WARN if an error occurs
  */
 
+/*!
+ * \typedef FormatWriterGetEntryDigest
+ * \ingroup MB_BI_WRITER_FORMAT_CALLBACKS
+ *
+ * \brief Format writer callback to get the digest of a written entry
+ *
+ * \param[in] biw MbBiWriter
+ * \param[in] userdata User callback data
+ * \param[in] entry_type Entry type
+ * \param[in] algorithm Digest algorithm (one of the MB_BI_DIGEST_* constants)
+ * \param[out] digest Output buffer to write digest
+ * \param[in,out] digest_size Size of output buffer on input and size of digest
+ *                            on output
+ *
+ * \return
+ *   * Return #MB_BI_OK if the digest is successfully retrieved
+ *   * Return #MB_BI_UNSUPPORTED if the algorithm is not supported
+ *   * Return #MB_BI_WARN if the entry has not been written
+ *   * Return \<= #MB_BI_FAILED if an error occurs
+ */
+
+/*!
+ * \typedef FormatWriterPatchEntry
+ * \ingroup MB_BI_WRITER_FORMAT_CALLBACKS
+ *
+ * \brief Format writer callback to replace an entry in an existing image
+ *
+ * \param biw MbBiWriter
+ * \param userdata User callback data
+ * \param entry_type Entry type
+ * \param data New entry data
+ * \param size Size of new entry data
+ *
+ * \return
+ *   * Return #MB_BI_OK if the entry is successfully replaced
+ *   * Return #MB_BI_UNSUPPORTED if the entry type is not supported
+ *   * Return #MB_BI_WARN if the existing image is not in the expected format
+ *   * Return \<= #MB_BI_FAILED if an error occurs
+ */
+
 /*!
  * \typedef FormatWriterClose
  * \ingroup MB_BI_WRITER_FORMAT_CALLBACKS
@@ -171,6 +211,26 @@
  *   * Return \<= #MB_BI_WARN if an error occurs
  */
 
+/*!
+ * \typedef FormatWriterReset
+ * \ingroup MB_BI_WRITER_FORMAT_CALLBACKS
+ *
+ * \brief Format writer callback to reset state
+ *
+ * This function will be called during a call to mb_bi_writer_reset(), after
+ * the writer has been closed. It should clear all state related to the
+ * previously written boot image so that the format writer can be reused.
+ * Options set with the set option callback and allocations that can be reused
+ * should be kept.
+ *
+ * \param biw MbBiWriter
+ * \param userdata User callback data
+ *
+ * \return
+ *   * Return #MB_BI_OK if the state is successfully reset
+ *   * Return \<= #MB_BI_FAILED if an error occurs
+ */
+
 /*!
  * \typedef FormatWriterFree
  *
@@ -242,7 +302,10 @@ static struct
  * \param write_entry_cb Write entry callback (required)
  * \param write_data_cb Write data callback (required)
  * \param finish_entry_cb Finish entry callback (optional)
+ * \param get_entry_digest_cb Get entry digest callback (optional)
+ * \param patch_entry_cb Patch entry callback (optional)
  * \param close_cb Close callback (optional)
+ * \param reset_cb Reset callback (optional)
  * \param free_cb Free callback (optional)
  *
  * \return
@@ -260,7 +323,10 @@ int _mb_bi_writer_register_format(MbBiWriter *biw,
                                   FormatWriterWriteEntry write_entry_cb,
                                   FormatWriterWriteData write_data_cb,
                                   FormatWriterFinishEntry finish_entry_cb,
+                                  FormatWriterGetEntryDigest get_entry_digest_cb,
+                                  FormatWriterPatchEntry patch_entry_cb,
                                   FormatWriterClose close_cb,
+                                  FormatWriterReset reset_cb,
                                   FormatWriterFree free_cb)
 {
     int ret;
@@ -279,7 +345,10 @@ int _mb_bi_writer_register_format(MbBiWriter *biw,
     format.write_entry_cb = write_entry_cb;
     format.write_data_cb = write_data_cb;
     format.finish_entry_cb = finish_entry_cb;
+    format.get_entry_digest_cb = get_entry_digest_cb;
+    format.patch_entry_cb = patch_entry_cb;
     format.close_cb = close_cb;
+    format.reset_cb = reset_cb;
     format.free_cb = free_cb;
     format.userdata = userdata;
 
@@ -408,6 +477,48 @@ int mb_bi_writer_free(MbBiWriter *biw)
     return ret;
 }
 
+/*!
+ * \brief Reset an MbBiWriter so that it can be reused.
+ *
+ * If the writer has not been closed, it will be closed and the result of
+ * mb_bi_writer_close() will be returned. The writer is then returned to the
+ * state it was in before mb_bi_writer_open() was called. The output format, its
+ * options, and any memory that the format has allocated are kept. This avoids
+ * reallocating everything when many boot images are written in a row.
+ *
+ * \param biw MbBiWriter
+ * \return
+ *   * #MB_BI_OK if the writer is successfully reset
+ *   * \<= #MB_BI_FAILED if an error occurs while closing the writer (though the
+ *     writer will still be reset)
+ *   * #MB_BI_FATAL if the format cannot reset its state. The writer can only be
+ *     freed in this case.
+ */
+int mb_bi_writer_reset(MbBiWriter *biw)
+{
+    int ret = MB_BI_OK;
+
+    if (biw->state != WriterState::CLOSED) {
+        ret = mb_bi_writer_close(biw);
+    }
+
+    if (biw->format_set && biw->format.reset_cb
+            && biw->format.reset_cb(biw, biw->format.userdata) != MB_BI_OK) {
+        biw->state = WriterState::FATAL;
+        return MB_BI_FATAL;
+    }
+
+    mb_bi_header_clear(biw->header);
+    mb_bi_entry_clear(biw->entry);
+
+    biw->error_code = 0;
+    biw->error_string.clear();
+
+    biw->state = WriterState::NEW;
+
+    return ret;
+}
+
 /*!
  * \brief Open boot image from filename (MBS).
  *
@@ -832,6 +943,102 @@ int mb_bi_writer_write_data(MbBiWriter *biw, const void *buf, size_t size,
     return ret;
 }
 
+/*!
+ * \brief Get the digest of a boot image entry that has been written.
+ *
+ * The digests are computed while the entry data is written, so callers that
+ * need a checksum of an entry do not have to hash the data a second time. The
+ * digest of an entry is available once the entry is complete, ie. after the
+ * next call to mb_bi_writer_get_entry() or after mb_bi_writer_close().
+ *
+ * \param[in] biw MbBiWriter
+ * \param[in] entry_type Entry type
+ * \param[in] algorithm Digest algorithm (#MB_BI_DIGEST_SHA1 or
+ *                      #MB_BI_DIGEST_SHA256)
+ * \param[out] digest Output buffer to write digest
+ * \param[in,out] digest_size Size of \p digest on input and size of the digest
+ *                            on output
+ *
+ * \return
+ *   * #MB_BI_OK if the digest is successfully retrieved
+ *   * #MB_BI_UNSUPPORTED if the format or the algorithm is not supported
+ *   * #MB_BI_WARN if the entry has not been written
+ *   * \<= #MB_BI_FAILED if an error occurs
+ */
+int mb_bi_writer_get_entry_digest(MbBiWriter *biw, int entry_type,
+                                  int algorithm, unsigned char *digest,
+                                  size_t *digest_size)
+{
+    WRITER_ENSURE_STATE(biw, WriterState::ENTRY | WriterState::DATA
+            | WriterState::CLOSED);
+
+    if (!biw->format_set || !biw->format.get_entry_digest_cb) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support entry digests");
+        return MB_BI_UNSUPPORTED;
+    }
+
+    // Do not alter state
+    return biw->format.get_entry_digest_cb(biw, biw->format.userdata,
+                                           entry_type, algorithm, digest,
+                                           *digest_size);
+}
+
+/*!
+ * \brief Replace an entry in an existing boot image.
+ *
+ * This is a fast path for repacking images where only one entry changes, such
+ * as after patching the ramdisk. Instead of reading the whole image and writing
+ * it out again, the entry is rewritten in place. If the page-aligned size of
+ * the entry changes, only the data following the entry is moved. The header is
+ * updated to match the new entry.
+ *
+ * The writer must be opened with mb_bi_writer_open() on a readable and writable
+ * File containing an image of the selected format. This function can be called
+ * multiple times to replace several entries, but it cannot be mixed with
+ * mb_bi_writer_write_header() and the other functions for writing a new image.
+ * Call mb_bi_writer_close() when done.
+ *
+ * \param biw MbBiWriter
+ * \param entry_type Entry type
+ * \param data New entry data
+ * \param size Size of new entry data
+ *
+ * \return
+ *   * #MB_BI_OK if the entry is successfully replaced
+ *   * #MB_BI_UNSUPPORTED if the format or the entry type is not supported
+ *   * #MB_BI_WARN if the existing image is not in the expected format
+ *   * \<= #MB_BI_FAILED if an error occurs
+ */
+int mb_bi_writer_patch_entry(MbBiWriter *biw, int entry_type,
+                             const void *data, size_t size)
+{
+    WRITER_ENSURE_STATE(biw, WriterState::HEADER);
+    int ret;
+
+    if (!biw->format_set) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "No writer format registered");
+        return MB_BI_FAILED;
+    }
+
+    if (!biw->format.patch_entry_cb) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support patching entries");
+        return MB_BI_UNSUPPORTED;
+    }
+
+    ret = biw->format.patch_entry_cb(biw, biw->format.userdata, entry_type,
+                                     data, size);
+    if (ret == MB_BI_OK) {
+        // Do not alter state. Stay in WriterState::HEADER
+    } else if (ret <= MB_BI_FATAL) {
+        biw->state = WriterState::FATAL;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Get selected boot image format code.
  *
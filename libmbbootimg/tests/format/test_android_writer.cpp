@@ -19,8 +19,13 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
 
+#include <openssl/sha.h>
+
+#include "mbcommon/file/callbacks.h"
 #include "mbcommon/file/memory.h"
 
 #include "mbbootimg/entry.h"
@@ -155,3 +160,343 @@ TEST_F(AndroidWriterSHA1Test, HandlesKernelRamdiskSecondbootDT)
     TestChecksum(expected, MB_BI_ENTRY_KERNEL | MB_BI_ENTRY_RAMDISK
             | MB_BI_ENTRY_SECONDBOOT | MB_BI_ENTRY_DEVICE_TREE);
 }
+
+static bool _sink_write_cb(mb::File &file, void *userdata,
+                           const void *buf, size_t size,
+                           size_t &bytes_written)
+{
+    (void) file;
+    auto *data = static_cast<std::string *>(userdata);
+
+    data->append(static_cast<const char *>(buf), size);
+    bytes_written = size;
+
+    return true;
+}
+
+static void write_android_image(mb::File *file, bool is_bump)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    size_t n;
+
+    ASSERT_TRUE(!!biw);
+    if (is_bump) {
+        ASSERT_EQ(mb_bi_writer_set_format_bump(biw.get()), MB_BI_OK);
+    } else {
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    }
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), file, false), MB_BI_OK);
+
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+        std::string data(3000, 'a' + mb_bi_entry_type(entry) % 26);
+        ASSERT_EQ(mb_bi_writer_write_data(biw.get(), data.data(), data.size(),
+                                          &n), MB_BI_OK);
+        ASSERT_EQ(n, data.size());
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+}
+
+static void compare_streamed_image(bool is_bump)
+{
+    void *buf = nullptr;
+    size_t buf_size = 0;
+    std::string streamed;
+
+    {
+        mb::MemoryFile file(&buf, &buf_size);
+        ASSERT_TRUE(file.is_open());
+        write_android_image(&file, is_bump);
+    }
+
+    {
+        mb::CallbackFile file(nullptr, nullptr, nullptr, &_sink_write_cb,
+                              nullptr, nullptr, &streamed);
+        ASSERT_TRUE(file.is_open());
+        write_android_image(&file, is_bump);
+    }
+
+    ASSERT_EQ(streamed, std::string(static_cast<char *>(buf), buf_size));
+
+    free(buf);
+}
+
+TEST(AndroidWriterStreamingTest, NonSeekableOutputShouldMatch)
+{
+    compare_streamed_image(false);
+}
+
+TEST(AndroidWriterStreamingTest, NonSeekableBumpOutputShouldMatch)
+{
+    compare_streamed_image(true);
+}
+
+// Write an image with the given kernel and a short ramdisk. The kernel is
+// passed to the writer in chunks of chunk_size bytes.
+static void write_digest_image(mb::File *file, ScopedWriter &biw,
+                               const std::string &kernel, size_t chunk_size)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), file, false), MB_BI_OK);
+
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+        if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+            for (size_t i = 0; i < kernel.size(); i += chunk_size) {
+                size_t size = std::min(chunk_size, kernel.size() - i);
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), kernel.data() + i,
+                                                  size, &n), MB_BI_OK);
+                ASSERT_EQ(n, size);
+            }
+        } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+            ASSERT_EQ(mb_bi_writer_write_data(biw.get(), "hello", 5, &n),
+                      MB_BI_OK);
+            ASSERT_EQ(n, 5u);
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+}
+
+TEST(AndroidWriterDigestTest, EntryDigestsShouldMatch)
+{
+    std::string kernel(1024 * 1024, 'k');
+    void *buf = nullptr;
+    size_t buf_size = 0;
+    mb::MemoryFile file(&buf, &buf_size);
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    unsigned char expected_sha1[SHA_DIGEST_LENGTH];
+    unsigned char expected_sha256[SHA256_DIGEST_LENGTH];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    size_t digest_size;
+
+    write_digest_image(&file, biw, kernel, kernel.size());
+
+    SHA1(reinterpret_cast<const unsigned char *>(kernel.data()), kernel.size(),
+         expected_sha1);
+    SHA256(reinterpret_cast<const unsigned char *>(kernel.data()),
+           kernel.size(), expected_sha256);
+
+    digest_size = sizeof(digest);
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_KERNEL,
+                                            MB_BI_DIGEST_SHA1, digest,
+                                            &digest_size), MB_BI_OK);
+    ASSERT_EQ(digest_size, static_cast<size_t>(MB_BI_DIGEST_SHA1_SIZE));
+    ASSERT_EQ(memcmp(digest, expected_sha1, digest_size), 0);
+
+    digest_size = sizeof(digest);
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_KERNEL,
+                                            MB_BI_DIGEST_SHA256, digest,
+                                            &digest_size), MB_BI_OK);
+    ASSERT_EQ(digest_size, static_cast<size_t>(MB_BI_DIGEST_SHA256_SIZE));
+    ASSERT_EQ(memcmp(digest, expected_sha256, digest_size), 0);
+
+    SHA1(reinterpret_cast<const unsigned char *>("hello"), 5, expected_sha1);
+
+    digest_size = sizeof(digest);
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_RAMDISK,
+                                            MB_BI_DIGEST_SHA1, digest,
+                                            &digest_size), MB_BI_OK);
+    ASSERT_EQ(memcmp(digest, expected_sha1, digest_size), 0);
+
+    // Buffer too small
+    digest_size = MB_BI_DIGEST_SHA1_SIZE - 1;
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_KERNEL,
+                                            MB_BI_DIGEST_SHA1, digest,
+                                            &digest_size), MB_BI_FAILED);
+
+    // Invalid algorithm
+    digest_size = sizeof(digest);
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_KERNEL,
+                                            0, digest, &digest_size),
+              MB_BI_UNSUPPORTED);
+
+    // Not an Android entry
+    ASSERT_EQ(mb_bi_writer_get_entry_digest(biw.get(), MB_BI_ENTRY_SONY_IPL,
+                                            MB_BI_DIGEST_SHA1, digest,
+                                            &digest_size), MB_BI_WARN);
+
+    biw.reset();
+    free(buf);
+}
+
+TEST(AndroidWriterDigestTest, SingleWriteShouldMatchChunkedWrites)
+{
+    std::string kernel(1024 * 1024 + 123, 'k');
+    void *buf_chunked = nullptr;
+    size_t buf_chunked_size = 0;
+    void *buf_single = nullptr;
+    size_t buf_single_size = 0;
+
+    {
+        mb::MemoryFile file(&buf_chunked, &buf_chunked_size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        write_digest_image(&file, biw, kernel, 4096);
+    }
+    {
+        mb::MemoryFile file(&buf_single, &buf_single_size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        write_digest_image(&file, biw, kernel, kernel.size());
+    }
+
+    ASSERT_EQ(buf_chunked_size, buf_single_size);
+    ASSERT_EQ(memcmp(buf_chunked, buf_single, buf_chunked_size), 0);
+
+    free(buf_chunked);
+    free(buf_single);
+}
+
+// Write an image with the given ramdisk and a kernel and device tree that are
+// not page-aligned
+static std::string write_patch_image(const std::string &ramdisk, bool is_bump)
+{
+    void *buf = nullptr;
+    size_t buf_size = 0;
+
+    {
+        mb::MemoryFile file(&buf, &buf_size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        size_t n;
+
+        if (is_bump) {
+            EXPECT_EQ(mb_bi_writer_set_format_bump(biw.get()), MB_BI_OK);
+        } else {
+            EXPECT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        }
+        EXPECT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        EXPECT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        EXPECT_EQ(mb_bi_header_set_kernel_cmdline(header, "console=null"),
+                  MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while (mb_bi_writer_get_entry(biw.get(), &entry) == MB_BI_OK) {
+            EXPECT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            std::string data;
+            switch (mb_bi_entry_type(entry)) {
+            case MB_BI_ENTRY_KERNEL:
+                data.assign(3000, 'k');
+                break;
+            case MB_BI_ENTRY_RAMDISK:
+                data = ramdisk;
+                break;
+            case MB_BI_ENTRY_DEVICE_TREE:
+                data.assign(100, 'd');
+                break;
+            }
+
+            if (!data.empty()) {
+                EXPECT_EQ(mb_bi_writer_write_data(biw.get(), data.data(),
+                                                  data.size(), &n), MB_BI_OK);
+            }
+        }
+
+        EXPECT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    std::string result(static_cast<char *>(buf), buf_size);
+    free(buf);
+    return result;
+}
+
+static void patch_ramdisk(const std::string &old_ramdisk,
+                          const std::string &new_ramdisk, bool is_bump)
+{
+    std::string image = write_patch_image(old_ramdisk, is_bump);
+    void *buf = malloc(image.size());
+    size_t buf_size = image.size();
+
+    ASSERT_TRUE(!!buf);
+    memcpy(buf, image.data(), image.size());
+
+    {
+        mb::MemoryFile file(&buf, &buf_size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+        ASSERT_TRUE(file.is_open());
+        if (is_bump) {
+            ASSERT_EQ(mb_bi_writer_set_format_bump(biw.get()), MB_BI_OK);
+        } else {
+            ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        }
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_patch_entry(biw.get(), MB_BI_ENTRY_RAMDISK,
+                                           new_ramdisk.data(),
+                                           new_ramdisk.size()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    // Must be identical to an image written from scratch
+    ASSERT_EQ(std::string(static_cast<char *>(buf), buf_size),
+              write_patch_image(new_ramdisk, is_bump));
+
+    free(buf);
+}
+
+TEST(AndroidWriterPatchTest, SameAlignedSizeShouldPatchInPlace)
+{
+    patch_ramdisk(std::string(1000, 'r'), std::string(2000, 'R'), false);
+}
+
+TEST(AndroidWriterPatchTest, LargerEntryShouldMoveFollowingEntries)
+{
+    patch_ramdisk(std::string(1000, 'r'), std::string(10000, 'R'), false);
+}
+
+TEST(AndroidWriterPatchTest, SmallerEntryShouldMoveFollowingEntries)
+{
+    patch_ramdisk(std::string(10000, 'r'), std::string(1000, 'R'), false);
+}
+
+TEST(AndroidWriterPatchTest, BumpMagicShouldBePreserved)
+{
+    patch_ramdisk(std::string(1000, 'r'), std::string(10000, 'R'), true);
+}
+
+TEST(AndroidWriterPatchTest, InvalidImageShouldWarn)
+{
+    std::string garbage(4096, 'x');
+    mb::MemoryFile file(&garbage[0], garbage.size());
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_patch_entry(biw.get(), MB_BI_ENTRY_RAMDISK,
+                                       "hello", 5), MB_BI_WARN);
+}
+
+TEST(AndroidWriterPatchTest, UnsupportedEntryShouldFail)
+{
+    std::string image = write_patch_image("hello", false);
+    mb::MemoryFile file(&image[0], image.size());
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_patch_entry(biw.get(), MB_BI_ENTRY_SONY_IPL,
+                                       "hello", 5), MB_BI_UNSUPPORTED);
+}
@@ -18,3 +18,60 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstring>
+
+#include "mbbootimg/format/loki_p.h"
+
+TEST(LokiFindAbootFuncTest, FirstPassPatternShouldBeFound)
+{
+    std::vector<unsigned char> aboot(0x4000, 0xf0);
+    memcpy(aboot.data() + 0x1234, "\x2d\xe9\xf0\x4f\xad\xf5\x21\x7d", 8);
+    size_t offset;
+
+    ASSERT_TRUE(_loki_find_aboot_func(aboot.data(), aboot.size(), &offset));
+    ASSERT_EQ(offset, 0x1234u);
+}
+
+TEST(LokiFindAbootFuncTest, FirstPassShouldTakePrecedence)
+{
+    std::vector<unsigned char> aboot(0x4000, 0x2d);
+    // PATTERN6 comes first, but is only used if no other pattern matches
+    memcpy(aboot.data() + 0x100, "\x2d\xe9\xf0\x4f\xf3\xb0\x05\x46", 8);
+    memcpy(aboot.data() + 0x200, "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7", 8);
+    size_t offset;
+
+    ASSERT_TRUE(_loki_find_aboot_func(aboot.data(), aboot.size(), &offset));
+    ASSERT_EQ(offset, 0x200u);
+}
+
+TEST(LokiFindAbootFuncTest, SecondPassPatternShouldBeFound)
+{
+    std::vector<unsigned char> aboot(0x4000, 0);
+    memcpy(aboot.data() + 0x100, "\x2d\xe9\xf0\x4f\xf3\xb0\x05\x46", 8);
+    size_t offset;
+
+    ASSERT_TRUE(_loki_find_aboot_func(aboot.data(), aboot.size(), &offset));
+    ASSERT_EQ(offset, 0x100u);
+}
+
+TEST(LokiFindAbootFuncTest, PatternInSearchLimitShouldBeIgnored)
+{
+    std::vector<unsigned char> aboot(0x4000, 0);
+    memcpy(aboot.data() + aboot.size() - 0x100,
+           "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7", 8);
+    size_t offset;
+
+    ASSERT_FALSE(_loki_find_aboot_func(aboot.data(), aboot.size(), &offset));
+}
+
+TEST(LokiFindAbootFuncTest, UndersizedAbootShouldFail)
+{
+    std::vector<unsigned char> aboot(0x100, 0);
+    memcpy(aboot.data(), "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7", 8);
+    size_t offset;
+
+    ASSERT_FALSE(_loki_find_aboot_func(aboot.data(), aboot.size(), &offset));
+}
@@ -18,3 +18,120 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/format/mtk_reader_p.h"
+#include "mbbootimg/reader.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+
+static void append_mtk_header(std::vector<unsigned char> &data,
+                              uint32_t size, const char *type)
+{
+    MtkHeader mtkhdr;
+    memset(&mtkhdr, 0xff, sizeof(mtkhdr));
+    memcpy(mtkhdr.magic, MTK_MAGIC, MTK_MAGIC_SIZE);
+    mtkhdr.size = mb_htole32(size);
+    memset(mtkhdr.type, 0, sizeof(mtkhdr.type));
+    memcpy(mtkhdr.type, type, strlen(type));
+
+    data.insert(data.end(),
+                reinterpret_cast<unsigned char *>(&mtkhdr),
+                reinterpret_cast<unsigned char *>(&mtkhdr) + sizeof(mtkhdr));
+}
+
+// Tests for find_mtk_headers()
+
+TEST(FindMtkHeadersTest, ValidHeadersShouldSucceed)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader hdr = {};
+    hdr.page_size = 2048;
+    hdr.kernel_size = sizeof(MtkHeader) + 100;
+    hdr.ramdisk_size = sizeof(MtkHeader) + 200;
+
+    std::vector<unsigned char> data(hdr.page_size);
+    append_mtk_header(data, 100, "KERNEL");
+    data.resize(2 * hdr.page_size);
+    append_mtk_header(data, 200, "ROOTFS");
+    data.resize(3 * hdr.page_size);
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    MtkHeader kernel_mtkhdr;
+    MtkHeader ramdisk_mtkhdr;
+    uint64_t kernel_offset;
+    uint64_t ramdisk_offset;
+
+    ASSERT_EQ(find_mtk_headers(bir.get(), &file, &hdr,
+                               &kernel_mtkhdr, &kernel_offset,
+                               &ramdisk_mtkhdr, &ramdisk_offset), MB_BI_OK);
+    ASSERT_EQ(kernel_mtkhdr.size, 100u);
+    ASSERT_EQ(kernel_offset, hdr.page_size + sizeof(MtkHeader));
+    ASSERT_EQ(ramdisk_mtkhdr.size, 200u);
+    ASSERT_EQ(ramdisk_offset, 2 * hdr.page_size + sizeof(MtkHeader));
+}
+
+TEST(FindMtkHeadersTest, UndersizedImagesShouldWarn)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader hdr = {};
+    hdr.page_size = 2048;
+    hdr.kernel_size = 100;
+    hdr.ramdisk_size = 200;
+
+    mb::MemoryFile file(static_cast<const void *>(nullptr), 0);
+    ASSERT_TRUE(file.is_open());
+
+    MtkHeader kernel_mtkhdr;
+    MtkHeader ramdisk_mtkhdr;
+    uint64_t kernel_offset;
+    uint64_t ramdisk_offset;
+
+    ASSERT_EQ(find_mtk_headers(bir.get(), &file, &hdr,
+                               &kernel_mtkhdr, &kernel_offset,
+                               &ramdisk_mtkhdr, &ramdisk_offset), MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()), "too small"));
+}
+
+TEST(FindMtkHeadersTest, MismatchedKernelSizeShouldWarnBeforeRamdisk)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader hdr = {};
+    hdr.page_size = 2048;
+    hdr.kernel_size = sizeof(MtkHeader) + 100;
+    hdr.ramdisk_size = sizeof(MtkHeader) + 200;
+
+    // The image ends before the ramdisk MTK header, so this only succeeds if
+    // the ramdisk MTK header is never read
+    std::vector<unsigned char> data(hdr.page_size);
+    append_mtk_header(data, 50, "KERNEL");
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    MtkHeader kernel_mtkhdr;
+    MtkHeader ramdisk_mtkhdr;
+    uint64_t kernel_offset;
+    uint64_t ramdisk_offset;
+
+    ASSERT_EQ(find_mtk_headers(bir.get(), &file, &hdr,
+                               &kernel_mtkhdr, &kernel_offset,
+                               &ramdisk_mtkhdr, &ramdisk_offset), MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()),
+                       "Mismatched kernel size"));
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <lz4.h>
+#include <lzma.h>
+#include <zlib.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/decoder.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+// Compressible data that is not just one repeated byte
+static std::string make_payload(size_t size)
+{
+    std::string data;
+    data.reserve(size);
+
+    for (size_t i = 0; data.size() < size; ++i) {
+        data += "line " + std::to_string(i * 7919 % 1000) + "\n";
+    }
+
+    data.resize(size);
+    return data;
+}
+
+static std::string compress_gzip(const std::string &data)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    EXPECT_EQ(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                           16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY), Z_OK);
+
+    std::string out(deflateBound(&z, data.size()), '\0');
+    z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    z.avail_in = static_cast<uInt>(data.size());
+    z.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    z.avail_out = static_cast<uInt>(out.size());
+
+    EXPECT_EQ(deflate(&z, Z_FINISH), Z_STREAM_END);
+    out.resize(z.total_out);
+    deflateEnd(&z);
+
+    return out;
+}
+
+static std::string compress_lzma(const std::string &data, bool xz)
+{
+    lzma_stream s = LZMA_STREAM_INIT;
+
+    if (xz) {
+        EXPECT_EQ(lzma_easy_encoder(&s, 1, LZMA_CHECK_CRC32), LZMA_OK);
+    } else {
+        lzma_options_lzma options;
+        EXPECT_FALSE(lzma_lzma_preset(&options, 1));
+        EXPECT_EQ(lzma_alone_encoder(&s, &options), LZMA_OK);
+    }
+
+    std::string out(data.size() + data.size() / 2 + 1024, '\0');
+    s.next_in = reinterpret_cast<const uint8_t *>(data.data());
+    s.avail_in = data.size();
+    s.next_out = reinterpret_cast<uint8_t *>(&out[0]);
+    s.avail_out = out.size();
+
+    EXPECT_EQ(lzma_code(&s, LZMA_FINISH), LZMA_STREAM_END);
+    out.resize(s.total_out);
+    lzma_end(&s);
+
+    return out;
+}
+
+static void append_le32(std::string &out, uint32_t value)
+{
+    value = mb_htole32(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static std::string compress_lz4_legacy(const std::string &data)
+{
+    const size_t block_size = 8 * 1024 * 1024;
+    std::string out;
+
+    append_le32(out, 0x184c2102);
+
+    for (size_t offset = 0; offset < data.size(); offset += block_size) {
+        int in_size = static_cast<int>(
+                std::min(block_size, data.size() - offset));
+        std::string block(LZ4_compressBound(in_size), '\0');
+
+        int n = LZ4_compress_default(data.data() + offset, &block[0],
+                                     in_size, static_cast<int>(block.size()));
+        EXPECT_GT(n, 0);
+
+        append_le32(out, static_cast<uint32_t>(n));
+        out.append(block.data(), n);
+    }
+
+    return out;
+}
+
+// Build an Android boot image with the given ramdisk
+static std::string make_android_image(const std::string &ramdisk)
+{
+    void *buf = nullptr;
+    size_t size = 0;
+
+    {
+        mb::MemoryFile file(&buf, &size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        size_t n;
+
+        EXPECT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        mb_bi_header_set_page_size(header, 2048);
+        EXPECT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while (mb_bi_writer_get_entry(biw.get(), &entry) == MB_BI_OK) {
+            EXPECT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+            if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+                EXPECT_EQ(mb_bi_writer_write_data(biw.get(), ramdisk.data(),
+                                                  ramdisk.size(), &n),
+                          MB_BI_OK);
+            }
+        }
+
+        EXPECT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    std::string result(static_cast<char *>(buf), size);
+    free(buf);
+    return result;
+}
+
+static void check_decoded_ramdisk(const std::string &ramdisk,
+                                  int expected_compression,
+                                  const std::string &expected_data)
+{
+    std::string image = make_android_image(ramdisk);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    mb::File *decoded;
+    int compression;
+    ASSERT_EQ(mb_bi_reader_open_entry_decoded(bir.get(), MB_BI_ENTRY_RAMDISK,
+                                              &decoded, &compression),
+              MB_BI_OK) << mb_bi_reader_error_string(bir.get());
+    std::unique_ptr<mb::File> decoded_ptr(decoded);
+
+    ASSERT_EQ(compression, expected_compression);
+
+    std::string data;
+    char buf[10000];
+    size_t n;
+
+    while (decoded->read(buf, sizeof(buf), n) && n > 0) {
+        data.append(buf, n);
+    }
+    ASSERT_FALSE(decoded->is_fatal()) << decoded->error_string();
+    ASSERT_EQ(data.size(), expected_data.size());
+    ASSERT_TRUE(data == expected_data);
+}
+
+TEST(BootImgDecoderTest, DetectCompression)
+{
+    const unsigned char gzip[] = { 0x1f, 0x8b, 0x08 };
+    const unsigned char lz4[] = { 0x02, 0x21, 0x4c, 0x18 };
+    const unsigned char xz[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+    const unsigned char lzma[] = {
+        0x5d, 0x00, 0x00, 0x80, 0x00, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+    const unsigned char bad_lzma[] = {
+        0x5d, 0x12, 0x34, 0x56, 0x78, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff,
+    };
+
+    ASSERT_EQ(mb_bi_detect_compression(gzip, sizeof(gzip)),
+              MB_BI_COMPRESSION_GZIP);
+    ASSERT_EQ(mb_bi_detect_compression(lz4, sizeof(lz4)),
+              MB_BI_COMPRESSION_LZ4_LEGACY);
+    ASSERT_EQ(mb_bi_detect_compression(xz, sizeof(xz)),
+              MB_BI_COMPRESSION_XZ);
+    ASSERT_EQ(mb_bi_detect_compression(lzma, sizeof(lzma)),
+              MB_BI_COMPRESSION_LZMA);
+    ASSERT_EQ(mb_bi_detect_compression(bad_lzma, sizeof(bad_lzma)),
+              MB_BI_COMPRESSION_NONE);
+    ASSERT_EQ(mb_bi_detect_compression(lzma, sizeof(lzma) - 1),
+              MB_BI_COMPRESSION_NONE);
+    ASSERT_EQ(mb_bi_detect_compression("070701", 6),
+              MB_BI_COMPRESSION_NONE);
+
+    ASSERT_STREQ(mb_bi_compression_name(MB_BI_COMPRESSION_LZ4_LEGACY),
+                 "lz4_legacy");
+    ASSERT_EQ(mb_bi_compression_name(-1), nullptr);
+}
+
+TEST(BootImgDecoderTest, DecodeUncompressed)
+{
+    std::string payload = make_payload(100000);
+    check_decoded_ramdisk(payload, MB_BI_COMPRESSION_NONE, payload);
+}
+
+TEST(BootImgDecoderTest, DecodeGzip)
+{
+    std::string payload = make_payload(500000);
+    check_decoded_ramdisk(compress_gzip(payload), MB_BI_COMPRESSION_GZIP,
+                          payload);
+}
+
+TEST(BootImgDecoderTest, DecodeConcatenatedGzip)
+{
+    std::string first = make_payload(100000);
+    std::string second = make_payload(50000);
+    check_decoded_ramdisk(compress_gzip(first) + compress_gzip(second),
+                          MB_BI_COMPRESSION_GZIP, first + second);
+}
+
+TEST(BootImgDecoderTest, DecodeLzma)
+{
+    std::string payload = make_payload(500000);
+    check_decoded_ramdisk(compress_lzma(payload, false),
+                          MB_BI_COMPRESSION_LZMA, payload);
+}
+
+TEST(BootImgDecoderTest, DecodeXz)
+{
+    std::string payload = make_payload(500000);
+    check_decoded_ramdisk(compress_lzma(payload, true),
+                          MB_BI_COMPRESSION_XZ, payload);
+}
+
+TEST(BootImgDecoderTest, DecodeLz4LegacyMultipleBlocks)
+{
+    // Three blocks, with padding after the last one
+    std::string payload = make_payload(20 * 1024 * 1024);
+    check_decoded_ramdisk(compress_lz4_legacy(payload) + std::string(12, '\0'),
+                          MB_BI_COMPRESSION_LZ4_LEGACY, payload);
+}
+
+TEST(BootImgDecoderTest, DecodeCorruptData)
+{
+    std::string ramdisk = compress_gzip(make_payload(100000));
+    ramdisk.resize(ramdisk.size() / 2);
+
+    std::string image = make_android_image(ramdisk);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    mb::File *decoded;
+    ASSERT_EQ(mb_bi_reader_open_entry_decoded(bir.get(), MB_BI_ENTRY_RAMDISK,
+                                              &decoded, nullptr), MB_BI_OK);
+    std::unique_ptr<mb::File> decoded_ptr(decoded);
+
+    char buf[10000];
+    size_t n;
+    bool ret;
+
+    while ((ret = decoded->read(buf, sizeof(buf), n)) && n > 0) {
+    }
+    ASSERT_FALSE(ret);
+    ASSERT_EQ(decoded->error(), mb::FileError::BadFileFormat);
+}
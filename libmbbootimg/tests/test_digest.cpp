@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/digest.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct DigestImage
+{
+    bool is_bump = false;
+    const char *cmdline = "console=null";
+    std::string kernel = std::string(3000, 'k');
+    std::string ramdisk = std::string(2000, 'r');
+};
+
+static void write_image(const DigestImage &image, std::string &out)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    void *buf = nullptr;
+    size_t buf_size = 0;
+    int ret;
+    size_t n;
+
+    mb::MemoryFile file(&buf, &buf_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(!!biw);
+    if (image.is_bump) {
+        ASSERT_EQ(mb_bi_writer_set_format_bump(biw.get()), MB_BI_OK);
+    } else {
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    }
+    ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+
+    ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, image.cmdline),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+        const std::string *data = nullptr;
+        if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+            data = &image.kernel;
+        } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+            data = &image.ramdisk;
+        }
+
+        if (data) {
+            ASSERT_EQ(mb_bi_writer_write_data(biw.get(), data->data(),
+                                              data->size(), &n), MB_BI_OK);
+            ASSERT_EQ(n, data->size());
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    biw.reset();
+    ASSERT_TRUE(file.close());
+
+    out.assign(static_cast<char *>(buf), buf_size);
+    free(buf);
+}
+
+static void digest_image(const DigestImage &image, unsigned char *digest,
+                         bool parallel = false)
+{
+    std::string data;
+    ASSERT_NO_FATAL_FAILURE(write_image(image, data));
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    mb::MemoryFile file(data.data(), data.size());
+
+    ASSERT_TRUE(!!bir);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    if (parallel) {
+        ASSERT_EQ(mb_bi_image_digest_parallel(bir.get(), digest), MB_BI_OK);
+    } else {
+        ASSERT_EQ(mb_bi_image_digest(bir.get(), digest), MB_BI_OK);
+    }
+}
+
+TEST(ImageDigestTest, IdenticalImagesShouldMatch)
+{
+    unsigned char digest1[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char digest2[MB_BI_IMAGE_DIGEST_SIZE];
+    DigestImage image;
+
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest1));
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest2));
+    ASSERT_EQ(memcmp(digest1, digest2, sizeof(digest1)), 0);
+}
+
+TEST(ImageDigestTest, FormatShouldNotMatter)
+{
+    unsigned char digest1[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char digest2[MB_BI_IMAGE_DIGEST_SIZE];
+    DigestImage image;
+
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest1));
+    image.is_bump = true;
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest2));
+    ASSERT_EQ(memcmp(digest1, digest2, sizeof(digest1)), 0);
+}
+
+TEST(ImageDigestTest, ParallelDigestShouldMatch)
+{
+    unsigned char digest1[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char digest2[MB_BI_IMAGE_DIGEST_SIZE];
+    DigestImage image;
+
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest1));
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest2, true));
+    ASSERT_EQ(memcmp(digest1, digest2, sizeof(digest1)), 0);
+
+    image.is_bump = true;
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest2, true));
+    ASSERT_EQ(memcmp(digest1, digest2, sizeof(digest1)), 0);
+
+    image.ramdisk[1000] = 'x';
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest2, true));
+    ASSERT_NE(memcmp(digest1, digest2, sizeof(digest1)), 0);
+}
+
+TEST(ImageDigestTest, DifferentContentsShouldNotMatch)
+{
+    unsigned char digest1[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char digest2[MB_BI_IMAGE_DIGEST_SIZE];
+    DigestImage image;
+
+    ASSERT_NO_FATAL_FAILURE(digest_image(image, digest1));
+
+    // Different header
+    {
+        DigestImage changed;
+        changed.cmdline = "console=ttyS0";
+        ASSERT_NO_FATAL_FAILURE(digest_image(changed, digest2));
+        ASSERT_NE(memcmp(digest1, digest2, sizeof(digest1)), 0);
+    }
+
+    // Different data
+    {
+        DigestImage changed;
+        changed.ramdisk[1000] = 'x';
+        ASSERT_NO_FATAL_FAILURE(digest_image(changed, digest2));
+        ASSERT_NE(memcmp(digest1, digest2, sizeof(digest1)), 0);
+    }
+
+    // Data moved between entries
+    {
+        DigestImage changed;
+        changed.kernel += 'r';
+        changed.ramdisk.pop_back();
+        ASSERT_NO_FATAL_FAILURE(digest_image(changed, digest2));
+        ASSERT_NE(memcmp(digest1, digest2, sizeof(digest1)), 0);
+    }
+}
+
+#ifndef _WIN32
+TEST(ImageDigestTest, CacheShouldTrackFile)
+{
+    unsigned char digest[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char cached[MB_BI_IMAGE_DIGEST_SIZE];
+    char path[] = "/tmp/mbbootimg-digest-XXXXXX";
+    std::string cache_path;
+
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    cache_path = path;
+    cache_path += ".digest";
+
+    ASSERT_EQ(write(fd, "abc", 3), 3);
+
+    memset(digest, 0x5a, sizeof(digest));
+
+    // No cache yet
+    EXPECT_EQ(mb_bi_image_digest_load_cache(path, cached), MB_BI_WARN);
+
+    EXPECT_EQ(mb_bi_image_digest_save_cache(path, digest), MB_BI_OK);
+    EXPECT_EQ(mb_bi_image_digest_load_cache(path, cached), MB_BI_OK);
+    EXPECT_EQ(memcmp(digest, cached, sizeof(digest)), 0);
+
+    // Changing the file invalidates the cache
+    EXPECT_EQ(write(fd, "d", 1), 1);
+    EXPECT_EQ(mb_bi_image_digest_load_cache(path, cached), MB_BI_WARN);
+
+    // Truncated cache is ignored
+    EXPECT_EQ(mb_bi_image_digest_save_cache(path, digest), MB_BI_OK);
+    EXPECT_EQ(truncate(cache_path.c_str(), 20), 0);
+    EXPECT_EQ(mb_bi_image_digest_load_cache(path, cached), MB_BI_WARN);
+
+    close(fd);
+    unlink(path);
+    unlink(cache_path.c_str());
+}
+#endif
@@ -20,6 +20,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
 
 #include "mbbootimg/defs.h"
 #include "mbbootimg/header.h"
@@ -44,8 +45,8 @@ TEST(BootImgHeaderTest, CheckDefaultValues)
     ASSERT_EQ(header->field.rpm_addr, 0u);
     ASSERT_EQ(header->field.appsbl_addr, 0u);
     ASSERT_EQ(header->field.page_size, 0u);
-    ASSERT_EQ(header->field.board_name, nullptr);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_EQ(header->field.board_name.get(), nullptr);
+    ASSERT_EQ(header->field.cmdline.get(), nullptr);
     ASSERT_EQ(header->field.hdr_kernel_size, 0u);
     ASSERT_EQ(header->field.hdr_ramdisk_size, 0u);
     ASSERT_EQ(header->field.hdr_second_size, 0u);
@@ -93,24 +94,24 @@ TEST(BootImgHeaderTest, CheckGettersSetters)
 
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), "test"), MB_BI_OK);
     ASSERT_TRUE(header->fields_set & MB_BI_HEADER_FIELD_BOARD_NAME);
-    ASSERT_STREQ(header->field.board_name, "test");
+    ASSERT_STREQ(header->field.board_name.get(), "test");
     ASSERT_STREQ(mb_bi_header_board_name(header.get()), "test");
 
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), nullptr), MB_BI_OK);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_BOARD_NAME);
-    ASSERT_EQ(header->field.board_name, nullptr);
+    ASSERT_EQ(header->field.board_name.get(), nullptr);
     ASSERT_EQ(mb_bi_header_board_name(header.get()), nullptr);
 
     // Kernel cmdline field
 
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"), MB_BI_OK);
     ASSERT_TRUE(header->fields_set & MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    ASSERT_STREQ(header->field.cmdline, "test");
+    ASSERT_STREQ(header->field.cmdline.get(), "test");
     ASSERT_STREQ(mb_bi_header_kernel_cmdline(header.get()), "test");
 
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), nullptr), MB_BI_OK);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_EQ(header->field.cmdline.get(), nullptr);
     ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
 
     // Page size field
@@ -255,7 +256,7 @@ TEST(BootImgHeaderTest, CheckSettingUnsupported)
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), "test"),
               MB_BI_UNSUPPORTED);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_BOARD_NAME);
-    ASSERT_EQ(header->field.board_name, nullptr);
+    ASSERT_EQ(header->field.board_name.get(), nullptr);
     ASSERT_EQ(mb_bi_header_board_name(header.get()), nullptr);
     ASSERT_EQ(mb_bi_header_set_board_name(header.get(), nullptr),
               MB_BI_UNSUPPORTED);
@@ -267,7 +268,7 @@ TEST(BootImgHeaderTest, CheckSettingUnsupported)
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"),
               MB_BI_UNSUPPORTED);
     ASSERT_FALSE(header->fields_set & MB_BI_HEADER_FIELD_KERNEL_CMDLINE);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_EQ(header->field.cmdline.get(), nullptr);
     ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), nullptr);
     ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), nullptr),
               MB_BI_UNSUPPORTED);
@@ -404,10 +405,8 @@ TEST(BootImgHeaderTest, CheckClone)
     header->field.rpm_addr = 0x6000;
     header->field.appsbl_addr = 0x7000;
     header->field.page_size = 2048;
-    header->field.board_name = strdup("test");
-    ASSERT_NE(header->field.board_name, nullptr);
-    header->field.cmdline = strdup("test2");
-    ASSERT_NE(header->field.cmdline, nullptr);
+    ASSERT_TRUE(header->field.board_name.assign("test"));
+    ASSERT_TRUE(header->field.cmdline.assign("test2"));
     header->field.hdr_kernel_size = 1024;
     header->field.hdr_ramdisk_size = 2048;
     header->field.hdr_second_size = 4096;
@@ -437,10 +436,10 @@ TEST(BootImgHeaderTest, CheckClone)
     ASSERT_EQ(header->field.rpm_addr, dup->field.rpm_addr);
     ASSERT_EQ(header->field.appsbl_addr, dup->field.appsbl_addr);
     ASSERT_EQ(header->field.page_size, dup->field.page_size);
-    ASSERT_NE(header->field.board_name, dup->field.board_name);
-    ASSERT_STREQ(header->field.board_name, dup->field.board_name);
-    ASSERT_NE(header->field.cmdline, dup->field.cmdline);
-    ASSERT_STREQ(header->field.cmdline, dup->field.cmdline);
+    ASSERT_NE(header->field.board_name.get(), dup->field.board_name.get());
+    ASSERT_STREQ(header->field.board_name.get(), dup->field.board_name.get());
+    ASSERT_NE(header->field.cmdline.get(), dup->field.cmdline.get());
+    ASSERT_STREQ(header->field.cmdline.get(), dup->field.cmdline.get());
     ASSERT_EQ(header->field.hdr_kernel_size, dup->field.hdr_kernel_size);
     ASSERT_EQ(header->field.hdr_ramdisk_size, dup->field.hdr_ramdisk_size);
     ASSERT_EQ(header->field.hdr_second_size, dup->field.hdr_second_size);
@@ -455,6 +454,7 @@ TEST(BootImgHeaderTest, CheckClone)
     ASSERT_EQ(header->field.hdr_id[6], dup->field.hdr_id[6]);
     ASSERT_EQ(header->field.hdr_id[7], dup->field.hdr_id[7]);
     ASSERT_EQ(header->field.hdr_entrypoint, dup->field.hdr_entrypoint);
+    ASSERT_TRUE(mb_bi_header_equals(header.get(), dup.get()));
 }
 
 TEST(BootImgHeaderTest, CheckClear)
@@ -472,10 +472,8 @@ TEST(BootImgHeaderTest, CheckClear)
     header->field.rpm_addr = 0x6000;
     header->field.appsbl_addr = 0x7000;
     header->field.page_size = 2048;
-    header->field.board_name = strdup("test");
-    ASSERT_NE(header->field.board_name, nullptr);
-    header->field.cmdline = strdup("test2");
-    ASSERT_NE(header->field.cmdline, nullptr);
+    ASSERT_TRUE(header->field.board_name.assign("test"));
+    ASSERT_TRUE(header->field.cmdline.assign("test2"));
     header->field.hdr_kernel_size = 1024;
     header->field.hdr_ramdisk_size = 2048;
     header->field.hdr_second_size = 4096;
@@ -504,8 +502,8 @@ TEST(BootImgHeaderTest, CheckClear)
     ASSERT_EQ(header->field.rpm_addr, 0u);
     ASSERT_EQ(header->field.appsbl_addr, 0u);
     ASSERT_EQ(header->field.page_size, 0u);
-    ASSERT_EQ(header->field.board_name, nullptr);
-    ASSERT_EQ(header->field.cmdline, nullptr);
+    ASSERT_EQ(header->field.board_name.get(), nullptr);
+    ASSERT_EQ(header->field.cmdline.get(), nullptr);
     ASSERT_EQ(header->field.hdr_kernel_size, 0u);
     ASSERT_EQ(header->field.hdr_ramdisk_size, 0u);
     ASSERT_EQ(header->field.hdr_second_size, 0u);
@@ -521,3 +519,56 @@ TEST(BootImgHeaderTest, CheckClear)
     ASSERT_EQ(header->field.hdr_id[7], 0u);
     ASSERT_EQ(header->field.hdr_entrypoint, 0u);
 }
+
+TEST(BootImgHeaderTest, CheckLongStrings)
+{
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+
+    // Values that don't fit inline are stored on the heap
+    std::string cmdline(ANDROID_BOOT_ARGS_SIZE * 2, 'a');
+
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), cmdline.c_str()),
+              MB_BI_OK);
+    ASSERT_NE(header->field.cmdline.heap, nullptr);
+    ASSERT_EQ(header->field.cmdline.size, cmdline.size());
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), cmdline);
+
+    ScopedHeader dup(mb_bi_header_clone(header.get()), mb_bi_header_free);
+    ASSERT_TRUE(!!dup);
+    ASSERT_NE(dup->field.cmdline.heap, header->field.cmdline.heap);
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(dup.get()), cmdline);
+
+    // Short values go back to the inline buffer
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"), MB_BI_OK);
+    ASSERT_EQ(header->field.cmdline.heap, nullptr);
+    ASSERT_STREQ(mb_bi_header_kernel_cmdline(header.get()), "test");
+}
+
+TEST(BootImgHeaderTest, CheckEquals)
+{
+    ScopedHeader a(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!a);
+    ScopedHeader b(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!b);
+
+    ASSERT_TRUE(mb_bi_header_equals(a.get(), b.get()));
+
+    ASSERT_EQ(mb_bi_header_set_board_name(a.get(), "test"), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equals(a.get(), b.get()));
+    ASSERT_EQ(mb_bi_header_set_board_name(b.get(), "test2"), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equals(a.get(), b.get()));
+    ASSERT_EQ(mb_bi_header_set_board_name(b.get(), "test"), MB_BI_OK);
+    ASSERT_TRUE(mb_bi_header_equals(a.get(), b.get()));
+
+    // Empty and unset strings differ
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(a.get(), ""), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equals(a.get(), b.get()));
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(a.get(), nullptr), MB_BI_OK);
+    ASSERT_TRUE(mb_bi_header_equals(a.get(), b.get()));
+
+    ASSERT_EQ(mb_bi_header_set_page_size(a.get(), 2048), MB_BI_OK);
+    ASSERT_FALSE(mb_bi_header_equals(a.get(), b.get()));
+    ASSERT_EQ(mb_bi_header_set_page_size(b.get(), 2048), MB_BI_OK);
+    ASSERT_TRUE(mb_bi_header_equals(a.get(), b.get()));
+}
@@ -20,11 +20,136 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
+#include <thread>
 
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/file/callbacks.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
+#include "mbbootimg/reader_formats.h"
 #include "mbbootimg/reader_p.h"
+#include "mbbootimg/writer.h"
 
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<MbBiEntryReader, decltype(mb_bi_entry_reader_free) *>
+        ScopedEntryReader;
+
+struct ReaderSourceFile
+{
+    std::string data;
+    size_t pos = 0;
+    bool seekable = true;
+    size_t read_calls = 0;
+    size_t seek_calls = 0;
+    size_t bytes_read = 0;
+};
+
+static bool _source_read_cb(mb::File &file, void *userdata,
+                            void *buf, size_t size, size_t &bytes_read)
+{
+    (void) file;
+    auto *source = static_cast<ReaderSourceFile *>(userdata);
+    size_t n = std::min(size, source->data.size() - source->pos);
+
+    memcpy(buf, source->data.data() + source->pos, n);
+    source->pos += n;
+    ++source->read_calls;
+    source->bytes_read += n;
+    bytes_read = n;
+
+    return true;
+}
+
+static bool _source_seek_cb(mb::File &file, void *userdata,
+                            int64_t offset, int whence, uint64_t &new_offset)
+{
+    auto *source = static_cast<ReaderSourceFile *>(userdata);
+
+    if (!source->seekable) {
+        file.set_error(make_error_code(mb::FileError::UnsupportedSeek),
+                       "Not seekable");
+        return false;
+    }
+
+    int64_t base = whence == SEEK_SET ? 0
+            : whence == SEEK_CUR ? static_cast<int64_t>(source->pos)
+            : static_cast<int64_t>(source->data.size());
+
+    source->pos = static_cast<size_t>(base + offset);
+    ++source->seek_calls;
+    new_offset = source->pos;
+
+    return true;
+}
+
+// Build an Android boot image whose entries are each filled with a letter
+// derived from the entry type
+static std::string make_android_image(size_t entry_size)
+{
+    void *buf = nullptr;
+    size_t size = 0;
+
+    {
+        mb::MemoryFile file(&buf, &size);
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        size_t n;
+
+        EXPECT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        EXPECT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        mb_bi_header_set_page_size(header, 2048);
+        EXPECT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while (mb_bi_writer_get_entry(biw.get(), &entry) == MB_BI_OK) {
+            EXPECT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+            std::string data(entry_size, 'a' + mb_bi_entry_type(entry) % 26);
+            EXPECT_EQ(mb_bi_writer_write_data(biw.get(), data.data(),
+                                              data.size(), &n), MB_BI_OK);
+        }
+
+        EXPECT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    std::string result(static_cast<char *>(buf), size);
+    free(buf);
+    return result;
+}
+
+static void check_android_entries(MbBiReader *bir, size_t entry_size)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ASSERT_EQ(mb_bi_reader_read_header(bir, &header), MB_BI_OK);
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        std::string data;
+        char buf[10240];
+        size_t n;
+
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+                == MB_BI_OK) {
+            data.append(buf, n);
+        }
+        ASSERT_EQ(ret, MB_BI_EOF) << mb_bi_reader_error_string(bir);
+
+        if (!data.empty()) {
+            ASSERT_EQ(data, std::string(entry_size,
+                    'a' + mb_bi_entry_type(entry) % 26));
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+}
 
 
 TEST(BootImgReaderTest, CheckInitialValues)
@@ -51,3 +176,380 @@ TEST(BootImgReaderTest, CheckInitialValues)
     ASSERT_NE(bir->header, nullptr);
     ASSERT_NE(bir->entry, nullptr);
 }
+
+// Bidding must be served from the probe window instead of having every bidder
+// seek and read the file head again
+TEST(BootImgReaderTest, BidReadsFileOnce)
+{
+    const size_t entry_size = 200 * 1024;
+
+    ReaderSourceFile source;
+    source.data = make_android_image(entry_size);
+    ASSERT_GT(source.data.size(), PROBE_HEAD_SIZE + PROBE_TAIL_SIZE);
+
+    mb::CallbackFile file(nullptr, nullptr, &_source_read_cb, nullptr,
+                          &_source_seek_cb, nullptr, &source);
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+
+    // Head and tail are each read once
+    ASSERT_EQ(source.bytes_read,
+              static_cast<size_t>(PROBE_HEAD_SIZE + PROBE_TAIL_SIZE));
+    ASSERT_LE(source.seek_calls, 3u);
+
+    check_android_entries(bir.get(), entry_size);
+}
+
+TEST(BootImgReaderTest, ReadNonSeekableFile)
+{
+    const size_t entry_size = 100 * 1024;
+
+    ReaderSourceFile source;
+    source.data = make_android_image(entry_size);
+    source.seekable = false;
+
+    mb::CallbackFile file(nullptr, nullptr, &_source_read_cb, nullptr,
+                          &_source_seek_cb, nullptr, &source);
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+
+    check_android_entries(bir.get(), entry_size);
+}
+
+TEST(BootImgReaderTest, ReadDataViewFromMemory)
+{
+    const size_t entry_size = 200 * 1024;
+    std::string image = make_android_image(entry_size);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        std::string data;
+        const void *ptr;
+        size_t size;
+
+        while ((ret = mb_bi_reader_read_data_view(bir.get(), &ptr, &size))
+                == MB_BI_OK) {
+            // Must point into the image
+            ASSERT_GE(static_cast<const char *>(ptr), image.data());
+            ASSERT_LE(static_cast<const char *>(ptr) + size,
+                      image.data() + image.size());
+            data.append(static_cast<const char *>(ptr), size);
+        }
+        ASSERT_EQ(ret, MB_BI_EOF) << mb_bi_reader_error_string(bir.get());
+
+        if (!data.empty()) {
+            ASSERT_EQ(data, std::string(entry_size,
+                    'a' + mb_bi_entry_type(entry) % 26));
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+}
+
+TEST(BootImgReaderTest, EntryRangeMatchesData)
+{
+    const size_t entry_size = 5000;
+    std::string image = make_android_image(entry_size);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        uint64_t offset;
+        uint64_t size;
+
+        ASSERT_EQ(mb_bi_reader_entry_range(bir.get(), &offset, &size),
+                  MB_BI_OK) << mb_bi_reader_error_string(bir.get());
+        ASSERT_EQ(size, mb_bi_entry_size(entry));
+        ASSERT_LE(offset + size, image.size());
+
+        if (size > 0) {
+            ASSERT_EQ(image.substr(offset, size), std::string(entry_size,
+                    'a' + mb_bi_entry_type(entry) % 26));
+        }
+
+        // The range covers only the data that has not been read yet
+        char buf[1000];
+        size_t n;
+        uint64_t new_offset;
+        uint64_t new_size;
+
+        if (size > 0) {
+            ASSERT_EQ(mb_bi_reader_read_data(bir.get(), buf, sizeof(buf), &n),
+                      MB_BI_OK);
+            ASSERT_EQ(mb_bi_reader_entry_range(bir.get(), &new_offset,
+                                               &new_size), MB_BI_OK);
+            ASSERT_EQ(new_offset, offset + n);
+            ASSERT_EQ(new_size, size - n);
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+}
+
+TEST(BootImgReaderTest, ReadEntriesConcurrently)
+{
+    const size_t entry_size = 300 * 1024;
+    std::string image = make_android_image(entry_size);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    const int types[] = { MB_BI_ENTRY_KERNEL, MB_BI_ENTRY_RAMDISK };
+    std::unique_ptr<ScopedEntryReader> handles[2];
+
+    for (size_t i = 0; i < 2; ++i) {
+        MbBiEntryReader *handle;
+        ASSERT_EQ(mb_bi_reader_open_entry(bir.get(), types[i], &handle),
+                  MB_BI_OK) << mb_bi_reader_error_string(bir.get());
+        handles[i].reset(new ScopedEntryReader(handle,
+                                               mb_bi_entry_reader_free));
+        ASSERT_EQ(mb_bi_entry_reader_size(handle), entry_size);
+    }
+
+    std::string data[2];
+    int results[2];
+    std::thread threads[2];
+
+    for (size_t i = 0; i < 2; ++i) {
+        threads[i] = std::thread([&, i]{
+            char buf[4096];
+            size_t n;
+
+            while ((results[i] = mb_bi_entry_reader_read(
+                    handles[i]->get(), buf, sizeof(buf), &n)) == MB_BI_OK) {
+                data[i].append(buf, n);
+            }
+        });
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        ASSERT_EQ(results[i], MB_BI_EOF)
+                << mb_bi_entry_reader_error_string(handles[i]->get());
+        ASSERT_EQ(data[i], std::string(entry_size, 'a' + types[i] % 26));
+    }
+
+    // Handles do not affect the reader's position
+    MbBiEntry *entry;
+    ASSERT_EQ(mb_bi_reader_read_entry(bir.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_KERNEL);
+
+    // Missing entries
+    MbBiEntryReader *handle;
+    ASSERT_EQ(mb_bi_reader_open_entry(bir.get(), MB_BI_ENTRY_SONY_IPL,
+                                      &handle), MB_BI_EOF);
+}
+
+TEST(BootImgReaderTest, ReadDataViewFallsBackToCopy)
+{
+    const size_t entry_size = 200 * 1024;
+
+    ReaderSourceFile source;
+    source.data = make_android_image(entry_size);
+
+    mb::CallbackFile file(nullptr, nullptr, &_source_read_cb, nullptr,
+                          &_source_seek_cb, nullptr, &source);
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_entry(bir.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_KERNEL);
+
+    std::string data;
+    const void *ptr;
+    size_t size;
+    char buf[10240];
+    int ret;
+
+    // The part of the kernel within the probe window is lent out
+    while ((ret = mb_bi_reader_read_data_view(bir.get(), &ptr, &size))
+            == MB_BI_OK) {
+        data.append(static_cast<const char *>(ptr), size);
+    }
+    ASSERT_EQ(ret, MB_BI_UNSUPPORTED);
+    ASSERT_FALSE(data.empty());
+
+    // The rest must be copied
+    while ((ret = mb_bi_reader_read_data(bir.get(), buf, sizeof(buf), &size))
+            == MB_BI_OK) {
+        data.append(buf, size);
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+    ASSERT_EQ(data, std::string(entry_size,
+            'a' + MB_BI_ENTRY_KERNEL % 26));
+}
+
+TEST(BootImgReaderTest, GoToEntryInAnyOrder)
+{
+    const size_t entry_size = 3000;
+    std::string image = make_android_image(entry_size);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    char buf[10];
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+
+    for (int type : { MB_BI_ENTRY_RAMDISK, MB_BI_ENTRY_KERNEL,
+                      MB_BI_ENTRY_RAMDISK }) {
+        ASSERT_EQ(mb_bi_reader_go_to_entry(bir.get(), &entry, type), MB_BI_OK);
+        ASSERT_EQ(mb_bi_entry_type(entry), type);
+        ASSERT_EQ(mb_bi_reader_read_data(bir.get(), buf, sizeof(buf), &n),
+                  MB_BI_OK);
+        ASSERT_EQ(std::string(buf, n), std::string(n, 'a' + type % 26));
+    }
+
+    // Missing entry types and combined type flags
+    ASSERT_EQ(mb_bi_reader_go_to_entry(bir.get(), &entry, MB_BI_ENTRY_SONY_IPL),
+              MB_BI_EOF);
+    ASSERT_EQ(mb_bi_reader_go_to_entry(bir.get(), &entry, MB_BI_ENTRY_KERNEL
+                                       | MB_BI_ENTRY_RAMDISK), MB_BI_EOF);
+}
+
+TEST(BootImgReaderTest, EnableFormatsAtCompileTime)
+{
+    const size_t entry_size = 3000;
+    std::string image = make_android_image(entry_size);
+
+    mb::MemoryFile file(image.data(), image.size());
+    ASSERT_TRUE(file.is_open());
+
+    typedef MbBiReaderFormats<mb_bi_reader_enable_format_android,
+                              mb_bi_reader_enable_format_mtk> Formats;
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(Formats::enable(bir.get()), MB_BI_OK);
+    ASSERT_EQ(bir->formats_len, 2u);
+
+    // Enabling again only warns for each format
+    ASSERT_EQ(Formats::enable(bir.get()), MB_BI_OK);
+    ASSERT_EQ(bir->formats_len, 2u);
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+    ASSERT_NO_FATAL_FAILURE(check_android_entries(bir.get(), entry_size));
+
+    // Same formats as the runtime table
+    ScopedReader bir2(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir2);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir2.get()), MB_BI_OK);
+    ASSERT_EQ(bir2->formats_len, 5u);
+}
+
+TEST(BootImgReaderTest, ResetKeepsFormats)
+{
+    const size_t entry_size = 3000;
+    std::string image1 = make_android_image(entry_size);
+    std::string image2 = make_android_image(entry_size * 2);
+
+    mb::MemoryFile file1(image1.data(), image1.size());
+    mb::MemoryFile file2(image2.data(), image2.size());
+    ASSERT_TRUE(file1.is_open());
+    ASSERT_TRUE(file2.is_open());
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+    size_t formats_len = bir->formats_len;
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file1, false), MB_BI_OK);
+    ASSERT_NO_FATAL_FAILURE(check_android_entries(bir.get(), entry_size));
+    ASSERT_NE(bir->format, nullptr);
+
+    // Reset closes the file, but keeps the enabled formats
+    ASSERT_EQ(mb_bi_reader_reset(bir.get()), MB_BI_OK);
+    ASSERT_EQ(bir->state, ReaderState::NEW);
+    ASSERT_EQ(bir->file, nullptr);
+    ASSERT_EQ(bir->formats_len, formats_len);
+
+    // Format chosen by bidding is forgotten
+    ASSERT_EQ(bir->format, nullptr);
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file2, false), MB_BI_OK);
+    ASSERT_NO_FATAL_FAILURE(check_android_entries(bir.get(), entry_size * 2));
+}
+
+TEST(BootImgReaderTest, ResetKeepsForcedFormat)
+{
+    const size_t entry_size = 3000;
+    std::string image = make_android_image(entry_size);
+
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_set_format_by_code(bir.get(),
+                                              MB_BI_FORMAT_ANDROID), MB_BI_OK);
+    FormatReader *format = bir->format;
+    ASSERT_NE(format, nullptr);
+
+    for (int i = 0; i < 2; ++i) {
+        mb::MemoryFile file(image.data(), image.size());
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+        ASSERT_NO_FATAL_FAILURE(check_android_entries(bir.get(), entry_size));
+        ASSERT_EQ(mb_bi_reader_reset(bir.get()), MB_BI_OK);
+        ASSERT_EQ(bir->format, format);
+    }
+}
@@ -18,3 +18,68 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+
+#include <cstdlib>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+#include "mbbootimg/writer_p.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+static void write_image(MbBiWriter *biw, const std::string &data,
+                        std::string &out)
+{
+    void *buf = nullptr;
+    size_t buf_size = 0;
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    size_t n;
+
+    mb::MemoryFile file(&buf, &buf_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_writer_open(biw, &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_get_header(biw, &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw, header), MB_BI_OK);
+
+    while ((ret = mb_bi_writer_get_entry(biw, &entry)) == MB_BI_OK) {
+        ASSERT_EQ(mb_bi_writer_write_entry(biw, entry), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_data(biw, data.data(), data.size(), &n),
+                  MB_BI_OK);
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+    ASSERT_EQ(mb_bi_writer_close(biw), MB_BI_OK);
+
+    out.assign(static_cast<char *>(buf), buf_size);
+    free(buf);
+}
+
+TEST(BootImgWriterTest, ResetProducesSameOutput)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    std::string data(3000, 'x');
+    std::string expected;
+    std::string actual;
+
+    ASSERT_TRUE(!!biw);
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_NO_FATAL_FAILURE(write_image(biw.get(), data, expected));
+
+    // Writing again requires a reset
+    ASSERT_EQ(mb_bi_writer_reset(biw.get()), MB_BI_OK);
+    ASSERT_EQ(biw->state, WriterState::NEW);
+    ASSERT_TRUE(biw->format_set);
+    ASSERT_NO_FATAL_FAILURE(write_image(biw.get(), data, actual));
+
+    // The checksum state must not carry over from the previous image
+    ASSERT_EQ(actual, expected);
+}
@@ -0,0 +1,524 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Lightweight benchmark harness for the libmbcommon file primitives.
+//
+// Usage: mbcommon_benchmarks [--size <MiB>] [--iterations <n>]
+//                            [--filter <substring>] [--json <path>]
+//
+// Results are written as JSON to stdout (or to the --json path) and a
+// human-readable summary is printed to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/callbacks.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file/posix.h"
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
+
+enum class Backend
+{
+    Fd,
+    Posix,
+    Standard,
+    Memory,
+    Callback,
+};
+
+static const Backend backends[] = {
+    Backend::Fd,
+    Backend::Posix,
+    Backend::Standard,
+    Backend::Memory,
+    Backend::Callback,
+};
+
+static const size_t buffer_sizes[] = {
+    4 * 1024,
+    64 * 1024,
+    1024 * 1024,
+};
+
+static const size_t pattern_sizes[] = {
+    1,
+    4,
+    16,
+    64,
+};
+
+struct Options
+{
+    uint64_t size = 16 * 1024 * 1024;
+    unsigned int iterations = 5;
+    std::string filter;
+    std::string json_path;
+};
+
+struct Result
+{
+    std::string name;
+    std::string backend;
+    std::string op;
+    size_t buffer_size;
+    size_t pattern_size;
+    uint64_t bytes;
+    unsigned int iterations;
+    uint64_t min_ns;
+    uint64_t mean_ns;
+};
+
+// Backing storage shared by all backends. File-based backends use a temporary
+// file and MemoryFile uses an in-memory copy of the same data.
+struct Fixture
+{
+    std::string path;
+    std::vector<unsigned char> data;
+    void *mem_buf = nullptr;
+    size_t mem_size = 0;
+};
+
+static const char * backend_name(Backend backend)
+{
+    switch (backend) {
+    case Backend::Fd:
+        return "FdFile";
+    case Backend::Posix:
+        return "PosixFile";
+    case Backend::Standard:
+        return "StandardFile";
+    case Backend::Memory:
+        return "MemoryFile";
+    case Backend::Callback:
+        return "CallbackFile";
+    }
+    return "unknown";
+}
+
+// CallbackFile forwards every operation to an FdFile to measure the overhead
+// of the callback indirection
+static bool cb_read(mb::File &file, void *userdata,
+                    void *buf, size_t size, size_t &bytes_read)
+{
+    (void) file;
+    return static_cast<mb::File *>(userdata)->read(buf, size, bytes_read);
+}
+
+static bool cb_write(mb::File &file, void *userdata,
+                     const void *buf, size_t size, size_t &bytes_written)
+{
+    (void) file;
+    return static_cast<mb::File *>(userdata)->write(buf, size, bytes_written);
+}
+
+static bool cb_seek(mb::File &file, void *userdata,
+                    int64_t offset, int whence, uint64_t &new_offset)
+{
+    (void) file;
+    return static_cast<mb::File *>(userdata)->seek(offset, whence,
+                                                   &new_offset);
+}
+
+static bool cb_truncate(mb::File &file, void *userdata, uint64_t size)
+{
+    (void) file;
+    return static_cast<mb::File *>(userdata)->truncate(size);
+}
+
+struct OpenedFile
+{
+    std::unique_ptr<mb::File> inner;
+    std::unique_ptr<mb::File> file;
+};
+
+static bool open_backend(Backend backend, Fixture &fixture,
+                         mb::FileOpenMode mode, OpenedFile &out)
+{
+    switch (backend) {
+    case Backend::Fd:
+        out.file.reset(new mb::FdFile(fixture.path, mode));
+        break;
+    case Backend::Posix:
+        out.file.reset(new mb::PosixFile(fixture.path, mode));
+        break;
+    case Backend::Standard:
+        out.file.reset(new mb::StandardFile(fixture.path, mode));
+        break;
+    case Backend::Memory:
+        if (mode == mb::FileOpenMode::READ_WRITE_TRUNC) {
+            free(fixture.mem_buf);
+            fixture.mem_buf = nullptr;
+            fixture.mem_size = 0;
+        } else if (!fixture.mem_buf) {
+            fixture.mem_buf = malloc(fixture.data.size());
+            if (!fixture.mem_buf) {
+                return false;
+            }
+            memcpy(fixture.mem_buf, fixture.data.data(), fixture.data.size());
+            fixture.mem_size = fixture.data.size();
+        }
+        out.file.reset(new mb::MemoryFile(&fixture.mem_buf,
+                                          &fixture.mem_size));
+        break;
+    case Backend::Callback:
+        out.inner.reset(new mb::FdFile(fixture.path, mode));
+        if (!out.inner->is_open()) {
+            fprintf(stderr, "%s: Failed to open: %s\n", fixture.path.c_str(),
+                    out.inner->error_string().c_str());
+            return false;
+        }
+        out.file.reset(new mb::CallbackFile(nullptr, nullptr, &cb_read,
+                                            &cb_write, &cb_seek,
+                                            &cb_truncate, out.inner.get()));
+        break;
+    }
+
+    if (!out.file->is_open()) {
+        fprintf(stderr, "%s: Failed to open %s: %s\n", fixture.path.c_str(),
+                backend_name(backend), out.file->error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Restore the fixture contents after a benchmark modified them
+static bool reset_fixture(Fixture &fixture)
+{
+    mb::FdFile file(fixture.path, mb::FileOpenMode::WRITE_ONLY);
+    size_t n;
+
+    if (!file.is_open() || !mb::file_write_fully(
+            file, fixture.data.data(), fixture.data.size(), n)
+            || n != fixture.data.size() || !file.close()) {
+        fprintf(stderr, "%s: Failed to write fixture\n", fixture.path.c_str());
+        return false;
+    }
+
+    free(fixture.mem_buf);
+    fixture.mem_buf = nullptr;
+    fixture.mem_size = 0;
+
+    return true;
+}
+
+static mb::FileSearchAction search_result_cb(mb::File &file, void *userdata,
+                                             uint64_t offset)
+{
+    (void) file;
+    (void) offset;
+
+    ++*static_cast<uint64_t *>(userdata);
+    return mb::FileSearchAction::Continue;
+}
+
+typedef std::function<bool(mb::File &file)> BenchmarkFn;
+
+static bool run_benchmark(const Options &options, Fixture &fixture,
+                          Backend backend, const char *op,
+                          mb::FileOpenMode mode, size_t buffer_size,
+                          size_t pattern_size, uint64_t bytes,
+                          const BenchmarkFn &fn, std::vector<Result> &results)
+{
+    Result result;
+    result.backend = backend_name(backend);
+    result.op = op;
+    result.buffer_size = buffer_size;
+    result.pattern_size = pattern_size;
+    result.bytes = bytes;
+    result.iterations = options.iterations;
+    result.name = result.op + "/" + result.backend;
+    if (buffer_size > 0) {
+        result.name += "/bsize:" + std::to_string(buffer_size);
+    }
+    if (pattern_size > 0) {
+        result.name += "/pattern:" + std::to_string(pattern_size);
+    }
+
+    if (!options.filter.empty()
+            && result.name.find(options.filter) == std::string::npos) {
+        return true;
+    }
+
+    uint64_t total_ns = 0;
+    uint64_t min_ns = UINT64_MAX;
+
+    for (unsigned int i = 0; i < options.iterations; ++i) {
+        OpenedFile opened;
+
+        if (!open_backend(backend, fixture, mode, opened)) {
+            return false;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        if (!fn(*opened.file)) {
+            fprintf(stderr, "%s: Benchmark failed: %s\n", result.name.c_str(),
+                    opened.file->error_string().c_str());
+            return false;
+        }
+
+        auto elapsed = static_cast<uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count());
+
+        total_ns += elapsed;
+        min_ns = std::min(min_ns, elapsed);
+    }
+
+    result.min_ns = min_ns;
+    result.mean_ns = options.iterations > 0 ? total_ns / options.iterations : 0;
+
+    fprintf(stderr, "%-50s %10.3f ms %10.1f MiB/s\n", result.name.c_str(),
+            static_cast<double>(result.min_ns) / 1e6,
+            result.min_ns > 0 ? static_cast<double>(bytes) / 1048576.0
+                    / (static_cast<double>(result.min_ns) / 1e9) : 0.0);
+
+    results.push_back(std::move(result));
+    return true;
+}
+
+static bool run_all(const Options &options, Fixture &fixture,
+                    std::vector<Result> &results)
+{
+    const uint64_t size = fixture.data.size();
+
+    for (Backend backend : backends) {
+        for (size_t bsize : buffer_sizes) {
+            std::vector<unsigned char> buf(bsize);
+
+            if (!run_benchmark(options, fixture, backend, "file_read_fully",
+                               mb::FileOpenMode::READ_ONLY, bsize, 0, size,
+                               [&](mb::File &file) {
+                size_t n;
+                do {
+                    if (!mb::file_read_fully(file, buf.data(), buf.size(),
+                                             n)) {
+                        return false;
+                    }
+                } while (n == buf.size());
+                return true;
+            }, results)) {
+                return false;
+            }
+
+            if (!run_benchmark(options, fixture, backend, "file_write_fully",
+                               mb::FileOpenMode::READ_WRITE_TRUNC, bsize, 0,
+                               size, [&](mb::File &file) {
+                size_t n;
+                for (uint64_t total = 0; total < size; total += bsize) {
+                    if (!mb::file_write_fully(file, fixture.data.data() + total,
+                                              std::min<uint64_t>(
+                                                      bsize, size - total),
+                                              n)) {
+                        return false;
+                    }
+                }
+                return true;
+            }, results) || !reset_fixture(fixture)) {
+                return false;
+            }
+        }
+
+        if (!run_benchmark(options, fixture, backend, "file_read_discard",
+                           mb::FileOpenMode::READ_ONLY, 0, 0, size,
+                           [&](mb::File &file) {
+            uint64_t n;
+            return mb::file_read_discard(file, size, n) && n == size;
+        }, results)) {
+            return false;
+        }
+
+        for (size_t pattern_size : pattern_sizes) {
+            // The pattern does not occur in the data, so the whole file is
+            // scanned
+            std::vector<unsigned char> pattern(pattern_size, 0xff);
+
+            if (!run_benchmark(options, fixture, backend, "file_search",
+                               mb::FileOpenMode::READ_ONLY, 0, pattern_size,
+                               size, [&](mb::File &file) {
+                uint64_t matches = 0;
+                return mb::file_search(file, -1, -1, 0, pattern.data(),
+                                       pattern.size(), -1, &search_result_cb,
+                                       &matches);
+            }, results)) {
+                return false;
+            }
+        }
+
+        if (!run_benchmark(options, fixture, backend, "file_move",
+                           mb::FileOpenMode::READ_WRITE, 0, 0, size / 2,
+                           [&](mb::File &file) {
+            uint64_t n;
+            return mb::file_move(file, size / 2, 0, size / 2, n)
+                    && n == size / 2;
+        }, results) || !reset_fixture(fixture)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void write_json(FILE *fp, const Options &options,
+                       const std::vector<Result> &results)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"context\": {\n");
+    fprintf(fp, "    \"library\": \"mbcommon\",\n");
+    fprintf(fp, "    \"version\": \"%s\",\n", mb::version());
+    fprintf(fp, "    \"file_size\": %" PRIu64 ",\n", options.size);
+    fprintf(fp, "    \"iterations\": %u\n", options.iterations);
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"benchmarks\": [");
+
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto const &r = results[i];
+        double seconds = static_cast<double>(r.min_ns) / 1e9;
+
+        fprintf(fp, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(fp, "      \"name\": \"%s\",\n", r.name.c_str());
+        fprintf(fp, "      \"backend\": \"%s\",\n", r.backend.c_str());
+        fprintf(fp, "      \"op\": \"%s\",\n", r.op.c_str());
+        fprintf(fp, "      \"buffer_size\": %" MB_PRIzu ",\n", r.buffer_size);
+        fprintf(fp, "      \"pattern_size\": %" MB_PRIzu ",\n", r.pattern_size);
+        fprintf(fp, "      \"bytes\": %" PRIu64 ",\n", r.bytes);
+        fprintf(fp, "      \"iterations\": %u,\n", r.iterations);
+        fprintf(fp, "      \"min_ns\": %" PRIu64 ",\n", r.min_ns);
+        fprintf(fp, "      \"mean_ns\": %" PRIu64 ",\n", r.mean_ns);
+        fprintf(fp, "      \"bytes_per_second\": %.0f\n",
+                seconds > 0 ? static_cast<double>(r.bytes) / seconds : 0.0);
+        fprintf(fp, "    }");
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+}
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream,
+            "Usage: %s [--size <MiB>] [--iterations <n>] [--filter <str>]"
+            " [--json <path>]\n", prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+        } else if (i + 1 >= argc) {
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        } else if (arg == "--size") {
+            options.size = strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (arg == "--iterations") {
+            options.iterations = static_cast<unsigned int>(
+                    strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--filter") {
+            options.filter = argv[++i];
+        } else if (arg == "--json") {
+            options.json_path = argv[++i];
+        } else {
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.size == 0 || options.iterations == 0) {
+        fprintf(stderr, "Size and iterations must be non-zero\n");
+        return EXIT_FAILURE;
+    }
+
+    Fixture fixture;
+
+    // Deterministic, incompressible-looking data without 0xff bytes so that
+    // search patterns never match
+    fixture.data.resize(options.size);
+    uint32_t state = 0x12345678;
+    for (auto &c : fixture.data) {
+        state = state * 1103515245 + 12345;
+        c = static_cast<unsigned char>((state >> 16) % 255);
+    }
+
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path_template = std::string(tmpdir ? tmpdir : "/tmp")
+            + "/mbcommon_benchmark_XXXXXX";
+    std::vector<char> path(path_template.begin(), path_template.end());
+    path.push_back('\0');
+
+    int fd = mkstemp(path.data());
+    if (fd < 0) {
+        fprintf(stderr, "%s: Failed to create temporary file: %s\n",
+                path.data(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    fixture.path = path.data();
+
+    std::vector<Result> results;
+    bool ret = reset_fixture(fixture) && run_all(options, fixture, results);
+
+    unlink(fixture.path.c_str());
+    free(fixture.mem_buf);
+
+    if (!ret) {
+        return EXIT_FAILURE;
+    }
+
+    if (options.json_path.empty()) {
+        write_json(stdout, options, results);
+    } else {
+        FILE *fp = fopen(options.json_path.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                    options.json_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+        write_json(fp, options, results);
+        if (fclose(fp) != 0) {
+            fprintf(stderr, "%s: Failed to close file: %s\n",
+                    options.json_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
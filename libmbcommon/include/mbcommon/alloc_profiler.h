@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+
+// Maximum number of distinct tags. Allocations under any further tags are
+// counted under ALLOC_PROFILER_OVERFLOW_TAG.
+constexpr size_t ALLOC_PROFILER_MAX_TAGS = 64;
+
+// Tag for allocations made outside of any AllocScope
+constexpr const char *ALLOC_PROFILER_UNTAGGED = "untagged";
+// Tag for allocations made under a tag that did not fit in the table
+constexpr const char *ALLOC_PROFILER_OVERFLOW_TAG = "overflow";
+
+/*!
+ * \brief Allocation counts and sizes attributed to one tag
+ */
+struct MB_EXPORT AllocTagStats
+{
+    const char *tag;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t frees;
+    uint64_t free_bytes;
+};
+
+/*!
+ * \brief Attribute allocations on the calling thread to a tag
+ *
+ * Allocations and frees that happen on the current thread while the object is
+ * alive are attributed to \p tag. Scopes nest, with the innermost scope taking
+ * precedence. Since there is no per-allocation header, frees are attributed to
+ * the scope that is active when the memory is freed, not the one in which it
+ * was allocated.
+ *
+ * Use MB_ALLOC_SCOPE() instead of constructing this directly, so the marker
+ * compiles to nothing unless allocation profiling is enabled.
+ *
+ * \note \p tag must be a string literal or otherwise outlive the process.
+ */
+class MB_EXPORT AllocScope
+{
+public:
+    explicit AllocScope(const char *tag);
+    ~AllocScope();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AllocScope)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(AllocScope)
+
+private:
+    void *_prev;
+};
+
+// Called by the allocator hooks. These never allocate.
+MB_EXPORT void alloc_profiler_record_alloc(size_t size);
+MB_EXPORT void alloc_profiler_record_free(size_t size);
+
+MB_EXPORT std::vector<AllocTagStats> alloc_profiler_snapshot();
+MB_EXPORT void alloc_profiler_reset();
+
+}
+
+#define MB_ALLOC_SCOPE_CONCAT_INNER(a, b) a ## b
+#define MB_ALLOC_SCOPE_CONCAT(a, b) MB_ALLOC_SCOPE_CONCAT_INNER(a, b)
+
+#ifdef MB_ALLOC_PROFILING
+#  define MB_ALLOC_SCOPE(tag) \
+    ::mb::AllocScope MB_ALLOC_SCOPE_CONCAT(mb_alloc_scope_, __LINE__)(tag)
+#else
+#  define MB_ALLOC_SCOPE(tag) static_cast<void>(0)
+#endif
@@ -80,7 +80,7 @@ static inline T * mb_get_ptr_helper(T *ptr)
 }
 
 template <typename T>
-static inline typename T::pointer mb_get_ptr_helper(const T &p)
+static inline auto mb_get_ptr_helper(const T &p) -> decltype(p.get())
 {
     return p.get();
 }
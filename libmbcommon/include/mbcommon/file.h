@@ -33,6 +33,38 @@
 namespace mb
 {
 
+struct FileIovec
+{
+    void *base;
+    size_t size;
+};
+
+constexpr size_t FILE_STATS_HISTOGRAM_BUCKETS = 10;
+
+struct FileStats
+{
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t seek_calls;
+
+    // Bucket i counts calls with a requested size of less than 16 * 4^i bytes.
+    // The last bucket counts all remaining calls.
+    uint64_t read_size_histogram[FILE_STATS_HISTOGRAM_BUCKETS];
+    uint64_t write_size_histogram[FILE_STATS_HISTOGRAM_BUCKETS];
+
+    uint64_t read_time_ns;
+    uint64_t write_time_ns;
+    uint64_t seek_time_ns;
+};
+
+class File;
+
+typedef void (*FileStatsCallback)(File &file, const FileStats &stats,
+                                  void *userdata);
+
 class FilePrivate;
 class MB_EXPORT File
 {
@@ -56,11 +88,32 @@ public:
     bool seek(int64_t offset, int whence, uint64_t *new_offset);
     bool truncate(uint64_t size);
 
+    // Positional file operations
+    bool read_at(uint64_t offset, void *buf, size_t size, size_t &bytes_read);
+    bool write_at(uint64_t offset, const void *buf, size_t size,
+                  size_t &bytes_written);
+
+    // Vectored file operations
+    bool readv(const FileIovec *iov, size_t iov_count, size_t &bytes_read);
+    bool writev(const FileIovec *iov, size_t iov_count,
+                size_t &bytes_written);
+
+    // Zero-copy read operations
+    bool peek(const void *&buf, size_t &size);
+    bool consume(size_t size);
+
     // File state
     bool is_open();
     bool is_fatal();
     bool set_fatal(bool fatal);
 
+    // I/O statistics
+    bool set_stats_enabled(bool enabled);
+    bool stats_enabled();
+    FileStats stats();
+    bool reset_stats();
+    bool set_stats_callback(FileStatsCallback cb, void *userdata);
+
     // Error handling functions
     std::error_code error();
     std::string error_string();
@@ -82,6 +135,16 @@ protected:
     virtual bool on_write(const void *buf, size_t size, size_t &bytes_written);
     virtual bool on_seek(int64_t offset, int whence, uint64_t &new_offset);
     virtual bool on_truncate(uint64_t size);
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read);
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written);
+    virtual bool on_readv(const FileIovec *iov, size_t iov_count,
+                          size_t &bytes_read);
+    virtual bool on_writev(const FileIovec *iov, size_t iov_count,
+                           size_t &bytes_written);
+    virtual bool on_peek(const void *&buf, size_t &size);
+    virtual bool on_consume(size_t size);
 
     std::unique_ptr<FilePrivate> _priv_ptr;
 };
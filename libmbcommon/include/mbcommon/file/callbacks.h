@@ -42,6 +42,8 @@ public:
                            int64_t offset, int whence, uint64_t &new_offset);
     typedef bool (*TruncateCb)(File &file, void *userdata,
                                uint64_t size);
+    typedef bool (*ReadBlockCb)(File &file, void *userdata,
+                                const void *&buf, size_t &size);
 
     CallbackFile();
     CallbackFile(OpenCb open_cb,
@@ -64,6 +66,8 @@ public:
               TruncateCb truncate_cb,
               void *userdata);
 
+    bool set_read_block_cb(ReadBlockCb read_block_cb);
+
 protected:
     /*! \cond INTERNAL */
     CallbackFile(CallbackFilePrivate *priv);
@@ -86,6 +90,8 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_peek(const void *&buf, size_t &size) override;
+    virtual bool on_consume(size_t size) override;
 };
 
 }
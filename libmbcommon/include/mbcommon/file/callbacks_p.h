@@ -44,7 +44,13 @@ public:
     CallbackFile::WriteCb write_cb;
     CallbackFile::SeekCb seek_cb;
     CallbackFile::TruncateCb truncate_cb;
+    CallbackFile::ReadBlockCb read_block_cb;
     void *userdata;
+
+    // Block lent by read_block_cb
+    const char *block;
+    size_t block_size;
+    size_t block_pos;
 };
 
 }
@@ -65,6 +65,14 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+    virtual bool on_readv(const FileIovec *iov, size_t iov_count,
+                          size_t &bytes_read) override;
+    virtual bool on_writev(const FileIovec *iov, size_t iov_count,
+                           size_t &bytes_written) override;
 };
 
 }
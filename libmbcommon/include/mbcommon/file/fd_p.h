@@ -24,6 +24,10 @@
 #include "mbcommon/file/fd.h"
 #include "mbcommon/file_p.h"
 
+#ifndef _WIN32
+#  include <sys/uio.h>
+#endif
+
 /*! \cond INTERNAL */
 namespace mb
 {
@@ -46,6 +50,14 @@ struct FdFileFuncs
     virtual off64_t fn_lseek64(int fd, off64_t offset, int whence) = 0;
     virtual ssize_t fn_read(int fd, void *buf, size_t count) = 0;
     virtual ssize_t fn_write(int fd, const void *buf, size_t count) = 0;
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) = 0;
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) = 0;
+    virtual ssize_t fn_readv(int fd, const struct iovec *iov, int iovcnt) = 0;
+    virtual ssize_t fn_writev(int fd, const struct iovec *iov, int iovcnt) = 0;
+#endif
 };
 
 class FdFilePrivate : public FilePrivate
@@ -24,6 +24,10 @@
 namespace mb
 {
 
+typedef void *(*MemoryFileReallocFn)(void *userdata, void *ptr,
+                                     size_t old_capacity,
+                                     size_t new_capacity);
+
 class MemoryFilePrivate;
 class MB_EXPORT MemoryFile : public File
 {
@@ -41,6 +45,11 @@ public:
     bool open(const void *buf, size_t size);
     bool open(void **buf_ptr, size_t *size_ptr);
 
+    // Buffer management for dynamically sized buffers
+    bool set_allocator(MemoryFileReallocFn realloc_fn, void *userdata);
+    bool reserve(size_t capacity);
+    size_t capacity();
+
 protected:
     /*! \cond INTERNAL */
     MemoryFile(MemoryFilePrivate *priv);
@@ -58,6 +67,12 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+    virtual bool on_peek(const void *&buf, size_t &size) override;
+    virtual bool on_consume(size_t size) override;
 };
 
 }
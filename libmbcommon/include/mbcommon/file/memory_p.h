@@ -46,6 +46,11 @@ public:
 
     size_t pos;
 
+    // Allocated size of the dynamically sized buffer
+    size_t capacity;
+    MemoryFileReallocFn realloc_fn;
+    void *realloc_userdata;
+
     bool fixed_size;
 };
 
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/file_p.h"
+
+#include <sys/types.h>
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+struct MmapFileFuncs
+{
+    // fcntl.h
+    virtual int fn_open(const char *path, int flags, mode_t mode) = 0;
+
+    // sys/mman.h
+    virtual void * fn_mmap64(void *addr, size_t length, int prot, int flags,
+                             int fd, off64_t offset) = 0;
+    virtual int fn_munmap(void *addr, size_t length) = 0;
+
+    // sys/stat.h
+    virtual int fn_fstat(int fildes, struct stat *buf) = 0;
+
+    // unistd.h
+    virtual int fn_close(int fd) = 0;
+    virtual off64_t fn_lseek64(int fd, off64_t offset, int whence) = 0;
+    virtual long fn_page_size() = 0;
+};
+
+class MmapFilePrivate : public FilePrivate
+{
+public:
+    MmapFilePrivate();
+    virtual ~MmapFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MmapFilePrivate)
+
+    void clear();
+
+    MmapFileFuncs *funcs;
+
+    int fd;
+    bool owned;
+    std::string filename;
+
+    // Requested window
+    uint64_t offset;
+    uint64_t size;
+
+    // Actual mapping (page-aligned)
+    void *map_addr;
+    size_t map_size;
+
+    // Window into the mapping
+    const char *data;
+    size_t data_size;
+
+    size_t pos;
+
+protected:
+    MmapFilePrivate(MmapFileFuncs *funcs);
+};
+
+}
+/*! \endcond */
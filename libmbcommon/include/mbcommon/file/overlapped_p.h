@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include "mbcommon/file/overlapped.h"
+#include "mbcommon/file/win32_p.h"
+
+#include <vector>
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+struct OverlappedSlot
+{
+    OVERLAPPED ov;
+    // Manual-reset event signaled when the request completes
+    HANDLE event;
+    uint64_t user_data;
+    bool busy;
+    // Read started at or past the end of the file, so there is nothing to
+    // wait for
+    bool eof;
+};
+
+class OverlappedFilePrivate : public Win32FilePrivate
+{
+public:
+    OverlappedFilePrivate();
+    virtual ~OverlappedFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(OverlappedFilePrivate)
+
+    void clear_queue();
+
+    unsigned int queue_depth;
+    bool unbuffered;
+
+    // One slot per request that can be in flight, plus one reserved for
+    // synchronous operations
+    std::vector<OverlappedSlot> slots;
+    std::vector<unsigned int> free_slots;
+    // Asynchronous requests that have not been waited for
+    size_t in_flight;
+
+    // Overlapped handles do not have a file pointer
+    uint64_t position;
+
+protected:
+    OverlappedFilePrivate(Win32FileFuncs *funcs);
+};
+
+}
+/*! \endcond */
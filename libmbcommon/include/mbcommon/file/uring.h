@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/file/fd.h"
+
+namespace mb
+{
+
+class UringFilePrivate;
+class MB_EXPORT UringFile : public FdFile
+{
+    MB_DECLARE_PRIVATE(UringFile)
+
+public:
+    static constexpr unsigned int DEFAULT_QUEUE_DEPTH = 8;
+
+    UringFile();
+    UringFile(int fd, bool owned,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+    UringFile(const std::string &filename, FileOpenMode mode,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+    UringFile(const std::wstring &filename, FileOpenMode mode,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+    virtual ~UringFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(UringFile)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(UringFile)
+
+    bool open(int fd, bool owned,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+    bool open(const std::string &filename, FileOpenMode mode,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+    bool open(const std::wstring &filename, FileOpenMode mode,
+              unsigned int queue_depth = DEFAULT_QUEUE_DEPTH);
+
+    // Asynchronous API
+    bool is_async();
+    size_t in_flight();
+    bool submit_read(uint64_t offset, void *buf, size_t size,
+                     uint64_t user_data);
+    bool submit_write(uint64_t offset, const void *buf, size_t size,
+                      uint64_t user_data);
+    bool wait(uint64_t &user_data, size_t &bytes_transferred);
+
+protected:
+    /*! \cond INTERNAL */
+    UringFile(UringFilePrivate *priv);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+};
+
+}
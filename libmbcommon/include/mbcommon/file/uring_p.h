@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include "mbcommon/file/uring.h"
+#include "mbcommon/file/fd_p.h"
+
+#include <vector>
+
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+struct UringSlot
+{
+    struct iovec iov;
+    uint64_t user_data;
+};
+
+class UringFilePrivate : public FdFilePrivate
+{
+public:
+    UringFilePrivate();
+    virtual ~UringFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(UringFilePrivate)
+
+    void clear_ring();
+
+    unsigned int queue_depth;
+
+    // Ring file descriptor (-1 if io_uring is unavailable)
+    int ring_fd;
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // Completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    io_uring_cqe *cqes;
+
+    // Per-request state, indexed by the SQE user_data field
+    std::vector<UringSlot> slots;
+    std::vector<unsigned int> free_slots;
+    // Submitted requests that have not been reaped yet
+    size_t in_flight;
+    // Requests queued in the SQ ring, but not yet passed to the kernel
+    unsigned int to_submit;
+
+    // Whether the file was opened with O_APPEND
+    bool append;
+};
+
+}
+/*! \endcond */
@@ -33,7 +33,12 @@ namespace mb
 struct Win32FileFuncs
 {
     // windows.h
+    virtual BOOL fn_CancelIoEx(HANDLE hFile, LPOVERLAPPED lpOverlapped) = 0;
     virtual BOOL fn_CloseHandle(HANDLE hObject) = 0;
+    virtual HANDLE fn_CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                                   BOOL bManualReset,
+                                   BOOL bInitialState,
+                                   LPCWSTR lpName) = 0;
     virtual HANDLE fn_CreateFileW(LPCWSTR lpFileName,
                                   DWORD dwDesiredAccess,
                                   DWORD dwShareMode,
@@ -41,6 +46,12 @@ struct Win32FileFuncs
                                   DWORD dwCreationDisposition,
                                   DWORD dwFlagsAndAttributes,
                                   HANDLE hTemplateFile) = 0;
+    virtual BOOL fn_GetFileSizeEx(HANDLE hFile,
+                                  PLARGE_INTEGER lpFileSize) = 0;
+    virtual BOOL fn_GetOverlappedResult(HANDLE hFile,
+                                        LPOVERLAPPED lpOverlapped,
+                                        LPDWORD lpNumberOfBytesTransferred,
+                                        BOOL bWait) = 0;
     virtual BOOL fn_ReadFile(HANDLE hFile,
                              LPVOID lpBuffer,
                              DWORD nNumberOfBytesToRead,
@@ -51,6 +62,10 @@ struct Win32FileFuncs
                                      LARGE_INTEGER liDistanceToMove,
                                      PLARGE_INTEGER lpNewFilePointer,
                                      DWORD dwMoveMethod) = 0;
+    virtual DWORD fn_WaitForMultipleObjects(DWORD nCount,
+                                            const HANDLE *lpHandles,
+                                            BOOL bWaitAll,
+                                            DWORD dwMilliseconds) = 0;
     virtual BOOL fn_WriteFile(HANDLE hFile,
                               LPCVOID lpBuffer,
                               DWORD nNumberOfBytesToWrite,
@@ -21,6 +21,8 @@
 
 #include "mbcommon/guard_p.h"
 
+#include <mutex>
+
 #include "mbcommon/file.h"
 #include "mbcommon/flags.h"
 
@@ -47,9 +49,17 @@ public:
 
     FileState state;
 
-    // Error
+    // Error. Guarded by error_lock since concurrent read_at() calls may fail
+    // at the same time.
+    std::mutex error_lock;
     std::error_code error_code;
     std::string error_string;
+
+    // I/O statistics
+    bool stats_enabled;
+    FileStats stats;
+    FileStatsCallback stats_cb;
+    void *stats_userdata;
 };
 
 }
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "mbcommon/file.h"
 
 namespace mb
@@ -34,6 +36,17 @@ enum class FileSearchAction
 typedef FileSearchAction (*FileSearchResultCallback)(File &file, void *userdata,
                                                      uint64_t offset);
 
+struct FileSearchPattern
+{
+    const void *data;
+    size_t size;
+};
+
+typedef FileSearchAction (*FileSearchMultiResultCallback)(File &file,
+                                                          void *userdata,
+                                                          size_t pattern_id,
+                                                          uint64_t offset);
+
 MB_EXPORT bool file_read_fully(File &file,
                                void *buf, size_t size,
                                size_t &bytes_read);
@@ -41,15 +54,65 @@ MB_EXPORT bool file_write_fully(File &file,
                                 const void *buf, size_t size,
                                 size_t &bytes_written);
 
+MB_EXPORT bool file_read_fully_at(File &file, uint64_t offset,
+                                  void *buf, size_t size,
+                                  size_t &bytes_read);
+MB_EXPORT bool file_write_fully_at(File &file, uint64_t offset,
+                                   const void *buf, size_t size,
+                                   size_t &bytes_written);
+
+MB_EXPORT bool file_peek_if_supported(File &file,
+                                      const void *&buf, size_t &size,
+                                      bool &lent);
+
 MB_EXPORT bool file_read_discard(File &file, uint64_t size,
                                  uint64_t &bytes_discarded);
 
+class MB_EXPORT FileSearcher
+{
+public:
+    FileSearcher(const void *pattern, size_t pattern_size);
+
+    size_t pattern_size() const;
+
+    const void * find(const void *buf, size_t size) const;
+
+    bool search(File &file, int64_t start, int64_t end, size_t bsize,
+                int64_t max_matches, FileSearchResultCallback result_cb,
+                void *userdata) const;
+
+    bool search_parallel(File &file, int64_t start, int64_t end,
+                         size_t bsize, unsigned int threads,
+                         int64_t max_matches,
+                         FileSearchResultCallback result_cb,
+                         void *userdata) const;
+
+private:
+    std::vector<unsigned char> _pattern;
+    // Boyer-Moore-Horspool bad character table (empty for short patterns)
+    std::vector<size_t> _skip;
+};
+
 MB_EXPORT bool file_search(File &file, int64_t start, int64_t end,
                            size_t bsize, const void *pattern,
                            size_t pattern_size, int64_t max_matches,
                            FileSearchResultCallback result_cb,
                            void *userdata);
 
+MB_EXPORT bool file_search_parallel(File &file, int64_t start, int64_t end,
+                                    size_t bsize, unsigned int threads,
+                                    const void *pattern, size_t pattern_size,
+                                    int64_t max_matches,
+                                    FileSearchResultCallback result_cb,
+                                    void *userdata);
+
+MB_EXPORT bool file_search_multi(File &file, int64_t start, int64_t end,
+                                 size_t bsize,
+                                 const FileSearchPattern *patterns,
+                                 size_t patterns_count, int64_t max_matches,
+                                 FileSearchMultiResultCallback result_cb,
+                                 void *userdata);
+
 MB_EXPORT bool file_move(File &file, uint64_t src, uint64_t dest,
                          uint64_t size, uint64_t &size_moved);
 
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+
+// Number of shards per counter or histogram. Threads are spread across the
+// shards by their ID, so concurrent updates rarely touch the same cache line.
+constexpr size_t METRICS_SHARDS = 8;
+
+// Histogram buckets are exact below 2^METRICS_SUB_BUCKET_BITS. Above that,
+// each power of two is split into 2^METRICS_SUB_BUCKET_BITS buckets, so any
+// recorded value is within 12.5% of its bucket's bounds.
+constexpr unsigned int METRICS_SUB_BUCKET_BITS = 3;
+constexpr size_t METRICS_SUB_BUCKETS = 1u << METRICS_SUB_BUCKET_BITS;
+constexpr size_t METRICS_HISTOGRAM_BUCKETS =
+        (64 - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS;
+
+/*!
+ * \brief Monotonically increasing count
+ */
+class MB_EXPORT Counter
+{
+public:
+    Counter();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(Counter)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(Counter)
+
+    void add(uint64_t n = 1);
+    uint64_t value() const;
+
+private:
+    struct Shard
+    {
+        std::atomic<uint64_t> value;
+        // Keep each shard on its own cache line
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    Shard _shards[METRICS_SHARDS];
+};
+
+/*!
+ * \brief Value that can go up and down
+ */
+class MB_EXPORT Gauge
+{
+public:
+    Gauge();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(Gauge)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(Gauge)
+
+    void set(int64_t value);
+    void add(int64_t n);
+    int64_t value() const;
+
+private:
+    std::atomic<int64_t> _value;
+};
+
+/*!
+ * \brief Point-in-time copy of a histogram
+ */
+struct MB_EXPORT HistogramSnapshot
+{
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> buckets;
+
+    uint64_t percentile(double p) const;
+    double mean() const;
+};
+
+/*!
+ * \brief Distribution of values, typically latencies
+ *
+ * Values are recorded in log-linear buckets, like HdrHistogram with 3 bits of
+ * precision (see METRICS_SUB_BUCKET_BITS). Recording is lock-free. The unit of
+ * the values is up to the caller and should be part of the metric name (eg.
+ * `_us` or `_ms`).
+ */
+class MB_EXPORT Histogram
+{
+public:
+    Histogram();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(Histogram)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(Histogram)
+
+    void record(uint64_t value);
+    HistogramSnapshot snapshot() const;
+
+    static size_t bucket_index(uint64_t value);
+    static uint64_t bucket_lower_bound(size_t index);
+    static uint64_t bucket_upper_bound(size_t index);
+
+private:
+    struct Shard
+    {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> min;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+    };
+
+    std::unique_ptr<Shard[]> _shards;
+};
+
+/*!
+ * \brief Records the lifetime of the object in a histogram in microseconds
+ */
+class MB_EXPORT HistogramTimer
+{
+public:
+    explicit HistogramTimer(Histogram &histogram);
+    ~HistogramTimer();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(HistogramTimer)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(HistogramTimer)
+
+private:
+    Histogram &_histogram;
+    std::chrono::steady_clock::time_point _start;
+};
+
+enum class MetricType : uint8_t
+{
+    Counter = 0,
+    Gauge = 1,
+    Histogram = 2,
+};
+
+/*!
+ * \brief Point-in-time copy of a metric
+ */
+struct MB_EXPORT MetricSnapshot
+{
+    std::string name;
+    MetricType type;
+    // Value of a counter or gauge
+    int64_t value;
+    // Distribution of a histogram
+    HistogramSnapshot histogram;
+};
+
+class MetricsRegistryPrivate;
+
+/*!
+ * \brief Named set of metrics
+ *
+ * Metrics are created on first use and live as long as the registry, so
+ * callers should look them up once and keep the reference:
+ *
+ * \code{.cpp}
+ * static Histogram &h = MetricsRegistry::global().histogram("foo.time_us");
+ * HistogramTimer timer(h);
+ * \endcode
+ *
+ * Counters, gauges, and histograms have separate namespaces.
+ */
+class MB_EXPORT MetricsRegistry
+{
+    MB_DECLARE_PRIVATE(MetricsRegistry)
+
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MetricsRegistry)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(MetricsRegistry)
+
+    Counter & counter(const std::string &name);
+    Gauge & gauge(const std::string &name);
+    Histogram & histogram(const std::string &name);
+
+    std::vector<MetricSnapshot> snapshot() const;
+
+    std::string to_json() const;
+    bool write_json_file(const std::string &path) const;
+
+    static MetricsRegistry & global();
+
+private:
+    std::unique_ptr<MetricsRegistryPrivate> _priv_ptr;
+};
+
+}
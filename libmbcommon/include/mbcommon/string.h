@@ -83,6 +83,46 @@ MB_EXPORT bool ends_with_icase(const std::string &string, const char *suffix);
 MB_EXPORT bool ends_with_icase(const char *string, const std::string &suffix);
 MB_EXPORT bool ends_with_icase(const std::string &string, const std::string &suffix);
 
+// String compare (allows non-NULL-terminated strings)
+MB_EXPORT bool equals_n(const char *a, size_t len_a,
+                        const char *b, size_t len_b);
+MB_EXPORT bool equals_icase_n(const char *a, size_t len_a,
+                              const char *b, size_t len_b);
+MB_EXPORT int compare_icase_n(const char *a, size_t len_a,
+                              const char *b, size_t len_b);
+
+// String trim (adjusts the bounds without copying)
+MB_EXPORT void trim_left_n(const char *&string, size_t &len_string);
+MB_EXPORT void trim_right_n(const char *&string, size_t &len_string);
+MB_EXPORT void trim_n(const char *&string, size_t &len_string);
+
+// String split (without copying)
+enum class SplitMode
+{
+    // Split at every occurrence of the delimiter string. Empty tokens are kept.
+    Delimiter,
+    // Split at any of the delimiter characters. Empty tokens are skipped.
+    AnyOf,
+};
+
+class MB_EXPORT StringSplitter
+{
+public:
+    StringSplitter(const char *string, size_t len_string,
+                   const char *delim, size_t len_delim,
+                   SplitMode mode = SplitMode::Delimiter);
+
+    bool next(const char *&token, size_t &len_token);
+
+private:
+    const char *_cur;
+    const char *_end;
+    const char *_delim;
+    size_t _len_delim;
+    SplitMode _mode;
+    bool _done;
+};
+
 // String insert
 MB_EXPORT int mem_insert(void **mem, size_t *mem_size, size_t pos,
                          const void *data, size_t data_size);
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include <cstddef>
+
+namespace mb
+{
+
+class ThreadPool;
+
+/*!
+ * \brief Set of tasks that can be waited on and cancelled together
+ *
+ * The group must outlive all of its tasks. The destructor waits for any tasks
+ * that are still pending.
+ */
+class MB_EXPORT TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool &pool);
+    ~TaskGroup();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TaskGroup)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(TaskGroup)
+
+    void submit(std::function<void()> task);
+    void wait();
+
+    void cancel();
+    bool is_cancelled() const;
+
+private:
+    ThreadPool &_pool;
+    std::atomic<size_t> _pending;
+    std::atomic<bool> _cancelled;
+
+    friend class ThreadPool;
+    friend class ThreadPoolPrivate;
+};
+
+class ThreadPoolPrivate;
+
+/*!
+ * \brief Work-stealing thread pool
+ *
+ * Each worker has its own task queue. Tasks submitted from a worker go to that
+ * worker's queue and idle workers steal from the other queues.
+ *
+ * A pool with one thread does not start any threads. Its tasks run one at a
+ * time, in the order they were submitted, on whichever thread waits for them.
+ */
+class MB_EXPORT ThreadPool
+{
+    MB_DECLARE_PRIVATE(ThreadPool)
+
+public:
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ThreadPool)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(ThreadPool)
+
+    unsigned int thread_count() const;
+
+    void submit(std::function<void()> task);
+    void wait();
+
+    bool parallel_for(size_t begin, size_t end, size_t grain,
+                      const std::function<bool(size_t, size_t)> &fn);
+
+    static ThreadPool & global();
+    static unsigned int online_cpus();
+
+private:
+    std::unique_ptr<ThreadPoolPrivate> _priv_ptr;
+
+    void submit(TaskGroup &group, std::function<void()> task);
+    void wait(TaskGroup &group);
+
+    friend class TaskGroup;
+};
+
+}
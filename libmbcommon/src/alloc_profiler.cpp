@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/alloc_profiler.h"
+
+#include <atomic>
+
+#include <cstring>
+
+#include <pthread.h>
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+struct AllocTagSlot
+{
+    std::atomic<const char *> tag;
+    std::atomic<uint64_t> allocs;
+    std::atomic<uint64_t> alloc_bytes;
+    std::atomic<uint64_t> frees;
+    std::atomic<uint64_t> free_bytes;
+};
+/*! \endcond */
+
+// Slot 0 is for untagged allocations and slot 1 is for tags that don't fit.
+// Everything here is zero-initialized static storage because the allocator
+// hooks may run before any constructors.
+static constexpr size_t UNTAGGED_SLOT = 0;
+static constexpr size_t OVERFLOW_SLOT = 1;
+static constexpr size_t FIRST_TAG_SLOT = 2;
+static constexpr size_t NUM_SLOTS = FIRST_TAG_SLOT + ALLOC_PROFILER_MAX_TAGS;
+
+static AllocTagSlot g_slots[NUM_SLOTS];
+
+// Thread-local storage is not reliable in the static binaries used during
+// early boot and emulated TLS allocates on first use, so the current slot is
+// kept in a pthread key instead. The key's value is the slot index.
+static pthread_key_t g_key;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static std::atomic<bool> g_key_created;
+
+static void create_key()
+{
+    if (pthread_key_create(&g_key, nullptr) == 0) {
+        g_key_created.store(true, std::memory_order_release);
+    }
+}
+
+static size_t current_slot()
+{
+    // No scope can exist before the key is created
+    if (!g_key_created.load(std::memory_order_acquire)) {
+        return UNTAGGED_SLOT;
+    }
+    return reinterpret_cast<uintptr_t>(pthread_getspecific(g_key));
+}
+
+static size_t find_slot(const char *tag)
+{
+    if (!tag) {
+        return UNTAGGED_SLOT;
+    }
+
+    for (size_t i = FIRST_TAG_SLOT; i < NUM_SLOTS; ++i) {
+        const char *slot_tag = g_slots[i].tag.load(std::memory_order_acquire);
+
+        if (!slot_tag) {
+            if (g_slots[i].tag.compare_exchange_strong(
+                    slot_tag, tag, std::memory_order_acq_rel)) {
+                return i;
+            }
+            // Another thread claimed the slot. slot_tag is now its tag.
+        }
+
+        // The same literal may have different addresses in different
+        // translation units
+        if (slot_tag == tag || strcmp(slot_tag, tag) == 0) {
+            return i;
+        }
+    }
+
+    return OVERFLOW_SLOT;
+}
+
+AllocScope::AllocScope(const char *tag)
+    : _prev(nullptr)
+{
+    pthread_once(&g_key_once, &create_key);
+    if (!g_key_created.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    _prev = pthread_getspecific(g_key);
+    pthread_setspecific(g_key, reinterpret_cast<void *>(find_slot(tag)));
+}
+
+AllocScope::~AllocScope()
+{
+    if (g_key_created.load(std::memory_order_acquire)) {
+        pthread_setspecific(g_key, _prev);
+    }
+}
+
+/*!
+ * \brief Count an allocation of \p size bytes under the current tag
+ */
+void alloc_profiler_record_alloc(size_t size)
+{
+    AllocTagSlot &slot = g_slots[current_slot()];
+    slot.allocs.fetch_add(1, std::memory_order_relaxed);
+    slot.alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Count a free of \p size bytes under the current tag
+ */
+void alloc_profiler_record_free(size_t size)
+{
+    AllocTagSlot &slot = g_slots[current_slot()];
+    slot.frees.fetch_add(1, std::memory_order_relaxed);
+    slot.free_bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Get the counters of every tag that has seen an allocation or free
+ *
+ * The counters are read individually, so they may be slightly inconsistent
+ * with each other if other threads are allocating.
+ */
+std::vector<AllocTagStats> alloc_profiler_snapshot()
+{
+    // Copy the counters before allocating the result so that the result's
+    // own allocation is not part of the snapshot
+    AllocTagStats stats[NUM_SLOTS];
+
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        const AllocTagSlot &slot = g_slots[i];
+
+        if (i == UNTAGGED_SLOT) {
+            stats[i].tag = ALLOC_PROFILER_UNTAGGED;
+        } else if (i == OVERFLOW_SLOT) {
+            stats[i].tag = ALLOC_PROFILER_OVERFLOW_TAG;
+        } else {
+            stats[i].tag = slot.tag.load(std::memory_order_acquire);
+        }
+
+        stats[i].allocs = slot.allocs.load(std::memory_order_relaxed);
+        stats[i].alloc_bytes = slot.alloc_bytes.load(std::memory_order_relaxed);
+        stats[i].frees = slot.frees.load(std::memory_order_relaxed);
+        stats[i].free_bytes = slot.free_bytes.load(std::memory_order_relaxed);
+    }
+
+    std::vector<AllocTagStats> result;
+
+    for (size_t i = 0; i < NUM_SLOTS; ++i) {
+        if (stats[i].tag && (stats[i].allocs > 0 || stats[i].frees > 0)) {
+            result.push_back(stats[i]);
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Reset all counters to zero
+ *
+ * Tags keep their slots.
+ */
+void alloc_profiler_reset()
+{
+    for (AllocTagSlot &slot : g_slots) {
+        slot.allocs.store(0, std::memory_order_relaxed);
+        slot.alloc_bytes.store(0, std::memory_order_relaxed);
+        slot.frees.store(0, std::memory_order_relaxed);
+        slot.free_bytes.store(0, std::memory_order_relaxed);
+    }
+}
+
+}
@@ -19,10 +19,13 @@
 
 #include "mbcommon/file.h"
 
+#include <chrono>
+
 #include <cassert>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include "mbcommon/file_p.h"
 #include "mbcommon/string.h"
@@ -58,12 +61,74 @@ namespace mb
 
 /*! \cond INTERNAL */
 FilePrivate::FilePrivate()
+    : stats_enabled(false)
+    , stats()
+    , stats_cb(nullptr)
+    , stats_userdata(nullptr)
 {
 }
 
 FilePrivate::~FilePrivate()
 {
 }
+
+typedef std::chrono::steady_clock StatsClock;
+
+static uint64_t elapsed_ns(StatsClock::time_point start)
+{
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    StatsClock::now() - start).count());
+}
+
+static size_t stats_bucket(size_t size)
+{
+    size_t bucket = 0;
+
+    for (size_t limit = 16; bucket < FILE_STATS_HISTOGRAM_BUCKETS - 1
+            && size >= limit; limit <<= 2) {
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+static void record_read(FilePrivate *priv, StatsClock::time_point start,
+                        size_t size, bool ret, size_t bytes_read)
+{
+    auto &stats = priv->stats;
+
+    stats.read_time_ns += elapsed_ns(start);
+    ++stats.read_calls;
+    ++stats.read_size_histogram[stats_bucket(size)];
+    if (ret) {
+        stats.bytes_read += bytes_read;
+    }
+}
+
+static void record_write(FilePrivate *priv, StatsClock::time_point start,
+                         size_t size, bool ret, size_t bytes_written)
+{
+    auto &stats = priv->stats;
+
+    stats.write_time_ns += elapsed_ns(start);
+    ++stats.write_calls;
+    ++stats.write_size_histogram[stats_bucket(size)];
+    if (ret) {
+        stats.bytes_written += bytes_written;
+    }
+}
+
+static size_t iovec_size(const FileIovec *iov, size_t iov_count)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < iov_count; ++i) {
+        total += iov[i].size;
+    }
+
+    return total;
+}
 /*! \endcond */
 
 /*!
@@ -206,6 +271,10 @@ bool File::close()
     // Avoid double-closing or closing nothing
     if (priv->state != FileState::NEW) {
         ret = on_close();
+
+        if (priv->stats_enabled && priv->stats_cb) {
+            priv->stats_cb(*this, priv->stats, priv->stats_userdata);
+        }
     }
 
     priv->state = FileState::NEW;
@@ -244,7 +313,15 @@ bool File::read(void *buf, size_t size, size_t &bytes_read)
     GET_PIMPL_OR_RETURN(false);
     ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
 
-    return on_read(buf, size, bytes_read);
+    if (!priv->stats_enabled) {
+        return on_read(buf, size, bytes_read);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_read(buf, size, bytes_read);
+    record_read(priv, start, size, ret, bytes_read);
+
+    return ret;
 }
 
 /*!
@@ -271,7 +348,15 @@ bool File::write(const void *buf, size_t size, size_t &bytes_written)
     GET_PIMPL_OR_RETURN(false);
     ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
 
-    return on_write(buf, size, bytes_written);
+    if (!priv->stats_enabled) {
+        return on_write(buf, size, bytes_written);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_write(buf, size, bytes_written);
+    record_write(priv, start, size, ret, bytes_written);
+
+    return ret;
 }
 
 /*!
@@ -290,8 +375,18 @@ bool File::seek(int64_t offset, int whence, uint64_t *new_offset)
 
     uint64_t new_offset_temp;
 
+    auto start = StatsClock::time_point();
+    if (priv->stats_enabled) {
+        start = StatsClock::now();
+    }
+
     auto ret = on_seek(offset, whence, new_offset_temp);
 
+    if (priv->stats_enabled) {
+        priv->stats.seek_time_ns += elapsed_ns(start);
+        ++priv->stats.seek_calls;
+    }
+
     if (ret) {
         if (new_offset) {
             *new_offset = new_offset_temp;
@@ -320,6 +415,198 @@ bool File::truncate(uint64_t size)
     return on_truncate(size);
 }
 
+/*!
+ * \brief Read from a File handle at the specified offset.
+ *
+ * This function is equivalent to File::read(), except that the data is read
+ * from offset \p offset and the file position is not changed.
+ *
+ * If the File handle implements positional reads natively (eg. with `pread()`),
+ * then multiple threads may call this function concurrently on the same handle.
+ * Otherwise, the fallback implementation emulates the operation with
+ * File::seek() and File::read() and is not thread-safe.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::read_at(uint64_t offset, void *buf, size_t size, size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!priv->stats_enabled) {
+        return on_read_at(offset, buf, size, bytes_read);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_read_at(offset, buf, size, bytes_read);
+    record_read(priv, start, size, ret, bytes_read);
+
+    return ret;
+}
+
+/*!
+ * \brief Write to a File handle at the specified offset.
+ *
+ * This function is equivalent to File::write(), except that the data is
+ * written to offset \p offset and the file position is not changed.
+ *
+ * \note On Linux, if the file was opened in append mode, the data is always
+ *       appended to the end of the file regardless of \p offset.
+ *
+ * \sa File::read_at()
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::write_at(uint64_t offset, const void *buf, size_t size,
+                    size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!priv->stats_enabled) {
+        return on_write_at(offset, buf, size, bytes_written);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_write_at(offset, buf, size, bytes_written);
+    record_write(priv, start, size, ret, bytes_written);
+
+    return ret;
+}
+
+/*!
+ * \brief Read from a File handle into multiple buffers.
+ *
+ * The buffers in \p iov are filled in order. Like File::read(), this function
+ * may return fewer bytes than the total size of all buffers. Use
+ * File::readv() in a loop or fall back to file_read_fully() to handle short
+ * reads.
+ *
+ * \param[in] iov Array of buffers to read into
+ * \param[in] iov_count Number of elements in \p iov
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::readv(const FileIovec *iov, size_t iov_count, size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!priv->stats_enabled) {
+        return on_readv(iov, iov_count, bytes_read);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_readv(iov, iov_count, bytes_read);
+    record_read(priv, start, iovec_size(iov, iov_count), ret, bytes_read);
+
+    return ret;
+}
+
+/*!
+ * \brief Write to a File handle from multiple buffers.
+ *
+ * The buffers in \p iov are written in order. Like File::write(), this
+ * function may write fewer bytes than the total size of all buffers.
+ *
+ * \param[in] iov Array of buffers to write from
+ * \param[in] iov_count Number of elements in \p iov
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::writev(const FileIovec *iov, size_t iov_count,
+                  size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!priv->stats_enabled) {
+        return on_writev(iov, iov_count, bytes_written);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_writev(iov, iov_count, bytes_written);
+    record_write(priv, start, iovec_size(iov, iov_count), ret, bytes_written);
+
+    return ret;
+}
+
+/*!
+ * \brief Get a pointer to the data at the current file position.
+ *
+ * If the File handle is backed by memory, such as a MemoryFile or an MmapFile,
+ * or by a producer that owns its own buffers, such as a CallbackFile with a
+ * #CallbackFile::ReadBlockCb callback, this function lends that buffer to the
+ * caller instead of copying the data. The data is not consumed. Call
+ * File::consume() to advance the file position.
+ *
+ * The buffer remains valid until the next operation on the File handle, other
+ * than File::consume(), which only invalidates the consumed part.
+ *
+ * If the File handle does not support lending its buffers, the error is set to
+ * FileError::UnsupportedRead and callers should fall back to File::read(). A
+ * File handle may also stop lending partway through the file, for example once
+ * the position leaves a cached region, so the fallback must work at any offset.
+ *
+ * \param[out] buf Pointer to the available data
+ * \param[out] size Number of bytes available at \p buf. 0 indicates end of file.
+ *
+ * \return Whether some bytes are available or EOF was reached
+ */
+bool File::peek(const void *&buf, size_t &size)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!priv->stats_enabled) {
+        return on_peek(buf, size);
+    }
+
+    auto start = StatsClock::now();
+    auto ret = on_peek(buf, size);
+
+    priv->stats.read_time_ns += elapsed_ns(start);
+    ++priv->stats.read_calls;
+
+    return ret;
+}
+
+/*!
+ * \brief Consume data returned by File::peek().
+ *
+ * \param size Number of bytes to consume. This must not exceed the size
+ *             returned by the last call to File::peek().
+ *
+ * \return Whether the data was successfully consumed
+ */
+bool File::consume(size_t size)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    auto ret = on_consume(size);
+
+    if (ret && priv->stats_enabled) {
+        priv->stats.bytes_read += size;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Check whether file is opened
  *
@@ -364,6 +651,83 @@ bool File::set_fatal(bool fatal)
     return true;
 }
 
+/*!
+ * \brief Enable or disable collection of I/O statistics
+ *
+ * Statistics collection is disabled by default. When enabled, every call to
+ * read(), write(), seek(), read_at(), write_at(), readv(), and writev() is
+ * counted and timed. Existing statistics are kept when collection is disabled
+ * and reenabled. Use reset_stats() to clear them.
+ *
+ * \param enabled Whether to collect statistics
+ *
+ * \return Whether the setting was successfully changed
+ */
+bool File::set_stats_enabled(bool enabled)
+{
+    GET_PIMPL_OR_RETURN(false);
+
+    priv->stats_enabled = enabled;
+    return true;
+}
+
+/*!
+ * \brief Check whether I/O statistics collection is enabled
+ *
+ * \return Whether statistics are being collected
+ */
+bool File::stats_enabled()
+{
+    GET_PIMPL_OR_RETURN(false);
+    return priv->stats_enabled;
+}
+
+/*!
+ * \brief Get I/O statistics
+ *
+ * \return Statistics collected since the handle was created or since the last
+ *         call to reset_stats()
+ */
+FileStats File::stats()
+{
+    GET_PIMPL_OR_RETURN({});
+    return priv->stats;
+}
+
+/*!
+ * \brief Clear I/O statistics
+ *
+ * \return Whether the statistics were successfully cleared
+ */
+bool File::reset_stats()
+{
+    GET_PIMPL_OR_RETURN(false);
+
+    memset(&priv->stats, 0, sizeof(priv->stats));
+    return true;
+}
+
+/*!
+ * \brief Set callback for reporting I/O statistics on close
+ *
+ * If statistics collection is enabled, \p cb is called with the collected
+ * statistics after the file is closed with close(). The callback must not
+ * perform any operations on the file other than querying its state.
+ *
+ * \param cb Callback to invoke on close (or nullptr to unset)
+ * \param userdata User data pointer to pass to \p cb
+ *
+ * \return Whether the callback was successfully set
+ */
+bool File::set_stats_callback(FileStatsCallback cb, void *userdata)
+{
+    GET_PIMPL_OR_RETURN(false);
+
+    priv->stats_cb = cb;
+    priv->stats_userdata = userdata;
+    return true;
+}
+
 /*!
  * \brief Get error code for a failed operation.
  *
@@ -375,6 +739,7 @@ std::error_code File::error()
 {
     GET_PIMPL_OR_RETURN({});
 
+    std::lock_guard<std::mutex> lock(priv->error_lock);
     return priv->error_code;
 }
 
@@ -390,6 +755,7 @@ std::string File::error_string()
 {
     GET_PIMPL_OR_RETURN({});
 
+    std::lock_guard<std::mutex> lock(priv->error_lock);
     return priv->error_string;
 }
 
@@ -431,16 +797,22 @@ bool File::set_error_v(std::error_code ec, const char *fmt, va_list ap)
 {
     GET_PIMPL_OR_RETURN(false);
 
-    priv->error_code = ec;
+    std::string error_string;
+    bool ret = format_v(error_string, fmt, ap);
 
-    if (!format_v(priv->error_string, fmt, ap)) {
-        return false;
+    if (ret) {
+        error_string += ": ";
+        error_string += ec.message();
     }
 
-    priv->error_string += ": ";
-    priv->error_string += ec.message();
+    std::lock_guard<std::mutex> lock(priv->error_lock);
 
-    return true;
+    priv->error_code = ec;
+    if (ret) {
+        priv->error_string = std::move(error_string);
+    }
+
+    return ret;
 }
 
 /*!
@@ -637,4 +1009,233 @@ bool File::on_truncate(uint64_t size)
     return false;
 }
 
+/*!
+ * \brief File positional read callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * reading at an offset without changing the file position. The return value
+ * semantics are the same as on_read().
+ *
+ * If this method is not overridden, the operation is emulated by saving the
+ * file position with on_seek(), seeking to \p offset, calling on_read(), and
+ * restoring the file position. If the file position cannot be restored, the
+ * file is placed in the fatal state.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file. This parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_read_at(uint64_t offset, void *buf, size_t size,
+                      size_t &bytes_read)
+{
+    uint64_t old_pos;
+    uint64_t new_pos;
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum seek offset");
+        return false;
+    }
+
+    if (!on_seek(0, SEEK_CUR, old_pos)
+            || !on_seek(static_cast<int64_t>(offset), SEEK_SET, new_pos)) {
+        return false;
+    }
+
+    bool ret = on_read(buf, size, bytes_read);
+
+    // Restore old position
+    if (!on_seek(static_cast<int64_t>(old_pos), SEEK_SET, new_pos)) {
+        set_fatal(true);
+        return false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief File positional write callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * writing at an offset without changing the file position. The return value
+ * semantics are the same as on_write().
+ *
+ * If this method is not overridden, the operation is emulated by saving the
+ * file position with on_seek(), seeking to \p offset, calling on_write(), and
+ * restoring the file position. If the file position cannot be restored, the
+ * file is placed in the fatal state.
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_write_at(uint64_t offset, const void *buf, size_t size,
+                       size_t &bytes_written)
+{
+    uint64_t old_pos;
+    uint64_t new_pos;
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum seek offset");
+        return false;
+    }
+
+    if (!on_seek(0, SEEK_CUR, old_pos)
+            || !on_seek(static_cast<int64_t>(offset), SEEK_SET, new_pos)) {
+        return false;
+    }
+
+    bool ret = on_write(buf, size, bytes_written);
+
+    // Restore old position
+    if (!on_seek(static_cast<int64_t>(old_pos), SEEK_SET, new_pos)) {
+        set_fatal(true);
+        return false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief File vectored read callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * scatter reads natively. The return value semantics are the same as
+ * on_read().
+ *
+ * If this method is not overridden, on_read() is called for each buffer in
+ * order until a short read occurs. If on_read() fails after some data has
+ * already been read, the number of bytes read so far is returned as a short
+ * read. The error will be reported again by the next read operation.
+ *
+ * \param[in] iov Array of buffers to read into
+ * \param[in] iov_count Number of elements in \p iov
+ * \param[out] bytes_read Output number of bytes that were read. This parameter
+ *                        is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_readv(const FileIovec *iov, size_t iov_count,
+                    size_t &bytes_read)
+{
+    size_t total = 0;
+    size_t n;
+
+    for (size_t i = 0; i < iov_count; ++i) {
+        if (!on_read(iov[i].base, iov[i].size, n)) {
+            if (total > 0) {
+                break;
+            }
+            return false;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_read = total;
+    return true;
+}
+
+/*!
+ * \brief File vectored write callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * gather writes natively. The return value semantics are the same as
+ * on_write().
+ *
+ * If this method is not overridden, on_write() is called for each buffer in
+ * order until a short write occurs. If on_write() fails after some data has
+ * already been written, the number of bytes written so far is returned as a
+ * short write.
+ *
+ * \param[in] iov Array of buffers to write from
+ * \param[in] iov_count Number of elements in \p iov
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_writev(const FileIovec *iov, size_t iov_count,
+                     size_t &bytes_written)
+{
+    size_t total = 0;
+    size_t n;
+
+    for (size_t i = 0; i < iov_count; ++i) {
+        if (!on_write(iov[i].base, iov[i].size, n)) {
+            if (total > 0) {
+                break;
+            }
+            return false;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_written = total;
+    return true;
+}
+
+/*!
+ * \brief File peek callback
+ *
+ * Subclasses should override this method if the file data already resides in
+ * memory that can be lent to the caller.
+ *
+ * If this method is not overridden, an error will be set and false will be
+ * returned.
+ *
+ * \param[out] buf Pointer to the available data
+ * \param[out] size Number of bytes available at \p buf. 0 indicates end of file.
+ *
+ * \return Whether some bytes are available or EOF was reached
+ */
+bool File::on_peek(const void *&buf, size_t &size)
+{
+    (void) buf;
+    (void) size;
+
+    set_error(make_error_code(FileError::UnsupportedRead),
+              "%s: Peek callback not supported", __func__);
+    return false;
+}
+
+/*!
+ * \brief File consume callback
+ *
+ * Subclasses that override on_peek() must also override this method.
+ *
+ * If this method is not overridden, an error will be set and false will be
+ * returned.
+ *
+ * \param size Number of bytes to consume
+ *
+ * \return Whether the data was successfully consumed
+ */
+bool File::on_consume(size_t size)
+{
+    (void) size;
+
+    set_error(make_error_code(FileError::UnsupportedRead),
+              "%s: Consume callback not supported", __func__);
+    return false;
+}
+
 }
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/buffered.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbcommon/file/buffered_p.h"
+
+/*!
+ * \file mbcommon/file/buffered.h
+ * \brief Buffered wrapper around another File handle
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+BufferedFilePrivate::BufferedFilePrivate()
+{
+    clear();
+}
+
+BufferedFilePrivate::~BufferedFilePrivate()
+{
+}
+
+void BufferedFilePrivate::clear()
+{
+    file = nullptr;
+    can_seek = false;
+    std::vector<char>().swap(buf);
+    buf_size = 0;
+    buf_offset = 0;
+    buf_len = 0;
+    buf_pos = 0;
+    dirty = false;
+    pos = 0;
+}
+
+/*! \endcond */
+
+constexpr size_t BufferedFile::DEFAULT_BUFFER_SIZE;
+
+/*!
+ * \brief Copy error from the underlying File handle
+ */
+static void copy_error(BufferedFile &file, BufferedFilePrivate *priv,
+                       const char *action)
+{
+    file.set_error(priv->file->error(), "%s: %s",
+                   action, priv->file->error_string().c_str());
+    if (priv->file->is_fatal()) {
+        file.set_fatal(true);
+    }
+}
+
+/*!
+ * \brief Write buffered data to the underlying File handle
+ *
+ * If only part of the buffer could be written, the unwritten data is kept at
+ * the beginning of the buffer so the operation can be reattempted.
+ */
+static bool flush_write_buffer(BufferedFile &file, BufferedFilePrivate *priv)
+{
+    if (!priv->dirty) {
+        return true;
+    }
+
+    size_t n;
+    bool ret = file_write_fully(*priv->file, priv->buf.data(), priv->buf_len,
+                                n);
+
+    // Keep whatever was not written
+    memmove(priv->buf.data(), priv->buf.data() + n, priv->buf_len - n);
+    priv->buf_offset += n;
+    priv->buf_len -= n;
+
+    if (!ret) {
+        copy_error(file, priv, "Failed to write buffered data");
+        return false;
+    } else if (priv->buf_len > 0) {
+        file.set_error(make_error_code(FileError::UnsupportedWrite),
+                       "Buffered data was truncated on write");
+        return false;
+    }
+
+    priv->buf_pos = 0;
+    priv->dirty = false;
+
+    return true;
+}
+
+/*!
+ * \brief Drop read-ahead data and resynchronize the underlying position
+ *
+ * After this function returns successfully, the buffer is empty and the
+ * underlying File handle's position matches the logical file position.
+ */
+static bool discard_buffer(BufferedFile &file, BufferedFilePrivate *priv)
+{
+    if (priv->dirty) {
+        return flush_write_buffer(file, priv);
+    }
+
+    // The underlying handle is ahead of us if there is unread data
+    if (priv->buf_pos != priv->buf_len) {
+        if (!priv->file->seek(static_cast<int64_t>(priv->pos), SEEK_SET,
+                              nullptr)) {
+            copy_error(file, priv, "Failed to discard read-ahead data");
+            return false;
+        }
+    }
+
+    priv->buf_offset = priv->pos;
+    priv->buf_len = 0;
+    priv->buf_pos = 0;
+
+    return true;
+}
+
+/*!
+ * \class BufferedFile
+ *
+ * \brief Add read-ahead and write-behind buffering to another File handle.
+ *
+ * This class is useful for wrapping File handles where each operation is
+ * expensive, such as CallbackFile handles backed by a decompressor or
+ * unbuffered FdFile handles that are accessed with many small reads.
+ *
+ * Seeks that land within the current read buffer are handled without calling
+ * into the underlying File handle. Consequently, no more than one seek per
+ * buffer refill will be performed on the underlying handle. If the underlying
+ * handle does not support seeking, neither will the BufferedFile.
+ *
+ * The underlying File handle is *not* owned by the BufferedFile. It must
+ * outlive the BufferedFile and must not be used directly while the
+ * BufferedFile is open. Closing the BufferedFile flushes any pending writes,
+ * but does not close the underlying handle.
+ */
+
+/*!
+ * \var BufferedFile::DEFAULT_BUFFER_SIZE
+ *
+ * \brief Default buffer size (64 KiB)
+ */
+
+/*!
+ * \brief Construct unbound BufferedFile.
+ *
+ * The File handle will not be bound to any file. The open function will need
+ * to be called to open a file.
+ */
+BufferedFile::BufferedFile()
+    : BufferedFile(new BufferedFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle that wraps another File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, size_t)
+ *
+ * \param file Underlying File handle
+ * \param buf_size Buffer size
+ */
+BufferedFile::BufferedFile(File *file, size_t buf_size)
+    : BufferedFile(new BufferedFilePrivate(), file, buf_size)
+{
+}
+
+/*! \cond INTERNAL */
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv)
+    : File(priv)
+{
+}
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv,
+                           File *file, size_t buf_size)
+    : File(priv)
+{
+    open(file, buf_size);
+}
+
+/*! \endcond */
+
+BufferedFile::~BufferedFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open File handle that wraps another File handle.
+ *
+ * \p file must already be opened. The initial file position is taken from
+ * \p file. If \p file does not support seeking, the initial position is
+ * assumed to be 0.
+ *
+ * Buffer sizes between 64 KiB and 4 MiB work well for most use cases. Reads
+ * or writes that are at least as large as the buffer bypass it entirely.
+ *
+ * \param file Underlying File handle
+ * \param buf_size Buffer size (must be non-zero)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool BufferedFile::open(File *file, size_t buf_size)
+{
+    MB_PRIVATE(BufferedFile);
+    if (priv) {
+        priv->file = file;
+        priv->buf_size = buf_size;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Write pending data to the underlying File handle.
+ *
+ * \return Whether all buffered data was successfully written
+ */
+bool BufferedFile::flush()
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    }
+
+    return flush_write_buffer(*this, priv);
+}
+
+bool BufferedFile::on_open()
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!priv->file) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "No underlying file specified");
+        return false;
+    } else if (priv->buf_size == 0) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Buffer size cannot be zero");
+        return false;
+    }
+
+    uint64_t pos;
+
+    if (priv->file->seek(0, SEEK_CUR, &pos)) {
+        priv->can_seek = true;
+        priv->pos = pos;
+    } else if (priv->file->error() == FileError::Unsupported) {
+        priv->can_seek = false;
+        priv->pos = 0;
+    } else {
+        copy_error(*this, priv, "Failed to get file position");
+        return false;
+    }
+
+    priv->buf.resize(priv->buf_size);
+    priv->buf_offset = priv->pos;
+    priv->buf_len = 0;
+    priv->buf_pos = 0;
+    priv->dirty = false;
+
+    return true;
+}
+
+bool BufferedFile::on_close()
+{
+    MB_PRIVATE(BufferedFile);
+
+    bool ret = true;
+
+    if (priv->file && priv->dirty) {
+        ret = flush_write_buffer(*this, priv);
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool BufferedFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (priv->dirty && !flush_write_buffer(*this, priv)) {
+        return false;
+    }
+
+    if (priv->buf_pos == priv->buf_len) {
+        size_t n;
+
+        if (size >= priv->buf_size) {
+            // Large reads bypass the buffer
+            if (!priv->file->read(buf, size, n)) {
+                copy_error(*this, priv, "Failed to read file");
+                return false;
+            }
+
+            priv->pos += n;
+            priv->buf_offset = priv->pos;
+            priv->buf_len = 0;
+            priv->buf_pos = 0;
+
+            bytes_read = n;
+            return true;
+        }
+
+        // Refill buffer
+        if (!priv->file->read(priv->buf.data(), priv->buf_size, n)) {
+            copy_error(*this, priv, "Failed to read file");
+            return false;
+        }
+
+        priv->buf_offset = priv->pos;
+        priv->buf_len = n;
+        priv->buf_pos = 0;
+    }
+
+    size_t to_copy = std::min(size, priv->buf_len - priv->buf_pos);
+    memcpy(buf, priv->buf.data() + priv->buf_pos, to_copy);
+    priv->buf_pos += to_copy;
+    priv->pos += to_copy;
+
+    bytes_read = to_copy;
+    return true;
+}
+
+bool BufferedFile::on_write(const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // Switch from reading to writing
+    if (!priv->dirty && !discard_buffer(*this, priv)) {
+        return false;
+    }
+
+    if (priv->buf_len > 0 && priv->buf_len + size > priv->buf_size
+            && !flush_write_buffer(*this, priv)) {
+        return false;
+    }
+
+    if (size >= priv->buf_size) {
+        // Large writes bypass the buffer
+        size_t n;
+
+        if (!priv->file->write(buf, size, n)) {
+            copy_error(*this, priv, "Failed to write file");
+            return false;
+        }
+
+        priv->pos += n;
+        priv->buf_offset = priv->pos;
+
+        bytes_written = n;
+        return true;
+    }
+
+    memcpy(priv->buf.data() + priv->buf_len, buf, size);
+    priv->buf_len += size;
+    priv->pos += size;
+    priv->dirty = priv->buf_len > 0;
+
+    bytes_written = size;
+    return true;
+}
+
+bool BufferedFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // Don't pretend to be seekable if the underlying file isn't. Callers like
+    // SparseFile probe for seekability and would otherwise choose a strategy
+    // that fails once a seek falls outside of the buffer.
+    if (!priv->can_seek) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking");
+        return false;
+    }
+
+    uint64_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        target = static_cast<uint64_t>(offset);
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > INT64_MAX - priv->pos)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" PRIu64, offset, priv->pos);
+            return false;
+        }
+        target = priv->pos + offset;
+        break;
+    case SEEK_END: {
+        // The file size is only known to the underlying handle
+        if (!discard_buffer(*this, priv)) {
+            return false;
+        }
+
+        uint64_t pos;
+        if (!priv->file->seek(offset, SEEK_END, &pos)) {
+            copy_error(*this, priv, "Failed to seek file");
+            return false;
+        }
+
+        priv->pos = pos;
+        priv->buf_offset = pos;
+
+        new_offset = pos;
+        return true;
+    }
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    if (target == priv->pos) {
+        // Nothing to do
+        new_offset = target;
+        return true;
+    } else if (!priv->dirty && target >= priv->buf_offset
+            && target - priv->buf_offset <= priv->buf_len) {
+        // Seek within the read buffer
+        priv->buf_pos = static_cast<size_t>(target - priv->buf_offset);
+        priv->pos = target;
+
+        new_offset = target;
+        return true;
+    }
+
+    if (priv->dirty && !flush_write_buffer(*this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->seek(static_cast<int64_t>(target), SEEK_SET, nullptr)) {
+        copy_error(*this, priv, "Failed to seek file");
+        return false;
+    }
+
+    priv->pos = target;
+    priv->buf_offset = target;
+    priv->buf_len = 0;
+    priv->buf_pos = 0;
+
+    new_offset = target;
+    return true;
+}
+
+bool BufferedFile::on_truncate(uint64_t size)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!discard_buffer(*this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->truncate(size)) {
+        copy_error(*this, priv, "Failed to truncate file");
+        return false;
+    }
+
+    return true;
+}
+
+}
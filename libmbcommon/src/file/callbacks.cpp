@@ -19,7 +19,13 @@
 
 #include "mbcommon/file/callbacks.h"
 
+#include <algorithm>
+
+#include <cstdio>
+#include <cstring>
+
 #include "mbcommon/file/callbacks_p.h"
+#include "mbcommon/string.h"
 
 /*!
  * \file mbcommon/file/callbacks.h
@@ -116,6 +122,22 @@ namespace mb
  * \return Return whether the file size was successfully changed
  */
 
+/*!
+ * \typedef CallbackFile::ReadBlockCb
+ *
+ * \brief File block read callback
+ *
+ * This callback lends the next block of data from the producer's own buffer,
+ * similar to `archive_read_data_block()`. The block must remain valid until the
+ * next invocation of any callback.
+ *
+ * \param[in] file File handle
+ * \param[out] buf Pointer to the block
+ * \param[out] size Size of the block. 0 indicates end of file.
+ *
+ * \return Return whether a block was returned or EOF was reached
+ */
+
 /*! \cond INTERNAL */
 
 CallbackFilePrivate::CallbackFilePrivate()
@@ -135,7 +157,11 @@ void CallbackFilePrivate::clear()
     write_cb = nullptr;
     seek_cb = nullptr;
     truncate_cb = nullptr;
+    read_block_cb = nullptr;
     userdata = nullptr;
+    block = nullptr;
+    block_size = 0;
+    block_pos = 0;
 }
 
 /*! \endcond */
@@ -144,6 +170,11 @@ void CallbackFilePrivate::clear()
  * \class CallbackFile
  *
  * \brief Open file with C-style callbacks.
+ *
+ * If a #CallbackFile::ReadBlockCb callback is registered with
+ * set_read_block_cb(), the producer's blocks are lent out directly through
+ * File::peek() and File::consume(), and File::read() copies out of them. The
+ * #CallbackFile::ReadCb callback is not used in that case.
  */
 
 /*!
@@ -252,6 +283,31 @@ bool CallbackFile::open(OpenCb open_cb,
     return File::open();
 }
 
+/*!
+ * \brief Set block read callback.
+ *
+ * This function must be called before opening the file. The callback is unset
+ * when the file is closed.
+ *
+ * \param read_block_cb File block read callback
+ *
+ * \return Whether the callback was successfully set
+ */
+bool CallbackFile::set_read_block_cb(ReadBlockCb read_block_cb)
+{
+    MB_PRIVATE(CallbackFile);
+    if (!priv) {
+        return false;
+    } else if (is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: Cannot set callback of opened file", __func__);
+        return false;
+    }
+
+    priv->read_block_cb = read_block_cb;
+    return true;
+}
+
 bool CallbackFile::on_open()
 {
     MB_PRIVATE(CallbackFile);
@@ -285,7 +341,21 @@ bool CallbackFile::on_read(void *buf, size_t size, size_t &bytes_read)
 {
     MB_PRIVATE(CallbackFile);
 
-    if (priv->read_cb) {
+    if (priv->read_block_cb) {
+        const void *block;
+        size_t block_size;
+
+        if (!on_peek(block, block_size)) {
+            return false;
+        }
+
+        size_t n = std::min(size, block_size);
+        memcpy(buf, block, n);
+        priv->block_pos += n;
+
+        bytes_read = n;
+        return true;
+    } else if (priv->read_cb) {
         return priv->read_cb(*this, priv->userdata, buf, size, bytes_read);
     } else {
         return File::on_read(buf, size, bytes_read);
@@ -308,7 +378,27 @@ bool CallbackFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
     MB_PRIVATE(CallbackFile);
 
     if (priv->seek_cb) {
-        return priv->seek_cb(*this, priv->userdata, offset, whence, new_offset);
+        // The producer is ahead of the file position by the unconsumed part
+        // of the lent block
+        size_t remain = priv->block_size - priv->block_pos;
+        if (whence == SEEK_CUR && remain > 0) {
+            if (offset < INT64_MIN + static_cast<int64_t>(remain)) {
+                set_error(make_error_code(FileError::ArgumentOutOfRange),
+                          "Offset underflows producer offset");
+                return false;
+            }
+            offset -= static_cast<int64_t>(remain);
+        }
+
+        if (!priv->seek_cb(*this, priv->userdata, offset, whence,
+                           new_offset)) {
+            return false;
+        }
+
+        priv->block = nullptr;
+        priv->block_size = 0;
+        priv->block_pos = 0;
+        return true;
     } else {
         return File::on_seek(offset, whence, new_offset);
     }
@@ -325,4 +415,47 @@ bool CallbackFile::on_truncate(uint64_t size)
     }
 }
 
+bool CallbackFile::on_peek(const void *&buf, size_t &size)
+{
+    MB_PRIVATE(CallbackFile);
+
+    if (!priv->read_block_cb) {
+        return File::on_peek(buf, size);
+    }
+
+    if (priv->block_pos == priv->block_size) {
+        const void *block;
+        size_t block_size;
+
+        if (!priv->read_block_cb(*this, priv->userdata, block, block_size)) {
+            return false;
+        }
+
+        priv->block = static_cast<const char *>(block);
+        priv->block_size = block_size;
+        priv->block_pos = 0;
+    }
+
+    buf = priv->block + priv->block_pos;
+    size = priv->block_size - priv->block_pos;
+    return true;
+}
+
+bool CallbackFile::on_consume(size_t size)
+{
+    MB_PRIVATE(CallbackFile);
+
+    if (!priv->read_block_cb) {
+        return File::on_consume(size);
+    } else if (size > priv->block_size - priv->block_pos) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Cannot consume more than the available %" MB_PRIzu
+                  " bytes", priv->block_size - priv->block_pos);
+        return false;
+    }
+
+    priv->block_pos += size;
+    return true;
+}
+
 }
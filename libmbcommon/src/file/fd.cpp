@@ -19,6 +19,8 @@
 
 #include "mbcommon/file/fd.h"
 
+#include <algorithm>
+
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
@@ -28,6 +30,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#  include <sys/uio.h>
+#endif
+
 #include "mbcommon/locale.h"
 
 #include "mbcommon/file/fd_p.h"
@@ -35,6 +41,10 @@
 #define DEFAULT_MODE \
     (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
+// Maximum number of buffers passed to a single readv()/writev() call. This is
+// well below IOV_MAX on all supported platforms.
+#define MAX_IOVECS 64
+
 /*!
  * \file mbcommon/file/fd.h
  * \brief Open file with POSIX file descriptors API
@@ -87,6 +97,32 @@ struct RealFdFileFuncs : public FdFileFuncs
     {
         return write(fd, buf, count);
     }
+
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) override
+    {
+        return pread64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) override
+    {
+        return pwrite64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_readv(int fd, const struct iovec *iov,
+                             int iovcnt) override
+    {
+        return ::readv(fd, iov, iovcnt);
+    }
+
+    virtual ssize_t fn_writev(int fd, const struct iovec *iov,
+                              int iovcnt) override
+    {
+        return ::writev(fd, iov, iovcnt);
+    }
+#endif
 };
 /*! \endcond */
 
@@ -488,4 +524,138 @@ bool FdFile::on_truncate(uint64_t size)
     return true;
 }
 
+bool FdFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                        size_t &bytes_read)
+{
+#ifdef _WIN32
+    return File::on_read_at(offset, buf, size, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    ssize_t n = priv->funcs->fn_pread64(priv->fd, buf, size,
+                                        static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                         size_t &bytes_written)
+{
+#ifdef _WIN32
+    return File::on_write_at(offset, buf, size, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    ssize_t n = priv->funcs->fn_pwrite64(priv->fd, buf, size,
+                                         static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
+#ifndef _WIN32
+/*!
+ * \brief Convert FileIovec array to iovec array for readv()/writev()
+ *
+ * At most MAX_IOVECS buffers are converted and the total size is limited to
+ * SSIZE_MAX. The remaining buffers are left for a subsequent call, which
+ * appears to the caller as a short read or write.
+ */
+static int convert_iovecs(const FileIovec *iov, size_t iov_count,
+                          struct iovec *out)
+{
+    size_t remain = SSIZE_MAX;
+    int n = 0;
+
+    for (size_t i = 0; i < iov_count && n < MAX_IOVECS && remain > 0; ++i) {
+        size_t size = std::min(iov[i].size, remain);
+        out[n].iov_base = iov[i].base;
+        out[n].iov_len = size;
+        remain -= size;
+        ++n;
+    }
+
+    return n;
+}
+#endif
+
+bool FdFile::on_readv(const FileIovec *iov, size_t iov_count,
+                      size_t &bytes_read)
+{
+#ifdef _WIN32
+    return File::on_readv(iov, iov_count, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    struct iovec vecs[MAX_IOVECS];
+    int vecs_count = convert_iovecs(iov, iov_count, vecs);
+
+    ssize_t n = priv->funcs->fn_readv(priv->fd, vecs, vecs_count);
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_writev(const FileIovec *iov, size_t iov_count,
+                       size_t &bytes_written)
+{
+#ifdef _WIN32
+    return File::on_writev(iov, iov_count, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    struct iovec vecs[MAX_IOVECS];
+    int vecs_count = convert_iovecs(iov, iov_count, vecs);
+
+    ssize_t n = priv->funcs->fn_writev(priv->fd, vecs, vecs_count);
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
 }
@@ -38,9 +38,20 @@
 namespace mb
 {
 
+static void * default_realloc(void *userdata, void *ptr, size_t old_capacity,
+                              size_t new_capacity)
+{
+    (void) userdata;
+    (void) old_capacity;
+
+    return realloc(ptr, new_capacity);
+}
+
 /*! \cond INTERNAL */
 
 MemoryFilePrivate::MemoryFilePrivate()
+    : realloc_fn(&default_realloc)
+    , realloc_userdata(nullptr)
 {
     clear();
 }
@@ -57,14 +68,96 @@ void MemoryFilePrivate::clear()
     size_ptr = nullptr;
     pos = 0;
     fixed_size = false;
+    capacity = 0;
 }
 
 /*! \endcond */
 
+// Minimum amount to allocate when enlarging a dynamically sized buffer
+#define MIN_GROW_SIZE       4096
+
+/*!
+ * \brief Set the buffer capacity to exactly \p capacity bytes
+ *
+ * \note The caller is responsible for setting the error on failure. `errno` is
+ *       set by the allocator.
+ */
+static bool set_capacity(MemoryFilePrivate *priv, size_t capacity)
+{
+    errno = 0;
+
+    void *new_data = priv->realloc_fn(priv->realloc_userdata, priv->data,
+                                      priv->capacity, capacity);
+    if (!new_data && capacity > 0) {
+        if (errno == 0) {
+            errno = ENOMEM;
+        }
+        return false;
+    }
+
+    priv->data = new_data;
+    priv->capacity = capacity;
+    if (priv->data_ptr) {
+        *priv->data_ptr = priv->data;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Ensure that the buffer can hold at least \p size bytes
+ *
+ * The capacity grows geometrically so that a sequence of small writes results
+ * in a logarithmic number of reallocations.
+ */
+static bool ensure_capacity(MemoryFilePrivate *priv, size_t size)
+{
+    if (size <= priv->capacity) {
+        return true;
+    }
+
+    size_t new_capacity = priv->capacity <= SIZE_MAX / 2
+            ? priv->capacity * 2 : SIZE_MAX;
+    new_capacity = std::max<size_t>(new_capacity, MIN_GROW_SIZE);
+    new_capacity = std::max(new_capacity, size);
+
+    if (set_capacity(priv, new_capacity)) {
+        return true;
+    }
+
+    // Retry with the exact size in case the larger allocation failed
+    return new_capacity != size && set_capacity(priv, size);
+}
+
+/*!
+ * \brief Set the file size, zero-initializing any new space
+ *
+ * \pre The capacity must be at least \p size bytes
+ */
+static void set_size(MemoryFilePrivate *priv, size_t size)
+{
+    if (size > priv->size) {
+        memset(static_cast<char *>(priv->data) + priv->size, 0,
+               size - priv->size);
+    }
+
+    priv->size = size;
+    if (priv->size_ptr) {
+        *priv->size_ptr = priv->size;
+    }
+}
+
 /*!
  * \class MemoryFile
  *
  * \brief Open file from statically or dynamically sized memory buffers.
+ *
+ * When opened with a dynamically sized buffer, the buffer is enlarged
+ * geometrically as data is written past the end of the file, so the allocated
+ * capacity may be larger than the file size. By default, the buffer is
+ * allocated with `realloc()` and must be freed by the caller with `free()`. If
+ * the final size of the file is known or can be estimated ahead of time,
+ * call reserve() after opening the file to avoid reallocating at all.
  */
 
 /*!
@@ -178,10 +271,95 @@ bool MemoryFile::open(void **buf_ptr, size_t *size_ptr)
         priv->size_ptr = size_ptr;
         priv->pos = 0;
         priv->fixed_size = false;
+        priv->capacity = *size_ptr;
     }
     return File::open();
 }
 
+/*!
+ * \brief Set allocator for dynamically sized buffer.
+ *
+ * \p realloc_fn is called with `realloc()` semantics whenever the buffer needs
+ * to be resized. The previous capacity is also passed in to allow allocators,
+ * such as arenas or `mremap()`-based allocators, to be implemented without
+ * tracking allocation sizes. The allocator should set `errno` on failure. The
+ * caller is responsible for freeing the final buffer in a way that matches
+ * the allocator.
+ *
+ * This function must be called before opening the file. The allocator is kept
+ * when the file is closed and reopened.
+ *
+ * \param realloc_fn Allocator function or nullptr to use `realloc()`
+ * \param userdata User data pointer to pass to \p realloc_fn
+ *
+ * \return Whether the allocator was successfully set
+ */
+bool MemoryFile::set_allocator(MemoryFileReallocFn realloc_fn, void *userdata)
+{
+    MB_PRIVATE(MemoryFile);
+    if (!priv) {
+        return false;
+    } else if (is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: Cannot change allocator of opened file", __func__);
+        return false;
+    }
+
+    priv->realloc_fn = realloc_fn ? realloc_fn : &default_realloc;
+    priv->realloc_userdata = realloc_fn ? userdata : nullptr;
+    return true;
+}
+
+/*!
+ * \brief Reserve space in dynamically sized buffer.
+ *
+ * Ensure that the buffer can hold at least \p capacity bytes without being
+ * reallocated. The file size is not changed. This function does nothing if the
+ * buffer is already large enough.
+ *
+ * \param capacity Minimum capacity of buffer
+ *
+ * \return Whether the space was successfully reserved
+ */
+bool MemoryFile::reserve(size_t capacity)
+{
+    MB_PRIVATE(MemoryFile);
+    if (!priv) {
+        return false;
+    } else if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    } else if (priv->fixed_size) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "Cannot enlarge fixed buffer");
+        return false;
+    }
+
+    if (capacity > priv->capacity && !set_capacity(priv, capacity)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to reserve buffer space");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get capacity of buffer.
+ *
+ * \return Number of bytes the buffer can hold without being reallocated. For
+ *         fixed size buffers, this is the buffer size.
+ */
+size_t MemoryFile::capacity()
+{
+    MB_PRIVATE(MemoryFile);
+    if (!priv) {
+        return 0;
+    }
+    return priv->fixed_size ? priv->size : priv->capacity;
+}
+
 bool MemoryFile::on_close()
 {
     MB_PRIVATE(MemoryFile);
@@ -196,15 +374,11 @@ bool MemoryFile::on_read(void *buf, size_t size, size_t &bytes_read)
 {
     MB_PRIVATE(MemoryFile);
 
-    size_t to_read = 0;
-    if (priv->pos < priv->size) {
-        to_read = std::min(priv->size - priv->pos, size);
+    if (!on_read_at(priv->pos, buf, size, bytes_read)) {
+        return false;
     }
 
-    memcpy(buf, static_cast<char *>(priv->data) + priv->pos, to_read);
-    priv->pos += to_read;
-
-    bytes_read = to_read;
+    priv->pos += bytes_read;
     return true;
 }
 
@@ -212,46 +386,11 @@ bool MemoryFile::on_write(const void *buf, size_t size, size_t &bytes_written)
 {
     MB_PRIVATE(MemoryFile);
 
-    if (priv->pos > SIZE_MAX - size) {
-        set_error(make_error_code(FileError::InvalidArgument),
-                  "Write would overflow size_t");
+    if (!on_write_at(priv->pos, buf, size, bytes_written)) {
         return false;
     }
 
-    size_t desired_size = priv->pos + size;
-    size_t to_write = size;
-
-    if (desired_size > priv->size) {
-        if (priv->fixed_size) {
-            to_write = priv->pos <= priv->size ? priv->size - priv->pos : 0;
-        } else {
-            // Enlarge buffer
-            void *new_data = realloc(priv->data, desired_size);
-            if (!new_data) {
-                set_error(std::error_code(errno, std::generic_category()),
-                          "Failed to enlarge buffer");
-                return false;
-            }
-
-            // Zero-initialize new space
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   desired_size - priv->size);
-
-            priv->data = new_data;
-            priv->size = desired_size;
-            if (priv->data_ptr) {
-                *priv->data_ptr = priv->data;
-            }
-            if (priv->size_ptr) {
-                *priv->size_ptr = priv->size;
-            }
-        }
-    }
-
-    memcpy(static_cast<char *>(priv->data) + priv->pos, buf, to_write);
-    priv->pos += to_write;
-
-    bytes_written = to_write;
+    priv->pos += bytes_written;
     return true;
 }
 
@@ -307,30 +446,111 @@ bool MemoryFile::on_truncate(uint64_t size)
         set_error(make_error_code(FileError::UnsupportedTruncate),
                   "Cannot truncate fixed buffer");
         return false;
+    } else if (size > SIZE_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Size exceeds maximum buffer size");
+        return false;
     } else {
-        void *new_data = realloc(priv->data, size);
-        if (!new_data) {
+        // The capacity is kept when shrinking so the buffer can be reused
+        if (size > priv->capacity
+                && !set_capacity(priv, static_cast<size_t>(size))) {
             set_error(std::error_code(errno, std::generic_category()),
                       "Failed to resize buffer");
             return false;
         }
 
-        // Zero-initialize new space
-        if (size > priv->size) {
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   size - priv->size);
-        }
+        set_size(priv, static_cast<size_t>(size));
+    }
 
-        priv->data = new_data;
-        priv->size = size;
-        if (priv->data_ptr) {
-            *priv->data_ptr = priv->data;
-        }
-        if (priv->size_ptr) {
-            *priv->size_ptr = priv->size;
+    return true;
+}
+
+bool MemoryFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read)
+{
+    MB_PRIVATE(MemoryFile);
+
+    size_t to_read = 0;
+    if (offset < priv->size) {
+        to_read = std::min<size_t>(priv->size - offset, size);
+        memcpy(buf, static_cast<char *>(priv->data) + offset, to_read);
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MemoryFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (offset > SIZE_MAX - size) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Write would overflow size_t");
+        return false;
+    }
+
+    size_t pos = static_cast<size_t>(offset);
+    size_t desired_size = pos + size;
+    size_t to_write = size;
+
+    if (desired_size > priv->size) {
+        if (priv->fixed_size) {
+            to_write = pos <= priv->size ? priv->size - pos : 0;
+        } else {
+            // Enlarge buffer
+            if (!ensure_capacity(priv, desired_size)) {
+                set_error(std::error_code(errno, std::generic_category()),
+                          "Failed to enlarge buffer");
+                return false;
+            }
+
+            // Only the gap between the old end of file and the write offset
+            // needs to be zero-initialized
+            set_size(priv, pos);
+            priv->size = desired_size;
+            if (priv->size_ptr) {
+                *priv->size_ptr = priv->size;
+            }
         }
     }
 
+    memcpy(static_cast<char *>(priv->data) + pos, buf, to_write);
+
+    bytes_written = to_write;
+    return true;
+}
+
+bool MemoryFile::on_peek(const void *&buf, size_t &size)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (priv->pos < priv->size) {
+        buf = static_cast<const char *>(priv->data) + priv->pos;
+        size = priv->size - priv->pos;
+    } else {
+        buf = nullptr;
+        size = 0;
+    }
+
+    return true;
+}
+
+bool MemoryFile::on_consume(size_t size)
+{
+    MB_PRIVATE(MemoryFile);
+
+    size_t available = priv->pos < priv->size ? priv->size - priv->pos : 0;
+
+    if (size > available) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Cannot consume more than the available %" MB_PRIzu
+                  " bytes", available);
+        return false;
+    }
+
+    priv->pos += size;
     return true;
 }
 
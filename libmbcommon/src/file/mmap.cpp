@@ -0,0 +1,613 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/mmap.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/locale.h"
+#include "mbcommon/string.h"
+
+#include "mbcommon/file/mmap_p.h"
+
+/*!
+ * \file mbcommon/file/mmap.h
+ * \brief Open file as a read-only memory mapping
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+struct RealMmapFileFuncs : public MmapFileFuncs
+{
+    virtual int fn_open(const char *path, int flags, mode_t mode) override
+    {
+        return ::open(path, flags, mode);
+    }
+
+    virtual void * fn_mmap64(void *addr, size_t length, int prot, int flags,
+                             int fd, off64_t offset) override
+    {
+        return mmap64(addr, length, prot, flags, fd, offset);
+    }
+
+    virtual int fn_munmap(void *addr, size_t length) override
+    {
+        return munmap(addr, length);
+    }
+
+    virtual int fn_fstat(int fildes, struct stat *buf) override
+    {
+        return fstat(fildes, buf);
+    }
+
+    virtual off64_t fn_lseek64(int fd, off64_t offset, int whence) override
+    {
+        return lseek64(fd, offset, whence);
+    }
+
+    virtual int fn_close(int fd) override
+    {
+        return ::close(fd);
+    }
+
+    virtual long fn_page_size() override
+    {
+        return sysconf(_SC_PAGESIZE);
+    }
+};
+/*! \endcond */
+
+static RealMmapFileFuncs g_default_funcs;
+
+/*! \cond INTERNAL */
+
+MmapFilePrivate::MmapFilePrivate()
+    : MmapFilePrivate(&g_default_funcs)
+{
+}
+
+MmapFilePrivate::MmapFilePrivate(MmapFileFuncs *funcs)
+    : funcs(funcs)
+{
+    clear();
+}
+
+MmapFilePrivate::~MmapFilePrivate()
+{
+}
+
+void MmapFilePrivate::clear()
+{
+    fd = -1;
+    owned = false;
+    filename.clear();
+    offset = 0;
+    size = 0;
+    map_addr = nullptr;
+    map_size = 0;
+    data = nullptr;
+    data_size = 0;
+    pos = 0;
+}
+
+/*! \endcond */
+
+/*!
+ * \class MmapFile
+ *
+ * \brief Open file as a read-only memory mapping.
+ *
+ * The whole file, or a window of it, is mapped into memory when the handle is
+ * opened. Reads and seeks are served directly from the mapping without any
+ * further system calls. The mapped bytes can be accessed without copying by
+ * calling mapped_data().
+ *
+ * Writing and truncation are not supported.
+ *
+ * The file must not be truncated by another process while it is mapped.
+ * Otherwise, accessing the pages beyond the new end of the file will result in
+ * `SIGBUS`.
+ */
+
+/*!
+ * \brief Construct unbound MmapFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+MmapFile::MmapFile()
+    : MmapFile(new MmapFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(int, bool)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ */
+MmapFile::MmapFile(int fd, bool owned)
+    : MmapFile(new MmapFilePrivate(), fd, owned)
+{
+}
+
+/*!
+ * \brief Open File handle from a multi-byte filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &)
+ *
+ * \param filename MBS filename
+ */
+MmapFile::MmapFile(const std::string &filename)
+    : MmapFile(new MmapFilePrivate(), filename)
+{
+}
+
+/*!
+ * \brief Open File handle from a wide-character filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::wstring &)
+ *
+ * \param filename WCS filename
+ */
+MmapFile::MmapFile(const std::wstring &filename)
+    : MmapFile(new MmapFilePrivate(), filename)
+{
+}
+
+/*! \cond INTERNAL */
+
+MmapFile::MmapFile(MmapFilePrivate *priv)
+    : File(priv)
+{
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   int fd, bool owned)
+    : File(priv)
+{
+    open(fd, owned);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::string &filename)
+    : File(priv)
+{
+    open(filename);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::wstring &filename)
+    : File(priv)
+{
+    open(filename);
+}
+
+/*! \endcond */
+
+MmapFile::~MmapFile()
+{
+    close();
+}
+
+/*!
+ * \brief Map the whole file from a file descriptor.
+ *
+ * \sa open(int, bool, uint64_t, uint64_t)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(int fd, bool owned)
+{
+    return open(fd, owned, 0, 0);
+}
+
+/*!
+ * \brief Map a window of a file from a file descriptor.
+ *
+ * If \p owned is true, then the File handle will take ownership of the file
+ * descriptor. In other words, the file descriptor will be closed when the
+ * File handle is closed. The file descriptor must be opened for reading.
+ *
+ * The window does not need to be page-aligned. Offset 0 of the File handle
+ * corresponds to offset \p offset of the underlying file. If the window
+ * extends past the end of the file, it will be truncated to the file size.
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ * \param offset Starting offset of the window
+ * \param size Size of the window or 0 to map until the end of the file
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(int fd, bool owned, uint64_t offset, uint64_t size)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = fd;
+        priv->owned = owned;
+        priv->filename.clear();
+        priv->offset = offset;
+        priv->size = size;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Map the whole file from a multi-byte filename.
+ *
+ * \sa open(const std::string &, uint64_t, uint64_t)
+ *
+ * \param filename MBS filename
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::string &filename)
+{
+    return open(filename, 0, 0);
+}
+
+/*!
+ * \brief Map a window of a file from a multi-byte filename.
+ *
+ * \p filename is directly passed to `open()`. See
+ * open(int, bool, uint64_t, uint64_t) for the semantics of \p offset and
+ * \p size.
+ *
+ * \param filename MBS filename
+ * \param offset Starting offset of the window
+ * \param size Size of the window or 0 to map until the end of the file
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::string &filename, uint64_t offset,
+                    uint64_t size)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = -1;
+        priv->owned = true;
+        priv->filename = filename;
+        priv->offset = offset;
+        priv->size = size;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Map the whole file from a wide-character filename.
+ *
+ * \sa open(const std::wstring &, uint64_t, uint64_t)
+ *
+ * \param filename WCS filename
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::wstring &filename)
+{
+    return open(filename, 0, 0);
+}
+
+/*!
+ * \brief Map a window of a file from a wide-character filename.
+ *
+ * \p filename is converted to MBS using wcs_to_mbs() before being passed to
+ * `open()`. See open(int, bool, uint64_t, uint64_t) for the semantics of
+ * \p offset and \p size.
+ *
+ * \param filename WCS filename
+ * \param offset Starting offset of the window
+ * \param size Size of the window or 0 to map until the end of the file
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::wstring &filename, uint64_t offset,
+                    uint64_t size)
+{
+    std::string mbs_filename;
+    if (!wcs_to_mbs(mbs_filename, filename)) {
+        set_error(make_error_code(FileError::CannotConvertEncoding),
+                  "Failed to convert WCS filename to MBS");
+        return false;
+    }
+
+    return open(mbs_filename, offset, size);
+}
+
+/*!
+ * \brief Get pointer to the mapped data.
+ *
+ * The returned buffer is valid until the File handle is closed. It covers the
+ * entire window, regardless of the current file position. If the window is
+ * empty, \p data is set to NULL and \p size is set to 0.
+ *
+ * \param[out] data Pointer to the first byte of the window
+ * \param[out] size Size of the window
+ *
+ * \return Whether the file is open and the data pointer was retrieved
+ */
+bool MmapFile::mapped_data(const void *&data, size_t &size)
+{
+    MB_PRIVATE(MmapFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    }
+
+    data = priv->data;
+    size = priv->data_size;
+    return true;
+}
+
+bool MmapFile::on_open()
+{
+    MB_PRIVATE(MmapFile);
+
+    if (!priv->filename.empty()) {
+        priv->fd = priv->funcs->fn_open(
+                priv->filename.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (priv->fd < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to open file");
+            return false;
+        }
+    }
+
+    struct stat sb;
+
+    if (priv->funcs->fn_fstat(priv->fd, &sb) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to stat file");
+        return false;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        set_error(std::make_error_code(std::errc::is_a_directory),
+                  "Failed to open file");
+        return false;
+    }
+
+    uint64_t file_size;
+
+    if (S_ISREG(sb.st_mode)) {
+        file_size = static_cast<uint64_t>(sb.st_size);
+    } else {
+        // Block devices report a size of 0 in st_size
+        off64_t end = priv->funcs->fn_lseek64(priv->fd, 0, SEEK_END);
+        if (end < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to get file size");
+            return false;
+        }
+        file_size = static_cast<uint64_t>(end);
+    }
+
+    if (priv->offset > file_size) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Window offset %" PRIu64 " exceeds file size %" PRIu64,
+                  priv->offset, file_size);
+        return false;
+    }
+
+    uint64_t window_size = file_size - priv->offset;
+    if (priv->size != 0) {
+        window_size = std::min(window_size, priv->size);
+    }
+
+    if (window_size == 0) {
+        // Nothing to map. mmap() does not permit zero-length mappings.
+        return true;
+    }
+
+    long page_size = priv->funcs->fn_page_size();
+    if (page_size <= 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to get page size");
+        return false;
+    }
+
+    uint64_t aligned_offset =
+            priv->offset / static_cast<uint64_t>(page_size)
+            * static_cast<uint64_t>(page_size);
+    uint64_t delta = priv->offset - aligned_offset;
+
+    if (window_size > SIZE_MAX - delta) {
+        set_error(make_error_code(FileError::IntegerOverflow),
+                  "Window size %" PRIu64 " does not fit in address space",
+                  window_size);
+        return false;
+    }
+
+    size_t map_size = static_cast<size_t>(window_size + delta);
+
+    void *addr = priv->funcs->fn_mmap64(nullptr, map_size, PROT_READ,
+                                        MAP_PRIVATE, priv->fd,
+                                        static_cast<off64_t>(aligned_offset));
+    if (addr == MAP_FAILED) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to map file");
+        return false;
+    }
+
+    priv->map_addr = addr;
+    priv->map_size = map_size;
+    priv->data = static_cast<const char *>(addr) + delta;
+    priv->data_size = static_cast<size_t>(window_size);
+
+    return true;
+}
+
+bool MmapFile::on_close()
+{
+    MB_PRIVATE(MmapFile);
+
+    bool ret = true;
+
+    if (priv->map_addr
+            && priv->funcs->fn_munmap(priv->map_addr, priv->map_size) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to unmap file");
+        ret = false;
+    }
+
+    if (priv->owned && priv->fd >= 0 && priv->funcs->fn_close(priv->fd) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to close file");
+        ret = false;
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool MmapFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    if (!on_read_at(priv->pos, buf, size, bytes_read)) {
+        return false;
+    }
+
+    priv->pos += bytes_read;
+    return true;
+}
+
+bool MmapFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(MmapFile);
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0 || static_cast<uint64_t>(offset) > SIZE_MAX) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        new_offset = priv->pos = offset;
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->pos)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" MB_PRIzu, offset, priv->pos);
+            return false;
+        }
+        new_offset = priv->pos += offset;
+        break;
+    case SEEK_END:
+        if ((offset < 0 && static_cast<size_t>(-offset) > priv->data_size)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->data_size)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_END offset %" PRId64
+                      " for file of size %" MB_PRIzu, offset,
+                      priv->data_size);
+            return false;
+        }
+        new_offset = priv->pos = priv->data_size + offset;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    return true;
+}
+
+bool MmapFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                          size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t to_read = 0;
+    if (offset < priv->data_size) {
+        to_read = std::min<size_t>(priv->data_size - offset, size);
+        memcpy(buf, priv->data + offset, to_read);
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MmapFile::on_peek(const void *&buf, size_t &size)
+{
+    MB_PRIVATE(MmapFile);
+
+    if (priv->pos < priv->data_size) {
+        buf = priv->data + priv->pos;
+        size = priv->data_size - priv->pos;
+    } else {
+        buf = nullptr;
+        size = 0;
+    }
+
+    return true;
+}
+
+bool MmapFile::on_consume(size_t size)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t available = priv->pos < priv->data_size ? priv->data_size - priv->pos : 0;
+
+    if (size > available) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Cannot consume more than the available %" MB_PRIzu
+                  " bytes", available);
+        return false;
+    }
+
+    priv->pos += size;
+    return true;
+}
+
+}
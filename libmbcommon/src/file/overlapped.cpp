@@ -0,0 +1,889 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/overlapped.h"
+
+#include <algorithm>
+
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#include "mbcommon/file/overlapped_p.h"
+
+// Synchronous reads and writes smaller than this are done with one request
+#define MIN_SPLIT_CHUNK_SIZE    (128 * 1024)
+
+/*!
+ * \file mbcommon/file/overlapped.h
+ * \brief Open file with Win32 overlapped I/O
+ */
+
+namespace mb
+{
+
+// Largest size of a single request. This is a multiple of the unbuffered I/O
+// alignment so that splitting an aligned buffer results in aligned chunks.
+static constexpr DWORD MAX_REQUEST_SIZE =
+        UINT_MAX & ~static_cast<DWORD>(OverlappedFile::UNBUFFERED_ALIGNMENT - 1);
+
+/*! \cond INTERNAL */
+
+OverlappedFilePrivate::OverlappedFilePrivate()
+{
+    queue_depth = OverlappedFile::DEFAULT_QUEUE_DEPTH;
+    unbuffered = false;
+    clear_queue();
+}
+
+OverlappedFilePrivate::OverlappedFilePrivate(Win32FileFuncs *funcs)
+    : Win32FilePrivate(funcs)
+{
+    queue_depth = OverlappedFile::DEFAULT_QUEUE_DEPTH;
+    unbuffered = false;
+    clear_queue();
+}
+
+OverlappedFilePrivate::~OverlappedFilePrivate()
+{
+}
+
+void OverlappedFilePrivate::clear_queue()
+{
+    slots.clear();
+    free_slots.clear();
+    in_flight = 0;
+    position = 0;
+}
+
+/*! \endcond */
+
+constexpr unsigned int OverlappedFile::DEFAULT_QUEUE_DEPTH;
+constexpr size_t OverlappedFile::UNBUFFERED_ALIGNMENT;
+
+/*!
+ * \brief Start a positional read or write
+ *
+ * \param[out] index Slot used by the request
+ *
+ * \return `ERROR_SUCCESS` if the request was started or the Win32 error code
+ *         if it failed
+ */
+static DWORD start_request(OverlappedFilePrivate *priv, bool write,
+                           uint64_t offset, const void *buf, DWORD size,
+                           uint64_t user_data, unsigned int &index)
+{
+    unsigned int i = priv->free_slots.back();
+    auto &slot = priv->slots[i];
+
+    memset(&slot.ov, 0, sizeof(slot.ov));
+    slot.ov.Offset = static_cast<DWORD>(offset);
+    slot.ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    slot.ov.hEvent = slot.event;
+    slot.user_data = user_data;
+    slot.eof = false;
+
+    // The number of bytes transferred is retrieved with GetOverlappedResult()
+    // because the output parameter is not reliable for overlapped requests
+    BOOL ret;
+    if (write) {
+        ret = priv->funcs->fn_WriteFile(priv->handle, buf, size, nullptr,
+                                        &slot.ov);
+    } else {
+        ret = priv->funcs->fn_ReadFile(priv->handle, const_cast<void *>(buf),
+                                       size, nullptr, &slot.ov);
+    }
+
+    if (!ret) {
+        DWORD error = GetLastError();
+
+        if (!write && error == ERROR_HANDLE_EOF) {
+            slot.eof = true;
+        } else if (error != ERROR_IO_PENDING) {
+            return error;
+        }
+    }
+
+    priv->free_slots.pop_back();
+    slot.busy = true;
+    index = i;
+
+    return ERROR_SUCCESS;
+}
+
+/*!
+ * \brief Wait for a request to complete and release its slot
+ *
+ * \param[out] bytes_transferred Number of bytes read or written
+ *
+ * \return `ERROR_SUCCESS` if the request succeeded or the Win32 error code if
+ *         it failed
+ */
+static DWORD finish_request(OverlappedFilePrivate *priv, unsigned int index,
+                            size_t &bytes_transferred)
+{
+    auto &slot = priv->slots[index];
+    DWORD error = ERROR_SUCCESS;
+    DWORD n = 0;
+
+    if (!slot.eof && !priv->funcs->fn_GetOverlappedResult(
+            priv->handle, &slot.ov, &n, TRUE)) {
+        error = GetLastError();
+
+        // Reads that start past the end of the file may fail asynchronously
+        if (error == ERROR_HANDLE_EOF) {
+            error = ERROR_SUCCESS;
+            n = 0;
+        }
+    }
+
+    slot.busy = false;
+    slot.eof = false;
+    priv->free_slots.push_back(index);
+
+    bytes_transferred = n;
+    return error;
+}
+
+/*!
+ * \brief Wait for any asynchronous request to complete
+ *
+ * The request's slot is not released.
+ *
+ * \param[out] index Slot of the completed request
+ *
+ * \return `ERROR_SUCCESS` if a request completed or the Win32 error code if
+ *         waiting failed
+ */
+static DWORD wait_any(OverlappedFilePrivate *priv, unsigned int &index)
+{
+    HANDLE events[MAXIMUM_WAIT_OBJECTS];
+    unsigned int indexes[MAXIMUM_WAIT_OBJECTS];
+    DWORD count = 0;
+
+    for (unsigned int i = 0; i < priv->slots.size(); ++i) {
+        auto &slot = priv->slots[i];
+
+        if (!slot.busy) {
+            continue;
+        } else if (slot.eof) {
+            index = i;
+            return ERROR_SUCCESS;
+        }
+
+        events[count] = slot.event;
+        indexes[count] = i;
+        ++count;
+    }
+
+    DWORD ret = priv->funcs->fn_WaitForMultipleObjects(
+            count, events, FALSE, INFINITE);
+
+    if (ret - WAIT_OBJECT_0 < count) {
+        index = indexes[ret - WAIT_OBJECT_0];
+        return ERROR_SUCCESS;
+    } else if (ret == WAIT_FAILED) {
+        return GetLastError();
+    } else {
+        return ERROR_INVALID_HANDLE;
+    }
+}
+
+/*!
+ * \brief Perform a positional read or write with one request
+ *
+ * \return `ERROR_SUCCESS` if the operation succeeded or the Win32 error code
+ *         if it failed
+ */
+static DWORD single_rw(OverlappedFilePrivate *priv, bool write,
+                       uint64_t offset, const void *buf, size_t size,
+                       size_t &bytes_transferred)
+{
+    unsigned int index;
+
+    DWORD error = start_request(
+            priv, write, offset, buf,
+            static_cast<DWORD>(std::min<size_t>(size, MAX_REQUEST_SIZE)), 0,
+            index);
+    if (error != ERROR_SUCCESS) {
+        return error;
+    }
+
+    return finish_request(priv, index, bytes_transferred);
+}
+
+/*!
+ * \brief Perform a large positional read or write with multiple requests
+ *
+ * The buffer is split into up to `queue_depth` chunks that are in flight
+ * together. The result is the number of bytes transferred contiguously from
+ * the beginning of the buffer.
+ *
+ * \return `ERROR_SUCCESS` if the operation succeeded or the Win32 error code
+ *         if it failed
+ */
+static DWORD split_rw(OverlappedFilePrivate *priv, bool write,
+                      uint64_t offset, const void *buf, size_t size,
+                      size_t &bytes_transferred)
+{
+    size = static_cast<size_t>(std::min<uint64_t>(
+            size, static_cast<uint64_t>(MAX_REQUEST_SIZE) * priv->queue_depth));
+
+    size_t n_chunks = std::min<size_t>(priv->queue_depth,
+                                       size / MIN_SPLIT_CHUNK_SIZE);
+    size_t chunk_size = (size + n_chunks - 1) / n_chunks;
+
+    if (priv->unbuffered) {
+        // Only the size of the last chunk may be unaligned. It is aligned too
+        // since unbuffered requests must be a multiple of the alignment.
+        chunk_size = (chunk_size + OverlappedFile::UNBUFFERED_ALIGNMENT - 1)
+                & ~(OverlappedFile::UNBUFFERED_ALIGNMENT - 1);
+        n_chunks = (size + chunk_size - 1) / chunk_size;
+    }
+
+    unsigned int indexes[MAXIMUM_WAIT_OBJECTS];
+    size_t results[MAXIMUM_WAIT_OBJECTS];
+    DWORD errors[MAXIMUM_WAIT_OBJECTS];
+    size_t started = 0;
+    DWORD error = ERROR_SUCCESS;
+
+    for (; started < n_chunks; ++started) {
+        size_t chunk_offset = started * chunk_size;
+        size_t len = std::min(chunk_size, size - chunk_offset);
+
+        error = start_request(
+                priv, write, offset + chunk_offset,
+                static_cast<const char *>(buf) + chunk_offset,
+                static_cast<DWORD>(len), 0, indexes[started]);
+        if (error != ERROR_SUCCESS) {
+            break;
+        }
+    }
+
+    // Requests that were started must complete before the buffer can be
+    // released, even if starting a later one failed
+    for (size_t i = 0; i < started; ++i) {
+        errors[i] = finish_request(priv, indexes[i], results[i]);
+    }
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < started; ++i) {
+        size_t len = std::min(chunk_size, size - i * chunk_size);
+
+        if (errors[i] != ERROR_SUCCESS) {
+            if (total > 0) {
+                // Report partial success
+                break;
+            }
+            return errors[i];
+        }
+
+        total += results[i];
+
+        if (results[i] < len) {
+            break;
+        }
+    }
+
+    if (total == 0 && error != ERROR_SUCCESS) {
+        return error;
+    }
+
+    bytes_transferred = total;
+    return ERROR_SUCCESS;
+}
+
+/*!
+ * \brief Whether a synchronous operation should be split into multiple
+ *        requests
+ */
+static bool should_split(OverlappedFilePrivate *priv, size_t size)
+{
+    return priv->in_flight == 0 && priv->queue_depth > 1
+            && size >= 2 * MIN_SPLIT_CHUNK_SIZE;
+}
+
+/*!
+ * \brief Check if an offset, buffer, and size can be used for unbuffered I/O
+ */
+static bool is_aligned(OverlappedFilePrivate *priv, uint64_t offset,
+                       const void *buf, size_t size)
+{
+    constexpr size_t mask = OverlappedFile::UNBUFFERED_ALIGNMENT - 1;
+
+    return !priv->unbuffered || ((offset & mask) == 0
+            && (reinterpret_cast<uintptr_t>(buf) & mask) == 0
+            && (size & mask) == 0);
+}
+
+/*!
+ * \class OverlappedFile
+ *
+ * \brief Open file using Win32 overlapped I/O.
+ *
+ * OverlappedFile behaves like Win32File, except that the file is opened with
+ * `FILE_FLAG_OVERLAPPED` and large reads and writes are split into multiple
+ * requests that are in flight simultaneously. This keeps the storage device
+ * busy while the file system processes each request, which greatly improves
+ * throughput for large sequential copies.
+ *
+ * In addition, the asynchronous API (submit_read(), submit_write(), and
+ * wait()) can be used to overlap I/O with other work, such as decompression.
+ * Synchronous operations can be performed while asynchronous requests are in
+ * flight, but they will not be split into multiple requests.
+ *
+ * If unbuffered I/O is enabled, the file is opened with
+ * `FILE_FLAG_NO_BUFFERING` and data bypasses the system cache. In this mode,
+ * all file offsets, buffer addresses, and sizes must be multiples of
+ * \ref UNBUFFERED_ALIGNMENT. Otherwise, the operation fails with
+ * FileError::InvalidArgument. Writes can only extend the file in multiples of
+ * the alignment, so truncate() should be used to set the final size.
+ *
+ * \note OverlappedFile is only available on Windows.
+ */
+
+/*!
+ * \var OverlappedFile::DEFAULT_QUEUE_DEPTH
+ *
+ * \brief Default maximum number of requests in flight
+ */
+
+/*!
+ * \var OverlappedFile::UNBUFFERED_ALIGNMENT
+ *
+ * \brief Required alignment for unbuffered I/O
+ *
+ * This is a multiple of the sector size of all common storage devices.
+ */
+
+/*!
+ * \brief Construct unbound OverlappedFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+OverlappedFile::OverlappedFile()
+    : OverlappedFile(new OverlappedFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle from a multi-byte filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &, FileOpenMode, unsigned int, bool)
+ *
+ * \param filename MBS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight
+ * \param unbuffered Whether to bypass the system cache
+ */
+OverlappedFile::OverlappedFile(const std::string &filename, FileOpenMode mode,
+                               unsigned int queue_depth, bool unbuffered)
+    : OverlappedFile(new OverlappedFilePrivate())
+{
+    open(filename, mode, queue_depth, unbuffered);
+}
+
+/*!
+ * \brief Open File handle from a wide-character filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::wstring &, FileOpenMode, unsigned int, bool)
+ *
+ * \param filename WCS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight
+ * \param unbuffered Whether to bypass the system cache
+ */
+OverlappedFile::OverlappedFile(const std::wstring &filename, FileOpenMode mode,
+                               unsigned int queue_depth, bool unbuffered)
+    : OverlappedFile(new OverlappedFilePrivate())
+{
+    open(filename, mode, queue_depth, unbuffered);
+}
+
+/*! \cond INTERNAL */
+
+OverlappedFile::OverlappedFile(OverlappedFilePrivate *priv)
+    : Win32File(priv)
+{
+}
+
+/*! \endcond */
+
+OverlappedFile::~OverlappedFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open from a multi-byte filename.
+ *
+ * \sa Win32File::open(const std::string &, FileOpenMode)
+ *
+ * \param filename MBS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight (must be between 1
+ *                    and `MAXIMUM_WAIT_OBJECTS`)
+ * \param unbuffered Whether to bypass the system cache
+ *
+ * \return Whether the file is successfully opened
+ */
+bool OverlappedFile::open(const std::string &filename, FileOpenMode mode,
+                          unsigned int queue_depth, bool unbuffered)
+{
+    MB_PRIVATE(OverlappedFile);
+    if (priv) {
+        priv->queue_depth = queue_depth;
+        priv->unbuffered = unbuffered;
+    }
+    return Win32File::open(filename, mode);
+}
+
+/*!
+ * \brief Open from a wide-character filename.
+ *
+ * \sa Win32File::open(const std::wstring &, FileOpenMode)
+ *
+ * \param filename WCS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight (must be between 1
+ *                    and `MAXIMUM_WAIT_OBJECTS`)
+ * \param unbuffered Whether to bypass the system cache
+ *
+ * \return Whether the file is successfully opened
+ */
+bool OverlappedFile::open(const std::wstring &filename, FileOpenMode mode,
+                          unsigned int queue_depth, bool unbuffered)
+{
+    MB_PRIVATE(OverlappedFile);
+    if (priv) {
+        priv->queue_depth = queue_depth;
+        priv->unbuffered = unbuffered;
+    }
+    return Win32File::open(filename, mode);
+}
+
+/*!
+ * \brief Get number of asynchronous requests that have not been waited for
+ *
+ * \return Number of requests in flight
+ */
+size_t OverlappedFile::in_flight()
+{
+    MB_PRIVATE(OverlappedFile);
+    return priv->in_flight;
+}
+
+/*!
+ * \brief Submit asynchronous positional read
+ *
+ * The read is started immediately. \p buf must remain valid until the
+ * corresponding wait() call returns. The file position is not changed.
+ *
+ * \param offset File offset to read from
+ * \param buf Buffer to read into
+ * \param size Size of buffer
+ * \param user_data Value returned by wait() when the request completes
+ *
+ * \return Whether the request was submitted. If the queue is full, the error
+ *         is set to `std::errc::resource_unavailable_try_again`.
+ */
+bool OverlappedFile::submit_read(uint64_t offset, void *buf, size_t size,
+                                 uint64_t user_data)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    } else if (priv->in_flight >= priv->queue_depth) {
+        set_error(std::make_error_code(
+                          std::errc::resource_unavailable_try_again),
+                  "%s: Submission queue is full", __func__);
+        return false;
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    } else if (!is_aligned(priv, offset, buf, size)) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Unaligned unbuffered read");
+        return false;
+    }
+
+    unsigned int index;
+
+    DWORD error = start_request(
+            priv, false, offset, buf,
+            static_cast<DWORD>(std::min<size_t>(size, MAX_REQUEST_SIZE)),
+            user_data, index);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to submit read request");
+        return false;
+    }
+
+    ++priv->in_flight;
+    return true;
+}
+
+/*!
+ * \brief Submit asynchronous positional write
+ *
+ * The write is started immediately. \p buf must remain valid until the
+ * corresponding wait() call returns. The file position is not changed.
+ *
+ * \param offset File offset to write to
+ * \param buf Buffer to write from
+ * \param size Size of buffer
+ * \param user_data Value returned by wait() when the request completes
+ *
+ * \return Whether the request was submitted. If the queue is full, the error
+ *         is set to `std::errc::resource_unavailable_try_again`.
+ */
+bool OverlappedFile::submit_write(uint64_t offset, const void *buf,
+                                  size_t size, uint64_t user_data)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    } else if (priv->in_flight >= priv->queue_depth) {
+        set_error(std::make_error_code(
+                          std::errc::resource_unavailable_try_again),
+                  "%s: Submission queue is full", __func__);
+        return false;
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    } else if (!is_aligned(priv, offset, buf, size)) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Unaligned unbuffered write");
+        return false;
+    }
+
+    unsigned int index;
+
+    DWORD error = start_request(
+            priv, true, offset, buf,
+            static_cast<DWORD>(std::min<size_t>(size, MAX_REQUEST_SIZE)),
+            user_data, index);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to submit write request");
+        return false;
+    }
+
+    ++priv->in_flight;
+    return true;
+}
+
+/*!
+ * \brief Wait for an asynchronous request to complete
+ *
+ * Requests may complete in any order.
+ *
+ * \param[out] user_data User data of the completed request
+ * \param[out] bytes_transferred Number of bytes read or written. A short read
+ *                               indicates end of file.
+ *
+ * \return Whether the request completed successfully. If the request failed,
+ *         \p user_data is still set and the error is set to the request's
+ *         error.
+ */
+bool OverlappedFile::wait(uint64_t &user_data, size_t &bytes_transferred)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (!is_open() || priv->in_flight == 0) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: No requests in flight", __func__);
+        return false;
+    }
+
+    unsigned int index;
+
+    DWORD error = wait_any(priv, index);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to wait for completion");
+        return false;
+    }
+
+    user_data = priv->slots[index].user_data;
+    --priv->in_flight;
+
+    error = finish_request(priv, index, bytes_transferred);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Asynchronous request failed");
+        return false;
+    }
+
+    return true;
+}
+
+bool OverlappedFile::on_open()
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (priv->queue_depth == 0 || priv->queue_depth > MAXIMUM_WAIT_OBJECTS) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid queue depth: %u", priv->queue_depth);
+        return false;
+    }
+
+    priv->attrib |= FILE_FLAG_OVERLAPPED;
+    if (priv->unbuffered) {
+        // The hint has no effect when the cache is bypassed
+        priv->attrib &= ~static_cast<DWORD>(FILE_FLAG_SEQUENTIAL_SCAN);
+        priv->attrib |= FILE_FLAG_NO_BUFFERING;
+    }
+
+    if (!Win32File::on_open()) {
+        return false;
+    }
+
+    priv->slots.resize(priv->queue_depth + 1);
+    priv->free_slots.reserve(priv->slots.size());
+
+    for (unsigned int i = 0; i < priv->slots.size(); ++i) {
+        auto &slot = priv->slots[i];
+
+        slot.busy = false;
+        slot.eof = false;
+        slot.event = priv->funcs->fn_CreateEventW(nullptr, TRUE, FALSE,
+                                                  nullptr);
+        if (!slot.event) {
+            set_error(std::error_code(GetLastError(), std::system_category()),
+                      "Failed to create event");
+            return false;
+        }
+
+        priv->free_slots.push_back(i);
+    }
+
+    return true;
+}
+
+bool OverlappedFile::on_close()
+{
+    MB_PRIVATE(OverlappedFile);
+
+    // Abandoned requests must finish before their OVERLAPPED structures can be
+    // freed
+    if (priv->in_flight > 0) {
+        priv->funcs->fn_CancelIoEx(priv->handle, nullptr);
+
+        for (unsigned int i = 0; i < priv->slots.size(); ++i) {
+            if (priv->slots[i].busy) {
+                size_t n;
+                finish_request(priv, i, n);
+            }
+        }
+    }
+
+    for (auto const &slot : priv->slots) {
+        if (slot.event) {
+            priv->funcs->fn_CloseHandle(slot.event);
+        }
+    }
+
+    priv->clear_queue();
+
+    return Win32File::on_close();
+}
+
+bool OverlappedFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    size_t n;
+
+    if (!on_read_at(priv->position, buf, size, n)) {
+        return false;
+    }
+
+    priv->position += n;
+    bytes_read = n;
+    return true;
+}
+
+bool OverlappedFile::on_write(const void *buf, size_t size,
+                              size_t &bytes_written)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    // There is no native append mode, so seek to the end before every write
+    if (priv->append) {
+        uint64_t pos;
+        if (!on_seek(0, SEEK_END, pos)) {
+            return false;
+        }
+    }
+
+    size_t n;
+
+    if (!on_write_at(priv->position, buf, size, n)) {
+        return false;
+    }
+
+    priv->position += n;
+    bytes_written = n;
+    return true;
+}
+
+bool OverlappedFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    uint64_t base;
+
+    switch (whence) {
+    case SEEK_CUR:
+        base = priv->position;
+        break;
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_END: {
+        LARGE_INTEGER size;
+        if (!priv->funcs->fn_GetFileSizeEx(priv->handle, &size)) {
+            set_error(std::error_code(GetLastError(), std::system_category()),
+                      "Failed to get file size");
+            return false;
+        }
+        base = static_cast<uint64_t>(size.QuadPart);
+        break;
+    }
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    if (offset < 0 ? static_cast<uint64_t>(-(offset + 1)) + 1 > base
+            : static_cast<uint64_t>(offset) > INT64_MAX - base) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset is out of range");
+        return false;
+    }
+
+    priv->position = base + static_cast<uint64_t>(offset);
+    new_offset = priv->position;
+    return true;
+}
+
+bool OverlappedFile::on_truncate(uint64_t size)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (size > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Size exceeds maximum file size");
+        return false;
+    }
+
+    // The handle's file pointer is only used for setting the EOF position, so
+    // it does not need to be restored
+    LARGE_INTEGER pos;
+    pos.QuadPart = static_cast<LONGLONG>(size);
+
+    if (!priv->funcs->fn_SetFilePointerEx(priv->handle, pos, nullptr,
+                                          FILE_BEGIN)) {
+        set_error(std::error_code(GetLastError(), std::system_category()),
+                  "Failed to seek file");
+        return false;
+    }
+
+    if (!priv->funcs->fn_SetEndOfFile(priv->handle)) {
+        set_error(std::error_code(GetLastError(), std::system_category()),
+                  "Failed to set EOF position");
+        return false;
+    }
+
+    return true;
+}
+
+bool OverlappedFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                                size_t &bytes_read)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    } else if (!is_aligned(priv, offset, buf, size)) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Unaligned unbuffered read");
+        return false;
+    }
+
+    DWORD error = should_split(priv, size)
+            ? split_rw(priv, false, offset, buf, size, bytes_read)
+            : single_rw(priv, false, offset, buf, size, bytes_read);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    return true;
+}
+
+bool OverlappedFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                                 size_t &bytes_written)
+{
+    MB_PRIVATE(OverlappedFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    } else if (!is_aligned(priv, offset, buf, size)) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Unaligned unbuffered write");
+        return false;
+    }
+
+    DWORD error = should_split(priv, size)
+            ? split_rw(priv, true, offset, buf, size, bytes_written)
+            : single_rw(priv, true, offset, buf, size, bytes_written);
+    if (error != ERROR_SUCCESS) {
+        set_error(std::error_code(error, std::system_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    return true;
+}
+
+}
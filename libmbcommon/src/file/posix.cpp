@@ -20,6 +20,7 @@
 #include "mbcommon/file/posix.h"
 
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -61,6 +62,11 @@ struct RealPosixFileFuncs : public PosixFileFuncs
         return ferror(stream);
     }
 
+    virtual int fn_fflush(FILE *stream) override
+    {
+        return fflush(stream);
+    }
+
     virtual int fn_fileno(FILE *stream) override
     {
         return fileno(stream);
@@ -105,6 +111,20 @@ struct RealPosixFileFuncs : public PosixFileFuncs
     {
         return ftruncate64(fd, length);
     }
+
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) override
+    {
+        return pread64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) override
+    {
+        return pwrite64(fd, buf, count, offset);
+    }
+#endif
 };
 /*! \endcond */
 
@@ -560,4 +580,111 @@ bool PosixFile::on_truncate(uint64_t size)
     return true;
 }
 
+bool PosixFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+#ifdef _WIN32
+    return File::on_read_at(offset, buf, size, bytes_read);
+#else
+    MB_PRIVATE(PosixFile);
+
+    if (!priv->can_seek) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Seek not supported");
+        return false;
+    }
+
+    int fd = priv->funcs->fn_fileno(priv->fp);
+    if (fd < 0) {
+        return File::on_read_at(offset, buf, size, bytes_read);
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    // Ensure that buffered writes are visible to pread()
+    if (priv->funcs->fn_fflush(priv->fp) != 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to flush file");
+        return false;
+    }
+
+    ssize_t n = priv->funcs->fn_pread64(fd, buf, size,
+                                        static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool PosixFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+#ifdef _WIN32
+    return File::on_write_at(offset, buf, size, bytes_written);
+#else
+    MB_PRIVATE(PosixFile);
+
+    if (!priv->can_seek) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Seek not supported");
+        return false;
+    }
+
+    int fd = priv->funcs->fn_fileno(priv->fp);
+    if (fd < 0) {
+        return File::on_write_at(offset, buf, size, bytes_written);
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    // Ensure that buffered writes do not overwrite the new data later
+    if (priv->funcs->fn_fflush(priv->fp) != 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to flush file");
+        return false;
+    }
+
+    ssize_t n = priv->funcs->fn_pwrite64(fd, buf, size,
+                                         static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    // Discard any read-ahead data that may now be stale. Seeking to the
+    // current position does not change the file position.
+    if (priv->funcs->fn_fseeko(priv->fp, 0, SEEK_CUR) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to discard stream buffer");
+        set_fatal(true);
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
 }
@@ -0,0 +1,867 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/uring.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mbcommon/file/uring_p.h"
+
+// Synchronous reads and writes smaller than this are passed directly to FdFile
+#define MIN_SPLIT_CHUNK_SIZE    (128 * 1024)
+
+/*!
+ * \file mbcommon/file/uring.h
+ * \brief Open file with the Linux io_uring API
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+UringFilePrivate::UringFilePrivate()
+{
+    queue_depth = UringFile::DEFAULT_QUEUE_DEPTH;
+    clear_ring();
+}
+
+UringFilePrivate::~UringFilePrivate()
+{
+}
+
+void UringFilePrivate::clear_ring()
+{
+    ring_fd = -1;
+    sq_ring = nullptr;
+    sq_ring_size = 0;
+    sq_head = nullptr;
+    sq_tail = nullptr;
+    sq_mask = nullptr;
+    sq_array = nullptr;
+    sqes = nullptr;
+    sqes_size = 0;
+    cq_ring = nullptr;
+    cq_ring_size = 0;
+    cq_head = nullptr;
+    cq_tail = nullptr;
+    cq_mask = nullptr;
+    cqes = nullptr;
+    slots.clear();
+    free_slots.clear();
+    in_flight = 0;
+    to_submit = 0;
+    append = false;
+}
+
+/*! \endcond */
+
+constexpr unsigned int UringFile::DEFAULT_QUEUE_DEPTH;
+
+static int sys_io_uring_setup(unsigned int entries, io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+static void destroy_ring(UringFilePrivate *priv)
+{
+    if (priv->sqes) {
+        munmap(priv->sqes, priv->sqes_size);
+    }
+    if (priv->cq_ring && priv->cq_ring != priv->sq_ring) {
+        munmap(priv->cq_ring, priv->cq_ring_size);
+    }
+    if (priv->sq_ring) {
+        munmap(priv->sq_ring, priv->sq_ring_size);
+    }
+    if (priv->ring_fd >= 0) {
+        close(priv->ring_fd);
+    }
+
+    priv->clear_ring();
+}
+
+/*!
+ * \brief Set up the submission and completion rings
+ *
+ * \return Whether the rings were set up. `errno` is set on failure.
+ */
+static bool create_ring(UringFilePrivate *priv)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = sys_io_uring_setup(priv->queue_depth, &p);
+    if (fd < 0) {
+        return false;
+    }
+
+    priv->ring_fd = fd;
+
+    priv->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    priv->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        priv->sq_ring_size = priv->cq_ring_size =
+                std::max(priv->sq_ring_size, priv->cq_ring_size);
+    }
+
+    void *sq_ring = mmap(nullptr, priv->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        goto error;
+    }
+    priv->sq_ring = sq_ring;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        priv->cq_ring = sq_ring;
+    } else {
+        void *cq_ring = mmap(nullptr, priv->cq_ring_size,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            goto error;
+        }
+        priv->cq_ring = cq_ring;
+    }
+
+    {
+        size_t sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            goto error;
+        }
+        priv->sqes = static_cast<io_uring_sqe *>(sqes);
+        priv->sqes_size = sqes_size;
+    }
+
+    {
+        auto sq = static_cast<char *>(priv->sq_ring);
+        auto cq = static_cast<char *>(priv->cq_ring);
+
+        priv->sq_head = reinterpret_cast<unsigned int *>(sq + p.sq_off.head);
+        priv->sq_tail = reinterpret_cast<unsigned int *>(sq + p.sq_off.tail);
+        priv->sq_mask = reinterpret_cast<unsigned int *>(
+                sq + p.sq_off.ring_mask);
+        priv->sq_array = reinterpret_cast<unsigned int *>(
+                sq + p.sq_off.array);
+        priv->cq_head = reinterpret_cast<unsigned int *>(cq + p.cq_off.head);
+        priv->cq_tail = reinterpret_cast<unsigned int *>(cq + p.cq_off.tail);
+        priv->cq_mask = reinterpret_cast<unsigned int *>(
+                cq + p.cq_off.ring_mask);
+        priv->cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    }
+
+    priv->slots.resize(priv->queue_depth);
+    priv->free_slots.reserve(priv->queue_depth);
+    for (unsigned int i = priv->queue_depth; i > 0; --i) {
+        priv->free_slots.push_back(i - 1);
+    }
+
+    return true;
+
+error:
+    int saved_errno = errno;
+    destroy_ring(priv);
+    errno = saved_errno;
+    return false;
+}
+
+/*!
+ * \brief Queue a readv/writev request in the submission ring
+ *
+ * \pre A free slot must be available
+ *
+ * \return Slot index
+ */
+static unsigned int queue_request(UringFilePrivate *priv, uint8_t opcode,
+                                  uint64_t offset, const void *buf,
+                                  size_t size, uint64_t user_data)
+{
+    unsigned int slot = priv->free_slots.back();
+    priv->free_slots.pop_back();
+
+    priv->slots[slot].iov.iov_base = const_cast<void *>(buf);
+    priv->slots[slot].iov.iov_len = size;
+    priv->slots[slot].user_data = user_data;
+
+    // Only this thread writes the tail
+    unsigned int tail = *priv->sq_tail;
+    unsigned int index = tail & *priv->sq_mask;
+
+    io_uring_sqe *sqe = &priv->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = priv->fd;
+    sqe->off = offset;
+    sqe->addr = reinterpret_cast<uintptr_t>(&priv->slots[slot].iov);
+    sqe->len = 1;
+    sqe->user_data = slot;
+
+    priv->sq_array[index] = index;
+
+    // Make the SQE visible to the kernel before publishing the new tail
+    __atomic_store_n(priv->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ++priv->to_submit;
+    ++priv->in_flight;
+
+    return slot;
+}
+
+/*!
+ * \brief Pass queued requests to the kernel and optionally wait for completions
+ *
+ * \return Whether the operation succeeded. `errno` is set on failure.
+ */
+static bool enter_ring(UringFilePrivate *priv, unsigned int min_complete)
+{
+    while (priv->to_submit > 0 || min_complete > 0) {
+        int ret = sys_io_uring_enter(
+                priv->ring_fd, priv->to_submit, min_complete,
+                min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        priv->to_submit -= std::min<unsigned int>(
+                static_cast<unsigned int>(ret), priv->to_submit);
+
+        if (min_complete > 0) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Reap a single completion, waiting for one if necessary
+ *
+ * \param[in] priv Private data
+ * \param[out] slot Slot index of the completed request
+ * \param[out] res Result of the request (bytes transferred or -errno)
+ *
+ * \return Whether a completion was reaped. `errno` is set on failure.
+ */
+static bool reap_completion(UringFilePrivate *priv, unsigned int &slot,
+                            int &res)
+{
+    // Only this thread writes the head
+    unsigned int head = *priv->cq_head;
+
+    while (head == __atomic_load_n(priv->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (!enter_ring(priv, 1)) {
+            return false;
+        }
+    }
+
+    io_uring_cqe *cqe = &priv->cqes[head & *priv->cq_mask];
+    slot = static_cast<unsigned int>(cqe->user_data);
+    res = cqe->res;
+
+    __atomic_store_n(priv->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    priv->free_slots.push_back(slot);
+    --priv->in_flight;
+
+    return true;
+}
+
+/*!
+ * \brief Perform a large positional read or write with multiple requests
+ *
+ * The buffer is split into up to `queue_depth` chunks that are submitted
+ * together. The result is the number of bytes transferred contiguously from
+ * the beginning of the buffer.
+ *
+ * \return Whether the operation succeeded. `errno` is set on failure.
+ */
+static bool split_rw(UringFilePrivate *priv, uint8_t opcode, uint64_t offset,
+                     const void *buf, size_t size, size_t &bytes_transferred)
+{
+    size_t n_chunks = std::min<size_t>(priv->queue_depth,
+                                       size / MIN_SPLIT_CHUNK_SIZE);
+    size_t chunk_size = (size + n_chunks - 1) / n_chunks;
+
+    std::vector<int> results(n_chunks);
+    std::vector<unsigned int> chunk_slots(n_chunks);
+
+    for (size_t i = 0; i < n_chunks; ++i) {
+        size_t chunk_offset = i * chunk_size;
+        size_t len = std::min(chunk_size, size - chunk_offset);
+
+        chunk_slots[i] = queue_request(
+                priv, opcode, offset + chunk_offset,
+                static_cast<const char *>(buf) + chunk_offset, len, i);
+    }
+
+    bool ret = enter_ring(priv, 0);
+    int saved_errno = errno;
+
+    // Requests that were queued must be reaped even if submission failed
+    while (priv->in_flight > 0) {
+        unsigned int slot;
+        int res;
+
+        if (!reap_completion(priv, slot, res)) {
+            // The ring is no longer usable
+            saved_errno = errno;
+            destroy_ring(priv);
+            errno = saved_errno;
+            return false;
+        }
+
+        results[priv->slots[slot].user_data] = res;
+    }
+
+    if (!ret) {
+        errno = saved_errno;
+        return false;
+    }
+
+    size_t total = 0;
+
+    for (size_t i = 0; i < n_chunks; ++i) {
+        size_t len = std::min(chunk_size, size - i * chunk_size);
+
+        if (results[i] < 0) {
+            if (total > 0) {
+                // Report partial success
+                break;
+            }
+            errno = -results[i];
+            return false;
+        }
+
+        total += static_cast<size_t>(results[i]);
+
+        if (static_cast<size_t>(results[i]) < len) {
+            break;
+        }
+    }
+
+    bytes_transferred = total;
+    return true;
+}
+
+/*!
+ * \brief Whether a synchronous operation should be split into multiple
+ *        requests
+ */
+static bool should_split(UringFilePrivate *priv, size_t size)
+{
+    return priv->ring_fd >= 0 && priv->in_flight == 0
+            && priv->queue_depth > 1 && size >= 2 * MIN_SPLIT_CHUNK_SIZE;
+}
+
+/*!
+ * \class UringFile
+ *
+ * \brief Open file using the Linux io_uring API.
+ *
+ * UringFile behaves like FdFile, except that large reads and writes are split
+ * into multiple requests that are in flight simultaneously. This allows the
+ * storage device to process multiple requests at once, which greatly improves
+ * throughput for flash storage that performs poorly at a queue depth of 1.
+ *
+ * In addition, the asynchronous API (submit_read(), submit_write(), and
+ * wait()) can be used to overlap I/O with other work, such as decompression.
+ * Synchronous operations can be performed while asynchronous requests are in
+ * flight, but they will not be split into multiple requests.
+ *
+ * If the kernel does not support io_uring, the file is still opened
+ * successfully and all synchronous operations fall back to the FdFile
+ * implementation. Use is_async() to check if the asynchronous API is
+ * available.
+ *
+ * \note UringFile is only available on Linux when libmbcommon is built with
+ *       `MBP_ENABLE_IO_URING` enabled.
+ */
+
+/*!
+ * \var UringFile::DEFAULT_QUEUE_DEPTH
+ *
+ * \brief Default maximum number of requests in flight
+ */
+
+/*!
+ * \brief Construct unbound UringFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+UringFile::UringFile()
+    : UringFile(new UringFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(int, bool, unsigned int)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ * \param queue_depth Maximum number of requests in flight
+ */
+UringFile::UringFile(int fd, bool owned, unsigned int queue_depth)
+    : UringFile(new UringFilePrivate())
+{
+    open(fd, owned, queue_depth);
+}
+
+/*!
+ * \brief Open File handle from a multi-byte filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &, FileOpenMode, unsigned int)
+ *
+ * \param filename MBS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight
+ */
+UringFile::UringFile(const std::string &filename, FileOpenMode mode,
+                     unsigned int queue_depth)
+    : UringFile(new UringFilePrivate())
+{
+    open(filename, mode, queue_depth);
+}
+
+/*!
+ * \brief Open File handle from a wide-character filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::wstring &, FileOpenMode, unsigned int)
+ *
+ * \param filename WCS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight
+ */
+UringFile::UringFile(const std::wstring &filename, FileOpenMode mode,
+                     unsigned int queue_depth)
+    : UringFile(new UringFilePrivate())
+{
+    open(filename, mode, queue_depth);
+}
+
+/*! \cond INTERNAL */
+
+UringFile::UringFile(UringFilePrivate *priv)
+    : FdFile(priv)
+{
+}
+
+/*! \endcond */
+
+UringFile::~UringFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open from file descriptor.
+ *
+ * \sa FdFile::open(int, bool)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ * \param queue_depth Maximum number of requests in flight (must be non-zero)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool UringFile::open(int fd, bool owned, unsigned int queue_depth)
+{
+    MB_PRIVATE(UringFile);
+    if (priv) {
+        priv->queue_depth = queue_depth;
+    }
+    return FdFile::open(fd, owned);
+}
+
+/*!
+ * \brief Open from a multi-byte filename.
+ *
+ * \sa FdFile::open(const std::string &, FileOpenMode)
+ *
+ * \param filename MBS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight (must be non-zero)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool UringFile::open(const std::string &filename, FileOpenMode mode,
+                     unsigned int queue_depth)
+{
+    MB_PRIVATE(UringFile);
+    if (priv) {
+        priv->queue_depth = queue_depth;
+    }
+    return FdFile::open(filename, mode);
+}
+
+/*!
+ * \brief Open from a wide-character filename.
+ *
+ * \sa FdFile::open(const std::wstring &, FileOpenMode)
+ *
+ * \param filename WCS filename
+ * \param mode Open mode (\ref FileOpenMode)
+ * \param queue_depth Maximum number of requests in flight (must be non-zero)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool UringFile::open(const std::wstring &filename, FileOpenMode mode,
+                     unsigned int queue_depth)
+{
+    MB_PRIVATE(UringFile);
+    if (priv) {
+        priv->queue_depth = queue_depth;
+    }
+    return FdFile::open(filename, mode);
+}
+
+/*!
+ * \brief Check whether the asynchronous API is available
+ *
+ * \return Whether the file is open and io_uring is supported by the kernel
+ */
+bool UringFile::is_async()
+{
+    MB_PRIVATE(UringFile);
+    return is_open() && priv->ring_fd >= 0;
+}
+
+/*!
+ * \brief Get number of asynchronous requests that have not been waited for
+ *
+ * \return Number of requests in flight
+ */
+size_t UringFile::in_flight()
+{
+    MB_PRIVATE(UringFile);
+    return priv->in_flight;
+}
+
+/*!
+ * \brief Submit asynchronous positional read
+ *
+ * The read is started immediately. \p buf must remain valid until the
+ * corresponding wait() call returns. The file position is not changed.
+ *
+ * \param offset File offset to read from
+ * \param buf Buffer to read into
+ * \param size Size of buffer
+ * \param user_data Value returned by wait() when the request completes
+ *
+ * \return Whether the request was submitted. If the queue is full, the error
+ *         is set to `std::errc::resource_unavailable_try_again`.
+ */
+bool UringFile::submit_read(uint64_t offset, void *buf, size_t size,
+                            uint64_t user_data)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!is_async()) {
+        set_error(make_error_code(FileError::UnsupportedRead),
+                  "%s: Asynchronous I/O is not available", __func__);
+        return false;
+    } else if (priv->free_slots.empty()) {
+        set_error(std::make_error_code(
+                          std::errc::resource_unavailable_try_again),
+                  "%s: Submission queue is full", __func__);
+        return false;
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    size = std::min<size_t>(size, INT_MAX);
+
+    queue_request(priv, IORING_OP_READV, offset, buf, size, user_data);
+
+    // If submission fails, the SQE remains queued and will be passed to the
+    // kernel by the next call
+    if (!enter_ring(priv, 0)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to submit read request");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Submit asynchronous positional write
+ *
+ * The write is started immediately. \p buf must remain valid until the
+ * corresponding wait() call returns. The file position is not changed.
+ *
+ * \param offset File offset to write to
+ * \param buf Buffer to write from
+ * \param size Size of buffer
+ * \param user_data Value returned by wait() when the request completes
+ *
+ * \return Whether the request was submitted. If the queue is full, the error
+ *         is set to `std::errc::resource_unavailable_try_again`.
+ */
+bool UringFile::submit_write(uint64_t offset, const void *buf, size_t size,
+                             uint64_t user_data)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!is_async()) {
+        set_error(make_error_code(FileError::UnsupportedWrite),
+                  "%s: Asynchronous I/O is not available", __func__);
+        return false;
+    } else if (priv->free_slots.empty()) {
+        set_error(std::make_error_code(
+                          std::errc::resource_unavailable_try_again),
+                  "%s: Submission queue is full", __func__);
+        return false;
+    } else if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    size = std::min<size_t>(size, INT_MAX);
+
+    queue_request(priv, IORING_OP_WRITEV, offset, buf, size, user_data);
+
+    if (!enter_ring(priv, 0)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to submit write request");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for an asynchronous request to complete
+ *
+ * Requests may complete in any order.
+ *
+ * \param[out] user_data User data of the completed request
+ * \param[out] bytes_transferred Number of bytes read or written. A short read
+ *                               indicates end of file.
+ *
+ * \return Whether the request completed successfully. If the request failed,
+ *         \p user_data is still set and the error is set to the request's
+ *         error.
+ */
+bool UringFile::wait(uint64_t &user_data, size_t &bytes_transferred)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!is_async() || priv->in_flight == 0) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: No requests in flight", __func__);
+        return false;
+    }
+
+    unsigned int slot;
+    int res;
+
+    if (!reap_completion(priv, slot, res)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to wait for completion");
+        return false;
+    }
+
+    user_data = priv->slots[slot].user_data;
+
+    if (res < 0) {
+        set_error(std::error_code(-res, std::generic_category()),
+                  "Asynchronous request failed");
+        return false;
+    }
+
+    bytes_transferred = static_cast<size_t>(res);
+    return true;
+}
+
+bool UringFile::on_open()
+{
+    MB_PRIVATE(UringFile);
+
+    if (priv->queue_depth == 0) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Queue depth cannot be zero");
+        return false;
+    }
+
+    if (!FdFile::on_open()) {
+        return false;
+    }
+
+    // Positional writes are not valid for files opened in append mode
+    int fl = fcntl(priv->fd, F_GETFL);
+    priv->append = fl >= 0 && (fl & O_APPEND);
+
+    // Fall back to synchronous I/O if io_uring is not supported
+    create_ring(priv);
+
+    return true;
+}
+
+bool UringFile::on_close()
+{
+    MB_PRIVATE(UringFile);
+
+    // Abandon in-flight requests. Closing the ring cancels them.
+    destroy_ring(priv);
+
+    return FdFile::on_close();
+}
+
+bool UringFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(UringFile);
+
+    if (!should_split(priv, size)) {
+        return FdFile::on_read(buf, size, bytes_read);
+    }
+
+    off64_t pos = priv->funcs->fn_lseek64(priv->fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        // Not seekable, so positional I/O is not possible
+        return FdFile::on_read(buf, size, bytes_read);
+    }
+
+    size_t n;
+
+    if (!on_read_at(static_cast<uint64_t>(pos), buf, size, n)) {
+        return false;
+    }
+
+    if (priv->funcs->fn_lseek64(priv->fd, pos + static_cast<off64_t>(n),
+                                SEEK_SET) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to update file position");
+        set_fatal(true);
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+}
+
+bool UringFile::on_write(const void *buf, size_t size, size_t &bytes_written)
+{
+    MB_PRIVATE(UringFile);
+
+    if (priv->append || !should_split(priv, size)) {
+        return FdFile::on_write(buf, size, bytes_written);
+    }
+
+    off64_t pos = priv->funcs->fn_lseek64(priv->fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        return FdFile::on_write(buf, size, bytes_written);
+    }
+
+    size_t n;
+
+    if (!on_write_at(static_cast<uint64_t>(pos), buf, size, n)) {
+        return false;
+    }
+
+    if (priv->funcs->fn_lseek64(priv->fd, pos + static_cast<off64_t>(n),
+                                SEEK_SET) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to update file position");
+        set_fatal(true);
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+}
+
+bool UringFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    MB_PRIVATE(UringFile);
+
+    if (offset > INT64_MAX || !should_split(priv, size)) {
+        return FdFile::on_read_at(offset, buf, size, bytes_read);
+    }
+
+    size = std::min<size_t>(size, SSIZE_MAX);
+
+    if (!split_rw(priv, IORING_OP_READV, offset, buf, size, bytes_read)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    return true;
+}
+
+bool UringFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(UringFile);
+
+    if (priv->append || offset > INT64_MAX || !should_split(priv, size)) {
+        return FdFile::on_write_at(offset, buf, size, bytes_written);
+    }
+
+    size = std::min<size_t>(size, SSIZE_MAX);
+
+    if (!split_rw(priv, IORING_OP_WRITEV, offset, buf, size, bytes_written)) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    return true;
+}
+
+}
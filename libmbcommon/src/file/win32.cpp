@@ -42,11 +42,26 @@ namespace mb
 struct RealWin32FileFuncs : public Win32FileFuncs
 {
     // windows.h
+    virtual BOOL fn_CancelIoEx(HANDLE hFile,
+                               LPOVERLAPPED lpOverlapped) override
+    {
+        return CancelIoEx(hFile, lpOverlapped);
+    }
+
     virtual BOOL fn_CloseHandle(HANDLE hObject) override
     {
         return CloseHandle(hObject);
     }
 
+    virtual HANDLE fn_CreateEventW(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                                   BOOL bManualReset,
+                                   BOOL bInitialState,
+                                   LPCWSTR lpName) override
+    {
+        return CreateEventW(lpEventAttributes, bManualReset, bInitialState,
+                            lpName);
+    }
+
     virtual HANDLE fn_CreateFileW(LPCWSTR lpFileName,
                                   DWORD dwDesiredAccess,
                                   DWORD dwShareMode,
@@ -60,6 +75,21 @@ struct RealWin32FileFuncs : public Win32FileFuncs
                            dwFlagsAndAttributes, hTemplateFile);
     }
 
+    virtual BOOL fn_GetFileSizeEx(HANDLE hFile,
+                                  PLARGE_INTEGER lpFileSize) override
+    {
+        return GetFileSizeEx(hFile, lpFileSize);
+    }
+
+    virtual BOOL fn_GetOverlappedResult(HANDLE hFile,
+                                        LPOVERLAPPED lpOverlapped,
+                                        LPDWORD lpNumberOfBytesTransferred,
+                                        BOOL bWait) override
+    {
+        return GetOverlappedResult(hFile, lpOverlapped,
+                                   lpNumberOfBytesTransferred, bWait);
+    }
+
     virtual BOOL fn_ReadFile(HANDLE hFile,
                              LPVOID lpBuffer,
                              DWORD nNumberOfBytesToRead,
@@ -84,6 +114,15 @@ struct RealWin32FileFuncs : public Win32FileFuncs
                                 dwMoveMethod);
     }
 
+    virtual DWORD fn_WaitForMultipleObjects(DWORD nCount,
+                                            const HANDLE *lpHandles,
+                                            BOOL bWaitAll,
+                                            DWORD dwMilliseconds) override
+    {
+        return WaitForMultipleObjects(nCount, lpHandles, bWaitAll,
+                                      dwMilliseconds);
+    }
+
     virtual BOOL fn_WriteFile(HANDLE hFile,
                               LPCVOID lpBuffer,
                               DWORD nNumberOfBytesToWrite,
@@ -150,6 +189,10 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
     case FileOpenMode::READ_ONLY:
         access = GENERIC_READ;
         creation = OPEN_EXISTING;
+        // Files opened for only reading or only writing are almost always
+        // streamed from start to finish. This enables more aggressive
+        // read-ahead and lets the cache manager drop pages once they are used.
+        attrib = FILE_FLAG_SEQUENTIAL_SCAN;
         break;
     case FileOpenMode::READ_WRITE:
         access = GENERIC_READ | GENERIC_WRITE;
@@ -158,6 +201,7 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
     case FileOpenMode::WRITE_ONLY:
         access = GENERIC_WRITE;
         creation = CREATE_ALWAYS;
+        attrib = FILE_FLAG_SEQUENTIAL_SCAN;
         break;
     case FileOpenMode::READ_WRITE_TRUNC:
         access = GENERIC_READ | GENERIC_WRITE;
@@ -166,6 +210,7 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
     case FileOpenMode::APPEND:
         access = GENERIC_WRITE;
         creation = OPEN_ALWAYS;
+        attrib = FILE_FLAG_SEQUENTIAL_SCAN;
         append = true;
         break;
     case FileOpenMode::READ_APPEND:
@@ -199,6 +244,10 @@ bool Win32FilePrivate::convert_mode(FileOpenMode mode,
  * \brief Open file using Win32 API.
  *
  * This class supports opening large files (64-bit offsets) on Windows.
+ *
+ * Files opened with FileOpenMode::READ_ONLY, FileOpenMode::WRITE_ONLY, or
+ * FileOpenMode::APPEND are opened with `FILE_FLAG_SEQUENTIAL_SCAN` since they
+ * are usually streamed. Seeking is still supported, but may be less efficient.
  */
 
 /*!
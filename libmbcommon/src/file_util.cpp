@@ -20,15 +20,26 @@
 #include "mbcommon/file_util.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 
-#include "mbcommon/libc/string.h"
+#include "mbcommon/string.h"
 
 #define DEFAULT_BUFFER_SIZE             (8 * 1024 * 1024)
 
+// Buffer size for file_move()
+#define MOVE_BUFFER_SIZE                (1024 * 1024)
+
+// Patterns shorter than this use a memchr()-based first/last byte filter
+#define MIN_HORSPOOL_SIZE               8
+
 /*!
  * \file mbcommon/file_util.h
  * \brief Useful utility functions for File API
@@ -125,6 +136,153 @@ bool file_write_fully(File &file, const void *buf, size_t size,
     return true;
 }
 
+/*!
+ * \brief Read from a File handle at the specified offset.
+ *
+ * This function differs from File::read_at() in that it will call
+ * File::read_at() repeatedly until the buffer is filled or EOF is reached. If
+ * File::read_at() fails and the error is std::errc::interrupted, the read
+ * operation will be automatically reattempted. The file position is not
+ * changed.
+ *
+ * \note \p bytes_read is updated with the number of bytes successfully read
+ *       even when this function fails. Take this into account if reattempting
+ *       the read operation.
+ *
+ * \param[in] file File handle
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. A short read
+ *                        indicates end of file.
+ *
+ * \return Whether some bytes are read or EOF is reached
+ */
+bool file_read_fully_at(File &file, uint64_t offset, void *buf, size_t size,
+                        size_t &bytes_read)
+{
+    size_t n;
+
+    bytes_read = 0;
+
+    while (bytes_read < size) {
+        if (!file.read_at(offset + bytes_read,
+                          static_cast<char *>(buf) + bytes_read,
+                          size - bytes_read, n)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            } else {
+                return false;
+            }
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_read += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write to a File handle at the specified offset.
+ *
+ * This function differs from File::write_at() in that it will call
+ * File::write_at() repeatedly until the buffer is written or EOF is reached.
+ * If File::write_at() fails and the error is std::errc::interrupted, the write
+ * operation will be automatically reattempted. The file position is not
+ * changed.
+ *
+ * \note \p bytes_written is updated with the number of bytes successfully
+ *       written even when this function fails. Take this into account if
+ *       reattempting the write operation.
+ *
+ * \param[in] file File handle
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes are written
+ */
+bool file_write_fully_at(File &file, uint64_t offset, const void *buf,
+                         size_t size, size_t &bytes_written)
+{
+    size_t n;
+
+    bytes_written = 0;
+
+    while (bytes_written < size) {
+        if (!file.write_at(offset + bytes_written,
+                           static_cast<const char *>(buf) + bytes_written,
+                           size - bytes_written, n)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            } else {
+                return false;
+            }
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_written += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Set a file's error to a copy made with File::error() and
+ *        File::error_string()
+ */
+static void restore_error(File &file, std::error_code ec,
+                          const std::string &error_string)
+{
+    // set_error() appends the error code's message again
+    std::string suffix = ": " + ec.message();
+    std::string message = error_string;
+
+    if (ends_with(message, suffix)) {
+        message.resize(message.size() - suffix.size());
+    }
+
+    file.set_error(ec, "%s", message.c_str());
+}
+
+/*!
+ * \brief Peek at a File handle without failing if it cannot lend its buffers
+ *
+ * This function is equivalent to File::peek(), except that if \p file does not
+ * lend its buffers, true is returned and \p lent is set to false. The error
+ * state of \p file is left unchanged in that case, so probing a file does not
+ * overwrite the error from an earlier operation.
+ *
+ * \param[in] file File handle
+ * \param[out] buf Pointer to the available data
+ * \param[out] size Number of bytes available at \p buf. 0 indicates end of file.
+ * \param[out] lent Whether \p file lent its buffer
+ *
+ * \return Whether some bytes are available, EOF was reached, or \p file does
+ *         not lend its buffers
+ */
+bool file_peek_if_supported(File &file, const void *&buf, size_t &size,
+                            bool &lent)
+{
+    std::error_code ec = file.error();
+    std::string error_string = file.error_string();
+
+    if (file.peek(buf, size)) {
+        lent = true;
+        return true;
+    } else if (file.error() == FileError::UnsupportedRead) {
+        restore_error(file, ec, error_string);
+        lent = false;
+        return true;
+    }
+
+    return false;
+}
+
 /*!
  * \brief Read from a File handle and discard the data.
  *
@@ -146,12 +304,39 @@ bool file_write_fully(File &file, const void *buf, size_t size,
 bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
 {
     char buf[10240];
+    const void *block;
     size_t n;
 
     bytes_discarded = 0;
 
+    // If the file can lend its buffers, skip the data without copying it
+    while (bytes_discarded < size) {
+        bool lent;
+
+        if (!file_peek_if_supported(file, block, n, lent)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            } else {
+                return false;
+            }
+        } else if (!lent) {
+            break;
+        } else if (n == 0) {
+            return true;
+        }
+
+        n = static_cast<size_t>(std::min<uint64_t>(size - bytes_discarded, n));
+
+        if (!file.consume(n)) {
+            return false;
+        }
+
+        bytes_discarded += n;
+    }
+
     while (bytes_discarded < size) {
-        if (!file.read(buf, std::min<uint64_t>(size, sizeof(buf)), n)) {
+        if (!file.read(buf, std::min<uint64_t>(size - bytes_discarded,
+                                               sizeof(buf)), n)) {
             if (file.error() == std::errc::interrupted) {
                 continue;
             } else {
@@ -175,7 +360,9 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  * \note The file position must not change after a successful return of this
  *       callback. If file operations need to be performed, save the file
  *       position beforehand with File::seek() and restore it afterwards. Note
- *       that the file position is unlikely to match \p offset.
+ *       that the file position is unlikely to match \p offset. If the file
+ *       supports File::peek(), the search is performed directly on the lent
+ *       buffers and the callback must not perform any file operations.
  *
  * \sa file_search()
  *
@@ -191,101 +378,47 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  */
 
 /*!
- * \brief Search file for binary sequence
+ * \struct FileSearchPattern
  *
- * If \p buf_size is non-zero, a buffer of size \p buf_size will be allocated.
- * If it is less than or equal to \p pattern_size, then the function will fail
- * and set `errno` to `EINVAL`. If \p buf_size is zero, then the larger of 8 MiB
- * and 2 * \p pattern_size will be used. In the rare case that
- * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
- * will be used.
+ * \brief Pattern for file_search_multi()
  *
- * If \p file does not support seeking, then the file position must be set to
- * the beginning of the file before calling this function. Instead of seeking,
- * the function will read and discard any data before \p start.
+ * \var FileSearchPattern::data
  *
- * \note We do not do overlapping searches. For example, if a file's contents
- *       is "ababababab" and the search pattern is "abab", the resulting offsets
- *       will be (0 and 4), *not* (0, 2, 4, 6). In other words, the next search
- *       begins at the end of the curent search.
+ * \brief Pattern data
  *
- * \note The file position after this function returns is undefined. Be sure to
- *       seek to a known location before attempting further read or write
- *       operations.
+ * \var FileSearchPattern::size
+ *
+ * \brief Size of pattern data (must be non-zero)
+ */
+
+/*!
+ * \typedef FileSearchMultiResultCallback
+ *
+ * \brief Search result callback for file_search_multi()
+ *
+ * \note The same restrictions as for #FileSearchResultCallback apply.
+ *
+ * \sa file_search_multi()
  *
  * \param file File handle
- * \param start Start offset or negative number for beginning of file
- * \param end End offset or negative number for end of file
- * \param bsize Buffer size or 0 to automatically choose a size
- * \param pattern Pattern to search
- * \param pattern_size Size of pattern
- * \param max_matches Maximum number of matches or -1 to find all matches
- * \param result_cb Callback to invoke upon finding a match
  * \param userdata User callback data
+ * \param pattern_id Index of matched pattern in the patterns array
+ * \param offset File offset of search result
  *
- * \return Whether the search completes successfully
+ * \return
+ *   * #FileSearchAction::Continue to continue search
+ *   * #FileSearchAction::Stop to stop search, but have file_search_multi()
+ *     report a successful result
+ *   * #FileSearchAction::Fail if an error occurs
  */
-bool file_search(File &file, int64_t start, int64_t end,
-                 size_t bsize, const void *pattern,
-                 size_t pattern_size, int64_t max_matches,
-                 FileSearchResultCallback result_cb,
-                 void *userdata)
-{
-    std::unique_ptr<char, decltype(free) *> buf(nullptr, &free);
-    size_t buf_size;
-    char *ptr;
-    size_t ptr_remain;
-    char *match;
-    size_t match_remain;
-    uint64_t offset;
-    size_t n;
-
-    // Check boundaries
-    if (start >= 0 && end >= 0 && end < start) {
-        file.set_error(make_error_code(FileError::InvalidArgument),
-                       "End offset < start offset");
-        return false;
-    }
-
-    // Trivial case
-    if (max_matches == 0 || pattern_size == 0) {
-        return true;
-    }
-
-    // Compute buffer size
-    if (bsize != 0) {
-        buf_size = bsize;
-    } else {
-        buf_size = DEFAULT_BUFFER_SIZE;
-
-        if (pattern_size > SIZE_MAX / 2) {
-            buf_size = SIZE_MAX;
-        } else {
-            buf_size = std::max(buf_size, pattern_size * 2);
-        }
-    }
-
-    // Ensure buffer is large enough
-    if (buf_size < pattern_size) {
-        file.set_error(make_error_code(FileError::InvalidArgument),
-                       "Buffer size cannot be less than pattern size");
-        return false;
-    }
-
-    buf.reset(static_cast<char *>(malloc(buf_size)));
-    if (!buf) {
-        file.set_error(std::error_code(errno, std::generic_category()),
-                       "Failed to allocate buffer");
-        return false;
-    }
-
-    if (start >= 0) {
-        offset = start;
-    } else {
-        offset = 0;
-    }
 
-    // Seek to starting point
+/*!
+ * \brief Seek to starting offset of a search
+ *
+ * If \p file does not support seeking, data is read and discarded instead.
+ */
+static bool seek_to_search_start(File &file, uint64_t offset)
+{
     if (!file.seek(offset, SEEK_SET, nullptr)) {
         if (file.error() == FileError::Unsupported) {
             uint64_t discarded;
@@ -302,40 +435,418 @@ bool file_search(File &file, int64_t start, int64_t end,
         }
     }
 
-    // Initially read to beginning of buffer
-    ptr = buf.get();
-    ptr_remain = buf_size;
+    return true;
+}
 
-    while (true) {
-        if (!file_read_fully(file, ptr, ptr_remain, n)) {
-            return false;
+/*!
+ * \brief Report a search match to the user callback
+ *
+ * \return
+ *   * #FileSearchAction::Continue if the search should continue
+ *   * #FileSearchAction::Stop if the search should stop successfully
+ *   * #FileSearchAction::Fail if the callback failed
+ */
+static FileSearchAction report_match(File &file, uint64_t offset,
+                                     size_t pattern_size, int64_t end,
+                                     int64_t &max_matches,
+                                     FileSearchResultCallback result_cb,
+                                     void *userdata)
+{
+    // Stop if match falls outside of ending boundary
+    if (end >= 0 && offset + pattern_size > static_cast<uint64_t>(end)) {
+        return FileSearchAction::Stop;
+    }
+
+    auto ret = result_cb(file, userdata, offset);
+    if (ret != FileSearchAction::Continue) {
+        return ret;
+    }
+
+    if (max_matches > 0) {
+        --max_matches;
+        if (max_matches == 0) {
+            return FileSearchAction::Stop;
         }
+    }
 
-        // Number of available bytes in buf
-        n += ptr - buf.get();
+    return FileSearchAction::Continue;
+}
 
-        if (n < pattern_size) {
+/*!
+ * \brief Search the blocks lent by File::peek() without copying them
+ *
+ * Only the last `pattern_size - 1` bytes of each block are copied so that
+ * matches spanning two blocks can be found.
+ *
+ * If the file stops lending its buffers partway through, \p unsupported is set
+ * to true and true is returned. \p offset is then the current file position
+ * and \p carry holds the preceding bytes that may still start a match, so the
+ * search can continue with File::read().
+ */
+static bool search_lent_blocks(const FileSearcher &searcher, File &file,
+                               uint64_t &offset, int64_t end,
+                               int64_t &max_matches,
+                               FileSearchResultCallback result_cb,
+                               void *userdata, std::vector<char> &carry,
+                               bool &unsupported)
+{
+    const size_t pattern_size = searcher.pattern_size();
+    std::vector<char> straddle;
+    // Matches do not overlap, so the next match cannot start before this
+    uint64_t next_allowed = offset;
+
+    unsupported = false;
+    carry.clear();
+    carry.reserve(pattern_size);
+    straddle.reserve(pattern_size * 2);
+
+    while (true) {
+        const void *ptr;
+        size_t n;
+
+        bool lent;
+
+        if (!file_peek_if_supported(file, ptr, n, lent)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            }
+            return false;
+        } else if (!lent) {
+            unsupported = true;
+            return true;
+        } else if (n == 0) {
             // Reached EOF
             return true;
         } else if (end >= 0 && offset >= static_cast<uint64_t>(end)) {
             // Artificial EOF
             return true;
-        }
-
-        // Ensure that offset + n (and consequently, offset + diff) cannot
-        // overflow
-        if (n > UINT64_MAX - offset) {
+        } else if (n > UINT64_MAX - offset) {
             file.set_error(make_error_code(FileError::IntegerOverflow),
                            "Read overflows offset value");
             return false;
         }
 
-        // Search from beginning of buffer
-        match = buf.get();
+        auto block = static_cast<const char *>(ptr);
+
+        // Matches that start in the carried over bytes and end in this block
+        if (!carry.empty()) {
+            uint64_t base = offset - carry.size();
+
+            straddle.assign(carry.begin(), carry.end());
+            straddle.insert(straddle.end(), block,
+                            block + std::min(n, pattern_size - 1));
+
+            size_t pos = 0;
+            const void *match;
+
+            while (pos < carry.size() && (match = searcher.find(
+                    straddle.data() + pos, straddle.size() - pos))) {
+                size_t index = static_cast<size_t>(
+                        static_cast<const char *>(match) - straddle.data());
+                if (index >= carry.size()) {
+                    // Will be found when searching the block itself
+                    break;
+                }
+
+                auto ret = report_match(file, base + index, pattern_size, end,
+                                        max_matches, result_cb, userdata);
+                if (ret == FileSearchAction::Stop) {
+                    return true;
+                } else if (ret != FileSearchAction::Continue) {
+                    return false;
+                }
+
+                next_allowed = base + index + pattern_size;
+                pos = index + pattern_size;
+            }
+        }
+
+        // Matches within this block
+        size_t pos = next_allowed > offset
+                ? static_cast<size_t>(next_allowed - offset) : 0;
+        const void *match;
+
+        while (pos < n && (match = searcher.find(block + pos, n - pos))) {
+            size_t index = static_cast<size_t>(
+                    static_cast<const char *>(match) - block);
+
+            auto ret = report_match(file, offset + index, pattern_size, end,
+                                    max_matches, result_cb, userdata);
+            if (ret == FileSearchAction::Stop) {
+                return true;
+            } else if (ret != FileSearchAction::Continue) {
+                return false;
+            }
+
+            next_allowed = offset + index + pattern_size;
+            pos = index + pattern_size;
+        }
+
+        // Keep up to pattern_size - 1 bytes that may still start a match
+        uint64_t data_end = offset + n;
+        uint64_t keep_start = data_end - std::min<uint64_t>(
+                data_end, pattern_size - 1);
+        keep_start = std::max(keep_start, next_allowed);
+        keep_start = std::max(keep_start, offset - carry.size());
+
+        if (keep_start >= offset) {
+            carry.assign(block + (keep_start - offset), block + n);
+        } else {
+            carry.erase(carry.begin(), carry.begin()
+                    + static_cast<size_t>(keep_start
+                            - (offset - carry.size())));
+            carry.insert(carry.end(), block, block + n);
+        }
+
+        if (!file.consume(n)) {
+            return false;
+        }
+
+        offset = data_end;
+    }
+}
+
+/*!
+ * \class FileSearcher
+ *
+ * \brief Precompiled binary pattern search
+ *
+ * The search tables are computed once when the object is constructed, so the
+ * same FileSearcher can be used to search any number of buffers or files
+ * without additional setup cost.
+ *
+ * Short patterns are located by scanning for the first byte with `memchr()`
+ * (which is vectorized by all the libc implementations we care about) and
+ * then checking the last byte before comparing the rest of the pattern.
+ * Longer patterns use the Boyer-Moore-Horspool algorithm, which can skip up to
+ * \p pattern_size bytes per comparison.
+ */
+
+/*!
+ * \brief Construct searcher for a binary pattern
+ *
+ * \param pattern Pattern to search (copied)
+ * \param pattern_size Size of pattern
+ */
+FileSearcher::FileSearcher(const void *pattern, size_t pattern_size)
+    : _pattern(static_cast<const unsigned char *>(pattern),
+               static_cast<const unsigned char *>(pattern) + pattern_size)
+{
+    if (pattern_size >= MIN_HORSPOOL_SIZE) {
+        _skip.assign(256, pattern_size);
+
+        for (size_t i = 0; i < pattern_size - 1; ++i) {
+            _skip[_pattern[i]] = pattern_size - 1 - i;
+        }
+    }
+}
+
+/*!
+ * \brief Get size of the pattern
+ *
+ * \return Pattern size in bytes
+ */
+size_t FileSearcher::pattern_size() const
+{
+    return _pattern.size();
+}
+
+/*!
+ * \brief Find first occurrence of the pattern in a buffer
+ *
+ * This function behaves like `memmem()`.
+ *
+ * \param buf Buffer to search
+ * \param size Size of buffer
+ *
+ * \return Pointer to the first match in \p buf or nullptr if the pattern was
+ *         not found. If the pattern is empty, \p buf is returned.
+ */
+const void * FileSearcher::find(const void *buf, size_t size) const
+{
+    const size_t m = _pattern.size();
+    const unsigned char *p = _pattern.data();
+    auto h = static_cast<const unsigned char *>(buf);
+
+    if (m == 0) {
+        return buf;
+    } else if (size < m) {
+        return nullptr;
+    } else if (m == 1) {
+        return memchr(h, p[0], size);
+    }
+
+    const unsigned char last = p[m - 1];
+
+    if (_skip.empty()) {
+        // First byte/last byte filter
+        const unsigned char *ptr = h;
+        const unsigned char *limit = h + size - m + 1;
+
+        while (ptr < limit) {
+            ptr = static_cast<const unsigned char *>(
+                    memchr(ptr, p[0], limit - ptr));
+            if (!ptr) {
+                break;
+            }
+
+            if (ptr[m - 1] == last && memcmp(ptr + 1, p + 1, m - 2) == 0) {
+                return ptr;
+            }
+
+            ++ptr;
+        }
+
+        return nullptr;
+    }
+
+    // Boyer-Moore-Horspool
+    for (size_t pos = 0; pos <= size - m; ) {
+        unsigned char c = h[pos + m - 1];
+
+        if (c == last && memcmp(h + pos, p, m - 1) == 0) {
+            return h + pos;
+        }
+
+        pos += _skip[c];
+    }
+
+    return nullptr;
+}
+
+/*!
+ * \brief Search file for the pattern
+ *
+ * See file_search() for a description of the parameters. The precompiled
+ * pattern is used in place of the \p pattern and \p pattern_size parameters.
+ *
+ * \return Whether the search completes successfully
+ */
+bool FileSearcher::search(File &file, int64_t start, int64_t end,
+                          size_t bsize, int64_t max_matches,
+                          FileSearchResultCallback result_cb,
+                          void *userdata) const
+{
+    std::unique_ptr<char, decltype(free) *> buf(nullptr, &free);
+    size_t buf_size;
+    char *ptr;
+    size_t ptr_remain;
+    char *match;
+    size_t match_remain;
+    uint64_t offset;
+    size_t n;
+
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "End offset < start offset");
+        return false;
+    }
+
+    size_t pattern_size = _pattern.size();
+
+    // Trivial case
+    if (max_matches == 0 || pattern_size == 0) {
+        return true;
+    }
+
+    // Compute buffer size
+    if (bsize != 0) {
+        buf_size = bsize;
+    } else {
+        buf_size = DEFAULT_BUFFER_SIZE;
+
+        if (pattern_size > SIZE_MAX / 2) {
+            buf_size = SIZE_MAX;
+        } else {
+            buf_size = std::max(buf_size, pattern_size * 2);
+        }
+    }
+
+    // Ensure buffer is large enough
+    if (buf_size < pattern_size) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "Buffer size cannot be less than pattern size");
+        return false;
+    }
+
+    if (start >= 0) {
+        offset = start;
+    } else {
+        offset = 0;
+    }
+
+    // Seek to starting point
+    if (!seek_to_search_start(file, offset)) {
+        return false;
+    }
+
+    // Search the file's own buffers if it can lend them. Unmatched bytes at
+    // the end of the lent blocks are carried over if the file stops lending.
+    std::vector<char> carry;
+    {
+        const void *block;
+        bool lent;
+        bool unsupported;
+
+        if (!file_peek_if_supported(file, block, n, lent)) {
+            return false;
+        } else if (lent) {
+            if (!search_lent_blocks(*this, file, offset, end, max_matches,
+                                    result_cb, userdata, carry,
+                                    unsupported)) {
+                return false;
+            } else if (!unsupported) {
+                return true;
+            }
+        }
+    }
+
+    buf.reset(static_cast<char *>(malloc(buf_size)));
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
+    // Initially read to beginning of buffer, after any carried over bytes
+    if (!carry.empty()) {
+        memcpy(buf.get(), carry.data(), carry.size());
+    }
+    ptr = buf.get() + carry.size();
+    ptr_remain = buf_size - carry.size();
+    offset -= carry.size();
+
+    while (true) {
+        if (!file_read_fully(file, ptr, ptr_remain, n)) {
+            return false;
+        }
+
+        // Number of available bytes in buf
+        n += ptr - buf.get();
+
+        if (n < pattern_size) {
+            // Reached EOF
+            return true;
+        } else if (end >= 0 && offset >= static_cast<uint64_t>(end)) {
+            // Artificial EOF
+            return true;
+        }
+
+        // Ensure that offset + n (and consequently, offset + diff) cannot
+        // overflow
+        if (n > UINT64_MAX - offset) {
+            file.set_error(make_error_code(FileError::IntegerOverflow),
+                           "Read overflows offset value");
+            return false;
+        }
+
+        // Search from beginning of buffer
+        match = buf.get();
         match_remain = n;
 
-        while ((match = static_cast<char *>(
-                mb_memmem(match, match_remain, pattern, pattern_size)))) {
+        while ((match = static_cast<char *>(const_cast<void *>(
+                find(match, match_remain))))) {
             // Stop if match falls outside of ending boundary
             if (end >= 0 && offset + match - buf.get() + pattern_size
                     > static_cast<uint64_t>(end)) {
@@ -380,6 +891,532 @@ bool file_search(File &file, int64_t start, int64_t end,
     return true;
 }
 
+/*!
+ * \brief Search file for the pattern using multiple threads
+ *
+ * The search range is split into chunks of \p bsize bytes (8 MiB if \p bsize
+ * is 0). Each chunk is read with File::read_at(), along with the following
+ * `pattern_size - 1` bytes so that matches spanning two chunks are found, and
+ * searched on one of \p threads worker threads. The matches are merged on the
+ * calling thread, which is also the only thread that invokes \p result_cb.
+ * Matches are reported in increasing offset order and the non-overlapping
+ * semantics of search() are preserved, so the results are identical to those
+ * of search().
+ *
+ * \warning \p file must support concurrent calls to File::read_at(). This is
+ *          true for FdFile, MmapFile, and MemoryFile, but not for files that
+ *          emulate positional I/O with seeks. \p file must also support
+ *          seeking if \p end is negative, since the file size must be known in
+ *          advance.
+ *
+ * \param file File handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Chunk size or 0 to automatically choose a size
+ * \param threads Number of worker threads or 0 to use the number of CPUs.
+ *                If this is 1, then search() is used instead.
+ * \param max_matches Maximum number of matches or -1 to find all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return Whether the search completes successfully
+ */
+bool FileSearcher::search_parallel(File &file, int64_t start, int64_t end,
+                                   size_t bsize, unsigned int threads,
+                                   int64_t max_matches,
+                                   FileSearchResultCallback result_cb,
+                                   void *userdata) const
+{
+    const size_t pattern_size = _pattern.size();
+
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "End offset < start offset");
+        return false;
+    }
+
+    // Trivial case
+    if (max_matches == 0 || pattern_size == 0) {
+        return true;
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (threads == 1) {
+        return search(file, start, end, bsize, max_matches, result_cb,
+                      userdata);
+    }
+
+    const size_t chunk_size = bsize != 0 ? bsize : DEFAULT_BUFFER_SIZE;
+
+    if (pattern_size - 1 > SIZE_MAX - chunk_size) {
+        file.set_error(make_error_code(FileError::IntegerOverflow),
+                       "Chunk size + pattern size overflows integer");
+        return false;
+    }
+
+    // Determine range to search
+    uint64_t range_begin = start >= 0 ? static_cast<uint64_t>(start) : 0;
+    uint64_t range_end;
+
+    if (end >= 0) {
+        range_end = static_cast<uint64_t>(end);
+    } else if (!file.seek(0, SEEK_END, &range_end)) {
+        return false;
+    }
+
+    if (range_end <= range_begin || range_end - range_begin < pattern_size) {
+        return true;
+    }
+
+    const uint64_t n_chunks = (range_end - range_begin - 1) / chunk_size + 1;
+    threads = static_cast<unsigned int>(
+            std::min<uint64_t>(threads, n_chunks));
+
+    struct ChunkResult
+    {
+        bool done = false;
+        bool failed = false;
+        std::vector<uint64_t> offsets;
+        // Copy of the read error. The calling thread reports it after the
+        // workers exit so that the file's error is not changed under them.
+        std::error_code error_code;
+        std::string error_string;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<ChunkResult> results;
+    // Index of the first chunk in results
+    uint64_t results_base = 0;
+    uint64_t next_chunk = 0;
+    bool cancelled = false;
+
+    // Workers must not get too far ahead of the merge to bound memory usage
+    const uint64_t max_pending = static_cast<uint64_t>(threads) * 2;
+
+    auto worker = [&]() {
+        std::vector<unsigned char> buf(chunk_size + pattern_size - 1);
+
+        while (true) {
+            uint64_t chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{
+                    return cancelled || next_chunk == n_chunks
+                            || next_chunk - results_base < max_pending;
+                });
+                if (cancelled || next_chunk == n_chunks) {
+                    return;
+                }
+                chunk = next_chunk++;
+                results.emplace_back();
+            }
+
+            uint64_t chunk_begin = range_begin + chunk * chunk_size;
+            size_t to_read = static_cast<size_t>(std::min<uint64_t>(
+                    buf.size(), range_end - chunk_begin));
+            // Matches must begin in this chunk to avoid duplicates
+            size_t match_limit = static_cast<size_t>(std::min<uint64_t>(
+                    chunk_size, range_end - chunk_begin));
+
+            ChunkResult result;
+            size_t n;
+
+            if (!file_read_fully_at(file, chunk_begin, buf.data(), to_read,
+                                    n)) {
+                result.failed = true;
+                result.error_code = file.error();
+                result.error_string = file.error_string();
+            } else {
+                // Find all matches, including overlapping ones. The merge
+                // step discards overlapping matches.
+                const unsigned char *ptr = buf.data();
+                const unsigned char *buf_end = buf.data() + n;
+
+                while ((ptr = static_cast<const unsigned char *>(
+                        find(ptr, buf_end - ptr)))) {
+                    size_t pos = ptr - buf.data();
+                    if (pos >= match_limit) {
+                        break;
+                    }
+                    result.offsets.push_back(chunk_begin + pos);
+                    ++ptr;
+                }
+            }
+
+            result.done = true;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                results[chunk - results_base] = std::move(result);
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    bool ret = true;
+    // Next offset that a match may start at
+    uint64_t min_offset = 0;
+    // First failed chunk in offset order
+    ChunkResult failure;
+
+    for (uint64_t chunk = 0; chunk < n_chunks; ++chunk) {
+        ChunkResult result;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]{
+                return !results.empty() && results.front().done;
+            });
+            result = std::move(results.front());
+            results.pop_front();
+            ++results_base;
+        }
+        cv.notify_all();
+
+        if (result.failed) {
+            failure = std::move(result);
+            ret = false;
+            break;
+        }
+
+        bool stop = false;
+
+        for (uint64_t offset : result.offsets) {
+            // We don't do overlapping searches
+            if (offset < min_offset) {
+                continue;
+            }
+            min_offset = offset + pattern_size;
+
+            auto action = result_cb(file, userdata, offset);
+            if (action == FileSearchAction::Stop) {
+                stop = true;
+                break;
+            } else if (action != FileSearchAction::Continue) {
+                ret = false;
+                stop = true;
+                break;
+            }
+
+            if (max_matches > 0) {
+                --max_matches;
+                if (max_matches == 0) {
+                    stop = true;
+                    break;
+                }
+            }
+        }
+
+        if (stop) {
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+    }
+    cv.notify_all();
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    if (failure.failed) {
+        restore_error(file, failure.error_code, failure.error_string);
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Search file for binary sequence
+ *
+ * If \p buf_size is non-zero, a buffer of size \p buf_size will be allocated.
+ * If it is less than or equal to \p pattern_size, then the function will fail
+ * and set `errno` to `EINVAL`. If \p buf_size is zero, then the larger of 8 MiB
+ * and 2 * \p pattern_size will be used. In the rare case that
+ * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
+ * will be used.
+ *
+ * If \p file does not support seeking, then the file position must be set to
+ * the beginning of the file before calling this function. Instead of seeking,
+ * the function will read and discard any data before \p start.
+ *
+ * \note We do not do overlapping searches. For example, if a file's contents
+ *       is "ababababab" and the search pattern is "abab", the resulting offsets
+ *       will be (0 and 4), *not* (0, 2, 4, 6). In other words, the next search
+ *       begins at the end of the curent search.
+ *
+ * \note The file position after this function returns is undefined. Be sure to
+ *       seek to a known location before attempting further read or write
+ *       operations.
+ *
+ * \note This is a convenience wrapper around FileSearcher. Callers that search
+ *       for the same pattern multiple times should construct a FileSearcher
+ *       once and reuse it.
+ *
+ * \param file File handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Buffer size or 0 to automatically choose a size
+ * \param pattern Pattern to search
+ * \param pattern_size Size of pattern
+ * \param max_matches Maximum number of matches or -1 to find all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return Whether the search completes successfully
+ */
+bool file_search(File &file, int64_t start, int64_t end,
+                 size_t bsize, const void *pattern,
+                 size_t pattern_size, int64_t max_matches,
+                 FileSearchResultCallback result_cb,
+                 void *userdata)
+{
+    return FileSearcher(pattern, pattern_size).search(
+            file, start, end, bsize, max_matches, result_cb, userdata);
+}
+
+/*!
+ * \brief Search file for binary sequence using multiple threads
+ *
+ * This is a convenience wrapper around FileSearcher::search_parallel(). See
+ * that function and file_search() for a description of the parameters.
+ *
+ * \return Whether the search completes successfully
+ */
+bool file_search_parallel(File &file, int64_t start, int64_t end,
+                          size_t bsize, unsigned int threads,
+                          const void *pattern, size_t pattern_size,
+                          int64_t max_matches,
+                          FileSearchResultCallback result_cb,
+                          void *userdata)
+{
+    return FileSearcher(pattern, pattern_size).search_parallel(
+            file, start, end, bsize, threads, max_matches, result_cb,
+            userdata);
+}
+
+/*!
+ * \brief Build Aho-Corasick automaton for a set of patterns
+ *
+ * The automaton is compiled into a DFA so that matching requires only a single
+ * table lookup per input byte.
+ *
+ * \param[in] patterns Array of patterns
+ * \param[in] patterns_count Number of patterns in \p patterns
+ * \param[out] next Transition table with 256 entries per state
+ * \param[out] outputs Patterns that end at each state, including those
+ *                     reachable via failure links
+ */
+static void build_aho_corasick(const FileSearchPattern *patterns,
+                               size_t patterns_count,
+                               std::vector<uint32_t> &next,
+                               std::vector<std::vector<size_t>> &outputs)
+{
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    // Build trie
+    next.assign(256, NONE);
+    outputs.assign(1, std::vector<size_t>());
+
+    for (size_t i = 0; i < patterns_count; ++i) {
+        auto data = static_cast<const unsigned char *>(patterns[i].data);
+        uint32_t state = 0;
+
+        for (size_t j = 0; j < patterns[i].size; ++j) {
+            uint32_t &target = next[state * 256 + data[j]];
+            if (target == NONE) {
+                target = static_cast<uint32_t>(outputs.size());
+                next.resize(next.size() + 256, NONE);
+                outputs.emplace_back();
+            }
+            // Re-lookup since resize() may have invalidated the reference
+            state = next[state * 256 + data[j]];
+        }
+
+        outputs[state].push_back(i);
+    }
+
+    // Compute failure links in BFS order and fill in the missing transitions
+    std::vector<uint32_t> fail(outputs.size(), 0);
+    std::deque<uint32_t> queue;
+
+    for (size_t c = 0; c < 256; ++c) {
+        uint32_t &target = next[c];
+        if (target == NONE) {
+            target = 0;
+        } else {
+            queue.push_back(target);
+        }
+    }
+
+    while (!queue.empty()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+
+        const std::vector<size_t> &inherited = outputs[fail[state]];
+        outputs[state].insert(outputs[state].end(),
+                              inherited.begin(), inherited.end());
+
+        for (size_t c = 0; c < 256; ++c) {
+            uint32_t &target = next[state * 256 + c];
+            uint32_t fallback = next[fail[state] * 256 + c];
+
+            if (target == NONE) {
+                target = fallback;
+            } else {
+                fail[target] = fallback;
+                queue.push_back(target);
+            }
+        }
+    }
+}
+
+/*!
+ * \brief Search file for multiple binary sequences in a single pass
+ *
+ * This function uses the Aho-Corasick algorithm to find all occurrences of any
+ * of the patterns while reading the file only once. Unlike file_search(),
+ * matches may overlap, both with other patterns and with other matches of the
+ * same pattern. Matches are reported in order of their ending offset. If
+ * multiple patterns end at the same offset, the longer pattern is reported
+ * first.
+ *
+ * If \p bsize is non-zero, a buffer of size \p bsize will be used for reading.
+ * Otherwise, an 8 MiB buffer is used. Since the matcher state is carried over
+ * between reads, the buffer size does not need to be related to the pattern
+ * sizes.
+ *
+ * If \p file does not support seeking, then the file position must be set to
+ * the beginning of the file before calling this function. Instead of seeking,
+ * the function will read and discard any data before \p start.
+ *
+ * \note The file position after this function returns is undefined. Be sure to
+ *       seek to a known location before attempting further read or write
+ *       operations.
+ *
+ * \param file File handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Buffer size or 0 to automatically choose a size
+ * \param patterns Array of patterns to search
+ * \param patterns_count Number of patterns in \p patterns
+ * \param max_matches Maximum number of matches or -1 to find all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return Whether the search completes successfully
+ */
+bool file_search_multi(File &file, int64_t start, int64_t end,
+                       size_t bsize, const FileSearchPattern *patterns,
+                       size_t patterns_count, int64_t max_matches,
+                       FileSearchMultiResultCallback result_cb,
+                       void *userdata)
+{
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "End offset < start offset");
+        return false;
+    }
+
+    for (size_t i = 0; i < patterns_count; ++i) {
+        if (patterns[i].size == 0) {
+            file.set_error(make_error_code(FileError::InvalidArgument),
+                           "Pattern %" MB_PRIzu " is empty", i);
+            return false;
+        }
+    }
+
+    // Trivial case
+    if (max_matches == 0 || patterns_count == 0) {
+        return true;
+    }
+
+    size_t buf_size = bsize != 0 ? bsize : DEFAULT_BUFFER_SIZE;
+
+    std::unique_ptr<unsigned char, decltype(free) *> buf(
+            static_cast<unsigned char *>(malloc(buf_size)), &free);
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
+    std::vector<uint32_t> next;
+    std::vector<std::vector<size_t>> outputs;
+    build_aho_corasick(patterns, patterns_count, next, outputs);
+
+    uint64_t offset = start >= 0 ? static_cast<uint64_t>(start) : 0;
+
+    if (!seek_to_search_start(file, offset)) {
+        return false;
+    }
+
+    uint32_t state = 0;
+
+    while (true) {
+        size_t n;
+
+        if (!file_read_fully(file, buf.get(), buf_size, n)) {
+            return false;
+        } else if (n == 0) {
+            // Reached EOF
+            return true;
+        } else if (n > UINT64_MAX - offset) {
+            file.set_error(make_error_code(FileError::IntegerOverflow),
+                           "Read overflows offset value");
+            return false;
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            state = next[state * 256 + buf.get()[i]];
+
+            for (size_t id : outputs[state]) {
+                uint64_t match_end = offset + i + 1;
+
+                // Stop if match falls outside of ending boundary
+                if (end >= 0 && match_end > static_cast<uint64_t>(end)) {
+                    return true;
+                }
+
+                auto ret = result_cb(file, userdata, id,
+                                     match_end - patterns[id].size);
+                if (ret == FileSearchAction::Stop) {
+                    // Stop searching early
+                    return true;
+                } else if (ret != FileSearchAction::Continue) {
+                    return false;
+                }
+
+                if (max_matches > 0) {
+                    --max_matches;
+                    if (max_matches == 0) {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        offset += n;
+
+        if (end >= 0 && offset >= static_cast<uint64_t>(end)) {
+            // Artificial EOF
+            return true;
+        }
+    }
+}
+
 /*!
  * \brief Move data in file
  *
@@ -388,9 +1425,10 @@ bool file_search(File &file, int64_t start, int64_t end,
  * case where \p src == \p dest or \p size == 0, no operation will be performed,
  * but the function will return true and set \p size_moved accordingly.
  *
- * \note This function is very seek-heavy and may be slow if the handle cannot
- *       seek efficiently. It will perform two seeks per loop interation. Each
- *       iteration moves up to 10240 bytes.
+ * \note This function uses File::read_at() and File::write_at(), so the file
+ *       position is not changed. Handles that do not implement positional I/O
+ *       natively will emulate it with seeks, which may be slow if the handle
+ *       cannot seek efficiently. Each iteration moves up to 1 MiB.
  *
  * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
  *       bytes have been copied from offset \p src to offset \p dest. This is
@@ -407,7 +1445,6 @@ bool file_search(File &file, int64_t start, int64_t end,
 bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
                uint64_t &size_moved)
 {
-    char buf[10240];
     size_t n_read;
     size_t n_written;
 
@@ -423,33 +1460,36 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
         return false;
     }
 
+    // Don't allocate more than needed for small moves
+    size_t buf_size = std::min<uint64_t>(MOVE_BUFFER_SIZE, size);
+
+    std::unique_ptr<char, decltype(free) *> buf(
+            static_cast<char *>(malloc(buf_size)), &free);
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
     size_moved = 0;
 
     if (dest < src) {
         // Copy forwards
         while (size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
-
-            // Seek to source offset
-            if (!file.seek(src + size_moved, SEEK_SET, nullptr)) {
-                return false;
-            }
+                    buf_size, size - size_moved);
 
             // Read data from source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
+            if (!file_read_fully_at(file, src + size_moved, buf.get(), to_read,
+                                    n_read)) {
                 return false;
             } else if (n_read == 0) {
                 break;
             }
 
-            // Seek to destination offset
-            if (!file.seek(dest + size_moved, SEEK_SET, nullptr)) {
-                return false;
-            }
-
             // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
+            if (!file_write_fully_at(file, dest + size_moved, buf.get(), n_read,
+                                     n_written)) {
                 return false;
             }
 
@@ -463,29 +1503,19 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
         // Copy backwards
         while (size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
-
-            // Seek to source offset
-            if (!file.seek(src + size - size_moved - to_read, SEEK_SET,
-                           nullptr)) {
-                return false;
-            }
+                    buf_size, size - size_moved);
 
             // Read data form source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
+            if (!file_read_fully_at(file, src + size - size_moved - to_read,
+                                    buf.get(), to_read, n_read)) {
                 return false;
             } else if (n_read == 0) {
                 break;
             }
 
-            // Seek to destination offset
-            if (!file.seek(dest + size - size_moved - n_read, SEEK_SET,
-                           nullptr)) {
-                return false;
-            }
-
             // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
+            if (!file_write_fully_at(file, dest + size - size_moved - n_read,
+                                     buf.get(), n_read, n_written)) {
                 return false;
             }
 
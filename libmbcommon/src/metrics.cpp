@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/metrics.h"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+#include "mbcommon/string.h"
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+class MetricsRegistryPrivate
+{
+public:
+    mutable std::mutex lock;
+    std::map<std::string, std::unique_ptr<Counter>> counters;
+    std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms;
+};
+/*! \endcond */
+
+/*!
+ * \brief Get the calling thread's shard
+ *
+ * Thread-local storage is not reliable in the static binaries used during
+ * early boot, so the shard is derived from the thread ID instead. The ID is
+ * mixed first because glibc's thread IDs are aligned pointers.
+ */
+static size_t shard_index()
+{
+    uint64_t h = std::hash<std::thread::id>()(std::this_thread::get_id());
+
+    // Finalizer from MurmurHash3
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+
+    return static_cast<size_t>(h % METRICS_SHARDS);
+}
+
+static void atomic_min(std::atomic<uint64_t> &target, uint64_t value)
+{
+    uint64_t curr = target.load(std::memory_order_relaxed);
+    while (value < curr && !target.compare_exchange_weak(
+            curr, value, std::memory_order_relaxed)) {
+        // Retry with the updated value
+    }
+}
+
+static void atomic_max(std::atomic<uint64_t> &target, uint64_t value)
+{
+    uint64_t curr = target.load(std::memory_order_relaxed);
+    while (value > curr && !target.compare_exchange_weak(
+            curr, value, std::memory_order_relaxed)) {
+        // Retry with the updated value
+    }
+}
+
+Counter::Counter()
+{
+    for (auto &shard : _shards) {
+        shard.value.store(0, std::memory_order_relaxed);
+    }
+}
+
+/*!
+ * \brief Increment the counter by \p n
+ */
+void Counter::add(uint64_t n)
+{
+    _shards[shard_index()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Get the sum of all increments
+ */
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for (auto const &shard : _shards) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Gauge::Gauge()
+    : _value(0)
+{
+}
+
+void Gauge::set(int64_t value)
+{
+    _value.store(value, std::memory_order_relaxed);
+}
+
+void Gauge::add(int64_t n)
+{
+    _value.fetch_add(n, std::memory_order_relaxed);
+}
+
+int64_t Gauge::value() const
+{
+    return _value.load(std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Get the approximate value at a percentile
+ *
+ * \param p Percentile between 0 and 100
+ *
+ * \return Upper bound of the bucket containing the percentile, clamped to the
+ *         minimum and maximum recorded values, or 0 if nothing was recorded
+ */
+uint64_t HistogramSnapshot::percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    p = std::min(std::max(p, 0.0), 100.0);
+    uint64_t rank = static_cast<uint64_t>(
+            std::ceil(p / 100.0 * static_cast<double>(count)));
+    rank = std::max<uint64_t>(rank, 1);
+
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(std::max(Histogram::bucket_upper_bound(i), min),
+                            max);
+        }
+    }
+
+    return max;
+}
+
+/*!
+ * \brief Get the mean of the recorded values
+ */
+double HistogramSnapshot::mean() const
+{
+    return count == 0 ? 0.0 : static_cast<double>(sum) / count;
+}
+
+Histogram::Histogram()
+    : _shards(new Shard[METRICS_SHARDS])
+{
+    for (size_t i = 0; i < METRICS_SHARDS; ++i) {
+        Shard &shard = _shards[i];
+
+        shard.count.store(0, std::memory_order_relaxed);
+        shard.sum.store(0, std::memory_order_relaxed);
+        shard.min.store(std::numeric_limits<uint64_t>::max(),
+                        std::memory_order_relaxed);
+        shard.max.store(0, std::memory_order_relaxed);
+
+        for (auto &bucket : shard.buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+/*!
+ * \brief Record a value
+ */
+void Histogram::record(uint64_t value)
+{
+    Shard &shard = _shards[shard_index()];
+
+    shard.buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(value, std::memory_order_relaxed);
+    atomic_min(shard.min, value);
+    atomic_max(shard.max, value);
+}
+
+/*!
+ * \brief Merge the shards into a snapshot
+ *
+ * Values recorded while the snapshot is being taken may be partially included
+ * (eg. in the count, but not in the sum).
+ */
+HistogramSnapshot Histogram::snapshot() const
+{
+    HistogramSnapshot result;
+    result.buckets.assign(METRICS_HISTOGRAM_BUCKETS, 0);
+
+    uint64_t min = std::numeric_limits<uint64_t>::max();
+
+    for (size_t i = 0; i < METRICS_SHARDS; ++i) {
+        const Shard &shard = _shards[i];
+
+        result.count += shard.count.load(std::memory_order_relaxed);
+        result.sum += shard.sum.load(std::memory_order_relaxed);
+        min = std::min(min, shard.min.load(std::memory_order_relaxed));
+        result.max = std::max(result.max,
+                              shard.max.load(std::memory_order_relaxed));
+
+        for (size_t j = 0; j < METRICS_HISTOGRAM_BUCKETS; ++j) {
+            result.buckets[j] +=
+                    shard.buckets[j].load(std::memory_order_relaxed);
+        }
+    }
+
+    result.min = result.count == 0 ? 0 : min;
+
+    return result;
+}
+
+/*!
+ * \brief Get the index of the bucket for \p value
+ */
+size_t Histogram::bucket_index(uint64_t value)
+{
+    if (value < METRICS_SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+
+    unsigned int exponent = 63;
+    while (!(value >> exponent)) {
+        --exponent;
+    }
+
+    unsigned int shift = exponent - METRICS_SUB_BUCKET_BITS;
+    size_t sub = static_cast<size_t>(value >> shift) & (METRICS_SUB_BUCKETS - 1);
+
+    return METRICS_SUB_BUCKETS + shift * METRICS_SUB_BUCKETS + sub;
+}
+
+/*!
+ * \brief Get the smallest value in bucket \p index
+ */
+uint64_t Histogram::bucket_lower_bound(size_t index)
+{
+    if (index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t shift = (index - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS;
+    size_t sub = (index - METRICS_SUB_BUCKETS) % METRICS_SUB_BUCKETS;
+
+    return static_cast<uint64_t>(METRICS_SUB_BUCKETS + sub) << shift;
+}
+
+/*!
+ * \brief Get the largest value in bucket \p index
+ */
+uint64_t Histogram::bucket_upper_bound(size_t index)
+{
+    if (index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+
+    size_t shift = (index - METRICS_SUB_BUCKETS) / METRICS_SUB_BUCKETS;
+
+    return bucket_lower_bound(index) + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+/*!
+ * \brief Start timing
+ */
+HistogramTimer::HistogramTimer(Histogram &histogram)
+    : _histogram(histogram)
+    , _start(std::chrono::steady_clock::now())
+{
+}
+
+/*!
+ * \brief Record the elapsed time
+ */
+HistogramTimer::~HistogramTimer()
+{
+    auto elapsed = std::chrono::steady_clock::now() - _start;
+    _histogram.record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                    elapsed).count()));
+}
+
+MetricsRegistry::MetricsRegistry()
+    : _priv_ptr(new MetricsRegistryPrivate())
+{
+}
+
+MetricsRegistry::~MetricsRegistry() = default;
+
+template<typename T>
+static T & find_or_create(std::map<std::string, std::unique_ptr<T>> &map,
+                          const std::string &name)
+{
+    auto &ptr = map[name];
+    if (!ptr) {
+        ptr.reset(new T());
+    }
+    return *ptr;
+}
+
+/*!
+ * \brief Get or create the counter named \p name
+ */
+Counter & MetricsRegistry::counter(const std::string &name)
+{
+    MB_PRIVATE(MetricsRegistry);
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+    return find_or_create(priv->counters, name);
+}
+
+/*!
+ * \brief Get or create the gauge named \p name
+ */
+Gauge & MetricsRegistry::gauge(const std::string &name)
+{
+    MB_PRIVATE(MetricsRegistry);
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+    return find_or_create(priv->gauges, name);
+}
+
+/*!
+ * \brief Get or create the histogram named \p name
+ */
+Histogram & MetricsRegistry::histogram(const std::string &name)
+{
+    MB_PRIVATE(MetricsRegistry);
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+    return find_or_create(priv->histograms, name);
+}
+
+/*!
+ * \brief Get the current values of all metrics
+ *
+ * \return Counters, then gauges, then histograms, each sorted by name
+ */
+std::vector<MetricSnapshot> MetricsRegistry::snapshot() const
+{
+    MB_PRIVATE(const MetricsRegistry);
+
+    std::vector<MetricSnapshot> result;
+
+    std::lock_guard<std::mutex> lock(priv->lock);
+
+    for (auto const &item : priv->counters) {
+        result.push_back({ item.first, MetricType::Counter,
+                           static_cast<int64_t>(item.second->value()), {} });
+    }
+    for (auto const &item : priv->gauges) {
+        result.push_back({ item.first, MetricType::Gauge,
+                           item.second->value(), {} });
+    }
+    for (auto const &item : priv->histograms) {
+        result.push_back({ item.first, MetricType::Histogram, 0,
+                           item.second->snapshot() });
+    }
+
+    return result;
+}
+
+static void append_json_string(std::string &out, const std::string &str)
+{
+    out += '"';
+
+    for (unsigned char c : str) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        default:
+            if (c < 0x20) {
+                out += format("\\u%04x", c);
+            } else {
+                out += static_cast<char>(c);
+            }
+            break;
+        }
+    }
+
+    out += '"';
+}
+
+/*!
+ * \brief Serialize all metrics to JSON
+ *
+ * The result is an object with `counters`, `gauges`, and `histograms` objects
+ * keyed by metric name. Histograms are summarized by their count, sum, min,
+ * max, mean, and the 50th, 90th, 99th, and 99.9th percentiles.
+ */
+std::string MetricsRegistry::to_json() const
+{
+    static const char *sections[] = { "counters", "gauges", "histograms" };
+
+    std::vector<MetricSnapshot> metrics = snapshot();
+    std::string out("{");
+
+    for (size_t i = 0; i < 3; ++i) {
+        auto type = static_cast<MetricType>(i);
+        bool first = true;
+
+        if (i > 0) {
+            out += ',';
+        }
+        out += format("\"%s\":{", sections[i]);
+
+        for (auto const &m : metrics) {
+            if (m.type != type) {
+                continue;
+            }
+
+            if (!first) {
+                out += ',';
+            }
+            first = false;
+
+            append_json_string(out, m.name);
+            out += ':';
+
+            if (type == MetricType::Histogram) {
+                auto const &h = m.histogram;
+                out += format(
+                        "{\"count\":%" PRIu64 ",\"sum\":%" PRIu64
+                        ",\"min\":%" PRIu64 ",\"max\":%" PRIu64
+                        ",\"mean\":%.3f,\"p50\":%" PRIu64 ",\"p90\":%" PRIu64
+                        ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 "}",
+                        h.count, h.sum, h.min, h.max, h.mean(),
+                        h.percentile(50), h.percentile(90), h.percentile(99),
+                        h.percentile(99.9));
+            } else {
+                out += format("%" PRId64, m.value);
+            }
+        }
+
+        out += '}';
+    }
+
+    out += '}';
+
+    return out;
+}
+
+/*!
+ * \brief Write all metrics to a file as JSON
+ *
+ * The file is replaced atomically, so it can be read while the metrics are
+ * being written out again.
+ *
+ * \return Whether the file was written successfully. If false, errno is set.
+ */
+bool MetricsRegistry::write_json_file(const std::string &path) const
+{
+    std::string json = to_json();
+    json += '\n';
+
+    std::string temp_path = path + ".tmp";
+
+    std::FILE *fp = std::fopen(temp_path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = std::fwrite(json.data(), 1, json.size(), fp) == json.size();
+    ret = std::fclose(fp) == 0 && ret;
+
+    if (!ret || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        int saved_errno = errno;
+        std::remove(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the process-wide registry
+ *
+ * The registry is never destroyed, so references to its metrics remain valid
+ * while the process is exiting.
+ */
+MetricsRegistry & MetricsRegistry::global()
+{
+    static MetricsRegistry *registry = new MetricsRegistry();
+    return *registry;
+}
+
+}
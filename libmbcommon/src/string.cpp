@@ -600,6 +600,220 @@ bool ends_with_icase(const std::string &string, const std::string &suffix)
                              suffix.c_str(), suffix.size());
 }
 
+/*!
+ * \brief Check if strings are equal (allows non-NULL-terminated strings)
+ *        (case sensitive)
+ *
+ * Unlike starts_with_n(), embedded NULL characters are compared too.
+ *
+ * \param a First string
+ * \param len_a First string length
+ * \param b Second string
+ * \param len_b Second string length
+ *
+ * \return Whether the strings are equal
+ */
+bool equals_n(const char *a, size_t len_a, const char *b, size_t len_b)
+{
+    return len_a == len_b && (len_a == 0 || memcmp(a, b, len_a) == 0);
+}
+
+static inline unsigned char ascii_to_lower(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c - 'A' + 'a')
+                                  : c;
+}
+
+/*!
+ * \brief Compare strings (allows non-NULL-terminated strings)
+ *        (case insensitive)
+ *
+ * Only ASCII letters are folded, so unlike starts_with_icase_n(), the result
+ * does not depend on the locale.
+ *
+ * \param a First string
+ * \param len_a First string length
+ * \param b Second string
+ * \param len_b Second string length
+ *
+ * \return Negative, zero, or positive if \p a is less than, equal to, or
+ *         greater than \p b
+ */
+int compare_icase_n(const char *a, size_t len_a, const char *b, size_t len_b)
+{
+    size_t n = len_a < len_b ? len_a : len_b;
+
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char ca = ascii_to_lower(static_cast<unsigned char>(a[i]));
+        unsigned char cb = ascii_to_lower(static_cast<unsigned char>(b[i]));
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+
+    return len_a < len_b ? -1 : len_a > len_b ? 1 : 0;
+}
+
+/*!
+ * \brief Check if strings are equal (allows non-NULL-terminated strings)
+ *        (case insensitive)
+ *
+ * \sa compare_icase_n()
+ *
+ * \param a First string
+ * \param len_a First string length
+ * \param b Second string
+ * \param len_b Second string length
+ *
+ * \return Whether the strings are equal, ignoring ASCII case
+ */
+bool equals_icase_n(const char *a, size_t len_a, const char *b, size_t len_b)
+{
+    return len_a == len_b && compare_icase_n(a, len_a, b, len_b) == 0;
+}
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f'
+            || c == '\r';
+}
+
+/*!
+ * \brief Trim whitespace from the left (without copying)
+ *
+ * \param[in,out] string String
+ * \param[in,out] len_string String length
+ */
+void trim_left_n(const char *&string, size_t &len_string)
+{
+    while (len_string > 0 && is_space(*string)) {
+        ++string;
+        --len_string;
+    }
+}
+
+/*!
+ * \brief Trim whitespace from the right (without copying)
+ *
+ * \param[in,out] string String
+ * \param[in,out] len_string String length
+ */
+void trim_right_n(const char *&string, size_t &len_string)
+{
+    while (len_string > 0 && is_space(string[len_string - 1])) {
+        --len_string;
+    }
+}
+
+/*!
+ * \brief Trim whitespace from the left and the right (without copying)
+ *
+ * \param[in,out] string String
+ * \param[in,out] len_string String length
+ */
+void trim_n(const char *&string, size_t &len_string)
+{
+    trim_left_n(string, len_string);
+    trim_right_n(string, len_string);
+}
+
+/*!
+ * \class StringSplitter
+ *
+ * \brief Split a string into tokens without allocating memory
+ *
+ * The tokens point into the original string, which (along with the delimiter)
+ * must outlive the splitter.
+ *
+ * Example usage:
+ *
+ * \code{.cpp}
+ * mb::StringSplitter splitter(str.data(), str.size(), ",", 1);
+ * const char *token;
+ * size_t len;
+ *
+ * while (splitter.next(token, len)) {
+ *     printf("%.*s\n", static_cast<int>(len), token);
+ * }
+ * \endcode
+ */
+
+/*!
+ * \brief Construct splitter for a string
+ *
+ * With SplitMode::Delimiter, an empty delimiter produces no tokens and any
+ * other delimiter produces at least one (possibly empty) token. With
+ * SplitMode::AnyOf, the behavior matches `strtok_r()`.
+ *
+ * \param string String to split
+ * \param len_string String length
+ * \param delim Delimiter string or set of delimiter characters
+ * \param len_delim Delimiter length
+ * \param mode Split mode
+ */
+StringSplitter::StringSplitter(const char *string, size_t len_string,
+                               const char *delim, size_t len_delim,
+                               SplitMode mode)
+    : _cur(string)
+    , _end(string + len_string)
+    , _delim(delim)
+    , _len_delim(len_delim)
+    , _mode(mode)
+    , _done(mode == SplitMode::Delimiter && len_delim == 0)
+{
+}
+
+/*!
+ * \brief Get next token
+ *
+ * \param[out] token Pointer to the beginning of the token
+ * \param[out] len_token Length of the token
+ *
+ * \return Whether a token was found. \p token and \p len_token are left
+ *         unchanged if no more tokens are available.
+ */
+bool StringSplitter::next(const char *&token, size_t &len_token)
+{
+    if (_done) {
+        return false;
+    }
+
+    if (_mode == SplitMode::AnyOf) {
+        while (_cur != _end && memchr(_delim, *_cur, _len_delim)) {
+            ++_cur;
+        }
+        if (_cur == _end) {
+            _done = true;
+            return false;
+        }
+
+        const char *begin = _cur;
+        while (_cur != _end && !memchr(_delim, *_cur, _len_delim)) {
+            ++_cur;
+        }
+
+        token = begin;
+        len_token = static_cast<size_t>(_cur - begin);
+        return true;
+    }
+
+    auto match = static_cast<const char *>(mb_memmem(
+            _cur, static_cast<size_t>(_end - _cur), _delim, _len_delim));
+
+    token = _cur;
+
+    if (match) {
+        len_token = static_cast<size_t>(match - _cur);
+        _cur = match + _len_delim;
+    } else {
+        len_token = static_cast<size_t>(_end - _cur);
+        _cur = _end;
+        _done = true;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Insert byte sequence into byte sequence
  *
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/thread_pool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdlib>
+
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <unistd.h>
+#endif
+
+// Environment variable for overriding the size of the global pool. Setting it
+// to 1 makes all tasks run deterministically on the waiting thread.
+#define THREAD_POOL_SIZE_ENV    "MB_THREAD_POOL_SIZE"
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+struct PoolTask
+{
+    std::function<void()> fn;
+    TaskGroup *group;
+};
+
+struct WorkerQueue
+{
+    std::mutex lock;
+    std::deque<PoolTask> tasks;
+};
+
+class ThreadPoolPrivate
+{
+public:
+    unsigned int thread_count;
+
+    // One queue per worker, plus one at the end for tasks submitted from
+    // threads outside of the pool
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+    // Used to find the calling thread's queue. This is only written before the
+    // workers start running tasks.
+    std::vector<std::thread::id> worker_ids;
+
+    // Number of queued tasks. May briefly be negative since it is decremented
+    // before the matching increment when a task is taken right after it was
+    // pushed.
+    std::atomic<long> queued{0};
+
+    // Used by idle workers and by threads waiting for a group
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    bool stop = false;
+
+    // Group for tasks submitted without one
+    std::unique_ptr<TaskGroup> default_group;
+
+    size_t current_queue() const;
+    void push(PoolTask task);
+    bool pop(size_t self, PoolTask &task);
+    void run(PoolTask &task);
+    void notify_waiters();
+    void worker_loop(size_t index);
+};
+/*! \endcond */
+
+/*!
+ * \brief Get the index of the calling thread's queue
+ *
+ * Threads outside of the pool share the last queue. This is a linear search,
+ * but pools are small and this avoids thread-local storage, which is not
+ * reliable in the static binaries used during early boot.
+ */
+size_t ThreadPoolPrivate::current_queue() const
+{
+    auto id = std::this_thread::get_id();
+
+    for (size_t i = 0; i < worker_ids.size(); ++i) {
+        if (worker_ids[i] == id) {
+            return i;
+        }
+    }
+
+    return queues.size() - 1;
+}
+
+void ThreadPoolPrivate::push(PoolTask task)
+{
+    auto &queue = *queues[current_queue()];
+
+    {
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+        ++queued;
+    }
+    sleep_cv.notify_one();
+}
+
+/*!
+ * \brief Take a task to run
+ *
+ * The thread's own queue is used in LIFO order to keep recently submitted
+ * (and likely cache-hot) work local. Other queues are stolen from in FIFO
+ * order, starting with the shared queue.
+ */
+bool ThreadPoolPrivate::pop(size_t self, PoolTask &task)
+{
+    size_t n = queues.size();
+
+    for (size_t i = 0; i < n; ++i) {
+        // Own queue first, then the shared queue, then the other workers
+        size_t index = i == 0 ? self : (self + n - i) % n;
+        auto &queue = *queues[index];
+
+        std::lock_guard<std::mutex> lock(queue.lock);
+
+        if (queue.tasks.empty()) {
+            continue;
+        }
+
+        // The shared queue is always FIFO so that the single-threaded mode
+        // runs tasks in submission order
+        if (index == self && index != n - 1) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+
+        --queued;
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPoolPrivate::run(PoolTask &task)
+{
+    TaskGroup *group = task.group;
+
+    if (!group->is_cancelled()) {
+        task.fn();
+    }
+
+    // Release anything captured by the task before waking up the waiters
+    task.fn = nullptr;
+
+    // The group may be destroyed as soon as the count reaches zero, so it must
+    // not be touched after this
+    if (--group->_pending == 0) {
+        notify_waiters();
+    }
+}
+
+void ThreadPoolPrivate::notify_waiters()
+{
+    // Taking the lock ensures that a waiter is either not yet checking its
+    // condition or is already sleeping
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+    }
+    sleep_cv.notify_all();
+}
+
+void ThreadPoolPrivate::worker_loop(size_t index)
+{
+    while (true) {
+        PoolTask task;
+
+        if (pop(index, task)) {
+            run(task);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        sleep_cv.wait(lock, [&]{
+            return stop || queued > 0;
+        });
+
+        if (stop && queued <= 0) {
+            return;
+        }
+    }
+}
+
+/*!
+ * \brief Create a group for tasks in \p pool
+ */
+TaskGroup::TaskGroup(ThreadPool &pool)
+    : _pool(pool)
+    , _pending(0)
+    , _cancelled(false)
+{
+}
+
+/*!
+ * \brief Wait for the pending tasks and destroy the group
+ */
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+/*!
+ * \brief Submit a task to the pool as part of this group
+ */
+void TaskGroup::submit(std::function<void()> task)
+{
+    _pool.submit(*this, std::move(task));
+}
+
+/*!
+ * \brief Wait for all tasks in the group to complete
+ *
+ * The calling thread runs queued tasks while it waits, so this can be called
+ * from within a task without tying up a worker.
+ */
+void TaskGroup::wait()
+{
+    _pool.wait(*this);
+}
+
+/*!
+ * \brief Cancel the group
+ *
+ * Tasks that have not started yet will be skipped. Running tasks can check
+ * is_cancelled() to stop early. Tasks submitted after calling this are skipped
+ * as well.
+ */
+void TaskGroup::cancel()
+{
+    _cancelled = true;
+}
+
+/*!
+ * \brief Check if the group was cancelled
+ */
+bool TaskGroup::is_cancelled() const
+{
+    return _cancelled;
+}
+
+/*!
+ * \brief Create a new pool
+ *
+ * \param threads Number of threads or 0 to use the number of online CPUs. If
+ *                this is 1, no threads are started and tasks run on the thread
+ *                that waits for them.
+ */
+ThreadPool::ThreadPool(unsigned int threads)
+    : _priv_ptr(new ThreadPoolPrivate())
+{
+    MB_PRIVATE(ThreadPool);
+
+    if (threads == 0) {
+        threads = online_cpus();
+    }
+
+    priv->thread_count = threads;
+    priv->default_group.reset(new TaskGroup(*this));
+
+    unsigned int workers = threads > 1 ? threads : 0;
+
+    for (unsigned int i = 0; i <= workers; ++i) {
+        priv->queues.emplace_back(new WorkerQueue());
+    }
+    priv->workers.reserve(workers);
+    priv->worker_ids.reserve(workers);
+
+    // Hold the sleep lock so no worker looks up its ID before all of them are
+    // known
+    std::lock_guard<std::mutex> lock(priv->sleep_lock);
+
+    for (unsigned int i = 0; i < workers; ++i) {
+        priv->workers.emplace_back(&ThreadPoolPrivate::worker_loop, priv, i);
+        priv->worker_ids.push_back(priv->workers.back().get_id());
+    }
+}
+
+/*!
+ * \brief Wait for all tasks to complete and stop the threads
+ */
+ThreadPool::~ThreadPool()
+{
+    MB_PRIVATE(ThreadPool);
+
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock(priv->sleep_lock);
+        priv->stop = true;
+    }
+    priv->sleep_cv.notify_all();
+
+    for (auto &t : priv->workers) {
+        t.join();
+    }
+
+    priv->default_group.reset();
+}
+
+/*!
+ * \brief Number of tasks that can run concurrently
+ */
+unsigned int ThreadPool::thread_count() const
+{
+    MB_PRIVATE(const ThreadPool);
+    return priv->thread_count;
+}
+
+/*!
+ * \brief Submit a task that is not part of any group
+ *
+ * Use wait() to wait for all such tasks.
+ */
+void ThreadPool::submit(std::function<void()> task)
+{
+    MB_PRIVATE(ThreadPool);
+    submit(*priv->default_group, std::move(task));
+}
+
+/*!
+ * \brief Wait for all tasks submitted with submit() to complete
+ */
+void ThreadPool::wait()
+{
+    MB_PRIVATE(ThreadPool);
+    wait(*priv->default_group);
+}
+
+/*!
+ * \brief Run a function over a range of indexes in parallel
+ *
+ * The range [\p begin, \p end) is split into chunks of \p grain indexes and
+ * \p fn is called with the bounds of each chunk. The calling thread helps to
+ * run the chunks.
+ *
+ * If \p fn returns false, the chunks that have not started yet are skipped.
+ *
+ * \param begin Start of range
+ * \param end End of range (exclusive)
+ * \param grain Number of indexes per chunk or 0 to choose automatically
+ * \param fn Function to call for each chunk
+ *
+ * \return Whether \p fn returned true for every chunk
+ */
+bool ThreadPool::parallel_for(size_t begin, size_t end, size_t grain,
+                              const std::function<bool(size_t, size_t)> &fn)
+{
+    if (end <= begin) {
+        return true;
+    }
+
+    size_t n = end - begin;
+
+    if (grain == 0) {
+        // A few chunks per thread to balance uneven work
+        grain = std::max<size_t>(1, n / (thread_count() * 4));
+    }
+
+    TaskGroup group(*this);
+
+    for (size_t i = begin; i < end; i += std::min(grain, end - i)) {
+        size_t chunk_end = i + std::min(grain, end - i);
+
+        group.submit([&fn, &group, i, chunk_end]{
+            if (!fn(i, chunk_end)) {
+                group.cancel();
+            }
+        });
+    }
+
+    group.wait();
+
+    return !group.is_cancelled();
+}
+
+/*!
+ * \brief Get the process-wide pool
+ *
+ * The pool has one thread per online CPU, unless the `MB_THREAD_POOL_SIZE`
+ * environment variable is set. The pool is never destroyed, so it remains
+ * usable while the process is exiting.
+ */
+ThreadPool & ThreadPool::global()
+{
+    static ThreadPool *pool = []{
+        unsigned int threads = 0;
+
+        const char *env = getenv(THREAD_POOL_SIZE_ENV);
+        if (env) {
+            char *end;
+            unsigned long n = strtoul(env, &end, 10);
+            if (*env != '\0' && *end == '\0' && n <= 1024) {
+                threads = static_cast<unsigned int>(n);
+            }
+        }
+
+        return new ThreadPool(threads);
+    }();
+
+    return *pool;
+}
+
+/*!
+ * \brief Get the number of online CPUs
+ *
+ * \return Number of online CPUs or 1 if it cannot be determined (eg. when
+ *         /sys is not mounted yet)
+ */
+unsigned int ThreadPool::online_cpus()
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    long n = si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    if (n < 1) {
+        n = std::thread::hardware_concurrency();
+    }
+
+    return n < 1 ? 1 : static_cast<unsigned int>(n);
+}
+
+void ThreadPool::submit(TaskGroup &group, std::function<void()> task)
+{
+    MB_PRIVATE(ThreadPool);
+
+    ++group._pending;
+    priv->push({ std::move(task), &group });
+}
+
+void ThreadPool::wait(TaskGroup &group)
+{
+    MB_PRIVATE(ThreadPool);
+
+    size_t self = priv->current_queue();
+
+    while (group._pending > 0) {
+        PoolTask task;
+
+        if (priv->pop(self, task)) {
+            priv->run(task);
+            continue;
+        }
+
+        // Sleep until the group is done or there is something to help with
+        std::unique_lock<std::mutex> lock(priv->sleep_lock);
+        priv->sleep_cv.wait(lock, [&]{
+            return group._pending == 0 || priv->queued > 0;
+        });
+    }
+}
+
+}
@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gmock/gmock.h>
+
+#include <cstring>
+
+#include "mbcommon/file/buffered.h"
+#include "mbcommon/file/buffered_p.h"
+#include "mbcommon/file_util.h"
+
+#include "mock_test_file.h"
+
+struct FileBufferedTest : testing::Test
+{
+    TestFileCounters _counters;
+    TestFile _file{&_counters};
+
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(_file.open());
+    }
+};
+
+TEST_F(FileBufferedTest, OpenFile)
+{
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+}
+
+TEST_F(FileBufferedTest, OpenWithoutFile)
+{
+    mb::BufferedFile file(nullptr, 16);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileBufferedTest, OpenZeroBufferSize)
+{
+    mb::BufferedFile file(&_file, 0);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileBufferedTest, OpenUsesCurrentPosition)
+{
+    ASSERT_TRUE(_file.seek(10, SEEK_SET, nullptr));
+
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 10u);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, 'k');
+}
+
+TEST_F(FileBufferedTest, CloseDoesNotCloseUnderlyingFile)
+{
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+    ASSERT_TRUE(_file.is_open());
+    ASSERT_EQ(_counters.n_close, 0u);
+}
+
+TEST_F(FileBufferedTest, SmallReadsAreBuffered)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    unsigned int n_read = _counters.n_read;
+
+    // 64 single byte reads should only require one underlying read
+    for (size_t i = 0; i < 64; ++i) {
+        char c;
+        size_t n;
+        ASSERT_TRUE(file.read(&c, 1, n));
+        ASSERT_EQ(n, 1u);
+        ASSERT_EQ(c, static_cast<char>('a' + i % 26));
+    }
+    ASSERT_EQ(_counters.n_read - n_read, 1u);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, static_cast<char>('a' + 64 % 26));
+    ASSERT_EQ(_counters.n_read - n_read, 2u);
+}
+
+TEST_F(FileBufferedTest, LargeReadsBypassBuffer)
+{
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[32];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, _file._buf.data(), sizeof(buf)), 0);
+    ASSERT_EQ(_file._position, sizeof(buf));
+}
+
+TEST_F(FileBufferedTest, ReadToEof)
+{
+    mb::BufferedFile file(&_file, 100);
+    ASSERT_TRUE(file.is_open());
+
+    std::vector<unsigned char> data(INITIAL_BUF_SIZE + 10);
+    size_t n;
+    ASSERT_TRUE(mb::file_read_fully(file, data.data(), 7, n));
+    ASSERT_EQ(n, 7u);
+    ASSERT_TRUE(mb::file_read_fully(file, data.data() + 7, data.size() - 7,
+                                    n));
+    ASSERT_EQ(n, INITIAL_BUF_SIZE - 7);
+    ASSERT_EQ(memcmp(data.data(), _file._buf.data(), INITIAL_BUF_SIZE), 0);
+}
+
+TEST_F(FileBufferedTest, SeekWithinBufferSkipsUnderlyingSeek)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+
+    unsigned int n_seek = _counters.n_seek;
+    unsigned int n_read = _counters.n_read;
+
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(30, SEEK_SET, &pos));
+    ASSERT_EQ(pos, 30u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'e');
+    ASSERT_TRUE(file.seek(-11, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 20u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'u');
+
+    ASSERT_EQ(_counters.n_seek, n_seek);
+    ASSERT_EQ(_counters.n_read, n_read);
+}
+
+TEST_F(FileBufferedTest, SeekOutsideBuffer)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+
+    unsigned int n_seek = _counters.n_seek;
+
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(500, SEEK_SET, &pos));
+    ASSERT_EQ(pos, 500u);
+    ASSERT_EQ(_counters.n_seek - n_seek, 1u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, static_cast<char>('a' + 500 % 26));
+}
+
+TEST_F(FileBufferedTest, SeekEnd)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(-1, SEEK_END, &pos));
+    ASSERT_EQ(pos, INITIAL_BUF_SIZE - 1);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, static_cast<char>('a' + (INITIAL_BUF_SIZE - 1) % 26));
+}
+
+TEST_F(FileBufferedTest, SeekInvalid)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.seek(-1, SEEK_SET, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(file.seek(-1, SEEK_CUR, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileBufferedTest, SmallWritesAreBuffered)
+{
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_TRUE(file.write("x", 1, n));
+        ASSERT_EQ(n, 1u);
+    }
+    ASSERT_EQ(_counters.n_write, 0u);
+    ASSERT_EQ(_file._buf[0], 'a');
+
+    ASSERT_TRUE(file.flush());
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "xxxxxxxxxxk", 11), 0);
+    ASSERT_EQ(_file._position, 10u);
+}
+
+TEST_F(FileBufferedTest, WriteFlushesWhenFull)
+{
+    mb::BufferedFile file(&_file, 4);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("123", 3, n));
+    ASSERT_TRUE(file.write("45", 2, n));
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "123d", 4), 0);
+
+    ASSERT_TRUE(file.close());
+    ASSERT_EQ(memcmp(_file._buf.data(), "12345f", 6), 0);
+}
+
+TEST_F(FileBufferedTest, LargeWritesBypassBuffer)
+{
+    mb::BufferedFile file(&_file, 4);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("12345678", 8, n));
+    ASSERT_EQ(n, 8u);
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "12345678i", 9), 0);
+}
+
+TEST_F(FileBufferedTest, WriteAfterRead)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_TRUE(file.write("XY", 2, n));
+    ASSERT_TRUE(file.read(buf, 2, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(buf, "gh", 2), 0);
+    ASSERT_TRUE(file.close());
+
+    ASSERT_EQ(memcmp(_file._buf.data(), "abcdXYghi", 9), 0);
+}
+
+TEST_F(FileBufferedTest, SeekFlushesWrites)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("XY", 2, n));
+    ASSERT_TRUE(file.seek(100, SEEK_SET, nullptr));
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_TRUE(file.write("Z", 1, n));
+    ASSERT_TRUE(file.seek(0, SEEK_SET, nullptr));
+
+    char buf[3];
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(memcmp(buf, "XYc", 3), 0);
+    ASSERT_EQ(_file._buf[100], 'Z');
+}
+
+TEST_F(FileBufferedTest, TruncateFlushesWrites)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("XY", 2, n));
+    ASSERT_TRUE(file.truncate(1));
+    ASSERT_EQ(_file._buf.size(), 1u);
+    ASSERT_EQ(_file._buf[0], 'X');
+}
+
+TEST_F(FileBufferedTest, ReadFailure)
+{
+    testing::NiceMock<MockTestFile> mock;
+    ASSERT_TRUE(mock.open());
+
+    mb::BufferedFile file(&mock, 64);
+    ASSERT_TRUE(file.is_open());
+
+    EXPECT_CALL(mock, on_read(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(
+                    testing::InvokeWithoutArgs([&]() {
+                        mock.set_error(mb::make_error_code(
+                                mb::FileError::UnsupportedRead), "Foo");
+                    }),
+                    testing::Return(false)));
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read(&c, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedRead);
+    ASSERT_NE(file.error_string().find("Foo"), std::string::npos);
+}
+
+TEST_F(FileBufferedTest, FlushFailure)
+{
+    testing::NiceMock<MockTestFile> mock;
+    ASSERT_TRUE(mock.open());
+
+    mb::BufferedFile file(&mock, 64);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write("XY", 2, n));
+
+    EXPECT_CALL(mock, on_write(testing::_, testing::_, testing::_))
+            .Times(testing::AtLeast(1))
+            .WillRepeatedly(testing::DoAll(
+                    testing::InvokeWithoutArgs([&]() {
+                        mock.set_error(mb::make_error_code(
+                                mb::FileError::UnsupportedWrite), "Foo");
+                    }),
+                    testing::Return(false)));
+
+    ASSERT_FALSE(file.flush());
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+}
+
+TEST_F(FileBufferedTest, SeekUnsupportedIfUnderlyingUnsupported)
+{
+    testing::NiceMock<MockTestFile> mock;
+    ASSERT_TRUE(mock.open());
+
+    EXPECT_CALL(mock, on_seek(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(
+                    testing::InvokeWithoutArgs([&]() {
+                        mock.set_error(mb::make_error_code(
+                                mb::FileError::UnsupportedSeek), "Foo");
+                    }),
+                    testing::Return(false)));
+
+    mb::BufferedFile file(&mock, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'a');
+
+    ASSERT_FALSE(file.seek(0, SEEK_CUR, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedSeek);
+}
@@ -19,7 +19,12 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <string>
+#include <utility>
+
 #include <cinttypes>
+#include <cstring>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file_p.h"
@@ -181,3 +186,134 @@ TEST_F(FileCallbacksTest, CheckMoveOpensAndClosesProperly)
     ASSERT_EQ(_n_open_cb, 2u);
     ASSERT_EQ(_n_close_cb, 1u);
 }
+
+struct FileCallbacksBlockProducer
+{
+    std::string data;
+    size_t block_size;
+    size_t pos;
+    unsigned int n_blocks;
+
+    FileCallbacksBlockProducer(std::string data_, size_t block_size_)
+        : data(std::move(data_)), block_size(block_size_), pos(0), n_blocks(0)
+    {
+    }
+
+    static bool read_block_cb(mb::File &file, void *userdata,
+                              const void *&buf, size_t &size)
+    {
+        (void) file;
+
+        auto *p = static_cast<FileCallbacksBlockProducer *>(userdata);
+        ++p->n_blocks;
+
+        buf = p->data.data() + p->pos;
+        size = std::min(p->block_size, p->data.size() - p->pos);
+        p->pos += size;
+
+        return true;
+    }
+
+    static bool seek_cb(mb::File &file, void *userdata,
+                        int64_t offset, int whence, uint64_t &new_offset)
+    {
+        (void) file;
+
+        auto *p = static_cast<FileCallbacksBlockProducer *>(userdata);
+        if (whence != SEEK_CUR) {
+            return false;
+        }
+
+        p->pos = static_cast<size_t>(static_cast<int64_t>(p->pos) + offset);
+        new_offset = p->pos;
+
+        return true;
+    }
+};
+
+TEST(FileCallbacksBlockTest, PeekAndConsumeLendProducerBuffer)
+{
+    FileCallbacksBlockProducer producer("abcdefghij", 4);
+
+    mb::CallbackFile file;
+    ASSERT_TRUE(file.set_read_block_cb(&FileCallbacksBlockProducer::read_block_cb));
+    ASSERT_TRUE(file.open(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                          &producer));
+
+    const void *buf;
+    size_t size;
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(buf, producer.data.data());
+    ASSERT_EQ(size, 4u);
+
+    // Peeking again does not fetch a new block
+    ASSERT_TRUE(file.consume(1));
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(buf, producer.data.data() + 1);
+    ASSERT_EQ(size, 3u);
+    ASSERT_EQ(producer.n_blocks, 1u);
+
+    ASSERT_FALSE(file.consume(4));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+
+    // Reads are served from the lent block and never span blocks
+    char out[10];
+    size_t n;
+    ASSERT_TRUE(file.read(out, sizeof(out), n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(out, "bcd", 3), 0);
+    ASSERT_TRUE(file.read(out, 2, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(out, "ef", 2), 0);
+
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(size, 2u);
+    ASSERT_TRUE(file.consume(2));
+    ASSERT_TRUE(file.read(out, sizeof(out), n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(out, "ij", 2), 0);
+
+    // EOF
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(size, 0u);
+    ASSERT_TRUE(file.read(out, sizeof(out), n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST(FileCallbacksBlockTest, SeekAccountsForUnconsumedData)
+{
+    FileCallbacksBlockProducer producer("abcdefghij", 4);
+
+    mb::CallbackFile file;
+    ASSERT_TRUE(file.set_read_block_cb(&FileCallbacksBlockProducer::read_block_cb));
+    ASSERT_TRUE(file.open(nullptr, nullptr, nullptr, nullptr,
+                          &FileCallbacksBlockProducer::seek_cb, nullptr, &producer));
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'a');
+
+    // The producer is at offset 4, but the file position is 1
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(2, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 3u);
+
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'd');
+}
+
+TEST(FileCallbacksBlockTest, PeekUnsupportedWithoutBlockCallback)
+{
+    mb::CallbackFile file(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                          nullptr);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.set_read_block_cb(&FileCallbacksBlockProducer::read_block_cb));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+
+    const void *buf;
+    size_t size;
+    ASSERT_FALSE(file.peek(buf, size));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedRead);
+}
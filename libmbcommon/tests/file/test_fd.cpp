@@ -20,6 +20,7 @@
 #include <gmock/gmock.h>
 
 #include <climits>
+#include <vector>
 
 #include <fcntl.h>
 
@@ -45,6 +46,16 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
     MOCK_METHOD3(fn_lseek64, off64_t(int fd, off64_t offset, int whence));
     MOCK_METHOD3(fn_read, ssize_t(int fd, void *buf, size_t count));
     MOCK_METHOD3(fn_write, ssize_t(int fd, const void *buf, size_t count));
+#ifndef _WIN32
+    MOCK_METHOD4(fn_pread64, ssize_t(int fd, void *buf, size_t count,
+                                     off64_t offset));
+    MOCK_METHOD4(fn_pwrite64, ssize_t(int fd, const void *buf, size_t count,
+                                      off64_t offset));
+    MOCK_METHOD3(fn_readv, ssize_t(int fd, const struct iovec *iov,
+                                   int iovcnt));
+    MOCK_METHOD3(fn_writev, ssize_t(int fd, const struct iovec *iov,
+                                    int iovcnt));
+#endif
 
     struct stat _sb_regfile{};
 
@@ -72,6 +83,18 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
         ON_CALL(*this, fn_write(testing::_, testing::_, testing::_))
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#ifndef _WIN32
+        ON_CALL(*this, fn_pread64(testing::_, testing::_, testing::_,
+                                  testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_pwrite64(testing::_, testing::_, testing::_,
+                                   testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_readv(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_writev(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#endif
     }
 
     void report_as_regular_file()
@@ -550,3 +573,179 @@ TEST_F(FileFdTest, TruncateFailed)
     ASSERT_FALSE(file.truncate(1024));
     ASSERT_EQ(file.error(), std::errc::io_error);
 }
+
+#ifndef _WIN32
+TEST_F(FileFdTest, ReadAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that pread is used instead of seek + read
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_, 100))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read_at(100, &c, 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, ReadAtFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(100, &c, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileFdTest, WriteAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that pwrite is used instead of seek + write
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, testing::_, 100))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write_at(100, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, WriteAtFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, testing::_,
+                                    testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_FALSE(file.write_at(100, "x", 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+static ssize_t total_iov_size(const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+TEST_F(FileFdTest, ReadvSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that all buffers are passed to a single readv call
+    EXPECT_CALL(_funcs, fn_readv(testing::_, testing::_, 2))
+            .Times(1)
+            .WillOnce(testing::Invoke([](int, const struct iovec *iov,
+                                         int iovcnt) {
+                return total_iov_size(iov, iovcnt);
+            }));
+    EXPECT_CALL(_funcs, fn_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char a[2];
+    char b[3];
+    mb::FileIovec iov[] = { { a, sizeof(a) }, { b, sizeof(b) } };
+    size_t n;
+    ASSERT_TRUE(file.readv(iov, 2, n));
+    ASSERT_EQ(n, 5u);
+}
+
+TEST_F(FileFdTest, ReadvFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_readv(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char a[2];
+    mb::FileIovec iov[] = { { a, sizeof(a) } };
+    size_t n;
+    ASSERT_FALSE(file.readv(iov, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileFdTest, WritevSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that all buffers are passed to a single writev call
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, 3))
+            .Times(1)
+            .WillOnce(testing::Invoke([](int, const struct iovec *iov,
+                                         int iovcnt) {
+                return total_iov_size(iov, iovcnt);
+            }));
+    EXPECT_CALL(_funcs, fn_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char a[] = "ab";
+    char b[] = "cde";
+    char c[] = "f";
+    mb::FileIovec iov[] = { { a, 2 }, { b, 3 }, { c, 1 } };
+    size_t n;
+    ASSERT_TRUE(file.writev(iov, 3, n));
+    ASSERT_EQ(n, 6u);
+}
+
+TEST_F(FileFdTest, WritevTooManyBuffers)
+{
+    _funcs.report_as_regular_file();
+
+    // Excess buffers are left for the next call
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, 64))
+            .Times(1)
+            .WillOnce(testing::Invoke([](int, const struct iovec *iov,
+                                         int iovcnt) {
+                return total_iov_size(iov, iovcnt);
+            }));
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c = 'x';
+    std::vector<mb::FileIovec> iov(100, mb::FileIovec{ &c, 1 });
+    size_t n;
+    ASSERT_TRUE(file.writev(iov.data(), iov.size(), n));
+    ASSERT_EQ(n, 64u);
+}
+#endif
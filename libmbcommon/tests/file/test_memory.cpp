@@ -20,6 +20,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/memory.h"
@@ -515,3 +516,209 @@ TEST(FileDynamicMemoryTest, TruncateFile)
 
     free(in);
 }
+
+TEST(FileStaticMemoryTest, ReadAtDoesNotChangePosition)
+{
+    constexpr char in[] = "abcdef";
+    constexpr size_t in_size = 6;
+    char out[3];
+    size_t out_size;
+    uint64_t pos;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read_at(2, out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 3u);
+    ASSERT_EQ(memcmp(out, "cde", 3), 0);
+
+    ASSERT_TRUE(file.read_at(5, out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 1u);
+    ASSERT_EQ(out[0], 'f');
+
+    ASSERT_TRUE(file.read_at(10, out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 0u);
+
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+}
+
+TEST(FileStaticMemoryTest, WriteAtOutOfBounds)
+{
+    char in[] = "abc";
+    constexpr size_t in_size = 3;
+    size_t n;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write_at(2, "xy", 2, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(in[2], 'x');
+}
+
+TEST(FileDynamicMemoryTest, WriteAtEnlargesBuffer)
+{
+    void *data = nullptr;
+    size_t data_size = 0;
+    size_t n;
+    uint64_t pos;
+
+    mb::MemoryFile file(&data, &data_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write_at(4, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(data_size, 5u);
+    ASSERT_EQ(memcmp(data, "\0\0\0\0x", 5), 0);
+
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+
+    ASSERT_TRUE(file.close());
+    free(data);
+}
+
+
+struct CountingAllocator
+{
+    unsigned int calls = 0;
+    size_t last_old_capacity = 0;
+
+    static void * realloc_fn(void *userdata, void *ptr, size_t old_capacity,
+                             size_t new_capacity)
+    {
+        auto a = static_cast<CountingAllocator *>(userdata);
+        ++a->calls;
+        a->last_old_capacity = old_capacity;
+        return realloc(ptr, new_capacity);
+    }
+};
+
+TEST(FileDynamicMemoryTest, WritesGrowGeometrically)
+{
+    void *data = nullptr;
+    size_t data_size = 0;
+    size_t n;
+    CountingAllocator allocator;
+
+    mb::MemoryFile file;
+    ASSERT_TRUE(file.set_allocator(&CountingAllocator::realloc_fn,
+                                   &allocator));
+    ASSERT_TRUE(file.open(&data, &data_size));
+
+    for (size_t i = 0; i < 1024 * 1024; i += 64) {
+        char buf[64];
+        memset(buf, static_cast<int>(i / 64), sizeof(buf));
+        ASSERT_TRUE(file.write(buf, sizeof(buf), n));
+        ASSERT_EQ(n, sizeof(buf));
+    }
+
+    ASSERT_EQ(data_size, 1024u * 1024);
+    ASSERT_GE(file.capacity(), data_size);
+    // 4 KiB to 1 MiB by doubling
+    ASSERT_LE(allocator.calls, 9u);
+    ASSERT_EQ(static_cast<unsigned char *>(data)[64 * 300], 300 % 256);
+
+    ASSERT_TRUE(file.close());
+    free(data);
+}
+
+TEST(FileDynamicMemoryTest, ReserveAvoidsReallocation)
+{
+    void *data = nullptr;
+    size_t data_size = 0;
+    size_t n;
+    CountingAllocator allocator;
+
+    mb::MemoryFile file;
+    ASSERT_TRUE(file.set_allocator(&CountingAllocator::realloc_fn,
+                                   &allocator));
+    ASSERT_TRUE(file.open(&data, &data_size));
+
+    ASSERT_TRUE(file.reserve(100000));
+    ASSERT_EQ(allocator.calls, 1u);
+    ASSERT_EQ(file.capacity(), 100000u);
+    ASSERT_EQ(data_size, 0u);
+
+    std::vector<char> buf(1000, 'a');
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(file.write(buf.data(), buf.size(), n));
+    }
+    ASSERT_EQ(allocator.calls, 1u);
+    ASSERT_EQ(data_size, 100000u);
+
+    // Shrinking keeps the capacity
+    ASSERT_TRUE(file.truncate(10));
+    ASSERT_EQ(data_size, 10u);
+    ASSERT_EQ(file.capacity(), 100000u);
+
+    // Growing again zero-initializes the new space
+    ASSERT_TRUE(file.truncate(20));
+    ASSERT_EQ(memcmp(data, "aaaaaaaaaa\0\0\0\0\0\0\0\0\0\0", 20), 0);
+    ASSERT_EQ(allocator.calls, 1u);
+
+    // Growing past the capacity passes the previous capacity to the allocator
+    ASSERT_TRUE(file.truncate(200000));
+    ASSERT_EQ(allocator.calls, 2u);
+    ASSERT_EQ(allocator.last_old_capacity, 100000u);
+
+    ASSERT_TRUE(file.close());
+    free(data);
+}
+
+TEST(FileDynamicMemoryTest, SetAllocatorWhenOpen)
+{
+    void *data = nullptr;
+    size_t data_size = 0;
+
+    mb::MemoryFile file(&data, &data_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.set_allocator(&CountingAllocator::realloc_fn, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+
+    ASSERT_TRUE(file.close());
+    free(data);
+}
+
+TEST(FileStaticMemoryTest, ReserveUnsupported)
+{
+    char in[] = "x";
+
+    mb::MemoryFile file(in, 1);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.reserve(10));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+    ASSERT_EQ(file.capacity(), 1u);
+}
+
+TEST(FileStaticMemoryTest, PeekLendsBuffer)
+{
+    char in[] = "abcdef";
+
+    mb::MemoryFile file(in, 6);
+    ASSERT_TRUE(file.is_open());
+
+    const void *buf;
+    size_t size;
+
+    ASSERT_TRUE(file.seek(2, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(buf, in + 2);
+    ASSERT_EQ(size, 4u);
+
+    ASSERT_FALSE(file.consume(5));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_TRUE(file.consume(3));
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, 'f');
+
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(size, 0u);
+}
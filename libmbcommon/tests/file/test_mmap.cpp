@@ -0,0 +1,513 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gmock/gmock.h>
+
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/file/mmap_p.h"
+
+struct MockMmapFileFuncs : public mb::MmapFileFuncs
+{
+    // fcntl.h
+    MOCK_METHOD3(fn_open, int(const char *path, int flags, mode_t mode));
+
+    // sys/mman.h
+    MOCK_METHOD6(fn_mmap64, void *(void *addr, size_t length, int prot,
+                                   int flags, int fd, off64_t offset));
+    MOCK_METHOD2(fn_munmap, int(void *addr, size_t length));
+
+    // sys/stat.h
+    MOCK_METHOD2(fn_fstat, int(int fildes, struct stat *buf));
+
+    // unistd.h
+    MOCK_METHOD1(fn_close, int(int fd));
+    MOCK_METHOD3(fn_lseek64, off64_t(int fd, off64_t offset, int whence));
+    MOCK_METHOD0(fn_page_size, long());
+
+    std::vector<char> _contents;
+    struct stat _sb_regfile{};
+
+    MockMmapFileFuncs()
+    {
+        _sb_regfile.st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+
+        // Fail everything by default
+        ON_CALL(*this, fn_open(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_mmap64(testing::_, testing::_, testing::_,
+                                 testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, MAP_FAILED));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_close(testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_lseek64(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_page_size())
+                .WillByDefault(testing::Return(4096));
+    }
+
+    void report_as_regular_file(const std::vector<char> &contents)
+    {
+        _contents = contents;
+        _sb_regfile.st_size = static_cast<off_t>(_contents.size());
+
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::DoAll(
+                        testing::SetArgPointee<1>(_sb_regfile),
+                        testing::Return(0)));
+    }
+
+    void open_with_success()
+    {
+        ON_CALL(*this, fn_open(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::Return(0));
+    }
+
+    void mmap_with_success()
+    {
+        ON_CALL(*this, fn_mmap64(testing::_, testing::_, testing::_,
+                                 testing::_, testing::_, testing::_))
+                .WillByDefault(testing::Invoke(
+                        this, &MockMmapFileFuncs::_mmap64));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::Return(0));
+    }
+
+    void * _mmap64(void *addr, size_t length, int prot, int flags, int fd,
+                   off64_t offset)
+    {
+        (void) addr;
+        (void) prot;
+        (void) flags;
+        (void) fd;
+
+        if (static_cast<uint64_t>(offset) + length > _contents.size()) {
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+
+        return _contents.data() + offset;
+    }
+};
+
+class TestableMmapFilePrivate : public mb::MmapFilePrivate
+{
+public:
+    TestableMmapFilePrivate(mb::MmapFileFuncs *funcs)
+        : mb::MmapFilePrivate(funcs)
+    {
+    }
+};
+
+class TestableMmapFile : public mb::MmapFile
+{
+public:
+    MB_DECLARE_PRIVATE(TestableMmapFile)
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs))
+    {
+    }
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs, int fd, bool owned)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs), fd, owned)
+    {
+    }
+
+    ~TestableMmapFile()
+    {
+    }
+};
+
+struct FileMmapTest : testing::Test
+{
+    testing::NiceMock<MockMmapFileFuncs> _funcs;
+};
+
+static std::vector<char> make_contents(size_t size)
+{
+    std::vector<char> contents(size);
+    for (size_t i = 0; i < size; ++i) {
+        contents[i] = static_cast<char>('a' + i % 26);
+    }
+    return contents;
+}
+
+TEST_F(FileMmapTest, OpenFilenameMbsSuccess)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.open_with_success();
+    _funcs.mmap_with_success();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, O_RDONLY | O_CLOEXEC, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open("x"));
+}
+
+TEST_F(FileMmapTest, OpenFilenameMbsFailure)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open("x"));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenFilenameWcsSuccess)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.open_with_success();
+    _funcs.mmap_with_success();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x"));
+}
+
+TEST_F(FileMmapTest, OpenFstatFailed)
+{
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenDirectory)
+{
+    struct stat sb{};
+    sb.st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::is_a_directory);
+}
+
+TEST_F(FileMmapTest, OpenBlockDevice)
+{
+    struct stat sb{};
+    sb.st_mode = S_IFBLK | S_IRWXU | S_IRWXG | S_IRWXO;
+
+    _funcs._contents = make_contents(10);
+    _funcs.mmap_with_success();
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, 0, SEEK_END))
+            .Times(1)
+            .WillOnce(testing::Return(10));
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(0, false));
+
+    const void *data;
+    size_t size;
+    ASSERT_TRUE(file.mapped_data(data, size));
+    ASSERT_EQ(size, 10u);
+}
+
+TEST_F(FileMmapTest, OpenMmapFailed)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+
+    EXPECT_CALL(_funcs, fn_mmap64(testing::_, testing::_, testing::_,
+                                  testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenEmptyFile)
+{
+    _funcs.report_as_regular_file({});
+
+    // Zero-length mappings are not allowed
+    EXPECT_CALL(_funcs, fn_mmap64(testing::_, testing::_, testing::_,
+                                  testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(0, false));
+
+    const void *data;
+    size_t size;
+    ASSERT_TRUE(file.mapped_data(data, size));
+    ASSERT_EQ(data, nullptr);
+    ASSERT_EQ(size, 0u);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, OpenWindowOutOfRange)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open(0, false, 11, 0));
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+}
+
+TEST_F(FileMmapTest, OpenUnalignedWindow)
+{
+    auto contents = make_contents(8192);
+    _funcs.report_as_regular_file(contents);
+    _funcs.mmap_with_success();
+
+    // The mapping must start at a page boundary
+    EXPECT_CALL(_funcs, fn_mmap64(testing::_, 14u, PROT_READ, testing::_,
+                                  testing::_, 4096))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_munmap(_funcs._contents.data() + 4096, 14u))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(0, false, 4100, 10));
+
+    const void *data;
+    size_t size;
+    ASSERT_TRUE(file.mapped_data(data, size));
+    ASSERT_EQ(size, 10u);
+    ASSERT_EQ(memcmp(data, contents.data() + 4100, 10), 0);
+
+    char buf[20];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 10u);
+    ASSERT_EQ(memcmp(buf, contents.data() + 4100, 10), 0);
+
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, OpenWindowTruncatedToFileSize)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open(0, false, 4, 100));
+
+    const void *data;
+    size_t size;
+    ASSERT_TRUE(file.mapped_data(data, size));
+    ASSERT_EQ(size, 6u);
+}
+
+TEST_F(FileMmapTest, MappedDataNotOpen)
+{
+    TestableMmapFile file(&_funcs);
+
+    const void *data;
+    size_t size;
+    ASSERT_FALSE(file.mapped_data(data, size));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST_F(FileMmapTest, CloseUnownedFile)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    // Ensure that the close callback is not called
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, 10u))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, CloseOwnedFile)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    // Ensure that the close callback is called
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(0));
+
+    TestableMmapFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, CloseUnmapFailure)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::SetErrnoAndReturn(EIO, -1));
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_FALSE(file.close());
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, ReadSuccess)
+{
+    auto contents = make_contents(10);
+    _funcs.report_as_regular_file(contents);
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, contents.data(), 4), 0);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, contents.data() + 4, 4), 0);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(buf, contents.data() + 8, 2), 0);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, SeekSuccess)
+{
+    auto contents = make_contents(10);
+    _funcs.report_as_regular_file(contents);
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t offset;
+    ASSERT_TRUE(file.seek(5, SEEK_SET, &offset));
+    ASSERT_EQ(offset, 5u);
+    ASSERT_TRUE(file.seek(2, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 7u);
+    ASSERT_TRUE(file.seek(-1, SEEK_END, &offset));
+    ASSERT_EQ(offset, 9u);
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c, contents[9]);
+
+    // Seeking past EOF is allowed
+    ASSERT_TRUE(file.seek(20, SEEK_SET, &offset));
+    ASSERT_EQ(offset, 20u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, SeekInvalid)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.seek(-1, SEEK_SET, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(file.seek(-1, SEEK_CUR, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(file.seek(-11, SEEK_END, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(file.seek(0, 10, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileMmapTest, WriteUnsupported)
+{
+    _funcs.report_as_regular_file(make_contents(10));
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_FALSE(file.write("x", 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+    ASSERT_FALSE(file.truncate(0));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedTruncate);
+}
+
+TEST_F(FileMmapTest, PeekLendsMapping)
+{
+    auto contents = make_contents(10);
+    _funcs.report_as_regular_file(contents);
+    _funcs.mmap_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    const void *data;
+    size_t data_size;
+    ASSERT_TRUE(file.mapped_data(data, data_size));
+
+    const void *buf;
+    size_t size;
+
+    ASSERT_TRUE(file.seek(4, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(buf, static_cast<const char *>(data) + 4);
+    ASSERT_EQ(size, 6u);
+    ASSERT_TRUE(file.consume(6));
+
+    ASSERT_TRUE(file.peek(buf, size));
+    ASSERT_EQ(size, 0u);
+    ASSERT_FALSE(file.consume(1));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <set>
+#include <vector>
+
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/file/uring.h"
+
+// These tests use real files since the rings are shared with the kernel
+
+struct FileUringTest : testing::Test
+{
+    char _path[32];
+    int _fd;
+
+    FileUringTest() : _path("/tmp/mbcommon_uring_XXXXXX"), _fd(-1)
+    {
+    }
+
+    void SetUp() override
+    {
+        _fd = mkstemp(_path);
+        ASSERT_GE(_fd, 0);
+    }
+
+    void TearDown() override
+    {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        unlink(_path);
+    }
+
+    static std::vector<unsigned char> make_data(size_t size)
+    {
+        std::vector<unsigned char> data(size);
+        for (size_t i = 0; i < size; ++i) {
+            data[i] = static_cast<unsigned char>((i * 31) ^ (i >> 9));
+        }
+        return data;
+    }
+};
+
+TEST_F(FileUringTest, LargeReadWriteRoundTrip)
+{
+    auto data = make_data(3 * 1024 * 1024 + 123);
+
+    mb::UringFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully(file, data.data(), data.size(), n));
+    ASSERT_EQ(n, data.size());
+
+    uint64_t pos;
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, data.size());
+
+    ASSERT_TRUE(file.seek(0, SEEK_SET, nullptr));
+
+    // Ask for more than is available to check the short read at EOF
+    std::vector<unsigned char> buf(data.size() + 4096);
+    ASSERT_TRUE(file.read(buf.data(), buf.size(), n));
+    ASSERT_EQ(n, data.size());
+    buf.resize(n);
+    ASSERT_EQ(buf, data);
+
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, data.size());
+
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileUringTest, LargeReadAt)
+{
+    auto data = make_data(1024 * 1024);
+    ASSERT_EQ(write(_fd, data.data(), data.size()),
+              static_cast<ssize_t>(data.size()));
+
+    mb::UringFile file(_fd, false, 4);
+    ASSERT_TRUE(file.is_open());
+
+    std::vector<unsigned char> buf(512 * 1024);
+    size_t n;
+    ASSERT_TRUE(file.read_at(1000, buf.data(), buf.size(), n));
+    ASSERT_EQ(n, buf.size());
+    ASSERT_TRUE(std::equal(buf.begin(), buf.end(), data.begin() + 1000));
+}
+
+TEST_F(FileUringTest, AsyncReads)
+{
+    auto data = make_data(64 * 1024);
+    ASSERT_EQ(write(_fd, data.data(), data.size()),
+              static_cast<ssize_t>(data.size()));
+
+    mb::UringFile file(_fd, false, 4);
+    ASSERT_TRUE(file.is_open());
+
+    if (!file.is_async()) {
+        // io_uring is not supported by the kernel
+        return;
+    }
+
+    std::vector<unsigned char> bufs[4];
+    for (uint64_t i = 0; i < 4; ++i) {
+        bufs[i].resize(16 * 1024);
+        ASSERT_TRUE(file.submit_read(i * 16 * 1024, bufs[i].data(),
+                                     bufs[i].size(), i));
+    }
+    ASSERT_EQ(file.in_flight(), 4u);
+
+    // Queue is full
+    unsigned char extra[16];
+    ASSERT_FALSE(file.submit_read(0, extra, sizeof(extra), 4));
+    ASSERT_EQ(file.error(), std::errc::resource_unavailable_try_again);
+    ASSERT_FALSE(file.is_fatal());
+
+    std::set<uint64_t> completed;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t user_data;
+        size_t n;
+        ASSERT_TRUE(file.wait(user_data, n));
+        ASSERT_LT(user_data, 4u);
+        ASSERT_EQ(n, 16u * 1024);
+        ASSERT_TRUE(std::equal(bufs[user_data].begin(), bufs[user_data].end(),
+                               data.begin() + user_data * 16 * 1024));
+        completed.insert(user_data);
+    }
+    ASSERT_EQ(completed.size(), 4u);
+    ASSERT_EQ(file.in_flight(), 0u);
+
+    uint64_t user_data;
+    size_t n;
+    ASSERT_FALSE(file.wait(user_data, n));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST_F(FileUringTest, AsyncWriteThenRead)
+{
+    mb::UringFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    if (!file.is_async()) {
+        return;
+    }
+
+    auto data = make_data(8192);
+    ASSERT_TRUE(file.submit_write(0, data.data(), data.size(), 42));
+
+    uint64_t user_data;
+    size_t n;
+    ASSERT_TRUE(file.wait(user_data, n));
+    ASSERT_EQ(user_data, 42u);
+    ASSERT_EQ(n, data.size());
+
+    // Read past EOF
+    std::vector<unsigned char> buf(data.size() * 2);
+    ASSERT_TRUE(file.submit_read(0, buf.data(), buf.size(), 7));
+    ASSERT_TRUE(file.wait(user_data, n));
+    ASSERT_EQ(user_data, 7u);
+    ASSERT_EQ(n, data.size());
+    buf.resize(n);
+    ASSERT_EQ(buf, data);
+}
+
+TEST_F(FileUringTest, AsyncErrorReported)
+{
+    close(_fd);
+    _fd = -1;
+
+    // Open read-only so that writes fail with EBADF
+    mb::UringFile file(_path, mb::FileOpenMode::READ_ONLY);
+    ASSERT_TRUE(file.is_open());
+
+    if (!file.is_async()) {
+        return;
+    }
+
+    unsigned char buf[16] = {};
+    ASSERT_TRUE(file.submit_write(0, buf, sizeof(buf), 9));
+
+    uint64_t user_data = 0;
+    size_t n;
+    ASSERT_FALSE(file.wait(user_data, n));
+    ASSERT_EQ(user_data, 9u);
+    ASSERT_EQ(file.error(), std::errc::bad_file_descriptor);
+}
+
+TEST_F(FileUringTest, ZeroQueueDepth)
+{
+    mb::UringFile file(_fd, false, 0);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
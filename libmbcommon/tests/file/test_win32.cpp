@@ -19,9 +19,13 @@
 
 #include <gmock/gmock.h>
 
+#include <vector>
+
 #include <climits>
 
 #include "mbcommon/file.h"
+#include "mbcommon/file/overlapped.h"
+#include "mbcommon/file/overlapped_p.h"
 #include "mbcommon/file/win32.h"
 #include "mbcommon/file/win32_p.h"
 
@@ -61,7 +65,12 @@ SetWin32ErrorAndReturn(int errval, T result)
 struct MockWin32FileFuncs : public mb::Win32FileFuncs
 {
     // windows.h
+    MOCK_METHOD2(fn_CancelIoEx, BOOL(HANDLE hFile, LPOVERLAPPED lpOverlapped));
     MOCK_METHOD1(fn_CloseHandle, BOOL(HANDLE hObject));
+    MOCK_METHOD4(fn_CreateEventW, HANDLE(LPSECURITY_ATTRIBUTES lpEventAttributes,
+                                         BOOL bManualReset,
+                                         BOOL bInitialState,
+                                         LPCWSTR lpName));
     MOCK_METHOD7(fn_CreateFileW, HANDLE(LPCWSTR lpFileName,
                                         DWORD dwDesiredAccess,
                                         DWORD dwShareMode,
@@ -69,6 +78,12 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                         DWORD dwCreationDisposition,
                                         DWORD dwFlagsAndAttributes,
                                         HANDLE hTemplateFile));
+    MOCK_METHOD2(fn_GetFileSizeEx, BOOL(HANDLE hFile,
+                                        PLARGE_INTEGER lpFileSize));
+    MOCK_METHOD4(fn_GetOverlappedResult, BOOL(HANDLE hFile,
+                                              LPOVERLAPPED lpOverlapped,
+                                              LPDWORD lpNumberOfBytesTransferred,
+                                              BOOL bWait));
     MOCK_METHOD5(fn_ReadFile, BOOL(HANDLE hFile,
                                    LPVOID lpBuffer,
                                    DWORD nNumberOfBytesToRead,
@@ -79,6 +94,10 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                            LARGE_INTEGER liDistanceToMove,
                                            PLARGE_INTEGER lpNewFilePointer,
                                            DWORD dwMoveMethod));
+    MOCK_METHOD4(fn_WaitForMultipleObjects, DWORD(DWORD nCount,
+                                                  const HANDLE *lpHandles,
+                                                  BOOL bWaitAll,
+                                                  DWORD dwMilliseconds));
     MOCK_METHOD5(fn_WriteFile, BOOL(HANDLE hFile,
                                     LPCVOID lpBuffer,
                                     DWORD nNumberOfBytesToWrite,
@@ -88,14 +107,28 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
     MockWin32FileFuncs()
     {
         // Fail everything by default
+        ON_CALL(*this, fn_CancelIoEx(testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
         ON_CALL(*this, fn_CloseHandle(testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       FALSE));
+        ON_CALL(*this, fn_CreateEventW(testing::_, testing::_, testing::_,
+                                       testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      HANDLE(nullptr)));
         ON_CALL(*this, fn_CreateFileW(testing::_, testing::_, testing::_,
                                       testing::_, testing::_, testing::_,
                                       testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       INVALID_HANDLE_VALUE));
+        ON_CALL(*this, fn_GetFileSizeEx(testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
+        ON_CALL(*this, fn_GetOverlappedResult(testing::_, testing::_,
+                                              testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      FALSE));
         ON_CALL(*this, fn_ReadFile(testing::_, testing::_, testing::_,
                                    testing::_, testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
@@ -107,6 +140,10 @@ struct MockWin32FileFuncs : public mb::Win32FileFuncs
                                            testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
                                                       FALSE));
+        ON_CALL(*this, fn_WaitForMultipleObjects(testing::_, testing::_,
+                                                 testing::_, testing::_))
+                .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
+                                                      WAIT_FAILED));
         ON_CALL(*this, fn_WriteFile(testing::_, testing::_, testing::_,
                                     testing::_, testing::_))
                 .WillByDefault(SetWin32ErrorAndReturn(ERROR_INVALID_HANDLE,
@@ -161,6 +198,30 @@ public:
     }
 };
 
+class TestableOverlappedFilePrivate : public mb::OverlappedFilePrivate
+{
+public:
+    TestableOverlappedFilePrivate(mb::Win32FileFuncs *funcs)
+        : mb::OverlappedFilePrivate(funcs)
+    {
+    }
+};
+
+class TestableOverlappedFile : public mb::OverlappedFile
+{
+public:
+    MB_DECLARE_PRIVATE(TestableOverlappedFile)
+
+    TestableOverlappedFile(mb::Win32FileFuncs *funcs)
+        : mb::OverlappedFile(new TestableOverlappedFilePrivate(funcs))
+    {
+    }
+
+    ~TestableOverlappedFile()
+    {
+    }
+};
+
 struct FileWin32Test : testing::Test
 {
     testing::NiceMock<MockWin32FileFuncs> _funcs;
@@ -616,3 +677,204 @@ TEST_F(FileWin32Test, TruncateThirdSeekFailed)
     ASSERT_TRUE(file.is_fatal());
     ASSERT_EQ(file.error().value(), ERROR_INVALID_HANDLE);
 }
+
+TEST_F(FileWin32Test, OpenReadOnlySequentialScan)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_,
+                                       FILE_FLAG_SEQUENTIAL_SCAN, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(reinterpret_cast<HANDLE>(1)));
+
+    TestableWin32File file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY));
+}
+
+TEST_F(FileWin32Test, OpenReadWriteNoSequentialScan)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_, 0, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(reinterpret_cast<HANDLE>(1)));
+
+    TestableWin32File file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_WRITE));
+}
+
+struct FileOverlappedTest : FileWin32Test
+{
+    void SetUp() override
+    {
+        ON_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_, testing::_,
+                                       testing::_))
+                .WillByDefault(testing::Return(reinterpret_cast<HANDLE>(1)));
+        ON_CALL(_funcs, fn_CreateEventW(testing::_, testing::_, testing::_,
+                                        testing::_))
+                .WillByDefault(testing::Return(reinterpret_cast<HANDLE>(2)));
+        ON_CALL(_funcs, fn_CloseHandle(testing::_))
+                .WillByDefault(testing::Return(TRUE));
+    }
+};
+
+TEST_F(FileOverlappedTest, OpenFlags)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_,
+                                       FILE_FLAG_SEQUENTIAL_SCAN
+                                               | FILE_FLAG_OVERLAPPED,
+                                       testing::_))
+            .Times(1);
+    // One event per request, plus one for synchronous operations
+    EXPECT_CALL(_funcs, fn_CreateEventW(testing::_, TRUE, FALSE, testing::_))
+            .Times(5);
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 4));
+}
+
+TEST_F(FileOverlappedTest, OpenUnbufferedFlags)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_,
+                                       FILE_FLAG_NO_BUFFERING
+                                               | FILE_FLAG_OVERLAPPED,
+                                       testing::_))
+            .Times(1);
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 4, true));
+}
+
+TEST_F(FileOverlappedTest, OpenInvalidQueueDepth)
+{
+    EXPECT_CALL(_funcs, fn_CreateFileW(testing::_, testing::_, testing::_,
+                                       testing::_, testing::_, testing::_,
+                                       testing::_))
+            .Times(0);
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_FALSE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 0));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileOverlappedTest, ReadUsesFilePosition)
+{
+    EXPECT_CALL(_funcs, fn_ReadFile(testing::_, testing::_, 10, testing::_,
+                                    testing::_))
+            .Times(1)
+            .WillOnce(testing::Invoke([](HANDLE, LPVOID, DWORD, LPDWORD,
+                                         LPOVERLAPPED ov) {
+                EXPECT_EQ(ov->Offset, 100u);
+                EXPECT_EQ(ov->OffsetHigh, 0u);
+                return TRUE;
+            }));
+    EXPECT_CALL(_funcs, fn_GetOverlappedResult(testing::_, testing::_,
+                                               testing::_, TRUE))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<2>(10),
+                                     testing::Return(TRUE)));
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY));
+    ASSERT_TRUE(file.seek(100, SEEK_SET, nullptr));
+
+    char buf[10];
+    size_t n;
+    uint64_t pos;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 10u);
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 110u);
+}
+
+TEST_F(FileOverlappedTest, ReadEof)
+{
+    EXPECT_CALL(_funcs, fn_ReadFile(testing::_, testing::_, testing::_,
+                                    testing::_, testing::_))
+            .Times(1)
+            .WillOnce(SetWin32ErrorAndReturn(ERROR_HANDLE_EOF, FALSE));
+    EXPECT_CALL(_funcs, fn_GetOverlappedResult(testing::_, testing::_,
+                                               testing::_, testing::_))
+            .Times(0);
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY));
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileOverlappedTest, ReadSplitsLargeBuffer)
+{
+    std::vector<char> buf(1024 * 1024);
+
+    EXPECT_CALL(_funcs, fn_ReadFile(testing::_, testing::_, 128 * 1024,
+                                    testing::_, testing::_))
+            .Times(8)
+            .WillRepeatedly(SetWin32ErrorAndReturn(ERROR_IO_PENDING, FALSE));
+    EXPECT_CALL(_funcs, fn_GetOverlappedResult(testing::_, testing::_,
+                                               testing::_, TRUE))
+            .Times(8)
+            .WillRepeatedly(testing::DoAll(testing::SetArgPointee<2>(128 * 1024),
+                                           testing::Return(TRUE)));
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 8));
+
+    size_t n;
+    ASSERT_TRUE(file.read(buf.data(), buf.size(), n));
+    ASSERT_EQ(n, buf.size());
+}
+
+TEST_F(FileOverlappedTest, ReadUnbufferedUnaligned)
+{
+    EXPECT_CALL(_funcs, fn_ReadFile(testing::_, testing::_, testing::_,
+                                    testing::_, testing::_))
+            .Times(0);
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 4, true));
+
+    char buf[10];
+    size_t n;
+    ASSERT_FALSE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileOverlappedTest, SubmitAndWait)
+{
+    EXPECT_CALL(_funcs, fn_ReadFile(testing::_, testing::_, testing::_,
+                                    testing::_, testing::_))
+            .Times(1)
+            .WillOnce(SetWin32ErrorAndReturn(ERROR_IO_PENDING, FALSE));
+    EXPECT_CALL(_funcs, fn_WaitForMultipleObjects(1, testing::_, FALSE,
+                                                  INFINITE))
+            .Times(1)
+            .WillOnce(testing::Return(WAIT_OBJECT_0));
+    EXPECT_CALL(_funcs, fn_GetOverlappedResult(testing::_, testing::_,
+                                               testing::_, TRUE))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<2>(4),
+                                     testing::Return(TRUE)));
+
+    TestableOverlappedFile file(&_funcs);
+    ASSERT_TRUE(file.open(L"x", mb::FileOpenMode::READ_ONLY, 1));
+
+    char buf[4];
+    ASSERT_TRUE(file.submit_read(0, buf, sizeof(buf), 42));
+    ASSERT_EQ(file.in_flight(), 1u);
+
+    // Only one request may be in flight
+    ASSERT_FALSE(file.submit_read(0, buf, sizeof(buf), 43));
+    ASSERT_EQ(file.error(), std::errc::resource_unavailable_try_again);
+
+    uint64_t user_data;
+    size_t n;
+    ASSERT_TRUE(file.wait(user_data, n));
+    ASSERT_EQ(user_data, 42u);
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(file.in_flight(), 0u);
+}
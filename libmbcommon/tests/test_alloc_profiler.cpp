@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/alloc_profiler.h"
+
+using namespace mb;
+
+static bool find_tag(const char *tag, AllocTagStats &out)
+{
+    for (auto const &s : alloc_profiler_snapshot()) {
+        if (strcmp(s.tag, tag) == 0) {
+            out = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+class AllocProfilerTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        alloc_profiler_reset();
+    }
+};
+
+TEST_F(AllocProfilerTest, RecordsUnderCurrentTag)
+{
+    {
+        AllocScope scope("test.basic");
+        alloc_profiler_record_alloc(100);
+        alloc_profiler_record_alloc(28);
+        alloc_profiler_record_free(100);
+    }
+
+    AllocTagStats stats;
+    ASSERT_TRUE(find_tag("test.basic", stats));
+    ASSERT_EQ(stats.allocs, 2u);
+    ASSERT_EQ(stats.alloc_bytes, 128u);
+    ASSERT_EQ(stats.frees, 1u);
+    ASSERT_EQ(stats.free_bytes, 100u);
+}
+
+TEST_F(AllocProfilerTest, NestedScopesRestoreOuterTag)
+{
+    {
+        AllocScope outer("test.outer");
+        alloc_profiler_record_alloc(1);
+        {
+            AllocScope inner("test.inner");
+            alloc_profiler_record_alloc(2);
+        }
+        alloc_profiler_record_alloc(4);
+    }
+    alloc_profiler_record_alloc(8);
+
+    AllocTagStats stats;
+    ASSERT_TRUE(find_tag("test.outer", stats));
+    ASSERT_EQ(stats.allocs, 2u);
+    ASSERT_EQ(stats.alloc_bytes, 5u);
+
+    ASSERT_TRUE(find_tag("test.inner", stats));
+    ASSERT_EQ(stats.allocs, 1u);
+    ASSERT_EQ(stats.alloc_bytes, 2u);
+
+    ASSERT_TRUE(find_tag(ALLOC_PROFILER_UNTAGGED, stats));
+    ASSERT_GE(stats.alloc_bytes, 8u);
+}
+
+TEST_F(AllocProfilerTest, TagsMatchByContents)
+{
+    // Simulate the same literal having different addresses
+    std::string copy("test.contents");
+
+    {
+        AllocScope scope("test.contents");
+        alloc_profiler_record_alloc(1);
+    }
+    {
+        AllocScope scope(copy.c_str());
+        alloc_profiler_record_alloc(1);
+    }
+
+    AllocTagStats stats;
+    ASSERT_TRUE(find_tag("test.contents", stats));
+    ASSERT_EQ(stats.allocs, 2u);
+}
+
+TEST_F(AllocProfilerTest, ScopesArePerThread)
+{
+    AllocScope scope("test.main_thread");
+
+    std::thread t([]{
+        AllocScope other("test.other_thread");
+        for (int i = 0; i < 1000; ++i) {
+            alloc_profiler_record_alloc(1);
+        }
+    });
+    t.join();
+
+    alloc_profiler_record_alloc(1);
+
+    AllocTagStats stats;
+    ASSERT_TRUE(find_tag("test.other_thread", stats));
+    ASSERT_EQ(stats.allocs, 1000u);
+
+    ASSERT_TRUE(find_tag("test.main_thread", stats));
+    ASSERT_EQ(stats.allocs, 1u);
+}
+
+TEST_F(AllocProfilerTest, ResetClearsCounters)
+{
+    {
+        AllocScope scope("test.reset");
+        alloc_profiler_record_alloc(10);
+    }
+
+    alloc_profiler_reset();
+
+    AllocTagStats stats;
+    ASSERT_FALSE(find_tag("test.reset", stats));
+}
@@ -500,6 +500,272 @@ TEST(FileTest, TruncateReturnFailure)
     ASSERT_EQ(file._priv_func()->state, mb::FileState::OPENED);
 }
 
+TEST(FileTest, ReadAtFallbackRestoresPosition)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Open file
+    ASSERT_TRUE(file.open());
+    ASSERT_TRUE(file.seek(5, SEEK_SET, nullptr));
+
+    // Save position, seek to offset, restore position
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(3);
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    // Read from file at offset
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read_at(20, buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, file._buf.data() + 20, sizeof(buf)), 0);
+    ASSERT_EQ(file._position, 5u);
+}
+
+TEST(FileTest, ReadAtInWrongState)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    // Read from file
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST(FileTest, ReadAtSeekFailure)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(false));
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Read from file at offset
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_FALSE(file.is_fatal());
+}
+
+TEST(FileTest, ReadAtRestoreFailureIsFatal)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(3)
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::Return(false));
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Read from file at offset
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_TRUE(file.is_fatal());
+}
+
+TEST(FileTest, WriteAtFallbackRestoresPosition)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(3);
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Write to file at offset
+    size_t n;
+    ASSERT_TRUE(file.write_at(10, "xyz", 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(file._buf.data() + 10, "xyz", 3), 0);
+    ASSERT_EQ(file._position, 0u);
+}
+
+TEST(FileTest, WriteAtInWrongState)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    // Write to file
+    size_t n;
+    ASSERT_FALSE(file.write_at(0, "x", 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST(FileTest, ReadvFallbackFillsBuffersInOrder)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(2);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    char a[3];
+    char b[5];
+    mb::FileIovec iov[] = { { a, sizeof(a) }, { b, sizeof(b) } };
+    size_t n;
+    ASSERT_TRUE(file.readv(iov, 2, n));
+    ASSERT_EQ(n, sizeof(a) + sizeof(b));
+    ASSERT_EQ(memcmp(a, file._buf.data(), sizeof(a)), 0);
+    ASSERT_EQ(memcmp(b, file._buf.data() + sizeof(a), sizeof(b)), 0);
+}
+
+TEST(FileTest, ReadvFallbackPartialFailure)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Second read fails, so the first read is reported as a short read
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(2)
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::Return(false));
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    char a[3];
+    char b[5];
+    mb::FileIovec iov[] = { { a, sizeof(a) }, { b, sizeof(b) } };
+    size_t n;
+    ASSERT_TRUE(file.readv(iov, 2, n));
+    ASSERT_EQ(n, sizeof(a));
+}
+
+TEST(FileTest, WritevFallbackWritesBuffersInOrder)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(2);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    char a[] = "abc";
+    char b[] = "de";
+    mb::FileIovec iov[] = { { a, 3 }, { b, 2 } };
+    size_t n;
+    ASSERT_TRUE(file.writev(iov, 2, n));
+    ASSERT_EQ(n, 5u);
+    ASSERT_EQ(memcmp(file._buf.data(), "abcde", 5), 0);
+}
+
+TEST(FileTest, WritevInWrongState)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    char a[] = "abc";
+    mb::FileIovec iov[] = { { a, 3 } };
+    size_t n;
+    ASSERT_FALSE(file.writev(iov, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST(FileTest, StatsDisabledByDefault)
+{
+    TestFile file;
+
+    ASSERT_TRUE(file.open());
+    ASSERT_FALSE(file.stats_enabled());
+
+    size_t n;
+    ASSERT_TRUE(file.write("foobar", 6, n));
+
+    auto stats = file.stats();
+    ASSERT_EQ(stats.write_calls, 0u);
+    ASSERT_EQ(stats.bytes_written, 0u);
+}
+
+TEST(FileTest, StatsCountOperations)
+{
+    TestFile file;
+
+    ASSERT_TRUE(file.open());
+    ASSERT_TRUE(file.set_stats_enabled(true));
+
+    std::vector<char> big(5000);
+    size_t n;
+    ASSERT_TRUE(file.write("foobar", 6, n));
+    ASSERT_TRUE(file.write(big.data(), big.size(), n));
+    ASSERT_TRUE(file.seek(0, SEEK_SET, nullptr));
+
+    char buf[4];
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_TRUE(file.read_at(2, buf, sizeof(buf), n));
+
+    auto stats = file.stats();
+    ASSERT_EQ(stats.write_calls, 2u);
+    ASSERT_EQ(stats.bytes_written, 5006u);
+    ASSERT_EQ(stats.read_calls, 2u);
+    ASSERT_EQ(stats.bytes_read, 8u);
+    // read_at() is emulated with on_seek(), which is not counted separately
+    ASSERT_EQ(stats.seek_calls, 1u);
+    ASSERT_EQ(stats.write_size_histogram[0], 1u);
+    ASSERT_EQ(stats.write_size_histogram[5], 1u);
+    ASSERT_EQ(stats.read_size_histogram[0], 2u);
+
+    ASSERT_TRUE(file.reset_stats());
+    stats = file.stats();
+    ASSERT_EQ(stats.read_calls, 0u);
+    ASSERT_EQ(stats.write_size_histogram[5], 0u);
+}
+
+TEST(FileTest, StatsCallbackCalledOnClose)
+{
+    struct Result
+    {
+        unsigned int calls = 0;
+        uint64_t bytes_written = 0;
+    } result;
+
+    auto cb = [](mb::File &file, const mb::FileStats &stats, void *userdata) {
+        (void) file;
+        auto r = static_cast<Result *>(userdata);
+        ++r->calls;
+        r->bytes_written = stats.bytes_written;
+    };
+
+    TestFile file;
+
+    ASSERT_TRUE(file.open());
+    ASSERT_TRUE(file.set_stats_enabled(true));
+    ASSERT_TRUE(file.set_stats_callback(cb, &result));
+
+    size_t n;
+    ASSERT_TRUE(file.write("foobar", 6, n));
+    ASSERT_TRUE(file.close());
+
+    ASSERT_EQ(result.calls, 1u);
+    ASSERT_EQ(result.bytes_written, 6u);
+
+    // Closing again does nothing
+    ASSERT_TRUE(file.close());
+    ASSERT_EQ(result.calls, 1u);
+}
+
 TEST(FileTest, SetError)
 {
     testing::NiceMock<MockTestFile> file;
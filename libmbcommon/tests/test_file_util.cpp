@@ -19,10 +19,16 @@
 
 #include <gmock/gmock.h>
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <cinttypes>
+#include <cstring>
 
+#include "mbcommon/file/callbacks.h"
 #include "mbcommon/file/memory.h"
 #include "mbcommon/file_p.h"
 #include "mbcommon/file_util.h"
@@ -226,15 +232,16 @@ struct FileSearchTest : testing::Test
 {
     // Callback counters
     int _n_result = 0;
+    std::vector<uint64_t> _offsets;
 
     static mb::FileSearchAction _result_cb(mb::File &file, void *userdata,
                                            uint64_t offset)
     {
         (void) file;
-        (void) offset;
 
         FileSearchTest *test = static_cast<FileSearchTest *>(userdata);
         ++test->_n_result;
+        test->_offsets.push_back(offset);
 
         return mb::FileSearchAction::Continue;
     }
@@ -297,6 +304,444 @@ TEST_F(FileSearchTest, FindNormal)
                                 this));
 }
 
+TEST_F(FileSearchTest, FindAcrossBufferBoundaries)
+{
+    std::string data(100, 'x');
+    data.replace(5, 16, "SEANDROIDENFORCE");
+    data.replace(30, 8, "ANDROID!");
+    data.replace(60, 16, "SEANDROIDENFORCE");
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    // Buffer size forces matches to straddle buffer refills
+    ASSERT_TRUE(mb::file_search(file, -1, -1, 20, "SEANDROIDENFORCE", 16, -1,
+                                &_result_cb, this));
+    ASSERT_EQ(_offsets, std::vector<uint64_t>({5, 60}));
+
+    _offsets.clear();
+
+    mb::FileSearcher searcher("ANDROID!", 8);
+    ASSERT_TRUE(searcher.search(file, -1, -1, 9, -1, &_result_cb, this));
+    ASSERT_EQ(_offsets, std::vector<uint64_t>({30}));
+}
+
+TEST_F(FileSearchTest, ParallelMatchesSerial)
+{
+    // Pattern occurrences overlap and straddle chunk boundaries
+    std::string data;
+    for (size_t i = 0; i < 2000; ++i) {
+        data += (i % 7 == 0) ? "abab" : "xab";
+    }
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileSearcher searcher("abab", 4);
+
+    for (size_t bsize : { 5, 64, 1000, 100000 }) {
+        for (int64_t max_matches : { -1, 1, 50 }) {
+            _offsets.clear();
+            ASSERT_TRUE(searcher.search(file, 3, 5000, bsize, max_matches,
+                                        &_result_cb, this));
+            std::vector<uint64_t> expected = std::move(_offsets);
+
+            _offsets.clear();
+            ASSERT_TRUE(searcher.search_parallel(file, 3, 5000, bsize, 4,
+                                                 max_matches, &_result_cb,
+                                                 this));
+            ASSERT_EQ(_offsets, expected)
+                    << "bsize=" << bsize << ", max_matches=" << max_matches;
+
+            _offsets.clear();
+            ASSERT_TRUE(mb::file_search(file, -1, -1, bsize, "abab", 4,
+                                        max_matches, &_result_cb, this));
+            expected = std::move(_offsets);
+
+            _offsets.clear();
+            ASSERT_TRUE(mb::file_search_parallel(file, -1, -1, bsize, 3,
+                                                 "abab", 4, max_matches,
+                                                 &_result_cb, this));
+            ASSERT_EQ(_offsets, expected)
+                    << "bsize=" << bsize << ", max_matches=" << max_matches;
+        }
+    }
+}
+
+// Fails every positional read at or past a given offset
+class FailingReadAtFile : public mb::MemoryFile
+{
+public:
+    FailingReadAtFile(const void *buf, size_t size, uint64_t fail_offset)
+        : mb::MemoryFile(buf, size), _fail_offset(fail_offset)
+    {
+    }
+
+protected:
+    bool on_read_at(uint64_t offset, void *buf, size_t size,
+                    size_t &bytes_read) override
+    {
+        if (offset >= _fail_offset) {
+            set_error(std::make_error_code(std::errc::io_error),
+                      "Failed at %" PRIu64, offset);
+            return false;
+        }
+        return mb::MemoryFile::on_read_at(offset, buf, size, bytes_read);
+    }
+
+private:
+    uint64_t _fail_offset;
+};
+
+TEST_F(FileSearchTest, ParallelReportsFirstReadError)
+{
+    std::string data(1000, 'x');
+    FailingReadAtFile file(data.data(), data.size(), 300);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileSearcher searcher("abab", 4);
+
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_FALSE(searcher.search_parallel(file, -1, -1, 100, 4, -1,
+                                              &_result_cb, this));
+        ASSERT_EQ(file.error(), std::errc::io_error);
+        ASSERT_EQ(file.error_string(), "Failed at 300: "
+                  + std::make_error_code(std::errc::io_error).message());
+    }
+}
+
+// Lends the data in fixed-size blocks from its own buffer
+struct BlockProducer
+{
+    const std::string *data;
+    size_t block_size;
+    size_t pos;
+
+    static bool read_block_cb(mb::File &file, void *userdata,
+                              const void *&buf, size_t &size)
+    {
+        (void) file;
+
+        auto *p = static_cast<BlockProducer *>(userdata);
+        buf = p->data->data() + p->pos;
+        size = std::min(p->block_size, p->data->size() - p->pos);
+        p->pos += size;
+
+        return true;
+    }
+};
+
+TEST_F(FileSearchTest, LentBlocksMatchBufferedSearch)
+{
+    std::string data;
+    for (size_t i = 0; i < 300; ++i) {
+        data += (i % 5 == 0) ? "abab" : "xab";
+    }
+
+    mb::MemoryFile mem_file(data.data(), data.size());
+    ASSERT_TRUE(mem_file.is_open());
+
+    for (size_t block_size : { 1, 2, 3, 7, 100, 10000 }) {
+        for (int64_t start : { -1, 0, 5 }) {
+            for (int64_t end : { -1, 700 }) {
+                for (int64_t max_matches : { -1, 10 }) {
+                    _offsets.clear();
+                    ASSERT_TRUE(mb::file_search(mem_file, start, end, 0,
+                                                "abab", 4, max_matches,
+                                                &_result_cb, this));
+                    std::vector<uint64_t> expected = std::move(_offsets);
+
+                    BlockProducer producer{&data, block_size, 0};
+                    mb::CallbackFile file;
+                    ASSERT_TRUE(file.set_read_block_cb(
+                            &BlockProducer::read_block_cb));
+                    ASSERT_TRUE(file.open(nullptr, nullptr, nullptr, nullptr,
+                                          nullptr, nullptr, &producer));
+
+                    _offsets.clear();
+                    ASSERT_TRUE(mb::file_search(file, start, end, 0, "abab",
+                                                4, max_matches, &_result_cb,
+                                                this));
+                    ASSERT_EQ(_offsets, expected)
+                            << "block_size=" << block_size
+                            << ", start=" << start << ", end=" << end
+                            << ", max_matches=" << max_matches;
+                }
+            }
+        }
+    }
+}
+
+// Lends the first part of its data and only supports copying reads after that,
+// like a file that caches a window of some underlying file
+class PartiallyLendingFile : public mb::File
+{
+public:
+    PartiallyLendingFile(const std::string &data, size_t lend_size)
+        : _data(data), _lend_size(std::min(lend_size, data.size())), _pos(0)
+    {
+        open();
+    }
+
+    virtual ~PartiallyLendingFile()
+    {
+        close();
+    }
+
+protected:
+    virtual bool on_read(void *buf, size_t size, size_t &bytes_read) override
+    {
+        bytes_read = std::min(size, _data.size() - _pos);
+        memcpy(buf, _data.data() + _pos, bytes_read);
+        _pos += bytes_read;
+        return true;
+    }
+
+    virtual bool on_peek(const void *&buf, size_t &size) override
+    {
+        if (_pos >= _lend_size) {
+            return mb::File::on_peek(buf, size);
+        }
+
+        buf = _data.data() + _pos;
+        size = _lend_size - _pos;
+        return true;
+    }
+
+    virtual bool on_consume(size_t size) override
+    {
+        _pos += size;
+        return true;
+    }
+
+private:
+    const std::string &_data;
+    size_t _lend_size;
+    size_t _pos;
+};
+
+TEST_F(FileSearchTest, LendingStoppingPartwayMatchesBufferedSearch)
+{
+    std::string data;
+    for (size_t i = 0; i < 300; ++i) {
+        data += (i % 5 == 0) ? "abab" : "xab";
+    }
+
+    mb::MemoryFile mem_file(data.data(), data.size());
+    ASSERT_TRUE(mem_file.is_open());
+
+    _offsets.clear();
+    ASSERT_TRUE(mb::file_search(mem_file, -1, -1, 0, "abab", 4, -1,
+                                &_result_cb, this));
+    std::vector<uint64_t> expected = std::move(_offsets);
+
+    // Stop lending in the middle of a match and right after one
+    for (size_t lend_size : { 2, 3, 17, 18, 19, 100, 10000 }) {
+        PartiallyLendingFile file(data, lend_size);
+        ASSERT_TRUE(file.is_open());
+
+        _offsets.clear();
+        ASSERT_TRUE(mb::file_search(file, -1, -1, 0, "abab", 4, -1,
+                                    &_result_cb, this))
+                << file.error_string();
+        ASSERT_EQ(_offsets, expected) << "lend_size=" << lend_size;
+    }
+}
+
+TEST(FileReadDiscardTest, LentBlocksAreConsumed)
+{
+    std::string data(25000, 'x');
+    data[15000] = 'y';
+
+    BlockProducer producer{&data, 4096, 0};
+    mb::CallbackFile file;
+    ASSERT_TRUE(file.set_read_block_cb(&BlockProducer::read_block_cb));
+    ASSERT_TRUE(file.open(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                          &producer));
+
+    uint64_t n;
+    ASSERT_TRUE(mb::file_read_discard(file, 15000, n));
+    ASSERT_EQ(n, 15000u);
+
+    char c;
+    size_t n_read;
+    ASSERT_TRUE(file.read(&c, 1, n_read));
+    ASSERT_EQ(c, 'y');
+
+    ASSERT_TRUE(mb::file_read_discard(file, 20000, n));
+    ASSERT_EQ(n, 9999u);
+}
+
+TEST(FileReadDiscardTest, LendingStoppingPartwayFallsBackToRead)
+{
+    std::string data(25000, 'x');
+    data[15000] = 'y';
+
+    PartiallyLendingFile file(data, 4096);
+    ASSERT_TRUE(file.is_open());
+
+    uint64_t n;
+    ASSERT_TRUE(mb::file_read_discard(file, 15000, n));
+    ASSERT_EQ(n, 15000u);
+
+    char c;
+    size_t n_read;
+    ASSERT_TRUE(file.read(&c, 1, n_read));
+    ASSERT_EQ(c, 'y');
+}
+
+TEST(FileReadDiscardTest, FallbackKeepsPreviousError)
+{
+    std::string data(25000, 'x');
+
+    PartiallyLendingFile file(data, 4096);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.set_error(std::make_error_code(std::errc::io_error),
+                               "Earlier failure"));
+
+    uint64_t n;
+    ASSERT_TRUE(mb::file_read_discard(file, 15000, n));
+    ASSERT_EQ(n, 15000u);
+
+    // Probing for lent buffers must not report UnsupportedRead
+    ASSERT_EQ(file.error(), std::errc::io_error);
+    ASSERT_EQ(file.error_string(), "Earlier failure: "
+              + std::make_error_code(std::errc::io_error).message());
+}
+
+TEST(FileSearcherTest, FindMatchesNaiveSearch)
+{
+    // Deterministic data with a small alphabet so that there are many partial
+    // matches for both the byte filter and Boyer-Moore-Horspool
+    std::vector<unsigned char> data(4096);
+    uint32_t state = 1;
+    for (auto &c : data) {
+        state = state * 1103515245 + 12345;
+        c = 'a' + (state >> 16) % 4;
+    }
+
+    for (size_t m = 1; m <= 20; ++m) {
+        for (size_t start = 0; start < 64; start += 7) {
+            const unsigned char *pattern = data.data() + 1000 + start;
+            mb::FileSearcher searcher(pattern, m);
+
+            size_t pos = 0;
+            while (true) {
+                auto it = std::search(data.begin() + pos, data.end(),
+                                      pattern, pattern + m);
+                auto match = static_cast<const unsigned char *>(
+                        searcher.find(data.data() + pos, data.size() - pos));
+
+                if (it == data.end()) {
+                    ASSERT_EQ(match, nullptr) << "m=" << m;
+                    break;
+                }
+
+                ASSERT_EQ(match, &*it) << "m=" << m;
+                pos = it - data.begin() + 1;
+            }
+        }
+    }
+}
+
+TEST(FileSearcherTest, FindEdgeCases)
+{
+    const char buf[] = "xabcdefgh";
+
+    mb::FileSearcher empty(nullptr, 0);
+    ASSERT_EQ(empty.find(buf, 9), buf);
+
+    mb::FileSearcher searcher("abcdefgh", 8);
+    ASSERT_EQ(searcher.find(buf + 1, 7), nullptr);
+    ASSERT_EQ(searcher.find(buf, 8), nullptr);
+    ASSERT_EQ(searcher.find(buf, 9), buf + 1);
+}
+
+struct FileSearchMultiTest : testing::Test
+{
+    std::vector<std::pair<size_t, uint64_t>> _results;
+
+    static mb::FileSearchAction _result_cb(mb::File &file, void *userdata,
+                                           size_t pattern_id, uint64_t offset)
+    {
+        (void) file;
+
+        auto *test = static_cast<FileSearchMultiTest *>(userdata);
+        test->_results.emplace_back(pattern_id, offset);
+
+        return mb::FileSearchAction::Continue;
+    }
+};
+
+TEST_F(FileSearchMultiTest, CheckInvalidArguments)
+{
+    mb::MemoryFile file("abc", 3);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileSearchPattern patterns[] = {
+        { "a", 1 },
+        { "", 0 },
+    };
+
+    ASSERT_FALSE(mb::file_search_multi(file, 20, 10, 0, patterns, 1, -1,
+                                       &_result_cb, this));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+
+    ASSERT_FALSE(mb::file_search_multi(file, -1, -1, 0, patterns, 2, -1,
+                                       &_result_cb, this));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileSearchMultiTest, FindOverlappingPatterns)
+{
+    constexpr char data[] = "ushers and hers";
+    mb::MemoryFile file(data, sizeof(data) - 1);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileSearchPattern patterns[] = {
+        { "he", 2 },
+        { "she", 3 },
+        { "his", 3 },
+        { "hers", 4 },
+    };
+
+    // Small buffer size so that matches straddle reads
+    ASSERT_TRUE(mb::file_search_multi(file, -1, -1, 3, patterns, 4, -1,
+                                      &_result_cb, this));
+
+    std::vector<std::pair<size_t, uint64_t>> expected{
+        { 1, 1 }, { 0, 2 }, { 3, 2 }, { 0, 11 }, { 3, 11 },
+    };
+    ASSERT_EQ(_results, expected);
+}
+
+TEST_F(FileSearchMultiTest, FindWithBoundariesAndMaxMatches)
+{
+    constexpr char data[] = "abcabcabc";
+    mb::MemoryFile file(data, sizeof(data) - 1);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileSearchPattern patterns[] = {
+        { "abc", 3 },
+        { "c", 1 },
+    };
+
+    ASSERT_TRUE(mb::file_search_multi(file, 1, 8, 0, patterns, 2, -1,
+                                      &_result_cb, this));
+    std::vector<std::pair<size_t, uint64_t>> expected{
+        { 1, 2 }, { 0, 3 }, { 1, 5 },
+    };
+    ASSERT_EQ(_results, expected);
+
+    _results.clear();
+
+    ASSERT_TRUE(mb::file_search_multi(file, -1, -1, 0, patterns, 2, 2,
+                                      &_result_cb, this));
+    expected = { { 0, 0 }, { 1, 2 } };
+    ASSERT_EQ(_results, expected);
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     constexpr char buf[] = "abcdef";
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "mbcommon/metrics.h"
+
+using namespace mb;
+
+TEST(MetricsTest, CounterSumsAcrossThreads)
+{
+    Counter counter;
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&]{
+            for (int j = 0; j < 10000; ++j) {
+                counter.add();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    counter.add(5);
+
+    ASSERT_EQ(counter.value(), 80005u);
+}
+
+TEST(MetricsTest, GaugeSetAndAdd)
+{
+    Gauge gauge;
+    ASSERT_EQ(gauge.value(), 0);
+
+    gauge.set(10);
+    gauge.add(-15);
+    ASSERT_EQ(gauge.value(), -5);
+}
+
+TEST(MetricsTest, BucketBoundsContainValues)
+{
+    const uint64_t values[] = {
+        0, 1, 7, 8, 9, 15, 16, 17, 100, 1000, 123456789,
+        std::numeric_limits<uint64_t>::max(),
+    };
+
+    for (uint64_t value : values) {
+        size_t index = Histogram::bucket_index(value);
+        ASSERT_LT(index, METRICS_HISTOGRAM_BUCKETS);
+        ASSERT_LE(Histogram::bucket_lower_bound(index), value);
+        ASSERT_GE(Histogram::bucket_upper_bound(index), value);
+    }
+
+    // Buckets are contiguous
+    for (size_t i = 1; i < METRICS_HISTOGRAM_BUCKETS; ++i) {
+        ASSERT_EQ(Histogram::bucket_lower_bound(i),
+                  Histogram::bucket_upper_bound(i - 1) + 1);
+    }
+    ASSERT_EQ(Histogram::bucket_upper_bound(METRICS_HISTOGRAM_BUCKETS - 1),
+              std::numeric_limits<uint64_t>::max());
+}
+
+TEST(MetricsTest, HistogramSnapshot)
+{
+    Histogram histogram;
+
+    auto empty = histogram.snapshot();
+    ASSERT_EQ(empty.count, 0u);
+    ASSERT_EQ(empty.min, 0u);
+    ASSERT_EQ(empty.percentile(50), 0u);
+
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        histogram.record(i);
+    }
+
+    auto s = histogram.snapshot();
+    ASSERT_EQ(s.count, 1000u);
+    ASSERT_EQ(s.sum, 500500u);
+    ASSERT_EQ(s.min, 1u);
+    ASSERT_EQ(s.max, 1000u);
+    ASSERT_DOUBLE_EQ(s.mean(), 500.5);
+
+    // Within the 12.5% bucket error
+    uint64_t p50 = s.percentile(50);
+    ASSERT_GE(p50, 500u);
+    ASSERT_LE(p50, 563u);
+    uint64_t p99 = s.percentile(99);
+    ASSERT_GE(p99, 990u);
+    ASSERT_LE(p99, 1000u);
+    ASSERT_EQ(s.percentile(0), 1u);
+    ASSERT_EQ(s.percentile(100), 1000u);
+}
+
+TEST(MetricsTest, RegistryReturnsSameMetric)
+{
+    MetricsRegistry registry;
+
+    Counter &a = registry.counter("a");
+    ASSERT_EQ(&a, &registry.counter("a"));
+    ASSERT_NE(&a, &registry.counter("b"));
+
+    // Separate namespaces
+    registry.gauge("a").set(-3);
+    a.add(2);
+    ASSERT_EQ(registry.counter("a").value(), 2u);
+}
+
+TEST(MetricsTest, RegistrySnapshotAndJson)
+{
+    MetricsRegistry registry;
+
+    registry.counter("requests").add(3);
+    registry.gauge("queue \"depth\"").set(-1);
+    registry.histogram("latency_us").record(10);
+
+    auto metrics = registry.snapshot();
+    ASSERT_EQ(metrics.size(), 3u);
+    ASSERT_EQ(metrics[0].name, "requests");
+    ASSERT_EQ(metrics[0].type, MetricType::Counter);
+    ASSERT_EQ(metrics[0].value, 3);
+    ASSERT_EQ(metrics[1].type, MetricType::Gauge);
+    ASSERT_EQ(metrics[1].value, -1);
+    ASSERT_EQ(metrics[2].type, MetricType::Histogram);
+    ASSERT_EQ(metrics[2].histogram.count, 1u);
+
+    ASSERT_EQ(registry.to_json(),
+              "{\"counters\":{\"requests\":3},"
+              "\"gauges\":{\"queue \\\"depth\\\"\":-1},"
+              "\"histograms\":{\"latency_us\":{\"count\":1,\"sum\":10,"
+              "\"min\":10,\"max\":10,\"mean\":10.000,\"p50\":10,\"p90\":10,"
+              "\"p99\":10,\"p999\":10}}}");
+}
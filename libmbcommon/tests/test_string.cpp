@@ -19,6 +19,11 @@
 
 #include <gtest/gtest.h>
 
+#include <string>
+#include <vector>
+
+#include <cstring>
+
 #include "mbcommon/string.h"
 
 TEST(StringTest, FormatString)
@@ -150,6 +155,84 @@ TEST(StringTest, CheckEndsWithEmpty)
     ASSERT_TRUE(mb::ends_with_icase("", ""));
 }
 
+TEST(StringTest, CheckEqualsN)
+{
+    ASSERT_TRUE(mb::equals_n("abc", 3, "abcd", 3));
+    ASSERT_FALSE(mb::equals_n("abc", 3, "abcd", 4));
+    ASSERT_TRUE(mb::equals_n("a\0b", 3, "a\0b", 3));
+    ASSERT_FALSE(mb::equals_n("a\0b", 3, "a\0c", 3));
+    ASSERT_TRUE(mb::equals_n(nullptr, 0, "", 0));
+}
+
+TEST(StringTest, CheckEqualsICaseN)
+{
+    ASSERT_TRUE(mb::equals_icase_n("MoUnT", 5, "mount", 5));
+    ASSERT_FALSE(mb::equals_icase_n("mount", 5, "mounts", 6));
+    ASSERT_EQ(mb::compare_icase_n("abc", 3, "ABD", 3), -1);
+    ASSERT_EQ(mb::compare_icase_n("ABD", 3, "abc", 3), 1);
+    ASSERT_EQ(mb::compare_icase_n("abc", 3, "ABCD", 4), -1);
+    ASSERT_EQ(mb::compare_icase_n("", 0, "", 0), 0);
+}
+
+TEST(StringTest, TrimN)
+{
+    const char *str = " \t hello world \n";
+    const char *ptr = str;
+    size_t len = strlen(str);
+
+    mb::trim_left_n(ptr, len);
+    ASSERT_EQ(std::string(ptr, len), "hello world \n");
+
+    mb::trim_right_n(ptr, len);
+    ASSERT_EQ(std::string(ptr, len), "hello world");
+
+    ptr = "   ";
+    len = 3;
+    mb::trim_n(ptr, len);
+    ASSERT_EQ(len, 0u);
+}
+
+static std::vector<std::string> split_all(const std::string &str,
+                                          const std::string &delim,
+                                          mb::SplitMode mode)
+{
+    mb::StringSplitter splitter(str.data(), str.size(),
+                                delim.data(), delim.size(), mode);
+    std::vector<std::string> result;
+    const char *token;
+    size_t len;
+
+    while (splitter.next(token, len)) {
+        result.emplace_back(token, len);
+    }
+
+    return result;
+}
+
+TEST(StringTest, SplitDelimiter)
+{
+    using V = std::vector<std::string>;
+    auto mode = mb::SplitMode::Delimiter;
+
+    ASSERT_EQ(split_all("a,b,,c", ",", mode), V({"a", "b", "", "c"}));
+    ASSERT_EQ(split_all(",a,", ",", mode), V({"", "a", ""}));
+    ASSERT_EQ(split_all("a::b::c", "::", mode), V({"a", "b", "c"}));
+    ASSERT_EQ(split_all("", ",", mode), V({""}));
+    ASSERT_EQ(split_all("abc", "", mode), V());
+}
+
+TEST(StringTest, SplitAnyOf)
+{
+    using V = std::vector<std::string>;
+    auto mode = mb::SplitMode::AnyOf;
+
+    ASSERT_EQ(split_all("  mount ext4\t/dev/a  /system\n", " \t\n", mode),
+              V({"mount", "ext4", "/dev/a", "/system"}));
+    ASSERT_EQ(split_all(" \t\n", " \t\n", mode), V());
+    ASSERT_EQ(split_all("", " ", mode), V());
+    ASSERT_EQ(split_all("abc", "", mode), V({"abc"}));
+}
+
 TEST(StringTest, InsertMemory)
 {
     struct {
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "mbcommon/thread_pool.h"
+
+using namespace mb;
+
+TEST(ThreadPoolTest, CheckThreadCount)
+{
+    ThreadPool pool(3);
+    ASSERT_EQ(pool.thread_count(), 3u);
+
+    ThreadPool default_pool;
+    ASSERT_EQ(default_pool.thread_count(), ThreadPool::online_cpus());
+    ASSERT_GE(ThreadPool::online_cpus(), 1u);
+}
+
+TEST(ThreadPoolTest, SubmitAndWait)
+{
+    ThreadPool pool(4);
+    std::atomic<int> count(0);
+
+    for (int i = 0; i < 1000; ++i) {
+        pool.submit([&]{
+            ++count;
+        });
+    }
+    pool.wait();
+
+    ASSERT_EQ(count, 1000);
+}
+
+TEST(ThreadPoolTest, ParallelForCoversRange)
+{
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> hits(10007);
+
+    for (auto &h : hits) {
+        h = 0;
+    }
+
+    ASSERT_TRUE(pool.parallel_for(0, hits.size(), 0,
+                                  [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            ++hits[i];
+        }
+        return true;
+    }));
+
+    for (auto &h : hits) {
+        ASSERT_EQ(h, 1);
+    }
+}
+
+TEST(ThreadPoolTest, ParallelForEmptyRange)
+{
+    ThreadPool pool(2);
+    bool called = false;
+
+    ASSERT_TRUE(pool.parallel_for(5, 5, 1, [&](size_t, size_t) {
+        called = true;
+        return true;
+    }));
+    ASSERT_FALSE(called);
+}
+
+TEST(ThreadPoolTest, ParallelForFailureSkipsRemainingChunks)
+{
+    // Single-threaded, so the chunks run in order
+    ThreadPool pool(1);
+    std::vector<size_t> begins;
+
+    ASSERT_FALSE(pool.parallel_for(0, 10, 1, [&](size_t begin, size_t) {
+        begins.push_back(begin);
+        return begin != 3;
+    }));
+
+    ASSERT_EQ(begins, (std::vector<size_t>{0, 1, 2, 3}));
+}
+
+TEST(ThreadPoolTest, NestedParallelFor)
+{
+    ThreadPool pool(2);
+    std::atomic<int> count(0);
+
+    // Waiting from inside a task must not deadlock the workers
+    ASSERT_TRUE(pool.parallel_for(0, 8, 1, [&](size_t, size_t) {
+        return pool.parallel_for(0, 100, 10, [&](size_t begin, size_t end) {
+            count += static_cast<int>(end - begin);
+            return true;
+        });
+    }));
+
+    ASSERT_EQ(count, 800);
+}
+
+TEST(ThreadPoolTest, TaskGroupCancel)
+{
+    ThreadPool pool(1);
+    TaskGroup group(pool);
+    int count = 0;
+
+    for (int i = 0; i < 10; ++i) {
+        group.submit([&]{
+            if (++count == 5) {
+                group.cancel();
+            }
+        });
+    }
+    group.wait();
+
+    ASSERT_TRUE(group.is_cancelled());
+    ASSERT_EQ(count, 5);
+}
+
+TEST(ThreadPoolTest, TaskGroupsAreIndependent)
+{
+    ThreadPool pool(4);
+    TaskGroup a(pool);
+    TaskGroup b(pool);
+    std::atomic<int> a_count(0);
+    std::atomic<int> b_count(0);
+
+    for (int i = 0; i < 100; ++i) {
+        a.submit([&]{ ++a_count; });
+        b.submit([&]{ ++b_count; });
+    }
+
+    b.cancel();
+    a.wait();
+    b.wait();
+
+    ASSERT_EQ(a_count, 100);
+    ASSERT_FALSE(a.is_cancelled());
+    ASSERT_TRUE(b.is_cancelled());
+    ASSERT_LE(b_count, 100);
+}
+
+TEST(ThreadPoolTest, SingleThreadRunsInOrderOnWaiter)
+{
+    ThreadPool pool(1);
+    std::vector<int> order;
+    auto id = std::this_thread::get_id();
+    bool same_thread = true;
+
+    for (int i = 0; i < 5; ++i) {
+        pool.submit([&, i]{
+            same_thread &= std::this_thread::get_id() == id;
+            order.push_back(i);
+
+            // Tasks submitted from a task run after the existing ones
+            if (i == 0) {
+                pool.submit([&]{
+                    order.push_back(100);
+                });
+            }
+        });
+    }
+
+    // Nothing runs until somebody waits
+    ASSERT_TRUE(order.empty());
+
+    pool.wait();
+
+    ASSERT_TRUE(same_thread);
+    ASSERT_EQ(order, (std::vector<int>{0, 1, 2, 3, 4, 100}));
+}
+
+TEST(ThreadPoolTest, GlobalPool)
+{
+    ThreadPool &pool = ThreadPool::global();
+    ASSERT_EQ(&pool, &ThreadPool::global());
+    ASSERT_GE(pool.thread_count(), 1u);
+
+    std::atomic<int> count(0);
+    ASSERT_TRUE(pool.parallel_for(0, 64, 4, [&](size_t begin, size_t end) {
+        count += static_cast<int>(end - begin);
+        return true;
+    }));
+    ASSERT_EQ(count, 64);
+}
@@ -28,21 +28,33 @@ namespace mb
 namespace device
 {
 
+// Interned values are shared by every device with the same value, so two
+// fields are equal if and only if they point to the same object. Empty values
+// are stored as null.
+using InternedString = std::shared_ptr<const std::string>;
+using InternedStringList = std::shared_ptr<const std::vector<std::string>>;
+
+InternedString intern_string(std::string value);
+InternedStringList intern_string_list(std::vector<std::string> value);
+
+const std::string & interned_value(const InternedString &value);
+const std::vector<std::string> & interned_value(const InternedStringList &value);
+
 struct BaseOptions
 {
-    std::string id;
-    std::vector<std::string> codenames;
-    std::string name;
-    std::string architecture;
+    InternedString id;
+    InternedStringList codenames;
+    InternedString name;
+    InternedString architecture;
     DeviceFlags flags;
 
-    std::vector<std::string> base_dirs;
-    std::vector<std::string> system_devs;
-    std::vector<std::string> cache_devs;
-    std::vector<std::string> data_devs;
-    std::vector<std::string> boot_devs;
-    std::vector<std::string> recovery_devs;
-    std::vector<std::string> extra_devs;
+    InternedStringList base_dirs;
+    InternedStringList system_devs;
+    InternedStringList cache_devs;
+    InternedStringList data_devs;
+    InternedStringList boot_devs;
+    InternedStringList recovery_devs;
+    InternedStringList extra_devs;
 
     bool operator==(const BaseOptions &other) const;
 };
@@ -60,20 +72,20 @@ struct TwOptions
     int default_x_offset;
     int default_y_offset;
 
-    std::string brightness_path;
-    std::string secondary_brightness_path;
+    InternedString brightness_path;
+    InternedString secondary_brightness_path;
     int max_brightness;
     int default_brightness;
 
-    std::string battery_path;
-    std::string cpu_temp_path;
+    InternedString battery_path;
+    InternedString cpu_temp_path;
 
-    std::string input_blacklist;
-    std::string input_whitelist;
+    InternedString input_blacklist;
+    InternedString input_whitelist;
 
-    std::vector<std::string> graphics_backends;
+    InternedStringList graphics_backends;
 
-    std::string theme;
+    InternedString theme;
 
     bool operator==(const TwOptions &other) const;
 };
@@ -55,5 +55,45 @@ MB_EXPORT bool device_list_from_json(const std::string &json,
 
 MB_EXPORT bool device_to_json(const Device &device, std::string &json);
 
+class DeviceDatabasePrivate;
+
+/*!
+ * \brief Indexed list of device definitions that are parsed on demand
+ *
+ * load() only records where each device is located in the JSON document along
+ * with its ID and codenames. A Device is only constructed when it is requested
+ * with get().
+ *
+ * The index can also be saved with to_binary() (as done by devicesgen) and
+ * used directly from memory with load_binary(), which skips parsing entirely.
+ */
+class MB_EXPORT DeviceDatabase
+{
+    MB_DECLARE_PRIVATE(DeviceDatabase)
+
+public:
+    DeviceDatabase();
+    ~DeviceDatabase();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(DeviceDatabase)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(DeviceDatabase)
+
+    bool load(std::string json, bool validate, JsonError &error);
+    bool load_binary(const void *data, size_t size, JsonError &error);
+    bool to_binary(std::string &output) const;
+
+    static bool is_binary(const void *data, size_t size);
+
+    size_t size() const;
+
+    bool find_id(const std::string &id, size_t &index) const;
+    bool find_codename(const std::string &codename, size_t &index) const;
+
+    bool get(size_t index, Device &device) const;
+
+private:
+    std::unique_ptr<DeviceDatabasePrivate> _priv_ptr;
+};
+
 }
 }
@@ -60,7 +60,7 @@ public:
             auto it = std::find_if(_schema_docs.begin(), _schema_docs.end(),
                                    [uri, length](const SchemaDocItem &item) {
                 return item.first.size() == length
-                        && memcmp(item.first.data(), uri, length);
+                        && memcmp(item.first.data(), uri, length) == 0;
             });
             if (it != _schema_docs.end()) {
                 return it->second.get();
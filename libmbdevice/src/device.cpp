@@ -19,6 +19,10 @@
 
 #include "mbdevice/device.h"
 
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
 #include "mbdevice/device_p.h"
 
 
@@ -27,26 +31,151 @@ namespace mb
 namespace device
 {
 
-Device::Device()
-    : _priv_ptr(new DevicePrivate())
+/*! \cond INTERNAL */
+struct InternHash
 {
-    MB_PRIVATE(Device);
+    size_t operator()(const std::string *value) const
+    {
+        return std::hash<std::string>()(*value);
+    }
+
+    size_t operator()(const std::vector<std::string> *value) const
+    {
+        size_t hash = value->size();
+        for (auto const &item : *value) {
+            hash = hash * 31 + std::hash<std::string>()(item);
+        }
+        return hash;
+    }
+};
+
+struct InternEqual
+{
+    template<typename T>
+    bool operator()(const T *a, const T *b) const
+    {
+        return *a == *b;
+    }
+};
+
+/*!
+ * \brief Pool of shared immutable values
+ *
+ * The pool only holds weak references, so a value is freed as soon as the
+ * last device that uses it is destroyed.
+ */
+template<typename T>
+class InternPool
+{
+public:
+    std::shared_ptr<const T> get(T value)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto it = _values.find(&value);
+        if (it != _values.end()) {
+            if (auto ptr = it->second.lock()) {
+                return ptr;
+            }
+
+            // The last reference is being dropped, but the deleter has not
+            // removed the entry yet
+            _values.erase(it);
+        }
+
+        std::shared_ptr<const T> ptr(new T(std::move(value)),
+                                     [this](const T *p) { release(p); });
+        _values.emplace(ptr.get(), ptr);
+        return ptr;
+    }
+
+private:
+    void release(const T *ptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            // The entry may already belong to a newer copy of the same value
+            auto it = _values.find(ptr);
+            if (it != _values.end() && it->first == ptr) {
+                _values.erase(it);
+            }
+        }
+
+        delete ptr;
+    }
 
-    priv->tw.pixel_format = TwPixelFormat::Default;
-    priv->tw.force_pixel_format = TwForcePixelFormat::None;
-    priv->tw.max_brightness = -1;
-    priv->tw.default_brightness = -1;
+    std::mutex _mutex;
+    std::unordered_map<const T *, std::weak_ptr<const T>,
+                       InternHash, InternEqual> _values;
+};
+
+// The pools are never destroyed, since devices with static storage duration
+// may release their values after the pools would have been destroyed
+
+InternedString intern_string(std::string value)
+{
+    static auto *pool = new InternPool<std::string>();
+
+    if (value.empty()) {
+        return nullptr;
+    }
+    return pool->get(std::move(value));
+}
+
+InternedStringList intern_string_list(std::vector<std::string> value)
+{
+    static auto *pool = new InternPool<std::vector<std::string>>();
+
+    if (value.empty()) {
+        return nullptr;
+    }
+    return pool->get(std::move(value));
+}
+
+const std::string & interned_value(const InternedString &value)
+{
+    static const std::string empty;
+    return value ? *value : empty;
+}
+
+const std::vector<std::string> & interned_value(const InternedStringList &value)
+{
+    static const std::vector<std::string> empty;
+    return value ? *value : empty;
+}
+
+/*!
+ * \brief Get the private data shared by all default-constructed devices
+ */
+static const std::shared_ptr<DevicePrivate> & default_private()
+{
+    static auto *ptr = []{
+        auto *priv = new DevicePrivate();
+        priv->tw.pixel_format = TwPixelFormat::Default;
+        priv->tw.force_pixel_format = TwForcePixelFormat::None;
+        priv->tw.max_brightness = -1;
+        priv->tw.default_brightness = -1;
+        return new std::shared_ptr<DevicePrivate>(priv);
+    }();
+    return *ptr;
+}
+/*! \endcond */
+
+Device::Device()
+    : _priv_ptr(default_private())
+{
 }
 
 Device::Device(const Device &device)
-    : _priv_ptr(new DevicePrivate(*device._priv_func()))
+    : _priv_ptr(device._priv_ptr)
 {
 }
 
 Device::Device(Device &&device)
     : _priv_ptr(std::move(device._priv_ptr))
 {
-    device._priv_ptr.reset(new DevicePrivate());
+    device._priv_ptr = default_private();
 }
 
 Device::~Device()
@@ -55,8 +184,7 @@ Device::~Device()
 
 void Device::operator=(const Device &device)
 {
-    MB_PRIVATE(Device);
-    *priv = *device._priv_func();
+    _priv_ptr = device._priv_ptr;
 }
 
 void Device::operator=(Device &&device)
@@ -64,15 +192,25 @@ void Device::operator=(Device &&device)
     _priv_ptr.swap(device._priv_ptr);
 }
 
+/*!
+ * \brief Give this device its own copy of the data before modifying it
+ */
+void Device::detach()
+{
+    if (_priv_ptr.use_count() > 1) {
+        _priv_ptr = std::make_shared<DevicePrivate>(*_priv_ptr);
+    }
+}
+
 /*!
  * \brief Get the device ID
  *
  * \return Device ID
  */
-std::string Device::id() const
+const std::string & Device::id() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.id;
+    return interned_value(priv->base.id);
 }
 
 /*!
@@ -82,8 +220,9 @@ std::string Device::id() const
  */
 void Device::set_id(std::string id)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.id = std::move(id);
+    priv->base.id = intern_string(std::move(id));
 }
 
 /*!
@@ -91,10 +230,10 @@ void Device::set_id(std::string id)
  *
  * \return List of device names
  */
-std::vector<std::string> Device::codenames() const
+const std::vector<std::string> & Device::codenames() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.codenames;
+    return interned_value(priv->base.codenames);
 }
 
 /*!
@@ -104,8 +243,9 @@ std::vector<std::string> Device::codenames() const
  */
 void Device::set_codenames(std::vector<std::string> codenames)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.codenames = std::move(codenames);
+    priv->base.codenames = intern_string_list(std::move(codenames));
 }
 
 /*!
@@ -113,10 +253,10 @@ void Device::set_codenames(std::vector<std::string> codenames)
  *
  * \return Device name
  */
-std::string Device::name() const
+const std::string & Device::name() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.name;
+    return interned_value(priv->base.name);
 }
 
 /*!
@@ -126,8 +266,9 @@ std::string Device::name() const
  */
 void Device::set_name(std::string name)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.name = std::move(name);
+    priv->base.name = intern_string(std::move(name));
 }
 
 /*!
@@ -135,10 +276,10 @@ void Device::set_name(std::string name)
  *
  * \return Device architecture
  */
-std::string Device::architecture() const
+const std::string & Device::architecture() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.architecture;
+    return interned_value(priv->base.architecture);
 }
 
 /*!
@@ -148,8 +289,9 @@ std::string Device::architecture() const
  */
 void Device::set_architecture(std::string architecture)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.architecture = std::move(architecture);
+    priv->base.architecture = intern_string(std::move(architecture));
 }
 
 DeviceFlags Device::flags() const
@@ -160,6 +302,7 @@ DeviceFlags Device::flags() const
 
 void Device::set_flags(DeviceFlags flags)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->base.flags = flags;
 }
@@ -169,10 +312,10 @@ void Device::set_flags(DeviceFlags flags)
  *
  * \return List of block device base directories
  */
-std::vector<std::string> Device::block_dev_base_dirs() const
+const std::vector<std::string> & Device::block_dev_base_dirs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.base_dirs;
+    return interned_value(priv->base.base_dirs);
 }
 
 /*!
@@ -182,8 +325,9 @@ std::vector<std::string> Device::block_dev_base_dirs() const
  */
 void Device::set_block_dev_base_dirs(std::vector<std::string> base_dirs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.base_dirs = std::move(base_dirs);
+    priv->base.base_dirs = intern_string_list(std::move(base_dirs));
 }
 
 /*!
@@ -191,10 +335,10 @@ void Device::set_block_dev_base_dirs(std::vector<std::string> base_dirs)
  *
  * \return List of system block device paths
  */
-std::vector<std::string> Device::system_block_devs() const
+const std::vector<std::string> & Device::system_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.system_devs;
+    return interned_value(priv->base.system_devs);
 }
 
 /*!
@@ -204,8 +348,9 @@ std::vector<std::string> Device::system_block_devs() const
  */
 void Device::set_system_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.system_devs = std::move(block_devs);
+    priv->base.system_devs = intern_string_list(std::move(block_devs));
 }
 
 /*!
@@ -213,10 +358,10 @@ void Device::set_system_block_devs(std::vector<std::string> block_devs)
  *
  * \return List of cache block device paths
  */
-std::vector<std::string> Device::cache_block_devs() const
+const std::vector<std::string> & Device::cache_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.cache_devs;
+    return interned_value(priv->base.cache_devs);
 }
 
 /*!
@@ -226,8 +371,9 @@ std::vector<std::string> Device::cache_block_devs() const
  */
 void Device::set_cache_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.cache_devs = std::move(block_devs);
+    priv->base.cache_devs = intern_string_list(std::move(block_devs));
 }
 
 /*!
@@ -235,10 +381,10 @@ void Device::set_cache_block_devs(std::vector<std::string> block_devs)
  *
  * \return List of data block device paths
  */
-std::vector<std::string> Device::data_block_devs() const
+const std::vector<std::string> & Device::data_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.data_devs;
+    return interned_value(priv->base.data_devs);
 }
 
 /*!
@@ -248,8 +394,9 @@ std::vector<std::string> Device::data_block_devs() const
  */
 void Device::set_data_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.data_devs = std::move(block_devs);
+    priv->base.data_devs = intern_string_list(std::move(block_devs));
 }
 
 /*!
@@ -257,10 +404,10 @@ void Device::set_data_block_devs(std::vector<std::string> block_devs)
  *
  * \return List of boot block device paths
  */
-std::vector<std::string> Device::boot_block_devs() const
+const std::vector<std::string> & Device::boot_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.boot_devs;
+    return interned_value(priv->base.boot_devs);
 }
 
 /*!
@@ -270,8 +417,9 @@ std::vector<std::string> Device::boot_block_devs() const
  */
 void Device::set_boot_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.boot_devs = std::move(block_devs);
+    priv->base.boot_devs = intern_string_list(std::move(block_devs));
 }
 
 /*!
@@ -279,10 +427,10 @@ void Device::set_boot_block_devs(std::vector<std::string> block_devs)
  *
  * \return List of recovery block devices
  */
-std::vector<std::string> Device::recovery_block_devs() const
+const std::vector<std::string> & Device::recovery_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.recovery_devs;
+    return interned_value(priv->base.recovery_devs);
 }
 
 /*!
@@ -292,8 +440,9 @@ std::vector<std::string> Device::recovery_block_devs() const
  */
 void Device::set_recovery_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.recovery_devs = std::move(block_devs);
+    priv->base.recovery_devs = intern_string_list(std::move(block_devs));
 }
 
 /*!
@@ -301,10 +450,10 @@ void Device::set_recovery_block_devs(std::vector<std::string> block_devs)
  *
  * \return List of extra block device paths
  */
-std::vector<std::string> Device::extra_block_devs() const
+const std::vector<std::string> & Device::extra_block_devs() const
 {
     MB_PRIVATE(const Device);
-    return priv->base.extra_devs;
+    return interned_value(priv->base.extra_devs);
 }
 
 /*!
@@ -314,8 +463,9 @@ std::vector<std::string> Device::extra_block_devs() const
  */
 void Device::set_extra_block_devs(std::vector<std::string> block_devs)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->base.extra_devs = std::move(block_devs);
+    priv->base.extra_devs = intern_string_list(std::move(block_devs));
 }
 
 bool Device::tw_supported() const
@@ -326,6 +476,7 @@ bool Device::tw_supported() const
 
 void Device::set_tw_supported(bool supported)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.supported = supported;
 }
@@ -338,6 +489,7 @@ TwFlags Device::tw_flags() const
 
 void Device::set_tw_flags(TwFlags flags)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.flags = flags;
 }
@@ -350,6 +502,7 @@ TwPixelFormat Device::tw_pixel_format() const
 
 void Device::set_tw_pixel_format(TwPixelFormat format)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.pixel_format = format;
 }
@@ -362,6 +515,7 @@ TwForcePixelFormat Device::tw_force_pixel_format() const
 
 void Device::set_tw_force_pixel_format(TwForcePixelFormat format)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.force_pixel_format = format;
 }
@@ -374,6 +528,7 @@ int Device::tw_overscan_percent() const
 
 void Device::set_tw_overscan_percent(int percent)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.overscan_percent = percent;
 }
@@ -386,6 +541,7 @@ int Device::tw_default_x_offset() const
 
 void Device::set_tw_default_x_offset(int offset)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.default_x_offset = offset;
 }
@@ -398,32 +554,35 @@ int Device::tw_default_y_offset() const
 
 void Device::set_tw_default_y_offset(int offset)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.default_y_offset = offset;
 }
 
-std::string Device::tw_brightness_path() const
+const std::string & Device::tw_brightness_path() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.brightness_path;
+    return interned_value(priv->tw.brightness_path);
 }
 
 void Device::set_tw_brightness_path(std::string path)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.brightness_path = std::move(path);
+    priv->tw.brightness_path = intern_string(std::move(path));
 }
 
-std::string Device::tw_secondary_brightness_path() const
+const std::string & Device::tw_secondary_brightness_path() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.secondary_brightness_path;
+    return interned_value(priv->tw.secondary_brightness_path);
 }
 
 void Device::set_tw_secondary_brightness_path(std::string path)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.secondary_brightness_path = std::move(path);
+    priv->tw.secondary_brightness_path = intern_string(std::move(path));
 }
 
 int Device::tw_max_brightness() const
@@ -434,6 +593,7 @@ int Device::tw_max_brightness() const
 
 void Device::set_tw_max_brightness(int value)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.max_brightness = value;
 }
@@ -446,80 +606,87 @@ int Device::tw_default_brightness() const
 
 void Device::set_tw_default_brightness(int value)
 {
+    detach();
     MB_PRIVATE(Device);
     priv->tw.default_brightness = value;
 }
 
-std::string Device::tw_battery_path() const
+const std::string & Device::tw_battery_path() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.battery_path;
+    return interned_value(priv->tw.battery_path);
 }
 
 void Device::set_tw_battery_path(std::string path)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.battery_path = std::move(path);
+    priv->tw.battery_path = intern_string(std::move(path));
 }
 
-std::string Device::tw_cpu_temp_path() const
+const std::string & Device::tw_cpu_temp_path() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.cpu_temp_path;
+    return interned_value(priv->tw.cpu_temp_path);
 }
 
 void Device::set_tw_cpu_temp_path(std::string path)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.cpu_temp_path = std::move(path);
+    priv->tw.cpu_temp_path = intern_string(std::move(path));
 }
 
-std::string Device::tw_input_blacklist() const
+const std::string & Device::tw_input_blacklist() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.input_blacklist;
+    return interned_value(priv->tw.input_blacklist);
 }
 
 void Device::set_tw_input_blacklist(std::string blacklist)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.input_blacklist = std::move(blacklist);
+    priv->tw.input_blacklist = intern_string(std::move(blacklist));
 }
 
-std::string Device::tw_input_whitelist() const
+const std::string & Device::tw_input_whitelist() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.input_whitelist;
+    return interned_value(priv->tw.input_whitelist);
 }
 
 void Device::set_tw_input_whitelist(std::string whitelist)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.input_whitelist = std::move(whitelist);
+    priv->tw.input_whitelist = intern_string(std::move(whitelist));
 }
 
-std::vector<std::string> Device::tw_graphics_backends() const
+const std::vector<std::string> & Device::tw_graphics_backends() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.graphics_backends;
+    return interned_value(priv->tw.graphics_backends);
 }
 
 void Device::set_tw_graphics_backends(std::vector<std::string> backends)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.graphics_backends = std::move(backends);
+    priv->tw.graphics_backends = intern_string_list(std::move(backends));
 }
 
-std::string Device::tw_theme() const
+const std::string & Device::tw_theme() const
 {
     MB_PRIVATE(const Device);
-    return priv->tw.theme;
+    return interned_value(priv->tw.theme);
 }
 
 void Device::set_tw_theme(std::string theme)
 {
+    detach();
     MB_PRIVATE(Device);
-    priv->tw.theme = std::move(theme);
+    priv->tw.theme = intern_string(std::move(theme));
 }
 
 
@@ -529,24 +696,25 @@ ValidateFlags Device::validate() const
 
     ValidateFlags flags = 0;
 
-    if (priv->base.id.empty()) {
+    if (!priv->base.id) {
         flags |= ValidateFlag::MissingId;
     }
 
-    if (priv->base.codenames.empty()) {
+    if (!priv->base.codenames) {
         flags |= ValidateFlag::MissingCodenames;
     }
 
-    if (priv->base.name.empty()) {
+    if (!priv->base.name) {
         flags |= ValidateFlag::MissingName;
     }
 
-    if (priv->base.architecture.empty()) {
+    auto const &architecture = interned_value(priv->base.architecture);
+    if (architecture.empty()) {
         flags |= ValidateFlag::MissingArchitecture;
-    } else if (priv->base.architecture != ARCH_ARMEABI_V7A
-            && priv->base.architecture != ARCH_ARM64_V8A
-            && priv->base.architecture != ARCH_X86
-            && priv->base.architecture != ARCH_X86_64) {
+    } else if (architecture != ARCH_ARMEABI_V7A
+            && architecture != ARCH_ARM64_V8A
+            && architecture != ARCH_X86
+            && architecture != ARCH_X86_64) {
         flags |= ValidateFlag::InvalidArchitecture;
     }
 
@@ -554,19 +722,19 @@ ValidateFlags Device::validate() const
         flags |= ValidateFlag::InvalidFlags;
     }
 
-    if (priv->base.system_devs.empty()) {
+    if (!priv->base.system_devs) {
         flags |= ValidateFlag::MissingSystemBlockDevs;
     }
 
-    if (priv->base.cache_devs.empty()) {
+    if (!priv->base.cache_devs) {
         flags |= ValidateFlag::MissingCacheBlockDevs;
     }
 
-    if (priv->base.data_devs.empty()) {
+    if (!priv->base.data_devs) {
         flags |= ValidateFlag::MissingDataBlockDevs;
     }
 
-    if (priv->base.boot_devs.empty()) {
+    if (!priv->base.boot_devs) {
         flags |= ValidateFlag::MissingBootBlockDevs;
     }
 
@@ -579,11 +747,11 @@ ValidateFlags Device::validate() const
             flags |= ValidateFlag::InvalidBootUiFlags;
         }
 
-        if (priv->tw.theme.empty()) {
+        if (!priv->tw.theme) {
             flags |= ValidateFlag::MissingBootUiTheme;
         }
 
-        if (priv->tw.graphics_backends.empty()) {
+        if (!priv->tw.graphics_backends) {
             flags |= ValidateFlag::MissingBootUiGraphicsBackends;
         }
     }
@@ -632,6 +800,10 @@ bool Device::operator==(const Device &other) const
 {
     MB_PRIVATE(const Device);
 
+    if (_priv_ptr == other._priv_ptr) {
+        return true;
+    }
+
     return priv->base == other._priv_func()->base
             && priv->tw == other._priv_func()->tw;
 }
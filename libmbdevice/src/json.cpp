@@ -19,15 +19,20 @@
 
 #include "mbdevice/json.h"
 
+#include <algorithm>
+#include <unordered_map>
+
 #include <cassert>
 #include <cstring>
 
 #include <rapidjson/document.h>
 #include <rapidjson/error/en.h>
+#include <rapidjson/reader.h>
 #include <rapidjson/schema.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
+#include "mbcommon/endian.h"
 #include "mbcommon/string.h"
 #include "mbdevice/schema.h"
 
@@ -282,10 +287,37 @@ static void process_device(Device &device, const Value &node)
     }
 }
 
+/*! \cond INTERNAL */
+struct CachedSchemas
+{
+    const SchemaDocument *device;
+    const SchemaDocument *device_list;
+};
+/*! \endcond */
+
+/*!
+ * \brief Get the compiled device schemas
+ *
+ * The schemas are compiled once and shared by the whole process. They are all
+ * compiled up front, so the provider's cache is never modified afterwards and
+ * the schemas can be used from multiple threads.
+ */
+static const CachedSchemas & cached_schemas()
+{
+    // Never destroyed so that the schemas remain usable while exiting
+    static const CachedSchemas *schemas = []{
+        auto *sp = new DeviceSchemaProvider<>();
+        return new CachedSchemas{
+            sp->GetSchema("device.json"),
+            sp->GetSchema("device_list.json"),
+        };
+    }();
+    return *schemas;
+}
+
 bool device_from_json(const std::string &json, Device &device, JsonError &error)
 {
-    DeviceSchemaProvider<> sp;
-    const SchemaDocument *sd = sp.GetSchema("device.json");
+    const SchemaDocument *sd = cached_schemas().device;
     if (!sd) {
         assert(false);
         return false;
@@ -325,8 +357,7 @@ bool device_list_from_json(const std::string &json,
                            std::vector<Device> &devices,
                            JsonError &error)
 {
-    DeviceSchemaProvider<> sp;
-    const SchemaDocument *sd = sp.GetSchema("device_list.json");
+    const SchemaDocument *sd = cached_schemas().device_list;
     if (!sd) {
         assert(false);
         return false;
@@ -369,247 +400,921 @@ bool device_list_from_json(const std::string &json,
     return true;
 }
 
-bool device_to_json(const Device &device, std::string &json)
+template<typename Handler, SizeType N>
+static bool write_key(Handler &h, const char (&key)[N])
 {
-    Document d;
-    d.SetObject();
+    return h.Key(key, N - 1, false);
+}
 
-    auto &alloc = d.GetAllocator();
+template<typename Handler>
+static bool write_string(Handler &h, const std::string &value)
+{
+    return h.String(value.data(), static_cast<SizeType>(value.size()), false);
+}
 
-    auto const &id = device.id();
-    if (!id.empty()) {
-        d.AddMember("id", id, alloc);
+template<typename Handler>
+static bool write_string_array(Handler &h, const std::vector<std::string> &values)
+{
+    if (!h.StartArray()) {
+        return false;
+    }
+    for (auto const &value : values) {
+        if (!write_string(h, value)) {
+            return false;
+        }
     }
+    return h.EndArray(static_cast<SizeType>(values.size()));
+}
+
+template<typename Handler, typename Mappings, typename Flags>
+static bool write_flag_array(Handler &h, const Mappings &mappings, Flags flags)
+{
+    SizeType count = 0;
 
-    auto const &codenames = device.codenames();
-    if (!codenames.empty()) {
-        Value array(kArrayType);
-        for (auto const &c : codenames) {
-            array.PushBack(StringRef(c), alloc);
+    if (!h.StartArray()) {
+        return false;
+    }
+    for (auto const &item : mappings) {
+        if (flags & item.second) {
+            if (!h.String(item.first, static_cast<SizeType>(strlen(item.first)),
+                          false)) {
+                return false;
+            }
+            ++count;
         }
-        d.AddMember("codenames", array, alloc);
     }
+    return h.EndArray(count);
+}
 
-    auto const &name = device.name();
-    if (!name.empty()) {
-        d.AddMember("name", name, alloc);
+template<typename Handler, typename Mappings, typename Enum>
+static bool write_enum(Handler &h, const Mappings &mappings, Enum value)
+{
+    for (auto const &item : mappings) {
+        if (value == item.second) {
+            return h.String(item.first,
+                            static_cast<SizeType>(strlen(item.first)), false);
+        }
     }
+    return false;
+}
+
+#define WRITE_MEMBER(KEY, EXPR) \
+    do { \
+        if (!write_key(h, KEY) || !(EXPR)) { \
+            return false; \
+        } \
+        ++members; \
+    } while (0)
+
+#define WRITE_STRING(KEY, VALUE) \
+    do { \
+        auto const &_value = (VALUE); \
+        if (!_value.empty()) { \
+            WRITE_MEMBER(KEY, write_string(h, _value)); \
+        } \
+    } while (0)
+
+#define WRITE_STRING_ARRAY(KEY, VALUE) \
+    do { \
+        auto const &_value = (VALUE); \
+        if (!_value.empty()) { \
+            WRITE_MEMBER(KEY, write_string_array(h, _value)); \
+        } \
+    } while (0)
+
+/*!
+ * \brief Emit the SAX events for a device object
+ *
+ * Members with default values are omitted and the members are written in the
+ * order in which they appear in the schema.
+ */
+template<typename Handler>
+static bool write_device(Handler &h, const Device &device)
+{
+    SizeType members = 0;
 
-    auto const &architecture = device.architecture();
-    if (!architecture.empty()) {
-        d.AddMember("architecture", architecture, alloc);
+    if (!h.StartObject()) {
+        return false;
     }
 
-    auto const flags = device.flags();
-    if (flags) {
-        Value array(kArrayType);
-        for (auto const &item : g_device_flag_mappings) {
-            if (flags & item.second) {
-                array.PushBack(StringRef(item.first), alloc);
-            }
-        }
-        d.AddMember("flags", array, alloc);
+    WRITE_STRING("id", device.id());
+    WRITE_STRING_ARRAY("codenames", device.codenames());
+    WRITE_STRING("name", device.name());
+    WRITE_STRING("architecture", device.architecture());
+
+    if (auto const flags = device.flags()) {
+        WRITE_MEMBER("flags", write_flag_array(h, g_device_flag_mappings, flags));
     }
 
     /* Block devs */
-    Value block_devs(kObjectType);
+    if (!device.block_dev_base_dirs().empty()
+            || !device.system_block_devs().empty()
+            || !device.cache_block_devs().empty()
+            || !device.data_block_devs().empty()
+            || !device.boot_block_devs().empty()
+            || !device.recovery_block_devs().empty()
+            || !device.extra_block_devs().empty()) {
+        SizeType outer_members = members;
+        members = 0;
+
+        if (!write_key(h, "block_devs") || !h.StartObject()) {
+            return false;
+        }
+
+        WRITE_STRING_ARRAY("base_dirs", device.block_dev_base_dirs());
+        WRITE_STRING_ARRAY("system", device.system_block_devs());
+        WRITE_STRING_ARRAY("cache", device.cache_block_devs());
+        WRITE_STRING_ARRAY("data", device.data_block_devs());
+        WRITE_STRING_ARRAY("boot", device.boot_block_devs());
+        WRITE_STRING_ARRAY("recovery", device.recovery_block_devs());
+        WRITE_STRING_ARRAY("extra", device.extra_block_devs());
 
-    auto const &base_dirs = device.block_dev_base_dirs();
-    if (!base_dirs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : base_dirs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
+        if (!h.EndObject(members)) {
+            return false;
         }
-        block_devs.AddMember("base_dirs", array, alloc);
+        members = outer_members + 1;
     }
 
-    auto const &system_devs = device.system_block_devs();
-    if (!system_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : system_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
+    /* Boot UI */
+    auto const tw_flags = device.tw_flags();
+    auto const pixel_format = device.tw_pixel_format();
+    auto const force_pixel_format = device.tw_force_pixel_format();
+    auto const overscan_percent = device.tw_overscan_percent();
+    auto const default_x_offset = device.tw_default_x_offset();
+    auto const default_y_offset = device.tw_default_y_offset();
+    auto const max_brightness = device.tw_max_brightness();
+    auto const default_brightness = device.tw_default_brightness();
+
+    if (device.tw_supported()
+            || tw_flags
+            || pixel_format != TwPixelFormat::Default
+            || force_pixel_format != TwForcePixelFormat::None
+            || overscan_percent != 0
+            || default_x_offset != 0
+            || default_y_offset != 0
+            || !device.tw_brightness_path().empty()
+            || !device.tw_secondary_brightness_path().empty()
+            || max_brightness != -1
+            || default_brightness != -1
+            || !device.tw_battery_path().empty()
+            || !device.tw_cpu_temp_path().empty()
+            || !device.tw_input_blacklist().empty()
+            || !device.tw_input_whitelist().empty()
+            || !device.tw_graphics_backends().empty()
+            || !device.tw_theme().empty()) {
+        SizeType outer_members = members;
+        members = 0;
+
+        if (!write_key(h, "boot_ui") || !h.StartObject()) {
+            return false;
         }
-        block_devs.AddMember("system", array, alloc);
-    }
 
-    auto const &cache_devs = device.cache_block_devs();
-    if (!cache_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : cache_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
+        if (device.tw_supported()) {
+            WRITE_MEMBER("supported", h.Bool(true));
+        }
+        if (tw_flags) {
+            WRITE_MEMBER("flags", write_flag_array(h, g_tw_flag_mappings,
+                                                   tw_flags));
+        }
+        if (pixel_format != TwPixelFormat::Default) {
+            WRITE_MEMBER("pixel_format", write_enum(h, g_tw_pxfmt_mappings,
+                                                    pixel_format));
+        }
+        if (force_pixel_format != TwForcePixelFormat::None) {
+            WRITE_MEMBER("force_pixel_format",
+                         write_enum(h, g_tw_force_pxfmt_mappings,
+                                    force_pixel_format));
+        }
+        if (overscan_percent != 0) {
+            WRITE_MEMBER("overscan_percent", h.Int(overscan_percent));
+        }
+        if (default_x_offset != 0) {
+            WRITE_MEMBER("default_x_offset", h.Int(default_x_offset));
+        }
+        if (default_y_offset != 0) {
+            WRITE_MEMBER("default_y_offset", h.Int(default_y_offset));
+        }
+        WRITE_STRING("brightness_path", device.tw_brightness_path());
+        WRITE_STRING("secondary_brightness_path",
+                     device.tw_secondary_brightness_path());
+        if (max_brightness != -1) {
+            WRITE_MEMBER("max_brightness", h.Int(max_brightness));
         }
-        block_devs.AddMember("cache", array, alloc);
+        if (default_brightness != -1) {
+            WRITE_MEMBER("default_brightness", h.Int(default_brightness));
+        }
+        WRITE_STRING("battery_path", device.tw_battery_path());
+        WRITE_STRING("cpu_temp_path", device.tw_cpu_temp_path());
+        WRITE_STRING("input_blacklist", device.tw_input_blacklist());
+        WRITE_STRING("input_whitelist", device.tw_input_whitelist());
+        WRITE_STRING_ARRAY("graphics_backends", device.tw_graphics_backends());
+        WRITE_STRING("theme", device.tw_theme());
+
+        if (!h.EndObject(members)) {
+            return false;
+        }
+        members = outer_members + 1;
     }
 
-    auto const &data_devs = device.data_block_devs();
-    if (!data_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : data_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
-        }
-        block_devs.AddMember("data", array, alloc);
+    return h.EndObject(members);
+}
+
+#undef WRITE_MEMBER
+#undef WRITE_STRING
+#undef WRITE_STRING_ARRAY
+
+// The device is written straight through the schema validator into the output
+// buffer without building a DOM first
+bool device_to_json(const Device &device, std::string &json)
+{
+    auto const *sd = cached_schemas().device;
+    if (!sd) {
+        assert(false);
+        return false;
     }
 
-    auto const &boot_devs = device.boot_block_devs();
-    if (!boot_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : boot_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
-        }
-        block_devs.AddMember("boot", array, alloc);
+    StringBuffer sb;
+    Writer<StringBuffer> writer(sb);
+    GenericSchemaValidator<SchemaDocument, decltype(writer)> sv(*sd, writer);
+
+    if (!write_device(sv, device)) {
+        return false;
     }
 
-    auto const &recovery_devs = device.recovery_block_devs();
-    if (!recovery_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : recovery_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
-        }
-        block_devs.AddMember("recovery", array, alloc);
+    json.assign(sb.GetString(), sb.GetSize());
+    return true;
+}
+
+/*! \cond INTERNAL */
+class DeviceDatabasePrivate
+{
+public:
+    struct Entry
+    {
+        // Location of the device's object in the JSON document
+        size_t offset;
+        size_t size;
+        std::string id;
+        std::vector<std::string> codenames;
+    };
+
+    // Loaded with load()
+    std::string json;
+    std::vector<Entry> entries;
+    // ID/codename -> index of the first device that has it
+    std::unordered_map<std::string, size_t> ids;
+    std::unordered_map<std::string, size_t> codenames;
+
+    // Loaded with load_binary(). The data is not copied.
+    const unsigned char *binary = nullptr;
+    size_t binary_size = 0;
+    uint32_t device_count = 0;
+    uint32_t codename_count = 0;
+    uint32_t devices_offset = 0;
+    uint32_t ids_offset = 0;
+    uint32_t codenames_offset = 0;
+    uint32_t strings_offset = 0;
+    uint32_t strings_size = 0;
+};
+/*! \endcond */
+
+/*!
+ * \brief SAX handler that records the location, ID, and codenames of every
+ *        device in a device list
+ *
+ * Depth 1 is the top-level array, depth 2 is a device object, and depth 3 is
+ * the array of codenames.
+ */
+class DeviceIndexHandler
+    : public BaseReaderHandler<UTF8<>, DeviceIndexHandler>
+{
+public:
+    DeviceIndexHandler(const StringStream &is, DeviceDatabasePrivate &priv)
+        : _is(is)
+        , _priv(priv)
+        , _depth(0)
+        , _key(KeyOther)
+        , _in_codenames(false)
+    {
     }
 
-    auto const &extra_devs = device.extra_block_devs();
-    if (!extra_devs.empty()) {
-        Value array(kArrayType);
-        for (auto const &p : extra_devs) {
-            array.PushBack(StringRef(p), d.GetAllocator());
+    bool Default()
+    {
+        // The document must be an array of objects
+        if (_depth <= 1) {
+            return false;
+        }
+        if (_depth == 2) {
+            _key = KeyOther;
         }
-        block_devs.AddMember("extra", array, alloc);
+        return true;
     }
 
-    if (!block_devs.ObjectEmpty()) {
-        d.AddMember("block_devs", block_devs, alloc);
+    bool String(const char *str, SizeType length, bool copy)
+    {
+        (void) copy;
+
+        if (_depth == 2 && _key == KeyId) {
+            _id.assign(str, length);
+        } else if (_depth == 3 && _in_codenames) {
+            _codenames.emplace_back(str, length);
+        }
+
+        return Default();
     }
 
-    /* Boot UI */
-    Value boot_ui(kObjectType);
+    bool StartObject()
+    {
+        if (_depth == 0) {
+            return false;
+        } else if (_depth == 1) {
+            // The opening brace was already consumed
+            _offset = _is.Tell() - 1;
+            _id.clear();
+            _codenames.clear();
+        }
 
-    if (device.tw_supported()) {
-        boot_ui.AddMember("supported", true, alloc);
+        ++_depth;
+        return true;
     }
 
-    auto const tw_flags = device.tw_flags();
-    if (tw_flags) {
-        Value array(kArrayType);
-        for (auto const &item : g_tw_flag_mappings) {
-            if (tw_flags & item.second) {
-                array.PushBack(StringRef(item.first), d.GetAllocator());
+    bool Key(const char *str, SizeType length, bool copy)
+    {
+        (void) copy;
+
+        if (_depth == 2) {
+            std::string key(str, length);
+            if (key == "id") {
+                _key = KeyId;
+            } else if (key == "codenames") {
+                _key = KeyCodenames;
+            } else {
+                _key = KeyOther;
             }
         }
-        boot_ui.AddMember("flags", array, alloc);
+
+        return true;
     }
 
-    auto const pixel_format = device.tw_pixel_format();
-    if (pixel_format != TwPixelFormat::Default) {
-        for (auto const &item : g_tw_pxfmt_mappings) {
-            if (pixel_format == item.second) {
-                boot_ui.AddMember("pixel_format", StringRef(item.first), alloc);
-                break;
+    bool EndObject(SizeType member_count)
+    {
+        (void) member_count;
+
+        if (--_depth == 1) {
+            size_t index = _priv.entries.size();
+
+            if (!_id.empty()) {
+                _priv.ids.emplace(_id, index);
             }
+            for (auto const &codename : _codenames) {
+                _priv.codenames.emplace(codename, index);
+            }
+
+            _priv.entries.push_back({ _offset, _is.Tell() - _offset,
+                                      std::move(_id), std::move(_codenames) });
+            _id.clear();
+            _codenames.clear();
+        } else if (_depth == 2) {
+            _key = KeyOther;
         }
+
+        return true;
     }
 
-    auto const force_pixel_format = device.tw_force_pixel_format();
-    if (force_pixel_format != TwForcePixelFormat::None) {
-        for (auto const &item : g_tw_force_pxfmt_mappings) {
-            if (force_pixel_format == item.second) {
-                boot_ui.AddMember("force_pixel_format", StringRef(item.first),
-                                  alloc);
-                break;
-            }
+    bool StartArray()
+    {
+        if (_depth == 1) {
+            return false;
+        } else if (_depth == 2) {
+            _in_codenames = _key == KeyCodenames;
         }
+
+        ++_depth;
+        return true;
     }
 
-    auto const overscan_percent = device.tw_overscan_percent();
-    if (overscan_percent != 0) {
-        boot_ui.AddMember("overscan_percent", overscan_percent, alloc);
+    bool EndArray(SizeType element_count)
+    {
+        (void) element_count;
+
+        if (--_depth == 2) {
+            _in_codenames = false;
+            _key = KeyOther;
+        }
+
+        return true;
     }
 
-    auto const default_x_offset = device.tw_default_x_offset();
-    if (default_x_offset != 0) {
-        boot_ui.AddMember("default_x_offset", default_x_offset, alloc);
+private:
+    enum CurrentKey
+    {
+        KeyId,
+        KeyCodenames,
+        KeyOther,
+    };
+
+    const StringStream &_is;
+    DeviceDatabasePrivate &_priv;
+
+    unsigned int _depth;
+    CurrentKey _key;
+    bool _in_codenames;
+
+    size_t _offset;
+    std::string _id;
+    std::vector<std::string> _codenames;
+};
+
+/*
+ * Binary device database layout (all integers are little-endian uint32_t):
+ *
+ *   Header (40 bytes)
+ *     char[8]  "MBDEVDB\0"
+ *     version  BINARY_VERSION
+ *     device_count, codename_count
+ *     devices_offset, ids_offset, codenames_offset
+ *     strings_offset, strings_size
+ *
+ *   Devices table: device_count * { id offset, id size,
+ *                                   JSON offset, JSON size }
+ *   ID index: device_count * device index, sorted by ID
+ *   Codename index: codename_count * { codename offset, codename size,
+ *                                      device index }, sorted by codename
+ *   String table: IDs, codenames, and the compact JSON of each device
+ *
+ * Offsets in the tables are relative to the start of the string table. Sorts
+ * are stable so that a binary search finds the first device with a key.
+ */
+
+static constexpr char BINARY_MAGIC[8] = { 'M', 'B', 'D', 'E', 'V', 'D', 'B', '\0' };
+static constexpr uint32_t BINARY_VERSION = 1;
+static constexpr size_t BINARY_HEADER_SIZE = 40;
+static constexpr size_t BINARY_DEVICE_SIZE = 16;
+static constexpr size_t BINARY_ID_SIZE = 4;
+static constexpr size_t BINARY_CODENAME_SIZE = 12;
+
+static uint32_t read_u32(const unsigned char *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static void append_u32(std::string &out, uint32_t value)
+{
+    value = mb_htole32(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static int compare_key(const unsigned char *data, uint32_t size,
+                       const std::string &key)
+{
+    int ret = memcmp(data, key.data(), std::min<size_t>(size, key.size()));
+    if (ret != 0) {
+        return ret;
     }
+    return size < key.size() ? -1 : size > key.size() ? 1 : 0;
+}
 
-    auto const default_y_offset = device.tw_default_y_offset();
-    if (default_y_offset != 0) {
-        boot_ui.AddMember("default_y_offset", default_y_offset, alloc);
+static bool fits(uint64_t offset, uint64_t size, uint64_t limit)
+{
+    return offset <= limit && size <= limit - offset;
+}
+
+DeviceDatabase::DeviceDatabase()
+    : _priv_ptr(new DeviceDatabasePrivate())
+{
+}
+
+DeviceDatabase::~DeviceDatabase()
+{
+}
+
+/*!
+ * \brief Index a list of device definitions
+ *
+ * \param json JSON array of device definitions
+ * \param validate Whether to validate \p json against the device list schema.
+ *                 This should only be disabled for device lists that were
+ *                 already validated (eg. at build time), as get() assumes that
+ *                 every device definition is valid.
+ * \param error Error information if this function fails
+ *
+ * \return Whether the device list was successfully indexed
+ */
+bool DeviceDatabase::load(std::string json, bool validate, JsonError &error)
+{
+    MB_PRIVATE(DeviceDatabase);
+
+    DeviceDatabasePrivate result;
+    result.json = std::move(json);
+
+    StringStream is(result.json.c_str());
+    DeviceIndexHandler handler(is, result);
+    Reader reader;
+    ParseResult parse_result;
+
+    if (validate) {
+        const SchemaDocument *sd = cached_schemas().device_list;
+        if (!sd) {
+            assert(false);
+            return false;
+        }
+
+        GenericSchemaValidator<SchemaDocument, DeviceIndexHandler> sv(
+                *sd, handler);
+        parse_result = reader.Parse(is, sv);
+
+        if (!parse_result && !sv.IsValid()) {
+            StringBuffer sb;
+            sv.GetInvalidSchemaPointer().StringifyUriFragment(sb);
+            std::string schema_uri{sb.GetString(), sb.GetLength()};
+            sb.Clear();
+            sv.GetInvalidDocumentPointer().StringifyUriFragment(sb);
+            std::string document_uri{sb.GetString(), sb.GetLength()};
+
+            json_error_set_schema_validation_failure(
+                    error, std::move(schema_uri),
+                    sv.GetInvalidSchemaKeyword(), std::move(document_uri));
+            return false;
+        }
+    } else {
+        parse_result = reader.Parse(is, handler);
+    }
+
+    if (!parse_result) {
+        json_error_set_parse_error(error, parse_result.Offset(),
+                                   GetParseError_En(parse_result.Code()));
+        return false;
     }
 
-    auto const &brightness_path = device.tw_brightness_path();
-    if (!brightness_path.empty()) {
-        boot_ui.AddMember("brightness_path", brightness_path, alloc);
+    *priv = std::move(result);
+    return true;
+}
+
+/*!
+ * \brief Check if data looks like a binary device database
+ */
+bool DeviceDatabase::is_binary(const void *data, size_t size)
+{
+    return size >= sizeof(BINARY_MAGIC)
+            && memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+}
+
+/*!
+ * \brief Load a binary device database created by to_binary()
+ *
+ * Only the header and tables are checked. Nothing is copied, so \p data (eg.
+ * a mmap'd file) must remain valid for as long as the database is used.
+ * Device definitions are validated one at a time by get() so that a corrupted
+ * file cannot crash the caller.
+ *
+ * \param data Binary device database
+ * \param size Size of \p data
+ * \param error Error information if this function fails
+ *
+ * \return Whether the database was successfully loaded
+ */
+bool DeviceDatabase::load_binary(const void *data, size_t size,
+                                 JsonError &error)
+{
+    MB_PRIVATE(DeviceDatabase);
+
+    auto const *ptr = static_cast<const unsigned char *>(data);
+
+    if (size < BINARY_HEADER_SIZE || !is_binary(data, size)) {
+        json_error_set_parse_error(error, 0, "Invalid database header");
+        return false;
+    } else if (read_u32(ptr + 8) != BINARY_VERSION) {
+        json_error_set_parse_error(error, 8, "Unsupported database version");
+        return false;
     }
 
-    auto const &secondary_brightness_path =
-            device.tw_secondary_brightness_path();
-    if (!secondary_brightness_path.empty()) {
-        boot_ui.AddMember("secondary_brightness_path",
-                          secondary_brightness_path, alloc);
+    DeviceDatabasePrivate result;
+    result.binary = ptr;
+    result.binary_size = size;
+    result.device_count = read_u32(ptr + 12);
+    result.codename_count = read_u32(ptr + 16);
+    result.devices_offset = read_u32(ptr + 20);
+    result.ids_offset = read_u32(ptr + 24);
+    result.codenames_offset = read_u32(ptr + 28);
+    result.strings_offset = read_u32(ptr + 32);
+    result.strings_size = read_u32(ptr + 36);
+
+    // Check every table and reference up front so lookups need no checks
+    if (!fits(result.devices_offset,
+              uint64_t(result.device_count) * BINARY_DEVICE_SIZE, size)
+            || !fits(result.ids_offset,
+                     uint64_t(result.device_count) * BINARY_ID_SIZE, size)
+            || !fits(result.codenames_offset,
+                     uint64_t(result.codename_count) * BINARY_CODENAME_SIZE,
+                     size)
+            || !fits(result.strings_offset, result.strings_size, size)) {
+        json_error_set_parse_error(error, 12, "Database table out of bounds");
+        return false;
     }
 
-    auto const max_brightness = device.tw_max_brightness();
-    if (max_brightness != -1) {
-        boot_ui.AddMember("max_brightness", max_brightness, alloc);
+    for (uint32_t i = 0; i < result.device_count; ++i) {
+        auto const *device = ptr + result.devices_offset
+                + i * BINARY_DEVICE_SIZE;
+        if (!fits(read_u32(device), read_u32(device + 4), result.strings_size)
+                || !fits(read_u32(device + 8), read_u32(device + 12),
+                         result.strings_size)
+                || read_u32(ptr + result.ids_offset + i * BINARY_ID_SIZE)
+                        >= result.device_count) {
+            json_error_set_parse_error(error, result.devices_offset,
+                                       "Invalid device entry");
+            return false;
+        }
     }
 
-    auto const default_brightness = device.tw_default_brightness();
-    if (default_brightness != -1) {
-        boot_ui.AddMember("default_brightness", default_brightness, alloc);
+    for (uint32_t i = 0; i < result.codename_count; ++i) {
+        auto const *codename = ptr + result.codenames_offset
+                + i * BINARY_CODENAME_SIZE;
+        if (!fits(read_u32(codename), read_u32(codename + 4),
+                  result.strings_size)
+                || read_u32(codename + 8) >= result.device_count) {
+            json_error_set_parse_error(error, result.codenames_offset,
+                                       "Invalid codename entry");
+            return false;
+        }
     }
 
-    auto const &battery_path = device.tw_battery_path();
-    if (!battery_path.empty()) {
-        boot_ui.AddMember("battery_path", battery_path, alloc);
+    *priv = std::move(result);
+    return true;
+}
+
+/*!
+ * \brief Serialize the database to the binary format read by load_binary()
+ *
+ * \param[out] output Binary device database
+ *
+ * \return Whether the database could be serialized
+ */
+bool DeviceDatabase::to_binary(std::string &output) const
+{
+    MB_PRIVATE(const DeviceDatabase);
+
+    if (priv->binary) {
+        output.assign(reinterpret_cast<const char *>(priv->binary),
+                      priv->binary_size);
+        return true;
     }
 
-    auto const &cpu_temp_path = device.tw_cpu_temp_path();
-    if (!cpu_temp_path.empty()) {
-        boot_ui.AddMember("cpu_temp_path", cpu_temp_path, alloc);
+    struct Key
+    {
+        std::string key;
+        uint32_t offset;
+        uint32_t device;
+    };
+
+    std::string strings;
+    std::string devices;
+    std::vector<Key> ids;
+    std::vector<Key> codenames;
+
+    auto add_string = [&](const char *data, size_t size) {
+        auto offset = static_cast<uint32_t>(strings.size());
+        strings.append(data, size);
+        return offset;
+    };
+
+    for (size_t i = 0; i < priv->entries.size(); ++i) {
+        auto const &entry = priv->entries[i];
+        auto device = static_cast<uint32_t>(i);
+
+        uint32_t id_offset = add_string(entry.id.data(), entry.id.size());
+        uint32_t json_offset = add_string(priv->json.data() + entry.offset,
+                                          entry.size);
+
+        append_u32(devices, id_offset);
+        append_u32(devices, static_cast<uint32_t>(entry.id.size()));
+        append_u32(devices, json_offset);
+        append_u32(devices, static_cast<uint32_t>(entry.size));
+
+        ids.push_back({ entry.id, id_offset, device });
+
+        for (auto const &codename : entry.codenames) {
+            codenames.push_back({
+                codename, add_string(codename.data(), codename.size()), device
+            });
+        }
     }
 
-    auto const &input_blacklist = device.tw_input_blacklist();
-    if (!input_blacklist.empty()) {
-        boot_ui.AddMember("input_blacklist", input_blacklist, alloc);
+    if (strings.size() > UINT32_MAX / 2) {
+        return false;
     }
 
-    auto const &input_whitelist = device.tw_input_whitelist();
-    if (!input_whitelist.empty()) {
-        boot_ui.AddMember("input_whitelist", input_whitelist, alloc);
+    auto by_key = [](const Key &a, const Key &b) {
+        return a.key < b.key;
+    };
+    std::stable_sort(ids.begin(), ids.end(), by_key);
+    std::stable_sort(codenames.begin(), codenames.end(), by_key);
+
+    auto devices_offset = static_cast<uint32_t>(BINARY_HEADER_SIZE);
+    auto ids_offset = static_cast<uint32_t>(devices_offset + devices.size());
+    auto codenames_offset = static_cast<uint32_t>(
+            ids_offset + ids.size() * BINARY_ID_SIZE);
+    auto strings_offset = static_cast<uint32_t>(
+            codenames_offset + codenames.size() * BINARY_CODENAME_SIZE);
+
+    std::string out(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    append_u32(out, BINARY_VERSION);
+    append_u32(out, static_cast<uint32_t>(priv->entries.size()));
+    append_u32(out, static_cast<uint32_t>(codenames.size()));
+    append_u32(out, devices_offset);
+    append_u32(out, ids_offset);
+    append_u32(out, codenames_offset);
+    append_u32(out, strings_offset);
+    append_u32(out, static_cast<uint32_t>(strings.size()));
+    assert(out.size() == BINARY_HEADER_SIZE);
+
+    out += devices;
+    for (auto const &id : ids) {
+        append_u32(out, id.device);
+    }
+    for (auto const &codename : codenames) {
+        append_u32(out, codename.offset);
+        append_u32(out, static_cast<uint32_t>(codename.key.size()));
+        append_u32(out, codename.device);
     }
+    out += strings;
 
-    auto const &graphics_backends = device.tw_graphics_backends();
-    if (!graphics_backends.empty()) {
-        Value array(kArrayType);
-        for (auto const &b : graphics_backends) {
-            array.PushBack(StringRef(b), d.GetAllocator());
+    output.swap(out);
+    return true;
+}
+
+/*!
+ * \brief Number of devices in the database
+ */
+size_t DeviceDatabase::size() const
+{
+    MB_PRIVATE(const DeviceDatabase);
+    return priv->binary ? priv->device_count : priv->entries.size();
+}
+
+// Binary search of a sorted index in a binary database. Returns the first
+// matching device.
+static bool binary_find(const DeviceDatabasePrivate *priv,
+                        const unsigned char *table, uint32_t count,
+                        size_t entry_size, bool by_id,
+                        const std::string &key, size_t &index)
+{
+    const unsigned char *strings = priv->binary + priv->strings_offset;
+
+    auto entry_key = [&](uint32_t i, const unsigned char **data,
+                         uint32_t *size) {
+        const unsigned char *entry = table + i * entry_size;
+        if (by_id) {
+            entry = priv->binary + priv->devices_offset
+                    + read_u32(entry) * BINARY_DEVICE_SIZE;
+        }
+        *data = strings + read_u32(entry);
+        *size = read_u32(entry + 4);
+    };
+
+    uint32_t low = 0;
+    uint32_t high = count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const unsigned char *data;
+        uint32_t size;
+        entry_key(mid, &data, &size);
+
+        if (compare_key(data, size, key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
         }
-        boot_ui.AddMember("graphics_backends", array, alloc);
     }
 
-    auto const &theme = device.tw_theme();
-    if (!theme.empty()) {
-        boot_ui.AddMember("theme", theme, alloc);
+    if (low == count) {
+        return false;
     }
 
-    if (!boot_ui.ObjectEmpty()) {
-        d.AddMember("boot_ui", boot_ui, alloc);
+    const unsigned char *data;
+    uint32_t size;
+    entry_key(low, &data, &size);
+    if (compare_key(data, size, key) != 0) {
+        return false;
     }
 
-    StringBuffer sb;
-    Writer<StringBuffer> writer(sb);
-    DeviceSchemaProvider<> sp;
-    const SchemaDocument *sd = sp.GetSchema("device.json");
-    if (!sd) {
-        assert(false);
+    const unsigned char *entry = table + low * entry_size;
+    index = read_u32(by_id ? entry : entry + 8);
+    return true;
+}
+
+/*!
+ * \brief Find the first device with an ID
+ *
+ * \param[in] id Device ID
+ * \param[out] index Index of the device for use with get()
+ *
+ * \return Whether a device with the ID exists
+ */
+bool DeviceDatabase::find_id(const std::string &id, size_t &index) const
+{
+    MB_PRIVATE(const DeviceDatabase);
+
+    if (priv->binary) {
+        return binary_find(priv, priv->binary + priv->ids_offset,
+                           priv->device_count, BINARY_ID_SIZE, true, id,
+                           index);
+    }
+
+    auto it = priv->ids.find(id);
+    if (it == priv->ids.end()) {
         return false;
     }
-    GenericSchemaValidator<SchemaDocument, decltype(writer)> sv(*sd, writer);
 
-    if (!d.Accept(sv)) {
+    index = it->second;
+    return true;
+}
+
+/*!
+ * \brief Find the first device with a codename
+ *
+ * \param[in] codename Device codename
+ * \param[out] index Index of the device for use with get()
+ *
+ * \return Whether a device with the codename exists
+ */
+bool DeviceDatabase::find_codename(const std::string &codename,
+                                   size_t &index) const
+{
+    MB_PRIVATE(const DeviceDatabase);
+
+    if (priv->binary) {
+        return binary_find(priv, priv->binary + priv->codenames_offset,
+                           priv->codename_count, BINARY_CODENAME_SIZE, false,
+                           codename, index);
+    }
+
+    auto it = priv->codenames.find(codename);
+    if (it == priv->codenames.end()) {
         return false;
     }
 
-    json = {sb.GetString(), sb.GetSize()};
+    index = it->second;
+    return true;
+}
+
+/*!
+ * \brief Parse the device at an index
+ *
+ * \param[in] index Index of the device
+ * \param[out] device Device to store the definition in
+ *
+ * \return Whether \p index is valid and the device was parsed. For binary
+ *         databases, the device must also pass schema validation.
+ */
+bool DeviceDatabase::get(size_t index, Device &device) const
+{
+    MB_PRIVATE(const DeviceDatabase);
+
+    if (index >= size()) {
+        return false;
+    }
+
+    const char *json;
+    size_t json_size;
+
+    if (priv->binary) {
+        auto const *entry = priv->binary + priv->devices_offset
+                + index * BINARY_DEVICE_SIZE;
+        json = reinterpret_cast<const char *>(
+                priv->binary + priv->strings_offset + read_u32(entry + 8));
+        json_size = read_u32(entry + 12);
+    } else {
+        auto const &entry = priv->entries[index];
+        json = priv->json.data() + entry.offset;
+        json_size = entry.size;
+    }
+
+    Document d;
+    d.Parse(json, json_size);
+    if (d.HasParseError() || !d.IsObject()) {
+        return false;
+    }
+
+    // The file may have been modified since devicesgen validated it and
+    // process_device() requires a valid definition
+    if (priv->binary) {
+        const SchemaDocument *sd = cached_schemas().device;
+        if (!sd) {
+            assert(false);
+            return false;
+        }
+
+        SchemaValidator sv(*sd);
+        if (!d.Accept(sv)) {
+            return false;
+        }
+    }
+
+    device = Device();
+    process_device(device, d);
     return true;
 }
 
@@ -167,3 +167,47 @@ TEST(DeviceTest, CheckGettersSetters)
     device.set_tw_theme("portrait_hdpi");
     ASSERT_EQ(device.tw_theme(), "portrait_hdpi");
 }
+
+TEST(DeviceTest, CheckCopiesAreIndependent)
+{
+    Device d1;
+    d1.set_id("test");
+    d1.set_system_block_devs({"/dev/block/platform/msm_sdcc.1/by-name/system"});
+
+    Device d2(d1);
+    ASSERT_EQ(d1, d2);
+    ASSERT_EQ(&d1.id(), &d2.id());
+
+    d2.set_id("test2");
+    d2.set_tw_max_brightness(255);
+    ASSERT_EQ(d1.id(), "test");
+    ASSERT_EQ(d1.tw_max_brightness(), -1);
+    ASSERT_EQ(d2.id(), "test2");
+    ASSERT_EQ(d2.tw_max_brightness(), 255);
+    ASSERT_EQ(d1.system_block_devs(), d2.system_block_devs());
+    ASSERT_FALSE(d1 == d2);
+
+    Device d3;
+    d3 = d1;
+    d1.set_name("Test");
+    ASSERT_TRUE(d3.name().empty());
+}
+
+TEST(DeviceTest, CheckEqualValuesAreShared)
+{
+    Device d1;
+    Device d2;
+
+    d1.set_codenames({"a", "b"});
+    d1.set_tw_theme("portrait_hdpi");
+    d2.set_codenames({"a", "b"});
+    d2.set_tw_theme("portrait_hdpi");
+
+    ASSERT_EQ(&d1.codenames(), &d2.codenames());
+    ASSERT_EQ(&d1.tw_theme(), &d2.tw_theme());
+    ASSERT_EQ(d1, d2);
+
+    d2.set_codenames({"a"});
+    ASSERT_NE(&d1.codenames(), &d2.codenames());
+    ASSERT_FALSE(d1 == d2);
+}
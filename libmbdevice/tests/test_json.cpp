@@ -200,6 +200,47 @@ static constexpr char sample_multiple[] = R"json(
     ]
 )json";
 
+static constexpr char sample_duplicates[] = R"json(
+    [
+        {
+            "name": "test1",
+            "id": "test1",
+            "codenames": ["test1", "shared"],
+            "architecture": "armeabi-v7a",
+            "block_devs": {
+                "system": ["/dev/blah"],
+                "cache": ["/dev/blah"],
+                "data": ["/dev/blah"],
+                "boot": ["/dev/blah"]
+            }
+        },
+        {
+            "name": "test2",
+            "id": "dup",
+            "codenames": ["shared", "test2"],
+            "architecture": "arm64-v8a",
+            "block_devs": {
+                "system": ["/dev/blah"],
+                "cache": ["/dev/blah"],
+                "data": ["/dev/blah"],
+                "boot": ["/dev/blah"]
+            }
+        },
+        {
+            "name": "test3",
+            "id": "dup",
+            "codenames": ["shared"],
+            "architecture": "x86",
+            "block_devs": {
+                "system": ["/dev/blah"],
+                "cache": ["/dev/blah"],
+                "data": ["/dev/blah"],
+                "boot": ["/dev/blah"]
+            }
+        }
+    ]
+)json";
+
 
 TEST(JsonTest, LoadCompleteDefinition)
 {
@@ -406,6 +447,163 @@ TEST(JsonTest, CreateJson)
     ASSERT_EQ(d1, d2);
 }
 
+TEST(JsonTest, DatabaseLookup)
+{
+    for (bool validate : { true, false }) {
+        DeviceDatabase db;
+        JsonError error;
+        ASSERT_TRUE(db.load(sample_multiple, validate, error));
+        ASSERT_EQ(db.size(), 2u);
+
+        size_t index;
+        ASSERT_TRUE(db.find_id("test2", index));
+        ASSERT_EQ(index, 1u);
+        ASSERT_TRUE(db.find_codename("test1", index));
+        ASSERT_EQ(index, 0u);
+        ASSERT_FALSE(db.find_id("test3", index));
+        ASSERT_FALSE(db.find_codename("test3", index));
+
+        std::vector<Device> devices;
+        ASSERT_TRUE(device_list_from_json(sample_multiple, devices, error));
+
+        Device device;
+        ASSERT_TRUE(db.get(0, device));
+        ASSERT_EQ(device, devices[0]);
+        ASSERT_TRUE(db.get(1, device));
+        ASSERT_EQ(device, devices[1]);
+        ASSERT_FALSE(db.get(2, device));
+    }
+}
+
+TEST(JsonTest, DatabaseFindsFirstDevice)
+{
+    DeviceDatabase db;
+    JsonError error;
+    ASSERT_TRUE(db.load(sample_duplicates, true, error));
+    ASSERT_EQ(db.size(), 3u);
+
+    size_t index;
+    ASSERT_TRUE(db.find_id("dup", index));
+    ASSERT_EQ(index, 1u);
+    ASSERT_TRUE(db.find_codename("shared", index));
+    ASSERT_EQ(index, 0u);
+    ASSERT_TRUE(db.find_codename("test2", index));
+    ASSERT_EQ(index, 1u);
+
+    Device device;
+    ASSERT_TRUE(db.get(2, device));
+    ASSERT_EQ(device.name(), "test3");
+}
+
+TEST(JsonTest, DatabaseLoadInvalid)
+{
+    DeviceDatabase db;
+
+    JsonError e1;
+    ASSERT_FALSE(db.load(sample_complete, true, e1));
+    ASSERT_EQ(e1.type, JsonErrorType::SchemaValidationFailure);
+    ASSERT_EQ(e1.schema_uri, "#");
+    ASSERT_EQ(e1.schema_keyword, "type");
+    ASSERT_EQ(e1.document_uri, "#");
+
+    // The top-level array is still required without validation
+    JsonError e2;
+    ASSERT_FALSE(db.load(sample_complete, false, e2));
+    ASSERT_EQ(e2.type, JsonErrorType::ParseError);
+
+    JsonError e3;
+    ASSERT_FALSE(db.load(sample_malformed, false, e3));
+    ASSERT_EQ(e3.type, JsonErrorType::ParseError);
+
+    ASSERT_EQ(db.size(), 0u);
+}
+
+TEST(JsonTest, DatabaseBinaryRoundTrip)
+{
+    DeviceDatabase db1;
+    JsonError e1;
+    ASSERT_TRUE(db1.load(sample_multiple, true, e1));
+
+    std::string binary;
+    ASSERT_TRUE(db1.to_binary(binary));
+    ASSERT_TRUE(DeviceDatabase::is_binary(binary.data(), binary.size()));
+    ASSERT_FALSE(DeviceDatabase::is_binary(sample_multiple,
+                                           sizeof(sample_multiple)));
+
+    DeviceDatabase db2;
+    JsonError e2;
+    ASSERT_TRUE(db2.load_binary(binary.data(), binary.size(), e2));
+    ASSERT_EQ(db2.size(), db1.size());
+
+    size_t index;
+    ASSERT_TRUE(db2.find_id("test2", index));
+    ASSERT_EQ(index, 1u);
+    ASSERT_TRUE(db2.find_codename("test1", index));
+    ASSERT_EQ(index, 0u);
+    ASSERT_FALSE(db2.find_id("test", index));
+    ASSERT_FALSE(db2.find_codename("test10", index));
+
+    for (size_t i = 0; i < db1.size(); ++i) {
+        Device d1;
+        Device d2;
+        ASSERT_TRUE(db1.get(i, d1));
+        ASSERT_TRUE(db2.get(i, d2));
+        ASSERT_EQ(d1, d2);
+    }
+
+    // Truncated tables must be rejected
+    DeviceDatabase db3;
+    JsonError e3;
+    ASSERT_FALSE(db3.load_binary(binary.data(), binary.size() / 2, e3));
+    ASSERT_EQ(e3.type, JsonErrorType::ParseError);
+}
+
+TEST(JsonTest, DatabaseBinaryFindsFirstDevice)
+{
+    DeviceDatabase db1;
+    JsonError e1;
+    ASSERT_TRUE(db1.load(sample_duplicates, true, e1));
+
+    std::string binary;
+    ASSERT_TRUE(db1.to_binary(binary));
+
+    DeviceDatabase db2;
+    JsonError e2;
+    ASSERT_TRUE(db2.load_binary(binary.data(), binary.size(), e2));
+
+    size_t index;
+    ASSERT_TRUE(db2.find_id("dup", index));
+    ASSERT_EQ(index, 1u);
+    ASSERT_TRUE(db2.find_codename("shared", index));
+    ASSERT_EQ(index, 0u);
+    ASSERT_TRUE(db2.find_codename("test2", index));
+    ASSERT_EQ(index, 1u);
+}
+
+TEST(JsonTest, DatabaseBinaryRejectsInvalidDevice)
+{
+    DeviceDatabase db1;
+    JsonError e1;
+    ASSERT_TRUE(db1.load(sample_multiple, true, e1));
+
+    std::string binary;
+    ASSERT_TRUE(db1.to_binary(binary));
+
+    // Corrupt the first device's architecture
+    auto pos = binary.find("armeabi-v7a");
+    ASSERT_NE(pos, std::string::npos);
+    binary[pos] = 'x';
+
+    DeviceDatabase db2;
+    JsonError e2;
+    ASSERT_TRUE(db2.load_binary(binary.data(), binary.size(), e2));
+
+    Device device;
+    ASSERT_FALSE(db2.get(0, device));
+    ASSERT_TRUE(db2.get(1, device));
+    ASSERT_EQ(device.id(), "test2");
+}
+
 TEST(JsonTest, CheckCapiFlagsEqual)
 {
     ASSERT_EQ(TO_U(JsonErrorType, ParseError),
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <memory>
+
+#include <cstddef>
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Logger that hands messages to another logger on a background thread
+ *
+ * Messages are formatted by the calling thread into a preallocated slot of a
+ * lock-free ring buffer, so logging never allocates or blocks on I/O unless
+ * the buffer is full. The wrapped logger is only ever called from the flusher
+ * thread (or synchronously in forked children, which don't have one).
+ *
+ * Messages longer than ENTRY_SIZE bytes are truncated.
+ */
+class MB_EXPORT AsyncLogger : public BaseLogger
+{
+public:
+    enum Flags : int {
+        // Wait for each error message to be written before returning
+        FlushOnError = 0x1,
+    };
+
+    static constexpr size_t ENTRY_SIZE = 1024;
+
+    AsyncLogger(std::shared_ptr<BaseLogger> logger, int flags = FlushOnError,
+                size_t capacity = 256);
+    virtual ~AsyncLogger();
+
+    AsyncLogger(const AsyncLogger &) = delete;
+    AsyncLogger & operator=(const AsyncLogger &) = delete;
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+    virtual void flush() override;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+}
+}
@@ -19,9 +19,19 @@
 
 #pragma once
 
+#include <mutex>
+#include <string>
+
+#include <cstdint>
+
+#include <sys/types.h>
+
 #include "mblog/base_logger.h"
 
 #define KMSG_BUF_SIZE 512
+// Largest record that the kernel accepts in a single write to /dev/kmsg
+// (LOG_LINE_MAX in kernel/printk/printk.c), including the priority prefix
+#define KMSG_RECORD_SIZE 992
 
 namespace mb
 {
@@ -36,11 +46,39 @@ public:
     virtual ~KmsgLogger();
 
     virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+    virtual void flush() override;
 
 private:
     int _fd;
     char _buf[KMSG_BUF_SIZE];
     bool _force_error_prio;
+
+    std::mutex _mutex;
+    pid_t _pid;
+
+    // Lines waiting to be written as one record
+    char _batch[KMSG_RECORD_SIZE];
+    size_t _batch_len;
+    const char *_batch_kprio;
+    uint64_t _batch_time;
+
+    // Last message and the number of times it was repeated since
+    std::string _last_msg;
+    LogLevel _last_prio;
+    unsigned int _repeats;
+
+    // Rate limiting
+    uint64_t _window_start;
+    unsigned int _window_lines;
+    unsigned int _suppressed;
+
+    const char * kmsg_prio(LogLevel prio);
+    void append_line(LogLevel prio, const char *line, size_t len,
+                     uint64_t now);
+    void append_note(LogLevel prio, const char *fmt, unsigned int count,
+                     uint64_t now);
+    void flush_pending(uint64_t now);
+    void write_batch();
 };
 
 }
@@ -27,17 +27,29 @@
 #include "mblog/base_logger.h"
 #include "mblog/log_level.h"
 
-#define LOGE(...) mb::log::log(mb::log::LogLevel::Error, __VA_ARGS__)
-#define LOGW(...) mb::log::log(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define LOGI(...) mb::log::log(mb::log::LogLevel::Info, __VA_ARGS__)
-#define LOGD(...) mb::log::log(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define LOGV(...) mb::log::log(mb::log::LogLevel::Verbose, __VA_ARGS__)
-
-#define VLOGE(...) mb::log::logv(mb::log::LogLevel::Error, __VA_ARGS__)
-#define VLOGW(...) mb::log::logv(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define VLOGI(...) mb::log::logv(mb::log::LogLevel::Info, __VA_ARGS__)
-#define VLOGD(...) mb::log::logv(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define VLOGV(...) mb::log::logv(mb::log::LogLevel::Verbose, __VA_ARGS__)
+// Least severe level that is compiled in (see the LogLevel values). Log
+// statements for less severe levels are compiled out entirely.
+#ifndef MBLOG_MIN_LEVEL
+#  define MBLOG_MIN_LEVEL 4
+#endif
+
+// The arguments are only evaluated if the level is enabled
+#define MBLOG_LOG(func, prio, ...) \
+    ((static_cast<int>(prio) <= MBLOG_MIN_LEVEL \
+            && mb::log::log_is_enabled(prio)) \
+        ? mb::log::func(prio, __VA_ARGS__) : static_cast<void>(0))
+
+#define LOGE(...) MBLOG_LOG(log, mb::log::LogLevel::Error, __VA_ARGS__)
+#define LOGW(...) MBLOG_LOG(log, mb::log::LogLevel::Warning, __VA_ARGS__)
+#define LOGI(...) MBLOG_LOG(log, mb::log::LogLevel::Info, __VA_ARGS__)
+#define LOGD(...) MBLOG_LOG(log, mb::log::LogLevel::Debug, __VA_ARGS__)
+#define LOGV(...) MBLOG_LOG(log, mb::log::LogLevel::Verbose, __VA_ARGS__)
+
+#define VLOGE(...) MBLOG_LOG(logv, mb::log::LogLevel::Error, __VA_ARGS__)
+#define VLOGW(...) MBLOG_LOG(logv, mb::log::LogLevel::Warning, __VA_ARGS__)
+#define VLOGI(...) MBLOG_LOG(logv, mb::log::LogLevel::Info, __VA_ARGS__)
+#define VLOGD(...) MBLOG_LOG(logv, mb::log::LogLevel::Debug, __VA_ARGS__)
+#define VLOGV(...) MBLOG_LOG(logv, mb::log::LogLevel::Verbose, __VA_ARGS__)
 
 namespace mb
 {
@@ -50,6 +62,11 @@ MB_EXPORT void log_set_logger(std::shared_ptr<BaseLogger> logger);
 MB_PRINTF(2, 3)
 MB_EXPORT void log(LogLevel prio, const char *fmt, ...);
 MB_EXPORT void logv(LogLevel prio, const char *fmt, va_list ap);
+MB_EXPORT void log_flush();
+MB_EXPORT void log_set_level(LogLevel level);
+MB_EXPORT void log_set_tag_level(const char *tag, LogLevel level);
+MB_EXPORT void log_clear_tag_level(const char *tag);
+MB_EXPORT bool log_is_enabled(LogLevel prio);
 
 }
 }
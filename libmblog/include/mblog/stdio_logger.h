@@ -31,13 +31,17 @@ namespace log
 class MB_EXPORT StdioLogger : public BaseLogger
 {
 public:
-    StdioLogger(std::FILE *stream, bool show_timestamps);
+    // If auto_flush is false, the stream is only flushed by flush()
+    StdioLogger(std::FILE *stream, bool show_timestamps,
+                bool auto_flush = true);
 
     virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+    virtual void flush() override;
 
 private:
     std::FILE *_stream;
     bool _show_timestamps;
+    bool _auto_flush;
 };
 
 }
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/async_logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+
+#include <unistd.h>
+
+namespace mb
+{
+namespace log
+{
+
+// Producers only wake up the flusher when the buffer is half full (or when
+// flushing), so that messages are written in batches. Otherwise, it writes
+// whatever is queued at this interval.
+#define ASYNC_LOG_POLL_INTERVAL_MS  100
+
+// Used to keep frequently modified counters on separate cache lines
+#define ASYNC_LOG_CACHE_LINE_SIZE   64
+
+struct AsyncLogSlot
+{
+    // Vyukov-style sequence number. If equal to the slot's position, the slot
+    // is free. If equal to the position + 1, it contains a message.
+    std::atomic<size_t> seq;
+    LogLevel prio;
+    char text[AsyncLogger::ENTRY_SIZE];
+};
+
+struct AsyncLogger::Impl
+{
+    std::shared_ptr<BaseLogger> logger;
+    int flags;
+    pid_t pid;
+
+    std::vector<AsyncLogSlot> slots;
+    size_t mask;
+    // Next position to be claimed by a producer. The padding keeps it on a
+    // separate cache line from the flusher's counters. (alignas() isn't used
+    // because C++11's operator new doesn't support over-aligned types.)
+    char pad_before_tail[ASYNC_LOG_CACHE_LINE_SIZE];
+    std::atomic<size_t> tail;
+    char pad_after_tail[ASYNC_LOG_CACHE_LINE_SIZE];
+    // Next position to be consumed (only modified by the flusher thread)
+    size_t head;
+    // Number of messages that have been passed to the wrapped logger (updated
+    // after each batch)
+    std::atomic<size_t> written;
+
+    std::mutex mutex;
+    std::condition_variable work_cv;
+    std::condition_variable written_cv;
+    std::atomic<bool> sleeping;
+    bool stop;
+
+    std::thread thread;
+
+    void wake();
+    bool enqueue(LogLevel prio, const char *fmt, va_list ap, size_t &pos);
+    bool consume_one();
+    void run();
+};
+
+static void forward(BaseLogger *logger, LogLevel prio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    logger->log(prio, fmt, ap);
+    va_end(ap);
+}
+
+void AsyncLogger::Impl::wake()
+{
+    // Pairs with the fence in run() so that either the flusher sees the new
+    // message or we see that it's going to sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        work_cv.notify_one();
+    }
+}
+
+/*!
+ * \brief Claim a slot and format the message into it
+ *
+ * \return False if the buffer is full
+ */
+bool AsyncLogger::Impl::enqueue(LogLevel prio, const char *fmt, va_list ap,
+                                size_t &pos)
+{
+    pos = tail.load(std::memory_order_relaxed);
+    AsyncLogSlot *slot;
+
+    while (true) {
+        slot = &slots[pos & mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq)
+                - static_cast<intptr_t>(pos);
+
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->prio = prio;
+    vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    return true;
+}
+
+/*!
+ * \brief Pass the oldest message to the wrapped logger
+ *
+ * \return False if there are no messages ready
+ */
+bool AsyncLogger::Impl::consume_one()
+{
+    AsyncLogSlot &slot = slots[head & mask];
+
+    if (slot.seq.load(std::memory_order_acquire) != head + 1) {
+        return false;
+    }
+
+    forward(logger.get(), slot.prio, "%s", slot.text);
+
+    slot.seq.store(head + slots.size(), std::memory_order_release);
+    ++head;
+
+    return true;
+}
+
+void AsyncLogger::Impl::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        lock.unlock();
+        bool consumed = false;
+        while (consume_one()) {
+            consumed = true;
+        }
+        // Let loggers that buffer write out the whole batch at once
+        if (consumed) {
+            logger->flush();
+            written.store(head, std::memory_order_release);
+        }
+        lock.lock();
+
+        written_cv.notify_all();
+
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        AsyncLogSlot &slot = slots[head & mask];
+        bool empty = slot.seq.load(std::memory_order_acquire) != head + 1;
+
+        if (empty && stop) {
+            break;
+        } else if (empty) {
+            work_cv.wait_for(lock, std::chrono::milliseconds(
+                    ASYNC_LOG_POLL_INTERVAL_MS));
+        }
+
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+/*!
+ * \brief Construct an AsyncLogger
+ *
+ * \param logger Logger to write messages to
+ * \param flags Bitwise-OR of Flags
+ * \param capacity Number of messages that can be queued (rounded up to a power
+ *                 of 2)
+ */
+AsyncLogger::AsyncLogger(std::shared_ptr<BaseLogger> logger, int flags,
+                         size_t capacity)
+    : _impl(new Impl())
+{
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    _impl->logger = std::move(logger);
+    _impl->flags = flags;
+    _impl->pid = getpid();
+    _impl->slots = std::vector<AsyncLogSlot>(size);
+    _impl->mask = size - 1;
+    _impl->tail = 0;
+    _impl->head = 0;
+    _impl->written = 0;
+    _impl->sleeping = false;
+    _impl->stop = false;
+
+    for (size_t i = 0; i < size; ++i) {
+        _impl->slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    _impl->thread = std::thread(&Impl::run, _impl.get());
+}
+
+/*!
+ * \brief Write all queued messages and stop the flusher thread
+ */
+AsyncLogger::~AsyncLogger()
+{
+    // The thread doesn't exist in forked children and its handle can't be
+    // detached or joined there, so the state is leaked instead
+    if (getpid() != _impl->pid) {
+        _impl.release();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_impl->mutex);
+        _impl->stop = true;
+        _impl->work_cv.notify_one();
+    }
+
+    _impl->thread.join();
+}
+
+void AsyncLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    // Forked children don't have a flusher thread
+    if (getpid() != _impl->pid) {
+        _impl->logger->log(prio, fmt, ap);
+        _impl->logger->flush();
+        return;
+    }
+
+    size_t pos;
+
+    while (true) {
+        va_list copy;
+        va_copy(copy, ap);
+        bool ret = _impl->enqueue(prio, fmt, copy, pos);
+        va_end(copy);
+
+        if (ret) {
+            break;
+        }
+
+        // The buffer is full. Messages are never dropped, so wait for the
+        // flusher to catch up.
+        _impl->wake();
+        std::this_thread::yield();
+    }
+
+    if (prio == LogLevel::Error && (_impl->flags & FlushOnError)) {
+        flush();
+    } else if (pos + 1 - _impl->written.load(std::memory_order_relaxed)
+            >= _impl->slots.size() / 2) {
+        _impl->wake();
+    }
+}
+
+/*!
+ * \brief Wait for all messages logged before this call to be written
+ */
+void AsyncLogger::flush()
+{
+    if (getpid() != _impl->pid) {
+        _impl->logger->flush();
+        return;
+    }
+
+    size_t target = _impl->tail.load(std::memory_order_acquire);
+
+    std::unique_lock<std::mutex> lock(_impl->mutex);
+    _impl->work_cv.notify_one();
+    _impl->written_cv.wait(lock, [&] {
+        return _impl->written.load(std::memory_order_acquire) >= target;
+    });
+    lock.unlock();
+
+    _impl->logger->flush();
+}
+
+}
+}
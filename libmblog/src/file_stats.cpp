@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/file_stats.h"
+
+#include <string>
+
+#include <cinttypes>
+
+#include "mbcommon/string.h"
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace log
+{
+
+static std::string format_histogram(const uint64_t *histogram)
+{
+    static const char *labels[FILE_STATS_HISTOGRAM_BUCKETS] = {
+        "<16", "<64", "<256", "<1K", "<4K", "<16K", "<64K", "<256K", "<1M",
+        ">=1M",
+    };
+
+    std::string result;
+
+    for (size_t i = 0; i < FILE_STATS_HISTOGRAM_BUCKETS; ++i) {
+        if (histogram[i] == 0) {
+            continue;
+        }
+
+        if (!result.empty()) {
+            result += ' ';
+        }
+        result += format("%s:%" PRIu64, labels[i], histogram[i]);
+    }
+
+    if (result.empty()) {
+        result = "-";
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Log I/O statistics for a file
+ *
+ * This function can be passed to File::set_stats_callback() to dump the
+ * statistics of a File handle when it is closed. The statistics are logged at
+ * the debug level.
+ *
+ * \param file File handle (unused)
+ * \param stats Statistics to log
+ * \param userdata `const char *` label identifying the file (may be nullptr)
+ */
+void log_file_stats(File &file, const FileStats &stats, void *userdata)
+{
+    (void) file;
+
+    const char *label = userdata
+            ? static_cast<const char *>(userdata) : "<file>";
+
+    LOGD("%s: read %" PRIu64 " bytes in %" PRIu64 " calls (%.3f ms)",
+         label, stats.bytes_read, stats.read_calls,
+         static_cast<double>(stats.read_time_ns) / 1000000.0);
+    LOGD("%s: wrote %" PRIu64 " bytes in %" PRIu64 " calls (%.3f ms)",
+         label, stats.bytes_written, stats.write_calls,
+         static_cast<double>(stats.write_time_ns) / 1000000.0);
+    LOGD("%s: seeked %" PRIu64 " times (%.3f ms)",
+         label, stats.seek_calls,
+         static_cast<double>(stats.seek_time_ns) / 1000000.0);
+    LOGD("%s: read sizes: %s",
+         label, format_histogram(stats.read_size_histogram).c_str());
+    LOGD("%s: write sizes: %s",
+         label, format_histogram(stats.write_size_histogram).c_str());
+}
+
+}
+}
@@ -19,12 +19,15 @@
 
 #include "mblog/kmsg_logger.h"
 
+#include <algorithm>
+
 #include <cstdio>
 #include <cstring>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
@@ -44,8 +47,35 @@ namespace log
 #define KMSG_LEVEL_EMERG    "<0>"
 #define KMSG_LEVEL_DEFAULT  "<d>"
 
+// Lines with the same priority are written as a single record to reduce the
+// number of syscalls and to stay under the kernel's /dev/kmsg rate limit.
+// Errors and warnings are written out immediately. Otherwise, a partial record
+// is held back for at most this long (checked when the next message arrives).
+#define KMSG_BATCH_MAX_AGE_MS       50
+
+// Number of non-error lines allowed per second. Further lines are dropped
+// and counted so that chatty code doesn't push older messages out of the
+// kernel's ring buffer.
+#define KMSG_MAX_LINES_PER_SEC      200
+
+static uint64_t current_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 KmsgLogger::KmsgLogger(bool force_error_prio)
     : _force_error_prio(force_error_prio)
+    , _pid(getpid())
+    , _batch_len(0)
+    , _batch_kprio(nullptr)
+    , _batch_time(0)
+    , _last_prio(LogLevel::Verbose)
+    , _repeats(0)
+    , _window_start(0)
+    , _window_lines(0)
+    , _suppressed(0)
 {
     static int open_mode = O_WRONLY | O_NOCTTY | O_CLOEXEC;
     static const char *kmsg = "/dev/kmsg";
@@ -66,60 +96,189 @@ KmsgLogger::KmsgLogger(bool force_error_prio)
 
 KmsgLogger::~KmsgLogger()
 {
+    flush();
+
     if (_fd > 0) {
         close(_fd);
     }
 }
 
+const char * KmsgLogger::kmsg_prio(LogLevel prio)
+{
+    if (_force_error_prio) {
+        return KMSG_LEVEL_ERROR;
+    }
+
+    switch (prio) {
+    case LogLevel::Error:
+        return KMSG_LEVEL_ERROR;
+    case LogLevel::Warning:
+        return KMSG_LEVEL_WARNING;
+    case LogLevel::Info:
+        return KMSG_LEVEL_INFO;
+    case LogLevel::Debug:
+        return KMSG_LEVEL_DEBUG;
+    case LogLevel::Verbose:
+        return KMSG_LEVEL_DEFAULT;
+    }
+
+    return KMSG_LEVEL_DEFAULT;
+}
+
+void KmsgLogger::write_batch()
+{
+    if (_batch_len > 0) {
+        write(_fd, _batch, _batch_len);
+        _batch_len = 0;
+    }
+}
+
+/*!
+ * \brief Add a line (without the trailing newline) to the pending record
+ *
+ * The pending record is written first if the new line has a different kernel
+ * priority, doesn't fit, or if the record has been held back for too long.
+ */
+void KmsgLogger::append_line(LogLevel prio, const char *line, size_t len,
+                             uint64_t now)
+{
+    const char *kprio = kmsg_prio(prio);
+
+    if (_batch_len > 0 && (kprio != _batch_kprio
+            || _batch_len + len + 1 > sizeof(_batch)
+            || now - _batch_time >= KMSG_BATCH_MAX_AGE_MS)) {
+        write_batch();
+    }
+
+    if (_batch_len == 0) {
+        size_t kprio_len = strlen(kprio);
+        memcpy(_batch, kprio, kprio_len);
+        _batch_len = kprio_len;
+        _batch_kprio = kprio;
+        _batch_time = now;
+    }
+
+    // Lines are at most KMSG_BUF_SIZE bytes, so this only truncates if the
+    // record size is misconfigured
+    len = std::min(len, sizeof(_batch) - _batch_len - 1);
+    memcpy(_batch + _batch_len, line, len);
+    _batch_len += len;
+    _batch[_batch_len++] = '\n';
+}
+
+void KmsgLogger::append_note(LogLevel prio, const char *fmt,
+                             unsigned int count, uint64_t now)
+{
+    char line[128];
+    int n = snprintf(line, sizeof(line), fmt, get_log_tag(), count);
+    if (n > 0) {
+        append_line(prio, line, std::min(static_cast<size_t>(n),
+                                         sizeof(line) - 1), now);
+    }
+}
+
+/*!
+ * \brief Add notes about collapsed and suppressed messages
+ */
+void KmsgLogger::flush_pending(uint64_t now)
+{
+    if (_repeats > 0) {
+        append_note(_last_prio, "%s: [previous message repeated %u times]",
+                    _repeats, now);
+        _repeats = 0;
+    }
+    if (_suppressed > 0) {
+        append_note(LogLevel::Warning, "%s: [%u messages suppressed]",
+                    _suppressed, now);
+        _suppressed = 0;
+    }
+}
+
 void KmsgLogger::log(LogLevel prio, const char *fmt, va_list ap)
 {
     if (_fd < 0) {
         return;
     }
 
-    const char *kprio;
+    std::lock_guard<std::mutex> guard(_mutex);
 
-    if (_force_error_prio) {
-        kprio = KMSG_LEVEL_ERROR;
-    } else {
-        kprio = KMSG_LEVEL_DEFAULT;
-
-        switch (prio) {
-        case LogLevel::Error:
-            kprio = KMSG_LEVEL_ERROR;
-            break;
-        case LogLevel::Warning:
-            kprio = KMSG_LEVEL_WARNING;
-            break;
-        case LogLevel::Info:
-            kprio = KMSG_LEVEL_INFO;
-            break;
-        case LogLevel::Debug:
-            kprio = KMSG_LEVEL_DEBUG;
-            break;
-        case LogLevel::Verbose:
-            kprio = KMSG_LEVEL_DEFAULT;
-            break;
-        }
+    // Don't write out the parent's pending messages again after a fork
+    if (getpid() != _pid) {
+        _pid = getpid();
+        _batch_len = 0;
+        _repeats = 0;
+        _suppressed = 0;
+        _last_msg.clear();
     }
 
-    char new_fmt[64];
-    if (snprintf(new_fmt, sizeof(new_fmt), "%s%s: %s\n",
-                 kprio, get_log_tag(), fmt) >= (int) sizeof(new_fmt)) {
+    int prefix_len = snprintf(_buf, sizeof(_buf), "%s: ", get_log_tag());
+    if (prefix_len < 0 || prefix_len >= static_cast<int>(sizeof(_buf))) {
         // Doesn't fit
         return;
     }
 
-    std::size_t len = vsnprintf(_buf, KMSG_BUF_SIZE, new_fmt, ap);
+    std::size_t len = prefix_len + vsnprintf(
+            _buf + prefix_len, sizeof(_buf) - prefix_len, fmt, ap);
 
     // Make user aware of any truncation
     if (len >= KMSG_BUF_SIZE) {
-        static const char trunc[] = " [trunc...]\n";
+        static const char trunc[] = " [trunc...]";
         memcpy(_buf + sizeof(_buf) - sizeof(trunc), trunc, sizeof(trunc));
+        len = sizeof(_buf) - 1;
+    }
+
+    // Records are separated by newlines
+    while (len > 0 && _buf[len - 1] == '\n') {
+        --len;
+    }
+
+    uint64_t now = current_time_ms();
+    bool important = prio == LogLevel::Error || prio == LogLevel::Warning;
+
+    if (prio == _last_prio && _last_msg.size() == len
+            && memcmp(_last_msg.data(), _buf, len) == 0) {
+        // Collapse repeated messages
+        ++_repeats;
+    } else {
+        if (now - _window_start >= 1000) {
+            flush_pending(now);
+            _window_start = now;
+            _window_lines = 0;
+        } else if (_repeats > 0) {
+            flush_pending(now);
+        }
+
+        if (!important && _window_lines >= KMSG_MAX_LINES_PER_SEC) {
+            ++_suppressed;
+            return;
+        }
+
+        ++_window_lines;
+        _last_msg.assign(_buf, len);
+        _last_prio = prio;
+
+        append_line(prio, _buf, len, now);
+    }
+
+    if (important) {
+        write_batch();
+    }
+}
+
+void KmsgLogger::flush()
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(_mutex);
+
+    if (getpid() != _pid) {
+        return;
     }
 
-    write(_fd, _buf, strlen(_buf));
-    //vdprintf(_fd, new_fmt.c_str(), ap);
+    flush_pending(current_time_ms());
+    write_batch();
 }
 
 }
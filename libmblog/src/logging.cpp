@@ -19,7 +19,10 @@
 
 #include "mblog/logging.h"
 
+#include <atomic>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 
 #include <cerrno>
 
@@ -33,6 +36,26 @@ namespace log
 static std::string log_tag("mblog");
 static std::shared_ptr<BaseLogger> logger;
 
+// Protects log_tag, global_level, and tag_levels
+static std::mutex level_lock;
+static LogLevel global_level = LogLevel::Verbose;
+static std::unordered_map<std::string, LogLevel> tag_levels;
+// Level for the current tag. This is the only thing accessed when logging.
+static std::atomic<int> effective_level(static_cast<int>(LogLevel::Verbose));
+
+// Must be called with level_lock held
+static void update_effective_level()
+{
+    LogLevel level = global_level;
+
+    auto it = tag_levels.find(log_tag);
+    if (it != tag_levels.end()) {
+        level = it->second;
+    }
+
+    effective_level.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
 const char * get_log_tag()
 {
     return log_tag.c_str();
@@ -40,7 +63,9 @@ const char * get_log_tag()
 
 void set_log_tag(const char *tag)
 {
+    std::lock_guard<std::mutex> guard(level_lock);
     log_tag = tag;
+    update_effective_level();
 }
 
 void log_set_logger(std::shared_ptr<BaseLogger> logger_local)
@@ -60,6 +85,10 @@ void log(LogLevel prio, const char *fmt, ...)
 
 void logv(LogLevel prio, const char *fmt, va_list ap)
 {
+    if (!log_is_enabled(prio)) {
+        return;
+    }
+
     int saved_errno = errno;
 
     if (!logger) {
@@ -71,5 +100,70 @@ void logv(LogLevel prio, const char *fmt, va_list ap)
     errno = saved_errno;
 }
 
+/*!
+ * \brief Wait until all messages have been written by the current logger
+ *
+ * This should be called before exiting or rebooting if the logger is an
+ * AsyncLogger.
+ */
+void log_flush()
+{
+    int saved_errno = errno;
+
+    if (logger) {
+        logger->flush();
+    }
+
+    errno = saved_errno;
+}
+
+/*!
+ * \brief Set the least severe level that will be logged
+ *
+ * This applies to all tags that don't have a level set with
+ * log_set_tag_level(). Levels excluded at build time with `MBLOG_MIN_LEVEL`
+ * cannot be re-enabled.
+ */
+void log_set_level(LogLevel level)
+{
+    std::lock_guard<std::mutex> guard(level_lock);
+    global_level = level;
+    update_effective_level();
+}
+
+/*!
+ * \brief Set the least severe level that will be logged while \p tag is the
+ *        current log tag
+ */
+void log_set_tag_level(const char *tag, LogLevel level)
+{
+    std::lock_guard<std::mutex> guard(level_lock);
+    tag_levels[tag] = level;
+    update_effective_level();
+}
+
+/*!
+ * \brief Make \p tag use the level set with log_set_level() again
+ */
+void log_clear_tag_level(const char *tag)
+{
+    std::lock_guard<std::mutex> guard(level_lock);
+    tag_levels.erase(tag);
+    update_effective_level();
+}
+
+/*!
+ * \brief Check if messages with priority \p prio will be logged
+ *
+ * This is used by the LOG* macros to avoid evaluating the arguments of
+ * disabled log statements.
+ */
+bool log_is_enabled(LogLevel prio)
+{
+    return static_cast<int>(prio) <= MBLOG_MIN_LEVEL
+            && static_cast<int>(prio)
+                    <= effective_level.load(std::memory_order_relaxed);
+}
+
 }
 }
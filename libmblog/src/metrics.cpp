@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/metrics.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+
+#include "mbcommon/alloc_profiler.h"
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \brief Log the current value of every metric in a registry
+ *
+ * Each metric is logged on its own line at the debug level. Histograms are
+ * summarized by their count, mean, percentiles, and maximum.
+ *
+ * \param registry Registry to dump
+ */
+void log_metrics(const MetricsRegistry &registry)
+{
+    for (auto const &m : registry.snapshot()) {
+        switch (m.type) {
+        case MetricType::Counter:
+            LOGD("[metrics] %s: %" PRId64, m.name.c_str(), m.value);
+            break;
+        case MetricType::Gauge:
+            LOGD("[metrics] %s: %" PRId64 " (gauge)", m.name.c_str(), m.value);
+            break;
+        case MetricType::Histogram: {
+            auto const &h = m.histogram;
+            LOGD("[metrics] %s: count=%" PRIu64 " mean=%.1f p50=%" PRIu64
+                 " p90=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64,
+                 m.name.c_str(), h.count, h.mean(), h.percentile(50),
+                 h.percentile(90), h.percentile(99), h.max);
+            break;
+        }
+        }
+    }
+}
+
+#ifndef _WIN32
+/*!
+ * \brief Log the allocation counters of every tag
+ *
+ * Tags are logged at the info level, heaviest first by allocated bytes. The
+ * counters only change when mbtool is built with MBP_ENABLE_ALLOC_PROFILING.
+ */
+void log_alloc_profile()
+{
+    auto stats = alloc_profiler_snapshot();
+
+    std::sort(stats.begin(), stats.end(),
+              [](const AllocTagStats &a, const AllocTagStats &b) {
+        return a.alloc_bytes > b.alloc_bytes;
+    });
+
+    for (auto const &s : stats) {
+        LOGI("[alloc] %s: allocs=%" PRIu64 " bytes=%" PRIu64
+             " frees=%" PRIu64 " freed_bytes=%" PRIu64,
+             s.tag, s.allocs, s.alloc_bytes, s.frees, s.free_bytes);
+    }
+}
+#endif
+
+}
+}
@@ -32,8 +32,10 @@ namespace log
 #define STDLOG_LEVEL_DEBUG   "[D]"
 #define STDLOG_LEVEL_VERBOSE "[V]"
 
-StdioLogger::StdioLogger(std::FILE *stream, bool show_timestamps)
-    : _stream(stream), _show_timestamps(show_timestamps)
+StdioLogger::StdioLogger(std::FILE *stream, bool show_timestamps,
+                         bool auto_flush)
+    : _stream(stream), _show_timestamps(show_timestamps),
+    _auto_flush(auto_flush)
 {
 }
 
@@ -79,7 +81,16 @@ void StdioLogger::log(LogLevel prio, const char *fmt, va_list ap)
     fprintf(_stream, "%s ", stdprio);
     vfprintf(_stream, fmt, ap);
     fprintf(_stream, "\n");
-    fflush(_stream);
+    if (_auto_flush) {
+        fflush(_stream);
+    }
+}
+
+void StdioLogger::flush()
+{
+    if (_stream) {
+        fflush(_stream);
+    }
 }
 
 }
@@ -21,6 +21,7 @@
 
 #include <memory>
 
+#include "mbpatcher/edify/rewriter.h"
 #include "mbpatcher/patcherconfig.h"
 #include "mbpatcher/patcherinterface.h"
 
@@ -54,6 +55,10 @@ public:
     virtual std::vector<std::string> existing_files() const override;
 
     virtual bool patch_files(const std::string &directory) override;
+    virtual bool patch_contents(const std::string &file,
+                                std::string &contents) override;
+
+    EdifyRewriter & edify_rewriter();
 
     bool patch_updater(const std::string &directory);
     bool patch_transfer_list(const std::string &directory);
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mbcommon/common.h"
@@ -42,8 +43,24 @@ MB_EXPORT bool mbpatcher_patcher_patch_file(CPatcher *patcher,
                                       FilesUpdatedCallback filesCb,
                                       DetailsUpdatedCallback detailsCb,
                                       void *userData);
+MB_EXPORT bool mbpatcher_patcher_patch_file_multi(CPatcher *patcher,
+                                                  const CFileInfo * const *infos,
+                                                  size_t count,
+                                                  ProgressUpdatedCallback progressCb,
+                                                  FilesUpdatedCallback filesCb,
+                                                  DetailsUpdatedCallback detailsCb,
+                                                  void *userData);
+MB_EXPORT bool mbpatcher_patcher_patch_file_polled(CPatcher *patcher,
+                                                   CPatcherProgress *progress,
+                                                   DetailsUpdatedCallback detailsCb,
+                                                   void *userData);
 MB_EXPORT void mbpatcher_patcher_cancel_patching(CPatcher *patcher);
 
+MB_EXPORT CPatcherProgress * mbpatcher_progress_create(void);
+MB_EXPORT void mbpatcher_progress_destroy(CPatcherProgress *progress);
+MB_EXPORT void mbpatcher_progress_get(const CPatcherProgress *progress,
+                                      uint64_t *values);
+
 
 MB_EXPORT /* enum ErrorCode */ int mbpatcher_autopatcher_error(const CAutoPatcher *patcher);
 MB_EXPORT char * mbpatcher_autopatcher_id(const CAutoPatcher *patcher);
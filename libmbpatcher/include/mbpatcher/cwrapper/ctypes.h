@@ -34,6 +34,9 @@ typedef struct CPatcher CPatcher;
 struct CAutoPatcher;
 typedef struct CAutoPatcher CAutoPatcher;
 
+struct CPatcherProgress;
+typedef struct CPatcherProgress CPatcherProgress;
+
 #ifdef __cplusplus
 }
 #endif
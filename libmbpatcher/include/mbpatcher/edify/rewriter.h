@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mbpatcher/edify/tokenizer.h"
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Location of an edify function call in an EdifyTokenStream
+ */
+struct EdifyFunctionCall
+{
+    // Index of the function name token
+    std::size_t func_name;
+    // Index of the left parenthesis token
+    std::size_t left_paren;
+    // Index of the matching right parenthesis token
+    std::size_t right_paren;
+};
+
+/*!
+ * \brief Edify rewrite rule
+ *
+ * \param tokens Token stream containing the function call
+ * \param call Location of the function call
+ * \param[out] replacement Replacement edify code for the whole call
+ * \param userdata User-supplied pointer passed to EdifyRewriter::add_rule()
+ *
+ * \return Whether the function call should be replaced with \a replacement.
+ *         If false, the next rule for the same function is tried.
+ */
+typedef bool (*EdifyRewriteRule)(const EdifyTokenStream &tokens,
+                                 const EdifyFunctionCall &call,
+                                 std::string *replacement, void *userdata);
+
+/*!
+ * \brief Apply edify rewrite rules in a single pass
+ *
+ * Rules are registered by function name up front and looked up through a hash
+ * table for each function call encountered while walking the token stream
+ * once. Once a call is replaced, the tokens inside it are not visited again.
+ */
+class EdifyRewriter
+{
+public:
+    void add_rule(const std::string &function, EdifyRewriteRule rule,
+                  void *userdata);
+
+    bool rewrite(EdifyTokenStream *tokens) const;
+
+private:
+    struct Rule
+    {
+        EdifyRewriteRule fn;
+        void *userdata;
+    };
+
+    std::unordered_map<std::string, std::vector<Rule>> m_rules;
+};
+
+}
+}
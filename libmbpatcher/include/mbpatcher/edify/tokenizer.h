@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -291,5 +292,64 @@ private:
     MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(EdifyTokenizer)
 };
 
+////////////////////////////////////////////////////////////////////////////////
+
+/*!
+ * \brief Compact edify token
+ *
+ * The token does not own its text. \a data points to a slice of the buffer
+ * owned by the EdifyTokenStream that produced it and is exactly the text that
+ * will be generated for the token (ie. comments include the leading '#' and
+ * quoted strings include the quotes).
+ */
+struct EdifyTokenSlice
+{
+    EdifyTokenType type;
+    const char *data;
+    std::size_t size;
+};
+
+/*!
+ * \brief Flat edify token stream
+ *
+ * Unlike EdifyTokenizer, which allocates an object per token, the stream
+ * stores tokens in a contiguous array and the text of every token lives in a
+ * small number of arena blocks owned by the stream. Slices remain valid until
+ * the stream is destroyed, even after tokens are replaced.
+ */
+class EdifyTokenStream
+{
+public:
+    EdifyTokenStream();
+    ~EdifyTokenStream();
+
+    bool tokenize(const char *data, std::size_t size);
+
+    std::vector<EdifyTokenSlice> & tokens();
+    const std::vector<EdifyTokenSlice> & tokens() const;
+
+    bool replace(std::size_t begin, std::size_t end,
+                 const std::string &replacement, std::size_t *new_end);
+
+    std::string generate() const;
+
+    void dump() const;
+
+    static std::string string(const EdifyTokenSlice &token);
+    static std::string unescaped_string(const EdifyTokenSlice &token);
+
+private:
+    bool tokenize_into(const char *data, std::size_t size,
+                       std::vector<EdifyTokenSlice> *tokens);
+    const char * arena_copy(const char *data, std::size_t size);
+
+    std::vector<EdifyTokenSlice> m_tokens;
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    std::size_t m_block_size;
+    std::size_t m_block_used;
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(EdifyTokenStream)
+};
+
 }
 }
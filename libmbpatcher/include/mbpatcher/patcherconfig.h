@@ -20,6 +20,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "mbcommon/common.h"
@@ -42,6 +43,22 @@ class MB_EXPORT PatcherConfig
     MB_DECLARE_PRIVATE(PatcherConfig)
 
 public:
+    // Returns instances to the config that created them
+    struct MB_EXPORT PatcherDeleter
+    {
+        PatcherConfig *pc;
+        void operator()(Patcher *patcher) const;
+    };
+
+    struct MB_EXPORT AutoPatcherDeleter
+    {
+        PatcherConfig *pc;
+        void operator()(AutoPatcher *patcher) const;
+    };
+
+    using PatcherHandle = std::unique_ptr<Patcher, PatcherDeleter>;
+    using AutoPatcherHandle = std::unique_ptr<AutoPatcher, AutoPatcherDeleter>;
+
     PatcherConfig();
     ~PatcherConfig();
 
@@ -49,9 +66,14 @@ public:
 
     std::string data_directory() const;
     std::string temp_directory() const;
+    std::string cache_directory() const;
+
+    bool set_data_directory(std::string path);
+    bool set_temp_directory(std::string path);
+    bool set_cache_directory(std::string path);
 
-    void set_data_directory(std::string path);
-    void set_temp_directory(std::string path);
+    void freeze();
+    bool is_frozen() const;
 
     std::vector<std::string> patchers() const;
     std::vector<std::string> auto_patchers() const;
@@ -63,6 +85,10 @@ public:
     void destroy_patcher(Patcher *patcher);
     void destroy_auto_patcher(AutoPatcher *patcher);
 
+    PatcherHandle make_patcher(const std::string &id);
+    AutoPatcherHandle make_auto_patcher(const std::string &id,
+                                        const FileInfo * const info);
+
     MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(PatcherConfig)
     MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(PatcherConfig)
 
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "mbcommon/common.h"
 
 #include "mbpatcher/errors.h"
@@ -82,6 +84,38 @@ public:
                             DetailsUpdatedCallback details_cb,
                             void *userdata) = 0;
 
+    /*!
+     * \brief Patch one input file into several output files
+     *
+     * Every FileInfo must have the same input path. The default implementation
+     * patches the files one at a time with patch_file(). Patchers that can
+     * share work between the outputs override this.
+     *
+     * \note This replaces the FileInfo set with set_file_info().
+     *
+     * \param infos FileInfo objects for each output file
+     * \param progress_cb Callback for receiving current progress values
+     * \param files_cb Callback for receiving current files count
+     * \param details_cb Callback for receiving detailed progress text
+     * \param userdata Pointer to pass to callback functions
+     */
+    virtual bool patch_file_multi(const std::vector<const FileInfo *> &infos,
+                                  ProgressUpdatedCallback progress_cb,
+                                  FilesUpdatedCallback files_cb,
+                                  DetailsUpdatedCallback details_cb,
+                                  void *userdata)
+    {
+        for (auto const *info : infos) {
+            set_file_info(info);
+
+            if (!patch_file(progress_cb, files_cb, details_cb, userdata)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
     /*!
      * \brief Cancel the patching of a file
      *
@@ -140,6 +174,18 @@ public:
      * \param directory Directory containing the files to be patched
      */
     virtual bool patch_files(const std::string &directory) = 0;
+
+    /*!
+     * \brief Patch the contents of a file in memory
+     *
+     * This allows files to be patched while they are being copied from one
+     * zip archive to another, without extracting them first.
+     *
+     * \param file Path of the file in the zip (one of existing_files())
+     * \param contents Contents of the file, which are replaced in place
+     */
+    virtual bool patch_contents(const std::string &file,
+                                std::string &contents) = 0;
 };
 
 }
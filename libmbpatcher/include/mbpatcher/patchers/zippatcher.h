@@ -54,6 +54,12 @@ public:
                             DetailsUpdatedCallback details_cb,
                             void *userdata) override;
 
+    virtual bool patch_file_multi(const std::vector<const FileInfo *> &infos,
+                                  ProgressUpdatedCallback progress_cb,
+                                  FilesUpdatedCallback files_cb,
+                                  DetailsUpdatedCallback details_cb,
+                                  void *userdata) override;
+
     virtual void cancel_patching() override;
 
     static std::string create_info_prop(const PatcherConfig * const pc,
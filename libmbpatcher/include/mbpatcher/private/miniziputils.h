@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "minizip/unzip.h"
@@ -41,6 +42,20 @@ public:
         uint64_t total_size;
     };
 
+    struct IndexEntry {
+        std::string name;
+        unz64_file_pos pos;
+        unz_file_info64 info;
+    };
+
+    // In-memory copy of the central directory
+    struct ArchiveIndex {
+        // Entries in central directory order
+        std::vector<IndexEntry> entries;
+        // Maps entry names to indexes in `entries`
+        std::unordered_map<std::string, size_t> names;
+    };
+
     static std::string unz_error_string(int ret);
 
     static std::string zip_error_string(int ret);
@@ -64,6 +79,17 @@ public:
                                    ArchiveStats *stats,
                                    std::vector<std::string> ignore);
 
+    static bool build_index(unzFile uf, ArchiveIndex *index);
+
+    static void index_stats(const ArchiveIndex &index,
+                            ArchiveStats *stats,
+                            const std::vector<std::string> &ignore);
+
+    static const IndexEntry * find_entry(const ArchiveIndex &index,
+                                         const std::string &name);
+
+    static bool go_to_entry(unzFile uf, const IndexEntry &entry);
+
     static bool get_info(unzFile uf,
                          unz_file_info64 *fi,
                          std::string *filename);
@@ -74,6 +100,12 @@ public:
                               void (*cb)(uint64_t bytes, void *),
                               void *userData);
 
+    static bool copy_file_raw(unzFile uf,
+                              const std::vector<zipFile> &zfs,
+                              const std::string &name,
+                              void (*cb)(uint64_t bytes, void *),
+                              void *userData);
+
     static bool read_to_memory(unzFile uf,
                                std::vector<unsigned char> *output,
                                void (*cb)(uint64_t bytes, void *),
@@ -82,6 +114,9 @@ public:
     static bool extract_file(unzFile uf,
                              const std::string &directory);
 
+    static bool get_file_time(const std::string &filename,
+                              uint32_t *dostime);
+
     static ErrorCode add_file(zipFile zf,
                               const std::string &name,
                               const std::vector<unsigned char> &contents);
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "minizip/zip.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Deflate a single large zip entry on a pool of worker threads
+ *
+ * The data is split into fixed-size blocks that are compressed independently
+ * (using the tail of the previous block as the dictionary) and joined with
+ * sync flushes, so the result is one ordinary deflate stream. Compressed
+ * blocks are written to the zip file by a dedicated writer thread. Nothing
+ * else may write to the zip file between open() and close().
+ */
+class ParallelDeflateWriter
+{
+public:
+    explicit ParallelDeflateWriter(zipFile zf);
+    ~ParallelDeflateWriter();
+
+    ParallelDeflateWriter(const ParallelDeflateWriter &) = delete;
+    ParallelDeflateWriter & operator=(const ParallelDeflateWriter &) = delete;
+
+    ErrorCode open(const std::string &name, int level, bool zip64);
+    ErrorCode write(const void *data, size_t size);
+    ErrorCode close();
+
+private:
+    struct Block
+    {
+        std::vector<unsigned char> in;
+        std::vector<unsigned char> dict;
+        bool last;
+
+        // Set by the worker thread
+        bool done;
+        bool ok;
+        std::vector<unsigned char> out;
+        uint32_t crc;
+    };
+
+    ErrorCode submit(bool last);
+    void worker();
+    void writer();
+
+    static bool compress(Block &block, int level);
+
+    zipFile _zf;
+    size_t _max_pending;
+    bool _open;
+    int _level;
+    std::unique_ptr<Block> _current;
+    std::vector<unsigned char> _dict;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Blocks in the order they will be written
+    std::deque<std::unique_ptr<Block>> _pending;
+    // Blocks that have not been picked up by a worker
+    std::deque<Block *> _queue;
+    bool _stop;
+    bool _write_failed;
+    // Updated by the writer thread
+    uint32_t _crc;
+    uint64_t _uncompressed_size;
+
+    std::vector<std::thread> _workers;
+    std::thread _writer;
+};
+
+}
+}
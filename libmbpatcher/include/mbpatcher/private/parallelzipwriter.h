@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "minizip/zip.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Compress new zip entries on a pool of worker threads
+ *
+ * Entries are deflated in parallel, but are written to the zip file on the
+ * calling thread in the order they were added. Entries that are still being
+ * compressed must be written with flush() before anything else is written to
+ * the zip file.
+ */
+class ParallelZipWriter
+{
+public:
+    explicit ParallelZipWriter(zipFile zf);
+    ~ParallelZipWriter();
+
+    ParallelZipWriter(const ParallelZipWriter &) = delete;
+    ParallelZipWriter & operator=(const ParallelZipWriter &) = delete;
+
+    ErrorCode add_file(const std::string &name,
+                       std::vector<unsigned char> contents, int level);
+    ErrorCode add_file(const std::string &name, const std::string &path,
+                       int level);
+
+    ErrorCode flush();
+
+    static int compression_level(const std::string &name);
+
+private:
+    struct Entry
+    {
+        std::string name;
+        uint32_t dos_date;
+        int level;
+        std::vector<unsigned char> data;
+
+        // Set by the worker thread
+        bool done;
+        bool ok;
+        int method;
+        uint32_t crc;
+        uint64_t uncompressed_size;
+    };
+
+    ErrorCode add_entry(std::unique_ptr<Entry> entry);
+    ErrorCode write_next();
+    void worker();
+
+    static bool compress(Entry &entry);
+
+    zipFile _zf;
+    size_t _max_pending;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Entries in the order they will be written
+    std::deque<std::unique_ptr<Entry>> _pending;
+    // Entries that have not been picked up by a worker
+    std::deque<Entry *> _queue;
+    bool _stop;
+
+    std::vector<std::thread> _workers;
+};
+
+}
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "mbpatcher/patcherinterface.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Rate-limited delivery of progress and file count callbacks
+ *
+ * Updates only store the new values in atomic variables. The callbacks are
+ * invoked from whichever thread made the update, but no more than
+ * PROGRESS_INTERVAL_MS apart, and never concurrently. flush() must be called
+ * when patching is done so that the final values are reported.
+ */
+class ProgressReporter
+{
+public:
+    // ~30 Hz is plenty for a progress bar
+    static constexpr int64_t PROGRESS_INTERVAL_MS = 33;
+
+    ProgressReporter();
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter & operator=(const ProgressReporter &) = delete;
+
+    void reset(Patcher::ProgressUpdatedCallback progress_cb,
+               Patcher::FilesUpdatedCallback files_cb,
+               void *userdata);
+
+    void set_bytes(uint64_t bytes, uint64_t max_bytes);
+    void set_files(uint64_t files, uint64_t max_files);
+
+    void flush();
+
+private:
+    void try_deliver(bool force);
+
+    Patcher::ProgressUpdatedCallback _progress_cb;
+    Patcher::FilesUpdatedCallback _files_cb;
+    void *_userdata;
+
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _max_bytes;
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _max_files;
+    std::atomic<bool> _bytes_dirty;
+    std::atomic<bool> _files_dirty;
+
+    // steady_clock time of the last delivery in milliseconds
+    std::atomic<int64_t> _last_ms;
+    std::atomic<bool> _delivering;
+};
+
+}
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2014-2016  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Set of block ranges from a block-based OTA transfer list
+ *
+ * The ranges are kept sorted and merged, so two equal sets always have the
+ * same string representation.
+ */
+class RangeSet
+{
+public:
+    // Half-open range of blocks: [first, second)
+    typedef std::pair<uint64_t, uint64_t> Range;
+
+    static bool parse(const char *str, size_t size, RangeSet &out);
+    std::string to_string() const;
+
+    void add(uint64_t begin, uint64_t end);
+    void add(const RangeSet &other);
+    RangeSet subtract(const RangeSet &other) const;
+
+    bool empty() const;
+    uint64_t blocks() const;
+    const std::vector<Range> & ranges() const;
+
+private:
+    std::vector<Range> _ranges;
+};
+
+struct TransferListOptions
+{
+    // Remove "erase" commands. The system partition of a secondary ROM is an
+    // image or directory that is never discarded, so erasing is useless.
+    bool remove_erase = true;
+    // Remove blocks from "zero" commands if they are overwritten later. This
+    // needs a scan() pass to build the block map first and is only done for
+    // transfer lists that never read from the target (ie. full OTAs).
+    bool trim_zero = true;
+};
+
+/*!
+ * \brief Streaming rewriter for `system.transfer.list`
+ *
+ * The transfer list is fed in arbitrarily sized pieces, so it never has to be
+ * held in memory as a whole. If TransferListOptions::trim_zero is set, the
+ * list must be passed through scan() and finish_scan() before it is passed
+ * through rewrite() and finish_rewrite(). Otherwise, the scan pass is
+ * optional.
+ */
+class TransferListRewriter
+{
+public:
+    explicit TransferListRewriter(const TransferListOptions &options);
+
+    void scan(const char *data, size_t size);
+    void finish_scan();
+
+    void rewrite(const char *data, size_t size, std::string &out);
+    void finish_rewrite(std::string &out);
+
+    uint64_t removed_blocks() const;
+
+private:
+    enum class Pass
+    {
+        Scan,
+        Rewrite,
+    };
+
+    struct ZeroCommand
+    {
+        RangeSet blocks;
+        // Blocks that still need to be zeroed after trimming
+        RangeSet trimmed;
+    };
+
+    TransferListOptions _options;
+
+    // Line that has not been terminated yet
+    std::string _partial;
+    // Number of lines seen in the current pass
+    size_t _line;
+    // Version from the first line or 0 if it is not supported
+    int _version;
+
+    // Zero commands, in order, from the scan pass
+    std::vector<ZeroCommand> _zeros;
+    // Index of the next zero command in the rewrite pass
+    size_t _zero_index;
+    // Writes of each command, in order, from the scan pass. Only used while
+    // scanning.
+    std::vector<std::pair<bool, RangeSet>> _writes;
+    bool _can_trim;
+    bool _scanned;
+    uint64_t _removed_blocks;
+
+    void feed(Pass pass, const char *data, size_t size, std::string *out);
+    void handle_line(Pass pass, const char *line, size_t size,
+                     bool terminated, std::string *out);
+    void scan_line(const char *line, size_t size);
+    void rewrite_line(const char *line, size_t size, bool terminated,
+                      std::string &out);
+    size_t header_lines() const;
+};
+
+}
+}
@@ -19,14 +19,19 @@
 
 #include "mbpatcher/autopatchers/standardpatcher.h"
 
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 
+#include "mbcommon/file_util.h"
+#include "mbcommon/libc/string.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 
-#include "mbpatcher/edify/tokenizer.h"
+#include "mbpatcher/edify/rewriter.h"
 #include "mbpatcher/private/fileutils.h"
-#include "mbpatcher/private/stringutils.h"
+#include "mbpatcher/private/transferlist.h"
 
 #define DUMP_DEBUG 0
 
@@ -37,11 +42,22 @@ namespace patcher
 {
 
 /*! \cond INTERNAL */
+struct BlockDevs
+{
+    std::vector<std::string> system;
+    std::vector<std::string> cache;
+    std::vector<std::string> data;
+};
+
 class StandardPatcherPrivate
 {
 public:
     const PatcherConfig *pc;
     const FileInfo *info;
+
+    // Block devices of the target device. Updated before each rewrite.
+    BlockDevs devs;
+    EdifyRewriter rewriter;
 };
 /*! \endcond */
 
@@ -55,6 +71,9 @@ const std::string StandardPatcher::UpdaterScript
 const std::string StandardPatcher::SystemTransferList
         = "system.transfer.list";
 
+// Size of the pieces that the transfer list is streamed in
+static constexpr size_t TRANSFER_LIST_BUF_SIZE = 64 * 1024;
+
 static constexpr char MOUNT_FMT[] =
         "(run_program(\"/update-binary-tool\", \"mount\", \"%s\") == 0)";
 static constexpr char UNMOUNT_FMT[] =
@@ -62,6 +81,7 @@ static constexpr char UNMOUNT_FMT[] =
 static constexpr char FORMAT_FMT[] =
         "(run_program(\"/update-binary-tool\", \"format\", \"%s\") == 0)";
 
+static void add_standard_rules(EdifyRewriter *rewriter, BlockDevs *devs);
 
 StandardPatcher::StandardPatcher(const PatcherConfig * const pc,
                                  const FileInfo * const info)
@@ -70,6 +90,8 @@ StandardPatcher::StandardPatcher(const PatcherConfig * const pc,
     MB_PRIVATE(StandardPatcher);
     priv->pc = pc;
     priv->info = info;
+
+    add_standard_rules(&priv->rewriter, &priv->devs);
 }
 
 StandardPatcher::~StandardPatcher()
@@ -96,274 +118,179 @@ std::vector<std::string> StandardPatcher::existing_files() const
     return { UpdaterScript, SystemTransferList };
 }
 
-static bool find_items_in_string(const std::string &haystack,
-                                 const std::vector<std::string> &needles)
+static bool contains_n(const char *haystack, std::size_t len_haystack,
+                       const char *needle, std::size_t len_needle)
 {
-    for (auto const &needle : needles) {
-        if (haystack.find(needle) != std::string::npos) {
-            return true;
-        }
-    }
-
-    return false;
+    return mb_memmem(haystack, len_haystack, needle, len_needle) != nullptr;
 }
 
-static bool find_function(const std::vector<EdifyToken *>::iterator begin,
-                          const std::vector<EdifyToken *>::iterator end,
-                          std::vector<EdifyToken *>::iterator *out_func_name,
-                          std::vector<EdifyToken *>::iterator *out_left_paren,
-                          std::vector<EdifyToken *>::iterator *out_right_paren)
+static bool contains_n(const char *haystack, std::size_t len_haystack,
+                       const char *needle)
 {
-    std::vector<EdifyToken *>::iterator func_name;
-    std::vector<EdifyToken *>::iterator left_paren;
-    std::vector<EdifyToken *>::iterator right_paren;
-
-    for (auto it = begin; it != end; ++it) {
-        // Find string representing the function name
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        func_name = it;
-
-        bool found_left_paren = false;
-        bool found_right_paren = false;
-
-        // Barring any whitespace, newlines, or comments, the function name
-        // should be followed by a left parenthesis
-        for (auto it2 = it + 1; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::Whitespace
-                    || (*it2)->type() == EdifyTokenType::Newline
-                    || (*it2)->type() == EdifyTokenType::Comment) {
-                continue;
-            } else if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                found_left_paren = true;
-                left_paren = it2;
-            }
-            break;
-        }
-
-        // If a left parenthesis was not found, then the string token was not
-        // a function name
-        if (!found_left_paren) {
-            continue;
-        }
-
-        // Left for matching right parenthesis
-        std::size_t depth = 0;
-
-        for (auto it2 = left_paren; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                ++depth;
-            } else if ((*it2)->type() == EdifyTokenType::RightParen) {
-                --depth;
-            }
-            if (depth == 0) {
-                found_right_paren = true;
-                right_paren = it2;
-                break;
-            }
-        }
+    return contains_n(haystack, len_haystack, needle, strlen(needle));
+}
 
-        // If a right parenthesis was not found, but the function name and left
-        // parenthesis were found, then assume there's a syntax error and bail
-        // out
-        if (!found_right_paren) {
-            return false;
+static bool find_items_in_string(const char *haystack,
+                                 std::size_t len_haystack,
+                                 const std::vector<std::string> &needles)
+{
+    for (auto const &needle : needles) {
+        if (contains_n(haystack, len_haystack, needle.data(), needle.size())) {
+            return true;
         }
-
-        *out_func_name = func_name;
-        *out_left_paren = left_paren;
-        *out_right_paren = right_paren;
-
-        return true;
     }
 
     return false;
 }
 
 /*!
- * \brief Replace edify function
+ * \brief Get the unescaped value of a string token without copying if possible
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token of the replaced function
- * \param left_paren Left parenthesis token of the replaced function
- * \param right_paren Right parenthesis token of the replaced function
- * \param replacement Replacement edify function (in string form)
- *
- * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
+ * Tokens without escape sequences are returned in place (excluding the
+ * quotes). Only the others are unescaped into \p buf.
  */
-static std::vector<EdifyToken *>::iterator
-replace_function(std::vector<EdifyToken *> *tokens,
-                 std::vector<EdifyToken *>::iterator func_name,
-                 std::vector<EdifyToken *>::iterator left_paren,
-                 std::vector<EdifyToken *>::iterator right_paren,
-                 const std::string &replacement)
+static void token_value(const EdifyTokenSlice &token, std::string &buf,
+                        const char *&data, std::size_t &size)
 {
-    // Included for completeness' sake
-    (void) left_paren;
-
-    std::vector<EdifyToken *> replacement_tokens;
-    bool result = EdifyTokenizer::tokenize(
-            replacement.data(), replacement.size(), &replacement_tokens);
-    if (!result) {
-        LOGE("Failed to tokenize replacement function string: %s",
-             replacement.c_str());
-        return tokens->end();
-    }
-
-    // Deallocate replaced tokens
-    for (auto it = func_name; it != right_paren; ++it) {
-        delete *it;
+    if (std::memchr(token.data, '\\', token.size)) {
+        buf = EdifyTokenStream::unescaped_string(token);
+        data = buf.data();
+        size = buf.size();
+    } else if (token.size >= 2 && token.data[0] == '"') {
+        data = token.data + 1;
+        size = token.size - 2;
+    } else {
+        data = token.data;
+        size = token.size;
     }
-    delete *right_paren;
-
-    // Remove replaced tokens
-    auto it = tokens->erase(func_name, right_paren);
-    it = tokens->erase(it);
-
-    // Add replacement tokens
-    it = tokens->insert(it, replacement_tokens.begin(),
-                        replacement_tokens.end());
-
-    // Move iterator to the end of the replaced tokens
-    it += replacement_tokens.size();
-
-    return it;
 }
 
 /*!
  * \brief Replace edify mount() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tokens Edify token stream
+ * \param call Location of the function call
+ * \param[out] replacement Replacement function
+ * \param userdata BlockDevs for the device
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_mount(std::vector<EdifyToken *> *tokens,
-                    const std::vector<EdifyToken *>::iterator func_name,
-                    const std::vector<EdifyToken *>::iterator left_paren,
-                    const std::vector<EdifyToken *>::iterator right_paren,
-                    const std::vector<std::string> &system_devs,
-                    const std::vector<std::string> &cache_devs,
-                    const std::vector<std::string> &data_devs)
+static bool
+rule_mount(const EdifyTokenStream &tokens,
+           const EdifyFunctionCall &call,
+           std::string *replacement, void *userdata)
 {
+    const BlockDevs *devs = static_cast<const BlockDevs *>(userdata);
+    const std::vector<std::string> &system_devs = devs->system;
+    const std::vector<std::string> &cache_devs = devs->cache;
+    const std::vector<std::string> &data_devs = devs->data;
+
     // For the mount() edify function, replace with the corresponding
     // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t it = call.left_paren + 1; it != call.right_paren; ++it) {
+        const EdifyTokenSlice &token = tokens.tokens()[it];
+        if (token.type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const char *str = token.data;
+        std::size_t len = token.size;
 
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
+        bool is_system = contains_n(str, len, "/system")
+                || find_items_in_string(str, len, system_devs);
+        bool is_cache = contains_n(str, len, "/cache")
+                || find_items_in_string(str, len, cache_devs);
+        bool is_data = contains_n(str, len, "/data")
+                || contains_n(str, len, "/userdata")
+                || find_items_in_string(str, len, data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/system"));
+            *replacement = format(MOUNT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/cache"));
+            *replacement = format(MOUNT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/data"));
+            *replacement = format(MOUNT_FMT, "/data");
+            return true;
         }
     }
-    return right_paren + 1;
+    return false;
 }
 
 /*!
  * \brief Replace edify unmount() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tokens Edify token stream
+ * \param call Location of the function call
+ * \param[out] replacement Replacement function
+ * \param userdata BlockDevs for the device
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_unmount(std::vector<EdifyToken *> *tokens,
-                      const std::vector<EdifyToken *>::iterator func_name,
-                      const std::vector<EdifyToken *>::iterator left_paren,
-                      const std::vector<EdifyToken *>::iterator right_paren,
-                      const std::vector<std::string> &system_devs,
-                      const std::vector<std::string> &cache_devs,
-                      const std::vector<std::string> &data_devs)
+static bool
+rule_unmount(const EdifyTokenStream &tokens,
+             const EdifyFunctionCall &call,
+             std::string *replacement, void *userdata)
 {
+    const BlockDevs *devs = static_cast<const BlockDevs *>(userdata);
+    const std::vector<std::string> &system_devs = devs->system;
+    const std::vector<std::string> &cache_devs = devs->cache;
+    const std::vector<std::string> &data_devs = devs->data;
+
     // For the unmount() edify function, replace with the corresponding
     // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t it = call.left_paren + 1; it != call.right_paren; ++it) {
+        const EdifyTokenSlice &token = tokens.tokens()[it];
+        if (token.type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const char *str = token.data;
+        std::size_t len = token.size;
 
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
+        bool is_system = contains_n(str, len, "/system")
+                || find_items_in_string(str, len, system_devs);
+        bool is_cache = contains_n(str, len, "/cache")
+                || find_items_in_string(str, len, cache_devs);
+        bool is_data = contains_n(str, len, "/data")
+                || contains_n(str, len, "/userdata")
+                || find_items_in_string(str, len, data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/system"));
+            *replacement = format(UNMOUNT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/cache"));
+            *replacement = format(UNMOUNT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/data"));
+            *replacement = format(UNMOUNT_FMT, "/data");
+            return true;
         }
     }
-    return right_paren + 1;
+    return false;
 }
 
 /*!
  * \brief Replace edify run_program() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tokens Edify token stream
+ * \param call Location of the function call
+ * \param[out] replacement Replacement function
+ * \param userdata BlockDevs for the device
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_run_program(std::vector<EdifyToken *> *tokens,
-                          const std::vector<EdifyToken *>::iterator func_name,
-                          const std::vector<EdifyToken *>::iterator left_paren,
-                          const std::vector<EdifyToken *>::iterator right_paren,
-                          const std::vector<std::string> &system_devs,
-                          const std::vector<std::string> &cache_devs,
-                          const std::vector<std::string> &data_devs)
+static bool
+rule_run_program(const EdifyTokenStream &tokens,
+                 const EdifyFunctionCall &call,
+                 std::string *replacement, void *userdata)
 {
+    const BlockDevs *devs = static_cast<const BlockDevs *>(userdata);
+    const std::vector<std::string> &system_devs = devs->system;
+    const std::vector<std::string> &cache_devs = devs->cache;
+    const std::vector<std::string> &data_devs = devs->data;
+
     bool found_reboot = false;
     bool found_mount = false;
     bool found_umount = false;
@@ -373,176 +300,273 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
     bool is_cache = false;
     bool is_data = false;
 
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    std::string buf;
+
+    for (std::size_t it = call.left_paren + 1; it != call.right_paren; ++it) {
+        const EdifyTokenSlice &token = tokens.tokens()[it];
+        if (token.type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescaped_string();
+        const char *str;
+        std::size_t len;
+        token_value(token, buf, str, len);
 
-        if (ends_with(unescaped, "reboot")) {
+        if (ends_with_n(str, len, "reboot", 6)) {
             found_reboot = true;
         }
-        if (ends_with(unescaped, "mount")) {
+        if (ends_with_n(str, len, "mount", 5)) {
             found_mount = true;
         }
-        if (ends_with(unescaped, "umount")) {
+        if (ends_with_n(str, len, "umount", 6)) {
             found_umount = true;
         }
-        if (ends_with(unescaped, "/format.sh")) {
+        if (ends_with_n(str, len, "/format.sh", 10)) {
             found_format_sh = true;
         }
-        if (ends_with(unescaped, "/mke2fs")) {
+        if (ends_with_n(str, len, "/mke2fs", 7)) {
             found_mke2fs = true;
         }
 
-        if (unescaped.find("/system") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), system_devs)) {
+        if (contains_n(str, len, "/system")
+                || find_items_in_string(str, len, system_devs)) {
             is_system = true;
         }
-        if (unescaped.find("/cache") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), cache_devs)) {
+        if (contains_n(str, len, "/cache")
+                || find_items_in_string(str, len, cache_devs)) {
             is_cache = true;
         }
-        if (unescaped.find("/data") != std::string::npos
-                || unescaped.find("/userdata") != std::string::npos
-                || find_items_in_string(unescaped.c_str(), data_devs)) {
+        if (contains_n(str, len, "/data")
+                || contains_n(str, len, "/userdata")
+                || find_items_in_string(str, len, data_devs)) {
             is_data = true;
         }
     }
 
     if (found_reboot) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
-                                "(ui_print(\"Removed reboot command\") == 0)");
+        *replacement = "(ui_print(\"Removed reboot command\") == 0)";
+        return true;
     } else if (found_umount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/system"));
+            *replacement = format(UNMOUNT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/cache"));
+            *replacement = format(UNMOUNT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(UNMOUNT_FMT, "/data"));
+            *replacement = format(UNMOUNT_FMT, "/data");
+            return true;
         }
     } else if (found_mount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/system"));
+            *replacement = format(MOUNT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/cache"));
+            *replacement = format(MOUNT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(MOUNT_FMT, "/data"));
+            *replacement = format(MOUNT_FMT, "/data");
+            return true;
         }
     } else if (found_format_sh) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
-                                format(FORMAT_FMT, "/system"));
+        *replacement = format(FORMAT_FMT, "/system");
+        return true;
     } else if (found_mke2fs) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
+            *replacement = format(FORMAT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
+            *replacement = format(FORMAT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/data"));
+            *replacement = format(FORMAT_FMT, "/data");
+            return true;
         }
     }
 
-    return right_paren + 1;
+    return false;
 }
 
 /*!
  * \brief Replace edify delete_recursive() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
+ * \param tokens Edify token stream
+ * \param call Location of the function call
+ * \param[out] replacement Replacement function
+ * \param userdata Unused
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
-                               const std::vector<EdifyToken *>::iterator func_name,
-                               const std::vector<EdifyToken *>::iterator left_paren,
-                               const std::vector<EdifyToken *>::iterator right_paren)
+static bool
+rule_delete_recursive(const EdifyTokenStream &tokens,
+                      const EdifyFunctionCall &call,
+                      std::string *replacement, void *userdata)
 {
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    (void) userdata;
+
+    std::string buf;
+
+    for (std::size_t it = call.left_paren + 1; it != call.right_paren; ++it) {
+        const EdifyTokenSlice &token = tokens.tokens()[it];
+        if (token.type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescaped_string();
+        const char *str;
+        std::size_t len;
+        token_value(token, buf, str, len);
 
-        if (unescaped == "/system" || unescaped == "/system/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
-        } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
+        if (equals_n(str, len, "/system", 7)
+                || equals_n(str, len, "/system/", 8)) {
+            *replacement = format(FORMAT_FMT, "/system");
+            return true;
+        } else if (equals_n(str, len, "/cache", 6)
+                || equals_n(str, len, "/cache/", 7)) {
+            *replacement = format(FORMAT_FMT, "/cache");
+            return true;
         }
     }
-    return right_paren + 1;
+    return false;
 }
 
 /*!
  * \brief Replace edify format() command
  *
- * \param tokens List of edify tokens
- * \param func_name Function name token
- * \param left_paren Left parenthesis token
- * \param right_paren Right parenthesis token
- * \param system_devs List of system partition block devices
- * \param cache_devs List of cache partition block devices
- * \param data_devs List of data partition block devices
+ * \param tokens Edify token stream
+ * \param call Location of the function call
+ * \param[out] replacement Replacement function
+ * \param userdata BlockDevs for the device
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \return Whether the function should be replaced
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_format(std::vector<EdifyToken *> *tokens,
-                     const std::vector<EdifyToken *>::iterator func_name,
-                     const std::vector<EdifyToken *>::iterator left_paren,
-                     const std::vector<EdifyToken *>::iterator right_paren,
-                     const std::vector<std::string> &system_devs,
-                     const std::vector<std::string> &cache_devs,
-                     const std::vector<std::string> &data_devs)
+static bool
+rule_format(const EdifyTokenStream &tokens,
+            const EdifyFunctionCall &call,
+            std::string *replacement, void *userdata)
 {
+    const BlockDevs *devs = static_cast<const BlockDevs *>(userdata);
+    const std::vector<std::string> &system_devs = devs->system;
+    const std::vector<std::string> &cache_devs = devs->cache;
+    const std::vector<std::string> &data_devs = devs->data;
+
     // For the format() edify function, replace with the corresponding
     // update-binary-tool command
-    for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t it = call.left_paren + 1; it != call.right_paren; ++it) {
+        const EdifyTokenSlice &token = tokens.tokens()[it];
+        if (token.type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const char *str = token.data;
+        std::size_t len = token.size;
 
-        bool is_system = str.find("/system") != std::string::npos
-                || find_items_in_string(str.c_str(), system_devs);
-        bool is_cache = str.find("/cache") != std::string::npos
-                || find_items_in_string(str.c_str(), cache_devs);
-        bool is_data = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || find_items_in_string(str.c_str(), data_devs);
+        bool is_system = contains_n(str, len, "/system")
+                || find_items_in_string(str, len, system_devs);
+        bool is_cache = contains_n(str, len, "/cache")
+                || find_items_in_string(str, len, cache_devs);
+        bool is_data = contains_n(str, len, "/data")
+                || contains_n(str, len, "/userdata")
+                || find_items_in_string(str, len, data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/system"));
+            *replacement = format(FORMAT_FMT, "/system");
+            return true;
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/cache"));
+            *replacement = format(FORMAT_FMT, "/cache");
+            return true;
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
-                                    format(FORMAT_FMT, "/data"));
+            *replacement = format(FORMAT_FMT, "/data");
+            return true;
         }
     }
-    return right_paren + 1;
+    return false;
+}
+
+static void add_standard_rules(EdifyRewriter *rewriter, BlockDevs *devs)
+{
+    rewriter->add_rule("mount", &rule_mount, devs);
+    rewriter->add_rule("unmount", &rule_unmount, devs);
+    rewriter->add_rule("run_program", &rule_run_program, devs);
+    rewriter->add_rule("delete_recursive", &rule_delete_recursive, nullptr);
+    rewriter->add_rule("format", &rule_format, devs);
+}
+
+static bool patch_updater_contents(StandardPatcherPrivate *priv,
+                                   std::string &contents)
+{
+    if (contents.size() >= 2 && std::memcmp(contents.data(), "#!", 2) == 0) {
+        // Ignore any script with a shebang line
+        return true;
+    }
+
+    EdifyTokenStream tokens;
+    if (!tokens.tokenize(contents.data(), contents.size())) {
+        LOGE("Failed to tokenize updater-script");
+        return false;
+    }
+
+#if DUMP_DEBUG
+    tokens.dump();
+#endif
+
+    auto &&device = priv->info->device();
+    priv->devs.system = device.system_block_devs();
+    priv->devs.cache = device.cache_block_devs();
+    priv->devs.data = device.data_block_devs();
+
+    if (!priv->rewriter.rewrite(&tokens)) {
+        return false;
+    }
+
+#if DUMP_DEBUG
+    tokens.dump();
+#endif
+
+    contents = tokens.generate();
+
+    return true;
+}
+
+static void patch_transfer_list_contents(std::string &contents)
+{
+    TransferListRewriter rewriter(TransferListOptions{});
+    std::string output;
+
+    rewriter.scan(contents.data(), contents.size());
+    rewriter.finish_scan();
+
+    output.reserve(contents.size());
+    rewriter.rewrite(contents.data(), contents.size(), output);
+    rewriter.finish_rewrite(output);
+
+    contents.swap(output);
+}
+
+bool StandardPatcher::patch_contents(const std::string &file,
+                                     std::string &contents)
+{
+    MB_PRIVATE(StandardPatcher);
+
+    if (file == UpdaterScript) {
+        return patch_updater_contents(priv, contents);
+    } else if (file == SystemTransferList) {
+        patch_transfer_list_contents(contents);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Edify rewriter used for the updater-script
+ *
+ * Other autopatchers may register additional rules so that they are applied
+ * in the same pass as the standard replacements. Rules for a function are
+ * tried after the standard rules for that function.
+ */
+EdifyRewriter & StandardPatcher::edify_rewriter()
+{
+    MB_PRIVATE(StandardPatcher);
+    return priv->rewriter;
 }
 
 bool StandardPatcher::patch_files(const std::string &directory)
@@ -571,109 +595,128 @@ bool StandardPatcher::patch_updater(const std::string &directory)
 
     FileUtils::read_to_string(path, &contents);
 
-    if (contents.size() >= 2 && std::memcmp(contents.data(), "#!", 2) == 0) {
-        // Ignore any script with a shebang line
-        return true;
-    }
-
-    std::vector<EdifyToken *> tokens;
-    bool result = EdifyTokenizer::tokenize(
-            contents.data(), contents.size(), &tokens);
-    if (!result) {
-        LOGE("Failed to tokenize updater-script");
+    if (!patch_updater_contents(priv, contents)) {
         return false;
     }
 
-#if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
-#endif
+    FileUtils::write_from_string(path, contents);
 
-    auto &&device = priv->info->device();
-    auto system_devs = device.system_block_devs();
-    auto cache_devs = device.cache_block_devs();
-    auto data_devs = device.data_block_devs();
+    return true;
+}
 
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
+/*!
+ * \brief Rewrite the transfer list of a block-based OTA
+ *
+ * The list is streamed twice: once to precompute the final block map and once
+ * to write the rewritten commands to a temporary file, which then replaces the
+ * original. "erase" commands are removed and "zero" commands are trimmed to
+ * the blocks that are not overwritten later.
+ *
+ * \return Whether the transfer list was rewritten or does not exist
+ */
+bool StandardPatcher::patch_transfer_list(const std::string &directory)
+{
+    std::string path;
 
-    // TODO: Catch errors
-    while (true) {
-        end = tokens.end();
+    path += directory;
+    path += "/";
+    path += SystemTransferList;
 
-        // Need to find:
-        // 1. String containing function name
-        // 2. Left parenthesis for the function
-        // 3. Right parenthesis for the function
-        std::vector<EdifyToken *>::iterator func_name;
-        std::vector<EdifyToken *>::iterator left_paren;
-        std::vector<EdifyToken *>::iterator right_paren;
+    std::string temp_path = path + ".tmp";
 
-        if (!find_function(begin, end, &func_name, &left_paren, &right_paren)) {
-            break;
-        }
+    StandardFile input;
+    StandardFile output;
 
-        // Tokens (types are checked by findFunction())
-        EdifyTokenString *t_func_name = (EdifyTokenString *)(*func_name);
-
-        if (t_func_name->unescaped_string() == "mount") {
-            begin = replace_edify_mount(&tokens, func_name, left_paren, right_paren,
-                                        system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "unmount") {
-            begin = replace_edify_unmount(&tokens, func_name, left_paren, right_paren,
-                                          system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "run_program") {
-            begin = replace_edify_run_program(&tokens, func_name, left_paren, right_paren,
-                                              system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "delete_recursive") {
-            begin = replace_edify_delete_recursive(&tokens, func_name, left_paren, right_paren);
-        } else if (t_func_name->unescaped_string() == "format") {
-            begin = replace_edify_format(&tokens, func_name, left_paren, right_paren,
-                                         system_devs, cache_devs, data_devs);
-        } else {
-            begin = func_name + 1;
-        }
+    auto ret = FileUtils::open_file(input, path, FileOpenMode::READ_ONLY);
+    if (ret != ErrorCode::NoError) {
+        // The transfer list is optional
+        return true;
     }
 
-#if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
-#endif
+    TransferListRewriter rewriter(TransferListOptions{});
+    std::vector<char> buf(TRANSFER_LIST_BUF_SIZE);
+    std::string out;
+    size_t n;
 
-    FileUtils::write_from_string(path, EdifyTokenizer::untokenize(tokens));
+    while (true) {
+        if (!input.read(buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read file: %s",
+                 path.c_str(), input.error_string().c_str());
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        rewriter.scan(buf.data(), n);
+    }
+    rewriter.finish_scan();
 
-    for (EdifyToken *t : tokens) {
-        delete t;
+    if (!input.seek(0, SEEK_SET, nullptr)) {
+        LOGE("%s: Failed to seek file: %s",
+             path.c_str(), input.error_string().c_str());
+        return false;
     }
 
-    return true;
-}
+    ret = FileUtils::open_file(output, temp_path, FileOpenMode::WRITE_ONLY);
+    if (ret != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             temp_path.c_str(), output.error_string().c_str());
+        return false;
+    }
 
-bool StandardPatcher::patch_transfer_list(const std::string &directory)
-{
-    std::string contents;
-    std::string path;
-    std::vector<std::string> lines;
+    auto flush = [&]{
+        if (!file_write_fully(output, out.data(), out.size(), n)
+                || n != out.size()) {
+            LOGE("%s: Failed to write file: %s",
+                 temp_path.c_str(), output.error_string().c_str());
+            return false;
+        }
+        out.clear();
+        return true;
+    };
 
-    path += directory;
-    path += "/";
-    path += SystemTransferList;
+    while (true) {
+        if (!input.read(buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read file: %s",
+                 path.c_str(), input.error_string().c_str());
+            remove(temp_path.c_str());
+            return false;
+        } else if (n == 0) {
+            break;
+        }
 
-    auto ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return ret == ErrorCode::FileOpenError;
+        rewriter.rewrite(buf.data(), n, out);
+
+        if (out.size() >= TRANSFER_LIST_BUF_SIZE && !flush()) {
+            remove(temp_path.c_str());
+            return false;
+        }
+    }
+    rewriter.finish_rewrite(out);
+
+    if (!flush() || !output.close()) {
+        LOGE("%s: Failed to close file: %s",
+             temp_path.c_str(), output.error_string().c_str());
+        remove(temp_path.c_str());
+        return false;
     }
 
-    lines = StringUtils::split(contents, '\n');
+    input.close();
 
-    for (auto it = lines.begin(); it != lines.end();) {
-        if (starts_with(*it, "erase ")) {
-            it = lines.erase(it);
-        } else {
-            ++it;
-        }
+#ifdef _WIN32
+    // rename() does not replace existing files on Windows
+    remove(path.c_str());
+#endif
+
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        LOGE("%s: Failed to replace file: %s", path.c_str(), strerror(errno));
+        remove(temp_path.c_str());
+        return false;
     }
 
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::write_from_string(path, contents);
+    if (rewriter.removed_blocks() > 0) {
+        LOGD("%s: Removed %" PRIu64 " redundant zeroed blocks",
+             path.c_str(), rewriter.removed_blocks());
+    }
 
     return true;
 }
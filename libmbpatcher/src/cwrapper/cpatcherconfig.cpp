@@ -126,6 +126,23 @@ char * mbpatcher_config_temp_directory(const CPatcherConfig *pc)
     return mb::capi_str_to_cstr(config->temp_directory());
 }
 
+/*!
+ * \brief Get the patch result cache directory
+ *
+ * \note The returned string is dynamically allocated. It should be free()'d
+ *       when it is no longer needed.
+ *
+ * \param pc CPatcherConfig object
+ * \return Cache directory
+ *
+ * \sa PatcherConfig::cache_directory()
+ */
+char * mbpatcher_config_cache_directory(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return mb::capi_str_to_cstr(config->cache_directory());
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -154,6 +171,20 @@ void mbpatcher_config_set_temp_directory(CPatcherConfig *pc, char *path)
     config->set_temp_directory(path);
 }
 
+/*!
+ * \brief Set the patch result cache directory
+ *
+ * \param pc CPatcherConfig object
+ * \param path Path to cache directory or an empty string to disable caching
+ *
+ * \sa PatcherConfig::set_cache_directory()
+ */
+void mbpatcher_config_set_cache_directory(CPatcherConfig *pc, char *path)
+{
+    CAST(pc);
+    config->set_cache_directory(path);
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
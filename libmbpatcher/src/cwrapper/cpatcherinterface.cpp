@@ -19,6 +19,8 @@
 
 #include "mbpatcher/cwrapper/cpatcherinterface.h"
 
+#include <mutex>
+
 #include <cassert>
 
 #include "mbcommon/capi/util.h"
@@ -51,6 +53,19 @@
  * \sa Patcher, AutoPatcher
  */
 
+/*! \cond INTERNAL */
+struct PatcherProgress
+{
+    // Held briefly by both the patcher and the poller so that each pair of
+    // values is read consistently
+    mutable std::mutex lock;
+    uint64_t bytes = 0;
+    uint64_t max_bytes = 0;
+    uint64_t files = 0;
+    uint64_t max_files = 0;
+};
+/*! \endcond */
+
 extern "C" {
 
 struct CallbackWrapper
@@ -73,7 +88,7 @@ void files_cb_wrapper(uint64_t files, uint64_t max_files, void *userdata)
 {
     CallbackWrapper *wrapper = reinterpret_cast<CallbackWrapper *>(userdata);
     if (wrapper->files_cb) {
-        wrapper->files_cb(files, max_files, userdata);
+        wrapper->files_cb(files, max_files, wrapper->userdata);
     }
 }
 
@@ -85,6 +100,37 @@ void details_cb_wrapper(const std::string &text, void *userdata)
     }
 }
 
+struct PolledWrapper
+{
+    PatcherProgress *progress;
+    DetailsUpdatedCallback details_cb;
+    void *userdata;
+};
+
+void polled_progress_cb(uint64_t bytes, uint64_t max_bytes, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<PolledWrapper *>(userdata);
+    std::lock_guard<std::mutex> lock(wrapper->progress->lock);
+    wrapper->progress->bytes = bytes;
+    wrapper->progress->max_bytes = max_bytes;
+}
+
+void polled_files_cb(uint64_t files, uint64_t max_files, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<PolledWrapper *>(userdata);
+    std::lock_guard<std::mutex> lock(wrapper->progress->lock);
+    wrapper->progress->files = files;
+    wrapper->progress->max_files = max_files;
+}
+
+void polled_details_cb(const std::string &text, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<PolledWrapper *>(userdata);
+    if (wrapper->details_cb) {
+        wrapper->details_cb(text.c_str(), wrapper->userdata);
+    }
+}
+
 /*!
  * \brief Get the error information
  *
@@ -167,6 +213,82 @@ bool mbpatcher_patcher_patch_file(CPatcher *patcher,
                          reinterpret_cast<void *>(&wrapper));
 }
 
+/*!
+ * \brief Patch one input file into several output files
+ *
+ * \param patcher CPatcher object
+ * \param infos Array of CFileInfo objects for each output file
+ * \param count Number of elements in \p infos
+ * \param progressCb Callback for receiving current progress value
+ * \param detailsCb Callback for receiving detailed progress text
+ * \param userData Pointer to pass to callback functions
+ * \return true on success, otherwise false (and error set appropriately)
+ *
+ * \sa Patcher::patch_file_multi()
+ */
+bool mbpatcher_patcher_patch_file_multi(CPatcher *patcher,
+                                        const CFileInfo * const *infos,
+                                        size_t count,
+                                        ProgressUpdatedCallback progressCb,
+                                        FilesUpdatedCallback filesCb,
+                                        DetailsUpdatedCallback detailsCb,
+                                        void *userData)
+{
+    CASTP(patcher);
+
+    std::vector<const mb::patcher::FileInfo *> list;
+    for (size_t i = 0; i < count; ++i) {
+        list.push_back(
+                reinterpret_cast<const mb::patcher::FileInfo *>(infos[i]));
+    }
+
+    CallbackWrapper wrapper;
+    wrapper.progress_cb = progressCb;
+    wrapper.files_cb = filesCb;
+    wrapper.details_cb = detailsCb;
+    wrapper.userdata = userData;
+
+    return p->patch_file_multi(list, &progress_cb_wrapper, &files_cb_wrapper,
+                               &details_cb_wrapper,
+                               reinterpret_cast<void *>(&wrapper));
+}
+
+/*!
+ * \brief Start patching the file, publishing progress to a shared counter
+ *
+ * This is equivalent to mbpatcher_patcher_patch_file(), except that progress
+ * and file count updates are stored in \p progress instead of being passed to
+ * callbacks. Callers that cross a language boundary for every callback, such as
+ * JNI/JNA, can read the values with mbpatcher_progress_get() at their own pace
+ * from another thread. Detail updates are infrequent, so they are still passed
+ * to \p detailsCb.
+ *
+ * \param patcher CPatcher object
+ * \param progress Shared progress counters
+ * \param detailsCb Callback for receiving detailed progress text (may be NULL)
+ * \param userData Pointer to pass to \p detailsCb
+ * \return true on success, otherwise false (and error set appropriately)
+ *
+ * \sa Patcher::patchFile()
+ */
+bool mbpatcher_patcher_patch_file_polled(CPatcher *patcher,
+                                         CPatcherProgress *progress,
+                                         DetailsUpdatedCallback detailsCb,
+                                         void *userData)
+{
+    CASTP(patcher);
+    assert(progress != nullptr);
+
+    PolledWrapper wrapper;
+    wrapper.progress = reinterpret_cast<PatcherProgress *>(progress);
+    wrapper.details_cb = detailsCb;
+    wrapper.userdata = userData;
+
+    return p->patch_file(&polled_progress_cb, &polled_files_cb,
+                         &polled_details_cb,
+                         reinterpret_cast<void *>(&wrapper));
+}
+
 /*!
  * \brief Cancel the patching of a file
  *
@@ -180,6 +302,53 @@ void mbpatcher_patcher_cancel_patching(CPatcher *patcher)
     p->cancel_patching();
 }
 
+/*!
+ * \brief Create shared progress counters
+ *
+ * \note The returned object should be freed with mbpatcher_progress_destroy()
+ *       when it is no longer needed.
+ *
+ * \return New CPatcherProgress object with all values set to 0
+ *
+ * \sa mbpatcher_patcher_patch_file_polled()
+ */
+CPatcherProgress * mbpatcher_progress_create(void)
+{
+    return reinterpret_cast<CPatcherProgress *>(new PatcherProgress());
+}
+
+/*!
+ * \brief Destroy shared progress counters
+ *
+ * \param progress CPatcherProgress object
+ */
+void mbpatcher_progress_destroy(CPatcherProgress *progress)
+{
+    delete reinterpret_cast<PatcherProgress *>(progress);
+}
+
+/*!
+ * \brief Get a snapshot of the current progress
+ *
+ * This can be called from any thread while the patcher is running.
+ *
+ * \param progress CPatcherProgress object
+ * \param values Array of 4 elements to store the current number of bytes,
+ *               maximum number of bytes, current number of files, and maximum
+ *               number of files
+ */
+void mbpatcher_progress_get(const CPatcherProgress *progress, uint64_t *values)
+{
+    assert(progress != nullptr);
+    auto const *pp = reinterpret_cast<const PatcherProgress *>(progress);
+
+    std::lock_guard<std::mutex> lock(pp->lock);
+    values[0] = pp->bytes;
+    values[1] = pp->max_bytes;
+    values[2] = pp->files;
+    values[3] = pp->max_files;
+}
+
 /*!
  * \brief Get the error information
  *
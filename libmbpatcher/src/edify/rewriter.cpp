@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/edify/rewriter.h"
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace patcher
+{
+
+static bool find_function(const std::vector<EdifyTokenSlice> &tokens,
+                          std::size_t begin, EdifyFunctionCall *call)
+{
+    const std::size_t end = tokens.size();
+
+    for (std::size_t it = begin; it != end; ++it) {
+        // Find string representing the function name
+        if (tokens[it].type != EdifyTokenType::String) {
+            continue;
+        }
+
+        std::size_t left_paren = 0;
+        std::size_t right_paren = 0;
+        bool found_left_paren = false;
+        bool found_right_paren = false;
+
+        // Barring any whitespace, newlines, or comments, the function name
+        // should be followed by a left parenthesis
+        for (std::size_t it2 = it + 1; it2 != end; ++it2) {
+            if (tokens[it2].type == EdifyTokenType::Whitespace
+                    || tokens[it2].type == EdifyTokenType::Newline
+                    || tokens[it2].type == EdifyTokenType::Comment) {
+                continue;
+            } else if (tokens[it2].type == EdifyTokenType::LeftParen) {
+                found_left_paren = true;
+                left_paren = it2;
+            }
+            break;
+        }
+
+        // If a left parenthesis was not found, then the string token was not
+        // a function name
+        if (!found_left_paren) {
+            continue;
+        }
+
+        // Left for matching right parenthesis
+        std::size_t depth = 0;
+
+        for (std::size_t it2 = left_paren; it2 != end; ++it2) {
+            if (tokens[it2].type == EdifyTokenType::LeftParen) {
+                ++depth;
+            } else if (tokens[it2].type == EdifyTokenType::RightParen) {
+                --depth;
+            }
+            if (depth == 0) {
+                found_right_paren = true;
+                right_paren = it2;
+                break;
+            }
+        }
+
+        // If a right parenthesis was not found, but the function name and left
+        // parenthesis were found, then assume there's a syntax error and bail
+        // out
+        if (!found_right_paren) {
+            return false;
+        }
+
+        call->func_name = it;
+        call->left_paren = left_paren;
+        call->right_paren = right_paren;
+
+        return true;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Register rule for an edify function
+ *
+ * Rules for the same function are tried in the order they were added.
+ *
+ * \param function Unescaped name of the function
+ * \param rule Rule callback
+ * \param userdata Pointer to pass to \a rule
+ */
+void EdifyRewriter::add_rule(const std::string &function,
+                             EdifyRewriteRule rule, void *userdata)
+{
+    m_rules[function].push_back({ rule, userdata });
+}
+
+/*!
+ * \brief Rewrite token stream
+ *
+ * \return False if a replacement could not be tokenized. Otherwise, true.
+ */
+bool EdifyRewriter::rewrite(EdifyTokenStream *tokens) const
+{
+    std::size_t begin = 0;
+    EdifyFunctionCall call;
+    std::string replacement;
+
+    while (find_function(tokens->tokens(), begin, &call)) {
+        auto it = m_rules.find(EdifyTokenStream::unescaped_string(
+                tokens->tokens()[call.func_name]));
+        if (it == m_rules.end()) {
+            // Look for function calls within the arguments
+            begin = call.func_name + 1;
+            continue;
+        }
+
+        begin = call.right_paren + 1;
+
+        for (const Rule &rule : it->second) {
+            if (!rule.fn(*tokens, call, &replacement, rule.userdata)) {
+                continue;
+            }
+
+            if (!tokens->replace(call.func_name, call.right_paren + 1,
+                                 replacement, &begin)) {
+                LOGE("Failed to tokenize replacement function string: %s",
+                     replacement.c_str());
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+}
+}
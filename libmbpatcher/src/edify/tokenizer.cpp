@@ -19,9 +19,12 @@
 
 #include "mbpatcher/edify/tokenizer.h"
 
+#include <algorithm>
+
 #include <cassert>
 #include <cstring>
 
+#include "mbcommon/alloc_profiler.h"
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
@@ -33,6 +36,9 @@ namespace mb
 namespace patcher
 {
 
+// Minimum size of each arena block in EdifyTokenStream
+static constexpr std::size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
 EdifyToken::~EdifyToken()
 {
 }
@@ -291,15 +297,16 @@ static int hex_char_to_int(char c)
     }
 }
 
-bool EdifyTokenString::unescape(const std::string &str, std::string *out)
+static bool unescape_data(const char *str, std::size_t size, std::string *out)
 {
     std::string output;
+    output.reserve(size);
 
-    for (std::size_t i = 0; i < str.size();) {
+    for (std::size_t i = 0; i < size;) {
         char c = str[i];
 
         if (c == '\\') {
-            if (i == str.size() - 1) {
+            if (i == size - 1) {
                 // Escape character is last character
                 return false;
             }
@@ -323,7 +330,7 @@ bool EdifyTokenString::unescape(const std::string &str, std::string *out)
             } else if (str[i + 1] == '\\') {
                 output += '\\';
             } else if (str[i + 1] == 'x') {
-                if (str.size() - i < 4) {
+                if (size - i < 4) {
                     // Need 4 chars: \xYY
                     return false;
                 }
@@ -355,6 +362,11 @@ bool EdifyTokenString::unescape(const std::string &str, std::string *out)
     return true;
 }
 
+bool EdifyTokenString::unescape(const std::string &str, std::string *out)
+{
+    return unescape_data(str.data(), str.size(), out);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 EdifyTokenUnknown::EdifyTokenUnknown(char c) : EdifyToken(EdifyTokenType::Unknown), m_char(c)
@@ -368,7 +380,7 @@ std::string EdifyTokenUnknown::generate()
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool EdifyTokenizer::is_valid_unquoted(char c)
+static bool is_unquoted_char(char c)
 {
     return std::isalnum(c)
             || c == '_'
@@ -377,88 +389,88 @@ bool EdifyTokenizer::is_valid_unquoted(char c)
             || c == '.';
 }
 
-bool EdifyTokenizer::next_token(const char *data, std::size_t size,
-                                std::size_t *pos, EdifyToken **token)
+/*!
+ * \brief Find the extent of the next token
+ *
+ * \param[in] data Script contents
+ * \param[in] size Script size
+ * \param[in,out] pos Position of the token. Will be set to the position
+ *                    immediately after the token.
+ * \param[out] type Type of the token
+ *
+ * \return Whether a token could be scanned
+ */
+static bool scan_token(const char *data, std::size_t size, std::size_t *pos,
+                       EdifyTokenType *type)
 {
     std::size_t p = *pos;
     assert(p < size);
 
     if (size - p >= 2 && std::memcmp(data + p, "if", 2) == 0) {
-        *token = new EdifyTokenIf();
+        *type = EdifyTokenType::If;
         p += 2;
     } else if (size - p >= 4 && std::memcmp(data + p, "then", 4) == 0) {
-        *token = new EdifyTokenThen();
+        *type = EdifyTokenType::Then;
         p += 4;
     } else if (size - p >= 4 && std::memcmp(data + p, "else", 4) == 0) {
-        *token = new EdifyTokenElse();
+        *type = EdifyTokenType::Else;
         p += 4;
     } else if (size - p >= 5 && std::memcmp(data + p, "endif", 5) == 0) {
-        *token = new EdifyTokenEndif();
+        *type = EdifyTokenType::Endif;
         p += 5;
     } else if (size - p >= 2 && std::memcmp(data + p, "&&", 2) == 0) {
-        *token = new EdifyTokenAnd();
+        *type = EdifyTokenType::And;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "||", 2) == 0) {
-        *token = new EdifyTokenOr();
+        *type = EdifyTokenType::Or;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "==", 2) == 0) {
-        *token = new EdifyTokenEquals();
+        *type = EdifyTokenType::Equals;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "!=", 2) == 0) {
-        *token = new EdifyTokenNotEquals();
+        *type = EdifyTokenType::NotEquals;
         p += 2;
     } else if (data[p] == '!') {
-        *token = new EdifyTokenNot();
+        *type = EdifyTokenType::Not;
         p += 1;
     } else if (data[p] == '(') {
-        *token = new EdifyTokenLeftParen();
+        *type = EdifyTokenType::LeftParen;
         p += 1;
     } else if (data[p] == ')') {
-        *token = new EdifyTokenRightParen();
+        *type = EdifyTokenType::RightParen;
         p += 1;
     } else if (data[p] == ';') {
-        *token = new EdifyTokenSemicolon();
+        *type = EdifyTokenType::Semicolon;
         p += 1;
     } else if (data[p] == ',') {
-        *token = new EdifyTokenComma();
+        *type = EdifyTokenType::Comma;
         p += 1;
     } else if (data[p] == '+') {
-        *token = new EdifyTokenConcat();
+        *type = EdifyTokenType::Concat;
         p += 1;
     } else if (data[p] == '\n') {
-        *token = new EdifyTokenNewline();
+        *type = EdifyTokenType::Newline;
         p += 1;
-    } else if (data[p] != '\n' && std::isspace(data[p])) {
-        std::string buf;
-        buf += data[p];
+    } else if (std::isspace(static_cast<unsigned char>(data[p]))) {
+        *type = EdifyTokenType::Whitespace;
         p += 1;
-        while (size - p >= 1 && data[p] != '\n' && std::isspace(data[p])) {
-            buf += data[p];
+        while (size - p >= 1 && data[p] != '\n'
+                && std::isspace(static_cast<unsigned char>(data[p]))) {
             p += 1;
         }
-        *token = new EdifyTokenWhitespace(std::move(buf));
     } else if (data[p] == '#') {
-        std::string buf;
-        // Omit '#' character
+        *type = EdifyTokenType::Comment;
         p += 1;
         while (size - p >= 1 && data[p] != '\n') {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenComment(std::move(buf));
-    } else if (is_valid_unquoted(data[p])) {
-        std::string buf;
-        buf += data[p];
+    } else if (is_unquoted_char(data[p])) {
+        *type = EdifyTokenType::String;
         p += 1;
-        while (size - p >= 1 && is_valid_unquoted(data[p])) {
-            buf += data[p];
+        while (size - p >= 1 && is_unquoted_char(data[p])) {
             p += 1;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::NotQuoted);
     } else if (data[p] == '"') {
-        std::size_t curPos = p;
-        std::string buf;
-        buf += data[p];
         p += 1;
         bool escaped = false;
         bool terminated = false;
@@ -466,21 +478,19 @@ bool EdifyTokenizer::next_token(const char *data, std::size_t size,
             if (data[p] == '\\' || escaped) {
                 escaped = !escaped;
             } else if (!escaped && data[p] == '"') {
-                buf += data[p];
                 p += 1;
                 terminated = true;
                 break;
             }
-            buf += data[p];
             p += 1;
         }
         if (!terminated) {
-            LOGE("Unterminated quote at position %" MB_PRIzu, curPos);
+            LOGE("Unterminated quote at position %" MB_PRIzu, *pos);
             return false;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::AlreadyQuoted);
+        *type = EdifyTokenType::String;
     } else {
-        *token = new EdifyTokenUnknown(data[p]);
+        *type = EdifyTokenType::Unknown;
         p += 1;
     }
 
@@ -489,9 +499,93 @@ bool EdifyTokenizer::next_token(const char *data, std::size_t size,
     return true;
 }
 
+static const char * token_type_name(EdifyTokenType type)
+{
+    switch (type) {
+    case EdifyTokenType::If:         return "If";
+    case EdifyTokenType::Then:       return "Then";
+    case EdifyTokenType::Else:       return "Else";
+    case EdifyTokenType::Endif:      return "Endif";
+    case EdifyTokenType::And:        return "And";
+    case EdifyTokenType::Or:         return "Or";
+    case EdifyTokenType::Equals:     return "Equals";
+    case EdifyTokenType::NotEquals:  return "NotEquals";
+    case EdifyTokenType::Not:        return "Not";
+    case EdifyTokenType::LeftParen:  return "LeftParen";
+    case EdifyTokenType::RightParen: return "RightParen";
+    case EdifyTokenType::Semicolon:  return "Semicolon";
+    case EdifyTokenType::Comma:      return "Comma";
+    case EdifyTokenType::Concat:     return "Concat";
+    case EdifyTokenType::Newline:    return "Newline";
+    case EdifyTokenType::Whitespace: return "Whitespace";
+    case EdifyTokenType::Comment:    return "Comment";
+    case EdifyTokenType::String:     return "String";
+    case EdifyTokenType::Unknown:    return "Unknown";
+    }
+
+    return nullptr;
+}
+
+bool EdifyTokenizer::is_valid_unquoted(char c)
+{
+    return is_unquoted_char(c);
+}
+
+bool EdifyTokenizer::next_token(const char *data, std::size_t size,
+                                std::size_t *pos, EdifyToken **token)
+{
+    std::size_t begin = *pos;
+    EdifyTokenType type;
+
+    if (!scan_token(data, size, pos, &type)) {
+        return false;
+    }
+
+    const char *str = data + begin;
+    std::size_t str_size = *pos - begin;
+
+    switch (type) {
+    case EdifyTokenType::If:         *token = new EdifyTokenIf();         break;
+    case EdifyTokenType::Then:       *token = new EdifyTokenThen();       break;
+    case EdifyTokenType::Else:       *token = new EdifyTokenElse();       break;
+    case EdifyTokenType::Endif:      *token = new EdifyTokenEndif();      break;
+    case EdifyTokenType::And:        *token = new EdifyTokenAnd();        break;
+    case EdifyTokenType::Or:         *token = new EdifyTokenOr();         break;
+    case EdifyTokenType::Equals:     *token = new EdifyTokenEquals();     break;
+    case EdifyTokenType::NotEquals:  *token = new EdifyTokenNotEquals();  break;
+    case EdifyTokenType::Not:        *token = new EdifyTokenNot();        break;
+    case EdifyTokenType::LeftParen:  *token = new EdifyTokenLeftParen();  break;
+    case EdifyTokenType::RightParen: *token = new EdifyTokenRightParen(); break;
+    case EdifyTokenType::Semicolon:  *token = new EdifyTokenSemicolon();  break;
+    case EdifyTokenType::Comma:      *token = new EdifyTokenComma();      break;
+    case EdifyTokenType::Concat:     *token = new EdifyTokenConcat();     break;
+    case EdifyTokenType::Newline:    *token = new EdifyTokenNewline();    break;
+    case EdifyTokenType::Whitespace:
+        *token = new EdifyTokenWhitespace(std::string(str, str_size));
+        break;
+    case EdifyTokenType::Comment:
+        // Omit '#' character
+        *token = new EdifyTokenComment(std::string(str + 1, str_size - 1));
+        break;
+    case EdifyTokenType::String:
+        *token = new EdifyTokenString(std::string(str, str_size),
+                                      *str == '"'
+                                      ? EdifyTokenString::AlreadyQuoted
+                                      : EdifyTokenString::NotQuoted);
+        break;
+    case EdifyTokenType::Unknown:
+        *token = new EdifyTokenUnknown(*str);
+        break;
+    }
+
+    return true;
+}
+
 bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
                               std::vector<EdifyToken *> *tokens)
 {
+    MB_ALLOC_SCOPE("edify.tokenize");
+
     std::vector<EdifyToken *> temp;
     EdifyToken *token;
     std::size_t pos = 0;
@@ -544,35 +638,191 @@ std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *>::iterator
 
 void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
 {
-    const char *token_name = nullptr;
-
     for (std::size_t i = 0; i < tokens.size(); ++i) {
         EdifyToken *t = tokens[i];
 
-        switch (t->type()) {
-        case EdifyTokenType::If:         token_name = "If";         break;
-        case EdifyTokenType::Then:       token_name = "Then";       break;
-        case EdifyTokenType::Else:       token_name = "Else";       break;
-        case EdifyTokenType::Endif:      token_name = "Endif";      break;
-        case EdifyTokenType::And:        token_name = "And";        break;
-        case EdifyTokenType::Or:         token_name = "Or";         break;
-        case EdifyTokenType::Equals:     token_name = "Equals";     break;
-        case EdifyTokenType::NotEquals:  token_name = "NotEquals";  break;
-        case EdifyTokenType::Not:        token_name = "Not";        break;
-        case EdifyTokenType::LeftParen:  token_name = "LeftParen";  break;
-        case EdifyTokenType::RightParen: token_name = "RightParen"; break;
-        case EdifyTokenType::Semicolon:  token_name = "Semicolon";  break;
-        case EdifyTokenType::Comma:      token_name = "Comma";      break;
-        case EdifyTokenType::Concat:     token_name = "Concat";     break;
-        case EdifyTokenType::Newline:    token_name = "Newline";    break;
-        case EdifyTokenType::Whitespace: token_name = "Whitespace"; break;
-        case EdifyTokenType::Comment:    token_name = "Comment";    break;
-        case EdifyTokenType::String:     token_name = "String";     break;
-        case EdifyTokenType::Unknown:    token_name = "Unknown";    break;
+        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_type_name(t->type()),
+             t->generate().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EdifyTokenStream::EdifyTokenStream()
+    : m_block_size(0)
+    , m_block_used(0)
+{
+}
+
+EdifyTokenStream::~EdifyTokenStream()
+{
+}
+
+/*!
+ * \brief Tokenize script
+ *
+ * The script is copied into the stream's arena, so \a data does not need to
+ * outlive the stream. Any existing tokens are discarded.
+ *
+ * \return Whether the script was successfully tokenized
+ */
+bool EdifyTokenStream::tokenize(const char *data, std::size_t size)
+{
+    MB_ALLOC_SCOPE("edify.tokenize");
+
+    std::vector<EdifyTokenSlice> temp;
+
+    if (!tokenize_into(arena_copy(data, size), size, &temp)) {
+        return false;
+    }
+
+    m_tokens.swap(temp);
+    return true;
+}
+
+std::vector<EdifyTokenSlice> & EdifyTokenStream::tokens()
+{
+    return m_tokens;
+}
+
+const std::vector<EdifyTokenSlice> & EdifyTokenStream::tokens() const
+{
+    return m_tokens;
+}
+
+/*!
+ * \brief Replace range of tokens with the tokens of another string
+ *
+ * \param begin Index of first token to replace
+ * \param end Index after the last token to replace
+ * \param replacement Replacement edify code (in string form)
+ * \param[out] new_end Index immediately after the inserted tokens
+ *
+ * \return Whether the replacement string could be tokenized. If false, the
+ *         token stream is left unmodified.
+ */
+bool EdifyTokenStream::replace(std::size_t begin, std::size_t end,
+                               const std::string &replacement,
+                               std::size_t *new_end)
+{
+    assert(begin <= end && end <= m_tokens.size());
+
+    std::vector<EdifyTokenSlice> temp;
+
+    if (!tokenize_into(arena_copy(replacement.data(), replacement.size()),
+                       replacement.size(), &temp)) {
+        return false;
+    }
+
+    std::size_t removed = end - begin;
+
+    // Overwrite as much of the existing range as possible so that only the
+    // difference needs to be shifted
+    std::size_t common = std::min(removed, temp.size());
+    std::copy(temp.begin(), temp.begin() + common, m_tokens.begin() + begin);
+
+    if (temp.size() > removed) {
+        m_tokens.insert(m_tokens.begin() + end, temp.begin() + common,
+                        temp.end());
+    } else if (temp.size() < removed) {
+        m_tokens.erase(m_tokens.begin() + begin + common,
+                       m_tokens.begin() + end);
+    }
+
+    *new_end = begin + temp.size();
+    return true;
+}
+
+/*!
+ * \brief Generate script from tokens
+ *
+ * The output is built in a single buffer that is allocated once.
+ */
+std::string EdifyTokenStream::generate() const
+{
+    std::size_t total = 0;
+    for (const EdifyTokenSlice &t : m_tokens) {
+        total += t.size;
+    }
+
+    std::string output;
+    output.reserve(total);
+
+    for (const EdifyTokenSlice &t : m_tokens) {
+        output.append(t.data, t.size);
+    }
+
+    return output;
+}
+
+void EdifyTokenStream::dump() const
+{
+    for (std::size_t i = 0; i < m_tokens.size(); ++i) {
+        const EdifyTokenSlice &t = m_tokens[i];
+
+        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_type_name(t.type),
+             string(t).c_str());
+    }
+}
+
+std::string EdifyTokenStream::string(const EdifyTokenSlice &token)
+{
+    return std::string(token.data, token.size);
+}
+
+std::string EdifyTokenStream::unescaped_string(const EdifyTokenSlice &token)
+{
+    std::string out;
+    // TODO: Check return value
+    unescape_data(token.data, token.size, &out);
+    if (token.size > 0 && token.data[0] == '"' && out.size() >= 2) {
+        out.pop_back();
+        out.erase(out.begin());
+    }
+    return out;
+}
+
+bool EdifyTokenStream::tokenize_into(const char *data, std::size_t size,
+                                     std::vector<EdifyTokenSlice> *tokens)
+{
+    std::size_t pos = 0;
+
+    // Most tokens in updater-scripts are a few characters long, so this avoids
+    // most reallocations without grossly overallocating
+    tokens->reserve(tokens->size() + size / 4);
+
+    while (pos < size) {
+        EdifyTokenSlice token;
+        std::size_t begin = pos;
+
+        if (!scan_token(data, size, &pos, &token.type)) {
+            return false;
         }
 
-        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_name, t->generate().c_str());
+        token.data = data + begin;
+        token.size = pos - begin;
+        tokens->push_back(token);
+    }
+
+    return true;
+}
+
+const char * EdifyTokenStream::arena_copy(const char *data, std::size_t size)
+{
+    if (m_blocks.empty() || m_block_size - m_block_used < size) {
+        std::size_t block_size = std::max(ARENA_BLOCK_SIZE, size);
+        m_blocks.emplace_back(new char[block_size]);
+        m_block_size = block_size;
+        m_block_used = 0;
+    }
+
+    char *ptr = m_blocks.back().get() + m_block_used;
+    if (size > 0) {
+        std::memcpy(ptr, data, size);
     }
+    m_block_used += size;
+
+    return ptr;
 }
 
 }
@@ -20,9 +20,13 @@
 #include "mbpatcher/patcherconfig.h"
 
 #include <algorithm>
+#include <atomic>
+#include <mutex>
 
 #include <cassert>
 
+#include "mblog/logging.h"
+
 #include "mbpatcher/patcherinterface.h"
 #include "mbpatcher/private/fileutils.h"
 
@@ -43,14 +47,20 @@ namespace patcher
 class PatcherConfigPrivate
 {
 public:
-    // Directories
+    // Directories. These cannot be changed once the config is frozen, so they
+    // can be read from any thread without locking.
+    std::atomic<bool> frozen{false};
     std::string data_dir;
     std::string temp_dir;
+    std::string cache_dir;
 
     // Errors
     ErrorCode error;
 
-    // Created patchers
+    // Created patchers. Patchers may be created and destroyed from several
+    // threads at once (eg. when patching multiple files concurrently and the
+    // patchers create their AutoPatchers).
+    std::mutex alloc_lock;
     std::vector<Patcher *> alloc_patchers;
     std::vector<AutoPatcher *> alloc_auto_patchers;
 };
@@ -60,7 +70,13 @@ public:
  * \class PatcherConfig
  *
  * This is the main interface of the patcher.
- * Blah blah documenting later ;)
+ *
+ * A single config can be shared by any number of concurrent patch jobs. The
+ * directories are set up first and then the config is frozen, either
+ * explicitly with freeze() or implicitly by the first call to one of the
+ * factory functions. After that, the config is read-only, except for the list
+ * of created instances, which is protected by a lock. Each job should own the
+ * instances it creates, preferably via make_patcher() and make_auto_patcher().
  */
 
 PatcherConfig::PatcherConfig() : _priv_ptr(new PatcherConfigPrivate())
@@ -71,15 +87,17 @@ PatcherConfig::~PatcherConfig()
 {
     MB_PRIVATE(PatcherConfig);
 
-    for (Patcher *patcher : priv->alloc_patchers) {
+    // destroy_patcher() removes the patcher from the list, so iterate over a
+    // copy. Patchers may destroy their AutoPatchers, so those go last.
+    auto patchers = priv->alloc_patchers;
+    for (Patcher *patcher : patchers) {
         destroy_patcher(patcher);
     }
-    priv->alloc_patchers.clear();
 
-    for (AutoPatcher *patcher : priv->alloc_auto_patchers) {
+    auto auto_patchers = priv->alloc_auto_patchers;
+    for (AutoPatcher *patcher : auto_patchers) {
         destroy_auto_patcher(patcher);
     }
-    priv->alloc_auto_patchers.clear();
 }
 
 /*!
@@ -125,15 +143,35 @@ std::string PatcherConfig::temp_directory() const
     }
 }
 
+/*!
+ * \brief Get the patch result cache directory
+ *
+ * \return Cache directory or an empty string if caching is disabled
+ */
+std::string PatcherConfig::cache_directory() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->cache_dir;
+}
+
 /*!
  * \brief Set top-level data directory
  *
  * \param path Path to data directory
+ *
+ * \return Whether the directory was set. This fails if the config is frozen.
  */
-void PatcherConfig::set_data_directory(std::string path)
+bool PatcherConfig::set_data_directory(std::string path)
 {
     MB_PRIVATE(PatcherConfig);
+
+    if (priv->frozen) {
+        LOGW("Cannot change data directory of frozen config");
+        return false;
+    }
+
     priv->data_dir = std::move(path);
+    return true;
 }
 
 /*!
@@ -143,11 +181,69 @@ void PatcherConfig::set_data_directory(std::string path)
  *       desired.
  *
  * \param path Path to temporary directory
+ *
+ * \return Whether the directory was set. This fails if the config is frozen.
  */
-void PatcherConfig::set_temp_directory(std::string path)
+bool PatcherConfig::set_temp_directory(std::string path)
 {
     MB_PRIVATE(PatcherConfig);
+
+    if (priv->frozen) {
+        LOGW("Cannot change temp directory of frozen config");
+        return false;
+    }
+
     priv->temp_dir = std::move(path);
+    return true;
+}
+
+/*!
+ * \brief Set the patch result cache directory
+ *
+ * When set, ZipPatcher stores the entries it patched or added for each
+ * combination of input zip, device, ROM ID and patcher version. Patching the
+ * same file again then only needs a raw copy of the input entries and the
+ * cached entries. Caching is disabled by default.
+ *
+ * \param path Path to cache directory or an empty string to disable caching
+ *
+ * \return Whether the directory was set. This fails if the config is frozen.
+ */
+bool PatcherConfig::set_cache_directory(std::string path)
+{
+    MB_PRIVATE(PatcherConfig);
+
+    if (priv->frozen) {
+        LOGW("Cannot change cache directory of frozen config");
+        return false;
+    }
+
+    priv->cache_dir = std::move(path);
+    return true;
+}
+
+/*!
+ * \brief Make the config read-only
+ *
+ * After this is called, the directories can no longer be changed and the
+ * config can be shared between threads. This is called automatically when the
+ * first Patcher or AutoPatcher is created.
+ */
+void PatcherConfig::freeze()
+{
+    MB_PRIVATE(PatcherConfig);
+    priv->frozen = true;
+}
+
+/*!
+ * \brief Check whether the config is read-only
+ *
+ * \return Whether freeze() was called or any instances were created
+ */
+bool PatcherConfig::is_frozen() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->frozen;
 }
 
 /*!
@@ -180,14 +276,19 @@ std::vector<std::string> PatcherConfig::auto_patchers() const
 /*!
  * \brief Create new Patcher
  *
+ * The config is frozen if it is not already. This function is thread safe.
+ *
  * \param id Patcher ID
  *
- * \return New Patcher
+ * \return New Patcher or nullptr if the ID is unknown. The Patcher must be
+ *         destroyed with destroy_patcher().
  */
 Patcher * PatcherConfig::create_patcher(const std::string &id)
 {
     MB_PRIVATE(PatcherConfig);
 
+    freeze();
+
     Patcher *p = nullptr;
 
     if (id == OdinPatcher::Id) {
@@ -199,6 +300,7 @@ Patcher * PatcherConfig::create_patcher(const std::string &id)
     }
 
     if (p != nullptr) {
+        std::lock_guard<std::mutex> lock(priv->alloc_lock);
         priv->alloc_patchers.push_back(p);
     }
 
@@ -208,16 +310,21 @@ Patcher * PatcherConfig::create_patcher(const std::string &id)
 /*!
  * \brief Create new AutoPatcher
  *
+ * The config is frozen if it is not already. This function is thread safe.
+ *
  * \param id AutoPatcher ID
  * \param info FileInfo describing file to be patched
  *
- * \return New AutoPatcher
+ * \return New AutoPatcher or nullptr if the ID is unknown. The AutoPatcher
+ *         must be destroyed with destroy_auto_patcher().
  */
 AutoPatcher * PatcherConfig::create_auto_patcher(const std::string &id,
                                                  const FileInfo * const info)
 {
     MB_PRIVATE(PatcherConfig);
 
+    freeze();
+
     AutoPatcher *ap = nullptr;
 
     if (id == StandardPatcher::Id) {
@@ -227,6 +334,7 @@ AutoPatcher * PatcherConfig::create_auto_patcher(const std::string &id,
     }
 
     if (ap != nullptr) {
+        std::lock_guard<std::mutex> lock(priv->alloc_lock);
         priv->alloc_auto_patchers.push_back(ap);
     }
 
@@ -242,13 +350,19 @@ void PatcherConfig::destroy_patcher(Patcher *patcher)
 {
     MB_PRIVATE(PatcherConfig);
 
-    auto it = std::find(priv->alloc_patchers.begin(),
-                        priv->alloc_patchers.end(),
-                        patcher);
+    {
+        std::lock_guard<std::mutex> lock(priv->alloc_lock);
+
+        auto it = std::find(priv->alloc_patchers.begin(),
+                            priv->alloc_patchers.end(),
+                            patcher);
+
+        assert(it != priv->alloc_patchers.end());
 
-    assert(it != priv->alloc_patchers.end());
+        priv->alloc_patchers.erase(it);
+    }
 
-    priv->alloc_patchers.erase(it);
+    // Not done with the lock held since patchers destroy their AutoPatchers
     delete patcher;
 }
 
@@ -261,15 +375,66 @@ void PatcherConfig::destroy_auto_patcher(AutoPatcher *patcher)
 {
     MB_PRIVATE(PatcherConfig);
 
-    auto it = std::find(priv->alloc_auto_patchers.begin(),
-                        priv->alloc_auto_patchers.end(),
-                        patcher);
+    {
+        std::lock_guard<std::mutex> lock(priv->alloc_lock);
+
+        auto it = std::find(priv->alloc_auto_patchers.begin(),
+                            priv->alloc_auto_patchers.end(),
+                            patcher);
 
-    assert(it != priv->alloc_auto_patchers.end());
+        assert(it != priv->alloc_auto_patchers.end());
+
+        priv->alloc_auto_patchers.erase(it);
+    }
 
-    priv->alloc_auto_patchers.erase(it);
     delete patcher;
 }
 
+/*!
+ * \brief Create new Patcher that is owned by the caller
+ *
+ * This is the same as create_patcher(), except that the Patcher is destroyed
+ * automatically when the returned handle goes out of scope. The handle must
+ * not outlive the config.
+ *
+ * \param id Patcher ID
+ *
+ * \return Handle to new Patcher or an empty handle if the ID is unknown
+ */
+PatcherConfig::PatcherHandle PatcherConfig::make_patcher(const std::string &id)
+{
+    return PatcherHandle(create_patcher(id), PatcherDeleter{this});
+}
+
+/*!
+ * \brief Create new AutoPatcher that is owned by the caller
+ *
+ * This is the same as create_auto_patcher(), except that the AutoPatcher is
+ * destroyed automatically when the returned handle goes out of scope. The
+ * handle must not outlive the config.
+ *
+ * \param id AutoPatcher ID
+ * \param info FileInfo describing file to be patched
+ *
+ * \return Handle to new AutoPatcher or an empty handle if the ID is unknown
+ */
+PatcherConfig::AutoPatcherHandle
+PatcherConfig::make_auto_patcher(const std::string &id,
+                                 const FileInfo * const info)
+{
+    return AutoPatcherHandle(create_auto_patcher(id, info),
+                             AutoPatcherDeleter{this});
+}
+
+void PatcherConfig::PatcherDeleter::operator()(Patcher *patcher) const
+{
+    pc->destroy_patcher(patcher);
+}
+
+void PatcherConfig::AutoPatcherDeleter::operator()(AutoPatcher *patcher) const
+{
+    pc->destroy_auto_patcher(patcher);
+}
+
 }
 }
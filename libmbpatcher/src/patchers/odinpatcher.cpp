@@ -20,10 +20,15 @@
 #include "mbpatcher/patchers/odinpatcher.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <unordered_set>
 
 #include <cassert>
+#include <cctype>
 #include <cinttypes>
 #include <cstring>
 
@@ -35,6 +40,9 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+// OpenSSL
+#include <openssl/md5.h>
+
 #include "mbcommon/locale.h"
 #include "mbcommon/string.h"
 
@@ -46,10 +54,14 @@
 #include "mbpatcher/patchers/zippatcher.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/paralleldeflatewriter.h"
+#include "mbpatcher/private/progressreporter.h"
 #include "mbpatcher/private/stringutils.h"
 
 #if defined(__ANDROID__)
 #  include "mbcommon/file/fd.h"
+#elif defined(_WIN32)
+#  include "mbcommon/file/overlapped.h"
 #else
 #  include "mbcommon/file/standard.h"
 #endif
@@ -64,6 +76,98 @@ namespace mb
 namespace patcher
 {
 
+// Size of each buffer read ahead from the input file
+static constexpr size_t READ_AHEAD_SIZE = 1024 * 1024;
+// Number of buffers the reader thread may get ahead by
+static constexpr size_t READ_AHEAD_COUNT = 8;
+
+// Largest "<md5sum>  <filename>\n" trailer that will be recognized
+static constexpr size_t MD5_TRAILER_MAX_SIZE = 1024;
+
+enum class Md5Result
+{
+    Match,
+    Mismatch,
+    Missing,
+};
+
+/*!
+ * \brief Verify the MD5 trailer of an Odin tarball while it is being read
+ *
+ * Odin tarballs have the MD5 checksum of the tar data appended as a line in
+ * md5sum's format. The last few bytes of the stream are held back until
+ * finish() is called so that the trailer itself is not hashed.
+ */
+class Md5TrailerVerifier
+{
+public:
+    Md5TrailerVerifier()
+    {
+        MD5_Init(&_ctx);
+    }
+
+    void update(const void *data, size_t size)
+    {
+        auto *ptr = static_cast<const unsigned char *>(data);
+
+        if (size >= MD5_TRAILER_MAX_SIZE) {
+            MD5_Update(&_ctx, _tail.data(), _tail.size());
+            MD5_Update(&_ctx, ptr, size - MD5_TRAILER_MAX_SIZE);
+            _tail.assign(ptr + size - MD5_TRAILER_MAX_SIZE, ptr + size);
+            return;
+        }
+
+        _tail.insert(_tail.end(), ptr, ptr + size);
+
+        if (_tail.size() > MD5_TRAILER_MAX_SIZE) {
+            size_t excess = _tail.size() - MD5_TRAILER_MAX_SIZE;
+            MD5_Update(&_ctx, _tail.data(), excess);
+            _tail.erase(_tail.begin(), _tail.begin() + excess);
+        }
+    }
+
+    Md5Result finish()
+    {
+        // The tar data ends with zero padding and the trailer is text
+        size_t start = _tail.size();
+        while (start > 0 && _tail[start - 1] != '\0') {
+            --start;
+        }
+
+        static const char hex[] = "0123456789abcdef";
+        size_t trailer_size = _tail.size() - start;
+
+        if (start == 0 || trailer_size < MD5_DIGEST_LENGTH * 2 + 1
+                || _tail.back() != '\n') {
+            return Md5Result::Missing;
+        }
+
+        const unsigned char *trailer = _tail.data() + start;
+        for (size_t i = 0; i < MD5_DIGEST_LENGTH * 2; ++i) {
+            if (!std::isxdigit(trailer[i])) {
+                return Md5Result::Missing;
+            }
+        }
+
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        MD5_Update(&_ctx, _tail.data(), start);
+        MD5_Final(digest, &_ctx);
+
+        for (size_t i = 0; i < MD5_DIGEST_LENGTH; ++i) {
+            if (std::tolower(trailer[i * 2]) != hex[digest[i] >> 4]
+                    || std::tolower(trailer[i * 2 + 1]) != hex[digest[i] & 0xf]) {
+                return Md5Result::Mismatch;
+            }
+        }
+
+        return Md5Result::Match;
+    }
+
+private:
+    MD5_CTX _ctx;
+    std::vector<unsigned char> _tail;
+};
+
 /*! \cond INTERNAL */
 class OdinPatcherPrivate
 {
@@ -71,7 +175,6 @@ public:
     PatcherConfig *pc;
     const FileInfo *info;
 
-    uint64_t old_bytes;
     uint64_t bytes;
     uint64_t max_bytes;
 
@@ -79,24 +182,40 @@ public:
 
     ErrorCode error;
 
-    unsigned char la_buf[10240];
-#ifdef __ANDROID__
+#if defined(__ANDROID__)
     FdFile la_file;
     int fd = -1;
+#elif defined(_WIN32)
+    // Keeps several requests in flight for each read-ahead buffer
+    OverlappedFile la_file;
 #else
     StandardFile la_file;
 #endif
 
+    // Input read-ahead. The reader thread owns la_file while it is running.
+    std::thread reader;
+    std::mutex reader_mutex;
+    std::condition_variable reader_cv;
+    std::deque<std::vector<unsigned char>> reader_queue;
+    // Buffer most recently passed to libarchive
+    std::vector<unsigned char> reader_buf;
+    bool reader_eof;
+    bool reader_failed;
+    bool reader_stop;
+    bool reader_drain;
+    std::unique_ptr<Md5TrailerVerifier> input_md5;
+
     std::unordered_set<std::string> added_files;
 
     // Callbacks
-    OdinPatcher::ProgressUpdatedCallback progress_cb;
     OdinPatcher::DetailsUpdatedCallback details_cb;
     void *userdata;
+    ProgressReporter reporter;
 
     // Patching
     archive *a_input = nullptr;
     MinizipUtils::ZipCtx *z_output = nullptr;
+    std::unique_ptr<ParallelDeflateWriter> deflater;
 
     bool patch_tar();
 
@@ -107,6 +226,11 @@ public:
     bool open_output_archive();
     bool close_output_archive();
 
+    void read_input();
+    void stop_reader();
+    bool verify_input_checksum();
+    bool check_md5(Md5TrailerVerifier &md5, const char *name);
+
     void update_progress(uint64_t bytes, uint64_t max_bytes);
     void update_details(const std::string &msg);
 
@@ -115,8 +239,6 @@ public:
 
     static la_ssize_t la_read_cb(archive *a, void *userdata,
                                  const void **buffer);
-    static la_int64_t la_skip_cb(archive *a, void *userdata,
-                                 la_int64_t request);
     static int la_open_cb(archive *a, void *userdata);
     static int la_close_cb(archive *a, void *userdata);
 };
@@ -173,17 +295,17 @@ bool OdinPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
     priv->details_cb = details_cb;
     priv->userdata = userdata;
+    priv->reporter.reset(progress_cb, nullptr, userdata);
 
-    priv->old_bytes = 0;
     priv->bytes = 0;
     priv->max_bytes = 0;
 
     bool ret = priv->patch_tar();
 
-    priv->progress_cb = nullptr;
+    priv->reporter.flush();
+    priv->reporter.reset(nullptr, nullptr, nullptr);
     priv->details_cb = nullptr;
     priv->userdata = nullptr;
 
@@ -251,20 +373,11 @@ bool OdinPatcherPrivate::patch_tar()
 
     if (cancelled) return false;
 
-    // Get file size and seek back to original location
-    uint64_t current_pos;
-    if (!la_file.seek(0, SEEK_CUR, &current_pos)
-            || !la_file.seek(0, SEEK_END, &max_bytes)
-            || !la_file.seek(current_pos, SEEK_SET, nullptr)) {
-        LOGE("%s: Failed to seek: %s", info->input_path().c_str(),
-             la_file.error_string().c_str());
-        error = ErrorCode::FileSeekError;
+    if (!process_contents(a_input, 0)) {
         return false;
     }
 
-    if (cancelled) return false;
-
-    if (!process_contents(a_input, 0)) {
+    if (!verify_input_checksum()) {
         return false;
     }
 
@@ -385,45 +498,27 @@ bool OdinPatcherPrivate::process_file(archive *a, archive_entry *entry,
     // Ha! I'll be impressed if a Samsung firmware image does NOT need zip64
     int zip64 = archive_entry_size(entry) > ((1ll << 32) - 1);
 
-    zip_fileinfo zi;
-    memset(&zi, 0, sizeof(zi));
-
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
-
-    // Open file in output zip
-    int mz_ret = zipOpenNewFileInZip2_64(
-        zf,                    // file
-        zip_name.c_str(),      // filename
-        &zi,                   // zip_fileinfo
-        nullptr,               // extrafield_local
-        0,                     // size_extrafield_local
-        nullptr,               // extrafield_global
-        0,                     // size_extrafield_global
-        nullptr,               // comment
-        Z_DEFLATED,            // method
-        Z_DEFAULT_COMPRESSION, // level
-        0,                     // raw
-        zip64                  // zip64
-    );
-    if (mz_ret != ZIP_OK) {
-        LOGE("minizip: Failed to open new file in output zip: %s",
-             MinizipUtils::zip_error_string(mz_ret).c_str());
-        error = ErrorCode::ArchiveWriteHeaderError;
+    // Images are deflated in parallel blocks while libarchive keeps reading
+    // and decompressing the input on this thread
+    ErrorCode ret = deflater->open(zip_name, Z_DEFAULT_COMPRESSION, zip64);
+    if (ret != ErrorCode::NoError) {
+        error = ret;
         return false;
     }
 
     la_ssize_t n_read;
-    char buf[10240];
-    while ((n_read = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        if (cancelled) return false;
+    std::vector<char> buf(256 * 1024);
+    while ((n_read = archive_read_data(a, buf.data(), buf.size())) > 0) {
+        if (cancelled) {
+            deflater->close();
+            return false;
+        }
 
-        mz_ret = zipWriteInFileInZip(zf, buf, n_read);
-        if (mz_ret != ZIP_OK) {
-            LOGE("minizip: Failed to write %s in output zip: %s",
-                 zip_name.c_str(),
-                 MinizipUtils::zip_error_string(mz_ret).c_str());
-            error = ErrorCode::ArchiveWriteDataError;
-            zipCloseFileInZip(zf);
+        ret = deflater->write(buf.data(), static_cast<size_t>(n_read));
+        if (ret != ErrorCode::NoError) {
+            LOGE("Failed to write %s in output zip", zip_name.c_str());
+            error = ret;
+            deflater->close();
             return false;
         }
     }
@@ -432,16 +527,15 @@ bool OdinPatcherPrivate::process_file(archive *a, archive_entry *entry,
         LOGE("libarchive: Failed to read %s: %s",
              name, archive_error_string(a));
         error = ErrorCode::ArchiveReadDataError;
-        zipCloseFileInZip(zf);
+        deflater->close();
         return false;
     }
 
     // Close file in output zip
-    mz_ret = zipCloseFileInZip(zf);
-    if (mz_ret != ZIP_OK) {
-        LOGE("minizip: Failed to close file in output zip: %s",
-             MinizipUtils::zip_error_string(mz_ret).c_str());
-        error = ErrorCode::ArchiveWriteDataError;
+    ret = deflater->close();
+    if (ret != ErrorCode::NoError) {
+        LOGE("Failed to close %s in output zip", zip_name.c_str());
+        error = ret;
         return false;
     }
 
@@ -467,6 +561,7 @@ struct NestedCtx
     archive *nested;
     archive *parent;
     char buf[10240];
+    Md5TrailerVerifier md5;
 
     NestedCtx(archive *a) : nested(archive_read_new()), parent(a)
     {
@@ -545,6 +640,20 @@ bool OdinPatcherPrivate::process_contents(archive *a, int depth)
             if (!process_contents(ctx.nested, depth + 1)) {
                 return false;
             }
+
+            // Hash whatever the tar reader did not consume
+            la_ssize_t n;
+            while ((n = la_nested_read_cb(ctx.nested, &ctx, nullptr)) > 0);
+            if (n < 0) {
+                LOGE("libarchive: Failed to read %s: %s",
+                     name, archive_error_string(a));
+                error = ErrorCode::ArchiveReadDataError;
+                return false;
+            }
+
+            if (!check_md5(ctx.md5, name)) {
+                return false;
+            }
         } else {
             LOGD("%sSkipping unneeded file: %s", indent(depth), name);
 
@@ -582,8 +691,10 @@ bool OdinPatcherPrivate::open_input_archive()
 
     // Our callbacks use the libmbcommon File API, which supports LFS on every
     // platform. Also allows progress info by counting number of bytes read.
+    // There is no skip callback because the whole file is read by the
+    // read-ahead thread anyway
     int ret = archive_read_open2(a_input, this, &la_open_cb, &la_read_cb,
-                                 &la_skip_cb, &la_close_cb);
+                                 nullptr, &la_close_cb);
     if (ret != ARCHIVE_OK) {
         LOGW("libarchive: Failed to open for reading: %s",
              archive_error_string(a_input));
@@ -628,6 +739,9 @@ bool OdinPatcherPrivate::open_output_archive()
         return false;
     }
 
+    deflater.reset(new ParallelDeflateWriter(
+            MinizipUtils::ctx_get_zip_file(z_output)));
+
     return true;
 }
 
@@ -635,6 +749,8 @@ bool OdinPatcherPrivate::close_output_archive()
 {
     assert(z_output != nullptr);
 
+    deflater.reset();
+
     int ret = MinizipUtils::close_output_file(z_output);
     if (ret != ZIP_OK) {
         LOGW("minizip: Failed to close archive: %s",
@@ -648,25 +764,113 @@ bool OdinPatcherPrivate::close_output_archive()
     return true;
 }
 
-void OdinPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
+/*!
+ * \brief Read the input file ahead of libarchive
+ *
+ * Runs on the reader thread. The MD5 checksum of the input is computed here
+ * so that it does not slow down decompression.
+ */
+void OdinPatcherPrivate::read_input()
 {
-    if (progress_cb) {
-        bool should_call = true;
-        if (max_bytes > 0) {
-            // Rate limit... call back only if percentage exceeds 0.01%
-            double old_ratio = (double) old_bytes / max_bytes;
-            double new_ratio = (double) bytes / max_bytes;
-            if (new_ratio - old_ratio < 0.0001) {
-                should_call = false;
-            }
+    while (true) {
+        std::vector<unsigned char> buf(READ_AHEAD_SIZE);
+        size_t n;
+
+        bool ok = la_file.read(buf.data(), buf.size(), n);
+        if (!ok) {
+            LOGE("%s: Failed to read: %s", info->input_path().c_str(),
+                 la_file.error_string().c_str());
+        } else if (n > 0 && input_md5) {
+            input_md5->update(buf.data(), n);
+        }
+
+        std::unique_lock<std::mutex> lock(reader_mutex);
+
+        if (!ok || n == 0) {
+            reader_failed = !ok;
+            reader_eof = true;
+            break;
+        }
+
+        buf.resize(n);
+
+        reader_cv.wait(lock, [&]{
+            return reader_queue.size() < READ_AHEAD_COUNT
+                    || reader_stop || reader_drain;
+        });
+        if (reader_stop) {
+            break;
+        } else if (!reader_drain) {
+            reader_queue.push_back(std::move(buf));
+            reader_cv.notify_all();
         }
-        if (should_call) {
-            progress_cb(bytes, max_bytes, userdata);
-            old_bytes = bytes;
+    }
+
+    reader_cv.notify_all();
+}
+
+void OdinPatcherPrivate::stop_reader()
+{
+    if (reader.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(reader_mutex);
+            reader_stop = true;
         }
+        reader_cv.notify_all();
+        reader.join();
     }
 }
 
+/*!
+ * \brief Finish reading the input and verify its MD5 trailer
+ *
+ * Does nothing unless the input is a .tar.md5 file. Compressed tarballs are
+ * not checked because the trailer covers the uncompressed data.
+ */
+bool OdinPatcherPrivate::verify_input_checksum()
+{
+    if (!input_md5) {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(reader_mutex);
+        reader_drain = true;
+    }
+    reader_cv.notify_all();
+    reader.join();
+
+    if (reader_failed) {
+        error = ErrorCode::FileReadError;
+        return false;
+    }
+
+    return check_md5(*input_md5, info->input_path().c_str());
+}
+
+bool OdinPatcherPrivate::check_md5(Md5TrailerVerifier &md5, const char *name)
+{
+    switch (md5.finish()) {
+    case Md5Result::Match:
+        LOGV("%s: MD5 checksum matches", name);
+        return true;
+    case Md5Result::Missing:
+        LOGW("%s: No MD5 checksum found", name);
+        return true;
+    case Md5Result::Mismatch:
+        LOGE("%s: MD5 checksum does not match", name);
+        error = ErrorCode::ArchiveChecksumError;
+        return false;
+    }
+
+    return false;
+}
+
+void OdinPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
+{
+    reporter.set_bytes(bytes, max_bytes);
+}
+
 void OdinPatcherPrivate::update_details(const std::string &msg)
 {
     if (details_cb) {
@@ -681,9 +885,16 @@ la_ssize_t OdinPatcherPrivate::la_nested_read_cb(archive *a, void *userdata,
 
     NestedCtx *ctx = static_cast<NestedCtx *>(userdata);
 
-    *buffer = ctx->buf;
+    if (buffer) {
+        *buffer = ctx->buf;
+    }
+
+    la_ssize_t n = archive_read_data(ctx->parent, ctx->buf, sizeof(ctx->buf));
+    if (n > 0) {
+        ctx->md5.update(ctx->buf, static_cast<size_t>(n));
+    }
 
-    return archive_read_data(ctx->parent, ctx->buf, sizeof(ctx->buf));
+    return n;
 }
 
 la_ssize_t OdinPatcherPrivate::la_read_cb(archive *a, void *userdata,
@@ -691,37 +902,31 @@ la_ssize_t OdinPatcherPrivate::la_read_cb(archive *a, void *userdata,
 {
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
-    *buffer = priv->la_buf;
-    size_t bytes_read;
-
-    if (!priv->la_file.read(priv->la_buf, sizeof(priv->la_buf), bytes_read)) {
-        LOGE("%s: Failed to read: %s", priv->info->input_path().c_str(),
-             priv->la_file.error_string().c_str());
-        priv->error = ErrorCode::FileReadError;
-        return -1;
-    }
-
-    priv->bytes += bytes_read;
-    priv->update_progress(priv->bytes, priv->max_bytes);
-    return static_cast<la_ssize_t>(bytes_read);
-}
 
-la_int64_t OdinPatcherPrivate::la_skip_cb(archive *a, void *userdata,
-                                          la_int64_t request)
-{
-    (void) a;
-    auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
+    {
+        std::unique_lock<std::mutex> lock(priv->reader_mutex);
+        priv->reader_cv.wait(lock, [&]{
+            return !priv->reader_queue.empty() || priv->reader_eof;
+        });
+
+        if (priv->reader_queue.empty()) {
+            if (priv->reader_failed) {
+                priv->error = ErrorCode::FileReadError;
+                return -1;
+            }
+            return 0;
+        }
 
-    if (!priv->la_file.seek(request, SEEK_CUR, nullptr)) {
-        LOGE("%s: Failed to seek: %s", priv->info->input_path().c_str(),
-             priv->la_file.error_string().c_str());
-        priv->error = ErrorCode::FileSeekError;
-        return -1;
+        priv->reader_buf = std::move(priv->reader_queue.front());
+        priv->reader_queue.pop_front();
     }
+    priv->reader_cv.notify_all();
+
+    *buffer = priv->reader_buf.data();
 
-    priv->bytes += request;
+    priv->bytes += priv->reader_buf.size();
     priv->update_progress(priv->bytes, priv->max_bytes);
-    return request;
+    return static_cast<la_ssize_t>(priv->reader_buf.size());
 }
 
 int OdinPatcherPrivate::la_open_cb(archive *a, void *userdata)
@@ -756,6 +961,31 @@ int OdinPatcherPrivate::la_open_cb(archive *a, void *userdata)
         return -1;
     }
 
+    // Get file size and seek back to original location
+    uint64_t current_pos;
+    if (!priv->la_file.seek(0, SEEK_CUR, &current_pos)
+            || !priv->la_file.seek(0, SEEK_END, &priv->max_bytes)
+            || !priv->la_file.seek(current_pos, SEEK_SET, nullptr)) {
+        LOGE("%s: Failed to seek: %s", priv->info->input_path().c_str(),
+             priv->la_file.error_string().c_str());
+        priv->error = ErrorCode::FileSeekError;
+        return -1;
+    }
+
+    priv->reader_queue.clear();
+    priv->reader_eof = false;
+    priv->reader_failed = false;
+    priv->reader_stop = false;
+    priv->reader_drain = false;
+
+    if (ends_with(priv->info->input_path(), ".tar.md5")) {
+        priv->input_md5.reset(new Md5TrailerVerifier());
+    } else {
+        priv->input_md5.reset();
+    }
+
+    priv->reader = std::thread(&OdinPatcherPrivate::read_input, priv);
+
     return 0;
 }
 
@@ -764,6 +994,8 @@ int OdinPatcherPrivate::la_close_cb(archive *a, void *userdata)
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
 
+    priv->stop_reader();
+
     if (!priv->la_file.close()) {
         LOGE("%s: Failed to close: %s", priv->info->input_path().c_str(),
              priv->la_file.error_string().c_str());
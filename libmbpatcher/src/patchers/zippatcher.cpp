@@ -20,20 +20,28 @@
 #include "mbpatcher/patchers/zippatcher.h"
 
 #include <algorithm>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 
+// OpenSSL
+#include <openssl/sha.h>
+
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
 #include "mblog/logging.h"
-#include "mbpio/delete.h"
+
+#include "mbpio/directory.h"
 
 #include "mbpatcher/patcherconfig.h"
-#include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/parallelzipwriter.h"
+#include "mbpatcher/private/progressreporter.h"
 #include "mbpatcher/private/stringutils.h"
 
 // minizip
@@ -46,7 +54,57 @@ namespace mb
 namespace patcher
 {
 
+// Bump when the cache key or the cache entry layout changes
+static constexpr uint64_t CACHE_FORMAT_VERSION = 1;
+
+// Entry in a cache zip describing how to assemble the output
+static constexpr char CACHE_RECIPE_NAME[] = "mbpatcher-cache-recipe";
+
+// Bump when the bundle key or the bundle layout changes
+static constexpr uint64_t BUNDLE_FORMAT_VERSION = 1;
+
+struct CopySpec
+{
+    std::string source;
+    std::string target;
+};
+
+// One output entry, which is copied raw from either the input zip or the
+// cache zip
+struct CacheStep
+{
+    bool from_input;
+    std::string source;
+    std::string target;
+};
+
 /*! \cond INTERNAL */
+// State for one of the output zips being written from the input zip
+struct ZipOutput
+{
+    const FileInfo *info;
+    MinizipUtils::ZipCtx *z_output = nullptr;
+    // New and patched entries are compressed in parallel
+    std::unique_ptr<ParallelZipWriter> writer;
+    std::vector<AutoPatcher *> auto_patchers;
+    // Files that the AutoPatchers patch in memory while they are copied
+    std::unordered_set<std::string> patched_files;
+    std::vector<CopySpec> to_copy;
+
+    // Patch result cache
+    std::string cache_path;
+    bool cache_hit = false;
+    MinizipUtils::UnzCtx *z_cache = nullptr;
+    MinizipUtils::ArchiveIndex cache_index;
+    std::vector<CacheStep> cache_steps;
+    // Output name -> input name of entries copied unmodified
+    std::unordered_map<std::string, std::string> raw_copies;
+
+    // Precompressed copies of the bundled files
+    MinizipUtils::UnzCtx *z_bundle = nullptr;
+    MinizipUtils::ArchiveIndex bundle_index;
+};
+
 class ZipPatcherPrivate
 {
 public:
@@ -63,26 +121,46 @@ public:
     ErrorCode error;
 
     // Callbacks
-    ZipPatcher::ProgressUpdatedCallback progress_cb;
-    ZipPatcher::FilesUpdatedCallback files_cb;
     ZipPatcher::DetailsUpdatedCallback details_cb;
     void *userdata;
+    ProgressReporter reporter;
 
     // Patching
     MinizipUtils::UnzCtx *z_input = nullptr;
-    MinizipUtils::ZipCtx *z_output = nullptr;
-    std::vector<AutoPatcher *> auto_patchers;
-
+    MinizipUtils::ArchiveIndex input_index;
+    std::vector<ZipOutput> outputs;
+
+    bool patch(const std::vector<const FileInfo *> &infos,
+               ZipPatcher::ProgressUpdatedCallback progress_cb,
+               ZipPatcher::FilesUpdatedCallback files_cb,
+               ZipPatcher::DetailsUpdatedCallback details_cb,
+               void *userdata);
     bool patch_zip();
-
-    bool pass1(const std::string &temporary_dir,
-               const std::unordered_set<std::string> &exclude);
-    bool pass2(const std::string &temporary_dir,
-               const std::unordered_set<std::string> &files);
+    void cleanup();
+
+    bool create_auto_patchers(ZipOutput &out);
+    std::vector<CopySpec> bundled_files(const FileInfo *info) const;
+    bool add_new_files(ZipOutput &out);
+
+    std::string bundle_key(const std::vector<CopySpec> &to_copy) const;
+    bool load_bundle(ZipOutput &out);
+    bool write_bundle(const std::vector<CopySpec> &to_copy,
+                      const std::string &path);
+    bool add_bundled_files(ZipOutput &out);
+
+    std::string cache_key(const ZipOutput &out) const;
+    bool load_cache(ZipOutput &out);
+    bool apply_cache(ZipOutput &out);
+    bool write_cache(const ZipOutput &out, const std::string &path);
+    void store_cache(const ZipOutput &out);
+
+    bool copy_entries(const std::vector<ZipOutput *> &targets);
+    bool patch_entry(ZipOutput &out, const std::string &name,
+                     std::string &contents);
     bool open_input_archive();
     void close_input_archive();
-    bool open_output_archive();
-    void close_output_archive();
+    bool open_output_archive(ZipOutput &out);
+    void close_output_archive(ZipOutput &out);
 
     void update_progress(uint64_t bytes, uint64_t maxBytes);
     void update_files(uint64_t files, uint64_t maxFiles);
@@ -136,100 +214,262 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
                             void *userdata)
 {
     MB_PRIVATE(ZipPatcher);
-    priv->cancelled = false;
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
-    priv->files_cb = files_cb;
-    priv->details_cb = details_cb;
-    priv->userdata = userdata;
-
-    priv->bytes = 0;
-    priv->max_bytes = 0;
-    priv->files = 0;
-    priv->max_files = 0;
+    return priv->patch({ priv->info }, progress_cb, files_cb, details_cb,
+                       userdata);
+}
 
-    bool ret = priv->patch_zip();
+/*!
+ * \brief Patch one input zip into several output zips
+ *
+ * The input zip is only read once. Entries that are not patched are copied to
+ * every output zip from the same read. Each output zip gets its own patched
+ * files, info.prop, and device.json.
+ *
+ * If any output zip fails, the whole batch fails.
+ */
+bool ZipPatcher::patch_file_multi(const std::vector<const FileInfo *> &infos,
+                                  ProgressUpdatedCallback progress_cb,
+                                  FilesUpdatedCallback files_cb,
+                                  DetailsUpdatedCallback details_cb,
+                                  void *userdata)
+{
+    MB_PRIVATE(ZipPatcher);
 
-    priv->progress_cb = nullptr;
-    priv->files_cb = nullptr;
-    priv->details_cb = nullptr;
-    priv->userdata = nullptr;
+    assert(!infos.empty());
 
-    for (auto *p : priv->auto_patchers) {
-        priv->pc->destroy_auto_patcher(p);
+    for (auto const *i : infos) {
+        if (i->input_path() != infos[0]->input_path()) {
+            LOGE("All outputs must be patched from the same input: %s != %s",
+                 i->input_path().c_str(), infos[0]->input_path().c_str());
+            priv->error = ErrorCode::ArchiveReadOpenError;
+            return false;
+        }
     }
-    priv->auto_patchers.clear();
 
-    if (priv->z_input != nullptr) {
-        priv->close_input_archive();
-    }
-    if (priv->z_output != nullptr) {
-        priv->close_output_archive();
+    return priv->patch(infos, progress_cb, files_cb, details_cb, userdata);
+}
+
+bool ZipPatcherPrivate::patch(const std::vector<const FileInfo *> &infos,
+                              ZipPatcher::ProgressUpdatedCallback progress_cb,
+                              ZipPatcher::FilesUpdatedCallback files_cb,
+                              ZipPatcher::DetailsUpdatedCallback details_cb,
+                              void *userdata)
+{
+    cancelled = false;
+
+    this->details_cb = details_cb;
+    this->userdata = userdata;
+    reporter.reset(progress_cb, files_cb, userdata);
+
+    bytes = 0;
+    max_bytes = 0;
+    files = 0;
+    max_files = 0;
+
+    outputs.clear();
+    outputs.resize(infos.size());
+    for (size_t i = 0; i < infos.size(); ++i) {
+        outputs[i].info = infos[i];
     }
 
-    if (priv->cancelled) {
-        priv->error = ErrorCode::PatchingCancelled;
+    bool ret = patch_zip();
+
+    reporter.flush();
+    reporter.reset(nullptr, nullptr, nullptr);
+    this->details_cb = nullptr;
+    this->userdata = nullptr;
+
+    cleanup();
+
+    if (cancelled) {
+        error = ErrorCode::PatchingCancelled;
+        outputs.clear();
         return false;
     }
 
+    // The outputs must be complete before their entries can be cached
+    if (ret) {
+        for (auto const &out : outputs) {
+            if (!out.cache_path.empty() && !out.cache_hit) {
+                store_cache(out);
+            }
+        }
+    }
+    outputs.clear();
+
     return ret;
 }
 
-struct CopySpec
+void ZipPatcherPrivate::cleanup()
 {
-    std::string source;
-    std::string target;
-};
+    for (auto &out : outputs) {
+        for (auto *p : out.auto_patchers) {
+            pc->destroy_auto_patcher(p);
+        }
+        out.auto_patchers.clear();
+
+        if (out.z_output != nullptr) {
+            close_output_archive(out);
+        }
+        if (out.z_cache != nullptr) {
+            MinizipUtils::close_input_file(out.z_cache);
+            out.z_cache = nullptr;
+        }
+        if (out.z_bundle != nullptr) {
+            MinizipUtils::close_input_file(out.z_bundle);
+            out.z_bundle = nullptr;
+        }
+    }
+
+    if (z_input != nullptr) {
+        close_input_archive();
+    }
+    input_index = MinizipUtils::ArchiveIndex();
+}
 
 bool ZipPatcherPrivate::patch_zip()
 {
-    std::unordered_set<std::string> exclude_from_pass1;
+    for (auto &out : outputs) {
+        if (!create_auto_patchers(out)) {
+            return false;
+        }
+    }
 
-    auto *standard_ap = pc->create_auto_patcher("StandardPatcher", info);
-    if (!standard_ap) {
-        error = ErrorCode::AutoPatcherCreateError;
+    if (cancelled) return false;
+
+    // The central directory is only read once. Both the statistics and the
+    // copying of entries use the index.
+    if (!open_input_archive()) {
         return false;
     }
 
-    auto *mount_cmd_ap = pc->create_auto_patcher("MountCmdPatcher", info);
-    if (!mount_cmd_ap) {
-        error = ErrorCode::AutoPatcherCreateError;
+    unzFile uf = MinizipUtils::ctx_get_unz_file(z_input);
+
+    if (!MinizipUtils::build_index(uf, &input_index)) {
+        error = ErrorCode::ArchiveReadHeaderError;
         return false;
     }
 
-    auto_patchers.push_back(standard_ap);
-    auto_patchers.push_back(mount_cmd_ap);
+    MinizipUtils::ArchiveStats stats;
+    MinizipUtils::index_stats(input_index, &stats, {});
+
+    if (cancelled) return false;
 
-    for (auto *ap : auto_patchers) {
-        // AutoPatcher files should be excluded from the first pass
-        for (auto const &file : ap->existing_files()) {
-            exclude_from_pass1.insert(file);
+    // Outputs that are not in the cache share a single pass over the input
+    std::vector<ZipOutput *> pending;
+    std::vector<ZipOutput *> cached;
+
+    for (auto &out : outputs) {
+        out.to_copy = bundled_files(out.info);
+
+        if (!pc->cache_directory().empty()) {
+            out.cache_path = pc->cache_directory();
+            out.cache_path += "/";
+            out.cache_path += cache_key(out);
+            out.cache_path += ".zip";
+
+            if (load_cache(out)) {
+                LOGD("Using cached patch result: %s", out.cache_path.c_str());
+                cached.push_back(&out);
+                continue;
+            }
         }
+
+        pending.push_back(&out);
     }
 
-    // Unlike the old patcher, we'll write directly to the new file
-    if (!open_output_archive()) {
-        return false;
+    max_bytes = stats.total_size * (cached.size() + !pending.empty());
+    if (!pending.empty()) {
+        max_files = stats.files;
+    }
+    for (ZipOutput *out : pending) {
+        // +1 for info.prop
+        // +1 for device.json
+        max_files += out->to_copy.size() + 2;
+    }
+    for (ZipOutput *out : cached) {
+        max_files += out->cache_steps.size();
+    }
+    update_files(files, max_files);
+
+    for (ZipOutput *out : cached) {
+        if (!open_output_archive(*out) || !apply_cache(*out)) {
+            return false;
+        }
+        close_output_archive(*out);
+    }
+
+    if (pending.empty()) {
+        return true;
     }
 
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+    // Unlike the old patcher, we'll write directly to the new files
+    for (ZipOutput *out : pending) {
+        if (!open_output_archive(*out)) {
+            return false;
+        }
+
+        out->writer.reset(new ParallelZipWriter(
+                MinizipUtils::ctx_get_zip_file(out->z_output)));
+    }
 
     if (cancelled) return false;
 
-    MinizipUtils::ArchiveStats stats;
-    auto result = MinizipUtils::archive_stats(info->input_path(), &stats,
-                                              std::vector<std::string>());
-    if (result != ErrorCode::NoError) {
-        error = result;
+    if (!copy_entries(pending)) {
         return false;
     }
 
-    max_bytes = stats.total_size;
+    for (ZipOutput *out : pending) {
+        if (load_bundle(*out)) {
+            LOGD("Using precompressed bundle for %s",
+                 out->info->output_path().c_str());
+        }
+
+        if (!add_new_files(*out)) {
+            return false;
+        }
+    }
 
     if (cancelled) return false;
 
+    return true;
+}
+
+bool ZipPatcherPrivate::create_auto_patchers(ZipOutput &out)
+{
+    auto *standard_ap = pc->create_auto_patcher("StandardPatcher", out.info);
+    if (!standard_ap) {
+        error = ErrorCode::AutoPatcherCreateError;
+        return false;
+    }
+    out.auto_patchers.push_back(standard_ap);
+
+    auto *mount_cmd_ap = pc->create_auto_patcher("MountCmdPatcher", out.info);
+    if (!mount_cmd_ap) {
+        error = ErrorCode::AutoPatcherCreateError;
+        return false;
+    }
+    out.auto_patchers.push_back(mount_cmd_ap);
+
+    for (auto *ap : out.auto_patchers) {
+        // AutoPatcher files are patched in memory while they are copied
+        for (auto const &file : ap->existing_files()) {
+            out.patched_files.insert(file);
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Files from the data directory that are added to the output zip
+ */
+std::vector<CopySpec> ZipPatcherPrivate::bundled_files(
+        const FileInfo *info) const
+{
     std::string arch_dir(pc->data_directory());
     arch_dir += "/binaries/android/";
     arch_dir += info->device().architecture();
@@ -266,46 +506,43 @@ bool ZipPatcherPrivate::patch_zip()
                           "multiboot/binaries/" + binary});
     }
 
-    // +1 for info.prop
-    // +1 for device.json
-    max_files = stats.files + to_copy.size() + 2;
-    update_files(files, max_files);
-
-    if (!open_input_archive()) {
-        return false;
-    }
-
-    // Create temporary dir for extracted files for autopatchers
-    std::string temp_dir =
-            FileUtils::create_temporary_dir(pc->temp_directory());
-
-    if (!pass1(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
-        return false;
-    }
-
-    if (cancelled) return false;
-
-    // On the second pass, run the autopatchers on the rest of the files
-
-    if (!pass2(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
-        return false;
-    }
-
-    io::deleteRecursively(temp_dir);
-
-    for (const CopySpec &spec : to_copy) {
-        if (cancelled) return false;
+    return to_copy;
+}
 
-        update_files(++files, max_files);
-        update_details(spec.target);
+/*!
+ * \brief Add the bundled files, info.prop, and device.json to an output zip
+ */
+bool ZipPatcherPrivate::add_new_files(ZipOutput &out)
+{
+    ParallelZipWriter &writer = *out.writer;
+    ErrorCode result;
 
-        result = MinizipUtils::add_file(zf, spec.target, spec.source);
+    if (out.z_bundle) {
+        // Entries that are still being compressed must be written first
+        result = writer.flush();
         if (result != ErrorCode::NoError) {
             error = result;
             return false;
         }
+
+        if (!add_bundled_files(out)) {
+            return false;
+        }
+    } else {
+        for (const CopySpec &spec : out.to_copy) {
+            if (cancelled) return false;
+
+            update_files(++files, max_files);
+            update_details(spec.target);
+
+            result = writer.add_file(
+                    spec.target, spec.source,
+                    ParallelZipWriter::compression_level(spec.target));
+            if (result != ErrorCode::NoError) {
+                error = result;
+                return false;
+            }
+        }
     }
 
     if (cancelled) return false;
@@ -314,10 +551,11 @@ bool ZipPatcherPrivate::patch_zip()
     update_details("multiboot/info.prop");
 
     const std::string info_prop =
-            ZipPatcher::create_info_prop(pc, info->rom_id(), false);
-    result = MinizipUtils::add_file(
-            zf, "multiboot/info.prop",
-            std::vector<unsigned char>(info_prop.begin(), info_prop.end()));
+            ZipPatcher::create_info_prop(pc, out.info->rom_id(), false);
+    result = writer.add_file(
+            "multiboot/info.prop",
+            std::vector<unsigned char>(info_prop.begin(), info_prop.end()),
+            Z_DEFAULT_COMPRESSION);
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
@@ -329,51 +567,51 @@ bool ZipPatcherPrivate::patch_zip()
     update_details("multiboot/device.json");
 
     std::string json;
-    if (!device::device_to_json(info->device(), json)) {
+    if (!device::device_to_json(out.info->device(), json)) {
         error = ErrorCode::MemoryAllocationError;
         return false;
     }
 
-    result = MinizipUtils::add_file(
-            zf, "multiboot/device.json",
-            std::vector<unsigned char>(json.begin(), json.end()));
+    result = writer.add_file(
+            "multiboot/device.json",
+            std::vector<unsigned char>(json.begin(), json.end()),
+            Z_DEFAULT_COMPRESSION);
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
     }
 
-    if (cancelled) return false;
+    result = writer.flush();
+    if (result != ErrorCode::NoError) {
+        error = result;
+        return false;
+    }
 
     return true;
 }
 
 /*!
- * \brief First pass of patching operation
+ * \brief Copy entries from the input zip to the output zips
  *
- * This performs the following operations:
+ * This performs the following operations for each entry in the central
+ * directory index:
  *
- * - Files needed by an AutoPatcher are extracted to the temporary directory.
- * - Otherwise, the file is copied directly to the output zip.
+ * - Files needed by an AutoPatcher are read into memory once, patched
+ *   separately for each output zip, and added to the output zips.
+ * - Otherwise, the file is copied directly to every output zip from a single
+ *   read of its raw data.
  */
-bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
-                              const std::unordered_set<std::string> &exclude)
+bool ZipPatcherPrivate::copy_entries(const std::vector<ZipOutput *> &targets)
 {
     unzFile uf = MinizipUtils::ctx_get_unz_file(z_input);
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
-
-    int ret = unzGoToFirstFile(uf);
-    if (ret != UNZ_OK) {
-        error = ErrorCode::ArchiveReadHeaderError;
-        return false;
-    }
+    std::vector<zipFile> raw_targets;
 
-    do {
+    for (auto const &entry : input_index.entries) {
         if (cancelled) return false;
 
-        unz_file_info64 fi;
-        std::string cur_file;
+        const std::string &cur_file = entry.name;
 
-        if (!MinizipUtils::get_info(uf, &fi, &cur_file)) {
+        if (!MinizipUtils::go_to_entry(uf, entry)) {
             error = ErrorCode::ArchiveReadHeaderError;
             return false;
         }
@@ -381,32 +619,67 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
         update_files(++files, max_files);
         update_details(cur_file);
 
-        // Skip files that should be patched and added in pass 2
-        if (exclude.find(cur_file) != exclude.end()) {
-            if (!MinizipUtils::extract_file(uf, temporary_dir)) {
-                error = ErrorCode::ArchiveReadDataError;
-                return false;
-            }
-            continue;
+        bool needs_patching = std::any_of(
+                targets.begin(), targets.end(), [&](const ZipOutput *out) {
+                    return out->patched_files.find(cur_file)
+                            != out->patched_files.end();
+                });
+        std::vector<unsigned char> data;
+
+        if (needs_patching && !MinizipUtils::read_to_memory(
+                uf, &data, &la_progress_cb, this)) {
+            error = ErrorCode::ArchiveReadDataError;
+            return false;
         }
 
         // Rename the installer for mbtool
-        if (cur_file == "META-INF/com/google/android/update-binary") {
-            cur_file = "META-INF/com/google/android/update-binary.orig";
+        std::string name = cur_file;
+        if (name == "META-INF/com/google/android/update-binary") {
+            name = "META-INF/com/google/android/update-binary.orig";
+        }
+
+        raw_targets.clear();
+
+        for (ZipOutput *out : targets) {
+            ErrorCode result;
+
+            if (out->patched_files.find(cur_file) != out->patched_files.end()) {
+                std::string contents(data.begin(), data.end());
+
+                if (!patch_entry(*out, cur_file, contents)) {
+                    return false;
+                }
+
+                // TODO Headers are being discarded
+                result = out->writer->add_file(
+                        name, std::vector<unsigned char>(
+                                contents.begin(), contents.end()),
+                        ParallelZipWriter::compression_level(name));
+            } else {
+                // Keep the entries in their original order
+                result = out->writer->flush();
+
+                raw_targets.push_back(
+                        MinizipUtils::ctx_get_zip_file(out->z_output));
+                out->raw_copies[name] = cur_file;
+            }
+
+            if (result != ErrorCode::NoError) {
+                error = result;
+                return false;
+            }
         }
 
-        if (!MinizipUtils::copy_file_raw(uf, zf, cur_file, &la_progress_cb, this)) {
-            LOGW("minizip: Failed to copy raw data: %s", cur_file.c_str());
+        // The entry's progress was already reported if it was read into memory
+        if (!raw_targets.empty() && !MinizipUtils::copy_file_raw(
+                uf, raw_targets, name,
+                needs_patching ? nullptr : &la_progress_cb, this)) {
+            LOGW("minizip: Failed to copy raw data: %s", name.c_str());
             error = ErrorCode::ArchiveWriteDataError;
             return false;
         }
 
-        bytes += fi.uncompressed_size;
-    } while ((ret = unzGoToNextFile(uf)) == UNZ_OK);
-
-    if (ret != UNZ_END_OF_LIST_OF_FILE) {
-        error = ErrorCode::ArchiveReadHeaderError;
-        return false;
+        bytes += entry.info.uncompressed_size;
     }
 
     if (cancelled) return false;
@@ -414,55 +687,465 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
     return true;
 }
 
+static void hash_u64(SHA256_CTX *ctx, uint64_t value)
+{
+    SHA256_Update(ctx, &value, sizeof(value));
+}
+
+// Length-prefixed so that adjacent fields cannot run into each other
+static void hash_string(SHA256_CTX *ctx, const std::string &str)
+{
+    hash_u64(ctx, str.size());
+    SHA256_Update(ctx, str.data(), str.size());
+}
+
+static std::string hash_hex_digest(SHA256_CTX *ctx)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, ctx);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string key;
+    for (unsigned char c : digest) {
+        key += hex[c >> 4];
+        key += hex[c & 0xf];
+    }
+    return key;
+}
+
 /*!
- * \brief Second pass of patching operation
+ * \brief Compute the cache key for an output zip
  *
- * This performs the following operations:
+ * The input zip is identified by the names, CRC32s and sizes in its central
+ * directory, which avoids reading the whole file. The device is identified by
+ * its JSON representation.
  *
- * - Patch files in the temporary directory using the AutoPatchers and add the
- *   resulting files to the output zip
+ * \return Hex-encoded SHA-256 digest
  */
-bool ZipPatcherPrivate::pass2(const std::string &temporary_dir,
-                              const std::unordered_set<std::string> &files)
+std::string ZipPatcherPrivate::cache_key(const ZipOutput &out) const
 {
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
 
-    for (auto *ap : auto_patchers) {
-        if (cancelled) return false;
-        if (!ap->patch_files(temporary_dir)) {
-            error = ap->error();
+    hash_u64(&ctx, CACHE_FORMAT_VERSION);
+    hash_string(&ctx, version());
+    hash_string(&ctx, out.info->rom_id());
+
+    std::string json;
+    if (device::device_to_json(out.info->device(), json)) {
+        hash_string(&ctx, json);
+    }
+
+    // Catches rebuilt binaries that did not change the version number
+    for (const CopySpec &spec : out.to_copy) {
+        uint32_t dos_date = 0;
+        MinizipUtils::get_file_time(spec.source, &dos_date);
+        hash_string(&ctx, spec.target);
+        hash_u64(&ctx, dos_date);
+    }
+
+    hash_u64(&ctx, input_index.entries.size());
+    for (auto const &entry : input_index.entries) {
+        hash_string(&ctx, entry.name);
+        hash_u64(&ctx, entry.info.crc);
+        hash_u64(&ctx, entry.info.compression_method);
+        hash_u64(&ctx, entry.info.compressed_size);
+        hash_u64(&ctx, entry.info.uncompressed_size);
+    }
+
+    return hash_hex_digest(&ctx);
+}
+
+/*!
+ * \brief Compute the key of the precompressed bundle for a set of files
+ *
+ * Outputs for devices with the same architecture share a bundle.
+ *
+ * \return Hex-encoded SHA-256 digest
+ */
+std::string ZipPatcherPrivate::bundle_key(
+        const std::vector<CopySpec> &to_copy) const
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+
+    hash_u64(&ctx, BUNDLE_FORMAT_VERSION);
+    hash_string(&ctx, version());
+
+    hash_u64(&ctx, to_copy.size());
+    for (const CopySpec &spec : to_copy) {
+        uint32_t dos_date = 0;
+        MinizipUtils::get_file_time(spec.source, &dos_date);
+        hash_string(&ctx, spec.source);
+        hash_string(&ctx, spec.target);
+        hash_u64(&ctx, dos_date);
+    }
+
+    return hash_hex_digest(&ctx);
+}
+
+/*!
+ * \brief Open the precompressed bundle for an output zip, creating it if
+ *        needed
+ *
+ * The bundle is a zip in the cache directory containing every bundled file,
+ * compressed the same way as add_new_files() would, under its output name.
+ * The entries, along with their CRC32s and sizes, are copied raw into the
+ * output zip, so the binaries are only compressed once per build.
+ *
+ * Failures are not fatal. The files are compressed normally instead.
+ *
+ * \return Whether a valid bundle was opened
+ */
+bool ZipPatcherPrivate::load_bundle(ZipOutput &out)
+{
+    if (pc->cache_directory().empty()) {
+        return false;
+    }
+
+    std::string path(pc->cache_directory());
+    path += "/bundle-";
+    path += bundle_key(out.to_copy);
+    path += ".zip";
+
+    MinizipUtils::UnzCtx *ctx = MinizipUtils::open_input_file(path);
+
+    if (!ctx) {
+        if (!io::createDirectories(pc->cache_directory())) {
+            return false;
+        }
+
+        // Write to a temporary file so that a partial bundle is never used
+        std::string temp_path = path + ".tmp";
+
+        if (!write_bundle(out.to_copy, temp_path)
+                || rename(temp_path.c_str(), path.c_str()) != 0) {
+            LOGW("%s: Failed to write bundle", path.c_str());
+            remove(temp_path.c_str());
+            return false;
+        }
+
+        LOGD("Stored precompressed bundle: %s", path.c_str());
+
+        ctx = MinizipUtils::open_input_file(path);
+        if (!ctx) {
             return false;
         }
     }
 
-    // TODO Headers are being discarded
+    unzFile uf = MinizipUtils::ctx_get_unz_file(ctx);
+    bool valid = MinizipUtils::build_index(uf, &out.bundle_index);
 
-    for (auto const &file : files) {
+    for (auto it = out.to_copy.begin(); valid && it != out.to_copy.end();
+            ++it) {
+        valid = MinizipUtils::find_entry(out.bundle_index, it->target)
+                != nullptr;
+    }
+
+    if (!valid) {
+        LOGW("%s: Ignoring invalid bundle", path.c_str());
+        MinizipUtils::close_input_file(ctx);
+        remove(path.c_str());
+        out.bundle_index = MinizipUtils::ArchiveIndex();
+        return false;
+    }
+
+    out.z_bundle = ctx;
+    return true;
+}
+
+/*!
+ * \brief Compress the bundled files into a new bundle at \p path
+ */
+bool ZipPatcherPrivate::write_bundle(const std::vector<CopySpec> &to_copy,
+                                     const std::string &path)
+{
+    MinizipUtils::ZipCtx *ctx = MinizipUtils::open_output_file(path);
+    if (!ctx) {
+        return false;
+    }
+
+    bool ret = true;
+
+    {
+        ParallelZipWriter writer(MinizipUtils::ctx_get_zip_file(ctx));
+
+        for (auto it = to_copy.begin(); ret && it != to_copy.end(); ++it) {
+            ret = writer.add_file(
+                    it->target, it->source,
+                    ParallelZipWriter::compression_level(it->target))
+                    == ErrorCode::NoError;
+        }
+
+        if (ret) {
+            ret = writer.flush() == ErrorCode::NoError;
+        }
+    }
+
+    if (MinizipUtils::close_output_file(ctx) != ZIP_OK) {
+        ret = false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Copy the bundled files into an output zip from its bundle
+ */
+bool ZipPatcherPrivate::add_bundled_files(ZipOutput &out)
+{
+    unzFile uf = MinizipUtils::ctx_get_unz_file(out.z_bundle);
+    zipFile zf = MinizipUtils::ctx_get_zip_file(out.z_output);
+
+    for (const CopySpec &spec : out.to_copy) {
         if (cancelled) return false;
 
-        ErrorCode ret;
+        update_files(++files, max_files);
+        update_details(spec.target);
+
+        auto const *entry = MinizipUtils::find_entry(out.bundle_index,
+                                                     spec.target);
+
+        if (!MinizipUtils::go_to_entry(uf, *entry)) {
+            error = ErrorCode::ArchiveReadHeaderError;
+            return false;
+        }
+
+        if (!MinizipUtils::copy_file_raw(uf, zf, spec.target,
+                                         nullptr, nullptr)) {
+            LOGW("minizip: Failed to copy raw data: %s", spec.target.c_str());
+            error = ErrorCode::ArchiveWriteDataError;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool parse_recipe(const std::string &recipe,
+                         std::vector<CacheStep> *steps)
+{
+    std::vector<CacheStep> result;
 
-        if (file == "META-INF/com/google/android/update-binary") {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    "META-INF/com/google/android/update-binary.orig",
-                      temporary_dir + "/" + file);
+    for (auto const &line : StringUtils::split(recipe, '\n')) {
+        if (line.empty()) {
+            continue;
+        }
+
+        auto fields = StringUtils::split(line, '\t');
+        if (fields.size() == 3 && fields[0] == "I") {
+            result.push_back({ true, fields[1], fields[2] });
+        } else if (fields.size() == 2 && fields[0] == "C") {
+            result.push_back({ false, fields[1], fields[1] });
         } else {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    file,
-                      temporary_dir + "/" + file);
+            return false;
         }
+    }
 
-        if (ret == ErrorCode::FileOpenError) {
-            LOGW("File does not exist in temporary directory: %s", file.c_str());
-        } else if (ret != ErrorCode::NoError) {
-            error = ret;
+    steps->swap(result);
+    return true;
+}
+
+/*!
+ * \brief Open the cache entry for an output zip
+ *
+ * Nothing is written to the output zip, so patching can fall back to the
+ * normal path if this fails.
+ *
+ * \return Whether a valid cache entry exists
+ */
+bool ZipPatcherPrivate::load_cache(ZipOutput &out)
+{
+    MinizipUtils::UnzCtx *cache_ctx =
+            MinizipUtils::open_input_file(out.cache_path);
+    if (!cache_ctx) {
+        return false;
+    }
+
+    unzFile cache_uf = MinizipUtils::ctx_get_unz_file(cache_ctx);
+    std::vector<unsigned char> recipe;
+    MinizipUtils::ArchiveIndex *index = &out.cache_index;
+    std::vector<CacheStep> *steps = &out.cache_steps;
+    bool valid = MinizipUtils::build_index(cache_uf, index);
+
+    if (valid) {
+        auto const *entry = MinizipUtils::find_entry(*index, CACHE_RECIPE_NAME);
+        valid = entry
+                && MinizipUtils::go_to_entry(cache_uf, *entry)
+                && MinizipUtils::read_to_memory(cache_uf, &recipe,
+                                                nullptr, nullptr)
+                && parse_recipe(std::string(recipe.begin(), recipe.end()),
+                                steps);
+    }
+
+    // Every referenced entry must exist before anything is copied
+    for (auto it = steps->begin(); valid && it != steps->end(); ++it) {
+        valid = MinizipUtils::find_entry(
+                it->from_input ? input_index : *index, it->source) != nullptr;
+    }
+
+    if (!valid) {
+        LOGW("%s: Ignoring invalid cache entry", out.cache_path.c_str());
+        MinizipUtils::close_input_file(cache_ctx);
+        remove(out.cache_path.c_str());
+        out.cache_index = MinizipUtils::ArchiveIndex();
+        steps->clear();
+        return false;
+    }
+
+    out.z_cache = cache_ctx;
+    out.cache_hit = true;
+    return true;
+}
+
+/*!
+ * \brief Assemble the output zip from the input zip and a cache entry
+ *
+ * Every entry is copied raw, so nothing is recompressed or patched.
+ */
+bool ZipPatcherPrivate::apply_cache(ZipOutput &out)
+{
+    unzFile input_uf = MinizipUtils::ctx_get_unz_file(z_input);
+    unzFile cache_uf = MinizipUtils::ctx_get_unz_file(out.z_cache);
+    zipFile zf = MinizipUtils::ctx_get_zip_file(out.z_output);
+
+    for (const CacheStep &step : out.cache_steps) {
+        if (cancelled) return false;
+
+        update_files(++files, max_files);
+        update_details(step.target);
+
+        unzFile uf = step.from_input ? input_uf : cache_uf;
+        auto const *entry = MinizipUtils::find_entry(
+                step.from_input ? input_index : out.cache_index, step.source);
+
+        if (!MinizipUtils::go_to_entry(uf, *entry)) {
+            error = ErrorCode::ArchiveReadHeaderError;
+            return false;
+        }
+
+        if (!MinizipUtils::copy_file_raw(uf, zf, step.target,
+                                         &la_progress_cb, this)) {
+            LOGW("minizip: Failed to copy raw data: %s", step.target.c_str());
+            error = ErrorCode::ArchiveWriteDataError;
             return false;
         }
+
+        if (step.from_input) {
+            bytes += entry->info.uncompressed_size;
+        }
     }
 
-    if (cancelled) return false;
+    return true;
+}
+
+/*!
+ * \brief Write the cache entry for the output zip to \p path
+ *
+ * The cache zip contains the entries that were not copied from the input zip
+ * and a recipe listing every output entry in order.
+ */
+bool ZipPatcherPrivate::write_cache(const ZipOutput &out,
+                                    const std::string &path)
+{
+    MinizipUtils::UnzCtx *out_ctx =
+            MinizipUtils::open_input_file(out.info->output_path());
+    if (!out_ctx) {
+        return false;
+    }
+
+    MinizipUtils::ZipCtx *cache_ctx = MinizipUtils::open_output_file(path);
+    if (!cache_ctx) {
+        MinizipUtils::close_input_file(out_ctx);
+        return false;
+    }
+
+    unzFile out_uf = MinizipUtils::ctx_get_unz_file(out_ctx);
+    zipFile cache_zf = MinizipUtils::ctx_get_zip_file(cache_ctx);
+    MinizipUtils::ArchiveIndex out_index;
+    std::string recipe;
+
+    bool ret = MinizipUtils::build_index(out_uf, &out_index);
+
+    for (auto it = out_index.entries.begin();
+            ret && it != out_index.entries.end(); ++it) {
+        if (it->name.find_first_of("\t\n") != std::string::npos) {
+            ret = false;
+            break;
+        }
+
+        auto raw = out.raw_copies.find(it->name);
+        if (raw != out.raw_copies.end()) {
+            recipe += "I\t" + raw->second + "\t" + it->name + "\n";
+        } else {
+            recipe += "C\t" + it->name + "\n";
+            ret = MinizipUtils::go_to_entry(out_uf, *it)
+                    && MinizipUtils::copy_file_raw(out_uf, cache_zf, it->name,
+                                                   nullptr, nullptr);
+        }
+    }
+
+    if (ret) {
+        ret = MinizipUtils::add_file(
+                cache_zf, CACHE_RECIPE_NAME,
+                std::vector<unsigned char>(recipe.begin(), recipe.end()))
+                == ErrorCode::NoError;
+    }
+
+    if (MinizipUtils::close_output_file(cache_ctx) != ZIP_OK) {
+        ret = false;
+    }
+    MinizipUtils::close_input_file(out_ctx);
+
+    return ret;
+}
+
+/*!
+ * \brief Save the patched and new entries of the output zip to the cache
+ *
+ * Failures are not fatal since the output zip is already complete.
+ */
+void ZipPatcherPrivate::store_cache(const ZipOutput &out)
+{
+    if (!io::createDirectories(pc->cache_directory())) {
+        LOGW("%s: Failed to create cache directory",
+             pc->cache_directory().c_str());
+        return;
+    }
+
+    // Write to a temporary file so that a partial entry is never used
+    std::string temp_path = out.cache_path + ".tmp";
+
+    if (!write_cache(out, temp_path)
+            || rename(temp_path.c_str(), out.cache_path.c_str()) != 0) {
+        LOGW("%s: Failed to write cache entry", out.cache_path.c_str());
+        remove(temp_path.c_str());
+        return;
+    }
+
+    LOGD("Stored patch result in cache: %s", out.cache_path.c_str());
+}
+
+/*!
+ * \brief Run every AutoPatcher that handles a file on its contents
+ */
+bool ZipPatcherPrivate::patch_entry(ZipOutput &out, const std::string &name,
+                                    std::string &contents)
+{
+    for (auto *ap : out.auto_patchers) {
+        if (cancelled) return false;
+
+        auto ap_files = ap->existing_files();
+        if (std::find(ap_files.begin(), ap_files.end(), name)
+                == ap_files.end()) {
+            continue;
+        }
+
+        if (!ap->patch_contents(name, contents)) {
+            error = ap->error();
+            return false;
+        }
+    }
 
     return true;
 }
@@ -471,11 +1154,13 @@ bool ZipPatcherPrivate::open_input_archive()
 {
     assert(z_input == nullptr);
 
-    z_input = MinizipUtils::open_input_file(info->input_path());
+    // Every output is patched from the same input
+    const std::string &input_path = outputs.front().info->input_path();
+
+    z_input = MinizipUtils::open_input_file(input_path);
 
     if (!z_input) {
-        LOGE("minizip: Failed to open for reading: %s",
-             info->input_path().c_str());
+        LOGE("minizip: Failed to open for reading: %s", input_path.c_str());
         error = ErrorCode::ArchiveReadOpenError;
         return false;
     }
@@ -495,15 +1180,15 @@ void ZipPatcherPrivate::close_input_archive()
     z_input = nullptr;
 }
 
-bool ZipPatcherPrivate::open_output_archive()
+bool ZipPatcherPrivate::open_output_archive(ZipOutput &out)
 {
-    assert(z_output == nullptr);
+    assert(out.z_output == nullptr);
 
-    z_output = MinizipUtils::open_output_file(info->output_path());
+    out.z_output = MinizipUtils::open_output_file(out.info->output_path());
 
-    if (!z_output) {
+    if (!out.z_output) {
         LOGE("minizip: Failed to open for writing: %s",
-             info->output_path().c_str());
+             out.info->output_path().c_str());
         error = ErrorCode::ArchiveWriteOpenError;
         return false;
     }
@@ -511,30 +1196,29 @@ bool ZipPatcherPrivate::open_output_archive()
     return true;
 }
 
-void ZipPatcherPrivate::close_output_archive()
+void ZipPatcherPrivate::close_output_archive(ZipOutput &out)
 {
-    assert(z_output != nullptr);
+    assert(out.z_output != nullptr);
 
-    int ret = MinizipUtils::close_output_file(z_output);
+    // Pending entries must not be written after the zip is closed
+    out.writer.reset();
+
+    int ret = MinizipUtils::close_output_file(out.z_output);
     if (ret != ZIP_OK) {
         LOGW("minizip: Failed to close archive (error code: %d)", ret);
     }
 
-    z_output = nullptr;
+    out.z_output = nullptr;
 }
 
 void ZipPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
-    if (progress_cb) {
-        progress_cb(bytes, max_bytes, userdata);
-    }
+    reporter.set_bytes(bytes, max_bytes);
 }
 
 void ZipPatcherPrivate::update_files(uint64_t files, uint64_t max_files)
 {
-    if (files_cb) {
-        files_cb(files, max_files, userdata);
-    }
+    reporter.set_files(files, max_files);
 }
 
 void ZipPatcherPrivate::update_details(const std::string &msg)
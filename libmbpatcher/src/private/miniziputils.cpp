@@ -251,45 +251,114 @@ ErrorCode MinizipUtils::archive_stats(const std::string &path,
         return ErrorCode::ArchiveReadOpenError;
     }
 
-    uint64_t count = 0;
-    uint64_t total_size = 0;
-    std::string name;
-    unz_file_info64 fi;
-    memset(&fi, 0, sizeof(fi));
+    ArchiveIndex index;
+    bool ret = build_index(ctx->uf, &index);
+
+    close_input_file(ctx);
+
+    if (!ret) {
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    index_stats(index, stats, ignore);
+
+    return ErrorCode::NoError;
+}
 
-    int ret = unzGoToFirstFile(ctx->uf);
+/*!
+ * \brief Read the central directory of a zip file into memory
+ *
+ * This walks the central directory once. Afterwards, entries can be looked up
+ * by name with find_entry() and opened with go_to_entry() without scanning the
+ * central directory again.
+ *
+ * \param uf Opened zip file
+ * \param index Output index
+ *
+ * \return Whether the central directory was read successfully
+ */
+bool MinizipUtils::build_index(unzFile uf, ArchiveIndex *index)
+{
+    assert(index != nullptr);
+
+    ArchiveIndex result;
+    IndexEntry entry;
+
+    int ret = unzGoToFirstFile(uf);
     if (ret != UNZ_OK) {
         LOGE("miniunz: Failed to move to first file: %s",
              unz_error_string(ret).c_str());
-        close_input_file(ctx);
-        return ErrorCode::ArchiveReadHeaderError;
+        return false;
     }
 
     do {
-        if (!get_info(ctx->uf, &fi, &name)) {
-            close_input_file(ctx);
-            return ErrorCode::ArchiveReadHeaderError;
+        if (!get_info(uf, &entry.info, &entry.name)) {
+            return false;
         }
 
-        if (std::find(ignore.begin(), ignore.end(), name) == ignore.end()) {
-            ++count;
-            total_size += fi.uncompressed_size;
+        ret = unzGetFilePos64(uf, &entry.pos);
+        if (ret != UNZ_OK) {
+            LOGE("miniunz: Failed to get position of inner file: %s",
+                 unz_error_string(ret).c_str());
+            return false;
         }
-    } while ((ret = unzGoToNextFile(ctx->uf)) == UNZ_OK);
+
+        // Like unzLocateFile(), the first entry wins if a name is duplicated
+        result.names.emplace(entry.name, result.entries.size());
+        result.entries.push_back(std::move(entry));
+    } while ((ret = unzGoToNextFile(uf)) == UNZ_OK);
 
     if (ret != UNZ_END_OF_LIST_OF_FILE) {
         LOGE("miniunz: Finished before EOF: %s",
              unz_error_string(ret).c_str());
-        close_input_file(ctx);
-        return ErrorCode::ArchiveReadHeaderError;
+        return false;
     }
 
-    close_input_file(ctx);
+    *index = std::move(result);
+    return true;
+}
+
+void MinizipUtils::index_stats(const ArchiveIndex &index,
+                               ArchiveStats *stats,
+                               const std::vector<std::string> &ignore)
+{
+    assert(stats != nullptr);
+
+    uint64_t count = 0;
+    uint64_t total_size = 0;
+
+    for (auto const &entry : index.entries) {
+        if (std::find(ignore.begin(), ignore.end(), entry.name)
+                == ignore.end()) {
+            ++count;
+            total_size += entry.info.uncompressed_size;
+        }
+    }
 
     stats->files = count;
     stats->total_size = total_size;
+}
 
-    return ErrorCode::NoError;
+const MinizipUtils::IndexEntry *
+MinizipUtils::find_entry(const ArchiveIndex &index, const std::string &name)
+{
+    auto it = index.names.find(name);
+    if (it == index.names.end()) {
+        return nullptr;
+    }
+    return &index.entries[it->second];
+}
+
+bool MinizipUtils::go_to_entry(unzFile uf, const IndexEntry &entry)
+{
+    int ret = unzGoToFilePos64(uf, &entry.pos);
+    if (ret != UNZ_OK) {
+        LOGE("miniunz: Failed to move to inner file %s: %s",
+             entry.name.c_str(), unz_error_string(ret).c_str());
+        return false;
+    }
+
+    return true;
 }
 
 bool MinizipUtils::get_info(unzFile uf,
@@ -352,6 +421,21 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
                                  const std::string &name,
                                  void (*cb)(uint64_t bytes, void *),
                                  void *userData)
+{
+    return copy_file_raw(uf, std::vector<zipFile>{ zf }, name, cb, userData);
+}
+
+/*!
+ * \brief Copy the current entry's raw data to several zip files
+ *
+ * The compressed data is only read once. Each chunk is written to every output
+ * zip file before the next chunk is read.
+ */
+bool MinizipUtils::copy_file_raw(unzFile uf,
+                                 const std::vector<zipFile> &zfs,
+                                 const std::string &name,
+                                 void (*cb)(uint64_t bytes, void *),
+                                 void *userData)
 {
     unz_file_info64 ufi;
 
@@ -384,26 +468,31 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
         return false;
     }
 
-    // Open raw file in output zip
-    ret = zipOpenNewFileInZip2_64(
-        zf,             // file
-        name.c_str(),   // filename
-        &zfi,           // zip_fileinfo
-        nullptr,        // extrafield_local
-        0,              // size_extrafield_local
-        nullptr,        // extrafield_global
-        0,              // size_extrafield_global
-        nullptr,        // comment
-        method,         // method
-        level,          // level
-        1,              // raw
-        zip64           // zip64
-    );
-    if (ret != ZIP_OK) {
-        LOGE("minizip: Failed to open inner file: %s",
-             zip_error_string(ret).c_str());
-        unzCloseCurrentFile(uf);
-        return false;
+    // Open raw file in output zips
+    for (size_t i = 0; i < zfs.size(); ++i) {
+        ret = zipOpenNewFileInZip2_64(
+            zfs[i],         // file
+            name.c_str(),   // filename
+            &zfi,           // zip_fileinfo
+            nullptr,        // extrafield_local
+            0,              // size_extrafield_local
+            nullptr,        // extrafield_global
+            0,              // size_extrafield_global
+            nullptr,        // comment
+            method,         // method
+            level,          // level
+            1,              // raw
+            zip64           // zip64
+        );
+        if (ret != ZIP_OK) {
+            LOGE("minizip: Failed to open inner file: %s",
+                 zip_error_string(ret).c_str());
+            for (size_t j = 0; j < i; ++j) {
+                zipCloseFileInZip(zfs[j]);
+            }
+            unzCloseCurrentFile(uf);
+            return false;
+        }
     }
 
     uint64_t bytes = 0;
@@ -422,13 +511,17 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
             cb(ratio * ufi.uncompressed_size, userData);
         }
 
-        ret = zipWriteInFileInZip(zf, buf, bytes_read);
-        if (ret != ZIP_OK) {
-            LOGE("minizip: Failed to write data to inner file: %s",
-                 zip_error_string(ret).c_str());
-            unzCloseCurrentFile(uf);
-            zipCloseFileInZip(zf);
-            return false;
+        for (zipFile zf : zfs) {
+            ret = zipWriteInFileInZip(zf, buf, bytes_read);
+            if (ret != ZIP_OK) {
+                LOGE("minizip: Failed to write data to inner file: %s",
+                     zip_error_string(ret).c_str());
+                unzCloseCurrentFile(uf);
+                for (zipFile zf_close : zfs) {
+                    zipCloseFileInZip(zf_close);
+                }
+                return false;
+            }
         }
     }
     if (bytes_read != 0) {
@@ -444,11 +537,13 @@ bool MinizipUtils::copy_file_raw(unzFile uf,
              unz_error_string(ret).c_str());
         close_success = false;
     }
-    ret = zipCloseFileInZipRaw64(zf, ufi.uncompressed_size, ufi.crc);
-    if (ret != ZIP_OK) {
-        LOGE("minizip: Failed to close inner file: %s",
-             zip_error_string(ret).c_str());
-        close_success = false;
+    for (zipFile zf : zfs) {
+        ret = zipCloseFileInZipRaw64(zf, ufi.uncompressed_size, ufi.crc);
+        if (ret != ZIP_OK) {
+            LOGE("minizip: Failed to close inner file: %s",
+                 zip_error_string(ret).c_str());
+            close_success = false;
+        }
     }
 
     return bytes_read == 0 && close_success;
@@ -579,7 +674,8 @@ bool MinizipUtils::extract_file(unzFile uf, const std::string &directory)
     return n == 0;
 }
 
-static bool get_file_time(const std::string &filename, uint32_t *dostime)
+bool MinizipUtils::get_file_time(const std::string &filename,
+                                 uint32_t *dostime)
 {
     // Don't fail when building with -Werror
     (void) filename;
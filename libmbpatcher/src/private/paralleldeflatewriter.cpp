@@ -0,0 +1,382 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/paralleldeflatewriter.h"
+
+#include <algorithm>
+
+#include <cassert>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/miniziputils.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+// Amount of uncompressed data per block
+static constexpr size_t BLOCK_SIZE = 1024 * 1024;
+
+// Size of the deflate window, which is the most that a block can refer back to
+static constexpr size_t DICT_SIZE = 32 * 1024;
+
+ParallelDeflateWriter::ParallelDeflateWriter(zipFile zf)
+    : _zf(zf)
+    , _open(false)
+    , _level(Z_DEFAULT_COMPRESSION)
+    , _stop(false)
+    , _write_failed(false)
+    , _crc(0)
+    , _uncompressed_size(0)
+{
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Bound memory usage by limiting how far the reader can get ahead of the
+    // writer
+    _max_pending = threads * 2;
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        _workers.emplace_back(&ParallelDeflateWriter::worker, this);
+    }
+    _writer = std::thread(&ParallelDeflateWriter::writer, this);
+}
+
+ParallelDeflateWriter::~ParallelDeflateWriter()
+{
+    if (_open) {
+        close();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+
+    for (auto &t : _workers) {
+        t.join();
+    }
+    _writer.join();
+}
+
+/*!
+ * \brief Open a new deflated entry in the zip file
+ *
+ * \param name Path of the entry in the zip file
+ * \param level zlib compression level
+ * \param zip64 Whether the entry needs zip64 extensions
+ */
+ErrorCode ParallelDeflateWriter::open(const std::string &name, int level,
+                                      bool zip64)
+{
+    assert(!_open);
+
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+
+    int ret = zipOpenNewFileInZip2_64(
+        _zf,                    // file
+        name.c_str(),           // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        Z_DEFLATED,             // method
+        level,                  // level
+        1,                      // raw
+        zip64                   // zip64
+    );
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to open new file in output zip: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+        return ErrorCode::ArchiveWriteHeaderError;
+    }
+
+    _open = true;
+    _level = level;
+    _current.reset();
+    _dict.clear();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _write_failed = false;
+    _crc = static_cast<uint32_t>(crc32(0L, Z_NULL, 0));
+    _uncompressed_size = 0;
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Append data to the current entry
+ *
+ * Blocks until there is room for another block if the workers or the writer
+ * thread have fallen behind.
+ */
+ErrorCode ParallelDeflateWriter::write(const void *data, size_t size)
+{
+    assert(_open);
+
+    auto *ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        if (!_current) {
+            _current.reset(new Block());
+            _current->in.reserve(BLOCK_SIZE);
+        }
+
+        size_t n = std::min(size, BLOCK_SIZE - _current->in.size());
+        _current->in.insert(_current->in.end(), ptr, ptr + n);
+        ptr += n;
+        size -= n;
+
+        if (_current->in.size() == BLOCK_SIZE) {
+            auto ret = submit(false);
+            if (ret != ErrorCode::NoError) {
+                return ret;
+            }
+        }
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Write the remaining blocks and close the current entry
+ */
+ErrorCode ParallelDeflateWriter::close()
+{
+    assert(_open);
+
+    if (!_current) {
+        _current.reset(new Block());
+    }
+
+    // Errors are reported after the queue is drained
+    submit(true);
+
+    bool failed;
+    uint32_t crc;
+    uint64_t uncompressed_size;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _pending.empty(); });
+        failed = _write_failed;
+        crc = _crc;
+        uncompressed_size = _uncompressed_size;
+    }
+
+    _open = false;
+
+    int ret = zipCloseFileInZipRaw64(_zf, uncompressed_size, crc);
+    if (failed) {
+        return ErrorCode::ArchiveWriteDataError;
+    } else if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to close file in output zip: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+ErrorCode ParallelDeflateWriter::submit(bool last)
+{
+    std::unique_ptr<Block> block = std::move(_current);
+    block->last = last;
+    block->done = false;
+    block->ok = false;
+    block->dict.swap(_dict);
+
+    // The next block uses the tail of this one as its dictionary
+    size_t dict_size = std::min(block->in.size(), DICT_SIZE);
+    _dict.assign(block->in.end() - dict_size, block->in.end());
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return _pending.size() < _max_pending || _write_failed;
+        });
+        if (_write_failed && !last) {
+            return ErrorCode::ArchiveWriteDataError;
+        }
+        _queue.push_back(block.get());
+        _pending.push_back(std::move(block));
+    }
+    _cv.notify_all();
+
+    return ErrorCode::NoError;
+}
+
+void ParallelDeflateWriter::worker()
+{
+    while (true) {
+        Block *block;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_stop) {
+                return;
+            }
+            block = _queue.front();
+            _queue.pop_front();
+        }
+
+        bool ok = compress(*block, _level);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            block->ok = ok;
+            block->done = true;
+        }
+        _cv.notify_all();
+    }
+}
+
+void ParallelDeflateWriter::writer()
+{
+    while (true) {
+        Block *block;
+        bool failed;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{
+                return _stop || (!_pending.empty() && _pending.front()->done);
+            });
+            if (_stop) {
+                return;
+            }
+            block = _pending.front().get();
+            failed = _write_failed;
+        }
+
+        // Once something fails, the remaining blocks are only discarded
+        if (!failed && !block->ok) {
+            failed = true;
+        }
+
+        if (!failed) {
+            int ret = zipWriteInFileInZip(
+                    _zf, block->out.data(),
+                    static_cast<uint32_t>(block->out.size()));
+            if (ret != ZIP_OK) {
+                LOGE("minizip: Failed to write data to output zip: %s",
+                     MinizipUtils::zip_error_string(ret).c_str());
+                failed = true;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (failed) {
+                _write_failed = true;
+            } else {
+                _crc = static_cast<uint32_t>(crc32_combine(
+                        _crc, block->crc,
+                        static_cast<z_off_t>(block->in.size())));
+                _uncompressed_size += block->in.size();
+            }
+            _pending.pop_front();
+        }
+        _cv.notify_all();
+    }
+}
+
+/*!
+ * \brief Compute the CRC32 of a block and deflate it
+ *
+ * Every block except the last ends with a sync flush, which leaves the
+ * stream byte-aligned without marking the final deflate block.
+ */
+bool ParallelDeflateWriter::compress(Block &block, int level)
+{
+    block.crc = static_cast<uint32_t>(crc32(
+            crc32(0L, Z_NULL, 0), block.in.data(),
+            static_cast<uInt>(block.in.size())));
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    int ret = deflateInit2(&strm, level, Z_DEFLATED, -MAX_WBITS, 8,
+                           Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to initialize deflate: %d", ret);
+        return false;
+    }
+
+    if (!block.dict.empty()) {
+        ret = deflateSetDictionary(&strm, block.dict.data(),
+                                   static_cast<uInt>(block.dict.size()));
+        if (ret != Z_OK) {
+            LOGE("zlib: Failed to set dictionary: %d", ret);
+            deflateEnd(&strm);
+            return false;
+        }
+    }
+
+    // Leave room for the sync flush marker
+    block.out.resize(deflateBound(
+            &strm, static_cast<uLong>(block.in.size())) + 16);
+
+    int flush = block.last ? Z_FINISH : Z_SYNC_FLUSH;
+    size_t out_pos = 0;
+
+    strm.next_in = block.in.data();
+    strm.avail_in = static_cast<uInt>(block.in.size());
+
+    do {
+        if (out_pos == block.out.size()) {
+            block.out.resize(block.out.size() * 2);
+        }
+
+        strm.next_out = block.out.data() + out_pos;
+        strm.avail_out = static_cast<uInt>(block.out.size() - out_pos);
+
+        ret = deflate(&strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            LOGE("zlib: Failed to deflate data: %d", ret);
+            deflateEnd(&strm);
+            return false;
+        }
+
+        out_pos = block.out.size() - strm.avail_out;
+    } while (strm.avail_out == 0);
+
+    deflateEnd(&strm);
+
+    if (block.last && ret != Z_STREAM_END) {
+        LOGE("zlib: Deflate did not finish: %d", ret);
+        return false;
+    }
+
+    block.out.resize(out_pos);
+    return true;
+}
+
+}
+}
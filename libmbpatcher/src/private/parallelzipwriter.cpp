@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/parallelzipwriter.h"
+
+#include <algorithm>
+
+#include <climits>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/miniziputils.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+// Largest amount of data passed to zlib or minizip at once
+static constexpr size_t MAX_CHUNK_SIZE = 1 << 30;
+
+// Entries whose contents are already compressed
+static const char *stored_suffixes[] = {
+    ".br",
+    ".gz",
+    ".img",
+    ".lz4",
+    ".xz",
+    ".zip",
+};
+
+ParallelZipWriter::ParallelZipWriter(zipFile zf)
+    : _zf(zf), _stop(false)
+{
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Bound memory usage by limiting how far the workers can get ahead of
+    // the writer
+    _max_pending = threads * 2;
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        _workers.emplace_back(&ParallelZipWriter::worker, this);
+    }
+}
+
+ParallelZipWriter::~ParallelZipWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+
+    for (auto &t : _workers) {
+        t.join();
+    }
+}
+
+/*!
+ * \brief Queue an entry for compression
+ *
+ * \param name Path of the entry in the zip file
+ * \param contents Contents of the entry
+ * \param level zlib compression level. Z_NO_COMPRESSION stores the entry.
+ */
+ErrorCode ParallelZipWriter::add_file(const std::string &name,
+                                      std::vector<unsigned char> contents,
+                                      int level)
+{
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->dos_date = 0;
+    entry->level = level;
+    entry->data.swap(contents);
+
+    return add_entry(std::move(entry));
+}
+
+/*!
+ * \brief Queue a file for compression
+ *
+ * The file is read into memory on the calling thread.
+ *
+ * \param name Path of the entry in the zip file
+ * \param path Path of the file to add
+ * \param level zlib compression level. Z_NO_COMPRESSION stores the entry.
+ */
+ErrorCode ParallelZipWriter::add_file(const std::string &name,
+                                      const std::string &path, int level)
+{
+    std::unique_ptr<Entry> entry(new Entry());
+    entry->name = name;
+    entry->level = level;
+
+    if (!MinizipUtils::get_file_time(path, &entry->dos_date)) {
+        LOGE("%s: Failed to get modification time", path.c_str());
+        return ErrorCode::FileOpenError;
+    }
+
+    auto ret = FileUtils::read_to_memory(path, &entry->data);
+    if (ret != ErrorCode::NoError) {
+        return ret;
+    }
+
+    return add_entry(std::move(entry));
+}
+
+/*!
+ * \brief Write all queued entries to the zip file
+ */
+ErrorCode ParallelZipWriter::flush()
+{
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_pending.empty()) {
+                return ErrorCode::NoError;
+            }
+        }
+
+        auto ret = write_next();
+        if (ret != ErrorCode::NoError) {
+            return ret;
+        }
+    }
+}
+
+/*!
+ * \brief Pick a compression level for an entry based on its name
+ *
+ * \return Z_NO_COMPRESSION if the entry is likely already compressed,
+ *         otherwise Z_DEFAULT_COMPRESSION
+ */
+int ParallelZipWriter::compression_level(const std::string &name)
+{
+    for (auto const &suffix : stored_suffixes) {
+        if (ends_with_icase(name, suffix)) {
+            return Z_NO_COMPRESSION;
+        }
+    }
+
+    return Z_DEFAULT_COMPRESSION;
+}
+
+ErrorCode ParallelZipWriter::add_entry(std::unique_ptr<Entry> entry)
+{
+    entry->done = false;
+    entry->ok = false;
+
+    size_t pending;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(entry.get());
+        _pending.push_back(std::move(entry));
+        pending = _pending.size();
+    }
+    _cv.notify_all();
+
+    if (pending > _max_pending) {
+        return write_next();
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Wait for the oldest entry to be compressed and write it
+ */
+ErrorCode ParallelZipWriter::write_next()
+{
+    std::unique_ptr<Entry> entry;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _pending.front()->done; });
+        entry = std::move(_pending.front());
+        _pending.pop_front();
+    }
+
+    if (!entry->ok) {
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    bool zip64 = entry->uncompressed_size >= ((1ull << 32) - 1);
+
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+    zi.dos_date = entry->dos_date;
+
+    int ret = zipOpenNewFileInZip2_64(
+        _zf,                    // file
+        entry->name.c_str(),    // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        entry->method,          // method
+        entry->level,           // level
+        1,                      // raw
+        zip64                   // zip64
+    );
+
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to open inner file: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    for (size_t pos = 0; pos < entry->data.size();) {
+        size_t n = std::min(entry->data.size() - pos, MAX_CHUNK_SIZE);
+
+        ret = zipWriteInFileInZip(_zf, entry->data.data() + pos,
+                                  static_cast<uint32_t>(n));
+        if (ret != ZIP_OK) {
+            LOGE("minizip: Failed to write inner file data: %s",
+                 MinizipUtils::zip_error_string(ret).c_str());
+            zipCloseFileInZipRaw64(_zf, entry->uncompressed_size, entry->crc);
+
+            return ErrorCode::ArchiveWriteDataError;
+        }
+
+        pos += n;
+    }
+
+    ret = zipCloseFileInZipRaw64(_zf, entry->uncompressed_size, entry->crc);
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to close inner file: %s",
+             MinizipUtils::zip_error_string(ret).c_str());
+
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+void ParallelZipWriter::worker()
+{
+    while (true) {
+        Entry *entry;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_stop) {
+                return;
+            }
+            entry = _queue.front();
+            _queue.pop_front();
+        }
+
+        bool ok = compress(*entry);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            entry->ok = ok;
+            entry->done = true;
+        }
+        _cv.notify_all();
+    }
+}
+
+/*!
+ * \brief Compute the CRC32 of an entry and deflate its data in place
+ *
+ * The output is a raw deflate stream, which is written to the zip file
+ * without being touched again by minizip.
+ */
+bool ParallelZipWriter::compress(Entry &entry)
+{
+    entry.uncompressed_size = entry.data.size();
+    entry.crc = crc32(0L, Z_NULL, 0);
+
+    for (size_t pos = 0; pos < entry.data.size();) {
+        size_t n = std::min(entry.data.size() - pos, MAX_CHUNK_SIZE);
+        entry.crc = static_cast<uint32_t>(crc32(
+                entry.crc, entry.data.data() + pos, static_cast<uInt>(n)));
+        pos += n;
+    }
+
+    if (entry.level == Z_NO_COMPRESSION) {
+        entry.method = 0;
+        return true;
+    }
+
+    entry.method = Z_DEFLATED;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    int ret = deflateInit2(&strm, entry.level, Z_DEFLATED, -MAX_WBITS, 8,
+                           Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to initialize deflate: %d", ret);
+        return false;
+    }
+
+    std::vector<unsigned char> out(deflateBound(
+            &strm, static_cast<uLong>(entry.data.size())));
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    int flush;
+
+    do {
+        size_t in_n = std::min(entry.data.size() - in_pos, MAX_CHUNK_SIZE);
+        strm.next_in = entry.data.data() + in_pos;
+        strm.avail_in = static_cast<uInt>(in_n);
+        flush = in_pos + in_n == entry.data.size() ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            if (out_pos == out.size()) {
+                out.resize(out.size() * 2);
+            }
+
+            size_t out_n = std::min(out.size() - out_pos, MAX_CHUNK_SIZE);
+            strm.next_out = out.data() + out_pos;
+            strm.avail_out = static_cast<uInt>(out_n);
+
+            ret = deflate(&strm, flush);
+            if (ret == Z_STREAM_ERROR) {
+                LOGE("zlib: Failed to deflate data: %d", ret);
+                deflateEnd(&strm);
+                return false;
+            }
+
+            out_pos += out_n - strm.avail_out;
+        } while (strm.avail_out == 0);
+
+        in_pos += in_n;
+    } while (flush != Z_FINISH);
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        LOGE("zlib: Deflate did not finish: %d", ret);
+        return false;
+    }
+
+    out.resize(out_pos);
+    entry.data.swap(out);
+    return true;
+}
+
+}
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/progressreporter.h"
+
+#include <chrono>
+#include <thread>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+constexpr int64_t ProgressReporter::PROGRESS_INTERVAL_MS;
+
+static int64_t now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProgressReporter::ProgressReporter()
+    : _progress_cb(nullptr)
+    , _files_cb(nullptr)
+    , _userdata(nullptr)
+    , _bytes(0)
+    , _max_bytes(0)
+    , _files(0)
+    , _max_files(0)
+    , _bytes_dirty(false)
+    , _files_dirty(false)
+    , _last_ms(0)
+    , _delivering(false)
+{
+}
+
+/*!
+ * \brief Set the callbacks and clear the stored values
+ *
+ * This must not be called while another thread may be updating the values.
+ */
+void ProgressReporter::reset(Patcher::ProgressUpdatedCallback progress_cb,
+                             Patcher::FilesUpdatedCallback files_cb,
+                             void *userdata)
+{
+    _progress_cb = progress_cb;
+    _files_cb = files_cb;
+    _userdata = userdata;
+
+    _bytes = 0;
+    _max_bytes = 0;
+    _files = 0;
+    _max_files = 0;
+    _bytes_dirty = false;
+    _files_dirty = false;
+    // The first update is always delivered
+    _last_ms = now_ms() - PROGRESS_INTERVAL_MS;
+}
+
+void ProgressReporter::set_bytes(uint64_t bytes, uint64_t max_bytes)
+{
+    _bytes.store(bytes, std::memory_order_relaxed);
+    _max_bytes.store(max_bytes, std::memory_order_relaxed);
+    _bytes_dirty.store(true, std::memory_order_release);
+
+    try_deliver(false);
+}
+
+void ProgressReporter::set_files(uint64_t files, uint64_t max_files)
+{
+    _files.store(files, std::memory_order_relaxed);
+    _max_files.store(max_files, std::memory_order_relaxed);
+    _files_dirty.store(true, std::memory_order_release);
+
+    try_deliver(false);
+}
+
+/*!
+ * \brief Deliver any values that were held back by the rate limit
+ */
+void ProgressReporter::flush()
+{
+    try_deliver(true);
+}
+
+void ProgressReporter::try_deliver(bool force)
+{
+    if (!force && now_ms() - _last_ms.load(std::memory_order_relaxed)
+            < PROGRESS_INTERVAL_MS) {
+        return;
+    }
+
+    // Only one thread calls the callbacks at a time. Other threads just drop
+    // their update since the delivering thread will report newer values soon.
+    while (_delivering.exchange(true, std::memory_order_acquire)) {
+        if (!force) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+
+    _last_ms.store(now_ms(), std::memory_order_relaxed);
+
+    if (_files_dirty.exchange(false, std::memory_order_acquire) && _files_cb) {
+        _files_cb(_files.load(std::memory_order_relaxed),
+                  _max_files.load(std::memory_order_relaxed), _userdata);
+    }
+    if (_bytes_dirty.exchange(false, std::memory_order_acquire)
+            && _progress_cb) {
+        _progress_cb(_bytes.load(std::memory_order_relaxed),
+                     _max_bytes.load(std::memory_order_relaxed), _userdata);
+    }
+
+    _delivering.store(false, std::memory_order_release);
+}
+
+}
+}
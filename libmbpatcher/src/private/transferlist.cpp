@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2014-2016  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbpatcher/private/transferlist.h"
+
+#include <algorithm>
+#include <limits>
+
+#include <cstring>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \brief Parse an unsigned decimal number
+ *
+ * \return Pointer to the first unparsed character or nullptr if there are no
+ *         digits or the number does not fit in 64 bits
+ */
+static const char * parse_number(const char *ptr, const char *end,
+                                 uint64_t &out)
+{
+    const char *start = ptr;
+    uint64_t value = 0;
+
+    for (; ptr != end && *ptr >= '0' && *ptr <= '9'; ++ptr) {
+        uint64_t digit = static_cast<uint64_t>(*ptr - '0');
+        if (value > (std::numeric_limits<uint64_t>::max() - digit) / 10) {
+            return nullptr;
+        }
+        value = value * 10 + digit;
+    }
+
+    if (ptr == start) {
+        return nullptr;
+    }
+
+    out = value;
+    return ptr;
+}
+
+static void normalize(std::vector<RangeSet::Range> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+
+    size_t n = 0;
+
+    for (auto const &r : ranges) {
+        if (n > 0 && r.first <= ranges[n - 1].second) {
+            ranges[n - 1].second = std::max(ranges[n - 1].second, r.second);
+        } else {
+            ranges[n++] = r;
+        }
+    }
+
+    ranges.resize(n);
+}
+
+/*!
+ * \brief Parse a range set
+ *
+ * The format is the one used by the transfer list: the number of values,
+ * followed by pairs of block numbers, each describing a half-open range. All
+ * values are separated by commas (eg. `4,0,10,20,30`).
+ *
+ * \param str Range set string (does not need to be NULL-terminated)
+ * \param size Size of \p str
+ * \param[out] out Parsed range set
+ *
+ * \return Whether the range set is valid
+ */
+bool RangeSet::parse(const char *str, size_t size, RangeSet &out)
+{
+    const char *ptr = str;
+    const char *end = str + size;
+    uint64_t count;
+
+    ptr = parse_number(ptr, end, count);
+    if (!ptr || count == 0 || count % 2 != 0) {
+        return false;
+    }
+
+    std::vector<Range> ranges;
+
+    for (uint64_t i = 0; i < count; i += 2) {
+        Range r;
+
+        if (ptr == end || *ptr != ','
+                || !(ptr = parse_number(ptr + 1, end, r.first))
+                || ptr == end || *ptr != ','
+                || !(ptr = parse_number(ptr + 1, end, r.second))
+                || r.first >= r.second) {
+            return false;
+        }
+
+        ranges.push_back(r);
+    }
+
+    if (ptr != end) {
+        return false;
+    }
+
+    normalize(ranges);
+    out._ranges.swap(ranges);
+
+    return true;
+}
+
+/*!
+ * \brief Format the range set in the transfer list format
+ */
+std::string RangeSet::to_string() const
+{
+    std::string result = std::to_string(_ranges.size() * 2);
+
+    for (auto const &r : _ranges) {
+        result += ',';
+        result += std::to_string(r.first);
+        result += ',';
+        result += std::to_string(r.second);
+    }
+
+    return result;
+}
+
+void RangeSet::add(uint64_t begin, uint64_t end)
+{
+    if (begin < end) {
+        _ranges.emplace_back(begin, end);
+        normalize(_ranges);
+    }
+}
+
+void RangeSet::add(const RangeSet &other)
+{
+    _ranges.insert(_ranges.end(), other._ranges.begin(), other._ranges.end());
+    normalize(_ranges);
+}
+
+/*!
+ * \brief Get the blocks that are in this set, but not in \p other
+ */
+RangeSet RangeSet::subtract(const RangeSet &other) const
+{
+    RangeSet result;
+    auto it = other._ranges.begin();
+
+    for (auto r : _ranges) {
+        // Skip ranges that end before this one starts
+        while (it != other._ranges.end() && it->second <= r.first) {
+            ++it;
+        }
+
+        for (auto o = it; o != other._ranges.end() && o->first < r.second;
+                ++o) {
+            if (o->first > r.first) {
+                result._ranges.emplace_back(r.first, o->first);
+            }
+            r.first = std::max(r.first, o->second);
+            if (r.first >= r.second) {
+                break;
+            }
+        }
+
+        if (r.first < r.second) {
+            result._ranges.push_back(r);
+        }
+    }
+
+    return result;
+}
+
+bool RangeSet::empty() const
+{
+    return _ranges.empty();
+}
+
+uint64_t RangeSet::blocks() const
+{
+    uint64_t total = 0;
+    for (auto const &r : _ranges) {
+        total += r.second - r.first;
+    }
+    return total;
+}
+
+const std::vector<RangeSet::Range> & RangeSet::ranges() const
+{
+    return _ranges;
+}
+
+static bool is_command(const char *line, size_t size, const char *cmd,
+                       const char *&args, size_t &args_size)
+{
+    size_t cmd_size = strlen(cmd);
+
+    if (size > cmd_size && memcmp(line, cmd, cmd_size) == 0
+            && line[cmd_size] == ' ') {
+        args = line + cmd_size + 1;
+        args_size = size - cmd_size - 1;
+        return true;
+    }
+
+    return false;
+}
+
+TransferListRewriter::TransferListRewriter(const TransferListOptions &options)
+    : _options(options)
+    , _line(0)
+    , _version(0)
+    , _zero_index(0)
+    , _can_trim(options.trim_zero)
+    , _scanned(false)
+    , _removed_blocks(0)
+{
+}
+
+/*!
+ * \brief Feed the next piece of the transfer list to the scan pass
+ *
+ * This records the blocks written by each command so that the final block map
+ * is known before any command is rewritten.
+ */
+void TransferListRewriter::scan(const char *data, size_t size)
+{
+    feed(Pass::Scan, data, size, nullptr);
+}
+
+/*!
+ * \brief Finish the scan pass
+ *
+ * Every block of a "zero" command that is written again by a later command
+ * does not need to be zeroed. Since the scanned transfer list does not read
+ * from the target, the zeros could never be observed.
+ */
+void TransferListRewriter::finish_scan()
+{
+    if (!_partial.empty()) {
+        handle_line(Pass::Scan, _partial.data(), _partial.size(), false,
+                    nullptr);
+        _partial.clear();
+    }
+
+    if (_can_trim) {
+        RangeSet written_after;
+        size_t zero_index = _zeros.size();
+
+        for (auto it = _writes.rbegin(); it != _writes.rend(); ++it) {
+            if (it->first) {
+                ZeroCommand &zero = _zeros[--zero_index];
+                zero.trimmed = zero.blocks.subtract(written_after);
+                _removed_blocks += zero.blocks.blocks()
+                        - zero.trimmed.blocks();
+            }
+            written_after.add(it->second);
+        }
+    }
+
+    _writes.clear();
+    _scanned = true;
+    _line = 0;
+}
+
+/*!
+ * \brief Feed the next piece of the transfer list to the rewrite pass
+ *
+ * \param data Input data
+ * \param size Size of \p data
+ * \param[out] out String to append the rewritten lines to
+ */
+void TransferListRewriter::rewrite(const char *data, size_t size,
+                                   std::string &out)
+{
+    feed(Pass::Rewrite, data, size, &out);
+}
+
+/*!
+ * \brief Finish the rewrite pass
+ *
+ * \param[out] out String to append the last (unterminated) line to
+ */
+void TransferListRewriter::finish_rewrite(std::string &out)
+{
+    if (!_partial.empty()) {
+        handle_line(Pass::Rewrite, _partial.data(), _partial.size(), false,
+                    &out);
+        _partial.clear();
+    }
+
+    _line = 0;
+}
+
+/*!
+ * \brief Number of blocks removed from "zero" commands
+ */
+uint64_t TransferListRewriter::removed_blocks() const
+{
+    return _removed_blocks;
+}
+
+void TransferListRewriter::feed(Pass pass, const char *data, size_t size,
+                                std::string *out)
+{
+    const char *end = data + size;
+
+    while (data != end) {
+        auto nl = static_cast<const char *>(memchr(data, '\n', end - data));
+        if (!nl) {
+            _partial.append(data, end);
+            break;
+        }
+
+        if (_partial.empty()) {
+            handle_line(pass, data, nl - data, true, out);
+        } else {
+            _partial.append(data, nl);
+            handle_line(pass, _partial.data(), _partial.size(), true, out);
+            _partial.clear();
+        }
+
+        data = nl + 1;
+    }
+}
+
+void TransferListRewriter::handle_line(Pass pass, const char *line,
+                                       size_t size, bool terminated,
+                                       std::string *out)
+{
+    ++_line;
+
+    if (_line == 1) {
+        uint64_t version;
+        if (parse_number(line, line + size, version) == line + size
+                && version >= 1 && version <= 4) {
+            _version = static_cast<int>(version);
+        } else {
+            _version = 0;
+        }
+    }
+
+    if (pass == Pass::Scan) {
+        scan_line(line, size);
+    } else {
+        rewrite_line(line, size, terminated, *out);
+    }
+}
+
+/*!
+ * \brief Number of lines before the first command
+ *
+ * Version 1 only has the total block count. Later versions also have the
+ * number of stash entries and the maximum number of stashed blocks.
+ */
+size_t TransferListRewriter::header_lines() const
+{
+    return _version >= 2 ? 4 : 2;
+}
+
+void TransferListRewriter::scan_line(const char *line, size_t size)
+{
+    const char *args;
+    size_t args_size;
+    RangeSet blocks;
+
+    if (!_can_trim) {
+        return;
+    }
+
+    if (_line == 1) {
+        // Unknown versions may have commands that cannot be handled here
+        if (_version == 0) {
+            _can_trim = false;
+        }
+    } else if (_line <= header_lines() || size == 0) {
+        // Nothing to do
+    } else if (is_command(line, size, "zero", args, args_size)) {
+        if (!RangeSet::parse(args, args_size, blocks)) {
+            _can_trim = false;
+            return;
+        }
+        _zeros.push_back({ blocks, blocks });
+        _writes.emplace_back(true, std::move(blocks));
+    } else if (is_command(line, size, "new", args, args_size)) {
+        if (!RangeSet::parse(args, args_size, blocks)) {
+            _can_trim = false;
+            return;
+        }
+        _writes.emplace_back(false, std::move(blocks));
+    } else if (is_command(line, size, "erase", args, args_size)) {
+        if (_options.remove_erase) {
+            return;
+        }
+        // A kept erase leaves the blocks undefined, which overrides any
+        // earlier zeroing anyway
+        if (!RangeSet::parse(args, args_size, blocks)) {
+            _can_trim = false;
+            return;
+        }
+        _writes.emplace_back(false, std::move(blocks));
+    } else {
+        // Commands like move, bsdiff, imgdiff, and stash read from the target,
+        // so zeroed blocks could be observed before they are overwritten
+        _can_trim = false;
+    }
+}
+
+void TransferListRewriter::rewrite_line(const char *line, size_t size,
+                                        bool terminated, std::string &out)
+{
+    const char *args;
+    size_t args_size;
+    bool trimming = _scanned && _can_trim;
+
+    if (_line <= header_lines()) {
+        uint64_t total;
+
+        // The total block count includes the zeroed blocks and is used for
+        // the progress bar
+        if (_line == 2 && trimming && _removed_blocks > 0
+                && parse_number(line, line + size, total) == line + size
+                && total >= _removed_blocks) {
+            out += std::to_string(total - _removed_blocks);
+        } else {
+            out.append(line, size);
+        }
+    } else if (_options.remove_erase
+            && is_command(line, size, "erase", args, args_size)) {
+        return;
+    } else if (trimming && _zero_index < _zeros.size()
+            && is_command(line, size, "zero", args, args_size)) {
+        const RangeSet &blocks = _zeros[_zero_index++].trimmed;
+        if (blocks.empty()) {
+            return;
+        }
+        out += "zero ";
+        out += blocks.to_string();
+    } else {
+        out.append(line, size);
+    }
+
+    if (terminated) {
+        out += '\n';
+    }
+}
+
+}
+}
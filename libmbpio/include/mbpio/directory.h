@@ -20,10 +20,12 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace io
 {
 
 bool createDirectories(const std::string &path);
+bool listFiles(const std::string &path, std::vector<std::string> &names);
 
 }
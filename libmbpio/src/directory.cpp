@@ -19,6 +19,8 @@
 
 #include "mbpio/directory.h"
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 
 #include <cstring>
@@ -33,6 +35,7 @@
 #include "mbpio/win32/error.h"
 #else
 #include <cerrno>
+#include <dirent.h>
 #include <sys/stat.h>
 #endif
 
@@ -104,4 +107,104 @@ bool createDirectories(const std::string &path)
     return true;
 }
 
+/*!
+ * \brief List the regular files in a directory
+ *
+ * Subdirectories and special files are skipped and the directory is not
+ * traversed recursively.
+ *
+ * \param path Directory to list
+ * \param names Output list of filenames (without \a path), sorted by name
+ *
+ * \return Whether the directory was successfully read
+ */
+bool listFiles(const std::string &path, std::vector<std::string> &names)
+{
+    names.clear();
+
+#if IO_PLATFORM_WINDOWS
+    std::wstring wPattern;
+    WIN32_FIND_DATAW data;
+
+    if (!mb::utf8_to_wcs(wPattern, path)) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to convert UTF-8 to UTF-16: %s",
+                path.c_str(), win32::errorToString(GetLastError()).c_str()));
+        return false;
+    }
+    wPattern += L"\\*";
+
+    HANDLE hFind = FindFirstFileW(wPattern.c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), win32::errorToString(GetLastError()).c_str()));
+        return false;
+    }
+
+    do {
+        if (data.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY
+                | FILE_ATTRIBUTE_DEVICE)) {
+            continue;
+        }
+
+        std::string name;
+        if (!mb::wcs_to_utf8(name, data.cFileName)) {
+            setLastError(Error::PlatformError, priv::format(
+                    "%s: Failed to convert UTF-16 to UTF-8: %s",
+                    path.c_str(), win32::errorToString(GetLastError()).c_str()));
+            FindClose(hFind);
+            return false;
+        }
+        names.push_back(std::move(name));
+    } while (FindNextFileW(hFind, &data));
+
+    DWORD error = GetLastError();
+    FindClose(hFind);
+
+    if (error != ERROR_NO_MORE_FILES) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to read directory: %s",
+                path.c_str(), win32::errorToString(error).c_str()));
+        return false;
+    }
+#else
+    std::unique_ptr<DIR, int (*)(DIR *)> dp(opendir(path.c_str()), closedir);
+    if (!dp) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    struct dirent *ent;
+    struct stat sb;
+
+    errno = 0;
+
+    while ((ent = readdir(dp.get()))) {
+        std::string file_path(path);
+        file_path += '/';
+        file_path += ent->d_name;
+
+        if (stat(file_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+            names.push_back(ent->d_name);
+        }
+
+        errno = 0;
+    }
+
+    if (errno != 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to read directory: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+#endif
+
+    std::sort(names.begin(), names.end());
+
+    return true;
+}
+
 }
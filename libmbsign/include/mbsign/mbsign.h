@@ -21,6 +21,8 @@
 
 #include "mbcommon/common.h"
 
+#include <cstddef>
+
 #include <openssl/evp.h>
 
 namespace mb
@@ -33,6 +35,21 @@ enum {
     KEY_FORMAT_PKCS12 = 2
 };
 
+enum {
+    SIGNATURE_VERSION_1 = 1,
+    SIGNATURE_VERSION_2 = 2
+};
+
+struct VerifyFileInfo
+{
+    const char *path;
+    const char *sig_path;
+    // Whether the verification operation completed
+    bool ok;
+    // Whether the signature is valid (only meaningful if `ok` is true)
+    bool valid;
+};
+
 MB_EXPORT EVP_PKEY * load_private_key(BIO *bio_key, int format,
                                       const char *pass);
 MB_EXPORT EVP_PKEY * load_private_key_from_file(const char *file, int format,
@@ -43,8 +60,16 @@ MB_EXPORT EVP_PKEY * load_public_key_from_file(const char *file, int format,
                                                const char *pass);
 MB_EXPORT bool sign_data(BIO *bio_data_in, BIO *bio_sig_out,
                          EVP_PKEY *pkey);
+MB_EXPORT bool sign_data_with_version(BIO *bio_data_in, BIO *bio_sig_out,
+                                      EVP_PKEY *pkey, int version);
 MB_EXPORT bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
                            EVP_PKEY *pkey, bool *result_out);
+MB_EXPORT bool verify_data_with_keys(BIO *bio_data_in, BIO *bio_sig_in,
+                                     EVP_PKEY * const *pkeys, size_t count,
+                                     bool *result_out);
+MB_EXPORT bool verify_files(VerifyFileInfo *files, size_t n,
+                            EVP_PKEY * const *pkeys, size_t count,
+                            unsigned int threads);
 
 }
 }
@@ -19,6 +19,11 @@
 
 #include "mbsign/mbsign.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include <cassert>
 #include <cstring>
 
@@ -29,15 +34,26 @@
 #include <openssl/pem.h>
 #include <openssl/pkcs12.h>
 
+#include "mbcommon/endian.h"
+
 #include "mblog/logging.h"
 
-#define BUFSIZE                 1024 * 8
+// I/O buffer size for hashing input data (large files are common)
+#define BUFSIZE                 (256 * 1024)
 
 #define MAGIC                   "!MBSIGN!"
 #define MAGIC_SIZE              8
 
 #define VERSION_1_SHA512_DGST   1u
-#define VERSION_LATEST          VERSION_1_SHA512_DGST
+#define VERSION_2_SHA512_MERKLE 2u
+
+// Size of the chunks that are the leaves of the version 2 hash tree
+#define MERKLE_CHUNK_SIZE       (1024 * 1024)
+// Maximum number of leaves accepted in a signature file (64 GiB of data)
+#define MERKLE_MAX_LEAVES       (64 * 1024)
+// Domain separation prefixes for leaf and interior node hashes
+#define MERKLE_LEAF_PREFIX      0x00
+#define MERKLE_NODE_PREFIX      0x01
 
 // NOTE: All integers are stored in little endian form
 struct SigHeader
@@ -48,6 +64,16 @@ struct SigHeader
     uint32_t unused;
 };
 
+// Follows the header in version 2 signature files. It is followed by
+// `leaf_count` SHA512 digests (one per chunk) and then by the signature of
+// SHA512(SigV2Info || root).
+struct SigV2Info
+{
+    uint64_t data_size;
+    uint32_t chunk_size;
+    uint32_t leaf_count;
+};
+
 namespace mb
 {
 namespace sign
@@ -330,21 +356,28 @@ EVP_PKEY * load_public_key_from_file(const char *file, int format,
     return pkey;
 }
 
+static bool write_header(BIO *bio_sig_out, uint32_t version)
+{
+    SigHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MAGIC, MAGIC_SIZE);
+    hdr.version = mb_htole32(version);
+
+    if (BIO_write(bio_sig_out, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        LOGE("Failed to write header to signature BIO stream");
+        openssl_log_errors();
+        return false;
+    }
+
+    return true;
+}
+
 /*!
- * \brief Sign data from stream
- *
- * \param bio_data_in Input stream for data
- * \param bio_sig_out Output stream for signature
- * \param pkey Private key
- *
- * \return Whether the signing operation was successful
+ * \brief Sign SHA512 digest of the whole input (version 1)
  */
-bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+static bool sign_data_v1(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
 {
-    assert(bio_data_in && bio_sig_out && pkey);
-
-    unsigned int version = VERSION_LATEST;
-    const EVP_MD *md_type = nullptr;
+    const EVP_MD *md_type = EVP_sha512();
     EVP_MD_CTX *mctx = nullptr;
     EVP_PKEY_CTX *pctx = nullptr;
 #ifdef OPENSSL_IS_BORINGSSL
@@ -357,13 +390,6 @@ bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
     size_t len;
     int n;
 
-    if (version == VERSION_1_SHA512_DGST) {
-        md_type = EVP_sha512();
-    } else {
-        LOGE("Invalid signature file version");
-        return false;
-    }
-
 #ifdef OPENSSL_IS_BORINGSSL
     EVP_MD_CTX_init(&ctx);
     mctx = &ctx;
@@ -426,15 +452,7 @@ bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
         goto error;
     }
 
-    // Write header
-    SigHeader hdr;
-    memset(&hdr, 0, sizeof(hdr));
-    memcpy(hdr.magic, MAGIC, MAGIC_SIZE);
-    hdr.version = version;
-
-    if (BIO_write(bio_sig_out, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-        LOGE("Failed to write header to signature BIO stream");
-        openssl_log_errors();
+    if (!write_header(bio_sig_out, VERSION_1_SHA512_DGST)) {
         goto error;
     }
 
@@ -462,158 +480,808 @@ error:
     return false;
 }
 
+
 /*!
- * \brief Verify signature of data from stream
+ * \brief Read until \a size bytes have been read or EOF is reached
  *
- * \param bio_data_in Input stream for data
- * \param bio_sig_in Input stream for signature
- * \param pkey Public key
- * \param result_out Output pointer for result of verification operation
+ * \return Number of bytes read or -1 on error
+ */
+static long read_full(BIO *bio, unsigned char *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        size_t to_read = std::min<size_t>(size - total, INT32_MAX);
+        int n = BIO_read(bio, buf + total, static_cast<int>(to_read));
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    return static_cast<long>(total);
+}
+
+static bool sha512_prefixed(unsigned char prefix,
+                            const unsigned char *data1, size_t size1,
+                            const unsigned char *data2, size_t size2,
+                            unsigned char *digest_out)
+{
+    EVP_MD_CTX *mctx = EVP_MD_CTX_create();
+    bool ret = mctx
+            && EVP_DigestInit_ex(mctx, EVP_sha512(), nullptr)
+            && EVP_DigestUpdate(mctx, &prefix, 1)
+            && EVP_DigestUpdate(mctx, data1, size1)
+            && (!data2 || EVP_DigestUpdate(mctx, data2, size2))
+            && EVP_DigestFinal_ex(mctx, digest_out, nullptr);
+    EVP_MD_CTX_destroy(mctx);
+
+    if (!ret) {
+        LOGE("Failed to compute digest");
+        openssl_log_errors();
+    }
+    return ret;
+}
+
+static inline bool merkle_leaf(const unsigned char *data, size_t size,
+                               unsigned char *digest_out)
+{
+    return sha512_prefixed(MERKLE_LEAF_PREFIX, data, size, nullptr, 0,
+                           digest_out);
+}
+
+/*!
+ * \brief Compute the root of the hash tree over the chunk digests
  *
- * \return Whether the verification operation completed successfully (does not
- *         indicate whether the signature is valid)
+ * Each interior node is SHA512(0x01 || left || right). If a level has an odd
+ * number of nodes, the last one is carried up to the next level unchanged.
  */
-bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
-                 EVP_PKEY *pkey, bool *result_out)
+static bool merkle_root(const std::vector<unsigned char> &leaves,
+                        unsigned char *root_out)
 {
-    assert(bio_data_in && bio_sig_in && pkey && result_out);
+    std::vector<unsigned char> level(leaves);
+    size_t count = level.size() / SHA512_DIGEST_LENGTH;
+
+    while (count > 1) {
+        size_t next = 0;
+
+        for (size_t i = 0; i < count; i += 2) {
+            unsigned char *dest = level.data() + next * SHA512_DIGEST_LENGTH;
+            const unsigned char *left = level.data() + i * SHA512_DIGEST_LENGTH;
+
+            if (i + 1 < count) {
+                if (!sha512_prefixed(MERKLE_NODE_PREFIX,
+                                     left, SHA512_DIGEST_LENGTH,
+                                     left + SHA512_DIGEST_LENGTH,
+                                     SHA512_DIGEST_LENGTH, dest)) {
+                    return false;
+                }
+            } else if (dest != left) {
+                memmove(dest, left, SHA512_DIGEST_LENGTH);
+            }
+            ++next;
+        }
 
-    SigHeader hdr;
-    const EVP_MD *md_type = nullptr;
+        count = next;
+    }
+
+    memcpy(root_out, level.data(), SHA512_DIGEST_LENGTH);
+    return true;
+}
+
+/*!
+ * \brief Build the message that is signed in version 2 signature files
+ *
+ * \param info Info structure (host byte order)
+ * \param leaves Chunk digests
+ * \param msg_out Output buffer for SigV2Info (little endian) || root
+ */
+static bool v2_signed_message(const SigV2Info &info,
+                              const std::vector<unsigned char> &leaves,
+                              std::vector<unsigned char> *msg_out)
+{
+    SigV2Info info_le;
+    info_le.data_size = mb_htole64(info.data_size);
+    info_le.chunk_size = mb_htole32(info.chunk_size);
+    info_le.leaf_count = mb_htole32(info.leaf_count);
+
+    msg_out->resize(sizeof(info_le) + SHA512_DIGEST_LENGTH);
+    memcpy(msg_out->data(), &info_le, sizeof(info_le));
+
+    return merkle_root(leaves, msg_out->data() + sizeof(info_le));
+}
+
+/*!
+ * \brief Hash input in 1 MiB chunks and sign the root of the hash tree
+ *        (version 2)
+ */
+static bool sign_data_v2(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    SigV2Info info;
+    std::vector<unsigned char> leaves;
+    std::vector<unsigned char> msg;
+    std::vector<unsigned char> sig;
+    std::vector<unsigned char> buf(MERKLE_CHUNK_SIZE);
     EVP_MD_CTX *mctx = nullptr;
-    EVP_PKEY_CTX *pctx = nullptr;
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX ctx;
-#else
-    BIO *bio_md = nullptr;
-#endif
-    BIO *bio_input = nullptr;
-    unsigned char *buf = nullptr;
-    unsigned char *sigbuf = nullptr;
-    int siglen;
-    int n;
+    size_t sig_len;
+    bool ret = false;
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_init(&ctx);
-    mctx = &ctx;
-#else
-    bio_md = BIO_new(BIO_f_md());
-    if (!bio_md) {
+    info.data_size = 0;
+    info.chunk_size = MERKLE_CHUNK_SIZE;
+    info.leaf_count = 0;
+
+    // An empty input still has one (empty) chunk
+    do {
+        long n = read_full(bio_data_in, buf.data(), buf.size());
+        if (n < 0) {
+            LOGE("Failed to read from input data BIO stream");
+            openssl_log_errors();
+            return false;
+        } else if (n == 0 && info.leaf_count > 0) {
+            break;
+        }
+
+        leaves.resize(leaves.size() + SHA512_DIGEST_LENGTH);
+        if (!merkle_leaf(buf.data(), n,
+                         leaves.data() + leaves.size() - SHA512_DIGEST_LENGTH)) {
+            return false;
+        }
+
+        info.data_size += n;
+        ++info.leaf_count;
+
+        if (static_cast<size_t>(n) < buf.size()) {
+            break;
+        }
+    } while (info.leaf_count < MERKLE_MAX_LEAVES);
+
+    if (info.leaf_count >= MERKLE_MAX_LEAVES) {
+        LOGE("Input data is too large");
+        return false;
+    }
+
+    if (!v2_signed_message(info, leaves, &msg)) {
+        return false;
+    }
+
+    mctx = EVP_MD_CTX_create();
+    sig.resize(EVP_PKEY_size(pkey));
+    sig_len = sig.size();
+
+    if (!mctx
+            || !EVP_DigestSignInit(mctx, nullptr, EVP_sha512(), nullptr, pkey)
+            || !EVP_DigestSignUpdate(mctx, msg.data(), msg.size())
+            || !EVP_DigestSignFinal(mctx, sig.data(), &sig_len)) {
+        LOGE("Failed to sign data");
         openssl_log_errors();
-        goto error;
+        goto done;
     }
 
-    if (!BIO_get_md_ctx(bio_md, &mctx)) {
-        LOGE("Failed to get message digest context");
+    if (!write_header(bio_sig_out, VERSION_2_SHA512_MERKLE)) {
+        goto done;
+    }
+
+    if (BIO_write(bio_sig_out, msg.data(), sizeof(SigV2Info))
+                    != sizeof(SigV2Info)
+            || BIO_write(bio_sig_out, leaves.data(), leaves.size())
+                    != static_cast<int>(leaves.size())
+            || BIO_write(bio_sig_out, sig.data(), sig_len)
+                    != static_cast<int>(sig_len)) {
+        LOGE("Failed to write signature to signature BIO stream");
         openssl_log_errors();
-        goto error;
+        goto done;
     }
-#endif
+
+    ret = true;
+
+done:
+    EVP_MD_CTX_destroy(mctx);
+    return ret;
+}
+
+/*!
+ * \brief Sign data from stream
+ *
+ * This creates a version 1 signature, which all versions of mbtool can verify.
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    return sign_data_with_version(bio_data_in, bio_sig_out, pkey,
+                                  SIGNATURE_VERSION_1);
+}
+
+/*!
+ * \brief Sign data from stream using a specific signature format
+ *
+ * Version 1 signs the SHA512 digest of the data. Version 2 signs the root of
+ * a hash tree of 1 MiB chunks and stores the chunk digests in the signature
+ * file, which allows the chunks to be verified independently and in parallel.
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ * \param version Signature format (one of the SIGNATURE_VERSION_* values)
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data_with_version(BIO *bio_data_in, BIO *bio_sig_out,
+                            EVP_PKEY *pkey, int version)
+{
+    assert(bio_data_in && bio_sig_out && pkey);
+
+    switch (version) {
+    case SIGNATURE_VERSION_1:
+        return sign_data_v1(bio_data_in, bio_sig_out, pkey);
+    case SIGNATURE_VERSION_2:
+        return sign_data_v2(bio_data_in, bio_sig_out, pkey);
+    default:
+        LOGE("Invalid signature file version");
+        return false;
+    }
+}
+
+struct ParsedSignature
+{
+    uint32_t version;
+    // Only used for version 2 (host byte order)
+    SigV2Info info;
+    std::vector<unsigned char> leaves;
+    std::vector<unsigned char> sig;
+};
+
+/*!
+ * \brief Read and validate the structure of a signature file
+ *
+ * \param bio_sig_in Input stream for signature
+ * \param max_sig_len Largest signature size of the keys that will be checked
+ * \param out Output for parsed signature
+ */
+static bool read_signature(BIO *bio_sig_in, int max_sig_len,
+                           ParsedSignature *out)
+{
+    SigHeader hdr;
 
     // Read header from signature file
     if (BIO_read(bio_sig_in, &hdr, sizeof(hdr)) != sizeof(hdr)) {
         LOGE("Failed to read header from signature BIO stream");
         openssl_log_errors();
-        goto error;
+        return false;
     }
 
     // Verify header
     if (memcmp(hdr.magic, MAGIC, MAGIC_SIZE) != 0) {
         LOGE("Invalid magic in signature file");
         openssl_log_errors();
-        goto error;
+        return false;
     }
 
+    out->version = mb_le32toh(hdr.version);
+
     // Verify version
-    if (hdr.version == VERSION_1_SHA512_DGST) {
-        md_type = EVP_sha512();
-    } else {
-        LOGE("Invalid version in signature file: %u", hdr.version);
+    if (out->version == VERSION_2_SHA512_MERKLE) {
+        SigV2Info info;
+
+        if (BIO_read(bio_sig_in, &info, sizeof(info)) != sizeof(info)) {
+            LOGE("Failed to read tree info from signature BIO stream");
+            openssl_log_errors();
+            return false;
+        }
+
+        out->info.data_size = mb_le64toh(info.data_size);
+        out->info.chunk_size = mb_le32toh(info.chunk_size);
+        out->info.leaf_count = mb_le32toh(info.leaf_count);
+
+        // The chunk count must match the data size exactly
+        uint64_t chunk_size = out->info.chunk_size;
+        uint64_t expected = out->info.data_size == 0 ? 1
+                : (out->info.data_size + chunk_size - 1) / chunk_size;
+        if (chunk_size == 0 || out->info.leaf_count >= MERKLE_MAX_LEAVES
+                || out->info.leaf_count != expected) {
+            LOGE("Invalid tree info in signature file");
+            return false;
+        }
+
+        out->leaves.resize(
+                static_cast<size_t>(out->info.leaf_count) * SHA512_DIGEST_LENGTH);
+        if (read_full(bio_sig_in, out->leaves.data(), out->leaves.size())
+                != static_cast<long>(out->leaves.size())) {
+            LOGE("Failed to read chunk digests from signature BIO stream");
+            openssl_log_errors();
+            return false;
+        }
+    } else if (out->version != VERSION_1_SHA512_DGST) {
+        LOGE("Invalid version in signature file: %u", out->version);
         openssl_log_errors();
-        goto error;
+        return false;
     }
 
-    if (!EVP_DigestVerifyInit(mctx, &pctx, md_type, nullptr, pkey)) {
-        LOGE("Failed to set message digest context");
+    out->sig.resize(max_sig_len);
+    int n = BIO_read(bio_sig_in, out->sig.data(), max_sig_len);
+    if (n <= 0) {
+        LOGE("Failed to read signature BIO stream");
         openssl_log_errors();
-        goto error;
+        return false;
     }
+    out->sig.resize(n);
 
-    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
-    if (!buf) {
-        LOGE("Failed to allocate I/O buffer");
-        openssl_log_errors();
-        goto error;
+    return true;
+}
+
+static int max_signature_size(EVP_PKEY * const *pkeys, size_t count)
+{
+    int size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size = std::max(size, EVP_PKEY_size(pkeys[i]));
+    }
+    return size;
+}
+
+/*!
+ * \brief Check the signature of a SHA512 digest against a list of keys
+ *
+ * \return Whether the check completed (\a valid_out is true if any key matched)
+ */
+static bool check_signed_digest(const ParsedSignature &psig,
+                                const unsigned char *digest,
+                                unsigned int digest_len,
+                                EVP_PKEY * const *pkeys, size_t count,
+                                bool *valid_out)
+{
+    bool valid = false;
+
+    for (size_t i = 0; i < count && !valid; ++i) {
+        EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(pkeys[i], nullptr);
+        if (!pctx || EVP_PKEY_verify_init(pctx) <= 0
+                || EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha512()) <= 0) {
+            LOGE("Failed to set public key context");
+            openssl_log_errors();
+            EVP_PKEY_CTX_free(pctx);
+            return false;
+        }
+
+        int n = EVP_PKEY_verify(pctx, psig.sig.data(), psig.sig.size(),
+                                digest, digest_len);
+        EVP_PKEY_CTX_free(pctx);
+
+        if (n == 1) {
+            valid = true;
+        } else if (n < 0) {
+            LOGE("Failed to verify data");
+            openssl_log_errors();
+            return false;
+        }
     }
 
-    siglen = EVP_PKEY_size(pkey);
-    sigbuf = (unsigned char *) OPENSSL_malloc(siglen);
-    if (!sigbuf) {
-        LOGE("Failed to allocate signature buffer");
+    *valid_out = valid;
+    return true;
+}
+
+/*!
+ * \brief Check the signature over a version 2 hash tree
+ *
+ * The chunk digests themselves must be checked against the data separately.
+ */
+static bool check_signed_tree(const ParsedSignature &psig,
+                              EVP_PKEY * const *pkeys, size_t count,
+                              bool *valid_out)
+{
+    std::vector<unsigned char> msg;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+
+    if (!v2_signed_message(psig.info, psig.leaves, &msg)) {
+        return false;
+    }
+
+    if (!EVP_Digest(msg.data(), msg.size(), digest, &digest_len, EVP_sha512(),
+                    nullptr)) {
+        LOGE("Failed to compute digest");
         openssl_log_errors();
-        goto error;
+        return false;
     }
-    siglen = BIO_read(bio_sig_in, sigbuf, siglen);
-    if (siglen <= 0) {
-        LOGE("Failed to read signature BIO stream");
+
+    return check_signed_digest(psig, digest, digest_len, pkeys, count,
+                               valid_out);
+}
+
+static bool digest_stream(BIO *bio_data_in, unsigned char *digest,
+                          unsigned int *digest_len)
+{
+    EVP_MD_CTX *mctx = nullptr;
+    unsigned char *buf = nullptr;
+    bool ret = false;
+
+    mctx = EVP_MD_CTX_create();
+    if (!mctx || !EVP_DigestInit_ex(mctx, EVP_sha512(), nullptr)) {
+        LOGE("Failed to set message digest context");
         openssl_log_errors();
-        goto error;
+        goto done;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    bio_input = bio_data_in;
-#else
-    bio_input = BIO_push(bio_md, bio_data_in);
-#endif
+    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
+    if (!buf) {
+        LOGE("Failed to allocate I/O buffer");
+        openssl_log_errors();
+        goto done;
+    }
 
     while (true) {
-        n = BIO_read(bio_input, buf, BUFSIZE);
+        int n = BIO_read(bio_data_in, buf, BUFSIZE);
         if (n < 0) {
             LOGE("Failed to read input data BIO stream");
             openssl_log_errors();
-            goto error;
+            goto done;
         }
         if (n == 0) {
             break;
         }
-#ifdef OPENSSL_IS_BORINGSSL
         if (!EVP_DigestUpdate(mctx, buf, n)) {
             LOGE("Failed to update digest");
             openssl_log_errors();
-            goto error;
+            goto done;
         }
-#endif
     }
 
-    n = EVP_DigestVerifyFinal(mctx, sigbuf, siglen);
-    if (n == 1) {
-        *result_out = true;
-    } else if (n == 0) {
-        *result_out = false;
-    } else {
-        LOGE("Failed to verify data");
+    if (!EVP_DigestFinal_ex(mctx, digest, digest_len)) {
+        LOGE("Failed to finalize digest");
         openssl_log_errors();
-        goto error;
+        goto done;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(sigbuf);
+    ret = true;
+
+done:
+    EVP_MD_CTX_destroy(mctx);
     OPENSSL_free(buf);
+    return ret;
+}
+
+/*!
+ * \brief Hash one chunk of the data and compare it to its digest in the
+ *        signature file
+ *
+ * \param bio_data_in Input stream positioned at the start of the chunk
+ * \param psig Parsed version 2 signature
+ * \param index Chunk index
+ * \param buf Buffer of at least the chunk size
+ * \param match_out Whether the data matched
+ */
+static bool check_chunk(BIO *bio_data_in, const ParsedSignature &psig,
+                        uint32_t index, unsigned char *buf, bool *match_out)
+{
+    uint64_t offset = static_cast<uint64_t>(index) * psig.info.chunk_size;
+    size_t expected = static_cast<size_t>(std::min<uint64_t>(
+            psig.info.chunk_size, psig.info.data_size - offset));
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    long n = read_full(bio_data_in, buf, expected);
+    if (n < 0) {
+        LOGE("Failed to read input data BIO stream");
+        openssl_log_errors();
+        return false;
+    } else if (static_cast<size_t>(n) != expected) {
+        // Truncated
+        *match_out = false;
+        return true;
+    }
+
+    if (!merkle_leaf(buf, expected, digest)) {
+        return false;
+    }
+
+    *match_out = memcmp(digest, psig.leaves.data()
+            + static_cast<size_t>(index) * SHA512_DIGEST_LENGTH,
+            SHA512_DIGEST_LENGTH) == 0;
     return true;
+}
 
-error:
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
-    OPENSSL_free(sigbuf);
-    OPENSSL_free(buf);
-    return false;
+/*!
+ * \brief Verify signature of data from stream
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_in Input stream for signature
+ * \param pkey Public key
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
+                 EVP_PKEY *pkey, bool *result_out)
+{
+    return verify_data_with_keys(bio_data_in, bio_sig_in, &pkey, 1,
+                                 result_out);
+}
+
+/*!
+ * \brief Verify signature of data from stream against multiple public keys
+ *
+ * The data is read and hashed only once, regardless of the number of keys.
+ * Both signature versions are supported. For version 2 signatures, reading
+ * stops at the first chunk that does not match.
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_in Input stream for signature
+ * \param pkeys Array of public keys
+ * \param count Number of public keys
+ * \param result_out Output pointer for result of verification operation (true
+ *                   if the signature is valid for any of the keys)
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data_with_keys(BIO *bio_data_in, BIO *bio_sig_in,
+                           EVP_PKEY * const *pkeys, size_t count,
+                           bool *result_out)
+{
+    assert(bio_data_in && bio_sig_in && pkeys && count > 0 && result_out);
+
+    ParsedSignature psig;
+
+    if (!read_signature(bio_sig_in, max_signature_size(pkeys, count), &psig)) {
+        return false;
+    }
+
+    if (psig.version == VERSION_1_SHA512_DGST) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int digest_len;
+
+        return digest_stream(bio_data_in, digest, &digest_len)
+                && check_signed_digest(psig, digest, digest_len, pkeys, count,
+                                       result_out);
+    }
+
+    // Check the (cheap) signature over the tree before reading the data
+    bool valid;
+    if (!check_signed_tree(psig, pkeys, count, &valid)) {
+        return false;
+    } else if (!valid) {
+        *result_out = false;
+        return true;
+    }
+
+    std::vector<unsigned char> buf(psig.info.chunk_size);
+
+    for (uint32_t i = 0; i < psig.info.leaf_count; ++i) {
+        bool match;
+        if (!check_chunk(bio_data_in, psig, i, buf.data(), &match)) {
+            return false;
+        } else if (!match) {
+            *result_out = false;
+            return true;
+        }
+    }
+
+    // There must not be any trailing data
+    unsigned char c;
+    int n = BIO_read(bio_data_in, &c, 1);
+    if (n < 0) {
+        LOGE("Failed to read input data BIO stream");
+        openssl_log_errors();
+        return false;
+    }
+
+    *result_out = n == 0;
+    return true;
+}
+
+struct BatchTask
+{
+    size_t file;
+    // Chunk index for version 2 signatures (unused for version 1)
+    uint32_t chunk;
+};
+
+struct BatchFile
+{
+    ParsedSignature psig;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len;
+    std::atomic<bool> failed;
+    std::atomic<bool> mismatch;
+};
+
+static BIO * open_file_at(const char *path, uint64_t offset)
+{
+    BIO *bio = BIO_new_file(path, "rb");
+    if (!bio) {
+        LOGE("%s: Failed to open file", path);
+        openssl_log_errors();
+        return nullptr;
+    }
+
+    if (offset > 0 && BIO_seek(bio, static_cast<long>(offset)) < 0) {
+        LOGE("%s: Failed to seek file", path);
+        openssl_log_errors();
+        BIO_free(bio);
+        return nullptr;
+    }
+
+    return bio;
+}
+
+/*!
+ * \brief Run one verification task
+ */
+static void run_batch_task(VerifyFileInfo *infos, BatchFile *files,
+                           const BatchTask &task, unsigned char *buf)
+{
+    VerifyFileInfo &info = infos[task.file];
+    BatchFile &file = files[task.file];
+
+    if (file.failed || file.mismatch) {
+        return;
+    }
+
+    if (file.psig.version == VERSION_1_SHA512_DGST) {
+        BIO *bio = open_file_at(info.path, 0);
+        if (!bio || !digest_stream(bio, file.digest, &file.digest_len)) {
+            file.failed = true;
+        }
+        BIO_free(bio);
+        return;
+    }
+
+    const ParsedSignature &psig = file.psig;
+    uint64_t offset = static_cast<uint64_t>(task.chunk) * psig.info.chunk_size;
+    bool last = task.chunk + 1 == psig.info.leaf_count;
+    bool match;
+
+    BIO *bio = open_file_at(info.path, offset);
+    if (!bio || !check_chunk(bio, psig, task.chunk, buf, &match)) {
+        file.failed = true;
+    } else if (!match) {
+        file.mismatch = true;
+    } else if (last) {
+        // There must not be any trailing data
+        unsigned char c;
+        int n = BIO_read(bio, &c, 1);
+        if (n < 0) {
+            LOGE("%s: Failed to read file", info.path);
+            openssl_log_errors();
+            file.failed = true;
+        } else if (n > 0) {
+            file.mismatch = true;
+        }
+    }
+    BIO_free(bio);
+}
+
+/*!
+ * \brief Verify the signatures of multiple files concurrently
+ *
+ * All signature files are read first. The work is then split into tasks that
+ * are run on \a threads threads: one task per file for version 1 signatures
+ * and one task per 1 MiB chunk for version 2 signatures, so a single large
+ * file can also be verified in parallel. Once one chunk of a file does not
+ * match, the rest of that file's chunks are skipped.
+ *
+ * \param files Array of files. `path` and `sig_path` are inputs. `ok` is set
+ *              to whether the file's verification completed and `valid` to
+ *              whether its signature is valid for any of the keys.
+ * \param n Number of files
+ * \param pkeys Array of public keys
+ * \param count Number of public keys
+ * \param threads Number of threads (0 to use the number of CPUs)
+ *
+ * \return Whether the verification of every file completed (does not indicate
+ *         whether the signatures are valid)
+ */
+bool verify_files(VerifyFileInfo *files, size_t n,
+                  EVP_PKEY * const *pkeys, size_t count,
+                  unsigned int threads)
+{
+    assert((files || n == 0) && pkeys && count > 0);
+
+    std::vector<BatchFile> state(n);
+    std::vector<BatchTask> tasks;
+    int max_sig_len = max_signature_size(pkeys, count);
+
+    for (size_t i = 0; i < n; ++i) {
+        files[i].ok = false;
+        files[i].valid = false;
+        state[i].failed = false;
+        state[i].mismatch = false;
+
+        BIO *bio_sig = BIO_new_file(files[i].sig_path, "rb");
+        if (!bio_sig) {
+            LOGE("%s: Failed to open signature file", files[i].sig_path);
+            openssl_log_errors();
+            state[i].failed = true;
+            continue;
+        }
+
+        bool ret = read_signature(bio_sig, max_sig_len, &state[i].psig);
+        BIO_free(bio_sig);
+
+        if (!ret) {
+            state[i].failed = true;
+        } else if (state[i].psig.version == VERSION_1_SHA512_DGST) {
+            tasks.push_back({ i, 0 });
+        } else {
+            bool valid;
+            if (!check_signed_tree(state[i].psig, pkeys, count, &valid)) {
+                state[i].failed = true;
+            } else if (!valid) {
+                state[i].mismatch = true;
+            } else {
+                for (uint32_t c = 0; c < state[i].psig.info.leaf_count; ++c) {
+                    tasks.push_back({ i, c });
+                }
+            }
+        }
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned int>(
+            std::min<size_t>(threads, tasks.size()));
+
+    std::atomic<size_t> next_task(0);
+    auto worker = [&]{
+        std::vector<unsigned char> buf;
+        size_t i;
+
+        while ((i = next_task++) < tasks.size()) {
+            const BatchTask &task = tasks[i];
+            uint32_t chunk_size = state[task.file].psig.info.chunk_size;
+            if (state[task.file].psig.version == VERSION_2_SHA512_MERKLE
+                    && buf.size() < chunk_size) {
+                buf.resize(chunk_size);
+            }
+            run_batch_task(files, state.data(), task, buf.data());
+        }
+    };
+
+    if (threads > 1) {
+        std::vector<std::thread> workers;
+        for (unsigned int i = 1; i < threads; ++i) {
+            workers.emplace_back(worker);
+        }
+        worker();
+        for (auto &t : workers) {
+            t.join();
+        }
+    } else {
+        worker();
+    }
+
+    bool ret = true;
+
+    for (size_t i = 0; i < n; ++i) {
+        BatchFile &file = state[i];
+
+        if (file.failed) {
+            ret = false;
+            continue;
+        }
+
+        if (file.mismatch) {
+            files[i].valid = false;
+        } else if (file.psig.version == VERSION_1_SHA512_DGST) {
+            if (!check_signed_digest(file.psig, file.digest, file.digest_len,
+                                     pkeys, count, &files[i].valid)) {
+                ret = false;
+                continue;
+            }
+        } else {
+            // The signature over the tree was checked before hashing
+            files[i].valid = true;
+        }
+
+        files[i].ok = true;
+    }
+
+    return ret;
 }
 
 }
@@ -19,6 +19,13 @@
 
 #include <gtest/gtest.h>
 
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include <unistd.h>
+
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -235,3 +242,261 @@ TEST(SignTest, TestLoadValidPemKeysWithInvalidPassphrase)
     EVP_PKEY_free(private_key_read);
     BIO_free(bio);
 }
+
+TEST(SignTest, TestVerifyWithMultipleKeys)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    EVP_PKEY *other_private_key;
+    EVP_PKEY *other_public_key;
+    EVP_PKEY *pkeys[2];
+    BIO *bio_data;
+    BIO *bio_sig;
+    char *sig_data;
+    long sig_size;
+    bool result;
+
+    static const char data[] = "The quick brown fox jumps over the lazy dog";
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+    ASSERT_TRUE(generate_keys(&other_private_key, &other_public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf(data, sizeof(data));
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    BIO_free(bio_data);
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+
+    // Matching key is second
+    pkeys[0] = other_public_key;
+    pkeys[1] = public_key;
+    bio_data = BIO_new_mem_buf(data, sizeof(data));
+    BIO *bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_TRUE(mb::sign::verify_data_with_keys(
+            bio_data, bio_sig_in, pkeys, 2, &result));
+    ASSERT_TRUE(result);
+    BIO_free(bio_data);
+    BIO_free(bio_sig_in);
+
+    // No matching key
+    bio_data = BIO_new_mem_buf(data, sizeof(data));
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_TRUE(mb::sign::verify_data_with_keys(
+            bio_data, bio_sig_in, pkeys, 1, &result));
+    ASSERT_FALSE(result);
+    BIO_free(bio_data);
+    BIO_free(bio_sig_in);
+
+    // Single key
+    bio_data = BIO_new_mem_buf(data, sizeof(data));
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_TRUE(mb::sign::verify_data(
+            bio_data, bio_sig_in, public_key, &result));
+    ASSERT_TRUE(result);
+    BIO_free(bio_data);
+    BIO_free(bio_sig_in);
+
+    // Modified data
+    bio_data = BIO_new_mem_buf(data, sizeof(data) - 2);
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_TRUE(mb::sign::verify_data_with_keys(
+            bio_data, bio_sig_in, pkeys, 2, &result));
+    ASSERT_FALSE(result);
+    BIO_free(bio_data);
+    BIO_free(bio_sig_in);
+
+    BIO_free(bio_sig);
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_free(other_private_key);
+    EVP_PKEY_free(other_public_key);
+}
+
+static bool verify_buffer(const std::vector<unsigned char> &data,
+                          const char *sig_data, long sig_size,
+                          EVP_PKEY *public_key, bool *result)
+{
+    BIO *bio_data = BIO_new_mem_buf(
+            const_cast<unsigned char *>(data.data()), data.size());
+    BIO *bio_sig_in = BIO_new_mem_buf(const_cast<char *>(sig_data), sig_size);
+    bool ret = bio_data && bio_sig_in && mb::sign::verify_data(
+            bio_data, bio_sig_in, public_key, result);
+    BIO_free(bio_data);
+    BIO_free(bio_sig_in);
+    return ret;
+}
+
+TEST(SignTest, TestVersion2Signature)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    BIO *bio_data;
+    BIO *bio_sig;
+    char *sig_data;
+    long sig_size;
+    bool result;
+
+    // Spans three 1 MiB chunks
+    std::vector<unsigned char> data(2 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<unsigned char>(i * 31 + (i >> 12));
+    }
+
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf(data.data(), data.size());
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data_with_version(
+            bio_data, bio_sig, private_key, mb::sign::SIGNATURE_VERSION_2));
+    BIO_free(bio_data);
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+
+    // Unmodified data
+    ASSERT_TRUE(verify_buffer(data, sig_data, sig_size, public_key, &result));
+    ASSERT_TRUE(result);
+
+    // Modified chunk
+    std::vector<unsigned char> modified(data);
+    modified[1024 * 1024 + 5] ^= 0xff;
+    ASSERT_TRUE(verify_buffer(modified, sig_data, sig_size, public_key,
+                              &result));
+    ASSERT_FALSE(result);
+
+    // Truncated data
+    modified.assign(data.begin(), data.end() - 1);
+    ASSERT_TRUE(verify_buffer(modified, sig_data, sig_size, public_key,
+                              &result));
+    ASSERT_FALSE(result);
+
+    // Trailing data
+    modified.assign(data.begin(), data.end());
+    modified.push_back(0);
+    ASSERT_TRUE(verify_buffer(modified, sig_data, sig_size, public_key,
+                              &result));
+    ASSERT_FALSE(result);
+
+    // Modified chunk digest in the signature file (after the header and tree
+    // info)
+    std::vector<char> bad_sig(sig_data, sig_data + sig_size);
+    bad_sig[20 + 16 + 5] ^= 0xff;
+    ASSERT_TRUE(verify_buffer(data, bad_sig.data(), bad_sig.size(), public_key,
+                              &result));
+    ASSERT_FALSE(result);
+
+    BIO_free(bio_sig);
+
+    // Empty data
+    data.clear();
+    bio_data = BIO_new_mem_buf(const_cast<char *>(""), 0);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data_with_version(
+            bio_data, bio_sig, private_key, mb::sign::SIGNATURE_VERSION_2));
+    BIO_free(bio_data);
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_TRUE(verify_buffer(data, sig_data, sig_size, public_key, &result));
+    ASSERT_TRUE(result);
+    BIO_free(bio_sig);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+}
+
+static bool write_file(const std::string &path,
+                       const std::vector<unsigned char> &data)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ret = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return fclose(fp) == 0 && ret;
+}
+
+static bool sign_file(const std::string &path, const std::string &sig_path,
+                      EVP_PKEY *private_key, int version)
+{
+    BIO *bio_data = BIO_new_file(path.c_str(), "rb");
+    BIO *bio_sig = BIO_new_file(sig_path.c_str(), "wb");
+    bool ret = bio_data && bio_sig && mb::sign::sign_data_with_version(
+            bio_data, bio_sig, private_key, version);
+    BIO_free(bio_data);
+    BIO_free(bio_sig);
+    return ret;
+}
+
+TEST(SignTest, TestVerifyFiles)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    char tmpdir[] = "/tmp/mbsign_test_XXXXXX";
+
+    ASSERT_NE(mkdtemp(tmpdir), nullptr);
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+
+    std::vector<std::string> paths;
+    std::vector<std::string> sig_paths;
+
+    for (int i = 0; i < 4; ++i) {
+        std::vector<unsigned char> data(1024 * 1024 * i + 1000 * i, 'a' + i);
+        std::string path(tmpdir);
+        path += "/file";
+        path += static_cast<char>('0' + i);
+
+        paths.push_back(path);
+        sig_paths.push_back(path + ".sig");
+
+        ASSERT_TRUE(write_file(path, data));
+        ASSERT_TRUE(sign_file(path, sig_paths.back(), private_key,
+                              i % 2 == 0 ? mb::sign::SIGNATURE_VERSION_1
+                                         : mb::sign::SIGNATURE_VERSION_2));
+    }
+
+    // Corrupt the v2 file with more than one chunk and the last v1 file
+    ASSERT_TRUE(write_file(paths[3], std::vector<unsigned char>(
+            3 * 1024 * 1024 + 3000, 'x')));
+    ASSERT_TRUE(write_file(paths[2], std::vector<unsigned char>(
+            2 * 1024 * 1024 + 2000, 'x')));
+
+    std::vector<mb::sign::VerifyFileInfo> files(paths.size() + 1);
+    for (size_t i = 0; i < paths.size(); ++i) {
+        files[i].path = paths[i].c_str();
+        files[i].sig_path = sig_paths[i].c_str();
+    }
+    // Missing signature
+    files.back().path = paths[0].c_str();
+    files.back().sig_path = "/nonexistent";
+
+    for (unsigned int threads : { 1u, 4u }) {
+        ASSERT_FALSE(mb::sign::verify_files(files.data(), files.size(),
+                                            &public_key, 1, threads));
+        ASSERT_TRUE(files[0].ok);
+        ASSERT_TRUE(files[0].valid);
+        ASSERT_TRUE(files[1].ok);
+        ASSERT_TRUE(files[1].valid);
+        ASSERT_TRUE(files[2].ok);
+        ASSERT_FALSE(files[2].valid);
+        ASSERT_TRUE(files[3].ok);
+        ASSERT_FALSE(files[3].valid);
+        ASSERT_FALSE(files[4].ok);
+    }
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        unlink(paths[i].c_str());
+        unlink(sig_paths[i].c_str());
+    }
+    rmdir(tmpdir);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+// Called from the worker threads, but never concurrently
+typedef void (*ExpandProgressCallback)(uint64_t bytes, uint64_t max_bytes,
+                                       void *userdata);
+
+struct ExpandOptions
+{
+    // Number of threads or 0 to use the global thread pool
+    unsigned int threads = 0;
+    // Maximum number of bytes copied or filled by each read or write. Must be
+    // a multiple of 4.
+    size_t buffer_size = 1024 * 1024;
+    ExpandProgressCallback progress_cb = nullptr;
+    void *userdata = nullptr;
+};
+
+struct ExpandStats
+{
+    // Bytes copied from raw chunks
+    uint64_t data_bytes = 0;
+    // Bytes written for fill chunks
+    uint64_t fill_bytes = 0;
+    // Bytes in "don't care" chunks, which are not written
+    uint64_t hole_bytes = 0;
+};
+
+MB_EXPORT bool expand_parallel(File &source, File &target,
+                               const ExpandOptions &options,
+                               std::string &error);
+MB_EXPORT bool expand_parallel(File &source, File &target,
+                               const ExpandOptions &options,
+                               ExpandStats &stats, std::string &error);
+
+}
+}
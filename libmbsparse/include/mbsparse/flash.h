@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+// Alignment of the buffers passed to the target file
+constexpr size_t FLASH_BUFFER_ALIGNMENT = 4096;
+
+// Called from the thread that invoked flash()
+typedef void (*FlashProgressCallback)(uint64_t bytes, uint64_t max_bytes,
+                                      void *userdata);
+
+// Called from the writer thread for each "don't care" region. The offsets are
+// absolute offsets in the target file.
+typedef bool (*FlashDiscardCallback)(uint64_t offset, uint64_t size,
+                                     void *userdata);
+
+struct FlashOptions
+{
+    // Size of each buffer passed between the stages. Must be a multiple of
+    // FLASH_BUFFER_ALIGNMENT.
+    size_t buffer_size = 1024 * 1024;
+    // Number of buffers between each pair of stages
+    size_t buffer_count = 4;
+    // Verify CRC32 chunks (implies reading "don't care" regions)
+    bool verify_crc32 = false;
+    // Read the target before writing each buffer and skip the write if the
+    // target already has the same contents. The target must be readable.
+    bool skip_identical = false;
+    // If set, also called for the "don't care" region at the end of the image
+    FlashDiscardCallback discard_cb = nullptr;
+    FlashProgressCallback progress_cb = nullptr;
+    void *userdata = nullptr;
+};
+
+struct FlashStats
+{
+    // Bytes written to the target
+    uint64_t written_bytes = 0;
+    // Bytes not written because the target already had the same contents
+    uint64_t skipped_bytes = 0;
+    // Bytes passed to the discard callback
+    uint64_t discarded_bytes = 0;
+};
+
+MB_EXPORT bool flash(File &source, File &target, const FlashOptions &options,
+                     std::string &error);
+MB_EXPORT bool flash(File &source, File &target, const FlashOptions &options,
+                     FlashStats &stats, std::string &error);
+
+}
+}
@@ -27,6 +27,29 @@ namespace mb
 namespace sparse
 {
 
+enum class SparseExtentType
+{
+    // Data that must be read from the sparse file
+    Data,
+    // Repeated 4-byte pattern
+    Fill,
+    // "Don't care" region that reads as zeros
+    Hole,
+};
+
+struct SparseExtent
+{
+    SparseExtentType type;
+    // Byte range in the sparse file
+    uint64_t begin;
+    uint64_t end;
+    // [SparseExtentType::Fill only] Pattern bytes, starting at `begin`
+    unsigned char fill[4];
+    // [SparseExtentType::Data only] Offset of the data at `begin`, relative to
+    // the position of the underlying file when the sparse file was opened
+    uint64_t src_offset;
+};
+
 class SparseFilePrivate;
 class MB_EXPORT SparseFile : public File
 {
@@ -45,6 +68,18 @@ public:
 
     // File size
     uint64_t size();
+    uint32_t block_size();
+
+    // Chunk index
+    bool build_index();
+    bool load_index(File &file);
+    bool save_index(File &file);
+
+    // Checksums
+    void set_verify_crc32(bool verify);
+
+    // Extents
+    bool get_extent(SparseExtent &extent);
 
 protected:
     /*! \cond INTERNAL */
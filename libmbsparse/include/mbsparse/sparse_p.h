@@ -69,6 +69,41 @@ struct ChunkHeader
  * - For a CRC32 chunk, it's 4 bytes of CRC32
  */
 
+/*
+ * A chunk index is stored as a SparseIndexHeader followed by one
+ * SparseIndexChunk for each chunk in the sparse file. All fields are little
+ * endian. The offsets of each chunk are not stored since they can be computed
+ * from the sizes of the previous chunks.
+ *
+ * Since the sparse header alone does not identify a sparse file, the index
+ * also records the size of the sparse file and a checksum of the index
+ * entries. The last chunk header is compared against the sparse file when the
+ * index is loaded.
+ */
+
+constexpr uint32_t SPARSE_INDEX_MAGIC =     0x5844494d; // "MIDX"
+constexpr uint32_t SPARSE_INDEX_VERSION =   2;
+
+struct SparseIndexHeader
+{
+    uint32_t magic;          // SPARSE_INDEX_MAGIC
+    uint32_t version;        // SPARSE_INDEX_VERSION
+    uint64_t source_size;    // Size of the indexed sparse file
+    uint32_t chunks_crc32;   // CRC32 of all SparseIndexChunk entries
+    uint32_t reserved1;
+    SparseHeader shdr;       // Sparse header of the indexed file
+    uint32_t reserved2;
+};
+
+struct SparseIndexChunk
+{
+    uint16_t chunk_type;     // Same as ChunkHeader::chunk_type
+    uint16_t reserved1;
+    uint32_t chunk_sz;       // Same as ChunkHeader::chunk_sz
+    uint32_t total_sz;       // Same as ChunkHeader::total_sz
+    uint32_t fill_val;       // [CHUNK_TYPE_FILL only] Filler value
+};
+
 /*! \brief Minimum information we need from the chunk headers while reading */
 struct ChunkInfo
 {
@@ -131,13 +166,23 @@ public:
                        ChunkInfo &chunk_out);
 
     bool move_to_chunk(uint64_t offset);
+    bool read_all_chunks();
+
+    bool index_chunk(const SparseIndexChunk &ichunk, uint64_t src_offset,
+                     uint64_t tgt_offset, ChunkInfo &chunk_out);
+    bool source_size(uint64_t &size_out);
+    bool read_chunk_header_at(uint64_t src_offset, ChunkHeader &chdr);
 
     File *file;
     Seekability seekability;
 
-    // Expected CRC32 checksum. We currently do *not* validate this. It would
-    // only work if the entire file was read sequentially anyway.
+    // Expected CRC32 checksum from the last CRC32 chunk
     uint32_t expected_crc32;
+    // Whether to verify CRC32 chunks
+    bool verify_crc32;
+    // Checksum of the output data in the range [0, crc32_offset)
+    uint32_t crc32;
+    uint64_t crc32_offset;
     // Relative offset in input file
     uint64_t cur_src_offset;
     // Absolute offset in output file
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/guard_p.h"
+
+#include <vector>
+
+#include <cstdint>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_p.h"
+#include "mbsparse/sparse_writer.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+// Maximum size of the data in a raw chunk. Raw blocks are buffered until the
+// chunk is complete so that the chunk header can be written before the data.
+constexpr size_t SPARSE_WRITER_MAX_RAW_SIZE = 1024 * 1024;
+
+class SparseWriterPrivate
+{
+    MB_DECLARE_PUBLIC(SparseWriter)
+
+public:
+    SparseWriterPrivate(SparseWriter *sw);
+    ~SparseWriterPrivate() = default;
+
+    void clear();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseWriterPrivate)
+
+    bool wwrite(const void *buf, size_t size);
+
+    bool write_chunk_header(uint16_t type, uint32_t chunk_sz,
+                            uint32_t data_size);
+    bool flush_chunk();
+    bool append_blocks(uint16_t type, uint32_t fill_val,
+                       const unsigned char *raw_data, uint64_t count);
+    bool process_block(const unsigned char *buf);
+    bool write_repeated(uint16_t type, uint32_t fill_val, uint64_t size);
+
+    File *file;
+    uint32_t block_size;
+    bool add_crc32;
+
+    // Offset of the sparse header in the output file
+    uint64_t header_offset;
+
+    uint64_t total_blocks;
+    uint32_t total_chunks;
+    uint32_t crc32;
+
+    // Partially written block
+    std::vector<unsigned char> block;
+    size_t block_used;
+
+    // Chunk that is still being extended. A type of 0 means that there is no
+    // pending chunk.
+    uint16_t chunk_type;
+    uint32_t chunk_blocks;
+    uint32_t chunk_fill_val;
+    std::vector<unsigned char> chunk_data;
+
+private:
+    SparseWriter *_pub_ptr;
+};
+
+/*! \endcond */
+
+}
+}
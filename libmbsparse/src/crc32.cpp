@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/crc32_p.h"
+
+#include <cstring>
+
+#if defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#endif
+
+#include "mbcommon/endian.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+#if !defined(__ARM_FEATURE_CRC32)
+// Tables for processing 8 bytes at a time ("slicing-by-8")
+struct Crc32Tables
+{
+    uint32_t data[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            data[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int t = 1; t < 8; ++t) {
+                data[t][i] = data[0][data[t - 1][i] & 0xff]
+                        ^ (data[t - 1][i] >> 8);
+            }
+        }
+    }
+};
+#endif
+
+/*!
+ * \brief Update CRC32 checksum
+ *
+ * This uses the standard 802.3 polynomial, as required by the sparse file
+ * format. If the target supports the ARMv8 CRC32 instructions, they are used
+ * instead of the lookup tables.
+ *
+ * \param crc Checksum of the previous data (0 for no data)
+ * \param buf Data
+ * \param size Size of data
+ *
+ * \return Checksum of the previous data followed by \p buf
+ */
+uint32_t update_crc32(uint32_t crc, const void *buf, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(buf);
+
+    crc = ~crc;
+
+#if defined(__ARM_FEATURE_CRC32)
+    while (size >= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+        crc = __crc32d(crc, mb_le64toh(word));
+        ptr += sizeof(word);
+        size -= sizeof(word);
+    }
+    while (size-- > 0) {
+        crc = __crc32b(crc, *ptr++);
+    }
+#else
+    static const Crc32Tables tables;
+    auto const &t = tables.data;
+
+    while (size >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, ptr, sizeof(lo));
+        memcpy(&hi, ptr + 4, sizeof(hi));
+        lo = mb_le32toh(lo) ^ crc;
+        hi = mb_le32toh(hi);
+
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+                ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+                ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+                ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+        ptr += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = t[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+#endif
+
+    return ~crc;
+}
+
+/*! \endcond */
+
+}
+}
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbsparse/expand.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cinttypes>
+#include <cstring>
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbsparse/sparse.h"
+
+/*!
+ * \file expand.cpp
+ * \brief Random-access sparse image expander
+ *
+ * expand_parallel() reads all of the chunk headers up front and splits the raw
+ * and fill chunks into pieces of at most ExpandOptions::buffer_size bytes.
+ * Every piece has a fixed position in both the source and the target, so the
+ * pieces do not depend on each other and are spread across a thread pool.
+ * Each worker copies its pieces with read_at() and write_at(), so no file
+ * position is shared between the threads. "Don't care" chunks are never
+ * written and remain holes in the target.
+ */
+
+namespace mb
+{
+namespace sparse
+{
+
+struct ExpandPiece
+{
+    SparseExtentType type;
+    // Byte range in the target file
+    uint64_t offset;
+    size_t size;
+    // [SparseExtentType::Data only] Offset in the source file
+    uint64_t src_offset;
+    // [SparseExtentType::Fill only] Pattern bytes, starting at `offset`
+    unsigned char fill[4];
+};
+
+struct ExpandContext
+{
+    ExpandContext(File &source_, File &target_, const ExpandOptions &options_)
+        : source(source_), target(target_), options(options_)
+    {
+    }
+
+    File &source;
+    File &target;
+    const ExpandOptions &options;
+    uint64_t max_bytes = 0;
+
+    std::atomic<uint64_t> data_bytes{0};
+    std::atomic<uint64_t> fill_bytes{0};
+    // Includes the holes, which are counted before any work starts
+    std::atomic<uint64_t> done_bytes{0};
+
+    // Protects the error message and serializes the progress callback
+    std::mutex lock;
+    std::string error;
+
+    void fail(std::string msg)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Only keep the first error
+        if (error.empty()) {
+            error = std::move(msg);
+        }
+    }
+
+    void report()
+    {
+        if (!options.progress_cb) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Loading the counter under the lock keeps the reported values
+        // increasing even if the workers finish out of order
+        options.progress_cb(done_bytes, max_bytes, options.userdata);
+    }
+};
+
+/*!
+ * \brief Split the extents of the sparse image into independent pieces
+ */
+static bool collect_pieces(ExpandContext &ctx, std::vector<ExpandPiece> &pieces,
+                           uint64_t &hole_bytes)
+{
+    SparseFile sparse_file;
+    SparseExtent extent;
+    uint64_t base;
+
+    // The extent source offsets are relative to the start of the image
+    if (!ctx.source.seek(0, SEEK_CUR, &base)) {
+        ctx.fail(format("Failed to get source file position: %s",
+                        ctx.source.error_string().c_str()));
+        return false;
+    }
+
+    if (!sparse_file.open(&ctx.source)) {
+        ctx.fail(format("Failed to open sparse file: %s",
+                        sparse_file.error_string().c_str()));
+        return false;
+    }
+
+    if (!sparse_file.build_index()) {
+        ctx.fail(format("Failed to index sparse file: %s",
+                        sparse_file.error_string().c_str()));
+        return false;
+    }
+
+    ctx.max_bytes = sparse_file.size();
+    hole_bytes = 0;
+
+    while (true) {
+        if (!sparse_file.get_extent(extent)) {
+            ctx.fail(format("Failed to read sparse file: %s",
+                            sparse_file.error_string().c_str()));
+            return false;
+        } else if (extent.begin == extent.end) {
+            break;
+        }
+
+        if (extent.type == SparseExtentType::Hole) {
+            hole_bytes += extent.end - extent.begin;
+        } else {
+            // The pieces start at multiples of buffer_size from the beginning
+            // of the extent, so the fill pattern does not need to be shifted
+            for (uint64_t offset = extent.begin; offset < extent.end;) {
+                ExpandPiece piece = {};
+                piece.type = extent.type;
+                piece.offset = offset;
+                piece.size = static_cast<size_t>(std::min<uint64_t>(
+                        extent.end - offset, ctx.options.buffer_size));
+
+                if (extent.type == SparseExtentType::Data) {
+                    piece.src_offset = base + extent.src_offset
+                            + (offset - extent.begin);
+                } else {
+                    memcpy(piece.fill, extent.fill, sizeof(piece.fill));
+                }
+
+                pieces.push_back(piece);
+                offset += piece.size;
+            }
+        }
+
+        if (!sparse_file.seek(static_cast<int64_t>(extent.end), SEEK_SET,
+                              nullptr)) {
+            ctx.fail(format("Failed to seek sparse file: %s",
+                            sparse_file.error_string().c_str()));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool expand_piece(ExpandContext &ctx, const ExpandPiece &piece,
+                         std::vector<unsigned char> &buf, bool &buf_is_fill,
+                         uint32_t &buf_fill)
+{
+    size_t n;
+
+    if (piece.type == SparseExtentType::Data) {
+        buf_is_fill = false;
+
+        if (!file_read_fully_at(ctx.source, piece.src_offset, buf.data(),
+                                piece.size, n)) {
+            ctx.fail(format("Failed to read sparse file: %s",
+                            ctx.source.error_string().c_str()));
+            return false;
+        } else if (n != piece.size) {
+            ctx.fail("Unexpected EOF in sparse file");
+            return false;
+        }
+    } else {
+        uint32_t fill;
+        memcpy(&fill, piece.fill, sizeof(fill));
+
+        // Consecutive fill pieces usually have the same pattern
+        if (!buf_is_fill || buf_fill != fill) {
+            for (size_t i = 0; i < buf.size(); i += sizeof(fill)) {
+                memcpy(buf.data() + i, piece.fill, sizeof(fill));
+            }
+            buf_is_fill = true;
+            buf_fill = fill;
+        }
+    }
+
+    if (!file_write_fully_at(ctx.target, piece.offset, buf.data(), piece.size,
+                             n)) {
+        ctx.fail(format("Failed to write target file: %s",
+                        ctx.target.error_string().c_str()));
+        return false;
+    } else if (n != piece.size) {
+        ctx.fail("Unexpected EOF when writing target file");
+        return false;
+    }
+
+    if (piece.type == SparseExtentType::Data) {
+        ctx.data_bytes += piece.size;
+    } else {
+        ctx.fill_bytes += piece.size;
+    }
+    ctx.done_bytes += piece.size;
+
+    ctx.report();
+
+    return true;
+}
+
+/*!
+ * \brief Expand a sparse image using multiple threads
+ *
+ * Unlike flash(), which streams the image, this function needs random access
+ * to both files. The chunk headers of \p source are indexed first and then the
+ * raw and fill chunks are expanded in parallel, in no particular order; see
+ * the description at the top of expand.cpp. \p target is resized to the size
+ * of the expanded image and the "don't care" regions are not written, so
+ * they will read as zeros if \p target was empty (and will take up no space on
+ * file systems that support sparse files).
+ *
+ * Both files are accessed from several threads at once with read_at() and
+ * write_at(), so they must implement those natively (eg. FdFile, PosixFile, or
+ * MemoryFile). Files that emulate them by seeking are not thread safe.
+ *
+ * \param source Seekable sparse image
+ * \param target File to write the expanded image to
+ * \param options Number of threads, buffer size, and progress callback
+ * \param[out] stats Number of bytes copied, filled, and left as holes
+ * \param[out] error Error message if expanding fails
+ *
+ * \return Whether the image was successfully expanded
+ */
+bool expand_parallel(File &source, File &target, const ExpandOptions &options,
+                     ExpandStats &stats, std::string &error)
+{
+    if (options.buffer_size == 0 || options.buffer_size % 4 != 0) {
+        error = format("Invalid buffer size: %" MB_PRIzu, options.buffer_size);
+        return false;
+    }
+
+    ExpandContext ctx(source, target, options);
+    std::vector<ExpandPiece> pieces;
+    uint64_t hole_bytes;
+
+    if (!collect_pieces(ctx, pieces, hole_bytes)) {
+        error = ctx.error;
+        return false;
+    }
+
+    if (!target.truncate(ctx.max_bytes)) {
+        error = format("Failed to resize target file: %s",
+                       target.error_string().c_str());
+        return false;
+    }
+
+    ctx.done_bytes = hole_bytes;
+    ctx.report();
+
+    std::unique_ptr<ThreadPool> local_pool;
+    if (options.threads != 0) {
+        local_pool.reset(new ThreadPool(options.threads));
+    }
+    ThreadPool &pool = local_pool ? *local_pool : ThreadPool::global();
+
+    pool.parallel_for(0, pieces.size(), 0, [&](size_t begin, size_t end) {
+        std::vector<unsigned char> buf(static_cast<size_t>(
+                std::min<uint64_t>(options.buffer_size, ctx.max_bytes)));
+        bool buf_is_fill = false;
+        uint32_t buf_fill = 0;
+
+        for (size_t i = begin; i < end; ++i) {
+            if (!expand_piece(ctx, pieces[i], buf, buf_is_fill, buf_fill)) {
+                return false;
+            }
+        }
+
+        return true;
+    });
+
+    stats.data_bytes = ctx.data_bytes;
+    stats.fill_bytes = ctx.fill_bytes;
+    stats.hole_bytes = hole_bytes;
+
+    if (!ctx.error.empty()) {
+        error = ctx.error;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Expand a sparse image using multiple threads
+ *
+ * This is the same as expand_parallel(File &, File &, const ExpandOptions &,
+ * ExpandStats &, std::string &), but does not return the statistics.
+ */
+bool expand_parallel(File &source, File &target, const ExpandOptions &options,
+                     std::string &error)
+{
+    ExpandStats stats;
+    return expand_parallel(source, target, options, stats, error);
+}
+
+}
+}
@@ -0,0 +1,665 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/flash.h"
+
+// For std::min()
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#  include <malloc.h>
+#endif
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbsparse/sparse.h"
+
+/*!
+ * \file flash.cpp
+ * \brief Pipelined sparse image flasher
+ *
+ * flash() splits the work into three stages that run concurrently:
+ *
+ * 1. A reader thread copies the (possibly compressed) source file into a ring
+ *    of buffers. All of the decompression cost is paid on this thread.
+ * 2. The calling thread parses the sparse image from that ring, expands raw
+ *    and fill chunks, and verifies CRC32 chunks if requested. The expanded
+ *    data is packed into a second ring of aligned buffers.
+ * 3. A writer thread writes each buffer to the target file with a single
+ *    large write, seeking over "don't care" regions.
+ *
+ * Each ring holds a fixed number of buffers, so a slow stage applies
+ * backpressure to the stages before it instead of growing memory usage.
+ */
+
+namespace mb
+{
+namespace sparse
+{
+
+static unsigned char * aligned_alloc_buffer(size_t size)
+{
+    void *ptr;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, FLASH_BUFFER_ALIGNMENT);
+#else
+    if (posix_memalign(&ptr, FLASH_BUFFER_ALIGNMENT, size) != 0) {
+        ptr = nullptr;
+    }
+#endif
+    return static_cast<unsigned char *>(ptr);
+}
+
+static void aligned_free_buffer(unsigned char *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+struct FlashBuffer
+{
+    unsigned char *data;
+    size_t size;
+    // [Write ring only] Offset in the expanded image
+    uint64_t offset;
+};
+
+/*!
+ * \brief Bounded ring of buffers shared by a producer and a consumer
+ *
+ * The producer acquire()s an empty buffer, fills it, and submit()s it. The
+ * consumer receive()s filled buffers in the order they were submitted and
+ * release()s them once they are no longer needed.
+ */
+class BufferRing
+{
+public:
+    BufferRing(size_t count, size_t size) :
+        _buffer_size(size), _finished(false), _aborted(false)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            unsigned char *ptr = aligned_alloc_buffer(size);
+            if (!ptr) {
+                break;
+            }
+            _storage.push_back(ptr);
+            _free.push_back({ ptr, 0, 0 });
+        }
+    }
+
+    ~BufferRing()
+    {
+        for (auto *ptr : _storage) {
+            aligned_free_buffer(ptr);
+        }
+    }
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BufferRing)
+
+    bool allocated(size_t count) const
+    {
+        return _storage.size() == count;
+    }
+
+    size_t buffer_size() const
+    {
+        return _buffer_size;
+    }
+
+    bool acquire(FlashBuffer &buf)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _aborted || !_free.empty(); });
+
+        if (_aborted) {
+            return false;
+        }
+
+        buf = _free.front();
+        buf.size = 0;
+        buf.offset = 0;
+        _free.pop_front();
+        return true;
+    }
+
+    void submit(const FlashBuffer &buf)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _filled.push_back(buf);
+        }
+        _cv.notify_all();
+    }
+
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+        }
+        _cv.notify_all();
+    }
+
+    // Returns false once the ring is finished and drained or was aborted
+    bool receive(FlashBuffer &buf)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return _aborted || _finished || !_filled.empty();
+        });
+
+        if (_aborted || _filled.empty()) {
+            return false;
+        }
+
+        buf = _filled.front();
+        _filled.pop_front();
+        return true;
+    }
+
+    void release(const FlashBuffer &buf)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _free.push_back(buf);
+        }
+        _cv.notify_all();
+    }
+
+    void abort()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _aborted = true;
+        }
+        _cv.notify_all();
+    }
+
+    bool aborted()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _aborted;
+    }
+
+private:
+    size_t _buffer_size;
+    std::vector<unsigned char *> _storage;
+    std::deque<FlashBuffer> _free;
+    std::deque<FlashBuffer> _filled;
+    bool _finished;
+    bool _aborted;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+};
+
+struct FlashContext
+{
+    FlashContext(const FlashOptions &options) :
+        read_ring(options.buffer_count, options.buffer_size),
+        write_ring(options.buffer_count, options.buffer_size)
+    {
+    }
+
+    BufferRing read_ring;
+    BufferRing write_ring;
+
+    // Only accessed by the writer thread until it is joined
+    FlashStats stats;
+
+    std::mutex error_mutex;
+    std::string error;
+
+    // Record the first error and stop all stages
+    void fail(std::string msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (error.empty()) {
+                error = std::move(msg);
+            }
+        }
+
+        read_ring.abort();
+        write_ring.abort();
+    }
+};
+
+/*!
+ * \brief Read-only file that returns the contents of a BufferRing
+ */
+class RingFile : public File
+{
+public:
+    RingFile(BufferRing &ring) : _ring(ring), _have_buf(false), _pos(0)
+    {
+        open();
+    }
+
+    virtual ~RingFile()
+    {
+        close();
+    }
+
+protected:
+    virtual bool on_close() override
+    {
+        if (_have_buf) {
+            _ring.release(_buf);
+            _have_buf = false;
+        }
+        return true;
+    }
+
+    virtual bool on_read(void *buf, size_t size, size_t &bytes_read) override
+    {
+        if (!_have_buf) {
+            if (!_ring.receive(_buf)) {
+                if (_ring.aborted()) {
+                    set_error(make_error_code(std::errc::operation_canceled),
+                              "Source reader was stopped");
+                    return false;
+                }
+
+                bytes_read = 0;
+                return true;
+            }
+
+            _have_buf = true;
+            _pos = 0;
+        }
+
+        size_t n = std::min(size, _buf.size - _pos);
+        memcpy(buf, _buf.data + _pos, n);
+        _pos += n;
+
+        if (_pos == _buf.size) {
+            _ring.release(_buf);
+            _have_buf = false;
+        }
+
+        bytes_read = n;
+        return true;
+    }
+
+private:
+    BufferRing &_ring;
+    FlashBuffer _buf;
+    bool _have_buf;
+    size_t _pos;
+};
+
+static void read_stage(FlashContext &ctx, File &source)
+{
+    BufferRing &ring = ctx.read_ring;
+    FlashBuffer buf;
+    size_t n;
+
+    while (ring.acquire(buf)) {
+        if (!file_read_fully(source, buf.data, ring.buffer_size(), n)) {
+            ring.release(buf);
+            ctx.fail(format("Failed to read source file: %s",
+                            source.error_string().c_str()));
+            return;
+        }
+
+        if (n > 0) {
+            buf.size = n;
+            ring.submit(buf);
+        } else {
+            ring.release(buf);
+        }
+
+        if (n < ring.buffer_size()) {
+            ring.finish();
+            return;
+        }
+    }
+}
+
+/*!
+ * \brief Check if the target already contains the buffer's data
+ *
+ * \return Whether the comparison could be done
+ */
+static bool target_matches(File &target, uint64_t offset,
+                           const FlashBuffer &buf, unsigned char *scratch,
+                           bool &matches)
+{
+    size_t n;
+
+    if (!file_read_fully_at(target, offset, scratch, buf.size, n)) {
+        return false;
+    }
+
+    // Target may be shorter than the image (eg. a new file)
+    matches = n == buf.size && memcmp(scratch, buf.data, buf.size) == 0;
+    return true;
+}
+
+static void write_stage(FlashContext &ctx, File &target,
+                        const FlashOptions &options)
+{
+    BufferRing &ring = ctx.write_ring;
+    FlashBuffer buf;
+    // Target position relative to the starting offset
+    uint64_t pos = 0;
+    // End of the previous buffer. Any gap before the next one is a hole.
+    uint64_t data_end = 0;
+    uint64_t base = 0;
+    std::unique_ptr<unsigned char, decltype(&aligned_free_buffer)> scratch(
+            nullptr, &aligned_free_buffer);
+    size_t n;
+
+    if (options.skip_identical || options.discard_cb) {
+        if (!target.seek(0, SEEK_CUR, &base)) {
+            ctx.fail(format("Failed to get target file position: %s",
+                            target.error_string().c_str()));
+            return;
+        }
+    }
+
+    if (options.skip_identical) {
+        scratch.reset(aligned_alloc_buffer(ring.buffer_size()));
+        if (!scratch) {
+            ctx.fail("Failed to allocate buffers");
+            return;
+        }
+    }
+
+    while (ring.receive(buf)) {
+        if (options.discard_cb && buf.offset > data_end) {
+            if (!options.discard_cb(base + data_end, buf.offset - data_end,
+                                    options.userdata)) {
+                ring.release(buf);
+                ctx.fail(format("Failed to discard target region"));
+                return;
+            }
+            ctx.stats.discarded_bytes += buf.offset - data_end;
+        }
+        data_end = buf.offset + buf.size;
+
+        if (options.skip_identical) {
+            bool matches;
+
+            if (!target_matches(target, base + buf.offset, buf, scratch.get(),
+                                matches)) {
+                ring.release(buf);
+                ctx.fail(format("Failed to read target file: %s",
+                                target.error_string().c_str()));
+                return;
+            } else if (matches) {
+                ctx.stats.skipped_bytes += buf.size;
+                ring.release(buf);
+                continue;
+            }
+        }
+
+        // End of image marker for the discard callback
+        if (buf.size == 0) {
+            ring.release(buf);
+            continue;
+        }
+
+        // Leave "don't care" regions and identical data untouched
+        if (buf.offset != pos && !target.seek(
+                static_cast<int64_t>(buf.offset - pos), SEEK_CUR, nullptr)) {
+            ring.release(buf);
+            ctx.fail(format("Failed to seek target file: %s",
+                            target.error_string().c_str()));
+            return;
+        }
+
+        if (!file_write_fully(target, buf.data, buf.size, n)) {
+            ring.release(buf);
+            ctx.fail(format("Failed to write target file: %s",
+                            target.error_string().c_str()));
+            return;
+        } else if (n != buf.size) {
+            ring.release(buf);
+            ctx.fail(format("Unexpected EOF when writing target file"));
+            return;
+        }
+
+        ctx.stats.written_bytes += buf.size;
+        pos = buf.offset + buf.size;
+        ring.release(buf);
+    }
+}
+
+static bool expand_stage(FlashContext &ctx, const FlashOptions &options)
+{
+    RingFile ring_file(ctx.read_ring);
+    SparseFile sparse_file;
+    BufferRing &ring = ctx.write_ring;
+    SparseExtent extent;
+    FlashBuffer buf;
+    bool have_buf = false;
+    std::vector<unsigned char> scratch;
+    size_t n;
+
+    sparse_file.set_verify_crc32(options.verify_crc32);
+
+    if (!sparse_file.open(&ring_file)) {
+        ctx.fail(format("Failed to open sparse file: %s",
+                        sparse_file.error_string().c_str()));
+        return false;
+    }
+
+    uint64_t max_bytes = sparse_file.size();
+
+    if (options.progress_cb) {
+        options.progress_cb(0, max_bytes, options.userdata);
+    }
+
+    while (true) {
+        if (!sparse_file.get_extent(extent)) {
+            ctx.fail(format("Failed to read sparse file: %s",
+                            sparse_file.error_string().c_str()));
+            return false;
+        } else if (extent.begin == extent.end) {
+            break;
+        }
+
+        if (extent.type == SparseExtentType::Hole) {
+            // Holes break up the contiguous output
+            if (have_buf) {
+                ring.submit(buf);
+                have_buf = false;
+            }
+
+            if (options.verify_crc32) {
+                // The checksum covers the zeros too, so they must be read
+                scratch.resize(ring.buffer_size());
+                for (uint64_t remain = extent.end - extent.begin; remain > 0;
+                        remain -= n) {
+                    if (!file_read_fully(sparse_file, scratch.data(),
+                                         static_cast<size_t>(std::min<uint64_t>(
+                                                 remain, scratch.size())), n)
+                            || n == 0) {
+                        ctx.fail(format("Failed to read sparse file: %s",
+                                        sparse_file.error_string().c_str()));
+                        return false;
+                    }
+                }
+            } else if (!sparse_file.seek(static_cast<int64_t>(extent.end),
+                                         SEEK_SET, nullptr)) {
+                ctx.fail(format("Failed to seek sparse file: %s",
+                                sparse_file.error_string().c_str()));
+                return false;
+            }
+        } else {
+            uint64_t offset = extent.begin;
+
+            while (offset < extent.end) {
+                if (!have_buf) {
+                    if (!ring.acquire(buf)) {
+                        // Writer failed and already recorded the error
+                        return false;
+                    }
+                    buf.offset = offset;
+                    have_buf = true;
+                }
+
+                size_t to_read = static_cast<size_t>(std::min<uint64_t>(
+                        extent.end - offset, ring.buffer_size() - buf.size));
+
+                if (!file_read_fully(sparse_file, buf.data + buf.size,
+                                     to_read, n)) {
+                    ring.release(buf);
+                    ctx.fail(format("Failed to read sparse file: %s",
+                                    sparse_file.error_string().c_str()));
+                    return false;
+                } else if (n != to_read) {
+                    ring.release(buf);
+                    ctx.fail(format("Unexpected EOF in sparse file"));
+                    return false;
+                }
+
+                buf.size += n;
+                offset += n;
+
+                if (buf.size == ring.buffer_size()) {
+                    ring.submit(buf);
+                    have_buf = false;
+                }
+            }
+        }
+
+        if (options.progress_cb) {
+            options.progress_cb(extent.end, max_bytes, options.userdata);
+        }
+    }
+
+    if (have_buf) {
+        ring.submit(buf);
+    }
+
+    // Let the writer discard the trailing hole too
+    if (options.discard_cb) {
+        if (!ring.acquire(buf)) {
+            return false;
+        }
+        buf.offset = max_bytes;
+        ring.submit(buf);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Flash a sparse image to a file or block device
+ *
+ * The sparse image is read from \p source, which does not need to be
+ * seekable, and is expanded into \p target starting at its current offset.
+ * "Don't care" regions are skipped with a seek, so they keep their existing
+ * contents. Reading, expanding, and writing happen on separate threads; see
+ * the description at the top of flash.cpp.
+ *
+ * The buffers written to \p target are aligned to FLASH_BUFFER_ALIGNMENT and
+ * every write except the last of each contiguous region is
+ * FLASH_BUFFER_ALIGNMENT bytes long. Since the regions start and end on sparse
+ * block boundaries, \p target may be opened with `O_DIRECT` if the sparse
+ * block size is a multiple of the device's logical block size.
+ *
+ * If FlashOptions::skip_identical is set, each buffer is compared with the
+ * target's existing contents first and is only written if they differ. This
+ * makes re-flashing an unchanged image mostly read-only. If
+ * FlashOptions::discard_cb is set, it is called with every "don't care" region
+ * (including one at the end of the image), which allows the caller to discard
+ * those regions on a block device.
+ *
+ * \param source Sparse image
+ * \param target File to write the expanded image to
+ * \param options Buffer sizes, checksum verification, write elision, and
+ *                progress callback
+ * \param[out] stats Number of bytes written, skipped, and discarded
+ * \param[out] error Error message if flashing fails
+ *
+ * \return Whether the image was successfully flashed
+ */
+bool flash(File &source, File &target, const FlashOptions &options,
+           FlashStats &stats, std::string &error)
+{
+    if (options.buffer_count == 0 || options.buffer_size == 0
+            || options.buffer_size % FLASH_BUFFER_ALIGNMENT != 0) {
+        error = format("Invalid buffer size or count: %" MB_PRIzu " x %"
+                       MB_PRIzu, options.buffer_count, options.buffer_size);
+        return false;
+    }
+
+    FlashContext ctx(options);
+
+    if (!ctx.read_ring.allocated(options.buffer_count)
+            || !ctx.write_ring.allocated(options.buffer_count)) {
+        error = "Failed to allocate buffers";
+        return false;
+    }
+
+    std::thread reader(&read_stage, std::ref(ctx), std::ref(source));
+    std::thread writer(&write_stage, std::ref(ctx), std::ref(target),
+                       std::cref(options));
+
+    if (expand_stage(ctx, options)) {
+        // Any data after the sparse image is ignored
+        ctx.read_ring.abort();
+        ctx.write_ring.finish();
+    }
+
+    reader.join();
+    writer.join();
+
+    stats = ctx.stats;
+
+    if (!ctx.error.empty()) {
+        error = ctx.error;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Flash a sparse image to a file or block device
+ *
+ * This is the same as flash(File &, File &, const FlashOptions &,
+ * FlashStats &, std::string &), but does not return the statistics.
+ */
+bool flash(File &source, File &target, const FlashOptions &options,
+           std::string &error)
+{
+    FlashStats stats;
+    return flash(source, target, options, stats, error);
+}
+
+}
+}
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/merge.h"
+
+// For std::min()
+#include <algorithm>
+#include <vector>
+
+#include <cinttypes>
+#include <cstring>
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+/*!
+ * \file merge.cpp
+ * \brief Merge sparse images chunk by chunk
+ *
+ * Both inputs are walked in order of their offsets in the expanded image. Any
+ * region covered by a raw or fill chunk in the overlay is taken from the
+ * overlay and every "don't care" region of the overlay is taken from the base.
+ * Fill and "don't care" regions are copied as chunks, so only the raw chunks
+ * that end up in the output are ever read and nothing is expanded to disk.
+ */
+
+namespace mb
+{
+namespace sparse
+{
+
+// Size of the buffer used for copying raw chunks
+constexpr size_t MERGE_BUFFER_SIZE = 1024 * 1024;
+
+/*!
+ * \brief Base image, which is either a SparseFile or a raw image
+ */
+struct MergeBase
+{
+    // File to read data from
+    File *file;
+    // Set if the base image is sparse
+    SparseFile *sparse;
+    // Size of the expanded image
+    uint64_t size;
+    // Current offset in the expanded image
+    uint64_t offset;
+};
+
+static bool base_get_extent(MergeBase &base, uint64_t offset,
+                            SparseExtent &extent, std::string &error)
+{
+    if (offset != base.offset) {
+        if (!base.file->seek(static_cast<int64_t>(offset), SEEK_SET,
+                             nullptr)) {
+            error = format("Failed to seek base image: %s",
+                           base.file->error_string().c_str());
+            return false;
+        }
+        base.offset = offset;
+    }
+
+    if (!base.sparse) {
+        extent = {};
+        extent.type = SparseExtentType::Data;
+        extent.begin = offset;
+        extent.end = base.size;
+        return true;
+    }
+
+    if (!base.sparse->get_extent(extent)) {
+        error = format("Failed to read base image: %s",
+                       base.sparse->error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_data(File &input, const char *name, SparseWriter &writer,
+                      uint64_t size, std::vector<unsigned char> &buf,
+                      std::string &error)
+{
+    size_t n;
+
+    while (size > 0) {
+        size_t to_read = static_cast<size_t>(
+                std::min<uint64_t>(size, buf.size()));
+
+        if (!file_read_fully(input, buf.data(), to_read, n)) {
+            error = format("Failed to read %s image: %s",
+                           name, input.error_string().c_str());
+            return false;
+        } else if (n != to_read) {
+            error = format("Unexpected EOF in %s image", name);
+            return false;
+        }
+
+        if (!file_write_fully(writer, buf.data(), n, n)) {
+            error = format("Failed to write output image: %s",
+                           writer.error_string().c_str());
+            return false;
+        }
+
+        size -= to_read;
+    }
+
+    return true;
+}
+
+static bool copy_extent(File &input, const char *name, SparseWriter &writer,
+                        const SparseExtent &extent, uint64_t end,
+                        std::vector<unsigned char> &buf, std::string &error)
+{
+    uint64_t size = end - extent.begin;
+    bool ret = false;
+
+    switch (extent.type) {
+    case SparseExtentType::Data:
+        return copy_data(input, name, writer, size, buf, error);
+    case SparseExtentType::Fill:
+        uint32_t fill_val;
+        memcpy(&fill_val, extent.fill, sizeof(fill_val));
+        ret = writer.write_fill(fill_val, size);
+        break;
+    case SparseExtentType::Hole:
+        ret = writer.write_dont_care(size);
+        break;
+    }
+
+    if (!ret) {
+        error = format("Failed to write output image: %s",
+                       writer.error_string().c_str());
+    }
+    return ret;
+}
+
+static bool merge(MergeBase &base, File &overlay_file, File &output,
+                  bool add_crc32, std::string &error)
+{
+    SparseFile overlay;
+    SparseExtent extent;
+    SparseExtent base_extent;
+    std::vector<unsigned char> buf(MERGE_BUFFER_SIZE);
+
+    if (!overlay.open(&overlay_file)) {
+        error = format("Failed to open overlay image: %s",
+                       overlay.error_string().c_str());
+        return false;
+    }
+
+    if (base.size != overlay.size()) {
+        error = format("Base image size (%" PRIu64 ") does not match overlay "
+                       "image size (%" PRIu64 ")", base.size, overlay.size());
+        return false;
+    } else if (base.sparse && base.sparse->block_size()
+            != overlay.block_size()) {
+        error = format("Base image block size (%" PRIu32 ") does not match "
+                       "overlay image block size (%" PRIu32 ")",
+                       base.sparse->block_size(), overlay.block_size());
+        return false;
+    }
+
+    SparseWriter writer(&output, overlay.block_size(), add_crc32);
+    if (!writer.is_open()) {
+        error = format("Failed to open output image: %s",
+                       writer.error_string().c_str());
+        return false;
+    }
+
+    while (true) {
+        if (!overlay.get_extent(extent)) {
+            error = format("Failed to read overlay image: %s",
+                           overlay.error_string().c_str());
+            return false;
+        } else if (extent.begin == extent.end) {
+            break;
+        }
+
+        if (extent.type != SparseExtentType::Hole) {
+            if (!copy_extent(overlay, "overlay", writer, extent, extent.end,
+                             buf, error)) {
+                return false;
+            }
+
+            // Data was consumed by reading, but fills need to be skipped
+            if (extent.type != SparseExtentType::Data) {
+                if (!overlay.seek(static_cast<int64_t>(extent.end), SEEK_SET,
+                                  nullptr)) {
+                    error = format("Failed to seek overlay image: %s",
+                                   overlay.error_string().c_str());
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        // Holes in the overlay keep the contents of the base image
+        for (uint64_t offset = extent.begin; offset < extent.end;) {
+            if (!base_get_extent(base, offset, base_extent, error)) {
+                return false;
+            } else if (base_extent.begin == base_extent.end) {
+                error = "Unexpected EOF in base image";
+                return false;
+            }
+
+            uint64_t end = std::min(base_extent.end, extent.end);
+
+            if (!copy_extent(*base.file, "base", writer, base_extent, end,
+                             buf, error)) {
+                return false;
+            }
+
+            if (base_extent.type == SparseExtentType::Data) {
+                base.offset = end;
+            }
+            offset = end;
+        }
+
+        if (!overlay.seek(static_cast<int64_t>(extent.end), SEEK_SET,
+                          nullptr)) {
+            error = format("Failed to seek overlay image: %s",
+                           overlay.error_string().c_str());
+            return false;
+        }
+    }
+
+    if (!writer.close()) {
+        error = format("Failed to finish output image: %s",
+                       writer.error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Merge a sparse overlay image into a sparse base image
+ *
+ * The output is a sparse image containing the raw and fill chunks of
+ * \p overlay with every "don't care" region filled in from \p base. Neither
+ * input is expanded, so merging takes no scratch space. The inputs are only
+ * read forwards and do not need to support seeking, but \p output does since
+ * the sparse header is written last.
+ *
+ * \param base Sparse base image
+ * \param overlay Sparse overlay image. It must have the same size and block
+ *                size as \p base.
+ * \param output File to write the merged sparse image to
+ * \param add_crc32 Whether to add a CRC32 chunk to the output
+ * \param[out] error Error message if merging fails
+ *
+ * \return Whether the images were successfully merged
+ */
+bool merge_sparse(File &base, File &overlay, File &output, bool add_crc32,
+                  std::string &error)
+{
+    SparseFile sparse_base;
+
+    if (!sparse_base.open(&base)) {
+        error = format("Failed to open base image: %s",
+                       sparse_base.error_string().c_str());
+        return false;
+    }
+
+    MergeBase merge_base{&sparse_base, &sparse_base, sparse_base.size(), 0};
+
+    return merge(merge_base, overlay, output, add_crc32, error);
+}
+
+/*!
+ * \brief Merge a sparse overlay image into a raw base image
+ *
+ * Like merge_sparse(), except that \p base is a raw image. Only the parts of
+ * \p base that are not covered by the overlay are read. Blocks of a repeated
+ * value in those parts, including blocks of zeros, are converted to fill
+ * chunks. \p base must support seeking.
+ *
+ * \param base Raw base image. Its size must match the expanded size of
+ *             \p overlay.
+ * \param overlay Sparse overlay image
+ * \param output File to write the merged sparse image to
+ * \param add_crc32 Whether to add a CRC32 chunk to the output
+ * \param[out] error Error message if merging fails
+ *
+ * \return Whether the images were successfully merged
+ */
+bool merge_raw(File &base, File &overlay, File &output, bool add_crc32,
+               std::string &error)
+{
+    uint64_t size;
+
+    if (!base.seek(0, SEEK_END, &size) || !base.seek(0, SEEK_SET, nullptr)) {
+        error = format("Failed to seek base image: %s",
+                       base.error_string().c_str());
+        return false;
+    }
+
+    MergeBase merge_base{&base, nullptr, size, 0};
+
+    return merge(merge_base, overlay, output, add_crc32, error);
+}
+
+}
+}
@@ -0,0 +1,641 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/sparse_writer.h"
+
+// For std::min()
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstring>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file_util.h"
+
+#include "mbsparse/crc32_p.h"
+#include "mbsparse/sparse_writer_p.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+static void fix_sparse_header_byte_order(SparseHeader &header)
+{
+    header.magic = mb_htole32(header.magic);
+    header.major_version = mb_htole16(header.major_version);
+    header.minor_version = mb_htole16(header.minor_version);
+    header.file_hdr_sz = mb_htole16(header.file_hdr_sz);
+    header.chunk_hdr_sz = mb_htole16(header.chunk_hdr_sz);
+    header.blk_sz = mb_htole32(header.blk_sz);
+    header.total_blks = mb_htole32(header.total_blks);
+    header.total_chunks = mb_htole32(header.total_chunks);
+    header.image_checksum = mb_htole32(header.image_checksum);
+}
+
+static void fix_chunk_header_byte_order(ChunkHeader &header)
+{
+    header.chunk_type = mb_htole16(header.chunk_type);
+    header.reserved1 = mb_htole16(header.reserved1);
+    header.chunk_sz = mb_htole32(header.chunk_sz);
+    header.total_sz = mb_htole32(header.total_sz);
+}
+
+/*!
+ * \brief Check if a block consists of a single repeated 32-bit value
+ *
+ * A block is made up of a repeated 32-bit value if and only if it is equal to
+ * itself shifted by 4 bytes. memcmp() is vectorized by the C library and stops
+ * at the first difference, so this is much faster than comparing word by word
+ * and is cheap for blocks containing random data.
+ *
+ * \param[in] buf Block data
+ * \param[in] size Block size (must be a non-zero multiple of 4)
+ * \param[out] fill_val Repeated value (in the byte order of the block data)
+ *
+ * \return Whether the block can be represented by a fill chunk
+ */
+static bool is_fill_block(const unsigned char *buf, size_t size,
+                          uint32_t &fill_val)
+{
+    if (memcmp(buf, buf + sizeof(fill_val), size - sizeof(fill_val)) != 0) {
+        return false;
+    }
+
+    memcpy(&fill_val, buf, sizeof(fill_val));
+    return true;
+}
+
+/*! \cond INTERNAL */
+
+SparseWriterPrivate::SparseWriterPrivate(SparseWriter *sw)
+    : _pub_ptr(sw)
+{
+    clear();
+}
+
+void SparseWriterPrivate::clear()
+{
+    file = nullptr;
+    block_size = 0;
+    add_crc32 = false;
+    header_offset = 0;
+    total_blocks = 0;
+    total_chunks = 0;
+    crc32 = 0;
+    block.clear();
+    block_used = 0;
+    chunk_type = 0;
+    chunk_blocks = 0;
+    chunk_fill_val = 0;
+    chunk_data.clear();
+}
+
+bool SparseWriterPrivate::wwrite(const void *buf, size_t size)
+{
+    MB_PUBLIC(SparseWriter);
+    size_t bytes_written;
+
+    if (!file_write_fully(*file, buf, size, bytes_written)
+            || bytes_written != size) {
+        pub->set_error(file->error(), "Failed to write file: %s",
+                       file->error_string().c_str());
+        pub->set_fatal(true);
+        return false;
+    }
+
+    return true;
+}
+
+bool SparseWriterPrivate::write_chunk_header(uint16_t type, uint32_t chunk_sz,
+                                             uint32_t data_size)
+{
+    ChunkHeader chdr = {};
+    chdr.chunk_type = type;
+    chdr.chunk_sz = chunk_sz;
+    chdr.total_sz = static_cast<uint32_t>(sizeof(chdr)) + data_size;
+    fix_chunk_header_byte_order(chdr);
+
+    if (!wwrite(&chdr, sizeof(chdr))) {
+        return false;
+    }
+
+    ++total_chunks;
+    return true;
+}
+
+/*!
+ * \brief Write the pending chunk, if any, to the output file
+ *
+ * \return Whether the chunk is successfully written
+ */
+bool SparseWriterPrivate::flush_chunk()
+{
+    switch (chunk_type) {
+    case 0:
+        return true;
+    case CHUNK_TYPE_RAW:
+        if (!write_chunk_header(chunk_type, chunk_blocks,
+                                static_cast<uint32_t>(chunk_data.size()))
+                || !wwrite(chunk_data.data(), chunk_data.size())) {
+            return false;
+        }
+        chunk_data.clear();
+        break;
+    case CHUNK_TYPE_FILL:
+        if (!write_chunk_header(chunk_type, chunk_blocks,
+                                sizeof(chunk_fill_val))
+                || !wwrite(&chunk_fill_val, sizeof(chunk_fill_val))) {
+            return false;
+        }
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        if (!write_chunk_header(chunk_type, chunk_blocks, 0)) {
+            return false;
+        }
+        break;
+    }
+
+    chunk_type = 0;
+    chunk_blocks = 0;
+    return true;
+}
+
+/*!
+ * \brief Add blocks to the pending chunk, starting new chunks as needed
+ *
+ * Adjacent blocks of the same kind are merged into a single chunk as long as
+ * the chunk does not exceed its size limits.
+ *
+ * \param type Chunk type
+ * \param fill_val [CHUNK_TYPE_FILL only] Repeated value
+ * \param raw_data [CHUNK_TYPE_RAW only] Block data (must be \p count *
+ *                 #block_size bytes)
+ * \param count Number of blocks
+ *
+ * \return Whether the blocks are successfully processed
+ */
+bool SparseWriterPrivate::append_blocks(uint16_t type, uint32_t fill_val,
+                                        const unsigned char *raw_data,
+                                        uint64_t count)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (count > UINT32_MAX - total_blocks) {
+        pub->set_error(make_error_code(FileError::IntegerOverflow),
+                       "Sparse file cannot have more than %" PRIu32 " blocks",
+                       UINT32_MAX);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    while (count > 0) {
+        bool extend = type == chunk_type && chunk_blocks < UINT32_MAX;
+        if (type == CHUNK_TYPE_FILL) {
+            extend = extend && fill_val == chunk_fill_val;
+        } else if (type == CHUNK_TYPE_RAW) {
+            extend = extend && chunk_data.size() + block_size
+                    <= SPARSE_WRITER_MAX_RAW_SIZE;
+        }
+
+        if (!extend) {
+            if (!flush_chunk()) {
+                return false;
+            }
+
+            chunk_type = type;
+            chunk_fill_val = fill_val;
+        }
+
+        uint32_t n;
+
+        if (type == CHUNK_TYPE_RAW) {
+            chunk_data.insert(chunk_data.end(), raw_data,
+                              raw_data + block_size);
+            raw_data += block_size;
+            n = 1;
+        } else {
+            n = static_cast<uint32_t>(std::min<uint64_t>(
+                    count, UINT32_MAX - chunk_blocks));
+        }
+
+        chunk_blocks += n;
+        total_blocks += n;
+        count -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add a block to the pending chunk or start a new chunk
+ *
+ * Blocks of a repeated 32-bit value, including blocks of zeros, are written as
+ * fill chunks and everything else is written as raw chunks.
+ *
+ * \param buf Block data (must be #block_size bytes)
+ *
+ * \return Whether the block is successfully processed
+ */
+bool SparseWriterPrivate::process_block(const unsigned char *buf)
+{
+    uint16_t type;
+    uint32_t fill_val = 0;
+
+    if (!is_fill_block(buf, block_size, fill_val)) {
+        type = CHUNK_TYPE_RAW;
+    } else {
+        type = CHUNK_TYPE_FILL;
+    }
+
+    return append_blocks(type, fill_val, buf, 1);
+}
+
+/*!
+ * \brief Add blocks of a repeated 32-bit value without buffering them
+ *
+ * \param type CHUNK_TYPE_FILL or CHUNK_TYPE_DONT_CARE
+ * \param fill_val Repeated value (0 for CHUNK_TYPE_DONT_CARE)
+ * \param size Number of bytes (must be a multiple of #block_size)
+ *
+ * \return Whether the blocks are successfully processed
+ */
+bool SparseWriterPrivate::write_repeated(uint16_t type, uint32_t fill_val,
+                                         uint64_t size)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (block_used != 0) {
+        pub->set_error(make_error_code(FileError::InvalidState),
+                       "Current position is not block aligned");
+        return false;
+    } else if (size % block_size != 0) {
+        pub->set_error(make_error_code(FileError::InvalidArgument),
+                       "Size is not a multiple of the block size: %" PRIu64,
+                       size);
+        return false;
+    }
+
+    uint64_t count = size / block_size;
+
+    if (add_crc32 && count > 0) {
+        // The unused block buffer holds one block of the pattern
+        for (size_t i = 0; i < block_size; i += sizeof(fill_val)) {
+            memcpy(block.data() + i, &fill_val, sizeof(fill_val));
+        }
+        for (uint64_t i = 0; i < count; ++i) {
+            crc32 = update_crc32(crc32, block.data(), block_size);
+        }
+    }
+
+    return append_blocks(type, fill_val, nullptr, count);
+}
+
+/*! \endcond */
+
+/*!
+ * \class SparseWriter
+ *
+ * \brief Write Android sparse file image.
+ *
+ * Data written to the SparseWriter is split into blocks and converted into
+ * sparse chunks. Blocks of a repeated 32-bit value, including blocks of zeros,
+ * become fill chunks, so they take up only a few bytes in the output file. If
+ * the total size of the data is not a multiple of the block size, the last
+ * block is padded with zeros.
+ *
+ * Don't care chunks are only written by write_dont_care(). Flashing tools leave
+ * the target untouched for don't care chunks, so they must not be used for data
+ * that is expected to read back as zeros.
+ *
+ * The sparse header is updated when the SparseWriter is closed, so the output
+ * file must support seeking.
+ */
+
+/*!
+ * \brief Construct unbound SparseWriter.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+SparseWriter::SparseWriter()
+    : SparseWriter(new SparseWriterPrivate(this))
+{
+}
+
+/*!
+ * \brief Open sparse file for writing to File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, uint32_t, bool)
+ *
+ * \param file File to write to
+ * \param block_size Block size of the sparse file
+ * \param add_crc32 Whether to add a CRC32 chunk
+ */
+SparseWriter::SparseWriter(File *file, uint32_t block_size, bool add_crc32)
+    : SparseWriter(new SparseWriterPrivate(this), file, block_size, add_crc32)
+{
+}
+
+/*! \cond INTERNAL */
+SparseWriter::SparseWriter(SparseWriterPrivate *priv)
+    : _priv_ptr(priv)
+{
+}
+
+SparseWriter::SparseWriter(SparseWriterPrivate *priv, File *file,
+                           uint32_t block_size, bool add_crc32)
+    : _priv_ptr(priv)
+{
+    open(file, block_size, add_crc32);
+}
+/*! \endcond */
+
+SparseWriter::~SparseWriter()
+{
+    close();
+}
+
+/*!
+ * \brief Open sparse file for writing to File handle.
+ *
+ * \note The SparseWriter will *not* take ownership of \p file. The caller must
+ *       ensure that it is properly closed and destroyed when it is no longer
+ *       needed.
+ *
+ * \param file File to write to
+ * \param block_size Block size of the sparse file. This must be a non-zero
+ *                   multiple of 4 that is no larger than 1 MiB. Android uses
+ *                   4096.
+ * \param add_crc32 Whether to add a CRC32 chunk containing the checksum of the
+ *                  data to the end of the sparse file
+ *
+ * \return Whether the file is successfully opened
+ */
+bool SparseWriter::open(File *file, uint32_t block_size, bool add_crc32)
+{
+    MB_PRIVATE(SparseWriter);
+    if (priv) {
+        priv->file = file;
+        priv->block_size = block_size;
+        priv->add_crc32 = add_crc32;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Write a repeated 32-bit value without passing the data through write()
+ *
+ * This is equivalent to writing \p size bytes consisting of \p fill_val
+ * repeated, but does not require the data to be in memory. A fill chunk is
+ * written even if \p fill_val is zero.
+ *
+ * \param fill_val Repeated value (in the byte order of the data)
+ * \param size Number of bytes. The current position and \p size must both be
+ *             multiples of the block size.
+ *
+ * \return Whether the data is successfully written
+ */
+bool SparseWriter::write_fill(uint32_t fill_val, uint64_t size)
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    }
+
+    return priv->write_repeated(CHUNK_TYPE_FILL, fill_val, size);
+}
+
+/*!
+ * \brief Write a don't care region
+ *
+ * The contents of the region are undefined. When the sparse file is flashed,
+ * the target is not written to in this region, so it keeps its previous
+ * contents. SparseFile reads the region back as zeros and the CRC32 checksum
+ * counts it as zeros. Use write_fill() with a fill value of zero if the region
+ * must read back as zeros.
+ *
+ * \param size Number of bytes. The current position and \p size must both be
+ *             multiples of the block size.
+ *
+ * \return Whether the region is successfully written
+ */
+bool SparseWriter::write_dont_care(uint64_t size)
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: File is not open", __func__);
+        return false;
+    }
+
+    return priv->write_repeated(CHUNK_TYPE_DONT_CARE, 0, size);
+}
+
+/*!
+ * \brief Open sparse file for writing
+ *
+ * A placeholder sparse header is written at the current position of the
+ * underlying file. It is filled in when the sparse file is closed.
+ *
+ * \return Whether the sparse file is successfully opened
+ */
+bool SparseWriter::on_open()
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!priv->file || !priv->file->is_open()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Underlying file is not open");
+        return false;
+    } else if (priv->block_size == 0 || priv->block_size % 4 != 0
+            || priv->block_size > SPARSE_WRITER_MAX_RAW_SIZE) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid block size: %" PRIu32, priv->block_size);
+        return false;
+    }
+
+    if (!priv->file->seek(0, SEEK_CUR, &priv->header_offset)) {
+        set_error(priv->file->error(), "Failed to get file position: %s",
+                  priv->file->error_string().c_str());
+        return false;
+    }
+
+    SparseHeader shdr = {};
+
+    if (!priv->wwrite(&shdr, sizeof(shdr))) {
+        return false;
+    }
+
+    priv->block.resize(priv->block_size);
+
+    return true;
+}
+
+/*!
+ * \brief Finish writing sparse file
+ *
+ * The last partial block and pending chunk are written and the sparse header
+ * is updated with the final number of blocks and chunks.
+ *
+ * \note Regardless of the return value, the sparse file will be closed.
+ *
+ * \return Whether the sparse file is successfully completed
+ */
+bool SparseWriter::on_close()
+{
+    MB_PRIVATE(SparseWriter);
+
+    bool ret = true;
+
+    // Nothing to finish if opening failed or a previous operation failed
+    if (priv->block.empty() || is_fatal()) {
+        ret = !is_fatal();
+        goto done;
+    }
+
+    if (priv->block_used > 0) {
+        size_t padding = priv->block_size - priv->block_used;
+        memset(priv->block.data() + priv->block_used, 0, padding);
+        if (priv->add_crc32) {
+            priv->crc32 = update_crc32(
+                    priv->crc32, priv->block.data() + priv->block_used,
+                    padding);
+        }
+
+        if (!priv->process_block(priv->block.data())) {
+            ret = false;
+            goto done;
+        }
+    }
+
+    if (!priv->flush_chunk()) {
+        ret = false;
+        goto done;
+    }
+
+    if (priv->add_crc32) {
+        uint32_t crc32 = mb_htole32(priv->crc32);
+
+        if (!priv->write_chunk_header(CHUNK_TYPE_CRC32, 0, sizeof(crc32))
+                || !priv->wwrite(&crc32, sizeof(crc32))) {
+            ret = false;
+            goto done;
+        }
+    }
+
+    {
+        SparseHeader shdr = {};
+        shdr.magic = SPARSE_HEADER_MAGIC;
+        shdr.major_version = SPARSE_HEADER_MAJOR_VER;
+        shdr.minor_version = 0;
+        shdr.file_hdr_sz = sizeof(SparseHeader);
+        shdr.chunk_hdr_sz = sizeof(ChunkHeader);
+        shdr.blk_sz = priv->block_size;
+        shdr.total_blks = static_cast<uint32_t>(priv->total_blocks);
+        shdr.total_chunks = priv->total_chunks;
+        shdr.image_checksum = priv->crc32;
+        fix_sparse_header_byte_order(shdr);
+
+        uint64_t end_offset;
+
+        if (!priv->file->seek(0, SEEK_CUR, &end_offset)
+                || !priv->file->seek(static_cast<int64_t>(priv->header_offset),
+                                     SEEK_SET, nullptr)
+                || !priv->wwrite(&shdr, sizeof(shdr))
+                || !priv->file->seek(static_cast<int64_t>(end_offset),
+                                     SEEK_SET, nullptr)) {
+            if (!is_fatal()) {
+                set_error(priv->file->error(),
+                          "Failed to update sparse header: %s",
+                          priv->file->error_string().c_str());
+            }
+            ret = false;
+            goto done;
+        }
+    }
+
+done:
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Write data to sparse file
+ *
+ * \param buf Buffer to write from
+ * \param size Buffer size
+ * \param bytes_written Number of bytes written. This will always be \p size if
+ *                      this function succeeds.
+ *
+ * \return Whether the data is successfully written
+ */
+bool SparseWriter::on_write(const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(SparseWriter);
+
+    auto ptr = static_cast<const unsigned char *>(buf);
+    size_t remaining = size;
+
+    if (priv->add_crc32) {
+        priv->crc32 = update_crc32(priv->crc32, buf, size);
+    }
+
+    while (remaining > 0) {
+        // Process full blocks without copying them
+        if (priv->block_used == 0 && remaining >= priv->block_size) {
+            if (!priv->process_block(ptr)) {
+                return false;
+            }
+            ptr += priv->block_size;
+            remaining -= priv->block_size;
+            continue;
+        }
+
+        size_t n = std::min<size_t>(remaining,
+                                    priv->block_size - priv->block_used);
+        memcpy(priv->block.data() + priv->block_used, ptr, n);
+        priv->block_used += n;
+        ptr += n;
+        remaining -= n;
+
+        if (priv->block_used == priv->block_size) {
+            if (!priv->process_block(priv->block.data())) {
+                return false;
+            }
+            priv->block_used = 0;
+        }
+    }
+
+    bytes_written = size;
+    return true;
+}
+
+}
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mbsparse/expand.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "mbcommon/file/memory.h"
+
+struct SparseExpandTest : testing::Test
+{
+    void *_data = nullptr;
+    size_t _size = 0;
+
+    virtual ~SparseExpandTest()
+    {
+        free(_data);
+    }
+
+    // If holes is true, blocks of zeros are written as don't care regions
+    void write_sparse(const std::string &input, uint32_t block_size,
+                      bool holes = true)
+    {
+        mb::MemoryFile file(&_data, &_size);
+        ASSERT_TRUE(file.is_open());
+
+        mb::sparse::SparseWriter writer(&file, block_size, false);
+        ASSERT_TRUE(writer.is_open()) << writer.error_string();
+
+        const std::string zeros(block_size, '\0');
+        size_t n;
+
+        for (size_t pos = 0; pos < input.size(); pos += block_size) {
+            size_t to_write = std::min<size_t>(block_size, input.size() - pos);
+
+            if (holes && input.compare(pos, to_write, zeros) == 0) {
+                ASSERT_TRUE(writer.write_dont_care(block_size))
+                        << writer.error_string();
+            } else {
+                ASSERT_TRUE(writer.write(input.data() + pos, to_write, n))
+                        << writer.error_string();
+                ASSERT_EQ(n, to_write);
+            }
+        }
+
+        ASSERT_TRUE(writer.close()) << writer.error_string();
+    }
+
+    // output is also the initial contents of the target
+    bool expand(std::string &output, const mb::sparse::ExpandOptions &options,
+                mb::sparse::ExpandStats &stats, std::string &error)
+    {
+        mb::MemoryFile source(_data, _size);
+        size_t size = output.size();
+        void *data = malloc(size);
+        if (!data && size > 0) {
+            error = "Failed to allocate target";
+            return false;
+        }
+        memcpy(data, output.data(), size);
+        mb::MemoryFile target(&data, &size);
+
+        bool ret = mb::sparse::expand_parallel(source, target, options, stats,
+                                               error);
+        output.assign(static_cast<char *>(data), size);
+        free(data);
+
+        return ret;
+    }
+
+    // Block i is a fill block if i % 3 == 0, a zero block if i % 3 == 1, and
+    // a data block otherwise
+    static std::string make_input(size_t blocks)
+    {
+        std::string input;
+
+        for (size_t i = 0; i < blocks; ++i) {
+            if (i % 3 == 0) {
+                for (size_t j = 0; j < 4096 / 4; ++j) {
+                    input += "abcd";
+                }
+            } else if (i % 3 == 1) {
+                input.append(4096, '\0');
+            } else {
+                for (size_t j = 0; j < 4096; ++j) {
+                    input += static_cast<char>(i * 7 + j);
+                }
+            }
+        }
+
+        return input;
+    }
+};
+
+TEST_F(SparseExpandTest, ExpandShouldMatchInput)
+{
+    std::string input = make_input(90);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096));
+
+    // Split each chunk into several pieces
+    mb::sparse::ExpandOptions options;
+    options.threads = 4;
+    options.buffer_size = 1024;
+
+    std::string output;
+    mb::sparse::ExpandStats stats;
+    std::string error;
+    ASSERT_TRUE(expand(output, options, stats, error)) << error;
+    ASSERT_EQ(output, input);
+
+    ASSERT_EQ(stats.data_bytes, 30u * 4096);
+    ASSERT_EQ(stats.fill_bytes, 30u * 4096);
+    ASSERT_EQ(stats.hole_bytes, 30u * 4096);
+}
+
+TEST_F(SparseExpandTest, ZeroBlocksShouldOverwriteTarget)
+{
+    std::string input = make_input(90);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, false));
+
+    mb::sparse::ExpandOptions options;
+    options.threads = 4;
+    options.buffer_size = 1024;
+
+    // Zeros written through SparseWriter::write() must replace the old data
+    std::string output(input.size(), '\xff');
+    mb::sparse::ExpandStats stats;
+    std::string error;
+    ASSERT_TRUE(expand(output, options, stats, error)) << error;
+    ASSERT_EQ(output, input);
+
+    ASSERT_EQ(stats.data_bytes, 30u * 4096);
+    ASSERT_EQ(stats.fill_bytes, 60u * 4096);
+    ASSERT_EQ(stats.hole_bytes, 0u);
+}
+
+TEST_F(SparseExpandTest, SingleThreadShouldReportProgress)
+{
+    std::string input = make_input(10);
+    input.append(2 * 4096, '\0');
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096));
+
+    struct Progress
+    {
+        uint64_t bytes = 0;
+        uint64_t max_bytes = 0;
+        bool ordered = true;
+    } progress;
+
+    mb::sparse::ExpandOptions options;
+    options.threads = 1;
+    options.userdata = &progress;
+    options.progress_cb = [](uint64_t bytes, uint64_t max_bytes,
+                             void *userdata) {
+        auto p = static_cast<Progress *>(userdata);
+        if (bytes < p->bytes) {
+            p->ordered = false;
+        }
+        p->bytes = bytes;
+        p->max_bytes = max_bytes;
+    };
+
+    std::string output;
+    mb::sparse::ExpandStats stats;
+    std::string error;
+    ASSERT_TRUE(expand(output, options, stats, error)) << error;
+
+    // The trailing hole is not written, but the target is still resized
+    ASSERT_EQ(output, input);
+    ASSERT_TRUE(progress.ordered);
+    ASSERT_EQ(progress.bytes, input.size());
+    ASSERT_EQ(progress.max_bytes, input.size());
+    ASSERT_EQ(stats.hole_bytes, 5u * 4096);
+}
+
+TEST_F(SparseExpandTest, SourceOffsetShouldBeHonored)
+{
+    std::string input = make_input(6);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096));
+
+    std::string source_data(100, 'x');
+    source_data.append(static_cast<char *>(_data), _size);
+
+    mb::MemoryFile source(&source_data[0], source_data.size());
+    ASSERT_TRUE(source.seek(100, SEEK_SET, nullptr));
+
+    void *data = nullptr;
+    size_t size = 0;
+    mb::MemoryFile target(&data, &size);
+
+    mb::sparse::ExpandOptions options;
+    std::string error;
+    ASSERT_TRUE(mb::sparse::expand_parallel(source, target, options, error))
+            << error;
+    ASSERT_EQ(std::string(static_cast<char *>(data), size), input);
+    free(data);
+}
+
+TEST_F(SparseExpandTest, InvalidSourceShouldFail)
+{
+    _data = malloc(8192);
+    _size = 8192;
+    memset(_data, 0, _size);
+
+    mb::sparse::ExpandOptions options;
+
+    std::string output;
+    mb::sparse::ExpandStats stats;
+    std::string error;
+    ASSERT_FALSE(expand(output, options, stats, error));
+    ASSERT_FALSE(error.empty());
+}
+
+TEST_F(SparseExpandTest, InvalidBufferSizeShouldFail)
+{
+    mb::sparse::ExpandOptions options;
+    options.buffer_size = 1001;
+
+    std::string output;
+    mb::sparse::ExpandStats stats;
+    std::string error;
+    ASSERT_FALSE(expand(output, options, stats, error));
+    ASSERT_NE(error.find("Invalid buffer size"), std::string::npos);
+}
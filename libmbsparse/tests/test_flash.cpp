@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstring>
+
+#include "mbsparse/flash.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "mbcommon/file/memory.h"
+
+struct SparseFlashTest : testing::Test
+{
+    void *_data = nullptr;
+    size_t _size = 0;
+
+    virtual ~SparseFlashTest()
+    {
+        free(_data);
+    }
+
+    // If holes is true, blocks of zeros are written as don't care regions
+    void write_sparse(const std::string &input, uint32_t block_size,
+                      bool add_crc32, bool holes = true)
+    {
+        mb::MemoryFile file(&_data, &_size);
+        ASSERT_TRUE(file.is_open());
+
+        mb::sparse::SparseWriter writer(&file, block_size, add_crc32);
+        ASSERT_TRUE(writer.is_open()) << writer.error_string();
+
+        const std::string zeros(block_size, '\0');
+        size_t n;
+
+        for (size_t pos = 0; pos < input.size(); pos += block_size) {
+            size_t to_write = std::min<size_t>(block_size, input.size() - pos);
+
+            if (holes && input.compare(pos, to_write, zeros) == 0) {
+                ASSERT_TRUE(writer.write_dont_care(block_size))
+                        << writer.error_string();
+            } else {
+                ASSERT_TRUE(writer.write(input.data() + pos, to_write, n))
+                        << writer.error_string();
+                ASSERT_EQ(n, to_write);
+            }
+        }
+
+        ASSERT_TRUE(writer.close()) << writer.error_string();
+    }
+
+    bool flash(std::string &output, const mb::sparse::FlashOptions &options,
+               std::string &error)
+    {
+        mb::MemoryFile source(_data, _size);
+        mb::MemoryFile target(&output[0], output.size());
+
+        return mb::sparse::flash(source, target, options, error);
+    }
+
+    bool flash(std::string &output, const mb::sparse::FlashOptions &options,
+               mb::sparse::FlashStats &stats, std::string &error)
+    {
+        mb::MemoryFile source(_data, _size);
+        mb::MemoryFile target(&output[0], output.size());
+
+        return mb::sparse::flash(source, target, options, stats, error);
+    }
+
+    // Block i is a fill block if i % 3 == 0, a zero block if i % 3 == 1, and
+    // a data block otherwise
+    static std::string make_input(size_t blocks)
+    {
+        std::string input;
+
+        for (size_t i = 0; i < blocks; ++i) {
+            if (i % 3 == 0) {
+                for (size_t j = 0; j < 4096 / 4; ++j) {
+                    input += "abcd";
+                }
+            } else if (i % 3 == 1) {
+                input.append(4096, '\0');
+            } else {
+                for (size_t j = 0; j < 4096; ++j) {
+                    input += static_cast<char>(i * 7 + j);
+                }
+            }
+        }
+
+        return input;
+    }
+};
+
+TEST_F(SparseFlashTest, FlashShouldSkipHoles)
+{
+    std::string input = make_input(30);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, false));
+
+    // Use small rings so that buffers get reused many times
+    mb::sparse::FlashOptions options;
+    options.buffer_size = 8192;
+    options.buffer_count = 2;
+
+    std::string output(input.size(), '\xff');
+    std::string error;
+    ASSERT_TRUE(flash(output, options, error)) << error;
+
+    for (size_t i = 0; i < 30; ++i) {
+        std::string expected = input.substr(i * 4096, 4096);
+        if (i % 3 == 1) {
+            expected.assign(4096, '\xff');
+        }
+        ASSERT_EQ(output.substr(i * 4096, 4096), expected) << "Block " << i;
+    }
+}
+
+TEST_F(SparseFlashTest, ZeroBlocksShouldOverwriteTarget)
+{
+    std::string input = make_input(30);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, true, false));
+
+    mb::sparse::FlashOptions options;
+    options.buffer_size = 8192;
+    options.buffer_count = 2;
+
+    // Zeros written through SparseWriter::write() must replace the old data
+    std::string output(input.size(), '\xff');
+    mb::sparse::FlashStats stats;
+    std::string error;
+    ASSERT_TRUE(flash(output, options, stats, error)) << error;
+    ASSERT_EQ(output, input);
+    ASSERT_EQ(stats.written_bytes, input.size());
+    ASSERT_EQ(stats.discarded_bytes, 0u);
+}
+
+TEST_F(SparseFlashTest, FlashShouldReportProgress)
+{
+    std::string input = make_input(10);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, true));
+
+    struct Progress
+    {
+        uint64_t bytes = 0;
+        uint64_t max_bytes = 0;
+        bool ordered = true;
+    } progress;
+
+    mb::sparse::FlashOptions options;
+    options.verify_crc32 = true;
+    options.userdata = &progress;
+    options.progress_cb = [](uint64_t bytes, uint64_t max_bytes,
+                             void *userdata) {
+        auto *p = static_cast<Progress *>(userdata);
+        p->ordered = p->ordered && bytes >= p->bytes;
+        p->bytes = bytes;
+        p->max_bytes = max_bytes;
+    };
+
+    std::string output(input.size(), '\0');
+    std::string error;
+    ASSERT_TRUE(flash(output, options, error)) << error;
+    ASSERT_EQ(output, input);
+    ASSERT_TRUE(progress.ordered);
+    ASSERT_EQ(progress.bytes, input.size());
+    ASSERT_EQ(progress.max_bytes, input.size());
+}
+
+TEST_F(SparseFlashTest, IdenticalDataShouldNotBeWritten)
+{
+    std::string input = make_input(30);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, false));
+
+    mb::sparse::FlashOptions options;
+    options.buffer_size = 8192;
+    options.buffer_count = 2;
+    options.skip_identical = true;
+
+    // Target already has the image, except for one modified block
+    std::string output(input);
+    output[5 * 4096 + 10] ^= 1;
+
+    mb::sparse::FlashStats stats;
+    std::string error;
+    ASSERT_TRUE(flash(output, options, stats, error)) << error;
+    ASSERT_EQ(output, input);
+
+    // Blocks 5 and 6 are between two holes, so they share one 8 KiB buffer
+    ASSERT_EQ(stats.written_bytes, 2u * 4096);
+    ASSERT_EQ(stats.skipped_bytes, 18u * 4096);
+    ASSERT_EQ(stats.discarded_bytes, 0u);
+}
+
+TEST_F(SparseFlashTest, HolesShouldBeDiscarded)
+{
+    std::string input = make_input(10);
+    input.append(2 * 4096, '\0');
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, false));
+
+    std::vector<std::pair<uint64_t, uint64_t>> regions;
+
+    mb::sparse::FlashOptions options;
+    options.userdata = &regions;
+    options.discard_cb = [](uint64_t offset, uint64_t size, void *userdata) {
+        static_cast<std::vector<std::pair<uint64_t, uint64_t>> *>(userdata)
+                ->emplace_back(offset, size);
+        return true;
+    };
+
+    std::string output(input.size(), '\xff');
+    mb::sparse::FlashStats stats;
+    std::string error;
+    ASSERT_TRUE(flash(output, options, stats, error)) << error;
+
+    // Blocks 1, 4, and 7 are holes and so are the trailing 3 blocks (9 is a
+    // fill block, but 10 and 11 are zero)
+    std::vector<std::pair<uint64_t, uint64_t>> expected{
+        { 1 * 4096, 4096 },
+        { 4 * 4096, 4096 },
+        { 7 * 4096, 4096 },
+        { 10 * 4096, 2 * 4096 },
+    };
+    ASSERT_EQ(regions, expected);
+    ASSERT_EQ(stats.discarded_bytes, 5u * 4096);
+    ASSERT_EQ(stats.written_bytes, 7u * 4096);
+}
+
+TEST_F(SparseFlashTest, CorruptedDataShouldFailCrc32Verification)
+{
+    std::string input = make_input(3);
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, true));
+
+    // Flip a bit in the raw data of the last block
+    static_cast<unsigned char *>(_data)[_size - 100] ^= 1;
+
+    mb::sparse::FlashOptions options;
+    options.verify_crc32 = true;
+
+    std::string output(input.size(), '\0');
+    std::string error;
+    ASSERT_FALSE(flash(output, options, error));
+    ASSERT_NE(error.find("CRC32"), std::string::npos) << error;
+}
+
+TEST_F(SparseFlashTest, InvalidSourceShouldFail)
+{
+    _data = malloc(8192);
+    _size = 8192;
+    memset(_data, 0, _size);
+
+    mb::sparse::FlashOptions options;
+
+    std::string output(4096, '\0');
+    std::string error;
+    ASSERT_FALSE(flash(output, options, error));
+    ASSERT_FALSE(error.empty());
+}
+
+TEST_F(SparseFlashTest, InvalidBufferSizeShouldFail)
+{
+    mb::sparse::FlashOptions options;
+    options.buffer_size = 1000;
+
+    std::string output;
+    std::string error;
+    ASSERT_FALSE(flash(output, options, error));
+    ASSERT_NE(error.find("Invalid buffer size"), std::string::npos);
+}
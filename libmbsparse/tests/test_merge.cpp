@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <cstdlib>
+
+#include "mbsparse/merge.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+static constexpr size_t BLOCK_SIZE = 4096;
+
+struct MemoryBuffer
+{
+    void *data = nullptr;
+    size_t size = 0;
+
+    ~MemoryBuffer()
+    {
+        free(data);
+    }
+};
+
+// Blocks of zeros are written as don't care regions
+static void write_sparse(const std::string &input, MemoryBuffer &out)
+{
+    mb::MemoryFile file(&out.data, &out.size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseWriter writer(&file, BLOCK_SIZE, false);
+    ASSERT_TRUE(writer.is_open()) << writer.error_string();
+
+    const std::string zeros(BLOCK_SIZE, '\0');
+    size_t n;
+
+    for (size_t pos = 0; pos < input.size(); pos += BLOCK_SIZE) {
+        if (input.compare(pos, BLOCK_SIZE, zeros) == 0) {
+            ASSERT_TRUE(writer.write_dont_care(BLOCK_SIZE))
+                    << writer.error_string();
+        } else {
+            ASSERT_TRUE(writer.write(input.data() + pos, BLOCK_SIZE, n))
+                    << writer.error_string();
+        }
+    }
+
+    ASSERT_TRUE(writer.close()) << writer.error_string();
+}
+
+static void read_sparse(const MemoryBuffer &in, std::string &output)
+{
+    mb::MemoryFile file(in.data, in.size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseFile sparse_file;
+    sparse_file.set_verify_crc32(true);
+    ASSERT_TRUE(sparse_file.open(&file)) << sparse_file.error_string();
+
+    output.resize(sparse_file.size());
+
+    size_t n;
+    ASSERT_TRUE(mb::file_read_fully(sparse_file, &output[0], output.size(),
+                                    n)) << sparse_file.error_string();
+    ASSERT_EQ(n, output.size());
+    ASSERT_TRUE(sparse_file.read(&n, 1, n)) << sparse_file.error_string();
+}
+
+// Builds an image from one character per block. '0' is a block of zeros, an
+// uppercase letter is a fill block, and anything else is a data block.
+static std::string make_image(const char *blocks)
+{
+    std::string image;
+
+    for (const char *c = blocks; *c; ++c) {
+        if (*c == '0') {
+            image.append(BLOCK_SIZE, '\0');
+        } else if (*c >= 'A' && *c <= 'Z') {
+            image.append(BLOCK_SIZE, *c);
+        } else {
+            for (size_t i = 0; i < BLOCK_SIZE; ++i) {
+                image += static_cast<char>(*c + i % 7);
+            }
+        }
+    }
+
+    return image;
+}
+
+TEST(SparseMergeTest, OverlayShouldReplaceBase)
+{
+    MemoryBuffer base;
+    MemoryBuffer overlay;
+    MemoryBuffer output;
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(make_image("abAB0cC0d"), base));
+    ASSERT_NO_FATAL_FAILURE(write_sparse(make_image("0x0YYz00Z"), overlay));
+
+    mb::MemoryFile base_file(base.data, base.size);
+    mb::MemoryFile overlay_file(overlay.data, overlay.size);
+    mb::MemoryFile output_file(&output.data, &output.size);
+    std::string error;
+
+    ASSERT_TRUE(mb::sparse::merge_sparse(base_file, overlay_file, output_file,
+                                         true, error)) << error;
+    ASSERT_TRUE(output_file.close());
+
+    std::string merged;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output, merged));
+    ASSERT_EQ(merged, make_image("axAYYzC0Z"));
+}
+
+TEST(SparseMergeTest, RawBaseShouldBeResparsed)
+{
+    std::string base = make_image("abAB0cC0d");
+    MemoryBuffer overlay;
+    MemoryBuffer output;
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(make_image("0x0YYz00Z"), overlay));
+
+    mb::MemoryFile base_file(base.data(), base.size());
+    mb::MemoryFile overlay_file(overlay.data, overlay.size);
+    mb::MemoryFile output_file(&output.data, &output.size);
+    std::string error;
+
+    ASSERT_TRUE(mb::sparse::merge_raw(base_file, overlay_file, output_file,
+                                      false, error)) << error;
+    ASSERT_TRUE(output_file.close());
+
+    std::string merged;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output, merged));
+    ASSERT_EQ(merged, make_image("axAYYzC0Z"));
+
+    // Only the 'a', 'x', and 'z' blocks should be stored as raw data
+    ASSERT_LT(output.size, 4 * BLOCK_SIZE);
+}
+
+TEST(SparseMergeTest, MismatchedSizesShouldFail)
+{
+    MemoryBuffer base;
+    MemoryBuffer overlay;
+    MemoryBuffer output;
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(make_image("ab"), base));
+    ASSERT_NO_FATAL_FAILURE(write_sparse(make_image("abc"), overlay));
+
+    mb::MemoryFile base_file(base.data, base.size);
+    mb::MemoryFile overlay_file(overlay.data, overlay.size);
+    mb::MemoryFile output_file(&output.data, &output.size);
+    std::string error;
+
+    ASSERT_FALSE(mb::sparse::merge_sparse(base_file, overlay_file, output_file,
+                                          false, error));
+    ASSERT_NE(error.find("does not match"), std::string::npos) << error;
+}
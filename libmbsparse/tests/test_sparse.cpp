@@ -728,3 +728,264 @@ TEST_F(SparseTest, ReadValidDataWithUnseekableFile)
 
     ASSERT_TRUE(_file.close());
 }
+
+TEST_F(SparseTest, BuildIndexReadsAllChunkHeaders)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.build_index());
+
+    // Reads must still start at the beginning
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, BuildIndexWithSkippableFileFails)
+{
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_SKIP);
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_FALSE(_file.build_index());
+    ASSERT_EQ(_file.error(), mb::FileError::UnsupportedSeek);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, SavedIndexShouldLoad)
+{
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+        ASSERT_TRUE(_file.close());
+    }
+
+    ASSERT_EQ(index_size, sizeof(mb::sparse::SparseIndexHeader)
+            + 4 * sizeof(mb::sparse::SparseIndexChunk));
+
+    mb::MemoryFile index_file(index_data, index_size);
+    ASSERT_TRUE(index_file.is_open());
+
+    ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.load_index(index_file));
+
+    // Seeking into the last chunk must not require reading any chunk headers
+    ASSERT_TRUE(_file.seek(40, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 8u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 40, 8), 0);
+
+    ASSERT_TRUE(_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+    free(index_data);
+}
+
+TEST_F(SparseTest, MismatchedIndexShouldNotLoad)
+{
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+        ASSERT_TRUE(_file.close());
+    }
+
+    // Change the total number of chunks in the sparse header of the index
+    auto *ihdr = static_cast<mb::sparse::SparseIndexHeader *>(index_data);
+    ihdr->shdr.total_chunks = mb_htole32(3);
+
+    mb::MemoryFile index_file(index_data, index_size);
+    ASSERT_TRUE(index_file.is_open());
+
+    ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_FALSE(_file.load_index(index_file));
+    ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+    ASSERT_FALSE(_file.is_fatal());
+
+    // The sparse file must still be usable
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+    free(index_data);
+}
+
+TEST_F(SparseTest, IndexOfModifiedFileShouldNotLoad)
+{
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    size_t n;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+        ASSERT_TRUE(_file.close());
+    }
+
+    // Turn the last chunk into an empty fill chunk. The sparse header and the
+    // file size are unchanged.
+    uint16_t chunk_type = mb_htole16(mb::sparse::CHUNK_TYPE_FILL);
+    ASSERT_TRUE(_source_file.seek(84, SEEK_SET, nullptr));
+    ASSERT_TRUE(_source_file.write(&chunk_type, sizeof(chunk_type), n));
+
+    {
+        mb::MemoryFile index_file(index_data, index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_FALSE(_file.load_index(index_file));
+        ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+        ASSERT_FALSE(_file.is_fatal());
+        ASSERT_TRUE(_file.close());
+    }
+
+    // Append data to the sparse file
+    ASSERT_TRUE(_source_file.seek(0, SEEK_END, nullptr));
+    ASSERT_TRUE(_source_file.write("x", 1, n));
+
+    {
+        mb::MemoryFile index_file(index_data, index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_FALSE(_file.load_index(index_file));
+        ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+        ASSERT_TRUE(_file.close());
+    }
+
+    free(index_data);
+}
+
+TEST_F(SparseTest, CorruptedIndexShouldNotLoad)
+{
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+        ASSERT_TRUE(_file.close());
+    }
+
+    // Change the fill value of the second chunk
+    auto *ichunks = reinterpret_cast<mb::sparse::SparseIndexChunk *>(
+            static_cast<char *>(index_data)
+            + sizeof(mb::sparse::SparseIndexHeader));
+    ichunks[1].fill_val ^= 0xff;
+
+    mb::MemoryFile index_file(index_data, index_size);
+    ASSERT_TRUE(index_file.is_open());
+
+    ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_FALSE(_file.load_index(index_file));
+    ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+
+    // The sparse file must still be usable
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+    free(index_data);
+}
+
+TEST_F(SparseTest, ExtentsShouldDescribeChunks)
+{
+    char buf[1024];
+    size_t n;
+    mb::sparse::SparseExtent extent;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Raw chunk, partially consumed
+    ASSERT_TRUE(_file.read(buf, 4, n));
+    ASSERT_TRUE(_file.get_extent(extent));
+    ASSERT_EQ(extent.type, mb::sparse::SparseExtentType::Data);
+    ASSERT_EQ(extent.begin, 4u);
+    ASSERT_EQ(extent.end, 16u);
+
+    // Skipping forward works without a seekable file
+    ASSERT_TRUE(_file.seek(extent.end + 1, SEEK_SET, nullptr));
+
+    // Fill chunk, with pattern starting at the current position
+    ASSERT_TRUE(_file.get_extent(extent));
+    ASSERT_EQ(extent.type, mb::sparse::SparseExtentType::Fill);
+    ASSERT_EQ(extent.begin, 17u);
+    ASSERT_EQ(extent.end, 32u);
+    ASSERT_EQ(memcmp(extent.fill, expected_valid_data + 17, 4), 0);
+    ASSERT_TRUE(_file.seek(extent.end, SEEK_SET, nullptr));
+
+    // Skip chunk
+    ASSERT_TRUE(_file.get_extent(extent));
+    ASSERT_EQ(extent.type, mb::sparse::SparseExtentType::Hole);
+    ASSERT_EQ(extent.begin, 32u);
+    ASSERT_EQ(extent.end, 48u);
+    ASSERT_TRUE(_file.seek(extent.end, SEEK_SET, nullptr));
+
+    // EOF
+    ASSERT_TRUE(_file.get_extent(extent));
+    ASSERT_EQ(extent.begin, extent.end);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, SeekForwardIntoRawChunkWithUnseekableFile)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    ASSERT_TRUE(_file.seek(10, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data) - 10);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 10, n), 0);
+
+    ASSERT_TRUE(_file.close());
+}
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+
+#include "mbsparse/sparse_p.h"
+
+struct SparseWriterTest : testing::Test
+{
+    void *_data = nullptr;
+    size_t _size = 0;
+
+    virtual ~SparseWriterTest()
+    {
+        free(_data);
+    }
+
+    void write_sparse(const std::string &input, uint32_t block_size,
+                      bool add_crc32)
+    {
+        mb::MemoryFile file(&_data, &_size);
+        ASSERT_TRUE(file.is_open());
+
+        mb::sparse::SparseWriter writer(&file, block_size, add_crc32);
+        ASSERT_TRUE(writer.is_open()) << writer.error_string();
+
+        // Write in odd sizes to test partial blocks
+        size_t n;
+        for (size_t pos = 0; pos < input.size(); pos += 7) {
+            size_t to_write = std::min<size_t>(7, input.size() - pos);
+            ASSERT_TRUE(writer.write(input.data() + pos, to_write, n));
+            ASSERT_EQ(n, to_write);
+        }
+
+        ASSERT_TRUE(writer.close()) << writer.error_string();
+    }
+
+    mb::sparse::SparseHeader sparse_header()
+    {
+        mb::sparse::SparseHeader shdr;
+        memcpy(&shdr, _data, sizeof(shdr));
+        return shdr;
+    }
+
+    void read_sparse(std::string &output, bool verify_crc32 = false)
+    {
+        mb::MemoryFile file(_data, _size);
+        ASSERT_TRUE(file.is_open());
+
+        mb::sparse::SparseFile sparse_file;
+        sparse_file.set_verify_crc32(verify_crc32);
+        ASSERT_TRUE(sparse_file.open(&file)) << sparse_file.error_string();
+
+        output.resize(sparse_file.size());
+
+        size_t n;
+        ASSERT_TRUE(mb::file_read_fully(sparse_file, &output[0], output.size(),
+                                        n)) << sparse_file.error_string();
+        ASSERT_EQ(n, output.size());
+
+        // Reach EOF so that the trailing CRC32 chunk is processed
+        char c;
+        ASSERT_TRUE(sparse_file.read(&c, 1, n)) << sparse_file.error_string();
+        ASSERT_EQ(n, 0u);
+    }
+};
+
+TEST_F(SparseWriterTest, RoundTripShouldMatch)
+{
+    // raw, raw, zero, zero, fill, fill, other fill, raw
+    std::string input;
+    input += "0123456789abcdef";
+    input += "fedcba9876543210";
+    input += std::string(32, '\0');
+    input += std::string(32, '\x5a');
+    input += std::string(16, '\x33');
+    input += "raw!raw!raw!raw?";
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 16, false));
+
+    auto shdr = sparse_header();
+    ASSERT_EQ(mb_le32toh(shdr.magic), mb::sparse::SPARSE_HEADER_MAGIC);
+    ASSERT_EQ(mb_le32toh(shdr.blk_sz), 16u);
+    ASSERT_EQ(mb_le32toh(shdr.total_blks), 8u);
+    ASSERT_EQ(mb_le32toh(shdr.total_chunks), 5u);
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output));
+    ASSERT_EQ(output, input);
+}
+
+TEST_F(SparseWriterTest, ZeroBlocksShouldBeFillChunk)
+{
+    std::string input(1024 * 1024, '\0');
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, false));
+    ASSERT_EQ(_size, sizeof(mb::sparse::SparseHeader)
+            + sizeof(mb::sparse::ChunkHeader) + sizeof(uint32_t));
+
+    // Zeros must not become a don't care chunk, which would leave the old
+    // contents of the target in place when flashed
+    mb::sparse::ChunkHeader chdr;
+    memcpy(&chdr, static_cast<char *>(_data)
+           + sizeof(mb::sparse::SparseHeader), sizeof(chdr));
+    ASSERT_EQ(mb_le16toh(chdr.chunk_type), mb::sparse::CHUNK_TYPE_FILL);
+    ASSERT_EQ(mb_le32toh(chdr.chunk_sz), 256u);
+
+    uint32_t fill_val;
+    memcpy(&fill_val, static_cast<char *>(_data)
+           + sizeof(mb::sparse::SparseHeader) + sizeof(chdr),
+           sizeof(fill_val));
+    ASSERT_EQ(fill_val, 0u);
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output));
+    ASSERT_EQ(output, input);
+}
+
+TEST_F(SparseWriterTest, ZeroFillShouldBeFillChunk)
+{
+    mb::MemoryFile file(&_data, &_size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseWriter writer(&file, 16, false);
+    ASSERT_TRUE(writer.is_open()) << writer.error_string();
+    ASSERT_TRUE(writer.write_fill(0, 64)) << writer.error_string();
+    ASSERT_TRUE(writer.close()) << writer.error_string();
+
+    ASSERT_EQ(mb_le32toh(sparse_header().total_chunks), 1u);
+
+    mb::sparse::ChunkHeader chdr;
+    memcpy(&chdr, static_cast<char *>(_data)
+           + sizeof(mb::sparse::SparseHeader), sizeof(chdr));
+    ASSERT_EQ(mb_le16toh(chdr.chunk_type), mb::sparse::CHUNK_TYPE_FILL);
+}
+
+TEST_F(SparseWriterTest, PartialBlockShouldBePadded)
+{
+    std::string input("0123456789");
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 16, false));
+    ASSERT_EQ(mb_le32toh(sparse_header().total_blks), 1u);
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output));
+    ASSERT_EQ(output, input + std::string(6, '\0'));
+}
+
+TEST_F(SparseWriterTest, Crc32ChunkShouldBeAdded)
+{
+    std::string input("123456789");
+    input += std::string(7, '\0');
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 16, true));
+
+    // CRC32 of "123456789" followed by 7 zero bytes
+    auto shdr = sparse_header();
+    ASSERT_EQ(mb_le32toh(shdr.total_chunks), 2u);
+    ASSERT_EQ(mb_le32toh(shdr.image_checksum), 0x0e8c1a27u);
+
+    uint32_t crc32;
+    memcpy(&crc32, static_cast<char *>(_data) + _size - sizeof(crc32),
+           sizeof(crc32));
+    ASSERT_EQ(mb_le32toh(crc32), 0x0e8c1a27u);
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output, true));
+    ASSERT_EQ(output, input);
+}
+
+TEST_F(SparseWriterTest, CorruptedDataShouldFailCrc32Verification)
+{
+    std::string input(64, '\0');
+    for (size_t i = 0; i < input.size(); ++i) {
+        input[i] = static_cast<char>(i);
+    }
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 16, true));
+
+    // Flip a bit in the raw data
+    static_cast<unsigned char *>(_data)[sizeof(mb::sparse::SparseHeader)
+            + sizeof(mb::sparse::ChunkHeader) + 10] ^= 1;
+
+    mb::MemoryFile file(_data, _size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseFile sparse_file;
+    sparse_file.set_verify_crc32(true);
+    ASSERT_TRUE(sparse_file.open(&file));
+
+    char buf[128];
+    size_t n;
+    ASSERT_FALSE(sparse_file.read(buf, sizeof(buf), n));
+    ASSERT_TRUE(sparse_file.is_fatal());
+    ASSERT_NE(sparse_file.error_string().find("CRC32"), std::string::npos);
+}
+
+TEST_F(SparseWriterTest, LargeFillShouldRoundTrip)
+{
+    // Fill patterns expanded across multiple read() calls must stay aligned
+    std::string input;
+    for (size_t i = 0; i < 100000; ++i) {
+        input += "abcd";
+    }
+
+    ASSERT_NO_FATAL_FAILURE(write_sparse(input, 4096, true));
+    ASSERT_EQ(mb_le32toh(sparse_header().total_chunks), 3u);
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output, true));
+    ASSERT_EQ(output.substr(0, input.size()), input);
+}
+
+TEST_F(SparseWriterTest, InvalidBlockSizeShouldFail)
+{
+    mb::MemoryFile file(&_data, &_size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseWriter writer;
+    ASSERT_FALSE(writer.open(&file, 4095, false));
+    ASSERT_EQ(writer.error(), mb::FileError::InvalidArgument);
+    ASSERT_FALSE(writer.open(&file, 0, false));
+    ASSERT_EQ(writer.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(SparseWriterTest, FillAndDontCareShouldRoundTrip)
+{
+    mb::MemoryFile file(&_data, &_size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::sparse::SparseWriter writer(&file, 16, true);
+    ASSERT_TRUE(writer.is_open()) << writer.error_string();
+
+    size_t n;
+    ASSERT_TRUE(writer.write("0123456789abcdef", 16, n));
+    ASSERT_TRUE(writer.write_fill(0x64636261, 32)) << writer.error_string();
+    ASSERT_TRUE(writer.write_dont_care(16)) << writer.error_string();
+    ASSERT_TRUE(writer.write_dont_care(16)) << writer.error_string();
+
+    // Unaligned position or size must fail
+    ASSERT_FALSE(writer.write_dont_care(4));
+    ASSERT_EQ(writer.error(), mb::FileError::InvalidArgument);
+    ASSERT_TRUE(writer.write("x", 1, n));
+    ASSERT_FALSE(writer.write_fill(1, 16));
+    ASSERT_EQ(writer.error(), mb::FileError::InvalidState);
+
+    ASSERT_TRUE(writer.close()) << writer.error_string();
+
+    // raw + fill + don't care + raw + crc32
+    ASSERT_EQ(mb_le32toh(sparse_header().total_chunks), 5u);
+
+    std::string expected = "0123456789abcdef";
+    for (int i = 0; i < 8; ++i) {
+        expected += "abcd";
+    }
+    expected.append(32, '\0');
+    expected += 'x';
+    expected.append(15, '\0');
+
+    std::string output;
+    ASSERT_NO_FATAL_FAILURE(read_sparse(output, true));
+    ASSERT_EQ(output, expected);
+}
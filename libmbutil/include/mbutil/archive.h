@@ -19,9 +19,12 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <cstdint>
+
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -45,30 +48,95 @@ enum class compression_type
     NONE,
     LZ4,
     GZIP,
-    XZ
+    XZ,
+    ZSTD
 };
 
+// Called for each regular file with data before it is added to an archive. If
+// the callback sets `*store_data` to false, the entry is written with a size
+// of 0 and without its data. The callback may modify the entry.
+typedef bool (*TarCreateFileCallback)(archive_entry *entry, bool *store_data,
+                                      void *userdata);
+
+// Called for each entry before it is extracted. If the callback sets
+// `*handled` to true, it must have written the header, data, and finished the
+// entry in the disk writer `out` itself.
+typedef bool (*TarExtractFileCallback)(archive *out, archive_entry *entry,
+                                       bool *handled, void *userdata);
+
 int libarchive_copy_data(archive *in, archive *out, archive_entry *entry);
 bool libarchive_copy_data_disk_to_archive(archive *in, archive *out,
                                           archive_entry *entry);
 int libarchive_copy_header_and_data(archive *in, archive *out,
                                     archive_entry *entry);
+bool libarchive_add_write_filters(archive *a, const std::vector<int> &filters,
+                                  unsigned int threads = 0);
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression);
+                            compression_type compression,
+                            unsigned int threads = 0,
+                            TarExtractFileCallback file_cb = nullptr,
+                            void *userdata = nullptr);
 bool libarchive_tar_create(const std::string &filename,
                            const std::string &base_dir,
                            const std::vector<std::string> &paths,
-                           compression_type compression);
+                           compression_type compression,
+                           unsigned int threads = 0,
+                           uint64_t *bytes_out = nullptr,
+                           TarCreateFileCallback file_cb = nullptr,
+                           void *userdata = nullptr);
+bool libarchive_tar_is_seekable(const std::string &filename);
+bool libarchive_tar_extract_seekable(const std::string &filename,
+                                     const std::string &target,
+                                     const std::vector<std::string> &paths);
+
+/*!
+ * \brief Index of the entries in a zip or tar archive
+ *
+ * For zips, the central directory is read when the archive is opened. For
+ * tarballs, the headers are scanned once on first use and the offset of each
+ * entry is recorded, so uncompressed tarballs can be extracted by seeking
+ * directly to the entries. The index can be reused for any number of lookups
+ * and extractions and is safe to use from multiple threads.
+ */
+class ArchiveIndex
+{
+public:
+    ArchiveIndex();
+    ~ArchiveIndex();
+
+    ArchiveIndex(const ArchiveIndex &) = delete;
+    ArchiveIndex & operator=(const ArchiveIndex &) = delete;
+
+    bool open(const std::string &filename);
+    void close();
+    bool is_open() const;
+
+    const std::string & filename() const;
+
+    bool exists(const std::string &name) const;
+    bool exists(std::vector<exists_info> &files) const;
+    bool extract_files(const std::vector<extract_info> &files) const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
 
 bool extract_archive(const std::string &filename, const std::string &target);
 bool extract_files(const std::string &filename, const std::string &target,
                    const std::vector<std::string> &files);
+bool extract_files(const ArchiveIndex &index, const std::string &target,
+                   const std::vector<std::string> &files);
 bool extract_files2(const std::string &filename,
                     const std::vector<extract_info> &files);
+bool extract_files2(const ArchiveIndex &index,
+                    const std::vector<extract_info> &files);
 bool archive_exists(const std::string &filename,
                     std::vector<exists_info> &files);
+bool archive_exists(const ArchiveIndex &index,
+                    std::vector<exists_info> &files);
 
 }
 }
@@ -19,12 +19,31 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
 namespace mb
 {
 namespace util
 {
 
+struct BlkidInfo
+{
+    // Whether the device was successfully read. If false, `error` is the errno
+    // value of the failure
+    bool ok = false;
+    int error = 0;
+    // Filesystem type (nullptr if unknown)
+    const char *type = nullptr;
+    // Filesystem UUID or volume serial number (empty if the filesystem does not
+    // have one)
+    std::string uuid;
+};
+
 bool blkid_get_fs_type(const char *path, const char **type);
 
+bool blkid_probe(const char *path, BlkidInfo &info);
+std::vector<BlkidInfo> blkid_probe_all(const std::vector<std::string> &paths);
+
 }
 }
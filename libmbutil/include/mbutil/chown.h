@@ -34,6 +34,9 @@ enum ChownFlags : int
     CHOWN_RECURSIVE       = 0x2
 };
 
+bool lookup_owner(const std::string &user, const std::string &group,
+                  uid_t *uid, gid_t *gid);
+
 bool chown(const std::string &path,
            const std::string &user,
            const std::string &group,
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 namespace mb
 {
@@ -60,6 +61,25 @@ typedef void (*CmdRawCb)(const char *data, size_t size, bool error,
  */
 typedef void (*CmdLineCb)(const char *line, bool error, void *userdata);
 
+struct CommandCtx;
+
+/*!
+ * \brief Line callback for command_group_line_reader()
+ *
+ * \note \a line points into the reader's internal buffer and is only valid
+ * until the callback returns. It is always NULL-terminated at \a size. The same
+ * rules as CmdLineCb apply for lines that are too long or that do not end with
+ * a newline.
+ *
+ * \param ctx Command that printed the line
+ * \param line Line that was read
+ * \param size Length of \a line, including the newline character
+ * \param error stderr if true, else stdout
+ * \param userdata User-provided pointer
+ */
+typedef void (*CmdGroupLineCb)(struct CommandCtx *ctx, const char *line,
+                               size_t size, bool error, void *userdata);
+
 struct CommandCtxPriv;
 
 struct CommandCtx
@@ -80,6 +100,13 @@ struct CommandCtx
     bool log_argv = false;
     bool log_envp = false;
 
+    // Statistics (updated by the reader functions)
+
+    /*! Number of bytes read from stdout */
+    uint64_t stdout_bytes = 0;
+    /*! Number of bytes read from stderr */
+    uint64_t stderr_bytes = 0;
+
     // Private variables
 
     CommandCtxPriv *_priv = nullptr;
@@ -90,6 +117,8 @@ int command_wait(struct CommandCtx *ctx);
 
 bool command_raw_reader(struct CommandCtx *ctx, CmdRawCb cb, void *userdata);
 bool command_line_reader(struct CommandCtx *ctx, CmdLineCb cb, void *userdata);
+bool command_group_line_reader(struct CommandCtx * const *ctxs, size_t count,
+                               CmdGroupLineCb cb, void *userdata);
 
 void command_line_reader(const char *data, size_t size, bool error,
                          void *userdata);
@@ -31,10 +31,29 @@ enum CopyFlags : int
     COPY_ATTRIBUTES          = 0x1,
     COPY_XATTRS              = 0x2,
     COPY_EXCLUDE_TOP_LEVEL   = 0x4,
-    COPY_FOLLOW_SYMLINKS     = 0x8
+    COPY_FOLLOW_SYMLINKS     = 0x8,
+    // Only used by copy_dir()
+    COPY_PARALLEL            = 0x10,
+    // Only used by copy_dir(). Regular files that cannot be reflinked are hard
+    // linked to the source instead of being copied. Only use this if files in
+    // neither tree are modified in place.
+    COPY_LINK_UNCLONEABLE    = 0x20
 };
 
+enum class CopyMethod
+{
+    Reflink,
+    Sparse,
+    CopyFileRange,
+    Sendfile,
+    ReadWrite,
+    HardLink,
+};
+
+const char * copy_method_name(CopyMethod method);
+
 bool copy_data_fd(int fd_source, int fd_target);
+bool copy_data_fd(int fd_source, int fd_target, CopyMethod *method);
 bool copy_xattrs(const std::string &source, const std::string &target);
 bool copy_stat(const std::string &source, const std::string &target);
 bool copy_contents(const std::string &source, const std::string &target);
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/types.h>
+
+#include "mbutil/autoclose/archive.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief In-memory model of a (possibly compressed) cpio archive
+ *
+ * All entries are loaded into memory, so they can be inspected and modified
+ * without extracting the archive to the filesystem. When saved, the archive is
+ * written out with the same format and compression filters it was loaded with.
+ * Entries keep their original order and metadata unless they are modified.
+ */
+class CpioArchive
+{
+public:
+    CpioArchive();
+    ~CpioArchive();
+
+    CpioArchive(const CpioArchive &) = delete;
+    CpioArchive & operator=(const CpioArchive &) = delete;
+
+    bool load_file(const std::string &path);
+    bool load_memory(const void *data, size_t size);
+    bool save_file(const std::string &path) const;
+    bool save_memory(std::string &out) const;
+
+    bool exists(const std::string &path) const;
+    bool is_symlink(const std::string &path) const;
+    bool symlink_target(const std::string &path, std::string &out) const;
+    bool contents(const std::string &path, std::string &out) const;
+
+    bool set_contents(const std::string &path, std::string data);
+    bool set_contents(const std::string &path, std::string data, mode_t perm);
+    bool add_file(const std::string &path, const std::string &source,
+                  mode_t perm);
+    bool add_symlink(const std::string &path, const std::string &target);
+    bool remove(const std::string &path);
+    bool rename(const std::string &from, const std::string &to);
+
+private:
+    struct Entry
+    {
+        autoclose::archive_entry header;
+        std::string data;
+    };
+
+    bool load(archive *a, const char *name);
+    bool set_up_writer(archive *a) const;
+    bool save(archive *a, const char *name) const;
+
+    Entry * find(const std::string &path);
+    const Entry * find(const std::string &path) const;
+    Entry * add_entry(const std::string &path, mode_t type, mode_t perm);
+    bool add_parents(const std::string &path);
+    void rebuild_index();
+
+    std::vector<Entry> _entries;
+    std::unordered_map<std::string, size_t> _index;
+    int _format;
+    std::vector<int> _filters;
+    int64_t _next_ino;
+};
+
+}
+}
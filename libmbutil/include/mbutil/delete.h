@@ -26,7 +26,14 @@ namespace mb
 namespace util
 {
 
+enum DeleteFlags : int
+{
+    // Delete sibling subtrees concurrently
+    DELETE_PARALLEL     = 0x1
+};
+
 bool delete_recursive(const std::string &path);
+bool delete_recursive(const std::string &path, int flags);
 
 }
 }
\ No newline at end of file
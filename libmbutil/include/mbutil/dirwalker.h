@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Directory tree walker built on `getdents64()` and `*at()` functions
+ *
+ * This has the same hooks and traversal order as FTSWrapper, but entries are
+ * only stat'ed when the hook asks for it with curr_stat(). The file type is
+ * normally known from the directory entry itself.
+ *
+ * One file descriptor is kept open for each level of the tree that is being
+ * traversed.
+ */
+class DirWalker
+{
+public:
+    enum Flags : int {
+        // Follow symlinks while traversing (WARNING: dangerous!)
+        FollowSymlinks                  = 0x1,
+        // If tree contains a mountpoint, traverse its contents
+        CrossMountPointBoundaries       = 0x2,
+        // Call on_reached_special_file() instead of separate functions
+        GroupSpecialFiles               = 0x4
+    };
+
+    enum Action : int {
+        // Hook succeeded
+        Ok                              = 0x0,
+        // Hook failed (run() will return false)
+        Fail                            = 0x1,
+        // Skip current file or tree (in case of directory)
+        Skip                            = 0x2,
+        // Stop traversal (if specified with Skip, behavior is undefined)
+        Stop                            = 0x4,
+        // Go to next entry (only useful for on_changed_path(). If this is
+        // returned, then the on_reached_*() functions will not be called)
+        Next                            = 0x8
+    };
+
+    struct Entry
+    {
+        // Path including the path passed to the constructor as a prefix
+        std::string path;
+        // Filename (for the root, this is the path passed to the constructor)
+        const char *name;
+        // Depth in the tree (0 for the root)
+        int level;
+        // Parent directory fd to use with the *at() functions along with
+        // `name` (AT_FDCWD for the root)
+        int dirfd;
+        // File type (one of the S_IF* values)
+        mode_t type;
+    };
+
+    DirWalker(std::string path, int flags);
+    virtual ~DirWalker();
+
+    DirWalker(const DirWalker &) = delete;
+    DirWalker & operator=(const DirWalker &) = delete;
+
+    bool run();
+    std::string error();
+
+    virtual bool on_pre_execute();
+    virtual bool on_post_execute(bool success);
+    virtual int on_changed_path();
+    virtual int on_reached_directory_pre();
+    virtual int on_reached_directory_post();
+    virtual int on_reached_file();
+    virtual int on_reached_symlink();
+    virtual int on_reached_special_file();
+
+    // Special files
+    virtual int on_reached_block_device();
+    virtual int on_reached_character_device();
+    virtual int on_reached_fifo();
+    virtual int on_reached_socket();
+
+protected:
+    // Input path
+    std::string _path;
+    // Input flags
+    int _flags = 0;
+    // Current entry
+    Entry *_curr = nullptr;
+    // Error message (valid only if run() returned false)
+    std::string _error_msg;
+
+    const struct stat * curr_stat();
+
+private:
+    Entry _entry;
+    struct stat _sb;
+    bool _have_sb = false;
+    // Device of the root directory
+    dev_t _root_dev = 0;
+    // (device, inode) of the directories being traversed (only used when
+    // following symlinks)
+    std::vector<std::pair<dev_t, ino_t>> _ancestors;
+    std::vector<char> _dents_buf;
+    bool _ret = true;
+    bool _stop = false;
+    bool _ran = false;
+
+    void set_entry(int dirfd, size_t name_offset, int level, mode_t type,
+                   const struct stat *sb);
+    bool read_dir(int fd, std::string &names,
+                  std::vector<std::pair<size_t, unsigned char>> &children);
+    int handle_result(int result);
+    int dispatch();
+    void visit(int dirfd, size_t name_offset, int level, unsigned char d_type);
+    bool walk_dir(int fd, int level);
+};
+
+}
+}
@@ -106,6 +106,19 @@ uint32_t mb__system_property_area_serial();
 */
 int mb__system_property_add(const char *name, unsigned int namelen, const char *value, unsigned int valuelen);
 
+/* Like mb__system_property_add, but does not bump the area serial or wake up
+** waiters. This is for adding many properties at once. Readers will not be
+** notified until mb__system_property_notify_deferred is called.
+**
+** Returns 0 on success, -1 if the property area is full.
+*/
+int mb__system_property_add_deferred(const char *name, unsigned int namelen, const char *value, unsigned int valuelen);
+
+/* Bump the area serial and wake up waiters after a batch of
+** mb__system_property_add_deferred calls.
+*/
+void mb__system_property_notify_deferred();
+
 /* Update the value of a system property returned by
 ** mb__system_property_find.  Can only be done by a single process
 ** that has write access to the property area, and that process
@@ -123,6 +136,12 @@ int mb__system_property_update(prop_info *pi, const char *value, unsigned int le
 */
 uint32_t mb__system_property_serial(const prop_info* pi);
 
+/* Same as mb__system_property_serial, but also works for properties returned
+** by the compat functions. The serial number changes whenever the value of the
+** property changes.
+*/
+uint32_t mb__system_property_read_serial(const prop_info* pi);
+
 /* Initialize the system properties area in read only mode.
  * Should be done by all processes that need to read system
  * properties.
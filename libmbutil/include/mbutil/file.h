@@ -22,11 +22,53 @@
 #include <string>
 #include <vector>
 
+#include <cstddef>
+#include <cstdint>
+
 namespace mb
 {
 namespace util
 {
 
+/*!
+ * \brief Read-only view of a file's contents
+ *
+ * Regular files and block devices are mapped into memory, so large images can
+ * be hashed or written out without copying them to the heap first. Files that
+ * cannot be mapped, like those in procfs and sysfs, are read into a buffer
+ * instead.
+ *
+ * \note The file must not be truncated while it is mapped. Accessing pages
+ *       past the new end of the file raises SIGBUS.
+ */
+class FileView
+{
+public:
+    FileView();
+    ~FileView();
+
+    FileView(const FileView &) = delete;
+    FileView & operator=(const FileView &) = delete;
+
+    FileView(FileView &&other);
+    FileView & operator=(FileView &&rhs);
+
+    bool open(const std::string &path);
+    void close();
+
+    const unsigned char * data() const;
+    size_t size() const;
+    bool is_mapped() const;
+
+    const unsigned char * begin() const;
+    const unsigned char * end() const;
+
+private:
+    void *_map;
+    size_t _map_size;
+    std::vector<unsigned char> _buf;
+};
+
 bool create_empty_file(const std::string &path);
 bool file_first_line(const std::string &path,
                      std::string *line_out);
@@ -73,7 +73,7 @@ struct twrp_fstab_rec
     std::string fs_type;
     std::vector<std::string> twrp_flags;
     std::vector<std::string> unknown_options;
-    int length;
+    int length = 0;
     std::string orig_line;
 };
 
@@ -21,6 +21,9 @@
 
 #include <string>
 
+#include <cstddef>
+#include <cstdint>
+
 #include <openssl/sha.h>
 
 namespace mb
@@ -28,8 +31,29 @@ namespace mb
 namespace util
 {
 
+// Leaf size for sha512_tree_hash()
+constexpr size_t SHA512_TREE_LEAF_SIZE = 1024 * 1024;
+
+// Incremental state for sha512_tree_hash()
+struct Sha512TreeCtx
+{
+    SHA512_CTX root;
+    SHA512_CTX leaf;
+    size_t leaf_used;
+    uint64_t size;
+};
+
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_tree_hash(const void *data, size_t size,
+                      unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_tree_hash(const std::string &path,
+                      unsigned char digest[SHA512_DIGEST_LENGTH]);
+
+bool sha512_tree_init(Sha512TreeCtx *ctx);
+bool sha512_tree_update(Sha512TreeCtx *ctx, const void *data, size_t size);
+bool sha512_tree_final(unsigned char digest[SHA512_DIGEST_LENGTH],
+                       Sha512TreeCtx *ctx);
 
 }
 }
@@ -21,14 +21,28 @@
 
 #include <string>
 
+#include <cstdint>
+
 namespace mb
 {
 namespace util
 {
 
+enum LoopdevFlags : int
+{
+    // Attach the file read-only
+    LOOPDEV_READ_ONLY   = 0x1,
+    // Bypass the page cache for the backing file (if supported by the kernel
+    // and the backing filesystem)
+    LOOPDEV_DIRECT_IO   = 0x2,
+};
+
 std::string loopdev_find_unused(void);
+bool loopdev_pool_init(int count);
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
                            uint64_t offset, bool ro);
+bool loopdev_attach(const std::string &file, uint64_t offset, int flags,
+                    uint32_t block_size, std::string &loopdev_out);
 bool loopdev_remove_device(const std::string &loopdev);
 
 }
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Multithreaded block compressor
+ *
+ * The input is split into fixed-size blocks that are compressed independently
+ * on a pool of worker threads. Each block becomes a complete LZ4 frame or gzip
+ * member and the blocks are written to the output fd in order. Concatenated
+ * frames and members are valid LZ4 and gzip streams, so the output can be
+ * decompressed by any regular decoder, including libarchive.
+ *
+ * The location of every frame or member that was written is recorded. Since
+ * they are independent, a reader can use this to start decompressing at any
+ * block.
+ */
+class ParallelCompressor
+{
+public:
+    enum class Format
+    {
+        LZ4,
+        GZIP,
+    };
+
+    struct Frame
+    {
+        uint64_t compressed_offset;
+        uint64_t compressed_size;
+        uint64_t uncompressed_offset;
+        uint64_t uncompressed_size;
+    };
+
+    ParallelCompressor(int fd, Format format, unsigned int threads,
+                       size_t block_size);
+    ~ParallelCompressor();
+
+    ParallelCompressor(const ParallelCompressor &) = delete;
+    ParallelCompressor & operator=(const ParallelCompressor &) = delete;
+
+    bool write(const void *data, size_t size);
+    bool finish();
+    std::string error();
+
+    const std::vector<Frame> & frames() const;
+
+private:
+    struct Block
+    {
+        std::vector<unsigned char> input;
+        size_t input_size = 0;
+        std::vector<unsigned char> output;
+        bool done = false;
+        bool ok = false;
+    };
+
+    int _fd;
+    Format _format;
+    size_t _block_size;
+    size_t _max_in_flight;
+
+    std::mutex _lock;
+    // Signaled when a block is queued or on shutdown
+    std::condition_variable _queued_cv;
+    // Signaled when a block has finished compressing
+    std::condition_variable _done_cv;
+    // Blocks waiting for a worker
+    std::deque<std::shared_ptr<Block>> _queue;
+    // Blocks in output order that have not been written yet
+    std::deque<std::shared_ptr<Block>> _in_flight;
+    bool _stop = false;
+    std::vector<std::thread> _threads;
+
+    std::shared_ptr<Block> _curr;
+    bool _have_output = false;
+    bool _finished = false;
+    bool _failed = false;
+    std::string _error_msg;
+
+    std::vector<Frame> _frames;
+    uint64_t _compressed_offset = 0;
+    uint64_t _uncompressed_offset = 0;
+
+    void worker();
+    bool compress_block(Block &block);
+    bool submit_block();
+    bool write_front_block();
+    void stop_threads();
+};
+
+}
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+enum PermissionsFlags : int
+{
+    // Set the mode of every file and directory (symlinks are skipped)
+    PERMS_SET_MODE        = 0x1,
+    // Set the owner of every file, directory, and symlink
+    PERMS_SET_OWNER       = 0x2,
+    // Change the owner of symlink targets instead of the symlinks
+    PERMS_FOLLOW_SYMLINKS = 0x4
+};
+
+bool set_permissions_recursive(const std::string &path, int flags,
+                               mode_t mode, uid_t uid, gid_t gid);
+
+}
+}
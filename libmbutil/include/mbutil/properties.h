@@ -22,6 +22,8 @@
 #include <string>
 #include <unordered_map>
 
+#include <sys/stat.h>
+
 #include "mbutil/integer.h"
 #include "mbutil/external/system_properties.h"
 
@@ -52,6 +54,8 @@ bool libc_system_property_wait(const prop_info *pi,
                                uint32_t old_serial,
                                uint32_t *new_serial_ptr,
                                const struct timespec *relative_timeout);
+uint32_t libc_system_property_serial(const prop_info *pi);
+uint32_t libc_system_property_area_serial();
 
 // Helper functions
 
@@ -95,8 +99,135 @@ bool property_list(PropertyListCb prop_fn, void *cookie);
 
 bool property_get_all(std::unordered_map<std::string, std::string> &map);
 
+/*!
+ * \brief Cached handle to a system property
+ *
+ * The property is only looked up once. After that, the value is only reread if
+ * the property's serial number changed. If the property does not exist, it is
+ * looked up again only after the global serial number changes.
+ */
+class SystemProperty
+{
+public:
+    explicit SystemProperty(std::string name);
+
+    const std::string & name() const;
+
+    bool get(std::string &value_out);
+    std::string get_string(const std::string &default_value);
+    bool get_bool(bool default_value);
+
+    bool wait(const struct timespec *relative_timeout);
+
+private:
+    std::string _name;
+    const prop_info *_pi = nullptr;
+    // Global serial number when the lookup last failed
+    bool _looked_up = false;
+    uint32_t _area_serial = 0;
+    // Serial number of the cached value
+    bool _have_value = false;
+    uint32_t _serial = 0;
+    std::string _value;
+
+    bool find();
+};
+
+/*!
+ * \brief Snapshot of all system properties
+ *
+ * update() only rereads the properties whose serial numbers changed since the
+ * previous update. Nothing is reread if the global serial number is unchanged.
+ */
+class SystemPropertySnapshot
+{
+public:
+    bool update();
+
+    const std::unordered_map<std::string, std::string> & properties() const;
+
+private:
+    bool _valid = false;
+    uint32_t _area_serial = 0;
+    std::unordered_map<const prop_info *, uint32_t> _serials;
+    std::unordered_map<std::string, std::string> _props;
+};
+
 // Properties file functions
 
+/*!
+ * \brief Parsed properties file
+ *
+ * The file is parsed once and kept in memory. Lookups reparse the file only if
+ * its inode, size, or modification time changed since it was last loaded and
+ * there are no unsaved changes.
+ *
+ * Changes made with set(), erase(), and clear() are only written to disk when
+ * save() is called. The file is replaced atomically, so readers never see a
+ * partially written file.
+ */
+class PropertyFile
+{
+public:
+    explicit PropertyFile(std::string path);
+
+    const std::string & path() const;
+
+    bool load();
+    bool save(mode_t mode = 0644);
+
+    bool get(const std::string &key, std::string &value_out);
+    std::string get_string(const std::string &key,
+                           const std::string &default_value);
+    bool get_bool(const std::string &key, bool default_value);
+
+    template<typename SNumType>
+    inline SNumType get_snum(const std::string &key, SNumType default_value)
+    {
+        std::string value;
+        SNumType result;
+
+        if (get(key, value) && str_to_snum(value.c_str(), 10, &result)) {
+            return result;
+        }
+
+        return default_value;
+    }
+
+    template<typename UNumType>
+    inline UNumType get_unum(const std::string &key, UNumType default_value)
+    {
+        std::string value;
+        UNumType result;
+
+        if (get(key, value) && str_to_unum(value.c_str(), 10, &result)) {
+            return result;
+        }
+
+        return default_value;
+    }
+
+    void set(const std::string &key, const std::string &value);
+    bool erase(const std::string &key);
+    void clear();
+
+    const std::unordered_map<std::string, std::string> & properties();
+
+private:
+    std::string _path;
+    std::unordered_map<std::string, std::string> _props;
+    // Identity of the file when it was last loaded
+    bool _loaded = false;
+    ino_t _ino = 0;
+    dev_t _dev = 0;
+    off_t _size = 0;
+    struct timespec _mtime = {};
+    // Whether there are unsaved changes
+    bool _dirty = false;
+
+    bool is_stale();
+};
+
 bool property_file_get(const std::string &path, const std::string &key,
                        std::string &value_out);
 std::string property_file_get_string(const std::string &path,
@@ -52,5 +52,38 @@ bool socket_write_string_array(int fd, const std::vector<std::string> &list);
 bool socket_receive_fds(int fd, std::vector<int> *fds);
 bool socket_send_fds(int fd, const std::vector<int> &fds);
 
+/*!
+ * \brief Buffered reader for length-prefixed messages
+ *
+ * This reads messages in the format written by socket_write_bytes(). Unlike
+ * socket_read_bytes(), the data is read into a single receive buffer that is
+ * reused for every message and as much data as is available is read at once,
+ * so several small messages can be received with a single read().
+ *
+ * Since data following the current message may already be buffered, nothing
+ * else should read from the file descriptor while the reader is in use.
+ */
+class SocketReader
+{
+public:
+    explicit SocketReader(int fd);
+
+    SocketReader(const SocketReader &) = delete;
+    SocketReader & operator=(const SocketReader &) = delete;
+
+    bool read_bytes(const uint8_t **data, size_t *size);
+    size_t buffered() const;
+
+private:
+    int _fd;
+    std::vector<uint8_t> _buf;
+    // Range of buffered, unconsumed data
+    size_t _begin;
+    size_t _end;
+
+    bool fill(size_t size);
+};
+
+
 }
 }
\ No newline at end of file
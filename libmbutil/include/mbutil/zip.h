@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+namespace util
+{
+
+struct ZipEntry
+{
+    std::string name;
+    uint16_t version_made_by;
+    uint16_t flags;
+    uint16_t method;
+    uint16_t dos_time;
+    uint16_t dos_date;
+    uint32_t crc32;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
+    uint32_t external_attrs;
+};
+
+class ZipReader;
+
+/*!
+ * \brief Sequential reader for the data of one zip entry
+ *
+ * Stored and deflated entries are supported. The CRC32 is verified when the
+ * end of the data is reached. Any number of readers can be used concurrently
+ * with the same ZipReader.
+ */
+class ZipEntryReader
+{
+public:
+    ZipEntryReader(const ZipReader &zip, const ZipEntry &entry);
+    ~ZipEntryReader();
+
+    ZipEntryReader(const ZipEntryReader &) = delete;
+    ZipEntryReader & operator=(const ZipEntryReader &) = delete;
+
+    bool read_block(const void *&buf, size_t &size);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> _impl;
+};
+
+/*!
+ * \brief Random-access zip reader
+ *
+ * The central directory is read once when the file is opened. Afterwards,
+ * entries can be looked up by name and read directly from their local headers
+ * without walking the rest of the archive. All reads use `pread()`, so entries
+ * can be read and extracted from multiple threads at the same time.
+ */
+class ZipReader
+{
+public:
+    ZipReader();
+    ~ZipReader();
+
+    ZipReader(const ZipReader &) = delete;
+    ZipReader & operator=(const ZipReader &) = delete;
+
+    bool open(const std::string &path);
+    void close();
+
+    const std::string & path() const;
+    const std::vector<ZipEntry> & entries() const;
+    const ZipEntry * find(const std::string &name) const;
+
+    bool read_to_memory(const ZipEntry &entry, std::vector<unsigned char> *out,
+                        size_t max_size) const;
+    bool extract(const ZipEntry &entry, const std::string &target) const;
+    bool extract_files(const std::vector<extract_info> &files,
+                       unsigned int threads = 0) const;
+
+private:
+    int _fd;
+    uint64_t _size;
+    std::string _path;
+    std::vector<ZipEntry> _entries;
+    // Maps entry names to indexes in `_entries`
+    std::unordered_map<std::string, size_t> _names;
+
+    bool read_central_directory();
+
+    friend class ZipEntryReader;
+};
+
+}
+}
@@ -20,15 +20,31 @@
 #include "mbutil/archive.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <cerrno>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lz4frame.h>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/parallel_compressor.h"
 #include "mbutil/path.h"
+#include "mbutil/zip.h"
 
 #define LIBARCHIVE_DISK_WRITER_FLAGS \
     ARCHIVE_EXTRACT_TIME \
@@ -45,6 +61,29 @@
 #define LIBARCHIVE_DISK_READER_FLAGS \
     ARCHIVE_READDISK_MAC_COPYFILE
 
+// Amount of uncompressed data in each independently compressed LZ4 frame or
+// gzip member when compressing tarballs with multiple threads
+#define PARALLEL_COMPRESS_BLOCK_SIZE    (4 * 1024 * 1024)
+
+// The index of a seekable tarball is stored in an LZ4 skippable frame after
+// the compressed tar stream. Decoders ignore skippable frames, so the file is
+// still a regular .tar.lz4. The index ends with a footer containing the size
+// of the whole skippable frame and SEEKABLE_FOOTER_MAGIC.
+#define SEEKABLE_FRAME_MAGIC            0x184d2a5eu
+#define SEEKABLE_FOOTER_MAGIC           0x4953424du // "MBSI"
+#define SEEKABLE_FOOTER_SIZE            8
+#define SEEKABLE_INDEX_VERSION          1u
+// Upper bound for the index size to avoid large allocations for corrupt files
+#define SEEKABLE_INDEX_MAX_SIZE         (256 * 1024 * 1024)
+
+// Regular files up to this size are buffered in memory and written to disk by
+// the extraction threads. Larger files are written by the reading thread.
+#define PARALLEL_EXTRACT_MAX_FILE_SIZE  (1024 * 1024)
+// Maximum amount of file data waiting to be written by the extraction threads
+#define PARALLEL_EXTRACT_MAX_BUFFERED   (32 * 1024 * 1024)
+// Maximum number of entries waiting to be written by the extraction threads
+#define PARALLEL_EXTRACT_MAX_QUEUED     1024
+
 namespace mb
 {
 namespace util
@@ -163,6 +202,347 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
     return ret;
 }
 
+static unsigned int default_thread_count()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*!
+ * \brief Add compression filters to an archive writer
+ *
+ * Compressors that support multithreading are set up to use all CPUs.
+ *
+ * \param a Archive writer
+ * \param filters Filters (`ARCHIVE_FILTER_*`) in the order they should be added
+ * \param threads Maximum number of compression threads (0 for all CPUs)
+ *
+ * \return Whether all of the filters were added
+ */
+bool libarchive_add_write_filters(archive *a, const std::vector<int> &filters,
+                                  unsigned int threads)
+{
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+
+    for (const int &filter : filters) {
+        if (archive_write_add_filter(a, filter) != ARCHIVE_OK) {
+            LOGE("Failed to add output archive filter: %s",
+                 archive_error_string(a));
+            return false;
+        }
+
+        const char *name = nullptr;
+        if (filter == ARCHIVE_FILTER_XZ) {
+            name = "xz";
+#ifdef ARCHIVE_FILTER_ZSTD
+        } else if (filter == ARCHIVE_FILTER_ZSTD) {
+            name = "zstd";
+#endif
+        }
+
+        if (name) {
+            std::string value = format("%u", threads);
+
+            // Not fatal if libarchive was built without threaded support
+            if (archive_write_set_filter_option(
+                    a, name, "threads", value.c_str()) != ARCHIVE_OK) {
+                LOGV("Failed to enable multithreaded %s compression: %s",
+                     name, archive_error_string(a));
+            }
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Writes buffered archive entries to disk on a pool of threads
+ *
+ * Each thread has its own disk writer. Restoring many small files is
+ * dominated by the latency of the open/write/fchown/fsetxattr/utimes calls for
+ * each file, so writing several files at the same time while the reading
+ * thread keeps decompressing hides most of it.
+ *
+ * The caller is responsible for ordering: entries must only be submitted if
+ * they don't depend on any other queued entry, and barrier() must be called
+ * otherwise.
+ */
+class ParallelExtractor
+{
+public:
+    explicit ParallelExtractor(unsigned int threads)
+        : _threads_count(std::max(1u, threads))
+    {
+    }
+
+    ~ParallelExtractor()
+    {
+        stop_threads();
+    }
+
+    ParallelExtractor(const ParallelExtractor &) = delete;
+    ParallelExtractor & operator=(const ParallelExtractor &) = delete;
+
+    bool start();
+    bool submit(archive *in, archive_entry *entry);
+    bool barrier();
+    bool finish();
+    std::string error();
+
+private:
+    struct Job
+    {
+        autoclose::archive_entry entry{nullptr, archive_entry_free};
+        std::vector<char> data;
+        // File offset and length of each block in `data`
+        std::vector<std::pair<int64_t, size_t>> blocks;
+    };
+
+    unsigned int _threads_count;
+    std::vector<autoclose::archive> _writers;
+    std::vector<std::thread> _threads;
+
+    std::mutex _lock;
+    // Signaled when a job is queued or on shutdown
+    std::condition_variable _queued_cv;
+    // Signaled when a job has been written
+    std::condition_variable _done_cv;
+    std::deque<std::unique_ptr<Job>> _queue;
+    // Jobs that have been queued, but not written yet
+    size_t _pending = 0;
+    // Data size of those jobs
+    size_t _buffered = 0;
+    // Whether the reading thread is waiting in submit() or barrier()
+    bool _waiting = false;
+    bool _stop = false;
+    bool _failed = false;
+    std::string _error_msg;
+
+    void worker(archive *out);
+    void finish_job(const Job &job);
+    void stop_threads();
+};
+
+/*!
+ * \brief Create the disk writers and start the threads
+ */
+bool ParallelExtractor::start()
+{
+    for (unsigned int i = 0; i < _threads_count; ++i) {
+        autoclose::archive out(archive_write_disk_new(), archive_write_free);
+        if (!out) {
+            _error_msg = "Out of memory when creating disk writer";
+            return false;
+        }
+
+        archive_write_disk_set_standard_lookup(out.get());
+        archive_write_disk_set_options(out.get(), LIBARCHIVE_DISK_WRITER_FLAGS);
+
+        _writers.push_back(std::move(out));
+    }
+
+    for (auto &out : _writers) {
+        _threads.emplace_back(&ParallelExtractor::worker, this, out.get());
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the data for \p entry and queue it for writing
+ *
+ * This blocks if too much data is already waiting to be written.
+ *
+ * \return Whether the data was read and all previous entries were written
+ *         successfully
+ */
+bool ParallelExtractor::submit(archive *in, archive_entry *entry)
+{
+    std::unique_ptr<Job> job(new Job());
+    job->entry.reset(archive_entry_clone(entry));
+    if (!job->entry) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _error_msg = "Out of memory when cloning entry";
+        _failed = true;
+        return false;
+    }
+
+    const void *buf;
+    size_t size;
+    int64_t offset;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &buf, &size, &offset))
+            == ARCHIVE_OK) {
+        auto ptr = static_cast<const char *>(buf);
+        job->data.insert(job->data.end(), ptr, ptr + size);
+        job->blocks.emplace_back(offset, size);
+    }
+
+    std::unique_lock<std::mutex> lock(_lock);
+
+    if (ret != ARCHIVE_EOF) {
+        _error_msg = format("%s: Data copy ended without reaching EOF: %s",
+                            archive_entry_pathname(entry),
+                            archive_error_string(in));
+        _failed = true;
+        return false;
+    }
+
+    size_t data_size = job->data.size();
+
+    _waiting = true;
+    _done_cv.wait(lock, [&]{
+        return _failed || _pending == 0
+                || (_pending < PARALLEL_EXTRACT_MAX_QUEUED
+                        && _buffered + data_size
+                                <= PARALLEL_EXTRACT_MAX_BUFFERED);
+    });
+    _waiting = false;
+
+    if (_failed) {
+        return false;
+    }
+
+    ++_pending;
+    _buffered += data_size;
+    _queue.push_back(std::move(job));
+    _queued_cv.notify_one();
+
+    return true;
+}
+
+/*!
+ * \brief Wait for all queued entries to be written
+ *
+ * \return Whether all entries were written successfully
+ */
+bool ParallelExtractor::barrier()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _waiting = true;
+    _done_cv.wait(lock, [&]{
+        return _pending == 0;
+    });
+    _waiting = false;
+    return !_failed;
+}
+
+/*!
+ * \brief Write all queued entries, stop the threads, and close the writers
+ *
+ * \return Whether all entries were written successfully
+ */
+bool ParallelExtractor::finish()
+{
+    bool ret = barrier();
+
+    stop_threads();
+
+    for (auto &out : _writers) {
+        if (archive_write_close(out.get()) != ARCHIVE_OK) {
+            if (ret) {
+                _error_msg = archive_error_string(out.get());
+            }
+            ret = false;
+        }
+    }
+    _writers.clear();
+
+    return ret;
+}
+
+std::string ParallelExtractor::error()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _error_msg;
+}
+
+void ParallelExtractor::worker(archive *out)
+{
+    while (true) {
+        std::unique_ptr<Job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _queued_cv.wait(lock, [&]{
+                return _stop || !_queue.empty();
+            });
+
+            if (_queue.empty()) {
+                return;
+            }
+
+            job = std::move(_queue.front());
+            _queue.pop_front();
+
+            // Skip the remaining entries after a failure
+            if (_failed) {
+                finish_job(*job);
+                continue;
+            }
+        }
+
+        archive_entry *entry = job->entry.get();
+        bool ok = archive_write_header(out, entry) == ARCHIVE_OK;
+
+        for (size_t i = 0, pos = 0; ok && i < job->blocks.size(); ++i) {
+            auto const &block = job->blocks[i];
+            ok = archive_write_data_block(out, job->data.data() + pos,
+                                          block.second, block.first)
+                    == ARCHIVE_OK;
+            pos += block.second;
+        }
+
+        if (ok) {
+            ok = archive_write_finish_entry(out) == ARCHIVE_OK;
+        }
+
+        std::lock_guard<std::mutex> guard(_lock);
+
+        if (!ok && !_failed) {
+            _error_msg = format("%s: %s", archive_entry_pathname(entry),
+                                archive_error_string(out));
+            _failed = true;
+        }
+
+        finish_job(*job);
+    }
+}
+
+/*!
+ * \brief Release a job's share of the queue limits
+ *
+ * Must be called with the lock held. The reading thread is only woken up if
+ * it is waiting to avoid a context switch for every entry.
+ */
+void ParallelExtractor::finish_job(const Job &job)
+{
+    --_pending;
+    _buffered -= job.data.size();
+
+    if (_waiting) {
+        _done_cv.notify_one();
+    }
+}
+
+void ParallelExtractor::stop_threads()
+{
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+        // Queued jobs are skipped by the workers once they see this
+        _failed = _failed || !_queue.empty();
+    }
+    _queued_cv.notify_all();
+
+    for (auto &t : _threads) {
+        t.join();
+    }
+    _threads.clear();
+}
+
 /*
  * The following libarchive functions are based on code from bsdtar. The main
  * difference is that they will not try to extract/add as many files as possible
@@ -170,10 +550,62 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
  * warning because an incomplete archive is useless for backup and restoring.
  */
 
+/*!
+ * \brief Make the path and hard link target of an entry relative to \p target
+ */
+static void set_target_paths(archive_entry *entry, const std::string &target)
+{
+    const char *path = archive_entry_pathname(entry);
+
+    std::string target_path(target);
+    if (target_path.back() != '/' && *path != '/') {
+        target_path += '/';
+    }
+    target_path += path;
+
+    archive_entry_set_pathname(entry, target_path.c_str());
+
+    // Hard link targets are relative to the archive root too
+    const char *hardlink = archive_entry_hardlink(entry);
+    if (hardlink && *hardlink != '/') {
+        target_path = target;
+        if (target_path.back() != '/') {
+            target_path += '/';
+        }
+        target_path += hardlink;
+
+        archive_entry_set_hardlink(entry, target_path.c_str());
+    }
+}
+
+/*!
+ * \brief Extract pax archive with all metadata
+ *
+ * Small regular files are written to disk by a pool of threads while the
+ * archive is being read. Directories, links, special files, large files, and
+ * entries handled by \a file_cb are written in archive order by the calling
+ * thread. Entries that depend on a queued entry (hard links and entries with a
+ * path that is already queued) wait for the queue to drain first. Directory
+ * permissions and timestamps are fixed up after all files have been written.
+ *
+ * \param filename Source archive path
+ * \param target Target directory
+ * \param patterns If not empty, only extract entries matching these patterns
+ * \param compression Compression type
+ * \param threads Maximum number of writer threads (0 for all CPUs, 1 to write
+ *                everything from the calling thread)
+ * \param file_cb Optional callback for each entry
+ * \param userdata User data for \a file_cb
+ *
+ * \return Whether the extraction was successful
+ */
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression)
+                            compression_type compression,
+                            unsigned int threads,
+                            TarExtractFileCallback file_cb,
+                            void *userdata)
 {
     if (target.empty()) {
         LOGE("%s: Invalid target path for extraction", target.c_str());
@@ -221,6 +653,14 @@ bool libarchive_tar_extract(const std::string &filename,
     case compression_type::XZ:
         archive_read_support_filter_xz(in.get());
         break;
+    case compression_type::ZSTD:
+#ifdef ARCHIVE_FILTER_ZSTD
+        archive_read_support_filter_zstd(in.get());
+        break;
+#else
+        LOGE("libarchive was built without zstd support");
+        return false;
+#endif
     default:
         LOGE("Invalid compression type");
         return false;
@@ -237,9 +677,26 @@ bool libarchive_tar_extract(const std::string &filename,
         return false;
     }
 
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+
+    // Must be destroyed before the disk writer so that directory fixups run
+    // after all queued files are written
+    std::unique_ptr<ParallelExtractor> extractor;
+    // Paths queued since the last barrier
+    std::unordered_set<std::string> queued_paths;
+
+    if (threads > 1) {
+        extractor.reset(new ParallelExtractor(threads));
+        if (!extractor->start()) {
+            LOGE("%s: %s", __FUNCTION__, extractor->error().c_str());
+            return false;
+        }
+    }
+
     archive_entry *entry;
     int ret;
-    std::string target_path;
 
     while (true) {
         ret = archive_read_next_header(in.get(), &entry);
@@ -262,20 +719,47 @@ bool libarchive_tar_extract(const std::string &filename,
 
         LOGV("%s", path);
 
-        // Build path
-        target_path = target;
-        if (target_path.back() != '/' && *path != '/') {
-            target_path += '/';
-        }
-        target_path += path;
-
-        archive_entry_set_pathname(entry, target_path.c_str());
+        set_target_paths(entry, target);
+        const char *hardlink = archive_entry_hardlink(entry);
 
         // Check pattern matches
         if (archive_match_excluded(matcher.get(), entry)) {
             continue;
         }
 
+        if (extractor) {
+            // Hard links need their target on disk and later entries with
+            // the same path must not race with the earlier ones
+            if (hardlink || !queued_paths.insert(
+                    archive_entry_pathname(entry)).second) {
+                if (!extractor->barrier()) {
+                    LOGE("%s", extractor->error().c_str());
+                    return false;
+                }
+                queued_paths.clear();
+                queued_paths.insert(archive_entry_pathname(entry));
+            }
+        }
+
+        if (file_cb) {
+            bool handled = false;
+            if (!file_cb(out.get(), entry, &handled, userdata)) {
+                return false;
+            } else if (handled) {
+                continue;
+            }
+        }
+
+        if (extractor && !hardlink
+                && archive_entry_filetype(entry) == AE_IFREG
+                && archive_entry_size(entry) <= PARALLEL_EXTRACT_MAX_FILE_SIZE) {
+            if (!extractor->submit(in.get(), entry)) {
+                LOGE("%s", extractor->error().c_str());
+                return false;
+            }
+            continue;
+        }
+
         // Extract file
         ret = archive_read_extract2(in.get(), entry, out.get());
         if (ret != ARCHIVE_OK) {
@@ -290,6 +774,17 @@ bool libarchive_tar_extract(const std::string &filename,
         return false;
     }
 
+    if (extractor && !extractor->finish()) {
+        LOGE("%s", extractor->error().c_str());
+        return false;
+    }
+
+    // Apply the deferred directory permissions and timestamps
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("%s: %s", target.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
     // Check that all patterns were matched
     const char *pattern;
     while ((ret = archive_match_path_unmatched_inclusions_next(
@@ -304,58 +799,397 @@ bool libarchive_tar_extract(const std::string &filename,
     return archive_match_path_unmatched_inclusions(matcher.get()) == 0;
 }
 
-static bool write_file(archive *in, archive *out, archive_entry *entry)
+struct SeekableTarMember
 {
-    int ret;
+    std::string path;
+    // Offset of the entry's headers in the uncompressed tar stream
+    uint64_t offset;
+};
 
-    ret = archive_write_header(out, entry);
-    if (ret != ARCHIVE_OK) {
-        LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(out));
+struct SeekableTarIndex
+{
+    std::vector<ParallelCompressor::Frame> frames;
+    std::vector<SeekableTarMember> members;
+};
+
+static void put_le32(std::vector<unsigned char> &buf, uint32_t value)
+{
+    value = mb_htole32(value);
+    auto ptr = reinterpret_cast<const unsigned char *>(&value);
+    buf.insert(buf.end(), ptr, ptr + sizeof(value));
+}
+
+static void put_le64(std::vector<unsigned char> &buf, uint64_t value)
+{
+    value = mb_htole64(value);
+    auto ptr = reinterpret_cast<const unsigned char *>(&value);
+    buf.insert(buf.end(), ptr, ptr + sizeof(value));
+}
+
+static bool get_le32(const unsigned char *&ptr, const unsigned char *end,
+                     uint32_t &value)
+{
+    if (static_cast<size_t>(end - ptr) < sizeof(value)) {
         return false;
     }
+    memcpy(&value, ptr, sizeof(value));
+    value = mb_le32toh(value);
+    ptr += sizeof(value);
+    return true;
+}
 
-    if (archive_entry_size(entry) > 0) {
-        return util::libarchive_copy_data_disk_to_archive(in, out, entry);
+static bool get_le64(const unsigned char *&ptr, const unsigned char *end,
+                     uint64_t &value)
+{
+    if (static_cast<size_t>(end - ptr) < sizeof(value)) {
+        return false;
     }
-
+    memcpy(&value, ptr, sizeof(value));
+    value = mb_le64toh(value);
+    ptr += sizeof(value);
     return true;
 }
 
-static int metadata_filter(archive *a, void *data, archive_entry *entry)
+/*!
+ * \brief Serialize a seekable tarball index into an LZ4 skippable frame
+ *
+ * Layout (all integers are little endian):
+ *
+ * - u32 skippable frame magic, u32 payload size
+ * - u32 version
+ * - u64 frame count, followed by u64 compressed size and u64 uncompressed size
+ *   for each frame
+ * - u64 member count, followed by u64 offset, u32 path length, and path for
+ *   each member
+ * - u32 size of the whole skippable frame, u32 footer magic
+ */
+static std::vector<unsigned char> build_seekable_index(
+        const SeekableTarIndex &index)
 {
-    (void) data;
-    (void) entry;
+    std::vector<unsigned char> buf;
 
-    if (archive_read_disk_can_descend(a)) {
-        archive_read_disk_descend(a);
+    put_le32(buf, SEEKABLE_FRAME_MAGIC);
+    // Payload size is filled in below
+    put_le32(buf, 0);
+    put_le32(buf, SEEKABLE_INDEX_VERSION);
+
+    put_le64(buf, index.frames.size());
+    for (auto const &frame : index.frames) {
+        put_le64(buf, frame.compressed_size);
+        put_le64(buf, frame.uncompressed_size);
     }
-    return 1;
+
+    put_le64(buf, index.members.size());
+    for (auto const &member : index.members) {
+        put_le64(buf, member.offset);
+        put_le32(buf, static_cast<uint32_t>(member.path.size()));
+        buf.insert(buf.end(), member.path.begin(), member.path.end());
+    }
+
+    put_le32(buf, static_cast<uint32_t>(buf.size() + SEEKABLE_FOOTER_SIZE));
+    put_le32(buf, SEEKABLE_FOOTER_MAGIC);
+
+    uint32_t payload_size = mb_htole32(static_cast<uint32_t>(buf.size() - 8));
+    memcpy(buf.data() + 4, &payload_size, sizeof(payload_size));
+
+    return buf;
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    auto ptr = static_cast<unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pread64(fd, ptr, size, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+
+    return true;
 }
 
 /*!
- * \brief Create pax archive with all metadata
- *
- * \param filename Target archive path
- * \param base_dir Base directory for \a paths
- * \param paths List of paths to add to the archive
+ * \brief Read the index of a seekable tarball
  *
- * \return Whether the archive creation was successful
+ * \return Whether \p fd refers to a seekable tarball with a valid index
  */
-bool libarchive_tar_create(const std::string &filename,
-                           const std::string &base_dir,
-                           const std::vector<std::string> &paths,
-                           compression_type compression)
+static bool read_seekable_index(int fd, SeekableTarIndex &index)
 {
-    if (base_dir.empty() && paths.empty()) {
-        LOGE("%s: No base directory or paths specified", filename.c_str());
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < 8 + SEEKABLE_FOOTER_SIZE) {
         return false;
     }
+    uint64_t file_size = static_cast<uint64_t>(sb.st_size);
 
-    autoclose::archive in(archive_read_disk_new(), archive_read_free);
-    if (!in) {
-        LOGE("%s: Out of memory when creating disk reader", __FUNCTION__);
+    unsigned char footer[SEEKABLE_FOOTER_SIZE];
+    if (!pread_fully(fd, footer, sizeof(footer),
+                     file_size - SEEKABLE_FOOTER_SIZE)) {
         return false;
     }
+
+    const unsigned char *ptr = footer;
+    uint32_t index_size;
+    uint32_t magic;
+    get_le32(ptr, footer + sizeof(footer), index_size);
+    get_le32(ptr, footer + sizeof(footer), magic);
+
+    if (magic != SEEKABLE_FOOTER_MAGIC
+            || index_size < 8 + 4 + 8 + 8 + SEEKABLE_FOOTER_SIZE
+            || index_size > SEEKABLE_INDEX_MAX_SIZE
+            || index_size > file_size) {
+        return false;
+    }
+
+    std::vector<unsigned char> buf(index_size);
+    if (!pread_fully(fd, buf.data(), buf.size(), file_size - index_size)) {
+        return false;
+    }
+
+    ptr = buf.data();
+    const unsigned char *end = buf.data() + buf.size() - SEEKABLE_FOOTER_SIZE;
+    uint32_t payload_size;
+    uint32_t version;
+    uint64_t count;
+
+    if (!get_le32(ptr, end, magic) || magic != SEEKABLE_FRAME_MAGIC
+            || !get_le32(ptr, end, payload_size)
+            || payload_size != index_size - 8
+            || !get_le32(ptr, end, version)
+            || version != SEEKABLE_INDEX_VERSION
+            || !get_le64(ptr, end, count)
+            || count > static_cast<size_t>(end - ptr) / 16) {
+        return false;
+    }
+
+    index.frames.clear();
+    index.frames.reserve(count);
+
+    ParallelCompressor::Frame frame{};
+
+    for (uint64_t i = 0; i < count; ++i) {
+        frame.compressed_offset += frame.compressed_size;
+        frame.uncompressed_offset += frame.uncompressed_size;
+        get_le64(ptr, end, frame.compressed_size);
+        get_le64(ptr, end, frame.uncompressed_size);
+        index.frames.push_back(frame);
+    }
+
+    // The frames must cover everything before the index
+    if (frame.compressed_offset + frame.compressed_size
+            != file_size - index_size) {
+        return false;
+    }
+
+    if (!get_le64(ptr, end, count)
+            || count > static_cast<size_t>(end - ptr) / 12) {
+        return false;
+    }
+
+    index.members.clear();
+    index.members.reserve(count);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        SeekableTarMember member;
+        uint32_t path_size;
+
+        if (!get_le64(ptr, end, member.offset)
+                || !get_le32(ptr, end, path_size)
+                || path_size > static_cast<size_t>(end - ptr)) {
+            return false;
+        }
+
+        member.path.assign(reinterpret_cast<const char *>(ptr), path_size);
+        ptr += path_size;
+
+        index.members.push_back(std::move(member));
+    }
+
+    return ptr == end;
+}
+
+static bool write_file(archive *in, archive *out, archive_entry *entry,
+                       TarCreateFileCallback file_cb, void *userdata,
+                       std::vector<SeekableTarMember> *members)
+{
+    int ret;
+    bool store_data = true;
+
+    if (file_cb && archive_entry_filetype(entry) == AE_IFREG
+            && archive_entry_size(entry) > 0) {
+        if (!file_cb(entry, &store_data, userdata)) {
+            return false;
+        }
+        if (!store_data) {
+            archive_entry_set_size(entry, 0);
+        }
+    }
+
+    if (members) {
+        // Write the padding of the previous entry so that the first filter's
+        // byte count is the offset of this entry in the uncompressed stream
+        ret = archive_write_finish_entry(out);
+        if (ret != ARCHIVE_OK) {
+            LOGE("%s: %s", archive_entry_pathname(entry),
+                 archive_error_string(out));
+            return false;
+        }
+
+        members->push_back({ archive_entry_pathname(entry),
+                             static_cast<uint64_t>(
+                                     archive_filter_bytes(out, 0)) });
+    }
+
+    ret = archive_write_header(out, entry);
+    if (ret != ARCHIVE_OK) {
+        LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(out));
+        return false;
+    }
+
+    if (archive_entry_size(entry) > 0) {
+        return util::libarchive_copy_data_disk_to_archive(in, out, entry);
+    }
+
+    return true;
+}
+
+static int metadata_filter(archive *a, void *data, archive_entry *entry)
+{
+    (void) data;
+    (void) entry;
+
+    if (archive_read_disk_can_descend(a)) {
+        archive_read_disk_descend(a);
+    }
+    return 1;
+}
+
+struct ParallelWriter
+{
+    int fd;
+    ParallelCompressor compressor;
+    // Whether to append an index of the frames and members
+    bool seekable = false;
+    std::vector<SeekableTarMember> members;
+
+    ParallelWriter(int fd, ParallelCompressor::Format format,
+                   unsigned int threads, size_t block_size)
+        : fd(fd), compressor(fd, format, threads, block_size)
+    {
+    }
+
+    ~ParallelWriter()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+static la_ssize_t parallel_write_cb(archive *a, void *userdata,
+                                    const void *buf, size_t size)
+{
+    auto *writer = static_cast<ParallelWriter *>(userdata);
+
+    if (!writer->compressor.write(buf, size)) {
+        archive_set_error(a, EIO, "%s", writer->compressor.error().c_str());
+        return -1;
+    }
+
+    return size;
+}
+
+static int parallel_close_cb(archive *a, void *userdata)
+{
+    auto *writer = static_cast<ParallelWriter *>(userdata);
+    int ret = ARCHIVE_OK;
+
+    if (!writer->compressor.finish()) {
+        archive_set_error(a, EIO, "%s", writer->compressor.error().c_str());
+        ret = ARCHIVE_FATAL;
+    } else if (writer->seekable) {
+        SeekableTarIndex index;
+        index.frames = writer->compressor.frames();
+        index.members = std::move(writer->members);
+
+        std::vector<unsigned char> buf = build_seekable_index(index);
+        const unsigned char *ptr = buf.data();
+        size_t size = buf.size();
+
+        while (size > 0) {
+            ssize_t n = write(writer->fd, ptr, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                archive_set_error(a, errno, "Failed to write index: %s",
+                                  strerror(errno));
+                ret = ARCHIVE_FATAL;
+                break;
+            }
+            ptr += n;
+            size -= n;
+        }
+    }
+
+    if (close(writer->fd) < 0) {
+        if (ret == ARCHIVE_OK) {
+            archive_set_error(a, errno, "Failed to close file: %s",
+                              strerror(errno));
+        }
+        ret = ARCHIVE_FATAL;
+    }
+    writer->fd = -1;
+
+    return ret;
+}
+
+/*!
+ * \brief Create pax archive with all metadata
+ *
+ * \param filename Target archive path
+ * \param base_dir Base directory for \a paths
+ * \param paths List of paths to add to the archive
+ * \param compression Compression type
+ * \param threads Maximum number of compression threads (0 for all CPUs)
+ * \param bytes_out If not nullptr, set to the uncompressed size of the archive
+ * \param file_cb Optional callback for regular files
+ * \param userdata User data for \a file_cb
+ *
+ * \return Whether the archive creation was successful
+ */
+bool libarchive_tar_create(const std::string &filename,
+                           const std::string &base_dir,
+                           const std::vector<std::string> &paths,
+                           compression_type compression,
+                           unsigned int threads,
+                           uint64_t *bytes_out,
+                           TarCreateFileCallback file_cb,
+                           void *userdata)
+{
+    if (base_dir.empty() && paths.empty()) {
+        LOGE("%s: No base directory or paths specified", filename.c_str());
+        return false;
+    }
+
+    autoclose::archive in(archive_read_disk_new(), archive_read_free);
+    if (!in) {
+        LOGE("%s: Out of memory when creating disk reader", __FUNCTION__);
+        return false;
+    }
+    // Must outlive the archive writer, which calls parallel_close_cb() when
+    // it is freed
+    std::unique_ptr<ParallelWriter> parallel_writer;
+
     autoclose::archive out(archive_write_new(), archive_write_free);
     if (!out) {
         LOGE("%s: Out of memory when creating archive writer", __FUNCTION__);
@@ -389,29 +1223,81 @@ bool libarchive_tar_create(const std::string &filename,
     archive_write_set_format_pax_restricted(out.get());
     archive_write_set_bytes_per_block(out.get(), 10240);
 
+    // lz4 and gzip are single-threaded in libarchive, so we compress those
+    // ourselves when there is more than one CPU
+    if (threads == 0) {
+        threads = default_thread_count();
+    }
+    bool parallel = false;
+    ParallelCompressor::Format parallel_format =
+            ParallelCompressor::Format::LZ4;
+    std::vector<int> filters;
+
     switch (compression) {
     case compression_type::NONE:
         break;
     case compression_type::LZ4:
-        archive_write_add_filter_lz4(out.get());
+        // Always compressed ourselves, even with one thread, so that the
+        // independent frames can be indexed
+        parallel = true;
+        parallel_format = ParallelCompressor::Format::LZ4;
         break;
     case compression_type::GZIP:
-        archive_write_add_filter_gzip(out.get());
+        if (threads > 1) {
+            parallel = true;
+            parallel_format = ParallelCompressor::Format::GZIP;
+        } else {
+            filters.push_back(ARCHIVE_FILTER_GZIP);
+        }
         break;
     case compression_type::XZ:
-        archive_write_add_filter_xz(out.get());
+        filters.push_back(ARCHIVE_FILTER_XZ);
+        break;
+    case compression_type::ZSTD:
+#ifdef ARCHIVE_FILTER_ZSTD
+        filters.push_back(ARCHIVE_FILTER_ZSTD);
         break;
+#else
+        LOGE("libarchive was built without zstd support");
+        return false;
+#endif
     default:
         LOGE("Invalid compression type");
         return false;
     }
 
+    if (!libarchive_add_write_filters(out.get(), filters, threads)) {
+        return false;
+    }
+
     // Set up link resolver parameters
     archive_entry_linkresolver_set_strategy(resolver.get(),
                                             archive_format(out.get()));
 
     // Open output file
-    if (archive_write_open_filename(out.get(), filename.c_str()) != ARCHIVE_OK) {
+    if (parallel) {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0666);
+        if (fd < 0) {
+            LOGE("%s: Failed to open file: %s",
+                 filename.c_str(), strerror(errno));
+            return false;
+        }
+
+        parallel_writer.reset(new ParallelWriter(
+                fd, parallel_format, threads, PARALLEL_COMPRESS_BLOCK_SIZE));
+        parallel_writer->seekable =
+                parallel_format == ParallelCompressor::Format::LZ4;
+
+        if (archive_write_open(out.get(), parallel_writer.get(), nullptr,
+                               &parallel_write_cb, &parallel_close_cb)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to open file: %s",
+                 filename.c_str(), archive_error_string(out.get()));
+            return false;
+        }
+    } else if (archive_write_open_filename(
+            out.get(), filename.c_str()) != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(out.get()));
         return false;
@@ -422,6 +1308,10 @@ bool libarchive_tar_create(const std::string &filename,
     int ret;
     std::string full_path;
 
+    std::vector<SeekableTarMember> *members =
+            parallel_writer && parallel_writer->seekable
+            ? &parallel_writer->members : nullptr;
+
     // Add hierarchies
     for (const std::string &path : paths) {
         if (path.empty()) {
@@ -496,7 +1386,8 @@ bool libarchive_tar_create(const std::string &filename,
             archive_entry_linkify(resolver.get(), &entry, &sparse_entry);
 
             if (entry) {
-                if (!write_file(in.get(), out.get(), entry)) {
+                if (!write_file(in.get(), out.get(), entry, file_cb,
+                                userdata, members)) {
                     archive_entry_free(entry);
                     return false;
                 }
@@ -504,7 +1395,8 @@ bool libarchive_tar_create(const std::string &filename,
                 entry = nullptr;
             }
             if (sparse_entry) {
-                if (!write_file(in.get(), out.get(), sparse_entry)) {
+                if (!write_file(in.get(), out.get(), sparse_entry, file_cb,
+                                userdata, members)) {
                     archive_entry_free(sparse_entry);
                     return false;
                 }
@@ -548,7 +1440,8 @@ bool libarchive_tar_create(const std::string &filename,
             return false;
         }
 
-        if (!write_file(in.get(), out.get(), entry)) {
+        if (!write_file(in.get(), out.get(), entry, file_cb, userdata,
+                        members)) {
             archive_entry_free(entry);
             return false;
         }
@@ -563,173 +1456,424 @@ bool libarchive_tar_create(const std::string &filename,
         return false;
     }
 
-    return true;
-}
-
-static bool set_up_input(archive *in, const std::string &filename)
-{
-    // Add more as needed
-    //archive_read_support_format_all(in);
-    //archive_read_support_filter_all(in);
-    //archive_read_support_format_tar(in);
-    archive_read_support_format_zip(in);
-    //archive_read_support_filter_xz(in);
-
-    if (archive_read_open_filename(in, filename.c_str(), 10240) != ARCHIVE_OK) {
-        LOGE("%s: Failed to open archive: %s",
-             filename.c_str(), archive_error_string(in));
-        return false;
+    if (bytes_out) {
+        // The first filter sees the uncompressed tar stream
+        *bytes_out = archive_filter_bytes(out.get(), 0);
     }
 
     return true;
 }
 
-static void set_up_output(archive *out)
+/*! \cond INTERNAL */
+struct SeekableReader
 {
-    archive_write_disk_set_options(out,
-                                   ARCHIVE_EXTRACT_ACL |
-                                   ARCHIVE_EXTRACT_FFLAGS |
-                                   ARCHIVE_EXTRACT_PERM |
-                                   ARCHIVE_EXTRACT_SECURE_NODOTDOT |
-                                   ARCHIVE_EXTRACT_SECURE_SYMLINKS |
-                                   ARCHIVE_EXTRACT_TIME |
-                                   ARCHIVE_EXTRACT_UNLINK |
-                                   ARCHIVE_EXTRACT_XATTR);
-}
-
-bool extract_archive(const std::string &filename, const std::string &target)
+    int fd;
+    const SeekableTarIndex *index;
+    // Next frame to decompress
+    size_t frame;
+    // Number of bytes to skip at the beginning of the next frame
+    uint64_t skip;
+    std::vector<unsigned char> compressed;
+    std::vector<unsigned char> buf;
+    LZ4F_dctx *dctx;
+};
+/*! \endcond */
+
+static la_ssize_t seekable_read_cb(archive *a, void *userdata,
+                                   const void **buf)
 {
-    autoclose::archive in(archive_read_new(), archive_read_free);
-    autoclose::archive out(archive_write_disk_new(), archive_write_free);
+    auto *reader = static_cast<SeekableReader *>(userdata);
 
-    if (!in || !out) {
-        LOGE("Out of memory");
-        return false;
+    if (reader->frame == reader->index->frames.size()) {
+        return 0;
     }
 
-    archive_entry *entry;
-    int ret;
-    std::string cwd = get_cwd();
+    auto const &frame = reader->index->frames[reader->frame];
 
-    if (cwd.empty()) {
-        return false;
+    reader->compressed.resize(frame.compressed_size);
+    if (!pread_fully(reader->fd, reader->compressed.data(),
+                     reader->compressed.size(), frame.compressed_offset)) {
+        archive_set_error(a, errno, "Failed to read frame: %s",
+                          strerror(errno));
+        return ARCHIVE_FATAL;
     }
 
-    if (!set_up_input(in.get(), filename)) {
-        return false;
-    }
+    reader->buf.resize(frame.uncompressed_size);
 
-    set_up_output(out.get());
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    size_t hint;
 
-    if (!mkdir_recursive(target, S_IRWXU | S_IRWXG | S_IRWXO)) {
-        LOGE("%s: Failed to create directory: %s",
-             target.c_str(), strerror(errno));
-        return false;
-    }
+    do {
+        size_t in_size = reader->compressed.size() - in_pos;
+        size_t out_size = reader->buf.size() - out_pos;
 
-    if (chdir(target.c_str()) < 0) {
-        LOGE("%s: Failed to change to target directory: %s",
-             target.c_str(), strerror(errno));
-        return false;
-    }
+        hint = LZ4F_decompress(reader->dctx, reader->buf.data() + out_pos,
+                               &out_size, reader->compressed.data() + in_pos,
+                               &in_size, nullptr);
+        if (LZ4F_isError(hint)) {
+            archive_set_error(a, EIO, "Failed to decompress frame: %s",
+                              LZ4F_getErrorName(hint));
+            return ARCHIVE_FATAL;
+        }
 
-    auto chdir_back = finally([&] {
-        chdir(cwd.c_str());
-    });
+        in_pos += in_size;
+        out_pos += out_size;
 
-    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
-        if (libarchive_copy_header_and_data(in.get(), out.get(), entry) != ARCHIVE_OK) {
-            return false;
+        if (hint != 0 && in_size == 0 && out_size == 0) {
+            break;
         }
-    }
+    } while (hint != 0);
 
-    if (ret != ARCHIVE_EOF) {
-        LOGE("Archive extraction ended without reaching EOF: %s",
-             archive_error_string(in.get()));
-        return false;
+    if (hint != 0 || out_pos != reader->buf.size()
+            || reader->skip > reader->buf.size()) {
+        archive_set_error(a, EIO, "Frame does not match the index");
+        return ARCHIVE_FATAL;
     }
 
-    return true;
+    *buf = reader->buf.data() + reader->skip;
+    la_ssize_t n = static_cast<la_ssize_t>(reader->buf.size() - reader->skip);
+
+    reader->skip = 0;
+    ++reader->frame;
+
+    return n;
 }
 
-bool extract_files(const std::string &filename, const std::string &target,
-                   const std::vector<std::string> &files)
+/*!
+ * \brief Normalize a path in a tarball for comparison
+ */
+static std::string normalize_member_path(const std::string &path)
 {
-    if (files.empty()) {
-        return false;
+    size_t begin = 0;
+    size_t end = path.size();
+
+    while (true) {
+        if (path.compare(begin, 2, "./") == 0) {
+            begin += 2;
+        } else if (begin < end && path[begin] == '/') {
+            ++begin;
+        } else {
+            break;
+        }
+    }
+    while (end > begin && path[end - 1] == '/') {
+        --end;
     }
 
-    autoclose::archive in(archive_read_new(), archive_read_free);
-    autoclose::archive out(archive_write_disk_new(), archive_write_free);
+    return path.substr(begin, end - begin);
+}
 
-    if (!in || !out) {
-        LOGE("Out of memory");
-        return false;
-    }
+static bool member_matches(const std::string &path, const std::string &prefix)
+{
+    return path.size() >= prefix.size()
+            && path.compare(0, prefix.size(), prefix) == 0
+            && (path.size() == prefix.size() || path[prefix.size()] == '/');
+}
 
-    archive_entry *entry;
-    int ret;
-    std::string cwd = get_cwd();
-    unsigned int count = 0;
+/*! \cond INTERNAL */
+struct SeekableExtractor
+{
+    const std::string &filename;
+    int fd;
+    const SeekableTarIndex &index;
+    archive *out;
+    const std::string &target;
+    // Normalized paths of the entries that have been extracted
+    std::unordered_set<std::string> extracted;
+    // Normalized path -> index of the last member with that path
+    std::unordered_map<std::string, size_t> members_by_path;
+};
+/*! \endcond */
 
-    if (cwd.empty()) {
+/*!
+ * \brief Extract \p count consecutive entries starting at \p member
+ *
+ * If an entry is a hard link to a file that was not extracted, that file is
+ * extracted first.
+ */
+static bool extract_seekable_run(SeekableExtractor &ctx, size_t member,
+                                 size_t count)
+{
+    auto const &frames = ctx.index.frames;
+    uint64_t offset = ctx.index.members[member].offset;
+
+    // Find the frame containing the first header
+    auto it = std::upper_bound(
+            frames.begin(), frames.end(), offset,
+            [](uint64_t offset, const ParallelCompressor::Frame &frame) {
+                return offset < frame.uncompressed_offset;
+            });
+    if (it == frames.begin()) {
+        LOGE("%s: Invalid offset for %s", ctx.filename.c_str(),
+             ctx.index.members[member].path.c_str());
         return false;
     }
-
-    if (!set_up_input(in.get(), filename)) {
+    --it;
+
+    SeekableReader reader;
+    reader.fd = ctx.fd;
+    reader.index = &ctx.index;
+    reader.frame = static_cast<size_t>(it - frames.begin());
+    reader.skip = offset - it->uncompressed_offset;
+    reader.dctx = nullptr;
+
+    LZ4F_errorCode_t lz4_ret =
+            LZ4F_createDecompressionContext(&reader.dctx, LZ4F_VERSION);
+    if (LZ4F_isError(lz4_ret)) {
+        LOGE("%s: Failed to create LZ4 context: %s",
+             ctx.filename.c_str(), LZ4F_getErrorName(lz4_ret));
         return false;
     }
 
-    set_up_output(out.get());
+    auto free_dctx = finally([&]{
+        LZ4F_freeDecompressionContext(reader.dctx);
+    });
 
-    if (!mkdir_recursive(target, S_IRWXU | S_IRWXG | S_IRWXO)) {
-        LOGE("%s: Failed to create directory: %s",
-             target.c_str(), strerror(errno));
+    autoclose::archive in(archive_read_new(), archive_read_free);
+    if (!in) {
+        LOGE("%s: Out of memory when creating archive reader", __FUNCTION__);
         return false;
     }
 
-    if (chdir(target.c_str()) < 0) {
-        LOGE("%s: Failed to change to target directory: %s",
-             target.c_str(), strerror(errno));
+    archive_read_support_format_tar(in.get());
+
+    if (archive_read_open(in.get(), &reader, nullptr, &seekable_read_cb,
+                          nullptr) != ARCHIVE_OK) {
+        LOGE("%s: Failed to open file: %s",
+             ctx.filename.c_str(), archive_error_string(in.get()));
         return false;
     }
 
-    auto chdir_back = finally([&] {
-        chdir(cwd.c_str());
-    });
+    archive_entry *entry;
+    int ret;
 
-    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
-        if (std::find(files.begin(), files.end(),
-                archive_entry_pathname(entry)) != files.end()) {
-            ++count;
+    for (size_t i = 0; i < count; ++i) {
+        ret = archive_read_next_header(in.get(), &entry);
+        if (ret == ARCHIVE_RETRY) {
+            LOGW("%s: Retrying header read", ctx.filename.c_str());
+            --i;
+            continue;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("%s: Failed to read header: %s",
+                 ctx.filename.c_str(), archive_error_string(in.get()));
+            return false;
+        }
 
-            if (libarchive_copy_header_and_data(in.get(), out.get(), entry) != ARCHIVE_OK) {
-                return false;
+        const char *path = archive_entry_pathname(entry);
+        if (!path || !*path) {
+            LOGE("%s: Header has null or empty filename",
+                 ctx.filename.c_str());
+            return false;
+        }
+
+        LOGV("%s", path);
+
+        ctx.extracted.insert(normalize_member_path(path));
+
+        const char *hardlink = archive_entry_hardlink(entry);
+        if (hardlink) {
+            std::string link_path = normalize_member_path(hardlink);
+
+            if (ctx.extracted.find(link_path) == ctx.extracted.end()) {
+                auto link_it = ctx.members_by_path.find(link_path);
+                if (link_it == ctx.members_by_path.end()) {
+                    LOGE("%s: Hard link target not found: %s",
+                         ctx.filename.c_str(), link_path.c_str());
+                    return false;
+                }
+
+                LOGD("%s: Extracting hard link target %s",
+                     ctx.filename.c_str(), link_path.c_str());
+
+                if (!extract_seekable_run(ctx, link_it->second, 1)) {
+                    return false;
+                }
             }
         }
+
+        set_target_paths(entry, ctx.target);
+
+        ret = archive_read_extract2(in.get(), entry, ctx.out);
+        if (ret != ARCHIVE_OK) {
+            LOGE("%s: %s", archive_entry_pathname(entry),
+                 archive_error_string(in.get()));
+            return false;
+        }
     }
 
-    if (ret != ARCHIVE_EOF) {
-        LOGE("Archive extraction ended without reaching EOF: %s",
-             archive_error_string(in.get()));
+    return true;
+}
+
+/*!
+ * \brief Check if a file is a seekable tarball
+ *
+ * Seekable tarballs are the LZ4-compressed tarballs created by
+ * libarchive_tar_create(). They consist of independently compressed frames
+ * followed by an index of the frames and of the offset of every entry.
+ */
+bool libarchive_tar_is_seekable(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return false;
     }
 
-    if (count != files.size()) {
-        LOGE("Not all specified files were extracted");
+    SeekableTarIndex index;
+    bool ret = read_seekable_index(fd, index);
+
+    close(fd);
+    return ret;
+}
+
+/*!
+ * \brief Extract some paths from a seekable tarball
+ *
+ * Only the frames containing the requested entries are read and decompressed.
+ * Each path selects the entry with that name and, if it is a directory,
+ * everything below it.
+ *
+ * \param filename Source archive path
+ * \param target Target directory
+ * \param paths Paths to extract, relative to the root of the archive
+ *
+ * \return Whether every path was found and extracted successfully
+ */
+bool libarchive_tar_extract_seekable(const std::string &filename,
+                                     const std::string &target,
+                                     const std::vector<std::string> &paths)
+{
+    if (target.empty()) {
+        LOGE("%s: Invalid target path for extraction", target.c_str());
         return false;
     }
 
-    return true;
+    std::vector<std::string> prefixes;
+    for (const std::string &path : paths) {
+        prefixes.push_back(normalize_member_path(path));
+        if (prefixes.back().empty()) {
+            LOGE("Invalid path: %s", path.c_str());
+            return false;
+        }
+    }
+
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open file: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    SeekableTarIndex index;
+    if (!read_seekable_index(fd, index)) {
+        LOGE("%s: Not a seekable tarball", filename.c_str());
+        return false;
+    }
+
+    autoclose::archive out(archive_write_disk_new(), archive_write_free);
+    if (!out) {
+        LOGE("%s: Out of memory when creating disk writer", __FUNCTION__);
+        return false;
+    }
+
+    archive_write_disk_set_standard_lookup(out.get());
+    archive_write_disk_set_options(out.get(), LIBARCHIVE_DISK_WRITER_FLAGS);
+
+    SeekableExtractor ctx{ filename, fd, index, out.get(), target, {}, {} };
+    std::vector<bool> found(prefixes.size());
+    auto const &members = index.members;
+
+    for (size_t i = 0; i < members.size(); ++i) {
+        ctx.members_by_path[normalize_member_path(members[i].path)] = i;
+    }
+
+    auto matches = [&](const SeekableTarMember &member) {
+        std::string path = normalize_member_path(member.path);
+        bool ret = false;
+
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            if (member_matches(path, prefixes[i])) {
+                found[i] = true;
+                ret = true;
+            }
+        }
+
+        return ret;
+    };
+
+    // Entries below a directory are stored consecutively, so each run of
+    // matching entries is read with a single pass over its frames
+    for (size_t i = 0; i < members.size();) {
+        if (!matches(members[i])) {
+            ++i;
+            continue;
+        }
+
+        size_t begin = i++;
+        while (i < members.size() && matches(members[i])) {
+            ++i;
+        }
+
+        if (!extract_seekable_run(ctx, begin, i - begin)) {
+            return false;
+        }
+    }
+
+    // Apply the deferred directory permissions and timestamps
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("%s: %s", target.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
+    bool ret = true;
+
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        if (!found[i]) {
+            LOGE("%s: Path not found: %s", filename.c_str(),
+                 prefixes[i].c_str());
+            ret = false;
+        }
+    }
+
+    return ret;
 }
 
-bool extract_files2(const std::string &filename,
-                    const std::vector<extract_info> &files)
+static bool set_up_input(archive *in, const std::string &filename)
 {
-    if (files.empty()) {
+    // Add more as needed
+    //archive_read_support_format_all(in);
+    //archive_read_support_filter_all(in);
+    //archive_read_support_format_tar(in);
+    archive_read_support_format_zip(in);
+    //archive_read_support_filter_xz(in);
+
+    if (archive_read_open_filename(in, filename.c_str(), 10240) != ARCHIVE_OK) {
+        LOGE("%s: Failed to open archive: %s",
+             filename.c_str(), archive_error_string(in));
         return false;
     }
 
+    return true;
+}
+
+static void set_up_output(archive *out)
+{
+    archive_write_disk_set_options(out,
+                                   ARCHIVE_EXTRACT_ACL |
+                                   ARCHIVE_EXTRACT_FFLAGS |
+                                   ARCHIVE_EXTRACT_PERM |
+                                   ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+                                   ARCHIVE_EXTRACT_SECURE_SYMLINKS |
+                                   ARCHIVE_EXTRACT_TIME |
+                                   ARCHIVE_EXTRACT_UNLINK |
+                                   ARCHIVE_EXTRACT_XATTR);
+}
+
+bool extract_archive(const std::string &filename, const std::string &target)
+{
     autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
@@ -740,7 +1884,11 @@ bool extract_files2(const std::string &filename,
 
     archive_entry *entry;
     int ret;
-    unsigned int count = 0;
+    std::string cwd = get_cwd();
+
+    if (cwd.empty()) {
+        return false;
+    }
 
     if (!set_up_input(in.get(), filename)) {
         return false;
@@ -748,19 +1896,25 @@ bool extract_files2(const std::string &filename,
 
     set_up_output(out.get());
 
-    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
-        for (const extract_info &info : files) {
-            if (info.from == archive_entry_pathname(entry)) {
-                ++count;
+    if (!mkdir_recursive(target, S_IRWXU | S_IRWXG | S_IRWXO)) {
+        LOGE("%s: Failed to create directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
 
-                archive_entry_set_pathname(entry, info.to.c_str());
+    if (chdir(target.c_str()) < 0) {
+        LOGE("%s: Failed to change to target directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
 
-                if (libarchive_copy_header_and_data(in.get(), out.get(), entry) != ARCHIVE_OK) {
-                    return false;
-                }
+    auto chdir_back = finally([&] {
+        chdir(cwd.c_str());
+    });
 
-                archive_entry_set_pathname(entry, info.from.c_str());
-            }
+    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
+        if (libarchive_copy_header_and_data(in.get(), out.get(), entry) != ARCHIVE_OK) {
+            return false;
         }
     }
 
@@ -770,43 +1924,62 @@ bool extract_files2(const std::string &filename,
         return false;
     }
 
-    if (count != files.size()) {
-        LOGE("Not all specified files were extracted");
-        return false;
-    }
-
     return true;
 }
 
-bool archive_exists(const std::string &filename,
-                    std::vector<exists_info> &files)
+bool extract_files(const std::string &filename, const std::string &target,
+                   const std::vector<std::string> &files)
 {
     if (files.empty()) {
         return false;
     }
 
     autoclose::archive in(archive_read_new(), archive_read_free);
+    autoclose::archive out(archive_write_disk_new(), archive_write_free);
 
-    if (!in) {
+    if (!in || !out) {
         LOGE("Out of memory");
         return false;
     }
 
     archive_entry *entry;
     int ret;
+    std::string cwd = get_cwd();
+    unsigned int count = 0;
 
-    for (exists_info &info : files) {
-        info.exists = false;
+    if (cwd.empty()) {
+        return false;
     }
 
     if (!set_up_input(in.get(), filename)) {
         return false;
     }
 
+    set_up_output(out.get());
+
+    if (!mkdir_recursive(target, S_IRWXU | S_IRWXG | S_IRWXO)) {
+        LOGE("%s: Failed to create directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (chdir(target.c_str()) < 0) {
+        LOGE("%s: Failed to change to target directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto chdir_back = finally([&] {
+        chdir(cwd.c_str());
+    });
+
     while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
-        for (exists_info &info : files) {
-            if (info.path == archive_entry_pathname(entry)) {
-                info.exists = true;
+        if (std::find(files.begin(), files.end(),
+                archive_entry_pathname(entry)) != files.end()) {
+            ++count;
+
+            if (libarchive_copy_header_and_data(in.get(), out.get(), entry) != ARCHIVE_OK) {
+                return false;
             }
         }
     }
@@ -817,8 +1990,584 @@ bool archive_exists(const std::string &filename,
         return false;
     }
 
+    if (count != files.size()) {
+        LOGE("Not all specified files were extracted");
+        return false;
+    }
+
+    return true;
+}
+
+/*! \cond INTERNAL */
+struct TarIndexEntry
+{
+    // Offset of the entry's header in the uncompressed stream
+    int64_t offset;
+    // Target of the entry if it is a hardlink
+    std::string hardlink;
+};
+
+struct ArchiveIndex::Impl
+{
+    std::string filename;
+    bool is_zip = false;
+
+    // Zip archives
+    ZipReader zip;
+
+    // Tarballs. The index is built on first use and is not modified afterwards.
+    std::mutex tar_lock;
+    bool tar_indexed = false;
+    bool tar_index_ok = false;
+    // Only uncompressed tarballs can be seeked into directly
+    bool tar_seekable = false;
+    std::unordered_map<std::string, TarIndexEntry> tar_entries;
+
+    bool ensure_tar_index();
+    bool build_tar_index();
+    const TarIndexEntry * tar_find(const std::string &name);
+    bool tar_extract_seek(const std::vector<extract_info> &files);
+    bool tar_extract_sequential(const std::vector<extract_info> &files);
+};
+/*! \endcond */
+
+static bool set_up_tar_input(archive *in)
+{
+    if (archive_read_support_format_tar(in) != ARCHIVE_OK
+            || archive_read_support_filter_all(in) != ARCHIVE_OK) {
+        LOGE("Failed to enable tar reader: %s", archive_error_string(in));
+        return false;
+    }
+
     return true;
 }
 
+bool ArchiveIndex::Impl::ensure_tar_index()
+{
+    std::lock_guard<std::mutex> lock(tar_lock);
+
+    if (!tar_indexed) {
+        tar_index_ok = build_tar_index();
+        tar_indexed = true;
+    }
+
+    return tar_index_ok;
+}
+
+bool ArchiveIndex::Impl::build_tar_index()
+{
+    autoclose::archive in(archive_read_new(), archive_read_free);
+
+    if (!in) {
+        LOGE("Out of memory");
+        return false;
+    }
+
+    if (!set_up_tar_input(in.get())) {
+        return false;
+    }
+
+    if (archive_read_open_filename(in.get(), filename.c_str(), 10240)
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open archive: %s",
+             filename.c_str(), archive_error_string(in.get()));
+        return false;
+    }
+
+    archive_entry *entry;
+    int ret;
+
+    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
+        const char *name = archive_entry_pathname(entry);
+        const char *hardlink = archive_entry_hardlink(entry);
+
+        if (!name) {
+            continue;
+        }
+
+        // Later entries replace earlier ones when extracting, so do the same
+        // here
+        auto &item = tar_entries[name];
+        item.offset = archive_read_header_position(in.get());
+        item.hardlink = hardlink ? hardlink : "";
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: Failed to index archive: %s",
+             filename.c_str(), archive_error_string(in.get()));
+        tar_entries.clear();
+        return false;
+    }
+
+    // The "none" filter is always present
+    tar_seekable = archive_filter_count(in.get()) == 1;
+
+    return true;
+}
+
+const TarIndexEntry * ArchiveIndex::Impl::tar_find(const std::string &name)
+{
+    auto it = tar_entries.find(name);
+    return it == tar_entries.end() ? nullptr : &it->second;
+}
+
+/*!
+ * \brief Extract entries from an uncompressed tarball by seeking to them
+ *
+ * Hardlinks are extracted as copies of the entries they point to since the
+ * original link target may not be extracted.
+ */
+bool ArchiveIndex::Impl::tar_extract_seek(const std::vector<extract_info> &files)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open archive: %s",
+             filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        ::close(fd);
+    });
+
+    autoclose::archive out(archive_write_disk_new(), archive_write_free);
+
+    if (!out) {
+        LOGE("Out of memory");
+        return false;
+    }
+
+    set_up_output(out.get());
+
+    for (auto const &info : files) {
+        std::string name = info.from;
+        const TarIndexEntry *item = tar_find(name);
+
+        // Follow hardlinks to the entry that holds the data. The limit guards
+        // against malformed archives with link cycles.
+        for (int depth = 0; item && !item->hardlink.empty(); ++depth) {
+            if (depth == 32) {
+                LOGE("%s: %s: Too many levels of hardlinks",
+                     filename.c_str(), info.from.c_str());
+                return false;
+            }
+
+            name = item->hardlink;
+            item = tar_find(name);
+        }
+
+        if (!item) {
+            LOGE("%s: %s: Hardlink target does not exist",
+                 filename.c_str(), info.from.c_str());
+            return false;
+        }
+
+        if (lseek64(fd, item->offset, SEEK_SET) < 0) {
+            LOGE("%s: Failed to seek: %s", filename.c_str(), strerror(errno));
+            return false;
+        }
+
+        autoclose::archive in(archive_read_new(), archive_read_free);
+        archive_entry *entry;
+
+        if (!in) {
+            LOGE("Out of memory");
+            return false;
+        }
+
+        if (archive_read_support_format_tar(in.get()) != ARCHIVE_OK
+                || archive_read_open_fd(in.get(), fd, 10240) != ARCHIVE_OK) {
+            LOGE("%s: Failed to open archive: %s",
+                 filename.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+
+        if (archive_read_next_header(in.get(), &entry) != ARCHIVE_OK) {
+            LOGE("%s: %s: Failed to read header: %s",
+                 filename.c_str(), name.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+
+        const char *pathname = archive_entry_pathname(entry);
+        if (!pathname || name != pathname) {
+            LOGE("%s: %s: Archive changed since it was indexed",
+                 filename.c_str(), name.c_str());
+            return false;
+        }
+
+        archive_entry_set_pathname(entry, info.to.c_str());
+
+        if (archive_write_header(out.get(), entry) != ARCHIVE_OK) {
+            LOGE("%s: Failed to write header: %s",
+                 info.to.c_str(), archive_error_string(out.get()));
+            return false;
+        }
+
+        if (archive_entry_size(entry) > 0
+                && libarchive_copy_data(in.get(), out.get(), entry)
+                        != ARCHIVE_OK) {
+            return false;
+        }
+
+        if (archive_write_finish_entry(out.get()) != ARCHIVE_OK) {
+            LOGE("%s: Failed to finish entry: %s",
+                 info.to.c_str(), archive_error_string(out.get()));
+            return false;
+        }
+    }
+
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("Failed to close disk writer: %s", archive_error_string(out.get()));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract entries from a compressed tarball
+ *
+ * Compressed streams cannot be seeked into, so this reads through the archive.
+ * Each pass extracts every requested entry once. More passes are only needed
+ * if an entry is requested multiple times. Hardlinks are recreated as links to
+ * the extracted copy of their target, which must be extracted first.
+ */
+bool ArchiveIndex::Impl::tar_extract_sequential(
+        const std::vector<extract_info> &files)
+{
+    std::vector<bool> done(files.size());
+    size_t remaining = files.size();
+
+    while (remaining > 0) {
+        autoclose::archive in(archive_read_new(), archive_read_free);
+        autoclose::archive out(archive_write_disk_new(), archive_write_free);
+
+        if (!in || !out) {
+            LOGE("Out of memory");
+            return false;
+        }
+
+        if (!set_up_tar_input(in.get())) {
+            return false;
+        }
+
+        if (archive_read_open_filename(in.get(), filename.c_str(), 10240)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to open archive: %s",
+                 filename.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+
+        set_up_output(out.get());
+
+        // First pending request for each entry
+        std::unordered_map<std::string, size_t> wanted;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (!done[i]) {
+                wanted.emplace(files[i].from, i);
+            }
+        }
+
+        // Where each entry was extracted to during this pass
+        std::unordered_map<std::string, std::string> written;
+
+        archive_entry *entry;
+        int ret;
+
+        while ((ret = archive_read_next_header(in.get(), &entry))
+                == ARCHIVE_OK) {
+            const char *pathname = archive_entry_pathname(entry);
+            if (!pathname) {
+                continue;
+            }
+
+            auto it = wanted.find(pathname);
+            if (it == wanted.end()) {
+                continue;
+            }
+
+            auto const &info = files[it->second];
+            const char *hardlink = archive_entry_hardlink(entry);
+
+            if (hardlink) {
+                auto link_it = written.find(hardlink);
+                if (link_it == written.end()) {
+                    LOGE("%s: %s: Hardlink target was not extracted",
+                         filename.c_str(), pathname);
+                    return false;
+                }
+                archive_entry_set_hardlink(entry, link_it->second.c_str());
+            }
+
+            archive_entry_set_pathname(entry, info.to.c_str());
+
+            if (libarchive_copy_header_and_data(in.get(), out.get(), entry)
+                    != ARCHIVE_OK) {
+                return false;
+            }
+
+            written[info.from] = info.to;
+            done[it->second] = true;
+            --remaining;
+            wanted.erase(it);
+        }
+
+        if (ret != ARCHIVE_EOF) {
+            LOGE("Archive extraction ended without reaching EOF: %s",
+                 archive_error_string(in.get()));
+            return false;
+        }
+
+        if (archive_write_close(out.get()) != ARCHIVE_OK) {
+            LOGE("Failed to close disk writer: %s",
+                 archive_error_string(out.get()));
+            return false;
+        }
+
+        if (!wanted.empty() && written.empty()) {
+            LOGE("%s: Not all specified files were found", filename.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+ArchiveIndex::ArchiveIndex() : _impl(new Impl())
+{
+}
+
+ArchiveIndex::~ArchiveIndex() = default;
+
+/*!
+ * \brief Open an archive
+ *
+ * Zips are detected by their signature. Everything else is treated as a
+ * (possibly compressed) tarball.
+ */
+bool ArchiveIndex::open(const std::string &filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open archive: %s",
+             filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    unsigned char magic[4];
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    int saved_errno = errno;
+    ::close(fd);
+
+    if (n < 0) {
+        LOGE("%s: Failed to read archive: %s",
+             filename.c_str(), strerror(saved_errno));
+        return false;
+    }
+
+    bool is_zip = n == sizeof(magic)
+            && (memcmp(magic, "PK\x03\x04", 4) == 0
+                    || memcmp(magic, "PK\x05\x06", 4) == 0);
+
+    if (is_zip && !_impl->zip.open(filename)) {
+        return false;
+    }
+
+    _impl->filename = filename;
+    _impl->is_zip = is_zip;
+
+    return true;
+}
+
+void ArchiveIndex::close()
+{
+    _impl.reset(new Impl());
+}
+
+bool ArchiveIndex::is_open() const
+{
+    return !_impl->filename.empty();
+}
+
+const std::string & ArchiveIndex::filename() const
+{
+    return _impl->filename;
+}
+
+/*!
+ * \brief Check if the archive contains an entry
+ *
+ * \return Whether the entry exists. If the index could not be built, false is
+ *         returned.
+ */
+bool ArchiveIndex::exists(const std::string &name) const
+{
+    if (_impl->is_zip) {
+        return _impl->zip.find(name) != nullptr;
+    } else if (is_open() && _impl->ensure_tar_index()) {
+        return _impl->tar_find(name) != nullptr;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Check if the archive contains each of the entries in \a files
+ *
+ * \return Whether the index could be read
+ */
+bool ArchiveIndex::exists(std::vector<exists_info> &files) const
+{
+    for (exists_info &info : files) {
+        info.exists = false;
+    }
+
+    if (!is_open()) {
+        LOGE("Archive is not open");
+        return false;
+    } else if (!_impl->is_zip && !_impl->ensure_tar_index()) {
+        return false;
+    }
+
+    for (exists_info &info : files) {
+        info.exists = exists(info.path);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract entries to the specified paths
+ *
+ * All entries must exist. Zip entries are extracted concurrently.
+ */
+bool ArchiveIndex::extract_files(const std::vector<extract_info> &files) const
+{
+    if (!is_open()) {
+        LOGE("Archive is not open");
+        return false;
+    } else if (_impl->is_zip) {
+        return _impl->zip.extract_files(files);
+    } else if (!_impl->ensure_tar_index()) {
+        return false;
+    }
+
+    for (auto const &info : files) {
+        if (!_impl->tar_find(info.from)) {
+            LOGE("%s: %s: Entry does not exist",
+                 _impl->filename.c_str(), info.from.c_str());
+            return false;
+        }
+    }
+
+    if (_impl->tar_seekable) {
+        return _impl->tar_extract_seek(files);
+    } else {
+        return _impl->tar_extract_sequential(files);
+    }
+}
+
+/*!
+ * \brief Extract specific files from an indexed archive into \a target
+ *
+ * Unlike the overload taking a filename, this does not change the working
+ * directory.
+ */
+bool extract_files(const ArchiveIndex &index, const std::string &target,
+                   const std::vector<std::string> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    std::vector<extract_info> info;
+    info.reserve(files.size());
+
+    for (auto const &file : files) {
+        info.push_back({ file, target + "/" + file });
+    }
+
+    if (!index.extract_files(info)) {
+        LOGE("Not all specified files were extracted");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract specific files from a zip
+ *
+ * The entries are found through the zip's central directory and extracted
+ * concurrently, so this does not need to walk the archive.
+ */
+bool extract_files2(const std::string &filename,
+                    const std::vector<extract_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    ArchiveIndex index;
+    if (!index.open(filename)) {
+        return false;
+    }
+
+    return extract_files2(index, files);
+}
+
+/*!
+ * \brief Extract specific files from an indexed archive
+ *
+ * Use this instead of the overload taking a filename when extracting from the
+ * same archive multiple times.
+ */
+bool extract_files2(const ArchiveIndex &index,
+                    const std::vector<extract_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    if (!index.extract_files(files)) {
+        LOGE("Not all specified files were extracted");
+        return false;
+    }
+
+    return true;
+}
+
+bool archive_exists(const std::string &filename,
+                    std::vector<exists_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    ArchiveIndex index;
+    if (!index.open(filename)) {
+        return false;
+    }
+
+    return index.exists(files);
+}
+
+/*!
+ * \brief Check which of \a files exist in an indexed archive
+ *
+ * Each lookup is a hash table lookup, so this is cheap to call repeatedly.
+ */
+bool archive_exists(const ArchiveIndex &index,
+                    std::vector<exists_info> &files)
+{
+    if (files.empty()) {
+        return false;
+    }
+
+    return index.exists(files);
+}
+
 }
 }
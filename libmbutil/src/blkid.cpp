@@ -19,15 +19,32 @@
 
 #include "mbutil/blkid.h"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <cerrno>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mbutil/finally.h"
+#include "mbutil/integer.h"
+
+// Enough to read the btrfs superblock, which has the largest offset
+#define PROBE_SIZE              (64 * 1024 + 4096)
+
+#define MAX_PROBE_THREADS       8
+
+#define UEVENT_SEQNUM_PATH      "/sys/kernel/uevent_seqnum"
 
 // NOTE: We don't use libblkid from util-linux because we don't need most of its
 // features and it increases mbtool's binary size more than 200KiB (armeabi-v7a)
@@ -94,29 +111,110 @@ static inline bool is_vfat(const void *data, size_t size)
             || check_magic(data, size, "\125\252", 2, 0x1fe);
 }
 
+static void format_uuid(const unsigned char *uuid, std::string &out)
+{
+    char buf[37];
+    snprintf(buf, sizeof(buf),
+             "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+             "%02x%02x%02x%02x%02x%02x",
+             uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5], uuid[6],
+             uuid[7], uuid[8], uuid[9], uuid[10], uuid[11], uuid[12],
+             uuid[13], uuid[14], uuid[15]);
+    out = buf;
+}
+
+// Serial numbers are little endian and printed with the most significant byte
+// first, like blkid does
+static void format_serial(const unsigned char *serial, size_t size,
+                          bool dash, std::string &out)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    out.clear();
+    for (size_t i = size; i > 0; --i) {
+        if (dash && i == size / 2) {
+            out += '-';
+        }
+        out += digits[serial[i - 1] >> 4];
+        out += digits[serial[i - 1] & 0xf];
+    }
+}
+
+static void uuid_at(const void *data, size_t size, size_t offset,
+                    std::string &out)
+{
+    if (offset + 16 <= size) {
+        format_uuid(static_cast<const unsigned char *>(data) + offset, out);
+    }
+}
+
+static void serial_at(const void *data, size_t size, size_t offset,
+                      size_t serial_size, bool dash, std::string &out)
+{
+    if (offset + serial_size <= size) {
+        format_serial(static_cast<const unsigned char *>(data) + offset,
+                      serial_size, dash, out);
+    }
+}
+
+static void btrfs_uuid(const void *data, size_t size, std::string &out)
+{
+    uuid_at(data, size, 64 * 1024 + 0x20, out);
+}
+
+static void exfat_uuid(const void *data, size_t size, std::string &out)
+{
+    serial_at(data, size, 0x64, 4, true, out);
+}
+
+static void ext_uuid(const void *data, size_t size, std::string &out)
+{
+    uuid_at(data, size, 0x400 + 0x68, out);
+}
+
+static void f2fs_uuid(const void *data, size_t size, std::string &out)
+{
+    uuid_at(data, size, 0x400 + 0x70, out);
+}
+
+static void ntfs_uuid(const void *data, size_t size, std::string &out)
+{
+    serial_at(data, size, 0x48, 8, false, out);
+}
+
+static void vfat_uuid(const void *data, size_t size, std::string &out)
+{
+    // FAT32 has a larger BPB, which moves the volume serial number
+    bool fat32 = check_magic(data, size, "MSWIN", 5, 0x52)
+            || check_magic(data, size, "FAT32   ", 8, 0x52);
+    serial_at(data, size, fat32 ? 0x43 : 0x27, 4, true, out);
+}
+
 struct probe_func
 {
     const char *name;
     bool (*func)(const void *, size_t);
+    void (*uuid_func)(const void *, size_t, std::string &);
 };
 
 static probe_func probe_funcs[] = {
-    { "btrfs",    &is_btrfs },
-    { "exfat",    &is_exfat },
-    { "ext",      &is_ext },
-    { "f2fs",     &is_f2fs },
-    { "ntfs",     &is_ntfs },
-    { "squashfs", &is_squashfs },
-    { "vfat",     &is_vfat },
-    { nullptr,    nullptr },
+    { "btrfs",    &is_btrfs,    &btrfs_uuid },
+    { "exfat",    &is_exfat,    &exfat_uuid },
+    { "ext",      &is_ext,      &ext_uuid },
+    { "f2fs",     &is_f2fs,     &f2fs_uuid },
+    { "ntfs",     &is_ntfs,     &ntfs_uuid },
+    { "squashfs", &is_squashfs, nullptr },
+    { "vfat",     &is_vfat,     &vfat_uuid },
+    { nullptr,    nullptr,      nullptr },
 };
 
-static ssize_t read_all(int fd, void *buf, size_t size)
+static ssize_t pread_all(int fd, void *buf, size_t size)
 {
     size_t total = 0;
 
     while (total < size) {
-        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        ssize_t n = pread(fd, static_cast<char *>(buf) + total, size - total,
+                          total);
         if (n == 0) {
             break;
         } else if (n < 0) {
@@ -133,12 +231,95 @@ static ssize_t read_all(int fd, void *buf, size_t size)
     return total;
 }
 
-bool blkid_get_fs_type(const char *path, const char **type)
+// Results for block devices are cached until the next uevent, which is when
+// media could have been changed or a device node could have been reused.
+struct CachedProbe
 {
-    std::vector<unsigned char> buf(1024 * 1024);
+    dev_t rdev;
+    uint64_t size;
+    BlkidInfo info;
+};
+
+static std::vector<CachedProbe> probe_cache;
+static uint64_t probe_cache_seqnum;
+static std::mutex probe_cache_lock;
+
+static bool get_uevent_seqnum(uint64_t &seqnum)
+{
+    int fd = open(UEVENT_SEQNUM_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    char buf[32];
+    ssize_t n = pread_all(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if (n <= 0) {
+        return false;
+    }
+
+    buf[n] = '\0';
+    if (buf[n - 1] == '\n') {
+        buf[n - 1] = '\0';
+    }
+
+    return str_to_unum(buf, 10, &seqnum);
+}
+
+static bool probe_cache_find(dev_t rdev, uint64_t size, uint64_t seqnum,
+                             BlkidInfo &info)
+{
+    std::lock_guard<std::mutex> lock(probe_cache_lock);
+
+    if (seqnum != probe_cache_seqnum) {
+        probe_cache.clear();
+        probe_cache_seqnum = seqnum;
+        return false;
+    }
+
+    for (auto const &entry : probe_cache) {
+        if (entry.rdev == rdev && entry.size == size) {
+            info = entry.info;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void probe_cache_add(dev_t rdev, uint64_t size, uint64_t seqnum,
+                            const BlkidInfo &info)
+{
+    std::lock_guard<std::mutex> lock(probe_cache_lock);
+
+    if (seqnum != probe_cache_seqnum) {
+        return;
+    }
+
+    probe_cache.push_back({ rdev, size, info });
+}
+
+/*!
+ * \brief Detect the filesystem type and UUID of a device or image
+ *
+ * Only the first PROBE_SIZE bytes are read, which covers the superblocks of all
+ * supported filesystems. Results for block devices are cached by device number
+ * and size until the kernel's uevent sequence number changes.
+ *
+ * \param[in] path Path to block device or image file
+ * \param[out] info Probe result. `info.type` is nullptr if the filesystem is
+ *                  not recognized.
+ *
+ * \return True if the device was read. Otherwise, false with errno set.
+ */
+bool blkid_probe(const char *path, BlkidInfo &info)
+{
+    info = BlkidInfo();
 
     int fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
+        info.error = errno;
         return false;
     }
 
@@ -148,19 +329,105 @@ bool blkid_get_fs_type(const char *path, const char **type)
         errno = saved_errno;
     });
 
-    ssize_t n = read_all(fd, buf.data(), buf.size());
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        info.error = errno;
+        return false;
+    }
+
+    uint64_t size = 0;
+    uint64_t seqnum;
+    bool cacheable = S_ISBLK(sb.st_mode)
+            && ioctl(fd, BLKGETSIZE64, &size) == 0
+            && get_uevent_seqnum(seqnum);
+
+    if (cacheable && probe_cache_find(sb.st_rdev, size, seqnum, info)) {
+        return true;
+    }
+
+    std::vector<unsigned char> buf(PROBE_SIZE);
+
+    ssize_t n = pread_all(fd, buf.data(), buf.size());
     if (n < 0) {
+        info.error = errno;
         return false;
     }
 
     for (auto it = probe_funcs; it->name; ++it) {
         if (it->func(buf.data(), n)) {
-            *type = it->name;
-            return true;
+            info.type = it->name;
+            if (it->uuid_func) {
+                it->uuid_func(buf.data(), n, info.uuid);
+            }
+            break;
+        }
+    }
+
+    info.ok = true;
+
+    if (cacheable) {
+        probe_cache_add(sb.st_rdev, size, seqnum, info);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Probe multiple devices concurrently
+ *
+ * The superblocks of the devices are read in parallel, so slow devices (eg. SD
+ * cards being initialized) do not delay probing the other devices.
+ *
+ * \param paths Paths to block devices or image files
+ *
+ * \return Probe result for each item in \p paths (in the same order)
+ */
+std::vector<BlkidInfo> blkid_probe_all(const std::vector<std::string> &paths)
+{
+    std::vector<BlkidInfo> results(paths.size());
+
+    if (paths.size() <= 1) {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            blkid_probe(paths[i].c_str(), results[i]);
         }
+        return results;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&] {
+        size_t i;
+        while ((i = next++) < paths.size()) {
+            blkid_probe(paths[i].c_str(), results[i]);
+        }
+    };
+
+    // Probing is I/O bound, so use more threads than there are CPUs
+    size_t thread_count = std::min<size_t>(paths.size(), MAX_PROBE_THREADS);
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return results;
+}
+
+bool blkid_get_fs_type(const char *path, const char **type)
+{
+    BlkidInfo info;
+
+    if (!blkid_probe(path, info)) {
+        errno = info.error;
+        return false;
     }
 
-    *type = nullptr;
+    *type = info.type;
     return true;
 }
 
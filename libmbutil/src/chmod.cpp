@@ -26,75 +26,17 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
-#include "mblog/logging.h"
-#include "mbutil/fts.h"
-#include "mbutil/string.h"
+#include "mbutil/permissions.h"
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveChmod : public FTSWrapper {
-public:
-    RecursiveChmod(std::string path, mode_t perms)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _perms(perms)
-    {
-    }
-
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted in
-        // on_reached_directory_post()
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_file() override
-    {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        // Avoid security issue
-        LOGW("%s: Not setting permissions on symlink",
-             _curr->fts_path);
-        return Action::FTS_Skip;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    mode_t _perms;
-
-    bool chmod_path()
-    {
-        if (::chmod(_curr->fts_accpath, _perms) < 0) {
-            mb::format(_error_msg, "%s: Failed to chmod: %s",
-                       _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
-};
-
-
 bool chmod(const std::string &path, mode_t perms, int flags)
 {
     if (flags & CHMOD_RECURSIVE) {
-        RecursiveChmod fts(path, perms);
-        return fts.run();
+        return set_permissions_recursive(path, PERMS_SET_MODE, perms, -1, -1);
     } else {
         return ::chmod(path.c_str(), perms) == 0;
     }
@@ -28,10 +28,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
-#include "mblog/logging.h"
-#include "mbutil/fts.h"
-#include "mbutil/string.h"
+#include "mbutil/permissions.h"
 
 namespace mb
 {
@@ -50,63 +47,10 @@ static bool chown_internal(const std::string &path,
     }
 }
 
-class RecursiveChown : public FTSWrapper {
-public:
-    RecursiveChown(std::string path, uid_t uid, gid_t gid,
-                   bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _uid(uid),
-        _gid(gid),
-        _follow_symlinks(follow_symlinks)
-    {
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_file() override
-    {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    uid_t _uid;
-    gid_t _gid;
-    bool _follow_symlinks;
-
-    bool chown_path()
-    {
-        if (!chown_internal(_curr->fts_accpath, _uid, _gid, _follow_symlinks)) {
-            mb::format(_error_msg, "%s: Failed to chown: %s",
-                       _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
-};
-
 // WARNING: Not thread safe! Android doesn't have getpwnam_r() or getgrnam_r()
-bool chown(const std::string &path,
-           const std::string &user,
-           const std::string &group,
-           int flags)
+bool lookup_owner(const std::string &user, const std::string &group,
+                  uid_t *uid, gid_t *gid)
 {
-    uid_t uid;
-    gid_t gid;
-
     errno = 0;
     struct passwd *pw = getpwnam(user.c_str());
     if (!pw) {
@@ -115,7 +59,7 @@ bool chown(const std::string &path,
         }
         return false;
     } else {
-        uid = pw->pw_uid;
+        *uid = pw->pw_uid;
     }
 
     errno = 0;
@@ -126,7 +70,23 @@ bool chown(const std::string &path,
         }
         return false;
     } else {
-        gid = gr->gr_gid;
+        *gid = gr->gr_gid;
+    }
+
+    return true;
+}
+
+// WARNING: Not thread safe! See lookup_owner()
+bool chown(const std::string &path,
+           const std::string &user,
+           const std::string &group,
+           int flags)
+{
+    uid_t uid;
+    gid_t gid;
+
+    if (!lookup_owner(user, group, &uid, &gid)) {
+        return false;
     }
 
     return chown(path, uid, gid, flags);
@@ -138,8 +98,11 @@ bool chown(const std::string &path,
            int flags)
 {
     if (flags & CHOWN_RECURSIVE) {
-        RecursiveChown fts(path, uid, gid, flags & CHOWN_FOLLOW_SYMLINKS);
-        return fts.run();
+        int perms_flags = PERMS_SET_OWNER;
+        if (flags & CHOWN_FOLLOW_SYMLINKS) {
+            perms_flags |= PERMS_FOLLOW_SYMLINKS;
+        }
+        return set_permissions_recursive(path, perms_flags, 0, uid, gid);
     } else {
         return chown_internal(path, uid, gid, flags & CHOWN_FOLLOW_SYMLINKS);
     }
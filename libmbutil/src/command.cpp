@@ -24,8 +24,17 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <fcntl.h>
+#include <paths.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -97,48 +106,18 @@ static void initialize_priv(struct CommandCtxPriv *priv)
     priv->stderr_pipe[1] = -1;
 }
 
-bool command_start(struct CommandCtx *ctx)
+/*!
+ * \brief Start the process with fork()
+ *
+ * This is only used when the child needs to do more than redirect stdio before
+ * exec'ing (ie. chroot). The child is a copy of the parent, so it can log.
+ */
+static bool start_fork(struct CommandCtx *ctx)
 {
-    if (ctx->_priv                              // Process already started
-            || !ctx->path                       // Invalid path
-            || !ctx->argv || !ctx->argv[0]) {   // Invalid arguments
-        errno = EINVAL;
-        goto error;
-    }
-
-    ctx->_priv = static_cast<CommandCtxPriv *>(malloc(sizeof(CommandCtxPriv)));
-    if (!ctx->_priv) {
-        goto error;
-    }
-    initialize_priv(ctx->_priv);
-
-    log_command(ctx->path, ctx->log_argv ? ctx->argv : nullptr,
-                ctx->log_envp ? ctx->envp : nullptr);
-
-    // Create stdout/stderr pipe if output callback is provided
-    if (ctx->redirect_stdio) {
-        if (pipe(ctx->_priv->stdout_pipe) < 0) {
-            ctx->_priv->stdout_pipe[0] = -1;
-            ctx->_priv->stdout_pipe[1] = -1;
-            goto error;
-        }
-        if (pipe(ctx->_priv->stderr_pipe) < 0) {
-            ctx->_priv->stderr_pipe[0] = -1;
-            ctx->_priv->stderr_pipe[1] = -1;
-            goto error;
-        }
-
-        // Make read ends non-blocking
-        if (fcntl(ctx->_priv->stdout_pipe[0], F_SETFL, O_NONBLOCK) < 0
-                || fcntl(ctx->_priv->stderr_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
-            goto error;
-        }
-    }
-
     ctx->_priv->pid = fork();
     if (ctx->_priv->pid < 0) {
         LOGE("Failed to fork: %s", strerror(errno));
-        goto error;
+        return false;
     } else if (ctx->_priv->pid == 0) {
         // Close read end of the pipes
         if (ctx->redirect_stdio) {
@@ -193,14 +172,228 @@ child_error:
         }
 
         _exit(127);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the paths to try when exec'ing \a file, like execvp() would
+ *
+ * The PATH lookup uses the caller's environment, like execvpe(), even if a
+ * different environment is passed to the new process.
+ */
+static std::vector<std::string> exec_candidates(const char *file)
+{
+    std::vector<std::string> result;
+
+    if (strchr(file, '/')) {
+        result.emplace_back(file);
+        return result;
+    }
+
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = _PATH_DEFPATH;
+    }
+
+    for (auto &dir : split(path_env, ":")) {
+        if (dir.empty()) {
+            dir = ".";
+        }
+        dir += '/';
+        dir += file;
+        result.push_back(std::move(dir));
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Start the process with vfork()
+ *
+ * The child borrows the parent's address space until it execs, so starting a
+ * process costs the same regardless of how much memory the parent has mapped.
+ * In exchange, the child may only make async-signal-safe calls and must not
+ * modify anything in the parent's memory. Everything it needs (including the
+ * PATH lookup candidates) is prepared beforehand.
+ *
+ * If exec fails, the child reports errno through a close-on-exec pipe so the
+ * failure can be logged by the parent. The child still exits with status 127,
+ * as with the fork() path.
+ */
+static bool start_vfork(struct CommandCtx *ctx)
+{
+    std::vector<std::string> candidates = exec_candidates(ctx->path);
+    std::vector<const char *> c_candidates;
+    c_candidates.reserve(candidates.size() + 1);
+    for (auto const &c : candidates) {
+        c_candidates.push_back(c.c_str());
+    }
+    c_candidates.push_back(nullptr);
+
+    char * const *argv = const_cast<char * const *>(ctx->argv);
+    char * const *envp = ctx->envp
+            ? const_cast<char * const *>(ctx->envp) : environ;
+    const bool redirect = ctx->redirect_stdio;
+    const int stdout_fds[2] = {
+        ctx->_priv->stdout_pipe[0], ctx->_priv->stdout_pipe[1]
+    };
+    const int stderr_fds[2] = {
+        ctx->_priv->stderr_pipe[0], ctx->_priv->stderr_pipe[1]
+    };
+
+    int error_pipe[2];
+    if (pipe2(error_pipe, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return false;
+    }
+
+    // Signal handlers must not run in the child while it shares the parent's
+    // memory. Block everything until the child has reset its handlers.
+    sigset_t all_signals;
+    sigset_t old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+
+    pid_t pid = vfork();
+    if (pid == 0) {
+        for (int sig = 1; sig < NSIG; ++sig) {
+            struct sigaction sa;
+            if (sigaction(sig, nullptr, &sa) == 0
+                    && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+                sa.sa_handler = SIG_DFL;
+                sa.sa_flags = 0;
+                sigemptyset(&sa.sa_mask);
+                sigaction(sig, &sa, nullptr);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &old_signals, nullptr);
+
+        int child_errno = 0;
+
+        if (redirect) {
+            close(stdout_fds[0]);
+            close(stderr_fds[0]);
+
+            if (dup2(stdout_fds[1], STDOUT_FILENO) < 0
+                    || dup2(stderr_fds[1], STDERR_FILENO) < 0) {
+                child_errno = errno;
+            } else {
+                if (stdout_fds[1] != STDOUT_FILENO) {
+                    close(stdout_fds[1]);
+                }
+                if (stderr_fds[1] != STDERR_FILENO) {
+                    close(stderr_fds[1]);
+                }
+            }
+        }
+
+        if (child_errno == 0) {
+            // Same search rules as execvp(): keep going if the file doesn't
+            // exist and remember EACCES in case nothing else is found
+            child_errno = ENOENT;
+            for (auto iter = c_candidates.data(); *iter; ++iter) {
+                execve(*iter, argv, envp);
+                if (errno == EACCES) {
+                    child_errno = EACCES;
+                } else if (errno != ENOENT && errno != ENOTDIR) {
+                    child_errno = errno;
+                    break;
+                }
+            }
+        }
+
+        if (write(error_pipe[1], &child_errno, sizeof(child_errno)) < 0) {
+            // Nothing we can do
+        }
+        _exit(127);
+    }
+
+    int saved_errno = errno;
+    pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+    close(error_pipe[1]);
+
+    if (pid < 0) {
+        close(error_pipe[0]);
+        LOGE("Failed to vfork: %s", strerror(saved_errno));
+        errno = saved_errno;
+        return false;
+    }
+
+    // The parent only resumes after the child has exec'd or exited, so this
+    // returns immediately
+    int child_errno;
+    ssize_t n;
+    do {
+        n = read(error_pipe[0], &child_errno, sizeof(child_errno));
+    } while (n < 0 && errno == EINTR);
+    close(error_pipe[0]);
+
+    if (n == sizeof(child_errno)) {
+        LOGE("%s: Failed to exec: %s", ctx->path, strerror(child_errno));
+    }
+
+    ctx->_priv->pid = pid;
+    return true;
+}
+
+bool command_start(struct CommandCtx *ctx)
+{
+    if (ctx->_priv                              // Process already started
+            || !ctx->path                       // Invalid path
+            || !ctx->argv || !ctx->argv[0]) {   // Invalid arguments
+        errno = EINVAL;
+        goto error;
+    }
+
+    ctx->_priv = static_cast<CommandCtxPriv *>(malloc(sizeof(CommandCtxPriv)));
+    if (!ctx->_priv) {
+        goto error;
+    }
+    initialize_priv(ctx->_priv);
+
+    log_command(ctx->path, ctx->log_argv ? ctx->argv : nullptr,
+                ctx->log_envp ? ctx->envp : nullptr);
+
+    // Create stdout/stderr pipe if output callback is provided
+    if (ctx->redirect_stdio) {
+        if (pipe(ctx->_priv->stdout_pipe) < 0) {
+            ctx->_priv->stdout_pipe[0] = -1;
+            ctx->_priv->stdout_pipe[1] = -1;
+            goto error;
+        }
+        if (pipe(ctx->_priv->stderr_pipe) < 0) {
+            ctx->_priv->stderr_pipe[0] = -1;
+            ctx->_priv->stderr_pipe[1] = -1;
+            goto error;
+        }
+
+        // Make read ends non-blocking
+        if (fcntl(ctx->_priv->stdout_pipe[0], F_SETFL, O_NONBLOCK) < 0
+                || fcntl(ctx->_priv->stderr_pipe[0], F_SETFL, O_NONBLOCK) < 0) {
+            goto error;
+        }
+    }
+
+    // chroot() has to happen before the executable is looked up in PATH, so
+    // it needs a real fork()ed child that is allowed to do arbitrary work
+    if (ctx->chroot_dir) {
+        if (!start_fork(ctx)) {
+            goto error;
+        }
     } else {
-        // Close write ends of the pipes
-        if (ctx->redirect_stdio) {
-            safely_close(&ctx->_priv->stdout_pipe[1]);
-            safely_close(&ctx->_priv->stderr_pipe[1]);
+        if (!start_vfork(ctx)) {
+            goto error;
         }
     }
 
+    // Close write ends of the pipes
+    if (ctx->redirect_stdio) {
+        safely_close(&ctx->_priv->stdout_pipe[1]);
+        safely_close(&ctx->_priv->stderr_pipe[1]);
+    }
+
     return true;
 
 error:
@@ -302,6 +495,12 @@ bool command_raw_reader(struct CommandCtx *ctx, CmdRawCb cb, void *userdata)
                     // Potential EOF (n == 0) here on some non-Linux systems,
                     // which is fine since it's not possible to reach both the
                     // POLLHUP block and this block
+                    if (is_stderr) {
+                        ctx->stderr_bytes += n;
+                    } else {
+                        ctx->stdout_bytes += n;
+                    }
+
                     cb(buf, n, is_stderr, userdata);
                 }
             }
@@ -311,92 +510,208 @@ bool command_raw_reader(struct CommandCtx *ctx, CmdRawCb cb, void *userdata)
     return ret;
 }
 
-struct CommandLineReaderCtx
+struct CommandGroupStream
 {
-    char stdout_buf[4096];
-    char stderr_buf[4096];
-    size_t stdout_used = 0;
-    size_t stderr_used = 0;
-
-    CmdLineCb cb;
-    void *userdata;
+    struct CommandCtx *ctx;
+    int fd;
+    bool is_stderr;
+    size_t used;
+    // One extra byte to NULL-terminate a full buffer in place
+    char buf[4096 + 1];
 };
 
-void command_line_reader_cb(const char *data, size_t size, bool error,
-                            void *userdata)
+static void group_stream_cb(CommandGroupStream *stream, char *line,
+                            size_t size, CmdGroupLineCb cb, void *userdata)
 {
-    CommandLineReaderCtx *ctx = static_cast<CommandLineReaderCtx *>(userdata);
-
-    size_t cap = (error ? sizeof(ctx->stderr_buf) : sizeof(ctx->stdout_buf)) - 1;
-    char *buf = error ? ctx->stderr_buf : ctx->stdout_buf;
-    size_t *used = error ? &ctx->stderr_used : &ctx->stdout_used;
-
-    // Reached EOF
-    if (size == 0 && *used > 0) {
-        // NULL-terminate the buffer
-        buf[*used] = '\0';
-        ctx->cb(buf, error, ctx->userdata);
-        *used = 0;
-    }
+    // Temporarily NULL-terminate
+    char c = line[size];
+    line[size] = '\0';
 
-    while (size > 0) {
-        // Find available space
-        size_t avail = cap - *used;
+    cb(stream->ctx, line, size, stream->is_stderr, userdata);
 
-        // Copy as much as we can into the buffer
-        size_t n = size > avail ? avail : size;
-        memcpy(buf + *used, data, n);
+    line[size] = c;
+}
+
+/*!
+ * \brief Read available data from a stream and pass complete lines to \a cb
+ *
+ * \return 1 if the stream is still open, 0 if EOF was reached, or -1 if the
+ *         read failed
+ */
+static int group_stream_read(CommandGroupStream *stream,
+                             CmdGroupLineCb cb, void *userdata)
+{
+    const size_t cap = sizeof(stream->buf) - 1;
 
-        // Advance pointer
-        data += n;
-        size -= n;
-        *used += n;
+    while (true) {
+        ssize_t n = read(stream->fd, stream->buf + stream->used,
+                         cap - stream->used);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        } else if (n == 0) {
+            // Pass along the last line if it doesn't end in a newline
+            if (stream->used > 0) {
+                group_stream_cb(stream, stream->buf, stream->used,
+                                cb, userdata);
+                stream->used = 0;
+            }
+            return 0;
+        }
 
-        // NULL-terminate the buffer
-        buf[*used] = '\0';
+        if (stream->is_stderr) {
+            stream->ctx->stderr_bytes += n;
+        } else {
+            stream->ctx->stdout_bytes += n;
+        }
 
-        // Call cb for each contained line
-        char *ptr = buf;
+        // Only the new data needs to be searched for newlines
+        char *begin = stream->buf;
+        char *search = stream->buf + stream->used;
+        char *end = search + n;
         char *newline;
-        while ((newline = strchr(ptr, '\n'))) {
-            // Temporarily NULL-terminate
-            char c = *(newline + 1);
-            *(newline + 1) = '\0';
 
-            // Yay
-            ctx->cb(ptr, error, ctx->userdata);
+        while ((newline = static_cast<char *>(
+                memchr(search, '\n', end - search)))) {
+            group_stream_cb(stream, begin, newline + 1 - begin, cb, userdata);
+            begin = search = newline + 1;
+        }
 
-            // Restore character
-            *(newline + 1) = c;
+        size_t remain = end - begin;
+        if (begin == stream->buf && remain == cap) {
+            // Line is too long to fit in the buffer
+            group_stream_cb(stream, begin, remain, cb, userdata);
+            remain = 0;
+        } else if (begin != stream->buf) {
+            // Move the partial line to the beginning of the buffer
+            memmove(stream->buf, begin, remain);
+        }
+        stream->used = remain;
+    }
+}
 
-            // Advance pointer for next search
-            ptr = newline + 1;
+/*!
+ * \brief Read the output of several commands line by line
+ *
+ * All of the stdout and stderr pipes are watched from a single epoll loop, so
+ * the lines are passed to \a cb in the order the commands print them (for
+ * lines on the same stream). The lines are passed directly from the read
+ * buffers without being copied. The `stdout_bytes` and `stderr_bytes` fields of
+ * each command are updated as data is read.
+ *
+ * Commands that were not started with `redirect_stdio` enabled are ignored.
+ *
+ * \param ctxs Array of started commands
+ * \param count Number of items in \a ctxs
+ * \param cb Line callback
+ * \param userdata User-provided pointer to pass to \a cb
+ *
+ * \return True if all streams were read until EOF. False if any read fails or
+ *         the epoll instance could not be set up.
+ */
+bool command_group_line_reader(struct CommandCtx * const *ctxs, size_t count,
+                               CmdGroupLineCb cb, void *userdata)
+{
+    bool ret = true;
+    std::vector<std::unique_ptr<CommandGroupStream>> streams;
+    size_t open_streams = 0;
+    struct epoll_event events[16];
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        LOGE("Failed to create epoll instance: %s", strerror(errno));
+        return false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        struct CommandCtx *ctx = ctxs[i];
+        if (!ctx->_priv || !ctx->redirect_stdio) {
+            continue;
         }
 
-        // ptr now points to the character after the last newline
-        size_t consumed = ptr - buf;
-        if (consumed == 0 && *used == cap) {
-            // If nothing was consumed and the buffer is full, then the line is
-            // too long.
-            ctx->cb(buf, error, ctx->userdata);
-            consumed = *used;
+        for (int fd : { ctx->_priv->stdout_pipe[0],
+                        ctx->_priv->stderr_pipe[0] }) {
+            if (fd < 0) {
+                continue;
+            }
+
+            std::unique_ptr<CommandGroupStream> stream(new CommandGroupStream());
+            stream->ctx = ctx;
+            stream->fd = fd;
+            stream->is_stderr = fd == ctx->_priv->stderr_pipe[0];
+            stream->used = 0;
+
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = stream.get();
+
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+                LOGE("Failed to add fd to epoll instance: %s",
+                     strerror(errno));
+                close(epfd);
+                return false;
+            }
+
+            streams.push_back(std::move(stream));
+            ++open_streams;
         }
+    }
 
-        // Move unconsumed data to the beginning of the buffer
-        if (consumed > 0) {
-            *used -= consumed;
-            memmove(buf, ptr, *used);
+    while (open_streams > 0) {
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+                           -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to wait for epoll events: %s", strerror(errno));
+            ret = false;
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            auto *stream = static_cast<CommandGroupStream *>(
+                    events[i].data.ptr);
+
+            // EPOLLHUP is reported once the write end is closed, but there
+            // may still be unread data in the pipe
+            int result = group_stream_read(stream, cb, userdata);
+            if (result < 0) {
+                ret = false;
+            }
+            if (result <= 0) {
+                // The fd will be closed by command_wait()
+                epoll_ctl(epfd, EPOLL_CTL_DEL, stream->fd, nullptr);
+                --open_streams;
+            }
         }
     }
+
+    close(epfd);
+
+    return ret;
+}
+
+static void command_line_reader_cb(struct CommandCtx *ctx, const char *line,
+                                   size_t size, bool error, void *userdata)
+{
+    (void) ctx;
+    (void) size;
+
+    auto *reader_ctx = static_cast<std::pair<CmdLineCb, void *> *>(userdata);
+    reader_ctx->first(line, error, reader_ctx->second);
 }
 
 bool command_line_reader(struct CommandCtx *ctx, CmdLineCb cb, void *userdata)
 {
-    CommandLineReaderCtx reader_ctx;
-    reader_ctx.cb = cb;
-    reader_ctx.userdata = userdata;
+    std::pair<CmdLineCb, void *> reader_ctx(cb, userdata);
 
-    return command_raw_reader(ctx, &command_line_reader_cb, &reader_ctx);
+    return command_group_line_reader(&ctx, 1, &command_line_reader_cb,
+                                     &reader_ctx);
 }
 
 int run_command(const char *path,
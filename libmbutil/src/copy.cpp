@@ -19,19 +19,32 @@
 
 #include "mbutil/copy.h"
 
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <algorithm>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
-#include <fts.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/dirwalker.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
 
@@ -43,13 +56,245 @@ namespace mb
 namespace util
 {
 
-bool copy_data_fd(int fd_source, int fd_target)
+// Maximum number of bytes to copy per copy_file_range()/sendfile() call
+#define KERNEL_COPY_CHUNK_SIZE  (1024 * 1024 * 1024)
+// Buffer size for the read()/write() fallback
+#define COPY_BUFFER_SIZE        (1024 * 1024)
+
+// Not defined in older kernel headers
+#ifndef FICLONE
+#  define FICLONE               _IOW(0x94, 9, int)
+#endif
+
+enum class KernelCopyResult
+{
+    Done,
+    Unsupported,
+    Failed,
+};
+
+/*!
+ * \brief Whether the error means the copy method does not apply to these fds
+ */
+static bool is_copy_unsupported_error(int error)
+{
+    return error == ENOSYS || error == EINVAL || error == EXDEV
+            || error == EOPNOTSUPP || error == EBADF;
+}
+
+/*!
+ * \brief Share the source's extents with the target (btrfs, xfs, f2fs, ...)
+ *
+ * This only applies when the entire source file is copied to an empty target
+ * file.
+ */
+static KernelCopyResult copy_data_fd_reflink(int fd_source, int fd_target)
+{
+    struct stat sb_source;
+    struct stat sb_target;
+
+    if (fstat(fd_source, &sb_source) < 0 || fstat(fd_target, &sb_target) < 0
+            || !S_ISREG(sb_source.st_mode) || !S_ISREG(sb_target.st_mode)
+            || sb_target.st_size != 0
+            || lseek(fd_source, 0, SEEK_CUR) != 0
+            || lseek(fd_target, 0, SEEK_CUR) != 0) {
+        return KernelCopyResult::Unsupported;
+    }
+
+    if (ioctl(fd_target, FICLONE, fd_source) < 0) {
+        return is_copy_unsupported_error(errno) || errno == ENOTTY
+                ? KernelCopyResult::Unsupported : KernelCopyResult::Failed;
+    }
+
+    // Leave the offsets where a normal copy would have left them
+    if (lseek(fd_source, 0, SEEK_END) < 0
+            || lseek(fd_target, 0, SEEK_END) < 0) {
+        return KernelCopyResult::Failed;
+    }
+
+    return KernelCopyResult::Done;
+}
+
+/*!
+ * \brief Copy \p size bytes between explicit offsets
+ *
+ * The file offsets of the fds are not used or changed.
+ */
+static bool copy_range(int fd_source, int fd_target, off64_t offset_source,
+                       off64_t offset_target, uint64_t size)
 {
-    char buf[10240];
+#ifdef __NR_copy_file_range
+    while (size > 0) {
+        loff_t in = offset_source;
+        loff_t out = offset_target;
+        ssize_t n = syscall(__NR_copy_file_range, fd_source, &in, fd_target,
+                            &out, std::min<uint64_t>(size,
+                                                     KERNEL_COPY_CHUNK_SIZE),
+                            0);
+        if (n < 0) {
+            if (is_copy_unsupported_error(errno)) {
+                break;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        offset_source += n;
+        offset_target += n;
+        size -= n;
+    }
+#endif
+
+    std::vector<char> buf(std::min<uint64_t>(size, COPY_BUFFER_SIZE));
+
+    while (size > 0) {
+        ssize_t n = pread64(fd_source, buf.data(),
+                            std::min<uint64_t>(size, buf.size()),
+                            offset_source);
+        if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = pwrite64(fd_target, buf.data() + written, n - written,
+                                 offset_target + written);
+            if (w < 0) {
+                return false;
+            }
+            written += w;
+        }
+
+        offset_source += n;
+        offset_target += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy only the data regions of a sparse file, leaving holes as holes
+ */
+static KernelCopyResult copy_data_fd_sparse(int fd_source, int fd_target)
+{
+    struct stat sb_source;
+    struct stat sb_target;
+
+    if (fstat(fd_source, &sb_source) < 0 || fstat(fd_target, &sb_target) < 0
+            || !S_ISREG(sb_source.st_mode) || !S_ISREG(sb_target.st_mode)
+            // Not sparse
+            || static_cast<uint64_t>(sb_source.st_blocks) * 512
+                    >= static_cast<uint64_t>(sb_source.st_size)) {
+        return KernelCopyResult::Unsupported;
+    }
+
+    off64_t start_source = lseek64(fd_source, 0, SEEK_CUR);
+    off64_t start_target = lseek64(fd_target, 0, SEEK_CUR);
+    if (start_source < 0 || start_target < 0
+            || start_source > sb_source.st_size) {
+        return KernelCopyResult::Unsupported;
+    }
+
+    off64_t pos = start_source;
+
+    while (pos < sb_source.st_size) {
+        off64_t data = lseek64(fd_source, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                // Only a hole remains
+                break;
+            } else if (pos == start_source
+                    && is_copy_unsupported_error(errno)) {
+                // SEEK_DATA is not supported. Nothing was written yet.
+                lseek64(fd_source, start_source, SEEK_SET);
+                return KernelCopyResult::Unsupported;
+            }
+            return KernelCopyResult::Failed;
+        }
+
+        off64_t hole = lseek64(fd_source, data, SEEK_HOLE);
+        if (hole < 0) {
+            return KernelCopyResult::Failed;
+        }
+
+        if (!copy_range(fd_source, fd_target, data,
+                        start_target + (data - start_source), hole - data)) {
+            return KernelCopyResult::Failed;
+        }
+
+        pos = hole;
+    }
+
+    // Extend the target over any trailing hole
+    off64_t end_target = start_target + (sb_source.st_size - start_source);
+    if (ftruncate64(fd_target, end_target) < 0
+            || lseek64(fd_source, sb_source.st_size, SEEK_SET) < 0
+            || lseek64(fd_target, end_target, SEEK_SET) < 0) {
+        return KernelCopyResult::Failed;
+    }
+
+    return KernelCopyResult::Done;
+}
+
+static KernelCopyResult copy_data_fd_copy_file_range(int fd_source,
+                                                     int fd_target)
+{
+#ifdef __NR_copy_file_range
+    ssize_t n;
+    bool copied = false;
+
+    while ((n = syscall(__NR_copy_file_range, fd_source, nullptr, fd_target,
+                        nullptr, KERNEL_COPY_CHUNK_SIZE, 0)) > 0) {
+        copied = true;
+    }
+
+    if (n == 0) {
+        // Some kernels return 0 instead of an error for files they cannot
+        // copy (eg. procfs and sysfs files or cross-filesystem copies), which
+        // is indistinguishable from EOF. Nothing has been copied yet, so let
+        // the caller retry with a method that does not have this problem.
+        return copied ? KernelCopyResult::Done : KernelCopyResult::Unsupported;
+    } else if (is_copy_unsupported_error(errno)) {
+        return KernelCopyResult::Unsupported;
+    } else {
+        return KernelCopyResult::Failed;
+    }
+#else
+    (void) fd_source;
+    (void) fd_target;
+    return KernelCopyResult::Unsupported;
+#endif
+}
+
+static KernelCopyResult copy_data_fd_sendfile(int fd_source, int fd_target)
+{
+    ssize_t n;
+
+    do {
+        n = sendfile(fd_target, fd_source, nullptr, KERNEL_COPY_CHUNK_SIZE);
+    } while (n > 0);
+
+    if (n == 0) {
+        return KernelCopyResult::Done;
+    } else if (is_copy_unsupported_error(errno)) {
+        return KernelCopyResult::Unsupported;
+    } else {
+        return KernelCopyResult::Failed;
+    }
+}
+
+static bool copy_data_fd_read_write(int fd_source, int fd_target)
+{
+    std::vector<char> buf(COPY_BUFFER_SIZE);
     ssize_t nread;
 
-    while ((nread = read(fd_source, buf, sizeof buf)) > 0) {
-        char *out_ptr = buf;
+    while ((nread = read(fd_source, buf.data(), buf.size())) > 0) {
+        char *out_ptr = buf.data();
         ssize_t nwritten;
 
         do {
@@ -65,7 +310,124 @@ bool copy_data_fd(int fd_source, int fd_target)
     return nread == 0;
 }
 
-static bool copy_data(const std::string &source, const std::string &target)
+/*!
+ * \brief Name of a copy method for log messages
+ */
+const char * copy_method_name(CopyMethod method)
+{
+    switch (method) {
+    case CopyMethod::Reflink:
+        return "reflink";
+    case CopyMethod::Sparse:
+        return "sparse copy";
+    case CopyMethod::CopyFileRange:
+        return "copy_file_range";
+    case CopyMethod::Sendfile:
+        return "sendfile";
+    case CopyMethod::ReadWrite:
+        return "read/write";
+    case CopyMethod::HardLink:
+        return "hard link";
+    }
+    return "unknown";
+}
+
+bool copy_data_fd(int fd_source, int fd_target)
+{
+    return copy_data_fd(fd_source, fd_target, nullptr);
+}
+
+/*!
+ * \brief Copy all remaining data from one fd to another
+ *
+ * The first method that applies to the given file descriptors is used:
+ *
+ * 1. Reflink (`FICLONE`) if the whole file is copied to an empty file
+ * 2. Copying only the data regions (`SEEK_DATA`/`SEEK_HOLE`) if the source is
+ *    a sparse regular file, so the target stays sparse
+ * 3. `copy_file_range()`
+ * 4. `sendfile()`
+ * 5. `read()`/`write()` through a userspace buffer (eg. when the source is a
+ *    pipe)
+ *
+ * Data is copied from the current file offset of \p fd_source to the current
+ * file offset of \p fd_target and both offsets are advanced accordingly.
+ *
+ * \param[in] fd_source Source file descriptor
+ * \param[in] fd_target Target file descriptor
+ * \param[out] method If not NULL, the method that was used
+ *
+ * \return Whether all data was copied. `errno` is set on failure.
+ */
+bool copy_data_fd(int fd_source, int fd_target, CopyMethod *method)
+{
+    static const struct {
+        CopyMethod method;
+        KernelCopyResult (*func)(int, int);
+    } kernel_methods[] = {
+        { CopyMethod::Reflink,       &copy_data_fd_reflink },
+        { CopyMethod::Sparse,        &copy_data_fd_sparse },
+        { CopyMethod::CopyFileRange, &copy_data_fd_copy_file_range },
+        { CopyMethod::Sendfile,      &copy_data_fd_sendfile },
+    };
+
+    for (auto const &item : kernel_methods) {
+        switch (item.func(fd_source, fd_target)) {
+        case KernelCopyResult::Done:
+            if (method) {
+                *method = item.method;
+            }
+            return true;
+        case KernelCopyResult::Failed:
+            return false;
+        case KernelCopyResult::Unsupported:
+            break;
+        }
+    }
+
+    if (method) {
+        *method = CopyMethod::ReadWrite;
+    }
+    return copy_data_fd_read_write(fd_source, fd_target);
+}
+
+/*!
+ * \brief Create a directory with exactly the given permissions
+ *
+ * The umask is process-wide and the copy functions may run concurrently with
+ * other threads, so it is not changed. Instead, the mode is set explicitly
+ * after the directory is created. An existing directory is left alone.
+ */
+static int mkdir_exact(const char *path, mode_t mode)
+{
+    if (mkdir(path, mode) < 0) {
+        return -1;
+    }
+    return chmod(path, mode);
+}
+
+/*!
+ * \brief Create a special file with exactly the given permissions
+ *
+ * \sa mkdir_exact()
+ */
+static int mknod_exact(const char *path, mode_t mode, dev_t dev)
+{
+    if (mknod(path, mode, dev) < 0) {
+        return -1;
+    }
+    return chmod(path, mode & ~S_IFMT);
+}
+
+/*!
+ * \brief Copy a regular file's data to a new file
+ *
+ * If \p link_fallback is true and the data cannot be reflinked, \p target is
+ * created as a hard link to \p source instead. A normal copy is only done if
+ * that fails too (eg. because the files are on different filesystems).
+ */
+static bool copy_data(const std::string &source, const std::string &target,
+                      CopyMethod *method = nullptr, bool link_fallback = false)
 {
     int fd_source = -1;
     int fd_target = -1;
@@ -85,10 +447,52 @@ static bool copy_data(const std::string &source, const std::string &target)
     }
 
     auto close_target_fd = finally([&] {
-        close(fd_target);
+        if (fd_target >= 0) {
+            close(fd_target);
+        }
     });
 
-    if (!copy_data_fd(fd_source, fd_target)) {
+    // Don't depend on the umask (see mkdir_exact())
+    if (fchmod(fd_target, 0666) < 0) {
+        return false;
+    }
+
+    if (link_fallback) {
+        switch (copy_data_fd_reflink(fd_source, fd_target)) {
+        case KernelCopyResult::Done:
+            if (method) {
+                *method = CopyMethod::Reflink;
+            }
+            return true;
+        case KernelCopyResult::Failed:
+            return false;
+        case KernelCopyResult::Unsupported:
+            break;
+        }
+
+        close(fd_target);
+        fd_target = -1;
+
+        if (unlink(target.c_str()) < 0) {
+            return false;
+        }
+
+        if (link(source.c_str(), target.c_str()) == 0) {
+            if (method) {
+                *method = CopyMethod::HardLink;
+            }
+            return true;
+        } else if (errno != EXDEV && errno != EMLINK && errno != EPERM) {
+            return false;
+        }
+
+        fd_target = open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd_target < 0 || fchmod(fd_target, 0666) < 0) {
+            return false;
+        }
+    }
+
+    if (!copy_data_fd(fd_source, fd_target, method)) {
         return false;
     }
 
@@ -221,12 +625,6 @@ bool copy_contents(const std::string &source, const std::string &target)
 
 bool copy_file(const std::string &source, const std::string &target, int flags)
 {
-    mode_t old_umask = umask(0);
-
-    auto restore_umask = finally([&] {
-        umask(old_umask);
-    });
-
     if (unlink(target.c_str()) < 0 && errno != ENOENT) {
         LOGE("%s: Failed to remove old file: %s",
              target.c_str(), strerror(errno));
@@ -243,7 +641,7 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 
     switch (sb.st_mode & S_IFMT) {
     case S_IFBLK:
-        if (mknod(target.c_str(), S_IFBLK | S_IRWXU, sb.st_rdev) < 0) {
+        if (mknod_exact(target.c_str(), S_IFBLK | S_IRWXU, sb.st_rdev) < 0) {
             LOGW("%s: Failed to create block device: %s",
                  target.c_str(), strerror(errno));
             return false;
@@ -251,7 +649,7 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
         break;
 
     case S_IFCHR:
-        if (mknod(target.c_str(), S_IFCHR | S_IRWXU, sb.st_rdev) < 0) {
+        if (mknod_exact(target.c_str(), S_IFCHR | S_IRWXU, sb.st_rdev) < 0) {
             LOGW("%s: Failed to create character device: %s",
                  target.c_str(), strerror(errno));
             return false;
@@ -259,7 +657,7 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
         break;
 
     case S_IFIFO:
-        if (mkfifo(target.c_str(), S_IRWXU) < 0) {
+        if (mknod_exact(target.c_str(), S_IFIFO | S_IRWXU, 0) < 0) {
             LOGW("%s: Failed to create FIFO pipe: %s",
                  target.c_str(), strerror(errno));
             return false;
@@ -286,13 +684,16 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 
         // Treat as file
 
-    case S_IFREG:
-        if (!copy_data(source, target)) {
+    case S_IFREG: {
+        CopyMethod method;
+        if (!copy_data(source, target, &method)) {
             LOGE("%s: Failed to copy data: %s",
                  target.c_str(), strerror(errno));
             return false;
         }
+        LOGD("%s: Copied using %s", target.c_str(), copy_method_name(method));
         break;
+    }
 
     case S_IFSOCK:
         LOGE("%s: Cannot copy socket", target.c_str());
@@ -322,10 +723,219 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 }
 
 
-class RecursiveCopier : public FTSWrapper {
+/*!
+ * \brief Bounded pool of threads for copying files
+ *
+ * Jobs are run in no particular order. submit() blocks while too many jobs are
+ * queued so that the directory walk does not get arbitrarily far ahead.
+ */
+class CopyPool
+{
+public:
+    // A job returns an empty string on success or an error message on failure
+    typedef std::string (*Job)(const std::string &source,
+                               const std::string &target, int flags);
+
+    explicit CopyPool(unsigned int threads)
+        : _max_queued(threads * 64), _stop(false)
+    {
+        for (unsigned int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&CopyPool::worker, this);
+        }
+    }
+
+    ~CopyPool()
+    {
+        wait();
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    CopyPool(const CopyPool &) = delete;
+    CopyPool & operator=(const CopyPool &) = delete;
+
+    void submit(Job job, std::string source, std::string target, int flags)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _queue.size() < _max_queued; });
+        _queue.push_back({ job, std::move(source), std::move(target), flags });
+        ++_outstanding;
+        _cv.notify_all();
+    }
+
+    // Wait for all jobs to complete and return their errors
+    std::vector<std::string> wait()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _outstanding == 0; });
+
+        std::vector<std::string> errors;
+        errors.swap(_errors);
+        return errors;
+    }
+
+private:
+    struct Item
+    {
+        Job job;
+        std::string source;
+        std::string target;
+        int flags;
+    };
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _cv.wait(lock, [&]{ return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+
+            Item item = std::move(_queue.front());
+            _queue.pop_front();
+            _cv.notify_all();
+
+            lock.unlock();
+            std::string error = item.job(item.source, item.target, item.flags);
+            lock.lock();
+
+            if (!error.empty()) {
+                _errors.push_back(std::move(error));
+            }
+            --_outstanding;
+            _cv.notify_all();
+        }
+    }
+
+    size_t _max_queued;
+    size_t _outstanding = 0;
+    bool _stop;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Item> _queue;
+    std::vector<std::string> _errors;
+    std::vector<std::thread> _threads;
+};
+
+static std::string copy_job_attrs(const std::string &source,
+                                  const std::string &target, int flags)
+{
+    std::string error;
+
+    if ((flags & COPY_ATTRIBUTES) && !copy_stat(source, target)) {
+        mb::format(error, "%s: Failed to copy attributes: %s",
+                   target.c_str(), strerror(errno));
+    } else if ((flags & COPY_XATTRS) && !copy_xattrs(source, target)) {
+        mb::format(error, "%s: Failed to copy xattrs: %s",
+                   target.c_str(), strerror(errno));
+    }
+
+    if (!error.empty()) {
+        LOGW("%s", error.c_str());
+    }
+    return error;
+}
+
+static std::string copy_job_file(const std::string &source,
+                                 const std::string &target, int flags)
+{
+    std::string error;
+    CopyMethod method;
+
+    if (unlink(target.c_str()) < 0 && errno != ENOENT) {
+        mb::format(error, "%s: Failed to remove old path: %s",
+                   target.c_str(), strerror(errno));
+    } else if (!copy_data(source, target, &method,
+                          flags & COPY_LINK_UNCLONEABLE)) {
+        mb::format(error, "%s: Failed to copy data: %s",
+                   target.c_str(), strerror(errno));
+    } else if (method == CopyMethod::HardLink) {
+        // Same inode, so the attributes already match
+        return error;
+    } else {
+        return copy_job_attrs(source, target, flags);
+    }
+
+    LOGW("%s", error.c_str());
+    return error;
+}
+
+static std::string copy_job_symlink(const std::string &source,
+                                    const std::string &target, int flags)
+{
+    std::string error;
+    std::string symlink_path;
+
+    if (unlink(target.c_str()) < 0 && errno != ENOENT) {
+        mb::format(error, "%s: Failed to remove old path: %s",
+                   target.c_str(), strerror(errno));
+    } else if (!read_link(source, &symlink_path)) {
+        mb::format(error, "%s: Failed to read symlink path: %s",
+                   source.c_str(), strerror(errno));
+    } else if (symlink(symlink_path.c_str(), target.c_str()) < 0) {
+        mb::format(error, "%s: Failed to create symlink: %s",
+                   target.c_str(), strerror(errno));
+    } else {
+        return copy_job_attrs(source, target, flags);
+    }
+
+    LOGW("%s", error.c_str());
+    return error;
+}
+
+
+class RecursiveCopier : public DirWalker {
 public:
     RecursiveCopier(std::string path, std::string target, int copyflags)
-        : FTSWrapper(path, 0), _copyflags(copyflags), _target(target) {
+        : DirWalker(path, 0), _copyflags(copyflags), _target(target) {
+        if (_copyflags & COPY_PARALLEL) {
+            unsigned int threads = std::thread::hardware_concurrency();
+            _pool.reset(new CopyPool(threads > 0 ? threads : 2));
+        }
+    }
+
+    virtual bool on_post_execute(bool success) override
+    {
+        if (!_pool) {
+            return success;
+        }
+
+        // Everything below depends on the files having been created
+        for (auto const &error : _pool->wait()) {
+            if (_error_msg.empty()) {
+                _error_msg = error;
+            }
+            success = false;
+        }
+
+        for (auto const &link : _hard_links) {
+            if (!create_hard_link(link.first, link.second)) {
+                success = false;
+            }
+        }
+
+        // Directory attributes are set last (children first) since a
+        // read-only mode would prevent files from being created inside
+        for (auto const &dir : _deferred_dirs) {
+            auto error = copy_job_attrs(dir.first, dir.second, _copyflags);
+            if (!error.empty()) {
+                _error_msg = std::move(error);
+                success = false;
+            }
+        }
+
+        return success;
     }
 
     virtual bool on_pre_execute() override
@@ -338,7 +948,7 @@ public:
         }
 
         // Create the target directory if it doesn't exist
-        if (mkdir(_target.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
+        if (mkdir_exact(_target.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
                 && errno != EEXIST) {
             mb::format(_error_msg, "%s: Failed to create directory: %s",
                        _target.c_str(), strerror(errno));
@@ -367,28 +977,37 @@ public:
 
     virtual int on_changed_path() override
     {
-        // Make sure we aren't copying the target on top of itself
-        if (sb_target.st_dev == _curr->fts_statp->st_dev
-                && sb_target.st_ino == _curr->fts_statp->st_ino) {
-            mb::format(_error_msg, "%s: Cannot copy on top of itself",
-                       _curr->fts_path);
-            LOGE("%s", _error_msg.c_str());
-            return Action::FTS_Fail | Action::FTS_Stop;
+        // Make sure we aren't copying the target on top of itself. Only a
+        // directory can be the target, so other entries don't need a stat.
+        if (_curr->type == S_IFDIR) {
+            const struct stat *sb = curr_stat();
+            if (!sb) {
+                LOGE("%s", _error_msg.c_str());
+                return Action::Fail | Action::Stop;
+            }
+
+            if (sb_target.st_dev == sb->st_dev
+                    && sb_target.st_ino == sb->st_ino) {
+                mb::format(_error_msg, "%s: Cannot copy on top of itself",
+                           _curr->path.c_str());
+                LOGE("%s", _error_msg.c_str());
+                return Action::Fail | Action::Stop;
+            }
         }
 
-        // According to fts_read()'s manpage, fts_path includes the path given
-        // to fts_open() as a prefix, so 'curr->fts_path + strlen(source)' will
-        // give us a relative path we can append to the target.
+        // The entry path includes the source path as a prefix, so
+        // 'path + strlen(source)' will give us a relative path we can append
+        // to the target.
         _curtgtpath.clear();
 
-        char *relpath = _curr->fts_path + _path.size();
+        const char *relpath = _curr->path.c_str() + _path.size();
 
         _curtgtpath += _target;
         if (!(_copyflags & COPY_EXCLUDE_TOP_LEVEL)) {
             if (_curtgtpath.back() != '/') {
                 _curtgtpath += "/";
             }
-            _curtgtpath += _root->fts_name;
+            _curtgtpath += _path;
         }
         if (_curtgtpath.back() != '/'
                 && *relpath != '/' && *relpath != '\0') {
@@ -396,7 +1015,7 @@ public:
         }
         _curtgtpath += relpath;
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_directory_pre() override
@@ -408,7 +1027,7 @@ public:
         struct stat sb;
 
         // Create target directory if it doesn't exist
-        if (mkdir(_curtgtpath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
+        if (mkdir_exact(_curtgtpath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
                 && errno != EEXIST) {
             mb::format(_error_msg, "%s: Failed to create directory: %s",
                        _curtgtpath.c_str(), strerror(errno));
@@ -439,61 +1058,106 @@ public:
             }
         }
 
-        return (skip ? Action::FTS_Skip : 0)
-                | (success ? Action::FTS_OK : Action::FTS_Fail);
+        return (skip ? Action::Skip : 0)
+                | (success ? Action::Ok : Action::Fail);
     }
 
     virtual int on_reached_directory_post() override
     {
+        if (_pool) {
+            _deferred_dirs.emplace_back(_curr->path, _curtgtpath);
+            return Action::Ok;
+        }
+
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_file() override
     {
+        const struct stat *sb = curr_stat();
+        if (!sb) {
+            LOGW("%s", _error_msg.c_str());
+            return Action::Fail;
+        }
+
+        // Recreate hard links instead of copying the data again
+        if (sb->st_nlink > 1) {
+            auto key = std::make_pair(sb->st_dev, sb->st_ino);
+            auto it = _inodes.find(key);
+            if (it != _inodes.end()) {
+                if (_pool) {
+                    // The first link may not have been copied yet
+                    _hard_links.emplace_back(it->second, _curtgtpath);
+                    return Action::Ok;
+                }
+                return create_hard_link(it->second, _curtgtpath)
+                        ? Action::Ok : Action::Fail;
+            }
+            _inodes.emplace(key, _curtgtpath);
+        }
+
+        if (_pool) {
+            _pool->submit(&copy_job_file, _curr->path, _curtgtpath,
+                          _copyflags);
+            return Action::Ok;
+        }
+
         if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         // Copy file contents
-        if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
+        CopyMethod method;
+        if (!copy_data(_curr->path, _curtgtpath, &method,
+                       _copyflags & COPY_LINK_UNCLONEABLE)) {
             mb::format(_error_msg, "%s: Failed to copy data: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
+        }
+
+        if (method == CopyMethod::HardLink) {
+            return Action::Ok;
         }
 
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_symlink() override
     {
+        if (_pool) {
+            _pool->submit(&copy_job_symlink, _curr->path, _curtgtpath,
+                          _copyflags);
+            return Action::Ok;
+        }
+
         if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         // Find current symlink target
         std::string symlink_path;
-        if (!read_link(_curr->fts_accpath, &symlink_path)) {
+        if (!read_link(_curr->path, &symlink_path)) {
             mb::format(_error_msg, "%s: Failed to read symlink path: %s",
-                       _curr->fts_accpath, strerror(errno));
+                       _curr->path.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         // Create new symlink
@@ -501,98 +1165,108 @@ public:
             mb::format(_error_msg, "%s: Failed to create symlink: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_block_device() override
     {
         if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
+        }
+
+        const struct stat *sb = curr_stat();
+        if (!sb) {
+            LOGW("%s", _error_msg.c_str());
+            return Action::Fail;
         }
 
-        if (mknod(_curtgtpath.c_str(), S_IFBLK | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
+        if (mknod_exact(_curtgtpath.c_str(), S_IFBLK | S_IRWXU, sb->st_rdev) < 0) {
             mb::format(_error_msg, "%s: Failed to create block device: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_character_device() override
     {
         if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        if (mknod(_curtgtpath.c_str(), S_IFCHR | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
+        const struct stat *sb = curr_stat();
+        if (!sb) {
+            LOGW("%s", _error_msg.c_str());
+            return Action::Fail;
+        }
+
+        if (mknod_exact(_curtgtpath.c_str(), S_IFCHR | S_IRWXU, sb->st_rdev) < 0) {
             mb::format(_error_msg, "%s: Failed to create character device: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_fifo() override
     {
         if (!remove_existing_file()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        if (mkfifo(_curtgtpath.c_str(), S_IRWXU) < 0) {
+        if (mknod_exact(_curtgtpath.c_str(), S_IFIFO | S_IRWXU, 0) < 0) {
             mb::format(_error_msg, "%s: Failed to create FIFO pipe: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_attrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
         if (!cp_xattrs()) {
-            return Action::FTS_Fail;
+            return Action::Fail;
         }
 
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_socket() override
     {
-        LOGD("%s: Skipping socket", _curr->fts_accpath);
-        return Action::FTS_Skip;
+        LOGD("%s: Skipping socket", _curr->path.c_str());
+        return Action::Skip;
     }
 
 private:
@@ -601,6 +1275,35 @@ private:
     struct stat sb_target;
     std::string _curtgtpath;
 
+    // (device, inode) -> target path of the first copy of a hard link
+    std::map<std::pair<dev_t, ino_t>, std::string> _inodes;
+
+    // Only used for parallel copies
+    std::unique_ptr<CopyPool> _pool;
+    // (existing target, new target) links to create once the pool is done
+    std::vector<std::pair<std::string, std::string>> _hard_links;
+    // (source, target) directories in post-order
+    std::vector<std::pair<std::string, std::string>> _deferred_dirs;
+
+    bool create_hard_link(const std::string &existing, const std::string &path)
+    {
+        if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+            mb::format(_error_msg, "%s: Failed to remove old path: %s",
+                       path.c_str(), strerror(errno));
+            LOGW("%s", _error_msg.c_str());
+            return false;
+        }
+
+        if (link(existing.c_str(), path.c_str()) < 0) {
+            mb::format(_error_msg, "%s: Failed to create hard link to %s: %s",
+                       path.c_str(), existing.c_str(), strerror(errno));
+            LOGW("%s", _error_msg.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
     bool remove_existing_file()
     {
         // Remove existing file
@@ -616,7 +1319,7 @@ private:
     bool cp_attrs()
     {
         if ((_copyflags & COPY_ATTRIBUTES)
-                && !copy_stat(_curr->fts_accpath, _curtgtpath)) {
+                && !copy_stat(_curr->path, _curtgtpath)) {
             mb::format(_error_msg, "%s: Failed to copy attributes: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
@@ -628,7 +1331,7 @@ private:
     bool cp_xattrs()
     {
         if ((_copyflags & COPY_XATTRS)
-                && !copy_xattrs(_curr->fts_accpath, _curtgtpath)) {
+                && !copy_xattrs(_curr->path, _curtgtpath)) {
             mb::format(_error_msg, "%s: Failed to copy xattrs: %s",
                        _curtgtpath.c_str(), strerror(errno));
             LOGW("%s", _error_msg.c_str());
@@ -640,16 +1343,14 @@ private:
 
 
 // Copy as much as possible
+//
+// With COPY_PARALLEL, directories are still created in traversal order by the
+// calling thread, but regular files and symlinks are copied by a thread pool.
+// Hard links and directory attributes are applied after the pool is done.
 bool copy_dir(const std::string &source, const std::string &target, int flags)
 {
-    mode_t old_umask = umask(0);
-
     RecursiveCopier copier(source, target, flags);
-    bool ret = copier.run();
-
-    umask(old_umask);
-
-    return ret;
+    return copier.run();
 }
 
 }
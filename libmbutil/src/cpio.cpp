@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/cpio.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include "mblog/logging.h"
+#include "mbutil/archive.h"
+#include "mbutil/autoclose/file.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Get index key for a path
+ *
+ * Leading `/` and `./` components and trailing slashes are ignored, so
+ * `./sbin/` and `sbin` refer to the same entry.
+ */
+static std::string entry_key(const std::string &path)
+{
+    size_t begin = 0;
+    size_t end = path.size();
+
+    while (true) {
+        if (begin < end && path[begin] == '/') {
+            ++begin;
+        } else if (end - begin >= 2 && path[begin] == '.'
+                && path[begin + 1] == '/') {
+            begin += 2;
+        } else {
+            break;
+        }
+    }
+
+    while (end > begin && path[end - 1] == '/') {
+        --end;
+    }
+
+    if (end - begin == 1 && path[begin] == '.') {
+        return std::string();
+    }
+
+    return path.substr(begin, end - begin);
+}
+
+static la_ssize_t memory_write_cb(archive *a, void *userdata,
+                                  const void *buf, size_t size)
+{
+    (void) a;
+
+    std::string *out = static_cast<std::string *>(userdata);
+    out->append(static_cast<const char *>(buf), size);
+    return static_cast<la_ssize_t>(size);
+}
+
+CpioArchive::CpioArchive()
+    : _format(ARCHIVE_FORMAT_CPIO_SVR4_NOCRC)
+    , _next_ino(1)
+{
+}
+
+CpioArchive::~CpioArchive() = default;
+
+/*!
+ * \brief Load all entries from a cpio archive file
+ *
+ * The archive may be compressed with gzip, lz4, lzma, or xz. Any previously
+ * loaded entries are discarded.
+ *
+ * \param path Path to archive
+ *
+ * \return Whether the archive was successfully loaded
+ */
+bool CpioArchive::load_file(const std::string &path)
+{
+    autoclose::archive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        LOGE("Failed to allocate archive reader instance");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_cpio(a.get());
+
+    if (archive_read_open_filename(a.get(), path.c_str(), 10240)
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open for reading: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return load(a.get(), path.c_str());
+}
+
+/*!
+ * \brief Load all entries from a cpio archive in memory
+ *
+ * \param data Archive data. It does not need to outlive this function call.
+ * \param size Size of \a data
+ *
+ * \return Whether the archive was successfully loaded
+ */
+bool CpioArchive::load_memory(const void *data, size_t size)
+{
+    autoclose::archive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        LOGE("Failed to allocate archive reader instance");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_cpio(a.get());
+
+    if (archive_read_open_memory(a.get(), data, size) != ARCHIVE_OK) {
+        LOGE("<memory>: Failed to open for reading: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    return load(a.get(), "<memory>");
+}
+
+bool CpioArchive::load(archive *a, const char *name)
+{
+    archive_entry *entry;
+    int ret;
+
+    _entries.clear();
+    _index.clear();
+    _filters.clear();
+    _next_ino = 1;
+
+    while (true) {
+        ret = archive_read_next_header(a, &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret == ARCHIVE_RETRY) {
+            continue;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("%s: Failed to read header: %s",
+                 name, archive_error_string(a));
+            return false;
+        }
+
+        const char *path = archive_entry_pathname(entry);
+        if (!path || !*path) {
+            LOGE("%s: Header has null or empty filename", name);
+            return false;
+        }
+
+        autoclose::archive_entry header(archive_entry_clone(entry),
+                                        archive_entry_free);
+        if (!header) {
+            LOGE("%s: Failed to copy header for %s", name, path);
+            return false;
+        }
+
+        std::string data;
+        char buf[10240];
+        la_ssize_t n;
+
+        while ((n = archive_read_data(a, buf, sizeof(buf))) > 0) {
+            data.append(buf, static_cast<size_t>(n));
+        }
+
+        if (n < 0) {
+            LOGE("%s: Failed to read data for %s: %s",
+                 name, path, archive_error_string(a));
+            return false;
+        }
+
+        if (archive_entry_ino64(entry) >= _next_ino) {
+            _next_ino = archive_entry_ino64(entry) + 1;
+        }
+
+        _index[entry_key(path)] = _entries.size();
+        _entries.push_back(Entry{std::move(header), std::move(data)});
+    }
+
+    // Save format
+    _format = archive_format(a);
+    for (int i = 0; i < archive_filter_count(a); ++i) {
+        int code = archive_filter_code(a, i);
+        if (code != ARCHIVE_FILTER_NONE) {
+            _filters.push_back(code);
+        }
+    }
+
+    if (archive_read_close(a) != ARCHIVE_OK) {
+        LOGE("%s: %s", name, archive_error_string(a));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write all entries to a cpio archive file
+ *
+ * The archive is written with the format and compression filters it was loaded
+ * with. An empty archive that was never loaded is written as an uncompressed
+ * newc archive.
+ *
+ * \param path Path to output archive
+ *
+ * \return Whether the archive was successfully written
+ */
+bool CpioArchive::save_file(const std::string &path) const
+{
+    autoclose::archive a(archive_write_new(), archive_write_free);
+    if (!a) {
+        LOGE("Failed to allocate archive writer instance");
+        return false;
+    }
+
+    if (!set_up_writer(a.get())) {
+        return false;
+    }
+
+    if (archive_write_open_filename(a.get(), path.c_str()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return save(a.get(), path.c_str());
+}
+
+/*!
+ * \brief Write all entries to a cpio archive in memory
+ *
+ * \param out String to store the archive data in. Its previous contents are
+ *            discarded.
+ *
+ * \return Whether the archive was successfully written
+ */
+bool CpioArchive::save_memory(std::string &out) const
+{
+    autoclose::archive a(archive_write_new(), archive_write_free);
+    if (!a) {
+        LOGE("Failed to allocate archive writer instance");
+        return false;
+    }
+
+    if (!set_up_writer(a.get())) {
+        return false;
+    }
+
+    out.clear();
+
+    if (archive_write_open(a.get(), &out, nullptr, &memory_write_cb, nullptr)
+            != ARCHIVE_OK) {
+        LOGE("<memory>: Failed to open for writing: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    return save(a.get(), "<memory>");
+}
+
+bool CpioArchive::set_up_writer(archive *a) const
+{
+    if (archive_write_set_format(a, _format) != ARCHIVE_OK) {
+        LOGE("Failed to set output archive format: %s",
+             archive_error_string(a));
+        return false;
+    }
+
+    if (!libarchive_add_write_filters(a, _filters)) {
+        return false;
+    }
+
+    archive_write_set_bytes_per_block(a, 512);
+
+    return true;
+}
+
+bool CpioArchive::save(archive *a, const char *name) const
+{
+    for (auto const &entry : _entries) {
+        if (archive_write_header(a, entry.header.get()) != ARCHIVE_OK) {
+            LOGE("%s: %s", name, archive_error_string(a));
+            return false;
+        }
+
+        if (!entry.data.empty() && archive_write_data(
+                a, entry.data.data(), entry.data.size())
+                != static_cast<la_ssize_t>(entry.data.size())) {
+            LOGE("%s: Failed to write data for %s: %s", name,
+                 archive_entry_pathname(entry.header.get()),
+                 archive_error_string(a));
+            return false;
+        }
+    }
+
+    if (archive_write_close(a) != ARCHIVE_OK) {
+        LOGE("%s: %s", name, archive_error_string(a));
+        return false;
+    }
+
+    return true;
+}
+
+CpioArchive::Entry * CpioArchive::find(const std::string &path)
+{
+    auto it = _index.find(entry_key(path));
+    return it == _index.end() ? nullptr : &_entries[it->second];
+}
+
+const CpioArchive::Entry * CpioArchive::find(const std::string &path) const
+{
+    auto it = _index.find(entry_key(path));
+    return it == _index.end() ? nullptr : &_entries[it->second];
+}
+
+void CpioArchive::rebuild_index()
+{
+    _index.clear();
+
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        _index[entry_key(archive_entry_pathname(_entries[i].header.get()))] = i;
+    }
+}
+
+/*!
+ * \brief Create directory entries for the missing parents of a path
+ */
+bool CpioArchive::add_parents(const std::string &path)
+{
+    std::string key = entry_key(path);
+    auto pos = key.rfind('/');
+    if (pos == std::string::npos) {
+        return true;
+    }
+
+    std::string parent = key.substr(0, pos);
+    const Entry *entry = find(parent);
+
+    if (entry) {
+        if (archive_entry_filetype(entry->header.get()) != AE_IFDIR) {
+            LOGE("%s: Parent is not a directory", path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    return add_entry(parent, AE_IFDIR, 0755) != nullptr;
+}
+
+/*!
+ * \brief Get or create an empty entry of the specified type
+ *
+ * An existing entry keeps its path, position, ownership, inode, and timestamps,
+ * but everything else is reset.
+ */
+CpioArchive::Entry * CpioArchive::add_entry(const std::string &path,
+                                            mode_t type, mode_t perm)
+{
+    Entry *entry = find(path);
+
+    if (!entry) {
+        if (entry_key(path).empty()) {
+            LOGE("%s: Invalid path", path.c_str());
+            return nullptr;
+        }
+
+        if (!add_parents(path)) {
+            return nullptr;
+        }
+
+        autoclose::archive_entry header(archive_entry_new(),
+                                        archive_entry_free);
+        if (!header) {
+            LOGE("%s: Failed to allocate header", path.c_str());
+            return nullptr;
+        }
+
+        archive_entry_set_pathname(header.get(), path.c_str());
+        archive_entry_set_ino64(header.get(), _next_ino++);
+        archive_entry_set_mtime(header.get(), time(nullptr), 0);
+
+        _index[entry_key(path)] = _entries.size();
+        _entries.push_back(Entry{std::move(header), std::string()});
+        entry = &_entries.back();
+    }
+
+    archive_entry_set_hardlink(entry->header.get(), nullptr);
+    archive_entry_set_symlink(entry->header.get(), nullptr);
+    archive_entry_set_filetype(entry->header.get(), type);
+    archive_entry_set_perm(entry->header.get(), perm);
+    archive_entry_set_nlink(entry->header.get(), type == AE_IFDIR ? 2 : 1);
+    archive_entry_set_size(entry->header.get(), 0);
+    entry->data.clear();
+
+    return entry;
+}
+
+/*!
+ * \brief Check whether an entry exists
+ */
+bool CpioArchive::exists(const std::string &path) const
+{
+    return find(path) != nullptr;
+}
+
+/*!
+ * \brief Check whether an entry exists and is a symlink
+ */
+bool CpioArchive::is_symlink(const std::string &path) const
+{
+    const Entry *entry = find(path);
+    return entry && archive_entry_filetype(entry->header.get()) == AE_IFLNK;
+}
+
+/*!
+ * \brief Get target of a symlink entry
+ *
+ * \return Whether the entry exists and is a symlink
+ */
+bool CpioArchive::symlink_target(const std::string &path,
+                                 std::string &out) const
+{
+    const Entry *entry = find(path);
+    if (!entry || archive_entry_filetype(entry->header.get()) != AE_IFLNK) {
+        return false;
+    }
+
+    const char *target = archive_entry_symlink(entry->header.get());
+    out = target ? target : "";
+    return true;
+}
+
+/*!
+ * \brief Get contents of a regular file entry
+ *
+ * \return Whether the entry exists and is a regular file
+ */
+bool CpioArchive::contents(const std::string &path, std::string &out) const
+{
+    const Entry *entry = find(path);
+    if (!entry || archive_entry_filetype(entry->header.get()) != AE_IFREG) {
+        return false;
+    }
+
+    out = entry->data;
+    return true;
+}
+
+/*!
+ * \brief Add or replace a regular file entry, keeping its permissions
+ *
+ * If the entry does not already exist as a regular file, it is created with
+ * mode 0644.
+ */
+bool CpioArchive::set_contents(const std::string &path, std::string data)
+{
+    const Entry *entry = find(path);
+    mode_t perm = 0644;
+
+    if (entry && archive_entry_filetype(entry->header.get()) == AE_IFREG) {
+        perm = archive_entry_perm(entry->header.get());
+    }
+
+    return set_contents(path, std::move(data), perm);
+}
+
+/*!
+ * \brief Add or replace a regular file entry
+ *
+ * Missing parent directories are created with mode 0755.
+ *
+ * \param path Path of entry
+ * \param data New file contents
+ * \param perm Permissions of entry
+ *
+ * \return Whether the entry was successfully added
+ */
+bool CpioArchive::set_contents(const std::string &path, std::string data,
+                               mode_t perm)
+{
+    Entry *entry = add_entry(path, AE_IFREG, perm);
+    if (!entry) {
+        return false;
+    }
+
+    entry->data = std::move(data);
+    archive_entry_set_size(entry->header.get(),
+                           static_cast<la_int64_t>(entry->data.size()));
+
+    return true;
+}
+
+/*!
+ * \brief Add or replace a regular file entry with the contents of a file
+ *
+ * \param path Path of entry
+ * \param source File to read the contents from
+ * \param perm Permissions of entry
+ *
+ * \return Whether the file was read and the entry was successfully added
+ */
+bool CpioArchive::add_file(const std::string &path, const std::string &source,
+                           mode_t perm)
+{
+    autoclose::file fp(autoclose::fopen(source.c_str(), "rb"));
+    if (!fp) {
+        LOGE("%s: Failed to open for reading: %s",
+             source.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string data;
+    char buf[10240];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
+        data.append(buf, n);
+    }
+
+    if (ferror(fp.get())) {
+        LOGE("%s: Failed to read file: %s", source.c_str(), strerror(errno));
+        return false;
+    }
+
+    return set_contents(path, std::move(data), perm);
+}
+
+/*!
+ * \brief Add or replace a symlink entry
+ *
+ * \param path Path of entry
+ * \param target Symlink target
+ *
+ * \return Whether the entry was successfully added
+ */
+bool CpioArchive::add_symlink(const std::string &path,
+                              const std::string &target)
+{
+    Entry *entry = add_entry(path, AE_IFLNK, 0777);
+    if (!entry) {
+        return false;
+    }
+
+    archive_entry_set_symlink(entry->header.get(), target.c_str());
+
+    return true;
+}
+
+/*!
+ * \brief Remove an entry
+ *
+ * If the entry is a directory, its children are not removed.
+ *
+ * \return Whether the entry existed
+ */
+bool CpioArchive::remove(const std::string &path)
+{
+    auto it = _index.find(entry_key(path));
+    if (it == _index.end()) {
+        return false;
+    }
+
+    _entries.erase(_entries.begin() + static_cast<ptrdiff_t>(it->second));
+    rebuild_index();
+
+    return true;
+}
+
+/*!
+ * \brief Rename an entry
+ *
+ * This behaves like rename(2) in that an existing entry at \a to is replaced.
+ * If \a from is a directory, its children are not renamed.
+ *
+ * \return Whether the entry was successfully renamed
+ */
+bool CpioArchive::rename(const std::string &from, const std::string &to)
+{
+    if (!exists(from)) {
+        LOGE("%s: Entry does not exist", from.c_str());
+        return false;
+    } else if (entry_key(to).empty()) {
+        LOGE("%s: Invalid path", to.c_str());
+        return false;
+    } else if (entry_key(from) == entry_key(to)) {
+        return true;
+    }
+
+    remove(to);
+
+    if (!add_parents(to)) {
+        return false;
+    }
+
+    archive_entry_set_pathname(find(from)->header.get(), to.c_str());
+    rebuild_index();
+
+    return true;
+}
+
+}
+}
@@ -19,14 +19,24 @@
 
 #include "mbutil/delete.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
+#include "mbutil/dirwalker.h"
 #include "mbutil/string.h"
 
 namespace mb
@@ -34,10 +44,10 @@ namespace mb
 namespace util
 {
 
-class RecursiveDeleter : public FTSWrapper {
+class RecursiveDeleter : public DirWalker {
 public:
     RecursiveDeleter(std::string path)
-        : FTSWrapper(path, FTS_GroupSpecialFiles)
+        : DirWalker(path, GroupSpecialFiles)
     {
     }
 
@@ -45,35 +55,36 @@ public:
     {
         // Do nothing. Need depth-first search, so directories are deleted in
         // on_reached_directory_post()
-        return Action::FTS_OK;
+        return Action::Ok;
     }
 
     virtual int on_reached_directory_post() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::Ok : Action::Fail;
     }
 
     virtual int on_reached_file() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::Ok : Action::Fail;
     }
 
     virtual int on_reached_symlink() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::Ok : Action::Fail;
     }
 
     virtual int on_reached_special_file() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::Ok : Action::Fail;
     }
 
 private:
     bool delete_path()
     {
-        if (remove(_curr->fts_accpath) < 0) {
+        int flags = _curr->type == S_IFDIR ? AT_REMOVEDIR : 0;
+        if (unlinkat(_curr->dirfd, _curr->name, flags) < 0) {
             mb::format(_error_msg, "%s: Failed to remove: %s",
-                       _curr->fts_path, strerror(errno));
+                       _curr->path.c_str(), strerror(errno));
             LOGE("%s", _error_msg.c_str());
             return false;
         }
@@ -81,7 +92,191 @@ private:
     }
 };
 
+/*!
+ * \brief Deletes sibling subtrees concurrently
+ *
+ * Each directory is a job that unlinks the directory's non-directory entries
+ * and queues its subdirectories as new jobs. A directory is removed by
+ * whichever thread finishes its last subdirectory. Like RecursiveDeleter,
+ * mountpoints are not traversed.
+ */
+class ParallelDeleter
+{
+public:
+    ParallelDeleter(std::string path, dev_t dev)
+        : _dev(dev)
+    {
+        _queue.push_back(new Node{ nullptr, std::move(path), { 1 }, { false } });
+    }
+
+    ParallelDeleter(const ParallelDeleter &) = delete;
+    ParallelDeleter & operator=(const ParallelDeleter &) = delete;
+
+    bool run()
+    {
+        unsigned int threads = std::thread::hardware_concurrency();
+        if (threads == 0) {
+            threads = 2;
+        }
+
+        std::vector<std::thread> pool;
+        for (unsigned int i = 0; i < threads; ++i) {
+            pool.emplace_back(&ParallelDeleter::worker, this);
+        }
+        for (auto &t : pool) {
+            t.join();
+        }
+
+        return !_failed;
+    }
+
+private:
+    struct Node
+    {
+        Node *parent;
+        std::string path;
+        // Scan of this directory plus its subdirectories that still exist
+        std::atomic<size_t> pending;
+        // Set if anything below this directory could not be deleted
+        std::atomic<bool> failed;
+    };
+
+    dev_t _dev;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Node *> _queue;
+    // Number of directories currently being scanned
+    size_t _active = 0;
+    std::atomic<bool> _failed{false};
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _cv.wait(lock, [&]{ return !_queue.empty() || _active == 0; });
+            if (_queue.empty()) {
+                // Nothing queued and nothing running that could queue more
+                break;
+            }
+
+            Node *node = _queue.front();
+            _queue.pop_front();
+            ++_active;
+
+            lock.unlock();
+            std::vector<Node *> children = scan(node);
+            lock.lock();
+
+            --_active;
+            _queue.insert(_queue.end(), children.begin(), children.end());
+            _cv.notify_all();
+        }
+    }
+
+    void fail(Node *node, const std::string &path, int error)
+    {
+        LOGE("%s: Failed to remove: %s", path.c_str(), strerror(error));
+        node->failed = true;
+        _failed = true;
+    }
+
+    // Called once a directory has been scanned and for each subdirectory that
+    // was removed
+    void release(Node *node)
+    {
+        while (node && --node->pending == 0) {
+            Node *parent = node->parent;
+
+            if (node->failed) {
+                if (parent) {
+                    parent->failed = true;
+                }
+            } else if (rmdir(node->path.c_str()) < 0) {
+                fail(node, node->path, errno);
+                if (parent) {
+                    parent->failed = true;
+                }
+            }
+
+            delete node;
+            node = parent;
+        }
+    }
+
+    std::vector<Node *> scan(Node *node)
+    {
+        std::vector<Node *> children;
+
+        int fd = open(node->path.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat sb;
+        DIR *dp = nullptr;
+
+        if (fd < 0 || fstat(fd, &sb) < 0 || !(dp = fdopendir(fd))) {
+            fail(node, node->path, errno);
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else if (sb.st_dev != _dev) {
+            // Don't cross mountpoint boundaries. rmdir() will report EBUSY.
+            closedir(dp);
+        } else {
+            struct dirent *ent;
+            while ((ent = readdir(dp))) {
+                if (strcmp(ent->d_name, ".") == 0
+                        || strcmp(ent->d_name, "..") == 0) {
+                    continue;
+                }
+
+                bool is_dir = ent->d_type == DT_DIR;
+                if (ent->d_type == DT_UNKNOWN) {
+                    struct stat sb_child;
+                    is_dir = fstatat(fd, ent->d_name, &sb_child,
+                                     AT_SYMLINK_NOFOLLOW) == 0
+                            && S_ISDIR(sb_child.st_mode);
+                }
+
+                std::string path(node->path);
+                path += '/';
+                path += ent->d_name;
+
+                if (is_dir) {
+                    ++node->pending;
+                    children.push_back(new Node{
+                            node, std::move(path), { 1 }, { false } });
+                } else if (unlinkat(fd, ent->d_name, 0) < 0
+                        && errno != ENOENT) {
+                    fail(node, path, errno);
+                }
+            }
+
+            closedir(dp);
+        }
+
+        release(node);
+        return children;
+    }
+};
+
 bool delete_recursive(const std::string &path)
+{
+    return delete_recursive(path, 0);
+}
+
+/*!
+ * \brief Recursively delete a path
+ *
+ * Mountpoints are not traversed (so deleting a tree containing one will fail).
+ * It is not an error if \p path does not exist.
+ *
+ * \param path Path to delete
+ * \param flags If DELETE_PARALLEL is set, directories are processed by
+ *              multiple threads. This only helps for large trees.
+ *
+ * \return Whether the path was fully deleted
+ */
+bool delete_recursive(const std::string &path, int flags)
 {
     struct stat sb;
     if (stat(path.c_str(), &sb) < 0 && errno == ENOENT) {
@@ -89,6 +284,12 @@ bool delete_recursive(const std::string &path)
         return true;
     }
 
+    if ((flags & DELETE_PARALLEL) && lstat(path.c_str(), &sb) == 0
+            && S_ISDIR(sb.st_mode)) {
+        ParallelDeleter deleter(path, sb.st_dev);
+        return deleter.run();
+    }
+
     RecursiveDeleter deleter(path);
     return deleter.run();
 }
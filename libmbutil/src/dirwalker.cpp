@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/dirwalker.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+
+// Size of the buffer passed to getdents64()
+#define DENTS_BUFFER_SIZE       (32 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+// Not exposed by older libcs. The NULL-terminated name immediately follows
+// d_type, so it is accessed through dirent_name() instead of a flexible array
+// member, which is not valid C++.
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+};
+
+static const char * dirent_name(const linux_dirent64 *dent)
+{
+    return reinterpret_cast<const char *>(dent)
+            + offsetof(linux_dirent64, d_type) + sizeof(dent->d_type);
+}
+
+static mode_t dtype_to_mode(unsigned char d_type)
+{
+    switch (d_type) {
+    case DT_DIR:  return S_IFDIR;
+    case DT_REG:  return S_IFREG;
+    case DT_LNK:  return S_IFLNK;
+    case DT_BLK:  return S_IFBLK;
+    case DT_CHR:  return S_IFCHR;
+    case DT_FIFO: return S_IFIFO;
+    case DT_SOCK: return S_IFSOCK;
+    default:      return 0;
+    }
+}
+
+DirWalker::DirWalker(std::string path, int flags)
+    : _path(std::move(path)), _flags(flags)
+{
+}
+
+DirWalker::~DirWalker() = default;
+
+bool DirWalker::run()
+{
+    if (_ran) {
+        _error_msg = "Already ran";
+        return false;
+    }
+    _ran = true;
+
+    // Pre-execute hook
+    if (!on_pre_execute()) {
+        return false;
+    }
+
+    _dents_buf.resize(DENTS_BUFFER_SIZE);
+
+    // We only support traversal of one tree
+    _entry.path = _path;
+    visit(AT_FDCWD, 0, 0, DT_UNKNOWN);
+
+    _curr = nullptr;
+    std::vector<char>().swap(_dents_buf);
+
+    if (!on_post_execute(_ret)) {
+        return false;
+    }
+
+    return _ret;
+}
+
+std::string DirWalker::error()
+{
+    return _error_msg;
+}
+
+/*!
+ * \brief Get the stat buffer for the current entry
+ *
+ * The entry is only stat'ed on the first call. If symlinks are followed, the
+ * result describes the symlink target, unless the symlink is broken.
+ *
+ * \return Pointer to the stat buffer or nullptr (with the error message set)
+ *         if the entry could not be stat'ed
+ */
+const struct stat * DirWalker::curr_stat()
+{
+    if (!_curr) {
+        return nullptr;
+    }
+
+    if (!_have_sb) {
+        int flags = AT_SYMLINK_NOFOLLOW;
+        if ((_flags & FollowSymlinks) && _entry.type != S_IFLNK) {
+            flags = 0;
+        }
+
+        if (fstatat(_entry.dirfd, _entry.name, &_sb, flags) < 0) {
+            mb::format(_error_msg, "%s: Failed to stat: %s",
+                       _entry.path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        _have_sb = true;
+    }
+
+    return &_sb;
+}
+
+bool DirWalker::on_pre_execute()
+{
+    return true;
+}
+
+bool DirWalker::on_post_execute(bool success)
+{
+    (void) success;
+    return true;
+}
+
+int DirWalker::on_changed_path()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_directory_pre()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_directory_post()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_file()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_symlink()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_special_file()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_block_device()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_character_device()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_fifo()
+{
+    return Action::Ok;
+}
+
+int DirWalker::on_reached_socket()
+{
+    return Action::Ok;
+}
+
+void DirWalker::set_entry(int dirfd, size_t name_offset, int level,
+                          mode_t type, const struct stat *sb)
+{
+    _entry.name = _entry.path.c_str() + name_offset;
+    _entry.level = level;
+    _entry.dirfd = dirfd;
+    _entry.type = type;
+    if (sb) {
+        _sb = *sb;
+        _have_sb = true;
+    } else {
+        _have_sb = false;
+    }
+    _curr = &_entry;
+}
+
+/*!
+ * \brief Read all entries of a directory, excluding "." and ".."
+ *
+ * The names are stored NULL-terminated in \p names. Each item in \p children
+ * is the offset of a name and its `d_type`.
+ */
+bool DirWalker::read_dir(int fd, std::string &names,
+                         std::vector<std::pair<size_t, unsigned char>> &children)
+{
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, _dents_buf.data(),
+                         _dents_buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+
+        for (long pos = 0; pos < n;) {
+            auto *dent = reinterpret_cast<const linux_dirent64 *>(
+                    _dents_buf.data() + pos);
+            const char *name = dirent_name(dent);
+            pos += dent->d_reclen;
+
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            children.emplace_back(names.size(), dent->d_type);
+            names += name;
+            names += '\0';
+        }
+    }
+}
+
+/*!
+ * \brief Record failure and stop requests from a hook's return value
+ */
+int DirWalker::handle_result(int result)
+{
+    if (result & Action::Fail) {
+        _ret = false;
+    }
+    if ((result & Action::Stop) && !(result & (Action::Skip | Action::Next))) {
+        _stop = true;
+    }
+    return result;
+}
+
+int DirWalker::dispatch()
+{
+    switch (_entry.type) {
+    case S_IFREG:
+        return on_reached_file();
+    case S_IFLNK:
+        return on_reached_symlink();
+    case S_IFBLK:
+    case S_IFCHR:
+    case S_IFIFO:
+    case S_IFSOCK:
+        if (_flags & GroupSpecialFiles) {
+            return on_reached_special_file();
+        }
+        switch (_entry.type) {
+        case S_IFBLK:  return on_reached_block_device();
+        case S_IFCHR:  return on_reached_character_device();
+        case S_IFIFO:  return on_reached_fifo();
+        case S_IFSOCK: return on_reached_socket();
+        }
+        // fallthrough
+    default:
+        return Action::Skip;
+    }
+}
+
+void DirWalker::visit(int dirfd, size_t name_offset, int level,
+                      unsigned char d_type)
+{
+    mode_t type = dtype_to_mode(d_type);
+    bool follow = _flags & FollowSymlinks;
+
+    set_entry(dirfd, name_offset, level, type, nullptr);
+
+    // The type is unknown for the root, on filesystems that don't report
+    // d_type, and for symlinks that may need to be followed
+    if (type == 0 || (follow && type == S_IFLNK)) {
+        struct stat sb;
+        int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+
+        if (fstatat(dirfd, _entry.name, &sb, flags) < 0
+                && !(follow && errno == ENOENT
+                        && fstatat(dirfd, _entry.name, &sb,
+                                   AT_SYMLINK_NOFOLLOW) == 0)) {
+            mb::format(_error_msg, "%s: Failed to stat: %s",
+                       _entry.path.c_str(), strerror(errno));
+            _ret = false;
+            return;
+        }
+
+        set_entry(dirfd, name_offset, level, sb.st_mode & S_IFMT, &sb);
+    }
+
+    if (_entry.type != S_IFDIR) {
+        _error_msg = "Handler returned failure";
+        int result = handle_result(on_changed_path());
+        if (result & (Action::Next | Action::Skip) || _stop) {
+            return;
+        }
+
+        _error_msg = "Handler returned failure";
+        handle_result(dispatch());
+        return;
+    }
+
+    // Directories need to be stat'ed for the mountpoint and cycle checks
+    bool descend = true;
+    struct stat sb_dir;
+
+    if ((!(_flags & CrossMountPointBoundaries) || follow) && !curr_stat()) {
+        _ret = false;
+        return;
+    }
+    bool have_sb_dir = _have_sb;
+    if (have_sb_dir) {
+        sb_dir = _sb;
+
+        if (level == 0) {
+            _root_dev = sb_dir.st_dev;
+        } else if (!(_flags & CrossMountPointBoundaries)
+                && sb_dir.st_dev != _root_dev) {
+            descend = false;
+        }
+
+        if (follow) {
+            auto id = std::make_pair(sb_dir.st_dev, sb_dir.st_ino);
+            if (std::find(_ancestors.begin(), _ancestors.end(), id)
+                    != _ancestors.end()) {
+                // Directory cycle
+                return;
+            }
+        }
+    }
+
+    // Pre-order visit
+    _error_msg = "Handler returned failure";
+    int result = handle_result(on_changed_path());
+    if (_stop) {
+        return;
+    }
+    if (result & Action::Skip) {
+        descend = false;
+    } else if (!(result & Action::Next)) {
+        _error_msg = "Handler returned failure";
+        result = handle_result(on_reached_directory_pre());
+        if (_stop) {
+            return;
+        }
+        if (result & Action::Skip) {
+            descend = false;
+        }
+    }
+
+    if (descend) {
+        int fd = openat(dirfd, _entry.name,
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC
+                        | (follow ? 0 : O_NOFOLLOW));
+        if (fd < 0) {
+            mb::format(_error_msg, "%s: Failed to open directory: %s",
+                       _entry.path.c_str(), strerror(errno));
+            _ret = false;
+            return;
+        }
+
+        if (follow) {
+            _ancestors.emplace_back(sb_dir.st_dev, sb_dir.st_ino);
+        }
+
+        bool ok = walk_dir(fd, level + 1);
+        close(fd);
+
+        if (follow) {
+            _ancestors.pop_back();
+        }
+
+        if (!ok || _stop) {
+            return;
+        }
+
+        set_entry(dirfd, name_offset, level, S_IFDIR,
+                  have_sb_dir ? &sb_dir : nullptr);
+    }
+
+    // Post-order visit (also done for skipped directories, like fts)
+    _error_msg = "Handler returned failure";
+    result = handle_result(on_changed_path());
+    if (result & (Action::Next | Action::Skip) || _stop) {
+        return;
+    }
+
+    _error_msg = "Handler returned failure";
+    handle_result(on_reached_directory_post());
+}
+
+/*!
+ * \brief Visit all children of a directory
+ *
+ * \return False if the directory could not be read. In that case, the
+ *         post-order visit of the directory is not done.
+ */
+bool DirWalker::walk_dir(int fd, int level)
+{
+    std::string names;
+    std::vector<std::pair<size_t, unsigned char>> children;
+
+    if (!read_dir(fd, names, children)) {
+        mb::format(_error_msg, "%s: Failed to read directory: %s",
+                   _entry.path.c_str(), strerror(errno));
+        _ret = false;
+        return false;
+    }
+
+    // Like fts, don't double up the separator if the path ends in a slash
+    size_t base_size = _entry.path.size();
+    bool need_slash = base_size == 0 || _entry.path.back() != '/';
+
+    for (auto const &child : children) {
+        _entry.path.resize(base_size);
+        if (need_slash) {
+            _entry.path += '/';
+        }
+        size_t name_offset = _entry.path.size();
+        _entry.path += names.c_str() + child.first;
+
+        visit(fd, name_offset, level, child.second);
+        if (_stop) {
+            break;
+        }
+    }
+
+    _entry.path.resize(base_size);
+    return true;
+}
+
+}
+}
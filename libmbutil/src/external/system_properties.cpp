@@ -1494,8 +1494,8 @@ int mb__system_property_update(prop_info* pi, const char* value, unsigned int le
   return 0;
 }
 
-int mb__system_property_add(const char* name, unsigned int namelen, const char* value,
-                            unsigned int valuelen) {
+static int add_property(const char* name, unsigned int namelen, const char* value,
+                        unsigned int valuelen, bool notify) {
   if (valuelen >= PROP_VALUE_MAX) {
     return -1;
   }
@@ -1520,6 +1520,27 @@ int mb__system_property_add(const char* name, unsigned int namelen, const char*
     return -1;
   }
 
+  if (notify) {
+    mb__system_property_notify_deferred();
+  }
+  return 0;
+}
+
+int mb__system_property_add(const char* name, unsigned int namelen, const char* value,
+                            unsigned int valuelen) {
+  return add_property(name, namelen, value, valuelen, true);
+}
+
+int mb__system_property_add_deferred(const char* name, unsigned int namelen,
+                                     const char* value, unsigned int valuelen) {
+  return add_property(name, namelen, value, valuelen, false);
+}
+
+void mb__system_property_notify_deferred() {
+  if (!mb__system_property_area__) {
+    return;
+  }
+
   // There is only a single mutator, but we want to make sure that
   // updates are visible to a reader waiting for the update.
   atomic_store_explicit(
@@ -1527,7 +1548,6 @@ int mb__system_property_add(const char* name, unsigned int namelen, const char*
       atomic_load_explicit(mb__system_property_area__->serial(), memory_order_relaxed) + 1,
       memory_order_release);
   __futex_wake(mb__system_property_area__->serial(), INT32_MAX);
-  return 0;
 }
 
 // Wait for non-locked serial, and retrieve it with acquire semantics.
@@ -1540,6 +1560,15 @@ uint32_t mb__system_property_serial(const prop_info* pi) {
   return serial;
 }
 
+uint32_t mb__system_property_read_serial(const prop_info* pi) {
+#if MB_ENABLE_COMPAT_PROPERTIES
+  if (__predict_false(compat_mode)) {
+    return mb__system_property_serial_compat(pi);
+  }
+#endif
+  return mb__system_property_serial(pi);
+}
+
 uint32_t mb__system_property_wait_any(uint32_t old_serial) {
   uint32_t new_serial;
   mb__system_property_wait(nullptr, old_serial, &new_serial, nullptr);
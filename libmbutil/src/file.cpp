@@ -20,6 +20,8 @@
 #include "mbutil/file.h"
 
 #include <memory>
+#include <utility>
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -228,6 +230,182 @@ bool file_read_all(const std::string &path,
     return true;
 }
 
+/*!
+ * \brief Read a file that cannot be mapped
+ *
+ * The size reported by fstat() is only used as a hint since it is 0 for procfs
+ * files and a full page for sysfs attributes.
+ */
+static bool read_fd_until_eof(int fd, size_t size_hint,
+                              std::vector<unsigned char> &buf)
+{
+    size_t size = 0;
+
+    buf.resize(size_hint > 0 ? size_hint + 1 : 4096);
+
+    while (true) {
+        if (size == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+
+        ssize_t n = read(fd, buf.data() + size, buf.size() - size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        size += static_cast<size_t>(n);
+    }
+
+    buf.resize(size);
+    buf.shrink_to_fit();
+    return true;
+}
+
+FileView::FileView()
+    : _map(nullptr)
+    , _map_size(0)
+{
+}
+
+FileView::~FileView()
+{
+    close();
+}
+
+FileView::FileView(FileView &&other)
+    : _map(other._map)
+    , _map_size(other._map_size)
+    , _buf(std::move(other._buf))
+{
+    other._map = nullptr;
+    other._map_size = 0;
+}
+
+FileView & FileView::operator=(FileView &&rhs)
+{
+    if (this != &rhs) {
+        close();
+
+        _map = rhs._map;
+        _map_size = rhs._map_size;
+        _buf = std::move(rhs._buf);
+
+        rhs._map = nullptr;
+        rhs._map_size = 0;
+    }
+
+    return *this;
+}
+
+/*!
+ * \brief Map or read a file
+ *
+ * Any previously opened file is closed first.
+ *
+ * \param path File to open
+ *
+ * \return true on success, false on failure with errno set appropriately
+ */
+bool FileView::open(const std::string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        int saved_errno = errno;
+        ::close(fd);
+        errno = saved_errno;
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    uint64_t size = 0;
+
+    if (S_ISREG(sb.st_mode)) {
+        size = static_cast<uint64_t>(sb.st_size);
+    } else if (S_ISBLK(sb.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+            return false;
+        }
+    }
+
+    if (size > SIZE_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+
+    if (size > 0) {
+        void *map = mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            _map = map;
+            _map_size = static_cast<size_t>(size);
+            return true;
+        }
+
+        // Most pseudo-filesystems do not support mmap()
+        if (errno != ENODEV && errno != EINVAL && errno != EACCES) {
+            return false;
+        }
+    }
+
+    return read_fd_until_eof(fd, static_cast<size_t>(size), _buf);
+}
+
+/*!
+ * \brief Unmap or free the file's contents
+ */
+void FileView::close()
+{
+    if (_map) {
+        munmap(_map, _map_size);
+        _map = nullptr;
+        _map_size = 0;
+    }
+
+    std::vector<unsigned char>().swap(_buf);
+}
+
+const unsigned char * FileView::data() const
+{
+    return _map ? static_cast<const unsigned char *>(_map) : _buf.data();
+}
+
+size_t FileView::size() const
+{
+    return _map ? _map_size : _buf.size();
+}
+
+/*!
+ * \brief Whether the contents are mapped rather than copied to the heap
+ */
+bool FileView::is_mapped() const
+{
+    return _map != nullptr;
+}
+
+const unsigned char * FileView::begin() const
+{
+    return data();
+}
+
+const unsigned char * FileView::end() const
+{
+    return data() + size();
+}
+
 bool get_blockdev_size(const char *path, uint64_t *size_out)
 {
     int fd = open(path, O_RDONLY);
@@ -20,22 +20,28 @@
 #include "mbutil/fstab.h"
 
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
+#include <cassert>
 #include <cctype>
 #include <cerrno>
 #include <climits>
-#include <cstdio>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "mbcommon/alloc_profiler.h"
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/string.h"
 
-
 namespace mb
 {
 namespace util
@@ -100,164 +106,377 @@ static struct mount_flag fs_mgr_flags[] =
     { nullptr,          0 }
 };
 
-static int options_to_flags(struct mount_flag *flags_map, char *args,
-                            char *new_args, int size)
+// Number of slots in the flag hash tables. Must be a power of 2.
+#define FLAG_TABLE_SIZE         64
+// FNV-1a offset basis modifier that makes the hash perfect (collision-free)
+// for both mount_flags and fs_mgr_flags. If a flag is ever added, a new seed
+// must be found. init_flag_tables() asserts that there are no collisions.
+#define FLAG_HASH_SEED          10965
+
+typedef unsigned char FlagTable[FLAG_TABLE_SIZE];
+
+static FlagTable mount_flags_table;
+static FlagTable fs_mgr_flags_table;
+static std::once_flag flag_tables_once;
+
+static size_t flag_hash(const char *str, size_t len)
 {
-    char *temp;
-    char *save_ptr;
-    int flags = 0;
-    int i;
+    uint32_t hash = 2166136261u ^ FLAG_HASH_SEED;
 
-    if (new_args && size > 0) {
-        new_args[0] = '\0';
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<unsigned char>(str[i]);
+        hash *= 16777619u;
     }
 
-    temp = strtok_r(args, ",", &save_ptr);
-    while (temp) {
-        for (i = 0; flags_map[i].name; ++i) {
-            if (strncmp(temp, flags_map[i].name, strlen(flags_map[i].name)) == 0) {
-                flags |= flags_map[i].flag;
-                break;
-            }
+    // The low bits of FNV-1a are weak, so use the high bits
+    return hash >> (32 - __builtin_ctz(FLAG_TABLE_SIZE));
+}
+
+// Each slot contains the index of the flag in the mount_flag array plus one
+static void build_flag_table(const struct mount_flag *flags_map,
+                             FlagTable &table)
+{
+    memset(table, 0, sizeof(table));
+
+    for (size_t i = 0; flags_map[i].name; ++i) {
+        size_t slot = flag_hash(flags_map[i].name, strlen(flags_map[i].name));
+        assert(table[slot] == 0);
+        table[slot] = static_cast<unsigned char>(i + 1);
+    }
+}
+
+static void init_flag_tables()
+{
+    std::call_once(flag_tables_once, [] {
+        build_flag_table(mount_flags, mount_flags_table);
+        build_flag_table(fs_mgr_flags, fs_mgr_flags_table);
+    });
+}
+
+static const struct mount_flag * find_flag(const struct mount_flag *flags_map,
+                                           const FlagTable &table,
+                                           const char *name, size_t len)
+{
+    unsigned char index = table[flag_hash(name, len)];
+    if (index == 0) {
+        return nullptr;
+    }
+
+    const struct mount_flag *flag = &flags_map[index - 1];
+    if (strncmp(flag->name, name, len) != 0 || flag->name[len] != '\0') {
+        return nullptr;
+    }
+
+    return flag;
+}
+
+/*!
+ * \brief Look up an option in a flag table
+ *
+ * Options with a value (eg. "length=1234") match the "length=" entry. Entries
+ * without "=" also match options with a value (eg. "verify=/dev/block/...").
+ */
+static const struct mount_flag * lookup_option(
+        const struct mount_flag *flags_map, const FlagTable &table,
+        const char *option, size_t len)
+{
+    const char *equals = static_cast<const char *>(memchr(option, '=', len));
+    if (!equals) {
+        return find_flag(flags_map, table, option, len);
+    }
+
+    const struct mount_flag *flag =
+            find_flag(flags_map, table, option, equals - option + 1);
+    if (!flag) {
+        flag = find_flag(flags_map, table, option, equals - option);
+    }
+    return flag;
+}
+
+static unsigned long options_to_flags(const struct mount_flag *flags_map,
+                                      const FlagTable &table, const char *args,
+                                      std::string *new_args)
+{
+    unsigned long flags = 0;
+
+    if (new_args) {
+        new_args->clear();
+    }
+
+    StringSplitter splitter(args, strlen(args), ",", 1);
+    const char *option;
+    size_t len;
+
+    while (splitter.next(option, len)) {
+        if (len == 0) {
+            continue;
         }
 
-        if (!flags_map[i].name) {
-            if (new_args) {
-                strlcat(new_args, temp, size);
-                strlcat(new_args, ",", size);
-            } else {
-                LOGW("Only universal mount options expected, but found %s", temp);
+        const struct mount_flag *flag =
+                lookup_option(flags_map, table, option, len);
+        if (flag) {
+            flags |= flag->flag;
+        } else if (new_args) {
+            if (!new_args->empty()) {
+                *new_args += ',';
             }
+            new_args->append(option, len);
+        } else {
+            LOGW("Only universal mount options expected, but found %.*s",
+                 static_cast<int>(len), option);
         }
+    }
 
-        temp = strtok_r(nullptr, ",", &save_ptr);
+    return flags;
+}
+
+static bool is_fstab_delim(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+/*!
+ * \brief Split the next whitespace-delimited field in place (like strtok_r())
+ *
+ * \return Pointer to the NULL-terminated field or nullptr if there are no more
+ *         fields
+ */
+static char * next_field(char *&ptr)
+{
+    while (is_fstab_delim(*ptr)) {
+        ++ptr;
+    }
+    if (!*ptr) {
+        return nullptr;
     }
 
-    if (new_args && new_args[0]) {
-        new_args[strlen(new_args) - 1] = '\0';
+    char *field = ptr;
+    while (*ptr && !is_fstab_delim(*ptr)) {
+        ++ptr;
+    }
+    if (*ptr) {
+        *ptr++ = '\0';
     }
 
-    return flags;
+    return field;
 }
 
-// Much simplified version of fs_mgr's fstab parsing code
-std::vector<fstab_rec> read_fstab(const std::string &path)
+/*!
+ * \brief Split the next line in place
+ *
+ * \return Pointer to the NULL-terminated line (without the newline) or nullptr
+ *         if the end of the buffer was reached
+ */
+static char * next_line(char *&ptr, char *end)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
-        return std::vector<fstab_rec>();
+    if (ptr >= end) {
+        return nullptr;
     }
 
-    int count, entries;
-    char *line = nullptr;
-    size_t len = 0; // allocated memory size
-    ssize_t bytes_read; // number of bytes read
-    char *temp;
-    char *save_ptr;
-    const char *delim = " \t";
-    std::vector<fstab_rec> fstab;
-    char temp_mount_args[1024];
+    char *line = ptr;
+    char *newline = static_cast<char *>(memchr(ptr, '\n', end - ptr));
+    if (newline) {
+        *newline = '\0';
+        ptr = newline + 1;
+    } else {
+        ptr = end;
+    }
 
-    auto free_line = finally([&] {
-        free(line);
-    });
+    return line;
+}
 
-    entries = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
+static bool is_fstab_entry(const char *line)
+{
+    while (isspace(static_cast<unsigned char>(*line))) {
+        ++line;
+    }
 
-        // Strip leading
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
+    // Skip empty lines and comments
+    return *line != '\0' && *line != '#';
+}
 
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
+/*!
+ * \brief Read the rest of a file into \p data
+ */
+static bool read_all(int fd, const std::string &path, const struct stat &sb,
+                     std::string &data)
+{
+    data.clear();
+    if (sb.st_size > 0) {
+        data.reserve(sb.st_size);
+    }
+
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to read: %s", path.c_str(), strerror(errno));
+            return false;
         }
+        data.append(buf, n);
+    }
 
-        ++entries;
+    return true;
+}
+
+/*!
+ * \brief Open and stat a fstab file
+ *
+ * \return File descriptor or -1 if the file could not be opened or stat'ed
+ */
+static int open_fstab(const std::string &path, struct stat &sb)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
+        return -1;
     }
 
-    if (entries == 0) {
-        LOGE("fstab contains no entries");
-        return std::vector<fstab_rec>();
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
     }
 
-    std::fseek(fp.get(), 0, SEEK_SET);
+    return fd;
+}
 
-    count = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
+struct CachedFstab
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::vector<fstab_rec> fstab;
+};
 
-        // Strip leading
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
+static std::unordered_map<std::string, CachedFstab> fstab_cache;
+static std::mutex fstab_cache_lock;
 
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
-        }
+static bool is_same_file(const CachedFstab &cached, const struct stat &sb)
+{
+    return cached.dev == sb.st_dev
+            && cached.ino == sb.st_ino
+            && cached.size == sb.st_size
+            && cached.mtime.tv_sec == sb.st_mtim.tv_sec
+            && cached.mtime.tv_nsec == sb.st_mtim.tv_nsec;
+}
 
-        // Avoid possible overflow if the file was changed
-        if (count >= entries) {
-            LOGE("Found more fstab entries on second read than first read");
-            break;
+static std::vector<fstab_rec> parse_fstab(char *data, char *end)
+{
+    std::vector<fstab_rec> fstab;
+    char *ptr = data;
+    char *line;
+
+    init_flag_tables();
+
+    while ((line = next_line(ptr, end))) {
+        if (!is_fstab_entry(line)) {
+            continue;
         }
 
         fstab_rec rec;
+        char *fields = line;
+        char *temp;
 
         rec.orig_line = line;
 
-        if ((temp = strtok_r(line, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No source path/device found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return {};
         }
         rec.blk_device = temp;
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No mount point found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return {};
         }
         rec.mount_point = temp;
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No filesystem type found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return {};
         }
         rec.fs_type = temp;
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No mount options found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return {};
         }
         rec.mount_args = temp;
-        rec.flags = options_to_flags(mount_flags, temp, temp_mount_args, 1024);
+        rec.flags = options_to_flags(mount_flags, mount_flags_table, temp,
+                                     &rec.fs_options);
 
-        if (temp_mount_args[0]) {
-            rec.fs_options = temp_mount_args;
-        }
-
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No fs_mgr/vold options found in entry: %s", line);
-            return std::vector<fstab_rec>();
+            return {};
         }
         rec.vold_args = temp;
-        rec.fs_mgr_flags = options_to_flags(fs_mgr_flags, temp, nullptr, 0);
+        rec.fs_mgr_flags = options_to_flags(fs_mgr_flags, fs_mgr_flags_table,
+                                            temp, nullptr);
 
         fstab.push_back(std::move(rec));
+    }
 
-        ++count;
+    if (fstab.empty()) {
+        LOGE("fstab contains no entries");
+    }
+
+    return fstab;
+}
+
+/*!
+ * \brief Much simplified version of fs_mgr's fstab parsing code
+ *
+ * The file is read once and tokenized in place. The result is cached by path
+ * and is reused as long as the file's inode, size, and modification time do
+ * not change.
+ */
+std::vector<fstab_rec> read_fstab(const std::string &path)
+{
+    MB_ALLOC_SCOPE("util.fstab");
+
+    struct stat sb;
+    int fd = open_fstab(path, sb);
+    if (fd < 0) {
+        return {};
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    {
+        std::lock_guard<std::mutex> lock(fstab_cache_lock);
+
+        auto it = fstab_cache.find(path);
+        if (it != fstab_cache.end() && is_same_file(it->second, sb)) {
+            return it->second.fstab;
+        }
+    }
+
+    std::string data;
+    if (!read_all(fd, path, sb, data)) {
+        return {};
+    }
+
+    std::vector<fstab_rec> fstab = parse_fstab(&data[0], &data[0] + data.size());
+
+    std::lock_guard<std::mutex> lock(fstab_cache_lock);
+
+    if (fstab.empty()) {
+        fstab_cache.erase(path);
+    } else {
+        CachedFstab &cached = fstab_cache[path];
+        cached.dev = sb.st_dev;
+        cached.ino = sb.st_ino;
+        cached.size = sb.st_size;
+        cached.mtime = sb.st_mtim;
+        cached.fstab = fstab;
     }
 
     return fstab;
@@ -278,75 +497,69 @@ static bool convert_to_int(const char *str, int *out)
 
 std::vector<twrp_fstab_rec> read_twrp_fstab(const std::string &path)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
+    MB_ALLOC_SCOPE("util.fstab");
+
+    struct stat sb;
+    int fd = open_fstab(path, sb);
+    if (fd < 0) {
         return {};
     }
 
-    char *line = nullptr;
-    size_t len = 0; // allocated memory size
-    ssize_t bytes_read; // number of bytes read
-    char *temp;
-    char *save_ptr;
-    const char *delim = " \t";
-    std::vector<twrp_fstab_rec> fstab;
-
-    auto free_line = finally([&] {
-        free(line);
+    auto close_fd = finally([&] {
+        close(fd);
     });
 
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
+    std::string data;
+    if (!read_all(fd, path, sb, data)) {
+        return {};
+    }
 
-        // Strip leading whitespace
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
+    std::vector<twrp_fstab_rec> fstab;
+    char *ptr = &data[0];
+    char *end = ptr + data.size();
+    char *line;
 
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
+    while ((line = next_line(ptr, end))) {
+        if (!is_fstab_entry(line)) {
             continue;
         }
 
         twrp_fstab_rec rec;
+        char *fields = line;
+        char *temp;
 
         rec.orig_line = line;
 
-        if ((temp = strtok_r(line, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No mount point found in entry: %s", line);
             return {};
         }
         rec.mount_point = temp;
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No filesystem type found in entry: %s", line);
             return {};
         }
         rec.fs_type = temp;
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
+        if ((temp = next_field(fields)) == nullptr) {
             LOGE("No block device found in entry: %s", line);
             return {};
         }
         rec.blk_devices.push_back(temp);
 
-        while ((temp = strtok_r(nullptr, delim, &save_ptr))) {
+        while ((temp = next_field(fields))) {
             if (*temp == '/') {
                 // Additional block device
                 rec.blk_devices.push_back(temp);
-            } else if (strncmp(temp, "length=", 7) == 0) {
+            } else if (starts_with(temp, "length=")) {
                 // Length of partition
                 temp += 7;
                 if (!convert_to_int(temp, &rec.length)) {
                     LOGE("Invalid length: %s", temp);
                     return {};
                 }
-            } else if (strncmp(temp, "flags=", 6) == 0) {
+            } else if (starts_with(temp, "flags=")) {
                 // TWRP flags
                 temp += 6;
                 rec.twrp_flags = util::tokenize(temp, ";");
@@ -19,22 +19,130 @@
 
 #include "mbutil/hash.h"
 
-#include <memory>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 #include <cerrno>
-#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+
+// Buffer size when the file can't be mmap'ed
+#define HASH_BUFFER_SIZE        (1024 * 1024)
 
 namespace mb
 {
 namespace util
 {
 
+/*!
+ * \brief Read-only view of a file's contents
+ *
+ * The file is mmap'ed if possible (including block devices). Otherwise, the
+ * contents are read into memory.
+ */
+class FileContents
+{
+public:
+    FileContents() = default;
+
+    ~FileContents()
+    {
+        if (_map) {
+            munmap(_map, _size);
+        }
+    }
+
+    FileContents(const FileContents &) = delete;
+    FileContents & operator=(const FileContents &) = delete;
+
+    bool open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_fd = finally([&] {
+            close(fd);
+        });
+
+        // Unlike st_size, this works for block devices too
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size > 0 && static_cast<uint64_t>(size) <= SIZE_MAX) {
+            void *map = mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+                             MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, static_cast<size_t>(size), MADV_SEQUENTIAL);
+                _map = map;
+                _size = static_cast<size_t>(size);
+                return true;
+            }
+        } else if (size == 0) {
+            return true;
+        }
+
+        // Not seekable (eg. a pipe) if size < 0
+        if (size > 0 && lseek(fd, 0, SEEK_SET) < 0) {
+            LOGE("%s: Failed to seek: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        while (true) {
+            size_t offset = _buf.size();
+            _buf.resize(offset + HASH_BUFFER_SIZE);
+
+            ssize_t n = read(fd, _buf.data() + offset, HASH_BUFFER_SIZE);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    _buf.resize(offset);
+                    continue;
+                }
+                LOGE("%s: Failed to read file: %s",
+                     path.c_str(), strerror(errno));
+                return false;
+            }
+
+            _buf.resize(offset + static_cast<size_t>(n));
+            if (n == 0) {
+                break;
+            }
+        }
+
+        _size = _buf.size();
+        return true;
+    }
+
+    const unsigned char * data() const
+    {
+        return _map ? static_cast<const unsigned char *>(_map) : _buf.data();
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+private:
+    void *_map = nullptr;
+    size_t _size = 0;
+    std::vector<unsigned char> _buf;
+};
+
 /*!
  * \brief Compute SHA512 hash of a file
  *
+ * The file is mmap'ed if possible. OpenSSL picks the fastest SHA512
+ * implementation for the CPU (eg. the ARMv8.2 SHA512 instructions) at runtime.
+ *
  * \param path Path to file
  * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
  *               computed hash value
@@ -44,39 +152,207 @@ namespace util
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH])
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+    FileContents contents;
+    if (!contents.open(path)) {
         return false;
     }
 
-    unsigned char buf[10240];
-    size_t n;
-
     SHA512_CTX ctx;
     if (!SHA512_Init(&ctx)) {
         LOGE("openssl: SHA512_Init() failed");
         return false;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA512_Update(&ctx, buf, n)) {
+    if (!SHA512_Update(&ctx, contents.data(), contents.size())) {
+        LOGE("openssl: SHA512_Update() failed");
+        return false;
+    }
+
+    if (!SHA512_Final(digest, &ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 tree hash of a buffer
+ *
+ * The data is split into leaves of `SHA512_TREE_LEAF_SIZE` bytes (the last
+ * one may be shorter) and the leaves are hashed in parallel. The result is
+ *
+ *     SHA512(SHA512(leaf 0) || ... || SHA512(leaf n - 1) || le64(size))
+ *
+ * This is not compatible with sha512_hash().
+ *
+ * \param data Data to hash
+ * \param size Size of data
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure
+ */
+bool sha512_tree_hash(const void *data, size_t size,
+                      unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    size_t leaves = (size + SHA512_TREE_LEAF_SIZE - 1) / SHA512_TREE_LEAF_SIZE;
+    std::vector<unsigned char> leaf_digests(leaves * SHA512_DIGEST_LENGTH);
+
+    auto hash_leaves = [&](size_t first, size_t step) {
+        for (size_t i = first; i < leaves; i += step) {
+            size_t offset = i * SHA512_TREE_LEAF_SIZE;
+            SHA512(bytes + offset,
+                   std::min<size_t>(SHA512_TREE_LEAF_SIZE, size - offset),
+                   leaf_digests.data() + i * SHA512_DIGEST_LENGTH);
+        }
+    };
+
+    size_t threads = std::thread::hardware_concurrency();
+    threads = std::max<size_t>(1, std::min(threads, leaves));
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(hash_leaves, i, threads);
+    }
+    hash_leaves(0, threads);
+    for (auto &t : pool) {
+        t.join();
+    }
+
+    unsigned char size_le[8];
+    for (int i = 0; i < 8; ++i) {
+        size_le[i] = static_cast<unsigned char>(
+                static_cast<uint64_t>(size) >> (i * 8));
+    }
+
+    SHA512_CTX ctx;
+    if (!SHA512_Init(&ctx)
+            || !SHA512_Update(&ctx, leaf_digests.data(), leaf_digests.size())
+            || !SHA512_Update(&ctx, size_le, sizeof(size_le))
+            || !SHA512_Final(digest, &ctx)) {
+        LOGE("openssl: Failed to compute SHA512 tree hash");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 tree hash of a file
+ *
+ * \see sha512_tree_hash(const void *, size_t, unsigned char *)
+ *
+ * \param path Path to file
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_tree_hash(const std::string &path,
+                      unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    FileContents contents;
+    if (!contents.open(path)) {
+        return false;
+    }
+
+    return sha512_tree_hash(contents.data(), contents.size(), digest);
+}
+
+/*!
+ * \brief Initialize the state for computing a SHA512 tree hash incrementally
+ *
+ * The data can be passed to sha512_tree_update() in pieces of any size. The
+ * result is the same as sha512_tree_hash(), but the leaves are hashed on the
+ * calling thread.
+ *
+ * \return true on success, false on failure
+ */
+bool sha512_tree_init(Sha512TreeCtx *ctx)
+{
+    ctx->leaf_used = 0;
+    ctx->size = 0;
+
+    if (!SHA512_Init(&ctx->root) || !SHA512_Init(&ctx->leaf)) {
+        LOGE("openssl: SHA512_Init() failed");
+        return false;
+    }
+
+    return true;
+}
+
+static bool sha512_tree_finish_leaf(Sha512TreeCtx *ctx)
+{
+    unsigned char leaf_digest[SHA512_DIGEST_LENGTH];
+
+    if (!SHA512_Final(leaf_digest, &ctx->leaf)
+            || !SHA512_Update(&ctx->root, leaf_digest, sizeof(leaf_digest))
+            || !SHA512_Init(&ctx->leaf)) {
+        LOGE("openssl: Failed to compute SHA512 tree hash leaf");
+        return false;
+    }
+
+    ctx->leaf_used = 0;
+    return true;
+}
+
+/*!
+ * \brief Add data to a SHA512 tree hash
+ *
+ * \return true on success, false on failure
+ */
+bool sha512_tree_update(Sha512TreeCtx *ctx, const void *data, size_t size)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        size_t n = std::min(size, SHA512_TREE_LEAF_SIZE - ctx->leaf_used);
+
+        if (!SHA512_Update(&ctx->leaf, bytes, n)) {
             LOGE("openssl: SHA512_Update() failed");
             return false;
         }
-        if (n < sizeof(buf)) {
-            break;
+
+        ctx->leaf_used += n;
+        ctx->size += n;
+        bytes += n;
+        size -= n;
+
+        if (ctx->leaf_used == SHA512_TREE_LEAF_SIZE
+                && !sha512_tree_finish_leaf(ctx)) {
+            return false;
         }
     }
 
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
-        errno = EIO;
+    return true;
+}
+
+/*!
+ * \brief Finish computing a SHA512 tree hash
+ *
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ * \param ctx State initialized with sha512_tree_init()
+ *
+ * \return true on success, false on failure
+ */
+bool sha512_tree_final(unsigned char digest[SHA512_DIGEST_LENGTH],
+                       Sha512TreeCtx *ctx)
+{
+    if (ctx->leaf_used > 0 && !sha512_tree_finish_leaf(ctx)) {
         return false;
     }
 
-    if (!SHA512_Final(digest, &ctx)) {
-        LOGE("openssl: SHA512_Final() failed");
+    unsigned char size_le[8];
+    for (int i = 0; i < 8; ++i) {
+        size_le[i] = static_cast<unsigned char>(ctx->size >> (i * 8));
+    }
+
+    if (!SHA512_Update(&ctx->root, size_le, sizeof(size_le))
+            || !SHA512_Final(digest, &ctx->root)) {
+        LOGE("openssl: Failed to compute SHA512 tree hash");
         return false;
     }
 
@@ -25,12 +25,15 @@
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include <linux/loop.h>
 
+#include "mblog/logging.h"
+
 #include "mbcommon/string.h"
 #include "mbutil/finally.h"
 #include "mbutil/string.h"
@@ -44,6 +47,31 @@
 
 #define MAX_LOOPDEVS    1024
 
+// Number of times to retry if another process grabs the loop device first
+#define MAX_ATTACH_ATTEMPTS 16
+
+// Not defined in older kernel headers
+#ifndef LOOP_SET_DIRECT_IO
+#  define LOOP_SET_DIRECT_IO    0x4C08
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#  define LOOP_SET_BLOCK_SIZE   0x4C09
+#endif
+#ifndef LOOP_CONFIGURE
+#  define LOOP_CONFIGURE        0x4C0A
+
+struct loop_config
+{
+    __u32 fd;
+    __u32 block_size;
+    struct loop_info64 info;
+    __u64 __reserved[8];
+};
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#  define LO_FLAGS_DIRECT_IO    16
+#endif
+
 
 namespace mb
 {
@@ -162,14 +190,106 @@ std::string loopdev_find_unused(void)
     return mb::format(LOOP_FMT, n);
 }
 
+/*!
+ * \brief Make sure that loop devices 1 through \p count exist
+ *
+ * This creates the loop devices (with LOOP_CTL_ADD) and their device nodes
+ * ahead of time so that setting up loop devices later does not have to wait
+ * for them to be created.
+ *
+ * \return True if all of the loop devices exist. Otherwise, false with errno
+ *         set.
+ */
+bool loopdev_pool_init(int count)
+{
+    int fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+
+    auto close_fd = finally([&] {
+        if (fd >= 0) {
+            close(fd);
+        }
+    });
+
+    for (int n = 1; n <= count && n < MAX_LOOPDEVS; ++n) {
+        if (fd >= 0 && ioctl(fd, LOOP_CTL_ADD, n) < 0 && errno != EEXIST) {
+            return false;
+        }
+
+        char loopdev[64];
+        sprintf(loopdev, LOOP_FMT, n);
+
+        if (mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) < 0
+                && errno != EEXIST) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Associate a backing file fd with a loop device fd
+ *
+ * This uses the atomic LOOP_CONFIGURE ioctl if the kernel supports it (Linux
+ * 5.8+). Otherwise, a loop device has to be set up with multiple ioctls and is
+ * briefly visible without its offset and options applied.
+ */
+static bool configure_loopdev(int lfd, int ffd, const std::string &file,
+                              uint64_t offset, int flags, uint32_t block_size)
+{
+    struct loop_config config;
+
+    memset(&config, 0, sizeof(config));
+    config.fd = ffd;
+    config.block_size = block_size;
+    strlcpy(reinterpret_cast<char *>(config.info.lo_file_name), file.c_str(),
+            LO_NAME_SIZE);
+    config.info.lo_offset = offset;
+    if (flags & LOOPDEV_READ_ONLY) {
+        config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+    }
+    if (flags & LOOPDEV_DIRECT_IO) {
+        config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+    }
+
+    if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0) {
+        return true;
+    } else if (errno != EINVAL && errno != ENOTTY) {
+        // Old kernels return EINVAL for unknown ioctls
+        return false;
+    }
+
+    if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
+        return false;
+    }
+
+    // LOOP_SET_STATUS64 ignores LO_FLAGS_DIRECT_IO
+    config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+
+    if (ioctl(lfd, LOOP_SET_STATUS64, &config.info) < 0
+            || (block_size != 0
+                    && ioctl(lfd, LOOP_SET_BLOCK_SIZE, block_size) < 0)) {
+        int saved_errno = errno;
+        ioctl(lfd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
+        return false;
+    }
+
+    // Direct I/O is only an optimization
+    if ((flags & LOOPDEV_DIRECT_IO) && ioctl(lfd, LOOP_SET_DIRECT_IO, 1) < 0) {
+        LOGW("%s: Failed to enable direct I/O: %s",
+             file.c_str(), strerror(errno));
+    }
+
+    return true;
+}
+
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
                            uint64_t offset, bool ro)
 {
     int ffd = -1;
     int lfd = -1;
 
-    struct loop_info64 loopinfo;
-
     if ((ffd = open(file.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
         return false;
     }
@@ -186,20 +306,71 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(lfd);
     });
 
-    memset(&loopinfo, 0, sizeof(struct loop_info64));
-    strlcpy((char *) loopinfo.lo_file_name, file.c_str(), LO_NAME_SIZE);
-    loopinfo.lo_offset = offset;
+    return configure_loopdev(lfd, ffd, file, offset,
+                             ro ? LOOPDEV_READ_ONLY : 0, 0);
+}
 
-    if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
+/*!
+ * \brief Find an unused loop device and attach a file to it
+ *
+ * Unlike calling loopdev_find_unused() and loopdev_set_up_device(), this
+ * handles other processes grabbing the same loop device in between by trying
+ * again with another loop device.
+ *
+ * \param[in] file Backing file
+ * \param[in] offset Offset of the data in the backing file
+ * \param[in] flags \ref LoopdevFlags
+ * \param[in] block_size Logical block size of the loop device (0 for the
+ *                       default)
+ * \param[out] loopdev_out Path of the loop device
+ *
+ * \return True if the file was attached. Otherwise, false with errno set.
+ */
+bool loopdev_attach(const std::string &file, uint64_t offset, int flags,
+                    uint32_t block_size, std::string &loopdev_out)
+{
+    bool ro = flags & LOOPDEV_READ_ONLY;
+
+    int ffd = open(file.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (ffd < 0) {
         return false;
     }
 
-    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
-        ioctl(lfd, LOOP_CLR_FD, 0);
-        return false;
+    auto close_ffd = finally([&] {
+        int saved_errno = errno;
+        close(ffd);
+        errno = saved_errno;
+    });
+
+    for (int attempt = 0; attempt < MAX_ATTACH_ATTEMPTS; ++attempt) {
+        std::string loopdev = loopdev_find_unused();
+        if (loopdev.empty()) {
+            return false;
+        }
+
+        int lfd = open(loopdev.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+        if (lfd < 0) {
+            return false;
+        }
+
+        bool ret = configure_loopdev(lfd, ffd, file, offset, flags,
+                                     block_size);
+        int saved_errno = errno;
+        close(lfd);
+
+        if (ret) {
+            loopdev_out = std::move(loopdev);
+            return true;
+        } else if (saved_errno != EBUSY) {
+            errno = saved_errno;
+            return false;
+        }
+
+        // Someone else took the loop device
+        errno = saved_errno;
     }
 
-    return true;
+    return false;
 }
 
 bool loopdev_remove_device(const std::string &loopdev)
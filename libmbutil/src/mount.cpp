@@ -225,21 +225,17 @@ bool mount(const char *source, const char *target, const char *fstype,
     }
 
     if (need_loopdev) {
-        std::string loopdev = util::loopdev_find_unused();
-        if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
-        }
+        std::string loopdev;
 
-        LOGD("Assigning %s to loop device %s", source, loopdev.c_str());
-
-        if (!util::loopdev_set_up_device(
-                loopdev, source, 0, mount_flags & MS_RDONLY)) {
-            LOGE("Failed to set up loop device %s: %s",
-                 loopdev.c_str(), strerror(errno));
+        if (!util::loopdev_attach(source, 0, (mount_flags & MS_RDONLY)
+                                  ? util::LOOPDEV_READ_ONLY : 0, 0, loopdev)) {
+            LOGE("Failed to set up loop device for %s: %s",
+                 source, strerror(errno));
             return false;
         }
 
+        LOGD("Assigned %s to loop device %s", source, loopdev.c_str());
+
         if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
             util::loopdev_remove_device(loopdev);
             return false;
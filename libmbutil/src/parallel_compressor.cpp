@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/parallel_compressor.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <lz4frame.h>
+#include <zlib.h>
+
+#include "mbcommon/string.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Construct a compressor that writes to \p fd
+ *
+ * \param fd Output file descriptor (not closed by the compressor)
+ * \param format Output format
+ * \param threads Number of worker threads (at least 1)
+ * \param block_size Size of the uncompressed data in each frame or member. For
+ *                   LZ4, this should not be larger than 4 MiB.
+ */
+ParallelCompressor::ParallelCompressor(int fd, Format format,
+                                       unsigned int threads, size_t block_size)
+    : _fd(fd)
+    , _format(format)
+    , _block_size(std::max<size_t>(1, block_size))
+{
+    threads = std::max(1u, threads);
+
+    // Allow the writer to get ahead of the workers by one block each
+    _max_in_flight = 2 * threads;
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        _threads.emplace_back(&ParallelCompressor::worker, this);
+    }
+}
+
+ParallelCompressor::~ParallelCompressor()
+{
+    stop_threads();
+}
+
+/*!
+ * \brief Queue data for compression
+ *
+ * This blocks if too many blocks are waiting to be compressed or written.
+ *
+ * \return Whether all previously completed blocks were compressed and written
+ *         successfully
+ */
+bool ParallelCompressor::write(const void *data, size_t size)
+{
+    if (_finished || _failed) {
+        if (!_failed) {
+            _error_msg = "Compressor already finished";
+        }
+        return false;
+    }
+
+    auto ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        if (!_curr) {
+            _curr = std::make_shared<Block>();
+            _curr->input.reserve(_block_size);
+        }
+
+        size_t n = std::min(size, _block_size - _curr->input.size());
+        _curr->input.insert(_curr->input.end(), ptr, ptr + n);
+        ptr += n;
+        size -= n;
+
+        if (_curr->input.size() == _block_size && !submit_block()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compress and write any remaining data and stop the worker threads
+ *
+ * The fd is not closed.
+ *
+ * \return Whether all of the data was compressed and written successfully
+ */
+bool ParallelCompressor::finish()
+{
+    if (_finished) {
+        return !_failed;
+    }
+    _finished = true;
+
+    // Always write at least one frame/member so that an empty input produces
+    // a valid compressed stream
+    if (!_failed && (_curr || !_have_output)) {
+        if (!_curr) {
+            _curr = std::make_shared<Block>();
+        }
+        submit_block();
+    }
+
+    while (!_failed && !_in_flight.empty()) {
+        write_front_block();
+    }
+
+    stop_threads();
+
+    return !_failed;
+}
+
+std::string ParallelCompressor::error()
+{
+    return _error_msg;
+}
+
+/*!
+ * \brief Get the frames or members that have been written so far
+ *
+ * The list is complete once finish() returns successfully.
+ */
+const std::vector<ParallelCompressor::Frame> & ParallelCompressor::frames() const
+{
+    return _frames;
+}
+
+void ParallelCompressor::worker()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+
+    while (true) {
+        _queued_cv.wait(lock, [&]{ return _stop || !_queue.empty(); });
+        if (_stop) {
+            return;
+        }
+
+        std::shared_ptr<Block> block = std::move(_queue.front());
+        _queue.pop_front();
+
+        lock.unlock();
+        bool ok = compress_block(*block);
+        lock.lock();
+
+        block->ok = ok;
+        block->done = true;
+        _done_cv.notify_all();
+    }
+}
+
+bool ParallelCompressor::compress_block(Block &block)
+{
+    switch (_format) {
+    case Format::LZ4: {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+        prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+        prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+        block.output.resize(LZ4F_compressFrameBound(block.input.size(), &prefs));
+
+        size_t n = LZ4F_compressFrame(
+                block.output.data(), block.output.size(),
+                block.input.data(), block.input.size(), &prefs);
+        if (LZ4F_isError(n)) {
+            return false;
+        }
+
+        block.output.resize(n);
+        break;
+    }
+
+    case Format::GZIP: {
+        z_stream strm;
+        memset(&strm, 0, sizeof(strm));
+
+        // windowBits + 16 produces a gzip header and trailer
+        if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+
+        block.output.resize(deflateBound(&strm, block.input.size()));
+
+        strm.next_in = block.input.data();
+        strm.avail_in = block.input.size();
+        strm.next_out = block.output.data();
+        strm.avail_out = block.output.size();
+
+        int ret = deflate(&strm, Z_FINISH);
+        deflateEnd(&strm);
+        if (ret != Z_STREAM_END) {
+            return false;
+        }
+
+        block.output.resize(block.output.size() - strm.avail_out);
+        break;
+    }
+
+    default:
+        return false;
+    }
+
+    // Input is no longer needed
+    std::vector<unsigned char>().swap(block.input);
+    return true;
+}
+
+bool ParallelCompressor::submit_block()
+{
+    _curr->input_size = _curr->input.size();
+
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _queue.push_back(_curr);
+        _in_flight.push_back(std::move(_curr));
+        _queued_cv.notify_one();
+    }
+    _curr.reset();
+    _have_output = true;
+
+    while (_in_flight.size() >= _max_in_flight) {
+        if (!write_front_block()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for the oldest block to be compressed and write it
+ */
+bool ParallelCompressor::write_front_block()
+{
+    std::shared_ptr<Block> block;
+
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _done_cv.wait(lock, [&]{ return _in_flight.front()->done; });
+        block = std::move(_in_flight.front());
+        _in_flight.pop_front();
+    }
+
+    if (!block->ok) {
+        _error_msg = _format == Format::LZ4
+                ? "Failed to compress LZ4 frame"
+                : "Failed to compress gzip member";
+        _failed = true;
+        return false;
+    }
+
+    const unsigned char *ptr = block->output.data();
+    size_t size = block->output.size();
+
+    while (size > 0) {
+        ssize_t n = ::write(_fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _error_msg = format("Failed to write compressed data: %s",
+                                strerror(errno));
+            _failed = true;
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+
+    _frames.push_back({ _compressed_offset, block->output.size(),
+                        _uncompressed_offset, block->input_size });
+    _compressed_offset += block->output.size();
+    _uncompressed_offset += block->input_size;
+
+    return true;
+}
+
+void ParallelCompressor::stop_threads()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _stop = true;
+        _queue.clear();
+        _queued_cv.notify_all();
+    }
+
+    for (auto &t : _threads) {
+        t.join();
+    }
+    _threads.clear();
+}
+
+}
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/permissions.h"
+
+#include <mutex>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+#include "mblog/logging.h"
+#include "mbutil/dirwalker.h"
+
+// Directories up to this depth are handed off to the thread pool as separate
+// subtrees. Deeper directories are walked by the thread that found them.
+#define MAX_SPLIT_DEPTH         4
+
+namespace mb
+{
+namespace util
+{
+
+/*! \cond INTERNAL */
+struct PermissionsJob
+{
+    int flags;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+
+    // Subtrees are not handed off if they are on a different filesystem
+    dev_t root_dev;
+    bool split;
+    TaskGroup *group;
+
+    std::mutex lock;
+    bool failed = false;
+    int saved_errno = 0;
+
+    void fail(int error)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!failed) {
+            failed = true;
+            saved_errno = error;
+        }
+        group->cancel();
+    }
+
+    void submit(std::string path, int depth);
+};
+/*! \endcond */
+
+class PermissionsWalker : public DirWalker
+{
+public:
+    PermissionsWalker(PermissionsJob &job, std::string path, int depth)
+        : DirWalker(std::move(path), GroupSpecialFiles)
+        , _job(job)
+        , _depth(depth)
+    {
+    }
+
+    // Whether a failure was already logged and recorded in the job
+    bool reported() const
+    {
+        return _reported;
+    }
+
+    virtual int on_changed_path() override
+    {
+        return _job.group->is_cancelled() ? Action::Stop : Action::Ok;
+    }
+
+    virtual int on_reached_directory_pre() override
+    {
+        if (_curr->level == 0 || !_job.split
+                || _depth + _curr->level > MAX_SPLIT_DEPTH) {
+            return Action::Ok;
+        }
+
+        const struct stat *sb = curr_stat();
+        if (!sb) {
+            return fail();
+        }
+
+        // The walker won't descend into other filesystems anyway
+        if (sb->st_dev != _job.root_dev) {
+            return Action::Ok;
+        }
+
+        // The subtree's walker sets the directory's own permissions after
+        // walking it, so skip the post-order visit here
+        _job.submit(_curr->path, _depth + _curr->level);
+        _handed_off = true;
+        return Action::Skip;
+    }
+
+    virtual int on_reached_directory_post() override
+    {
+        if (_handed_off) {
+            _handed_off = false;
+            return Action::Ok;
+        }
+        return apply(false);
+    }
+
+    virtual int on_reached_file() override
+    {
+        return apply(false);
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        if (_job.flags & PERMS_SET_MODE) {
+            // Avoid security issue
+            LOGW("%s: Not setting permissions on symlink", _curr->path.c_str());
+        }
+        return apply(true);
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        return apply(false);
+    }
+
+private:
+    PermissionsJob &_job;
+    int _depth;
+    bool _handed_off = false;
+    bool _reported = false;
+
+    int fail()
+    {
+        LOGW("%s", _error_msg.c_str());
+        _reported = true;
+        _job.fail(errno);
+        return Action::Fail;
+    }
+
+    /*!
+     * \brief Change the current entry's owner and mode if they don't match
+     *
+     * The owner is changed first since chown() clears the set-user-ID and
+     * set-group-ID bits.
+     */
+    int apply(bool is_symlink)
+    {
+        bool follow = is_symlink && (_job.flags & PERMS_FOLLOW_SYMLINKS);
+        bool chowned = false;
+
+        // The stat result describes the symlink itself, so it can't be used to
+        // skip anything when following symlinks
+        const struct stat *sb = nullptr;
+        if (!follow) {
+            sb = curr_stat();
+            if (!sb) {
+                return fail();
+            }
+        }
+
+        if (_job.flags & PERMS_SET_OWNER) {
+            if (!sb || (_job.uid != static_cast<uid_t>(-1)
+                            && sb->st_uid != _job.uid)
+                    || (_job.gid != static_cast<gid_t>(-1)
+                            && sb->st_gid != _job.gid)) {
+                if (fchownat(_curr->dirfd, _curr->name, _job.uid, _job.gid,
+                             follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0) {
+                    mb::format(_error_msg, "%s: Failed to chown: %s",
+                               _curr->path.c_str(), strerror(errno));
+                    return fail();
+                }
+                chowned = true;
+            }
+        }
+
+        if ((_job.flags & PERMS_SET_MODE) && !is_symlink) {
+            if ((sb->st_mode & 07777) != _job.mode
+                    || (chowned && (sb->st_mode & (S_ISUID | S_ISGID)))) {
+                if (fchmodat(_curr->dirfd, _curr->name, _job.mode, 0) < 0) {
+                    mb::format(_error_msg, "%s: Failed to chmod: %s",
+                               _curr->path.c_str(), strerror(errno));
+                    return fail();
+                }
+            }
+        }
+
+        return Action::Ok;
+    }
+};
+
+void PermissionsJob::submit(std::string path, int depth)
+{
+    group->submit([this, path, depth] {
+        PermissionsWalker walker(*this, path, depth);
+        if (!walker.run() && !walker.reported()) {
+            LOGW("%s", walker.error().c_str());
+            fail(errno);
+        }
+    });
+}
+
+/*!
+ * \brief Recursively set the owner and/or mode of a directory tree
+ *
+ * Entries are only modified if their owner or mode doesn't already match. All
+ * changes are made relative to the parent directory's file descriptor.
+ * Subtrees near the top of the tree are processed in parallel on the global
+ * thread pool. Like the other recursive functions, the walk does not cross
+ * filesystem boundaries.
+ *
+ * \param path Root of the tree
+ * \param flags \ref PermissionsFlags
+ * \param mode Mode to set if \ref PERMS_SET_MODE is specified
+ * \param uid User ID to set if \ref PERMS_SET_OWNER is specified (or -1 to
+ *            leave unchanged)
+ * \param gid Group ID to set if \ref PERMS_SET_OWNER is specified (or -1 to
+ *            leave unchanged)
+ *
+ * \return True if every entry was processed. False with errno set if any
+ *         entry could not be modified.
+ */
+bool set_permissions_recursive(const std::string &path, int flags,
+                               mode_t mode, uid_t uid, gid_t gid)
+{
+    struct stat sb;
+
+    if (lstat(path.c_str(), &sb) < 0) {
+        LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    ThreadPool &pool = ThreadPool::global();
+    TaskGroup group(pool);
+
+    PermissionsJob job;
+    job.flags = flags;
+    job.mode = mode & 07777;
+    job.uid = uid;
+    job.gid = gid;
+    job.root_dev = sb.st_dev;
+    // Subtrees may be walked before the permissions of their parents are set,
+    // which is only safe if the new mode doesn't prevent the traversal
+    job.split = pool.thread_count() > 1
+            && (!(flags & PERMS_SET_MODE)
+                    || (job.mode & S_IRWXU) == S_IRWXU);
+    job.group = &group;
+
+    job.submit(path, 0);
+    group.wait();
+
+    if (job.failed) {
+        errno = job.saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
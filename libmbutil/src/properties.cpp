@@ -19,6 +19,7 @@
 
 #include "mbutil/properties.h"
 
+#include <algorithm>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -26,6 +27,10 @@
 #include <cstdio>
 #include <cstring>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/alloc_profiler.h"
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
@@ -100,6 +105,20 @@ bool libc_system_property_wait(const prop_info *pi,
                                     relative_timeout);
 }
 
+uint32_t libc_system_property_serial(const prop_info *pi)
+{
+    initialize_properties();
+
+    return mb__system_property_read_serial(pi);
+}
+
+uint32_t libc_system_property_area_serial()
+{
+    initialize_properties();
+
+    return mb__system_property_area_serial();
+}
+
 // Helper functions
 
 static bool string_to_bool(const std::string &str, bool &value_out)
@@ -124,22 +143,31 @@ static bool string_to_bool(const std::string &str, bool &value_out)
 }
 
 static void read_property(const prop_info *pi, std::string &name_out,
-                          std::string &value_out)
+                          std::string &value_out,
+                          uint32_t *serial_out = nullptr)
 {
-    using KeyValuePair = std::pair<std::string, std::string>;
-    KeyValuePair ctx;
+    struct Ctx
+    {
+        std::string name;
+        std::string value;
+        uint32_t serial;
+    };
+    Ctx ctx;
 
     libc_system_property_read_callback(
             pi, [](void *cookie, const char *name, const char *value,
                    uint32_t serial) {
-        (void) serial;
-        auto *kvp = static_cast<KeyValuePair *>(cookie);
-        kvp->first = name;
-        kvp->second = value;
+        auto *ctx = static_cast<Ctx *>(cookie);
+        ctx->name = name;
+        ctx->value = value;
+        ctx->serial = serial;
     }, &ctx);
 
-    name_out = std::move(ctx.first);
-    value_out = std::move(ctx.second);
+    name_out = std::move(ctx.name);
+    value_out = std::move(ctx.value);
+    if (serial_out) {
+        *serial_out = ctx.serial;
+    }
 }
 
 bool property_get(const std::string &key, std::string &value_out)
@@ -235,6 +263,154 @@ bool property_get_all(std::unordered_map<std::string, std::string> &map)
     }, &map);
 }
 
+SystemProperty::SystemProperty(std::string name) : _name(std::move(name))
+{
+}
+
+const std::string & SystemProperty::name() const
+{
+    return _name;
+}
+
+bool SystemProperty::find()
+{
+    if (_pi) {
+        return true;
+    }
+
+    // Properties can only be added if the global serial number changes. It
+    // must be read before the lookup so that a concurrent addition is not
+    // missed the next time.
+    uint32_t area_serial = libc_system_property_area_serial();
+    if (_looked_up && area_serial == _area_serial) {
+        return false;
+    }
+
+    _pi = libc_system_property_find(_name.c_str());
+    _looked_up = true;
+    _area_serial = area_serial;
+
+    return _pi;
+}
+
+/*!
+ * \brief Get the value of the property
+ *
+ * \return True if the property exists. Otherwise, false with \p value_out
+ *         cleared.
+ */
+bool SystemProperty::get(std::string &value_out)
+{
+    if (!find()) {
+        value_out.clear();
+        return false;
+    }
+
+    if (!_have_value || libc_system_property_serial(_pi) != _serial) {
+        std::string name;
+        read_property(_pi, name, _value, &_serial);
+        _have_value = true;
+    }
+
+    value_out = _value;
+    return true;
+}
+
+std::string SystemProperty::get_string(const std::string &default_value)
+{
+    std::string value;
+
+    if (get(value) && !value.empty()) {
+        return value;
+    }
+
+    return default_value;
+}
+
+bool SystemProperty::get_bool(bool default_value)
+{
+    std::string value;
+    bool result;
+
+    if (get(value) && string_to_bool(value, result)) {
+        return result;
+    }
+
+    return default_value;
+}
+
+/*!
+ * \brief Wait for the property to change
+ *
+ * Waits until the value differs from the one last returned by get(). If the
+ * property does not exist, this waits for any property to change, so the
+ * caller should check again with get().
+ *
+ * \param relative_timeout Timeout or nullptr to wait forever
+ *
+ * \return True if something changed. False if the timeout expired.
+ */
+bool SystemProperty::wait(const struct timespec *relative_timeout)
+{
+    uint32_t new_serial;
+
+    if (find()) {
+        uint32_t old_serial = _have_value
+                ? _serial : libc_system_property_serial(_pi);
+        return libc_system_property_wait(_pi, old_serial, &new_serial,
+                                         relative_timeout);
+    } else {
+        return libc_system_property_wait(nullptr, _area_serial, &new_serial,
+                                         relative_timeout);
+    }
+}
+
+/*!
+ * \brief Reread the properties that changed since the last update
+ *
+ * \return True if the properties were successfully read. Otherwise, false.
+ */
+bool SystemPropertySnapshot::update()
+{
+    uint32_t area_serial = libc_system_property_area_serial();
+    if (_valid && area_serial == _area_serial) {
+        return true;
+    }
+
+    int ret = libc_system_property_foreach(
+            [](const prop_info *pi, void *cookie) {
+        auto *snapshot = static_cast<SystemPropertySnapshot *>(cookie);
+
+        auto it = snapshot->_serials.find(pi);
+        if (it != snapshot->_serials.end()
+                && it->second == libc_system_property_serial(pi)) {
+            return;
+        }
+
+        std::string name;
+        std::string value;
+        uint32_t serial;
+
+        read_property(pi, name, value, &serial);
+        snapshot->_props[std::move(name)] = std::move(value);
+        snapshot->_serials[pi] = serial;
+    }, this);
+    if (ret != 0) {
+        return false;
+    }
+
+    _area_serial = area_serial;
+    _valid = true;
+
+    return true;
+}
+
+const std::unordered_map<std::string, std::string> &
+SystemPropertySnapshot::properties() const
+{
+    return _props;
+}
+
 // Properties file functions
 
 enum class PropIterAction
@@ -243,18 +419,14 @@ enum class PropIterAction
     STOP,
 };
 
-typedef PropIterAction (*PropIterCb)(const std::string &key,
-                                     const std::string &value,
+// The key and value point into the line buffer and are only valid during the
+// callback
+typedef PropIterAction (*PropIterCb)(const char *key, size_t len_key,
+                                     const char *value, size_t len_value,
                                      void *cookie);
 
-static bool iterate_property_file(const std::string &path, PropIterCb cb,
-                                  void *cookie)
+static bool iterate_property_fp(FILE *fp, PropIterCb cb, void *cookie)
 {
-    ScopedFILE fp(fopen(path.c_str(), "r"), &fclose);
-    if (!fp) {
-        return false;
-    }
-
     char *line = nullptr;
     size_t len = 0;
     ssize_t read;
@@ -263,60 +435,312 @@ static bool iterate_property_file(const std::string &path, PropIterCb cb,
         free(line);
     });
 
-    while ((read = getline(&line, &len, fp.get())) >= 0) {
+    while ((read = getline(&line, &len, fp)) >= 0) {
         if (read == 0 || line[0] == '#') {
             // Skip empty and comment lines
             continue;
         }
 
-        char *equals = strchr(line, '=');
+        size_t len_line = static_cast<size_t>(read);
+        if (line[len_line - 1] == '\n') {
+            --len_line;
+        }
+
+        auto equals = static_cast<const char *>(
+                memchr(line, '=', len_line));
         if (!equals) {
             // No equals in line
             continue;
         }
 
-        *equals = '\0';
+        size_t len_key = static_cast<size_t>(equals - line);
 
-        if (line[read - 1] == '\n') {
-            line[read - 1] = '\0';
+        if (cb(line, len_key, equals + 1, len_line - len_key - 1, cookie)
+                == PropIterAction::STOP) {
+            return true;
         }
+    }
 
-        if (cb(line, equals + 1, cookie) == PropIterAction::STOP) {
-            return true;
+    return !ferror(fp);
+}
+
+static bool iterate_property_file(const std::string &path, PropIterCb cb,
+                                  void *cookie)
+{
+    ScopedFILE fp(fopen(path.c_str(), "r"), &fclose);
+    if (!fp) {
+        return false;
+    }
+
+    return iterate_property_fp(fp.get(), cb, cookie);
+}
+
+PropertyFile::PropertyFile(std::string path) : _path(std::move(path))
+{
+}
+
+const std::string & PropertyFile::path() const
+{
+    return _path;
+}
+
+bool PropertyFile::is_stale()
+{
+    struct stat sb;
+
+    if (stat(_path.c_str(), &sb) < 0) {
+        return true;
+    }
+
+    return sb.st_dev != _dev
+            || sb.st_ino != _ino
+            || sb.st_size != _size
+            || sb.st_mtim.tv_sec != _mtime.tv_sec
+            || sb.st_mtim.tv_nsec != _mtime.tv_nsec;
+}
+
+/*!
+ * \brief Load the file if it changed since it was last loaded
+ *
+ * If a key is listed more than once, the first value is used, matching
+ * property_file_get(). Nothing is reloaded if there are unsaved changes.
+ *
+ * \return True if the properties are loaded. False if the file could not be
+ *         read, in which case the properties are cleared.
+ */
+bool PropertyFile::load()
+{
+    MB_ALLOC_SCOPE("util.properties");
+
+    if (_dirty || (_loaded && !is_stale())) {
+        return true;
+    }
+
+    _loaded = false;
+    _props.clear();
+
+    ScopedFILE fp(fopen(_path.c_str(), "rbe"), &fclose);
+    if (!fp) {
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fileno(fp.get()), &sb) < 0) {
+        return false;
+    }
+
+    bool ret = iterate_property_fp(
+            fp.get(), [](const char *key, size_t len_key, const char *value,
+                         size_t len_value, void *cookie) {
+        auto *map = static_cast<std::unordered_map<std::string, std::string> *>(cookie);
+        map->emplace(std::string(key, len_key), std::string(value, len_value));
+        return PropIterAction::CONTINUE;
+    }, &_props);
+    if (!ret) {
+        _props.clear();
+        return false;
+    }
+
+    _dev = sb.st_dev;
+    _ino = sb.st_ino;
+    _size = sb.st_size;
+    _mtime = sb.st_mtim;
+    _loaded = true;
+
+    return true;
+}
+
+/*!
+ * \brief Atomically replace the file with the current properties
+ *
+ * The properties are written in the same format as property_file_write_all()
+ * to a temporary file in the same directory, which is then renamed over the
+ * original path.
+ *
+ * \param mode Permissions of the new file
+ *
+ * \return True if the file was written. Otherwise, false with errno set.
+ */
+bool PropertyFile::save(mode_t mode)
+{
+    std::string temp_path(_path);
+    temp_path += ".XXXXXX";
+
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto fail = [&] {
+        int saved_errno = errno;
+        unlink(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    };
+
+    if (fchmod(fd, mode) < 0) {
+        close(fd);
+        return fail();
+    }
+
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+        return fail();
+    }
+
+    for (auto const &pair : _props) {
+        if (fputs(pair.first.c_str(), fp) == EOF
+                || fputc('=', fp) == EOF
+                || fputs(pair.second.c_str(), fp) == EOF
+                || fputc('\n', fp) == EOF) {
+            fclose(fp);
+            return fail();
         }
     }
 
-    return !ferror(fp.get());
+    if (fflush(fp) == EOF || fsync(fileno(fp)) < 0) {
+        fclose(fp);
+        return fail();
+    }
+
+    struct stat sb;
+    if (fstat(fileno(fp), &sb) < 0) {
+        fclose(fp);
+        return fail();
+    }
+
+    if (fclose(fp) == EOF) {
+        return fail();
+    }
+
+    if (rename(temp_path.c_str(), _path.c_str()) < 0) {
+        return fail();
+    }
+
+    _dev = sb.st_dev;
+    _ino = sb.st_ino;
+    _size = sb.st_size;
+    _mtime = sb.st_mtim;
+    _loaded = true;
+    _dirty = false;
+
+    return true;
 }
 
+/*!
+ * \brief Get the value of a property
+ *
+ * \return True if the property exists. Otherwise, false with \p value_out
+ *         cleared.
+ */
+bool PropertyFile::get(const std::string &key, std::string &value_out)
+{
+    load();
+
+    auto it = _props.find(key);
+    if (it == _props.end()) {
+        value_out.clear();
+        return false;
+    }
+
+    value_out = it->second;
+    return true;
+}
+
+std::string PropertyFile::get_string(const std::string &key,
+                                     const std::string &default_value)
+{
+    std::string value;
+
+    if (get(key, value) && !value.empty()) {
+        return value;
+    }
+
+    return default_value;
+}
+
+bool PropertyFile::get_bool(const std::string &key, bool default_value)
+{
+    std::string value;
+    bool result;
+
+    if (get(key, value) && string_to_bool(value, result)) {
+        return result;
+    }
+
+    return default_value;
+}
+
+void PropertyFile::set(const std::string &key, const std::string &value)
+{
+    load();
+
+    _props[key] = value;
+    _dirty = true;
+}
+
+bool PropertyFile::erase(const std::string &key)
+{
+    load();
+
+    if (_props.erase(key) == 0) {
+        return false;
+    }
+
+    _dirty = true;
+    return true;
+}
+
+void PropertyFile::clear()
+{
+    _props.clear();
+    _dirty = true;
+}
+
+const std::unordered_map<std::string, std::string> & PropertyFile::properties()
+{
+    load();
+
+    return _props;
+}
+
+// Parsed files used by the property_file_get*() functions. The most recently
+// used file is at the end.
+static std::vector<std::unique_ptr<PropertyFile>> file_cache;
+static std::mutex file_cache_lock;
+static constexpr size_t FILE_CACHE_SIZE = 8;
+
 bool property_file_get(const std::string &path, const std::string &key,
                        std::string &value_out)
 {
-    struct Ctx
-    {
-        const std::string *key;
-        std::string *value_out;
-        bool found;
-    };
+    std::lock_guard<std::mutex> lock(file_cache_lock);
 
-    Ctx ctx{&key, &value_out, false};
+    auto it = std::find_if(file_cache.begin(), file_cache.end(),
+                           [&](const std::unique_ptr<PropertyFile> &file) {
+        return file->path() == path;
+    });
 
-    bool ret = iterate_property_file(
-            path, [](const std::string &key, const std::string &value,
-                     void *cookie){
-        auto *ctx = static_cast<Ctx *>(cookie);
-        if (key == *ctx->key) {
-            *ctx->value_out = value;
-            ctx->found = true;
-            return PropIterAction::STOP;
+    std::unique_ptr<PropertyFile> file;
+    if (it != file_cache.end()) {
+        file = std::move(*it);
+        file_cache.erase(it);
+    } else {
+        file.reset(new PropertyFile(path));
+        if (file_cache.size() == FILE_CACHE_SIZE) {
+            file_cache.erase(file_cache.begin());
         }
-        return PropIterAction::CONTINUE;
-    }, &ctx);
+    }
 
-    if (!ctx.found) {
+    bool ret = file->load();
+    if (ret) {
+        file->get(key, value_out);
+    } else {
         value_out.clear();
     }
 
+    file_cache.push_back(std::move(file));
+
     return ret;
 }
 
@@ -358,10 +782,11 @@ bool property_file_list(const std::string &path, PropertyListCb prop_fn,
     Ctx ctx{prop_fn, cookie};
 
     return iterate_property_file(
-            path, [](const std::string &key, const std::string &value,
-                     void *cookie){
+            path, [](const char *key, size_t len_key, const char *value,
+                     size_t len_value, void *cookie){
         auto *ctx = static_cast<Ctx *>(cookie);
-        ctx->prop_fn(key, value, ctx->cookie);
+        ctx->prop_fn(std::string(key, len_key), std::string(value, len_value),
+                     ctx->cookie);
         return PropIterAction::CONTINUE;
     }, &ctx);
 }
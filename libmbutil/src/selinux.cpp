@@ -19,8 +19,17 @@
 
 #include "mbutil/selinux.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstring>
+#include <ctime>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
@@ -31,85 +40,296 @@
 #include <sepol/sepol.h>
 
 #include "mblog/logging.h"
+#include "mbutil/dirwalker.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
+#include "mbutil/time.h"
 
 #define SELINUX_XATTR           "security.selinux"
 
 #define OPEN_ATTEMPTS           5
 
+// Number of paths handed to a relabeling thread at once
+#define RELABEL_BATCH_SIZE      256
+// Maximum number of batches waiting to be relabeled
+#define RELABEL_MAX_QUEUED      16
+
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveSetContext : public FTSWrapper {
+/*!
+ * \brief Check if a file already has a context and set it if it doesn't
+ *
+ * Reading the xattr is much cheaper than writing it, especially on filesystems
+ * where setxattr() dirties the inode even if the value does not change.
+ */
+static bool ensure_context(const char *path, const std::string &context,
+                           bool follow_symlinks)
+{
+    char buf[256];
+    ssize_t size = follow_symlinks
+            ? getxattr(path, SELINUX_XATTR, buf, sizeof(buf))
+            : lgetxattr(path, SELINUX_XATTR, buf, sizeof(buf));
+
+    // The stored value includes the NULL terminator
+    if (size == static_cast<ssize_t>(context.size() + 1)
+            && memcmp(buf, context.c_str(), size) == 0) {
+        return true;
+    }
+
+    if (follow_symlinks) {
+        return setxattr(path, SELINUX_XATTR, context.c_str(),
+                        context.size() + 1, 0) == 0;
+    } else {
+        return lsetxattr(path, SELINUX_XATTR, context.c_str(),
+                         context.size() + 1, 0) == 0;
+    }
+}
+
+/*!
+ * \brief Relabels files on a pool of worker threads
+ *
+ * The tree is walked on the calling thread. Paths are handed to the workers in
+ * batches so that the label checks and updates on different inodes can run
+ * concurrently.
+ */
+class ContextSetter
+{
+public:
+    ContextSetter(std::string context, bool follow_symlinks)
+        : _context(std::move(context)), _follow_symlinks(follow_symlinks)
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        for (unsigned int i = 1; i < n; ++i) {
+            _threads.emplace_back(&ContextSetter::worker, this);
+        }
+    }
+
+    ~ContextSetter()
+    {
+        finish();
+    }
+
+    void add(const std::string &path)
+    {
+        if (_threads.empty()) {
+            process_one(path);
+            return;
+        }
+
+        _batch.push_back(path);
+        if (_batch.size() == RELABEL_BATCH_SIZE) {
+            submit();
+        }
+    }
+
+    /*!
+     * \brief Wait for all queued paths to be processed
+     *
+     * \return True if all paths were relabeled. Otherwise, false with errno set
+     *         to the error of the first failure.
+     */
+    bool finish()
+    {
+        if (!_batch.empty()) {
+            submit();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done = true;
+        }
+        _cv_work.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+        _threads.clear();
+
+        if (_error != 0) {
+            errno = _error;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string _context;
+    bool _follow_symlinks;
+    std::vector<std::thread> _threads;
+    std::vector<std::string> _batch;
+    std::deque<std::vector<std::string>> _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv_work;
+    std::condition_variable _cv_space;
+    bool _done = false;
+    std::atomic<int> _error{0};
+
+    void process_one(const std::string &path)
+    {
+        if (!ensure_context(path.c_str(), _context, _follow_symlinks)) {
+            int expected = 0;
+            _error.compare_exchange_strong(expected, errno);
+        }
+    }
+
+    void submit()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        // Limit memory usage if the workers can't keep up
+        _cv_space.wait(lock, [&] {
+            return _queue.size() < RELABEL_MAX_QUEUED;
+        });
+        _queue.push_back(std::move(_batch));
+        lock.unlock();
+        _cv_work.notify_one();
+
+        _batch.clear();
+    }
+
+    void worker()
+    {
+        while (true) {
+            std::vector<std::string> batch;
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv_work.wait(lock, [&] {
+                    return _done || !_queue.empty();
+                });
+                if (_queue.empty()) {
+                    return;
+                }
+                batch = std::move(_queue.front());
+                _queue.pop_front();
+            }
+            _cv_space.notify_one();
+
+            for (auto const &path : batch) {
+                process_one(path);
+            }
+        }
+    }
+};
+
+class RecursiveSetContext : public DirWalker {
 public:
     RecursiveSetContext(std::string path, std::string context,
                         bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _context(std::move(context)),
-        _follow_symlinks(follow_symlinks)
+        : DirWalker(path, GroupSpecialFiles),
+        _setter(std::move(context), follow_symlinks)
+    {
+    }
+
+    virtual bool on_post_execute(bool success) override
     {
+        // Always wait for the workers, even if the walk failed
+        bool ret = _setter.finish();
+        return success && ret;
     }
 
     virtual int on_reached_directory_post() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context();
     }
 
     virtual int on_reached_file() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context();
     }
 
     virtual int on_reached_symlink() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context();
     }
 
     virtual int on_reached_special_file() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context();
     }
 
 private:
-    std::string _context;
-    bool _follow_symlinks;
+    ContextSetter _setter;
 
-    bool set_context()
+    int set_context()
     {
-        if (_follow_symlinks) {
-            return selinux_set_context(_curr->fts_accpath, _context);
-        } else {
-            return selinux_lset_context(_curr->fts_accpath, _context);
-        }
+        _setter.add(_curr->path);
+        return Action::Ok;
     }
 };
 
-bool selinux_read_policy(const std::string &path, policydb_t *pdb)
+static int open_policy(const std::string &path, int flags, mode_t mode)
 {
-    struct policy_file pf;
-    struct stat sb;
-    void *map;
-    int fd;
+    int fd = -1;
 
     for (int i = 0; i < OPEN_ATTEMPTS; ++i) {
-        fd = open(path.c_str(), O_RDONLY);
+        fd = open(path.c_str(), flags | O_CLOEXEC, mode);
         if (fd < 0) {
             LOGE("[%d/%d] %s: Failed to open sepolicy: %s",
                  i + 1, OPEN_ATTEMPTS, path.c_str(), strerror(errno));
             if (errno == EBUSY) {
                 usleep(500 * 1000);
                 continue;
-            } else {
-                return false;
             }
         }
         break;
     }
 
+    return fd;
+}
+
+/*!
+ * \brief Read the remainder of a file into a single buffer
+ *
+ * Used if the policy file can't be mmap'd. \p size is only a hint since some
+ * kernels report 0 for /sys/fs/selinux/policy.
+ */
+static bool read_policy_fd(int fd, size_t size, std::vector<char> &buf)
+{
+    buf.resize(size > 0 ? size : 1024 * 1024);
+    size_t total = 0;
+
+    while (true) {
+        if (total == buf.size()) {
+            buf.resize(buf.size() * 2);
+        }
+
+        ssize_t n = read(fd, buf.data() + total, buf.size() - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        total += n;
+    }
+
+    buf.resize(total);
+    return true;
+}
+
+bool selinux_read_policy(const std::string &path, policydb_t *pdb)
+{
+    struct policy_file pf;
+    struct stat sb;
+    void *map;
+    std::vector<char> buf;
+    struct timespec start;
+    struct timespec loaded;
+    struct timespec parsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open_policy(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+
     auto close_fd = finally([&] {
         close(fd);
     });
@@ -119,26 +339,121 @@ bool selinux_read_policy(const std::string &path, policydb_t *pdb)
         return false;
     }
 
-    map = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The policy is parsed from start to end, so fault in all of the pages at
+    // once
+    map = sb.st_size > 0
+            ? mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                   fd, 0)
+            : MAP_FAILED;
     if (map == MAP_FAILED) {
-        LOGE("%s: Failed to mmap sepolicy: %s", path.c_str(), strerror(errno));
-        return false;
+        LOGV("%s: Cannot mmap sepolicy; reading into memory instead",
+             path.c_str());
+
+        if (!read_policy_fd(fd, sb.st_size, buf)) {
+            LOGE("%s: Failed to read sepolicy: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
     }
 
     auto unmap_map = finally([&] {
-        munmap(map, sb.st_size);
+        if (map != MAP_FAILED) {
+            munmap(map, sb.st_size);
+        }
     });
 
+    clock_gettime(CLOCK_MONOTONIC, &loaded);
+
     policy_file_init(&pf);
     pf.type = PF_USE_MEMORY;
-    pf.data = (char *) map;
-    pf.len = sb.st_size;
+    if (map != MAP_FAILED) {
+        pf.data = static_cast<char *>(map);
+        pf.len = sb.st_size;
+    } else {
+        pf.data = buf.data();
+        pf.len = buf.size();
+    }
 
     auto destroy_pf = finally([&] {
         sepol_handle_destroy(pf.handle);
     });
 
-    return policydb_read(pdb, &pf, 0) == 0;
+    if (policydb_read(pdb, &pf, 0) != 0) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+
+    LOGD("%s: Loaded %zu byte policy in %" PRId64 "ms"
+         " (%s: %" PRId64 "ms, parse: %" PRId64 "ms)",
+         path.c_str(), pf.len, timespec_diff_ms(start, parsed),
+         map != MAP_FAILED ? "mmap" : "read", timespec_diff_ms(start, loaded),
+         timespec_diff_ms(loaded, parsed));
+
+    return true;
+}
+
+/*!
+ * \brief Read a binary policy without parsing it
+ *
+ * Unlike util::file_read_all(), this works for /sys/fs/selinux/policy, which
+ * may report a size of 0.
+ */
+bool selinux_read_policy_data(const std::string &path, std::vector<char> *data)
+{
+    int fd = open_policy(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat sepolicy: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!read_policy_fd(fd, sb.st_size, *data)) {
+        LOGE("%s: Failed to read sepolicy: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write a binary policy in a single write(2) call
+ *
+ * This can be used to load an already serialized policy into the kernel via
+ * /sys/fs/selinux/load.
+ */
+bool selinux_write_policy_data(const std::string &path,
+                               const void *data, size_t size)
+{
+    int fd = open_policy(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+        LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
+        return false;
+    } else if (static_cast<size_t>(n) != size) {
+        LOGE("%s: Short write of sepolicy: %zd/%zu bytes",
+             path.c_str(), n, size);
+        errno = EIO;
+        return false;
+    }
+
+    return true;
 }
 
 // /sys/fs/selinux/load requires the entire policy to be written in a single
@@ -149,7 +464,11 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
     void *data;
     size_t len;
     sepol_handle_t *handle;
-    int fd;
+    struct timespec start;
+    struct timespec serialized;
+    struct timespec written;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     // Don't print warnings to stderr
     handle = sepol_handle_create();
@@ -159,6 +478,8 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         sepol_handle_destroy(handle);
     });
 
+    // This computes the size of the image first and serializes the policy into
+    // a single allocation of that size
     if (policydb_to_image(handle, pdb, &data, &len) < 0) {
         LOGE("Failed to write policydb to memory");
         return false;
@@ -168,30 +489,20 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         free(data);
     });
 
-    for (int i = 0; i < OPEN_ATTEMPTS; ++i) {
-        fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
-        if (fd < 0) {
-            LOGE("[%d/%d] %s: Failed to open sepolicy: %s",
-                 i + 1, OPEN_ATTEMPTS, path.c_str(), strerror(errno));
-            if (errno == EBUSY) {
-                usleep(500 * 1000);
-                continue;
-            } else {
-                return false;
-            }
-        }
-        break;
-    }
-
-    auto close_fd = finally([&] {
-        close(fd);
-    });
+    clock_gettime(CLOCK_MONOTONIC, &serialized);
 
-    if (write(fd, data, len) < 0) {
-        LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
+    if (!selinux_write_policy_data(path, data, len)) {
         return false;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &written);
+
+    LOGD("%s: Wrote %zu byte policy in %" PRId64 "ms"
+         " (serialize: %" PRId64 "ms, write: %" PRId64 "ms)",
+         path.c_str(), len, timespec_diff_ms(start, written),
+         timespec_diff_ms(start, serialized),
+         timespec_diff_ms(serialized, written));
+
     return true;
 }
 
@@ -19,12 +19,20 @@
 
 #include "mbutil/socket.h"
 
+#include <algorithm>
+
+#include <cerrno>
 #include <climits>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// Minimum size of SocketReader's receive buffer
+#define READER_BUFFER_SIZE      (16 * 1024)
+
 namespace mb
 {
 namespace util
@@ -82,6 +90,60 @@ ssize_t socket_write(int fd, const void *buf, size_t size)
     return bytes_written;
 }
 
+/*!
+ * \brief Write all of the given buffers
+ *
+ * \note The iovec array is modified to track partial writes.
+ */
+static bool socket_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return false;
+        }
+
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write length-prefixed data without copying it into another buffer
+ */
+static bool socket_write_sized(int fd, const void *data, size_t len)
+{
+    if (len > INT32_MAX) {
+        errno = EINVAL;
+        return false;
+    }
+
+    int32_t header = len;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<void *>(data);
+    iov[1].iov_len = len;
+
+    return socket_writev(fd, iov, 2);
+}
+
 bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
 {
     int32_t len;
@@ -104,14 +166,7 @@ bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
 
 bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
 {
-    if (!socket_write_int32(fd, len)) {
-        return false;
-    }
-
-    if (socket_write(fd, data, len) == (ssize_t) len) {
-        return true;
-    }
-    return false;
+    return socket_write_sized(fd, data, len);
 }
 
 template<typename TYPE>
@@ -213,14 +268,7 @@ bool socket_read_string(int fd, std::string *result)
 
 bool socket_write_string(int fd, const std::string &str)
 {
-    if (!socket_write_int32(fd, str.size())) {
-        return false;
-    }
-
-    if (socket_write(fd, str.data(), str.size()) == (ssize_t) str.size()) {
-        return true;
-    }
-    return false;
+    return socket_write_sized(fd, str.data(), str.size());
 }
 
 bool socket_read_string_array(int fd, std::vector<std::string> *result)
@@ -342,5 +390,98 @@ bool socket_send_fds(int fd, const std::vector<int> &fds)
     return false;
 }
 
+SocketReader::SocketReader(int fd)
+    : _fd(fd)
+    , _begin(0)
+    , _end(0)
+{
+}
+
+/*!
+ * \brief Ensure that at least \p size unconsumed bytes are buffered
+ */
+bool SocketReader::fill(size_t size)
+{
+    if (_end - _begin >= size) {
+        return true;
+    }
+
+    if (_buf.size() - _begin < size) {
+        // Move the partial message to the front before growing the buffer
+        memmove(_buf.data(), _buf.data() + _begin, _end - _begin);
+        _end -= _begin;
+        _begin = 0;
+
+        if (_buf.size() < size) {
+            _buf.resize(std::max<size_t>(
+                    std::max<size_t>(size, _buf.size() * 2),
+                    READER_BUFFER_SIZE));
+        }
+    }
+
+    while (_end - _begin < size) {
+        ssize_t n = read(_fd, _buf.data() + _end, _buf.size() - _end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            // Connection closed in the middle of a message
+            return false;
+        }
+
+        _end += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the next length-prefixed message
+ *
+ * \param[out] data Pointer to the message data. It points into the reader's
+ *                  buffer and is only valid until the next call.
+ * \param[out] size Size of the message
+ *
+ * \return Whether a complete message was read
+ */
+bool SocketReader::read_bytes(const uint8_t **data, size_t *size)
+{
+    int32_t len;
+
+    if (!fill(sizeof(len))) {
+        return false;
+    }
+
+    memcpy(&len, _buf.data() + _begin, sizeof(len));
+    if (len < 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (!fill(sizeof(len) + len)) {
+        return false;
+    }
+
+    *data = _buf.data() + _begin + sizeof(len);
+    *size = len;
+
+    _begin += sizeof(len) + len;
+    if (_begin == _end) {
+        _begin = _end = 0;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Number of bytes received but not yet returned by read_bytes()
+ */
+size_t SocketReader::buffered() const
+{
+    return _end - _begin;
+}
+
 }
 }
\ No newline at end of file
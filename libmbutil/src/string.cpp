@@ -25,6 +25,8 @@
 #include <cstdarg>
 #include <cstring>
 
+#include "mbcommon/string.h"
+
 namespace mb
 {
 namespace util
@@ -62,16 +64,15 @@ void replace_all(std::string *source,
 
 std::vector<std::string> split(const std::string &str, const std::string &delim)
 {
-    std::size_t begin = 0;
-    std::size_t end;
+    StringSplitter splitter(str.data(), str.size(),
+                            delim.data(), delim.size(),
+                            SplitMode::Delimiter);
     std::vector<std::string> result;
+    const char *token;
+    size_t len;
 
-    if (!delim.empty()) {
-        while ((end = str.find(delim, begin)) != std::string::npos) {
-            result.push_back(str.substr(begin, end - begin));
-            begin = end + delim.size();
-        }
-        result.push_back(str.substr(begin));
+    while (splitter.next(token, len)) {
+        result.emplace_back(token, len);
     }
 
     return result;
@@ -97,18 +98,15 @@ std::string join(const std::vector<std::string> &list, std::string delim)
 std::vector<std::string> tokenize(const std::string &str,
                                   const std::string &delims)
 {
-    std::vector<char> linebuf(str.begin(), str.end());
-    linebuf.resize(linebuf.size() + 1);
+    StringSplitter splitter(str.data(), str.size(),
+                            delims.data(), delims.size(),
+                            SplitMode::AnyOf);
     std::vector<std::string> tokens;
+    const char *token;
+    size_t len;
 
-    char *temp;
-    char *token;
-
-    token = strtok_r(linebuf.data(), delims.c_str(), &temp);
-    while (token != nullptr) {
-        tokens.push_back(token);
-
-        token = strtok_r(nullptr, delims.c_str(), &temp);
+    while (splitter.next(token, len)) {
+        tokens.emplace_back(token, len);
     }
 
     return tokens;
@@ -0,0 +1,795 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/zip.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mblog/logging.h"
+#include "mbutil/directory.h"
+#include "mbutil/finally.h"
+
+// Size of the buffers for compressed and uncompressed data
+#define ZIP_BUFFER_SIZE                 (256 * 1024)
+
+#define ZIP_LOCAL_HEADER_SIG            0x04034b50
+#define ZIP_LOCAL_HEADER_SIZE           30
+#define ZIP_CENTRAL_HEADER_SIG          0x02014b50
+#define ZIP_CENTRAL_HEADER_SIZE         46
+#define ZIP_EOCD_SIG                    0x06054b50
+#define ZIP_EOCD_SIZE                   22
+#define ZIP_EOCD64_LOCATOR_SIG          0x07064b50
+#define ZIP_EOCD64_LOCATOR_SIZE         20
+#define ZIP_EOCD64_SIG                  0x06064b50
+#define ZIP_EOCD64_SIZE                 56
+#define ZIP_EXTRA_ZIP64                 0x0001
+#define ZIP_MAX_COMMENT_SIZE            0xffff
+
+#define ZIP_FLAG_ENCRYPTED              0x0001
+
+#define ZIP_METHOD_STORED               0
+#define ZIP_METHOD_DEFLATED             8
+
+#define ZIP_OS_UNIX                     3
+
+namespace mb
+{
+namespace util
+{
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8
+            | static_cast<uint32_t>(p[2]) << 16
+            | static_cast<uint32_t>(p[3]) << 24;
+}
+
+static inline uint64_t read_le64(const unsigned char *p)
+{
+    return static_cast<uint64_t>(read_le32(p))
+            | static_cast<uint64_t>(read_le32(p + 4)) << 32;
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = write(fd, static_cast<const char *>(buf) + total,
+                          size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+struct ZipEntryReader::Impl
+{
+    const ZipReader &zip;
+    const ZipEntry &entry;
+    // Offset of the next compressed byte to read (-1 until the local header
+    // has been read)
+    int64_t offset = -1;
+    uint64_t remaining_in = 0;
+    uint64_t total_out = 0;
+    uint32_t crc = 0;
+    bool stream_init = false;
+    bool eof = false;
+    z_stream stream;
+    std::vector<unsigned char> in_buf;
+    std::vector<unsigned char> out_buf;
+
+    Impl(const ZipReader &zip_, const ZipEntry &entry_)
+        : zip(zip_), entry(entry_)
+    {
+    }
+
+    ~Impl()
+    {
+        if (stream_init) {
+            inflateEnd(&stream);
+        }
+    }
+
+    bool start();
+    bool finish();
+};
+
+/*!
+ * \brief Locate the entry's data from its local header
+ */
+bool ZipEntryReader::Impl::start()
+{
+    const char *name = entry.name.c_str();
+
+    if (entry.flags & ZIP_FLAG_ENCRYPTED) {
+        LOGE("%s: %s: Encrypted entries are not supported",
+             zip._path.c_str(), name);
+        return false;
+    } else if (entry.method != ZIP_METHOD_STORED
+            && entry.method != ZIP_METHOD_DEFLATED) {
+        LOGE("%s: %s: Unsupported compression method: %u",
+             zip._path.c_str(), name, entry.method);
+        return false;
+    }
+
+    unsigned char header[ZIP_LOCAL_HEADER_SIZE];
+    if (!pread_fully(zip._fd, header, sizeof(header),
+                     entry.local_header_offset)) {
+        LOGE("%s: %s: Failed to read local header: %s",
+             zip._path.c_str(), name, strerror(errno));
+        return false;
+    } else if (read_le32(header) != ZIP_LOCAL_HEADER_SIG) {
+        LOGE("%s: %s: Invalid local header", zip._path.c_str(), name);
+        return false;
+    }
+
+    uint64_t data_offset = entry.local_header_offset + sizeof(header)
+            + read_le16(header + 26) + read_le16(header + 28);
+    if (data_offset > zip._size
+            || entry.compressed_size > zip._size - data_offset) {
+        LOGE("%s: %s: Entry data is out of bounds", zip._path.c_str(), name);
+        return false;
+    }
+
+    offset = static_cast<int64_t>(data_offset);
+    remaining_in = entry.compressed_size;
+    crc = crc32(0, nullptr, 0);
+
+    out_buf.resize(ZIP_BUFFER_SIZE);
+
+    if (entry.method == ZIP_METHOD_DEFLATED) {
+        in_buf.resize(ZIP_BUFFER_SIZE);
+
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+            LOGE("zlib: Failed to initialize inflate stream");
+            return false;
+        }
+        stream_init = true;
+    }
+
+    return true;
+}
+
+bool ZipEntryReader::Impl::finish()
+{
+    eof = true;
+
+    if (total_out != entry.uncompressed_size) {
+        LOGE("%s: %s: Expected %" PRIu64 " bytes, but got %" PRIu64,
+             zip._path.c_str(), entry.name.c_str(),
+             entry.uncompressed_size, total_out);
+        return false;
+    } else if (crc != entry.crc32) {
+        LOGE("%s: %s: CRC32 mismatch", zip._path.c_str(), entry.name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+ZipEntryReader::ZipEntryReader(const ZipReader &zip, const ZipEntry &entry)
+    : _impl(new Impl(zip, entry))
+{
+}
+
+ZipEntryReader::~ZipEntryReader() = default;
+
+/*!
+ * \brief Read the next block of uncompressed data
+ *
+ * \param[out] buf Pointer to the data, which is valid until the next call
+ * \param[out] size Size of the data (0 when the end of the entry is reached)
+ *
+ * \return Whether the data was successfully read and, at the end of the
+ *         entry, whether the size and CRC32 match the central directory
+ */
+bool ZipEntryReader::read_block(const void *&buf, size_t &size)
+{
+    Impl &d = *_impl;
+
+    if (d.offset < 0 && !d.start()) {
+        return false;
+    }
+
+    if (d.eof) {
+        buf = nullptr;
+        size = 0;
+        return true;
+    }
+
+    if (d.entry.method == ZIP_METHOD_STORED) {
+        if (d.remaining_in == 0) {
+            buf = nullptr;
+            size = 0;
+            return d.finish();
+        }
+
+        size_t n = static_cast<size_t>(std::min<uint64_t>(
+                d.remaining_in, d.out_buf.size()));
+        if (!pread_fully(d.zip._fd, d.out_buf.data(), n, d.offset)) {
+            LOGE("%s: %s: Failed to read data: %s", d.zip._path.c_str(),
+                 d.entry.name.c_str(), strerror(errno));
+            return false;
+        }
+
+        d.offset += n;
+        d.remaining_in -= n;
+        d.total_out += n;
+        d.crc = crc32(d.crc, d.out_buf.data(), n);
+
+        buf = d.out_buf.data();
+        size = n;
+        return true;
+    }
+
+    d.stream.next_out = d.out_buf.data();
+    d.stream.avail_out = d.out_buf.size();
+
+    while (d.stream.avail_out == d.out_buf.size()) {
+        if (d.stream.avail_in == 0 && d.remaining_in > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(
+                    d.remaining_in, d.in_buf.size()));
+            if (!pread_fully(d.zip._fd, d.in_buf.data(), n, d.offset)) {
+                LOGE("%s: %s: Failed to read data: %s", d.zip._path.c_str(),
+                     d.entry.name.c_str(), strerror(errno));
+                return false;
+            }
+
+            d.offset += n;
+            d.remaining_in -= n;
+            d.stream.next_in = d.in_buf.data();
+            d.stream.avail_in = n;
+        }
+
+        int ret = inflate(&d.stream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            break;
+        } else if (ret == Z_BUF_ERROR && d.stream.avail_in == 0
+                && d.remaining_in == 0) {
+            LOGE("%s: %s: Truncated deflate stream",
+                 d.zip._path.c_str(), d.entry.name.c_str());
+            return false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOGE("%s: %s: Failed to inflate data: %s", d.zip._path.c_str(),
+                 d.entry.name.c_str(), d.stream.msg ? d.stream.msg : "");
+            return false;
+        }
+    }
+
+    size_t n = d.out_buf.size() - d.stream.avail_out;
+    d.total_out += n;
+    d.crc = crc32(d.crc, d.out_buf.data(), n);
+
+    if (n == 0) {
+        buf = nullptr;
+        size = 0;
+        return d.finish();
+    }
+
+    buf = d.out_buf.data();
+    size = n;
+    return true;
+}
+
+ZipReader::ZipReader() : _fd(-1), _size(0)
+{
+}
+
+ZipReader::~ZipReader()
+{
+    close();
+}
+
+/*!
+ * \brief Open a zip file and read its central directory
+ *
+ * \return Whether the file was opened and the central directory is valid
+ */
+bool ZipReader::open(const std::string &path)
+{
+    close();
+
+    _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (_fd < 0) {
+        LOGE("%s: Failed to open zip: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    _path = path;
+
+    struct stat sb;
+    if (fstat(_fd, &sb) < 0) {
+        LOGE("%s: Failed to stat zip: %s", path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+    _size = sb.st_size;
+
+    if (!read_central_directory()) {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void ZipReader::close()
+{
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _size = 0;
+    _path.clear();
+    _entries.clear();
+    _names.clear();
+}
+
+const std::string & ZipReader::path() const
+{
+    return _path;
+}
+
+const std::vector<ZipEntry> & ZipReader::entries() const
+{
+    return _entries;
+}
+
+/*!
+ * \brief Find an entry by name
+ *
+ * \return Entry or nullptr if the zip does not contain \a name. If a name is
+ *         duplicated, the first entry in the central directory is returned.
+ */
+const ZipEntry * ZipReader::find(const std::string &name) const
+{
+    auto it = _names.find(name);
+    if (it == _names.end()) {
+        return nullptr;
+    }
+    return &_entries[it->second];
+}
+
+bool ZipReader::read_central_directory()
+{
+    // The end of central directory record is followed by a variable-length
+    // comment, so search backwards for its signature
+    uint64_t tail_size = std::min<uint64_t>(
+            _size, ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE);
+    uint64_t tail_offset = _size - tail_size;
+    std::vector<unsigned char> tail(tail_size);
+
+    if (tail_size < ZIP_EOCD_SIZE) {
+        LOGE("%s: File is too small to be a zip", _path.c_str());
+        return false;
+    } else if (!pread_fully(_fd, tail.data(), tail.size(), tail_offset)) {
+        LOGE("%s: Failed to read zip: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    const unsigned char *eocd = nullptr;
+    for (size_t i = tail_size - ZIP_EOCD_SIZE + 1; i-- > 0;) {
+        if (read_le32(tail.data() + i) == ZIP_EOCD_SIG
+                && i + ZIP_EOCD_SIZE + read_le16(tail.data() + i + 20)
+                        <= tail_size) {
+            eocd = tail.data() + i;
+            break;
+        }
+    }
+    if (!eocd) {
+        LOGE("%s: Failed to find end of central directory", _path.c_str());
+        return false;
+    }
+
+    uint64_t eocd_offset = tail_offset + (eocd - tail.data());
+    uint64_t count = read_le16(eocd + 10);
+    uint64_t cd_size = read_le32(eocd + 12);
+    uint64_t cd_offset = read_le32(eocd + 16);
+
+    if (count == 0xffff || cd_size == 0xffffffff
+            || cd_offset == 0xffffffff) {
+        unsigned char locator[ZIP_EOCD64_LOCATOR_SIZE];
+        unsigned char eocd64[ZIP_EOCD64_SIZE];
+
+        if (eocd_offset < sizeof(locator)
+                || !pread_fully(_fd, locator, sizeof(locator),
+                                eocd_offset - sizeof(locator))
+                || read_le32(locator) != ZIP_EOCD64_LOCATOR_SIG
+                || !pread_fully(_fd, eocd64, sizeof(eocd64),
+                                read_le64(locator + 8))
+                || read_le32(eocd64) != ZIP_EOCD64_SIG) {
+            LOGE("%s: Invalid zip64 end of central directory", _path.c_str());
+            return false;
+        }
+
+        count = read_le64(eocd64 + 32);
+        cd_size = read_le64(eocd64 + 40);
+        cd_offset = read_le64(eocd64 + 48);
+    }
+
+    if (cd_offset > _size || cd_size > _size - cd_offset
+            || count > cd_size / ZIP_CENTRAL_HEADER_SIZE) {
+        LOGE("%s: Central directory is out of bounds", _path.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> cd(cd_size);
+    if (!pread_fully(_fd, cd.data(), cd.size(), cd_offset)) {
+        LOGE("%s: Failed to read central directory: %s",
+             _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<ZipEntry> entries;
+    entries.reserve(count);
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        const unsigned char *h = cd.data() + pos;
+
+        if (cd_size - pos < ZIP_CENTRAL_HEADER_SIZE
+                || read_le32(h) != ZIP_CENTRAL_HEADER_SIG) {
+            LOGE("%s: Invalid central directory header", _path.c_str());
+            return false;
+        }
+
+        uint16_t name_size = read_le16(h + 28);
+        uint16_t extra_size = read_le16(h + 30);
+        uint16_t comment_size = read_le16(h + 32);
+        size_t header_size = ZIP_CENTRAL_HEADER_SIZE + name_size + extra_size
+                + comment_size;
+
+        if (cd_size - pos < header_size) {
+            LOGE("%s: Truncated central directory header", _path.c_str());
+            return false;
+        }
+
+        ZipEntry entry;
+        entry.version_made_by = read_le16(h + 4);
+        entry.flags = read_le16(h + 8);
+        entry.method = read_le16(h + 10);
+        entry.dos_time = read_le16(h + 12);
+        entry.dos_date = read_le16(h + 14);
+        entry.crc32 = read_le32(h + 16);
+        entry.compressed_size = read_le32(h + 20);
+        entry.uncompressed_size = read_le32(h + 24);
+        entry.external_attrs = read_le32(h + 38);
+        entry.local_header_offset = read_le32(h + 42);
+        entry.name.assign(reinterpret_cast<const char *>(
+                h + ZIP_CENTRAL_HEADER_SIZE), name_size);
+
+        // Sizes and offsets that don't fit are stored in the zip64 extra
+        // field, in this order
+        const unsigned char *extra = h + ZIP_CENTRAL_HEADER_SIZE + name_size;
+        const unsigned char *extra_end = extra + extra_size;
+
+        while (extra_end - extra >= 4) {
+            uint16_t id = read_le16(extra);
+            uint16_t size = read_le16(extra + 2);
+            const unsigned char *data = extra + 4;
+
+            if (extra_end - data < size) {
+                break;
+            }
+
+            if (id == ZIP_EXTRA_ZIP64) {
+                const unsigned char *end = data + size;
+                uint64_t *fields[] = {
+                    &entry.uncompressed_size,
+                    &entry.compressed_size,
+                    &entry.local_header_offset,
+                };
+
+                for (uint64_t *field : fields) {
+                    if (*field == 0xffffffff && end - data >= 8) {
+                        *field = read_le64(data);
+                        data += 8;
+                    }
+                }
+            }
+
+            extra += 4 + size;
+        }
+
+        if (entry.local_header_offset > _size) {
+            LOGE("%s: %s: Local header is out of bounds",
+                 _path.c_str(), entry.name.c_str());
+            return false;
+        }
+
+        entries.push_back(std::move(entry));
+        pos += header_size;
+    }
+
+    _entries.swap(entries);
+    for (size_t i = 0; i < _entries.size(); ++i) {
+        _names.emplace(_entries[i].name, i);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read an entry into memory
+ *
+ * \param entry Entry to read
+ * \param out Output buffer
+ * \param max_size Maximum size of the uncompressed data
+ *
+ * \return Whether the entry was successfully read
+ */
+bool ZipReader::read_to_memory(const ZipEntry &entry,
+                               std::vector<unsigned char> *out,
+                               size_t max_size) const
+{
+    if (entry.uncompressed_size > max_size) {
+        LOGE("%s: %s: Entry is too large", _path.c_str(), entry.name.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    data.reserve(entry.uncompressed_size);
+
+    ZipEntryReader reader(*this, entry);
+    const void *buf;
+    size_t size;
+
+    while (true) {
+        if (!reader.read_block(buf, size)) {
+            return false;
+        } else if (size == 0) {
+            break;
+        }
+
+        auto ptr = static_cast<const unsigned char *>(buf);
+        data.insert(data.end(), ptr, ptr + size);
+    }
+
+    out->swap(data);
+    return true;
+}
+
+static struct timespec dos_time_to_timespec(uint16_t dos_time,
+                                            uint16_t dos_date)
+{
+    struct tm t;
+    memset(&t, 0, sizeof(t));
+    t.tm_sec = (dos_time & 0x1f) * 2;
+    t.tm_min = (dos_time >> 5) & 0x3f;
+    t.tm_hour = dos_time >> 11;
+    t.tm_mday = dos_date & 0x1f;
+    t.tm_mon = ((dos_date >> 5) & 0xf) - 1;
+    t.tm_year = (dos_date >> 9) + 80;
+    t.tm_isdst = -1;
+
+    struct timespec ts;
+    ts.tv_sec = mktime(&t);
+    ts.tv_nsec = 0;
+    return ts;
+}
+
+/*!
+ * \brief Extract an entry to a path
+ *
+ * Parent directories of \a target are created as needed. Like libarchive's
+ * disk writer, an existing file at \a target is replaced, the Unix permissions
+ * stored in the zip are applied (0644 if there are none), and the modification
+ * time is set from the entry.
+ *
+ * \return Whether the entry was successfully extracted
+ */
+bool ZipReader::extract(const ZipEntry &entry, const std::string &target) const
+{
+    mode_t mode = 0;
+    if ((entry.version_made_by >> 8) == ZIP_OS_UNIX) {
+        mode = entry.external_attrs >> 16;
+    }
+
+    if (!mkdir_parent(target, 0755)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!entry.name.empty() && entry.name.back() == '/') {
+        if (mkdir(target.c_str(), (mode & 07777) ? mode & 07777 : 0755) < 0
+                && errno != EEXIST) {
+            LOGE("%s: Failed to create directory: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    if (unlink(target.c_str()) < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to remove existing file: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (S_ISLNK(mode)) {
+        std::vector<unsigned char> link_target;
+        if (!read_to_memory(entry, &link_target, PATH_MAX)) {
+            return false;
+        }
+        link_target.push_back('\0');
+
+        if (symlink(reinterpret_cast<const char *>(link_target.data()),
+                    target.c_str()) < 0) {
+            LOGE("%s: Failed to create symlink: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC
+                    | O_LARGEFILE, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    });
+
+    ZipEntryReader reader(*this, entry);
+    const void *buf;
+    size_t size;
+
+    while (true) {
+        if (!reader.read_block(buf, size)) {
+            return false;
+        } else if (size == 0) {
+            break;
+        }
+
+        if (!write_fully(fd, buf, size)) {
+            LOGE("%s: Failed to write file: %s",
+                 target.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    struct timespec times[2];
+    times[0] = dos_time_to_timespec(entry.dos_time, entry.dos_date);
+    times[1] = times[0];
+
+    if (fchmod(fd, (mode & 07777) ? mode & 07777 : 0644) < 0
+            || futimens(fd, times) < 0) {
+        LOGE("%s: Failed to set attributes: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    int ret = ::close(fd);
+    fd = -1;
+    if (ret < 0) {
+        LOGE("%s: Failed to close file: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract several entries concurrently
+ *
+ * \param files Entries to extract and their target paths
+ * \param threads Number of worker threads (0 to use one per CPU)
+ *
+ * \return Whether all entries exist and were successfully extracted
+ */
+bool ZipReader::extract_files(const std::vector<extract_info> &files,
+                              unsigned int threads) const
+{
+    std::vector<const ZipEntry *> entries;
+
+    for (auto const &info : files) {
+        const ZipEntry *entry = find(info.from);
+        if (!entry) {
+            LOGE("%s: %s: Entry does not exist",
+                 _path.c_str(), info.from.c_str());
+            return false;
+        }
+        entries.push_back(entry);
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::max<size_t>(1, std::min<size_t>(threads, files.size()));
+
+    std::atomic_size_t next(0);
+    std::atomic_bool ok(true);
+
+    auto worker = [&]{
+        size_t i;
+        while (ok && (i = next++) < files.size()) {
+            if (!extract(*entries[i], files[i].to)) {
+                ok = false;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : pool) {
+        t.join();
+    }
+
+    return ok;
+}
+
+}
+}
@@ -18,19 +18,32 @@
  */
 
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <cerrno>
 #include <cstdarg>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 #include <jni.h>
 
 #include "mbcommon/common.h"
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
 
+#include "mbbootimg/decoder.h"
+#include "mbbootimg/digest.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
@@ -43,11 +56,74 @@
     Java_com_github_chenxiaolong_dualbootpatcher_nativelib_libmiscstuff_LibMiscStuff_ ## method
 
 #define IOException             "java/io/IOException"
+#define IllegalArgumentException "java/lang/IllegalArgumentException"
 #define OutOfMemoryError        "java/lang/OutOfMemoryError"
 
 typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
+// Block size for reading archives from disk
+#define ARCHIVE_BLOCK_SIZE      (128 * 1024)
+
+// Size of the buffer for reading the decompressed ramdisk
+#define RAMDISK_BUFFER_SIZE     (64 * 1024)
+
+// Maximum number of boot images with cached ROM IDs
+#define ROM_ID_CACHE_MAX        128
+
+struct RomIdCacheEntry
+{
+    off_t size;
+    struct timespec mtime;
+    bool has_rom_id;
+    std::string rom_id;
+};
+
+// The app looks up the ROM ID of every boot image in the ROM list each time it
+// is shown, so results are kept for as long as the boot image is unchanged
+static std::mutex rom_id_cache_lock;
+static std::unordered_map<std::string, RomIdCacheEntry> rom_id_cache;
+
+/*!
+ * \brief Serializes values into a caller-provided buffer
+ *
+ * Values are written in native byte order. Nothing is written once a value
+ * does not fit, but the required size is still counted so that the caller can
+ * retry with a larger buffer.
+ */
+struct BulkWriter
+{
+    unsigned char *buf;
+    size_t capacity;
+    size_t size;
+
+    void write(size_t offset, const void *data, size_t n)
+    {
+        if (offset + n <= capacity) {
+            memcpy(buf + offset, data, n);
+        }
+    }
+
+    void append(const void *data, size_t n)
+    {
+        write(size, data, n);
+        size += n;
+    }
+
+    template<typename T>
+    void append_value(T value)
+    {
+        append(&value, sizeof(value));
+    }
+
+    void append_string(const char *str)
+    {
+        uint32_t len = str ? static_cast<uint32_t>(strlen(str)) : 0;
+        append_value(len);
+        append(str, len);
+    }
+};
+
 extern "C" {
 
 MB_PRINTF(3, 4)
@@ -117,7 +193,8 @@ CLASS_METHOD(extractArchive)(JNIEnv *env, jclass clazz, jstring jfilename,
     archive_read_support_format_zip(in);
     archive_read_support_filter_xz(in);
 
-    if (archive_read_open_filename(in, filename, 10240) != ARCHIVE_OK) {
+    if (archive_read_open_filename(in, filename, ARCHIVE_BLOCK_SIZE)
+            != ARCHIVE_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to open archive: %s",
                         filename, archive_error_string(in));
@@ -215,58 +292,108 @@ CLASS_METHOD(mblogSetLogcat)(JNIEnv *env, jclass clazz)
     mb::log::log_set_logger(std::make_shared<mb::log::AndroidLogger>());
 }
 
-struct LaBootImgCtx
+// Open boot image, mapping it into memory if possible so that entry data can
+// be compared without copying. If \p mapped is not null, it is set to whether
+// the mapping is used, in which case entries can be read concurrently.
+static int open_boot_image(MbBiReader *bir, const char *filename,
+                           bool *mapped = nullptr)
 {
-    MbBiReader *bir;
-    char buf[10240];
+    std::unique_ptr<mb::MmapFile> file(
+            new(std::nothrow) mb::MmapFile(std::string(filename)));
+    if (file && file->is_open()) {
+        if (mapped) {
+            *mapped = true;
+        }
+        return mb_bi_reader_open(bir, file.release(), true);
+    }
+
+    if (mapped) {
+        *mapped = false;
+    }
+    return mb_bi_reader_open_filename(bir, filename);
+}
+
+struct LaDecodedCtx
+{
+    mb::File *file;
+    std::vector<char> buf;
 };
 
-static la_ssize_t laBootImgReadCb(archive *a, void *userdata,
+static la_ssize_t laDecodedReadCb(archive *a, void *userdata,
                                   const void **buffer)
 {
-    (void) a;
-    LaBootImgCtx *ctx = static_cast<LaBootImgCtx *>(userdata);
+    LaDecodedCtx *ctx = static_cast<LaDecodedCtx *>(userdata);
     size_t bytesRead;
-    int ret;
 
-    ret = mb_bi_reader_read_data(ctx->bir, ctx->buf, sizeof(ctx->buf),
-                                 &bytesRead);
-    if (ret == MB_BI_EOF) {
-        return 0;
-    } else if (ret != MB_BI_OK) {
+    if (!ctx->file->read(ctx->buf.data(), ctx->buf.size(), bytesRead)) {
+        archive_set_error(a, EIO, "%s", ctx->file->error_string().c_str());
         return -1;
     }
 
-    *buffer = ctx->buf;
+    *buffer = ctx->buf.data();
     return static_cast<la_ssize_t>(bytesRead);
 }
 
-JNIEXPORT jstring JNICALL
-CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
+static bool rom_id_cache_find(const char *filename, const struct stat &sb,
+                              bool *has_rom_id, std::string *rom_id)
 {
-    (void) clazz;
+    std::lock_guard<std::mutex> lock(rom_id_cache_lock);
+
+    auto it = rom_id_cache.find(filename);
+    if (it == rom_id_cache.end()
+            || it->second.size != sb.st_size
+            || it->second.mtime.tv_sec != sb.st_mtim.tv_sec
+            || it->second.mtime.tv_nsec != sb.st_mtim.tv_nsec) {
+        return false;
+    }
+
+    *has_rom_id = it->second.has_rom_id;
+    *rom_id = it->second.rom_id;
+    return true;
+}
+
+static void rom_id_cache_add(const char *filename, const struct stat &sb,
+                             bool has_rom_id, const char *rom_id)
+{
+    std::lock_guard<std::mutex> lock(rom_id_cache_lock);
+
+    if (rom_id_cache.size() >= ROM_ID_CACHE_MAX
+            && rom_id_cache.find(filename) == rom_id_cache.end()) {
+        rom_id_cache.clear();
+    }
+
+    RomIdCacheEntry &entry = rom_id_cache[filename];
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.has_rom_id = has_rom_id;
+    entry.rom_id = has_rom_id ? rom_id : "";
+}
 
+/*!
+ * \brief Read the ROM ID from the ramdisk of a boot image
+ *
+ * \return Whether the ramdisk was read (\p rom_id_out is empty if the ramdisk
+ *         does not contain a ROM ID). If false is returned, an exception has
+ *         been thrown.
+ */
+static bool read_boot_image_rom_id(JNIEnv *env, const char *filename,
+                                   bool *has_rom_id, std::string *rom_id)
+{
     ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
     MbBiHeader *header;
-    MbBiEntry *entry;
     ScopedArchive a(archive_read_new(), &archive_read_free);
     archive_entry *aEntry;
-    LaBootImgCtx ctx;
+    LaDecodedCtx ctx;
     int ret;
-    const char *filename;
-    jstring romId = nullptr;
 
-    filename = env->GetStringUTFChars(jfilename, nullptr);
-    if (!filename) {
-        goto done;
-    }
+    *has_rom_id = false;
 
     if (!bir) {
         throw_exception(env, IOException, "Failed to allocate MbBiReader");
-        goto done;
+        return false;
     } else if (!a) {
         throw_exception(env, IOException, "Failed to allocate archive");
-        goto done;
+        return false;
     }
 
     // Open input boot image
@@ -275,14 +402,14 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         throw_exception(env, IOException,
                         "Failed to enable all boot image formats: %s",
                         mb_bi_reader_error_string(bir.get()));
-        goto done;
+        return false;
     }
-    ret = mb_bi_reader_open_filename(bir.get(), filename);
+    ret = open_boot_image(bir.get(), filename);
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to open boot image for reading: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        return false;
     }
 
     // Read header
@@ -291,45 +418,46 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         throw_exception(env, IOException,
                         "%s: Failed to read header: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        return false;
     }
 
-    // Go to ramdisk
-    ret = mb_bi_reader_go_to_entry(bir.get(), &entry, MB_BI_ENTRY_RAMDISK);
+    // Open the decompressed ramdisk. The entry is read directly without
+    // reading the kernel or any other entry.
+    mb::File *ramdisk;
+    ret = mb_bi_reader_open_entry_decoded(bir.get(), MB_BI_ENTRY_RAMDISK,
+                                          &ramdisk, nullptr);
     if (ret == MB_BI_EOF) {
         throw_exception(env, IOException,
                         "%s: Boot image is missing ramdisk", filename);
-        goto done;
+        return false;
     } else if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
-                        "%s: Failed to find ramdisk entry: %s",
+                        "%s: Failed to open ramdisk entry: %s",
                         filename, mb_bi_reader_error_string(bir.get()));
-        goto done;
+        return false;
     }
+    std::unique_ptr<mb::File> ramdisk_ptr(ramdisk);
 
-    // Enable support for common ramdisk formats
-    archive_read_support_filter_gzip(a.get());
-    archive_read_support_filter_lz4(a.get());
-    archive_read_support_filter_lzma(a.get());
-    archive_read_support_filter_xz(a.get());
     archive_read_support_format_cpio(a.get());
 
     // Open ramdisk archive
-    ctx.bir = bir.get();
-    ret = archive_read_open(a.get(), &ctx, nullptr, &laBootImgReadCb, nullptr);
+    ctx.file = ramdisk;
+    ctx.buf.resize(RAMDISK_BUFFER_SIZE);
+    ret = archive_read_open(a.get(), &ctx, nullptr, &laDecodedReadCb, nullptr);
     if (ret != ARCHIVE_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to open ramdisk: %s",
                         filename, archive_error_string(a.get()));
-        goto done;
+        return false;
     }
 
+    // Decompression stops as soon as the ROM ID is found
     while ((ret = archive_read_next_header(a.get(), &aEntry)) == ARCHIVE_OK) {
         const char *path = archive_entry_pathname(aEntry);
         if (!path) {
             throw_exception(env, IOException,
                             "%s: Ramdisk entry has no path", filename);
-            goto done;
+            return false;
         }
 
         if (strcmp(path, "romid") == 0) {
@@ -342,7 +470,7 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
                 throw_exception(env, IOException,
                                 "%s: Failed to read ramdisk entry: %s",
                                 filename, archive_error_string(a.get()));
-                goto done;
+                return false;
             }
 
             // NULL-terminate
@@ -354,11 +482,12 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
                 throw_exception(env, IOException,
                                 "%s: /romid in ramdisk is too large",
                                 filename);
-                goto done;
+                return false;
             }
 
-            romId = env->NewStringUTF(buf);
-            goto done;
+            *has_rom_id = true;
+            *rom_id = buf;
+            return true;
         }
     }
 
@@ -366,120 +495,102 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         throw_exception(env, IOException,
                         "%s: Failed to read ramdisk entry header: %s",
                         filename, archive_error_string(a.get()));
-        goto done;
-    }
-
-done:
-    if (filename) {
-        env->ReleaseStringUTFChars(jfilename, filename);
+        return false;
     }
 
-    return romId;
+    return true;
 }
 
-static bool bootImgHeadersEqual(MbBiHeader *header1, MbBiHeader *header2)
+JNIEXPORT jstring JNICALL
+CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
 {
-#define CHECK_COMPARABLE_VALUES(ISSET1, ISSET2, VALUE1, VALUE2) \
-    do { \
-        bool isset1 = (ISSET1); \
-        bool isset2 = (ISSET2); \
-        if (isset1 != isset2 \
-                || (isset1 && isset2 && (VALUE1) != (VALUE2))) { \
-            return false; \
-        } \
-    } while (0)
-
-#define CHECK_STRING_VALUES(ISSET1, ISSET2, STR1, STR2) \
-    do { \
-        bool isset1 = (ISSET1); \
-        bool isset2 = (ISSET2); \
-        if (isset1 != isset2 \
-                || (isset1 && isset2 && strcmp(STR1, STR2) != 0)) { \
-            return false; \
-        } \
-    } while (0)
-
-    // Board name
-
-    const char *name1 = mb_bi_header_board_name(header1);
-    const char *name2 = mb_bi_header_board_name(header2);
-
-    CHECK_STRING_VALUES(!!name1, !!name2, name1, name2);
-
-    // Kernel cmdline
-
-    const char *cmdline1 = mb_bi_header_kernel_cmdline(header1);
-    const char *cmdline2 = mb_bi_header_kernel_cmdline(header2);
-
-    CHECK_STRING_VALUES(!!cmdline1, !!cmdline2, cmdline1, cmdline2);
-
-    // Page size
-
-    CHECK_COMPARABLE_VALUES(mb_bi_header_page_size_is_set(header1),
-                            mb_bi_header_page_size_is_set(header2),
-                            mb_bi_header_page_size(header1),
-                            mb_bi_header_page_size(header2));
-
-    // Kernel address
-
-    CHECK_COMPARABLE_VALUES(mb_bi_header_kernel_address_is_set(header1),
-                            mb_bi_header_kernel_address_is_set(header2),
-                            mb_bi_header_kernel_address(header1),
-                            mb_bi_header_kernel_address(header2));
-
-    // Ramdisk address
+    (void) clazz;
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_ramdisk_address_is_set(header1),
-                            mb_bi_header_ramdisk_address_is_set(header2),
-                            mb_bi_header_ramdisk_address(header1),
-                            mb_bi_header_ramdisk_address(header2));
+    const char *filename;
+    struct stat sb;
+    bool has_stat;
+    bool has_rom_id;
+    std::string rom_id;
+    jstring result = nullptr;
 
-    // Second bootloader address
+    filename = env->GetStringUTFChars(jfilename, nullptr);
+    if (!filename) {
+        return nullptr;
+    }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_secondboot_address_is_set(header1),
-                            mb_bi_header_secondboot_address_is_set(header2),
-                            mb_bi_header_secondboot_address(header1),
-                            mb_bi_header_secondboot_address(header2));
+    has_stat = stat(filename, &sb) == 0;
 
-    // Kernel tags address
+    if (has_stat && rom_id_cache_find(filename, sb, &has_rom_id, &rom_id)) {
+        if (has_rom_id) {
+            result = env->NewStringUTF(rom_id.c_str());
+        }
+    } else if (read_boot_image_rom_id(env, filename, &has_rom_id, &rom_id)) {
+        // Failures are not cached
+        if (has_stat) {
+            rom_id_cache_add(filename, sb, has_rom_id, rom_id.c_str());
+        }
+        if (has_rom_id) {
+            result = env->NewStringUTF(rom_id.c_str());
+        }
+    }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_kernel_tags_address_is_set(header1),
-                            mb_bi_header_kernel_tags_address_is_set(header2),
-                            mb_bi_header_kernel_tags_address(header1),
-                            mb_bi_header_kernel_tags_address(header2));
+    env->ReleaseStringUTFChars(jfilename, filename);
 
-    // Sony IPL address
+    return result;
+}
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_ipl_address_is_set(header1),
-                            mb_bi_header_sony_ipl_address_is_set(header2),
-                            mb_bi_header_sony_ipl_address(header1),
-                            mb_bi_header_sony_ipl_address(header2));
+// Get the content digest of a boot image. The digest is cached alongside the
+// boot image, so unchanged images do not need to be read again. This does not
+// use the JNIEnv, so it may run on any thread. On failure, \p error is set.
+static bool get_image_digest(const char *filename, unsigned char *digest,
+                             std::string &error)
+{
+    if (mb_bi_image_digest_load_cache(filename, digest) == MB_BI_OK) {
+        return true;
+    }
 
-    // Sony RPM address
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    bool mapped;
+    int ret;
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_rpm_address_is_set(header1),
-                            mb_bi_header_sony_rpm_address_is_set(header2),
-                            mb_bi_header_sony_rpm_address(header1),
-                            mb_bi_header_sony_rpm_address(header2));
+    if (!bir) {
+        error = "Failed to allocate MbBiReader instance";
+        return false;
+    }
 
-    // Sony APPSBL address
+    ret = mb_bi_reader_enable_format_all(bir.get());
+    if (ret != MB_BI_OK) {
+        mb::format(error, "Failed to enable all boot image formats: %s",
+                   mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_sony_appsbl_address_is_set(header1),
-                            mb_bi_header_sony_appsbl_address_is_set(header2),
-                            mb_bi_header_sony_appsbl_address(header1),
-                            mb_bi_header_sony_appsbl_address(header2));
+    ret = open_boot_image(bir.get(), filename, &mapped);
+    if (ret != MB_BI_OK) {
+        mb::format(error, "%s: Failed to open boot image for reading: %s",
+                   filename, mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
 
-    // Entrypoint address
+    // The kernel, ramdisk, etc. are hashed in parallel when the image is
+    // mapped. The fallback File does not support concurrent positional reads.
+    if (mapped) {
+        ret = mb_bi_image_digest_parallel(bir.get(), digest);
+    } else {
+        ret = mb_bi_image_digest(bir.get(), digest);
+    }
+    if (ret != MB_BI_OK) {
+        mb::format(error, "%s: Failed to compute digest: %s",
+                   filename, mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
 
-    CHECK_COMPARABLE_VALUES(mb_bi_header_entrypoint_address_is_set(header1),
-                            mb_bi_header_entrypoint_address_is_set(header2),
-                            mb_bi_header_entrypoint_address(header1),
-                            mb_bi_header_entrypoint_address(header2));
+    // Not fatal if the cache cannot be written
+    if (mb_bi_image_digest_save_cache(filename, digest) != MB_BI_OK) {
+        LOGW("%s: Failed to cache boot image digest", filename);
+    }
 
     return true;
-
-#undef CHECK_COMPARABLE_VALUES
-#undef CHECK_STRING_VALUES
 }
 
 JNIEXPORT jboolean JNICALL
@@ -488,17 +599,15 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
 {
     (void) clazz;
 
-    ScopedReader bir1(mb_bi_reader_new(), &mb_bi_reader_free);
-    ScopedReader bir2(mb_bi_reader_new(), &mb_bi_reader_free);
-    MbBiHeader *header1;
-    MbBiHeader *header2;
-    MbBiEntry *entry1;
-    MbBiEntry *entry2;
-    size_t entries = 0;
-    int ret;
+    unsigned char digest1[MB_BI_IMAGE_DIGEST_SIZE];
+    unsigned char digest2[MB_BI_IMAGE_DIGEST_SIZE];
     const char *filename1 = nullptr;
     const char *filename2 = nullptr;
     jboolean result = false;
+    bool ret1 = false;
+    bool ret2 = false;
+    std::string error1;
+    std::string error2;
 
     filename1 = env->GetStringUTFChars(jfilename1, nullptr);
     if (!filename1) {
@@ -509,152 +618,187 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
         goto done;
     }
 
-    if (!bir1 || !bir2) {
-        throw_exception(env, IOException,
-                        "Failed to allocate MbBiReader instances");
-        goto done;
+    // Both images are read at the same time. Exceptions can only be thrown
+    // from this thread, so the errors are reported afterwards.
+    {
+        mb::TaskGroup group(mb::ThreadPool::global());
+
+        group.submit([&] {
+            ret2 = get_image_digest(filename2, digest2, error2);
+        });
+        ret1 = get_image_digest(filename1, digest1, error1);
+
+        group.wait();
     }
 
-    // Set up reader formats
-    ret = mb_bi_reader_enable_format_all(bir1.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir1.get()));
+    if (!ret1) {
+        throw_exception(env, IOException, "%s", error1.c_str());
         goto done;
-    }
-    ret = mb_bi_reader_enable_format_all(bir2.get());
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "Failed to enable all boot image formats: %s",
-                        mb_bi_reader_error_string(bir2.get()));
+    } else if (!ret2) {
+        throw_exception(env, IOException, "%s", error2.c_str());
         goto done;
     }
 
-    // Open boot images
-    ret = mb_bi_reader_open_filename(bir1.get(), filename1);
+    result = memcmp(digest1, digest2, sizeof(digest1)) == 0;
+
+done:
+    if (filename1) {
+        env->ReleaseStringUTFChars(jfilename1, filename1);
+    }
+    if (filename2) {
+        env->ReleaseStringUTFChars(jfilename2, filename2);
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Write the header and entry metadata of a boot image into a buffer
+ *
+ * Layout (native byte order, no padding):
+ *
+ * - int32: format code
+ * - int32: number of entries
+ * - uint64: supported header fields
+ * - uint32 x 9: page size, kernel, ramdisk, second bootloader, kernel tags,
+ *   Sony IPL, Sony RPM, Sony APPSBL, and entrypoint addresses (0 if unset)
+ * - uint32 + bytes: board name (UTF-8, not NULL-terminated)
+ * - uint32 + bytes: kernel cmdline
+ * - For each entry:
+ *   - int32: entry type
+ *   - uint64: entry size (UINT64_MAX if unknown)
+ *
+ * \return Whether the boot image was read. If false is returned, an exception
+ *         has been thrown.
+ */
+static bool write_boot_image_info(JNIEnv *env, const char *filename,
+                                  BulkWriter &writer)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!bir) {
+        throw_exception(env, IOException, "Failed to allocate MbBiReader");
+        return false;
+    }
+
+    ret = mb_bi_reader_enable_format_all(bir.get());
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
-                        "%s: Failed to open boot image for reading: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
+                        "Failed to enable all boot image formats: %s",
+                        mb_bi_reader_error_string(bir.get()));
+        return false;
     }
-    ret = mb_bi_reader_open_filename(bir2.get(), filename2);
+    ret = open_boot_image(bir.get(), filename);
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to open boot image for reading: %s",
-                        filename2, mb_bi_reader_error_string(bir2.get()));
-        goto done;
+                        filename, mb_bi_reader_error_string(bir.get()));
+        return false;
     }
 
-    // Read headers
-    ret = mb_bi_reader_read_header(bir1.get(), &header1);
-    if (ret != MB_BI_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir1.get()));
-        goto done;
-    }
-    ret = mb_bi_reader_read_header(bir2.get(), &header2);
+    ret = mb_bi_reader_read_header(bir.get(), &header);
     if (ret != MB_BI_OK) {
         throw_exception(env, IOException,
                         "%s: Failed to read header: %s",
-                        filename1, mb_bi_reader_error_string(bir2.get()));
-        goto done;
+                        filename, mb_bi_reader_error_string(bir.get()));
+        return false;
     }
 
-    // Compare headers
-    if (!bootImgHeadersEqual(header1, header2)) {
-        goto done;
-    }
+    writer.append_value<int32_t>(mb_bi_reader_format_code(bir.get()));
+    // Filled in once the entries are counted
+    size_t count_offset = writer.size;
+    writer.append_value<int32_t>(0);
+    writer.append_value<uint64_t>(mb_bi_header_supported_fields(header));
 
-    // Count entries in first boot image
-    {
-        while ((ret = mb_bi_reader_read_entry(bir1.get(), &entry1))
-                == MB_BI_OK) {
-            ++entries;
-        }
+#define APPEND_ADDRESS(name) \
+    writer.append_value<uint32_t>(mb_bi_header_ ## name ## _is_set(header) \
+            ? mb_bi_header_ ## name(header) : 0)
 
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename1, mb_bi_reader_error_string(bir1.get()));
-            goto done;
-        }
-    }
+    APPEND_ADDRESS(page_size);
+    APPEND_ADDRESS(kernel_address);
+    APPEND_ADDRESS(ramdisk_address);
+    APPEND_ADDRESS(secondboot_address);
+    APPEND_ADDRESS(kernel_tags_address);
+    APPEND_ADDRESS(sony_ipl_address);
+    APPEND_ADDRESS(sony_rpm_address);
+    APPEND_ADDRESS(sony_appsbl_address);
+    APPEND_ADDRESS(entrypoint_address);
 
-    // Compare each entry in second image to first
-    {
-        while ((ret = mb_bi_reader_read_entry(bir2.get(), &entry2))
-                == MB_BI_OK) {
-            if (entries == 0) {
-                // Too few entries in second image
-                goto done;
-            }
-            --entries;
+#undef APPEND_ADDRESS
 
-            // Find the same entry in first image
-            ret = mb_bi_reader_go_to_entry(bir1.get(), &entry1,
-                                           mb_bi_entry_type(entry2));
-            if (ret == MB_BI_EOF) {
-                // Cannot be equal if entry is missing
-                goto done;
-            } else if (ret != MB_BI_OK) {
-                throw_exception(env, IOException,
-                                "%s: Failed to seek to entry: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
+    writer.append_string(mb_bi_header_board_name(header));
+    writer.append_string(mb_bi_header_kernel_cmdline(header));
 
-            // Compare data
-            char buf1[10240];
-            char buf2[10240];
-            size_t n1;
-            size_t n2;
-
-            while ((ret = mb_bi_reader_read_data(
-                    bir1.get(), buf1, sizeof(buf1), &n1)) == MB_BI_OK) {
-                ret = mb_bi_reader_read_data(bir2.get(), buf2, n1, &n2);
-                if (ret != MB_BI_OK) {
-                    throw_exception(env, IOException,
-                                    "%s: Failed to read data: %s", filename2,
-                                    mb_bi_reader_error_string(bir2.get()));
-                    goto done;
-                }
-
-                if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
-                    // Data is not equivalent
-                    goto done;
-                }
-            }
+    // Only the entry headers are read. The formats seek past the data.
+    int32_t count = 0;
 
-            if (ret != MB_BI_EOF) {
-                throw_exception(env, IOException,
-                                "%s: Failed to read data: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
-        }
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        writer.append_value<int32_t>(mb_bi_entry_type(entry));
+        writer.append_value<uint64_t>(mb_bi_entry_size_is_set(entry)
+                ? mb_bi_entry_size(entry) : UINT64_MAX);
+        ++count;
+    }
 
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename2, mb_bi_reader_error_string(bir2.get()));
-            goto done;
-        }
+    if (ret != MB_BI_EOF) {
+        throw_exception(env, IOException,
+                        "%s: Failed to read entry: %s",
+                        filename, mb_bi_reader_error_string(bir.get()));
+        return false;
     }
 
-    result = true;
+    writer.write(count_offset, &count, sizeof(count));
 
-done:
-    if (filename1) {
-        env->ReleaseStringUTFChars(jfilename1, filename1);
+    return true;
+}
+
+/*!
+ * \brief Get the header and entry metadata of a boot image in one call
+ *
+ * The data is written into the direct ByteBuffer \p jbuf using the layout
+ * described in write_boot_image_info(). If the buffer is too small, its
+ * contents are unspecified and the caller should retry with a buffer of at
+ * least the returned size.
+ *
+ * \return Number of bytes required or -1 if an exception was thrown
+ */
+JNIEXPORT jint JNICALL
+CLASS_METHOD(getBootImageInfo)(JNIEnv *env, jclass clazz, jstring jfilename,
+                               jobject jbuf)
+{
+    (void) clazz;
+
+    BulkWriter writer;
+    writer.buf = static_cast<unsigned char *>(env->GetDirectBufferAddress(jbuf));
+    jlong capacity = env->GetDirectBufferCapacity(jbuf);
+    writer.size = 0;
+
+    if (!writer.buf || capacity < 0) {
+        throw_exception(env, IllegalArgumentException,
+                        "Buffer is not a direct buffer");
+        return -1;
     }
-    if (filename2) {
-        env->ReleaseStringUTFChars(jfilename2, filename2);
+    writer.capacity = static_cast<size_t>(capacity);
+
+    const char *filename = env->GetStringUTFChars(jfilename, nullptr);
+    if (!filename) {
+        return -1;
     }
 
-    return result;
+    bool ret = write_boot_image_info(env, filename, writer);
+
+    env->ReleaseStringUTFChars(jfilename, filename);
+
+    if (!ret) {
+        return -1;
+    } else if (writer.size > INT32_MAX) {
+        throw_exception(env, IOException, "Boot image has too many entries");
+        return -1;
+    }
+
+    return static_cast<jint>(writer.size);
 }
 
 }
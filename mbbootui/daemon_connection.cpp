@@ -48,10 +48,69 @@
 // Singleton
 MbtoolConnection mbtool_connection;
 MbtoolInterface *mbtool_interface = nullptr;
+MbtoolAsyncClient mbtool_async;
 
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
+static void parse_installed_roms(const v3::MbGetInstalledRomsResponse *response,
+                                 std::vector<Rom> *result)
+{
+    std::vector<Rom> roms;
+
+    if (response->roms()) {
+        for (auto const &mb_rom : *response->roms()) {
+            roms.emplace_back();
+            if (mb_rom->id()) {
+                roms.back().id = mb_rom->id()->str();
+            }
+            if (mb_rom->system_path()) {
+                roms.back().system_path = mb_rom->system_path()->str();
+            }
+            if (mb_rom->cache_path()) {
+                roms.back().cache_path = mb_rom->cache_path()->str();
+            }
+            if (mb_rom->data_path()) {
+                roms.back().data_path = mb_rom->data_path()->str();
+            }
+            if (mb_rom->version()) {
+                roms.back().version = mb_rom->version()->str();
+            }
+            if (mb_rom->build()) {
+                roms.back().build = mb_rom->build()->str();
+            }
+        }
+    }
+
+    result->swap(roms);
+}
+
+/*!
+ * \brief Check the type of a (verified) response
+ *
+ * \return The inner response table or nullptr if the daemon rejected the
+ *         request or sent something unexpected
+ */
+static const void * check_response(const v3::Response *response,
+                                   int request_type, int expected_type)
+{
+    int type = response->response_type();
+
+    if (type == v3::ResponseType_Unsupported) {
+        LOGE("Daemon does not support request type: %d", request_type);
+        return nullptr;
+    } else if (type == v3::ResponseType_Invalid) {
+        LOGE("Daemon says request is invalid: %d", request_type);
+        return nullptr;
+    } else if (type != expected_type) {
+        LOGE("Unexpected response type (actual=%d, expected=%d)",
+             type, expected_type);
+        return nullptr;
+    }
+
+    return response->response();
+}
+
 class MbtoolInterfaceV3 : public MbtoolInterface
 {
 public:
@@ -82,33 +141,7 @@ public:
             return false;
         }
 
-        std::vector<Rom> roms;
-
-        if (response->roms()) {
-            for (auto const &mb_rom : *response->roms()) {
-                roms.emplace_back();
-                if (mb_rom->id()) {
-                    roms.back().id = mb_rom->id()->str();
-                }
-                if (mb_rom->system_path()) {
-                    roms.back().system_path = mb_rom->system_path()->str();
-                }
-                if (mb_rom->cache_path()) {
-                    roms.back().cache_path = mb_rom->cache_path()->str();
-                }
-                if (mb_rom->data_path()) {
-                    roms.back().data_path = mb_rom->data_path()->str();
-                }
-                if (mb_rom->version()) {
-                    roms.back().version = mb_rom->version()->str();
-                }
-                if (mb_rom->build()) {
-                    roms.back().build = mb_rom->build()->str();
-                }
-            }
-        }
-
-        result->swap(roms);
+        parse_installed_roms(response, result);
         return true;
     }
 
@@ -296,23 +329,9 @@ private:
         }
 
         // Verify response type
-        const v3::Response *response = v3::GetResponse(buf->data());
-        v3::ResponseType type = response->response_type();
-
-        if (type == v3::ResponseType_Unsupported) {
-            LOGE("Daemon does not support request type: %d", request_type);
-            return false;
-        } else if (type == v3::ResponseType_Invalid) {
-            LOGE("Daemon says request is invalid: %d", request_type);
-            return false;
-        } else if (type != expected_type) {
-            LOGE("Unexpected response type (actual=%d, expected=%d)",
-                 type, expected_type);
-            return false;
-        }
-
-        *result = response->response();
-        return true;
+        *result = check_response(v3::GetResponse(buf->data()),
+                                 request_type, expected_type);
+        return *result != nullptr;
     }
 
     int _fd;
@@ -328,23 +347,23 @@ MbtoolConnection::MbtoolConnection::~MbtoolConnection()
     delete _iface;
 }
 
-bool MbtoolConnection::connect()
+/*!
+ * \brief Connect to the daemon and negotiate the protocol version
+ *
+ * \return Socket fd or -1 if the connection could not be established
+ */
+static int connect_to_daemon()
 {
-    if (_fd >= 0) {
-        // Already connected
-        return true;
-    }
-
     int fd;
     struct sockaddr_un addr;
 
     fd = socket(AF_LOCAL, SOCK_STREAM, 0);
     if (fd < 0) {
         LOGE("Failed to create socket: %s", strerror(errno));
-        return false;
+        return -1;
     }
 
-    bool ret = true;
+    bool ret = false;
 
     auto on_return = mb::util::finally([&]{
         if (!ret) {
@@ -365,7 +384,7 @@ bool MbtoolConnection::connect()
 
     if (::connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
         LOGE("Failed to connect to socket: %s", strerror(errno));
-        return ret = false;
+        return -1;
     }
 
     LOGD("Connected to daemon. Negotiating authorization...");
@@ -374,39 +393,55 @@ bool MbtoolConnection::connect()
     std::string result;
     if (!mb::util::socket_read_string(fd, &result)) {
         LOGE("Failed to receive authorization result: %s", strerror(errno));
-        return ret = false;
+        return -1;
     } else if (result == HANDSHAKE_RESPONSE_DENY) {
         LOGE("Daemon denied authorization");
-        return ret = false;
+        return -1;
     } else if (result != HANDSHAKE_RESPONSE_ALLOW) {
         LOGE("Invalid authorization result from daemon: %s",
              result.c_str());
-        return ret = false;
+        return -1;
     }
 
     // Send requested interface version
     if (!mb::util::socket_write_int32(fd, PROTOCOL_VERSION)) {
         LOGE("Failed to send interface version: %s", strerror(errno));
-        return ret = false;
+        return -1;
     }
 
     // Check interface request's response
     if (!mb::util::socket_read_string(fd, &result)) {
         LOGE("Failed to receive interface request result: %s", strerror(errno));
-        return ret = false;
+        return -1;
     } else if (result == HANDSHAKE_RESPONSE_UNSUPPORTED) {
         LOGE("Daemon does not support interface version %d", PROTOCOL_VERSION);
-        return ret = false;
+        return -1;
     } else if (result != HANDSHAKE_RESPONSE_OK) {
         LOGE("Invalid interface request result from daemon: %s",
              result.c_str());
-        return ret = false;
+        return -1;
+    }
+
+    ret = true;
+    return fd;
+}
+
+bool MbtoolConnection::connect()
+{
+    if (_fd >= 0) {
+        // Already connected
+        return true;
+    }
+
+    int fd = connect_to_daemon();
+    if (fd < 0) {
+        return false;
     }
 
     _fd = fd;
     _iface = new MbtoolInterfaceV3(_fd);
 
-    return ret = true;
+    return true;
 }
 
 bool MbtoolConnection::disconnect()
@@ -425,3 +460,364 @@ MbtoolInterface * MbtoolConnection::interface()
 {
     return _iface;
 }
+
+MbtoolAsyncClient::MbtoolAsyncClient()
+    : _fd(-1)
+    , _connected(false)
+    , _next_id(1)
+    , _decoding_id(0)
+    , _decoding_cancelled(false)
+{
+}
+
+MbtoolAsyncClient::~MbtoolAsyncClient()
+{
+    stop();
+}
+
+bool MbtoolAsyncClient::start()
+{
+    if (_fd >= 0) {
+        // Already started
+        return true;
+    }
+
+    int fd = connect_to_daemon();
+    if (fd < 0) {
+        return false;
+    }
+
+    _fd = fd;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _connected = true;
+    }
+    _reader = std::thread(&MbtoolAsyncClient::reader_loop, this);
+
+    return true;
+}
+
+void MbtoolAsyncClient::stop()
+{
+    if (_fd < 0) {
+        return;
+    }
+
+    // Wakes up the reader thread, which fails the outstanding requests
+    shutdown(_fd, SHUT_RDWR);
+    _reader.join();
+
+    close(_fd);
+    _fd = -1;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _completions.clear();
+}
+
+uint64_t MbtoolAsyncClient::get_installed_roms(InstalledRomsCallback cb)
+{
+    fb::FlatBufferBuilder builder;
+
+    auto request = v3::CreateMbGetInstalledRomsRequest(builder);
+
+    return submit(&builder, request.Union(),
+                  v3::RequestType_MbGetInstalledRomsRequest,
+                  v3::ResponseType_MbGetInstalledRomsResponse,
+                  [cb](const void *r) -> std::function<void()> {
+        std::vector<Rom> roms;
+        if (r) {
+            parse_installed_roms(
+                    static_cast<const v3::MbGetInstalledRomsResponse *>(r),
+                    &roms);
+        }
+        bool ok = r != nullptr;
+        return [cb, ok, roms]{ cb(ok, roms); };
+    });
+}
+
+uint64_t MbtoolAsyncClient::get_booted_rom_id(BootedRomIdCallback cb)
+{
+    fb::FlatBufferBuilder builder;
+
+    auto request = v3::CreateMbGetBootedRomIdRequest(builder);
+
+    return submit(&builder, request.Union(),
+                  v3::RequestType_MbGetBootedRomIdRequest,
+                  v3::ResponseType_MbGetBootedRomIdResponse,
+                  [cb](const void *r) -> std::function<void()> {
+        auto response = static_cast<const v3::MbGetBootedRomIdResponse *>(r);
+        std::string rom_id;
+        if (response && response->rom_id()) {
+            rom_id = response->rom_id()->str();
+        }
+        bool ok = r != nullptr;
+        return [cb, ok, rom_id]{ cb(ok, rom_id); };
+    });
+}
+
+uint64_t MbtoolAsyncClient::version(VersionCallback cb)
+{
+    fb::FlatBufferBuilder builder;
+
+    auto request = v3::CreateMbGetVersionRequest(builder);
+
+    return submit(&builder, request.Union(),
+                  v3::RequestType_MbGetVersionRequest,
+                  v3::ResponseType_MbGetVersionResponse,
+                  [cb](const void *r) -> std::function<void()> {
+        auto response = static_cast<const v3::MbGetVersionResponse *>(r);
+        std::string version;
+        if (response && response->version()) {
+            version = response->version()->str();
+        }
+        bool ok = r != nullptr;
+        return [cb, ok, version]{ cb(ok, version); };
+    });
+}
+
+/*!
+ * \brief Drop a request's callback
+ *
+ * The callback will not be called afterwards, even if the response already
+ * arrived. This must be called from the thread that runs run_completions().
+ */
+void MbtoolAsyncClient::cancel(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_pending.erase(id) > 0) {
+        return;
+    }
+
+    if (_decoding_id == id) {
+        _decoding_cancelled = true;
+        return;
+    }
+
+    for (auto it = _completions.begin(); it != _completions.end(); ++it) {
+        if (it->id == id) {
+            _completions.erase(it);
+            break;
+        }
+    }
+}
+
+/*!
+ * \brief Whether any callbacks have not been run yet
+ */
+bool MbtoolAsyncClient::has_pending()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return !_pending.empty() || _decoding_id != 0 || !_completions.empty();
+}
+
+/*!
+ * \brief Run the callbacks of all completed requests
+ *
+ * \return Number of callbacks that were run
+ */
+size_t MbtoolAsyncClient::run_completions()
+{
+    size_t count = 0;
+    size_t limit;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        limit = _completions.size();
+    }
+
+    // Callbacks are run without the lock because they may submit or cancel
+    // requests. Completions are popped one at a time so that a callback can
+    // still cancel the ones after it. Anything that completes in the meantime
+    // is left for the next call.
+    while (count < limit) {
+        Completion c;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_completions.empty()) {
+                break;
+            }
+            c = std::move(_completions.front());
+            _completions.pop_front();
+        }
+
+        c.fn();
+        ++count;
+    }
+
+    return count;
+}
+
+/*!
+ * \brief Wait for all outstanding requests and run their callbacks
+ */
+void MbtoolAsyncClient::wait_idle()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return _pending.empty() && _decoding_id == 0;
+        });
+    }
+
+    run_completions();
+}
+
+uint64_t MbtoolAsyncClient::submit(fb::FlatBufferBuilder *builder,
+                                   const fb::Offset<void> &fb_request,
+                                   int request_type, int expected_type,
+                                   Handler handler)
+{
+    uint64_t id;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        id = _next_id++;
+
+        if (!_connected) {
+            push_completion(id, handler(nullptr));
+            return id;
+        }
+
+        _pending[id] = { request_type, expected_type, handler };
+    }
+
+    // The ID makes the daemon send a TaggedResponse, which may arrive out of
+    // order with respect to other requests
+    v3::RequestBuilder rb(*builder);
+    rb.add_request_type(static_cast<v3::RequestType>(request_type));
+    rb.add_request(fb_request);
+    rb.add_id(id);
+    builder->Finish(rb.Finish());
+
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(_write_mutex);
+        ok = mb::util::socket_write_bytes(
+                _fd, builder->GetBufferPointer(), builder->GetSize());
+    }
+
+    if (!ok) {
+        LOGE("Failed to send request: %s", strerror(errno));
+
+        // The reader thread may have already failed the request if the
+        // connection was closed
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_pending.erase(id) > 0) {
+            push_completion(id, handler(nullptr));
+            _cv.notify_all();
+        }
+    }
+
+    return id;
+}
+
+/*!
+ * \brief Set a function to call whenever a callback is ready to run
+ *
+ * This lets the render loop sleep until there is something for
+ * run_completions() to do. The function is called with the client's lock held
+ * and possibly from the reader thread, so it must not call back into the
+ * client.
+ */
+void MbtoolAsyncClient::set_wakeup_callback(WakeupCallback cb)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _wakeup = std::move(cb);
+}
+
+/*!
+ * \brief Queue a callback for run_completions()
+ *
+ * Must be called with `_mutex` held.
+ */
+void MbtoolAsyncClient::push_completion(uint64_t id, std::function<void()> fn)
+{
+    _completions.push_back({ id, std::move(fn) });
+    if (_wakeup) {
+        _wakeup();
+    }
+}
+
+/*!
+ * \brief Decode a response and queue its callback
+ *
+ * Must be called without holding `_mutex` with `_decoding_id` set to \p id.
+ */
+void MbtoolAsyncClient::complete(uint64_t id, const Handler &handler,
+                                 const void *response)
+{
+    auto fn = handler(response);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_decoding_cancelled) {
+        push_completion(id, std::move(fn));
+    }
+    _decoding_id = 0;
+    _decoding_cancelled = false;
+    _cv.notify_all();
+}
+
+void MbtoolAsyncClient::reader_loop()
+{
+    std::vector<uint8_t> buf;
+
+    while (mb::util::socket_read_bytes(_fd, &buf)) {
+        auto verifier = fb::Verifier(buf.data(), buf.size());
+        if (!v3::VerifyResponseBuffer(verifier)) {
+            LOGE("Received invalid buffer");
+            break;
+        }
+
+        const v3::Response *response = v3::GetResponse(buf.data());
+        if (response->response_type() != v3::ResponseType_TaggedResponse) {
+            LOGE("Received untagged response: %d",
+                 response->response_type());
+            break;
+        }
+
+        auto tagged = static_cast<const v3::TaggedResponse *>(
+                response->response());
+        uint64_t id = tagged->id();
+        Pending pending;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _pending.find(id);
+            if (it == _pending.end()) {
+                // Cancelled
+                continue;
+            }
+            pending = std::move(it->second);
+            _pending.erase(it);
+            _decoding_id = id;
+        }
+
+        const void *result = nullptr;
+
+        auto data = tagged->data();
+        if (data) {
+            auto inner_verifier = fb::Verifier(data->Data(), data->size());
+            if (v3::VerifyResponseBuffer(inner_verifier)) {
+                result = check_response(v3::GetResponse(data->Data()),
+                                        pending.request_type,
+                                        pending.expected_type);
+            } else {
+                LOGE("Received invalid buffer");
+            }
+        }
+
+        complete(id, pending.handler, result);
+    }
+
+    // Connection is gone. Fail everything that is still outstanding.
+    std::lock_guard<std::mutex> lock(_mutex);
+    _connected = false;
+    for (auto &item : _pending) {
+        push_completion(item.first, item.second.handler(nullptr));
+    }
+    _pending.clear();
+    _cv.notify_all();
+}
@@ -17,9 +17,17 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <cstdint>
+
 #include <flatbuffers/flatbuffers.h>
 
 class Rom
@@ -78,5 +86,87 @@ private:
     MbtoolInterface *_iface;
 };
 
+/*!
+ * \brief Asynchronous client for requests made while the UI is running
+ *
+ * The client keeps its own connection to the daemon open. Requests are tagged
+ * with an ID and written immediately, so several can be in flight at once.
+ * A reader thread matches the responses to the requests and decodes them.
+ * The callbacks are only run from run_completions(), which is called from the
+ * render loop, so they can safely touch GUI objects.
+ */
+class MbtoolAsyncClient
+{
+public:
+    typedef std::function<void(bool ok, const std::vector<Rom> &roms)>
+            InstalledRomsCallback;
+    typedef std::function<void(bool ok, const std::string &rom_id)>
+            BootedRomIdCallback;
+    typedef std::function<void(bool ok, const std::string &version)>
+            VersionCallback;
+    typedef std::function<void()> WakeupCallback;
+
+    MbtoolAsyncClient();
+    ~MbtoolAsyncClient();
+
+    MbtoolAsyncClient(const MbtoolAsyncClient &) = delete;
+    MbtoolAsyncClient & operator=(const MbtoolAsyncClient &) = delete;
+
+    bool start();
+    void stop();
+
+    uint64_t get_installed_roms(InstalledRomsCallback cb);
+    uint64_t get_booted_rom_id(BootedRomIdCallback cb);
+    uint64_t version(VersionCallback cb);
+    void cancel(uint64_t id);
+
+    bool has_pending();
+    size_t run_completions();
+    void wait_idle();
+
+    void set_wakeup_callback(WakeupCallback cb);
+
+private:
+    // Decodes the response (or nullptr on failure) on the reader thread and
+    // returns the closure to run on the UI thread
+    typedef std::function<std::function<void()>(const void *)> Handler;
+
+    struct Pending
+    {
+        int request_type;
+        int expected_type;
+        Handler handler;
+    };
+
+    struct Completion
+    {
+        uint64_t id;
+        std::function<void()> fn;
+    };
+
+    int _fd;
+    bool _connected;
+    uint64_t _next_id;
+    // ID of the response being decoded by the reader thread (0 if none) and
+    // whether it was cancelled in the meantime
+    uint64_t _decoding_id;
+    bool _decoding_cancelled;
+    std::unordered_map<uint64_t, Pending> _pending;
+    std::deque<Completion> _completions;
+    WakeupCallback _wakeup;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::mutex _write_mutex;
+    std::thread _reader;
+
+    uint64_t submit(flatbuffers::FlatBufferBuilder *builder,
+                    const flatbuffers::Offset<void> &fb_request,
+                    int request_type, int expected_type, Handler handler);
+    void push_completion(uint64_t id, std::function<void()> fn);
+    void complete(uint64_t id, const Handler &handler, const void *response);
+    void reader_loop();
+};
+
 extern MbtoolConnection mbtool_connection;
 extern MbtoolInterface *mbtool_interface;
+extern MbtoolAsyncClient mbtool_async;
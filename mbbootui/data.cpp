@@ -20,6 +20,7 @@
 
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
 
 #include <cstdlib>
 #include <cstring>
@@ -47,6 +48,9 @@
 
 #define FILE_VERSION 0x00010010 // Do not set to 0
 
+// Maximum number of variables in the lookup table
+#define VALUE_TABLE_MAX 4096
+
 std::string DataManager::mBackingFile;
 int         DataManager::mInitialized = 0;
 InfoManager DataManager::mPersist;  // Data that that is not constant and will be saved to the settings file
@@ -61,12 +65,28 @@ pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
 
+// GetValue() is called by most GUI objects on every frame. Instead of checking
+// the const, persistent and data stores in turn while holding m_valuesLock,
+// readers look up the resolved value of a variable (or the fact that it is not
+// set) in this table under a shared lock. An entry is added the first time a
+// variable is read and is kept up to date by SetValue(). Writers always hold
+// m_valuesLock before gValueTableLock.
+struct ValueEntry
+{
+    std::string value;
+    bool defined;
+};
+
+static std::unordered_map<std::string, ValueEntry> gValueTable;
+static pthread_rwlock_t gValueTableLock = PTHREAD_RWLOCK_INITIALIZER;
+
 int DataManager::ResetDefaults()
 {
     pthread_mutex_lock(&m_valuesLock);
     mPersist.Clear();
     mData.Clear();
     mConst.Clear();
+    RebuildValueTable();
     pthread_mutex_unlock(&m_valuesLock);
 
     SetDefaultValues();
@@ -89,6 +109,7 @@ int DataManager::LoadValues(const std::string& filename)
     // Read in the file, if possible
     pthread_mutex_lock(&m_valuesLock);
     mPersist.LoadValues();
+    RebuildValueTable();
 
     if (!(tw_device.tw_flags() & mb::device::TwFlag::NoScreenTimeout)) {
         blankTimer.setTime(mPersist.GetIntValue(VAR_TW_SCREEN_TIMEOUT_SECS));
@@ -123,18 +144,19 @@ int DataManager::SaveValues()
 
 int DataManager::GetValue(const std::string& varName, std::string& value)
 {
-    std::string localStr = varName;
-    int ret = 0;
+    std::string stripped;
+    const std::string* name = &varName;
 
     if (!mInitialized) {
         SetDefaultValues();
     }
 
     // Strip off leading and trailing '%' if provided
-    if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%') {
-        localStr.erase(0, 1);
-        localStr.erase(localStr.length() - 1, 1);
+    if (varName.length() > 2 && varName[0] == '%' && varName[varName.length()-1] == '%') {
+        stripped = varName.substr(1, varName.length() - 2);
+        name = &stripped;
     }
+    const std::string& localStr = *name;
 
     // Handle magic values
     if (GetMagicValue(localStr, value) == 0) {
@@ -142,30 +164,87 @@ int DataManager::GetValue(const std::string& varName, std::string& value)
     }
 
     // Handle property
-    if (localStr.length() > 9 && localStr.substr(0, 9) == "property.") {
+    if (localStr.length() > 9 && localStr.compare(0, 9, "property.") == 0) {
         char property_value[PROPERTY_VALUE_MAX];
-        property_get(localStr.substr(9).c_str(), property_value, "");
+        property_get(localStr.c_str() + 9, property_value, "");
         value = property_value;
         return 0;
     }
 
-    pthread_mutex_lock(&m_valuesLock);
-    ret = mConst.GetValue(localStr, value);
-    if (ret == 0) {
-        goto exit;
+    return LookupValue(localStr, value);
+}
+
+// Find a variable in the stores. m_valuesLock must be held.
+int DataManager::ResolveValue(const std::string& varName, std::string& value)
+{
+    if (mConst.GetValue(varName, value) == 0) {
+        return 0;
+    }
+    if (mPersist.GetValue(varName, value) == 0) {
+        return 0;
     }
+    return mData.GetValue(varName, value);
+}
 
-    ret = mPersist.GetValue(localStr, value);
-    if (ret == 0) {
-        goto exit;
+int DataManager::LookupValue(const std::string& varName, std::string& value)
+{
+    int ret = -1;
+
+    pthread_rwlock_rdlock(&gValueTableLock);
+    auto it = gValueTable.find(varName);
+    if (it != gValueTable.end()) {
+        if (it->second.defined) {
+            value = it->second.value;
+            ret = 0;
+        }
+        pthread_rwlock_unlock(&gValueTableLock);
+        return ret;
     }
+    pthread_rwlock_unlock(&gValueTableLock);
 
-    ret = mData.GetValue(localStr, value);
-exit:
+    // First lookup of this variable
+    ValueEntry entry;
+
+    pthread_mutex_lock(&m_valuesLock);
+    entry.defined = ResolveValue(varName, entry.value) == 0;
+
+    pthread_rwlock_wrlock(&gValueTableLock);
+    if (gValueTable.size() < VALUE_TABLE_MAX) {
+        gValueTable[varName] = entry;
+    }
+    pthread_rwlock_unlock(&gValueTableLock);
     pthread_mutex_unlock(&m_valuesLock);
+
+    if (entry.defined) {
+        value = std::move(entry.value);
+        ret = 0;
+    }
     return ret;
 }
 
+// Update the table after a variable is set. m_valuesLock must be held.
+void DataManager::PublishValue(const std::string& varName, const std::string& value)
+{
+    pthread_rwlock_wrlock(&gValueTableLock);
+    auto it = gValueTable.find(varName);
+    if (it != gValueTable.end()) {
+        it->second.value = value;
+        it->second.defined = true;
+    }
+    pthread_rwlock_unlock(&gValueTableLock);
+}
+
+// Resolve all variables in the table again after the stores were changed
+// directly. m_valuesLock must be held.
+void DataManager::RebuildValueTable()
+{
+    pthread_rwlock_wrlock(&gValueTableLock);
+    for (auto& item : gValueTable) {
+        item.second.defined = ResolveValue(item.first, item.second.value) == 0;
+    }
+    pthread_rwlock_unlock(&gValueTableLock);
+}
+
 int DataManager::GetValue(const std::string& varName, int& value)
 {
     std::string data;
@@ -258,6 +337,7 @@ int DataManager::SetValue(const std::string& varName, const std::string& value,
             mData.SetValue(varName, value);
         }
     }
+    PublishValue(varName, value);
 
     pthread_mutex_unlock(&m_valuesLock);
 
@@ -482,6 +562,8 @@ void DataManager::SetDefaultValues()
     // Set default autoboot timeout to 5 seconds
     mPersist.SetValue(VAR_TW_AUTOBOOT_TIMEOUT, 5);
 
+    RebuildValueTable();
+
     pthread_mutex_unlock(&m_valuesLock);
 }
 
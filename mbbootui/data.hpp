@@ -68,6 +68,12 @@ protected:
 
     static int GetMagicValue(const std::string& varName, std::string& value);
 
+private:
+    static int ResolveValue(const std::string& varName, std::string& value);
+    static int LookupValue(const std::string& varName, std::string& value);
+    static void PublishValue(const std::string& varName, const std::string& value);
+    static void RebuildValueTable();
+
 private:
     static pthread_mutex_t m_valuesLock;
 };
@@ -19,6 +19,7 @@
 #include "gui/action.hpp"
 
 #include <algorithm>
+#include <deque>
 
 #include <cstring>
 
@@ -56,26 +57,43 @@ volatile GUIAction::AutobootSignal GUIAction::s_autoboot_signal =
 
 static void *ActionThread_work_wrapper(void *data);
 
+/*!
+ * Runs batches of actions on a worker thread, one batch at a time.
+ *
+ * Batches are queued in the order that they are triggered, so input that
+ * arrives while an action is running is serialized rather than dropped. A batch
+ * that is already queued or running is not queued again, which prevents eg. a
+ * double tap from switching ROMs twice. VAR_TW_ACTION_BUSY is set for as long
+ * as there is work left, so the theme can block input and show that the GUI is
+ * busy.
+ *
+ * The queue holds copies of the actions, not the GUIAction objects that
+ * triggered them, since those are deleted when the theme is reloaded. The
+ * actions are run on a GUIAction owned by the worker thread.
+ */
 class ActionThread
 {
 public:
+    typedef std::vector<GUIAction::Action> Batch;
+
     ActionThread();
     ~ActionThread();
 
-    void threadActions(GUIAction *act);
-    void run(void *data);
+    void threadActions(const Batch &batch);
+    void clear();
+    void stop();
+    void run();
 private:
     friend void *ActionThread_work_wrapper(void*);
-    struct ThreadData
-    {
-        ActionThread *this_;
-        GUIAction *act;
-        ThreadData(ActionThread *this_, GUIAction *act) : this_(this_), act(act) {}
-    };
 
     pthread_t m_thread;
     bool m_thread_running;
+    bool m_stop;
     pthread_mutex_t m_act_lock;
+    pthread_cond_t m_act_cond;
+    std::deque<Batch> m_queue;
+    bool m_busy;
+    Batch m_current;
 };
 
 static ActionThread action_thread; // for all kinds of longer running actions
@@ -83,56 +101,145 @@ static ActionThread cancel_thread; // for longer running "cancel" actions
 
 static void *ActionThread_work_wrapper(void *data)
 {
-    static_cast<ActionThread::ThreadData*>(data)->this_->run(data);
+    static_cast<ActionThread *>(data)->run();
     return nullptr;
 }
 
 ActionThread::ActionThread()
+    : m_thread_running(false)
+    , m_stop(false)
+    , m_busy(false)
 {
-    m_thread_running = false;
     pthread_mutex_init(&m_act_lock, nullptr);
+    pthread_cond_init(&m_act_cond, nullptr);
 }
 
+// stop() must have been called if the thread was started
 ActionThread::~ActionThread()
 {
-    pthread_mutex_lock(&m_act_lock);
-    if (m_thread_running) {
-        pthread_mutex_unlock(&m_act_lock);
-        pthread_join(m_thread, nullptr);
-    } else {
-        pthread_mutex_unlock(&m_act_lock);
-    }
+    pthread_cond_destroy(&m_act_cond);
     pthread_mutex_destroy(&m_act_lock);
 }
 
-void ActionThread::threadActions(GUIAction *act)
+void ActionThread::threadActions(const Batch &batch)
 {
     pthread_mutex_lock(&m_act_lock);
-    if (m_thread_running) {
+
+    if (m_stop) {
         pthread_mutex_unlock(&m_act_lock);
-        LOGE("Another threaded action is already running -- not running %zu actions starting with '%s'",
-             act->mActions.size(), act->mActions[0].mFunction.c_str());
-    } else {
-        m_thread_running = true;
+        return;
+    }
+
+    if ((m_busy && batch == m_current)
+            || std::find(m_queue.begin(), m_queue.end(), batch) != m_queue.end()) {
         pthread_mutex_unlock(&m_act_lock);
-        ThreadData *d = new ThreadData(this, act);
-        pthread_create(&m_thread, nullptr, &ActionThread_work_wrapper, d);
+        LOGW("Already running %zu actions starting with '%s' -- not queuing again",
+             batch.size(), batch[0].mFunction.c_str());
+        return;
+    }
+
+    if (!m_thread_running) {
+        int ret = pthread_create(&m_thread, nullptr,
+                                 &ActionThread_work_wrapper, this);
+        if (ret != 0) {
+            pthread_mutex_unlock(&m_act_lock);
+            LOGE("Failed to create action thread: %s", strerror(ret));
+            return;
+        }
+        m_thread_running = true;
     }
+
+    m_queue.push_back(batch);
+    DataManager::SetValue(VAR_TW_ACTION_BUSY, 1);
+    pthread_cond_signal(&m_act_cond);
+
+    pthread_mutex_unlock(&m_act_lock);
 }
 
-void ActionThread::run(void *data)
+/*!
+ * Drop the batches that haven't started yet. The running batch, if any, is
+ * left to finish.
+ */
+void ActionThread::clear()
 {
-    ThreadData *d = (ThreadData*) data;
-    GUIAction* act = d->act;
+    pthread_mutex_lock(&m_act_lock);
 
-    for (auto it = act->mActions.begin(); it != act->mActions.end(); ++it) {
-        act->doAction(*it);
+    m_queue.clear();
+    if (!m_busy && m_thread_running) {
+        DataManager::SetValue(VAR_TW_ACTION_BUSY, 0);
     }
 
+    pthread_mutex_unlock(&m_act_lock);
+}
+
+/*!
+ * Drop the queued batches, wait for the running batch to finish, and join the
+ * thread. No more batches are accepted afterwards.
+ */
+void ActionThread::stop()
+{
     pthread_mutex_lock(&m_act_lock);
+    m_stop = true;
+    m_queue.clear();
+    pthread_cond_signal(&m_act_cond);
+    bool running = m_thread_running;
     m_thread_running = false;
     pthread_mutex_unlock(&m_act_lock);
-    delete d;
+
+    if (running) {
+        pthread_join(m_thread, nullptr);
+    }
+}
+
+void ActionThread::run()
+{
+    GUIAction runner(nullptr);
+
+    pthread_mutex_lock(&m_act_lock);
+
+    while (true) {
+        while (!m_stop && m_queue.empty()) {
+            pthread_cond_wait(&m_act_cond, &m_act_lock);
+        }
+        if (m_stop) {
+            break;
+        }
+
+        m_current = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_busy = true;
+        pthread_mutex_unlock(&m_act_lock);
+
+        // operation_end() clears the busy flag, so set it again for the
+        // remaining actions in the batch
+        DataManager::SetValue(VAR_TW_ACTION_BUSY, 1);
+
+        // m_current is only modified by this thread
+        for (auto const &action : m_current) {
+            runner.doAction(action);
+        }
+
+        pthread_mutex_lock(&m_act_lock);
+        m_busy = false;
+        m_current.clear();
+        if (m_queue.empty()) {
+            DataManager::SetValue(VAR_TW_ACTION_BUSY, 0);
+        }
+    }
+
+    pthread_mutex_unlock(&m_act_lock);
+}
+
+void GUIAction::ClearQueuedActions()
+{
+    action_thread.clear();
+    cancel_thread.clear();
+}
+
+void GUIAction::StopActionThreads()
+{
+    action_thread.stop();
+    cancel_thread.stop();
 }
 
 GUIAction::GUIAction(xml_node<>* node)
@@ -150,7 +257,6 @@ GUIAction::GUIAction(xml_node<>* node)
 #define ADD_ACTION(n) mf[#n] = &GUIAction::n
 #define ADD_ACTION_EX(name, func) mf[name] = &GUIAction::func
         // These actions will be run in the caller's thread
-        ADD_ACTION(reboot);
         ADD_ACTION(home);
         ADD_ACTION(key);
         ADD_ACTION(page);
@@ -162,7 +268,6 @@ GUIAction::GUIAction(xml_node<>* node)
         ADD_ACTION_EX("addsubtract", compute);
         ADD_ACTION(setguitimezone);
         ADD_ACTION(overlay);
-        ADD_ACTION(sleep);
         ADD_ACTION(screenshot);
         ADD_ACTION(setbrightness);
         ADD_ACTION(setlanguage);
@@ -177,6 +282,8 @@ GUIAction::GUIAction(xml_node<>* node)
         // These actions will run in a separate thread
         ADD_ACTION(autoboot);
         ADD_ACTION(switch_rom);
+        ADD_ACTION(reboot);
+        ADD_ACTION(sleep);
     }
 
     // First, get the action
@@ -341,11 +448,11 @@ int GUIAction::doActions()
     // Now run the actions in the desired thread.
     switch (threadType) {
     case THREAD_ACTION:
-        action_thread.threadActions(this);
+        action_thread.threadActions(mActions);
         break;
 
     case THREAD_CANCEL:
-        cancel_thread.threadActions(this);
+        cancel_thread.threadActions(mActions);
         break;
 
     default: {
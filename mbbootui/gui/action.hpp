@@ -37,15 +37,29 @@ public:
     virtual int NotifyKey(int key, bool down);
     virtual int NotifyVarChange(const std::string& varName,
                                 const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars __unused)
+    {
+        return false;
+    }
 
     int doActions();
 
+    // Drop threaded actions that haven't started yet
+    static void ClearQueuedActions();
+    // Wait for the running threaded actions and stop the action threads
+    static void StopActionThreads();
+
 protected:
     class Action
     {
     public:
         std::string mFunction;
         std::string mArg;
+
+        bool operator==(const Action& other) const
+        {
+            return mFunction == other.mFunction && mArg == other.mArg;
+        }
     };
 
     std::vector<Action> mActions;
@@ -78,6 +78,12 @@ int GUIAnimation::Render()
     return 0;
 }
 
+int GUIAnimation::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    // Frames are always drawn at the same position and size
+    return GetRenderPos(x, y, w, h);
+}
+
 int GUIAnimation::Update()
 {
     if (!isConditionTrue()) {
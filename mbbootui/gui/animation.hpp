@@ -35,6 +35,9 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    // GetDamageRect - Returns the region that may have changed on Update()
+    virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
 protected:
     AnimationResource* mAnimation;
     int mFrame;
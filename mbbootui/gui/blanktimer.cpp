@@ -85,6 +85,31 @@ void blanktimer::checkForTimeout()
     }
 }
 
+int blanktimer::getTimeoutMs()
+{
+    if (tw_device.tw_flags() & mb::device::TwFlag::NoScreenTimeout) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&mutex);
+    int64_t deadline = -1;
+    // These match the whole second comparisons in checkForTimeout()
+    if (sleepTimer > 2 && state == kOn) {
+        deadline = (sleepTimer - 1) * 1000;
+    } else if (sleepTimer && state < kOff) {
+        deadline = (sleepTimer + 1) * 1000;
+    }
+    timespec curTime;
+    clock_gettime(CLOCK_MONOTONIC, &curTime);
+    int64_t elapsed = mb::util::timespec_diff_ms(btimer, curTime);
+    pthread_mutex_unlock(&mutex);
+
+    if (deadline < 0) {
+        return -1;
+    }
+    return deadline > elapsed ? static_cast<int>(deadline - elapsed) : 0;
+}
+
 std::string blanktimer::getBrightness()
 {
     std::string result;
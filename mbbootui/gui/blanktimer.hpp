@@ -34,6 +34,10 @@ public:
     // call this in regular intervals
     void checkForTimeout();
 
+    // milliseconds until checkForTimeout() needs to be called or -1 if the
+    // screen will not dim or turn off by itself
+    int getTimeoutMs();
+
     // call this when an input event is received or when an operation is finished
     void resetTimerAndUnblank();
 
@@ -307,6 +307,15 @@ int GUIConsole::Update()
     return 0;
 }
 
+int GUIConsole::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    // The slideout button is outside of the list
+    if (mSlideout) {
+        return -1;
+    }
+    return GUIScrollList::GetDamageRect(x, y, w, h);
+}
+
 // IsInRegion - Checks if the request is handled by this object
 //  Return 1 if this object handles the request, 0 if not
 int GUIConsole::IsInRegion(int x, int y)
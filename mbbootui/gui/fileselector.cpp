@@ -19,17 +19,222 @@
 #include "gui/fileselector.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
+#include <cerrno>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "mblog/logging.h"
 
 #include "data.hpp"
 
+// Number of entries read before they are handed to the GUI thread
+#define LISTING_BATCH_SIZE      64
+// Number of directories kept in the listing cache
+#define DIR_CACHE_MAX           16
+
+// Events that may change the contents of a cached listing
+#define DIR_WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+            | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct GUIFileSelector::Listing
+{
+    std::string folder;
+    DIR* dir;
+    bool watched; // changes are reported by the cache while reading
+    bool refresh; // keep showing the old lists until reading is done
+    std::vector<FileData> entries; // entries merged so far (GUI thread only)
+
+    std::atomic<bool> cancelled;
+    std::mutex mutex;
+    // protected by mutex
+    std::vector<FileData> batch; // read, but not merged yet
+    bool done;
+
+    Listing() : dir(nullptr), watched(false), refresh(false),
+            cancelled(false), done(false)
+    {
+    }
+};
+
+/*
+DirCache keeps the unfiltered entries of recently listed directories. Each
+directory is watched with inotify before it is read and its entry is dropped
+as soon as anything inside it changes. It is only used from the GUI thread.
+*/
+struct GUIFileSelector::DirCache
+{
+    struct Dir
+    {
+        std::vector<FileData> entries;
+        bool valid; // entries are complete and up to date
+        int wd;
+        unsigned long lastUse;
+    };
+
+    int fd;
+    std::unordered_map<std::string, Dir> dirs;
+    unsigned long useCounter;
+
+    DirCache() : fd(-1), useCounter(0)
+    {
+    }
+
+    ~DirCache()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Start watching a directory before it is read. Returns false if changes
+    // cannot be detected, in which case the listing must not be cached.
+    bool watch(const std::string& folder)
+    {
+        auto it = dirs.find(folder);
+        if (it != dirs.end()) {
+            it->second.lastUse = ++useCounter;
+            return true;
+        }
+
+        if (fd < 0) {
+            fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd < 0) {
+                LOGW("Failed to initialize inotify: %s", strerror(errno));
+                return false;
+            }
+        }
+
+        if (dirs.size() >= DIR_CACHE_MAX) {
+            auto oldest = dirs.begin();
+            for (auto iter = dirs.begin(); iter != dirs.end(); ++iter) {
+                if (iter->second.lastUse < oldest->second.lastUse) {
+                    oldest = iter;
+                }
+            }
+            remove(oldest);
+        }
+
+        int wd = inotify_add_watch(fd, folder.c_str(), DIR_WATCH_MASK);
+        if (wd < 0) {
+            LOGW("%s: Failed to add inotify watch: %s",
+                 folder.c_str(), strerror(errno));
+            return false;
+        }
+
+        Dir& dir = dirs[folder];
+        dir.valid = false;
+        dir.wd = wd;
+        dir.lastUse = ++useCounter;
+        return true;
+    }
+
+    const std::vector<FileData>* find(const std::string& folder)
+    {
+        auto it = dirs.find(folder);
+        if (it == dirs.end() || !it->second.valid) {
+            return nullptr;
+        }
+        it->second.lastUse = ++useCounter;
+        return &it->second.entries;
+    }
+
+    bool contains(const std::string& folder) const
+    {
+        auto it = dirs.find(folder);
+        return it != dirs.end() && it->second.valid;
+    }
+
+    // Returns false if the directory changed since watch() was called
+    bool store(const std::string& folder, std::vector<FileData>&& entries)
+    {
+        auto it = dirs.find(folder);
+        if (it == dirs.end()) {
+            return false;
+        }
+        it->second.entries = std::move(entries);
+        it->second.valid = true;
+        return true;
+    }
+
+    // Drop the entries of all directories that changed
+    void readEvents()
+    {
+        if (fd < 0) {
+            return;
+        }
+
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* ptr = buf; ptr < buf + n;) {
+                struct inotify_event* event = (struct inotify_event*) ptr;
+                ptr += sizeof(struct inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    while (!dirs.empty()) {
+                        remove(dirs.begin());
+                    }
+                    continue;
+                }
+
+                for (auto iter = dirs.begin(); iter != dirs.end(); ++iter) {
+                    if (iter->second.wd == event->wd) {
+                        if (event->mask & IN_IGNORED) {
+                            // the kernel already removed the watch
+                            dirs.erase(iter);
+                        } else {
+                            remove(iter);
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    void remove(std::unordered_map<std::string, Dir>::iterator iter)
+    {
+        inotify_rm_watch(fd, iter->second.wd);
+        dirs.erase(iter);
+    }
+};
+
 int GUIFileSelector::mSortOrder = 0;
+GUIFileSelector::DirCache GUIFileSelector::sDirCache;
+
+static unsigned char mode_to_dtype(mode_t mode)
+{
+    if (S_ISDIR(mode)) {
+        return DT_DIR;
+    } else if (S_ISBLK(mode)) {
+        return DT_BLK;
+    } else if (S_ISCHR(mode)) {
+        return DT_CHR;
+    } else if (S_ISFIFO(mode)) {
+        return DT_FIFO;
+    } else if (S_ISLNK(mode)) {
+        return DT_LNK;
+    } else if (S_ISREG(mode)) {
+        return DT_REG;
+    } else if (S_ISSOCK(mode)) {
+        return DT_SOCK;
+    }
+    return DT_UNKNOWN;
+}
 
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 {
@@ -41,6 +246,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
     mUpdate = 0;
     mPathVar = "cwd";
     updateFileList = false;
+    mLoadedCached = false;
 
     // Load filter for filtering files (e.g. *.zip for only zips)
     child = FindNode(node, "filter");
@@ -131,6 +337,10 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+    // The reader thread owns its own reference
+    if (mListing) {
+        mListing->cancelled = true;
+    }
 }
 
 int GUIFileSelector::Update()
@@ -141,6 +351,14 @@ int GUIFileSelector::Update()
 
     GUIScrollList::Update();
 
+    sDirCache.readEvents();
+
+    // Reload the list when the folder changed on disk
+    if (!mListing && mLoadedCached && !sDirCache.contains(mLoadedFolder)) {
+        mLoadedCached = false;
+        updateFileList = true;
+    }
+
     // Update the file list if needed
     if (updateFileList) {
         std::string value;
@@ -153,11 +371,14 @@ int GUIFileSelector::Update()
         }
     }
 
+    if (mListing && MergeListing()) {
+        mUpdate = 1;
+    }
+
     if (mUpdate) {
+        // The page redraws the list's region on the next render
         mUpdate = 0;
-        if (Render() == 0) {
-            return 2;
-        }
+        return 2;
     }
     return 0;
 }
@@ -192,7 +413,29 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName,
     return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+int GUIFileSelector::Render()
+{
+    if (!isConditionTrue()) {
+        return 0;
+    }
+
+    int ret = GUIScrollList::Render();
+
+    // Show a placeholder after the entries that were already read
+    size_t count = GetItemCount();
+    if (ret == 0 && mListing && !mListing->refresh
+            && count < (size_t) GetDisplayItemCount()) {
+        gr_clip(mRenderX, mRenderY, mRenderW, mRenderH);
+        int yPos = mRenderY + mHeaderH + count * actualItemHeight;
+        RenderStdItem(yPos, false, nullptr,
+                      gui_lookup("loading", "Loading...").c_str());
+        gr_noclip();
+    }
+
+    return ret;
+}
+
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
     if (d1.fileName == ".") {
         return -1;
@@ -242,19 +485,47 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
     return 0;
 }
 
+// Start reading a folder. The lists are filled in by Update() as entries
+// arrive, unless the folder is in the cache.
 int GUIFileSelector::GetFileList(const std::string& folder)
 {
-    DIR* d;
-    struct dirent* de;
-    struct stat st;
+    if (mListing) {
+        if (mListing->folder == folder) {
+            // Only the sort order changed, keep reading
+            SetEntries(mListing->entries);
+            return 0;
+        }
+        mListing->cancelled = true;
+        mListing.reset();
+    }
 
-    // Clear all data
-    mFolderList.clear();
-    mFileList.clear();
+    const std::vector<FileData>* cached = sDirCache.find(folder);
+    if (cached) {
+        SetEntries(*cached);
+        mLoadedFolder = folder;
+        mLoadedCached = true;
+        return 0;
+    }
 
-    d = opendir(folder.c_str());
+    bool refresh = folder == mLoadedFolder;
+    mLoadedFolder.clear();
+    mLoadedCached = false;
+
+    if (!refresh) {
+        // Clear all data
+        mFolderList.clear();
+        mFileList.clear();
+    }
+
+    // Watch the folder before reading it so that changes made while reading
+    // are not missed
+    bool watched = sDirCache.watch(folder);
+
+    DIR* d = opendir(folder.c_str());
     if (d == nullptr) {
         LOGI("Unable to open '%s'", folder.c_str());
+        mFolderList.clear();
+        mFileList.clear();
         if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
             size_t found;
             found = folder.find_last_of('/');
@@ -270,65 +541,153 @@ int GUIFileSelector::GetFileList(const std::string& folder)
         return -1;
     }
 
-    while ((de = readdir(d)) != nullptr) {
-        FileData data;
+    std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+    listing->folder = folder;
+    listing->dir = d;
+    listing->watched = watched;
+    listing->refresh = refresh;
+
+    std::thread(ReadDirectory, listing).detach();
+
+    mListing = listing;
+    mLoadedFolder = folder;
+    return 0;
+}
+
+// Runs on its own thread
+void GUIFileSelector::ReadDirectory(std::shared_ptr<Listing> listing)
+{
+    std::vector<FileData> batch;
+    struct dirent* de;
+    struct stat st;
+    int dfd = dirfd(listing->dir);
+
+    while (!listing->cancelled && (de = readdir(listing->dir)) != nullptr) {
+        FileData data = FileData();
 
         data.fileName = de->d_name;
         if (data.fileName == ".") {
             continue;
         }
-        if (data.fileName == ".." && folder == "/") {
+        if (data.fileName == ".." && listing->folder == "/") {
             continue;
         }
 
         data.fileType = de->d_type;
 
-        std::string path = folder + "/" + data.fileName;
-        stat(path.c_str(), &st);
-        data.protection = st.st_mode;
-        data.userId = st.st_uid;
-        data.groupId = st.st_gid;
-        data.fileSize = st.st_size;
-        data.lastAccess = st.st_atime;
-        data.lastModified = st.st_mtime;
-        data.lastStatChange = st.st_ctime;
-
-        if (data.fileType == DT_UNKNOWN) {
-            struct stat sb;
-            if (stat(path.c_str(), &sb) == 0) {
-                if (sb.st_mode & S_IFDIR) {
-                    data.fileType = DT_DIR;
-                } else if (sb.st_mode & S_IFBLK) {
-                    data.fileType = DT_BLK;
-                } else if (sb.st_mode & S_IFCHR) {
-                    data.fileType = DT_CHR;
-                } else if (sb.st_mode & S_IFIFO) {
-                    data.fileType = DT_FIFO;
-                } else if (sb.st_mode & S_IFLNK) {
-                    data.fileType = DT_LNK;
-                } else if (sb.st_mode & S_IFREG) {
-                    data.fileType = DT_REG;
-                } else if (sb.st_mode & S_IFSOCK) {
-                    data.fileType = DT_SOCK;
-                }
+        if (fstatat(dfd, de->d_name, &st, 0) == 0) {
+            data.protection = st.st_mode;
+            data.userId = st.st_uid;
+            data.groupId = st.st_gid;
+            data.fileSize = st.st_size;
+            data.lastAccess = st.st_atime;
+            data.lastModified = st.st_mtime;
+            data.lastStatChange = st.st_ctime;
+
+            if (data.fileType == DT_UNKNOWN) {
+                data.fileType = mode_to_dtype(st.st_mode);
+            }
+        }
+
+        batch.push_back(std::move(data));
+
+        if (batch.size() >= LISTING_BATCH_SIZE) {
+            std::lock_guard<std::mutex> lock(listing->mutex);
+            std::move(batch.begin(), batch.end(),
+                      std::back_inserter(listing->batch));
+            batch.clear();
+        }
+    }
+
+    closedir(listing->dir);
+    listing->dir = nullptr;
+
+    std::lock_guard<std::mutex> lock(listing->mutex);
+    std::move(batch.begin(), batch.end(), std::back_inserter(listing->batch));
+    listing->done = true;
+}
+
+// Add the entries read since the last call to the lists. Returns true if the
+// displayed lists changed.
+bool GUIFileSelector::MergeListing()
+{
+    std::vector<FileData> batch;
+    bool done;
+
+    {
+        std::lock_guard<std::mutex> lock(mListing->mutex);
+        batch.swap(mListing->batch);
+        done = mListing->done;
+    }
+
+    bool changed = false;
+    std::vector<FileData>& entries = mListing->entries;
+
+    if (!batch.empty()) {
+        if (!mListing->refresh) {
+            AddEntries(batch);
+            changed = true;
+        }
+        std::move(batch.begin(), batch.end(), std::back_inserter(entries));
+    }
+
+    if (done) {
+        if (mListing->refresh) {
+            SetEntries(entries);
+        }
+        if (mListing->watched) {
+            // If the folder changed while reading, it is read again
+            mLoadedCached = true;
+            if (!sDirCache.store(mListing->folder, std::move(entries))) {
+                mLoadedCached = false;
+                updateFileList = true;
             }
         }
+        // remove the placeholder
+        mListing.reset();
+        changed = true;
+    }
+
+    return changed;
+}
+
+// Filter and merge entries into the sorted lists
+void GUIFileSelector::AddEntries(const std::vector<FileData>& entries)
+{
+    std::vector<FileData> folders;
+    std::vector<FileData> files;
+
+    for (const FileData& data : entries) {
         if (data.fileType == DT_DIR) {
             if (mShowNavFolders || (data.fileName != "." && data.fileName != "..")) {
-                mFolderList.push_back(data);
+                folders.push_back(data);
             }
         } else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
             if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-                mFileList.push_back(data);
+                files.push_back(data);
             }
         }
     }
-    closedir(d);
 
-    std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-    std::sort(mFileList.begin(), mFileList.end(), fileSort);
+    std::sort(folders.begin(), folders.end(), fileSort);
+    std::sort(files.begin(), files.end(), fileSort);
 
-    return 0;
+    size_t n = mFolderList.size();
+    std::move(folders.begin(), folders.end(), std::back_inserter(mFolderList));
+    std::inplace_merge(mFolderList.begin(), mFolderList.begin() + n,
+                       mFolderList.end(), fileSort);
+
+    n = mFileList.size();
+    std::move(files.begin(), files.end(), std::back_inserter(mFileList));
+    std::inplace_merge(mFileList.begin(), mFileList.begin() + n,
+                       mFileList.end(), fileSort);
+}
+
+void GUIFileSelector::SetEntries(const std::vector<FileData>& entries)
+{
+    mFolderList.clear();
+    mFileList.clear();
+    AddEntries(entries);
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
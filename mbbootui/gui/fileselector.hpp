@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <memory>
+
 #include "gui/scrolllist.hpp"
 
 class GUIFileSelector : public GUIScrollList
@@ -31,6 +33,10 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    // Render - Render the full object to the GL surface
+    //  Return 0 on success, <0 on error
+    virtual int Render();
+
     // NotifyVarChange - Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
@@ -54,9 +60,16 @@ protected:
         time_t lastStatChange;  // Uses time_t format from stat
     };
 
+    struct Listing; // directory being read in the background
+    struct DirCache; // contents of recently listed directories
+
 protected:
     virtual int GetFileList(const std::string& folder);
-    static bool fileSort(FileData d1, FileData d2);
+    static bool fileSort(const FileData& d1, const FileData& d2);
+    static void ReadDirectory(std::shared_ptr<Listing> listing);
+    bool MergeListing();
+    void AddEntries(const std::vector<FileData>& entries);
+    void SetEntries(const std::vector<FileData>& entries);
 
 protected:
     std::vector<FileData> mFolderList;
@@ -73,4 +86,8 @@ protected:
     ImageResource* mFolderIcon;
     ImageResource* mFileIcon;
     bool updateFileList;
+    std::shared_ptr<Listing> mListing; // set while the directory is being read
+    std::string mLoadedFolder; // folder that the lists were read from
+    bool mLoadedCached; // indicates that the lists match an entry in the cache
+    static DirCache sDirCache;
 };
@@ -18,15 +18,26 @@
 
 #include "gui/gui.h"
 
+#include <algorithm>
 #include <atomic>
 
+#include <cerrno>
+#include <cstring>
+
 #include <linux/input.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
+#include "mbcommon/metrics.h"
 #include "mblog/logging.h"
+#include "mblog/metrics.h"
 #include "mbutil/path.h"
 #include "mbutil/time.h"
 
+#include "daemon_connection.h"
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "variables.h"
@@ -65,6 +76,27 @@ void terminal_pty_read();
 
 static int gRecorder = -1;
 
+// The render loop blocks in one epoll on the input devices, the terminal pty,
+// a timerfd for the next deadline and an eventfd that other threads signal with
+// gui_wakeup() when something needs to be redrawn
+enum LoopSource : uint32_t
+{
+    LOOP_INPUT,
+    LOOP_WAKE,
+    LOOP_TIMER,
+    LOOP_PTY,
+};
+
+static int gLoopEpollFd = -1;
+static int gWakeFd = -1;
+static int gTimerFd = -1;
+
+// Frames are drawn at most 30 times per second
+#define FRAME_INTERVAL_NS   33333333LL
+// Without the event loop, the render loop still wakes up this often to watch
+// for changes
+#define FALLBACK_IDLE_MS    1000
+
 void gr_write_frame_to_file(int fd);
 
 void flip()
@@ -114,6 +146,12 @@ public:
     // process input events. returns true if any event was received.
     bool processInput(int timeout_ms);
 
+    // whether a touch or key is held down and needs hold/repeat processing
+    bool isHolding() const
+    {
+        return touch_status != TS_NONE || key_status != KS_NONE;
+    }
+
     void handleDrag();
 
 private:
@@ -359,46 +397,253 @@ void InputHandler::handleDrag()
     }
 }
 
-// Get and dispatch input events until it's time to draw the next frame
-// This special function will return immediately the first time, but then
-// always returns 1/30th of a second (or immediately if called later) from
-// the last time it was called
-static void loopTimer(int input_timeout_ms)
+static int64_t monotonicNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// Monotonic time at which the wall clock reaches the next full minute
+static int64_t nextMinuteNs(int64_t now)
+{
+    timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    int64_t into = static_cast<int64_t>(rt.tv_sec % 60) * 1000000000LL
+            + rt.tv_nsec;
+    return now + 60000000000LL - into;
+}
+
+static bool initEventLoop()
+{
+    gLoopEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    gWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    gTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    bool ok = gLoopEpollFd >= 0 && gWakeFd >= 0 && gTimerFd >= 0;
+
+    if (ok) {
+        epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+
+        event.data.u32 = LOOP_WAKE;
+        ok = epoll_ctl(gLoopEpollFd, EPOLL_CTL_ADD, gWakeFd, &event) == 0;
+        if (ok) {
+            event.data.u32 = LOOP_TIMER;
+            ok = epoll_ctl(gLoopEpollFd, EPOLL_CTL_ADD, gTimerFd, &event) == 0;
+        }
+    }
+
+    if (!ok) {
+        LOGW("Failed to set up render loop wakeups: %s", strerror(errno));
+        if (gLoopEpollFd >= 0) {
+            close(gLoopEpollFd);
+            gLoopEpollFd = -1;
+        }
+        if (gTimerFd >= 0) {
+            close(gTimerFd);
+            gTimerFd = -1;
+        }
+        // gWakeFd may already be in use by other threads, so it is kept
+    }
+
+    return ok;
+}
+
+// Make sure that an fd is in the loop's epoll set. The fd may have been closed
+// and reopened with the same number since the last call, which silently drops
+// it from the set, so this checks for the current file.
+static void watchLoopFd(int fd, uint32_t source)
+{
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+
+    if (epoll_ctl(gLoopEpollFd, EPOLL_CTL_MOD, fd, &event) < 0
+            && errno == ENOENT
+            && epoll_ctl(gLoopEpollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        LOGW("Failed to watch fd %d in render loop: %s", fd, strerror(errno));
+    }
+}
+
+// Arm the timerfd for an absolute monotonic deadline or disarm it if the
+// deadline is negative
+static void armLoopTimer(int64_t deadline)
+{
+    itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    if (deadline >= 0) {
+        // A zero value would disarm the timer
+        deadline = std::max<int64_t>(deadline, 1);
+        its.it_value.tv_sec = deadline / 1000000000LL;
+        its.it_value.tv_nsec = deadline % 1000000000LL;
+    }
+
+    timerfd_settime(gTimerFd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+// Text with clock, battery or temperature values has nothing to notify it when
+// they change. Poke those objects once a minute while the loop is idle.
+static void refreshMagicValues()
+{
+    PageManager::NotifyVarChange(VAR_TW_TIME, "");
+    PageManager::NotifyVarChange(VAR_TW_BATTERY, "");
+    PageManager::NotifyVarChange(VAR_TW_CPU_TEMP, "");
+}
+
+// Reset an eventfd or timerfd. Returns whether it had been signalled.
+static bool clearCounterFd(int fd)
+{
+    uint64_t value;
+    return read(fd, &value, sizeof(value)) == sizeof(value);
+}
+
+static void readPtyIfReady()
+{
+    if (g_pty_fd > 0) {
+        pollfd pfd;
+        pfd.fd = g_pty_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) > 0) {
+            terminal_pty_read();
+        }
+    }
+}
+
+// Get and dispatch input events until the loop has something to do. While
+// something on screen is changing (idle is false), this returns once per frame.
+// Otherwise, this only returns when input arrives, another thread calls
+// gui_wakeup(), the screen is due to dim or turn off, or the clock needs
+// updating. The first call returns immediately.
+static void waitForEvents(bool idle)
 {
-    static timespec lastCall;
+    static int64_t lastCall;
+    static int64_t nextMagicRefresh;
     static int initialized = 0;
 
     if (!initialized) {
-        clock_gettime(CLOCK_MONOTONIC, &lastCall);
+        lastCall = monotonicNs();
+        nextMagicRefresh = nextMinuteNs(lastCall);
         initialized = 1;
         return;
     }
 
-    do {
-        bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
-        timespec curTime, diff;
-        clock_gettime(CLOCK_MONOTONIC, &curTime);
-
-        mb::util::timespec_diff(lastCall, curTime, &diff);
+    bool got_event = false;
 
-        // This is really 2 or 30 times per second
-        // As long as we get events, increase the timeout so we can catch up with input
-        long timeout = got_event ? 500000000 : 33333333;
+    for (;;) {
+        // get inputs but don't send drag notices
+        while (input_handler.processInput(0)) {
+            got_event = true;
+        }
 
-        if (diff.tv_sec || diff.tv_nsec > timeout) {
-            // int64_t input_time = mb::util::timespec_diff_ms(lastCall, curTime);
-            // LOGI("loopTimer(): %" PRId64 " ms, count: %u", input_time, count);
+        int64_t now = monotonicNs();
+        // Touch and key repeats are checked once per frame
+        bool frame_due = !idle || got_event || input_handler.isHolding();
 
-            lastCall = curTime;
+        if (frame_due && now - lastCall >= FRAME_INTERVAL_NS) {
+            lastCall = now;
             input_handler.handleDrag(); // send only drag notices if needed
             return;
         }
 
-        // We need to sleep some period time microseconds
-        //unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-        //usleep(sleepTime); // removed so we can scan for input
-        input_timeout_ms = 0;
-    } while (1);
+        int64_t deadline;
+        if (frame_due) {
+            deadline = lastCall + FRAME_INTERVAL_NS;
+        } else {
+            if (now >= nextMagicRefresh) {
+                nextMagicRefresh = nextMinuteNs(now);
+                refreshMagicValues();
+                return;
+            }
+
+            int blank_ms = blankTimer.getTimeoutMs();
+            if (blank_ms == 0) {
+                return;
+            }
+
+            deadline = nextMagicRefresh;
+            if (blank_ms > 0) {
+                deadline = std::min<int64_t>(deadline, now + blank_ms * 1000000LL);
+            }
+        }
+
+        int input_fd = ev_get_fd();
+
+        if (gLoopEpollFd < 0 || input_fd < 0) {
+            // Wait for input the old way and wake up regularly so that changes
+            // made by other threads are noticed
+            int64_t timeout = std::min<int64_t>(
+                    (deadline - now + 999999) / 1000000, FALLBACK_IDLE_MS);
+            if (input_handler.processInput(timeout)) {
+                got_event = true;
+            }
+            readPtyIfReady();
+            if (!frame_due && !got_event && monotonicNs() < deadline) {
+                return;
+            }
+            continue;
+        }
+
+        watchLoopFd(input_fd, LOOP_INPUT);
+        if (g_pty_fd > 0) {
+            watchLoopFd(g_pty_fd, LOOP_PTY);
+        }
+        armLoopTimer(deadline);
+
+        epoll_event events[4];
+        int n = epoll_wait(gLoopEpollFd, events, 4, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to wait for render loop events: %s", strerror(errno));
+            // Don't spin if this keeps failing
+            usleep(FRAME_INTERVAL_NS / 1000);
+            return;
+        }
+
+        bool woken = false;
+
+        for (int i = 0; i < n; ++i) {
+            switch (events[i].data.u32) {
+            case LOOP_INPUT:
+                // Read at the start of the next iteration
+                break;
+            case LOOP_WAKE:
+                if (clearCounterFd(gWakeFd)) {
+                    woken = true;
+                }
+                break;
+            case LOOP_TIMER:
+                // The deadline is checked at the start of the next iteration
+                clearCounterFd(gTimerFd);
+                break;
+            case LOOP_PTY:
+                terminal_pty_read();
+                woken = true;
+                break;
+            }
+        }
+
+        if (woken) {
+            lastCall = monotonicNs();
+            input_handler.handleDrag();
+            return;
+        }
+    }
+}
+
+// Render the current page. If only some objects changed, drawing is limited to
+// the region that they occupy.
+static void renderPage()
+{
+    gr_clip_to_damage();
+    PageManager::Render();
+    gr_noclip_damage();
 }
 
 static int runPages(const char *page_name, const int stop_on_page_done)
@@ -415,25 +660,22 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
     DataManager::SetValue(VAR_TW_LOADED, 1);
 
-    struct timeval timeout;
-    fd_set fdset;
-    int has_data = 0;
-
-    int input_timeout_ms = 0;
+    bool idle = false;
     int idle_frames = 0;
 
+    mbtool_async.set_wakeup_callback(gui_wakeup);
+
+    mb::Histogram &render_time =
+            mb::MetricsRegistry::global().histogram("mbbootui.render_us");
+    mb::Histogram &flip_time =
+            mb::MetricsRegistry::global().histogram("mbbootui.flip_us");
+
     for (;;) {
-        loopTimer(input_timeout_ms);
-        if (g_pty_fd > 0) {
-            // TODO: this is not nice, we should have one central select for input, pty
-            FD_ZERO(&fdset);
-            FD_SET(g_pty_fd, &fdset);
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 1;
-            has_data = select(g_pty_fd + 1, &fdset, nullptr, nullptr, &timeout);
-            if (has_data > 0) {
-                terminal_pty_read();
-            }
+        waitForEvents(idle);
+
+        // Deliver daemon responses before the objects are updated
+        if (mbtool_async.run_completions() > 0) {
+            idle_frames = 0;
         }
 
         if (!gForceRender) {
@@ -445,41 +687,38 @@ static int runPages(const char *page_name, const int stop_on_page_done)
             } else {
                 idle_frames = 0;
             }
-            // due to possible animation objects, we need to delay activating the input timeout
-            input_timeout_ms = idle_frames > 15 ? 1000 : 0;
-
-#ifndef PRINT_RENDER_TIME
-            if (ret > 1) {
-                PageManager::Render();
-            }
+            // due to possible animation objects, we need to delay going idle
+            idle = idle_frames > 15;
 
-            if (ret > 0) {
-                flip();
-            }
-#else
             if (ret > 1) {
                 timespec start, end;
-                int64_t render_t, flip_t;
                 clock_gettime(CLOCK_MONOTONIC, &start);
-                PageManager::Render();
+                renderPage();
                 clock_gettime(CLOCK_MONOTONIC, &end);
-                render_t = mb::util::timespec_diff_ms(start, end);
+                int64_t render_us = mb::util::timespec_diff_us(start, end);
 
                 flip();
                 clock_gettime(CLOCK_MONOTONIC, &start);
-                flip_t = mb::util::timespec_diff_ms(end, start);
+                int64_t flip_us = mb::util::timespec_diff_us(end, start);
 
+                render_time.record(static_cast<uint64_t>(render_us));
+                flip_time.record(static_cast<uint64_t>(flip_us));
+
+#ifdef PRINT_RENDER_TIME
                 LOGI("Render(): %" PRId64 " ms, flip(): %" PRId64 " ms, total: %" PRId64 " ms",
-                     render_t, flip_t, render_t + flip_t);
+                     render_us / 1000, flip_us / 1000,
+                     (render_us + flip_us) / 1000);
+#endif
             } else if (ret > 0) {
                 flip();
             }
-#endif
         } else {
             gForceRender = 0;
+            gr_damage_all();
             PageManager::Render();
             flip();
-            input_timeout_ms = 0;
+            idle = false;
+            idle_frames = 0;
         }
 
         blankTimer.checkForTimeout();
@@ -491,13 +730,31 @@ static int runPages(const char *page_name, const int stop_on_page_done)
             break;
         }
     }
+    mbtool_async.set_wakeup_callback(nullptr);
     gGuiRunning = 0;
+
+    mb::log::log_metrics(mb::MetricsRegistry::global());
+
     return 0;
 }
 
+// Wake up the render loop so that it updates the page. This can be called from
+// any thread.
+void gui_wakeup()
+{
+    if (gWakeFd >= 0) {
+        uint64_t value = 1;
+        // This only fails if the counter would overflow, in which case a
+        // wakeup is already pending
+        while (write(gWakeFd, &value, sizeof(value)) < 0 && errno == EINTR) {
+        }
+    }
+}
+
 int gui_forceRender()
 {
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -506,6 +763,7 @@ int gui_changePage(std::string newPage)
     LOGI("Set page: '%s'", newPage.c_str());
     PageManager::ChangePage(newPage);
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
@@ -514,13 +772,14 @@ int gui_changeOverlay(std::string overlay)
     LOGI("Set overlay: '%s'", overlay.c_str());
     PageManager::ChangeOverlay(overlay);
     gForceRender = 1;
+    gui_wakeup();
     return 0;
 }
 
-std::string gui_parse_text(std::string str)
+std::string gui_parse_resources(std::string str)
 {
-    // This function parses text for DataManager values encompassed by %value% in the XML
-    // and string resources (%@resource_name%)
+    // This function only replaces string resources in the form of {@resource_name}
+    // or {@resource_name=default}
     size_t pos = 0, next, end;
 
     while (1) {
@@ -547,7 +806,16 @@ std::string gui_parse_text(std::string str)
             str.insert(next, PageManager::GetResources()->FindString(lookup, default_string));
         }
     }
-    pos = 0;
+    return str;
+}
+
+std::string gui_parse_text(std::string str)
+{
+    // This function parses text for DataManager values encompassed by %value% in the XML
+    // and string resources (%@resource_name%)
+    size_t pos = 0, next, end;
+
+    str = gui_parse_resources(std::move(str));
     while (1) {
         next = str.find('%', pos);
         if (next == std::string::npos) {
@@ -605,6 +873,7 @@ extern "C" int gui_init()
     }
 
     ev_init();
+    initEventLoop();
     return 0;
 }
 
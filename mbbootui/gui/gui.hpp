@@ -28,6 +28,7 @@ void gui_highlight(const char* text);
 void gui_msg(Message msg);
 
 std::string gui_parse_text(std::string inText);
+std::string gui_parse_resources(std::string inText);
 std::string gui_lookup(const std::string& resource_name, const std::string& default_value);
 
 #endif //_GUI_HPP_HEADER
@@ -41,6 +41,10 @@ public:
 
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars __unused)
+    {
+        return false;
+    }
 
     // NotifyTouch - Notify of a touch event
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
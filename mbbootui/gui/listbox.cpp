@@ -29,6 +29,7 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
     mIconSelected = mIconUnselected = nullptr;
     mUpdate = 0;
     isCheckList = isTextParsed = false;
+    mRomListRequest = 0;
 
     // Get the icons, if any
     child = FindNode(node, "icon");
@@ -116,6 +117,9 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
 
 GUIListBox::~GUIListBox()
 {
+    if (mRomListRequest) {
+        mbtool_async.cancel(mRomListRequest);
+    }
 }
 
 int GUIListBox::Update()
@@ -127,10 +131,9 @@ int GUIListBox::Update()
     GUIScrollList::Update();
 
     if (mUpdate) {
+        // The page redraws the list's region on the next render
         mUpdate = 0;
-        if (Render() == 0) {
-            return 2;
-        }
+        return 2;
     }
     return 0;
 }
@@ -201,27 +204,45 @@ void GUIListBox::SetPageFocus(int inFocus)
         }
 
         if (mVariable == VAR_TW_ROM_ID) {
-            mListItems.clear();
-
-            std::vector<Rom> roms;
-            mbtool_interface->get_installed_roms(&roms);
-
-            for (Rom rom : roms) {
-                ListItem data;
-                // TODO: Read name from config file
-                data.displayName = rom.id;
-                data.variableValue = rom.id;
-                data.action = nullptr;
-                data.selected = (currentValue == rom.id);
-                mListItems.push_back(std::move(data));
+            // The list is filled in when the daemon responds. Until then, the
+            // previous list (if any) stays visible instead of blocking here.
+            if (mRomListRequest) {
+                mbtool_async.cancel(mRomListRequest);
             }
+            mRomListRequest = mbtool_async.get_installed_roms(
+                    [this](bool ok, const std::vector<Rom>& roms) {
+                (void) ok;
+                mRomListRequest = 0;
+                SetRomList(roms);
+            });
         }
 
         DataManager::GetValue(mVariable, currentValue);
         NotifyVarChange(mVariable, currentValue);
+    } else if (mRomListRequest) {
+        mbtool_async.cancel(mRomListRequest);
+        mRomListRequest = 0;
     }
 }
 
+void GUIListBox::SetRomList(const std::vector<Rom>& roms)
+{
+    mListItems.clear();
+
+    for (const Rom& rom : roms) {
+        ListItem data;
+        // TODO: Read name from config file
+        data.displayName = rom.id;
+        data.variableValue = rom.id;
+        data.action = nullptr;
+        data.selected = (currentValue == rom.id);
+        mListItems.push_back(std::move(data));
+    }
+
+    DataManager::GetValue(mVariable, currentValue);
+    NotifyVarChange(mVariable, currentValue);
+}
+
 size_t GUIListBox::GetItemCount()
 {
     return mVisibleItems.size();
@@ -20,6 +20,8 @@
 
 #include "gui/scrolllist.hpp"
 
+#include "daemon_connection.h"
+
 #include "gui/action.hpp"
 
 class GUIListBox : public GUIScrollList
@@ -54,6 +56,9 @@ protected:
         std::vector<Condition> mConditions;
     };
 
+protected:
+    void SetRomList(const std::vector<Rom>& roms);
+
 protected:
     std::vector<ListItem> mListItems;
     std::vector<size_t> mVisibleItems; // contains indexes in mListItems of visible items only
@@ -63,4 +68,6 @@ protected:
     ImageResource* mIconUnselected;
     bool isCheckList;
     bool isTextParsed;
+    // ID of the outstanding ROM list request (0 if none)
+    uint64_t mRomListRequest;
 };
@@ -162,6 +162,15 @@ int GUIObject::NotifyVarChange(const std::string& varName,
     return 0;
 }
 
+bool GUIObject::GetVarDependencies(std::vector<std::string>& vars)
+{
+    for (auto iter = mConditions.begin(); iter != mConditions.end(); ++iter) {
+        vars.push_back(iter->mVar1);
+        vars.push_back(iter->mVar2);
+    }
+    return true;
+}
+
 bool GUIObject::UpdateConditions(std::vector<Condition>& conditions,
                                  const std::string& varName)
 {
@@ -50,6 +50,14 @@ public:
         return 0;
     }
 
+    // GetDamageRect - Returns the region that may have changed when Update()
+    //  returned >0. Return 0 on success, <0 if unknown (full screen update)
+    virtual int GetDamageRect(int& x __unused, int& y __unused,
+                              int& w __unused, int& h __unused)
+    {
+        return -1;
+    }
+
     // GetRenderPos - Returns the current position of the object
     virtual int GetRenderPos(int& x, int& y, int& w, int& h)
     {
@@ -163,6 +171,10 @@ public:
     virtual int NotifyVarChange(const std::string& varName,
                                 const std::string& value);
 
+    // GetVarDependencies - Add the names of the variables that NotifyVarChange()
+    //  needs to be called for. Return false if it must be called for every change.
+    virtual bool GetVarDependencies(std::vector<std::string>& vars);
+
 protected:
     class Condition
     {
@@ -162,7 +162,6 @@ xml_node<>* FindNode(xml_node<>* parent, const char* nodename, int depth /* = 0
         while (style) {
             if (!style->first_attribute("name")) {
                 LOGE("No name given for style.");
-                continue;
             } else {
                 std::string name = style->first_attribute("name")->value();
                 xml_node<>* node = PageManager::FindStyle(name);
@@ -324,6 +323,7 @@ int ActionObject::SetActionPos(int x, int y, int w, int h)
 Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 {
     mTouchStart = nullptr;
+    mVarIndexValid = false;
 
     // We can memset the whole structure, because the alpha channel is ignored
     memset(&mBackground, 0, sizeof(COLOR));
@@ -472,32 +472,10 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
                 LOGE("Invalid template request.");
             } else {
                 std::string name = child->first_attribute("name")->value();
-                xml_node<>* node;
-                bool node_found = false;
-
-                // We need to find the correct template
-                for (auto itr = templates->begin(); itr != templates->end(); itr++) {
-                    node = (*itr)->first_node("template");
-
-                    while (node) {
-                        if (!node->first_attribute("name")) {
-                            continue;
-                        }
+                xml_node<>* node = PageManager::FindTemplate(name);
 
-                        if (name == node->first_attribute("name")->value()) {
-                            if (!ProcessNode(node, templates, depth + 1)) {
-                                return false;
-                            } else {
-                                node_found = true;
-                                break;
-                            }
-                        }
-                        if (node_found) {
-                            break;
-                        }
-                        node = node->next_sibling("template");
-                    }
-                    // [check] why is there no if (node_found) here too?
+                if (node && !ProcessNode(node, templates, depth + 1)) {
+                    return false;
                 }
             }
         } else {
@@ -530,8 +508,18 @@ int Page::Update()
         int ret = (*iter)->Update();
         if (ret < 0) {
             LOGE("An update request has failed.");
-        } else if (ret > retCode) {
-            retCode = ret;
+        } else if (ret > 0) {
+            // Only redraw and flip the parts of the screen that changed
+            int x, y, w, h;
+            if ((*iter)->GetDamageRect(x, y, w, h) == 0) {
+                gr_damage(x, y, w, h);
+            } else {
+                gr_damage_all();
+            }
+
+            if (ret > retCode) {
+                retCode = ret;
+            }
         }
     }
 
@@ -630,14 +618,69 @@ void Page::SetPageFocus(int inFocus)
 
 int Page::NotifyVarChange(const std::string& varName, const std::string& value)
 {
-    for (auto iter = mObjects.begin(); iter != mObjects.end(); ++iter) {
-        if ((*iter)->NotifyVarChange(varName, value)) {
+    if (varName.empty()) {
+        // Everything is refreshed, which may also change the dependencies
+        for (auto iter = mObjects.begin(); iter != mObjects.end(); ++iter) {
+            if ((*iter)->NotifyVarChange(varName, value)) {
+                LOGE("An action handler errored on NotifyVarChange.");
+            }
+        }
+        mVarIndexValid = false;
+        return 0;
+    }
+
+    if (!mVarIndexValid) {
+        IndexVarDependencies();
+    }
+
+    // Notify the objects in the same order as mObjects. The list is copied
+    // because handlers may set variables and rebuild the index.
+    std::vector<size_t> targets;
+    auto it = mVarSubscribers.find(varName);
+    if (it != mVarSubscribers.end()) {
+        targets.reserve(it->second.size() + mVarWildcards.size());
+        std::merge(it->second.begin(), it->second.end(),
+                   mVarWildcards.begin(), mVarWildcards.end(),
+                   std::back_inserter(targets));
+    } else {
+        targets = mVarWildcards;
+    }
+
+    for (size_t index : targets) {
+        if (mObjects[index]->NotifyVarChange(varName, value)) {
             LOGE("An action handler errored on NotifyVarChange.");
         }
     }
     return 0;
 }
 
+void Page::IndexVarDependencies()
+{
+    std::vector<std::string> vars;
+
+    mVarSubscribers.clear();
+    mVarWildcards.clear();
+
+    for (size_t i = 0; i < mObjects.size(); ++i) {
+        vars.clear();
+        if (!mObjects[i]->GetVarDependencies(vars)) {
+            mVarWildcards.push_back(i);
+            continue;
+        }
+
+        std::sort(vars.begin(), vars.end());
+        vars.erase(std::unique(vars.begin(), vars.end()), vars.end());
+
+        for (auto const& var : vars) {
+            if (!var.empty()) {
+                mVarSubscribers[var].push_back(i);
+            }
+        }
+    }
+
+    mVarIndexValid = true;
+}
+
 
 // transient data for loading themes
 struct LoadingContext
@@ -649,6 +692,9 @@ struct LoadingContext
     std::vector<char*> xmlbuffers; // text buffers with xml content
     std::vector<xml_node<>*> styles; // refer to <styles> nodes inside xmldocs
     std::vector<xml_node<>*> templates; // refer to <templates> nodes inside xmldocs
+    // <style> and <template> nodes by name (the first definition wins)
+    std::unordered_map<std::string, xml_node<>*> style_index;
+    std::unordered_map<std::string, xml_node<>*> template_index;
 
     LoadingContext()
     {
@@ -667,6 +713,21 @@ struct LoadingContext
 // for FindStyle
 LoadingContext* PageManager::currentLoadingContext = nullptr;
 
+// Add the named children of a <styles> or <templates> node to an index
+static void IndexNamedNodes(xml_node<>* parent, const char* nodename,
+                            std::unordered_map<std::string, xml_node<>*>& index)
+{
+    for (xml_node<>* node = parent->first_node(nodename); node;
+            node = node->next_sibling(nodename)) {
+        xml_attribute<>* attr = node->first_attribute("name");
+        if (!attr) {
+            LOGE("No name given for %s.", nodename);
+            continue;
+        }
+        index.emplace(attr->value(), node);
+    }
+}
+
 
 PageSet::PageSet()
 {
@@ -745,11 +806,13 @@ int PageSet::Load(LoadingContext& ctx, const std::string& filename)
     child = root->first_node("templates");
     if (child) {
         ctx.templates.push_back(child);
+        IndexNamedNodes(child, "template", ctx.template_index);
     }
 
     child = root->first_node("styles");
     if (child) {
         ctx.styles.push_back(child);
+        IndexNamedNodes(child, "style", ctx.style_index);
     }
 
     // Load pages
@@ -1472,7 +1535,9 @@ int PageManager::ReloadPackage(const std::string& name,
     if (mCurrentSet == set) {
         SelectPackage(name);
     }
+    GUIAction::ClearQueuedActions();
     delete set;
+    GUIScrollList::ClearWrapCache();
     GUIConsole::Translate_Now();
     return 0;
 }
@@ -1486,7 +1551,9 @@ void PageManager::ReleasePackage(const std::string& name)
 
     PageSet* set = (*iter).second;
     mPageSets.erase(iter);
+    GUIAction::ClearQueuedActions();
     delete set;
+    GUIScrollList::ClearWrapCache();
     if (set == mCurrentSet) {
         mCurrentSet = nullptr;
     }
@@ -1598,21 +1665,19 @@ xml_node<>* PageManager::FindStyle(std::string name)
         return nullptr;
     }
 
-    for (auto itr = currentLoadingContext->styles.begin(); itr != currentLoadingContext->styles.end(); itr++) {
-        xml_node<>* node = (*itr)->first_node("style");
-
-        while (node) {
-            if (!node->first_attribute("name")) {
-                continue;
-            }
+    auto it = currentLoadingContext->style_index.find(name);
+    return it != currentLoadingContext->style_index.end() ? it->second : nullptr;
+}
 
-            if (name == node->first_attribute("name")->value()) {
-                return node;
-            }
-            node = node->next_sibling("style");
-        }
+xml_node<>* PageManager::FindTemplate(const std::string& name)
+{
+    if (!currentLoadingContext) {
+        LOGE("FindTemplate works only while loading a theme.");
+        return nullptr;
     }
-    return nullptr;
+
+    auto it = currentLoadingContext->template_index.find(name);
+    return it != currentLoadingContext->template_index.end() ? it->second : nullptr;
 }
 
 MouseCursor *PageManager::GetMouseCursor()
@@ -1646,6 +1711,9 @@ int PageManager::Update()
 
     if (mMouseCursor) {
         int c_res = mMouseCursor->Update();
+        if (c_res > 0) {
+            gr_damage_all();
+        }
         if (c_res > res) {
             res = c_res;
         }
@@ -1692,4 +1760,5 @@ extern "C" void gui_notifyVarChange(const char *name, const char* value)
     }
 
     PageManager::NotifyVarChange(name, value);
+    gui_wakeup();
 }
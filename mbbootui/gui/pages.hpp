@@ -51,6 +51,7 @@ extern std::vector<language_struct> Language_List;
 
 // Utility Functions
 int ConvertStrToColor(std::string str, COLOR* color);
+void gui_wakeup();
 int gui_forceRender();
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
@@ -96,8 +97,14 @@ protected:
     ActionObject* mTouchStart;
     COLOR mBackground;
 
+    // Indexes into mObjects of the objects to notify when a variable changes
+    bool mVarIndexValid;
+    std::unordered_map<std::string, std::vector<size_t>> mVarSubscribers;
+    std::vector<size_t> mVarWildcards; // objects that see every change
+
 protected:
     bool ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, int depth);
+    void IndexVarDependencies();
 };
 
 struct LoadingContext;
@@ -186,6 +193,7 @@ public:
     static HardwareKeyboard *GetHardwareKeyboard();
 
     static xml_node<>* FindStyle(std::string name);
+    static xml_node<>* FindTemplate(const std::string& name);
     static void AddStringResource(std::string resource_source, std::string resource_name, std::string value);
 
 protected:
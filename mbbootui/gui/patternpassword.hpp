@@ -34,6 +34,10 @@ public:
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
     virtual int NotifyVarChange(const std::string& varName,
                                 const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars __unused)
+    {
+        return false;
+    }
     virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
 
 protected:
@@ -69,6 +69,11 @@ int GUIProgressBar::RenderInternal()
     return 0;
 }
 
+int GUIProgressBar::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    return GetRenderPos(x, y, w, h);
+}
+
 int GUIProgressBar::Update()
 {
     if (!isConditionTrue()) {
@@ -206,3 +211,10 @@ int GUIProgressBar::NotifyVarChange(const std::string& varName,
     }
     return 0;
 }
+
+bool GUIProgressBar::GetVarDependencies(std::vector<std::string>& vars)
+{
+    vars.push_back(VAR_TW_UI_PROGRESS_PORTION);
+    vars.push_back(VAR_TW_UI_PROGRESS_FRAMES);
+    return GUIObject::GetVarDependencies(vars);
+}
@@ -2,8 +2,14 @@
 
 #include "gui/objects.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <iomanip>
 #include <iostream>
+#include <thread>
+#include <vector>
+
+#include <cstring>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -16,6 +22,22 @@
 
 #define TMP_RESOURCE_NAME   "/tmp/extract.bin"
 
+// Inflation buffers larger than this are freed after use instead of being kept
+// around for the next image
+#define INFLATE_BUFFER_KEEP_MAX (2 * 1024 * 1024)
+
+// Animations whose decoded frames fit in this many bytes are kept fully
+// resident. Longer animations are streamed through a ring of decoded frames
+// that fits in ANIMATION_RING_BUDGET, but has at least ANIMATION_RING_MIN_SLOTS
+// slots.
+#define ANIMATION_RESIDENT_MAX      (8 * 1024 * 1024)
+#define ANIMATION_RING_BUDGET       (4 * 1024 * 1024)
+#define ANIMATION_RING_MIN_SLOTS    3
+
+static const unsigned char PNG_SIGNATURE[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+
 Resource::Resource(xml_node<>* node, ZipArchive* pZip __unused)
 {
     if (node && node->first_attribute("name")) {
@@ -55,18 +77,85 @@ int Resource::ExtractResource(ZipArchive* pZip,
     return ret;
 }
 
+/*
+ * Decode a PNG from the theme zip without extracting it to a file. Stored
+ * entries are decoded straight from the zip mapping. Deflated entries are
+ * inflated into buf, which the caller keeps for the next image it decodes.
+ *
+ * Returns 1 if the entry is not a PNG, in which case it has to go through
+ * ExtractResource() and res_create_surface() instead.
+ */
+int Resource::DecodeZipImage(ZipArchive* pZip, const ZipEntry* entry,
+                             gr_surface* surface,
+                             std::vector<unsigned char>& buf)
+{
+    size_t size = mzGetZipEntryUncompLen(entry);
+    const unsigned char* data = mzGetStoredZipEntryData(pZip, entry);
+
+    if (!data) {
+        // JPEGs can only be decoded from a file
+        if (entry->fileNameLen > 4 && memcmp(
+                entry->fileName + entry->fileNameLen - 4, ".jpg", 4) == 0) {
+            return 1;
+        }
+
+        if (buf.size() < size) {
+            buf.resize(size);
+        }
+        if (!mzExtractZipEntryToBuffer(pZip, entry, buf.data())) {
+            return -1;
+        }
+        data = buf.data();
+    }
+
+    int rc;
+    if (size < sizeof(PNG_SIGNATURE)
+            || memcmp(data, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) != 0) {
+        rc = 1;
+    } else {
+        rc = res_create_surface_mem(data, size, surface);
+    }
+
+    if (buf.capacity() > INFLATE_BUFFER_KEEP_MAX) {
+        std::vector<unsigned char>().swap(buf);
+    }
+
+    return rc;
+}
+
 void Resource::LoadImage(ZipArchive* pZip, const std::string& file,
-                         gr_surface* surface)
+                         gr_surface* surface, const std::string& tmpFile,
+                         std::vector<unsigned char>& inflateBuf)
 {
     int rc = 0;
-    if (ExtractResource(pZip, "images", file, ".png", TMP_RESOURCE_NAME) == 0) {
-        rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-        unlink(TMP_RESOURCE_NAME);
-    } else if (ExtractResource(pZip, "images", file, "", TMP_RESOURCE_NAME) == 0) {
-        // JPG includes the .jpg extension in the filename so extension should be blank
-        rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-        unlink(TMP_RESOURCE_NAME);
-    } else if (!pZip) {
+    if (pZip) {
+        // JPG includes the .jpg extension in the filename so extension should
+        // be blank
+        std::string name = "images/" + file + ".png";
+        const ZipEntry* entry = mzFindZipEntry(pZip, name.c_str());
+        if (!entry) {
+            name.resize(name.size() - 4);
+            entry = mzFindZipEntry(pZip, name.c_str());
+        }
+
+        if (!entry) {
+            rc = -1;
+        } else if ((rc = DecodeZipImage(pZip, entry, surface, inflateBuf)) == 1) {
+            rc = -1;
+            unlink(tmpFile.c_str());
+            int fd = creat(tmpFile.c_str(), 0666);
+            if (fd >= 0) {
+                if (mzExtractZipEntryToFile(pZip, entry, fd)) {
+                    rc = 0;
+                }
+                close(fd);
+            }
+            if (rc == 0) {
+                rc = res_create_surface(tmpFile.c_str(), surface);
+            }
+            unlink(tmpFile.c_str());
+        }
+    } else {
         // File name in xml may have included .png so try without adding .png
         rc = res_create_surface(file.c_str(), surface);
     }
@@ -93,6 +182,8 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
         if (res_scale_surface(source, destination, scale_w, scale_h)) {
             LOGI("Error scaling image, using regular size.");
             *destination = source;
+        } else {
+            res_free_surface(source);
         }
     } else {
         *destination = source;
@@ -193,26 +284,35 @@ FontResource::~FontResource()
 ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
-    std::string file;
-    gr_surface temp_surface = nullptr;
-
     mSurface = nullptr;
+    mRetainAspect = false;
     if (!node) {
         LOGE("ImageResource node is NULL");
         return;
     }
 
     if (node->first_attribute("filename")) {
-        file = node->first_attribute("filename")->value();
+        mFile = node->first_attribute("filename")->value();
     } else {
         LOGE("No filename specified for image resource.");
         return;
     }
 
-    bool retain_aspect = (node->first_attribute("retainaspect") != nullptr);
     // the value does not matter, if retainaspect is present, we assume that we want to retain it
-    LoadImage(pZip, file, &temp_surface);
-    CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+    mRetainAspect = (node->first_attribute("retainaspect") != nullptr);
+}
+
+void ImageResource::Decode(ZipArchive* pZip, const std::string& tmpFile,
+                           std::vector<unsigned char>& inflateBuf)
+{
+    gr_surface temp_surface = nullptr;
+
+    if (mFile.empty() || mSurface) {
+        return;
+    }
+
+    LoadImage(pZip, mFile, &temp_surface, tmpFile, inflateBuf);
+    CheckAndScaleImage(temp_surface, &mSurface, mRetainAspect);
 }
 
 ImageResource::~ImageResource()
@@ -224,30 +324,124 @@ ImageResource::~ImageResource()
 
 AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
+    , mWantedFrame(0)
+    , mDecodingFrame(-1)
+    , mStopDecoder(false)
 {
-    std::string file;
-    int fileNum = 1;
-
+    mRetainAspect = false;
     if (!node) {
         return;
     }
 
     if (node->first_attribute("filename")) {
-        file = node->first_attribute("filename")->value();
+        mFile = node->first_attribute("filename")->value();
     } else {
         LOGE("No filename specified for image resource.");
         return;
     }
 
-    bool retain_aspect = (node->first_attribute("retainaspect") != nullptr);
     // the value does not matter, if retainaspect is present, we assume that we want to retain it
+    mRetainAspect = (node->first_attribute("retainaspect") != nullptr);
+}
+
+/*
+ * Read the PNG data of every frame from the theme zip. Returns false if there
+ * are no frames or if any frame is not a PNG, in which case the animation can
+ * only be decoded the regular way.
+ */
+bool AnimationResource::ReadFrames(ZipArchive* pZip)
+{
+    for (int fileNum = 1; ; ++fileNum) {
+        std::ostringstream fileName;
+        fileName << "images/" << mFile << std::setfill ('0') << std::setw (3)
+                 << fileNum << ".png";
+
+        std::string name = fileName.str();
+        const ZipEntry* entry = mzFindZipEntry(pZip, name.c_str());
+        if (!entry) {
+            name.resize(name.size() - 4);
+            entry = mzFindZipEntry(pZip, name.c_str());
+        }
+        if (!entry) {
+            break;
+        }
+
+        std::vector<unsigned char> data(mzGetZipEntryUncompLen(entry));
+        if (!mzExtractZipEntryToBuffer(pZip, entry, data.data())
+                || data.size() < sizeof(PNG_SIGNATURE)
+                || memcmp(data.data(), PNG_SIGNATURE,
+                          sizeof(PNG_SIGNATURE)) != 0) {
+            mFrameData.clear();
+            return false;
+        }
+
+        mFrameData.push_back(std::move(data));
+    }
+
+    return !mFrameData.empty();
+}
+
+bool AnimationResource::DecodeFrame(int frame, gr_surface* surface)
+{
+    const std::vector<unsigned char>& data = mFrameData[frame];
+    gr_surface temp_surface = nullptr;
+
+    *surface = nullptr;
+    if (res_create_surface_mem(data.data(), data.size(), &temp_surface) == 0) {
+        CheckAndScaleImage(temp_surface, surface, mRetainAspect);
+    }
+    return *surface != nullptr;
+}
+
+void AnimationResource::Decode(ZipArchive* pZip, const std::string& tmpFile,
+                               std::vector<unsigned char>& inflateBuf)
+{
+    int fileNum = 1;
+
+    if (mFile.empty() || !mSurfaces.empty()) {
+        return;
+    }
+
+    if (pZip && ReadFrames(pZip)) {
+        gr_surface surface;
+        if (!DecodeFrame(0, &surface)) {
+            mFrameData.clear();
+            return;
+        }
+        mSurfaces.push_back(surface);
+
+        const GRSurface* first = static_cast<const GRSurface*>(surface);
+        size_t frameSize = static_cast<size_t>(first->row_bytes)
+                * static_cast<size_t>(first->height);
+
+        size_t slots = ANIMATION_RING_BUDGET / std::max<size_t>(frameSize, 1);
+        slots = std::max<size_t>(slots, ANIMATION_RING_MIN_SLOTS);
+
+        // Streaming is pointless if the ring could hold every frame anyway
+        if (frameSize * mFrameData.size() > ANIMATION_RESIDENT_MAX
+                && slots < mFrameData.size() - 1) {
+            StartStreaming(slots);
+            return;
+        }
+
+        for (size_t i = 1; i < mFrameData.size(); ++i) {
+            if (!DecodeFrame(i, &surface)) {
+                break; // Done loading animation images
+            }
+            mSurfaces.push_back(surface);
+        }
+
+        std::vector<std::vector<unsigned char>>().swap(mFrameData);
+        return;
+    }
+
     for (;;) {
         std::ostringstream fileName;
-        fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
+        fileName << mFile << std::setfill ('0') << std::setw (3) << fileNum;
 
         gr_surface surface, temp_surface = nullptr;
-        LoadImage(pZip, fileName.str(), &temp_surface);
-        CheckAndScaleImage(temp_surface, &surface, retain_aspect);
+        LoadImage(pZip, fileName.str(), &temp_surface, tmpFile, inflateBuf);
+        CheckAndScaleImage(temp_surface, &surface, mRetainAspect);
         if (surface) {
             mSurfaces.push_back(surface);
             fileNum++;
@@ -257,8 +451,200 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
     }
 }
 
+// The first frame always stays in mSurfaces, so only the other frames go
+// through the ring
+void AnimationResource::StartStreaming(size_t slots)
+{
+    mBrokenFrames.assign(mFrameData.size(), 0);
+    mRing.assign(slots, RingSlot{-1, nullptr});
+
+    LOGI("Streaming %zu frames of animation %s through %zu slots",
+         mFrameData.size(), GetName().c_str(), mRing.size());
+
+    mDecoder = std::thread(&AnimationResource::StreamFrames, this);
+}
+
+// Number of frames until \p frame is shown, assuming playback continues in
+// order and wraps around. Must be called with mRingLock held.
+int AnimationResource::FrameDistance(int frame)
+{
+    int count = mFrameData.size();
+    return (frame - mWantedFrame + count) % count;
+}
+
+// Find the closest upcoming frame that should be in the ring, but is not. Must
+// be called with mRingLock held.
+int AnimationResource::NextMissingFrame()
+{
+    int count = mFrameData.size();
+    size_t window = 0;
+
+    // The slot of the frame being displayed counts towards the window even if
+    // that frame was never decoded
+    if (mWantedFrame != 0) {
+        ++window;
+    }
+
+    for (int d = 1; d < count && window < mRing.size(); ++d) {
+        int frame = (mWantedFrame + d) % count;
+        if (frame == 0) {
+            continue;
+        }
+        ++window;
+
+        if (mBrokenFrames[frame] || frame == mDecodingFrame) {
+            continue;
+        }
+
+        bool found = false;
+        for (const RingSlot& slot : mRing) {
+            if (slot.frame == frame) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) {
+            return frame;
+        }
+    }
+
+    return -1;
+}
+
+// Put a decoded frame in the slot holding the frame that is furthest away. The
+// surface is freed if every slot holds a closer frame. Must be called with
+// mRingLock held.
+void AnimationResource::InstallFrame(int frame, gr_surface surface)
+{
+    RingSlot* victim = nullptr;
+    int victimDistance = -1;
+
+    for (RingSlot& slot : mRing) {
+        if (slot.frame < 0) {
+            victim = &slot;
+            break;
+        }
+        // The displayed frame may still be in use by the caller
+        if (slot.frame == mWantedFrame) {
+            continue;
+        }
+        int distance = FrameDistance(slot.frame);
+        if (distance > victimDistance) {
+            victim = &slot;
+            victimDistance = distance;
+        }
+    }
+
+    if (!victim || (victim->frame >= 0 && frame != mWantedFrame
+            && victimDistance < FrameDistance(frame))) {
+        res_free_surface(surface);
+        return;
+    }
+
+    if (victim->surface) {
+        res_free_surface(victim->surface);
+    }
+    victim->frame = frame;
+    victim->surface = surface;
+}
+
+void AnimationResource::StreamFrames()
+{
+    std::unique_lock<std::mutex> lock(mRingLock);
+
+    while (!mStopDecoder) {
+        int frame = NextMissingFrame();
+        if (frame < 0) {
+            mRingCv.wait(lock);
+            continue;
+        }
+
+        mDecodingFrame = frame;
+        lock.unlock();
+
+        gr_surface surface;
+        bool ok = DecodeFrame(frame, &surface);
+
+        lock.lock();
+        mDecodingFrame = -1;
+        if (ok) {
+            InstallFrame(frame, surface);
+        } else {
+            LOGE("Failed to decode frame %d of animation %s",
+                 frame, GetName().c_str());
+            mBrokenFrames[frame] = 1;
+        }
+        mRingCv.notify_all();
+    }
+}
+
+/*
+ * Get a frame and let the decoder know which frames come next. If the decoder
+ * fell behind, the frame is decoded on the calling thread. Frames that cannot
+ * be decoded are replaced by the first frame.
+ */
+gr_surface AnimationResource::GetStreamedFrame(int entry)
+{
+    if (entry < 0 || static_cast<size_t>(entry) >= mFrameData.size()) {
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> lock(mRingLock);
+
+    if (mWantedFrame != entry) {
+        mWantedFrame = entry;
+        mRingCv.notify_all();
+    }
+
+    if (entry == 0) {
+        return mSurfaces[0];
+    }
+
+    while (mDecodingFrame == entry) {
+        mRingCv.wait(lock);
+    }
+
+    for (const RingSlot& slot : mRing) {
+        if (slot.frame == entry) {
+            return slot.surface;
+        }
+    }
+
+    if (!mBrokenFrames[entry]) {
+        lock.unlock();
+        gr_surface surface;
+        bool ok = DecodeFrame(entry, &surface);
+        lock.lock();
+
+        if (ok) {
+            // The decoder cannot have installed this frame in the meantime
+            // because it never decodes the wanted frame twice
+            InstallFrame(entry, surface);
+            return surface;
+        }
+        mBrokenFrames[entry] = 1;
+    }
+
+    return mSurfaces[0];
+}
+
 AnimationResource::~AnimationResource()
 {
+    if (mDecoder.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mRingLock);
+            mStopDecoder = true;
+        }
+        mRingCv.notify_all();
+        mDecoder.join();
+    }
+
+    for (const RingSlot& slot : mRing) {
+        if (slot.surface) {
+            res_free_surface(slot.surface);
+        }
+    }
+
     for (auto it = mSurfaces.begin(); it != mSurfaces.end(); ++it) {
         res_free_surface(*it);
     }
@@ -364,6 +750,66 @@ void ResourceManager::AddStringResource(std::string resource_source,
     mStrings[resource_name] = res;
 }
 
+static void LogResourceError(xml_node<>* child, const std::string& type)
+{
+    std::string res_name;
+    if (child->first_attribute("name")) {
+        res_name = child->first_attribute("name")->value();
+    }
+    if (res_name.empty() && child->first_attribute("filename")) {
+        res_name = child->first_attribute("filename")->value();
+    }
+
+    if (!res_name.empty()) {
+        LOGE("Resource (%s)-(%s) failed to load", type.c_str(), res_name.c_str());
+    } else {
+        LOGE("Resource type (%s) failed to load", type.c_str());
+    }
+}
+
+// Decode images and animations on all available cores. Each worker extracts
+// to its own temporary file and inflates into its own buffer.
+void ResourceManager::DecodeImages(const std::vector<ImageResource*>& images,
+                                   const std::vector<AnimationResource*>& animations,
+                                   ZipArchive* pZip)
+{
+    size_t total = images.size() + animations.size();
+    if (total == 0) {
+        return;
+    }
+
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max<size_t>(1, std::min<size_t>(threads, total));
+
+    std::atomic_size_t next(0);
+
+    auto worker = [&](unsigned int id) {
+        std::ostringstream tmpFile;
+        tmpFile << TMP_RESOURCE_NAME << "." << id;
+        std::vector<unsigned char> inflateBuf;
+
+        size_t i;
+        while ((i = next++) < total) {
+            // Animations have the most frames, so start them first
+            if (i < animations.size()) {
+                animations[i]->Decode(pZip, tmpFile.str(), inflateBuf);
+            } else {
+                images[i - animations.size()]->Decode(pZip, tmpFile.str(),
+                                                     inflateBuf);
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; ++i) {
+        pool.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &t : pool) {
+        t.join();
+    }
+}
+
 void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip,
                                     std::string resource_source)
 {
@@ -371,6 +817,13 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip,
         return;
     }
 
+    // Images and animations are decoded together after all resources have
+    // been parsed
+    std::vector<ImageResource*> images;
+    std::vector<xml_node<>*> image_nodes;
+    std::vector<AnimationResource*> animations;
+    std::vector<xml_node<>*> animation_nodes;
+
     for (xml_node<>* child = resList->first_node(); child; child = child->next_sibling()) {
         std::string type = child->name();
         if (type == "resource") {
@@ -408,21 +861,11 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip,
                 LOGE("Unable to locate font name for type fontoverride.");
             }
         } else if (type == "image") {
-            ImageResource* res = new ImageResource(child, pZip);
-            if (res->GetResource()) {
-                mImages.push_back(res);
-            } else {
-                error = true;
-                delete res;
-            }
+            images.push_back(new ImageResource(child, pZip));
+            image_nodes.push_back(child);
         } else if (type == "animation") {
-            AnimationResource* res = new AnimationResource(child, pZip);
-            if (res->GetResourceCount()) {
-                mAnimations.push_back(res);
-            } else {
-                error = true;
-                delete res;
-            }
+            animations.push_back(new AnimationResource(child, pZip));
+            animation_nodes.push_back(child);
         } else if (type == "string") {
             if (xml_attribute<>* attr = child->first_attribute("name")) {
                 string_resource_struct res;
@@ -438,19 +881,27 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipArchive* pZip,
         }
 
         if (error) {
-            std::string res_name;
-            if (child->first_attribute("name")) {
-                res_name = child->first_attribute("name")->value();
-            }
-            if (res_name.empty() && child->first_attribute("filename")) {
-                res_name = child->first_attribute("filename")->value();
-            }
+            LogResourceError(child, type);
+        }
+    }
 
-            if (!res_name.empty()) {
-                LOGE("Resource (%s)-(%s) failed to load", type.c_str(), res_name.c_str());
-            } else {
-                LOGE("Resource type (%s) failed to load", type.c_str());
-            }
+    DecodeImages(images, animations, pZip);
+
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (images[i]->GetResource()) {
+            mImages.push_back(images[i]);
+        } else {
+            LogResourceError(image_nodes[i], "image");
+            delete images[i];
+        }
+    }
+
+    for (size_t i = 0; i < animations.size(); ++i) {
+        if (animations[i]->GetResourceCount()) {
+            mAnimations.push_back(animations[i]);
+        } else {
+            LogResourceError(animation_nodes[i], "animation");
+            delete animations[i];
         }
     }
 }
@@ -3,6 +3,11 @@
 #ifndef _RESOURCE_HEADER
 #define _RESOURCE_HEADER
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "minuitwrp/minui.h"
 
 #include "gui/rapidxml.hpp"
@@ -31,8 +36,13 @@ protected:
                                const std::string& fileName,
                                const std::string& fileExtn,
                                const std::string& destFile);
+    static int DecodeZipImage(ZipArchive* pZip, const ZipEntry* entry,
+                              gr_surface* surface,
+                              std::vector<unsigned char>& buf);
     static void LoadImage(ZipArchive* pZip,
-                          const std::string& file, gr_surface* surface);
+                          const std::string& file, gr_surface* surface,
+                          const std::string& tmpFile,
+                          std::vector<unsigned char>& inflateBuf);
     static void CheckAndScaleImage(gr_surface source, gr_surface* destination,
                                    int retain_aspect);
 };
@@ -76,12 +86,17 @@ private:
     void* origFont;
 };
 
+// Images and animations are only decoded once Decode() is called. This allows
+// ResourceManager to decode all of them in parallel.
 class ImageResource : public Resource
 {
 public:
     ImageResource(xml_node<>* node, ZipArchive* pZip);
     virtual ~ImageResource();
 
+    void Decode(ZipArchive* pZip, const std::string& tmpFile,
+                std::vector<unsigned char>& inflateBuf);
+
 public:
     gr_surface GetResource()
     {
@@ -112,6 +127,10 @@ public:
 
 protected:
     gr_surface mSurface;
+
+private:
+    std::string mFile;
+    bool mRetainAspect;
 };
 
 class AnimationResource : public Resource
@@ -120,6 +139,9 @@ public:
     AnimationResource(xml_node<>* node, ZipArchive* pZip);
     virtual ~AnimationResource();
 
+    void Decode(ZipArchive* pZip, const std::string& tmpFile,
+                std::vector<unsigned char>& inflateBuf);
+
 public:
     gr_surface GetResource()
     {
@@ -132,6 +154,9 @@ public:
 
     gr_surface GetResource(int entry)
     {
+        if (!mRing.empty()) {
+            return GetStreamedFrame(entry);
+        }
 #if 0
         return (!this || mSurfaces.empty()) ? nullptr : mSurfaces.at(entry);
 #else
@@ -159,11 +184,44 @@ public:
 
     int GetResourceCount()
     {
-        return mSurfaces.size();
+        return mRing.empty() ? mSurfaces.size() : mFrameData.size();
     }
 
 protected:
+    // All frames when resident, otherwise only the first frame
     std::vector<gr_surface> mSurfaces;
+
+private:
+    struct RingSlot
+    {
+        int frame;
+        gr_surface surface;
+    };
+
+    bool ReadFrames(ZipArchive* pZip);
+    bool DecodeFrame(int frame, gr_surface* surface);
+    void StartStreaming(size_t slots);
+    void StreamFrames();
+    int NextMissingFrame();
+    int FrameDistance(int frame);
+    void InstallFrame(int frame, gr_surface surface);
+    gr_surface GetStreamedFrame(int entry);
+
+    std::string mFile;
+    bool mRetainAspect;
+
+    // Streaming state. The PNG data of every frame is kept in memory and the
+    // frames after the one being displayed are decoded ahead of time into a
+    // fixed number of slots by mDecoder.
+    std::vector<std::vector<unsigned char>> mFrameData;
+    std::vector<char> mBrokenFrames;
+    std::vector<RingSlot> mRing;
+    std::mutex mRingLock;
+    std::condition_variable mRingCv;
+    std::thread mDecoder;
+    int mWantedFrame;
+    int mDecodingFrame;
+    bool mStopDecoder;
 };
 
 class ResourceManager
@@ -184,6 +242,10 @@ public:
     void DumpStrings() const;
 
 private:
+    void DecodeImages(const std::vector<ImageResource*>& images,
+                      const std::vector<AnimationResource*>& animations,
+                      ZipArchive* pZip);
+
     struct string_resource_struct
     {
         std::string value;
@@ -18,11 +18,89 @@
 
 #include "gui/scrolllist.hpp"
 
+#include <unordered_map>
+
 #include "data.hpp"
 #include "variables.h"
 
 const float SCROLLING_SPEED_DECREMENT = 0.9; // friction
 const int SCROLLING_FLOOR = 2; // minimum pixels for scrolling to stop
+const size_t WRAP_CACHE_MAX_ENTRIES = 4096; // cache is dropped when it grows past this
+
+// Word wrapped lines only depend on the font, the width, and the text, so they
+// are shared by every scroll list. This way, a console shown on a different
+// page or a textbox whose variables changed does not need to measure lines that
+// were already wrapped.
+struct WrapKey
+{
+    void* font;
+    int width;
+    std::string text;
+
+    bool operator==(const WrapKey& other) const
+    {
+        return font == other.font && width == other.width
+                && text == other.text;
+    }
+};
+
+struct WrapKeyHash
+{
+    size_t operator()(const WrapKey& key) const
+    {
+        size_t h = std::hash<std::string>()(key.text);
+        h ^= std::hash<void*>()(key.font) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        h ^= std::hash<int>()(key.width) + 0x9e3779b9 + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+static std::unordered_map<WrapKey, std::vector<std::string>, WrapKeyHash> wrap_cache;
+
+static const std::vector<std::string>& WrapLine(const std::string& line, void* font, int width)
+{
+    WrapKey key{font, width, line};
+
+    auto it = wrap_cache.find(key);
+    if (it != wrap_cache.end()) {
+        return it->second;
+    }
+
+    if (wrap_cache.size() >= WRAP_CACHE_MAX_ENTRIES) {
+        wrap_cache.clear();
+    }
+
+    std::vector<std::string> pieces;
+    std::string curr_line = line;
+
+    for (;;) {
+        size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), font, width);
+        if (line_char_width < curr_line.size()) {
+            //string left = curr_line.substr(0, line_char_width);
+            size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
+            if (wrap_pos == std::string::npos) {
+                wrap_pos = line_char_width;
+            } else if (wrap_pos < line_char_width - 1) {
+                wrap_pos++;
+            }
+            pieces.push_back(curr_line.substr(0, wrap_pos));
+            curr_line = curr_line.substr(wrap_pos);
+            /* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
+             * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
+            curr_line.erase(0, curr_line.find_first_not_of(" "));
+        } else {
+            pieces.push_back(curr_line);
+            break;
+        }
+    }
+
+    return wrap_cache.emplace(std::move(key), std::move(pieces)).first->second;
+}
+
+void GUIScrollList::ClearWrapCache()
+{
+    wrap_cache.clear();
+}
 
 GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 {
@@ -229,6 +307,17 @@ int GUIScrollList::Render()
 
     int yPos = mRenderY + mHeaderH + y_offset;
 
+    // If only part of the screen is being redrawn (eg. because some other
+    // object changed), skip the rows outside of it. Their text does not need
+    // to be looked up, shaped or drawn.
+    int visibleTop = mRenderY + mHeaderH;
+    int visibleBottom = mRenderY + mRenderH;
+    int damageX, damageY, damageW, damageH;
+    if (gr_get_damage(&damageX, &damageY, &damageW, &damageH) == 0) {
+        visibleTop = std::max(visibleTop, damageY);
+        visibleBottom = std::min(visibleBottom, damageY + damageH);
+    }
+
     // render all visible items
     for (size_t line = 0; line < lines; line++) {
         size_t itemindex = line + firstDisplayedItem;
@@ -236,11 +325,13 @@ int GUIScrollList::Render()
             break;
         }
 
-        RenderItem(itemindex, yPos, itemindex == selectedItem);
+        if (yPos + actualItemHeight > visibleTop && yPos < visibleBottom) {
+            RenderItem(itemindex, yPos, itemindex == selectedItem);
 
-        // Add the separator
-        gr_color(mSeparatorColor.red, mSeparatorColor.green, mSeparatorColor.blue, mSeparatorColor.alpha);
-        gr_fill(mRenderX, yPos + actualItemHeight - mSeparatorH, listW, mSeparatorH);
+            // Add the separator
+            gr_color(mSeparatorColor.red, mSeparatorColor.green, mSeparatorColor.blue, mSeparatorColor.alpha);
+            gr_fill(mRenderX, yPos + actualItemHeight - mSeparatorH, listW, mSeparatorH);
+        }
 
         // Move the yPos
         yPos += actualItemHeight;
@@ -609,6 +700,16 @@ int GUIScrollList::SetRenderPos(int x, int y, int w /* = 0 */, int h /* = 0 */)
     return 0;
 }
 
+int GUIScrollList::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    // Scrolling, selection and list changes only affect the list itself
+    x = mRenderX;
+    y = mRenderY;
+    w = mRenderW;
+    h = mRenderH;
+    return 0;
+}
+
 void GUIScrollList::SetPageFocus(int inFocus)
 {
     if (inFocus) {
@@ -631,36 +732,10 @@ bool GUIScrollList::AddLines(std::vector<std::string>* origText, std::vector<std
     // Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
     // may different in different console windows
     for (size_t i = prevCount; i < *lastCount; i++) {
-        std::string curr_line = origText->at(i);
-        std::string curr_color;
+        const std::vector<std::string>& pieces = WrapLine(origText->at(i), mFont->GetResource(), mRenderW);
+        rText->insert(rText->end(), pieces.begin(), pieces.end());
         if (origColor) {
-            curr_color = origColor->at(i);
-        }
-        for (;;) {
-            size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
-            if (line_char_width < curr_line.size()) {
-                //string left = curr_line.substr(0, line_char_width);
-                size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
-                if (wrap_pos == std::string::npos) {
-                    wrap_pos = line_char_width;
-                } else if (wrap_pos < line_char_width - 1) {
-                    wrap_pos++;
-                }
-                rText->push_back(curr_line.substr(0, wrap_pos));
-                if (origColor) {
-                    rColor->push_back(curr_color);
-                }
-                curr_line = curr_line.substr(wrap_pos);
-                /* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
-                 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
-                curr_line.erase(0, curr_line.find_first_not_of(" "));
-            } else {
-                rText->push_back(curr_line);
-                if (origColor) {
-                    rColor->push_back(curr_color);
-                }
-                break;
-            }
+            rColor->insert(rColor->end(), pieces.size(), origColor->at(i));
         }
     }
     return true;
@@ -41,6 +41,10 @@ public:
 
     // NotifyVarChange - Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars __unused)
+    {
+        return false;
+    }
 
     // SetPos - Update the position of the render object
     //  Return 0 on success, <0 on error
@@ -49,6 +53,12 @@ public:
     // SetPageFocus - Notify when a page gains or loses focus
     virtual void SetPageFocus(int inFocus);
 
+    // GetDamageRect - Returns the region that may have changed on Update()
+    virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
+    // Drop all cached word wrapping. Must be called when fonts are freed.
+    static void ClearWrapCache();
+
 protected:
     // derived classes need to implement these
     // get number of items
@@ -400,6 +400,15 @@ int GUISliderValue::NotifyVarChange(const std::string& varName,
     return 0;
 }
 
+bool GUISliderValue::GetVarDependencies(std::vector<std::string>& vars)
+{
+    vars.push_back(mVariable);
+    if (mLabel && !mLabel->GetVarDependencies(vars)) {
+        return false;
+    }
+    return GUIObject::GetVarDependencies(vars);
+}
+
 void GUISliderValue::SetPageFocus(int inFocus)
 {
     if (inFocus) {
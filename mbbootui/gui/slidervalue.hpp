@@ -48,6 +48,7 @@ public:
 
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars);
 
     // SetPageFocus - Notify when a page gains or loses focus
     virtual void SetPageFocus(int inFocus);
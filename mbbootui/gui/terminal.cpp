@@ -20,12 +20,14 @@
 
 #include "gui/terminal.hpp"
 
+#include <algorithm>
 #include <vector>
 
 #include <cstring>
 
 #include <fcntl.h>
 #include <linux/input.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <termio.h>
 #include <unistd.h>
@@ -41,6 +43,11 @@
 #define debug_printf(...)
 #endif
 
+// Number of lines kept in the scrollback buffer
+#define TERMINAL_MAX_LINES      2000
+// Maximum number of bytes read from the pty per frame
+#define TERMINAL_READ_BUDGET    (64 * 1024)
+
 extern int g_pty_fd; // in gui.cpp where the select is
 
 /*
@@ -132,6 +139,19 @@ public:
         return rc;
     }
 
+    // Check if a read would return immediately (with data or an error)
+    bool readable() const
+    {
+        if (!started()) {
+            return false;
+        }
+        struct pollfd pfd;
+        pfd.fd = fdMaster;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        return poll(&pfd, 1, 0) > 0;
+    }
+
     int write(const char* buffer, size_t size)
     {
         if (!started()) {
@@ -280,8 +300,9 @@ public:
     {
         std::string text; // in UTF-8 format
         //std::vector<AttributeRange> attrs;
+        unsigned int serial; // value of the change serial when last modified
 
-        Line() {}
+        Line() : serial(0) {}
 
         size_t utf8forward(size_t start) const
         {
@@ -321,6 +342,67 @@ public:
         }
     };
 
+    // Fixed capacity ring buffer of lines. Index 0 is the oldest line.
+    class LineBuffer
+    {
+    public:
+        explicit LineBuffer(size_t capacity) : ring(capacity), first(0), count(0)
+        {
+        }
+
+        size_t size() const
+        {
+            return count;
+        }
+
+        bool full() const
+        {
+            return count == ring.size();
+        }
+
+        Line& operator[](size_t n)
+        {
+            return ring[(first + n) % ring.size()];
+        }
+
+        // The caller must make room with pop_front() if the buffer is full
+        void push_back()
+        {
+            ring[(first + count) % ring.size()] = Line();
+            ++count;
+        }
+
+        void pop_front(size_t n)
+        {
+            n = std::min(n, count);
+            for (size_t i = 0; i < n; ++i) {
+                ring[(first + i) % ring.size()] = Line();
+            }
+            first = (first + n) % ring.size();
+            count -= n;
+        }
+
+        // Remove all lines after the first n lines
+        void truncate(size_t n)
+        {
+            while (count > n) {
+                --count;
+                ring[(first + count) % ring.size()] = Line();
+            }
+        }
+
+        void clear()
+        {
+            truncate(0);
+            first = 0;
+        }
+
+    private:
+        std::vector<Line> ring;
+        size_t first; // ring index of the oldest line
+        size_t count;
+    };
+
     // A single character cell with a Unicode code point
     struct Cell
     {
@@ -350,12 +432,15 @@ public:
         }
     };
 
-    TerminalEngine()
+    TerminalEngine() : lines(TERMINAL_MAX_LINES)
     {
         // the default size will be overwritten by the GUI window when the size is known
         width = 40;
         height = 10;
 
+        cursorX = cursorY = 0;
+        unpackedY = kNoLine;
+        changeSerial = layoutSerial = 0;
         clear();
         updateCounter = 0;
         state = kStateGround;
@@ -381,27 +466,37 @@ public:
         }
     }
 
+    // Process everything the child wrote since the last frame, so that the GUI
+    // redraws once for the whole batch instead of once per read()
     void readPty()
     {
-        char buffer[1024];
-        int rc = pty.read(buffer, sizeof(buffer));
-        debug_printf("readPty: %d bytes\n", rc);
-        if (rc < 0) {
-            output("\r\nChild process exited.\r\n");
-            // TODO: maybe exit terminal here
-        } else {
+        char buffer[4096];
+        size_t total = 0;
+        do {
+            int rc = pty.read(buffer, sizeof(buffer));
+            debug_printf("readPty: %d bytes\n", rc);
+            if (rc < 0) {
+                output("\r\nChild process exited.\r\n");
+                // TODO: maybe exit terminal here
+                return;
+            } else if (rc == 0) {
+                break;
+            }
             for (int i = 0; i < rc; ++i) {
                 output(buffer[i]);
             }
-        }
+            total += rc;
+        } while (total < TERMINAL_READ_BUDGET && pty.readable());
     }
 
     void clear()
     {
         cursorX = cursorY = 0;
         lines.clear();
+        unpackedY = kNoLine;
         setY(0);
         unpackLine(0);
+        ++layoutSerial;
         ++updateCounter;
     }
 
@@ -499,10 +594,29 @@ public:
         return updateCounter;
     }
 
+    // Lines whose serial is newer than a previously returned change serial
+    // need to be redrawn
+    unsigned int getChangeSerial() const
+    {
+        return changeSerial;
+    }
+
+    unsigned int getLineSerial(size_t n)
+    {
+        return n < lines.size() ? lines[n].serial : 0;
+    }
+
+    // Changes whenever lines are removed, which moves all following lines
+    unsigned int getLayoutSerial() const
+    {
+        return layoutSerial;
+    }
+
     void setX(int x)
     {
         x = std::min(width, std::max(x, 0));
         cursorX = x;
+        markLineChanged(cursorY);
         ++updateCounter;
     }
 
@@ -510,10 +624,18 @@ public:
     {
         //y = min(height, max(y, 0));
         y = std::max(y, 0);
-        cursorY = y;
+        // the cursor is drawn on both the old and the new line
+        markLineChanged(cursorY);
         while (lines.size() <= (size_t) y) {
-            lines.push_back(Line());
+            if (lines.full()) {
+                // scroll the oldest line out of the buffer
+                dropLines(1);
+                --y;
+            }
+            lines.push_back();
         }
+        cursorY = y;
+        markLineChanged(cursorY);
         ++updateCounter;
     }
 
@@ -538,8 +660,34 @@ public:
     }
 
 private:
+    static const size_t kNoLine = (size_t) -1;
+
+    void markLineChanged(size_t y)
+    {
+        if (y < lines.size()) {
+            lines[y].serial = ++changeSerial;
+        }
+    }
+
+    // Discard the n oldest lines
+    void dropLines(size_t n)
+    {
+        n = std::min(n, lines.size());
+        if (unpackedY == kNoLine || unpackedY < n) {
+            unpackedY = kNoLine;
+        } else {
+            unpackedY -= n;
+        }
+        cursorY = std::max(cursorY - (int) n, 0);
+        lines.pop_front(n);
+        ++layoutSerial;
+    }
+
     void packLine()
     {
+        if (unpackedY >= lines.size()) {
+            return;
+        }
         std::string& s = lines[unpackedY].text;
         s.clear();
         for (size_t i = 0; i < unpackedLine.cells.size(); ++i) {
@@ -751,14 +899,17 @@ private:
             default:
             case 0:
                 unpackedLine.eraseFrom(cursorX);
+                markLineChanged(cursorY);
                 if (lines.size() > (size_t) cursorY + 1) {
-                    lines.erase(lines.begin() + cursorY + 1, lines.end());
+                    lines.truncate(cursorY + 1);
+                    ++layoutSerial;
                 }
                 break;
             case 1:
                 unpackedLine.eraseTo(cursorX);
+                markLineChanged(cursorY);
                 if (cursorY > 0) {
-                    lines.erase(lines.begin(), lines.begin() + cursorY - 1);
+                    dropLines(cursorY - 1);
                     cursorY = 0;
                 }
                 break;
@@ -784,6 +935,7 @@ private:
                 unpackedLine.cells.clear();
                 break;
             }
+            markLineChanged(cursorY);
             break;
         }
         // case 'L': // IL - insert line
@@ -797,10 +949,12 @@ private:
 private:
     int cursorX, cursorY; // 0-based, char based. TODO: decide how to handle scrollback
     int width, height; // window size in chars
-    std::vector<Line> lines; // the text buffer
+    LineBuffer lines; // the text buffer
     UnpackedLine unpackedLine; // current line for editing
     size_t unpackedY; // number of current line
     int updateCounter; // changes whenever terminal could require redraw
+    unsigned int changeSerial; // incremented whenever a line is modified
+    unsigned int layoutSerial; // incremented whenever lines are removed
 
     Pseudoterminal pty;
     enum { kStateGround, kStateEsc, kStateCsi } state;
@@ -836,6 +990,11 @@ GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 
     engine = &gEngine;
     updateCounter = 0;
+
+    drawnSerial = drawnLayoutSerial = 0;
+    drawnFirstItem = drawnYOffset = -1;
+    drawnItemCount = 0;
+    damageY = damageH = 0;
 }
 
 int GUITerminal::Update()
@@ -849,22 +1008,94 @@ int GUITerminal::Update()
         lastCondition = true;
         // we're becoming visible, so we might need to resize the terminal content
         InitAndResize();
+        drawnFirstItem = -1;
     }
 
+    // Input and touch scrolling need the whole widget to be redrawn
+    bool full = mUpdate != 0;
+    bool changed = false;
+
     if (updateCounter != engine->getUpdateCounter()) {
         // try to keep the cursor in view
         SetVisibleListLocation(engine->getCursorY());
         updateCounter = engine->getUpdateCounter();
+        changed = true;
     }
 
+    mUpdate = 0;
     GUIScrollList::Update();
-
     if (mUpdate) {
-        mUpdate = 0;
-        if (Render() == 0) {
-            return 2;
+        // kinetic scrolling or a new header value
+        full = true;
+    }
+    mUpdate = 0;
+
+    if ((full || changed) && UpdateDamage(full)) {
+        // the next Render() call draws the damaged rows
+        return 2;
+    }
+    return 0;
+}
+
+// Find the rows that need to be redrawn. Only lines that were modified since
+// the last redraw are damaged, unless the list scrolled or lines were removed.
+// Returns false if nothing visible changed.
+bool GUITerminal::UpdateDamage(bool full)
+{
+    size_t itemCount = GetItemCount();
+    size_t displayCount = GetDisplayItemCount();
+    unsigned int serial = engine->getChangeSerial();
+    unsigned int layoutSerial = engine->getLayoutSerial();
+
+    if (firstDisplayedItem != drawnFirstItem || y_offset != drawnYOffset
+            || layoutSerial != drawnLayoutSerial) {
+        full = true;
+    }
+    // the fast scroll bar changes with the number of lines
+    if (itemCount != drawnItemCount
+            && (itemCount > displayCount || drawnItemCount > displayCount)) {
+        full = true;
+    }
+
+    int listY = mRenderY + mHeaderH;
+    int listY2 = mRenderY + mRenderH;
+    int y1 = listY2, y2 = listY;
+
+    if (full) {
+        y1 = mRenderY;
+        y2 = listY2;
+    } else {
+        int yPos = listY + (itemCount > displayCount ? y_offset : 0);
+        for (size_t item = firstDisplayedItem; item < itemCount && yPos < listY2;
+                ++item, yPos += actualItemHeight) {
+            if (engine->getLineSerial(item) > drawnSerial) {
+                y1 = std::min(y1, std::max(yPos, listY));
+                y2 = std::max(y2, std::min(yPos + actualItemHeight, listY2));
+            }
         }
     }
+
+    drawnSerial = serial;
+    drawnLayoutSerial = layoutSerial;
+    drawnFirstItem = firstDisplayedItem;
+    drawnYOffset = y_offset;
+    drawnItemCount = itemCount;
+
+    if (y1 >= y2) {
+        return false;
+    }
+
+    damageY = y1;
+    damageH = y2 - y1;
+    return true;
+}
+
+int GUITerminal::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    x = mRenderX;
+    y = damageY;
+    w = mRenderW;
+    h = damageH;
     return 0;
 }
 
@@ -915,6 +1146,13 @@ size_t GUITerminal::GetItemCount()
 
 void GUITerminal::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 {
+    // Skip shaping the text of rows that are clipped away anyway
+    int dx, dy, dw, dh;
+    if (gr_get_damage(&dx, &dy, &dw, &dh) == 0
+            && (yPos >= dy + dh || yPos + actualItemHeight <= dy)) {
+        return;
+    }
+
     const TerminalEngine::Line& line = engine->getLine(itemindex);
 
     gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
@@ -31,6 +31,9 @@ public:
     //  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
     virtual int Update();
 
+    // GetDamageRect - Returns the region that may have changed on Update()
+    virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
     // NotifyTouch - Notify of a touch event
     //  Return 0 on success, >0 to ignore remainder of touch, and <0 on error (Return error to allow other handlers)
     virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -52,8 +55,16 @@ public:
 
 protected:
     void InitAndResize();
+    bool UpdateDamage(bool full);
 
     TerminalEngine* engine; // non-visual parts of the terminal (text buffer etc.), not owned
     int updateCounter; // to track if anything changed in the back-end
     bool lastCondition; // to track if the condition became true and we might need to resize the terminal engine
+
+    // State of the last redraw, to find the lines that changed since then
+    unsigned int drawnSerial;
+    unsigned int drawnLayoutSerial;
+    int drawnFirstItem, drawnYOffset;
+    size_t drawnItemCount;
+    int damageY, damageH; // rows to redraw from the last Update()
 };
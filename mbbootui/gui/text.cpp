@@ -26,6 +26,8 @@ GUIText::GUIText(xml_node<>* node) : GUIObject(node)
     mIsStatic = 1;
     mVarChanged = 0;
     mFontHeight = 0;
+    mMeasuredFont = nullptr;
+    mMeasuredWidth = 0;
     maxWidth = 0;
     scaleWidth = true;
     isHighlighted = false;
@@ -96,15 +98,13 @@ int GUIText::Render()
         return -1;
     }
 
-    mLastValue = gui_parse_text(mText);
+    // Static text never changes after it is loaded
+    if (!mIsStatic) {
+        mLastValue = gui_parse_text(mText);
+    }
 
     mVarChanged = 0;
 
-    __attribute__((unused))
-    int x = mRenderX, y = mRenderY;
-    __attribute__((unused))
-    int width = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
-
     if (isHighlighted) {
         gr_color(mHighlightColor.red, mHighlightColor.green,
                  mHighlightColor.blue, mHighlightColor.alpha);
@@ -156,11 +156,23 @@ int GUIText::GetCurrentBounds(int& w, int& h)
     }
 
     h = mFontHeight;
-    mLastValue = gui_parse_text(mText);
-    w = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
+    if (!mIsStatic) {
+        mLastValue = gui_parse_text(mText);
+    }
+    w = MeasureText(fontResource);
     return 0;
 }
 
+int GUIText::MeasureText(void* fontResource)
+{
+    if (fontResource != mMeasuredFont || mLastValue != mMeasuredValue) {
+        mMeasuredWidth = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
+        mMeasuredValue = mLastValue;
+        mMeasuredFont = fontResource;
+    }
+    return mMeasuredWidth;
+}
+
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
 {
     GUIObject::NotifyVarChange(varName, value);
@@ -169,6 +181,25 @@ int GUIText::NotifyVarChange(const std::string& varName, const std::string& valu
     return 0;
 }
 
+bool GUIText::GetVarDependencies(std::vector<std::string>& vars)
+{
+    if (!mIsStatic) {
+        // Find the %value% blocks in the same way as gui_parse_text()
+        std::string text = gui_parse_resources(mText);
+        size_t pos = 0, next, end;
+
+        while ((next = text.find('%', pos)) != std::string::npos
+                && (end = text.find('%', next + 1)) != std::string::npos) {
+            if (next + 1 != end && text[next + 1] != '@') {
+                vars.push_back(text.substr(next + 1, (end - next) - 1));
+            }
+            pos = end + 1;
+        }
+    }
+
+    return GUIObject::GetVarDependencies(vars);
+}
+
 int GUIText::SetMaxWidth(unsigned width)
 {
     maxWidth = width;
@@ -182,4 +213,9 @@ int GUIText::SetMaxWidth(unsigned width)
 void GUIText::SetText(std::string newtext)
 {
     mText = std::move(newtext);
+    mLastValue = gui_parse_text(mText);
+    if (mLastValue != mText) {
+        mIsStatic = 0;
+    }
+    mVarChanged = 1;
 }
@@ -42,6 +42,7 @@ public:
 
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+    virtual bool GetVarDependencies(std::vector<std::string>& vars);
 
     // Set maximum width in pixels
     virtual int SetMaxWidth(unsigned width);
@@ -62,4 +63,10 @@ protected:
     int mIsStatic;
     int mVarChanged;
     int mFontHeight;
+
+    // Width of mMeasuredValue, which is reused until the text or font changes
+    std::string mMeasuredValue;
+    void* mMeasuredFont;
+    int mMeasuredWidth;
+    int MeasureText(void* fontResource);
 };
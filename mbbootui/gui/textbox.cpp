@@ -97,20 +97,20 @@ int GUITextBox::NotifyVarChange(const std::string& varName, const std::string& v
         return 0;
     }
 
-    // Check to see if the variable exists in mText
+    // Re-wrap the text only if a line actually changed. Lines that did not
+    // change are served from the word wrap cache.
+    bool changed = false;
     for (size_t i = 0; i < mText.size(); i++) {
         std::string lookup = gui_parse_text(mText.at(i));
-        if (lookup != mText.at(i)) {
-            mLastValue.at(i) = lookup;
-            mUpdate = 1;
-            // There are ways to improve efficiency here, but I am not
-            // sure if we will even use this feature in the stock theme
-            // at all except for language translation. If we start using
-            // variables in textboxes in the stock theme, we can circle
-            // back and make improvements here.
-            mLastCount = 0;
-            rText.clear();
+        if (lookup != mLastValue.at(i)) {
+            mLastValue.at(i) = std::move(lookup);
+            changed = true;
         }
     }
+    if (changed) {
+        mUpdate = 1;
+        mLastCount = 0;
+        rText.clear();
+    }
     return 0;
 }
@@ -39,6 +39,7 @@
 
 #include <android/log.h>
 
+#include "gui/action.hpp"
 #include "gui/console.hpp"
 #include "gui/gui.h"
 // #include "gui/gui.hpp"
@@ -100,16 +101,15 @@ static bool redirect_output_to_file(const char *path, mode_t mode)
 
 static bool detect_device()
 {
-    std::vector<unsigned char> contents;
-    if (!mb::util::file_read_all(DEVICE_JSON_PATH, &contents)) {
+    mb::util::FileView contents;
+    if (!contents.open(DEVICE_JSON_PATH)) {
         LOGE("%s: Failed to read file: %s", DEVICE_JSON_PATH, strerror(errno));
         return false;
     }
-    contents.push_back('\0');
 
     JsonError error;
 
-    if (!device_from_json(reinterpret_cast<char *>(contents.data()),
+    if (!device_from_json(std::string(contents.begin(), contents.end()),
                           tw_device, error)) {
         LOGE("%s: Failed to load device", DEVICE_JSON_PATH);
         return false;
@@ -446,13 +446,27 @@ int main(int argc, char *argv[])
     }
     mbtool_interface = mbtool_connection.interface();
 
-    LOGV("Loading default values...");
-    DataManager::SetDefaultValues();
+    // Second connection for requests made while the UI is running. The
+    // version and ROM ID requests are sent right away so that the daemon can
+    // handle them while the graphics system is loaded.
+    if (!mbtool_async.start()) {
+        LOGE("Failed to connect to mbtool");
+        return EXIT_FAILURE;
+    }
 
-    // Set daemon version
     std::string mbtool_version;
-    mbtool_interface->version(&mbtool_version);
-    DataManager::SetValue(VAR_TW_MBTOOL_VERSION, mbtool_version);
+    std::string rom_id;
+    mbtool_async.version([&](bool ok, const std::string &version) {
+        (void) ok;
+        mbtool_version = version;
+    });
+    mbtool_async.get_booted_rom_id([&](bool ok, const std::string &id) {
+        (void) ok;
+        rom_id = id;
+    });
+
+    LOGV("Loading default values...");
+    DataManager::SetDefaultValues();
 
     LOGV("Loading graphics system...");
     if (gui_init() < 0) {
@@ -463,11 +477,14 @@ int main(int argc, char *argv[])
     LOGV("Loading resources...");
     gui_loadResources();
 
+    mbtool_async.wait_idle();
+
+    // Set daemon version
+    DataManager::SetValue(VAR_TW_MBTOOL_VERSION, mbtool_version);
+
     // Set ROM ID. mbtool's ROM detection code doesn't fully trust the
     // "ro.multiboot.romid" property and will do some additional checks to
     // ensure that the value is correct.
-    std::string rom_id;
-    mbtool_interface->get_booted_rom_id(&rom_id);
     if (rom_id.empty()) {
         LOGW("Could not determine ROM ID");
     }
@@ -487,6 +504,9 @@ int main(int argc, char *argv[])
     //gui_start();
     gui_startPage("autoboot", 1, 0);
 
+    // Let the running action finish before anything is torn down
+    GUIAction::StopActionThreads();
+
     // Exit action
     std::string exit_action;
     DataManager::GetValue(VAR_TW_EXIT_ACTION, exit_action);
@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -37,6 +39,12 @@
 
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(*(A)))
 
+// Three buffers allow drawing the next frame while a flip is still queued
+#define DRM_MAX_BUFFERS 3
+
+// How long to wait for a page flip event before assuming it was lost
+#define DRM_FLIP_TIMEOUT_MS 100
+
 struct drm_surface
 {
     GRSurface base;
@@ -44,14 +52,27 @@ struct drm_surface
     uint32_t handle;
 };
 
-static drm_surface *drm_surfaces[2];
+static drm_surface *drm_surfaces[DRM_MAX_BUFFERS];
+static int buffer_count;
+// Buffer being drawn into
 static int current_buffer;
+// Buffer being scanned out
+static int displayed_buffer;
+// Buffer that will be displayed at the next vblank (-1 if no flip is queued)
+static int pending_buffer = -1;
+
+static unsigned long flips_completed;
+// Number of flips whose event never arrived
+static unsigned long flips_timed_out;
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
 
 static int drm_fd = -1;
 
+// Cleared if the driver doesn't support DRM_IOCTL_MODE_DIRTYFB
+static bool drm_dirty_supported = true;
+
 static void drm_disable_crtc(int drm_fd, drmModeCrtc *crtc)
 {
     if (crtc) {
@@ -81,13 +102,62 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
     }
 }
 
+static void drm_page_flip_handler(int fd __unused,
+                                  unsigned int sequence __unused,
+                                  unsigned int tv_sec __unused,
+                                  unsigned int tv_usec __unused,
+                                  void *user_data __unused)
+{
+    ++flips_completed;
+
+    displayed_buffer = pending_buffer;
+    pending_buffer = -1;
+}
+
+// Block until the queued page flip (if any) has happened
+static void drm_wait_for_flip()
+{
+    drmEventContext ev_ctx;
+    memset(&ev_ctx, 0, sizeof(ev_ctx));
+    ev_ctx.version = 2;
+    ev_ctx.page_flip_handler = drm_page_flip_handler;
+
+    while (pending_buffer >= 0) {
+        struct pollfd fds;
+        fds.fd = drm_fd;
+        fds.events = POLLIN;
+        fds.revents = 0;
+
+        int ret = poll(&fds, 1, DRM_FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            // Don't hang the UI if the driver never sends the event
+            printf("Timed out waiting for page flip event\n");
+            ++flips_timed_out;
+            displayed_buffer = pending_buffer;
+            pending_buffer = -1;
+            break;
+        }
+
+        if (drmHandleEvent(drm_fd, &ev_ctx) != 0) {
+            printf("drmHandleEvent failed: %s\n", strerror(errno));
+            displayed_buffer = pending_buffer;
+            pending_buffer = -1;
+            break;
+        }
+    }
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank)
 {
+    drm_wait_for_flip();
+
     if (blank) {
         drm_disable_crtc(drm_fd, main_monitor_crtc);
     } else {
         drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+                        drm_surfaces[displayed_buffer]);
     }
 }
 
@@ -482,33 +552,103 @@ static GRSurface* drm_init(minui_backend* backend __unused)
         close(drm_fd);
         return nullptr;
     }
+    buffer_count = 2;
+
+    // Fall back to double buffering if there's not enough memory
+    for (i = 2; i < DRM_MAX_BUFFERS; ++i) {
+        drm_surfaces[i] = drm_create_surface(width, height);
+        if (!drm_surfaces[i]) {
+            break;
+        }
+        ++buffer_count;
+    }
+    printf("Using %d DRM buffers\n", buffer_count);
 
     current_buffer = 0;
+    displayed_buffer = 1;
+    pending_buffer = -1;
 
     drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
 
     return &(drm_surfaces[0]->base);
 }
 
+// Returns a buffer that is neither displayed nor queued for display
+static int drm_find_free_buffer()
+{
+    for (int i = 0; i < buffer_count; ++i) {
+        if (i != displayed_buffer && i != pending_buffer) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static GRSurface* drm_flip(minui_backend* backend __unused)
 {
     int ret;
 
+    // Only one flip can be queued at a time. This also paces rendering to
+    // the display's refresh rate.
+    drm_wait_for_flip();
+
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, nullptr);
+                          drm_surfaces[current_buffer]->fb_id,
+                          DRM_MODE_PAGE_FLIP_EVENT, nullptr);
     if (ret < 0) {
         printf("drmModePageFlip failed ret=%d\n", ret);
         return nullptr;
     }
-    current_buffer = 1 - current_buffer;
+    pending_buffer = current_buffer;
+
+    // With double buffering, the only other buffer is still being scanned out
+    // until the flip completes
+    current_buffer = drm_find_free_buffer();
+    if (current_buffer < 0) {
+        drm_wait_for_flip();
+        current_buffer = drm_find_free_buffer();
+    }
+
     return &(drm_surfaces[current_buffer]->base);
 }
 
+static GRSurface* drm_flip_region(minui_backend* backend,
+                                  int x, int y, int w, int h)
+{
+    uint32_t fb_id = drm_surfaces[current_buffer]->fb_id;
+
+    GRSurface *surface = drm_flip(backend);
+
+    // Let drivers for panels that support partial updates (eg. command mode
+    // DSI panels) know which part of the new front buffer changed
+    if (surface && drm_dirty_supported) {
+        drmModeClip clip;
+        clip.x1 = x;
+        clip.y1 = y;
+        clip.x2 = x + w;
+        clip.y2 = y + h;
+
+        int ret = drmModeDirtyFB(drm_fd, fb_id, &clip, 1);
+        if (ret == -ENOSYS || ret == -EINVAL) {
+            drm_dirty_supported = false;
+        }
+    }
+
+    return surface;
+}
+
 static void drm_exit(minui_backend* backend __unused)
 {
+    drm_wait_for_flip();
+    printf("DRM page flips: %lu completed, %lu timed out\n",
+           flips_completed, flips_timed_out);
+
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    for (int i = 0; i < buffer_count; ++i) {
+        drm_destroy_surface(drm_surfaces[i]);
+        drm_surfaces[i] = nullptr;
+    }
+    buffer_count = 0;
     drmModeFreeCrtc(main_monitor_crtc);
     drmModeFreeConnector(main_monitor_connector);
     close(drm_fd);
@@ -520,6 +660,7 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_region = drm_flip_region,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(drm)() {
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,7 @@
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_region(minui_backend*, int, int, int, int);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -51,11 +54,17 @@ static fb_var_screeninfo vi;
 static int fb_fd = -1;
 static __u32 smem_len;
 
+// Region that was copied to the displayed buffer during the last flip. The
+// other buffer is missing these changes. If false, it is missing everything.
+static bool prev_damage_valid = false;
+static int prev_damage_x, prev_damage_y, prev_damage_w, prev_damage_h;
+
 static minui_backend my_backend = {
     .init = fbdev_init,
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .flip_region = fbdev_flip_region,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(fbdev)()
@@ -277,6 +286,8 @@ static GRSurface* fbdev_init(minui_backend* backend)
 
 static GRSurface* fbdev_flip(minui_backend* backend __unused)
 {
+    prev_damage_valid = false;
+
     if (tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888) {
         // In case of BGRA, do some byte swapping
         unsigned int idx;
@@ -333,6 +344,58 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused)
     return gr_draw;
 }
 
+static void copy_region(GRSurface* dst, int x, int y, int w, int h)
+{
+    size_t offset = y * gr_draw->row_bytes + x * gr_draw->pixel_bytes;
+    size_t len = w * gr_draw->pixel_bytes;
+
+    for (int row = 0; row < h; ++row) {
+        memcpy(dst->data + offset, gr_draw->data + offset, len);
+        offset += gr_draw->row_bytes;
+    }
+}
+
+static GRSurface* fbdev_flip_region(minui_backend* backend,
+                                    int x, int y, int w, int h)
+{
+    // Byte swapping and rotation are done in place on the whole frame
+    if (tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888
+            || (tw_device.tw_flags()
+                    & mb::device::TwFlag::BoardHasFlippedScreen)) {
+        return fbdev_flip(backend);
+    }
+
+    if (!double_buffered) {
+        copy_region(&gr_framebuffer[0], x, y, w, h);
+        return gr_draw;
+    }
+
+    // The buffer being switched to also needs the previous frame's changes
+    int copy_x = 0;
+    int copy_y = 0;
+    int copy_w = gr_draw->width;
+    int copy_h = gr_draw->height;
+
+    if (prev_damage_valid) {
+        copy_x = std::min(x, prev_damage_x);
+        copy_y = std::min(y, prev_damage_y);
+        copy_w = std::max(x + w, prev_damage_x + prev_damage_w) - copy_x;
+        copy_h = std::max(y + h, prev_damage_y + prev_damage_h) - copy_y;
+    }
+
+    copy_region(&gr_framebuffer[1-displayed_buffer],
+                copy_x, copy_y, copy_w, copy_h);
+    set_displayed_framebuffer(1-displayed_buffer);
+
+    prev_damage_valid = true;
+    prev_damage_x = x;
+    prev_damage_y = y;
+    prev_damage_w = w;
+    prev_damage_h = h;
+
+    return gr_draw;
+}
+
 static void fbdev_exit(minui_backend* backend __unused)
 {
     close(fb_fd);
@@ -14,10 +14,12 @@
  * limitations under the License.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
 #include <sys/poll.h>
 #include <limits.h>
 #include <linux/input.h>
@@ -34,6 +36,10 @@
 //#define _EVENT_LOGGING
 
 #define MAX_DEVICES         32
+// Number of processed events that can be queued between calls to ev_get()
+#define EV_QUEUE_SIZE       256
+// Maximum number of raw events read from a device with one read() call
+#define EV_READ_BATCH       64
 
 #define VIBRATOR_TIMEOUT_FILE "/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
@@ -64,6 +70,10 @@
 #define ABS_MT_PRESSURE     0x3a
 #define ABS_MT_DISTANCE     0x3b
 
+#ifndef EPOLLWAKEUP
+#define EPOLLWAKEUP         (1u << 29)
+#endif
+
 enum
 {
     DOWN_NOT,
@@ -106,6 +116,16 @@ static unsigned ev_count = 0;
 static struct timespec lastInputStat;
 static unsigned long lastInputMTime;
 static int has_mouse = 0;
+static int ev_epoll_fd = -1;
+
+// Ring buffer of events that have already been through vk_modify(). The kernel
+// timestamps are preserved, so the render loop sees when each event happened.
+static struct input_event ev_queue[EV_QUEUE_SIZE];
+static unsigned ev_queue_head = 0;
+static unsigned ev_queue_count = 0;
+// Whether the newest queued event is a drag (a move that follows another move)
+// and can be replaced by the next move
+static int ev_queue_tail_is_drag = 0;
 
 static inline int ABS(int x)
 {
@@ -343,6 +363,12 @@ int ev_init(void)
                 continue;
             }
 
+#ifdef EVIOCSCLOCKID
+            // Use the same clock as the render loop for the event timestamps
+            int clock_id = CLOCK_MONOTONIC;
+            ioctl(fd, EVIOCSCLOCKID, &clock_id);
+#endif
+
             ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
             evs[ev_count].fd = &ev_fds[ev_count];
@@ -360,6 +386,30 @@ int ev_init(void)
         closedir(dir);
     }
 
+    // EPOLLWAKEUP keeps the device awake until the events have been read. The
+    // kernel silently drops the flag if we lack CAP_BLOCK_SUSPEND. If epoll
+    // isn't available at all, ev_get() falls back to poll(). The epoll fd is
+    // kept when the devices are reloaded so that ev_get_fd() stays valid.
+    if (ev_epoll_fd < 0) {
+        ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    }
+    if (ev_epoll_fd >= 0) {
+        for (unsigned n = 0; n < ev_count; n++) {
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN | EPOLLWAKEUP;
+            event.data.u32 = n;
+            if (epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_fds[n].fd,
+                          &event) < 0) {
+                printf("Failed to add input device to epoll: %s\n",
+                       strerror(errno));
+                close(ev_epoll_fd);
+                ev_epoll_fd = -1;
+                break;
+            }
+        }
+    }
+
     struct stat st;
     if (stat("/dev/input", &st) >= 0) {
         lastInputMTime = st.st_mtime;
@@ -369,7 +419,8 @@ int ev_init(void)
     return 0;
 }
 
-void ev_exit(void)
+// Closing the devices also removes them from the epoll set
+static void ev_close_devices(void)
 {
     while (ev_count-- > 0) {
         if (evs[ev_count].vk_count) {
@@ -381,6 +432,16 @@ void ev_exit(void)
     ev_count = 0;
 }
 
+void ev_exit(void)
+{
+    ev_close_devices();
+
+    if (ev_epoll_fd >= 0) {
+        close(ev_epoll_fd);
+        ev_epoll_fd = -1;
+    }
+}
+
 #if 0 // Unused
 static int vk_inside_display(__s32 value, struct input_absinfo *info, int screen_size)
 {
@@ -761,37 +822,130 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 0;
 }
 
+static inline int ev_is_move(const struct input_event *ev)
+{
+    return ev->type == EV_ABS && ev->code == 1;
+}
+
+static void ev_queue_push(const struct input_event *ev)
+{
+    if (ev_is_move(ev) && ev_queue_count > 0) {
+        struct input_event *tail = &ev_queue[
+                (ev_queue_head + ev_queue_count - 1) % EV_QUEUE_SIZE];
+
+        // Intermediate moves are merged, but the first move of a touch (the
+        // touch start) is kept so the press lands where the finger went down
+        if (ev_queue_tail_is_drag) {
+            *tail = *ev;
+            return;
+        }
+        ev_queue_tail_is_drag = ev_is_move(tail);
+    } else {
+        ev_queue_tail_is_drag = 0;
+    }
+
+    ev_queue[(ev_queue_head + ev_queue_count) % EV_QUEUE_SIZE] = *ev;
+    ev_queue_count++;
+}
+
+static int ev_queue_pop(struct input_event *ev)
+{
+    if (ev_queue_count == 0) {
+        return 0;
+    }
+
+    *ev = ev_queue[ev_queue_head];
+    ev_queue_head = (ev_queue_head + 1) % EV_QUEUE_SIZE;
+    ev_queue_count--;
+    if (ev_queue_count == 0) {
+        ev_queue_tail_is_drag = 0;
+    }
+    return 1;
+}
+
+// Read everything that is pending on a device and queue the processed events.
+// Reading stops early if the queue is nearly full; the rest stays in the
+// kernel's buffer until the next call.
+static void ev_read_device(unsigned n)
+{
+    struct input_event buf[EV_READ_BATCH];
+
+    while (EV_QUEUE_SIZE - ev_queue_count >= EV_READ_BATCH) {
+        ssize_t r = read(ev_fds[n].fd, buf, sizeof(buf));
+        if (r < (ssize_t) sizeof(buf[0])) {
+            break;
+        }
+
+        size_t count = r / sizeof(buf[0]);
+        for (size_t i = 0; i < count; i++) {
+            if (!vk_modify(&evs[n], &buf[i])) {
+                ev_queue_push(&buf[i]);
+            }
+        }
+
+        if (count < EV_READ_BATCH) {
+            break;
+        }
+    }
+}
+
+// Wait for input and read all ready devices. Returns the number of ready
+// devices, 0 on timeout, or -1 on error.
+static int ev_poll_devices(int timeout_ms)
+{
+    int r;
+
+    if (ev_epoll_fd >= 0) {
+        struct epoll_event events[MAX_DEVICES];
+
+        r = epoll_wait(ev_epoll_fd, events, MAX_DEVICES, timeout_ms);
+        for (int i = 0; i < r; i++) {
+            if (events[i].events & EPOLLIN) {
+                ev_read_device(events[i].data.u32);
+            }
+        }
+    } else {
+        r = poll(ev_fds, ev_count, timeout_ms);
+        if (r > 0) {
+            for (unsigned n = 0; n < ev_count; n++) {
+                if (ev_fds[n].revents & POLLIN) {
+                    ev_read_device(n);
+                }
+            }
+        }
+    }
+
+    return r;
+}
+
 int ev_get(struct input_event *ev, int timeout_ms)
 {
     int r;
-    unsigned n;
     struct timespec curr;
 
+    // Drain what we already have before going back to the kernel
+    if (ev_queue_pop(ev)) {
+        return 0;
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &curr);
     if (curr.tv_sec - lastInputStat.tv_sec >= 2) {
         struct stat st;
         stat("/dev/input", &st);
         if (st.st_mtime > lastInputMTime) {
             printf("Reloading input devices\n");
-            ev_exit();
+            ev_close_devices();
             ev_init();
             lastInputMTime = st.st_mtime;
         }
         lastInputStat = curr;
     }
 
-    r = poll(ev_fds, ev_count, timeout_ms);
+    r = ev_poll_devices(timeout_ms);
 
     if (r > 0) {
-        for (n = 0; n < ev_count; n++) {
-            if (ev_fds[n].revents & POLLIN) {
-                r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                if (r == sizeof(*ev)) {
-                    if (!vk_modify(&evs[n], ev)) {
-                        return 0;
-                    }
-                }
-            }
+        if (ev_queue_pop(ev)) {
+            return 0;
         }
         return -1;
     }
@@ -799,6 +953,13 @@ int ev_get(struct input_event *ev, int timeout_ms)
     return -2;
 }
 
+// Get an fd that becomes readable when input is available, or -1 if the
+// devices can only be polled through ev_get()
+int ev_get_fd(void)
+{
+    return ev_epoll_fd;
+}
+
 int ev_wait(int timeout)
 {
     (void) timeout;
@@ -14,9 +14,14 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+
 #include <unistd.h>
 
 #include <fcntl.h>
@@ -37,6 +42,7 @@
 #include "backend/backend.h"
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_kernels.h"
 #include "gui/placement.h"
 
 struct GRFont
@@ -71,6 +77,59 @@ static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
 
+enum class DamageState
+{
+    None,
+    Rect,
+    Full,
+};
+
+// Region damaged since the last flip (x2 and y2 are exclusive)
+static DamageState gr_damage_state = DamageState::None;
+static int gr_damage_x1, gr_damage_y1, gr_damage_x2, gr_damage_y2;
+// Whether gr_clip() and gr_noclip() are limited to the damaged region
+static bool gr_damage_clip = false;
+
+// Number of flips for which the damaged regions are remembered. Back ends that
+// return a surface older than this get a full copy of the last frame.
+#define GR_DAMAGE_HISTORY 4
+
+struct DamageRecord
+{
+    bool full;
+    int x1, y1, x2, y2;
+};
+
+// Damage of recent frames (indexed by frame number modulo GR_DAMAGE_HISTORY)
+static DamageRecord gr_damage_history[GR_DAMAGE_HISTORY];
+// Number of the last flipped frame
+static unsigned int gr_frame = 0;
+// Frame number each surface returned by the back end last contained
+static struct {
+    GRSurface *surface;
+    unsigned int frame;
+} gr_surface_frames[GR_DAMAGE_HISTORY];
+
+// Frame timing statistics
+static unsigned long gr_stats_frames = 0;
+static uint64_t gr_stats_flip_total_us = 0;
+static uint64_t gr_stats_flip_max_us = 0;
+static unsigned long gr_stats_intervals = 0;
+static uint64_t gr_stats_interval_total_us = 0;
+static uint64_t gr_stats_interval_max_us = 0;
+static uint64_t gr_stats_last_flip_us = 0;
+
+// Kernels for drawing directly to gr_draw, bypassing pixelflinger (nullptr if
+// the pixel format isn't supported)
+static const GRPixelOps *gr_pixel_ops = nullptr;
+// Format that loaded images are converted to (-1 if they aren't converted)
+static int gr_native_format = -1;
+// Current color components in pixelflinger's order (after any R/B swap)
+static unsigned char gr_color_c[4];
+// Current scissor rectangle (x2 and y2 are exclusive)
+static bool gr_scissor_enabled = false;
+static int gr_scissor_x1, gr_scissor_y1, gr_scissor_x2, gr_scissor_y2;
+
 #if 0 // unused
 static bool outside(int x, int y)
 {
@@ -130,21 +189,159 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
             y -= measured_height;
         }
     }
-    return gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, measured_width + x, -1);
+    // The string is never truncated here, so draw it without a width limit.
+    // That way, drawing uses the same string cache entry as the measurement
+    // above instead of shaping and caching the string a second time.
+    return gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, -1, -1);
 }
 
 void gr_clip(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
+
+    if (gr_damage_clip) {
+        int x2 = std::min(x + w, gr_damage_x2);
+        int y2 = std::min(y + h, gr_damage_y2);
+        x = std::max(x, gr_damage_x1);
+        y = std::max(y, gr_damage_y1);
+        w = std::max(x2 - x, 0);
+        h = std::max(y2 - y, 0);
+    }
+
     gl->scissor(gl, x, y, w, h);
     gl->enable(gl, GGL_SCISSOR_TEST);
+
+    gr_scissor_enabled = true;
+    gr_scissor_x1 = x;
+    gr_scissor_y1 = y;
+    gr_scissor_x2 = x + w;
+    gr_scissor_y2 = y + h;
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
+
+    if (gr_damage_clip) {
+        gl->scissor(gl, gr_damage_x1, gr_damage_y1,
+                    gr_damage_x2 - gr_damage_x1, gr_damage_y2 - gr_damage_y1);
+        gl->enable(gl, GGL_SCISSOR_TEST);
+
+        gr_scissor_enabled = true;
+        gr_scissor_x1 = gr_damage_x1;
+        gr_scissor_y1 = gr_damage_y1;
+        gr_scissor_x2 = gr_damage_x2;
+        gr_scissor_y2 = gr_damage_y2;
+        return;
+    }
+
     gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
     gl->disable(gl, GGL_SCISSOR_TEST);
+
+    gr_scissor_enabled = false;
+}
+
+// Clip a rectangle to the drawing surface and the scissor rectangle. Returns
+// false if nothing is left to draw.
+static bool clip_rect(int &x, int &y, int &w, int &h)
+{
+    int x1 = std::max(x, 0);
+    int y1 = std::max(y, 0);
+    int x2 = std::min(x + w, gr_draw->width);
+    int y2 = std::min(y + h, gr_draw->height);
+
+    if (gr_scissor_enabled) {
+        x1 = std::max(x1, gr_scissor_x1);
+        y1 = std::max(y1, gr_scissor_y1);
+        x2 = std::min(x2, gr_scissor_x2);
+        y2 = std::min(y2, gr_scissor_y2);
+    }
+
+    if (x1 >= x2 || y1 >= y2) {
+        return false;
+    }
+
+    x = x1;
+    y = y1;
+    w = x2 - x1;
+    h = y2 - y1;
+    return true;
+}
+
+void gr_damage(int x, int y, int w, int h)
+{
+    if (gr_damage_state == DamageState::Full) {
+        return;
+    }
+
+    int x1 = std::max(x, 0);
+    int y1 = std::max(y, 0);
+    int x2 = std::min(x + w, gr_fb_width());
+    int y2 = std::min(y + h, gr_fb_height());
+    if (x1 >= x2 || y1 >= y2) {
+        // Nothing visible changed
+        return;
+    }
+
+    if (gr_damage_state == DamageState::None) {
+        gr_damage_x1 = x1;
+        gr_damage_y1 = y1;
+        gr_damage_x2 = x2;
+        gr_damage_y2 = y2;
+        gr_damage_state = DamageState::Rect;
+    } else {
+        gr_damage_x1 = std::min(gr_damage_x1, x1);
+        gr_damage_y1 = std::min(gr_damage_y1, y1);
+        gr_damage_x2 = std::max(gr_damage_x2, x2);
+        gr_damage_y2 = std::max(gr_damage_y2, y2);
+    }
+}
+
+void gr_damage_all(void)
+{
+    gr_damage_state = DamageState::Full;
+}
+
+int gr_get_damage(int *x, int *y, int *w, int *h)
+{
+    if (gr_damage_state != DamageState::Rect) {
+        return -1;
+    }
+
+    *x = gr_damage_x1;
+    *y = gr_damage_y1;
+    *w = gr_damage_x2 - gr_damage_x1;
+    *h = gr_damage_y2 - gr_damage_y1;
+    return 0;
+}
+
+void gr_clip_to_damage(void)
+{
+    if (gr_damage_state != DamageState::Rect) {
+        return;
+    }
+
+    gr_damage_clip = true;
+    gr_noclip();
+}
+
+void gr_noclip_damage(void)
+{
+    gr_damage_clip = false;
+    gr_noclip();
+}
+
+// Copy a region between two surfaces with the same geometry
+static void copy_region(GRSurface *dst, const GRSurface *src,
+                        int x, int y, int w, int h)
+{
+    size_t offset = y * src->row_bytes + x * src->pixel_bytes;
+    size_t len = w * src->pixel_bytes;
+
+    for (int row = 0; row < h; ++row) {
+        memcpy(dst->data + offset, src->data + offset, len);
+        offset += src->row_bytes;
+    }
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -215,6 +412,13 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     }
     gl->color4xv(gl, color);
 
+    bool swap = tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Abgr8888
+            || tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888;
+    gr_color_c[0] = swap ? b : r;
+    gr_color_c[1] = g;
+    gr_color_c[2] = swap ? r : b;
+    gr_color_c[3] = a;
+
     gr_is_curr_clr_opaque = (a == 255);
 }
 
@@ -244,6 +448,29 @@ void gr_clear()
 
 void gr_fill(int x, int y, int w, int h)
 {
+    if (gr_pixel_ops) {
+        if (!clip_rect(x, y, w, h)) {
+            return;
+        }
+
+        // Pack the color in the surface's byte order
+        bool bgra = gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888;
+        uint32_t color = (bgra ? gr_color_c[2] : gr_color_c[0])
+                | gr_color_c[1] << 8
+                | (bgra ? gr_color_c[0] : gr_color_c[2]) << 16
+                | static_cast<uint32_t>(gr_color_c[3]) << 24;
+        auto fn = gr_is_curr_clr_opaque
+                ? gr_pixel_ops->fill : gr_pixel_ops->blend_color;
+
+        unsigned char *row = gr_draw->data + y * gr_draw->row_bytes
+                + x * gr_draw->pixel_bytes;
+        for (int i = 0; i < h; ++i) {
+            fn(reinterpret_cast<uint32_t *>(row), color, w);
+            row += gr_draw->row_bytes;
+        }
+        return;
+    }
+
     GGLContext *gl = gr_context;
 
     if (gr_is_curr_clr_opaque) {
@@ -257,6 +484,34 @@ void gr_fill(int x, int y, int w, int h)
     }
 }
 
+void gr_convert_surface(GGLSurface *surface)
+{
+    if (gr_native_format < 0
+            || (surface->format != GGL_PIXEL_FORMAT_RGBX_8888
+                    && surface->format != GGL_PIXEL_FORMAT_RGBA_8888)) {
+        return;
+    }
+
+    bool swap = gr_native_format == GGL_PIXEL_FORMAT_BGRA_8888;
+    bool premultiply = surface->format == GGL_PIXEL_FORMAT_RGBA_8888;
+    bool opaque = true;
+
+    uint32_t *row = reinterpret_cast<uint32_t *>(surface->data);
+    for (uint32_t y = 0; y < surface->height; ++y) {
+        opaque &= gr_convert_row_premul(row, surface->width, swap, premultiply);
+        row += surface->stride;
+    }
+
+    // Label the data with what it now is, so that pixelflinger (used for blits
+    // that the kernels can't do) doesn't convert it again
+    if (swap) {
+        surface->format = GGL_PIXEL_FORMAT_BGRA_8888;
+    } else if (opaque) {
+        surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
+    }
+    surface->rfu[0] = GR_SURFACE_NATIVE | (opaque ? GR_SURFACE_OPAQUE : 0);
+}
+
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
 {
     if (gr_context == nullptr) {
@@ -265,9 +520,57 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
 
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
+    bool native = surface->rfu[0] & GR_SURFACE_NATIVE;
+    bool opaque = surface->format == GGL_PIXEL_FORMAT_RGBX_8888
+            || (surface->rfu[0] & GR_SURFACE_OPAQUE);
+
+    // Unscaled copies and blends within the bounds of the source (pixelflinger
+    // would repeat the texture otherwise) can be done directly
+    if (gr_pixel_ops
+            && (native
+                    || surface->format == GGL_PIXEL_FORMAT_RGBX_8888
+                    || surface->format == GGL_PIXEL_FORMAT_RGBA_8888)
+            && sx >= 0 && sy >= 0
+            && sx + w <= static_cast<int>(surface->width)
+            && sy + h <= static_cast<int>(surface->height)) {
+        int x = dx;
+        int y = dy;
+        if (!clip_rect(x, y, w, h)) {
+            return;
+        }
+        sx += x - dx;
+        sy += y - dy;
+
+        const uint32_t *src = reinterpret_cast<const uint32_t *>(surface->data)
+                + sy * surface->stride + sx;
+        unsigned char *row = gr_draw->data + y * gr_draw->row_bytes
+                + x * gr_draw->pixel_bytes;
+
+        if (native && opaque) {
+            // Already in the right format
+            for (int i = 0; i < h; ++i) {
+                memcpy(row, src, w * sizeof(uint32_t));
+                src += surface->stride;
+                row += gr_draw->row_bytes;
+            }
+            return;
+        }
+
+        auto fn = native ? gr_pixel_ops->blend_premul
+                : opaque ? gr_pixel_ops->copy : gr_pixel_ops->blend;
+
+        for (int i = 0; i < h; ++i) {
+            fn(reinterpret_cast<uint32_t *>(row), src, w);
+            src += surface->stride;
+            row += gr_draw->row_bytes;
+        }
+        return;
+    }
 
-    if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+    if (opaque) {
         gl->disable(gl, GGL_BLEND);
+    } else if (native) {
+        gl->blendFunc(gl, GGL_ONE, GGL_ONE_MINUS_SRC_ALPHA);
     }
 
     gl->bindTexture(gl, surface);
@@ -279,8 +582,10 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     gl->recti(gl, dx, dy, dx + w, dy + h);
     gl->disable(gl, GGL_TEXTURE_2D);
 
-    if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+    if (opaque) {
         gl->enable(gl, GGL_BLEND);
+    } else if (native) {
+        gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
     }
 }
 
@@ -300,15 +605,138 @@ unsigned int gr_get_height(gr_surface surface)
     return ((GGLSurface*) surface)->height;
 }
 
+static uint64_t monotonic_us(void)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record_surface_frame(GRSurface *surface, unsigned int frame)
+{
+    size_t oldest = 0;
+
+    for (size_t i = 0; i < GR_DAMAGE_HISTORY; ++i) {
+        if (gr_surface_frames[i].surface == surface) {
+            oldest = i;
+            break;
+        } else if (gr_surface_frames[i].frame
+                < gr_surface_frames[oldest].frame) {
+            oldest = i;
+        }
+    }
+
+    gr_surface_frames[oldest].surface = surface;
+    gr_surface_frames[oldest].frame = frame;
+}
+
+// Bring a surface returned by the back end up to date with the frame that was
+// just flipped. Page flipping back ends hand back buffers that are one frame
+// (double buffering) or more (triple buffering) behind, so copy everything
+// that changed since the surface was last drawn.
+static void update_stale_surface(GRSurface *surface, GRSurface *latest)
+{
+    unsigned int frame = 0;
+
+    for (size_t i = 0; i < GR_DAMAGE_HISTORY; ++i) {
+        if (gr_surface_frames[i].surface == surface) {
+            frame = gr_surface_frames[i].frame;
+            break;
+        }
+    }
+
+    bool full = frame == 0 || gr_frame - frame >= GR_DAMAGE_HISTORY;
+    int x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+
+    for (unsigned int f = frame + 1; !full && f <= gr_frame; ++f) {
+        const DamageRecord &d = gr_damage_history[f % GR_DAMAGE_HISTORY];
+        if (d.full) {
+            full = true;
+        } else {
+            x1 = std::min(x1, d.x1);
+            y1 = std::min(y1, d.y1);
+            x2 = std::max(x2, d.x2);
+            y2 = std::max(y2, d.y2);
+        }
+    }
+
+    if (full) {
+        memcpy(surface->data, latest->data,
+               surface->height * surface->row_bytes);
+    } else if (x1 < x2 && y1 < y2) {
+        copy_region(surface, latest, x1, y1, x2 - x1, y2 - y1);
+    }
+}
+
 void gr_flip()
 {
-    gr_draw = gr_backend->flip(gr_backend);
+    GRSurface *prev_draw = gr_draw;
+    int x, y, w, h;
+    bool partial = gr_get_damage(&x, &y, &w, &h) == 0;
+    uint64_t start = monotonic_us();
+
+    if (partial && gr_backend->flip_region) {
+        gr_draw = gr_backend->flip_region(gr_backend, x, y, w, h);
+    } else {
+        gr_draw = gr_backend->flip(gr_backend);
+    }
+
+    uint64_t end = monotonic_us();
+
+    ++gr_stats_frames;
+    gr_stats_flip_total_us += end - start;
+    gr_stats_flip_max_us = std::max(gr_stats_flip_max_us, end - start);
+    // Only count continuous animation, not the gaps while the GUI is idle
+    if (gr_stats_last_flip_us != 0 && end - gr_stats_last_flip_us < 1000000) {
+        ++gr_stats_intervals;
+        gr_stats_interval_total_us += end - gr_stats_last_flip_us;
+        gr_stats_interval_max_us = std::max(gr_stats_interval_max_us,
+                                            end - gr_stats_last_flip_us);
+    }
+    gr_stats_last_flip_us = end;
+
+    ++gr_frame;
+    DamageRecord &record = gr_damage_history[gr_frame % GR_DAMAGE_HISTORY];
+    record.full = !partial;
+    record.x1 = x;
+    record.y1 = y;
+    record.x2 = x + w;
+    record.y2 = y + h;
+
+    gr_damage_state = DamageState::None;
+    gr_damage_clip = false;
+
+    if (gr_draw && prev_draw && gr_draw != prev_draw) {
+        record_surface_frame(prev_draw, gr_frame);
+
+        if (gr_draw->height == prev_draw->height
+                && gr_draw->row_bytes == prev_draw->row_bytes) {
+            update_stale_surface(gr_draw, prev_draw);
+        }
+        record_surface_frame(gr_draw, gr_frame);
+    }
+
     // On double buffered back ends, when we flip, we need to tell
     // pixel flinger to draw to the other buffer
     gr_mem_surface.data = (GGLubyte*)gr_draw->data;
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+void gr_dump_frame_stats(void)
+{
+    printf("Frame stats: %lu frames flipped\n", gr_stats_frames);
+    if (gr_stats_frames > 0) {
+        printf("  flip: %.2f ms average, %.2f ms max\n",
+               gr_stats_flip_total_us / 1000.0 / gr_stats_frames,
+               gr_stats_flip_max_us / 1000.0);
+    }
+    if (gr_stats_intervals > 0) {
+        printf("  frame interval: %.2f ms average, %.2f ms max\n",
+               gr_stats_interval_total_us / 1000.0 / gr_stats_intervals,
+               gr_stats_interval_max_us / 1000.0);
+    }
+}
+
 static void get_memory_surface(GGLSurface* ms)
 {
     ms->version = sizeof(*ms);
@@ -370,6 +798,16 @@ int gr_init(void)
     gl->enable(gl, GGL_BLEND);
     gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
 
+    // Use the direct fill and blit kernels for 32bpp surfaces
+    if (gr_draw->pixel_bytes == 4) {
+        gr_pixel_ops = gr_get_pixel_ops(gr_draw->format);
+    }
+    if (gr_pixel_ops) {
+        gr_native_format = gr_draw->format;
+    }
+    printf("Using %s fill/blit path\n",
+           gr_pixel_ops ? "direct" : "pixelflinger");
+
     gr_flip();
     gr_flip();
 
@@ -384,6 +822,7 @@ int gr_init(void)
 
 void gr_exit(void)
 {
+    gr_dump_frame_stats();
     gr_backend->exit(gr_backend);
     gr_backend = nullptr;
 }
@@ -19,6 +19,18 @@
 
 #include "minui.h"
 
+struct GGLSurface;
+
+// Flags stored in GGLSurface::rfu[0], which pixelflinger doesn't use. Surfaces
+// with GR_SURFACE_NATIVE are in the draw surface's channel order with
+// premultiplied alpha and are labelled with the matching pixelflinger format.
+#define GR_SURFACE_NATIVE   0x1
+#define GR_SURFACE_OPAQUE   0x2
+
+// Convert a newly loaded RGBA/RGBX surface to the draw surface's pixel format.
+// This does nothing if blits go through pixelflinger anyway.
+void gr_convert_surface(GGLSurface *surface);
+
 // TODO: lose the function pointers.
 struct minui_backend
 {
@@ -35,6 +47,10 @@ struct minui_backend
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Same as flip(), but only the given region of the drawing surface
+    // changed since the last flip. Optional (flip() is used if this is null).
+    GRSurface* (*flip_region)(minui_backend*, int x, int y, int w, int h);
 };
 
 #endif
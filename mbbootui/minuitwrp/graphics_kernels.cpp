@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "graphics_kernels.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define GR_KERNELS_NEON 1
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define GR_KERNELS_SSE2 1
+#endif
+
+#include <pixelflinger/pixelflinger.h>
+
+// All blending is done with the same equation as pixelflinger's
+// (GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA) blend function:
+//
+//   result = (src * alpha + dst * (255 - alpha)) / 255
+//
+// applied to all four channels. The division is done as
+// (t + 128 + ((t + 128) >> 8)) >> 8, which is exact for t <= 255 * 255.
+
+static inline uint32_t swap_rb(uint32_t px)
+{
+    return (px & 0xff00ff00u) | ((px >> 16) & 0xffu) | ((px & 0xffu) << 16);
+}
+
+static inline uint32_t blend_channel(uint32_t s, uint32_t d, uint32_t a)
+{
+    uint32_t t = s * a + d * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d)
+{
+    uint32_t a = s >> 24;
+
+    if (a == 255) {
+        return s;
+    } else if (a == 0) {
+        return d;
+    }
+
+    return blend_channel(s & 0xff, d & 0xff, a)
+            | blend_channel((s >> 8) & 0xff, (d >> 8) & 0xff, a) << 8
+            | blend_channel((s >> 16) & 0xff, (d >> 16) & 0xff, a) << 16
+            | blend_channel(s >> 24, d >> 24, a) << 24;
+}
+
+static inline uint32_t scale_channel(uint32_t c, uint32_t a)
+{
+    uint32_t t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+// Premultiplied blending is the same equation with the src * alpha term
+// already applied at load time
+static inline uint32_t blend_premul_pixel(uint32_t s, uint32_t d)
+{
+    uint32_t ia = 255 - (s >> 24);
+
+    if (ia == 0) {
+        return s;
+    } else if (ia == 255) {
+        return d;
+    }
+
+    return s + (scale_channel(d & 0xff, ia)
+            | scale_channel((d >> 8) & 0xff, ia) << 8
+            | scale_channel((d >> 16) & 0xff, ia) << 16
+            | scale_channel(d >> 24, ia) << 24);
+}
+
+#if GR_KERNELS_SSE2
+
+static inline __m128i swap_rb_sse2(__m128i v)
+{
+    const __m128i mask_ga = _mm_set1_epi32(0xff00ff00);
+    const __m128i mask_b0 = _mm_set1_epi32(0x000000ff);
+    const __m128i mask_b2 = _mm_set1_epi32(0x00ff0000);
+
+    return _mm_or_si128(
+            _mm_and_si128(v, mask_ga),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), mask_b0),
+                         _mm_and_si128(_mm_slli_epi32(v, 16), mask_b2)));
+}
+
+// Blend two pixels that were unpacked to 16-bit lanes
+static inline __m128i blend_sse2(__m128i s, __m128i d, __m128i a)
+{
+    const __m128i v255 = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+
+    __m128i t = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s, a),
+                          _mm_mullo_epi16(d, _mm_sub_epi16(v255, a))),
+            v128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Broadcast the alpha of each of the two unpacked pixels to its lanes
+static inline __m128i alpha_sse2(__m128i px)
+{
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, 0xff), 0xff);
+}
+
+template<bool Swap>
+static void blend_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask_a = _mm_set1_epi32(0xff000000);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        if (Swap) {
+            s = swap_rb_sse2(s);
+        }
+
+        __m128i sa = _mm_and_si128(s, mask_a);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, mask_a)) == 0xffff) {
+            // Fully opaque
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), s);
+            continue;
+        } else if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, zero)) == 0xffff) {
+            // Fully transparent
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+        __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+        __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+        __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+        __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+        __m128i r_lo = blend_sse2(s_lo, d_lo, alpha_sse2(s_lo));
+        __m128i r_hi = blend_sse2(s_hi, d_hi, alpha_sse2(s_hi));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(r_lo, r_hi));
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_pixel(Swap ? swap_rb(src[i]) : src[i], dst[i]);
+    }
+}
+
+// Multiply two pixels that were unpacked to 16-bit lanes by ia / 255
+static inline __m128i scale_sse2(__m128i d, __m128i ia)
+{
+    const __m128i v128 = _mm_set1_epi16(128);
+
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(d, ia), v128);
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void blend_premul_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask_a = _mm_set1_epi32(0xff000000);
+    const __m128i v255 = _mm_set1_epi16(255);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+
+        __m128i sa = _mm_and_si128(s, mask_a);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, mask_a)) == 0xffff) {
+            // Fully opaque
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), s);
+            continue;
+        } else if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff) {
+            // Fully transparent
+            continue;
+        }
+
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+        __m128i ia_lo = _mm_sub_epi16(
+                v255, alpha_sse2(_mm_unpacklo_epi8(s, zero)));
+        __m128i ia_hi = _mm_sub_epi16(
+                v255, alpha_sse2(_mm_unpackhi_epi8(s, zero)));
+
+        __m128i r_lo = scale_sse2(_mm_unpacklo_epi8(d, zero), ia_lo);
+        __m128i r_hi = scale_sse2(_mm_unpackhi_epi8(d, zero), ia_hi);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_adds_epu8(s, _mm_packus_epi16(r_lo, r_hi)));
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_premul_pixel(src[i], dst[i]);
+    }
+}
+
+static void blend_color_row(uint32_t *dst, uint32_t color, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    const __m128i a = alpha_sse2(c);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+        __m128i r_lo = blend_sse2(c, _mm_unpacklo_epi8(d, zero), a);
+        __m128i r_hi = blend_sse2(c, _mm_unpackhi_epi8(d, zero), a);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(r_lo, r_hi));
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_pixel(color, dst[i]);
+    }
+}
+
+static void fill_row(uint32_t *dst, uint32_t color, int count)
+{
+    const __m128i c = _mm_set1_epi32(color);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), c);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void copy_swap_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         swap_rb_sse2(s));
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = swap_rb(src[i]);
+    }
+}
+
+#elif GR_KERNELS_NEON
+
+// Blend one channel of eight pixels
+static inline uint8x8_t blend_neon(uint8x8_t s, uint8x8_t d, uint8x8_t a,
+                                   uint8x8_t ia)
+{
+    uint16x8_t t = vmlal_u8(vmull_u8(s, a), d, ia);
+    t = vaddq_u16(t, vdupq_n_u16(128));
+    return vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+}
+
+template<bool Swap>
+static void blend_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+
+        if (Swap) {
+            uint8x8_t tmp = s.val[0];
+            s.val[0] = s.val[2];
+            s.val[2] = tmp;
+        }
+
+        uint8x8_t a = s.val[3];
+        uint8x8_t ia = vmvn_u8(a);
+
+        for (int c = 0; c < 4; ++c) {
+            d.val[c] = blend_neon(s.val[c], d.val[c], a, ia);
+        }
+
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_pixel(Swap ? swap_rb(src[i]) : src[i], dst[i]);
+    }
+}
+
+static void blend_premul_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+
+        uint8x8_t ia = vmvn_u8(s.val[3]);
+
+        for (int c = 0; c < 4; ++c) {
+            uint16x8_t t = vaddq_u16(vmull_u8(d.val[c], ia), vdupq_n_u16(128));
+            uint8x8_t r = vshrn_n_u16(vaddq_u16(t, vshrq_n_u16(t, 8)), 8);
+            d.val[c] = vqadd_u8(s.val[c], r);
+        }
+
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_premul_pixel(src[i], dst[i]);
+    }
+}
+
+static void blend_color_row(uint32_t *dst, uint32_t color, int count)
+{
+    uint8x8_t a = vdup_n_u8(color >> 24);
+    uint8x8_t ia = vmvn_u8(a);
+    uint8x8_t c[4];
+    int i = 0;
+
+    for (int n = 0; n < 4; ++n) {
+        c[n] = vdup_n_u8((color >> (n * 8)) & 0xff);
+    }
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+
+        for (int n = 0; n < 4; ++n) {
+            d.val[n] = blend_neon(c[n], d.val[n], a, ia);
+        }
+
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = blend_pixel(color, dst[i]);
+    }
+}
+
+static void fill_row(uint32_t *dst, uint32_t color, int count)
+{
+    uint32x4_t c = vdupq_n_u32(color);
+    int i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        vst1q_u32(dst + i, c);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void copy_swap_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    int i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint8x8_t tmp = s.val[0];
+        s.val[0] = s.val[2];
+        s.val[2] = tmp;
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), s);
+    }
+
+    for (; i < count; ++i) {
+        dst[i] = swap_rb(src[i]);
+    }
+}
+
+#else
+
+template<bool Swap>
+static void blend_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = blend_pixel(Swap ? swap_rb(src[i]) : src[i], dst[i]);
+    }
+}
+
+static void blend_premul_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = blend_premul_pixel(src[i], dst[i]);
+    }
+}
+
+static void blend_color_row(uint32_t *dst, uint32_t color, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = blend_pixel(color, dst[i]);
+    }
+}
+
+static void fill_row(uint32_t *dst, uint32_t color, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = color;
+    }
+}
+
+static void copy_swap_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = swap_rb(src[i]);
+    }
+}
+
+#endif
+
+static void copy_row(uint32_t *dst, const uint32_t *src, int count)
+{
+    memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static const GRPixelOps rgba_ops = {
+    fill_row,
+    blend_color_row,
+    copy_row,
+    blend_row<false>,
+    blend_premul_row,
+};
+
+static const GRPixelOps bgra_ops = {
+    fill_row,
+    blend_color_row,
+    copy_swap_row,
+    blend_row<true>,
+    blend_premul_row,
+};
+
+const GRPixelOps * gr_get_pixel_ops(int format)
+{
+    switch (format) {
+    case GGL_PIXEL_FORMAT_RGBA_8888:
+    case GGL_PIXEL_FORMAT_RGBX_8888:
+        return &rgba_ops;
+    case GGL_PIXEL_FORMAT_BGRA_8888:
+        return &bgra_ops;
+    default:
+        return nullptr;
+    }
+}
+
+bool gr_convert_row_premul(uint32_t *row, int count, bool swap,
+                           bool premultiply)
+{
+    uint32_t alpha = 0xff;
+
+    for (int i = 0; i < count; ++i) {
+        uint32_t px = row[i];
+        uint32_t a = px >> 24;
+
+        alpha &= a;
+
+        if (premultiply && a != 255) {
+            px = scale_channel(px & 0xff, a)
+                    | scale_channel((px >> 8) & 0xff, a) << 8
+                    | scale_channel((px >> 16) & 0xff, a) << 16
+                    | a << 24;
+        }
+
+        row[i] = swap ? swap_rb(px) : px;
+    }
+
+    return alpha == 0xff;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Row kernels for the common gr_fill() and gr_blit() cases on 32bpp surfaces.
+// Pixels are in memory byte order with alpha in the last byte. The source
+// pixels passed to copy() and blend() are RGBA/RGBX and are converted to the
+// destination's channel order. Colors passed to fill() and blend_color() must
+// already be in the destination's channel order.
+struct GRPixelOps
+{
+    // Opaque solid fill
+    void (*fill)(uint32_t *dst, uint32_t color, int count);
+    // Blend solid color (non-premultiplied alpha) onto dst
+    void (*blend_color)(uint32_t *dst, uint32_t color, int count);
+    // Opaque copy
+    void (*copy)(uint32_t *dst, const uint32_t *src, int count);
+    // Blend src (non-premultiplied alpha) onto dst
+    void (*blend)(uint32_t *dst, const uint32_t *src, int count);
+    // Blend src (premultiplied alpha, already in the destination's channel
+    // order) onto dst
+    void (*blend_premul)(uint32_t *dst, const uint32_t *src, int count);
+};
+
+// Returns nullptr if there are no kernels for the pixel format
+const GRPixelOps * gr_get_pixel_ops(int format);
+
+// Convert a row of RGBA/RGBX pixels in place for blend_premul(). The alpha is
+// premultiplied if premultiply is true and R and B are swapped if swap is
+// true. Returns whether every pixel is fully opaque.
+bool gr_convert_row_premul(uint32_t *row, int count, bool swap,
+                           bool premultiply);
@@ -49,11 +49,24 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+// Print the number of flips and how long they took
+void gr_dump_frame_stats(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
+
+// Damage tracking. If only gr_damage() was called since the last flip, then
+// gr_flip() only updates the union of the damaged rectangles. Otherwise, the
+// whole screen is updated.
+void gr_damage(int x, int y, int w, int h);
+void gr_damage_all(void);
+// Returns 0 and the damaged region if only part of the screen changed
+int gr_get_damage(int *x, int *y, int *w, int *h);
+// Limit drawing (including gr_clip() regions) to the damaged region
+void gr_clip_to_damage(void);
+void gr_noclip_damage(void);
 void gr_fill(int x, int y, int w, int h);
 void gr_line(int x0, int y0, int x1, int y1, int width);
 gr_surface gr_render_circle(int radius, unsigned char r, unsigned char g, unsigned char b, unsigned char a);
@@ -87,12 +100,14 @@ struct input_event;
 int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, int timeout_ms);
+int ev_get_fd(void);
 int ev_has_mouse(void);
 
 // Resources
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
+int res_create_surface_mem(const unsigned char* data, size_t size, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h);
 
@@ -37,6 +37,7 @@ extern "C" {
 }
 #endif
 #include "config/config.hpp"
+#include "graphics.h"
 #include "minui.h"
 
 #define SURFACE_DATA_ALIGNMENT 8
@@ -54,7 +55,28 @@ static GGLSurface* malloc_surface(size_t data_size)
     return surface;
 }
 
-static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
+// PNG data that is already in memory (eg. a stored entry in the mapped theme
+// zip)
+struct png_mem_source
+{
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+};
+
+static void png_mem_read(png_structp png_ptr, png_bytep out, png_size_t len)
+{
+    png_mem_source* src = reinterpret_cast<png_mem_source*>(png_get_io_ptr(png_ptr));
+    if (len > src->size - src->pos) {
+        png_error(png_ptr, "Read past end of data");
+    }
+    memcpy(out, src->data + src->pos, len);
+    src->pos += len;
+}
+
+// Reads from |mem| if it is not null. Otherwise, the file |name| is opened.
+static int open_png(const char* name, png_mem_source* mem,
+                    png_structp* png_ptr, png_infop* info_ptr,
                     png_uint_32* width, png_uint_32* height, png_byte* channels, FILE** fpp)
 {
     char resPath[256];
@@ -62,22 +84,32 @@ static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
     int result = 0;
     int color_type, bit_depth;
     size_t bytesRead;
+    FILE* fp = nullptr;
 
-    snprintf(resPath, sizeof(resPath)-1, "%s/images/%s.png", tw_resource_path.c_str(), name);
-    resPath[sizeof(resPath)-1] = '\0';
-    FILE* fp = fopen(resPath, "rb");
-    if (fp == nullptr) {
-        fp = fopen(name, "rb");
-        if (fp == nullptr) {
-            result = -1;
+    if (mem) {
+        if (mem->size < sizeof(header)) {
+            result = -2;
             goto exit;
         }
-    }
+        memcpy(header, mem->data, sizeof(header));
+        mem->pos = sizeof(header);
+    } else {
+        snprintf(resPath, sizeof(resPath)-1, "%s/images/%s.png", tw_resource_path.c_str(), name);
+        resPath[sizeof(resPath)-1] = '\0';
+        fp = fopen(resPath, "rb");
+        if (fp == nullptr) {
+            fp = fopen(name, "rb");
+            if (fp == nullptr) {
+                result = -1;
+                goto exit;
+            }
+        }
 
-    bytesRead = fread(header, 1, sizeof(header), fp);
-    if (bytesRead != sizeof(header)) {
-        result = -2;
-        goto exit;
+        bytesRead = fread(header, 1, sizeof(header), fp);
+        if (bytesRead != sizeof(header)) {
+            result = -2;
+            goto exit;
+        }
     }
 
     if (png_sig_cmp(header, 0, sizeof(header))) {
@@ -102,7 +134,11 @@ static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
         goto exit;
     }
 
-    png_init_io(*png_ptr, fp);
+    if (mem) {
+        png_set_read_fn(*png_ptr, mem, png_mem_read);
+    } else {
+        png_init_io(*png_ptr, fp);
+    }
     png_set_sig_bytes(*png_ptr, sizeof(header));
     png_read_info(*png_ptr, *info_ptr);
 
@@ -141,12 +177,10 @@ static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
     return result;
 }
 
-// "display" surfaces are transformed into the framebuffer's required
-// pixel format (currently only RGBX is supported) at load time, so
-// gr_blit() can be nothing more than a memcpy() for each row.  The
-// next two functions are the only ones that know anything about the
-// framebuffer pixel format; they need to be modified if the
-// framebuffer format changes (but nothing else should).
+// "display" surfaces are expanded to RGBA/RGBX here and then converted to
+// the framebuffer's pixel format by gr_convert_surface() at load time, so
+// gr_blit() can be nothing more than a memcpy() or a premultiplied blend
+// for each row.
 
 // Allocate and return a GRSurface* sufficient for storing an image of
 // the indicated size in the framebuffer pixel format.
@@ -161,6 +195,7 @@ static GGLSurface* init_display_surface(png_uint_32 width, png_uint_32 height)
     surface->width = width;
     surface->height = height;
     surface->stride = width;
+    memset(surface->rfu, 0, sizeof(surface->rfu));
 
     return surface;
 }
@@ -211,7 +246,8 @@ static void transform_rgb_to_draw(unsigned char* input_row,
     }
 }
 
-int res_create_surface_png(const char* name, gr_surface* pSurface)
+static int create_surface_png(const char* name, png_mem_source* mem,
+                              gr_surface* pSurface)
 {
     GGLSurface* surface = nullptr;
     int result = 0;
@@ -225,7 +261,7 @@ int res_create_surface_png(const char* name, gr_surface* pSurface)
 
     *pSurface = nullptr;
 
-    result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
+    result = open_png(name, mem, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
     if (result < 0) {
         return result;
     }
@@ -257,11 +293,14 @@ int res_create_surface_png(const char* name, gr_surface* pSurface)
     } else {
         surface->format = GGL_PIXEL_FORMAT_RGBA_8888;
     }
+    gr_convert_surface(surface);
 
     *pSurface = (gr_surface) surface;
 
 exit:
-    fclose(fp);
+    if (fp) {
+        fclose(fp);
+    }
     png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
     if (result < 0 && surface != nullptr) {
         free(surface);
@@ -269,6 +308,11 @@ exit:
     return result;
 }
 
+int res_create_surface_png(const char* name, gr_surface* pSurface)
+{
+    return create_surface_png(name, nullptr, pSurface);
+}
+
 #ifdef TW_INCLUDE_JPEG
 int res_create_surface_jpg(const char* name, gr_surface* pSurface)
 {
@@ -325,6 +369,7 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface)
     surface->stride = width; /* Yes, pixels, not bytes */
     surface->data = pData;
     surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
+    memset(surface->rfu, 0, sizeof(surface->rfu));
 
     for (y = 0; y < (int) height; ++y) {
         unsigned char* pRow = pData + y * stride;
@@ -352,6 +397,7 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface)
             }
         }
     }
+    gr_convert_surface(surface);
     *pSurface = (gr_surface) surface;
 
 exit:
@@ -393,6 +439,19 @@ int res_create_surface(const char* name, gr_surface* pSurface)
     return ret;
 }
 
+// Decode a PNG image from memory. |data| only needs to stay valid for the
+// duration of the call.
+int res_create_surface_mem(const unsigned char* data, size_t size, gr_surface* pSurface)
+{
+    png_mem_source mem = { data, size, 0 };
+
+    if (!data) {
+        return -1;
+    }
+
+    return create_surface_png(nullptr, &mem, pSurface);
+}
+
 void res_free_surface(gr_surface surface)
 {
     GGLSurface* pSurface = (GGLSurface*) surface;
@@ -419,7 +478,10 @@ int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w,
         printf("gr_scale_surface failed to init_display_surface\n");
         return -1;
     }
+    // Premultiplied surfaces stay premultiplied, which is also what linear
+    // filtering needs to avoid dark fringes
     sc_mem_surface->format = surface->format;
+    sc_mem_surface->rfu[0] = surface->rfu[0];
 
     // Initialize the context
     gglInit(&gl);
@@ -427,7 +489,8 @@ int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w,
     gl->activeTexture(gl, 0);
 
     // Enable or disable blending based on source surface format
-    if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+    if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888
+            || (surface->rfu[0] & GR_SURFACE_OPAQUE)) {
         gl->disable(gl, GGL_BLEND);
     } else {
         gl->enable(gl, GGL_BLEND);
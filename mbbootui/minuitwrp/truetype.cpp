@@ -18,6 +18,11 @@
 #define STRING_CACHE_MAX_ENTRIES 400
 #define STRING_CACHE_TRUNCATE_ENTRIES 150
 
+// Maximum size of each font's glyph atlas texture
+#define GLYPH_ATLAS_MAX_BYTES (256 * 1024)
+// Preferred width of the glyph atlas texture
+#define GLYPH_ATLAS_WIDTH 1024
+
 typedef struct
 {
     int size;
@@ -25,6 +30,33 @@ typedef struct
     char *path;
 } TrueTypeFontKey;
 
+typedef struct
+{
+    struct TrueTypeCacheEntry *glyph; // nullptr if free
+    int prev;
+    int next;
+} GlyphAtlasSlot;
+
+// A_8 texture made up of fixed size cells, each holding one glyph. When the
+// byte budget is reached, the least recently used glyph is evicted.
+typedef struct
+{
+    GGLSurface surface;
+    int cell_w;
+    int cell_h;
+    int columns;
+    int rows;
+    int max_rows;
+    GlyphAtlasSlot *slots;
+    int slots_used;
+    // Indexes of the least and most recently used slots
+    int lru_head;
+    int lru_tail;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} GlyphAtlas;
+
 typedef struct
 {
     int type;
@@ -34,6 +66,7 @@ typedef struct
     int max_height;
     int base;
     FT_Face face;
+    GlyphAtlas atlas;
     Hashmap *glyph_cache;
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
@@ -42,11 +75,14 @@ typedef struct
     TrueTypeFontKey *key;
 } TrueTypeFont;
 
-typedef struct
+struct TrueTypeCacheEntry
 {
     FT_BBox bbox;
     FT_BitmapGlyph glyph;
-} TrueTypeCacheEntry;
+    int atlas_slot; // -1 if not in the atlas
+};
+
+typedef struct TrueTypeCacheEntry TrueTypeCacheEntry;
 
 typedef struct
 {
@@ -54,9 +90,18 @@ typedef struct
     int max_width;
 } StringCacheKey;
 
+typedef struct
+{
+    TrueTypeCacheEntry *glyph;
+    int x; // pen position relative to the start of the string
+} ShapedGlyph;
+
 struct StringCacheEntry
 {
-    GGLSurface surface;
+    int width;
+    int height;
+    ShapedGlyph *glyphs;
+    int glyph_count;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
     StringCacheKey *key;
     struct StringCacheEntry *prev;
@@ -178,6 +223,164 @@ static int gr_ttf_font_cache_hash(void *key)
     return hash;
 }
 
+static void gr_ttf_atlas_init(GlyphAtlas *atlas, FT_Face face)
+{
+    FT_Size_Metrics *m = &face->size->metrics;
+    int cell_w = (int) ((m->max_advance + 63) >> 6);
+    int cell_h = (int) ((m->ascender - m->descender + 63) >> 6);
+
+    // Rendered glyphs fit in the face's bounding box
+    if (FT_IS_SCALABLE(face)) {
+        FT_Pos bbox_w = FT_MulFix(face->bbox.xMax - face->bbox.xMin, m->x_scale);
+        FT_Pos bbox_h = FT_MulFix(face->bbox.yMax - face->bbox.yMin, m->y_scale);
+        cell_w = MAX(cell_w, (int) ((bbox_w + 63) >> 6));
+        cell_h = MAX(cell_h, (int) ((bbox_h + 63) >> 6));
+    }
+
+    memset(atlas, 0, sizeof(GlyphAtlas));
+    atlas->cell_w = MAX(cell_w, 1);
+    atlas->cell_h = MAX(cell_h, 1);
+    atlas->columns = MAX(GLYPH_ATLAS_WIDTH / atlas->cell_w, 1);
+    atlas->max_rows = MAX(GLYPH_ATLAS_MAX_BYTES
+            / (atlas->columns * atlas->cell_w * atlas->cell_h), 1);
+    atlas->lru_head = -1;
+    atlas->lru_tail = -1;
+
+    atlas->surface.version = sizeof(atlas->surface);
+    atlas->surface.width = atlas->columns * atlas->cell_w;
+    atlas->surface.height = 0;
+    atlas->surface.stride = atlas->surface.width;
+    atlas->surface.data = nullptr;
+    atlas->surface.format = GGL_PIXEL_FORMAT_A_8;
+}
+
+static void gr_ttf_atlas_free(GlyphAtlas *atlas)
+{
+    free(atlas->surface.data);
+    free(atlas->slots);
+}
+
+static void gr_ttf_atlas_lru_unlink(GlyphAtlas *atlas, int index)
+{
+    GlyphAtlasSlot *slot = &atlas->slots[index];
+
+    if (slot->prev >= 0) {
+        atlas->slots[slot->prev].next = slot->next;
+    } else {
+        atlas->lru_head = slot->next;
+    }
+    if (slot->next >= 0) {
+        atlas->slots[slot->next].prev = slot->prev;
+    } else {
+        atlas->lru_tail = slot->prev;
+    }
+}
+
+static void gr_ttf_atlas_lru_append(GlyphAtlas *atlas, int index)
+{
+    GlyphAtlasSlot *slot = &atlas->slots[index];
+
+    slot->prev = atlas->lru_tail;
+    slot->next = -1;
+    if (atlas->lru_tail >= 0) {
+        atlas->slots[atlas->lru_tail].next = index;
+    } else {
+        atlas->lru_head = index;
+    }
+    atlas->lru_tail = index;
+}
+
+// Returns the index of an unused slot, growing the texture or evicting the
+// least recently used glyph if needed
+static int gr_ttf_atlas_alloc_slot(GlyphAtlas *atlas)
+{
+    if (atlas->slots_used == atlas->rows * atlas->columns
+            && atlas->rows < atlas->max_rows) {
+        int rows = MIN(MAX(atlas->rows * 2, 1), atlas->max_rows);
+        size_t row_bytes = (size_t) atlas->surface.stride * atlas->cell_h;
+
+        // The stride is fixed, so existing cells stay where they are
+        uint8_t *data = (uint8_t *) realloc(atlas->surface.data,
+                                            row_bytes * rows);
+        if (!data) {
+            goto evict;
+        }
+        atlas->surface.data = data;
+
+        GlyphAtlasSlot *slots = (GlyphAtlasSlot *) realloc(atlas->slots,
+                sizeof(GlyphAtlasSlot) * rows * atlas->columns);
+        if (!slots) {
+            goto evict;
+        }
+        atlas->slots = slots;
+
+        atlas->rows = rows;
+        atlas->surface.height = rows * atlas->cell_h;
+    }
+
+    if (atlas->slots_used < atlas->rows * atlas->columns) {
+        return atlas->slots_used++;
+    }
+
+evict:
+    if (atlas->lru_head < 0) {
+        return -1;
+    }
+
+    int index = atlas->lru_head;
+    gr_ttf_atlas_lru_unlink(atlas, index);
+    atlas->slots[index].glyph->atlas_slot = -1;
+    atlas->slots[index].glyph = nullptr;
+    ++atlas->evictions;
+    return index;
+}
+
+// Get the position of a glyph in the atlas, uploading it if it's not already
+// there. Returns false if the glyph doesn't fit in a cell.
+static bool gr_ttf_atlas_get(GlyphAtlas *atlas, TrueTypeCacheEntry *ent,
+                             int *x, int *y)
+{
+    FT_Bitmap *bitmap = &ent->glyph->bitmap;
+    int index = ent->atlas_slot;
+
+    if (index >= 0) {
+        ++atlas->hits;
+        gr_ttf_atlas_lru_unlink(atlas, index);
+        gr_ttf_atlas_lru_append(atlas, index);
+    } else {
+        if ((int) bitmap->width > atlas->cell_w
+                || (int) bitmap->rows > atlas->cell_h) {
+            return false;
+        }
+
+        index = gr_ttf_atlas_alloc_slot(atlas);
+        if (index < 0) {
+            return false;
+        }
+        ++atlas->misses;
+
+        atlas->slots[index].glyph = ent;
+        gr_ttf_atlas_lru_append(atlas, index);
+        ent->atlas_slot = index;
+
+        // Only the glyph's own area is ever sampled, so the rest of the cell
+        // doesn't need to be cleared
+        uint8_t *dest_itr = atlas->surface.data
+                + (index / atlas->columns) * atlas->cell_h * atlas->surface.stride
+                + (index % atlas->columns) * atlas->cell_w;
+        uint8_t *src_itr = bitmap->buffer;
+        for (unsigned i = 0; i < bitmap->rows; ++i) {
+            memcpy(dest_itr, src_itr, bitmap->width);
+            src_itr += bitmap->pitch;
+            dest_itr += atlas->surface.stride;
+        }
+    }
+
+    *x = (index % atlas->columns) * atlas->cell_w;
+    *y = (index / atlas->columns) * atlas->cell_h;
+    return true;
+}
+
 void *gr_ttf_loadFont(const char *filename, int size, int dpi)
 {
     int error;
@@ -231,6 +434,7 @@ void *gr_ttf_loadFont(const char *filename, int size, int dpi)
     res->max_height = -1;
     res->base = -1;
     res->refcount = 1;
+    gr_ttf_atlas_init(&res->atlas, face);
     res->glyph_cache = hashmapCreate(32, hashmapIntHash, hashmapIntEquals);
     res->string_cache = hashmapCreate(128, gr_ttf_string_cache_hash, gr_ttf_string_cache_equals);
     pthread_mutex_init(&res->mutex, 0);
@@ -287,7 +491,7 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unuse
     free(k);
 
     StringCacheEntry *e = (StringCacheEntry *)value;
-    free(e->surface.data);
+    free(e->glyphs);
     free(e);
     return true;
 }
@@ -314,6 +518,7 @@ void gr_ttf_freeFont(void *font)
         hashmapFree(d->string_cache);
         hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, nullptr);
         hashmapFree(d->glyph_cache);
+        gr_ttf_atlas_free(&d->atlas);
         pthread_mutex_destroy(&d->mutex);
         free(d);
     }
@@ -346,6 +551,7 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
         res = (TrueTypeCacheEntry *)malloc(sizeof(TrueTypeCacheEntry));
         memset(res, 0, sizeof(TrueTypeCacheEntry));
         res->glyph = glyph;
+        res->atlas_slot = -1;
         FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
 
         int *key = (int *)malloc(sizeof(int));
@@ -357,33 +563,6 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
     return res;
 }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
-{
-    unsigned y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
-
-    if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
-        fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
-    }
-
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
-
-    // FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if (dest_itr < dest->data) {
-        dest_itr = dest->data;
-    }
-
-    for (y = 0; y < glyph->bitmap.rows; ++y) {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
-    }
-    return 0;
-}
-
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
 {
     char c;
@@ -435,23 +614,26 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     f->base += f->size / 4;
 }
 
+// Lays out the glyphs of the string without rendering anything. The pixels come
+// from the glyph atlas when the string is drawn.
 // returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+static int gr_ttf_shape_text(TrueTypeFont *font, StringCacheEntry *entry, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
     TrueTypeCacheEntry *ent;
     int bytes_rendered = 0, total_w = 0;
     int utf_bytes = 0;
     unsigned int unicode = 0;
-    int i, x, diff, char_idx, prev_idx = 0;
-    int height;
+    int kerning, advance, char_idx, prev_idx = 0;
     FT_Vector delta;
-    uint8_t *data = nullptr;
     const char *text_itr = text;
-    int *char_idxs;
-    int char_idxs_len = 0;
+    ShapedGlyph *glyphs;
+    int glyph_count = 0;
 
-    char_idxs = (int *) malloc(strlen(text) * sizeof(int));
+    glyphs = (ShapedGlyph *) malloc(MAX(strlen(text), 1) * sizeof(ShapedGlyph));
+    if (!glyphs) {
+        return -1;
+    }
 
     while (*text_itr) {
         utf_bytes = utf8_to_unicode(text_itr, &unicode);
@@ -459,25 +641,28 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         bytes_rendered += utf_bytes;
 
         char_idx = FT_Get_Char_Index(f->face, unicode);
-        char_idxs[char_idxs_len] = char_idx;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if (ent) {
-            diff = ent->glyph->root.advance.x >> 16;
+            kerning = 0;
+            advance = ent->glyph->root.advance.x >> 16;
 
             if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
                 FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-                diff += delta.x >> 6;
+                kerning = delta.x >> 6;
             }
 
-            if (max_width != -1 && total_w + diff > max_width) {
+            if (max_width != -1 && total_w + kerning + advance > max_width) {
                 break;
             }
 
-            total_w += diff;
+            glyphs[glyph_count].glyph = ent;
+            glyphs[glyph_count].x = total_w + kerning;
+            ++glyph_count;
+
+            total_w += kerning + advance;
         }
         prev_idx = char_idx;
-        ++char_idxs_len;
     }
 
     if (font->max_height == -1) {
@@ -485,41 +670,15 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
     }
 
     if (font->max_height == -1) {
-        free(char_idxs);
+        free(glyphs);
         return -1;
     }
 
-    height = font->max_height;
-
-    data = (uint8_t *) malloc(total_w*height);
-    memset(data, 0, total_w*height);
-    x = 0;
-    prev_idx = 0;
-
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
-
-    for (i = 0; i < char_idxs_len; ++i) {
-        char_idx = char_idxs[i];
-        if (FT_HAS_KERNING(f->face) && prev_idx && char_idx) {
-            FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-            x += delta.x >> 6;
-        }
-
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if (ent) {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
-        }
+    entry->width = total_w;
+    entry->height = font->max_height;
+    entry->glyphs = glyphs;
+    entry->glyph_count = glyph_count;
 
-        prev_idx = char_idx;
-    }
-
-    free(char_idxs);
     return bytes_rendered;
 }
 
@@ -545,7 +704,7 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
     if (!res) {
         res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
         memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+        res->rendered_bytes = gr_ttf_shape_text(font, res, text, max_width);
         if (res->rendered_bytes < 0) {
             free(res);
             return nullptr;
@@ -612,7 +771,7 @@ int gr_ttf_measureEx(const char *s, void *font)
     pthread_mutex_lock(&f->mutex);
     StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
     if (e) {
-        res = e->surface.width;
+        res = e->width;
     }
     pthread_mutex_unlock(&f->mutex);
 
@@ -689,7 +848,7 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
+    int y_bottom = y + e->height;
     int res = e->rendered_bytes;
 
     if (max_height != -1 && max_height < y_bottom) {
@@ -700,14 +859,65 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
+    GGLSurface *bound = nullptr;
+    GGLubyte *bound_data = nullptr;
+    int x_right = x + e->width;
+
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-
     gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
+
+    for (int i = 0; i < e->glyph_count; ++i) {
+        FT_BitmapGlyph glyph = e->glyphs[i].glyph->glyph;
+        GGLSurface glyph_surface;
+        GGLSurface *texture;
+        int tex_x, tex_y;
+
+        if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
+            fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
+            continue;
+        } else if (glyph->bitmap.width == 0 || glyph->bitmap.rows == 0) {
+            continue;
+        }
+
+        // Glyph quad, clipped to the string's bounding box
+        int gx = x + e->glyphs[i].x + glyph->left;
+        int gy = y + font->base - glyph->top;
+        int x1 = MAX(gx, x);
+        int y1 = MAX(gy, y);
+        int x2 = MIN(gx + (int) glyph->bitmap.width, x_right);
+        int y2 = MIN(gy + (int) glyph->bitmap.rows, y_bottom);
+        if (x1 >= x2 || y1 >= y2) {
+            continue;
+        }
+
+        if (gr_ttf_atlas_get(&font->atlas, e->glyphs[i].glyph, &tex_x, &tex_y)) {
+            texture = &font->atlas.surface;
+        } else {
+            // Too large for the atlas cells, so draw from the glyph itself
+            glyph_surface.version = sizeof(glyph_surface);
+            glyph_surface.width = glyph->bitmap.width;
+            glyph_surface.height = glyph->bitmap.rows;
+            glyph_surface.stride = glyph->bitmap.pitch;
+            glyph_surface.data = glyph->bitmap.buffer;
+            glyph_surface.format = GGL_PIXEL_FORMAT_A_8;
+            texture = &glyph_surface;
+            tex_x = 0;
+            tex_y = 0;
+        }
+
+        // The atlas texture may have been reallocated while growing
+        if (texture != bound || texture->data != bound_data) {
+            gl->bindTexture(gl, texture);
+            bound = texture == &glyph_surface ? nullptr : texture;
+            bound_data = texture->data;
+        }
+
+        gl->texCoord2i(gl, tex_x - gx, tex_y - gy);
+        gl->recti(gl, x1, y1, x2, y2);
+    }
+
     gl->disable(gl, GGL_TEXTURE_2D);
 
     pthread_mutex_unlock(&font->mutex);
@@ -734,7 +944,7 @@ static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value
 {
     int *string_cache_size = (int *) context;
     StringCacheEntry *e = (StringCacheEntry *) value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    *string_cache_size += e->glyph_count*sizeof(ShapedGlyph) + sizeof(StringCacheEntry);
     return true;
 }
 
@@ -742,27 +952,36 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
 {
     TrueTypeFontKey *k = (TrueTypeFontKey *)key;
     TrueTypeFont *f = (TrueTypeFont *)value;
-    int *total_string_cache_size = (int *)context;
+    int *totals = (int *)context;
     int string_cache_size = 0;
+    int atlas_size;
 
     pthread_mutex_lock(&f->mutex);
 
     hashmapForEach(f->string_cache, gr_ttf_dump_stats_count_string_cache, &string_cache_size);
+    atlas_size = f->atlas.surface.stride * f->atlas.surface.height;
 
     printf("  Font %s (size %d, dpi %d):\n"
            "    refcount: %d\n"
            "    max_height: %d\n"
            "    base: %d\n"
            "    glyph_cache: %zu entries\n"
+           "    glyph_atlas: %d/%d glyphs (%dx%d cells, %.2f/%.2f kB)\n"
+           "    glyph_atlas: %lu hits, %lu misses, %lu evictions\n"
            "    string_cache: %zu entries (%.2f kB)\n",
            k->path, k->size, k->dpi,
            f->refcount, f->max_height, f->base,
            hashmapSize(f->glyph_cache),
+           f->atlas.slots_used, f->atlas.max_rows * f->atlas.columns,
+           f->atlas.cell_w, f->atlas.cell_h, ((double)atlas_size)/1024,
+           ((double)f->atlas.max_rows * f->atlas.columns * f->atlas.cell_w * f->atlas.cell_h)/1024,
+           f->atlas.hits, f->atlas.misses, f->atlas.evictions,
            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
 
     pthread_mutex_unlock(&f->mutex);
 
-    *total_string_cache_size += string_cache_size;
+    totals[0] += string_cache_size;
+    totals[1] += atlas_size;
     return true;
 }
 
@@ -774,10 +993,12 @@ void gr_ttf_dump_stats(void)
     if (!font_data.fonts) {
         printf("no truetype fonts loaded.\n");
     } else {
-        int total_string_cache_size = 0;
+        // String cache and glyph atlas sizes
+        int totals[2] = { 0, 0 };
         printf("%zu fonts loaded.\n", hashmapSize(font_data.fonts));
-        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_string_cache_size);
-        printf("  Total string cache size: %.2f kB\n", ((double)total_string_cache_size)/1024);
+        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, totals);
+        printf("  Total string cache size: %.2f kB\n", ((double)totals[0])/1024);
+        printf("  Total glyph atlas size: %.2f kB\n", ((double)totals[1])/1024);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
@@ -725,6 +725,55 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
     return true;
 }
 
+/*
+ * Inflate a deflated entry straight into the caller's buffer, instead of
+ * going through processDeflatedEntry()'s staging buffer.
+ */
+static bool inflateEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    z_stream zstream;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.next_in = pArchive->addr + pEntry->offset;
+    zstream.avail_in = pEntry->compLen;
+    zstream.next_out = (Bytef*) buffer;
+    zstream.avail_out = pEntry->uncompLen;
+    zstream.data_type = Z_UNKNOWN;
+
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        return false;
+    }
+
+    zerr = inflate(&zstream, Z_FINISH);
+    inflateEnd(&zstream);
+
+    if (zerr != Z_STREAM_END || (long) zstream.total_out != pEntry->uncompLen) {
+        LOGW("Failed to inflate entry (zerr=%d, %ld vs %ld bytes)\n",
+            zerr, (long) zstream.total_out, pEntry->uncompLen);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Get a pointer to the data of a stored (uncompressed) entry inside the
+ * mapped archive. The data is valid for as long as the archive is open.
+ *
+ * Returns NULL if the entry is compressed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry)
+{
+    if (pEntry->compression != STORED) {
+        return NULL;
+    }
+    return pArchive->addr + pEntry->offset;
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to buffer, which must be large
  * enough to hold mzGetZipEntryUncomplen(pEntry) bytes.
@@ -732,6 +781,14 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
+    if (pEntry->compression == DEFLATED) {
+        if (!inflateEntryToBuffer(pArchive, pEntry, buffer)) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     BufferExtractCookie bec;
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
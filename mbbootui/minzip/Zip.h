@@ -134,6 +134,13 @@ bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char* buffer);
 
+/*
+ * Get the data of a stored entry directly from the archive mapping. Returns
+ * NULL if the entry is compressed.
+ */
+const unsigned char* mzGetStoredZipEntryData(const ZipArchive* pArchive,
+    const ZipEntry* pEntry);
+
 /*
  * Inflate all files under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+// libmbcommon
+#include <mbcommon/string.h>
+
+// libmbdevice
+#include <mbdevice/json.h>
+
+// libmblog
+#include <mblog/logging.h>
+#include <mblog/stdio_logger.h>
+
+// libmbpatcher
+#include <mbpatcher/patcherconfig.h>
+#include <mbpatcher/patcherinterface.h>
+#include <mbpatcher/patchers/odinpatcher.h>
+#include <mbpatcher/patchers/zippatcher.h>
+
+typedef std::chrono::steady_clock Clock;
+
+/*!
+ * \brief One input file and all of the outputs produced from it
+ *
+ * All outputs of a job are patched with a single call to
+ * Patcher::patch_file_multi(), so the input is only opened and indexed once
+ * regardless of how many device and ROM ID combinations were requested.
+ */
+struct PatchJob
+{
+    std::string input;
+    std::string patcher_id;
+    std::vector<std::unique_ptr<mb::patcher::FileInfo>> outputs;
+
+    uint64_t input_size = 0;
+    bool ok = false;
+    mb::patcher::ErrorCode error = mb::patcher::ErrorCode::NoError;
+    double seconds = 0.0;
+};
+
+static void usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: mbpatcher [option...] -d <device> -r <rom id> <input file>...\n\n"
+            "Patches each input file once for every combination of the given\n"
+            "devices and ROM IDs.\n\n"
+            "Options:\n"
+            "  -d, --device <id>        Target device ID or codename (repeatable)\n"
+            "  -r, --rom-id <id>        Target ROM ID (repeatable)\n"
+            "  -p, --patcher <id>       Patcher to use (default: based on the\n"
+            "                           file extension)\n"
+            "  -o, --output-dir <dir>   Directory for the patched files (default:\n"
+            "                           same directory as each input file)\n"
+            "  -j, --jobs <n>           Patch up to n input files at the same\n"
+            "                           time (default: number of CPUs)\n"
+            "  --data-dir <dir>         Data directory (default: data)\n"
+            "  --devices <file>         Device definitions (default:\n"
+            "                           <data dir>/devices.json)\n"
+            "  --temp-dir <dir>         Directory for temporary files\n"
+            "  --cache-dir <dir>        Enable the patch result cache, stored in\n"
+            "                           <dir>\n"
+            "  --stats <file>           Write timing and throughput statistics as\n"
+            "                           JSON to <file> ('-' for stdout)\n"
+            "  -v, --verbose            Show the patchers' log output\n"
+            "  -h, --help               Display this help message\n\n"
+            "Output files are named <base name>_<rom id>.zip. If more than one\n"
+            "device is given, they are named <base name>_<device id>_<rom id>.zip.\n"
+            "The exit status is non-zero if any file failed to patch.\n");
+}
+
+static bool ends_with(const std::string &str, const char *suffix)
+{
+    size_t len = strlen(suffix);
+    return str.size() >= len
+            && str.compare(str.size() - len, len, suffix) == 0;
+}
+
+static std::string default_patcher_id(const std::string &path)
+{
+    if (ends_with(path, ".tar.md5")
+            || ends_with(path, ".tar.md5.gz")
+            || ends_with(path, ".tar.md5.xz")) {
+        return mb::patcher::OdinPatcher::Id;
+    } else {
+        return mb::patcher::ZipPatcher::Id;
+    }
+}
+
+/*!
+ * \brief Compute output path
+ *
+ * This uses the same naming scheme as the GUI, with the device ID added when
+ * there are several devices to keep the names unique.
+ */
+static std::string output_path(const std::string &input,
+                               const std::string &output_dir,
+                               const std::string &device_id,
+                               const std::string &rom_id)
+{
+    static const char *suffixes[] = {
+        ".tar.md5", ".tar.md5.gz", ".tar.md5.xz", ".zip", nullptr
+    };
+
+    std::string dir;
+    std::string name;
+
+    auto slash = input.find_last_of('/');
+    if (slash == std::string::npos) {
+        name = input;
+    } else {
+        dir = input.substr(0, slash + 1);
+        name = input.substr(slash + 1);
+    }
+
+    if (!output_dir.empty()) {
+        dir = output_dir;
+        if (dir.back() != '/') {
+            dir += '/';
+        }
+    }
+
+    std::string ext = ".zip";
+    bool found = false;
+
+    for (auto it = suffixes; *it; ++it) {
+        if (ends_with(name, *it)) {
+            name.resize(name.size() - strlen(*it));
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        auto dot = name.find_last_of('.');
+        if (dot != std::string::npos && dot != 0) {
+            ext = name.substr(dot);
+            name.resize(dot);
+        }
+    }
+
+    name += '_';
+    if (!device_id.empty()) {
+        name += device_id;
+        name += '_';
+    }
+    name += rom_id;
+    name += ext;
+
+    return dir + name;
+}
+
+static bool load_devices(const std::string &path,
+                         const std::vector<std::string> &ids,
+                         std::vector<mb::device::Device> &devices)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open file: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string contents;
+    char buf[16384];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        contents.append(buf, n);
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "%s: Failed to read file: %s\n",
+                path.c_str(), strerror(errno));
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    mb::device::DeviceDatabase db;
+    mb::device::JsonError error;
+    bool loaded;
+
+    if (mb::device::DeviceDatabase::is_binary(contents.data(),
+                                              contents.size())) {
+        loaded = db.load_binary(contents.data(), contents.size(), error);
+    } else {
+        loaded = db.load(std::move(contents), true, error);
+    }
+    if (!loaded) {
+        fprintf(stderr, "%s: Failed to load devices: %s\n",
+                path.c_str(), error.message.c_str());
+        return false;
+    }
+
+    for (auto const &id : ids) {
+        size_t index;
+        mb::device::Device device;
+
+        if (!db.find_id(id, index) && !db.find_codename(id, index)) {
+            fprintf(stderr, "%s: Unknown device\n", id.c_str());
+            return false;
+        }
+
+        if (!db.get(index, device) || device.validate() != 0) {
+            fprintf(stderr, "%s: Invalid device definition\n", id.c_str());
+            return false;
+        }
+
+        devices.push_back(std::move(device));
+    }
+
+    return true;
+}
+
+static std::string json_escape(const std::string &str)
+{
+    std::string result;
+    result.reserve(str.size() + 2);
+
+    for (unsigned char c : str) {
+        switch (c) {
+        case '"':  result += "\\\""; break;
+        case '\\': result += "\\\\"; break;
+        case '\b': result += "\\b";  break;
+        case '\f': result += "\\f";  break;
+        case '\n': result += "\\n";  break;
+        case '\r': result += "\\r";  break;
+        case '\t': result += "\\t";  break;
+        default:
+            if (c < 0x20) {
+                result += mb::format("\\u%04x", c);
+            } else {
+                result += static_cast<char>(c);
+            }
+            break;
+        }
+    }
+
+    return result;
+}
+
+static double throughput(uint64_t bytes, double seconds)
+{
+    return seconds > 0.0 ? bytes / seconds / 1024.0 / 1024.0 : 0.0;
+}
+
+static bool write_stats(const std::string &path,
+                        const std::vector<PatchJob> &jobs,
+                        unsigned int threads, double seconds)
+{
+    FILE *fp;
+
+    if (path == "-") {
+        fp = stdout;
+    } else {
+        fp = fopen(path.c_str(), "w");
+        if (!fp) {
+            fprintf(stderr, "%s: Failed to open file: %s\n",
+                    path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    uint64_t total_bytes = 0;
+    size_t outputs = 0;
+    size_t failed = 0;
+
+    fprintf(fp, "{\n  \"jobs\": [");
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        auto const &job = jobs[i];
+
+        fprintf(fp, "%s\n    {\n", i == 0 ? "" : ",");
+        fprintf(fp, "      \"input\": \"%s\",\n",
+                json_escape(job.input).c_str());
+        fprintf(fp, "      \"patcher\": \"%s\",\n",
+                json_escape(job.patcher_id).c_str());
+        fprintf(fp, "      \"outputs\": [");
+        for (size_t j = 0; j < job.outputs.size(); ++j) {
+            fprintf(fp, "%s\"%s\"", j == 0 ? "" : ", ", json_escape(
+                    job.outputs[j]->output_path()).c_str());
+        }
+        fprintf(fp, "],\n");
+        fprintf(fp, "      \"success\": %s,\n", job.ok ? "true" : "false");
+        fprintf(fp, "      \"error\": %d,\n", static_cast<int>(job.error));
+        fprintf(fp, "      \"input_bytes\": %llu,\n",
+                static_cast<unsigned long long>(job.input_size));
+        fprintf(fp, "      \"seconds\": %.3f,\n", job.seconds);
+        fprintf(fp, "      \"mib_per_second\": %.2f\n",
+                throughput(job.input_size, job.seconds));
+        fprintf(fp, "    }");
+
+        total_bytes += job.input_size;
+        outputs += job.outputs.size();
+        if (!job.ok) {
+            ++failed;
+        }
+    }
+
+    fprintf(fp, "%s],\n", jobs.empty() ? "" : "\n  ");
+    fprintf(fp, "  \"threads\": %u,\n", threads);
+    fprintf(fp, "  \"inputs\": %zu,\n", jobs.size());
+    fprintf(fp, "  \"outputs\": %zu,\n", outputs);
+    fprintf(fp, "  \"failed\": %zu,\n", failed);
+    fprintf(fp, "  \"input_bytes\": %llu,\n",
+            static_cast<unsigned long long>(total_bytes));
+    fprintf(fp, "  \"seconds\": %.3f,\n", seconds);
+    fprintf(fp, "  \"mib_per_second\": %.2f\n",
+            throughput(total_bytes, seconds));
+    fprintf(fp, "}\n");
+
+    bool ret = !ferror(fp);
+
+    if (fp != stdout && fclose(fp) != 0) {
+        ret = false;
+    }
+    if (!ret) {
+        fprintf(stderr, "%s: Failed to write statistics\n", path.c_str());
+    }
+
+    return ret;
+}
+
+static void run_job(mb::patcher::PatcherConfig &pc, PatchJob &job,
+                    std::mutex &output_lock)
+{
+    auto start = Clock::now();
+
+    struct stat sb;
+    if (stat(job.input.c_str(), &sb) == 0) {
+        job.input_size = sb.st_size;
+    }
+
+    auto patcher = pc.make_patcher(job.patcher_id);
+    if (!patcher) {
+        job.error = mb::patcher::ErrorCode::PatcherCreateError;
+    } else {
+        std::vector<const mb::patcher::FileInfo *> infos;
+        for (auto const &output : job.outputs) {
+            infos.push_back(output.get());
+        }
+
+        job.ok = patcher->patch_file_multi(infos, nullptr, nullptr, nullptr,
+                                           nullptr);
+        if (!job.ok) {
+            job.error = patcher->error();
+        }
+
+        patcher->set_file_info(nullptr);
+    }
+
+    job.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::lock_guard<std::mutex> lock(output_lock);
+
+    if (job.ok) {
+        printf("%s: Patched %zu file(s) in %.2fs\n",
+               job.input.c_str(), job.outputs.size(), job.seconds);
+    } else {
+        fprintf(stderr, "%s: Failed to patch file (error %d)\n",
+                job.input.c_str(), static_cast<int>(job.error));
+    }
+}
+
+/*!
+ * \brief Patch every job using a pool of worker threads
+ *
+ * Workers take the next job from a shared index, so large files do not hold
+ * up the rest of the queue.
+ */
+static void run_jobs(mb::patcher::PatcherConfig &pc,
+                     std::vector<PatchJob> &jobs, unsigned int threads)
+{
+    std::atomic<size_t> next(0);
+    std::mutex output_lock;
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < jobs.size()) {
+            run_job(pc, jobs[i], output_lock);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+
+    for (auto &t : workers) {
+        t.join();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    enum {
+        OPT_DATA_DIR = CHAR_MAX + 1,
+        OPT_DEVICES,
+        OPT_TEMP_DIR,
+        OPT_CACHE_DIR,
+        OPT_STATS,
+    };
+
+    static const char short_options[] = "d:r:p:o:j:vh";
+
+    static struct option long_options[] = {
+        {"device",     required_argument, 0, 'd'},
+        {"rom-id",     required_argument, 0, 'r'},
+        {"patcher",    required_argument, 0, 'p'},
+        {"output-dir", required_argument, 0, 'o'},
+        {"jobs",       required_argument, 0, 'j'},
+        {"data-dir",   required_argument, 0, OPT_DATA_DIR},
+        {"devices",    required_argument, 0, OPT_DEVICES},
+        {"temp-dir",   required_argument, 0, OPT_TEMP_DIR},
+        {"cache-dir",  required_argument, 0, OPT_CACHE_DIR},
+        {"stats",      required_argument, 0, OPT_STATS},
+        {"verbose",    no_argument,       0, 'v'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    std::vector<std::string> device_ids;
+    std::vector<std::string> rom_ids;
+    std::string patcher_id;
+    std::string output_dir;
+    std::string data_dir = "data";
+    std::string devices_file;
+    std::string temp_dir;
+    std::string cache_dir;
+    std::string stats_file;
+    unsigned int threads = 0;
+    bool verbose = false;
+
+    int opt;
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'd':
+            device_ids.push_back(optarg);
+            break;
+        case 'r':
+            rom_ids.push_back(optarg);
+            break;
+        case 'p':
+            patcher_id = optarg;
+            break;
+        case 'o':
+            output_dir = optarg;
+            break;
+        case 'j': {
+            char *end;
+            unsigned long n = strtoul(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n == 0 || n > 1024) {
+                fprintf(stderr, "Invalid job count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            threads = static_cast<unsigned int>(n);
+            break;
+        }
+        case OPT_DATA_DIR:
+            data_dir = optarg;
+            break;
+        case OPT_DEVICES:
+            devices_file = optarg;
+            break;
+        case OPT_TEMP_DIR:
+            temp_dir = optarg;
+            break;
+        case OPT_CACHE_DIR:
+            cache_dir = optarg;
+            break;
+        case OPT_STATS:
+            stats_file = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+            usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc || device_ids.empty() || rom_ids.empty()) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    // The patchers log a lot of information that is only useful for debugging
+    mb::log::log_set_logger(
+            std::make_shared<mb::log::StdioLogger>(stderr, false));
+    if (!verbose) {
+        mb::log::log_set_level(mb::log::LogLevel::Error);
+    }
+
+    if (devices_file.empty()) {
+        devices_file = data_dir + "/devices.json";
+    }
+
+    std::vector<mb::device::Device> devices;
+    if (!load_devices(devices_file, device_ids, devices)) {
+        return EXIT_FAILURE;
+    }
+
+    mb::patcher::PatcherConfig pc;
+    pc.set_data_directory(data_dir);
+    if (!temp_dir.empty()) {
+        pc.set_temp_directory(temp_dir);
+    }
+    if (!cache_dir.empty()) {
+        pc.set_cache_directory(cache_dir);
+    }
+    // Shared by all of the workers
+    pc.freeze();
+
+    std::vector<PatchJob> jobs(argc - optind);
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        PatchJob &job = jobs[i];
+        job.input = argv[optind + i];
+        job.patcher_id = patcher_id.empty()
+                ? default_patcher_id(job.input) : patcher_id;
+
+        for (auto const &device : devices) {
+            for (auto const &rom_id : rom_ids) {
+                std::unique_ptr<mb::patcher::FileInfo> info(
+                        new mb::patcher::FileInfo());
+                info->set_input_path(job.input);
+                info->set_output_path(output_path(
+                        job.input, output_dir,
+                        devices.size() > 1 ? device.id() : std::string(),
+                        rom_id));
+                info->set_device(device);
+                info->set_rom_id(rom_id);
+                job.outputs.push_back(std::move(info));
+            }
+        }
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = std::min<unsigned int>(threads, jobs.size());
+
+    auto start = Clock::now();
+
+    run_jobs(pc, jobs, threads);
+
+    double seconds = std::chrono::duration<double>(
+            Clock::now() - start).count();
+
+    size_t failed = std::count_if(jobs.begin(), jobs.end(),
+                                  [](const PatchJob &job) { return !job.ok; });
+
+    printf("Patched %zu of %zu file(s) in %.2fs\n",
+           jobs.size() - failed, jobs.size(), seconds);
+
+    bool ret = failed == 0;
+
+    if (!stats_file.empty() && !write_stats(stats_file, jobs, threads,
+                                            seconds)) {
+        ret = false;
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Allocator hooks for MBP_ENABLE_ALLOC_PROFILING builds
+ *
+ * mbtool is linked statically with `-Wl,--wrap=<function>` for each of the
+ * functions below, so every call to eg. malloc() in mbtool, the libraries, and
+ * the static C++ runtime goes to __wrap_malloc() instead. The real allocator
+ * is still reachable as __real_malloc().
+ */
+
+#include "alloc_hooks.h"
+
+#include <thread>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "mbcommon/alloc_profiler.h"
+#include "mblog/logging.h"
+#include "mblog/metrics.h"
+
+extern "C"
+{
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+void __real_free(void *ptr);
+
+void * __wrap_malloc(size_t size);
+void * __wrap_calloc(size_t nmemb, size_t size);
+void * __wrap_realloc(void *ptr, size_t size);
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size);
+void __wrap_free(void *ptr);
+
+// Sizes are the usable sizes reported by the allocator so that allocations and
+// frees of the same memory count the same number of bytes
+
+void * __wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    if (ptr) {
+        mb::alloc_profiler_record_alloc(malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __real_calloc(nmemb, size);
+    if (ptr) {
+        mb::alloc_profiler_record_alloc(malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+void * __wrap_realloc(void *ptr, size_t size)
+{
+    size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+
+    void *new_ptr = __real_realloc(ptr, size);
+    if (new_ptr) {
+        if (ptr) {
+            mb::alloc_profiler_record_free(old_size);
+        }
+        mb::alloc_profiler_record_alloc(malloc_usable_size(new_ptr));
+    } else if (ptr && size == 0) {
+        // realloc(ptr, 0) may free ptr
+        mb::alloc_profiler_record_free(old_size);
+    }
+    return new_ptr;
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int ret = __real_posix_memalign(memptr, alignment, size);
+    if (ret == 0) {
+        mb::alloc_profiler_record_alloc(malloc_usable_size(*memptr));
+    }
+    return ret;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr) {
+        mb::alloc_profiler_record_free(malloc_usable_size(ptr));
+    }
+    __real_free(ptr);
+}
+
+}
+
+namespace mb
+{
+
+static int dump_pipe[2] = { -1, -1 };
+
+static void dump_signal_handler(int signum)
+{
+    (void) signum;
+    int saved_errno = errno;
+    char c = 0;
+    // Nothing to do if the pipe is full. A dump is already pending.
+    (void) !write(dump_pipe[1], &c, 1);
+    errno = saved_errno;
+}
+
+static void dump_at_exit()
+{
+    log::log_alloc_profile();
+}
+
+static void dump_thread()
+{
+    char c;
+    while (true) {
+        ssize_t n = read(dump_pipe[0], &c, 1);
+        if (n == 1) {
+            log::log_alloc_profile();
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            break;
+        }
+    }
+}
+
+/*!
+ * \brief Dump the allocation profile at exit and on SIGUSR2
+ *
+ * Logging from a signal handler is not safe, so the handler only wakes up a
+ * thread, which does the logging.
+ */
+bool alloc_profiler_start_dumper()
+{
+    std::atexit(dump_at_exit);
+
+    if (pipe2(dump_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        LOGW("Failed to create allocation profile pipe: %s", strerror(errno));
+        return false;
+    }
+
+    // Only the write end is non-blocking
+    int flags = fcntl(dump_pipe[0], F_GETFL);
+    if (flags < 0 || fcntl(dump_pipe[0], F_SETFL, flags & ~O_NONBLOCK) < 0) {
+        LOGW("Failed to make allocation profile pipe blocking: %s",
+             strerror(errno));
+        return false;
+    }
+
+    std::thread(dump_thread).detach();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGUSR2, &sa, nullptr) < 0) {
+        LOGW("Failed to set SIGUSR2 handler: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -20,16 +20,22 @@
 #include "appsync.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
-#include <cassert>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -38,6 +44,7 @@
 #include <unistd.h>
 
 #include "mbcommon/common.h"
+#include "mbcommon/metrics.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
@@ -60,6 +67,7 @@
 #include "appsyncmanager.h"
 #include "multiboot.h"
 #include "packages.h"
+#include "rom_inventory.h"
 #include "romconfig.h"
 #include "roms.h"
 
@@ -79,6 +87,9 @@
 
 #define COMMAND_BUF_SIZE                1024
 
+// Maximum number of events handled per epoll_wait() call
+#define PROXY_MAX_EVENTS                16
+
 #define PACKAGES_XML_PATH_FMT           "%s/system/packages.xml"
 
 namespace mb
@@ -114,11 +125,12 @@ static bool load_config_files()
         RomConfig &rom_config = cfg_pkgs_list.back().config;
         Packages &rom_packages = cfg_pkgs_list.back().packages;
 
-        if (!rom_config.load_file(config_path)) {
+        if (!RomInventory::global().rom_config(rom->id, rom_config)) {
             LOGW("%s: Failed to load config for ROM %s",
                  config_path.c_str(), rom->id.c_str());
         }
-        if (!rom_packages.load_xml(packages_path)) {
+        if (!rom_packages.load_xml(packages_path,
+                                   Packages::LOAD_SUMMARY)) {
             LOGW("%s: Failed to load packages for ROM %s",
                  packages_path.c_str(), rom->id.c_str());
         }
@@ -144,6 +156,46 @@ static bool load_config_files()
     return true;
 }
 
+/*!
+ * \brief Link identical APKs across all ROMs to the shared APK store
+ *
+ * This walks every ROM's app directory and hashes new APKs, so it runs on its
+ * own thread to avoid delaying installd.
+ */
+static void deduplicate_apks_async()
+{
+    std::vector<std::string> app_dirs;
+
+    for (const RomConfigAndPackages &cp : cfg_pkgs_list) {
+        std::string data_path = cp.rom->full_data_path();
+        if (!data_path.empty()) {
+            app_dirs.push_back(data_path + "/app");
+        }
+    }
+
+    std::thread([app_dirs]{
+        ApkDedupStats stats;
+        uint64_t start = util::current_time_ms();
+
+        if (!AppSyncManager::deduplicate_apks(app_dirs, stats)) {
+            LOGW("Failed to deduplicate some APKs");
+        }
+
+        uint64_t stop = util::current_time_ms();
+
+        auto &registry = MetricsRegistry::global();
+        registry.histogram("appsync.apk_dedup_ms").record(stop - start);
+        registry.counter("appsync.apk_dedup_linked").add(stats.linked);
+        registry.counter("appsync.apk_dedup_bytes_saved")
+                .add(stats.bytes_saved);
+
+        LOGD("Linked %" PRIu64 " APKs (%" PRIu64 " bytes saved), skipped %"
+             PRIu64 ", removed %" PRIu64 " unused APKs from store in %"
+             PRIu64 "ms", stats.linked, stats.bytes_saved, stats.skipped,
+             stats.collected, stop - start);
+    }).detach();
+}
+
 static bool prepare_appsync()
 {
     // Detect directory locations
@@ -194,18 +246,30 @@ static bool prepare_appsync()
 
     start = util::current_time_ms();
 
-    // Actually share the data
-    for (SharedPackage &shared_pkg : config.shared_pkgs) {
-        auto pkg = packages.find_by_pkg(shared_pkg.pkg_id);
+    // Actually share the data. All of the directories are mounted in one pass.
+    std::vector<SharedDataMount> mounts;
+    std::vector<SharedPackage *> mount_pkgs;
 
+    for (SharedPackage &shared_pkg : config.shared_pkgs) {
         if (disable_data_sharing) {
             shared_pkg.share_data = false;
         }
 
-        if (shared_pkg.share_data && !AppSyncManager::mount_shared_directory(
-                pkg->name, pkg->get_uid())) {
-            LOGW("Failed to mount shared data directory");
-            shared_pkg.share_data = false;
+        if (shared_pkg.share_data) {
+            auto pkg = packages.find_by_pkg(shared_pkg.pkg_id);
+            mounts.push_back({ pkg->name, pkg->get_uid(), false });
+            mount_pkgs.push_back(&shared_pkg);
+        }
+    }
+
+    if (!AppSyncManager::mount_shared_directories(mounts)) {
+        LOGW("Failed to mount some shared data directories");
+    }
+
+    for (size_t i = 0; i < mounts.size(); ++i) {
+        if (!mounts[i].mounted) {
+            LOGW("[%s] Data will not be shared", mounts[i].pkg.c_str());
+            mount_pkgs[i]->share_data = false;
         }
     }
 
@@ -295,77 +359,6 @@ static int create_new_socket()
     return fd;
 }
 
-/*
- * Socket messages are prefixed with 16-bit unsigned value (little-endian)
- * indicating the number of bytes that follow. The data should be treated as
- * a string and a null terminator must be added to the end.
- */
-
-/*!
- * \brief Receive a message from a socket
- */
-static bool receive_message(int fd, char *buf, std::size_t size,
-                            bool is_async, int *async_id)
-{
-    unsigned short count;
-
-    if (is_async) {
-        assert(async_id != nullptr);
-
-        if (!util::socket_read_int32(fd, async_id)) {
-            LOGE("Failed to receive async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
-
-    if (!util::socket_read_uint16(fd, &count)) {
-        LOGE("Failed to read command size: %s", strerror(errno));
-        return false;
-    }
-
-    if (count < 1 || count >= size) {
-        LOGE("Invalid size %u", count);
-        return false;
-    }
-
-    if (util::socket_read(fd, buf, count) != count) {
-        LOGE("Failed to read command: %s", strerror(errno));
-        return false;
-    }
-
-    buf[count] = 0;
-
-    return true;
-}
-
-/*!
- * \brief Send a message to a socket
- */
-static bool send_message(int fd, const char *command,
-                         bool is_async, int async_id)
-{
-    unsigned short count = strlen(command);
-
-    if (is_async) {
-        if (!util::socket_write_int32(fd, async_id)) {
-            LOGE("Failed to write async command ID: %s", strerror(errno));
-            return false;
-        }
-    }
-
-    if (!util::socket_write_uint16(fd, count)) {
-        LOGE("Failed to write command size: %s", strerror(errno));
-        return false;
-    }
-
-    if (util::socket_write(fd, command, count) != count) {
-        LOGE("Failed to write command: %s", strerror(errno));
-        return false;
-    }
-
-    return true;
-}
-
 /*!
  * \brief Connect to the installd socket at INSTALLD_SOCKET_PATH
  *
@@ -532,260 +525,723 @@ static void handle_command(const std::vector<std::string> &args)
     }
 }
 
-static bool handle_installd_event(int client_fd, int installd_fd,
-                                  bool is_async)
-{
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
-
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_send, time_stop_send;
+/*
+ * Socket messages are prefixed with 16-bit unsigned value (little-endian)
+ * indicating the number of bytes that follow. The data should be treated as
+ * a string and a null terminator must be added to the end. With the
+ * CyanogenMod async installd, the size is preceded by a 32-bit transaction ID.
+ */
 
-    int async_id;
+/*!
+ * \brief A complete message received from a socket
+ */
+struct InstalldMessage
+{
+    // Header and data, which are forwarded as is
+    std::string raw;
+    // Command or reply
+    std::string data;
+    int32_t async_id = 0;
+};
 
-    time_start = util::current_time_ms();
+/*!
+ * \brief Extract the next complete message from a receive buffer
+ *
+ * \return 1 if a message was extracted, 0 if more data is needed, or -1 if the
+ *         buffer contains an invalid message
+ */
+static int take_message(std::string &buf, bool is_async, InstalldMessage &msg)
+{
+    size_t header_size = (is_async ? sizeof(int32_t) : 0) + sizeof(uint16_t);
+    uint16_t count;
 
-    time_start_installd = util::current_time_ms();
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+    if (buf.size() < header_size) {
+        return 0;
     }
-    time_stop_installd = util::current_time_ms();
 
-    std::vector<std::string> args = parse_args(buf);
-    LOGD("Received async (probably) reply: %s", args_to_string(args).c_str());
+    if (is_async) {
+        memcpy(&msg.async_id, buf.data(), sizeof(msg.async_id));
+    }
+    memcpy(&count, buf.data() + header_size - sizeof(count), sizeof(count));
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
+    // Use the same size limit as installd
+    if (count < 1 || count >= COMMAND_BUF_SIZE) {
+        LOGE("Invalid size %u", count);
+        return -1;
     }
-    time_stop_send = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+    if (buf.size() < header_size + count) {
+        return 0;
+    }
 
-    LOGD("Command stats:");
-    LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-         time_stop_send - time_start_send);
-    LOGD("- Time to receive reply from installd: %" PRIu64 "ms",
-         time_stop_installd - time_start_installd);
-    LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-         time_stop - time_start);
-    LOGD("---");
+    msg.raw.assign(buf, 0, header_size + count);
+    msg.data.assign(buf, header_size, count);
+    buf.erase(0, header_size + count);
 
-    return true;
+    return 1;
 }
 
-static bool handle_android_event(int client_fd, int installd_fd,
-                                 bool can_appsync, bool is_async)
+/*!
+ * \brief Read everything that is currently available from a non-blocking fd
+ *
+ * \return 1 if the fd is still open, 0 on EOF, or -1 on error
+ */
+static int read_available(int fd, std::string &buf)
 {
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
+    char chunk[4096];
 
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_hook = 0, time_stop_hook = 0;
-    uint64_t time_start_send, time_stop_send;
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        } else if (n == 0) {
+            return 0;
+        }
 
-    int async_id;
+        buf.append(chunk, n);
+    }
+}
 
-    if (!receive_message(client_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive request from client");
-        return false;
+/*!
+ * \brief Write as much of a buffer as possible to a non-blocking socket
+ *
+ * \return False if an error occurs. Otherwise, true, even if some data could
+ *         not be written yet.
+ */
+static bool write_available(int fd, std::string &buf)
+{
+    size_t offset = 0;
+
+    while (offset < buf.size()) {
+        ssize_t n = send(fd, buf.data() + offset, buf.size() - offset,
+                         MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+
+        offset += n;
     }
 
-    time_start = util::current_time_ms();
+    buf.erase(0, offset);
+    return true;
+}
 
-    std::vector<std::string> args = parse_args(buf);
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) >= 0;
+}
 
-    bool log_result = true;
+/*!
+ * \brief Log the command and determine whether it needs to be hooked
+ *
+ * \param[in] args Command arguments
+ * \param[out] log_result Whether the reply should be logged
+ *
+ * \return Whether the command may need to be hooked by handle_command()
+ */
+static bool inspect_command(const std::vector<std::string> &args,
+                            bool *log_result)
+{
+    *log_result = true;
 
     if (args.empty()) {
         LOGE("Invalid command (empty message)");
-    } else {
-        const std::string &cmd = args[0];
-
-        if (cmd == "ping"
-                || cmd == "freecache") {
-            LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
-        } else if (cmd == "aapt"
-                || cmd == "aapt_with_common") {
-            LOGD("Received CyanogenMod-specific command: %s",
-                 args_to_string(args).c_str());
-        } else if (cmd == "rmrcl"
-                || cmd == "asyncDexopt"
-                || cmd == "changeDexOwner") {
-            LOGD("Received Touchwiz-specific command: %s",
-                 args_to_string(args).c_str());
-            if (cmd == "asyncDexopt") {
-                LOGD("Expecting future installd reply for 'asyncDexopt'");
-            }
-        } else if (cmd == "getsize") {
-            // Get size is so annoying we don't want it to show... EVER!
-            log_result = false;
-        } else if (cmd == "install"
-                || cmd == "dexopt"
-                || cmd == "markbootcomplete"
-                || cmd == "movedex"
-                || cmd == "rmdex"
-                || cmd == "remove"
-                || cmd == "rename"
-                || cmd == "fixuid"
-                || cmd == "rmcache"
-                || cmd == "rmcodecache"
-                || cmd == "rmuserdata"
-                || cmd == "movefiles"
-                || cmd == "linklib"
-                || cmd == "mkuserdata"
-                || cmd == "mkuserconfig"
-                || cmd == "rmuser"
-                || cmd == "idmap"
-                || cmd == "restorecondata"
-                || cmd == "patchoat") {
-            LOGD("Received command: %s", args_to_string(args).c_str());
+        return false;
+    }
 
-            if (can_appsync) {
-                time_start_hook = util::current_time_ms();
-                handle_command(args);
-                time_stop_hook = util::current_time_ms();
-            }
-        } else {
-            LOGW("Unrecognized command: %s", args_to_string(args).c_str());
+    const std::string &cmd = args[0];
+
+    if (cmd == "ping"
+            || cmd == "freecache") {
+        LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
+    } else if (cmd == "aapt"
+            || cmd == "aapt_with_common") {
+        LOGD("Received CyanogenMod-specific command: %s",
+             args_to_string(args).c_str());
+    } else if (cmd == "rmrcl"
+            || cmd == "asyncDexopt"
+            || cmd == "changeDexOwner") {
+        LOGD("Received Touchwiz-specific command: %s",
+             args_to_string(args).c_str());
+        if (cmd == "asyncDexopt") {
+            LOGD("Expecting future installd reply for 'asyncDexopt'");
         }
+    } else if (cmd == "getsize") {
+        // Get size is so annoying we don't want it to show... EVER!
+        *log_result = false;
+    } else if (cmd == "install"
+            || cmd == "dexopt"
+            || cmd == "markbootcomplete"
+            || cmd == "movedex"
+            || cmd == "rmdex"
+            || cmd == "remove"
+            || cmd == "rename"
+            || cmd == "fixuid"
+            || cmd == "rmcache"
+            || cmd == "rmcodecache"
+            || cmd == "rmuserdata"
+            || cmd == "movefiles"
+            || cmd == "linklib"
+            || cmd == "mkuserdata"
+            || cmd == "mkuserconfig"
+            || cmd == "rmuser"
+            || cmd == "idmap"
+            || cmd == "restorecondata"
+            || cmd == "patchoat") {
+        LOGD("Received command: %s", args_to_string(args).c_str());
+        return true;
+    } else {
+        LOGW("Unrecognized command: %s", args_to_string(args).c_str());
     }
 
-    time_start_installd = util::current_time_ms();
-    if (!send_message(installd_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send request to installd");
-        return false;
+    return false;
+}
+
+struct ProxySession;
+
+/*!
+ * \brief What an epoll event refers to
+ */
+struct ProxyEndpoint
+{
+    enum class Type
+    {
+        Listener,
+        HookDone,
+        Client,
+        Installd,
+    };
+
+    Type type;
+    ProxySession *session;
+    int fd;
+    // Events that the fd is currently registered for
+    uint32_t events;
+};
+
+/*!
+ * \brief Command received from a client that has not been sent to installd
+ */
+struct ProxyRequest
+{
+    InstalldMessage msg;
+    std::vector<std::string> args;
+    bool hook;
+    bool log_result;
+    bool hooked = false;
+    uint64_t hook_ms = 0;
+};
+
+/*!
+ * \brief Command that was sent to installd and awaits a reply
+ */
+struct ProxyInFlight
+{
+    int32_t async_id;
+    bool log_result;
+    bool hooked;
+    uint64_t hook_ms;
+    uint64_t time_sent;
+};
+
+/*!
+ * \brief One client connection and its installd connection
+ */
+struct ProxySession
+{
+    uint64_t id;
+    ProxyEndpoint client;
+    ProxyEndpoint installd;
+    std::string client_in;
+    std::string client_out;
+    std::string installd_in;
+    std::string installd_out;
+    // Commands waiting to be forwarded. Only the first one can be waiting for
+    // a hook, which keeps the order of the client's commands.
+    std::deque<ProxyRequest> requests;
+    bool hook_running = false;
+    std::deque<ProxyInFlight> in_flight;
+
+    ProxySession(uint64_t id, int client_fd, int installd_fd)
+        : id(id)
+        , client{ProxyEndpoint::Type::Client, this, client_fd, 0}
+        , installd{ProxyEndpoint::Type::Installd, this, installd_fd, 0}
+    {
     }
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+
+    ~ProxySession()
+    {
+        LOGD("Closing client connection");
+        close(client.fd);
+        LOGD("Closing installd connection");
+        close(installd.fd);
     }
-    time_stop_installd = util::current_time_ms();
 
-    args = parse_args(buf);
+    ProxySession(const ProxySession &) = delete;
+    ProxySession & operator=(const ProxySession &) = delete;
+};
 
-    if (log_result) {
-        LOGD("Sending reply: %s", args_to_string(args).c_str());
+/*!
+ * \brief Event loop for proxying installd connections
+ *
+ * Every client connection gets its own installd connection. Messages are
+ * forwarded as soon as they are complete, so one connection never waits on
+ * another. Commands that are hooked by appsync (eg. `remove`) are held back,
+ * along with the client's later commands, until the hook finishes on the hook
+ * thread. Hooks never run concurrently, so they need no locking.
+ */
+class InstalldProxy
+{
+public:
+    InstalldProxy(int listen_fd, bool can_appsync, bool is_async)
+        : _listener{ProxyEndpoint::Type::Listener, nullptr, listen_fd, 0}
+        , _can_appsync(can_appsync)
+        , _is_async(is_async)
+    {
     }
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
+    ~InstalldProxy()
+    {
+        if (_hook_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _stop = true;
+            }
+            _cv.notify_all();
+            _hook_thread.join();
+        }
+
+        _sessions.clear();
+
+        if (_hook_done.fd >= 0) {
+            close(_hook_done.fd);
+        }
+        if (_epoll_fd >= 0) {
+            close(_epoll_fd);
+        }
     }
-    time_stop_send = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+    InstalldProxy(const InstalldProxy &) = delete;
+    InstalldProxy & operator=(const InstalldProxy &) = delete;
 
-    if (log_result) {
-        LOGD("Command stats:");
-        LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-             time_stop_send - time_start_send);
-        LOGD("- Time to complete installd command:   %" PRIu64 "ms",
-             time_stop_installd - time_start_installd);
-        if (can_appsync) {
-            LOGD("- Time to hook installd command:       %" PRIu64 "ms",
-                 time_stop_hook - time_start_hook);
+    bool run()
+    {
+        _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epoll_fd < 0) {
+            LOGE("Failed to create epoll fd: %s", strerror(errno));
+            return false;
+        }
+
+        _hook_done.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (_hook_done.fd < 0) {
+            LOGE("Failed to create eventfd: %s", strerror(errno));
+            return false;
+        }
+
+        if (!set_nonblocking(_listener.fd)
+                || !set_events(_listener, EPOLLIN)
+                || !set_events(_hook_done, EPOLLIN)) {
+            LOGE("Failed to set up event loop: %s", strerror(errno));
+            return false;
+        }
+
+        _hook_thread = std::thread(&InstalldProxy::hook_worker, this);
+
+        struct epoll_event events[PROXY_MAX_EVENTS];
+
+        while (true) {
+            int n = epoll_wait(_epoll_fd, events, PROXY_MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("Failed to wait for events: %s", strerror(errno));
+                return false;
+            }
+
+            // Sessions are only destroyed after all events are handled since
+            // later events may refer to them
+            for (int i = 0; i < n; ++i) {
+                auto *ep = static_cast<ProxyEndpoint *>(events[i].data.ptr);
+
+                switch (ep->type) {
+                case ProxyEndpoint::Type::Listener:
+                    if (!accept_client()) {
+                        return false;
+                    }
+                    break;
+                case ProxyEndpoint::Type::HookDone:
+                    handle_hook_results();
+                    break;
+                case ProxyEndpoint::Type::Client:
+                case ProxyEndpoint::Type::Installd:
+                    if (!handle_event(*ep, events[i].events)) {
+                        _closing.push_back(ep->session->id);
+                    }
+                    break;
+                }
+            }
+
+            for (uint64_t id : _closing) {
+                _sessions.erase(id);
+            }
+            _closing.clear();
         }
-        LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-             time_stop - time_start);
-        LOGD("---");
     }
 
-    return true;
-}
+private:
+    struct HookJob
+    {
+        uint64_t session_id;
+        std::vector<std::string> args;
+    };
 
-/**
- * \brief Main function for capturing and relaying the daemon commands
- *
- * This function will not return under normal conditions. It runs through the
- * following loop infinitely:
- *
- * 1. Accept a connection on the original installd socket
- * 2. Run installd
- * 3. Connect to the installd
- * 4. Capture and proxy commands
- *
- * If installd crashes or connection between mbtool and installd breaks in some
- * way, it will simply loop again. If this function fails to accept a connection
- * on the original socket, then it will return false.
- *
- * \return False if accepting the socket connection fails. Otherwise, does not
- *         return
- */
-static bool proxy_process(int fd, bool can_appsync)
-{
-    while (true) {
-        int client_fd = accept(fd, nullptr, nullptr);
+    struct HookResult
+    {
+        uint64_t session_id;
+        uint64_t duration_ms;
+    };
+
+    ProxyEndpoint _listener;
+    ProxyEndpoint _hook_done{ProxyEndpoint::Type::HookDone, nullptr, -1, 0};
+    bool _can_appsync;
+    bool _is_async;
+    int _epoll_fd = -1;
+    uint64_t _next_id = 0;
+    std::unordered_map<uint64_t, std::unique_ptr<ProxySession>> _sessions;
+    std::vector<uint64_t> _closing;
+
+    std::thread _hook_thread;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::deque<HookJob> _jobs;
+    std::deque<HookResult> _results;
+    bool _stop = false;
+
+    bool set_events(ProxyEndpoint &ep, uint32_t events)
+    {
+        if (ep.events == events) {
+            return true;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = events;
+        ev.data.ptr = &ep;
+
+        if (epoll_ctl(_epoll_fd, ep.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      ep.fd, &ev) < 0) {
+            return false;
+        }
+
+        ep.events = events;
+        return true;
+    }
+
+    bool accept_client()
+    {
+        int client_fd = accept4(_listener.fd, nullptr, nullptr,
+                                SOCK_CLOEXEC | SOCK_NONBLOCK);
         if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) {
+                return true;
+            }
             LOGE("Failed to accept client connection: %s", strerror(errno));
             return false;
         }
 
-        auto close_client_fd = util::finally([&]{
-            LOGD("Closing client connection");
-            close(client_fd);
-        });
-
         LOGD("Accepted new client connection");
 
         // Connect to installd
         int installd_fd = connect_to_installd();
         if (installd_fd < 0) {
+            close(client_fd);
             return false;
         }
 
-        auto close_installd_fd = util::finally([&]{
-            LOGD("Closing installd connection");
-            close(installd_fd);
-        });
+        std::unique_ptr<ProxySession> session(
+                new ProxySession(_next_id++, client_fd, installd_fd));
 
-        // Check if we're using some variant of the CyanogenMood async installd
-        // NOTE: We'll effectively make the connection sychronous because we
-        //       always wait for a reply before receiving the next command.
-        // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
-        bool is_async = util::file_find_one_of(
-                INSTALLD_PATH, { "failed to read transaction id" });
-        LOGD("installd is CyanogenMod async version: %d", is_async);
+        if (!set_nonblocking(installd_fd)
+                || !set_events(session->client, EPOLLIN)
+                || !set_events(session->installd, EPOLLIN)) {
+            LOGE("Failed to add connection to event loop: %s",
+                 strerror(errno));
+            return true;
+        }
 
         LOGD("---");
 
-        struct pollfd fds[2];
-        memset(fds, 0, sizeof(fds));
+        _sessions[session->id] = std::move(session);
+        return true;
+    }
+
+    bool handle_event(ProxyEndpoint &ep, uint32_t events)
+    {
+        ProxySession &s = *ep.session;
+        bool is_client = ep.type == ProxyEndpoint::Type::Client;
+
+        int ret = 1;
+
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ret = read_available(
+                    ep.fd, is_client ? s.client_in : s.installd_in);
+            if (ret < 0) {
+                LOGE("Failed to read from %s: %s",
+                     is_client ? "client" : "installd", strerror(errno));
+                return false;
+            }
+
+            // Messages received before EOF are still forwarded
+            if (is_client ? !handle_requests(s) : !handle_replies(s)) {
+                return false;
+            }
+        }
 
-        fds[0].fd = client_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = installd_fd;
-        fds[1].events = POLLIN;
+        return flush(s) && ret > 0;
+    }
 
+    bool handle_requests(ProxySession &s)
+    {
         while (true) {
-            fds[0].revents = 0;
-            fds[1].revents = 1;
+            ProxyRequest req;
 
-            if (poll(fds, 2, -1) < 0) {
-                LOGE("Failed to poll() fds: %s", strerror(errno));
+            int ret = take_message(s.client_in, _is_async, req.msg);
+            if (ret < 0) {
+                LOGE("Failed to receive request from client");
+                return false;
+            } else if (ret == 0) {
                 break;
             }
 
-            if (fds[0].revents & POLLIN && !handle_android_event(
-                    client_fd, installd_fd, can_appsync, is_async)) {
+            req.args = parse_args(req.msg.data.c_str());
+            req.hook = inspect_command(req.args, &req.log_result)
+                    && _can_appsync;
+
+            s.requests.push_back(std::move(req));
+        }
+
+        forward_requests(s);
+        return true;
+    }
+
+    /*!
+     * \brief Forward queued commands until one needs to be hooked first
+     */
+    void forward_requests(ProxySession &s)
+    {
+        while (!s.hook_running && !s.requests.empty()) {
+            ProxyRequest &req = s.requests.front();
+
+            if (req.hook && !req.hooked) {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _jobs.push_back({s.id, req.args});
+                }
+                _cv.notify_one();
+                s.hook_running = true;
                 break;
             }
-            if (fds[1].revents & POLLIN && !handle_installd_event(
-                    client_fd, installd_fd, is_async)) {
+
+            s.installd_out += req.msg.raw;
+            s.in_flight.push_back({req.msg.async_id, req.log_result,
+                                   req.hooked, req.hook_ms,
+                                   util::current_time_ms()});
+            s.requests.pop_front();
+        }
+    }
+
+    bool handle_replies(ProxySession &s)
+    {
+        while (true) {
+            InstalldMessage msg;
+
+            int ret = take_message(s.installd_in, _is_async, msg);
+            if (ret < 0) {
+                LOGE("Failed to receive reply from installd");
+                return false;
+            } else if (ret == 0) {
                 break;
             }
+
+            auto args = parse_args(msg.data.c_str());
+
+            auto it = s.in_flight.begin();
+            if (_is_async) {
+                it = std::find_if(s.in_flight.begin(), s.in_flight.end(),
+                                  [&](const ProxyInFlight &cmd) {
+                    return cmd.async_id == msg.async_id;
+                });
+            }
+
+            if (it == s.in_flight.end()) {
+                LOGD("Received async (probably) reply: %s",
+                     args_to_string(args).c_str());
+            } else {
+                static Histogram &command_ms = MetricsRegistry::global()
+                        .histogram("appsync.installd_command_ms");
+                static Histogram &hook_ms = MetricsRegistry::global()
+                        .histogram("appsync.hook_ms");
+
+                uint64_t elapsed = util::current_time_ms() - it->time_sent;
+                command_ms.record(elapsed);
+                if (it->hooked) {
+                    hook_ms.record(it->hook_ms);
+                }
+
+                if (it->log_result) {
+                    LOGD("Sending reply: %s", args_to_string(args).c_str());
+                    LOGD("Command stats:");
+                    LOGD("- Time to complete installd command:   %" PRIu64 "ms",
+                         elapsed);
+                    if (it->hooked) {
+                        LOGD("- Time to hook installd command:       %" PRIu64 "ms",
+                             it->hook_ms);
+                    }
+                    LOGD("---");
+                }
+                s.in_flight.erase(it);
+            }
+
+            s.client_out += msg.raw;
         }
+
+        return true;
     }
 
-    // Not reached
-    return true;
+    bool flush(ProxySession &s)
+    {
+        if (!write_available(s.installd.fd, s.installd_out)) {
+            LOGE("Failed to send request to installd: %s", strerror(errno));
+            return false;
+        }
+        if (!write_available(s.client.fd, s.client_out)) {
+            LOGE("Failed to send reply to client: %s", strerror(errno));
+            return false;
+        }
+
+        // Only wait for writability while there is something left to write
+        uint32_t installd_events = EPOLLIN;
+        uint32_t client_events = EPOLLIN;
+        if (!s.installd_out.empty()) {
+            installd_events |= EPOLLOUT;
+        }
+        if (!s.client_out.empty()) {
+            client_events |= EPOLLOUT;
+        }
+
+        if (!set_events(s.installd, installd_events)
+                || !set_events(s.client, client_events)) {
+            LOGE("Failed to update events: %s", strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    void handle_hook_results()
+    {
+        uint64_t value;
+        if (read(_hook_done.fd, &value, sizeof(value)) < 0
+                && errno != EAGAIN) {
+            LOGW("Failed to read eventfd: %s", strerror(errno));
+        }
+
+        std::deque<HookResult> results;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            results.swap(_results);
+        }
+
+        for (auto const &result : results) {
+            auto it = _sessions.find(result.session_id);
+            if (it == _sessions.end()) {
+                // Client disconnected while the hook was running
+                continue;
+            }
+
+            ProxySession &s = *it->second;
+            ProxyRequest &req = s.requests.front();
+            req.hooked = true;
+            req.hook_ms = result.duration_ms;
+            s.hook_running = false;
+
+            forward_requests(s);
+            if (!flush(s)) {
+                _closing.push_back(s.id);
+            }
+        }
+    }
+
+    void hook_worker()
+    {
+        while (true) {
+            HookJob job;
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+                _cv.wait(lock, [&] {
+                    return _stop || !_jobs.empty();
+                });
+                if (_stop) {
+                    return;
+                }
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+
+            uint64_t start = util::current_time_ms();
+            handle_command(job.args);
+            uint64_t stop = util::current_time_ms();
+
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _results.push_back({job.session_id, stop - start});
+            }
+
+            uint64_t value = 1;
+            if (write(_hook_done.fd, &value, sizeof(value)) < 0) {
+                LOGW("Failed to write eventfd: %s", strerror(errno));
+            }
+        }
+    }
+};
+
+/**
+ * \brief Main function for capturing and relaying the daemon commands
+ *
+ * This function will not return under normal conditions. For every connection
+ * accepted on the original installd socket, it connects to installd and
+ * proxies the commands and replies, running the appsync hooks where needed.
+ *
+ * If installd crashes or the connection between mbtool and installd breaks in
+ * some way, only that connection is closed. If this function fails to accept a
+ * connection on the original socket or to connect to installd, then it will
+ * return false.
+ *
+ * \return False if accepting the socket connection fails. Otherwise, does not
+ *         return
+ */
+static bool proxy_process(int fd, bool can_appsync)
+{
+    // Check if we're using some variant of the CyanogenMood async installd
+    // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
+    bool is_async = util::file_find_one_of(
+            INSTALLD_PATH, { "failed to read transaction id" });
+    LOGD("installd is CyanogenMod async version: %d", is_async);
+
+    InstalldProxy proxy(fd, can_appsync, is_async);
+    return proxy.run();
 }
 
 /*!
@@ -956,11 +1412,17 @@ int appsync_main(int argc, char *argv[])
             uint64_t start = util::current_time_ms();
             can_appsync = prepare_appsync();
             uint64_t stop = util::current_time_ms();
+            MetricsRegistry::global().histogram("appsync.prepare_ms")
+                    .record(stop - start);
             if (!can_appsync) {
                 LOGW("appsync preparation failed. "
                      "App sharing is completely disabled");
             }
             LOGD("Entire appsync preparation took %" PRIu64 "ms", stop - start);
+
+            if (can_appsync) {
+                deduplicate_apks_async();
+            }
         }
     }
 
@@ -20,33 +20,178 @@
 #include "appsyncmanager.h"
 
 #include <algorithm>
+#include <unordered_set>
 
 #include <cerrno>
+#include <cstdio>
+#include <cstring>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/chown.h"
 #include "mbutil/directory.h"
+#include "mbutil/finally.h"
 #include "mbutil/fts.h"
+#include "mbutil/hash.h"
+#include "mbutil/mount.h"
 #include "mbutil/selinux.h"
+#include "mbutil/string.h"
 
 #define APP_SHARING_DATA_DIR            "/data/multiboot/_appsharing/data"
+#define APP_SHARING_APK_DIR             "/data/multiboot/_appsharing/apks"
 
 #define USER_DATA_DIR                   "/data/data"
 
+// From <linux/mount.h>, which the NDK headers may not have
+#ifndef OPEN_TREE_CLONE
+#  define OPEN_TREE_CLONE               1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#  define OPEN_TREE_CLOEXEC             O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#  define MOVE_MOUNT_F_EMPTY_PATH       0x00000004
+#endif
+
 static std::string _as_data_dir;
+static std::string _as_apk_dir;
 static std::string _user_data_dir;
 
 namespace mb
 {
 
+static int sys_open_tree(int dfd, const char *path, unsigned int flags)
+{
+#ifdef __NR_open_tree
+    return static_cast<int>(syscall(__NR_open_tree, dfd, path, flags));
+#else
+    (void) dfd;
+    (void) path;
+    (void) flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int sys_move_mount(int from_dfd, const char *from_path, int to_dfd,
+                          const char *to_path, unsigned int flags)
+{
+#ifdef __NR_move_mount
+    return static_cast<int>(syscall(__NR_move_mount, from_dfd, from_path,
+                                    to_dfd, to_path, flags));
+#else
+    (void) from_dfd;
+    (void) from_path;
+    (void) to_dfd;
+    (void) to_path;
+    (void) flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 /*!
  * Recursively chmod directories to 755 and files to 0644 and chown everything
  * system:system.
  */
+/*!
+ * Find APKs that are not yet linked to anything else. Only files on the same
+ * filesystem as the APK store can be linked.
+ */
+class FindUnlinkedApks : public util::FTSWrapper {
+public:
+    FindUnlinkedApks(std::string path, dev_t dev)
+        : FTSWrapper(path, FTS_GroupSpecialFiles)
+        , _dev(dev)
+    {
+    }
+
+    virtual int on_reached_directory_pre() override
+    {
+        // Don't walk into other filesystems
+        return _curr->fts_statp->st_dev == _dev
+                ? Action::FTS_OK : Action::FTS_Skip;
+    }
+
+    virtual int on_reached_file() override
+    {
+        if (_curr->fts_statp->st_nlink == 1
+                && _curr->fts_statp->st_dev == _dev
+                && ends_with(_curr->fts_name, ".apk")) {
+            paths.push_back(_curr->fts_path);
+        }
+        return Action::FTS_OK;
+    }
+
+    std::vector<std::string> paths;
+
+private:
+    dev_t _dev;
+};
+
+/*!
+ * Whether \p path can be replaced by a link to \p store_path without changing
+ * anything that the package manager or SELinux would see.
+ */
+static bool same_apk_attributes(const std::string &path, const struct stat &sb,
+                                const std::string &store_path,
+                                const struct stat &store_sb)
+{
+    if (sb.st_size != store_sb.st_size
+            || sb.st_uid != store_sb.st_uid
+            || sb.st_gid != store_sb.st_gid
+            || sb.st_mode != store_sb.st_mode) {
+        return false;
+    }
+
+    std::string context;
+    std::string store_context;
+
+    if (!util::selinux_lget_context(path, &context)
+            || !util::selinux_lget_context(store_path, &store_context)) {
+        return false;
+    }
+
+    return context == store_context;
+}
+
+/*!
+ * Replace \p path with a hard link to \p store_path
+ *
+ * The link is created next to the target and renamed over it, so the APK is
+ * never missing, even if we're interrupted.
+ */
+static bool replace_with_link(const std::string &store_path,
+                              const std::string &path)
+{
+    std::string temp_path(path);
+    temp_path += ".mbtool-link";
+
+    if (unlink(temp_path.c_str()) < 0 && errno != ENOENT) {
+        return false;
+    }
+
+    if (link(store_path.c_str(), temp_path.c_str()) < 0) {
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        int saved_errno = errno;
+        unlink(temp_path.c_str());
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
 class FixPermissions : public util::FTSWrapper {
 public:
     FixPermissions(std::string path)
@@ -76,9 +221,11 @@ public:
 void AppSyncManager::detect_directories()
 {
     _as_data_dir = get_raw_path(APP_SHARING_DATA_DIR);
+    _as_apk_dir = get_raw_path(APP_SHARING_APK_DIR);
     _user_data_dir = USER_DATA_DIR;
 
     LOGD("App sharing app data directory: %s", _as_data_dir.c_str());
+    LOGD("App sharing APK store:          %s", _as_apk_dir.c_str());
     LOGD("User app data directory:        %s", _user_data_dir.c_str());
 }
 
@@ -191,4 +338,271 @@ bool AppSyncManager::unmount_shared_directory(const std::string &pkg)
     return true;
 }
 
+/*!
+ * \brief Bind mount the shared data directories of several packages
+ *
+ * This does the same thing as calling mount_shared_directory() for each
+ * package, but the mount table is only read once to find the directories that
+ * need to be unmounted first instead of attempting an unmount for every
+ * package. If the kernel supports the new mount API, the bind mounts are made
+ * with `open_tree()` and `move_mount()`. Otherwise, this falls back to
+ * `mount()` for the remaining packages.
+ *
+ * \param mounts Packages to mount. SharedDataMount::mounted is set to whether
+ *               the package's directory was mounted.
+ *
+ * \return Whether every directory was mounted
+ */
+bool AppSyncManager::mount_shared_directories(
+        std::vector<SharedDataMount> &mounts)
+{
+    std::string prefix(_user_data_dir);
+    prefix += "/";
+
+    // Find the existing mounts in a single pass over the mount table
+    std::unordered_set<std::string> mounted;
+    {
+        std::FILE *fp = std::fopen(PROC_MOUNTS, "re");
+        if (!fp) {
+            LOGW("%s: Failed to open file: %s", PROC_MOUNTS, strerror(errno));
+            return false;
+        }
+
+        auto close_fp = util::finally([&]{
+            std::fclose(fp);
+        });
+
+        util::MountEntry entry;
+        while (util::get_mount_entry(fp, entry)) {
+            if (entry.dir.compare(0, prefix.size(), prefix) == 0) {
+                mounted.insert(std::move(entry.dir));
+            }
+        }
+    }
+
+    bool use_mount_api = true;
+    bool ret = true;
+
+    for (SharedDataMount &m : mounts) {
+        m.mounted = false;
+
+        std::string data_path = get_shared_data_path(m.pkg);
+        std::string target(prefix);
+        target += m.pkg;
+
+        if (!util::mkdir_recursive(target, 0755)) {
+            LOGW("[%s] %s: Failed to create directory: %s",
+                 m.pkg.c_str(), target.c_str(), strerror(errno));
+            ret = false;
+            continue;
+        }
+        if (!util::chown(target, m.uid, m.uid, util::CHOWN_RECURSIVE)) {
+            LOGW("[%s] %s: Failed to chown: %s",
+                 m.pkg.c_str(), target.c_str(), strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        if (mounted.find(target) != mounted.end()
+                && umount2(target.c_str(), MNT_DETACH) < 0
+                && errno != EINVAL) {
+            LOGW("[%s] %s: Failed to unmount: %s",
+                 m.pkg.c_str(), target.c_str(), strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        LOGV("[%s] Bind mounting data directory:", m.pkg.c_str());
+        LOGV("[%s] - Source: %s", m.pkg.c_str(), data_path.c_str());
+        LOGV("[%s] - Target: %s", m.pkg.c_str(), target.c_str());
+
+        if (use_mount_api) {
+            int fd = sys_open_tree(AT_FDCWD, data_path.c_str(),
+                                   OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+            if (fd >= 0) {
+                int result = sys_move_mount(fd, "", AT_FDCWD, target.c_str(),
+                                            MOVE_MOUNT_F_EMPTY_PATH);
+                int saved_errno = errno;
+                close(fd);
+
+                if (result == 0) {
+                    m.mounted = true;
+                    continue;
+                }
+
+                errno = saved_errno;
+            }
+
+            if (errno != ENOSYS) {
+                LOGW("[%s] Failed to bind mount: %s",
+                     m.pkg.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            LOGD("New mount API is not supported; falling back to mount()");
+            use_mount_api = false;
+        }
+
+        if (mount(data_path.c_str(), target.c_str(), "", MS_BIND, "") < 0) {
+            LOGW("[%s] Failed to bind mount: %s",
+                 m.pkg.c_str(), strerror(errno));
+            ret = false;
+            continue;
+        }
+
+        m.mounted = true;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Hard link identical APKs across ROMs
+ *
+ * Each unlinked `*.apk` file under \p app_dirs is hashed and added to a
+ * content-addressed store under the app sharing directory. If the store
+ * already has an APK with the same contents, the file is replaced by a hard
+ * link to it. Files whose owner, mode, or SELinux label differ from the copy
+ * in the store are left alone. Once all directories are processed, APKs in
+ * the store that are no longer referenced by any ROM are removed.
+ *
+ * \param app_dirs App directories (eg. `/data/app`) of each ROM
+ * \param stats Statistics about the pass
+ *
+ * \return Whether every APK was processed
+ */
+bool AppSyncManager::deduplicate_apks(const std::vector<std::string> &app_dirs,
+                                      ApkDedupStats &stats)
+{
+    if (!util::mkdir_recursive(_as_apk_dir, 0700) && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s", _as_apk_dir.c_str(),
+             strerror(errno));
+        return false;
+    }
+
+    struct stat store_dir_sb;
+    if (stat(_as_apk_dir.c_str(), &store_dir_sb) < 0) {
+        LOGW("%s: Failed to stat: %s", _as_apk_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = true;
+
+    for (const std::string &app_dir : app_dirs) {
+        struct stat dir_sb;
+        if (stat(app_dir.c_str(), &dir_sb) < 0) {
+            if (errno != ENOENT) {
+                LOGW("%s: Failed to stat: %s", app_dir.c_str(),
+                     strerror(errno));
+                ret = false;
+            }
+            continue;
+        } else if (dir_sb.st_dev != store_dir_sb.st_dev) {
+            LOGD("%s: Not on the same filesystem as the APK store",
+                 app_dir.c_str());
+            continue;
+        }
+
+        FindUnlinkedApks finder(app_dir, store_dir_sb.st_dev);
+        if (!finder.run()) {
+            LOGW("%s: Failed to search for APKs", app_dir.c_str());
+            ret = false;
+            continue;
+        }
+
+        for (const std::string &path : finder.paths) {
+            unsigned char digest[SHA512_DIGEST_LENGTH];
+            if (!util::sha512_tree_hash(path, digest)) {
+                LOGW("%s: Failed to hash file: %s",
+                     path.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            std::string store_path(_as_apk_dir);
+            store_path += "/";
+            store_path += util::hex_string(digest, sizeof(digest));
+            store_path += ".apk";
+
+            // First copy becomes the store's copy
+            if (link(path.c_str(), store_path.c_str()) == 0) {
+                continue;
+            } else if (errno != EEXIST) {
+                LOGW("%s: Failed to link to %s: %s", path.c_str(),
+                     store_path.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            struct stat sb;
+            struct stat store_sb;
+
+            if (lstat(path.c_str(), &sb) < 0
+                    || lstat(store_path.c_str(), &store_sb) < 0) {
+                LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            if (sb.st_ino == store_sb.st_ino) {
+                continue;
+            }
+
+            if (!same_apk_attributes(path, sb, store_path, store_sb)) {
+                LOGV("%s: Attributes differ from %s; not linking",
+                     path.c_str(), store_path.c_str());
+                ++stats.skipped;
+                continue;
+            }
+
+            if (!replace_with_link(store_path, path)) {
+                LOGW("%s: Failed to replace with link to %s: %s",
+                     path.c_str(), store_path.c_str(), strerror(errno));
+                ret = false;
+                continue;
+            }
+
+            ++stats.linked;
+            stats.bytes_saved += static_cast<uint64_t>(sb.st_size);
+        }
+    }
+
+    // Remove APKs that only the store references
+    DIR *dp = opendir(_as_apk_dir.c_str());
+    if (!dp) {
+        LOGW("%s: Failed to open directory: %s", _as_apk_dir.c_str(),
+             strerror(errno));
+        return false;
+    }
+
+    auto close_dp = util::finally([&]{
+        closedir(dp);
+    });
+
+    struct dirent *ent;
+    while ((ent = readdir(dp))) {
+        if (!ends_with(ent->d_name, ".apk")) {
+            continue;
+        }
+
+        struct stat sb;
+        if (fstatat(dirfd(dp), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+
+        if (S_ISREG(sb.st_mode) && sb.st_nlink == 1) {
+            if (unlinkat(dirfd(dp), ent->d_name, 0) < 0) {
+                LOGW("%s/%s: Failed to remove: %s", _as_apk_dir.c_str(),
+                     ent->d_name, strerror(errno));
+                ret = false;
+                continue;
+            }
+            ++stats.collected;
+        }
+    }
+
+    return ret;
+}
+
 }
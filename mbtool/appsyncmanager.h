@@ -20,6 +20,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 #include "packages.h"
 #include "roms.h"
@@ -35,6 +38,26 @@ struct RomConfigAndPackages
     Packages packages;
 };
 
+struct SharedDataMount
+{
+    std::string pkg;
+    uid_t uid;
+    // Set by AppSyncManager::mount_shared_directories()
+    bool mounted;
+};
+
+struct ApkDedupStats
+{
+    // Number of APKs that were replaced by a link to the APK store
+    uint64_t linked = 0;
+    // Number of bytes freed by linking
+    uint64_t bytes_saved = 0;
+    // Number of APKs whose copy in the store has different attributes
+    uint64_t skipped = 0;
+    // Number of unreferenced APKs removed from the store
+    uint64_t collected = 0;
+};
+
 class AppSyncManager
 {
 public:
@@ -48,6 +71,11 @@ public:
 
     static bool mount_shared_directory(const std::string &pkg, uid_t uid);
     static bool unmount_shared_directory(const std::string &pkg);
+
+    static bool mount_shared_directories(std::vector<SharedDataMount> &mounts);
+
+    static bool deduplicate_apks(const std::vector<std::string> &app_dirs,
+                                 ApkDedupStats &stats);
 };
 
 }
@@ -19,23 +19,253 @@
 
 #include "auditd.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <cerrno>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 #include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/finally.h"
 
 #include "external/audit/libaudit.h"
 
+// Maximum number of messages waiting to be logged
+#define AUDIT_QUEUE_SIZE            512
+// Identical AVC denials within this window are logged once, followed by a count
+#define AUDIT_DEDUP_WINDOW_MS       5000
+// Maximum number of distinct denials tracked at once
+#define AUDIT_DEDUP_MAX_ENTRIES     256
+// Receive buffer size for the audit socket
+#define AUDIT_RCVBUF_SIZE           (1024 * 1024)
+
 
 namespace mb
 {
 
+struct AuditRecord
+{
+    int type;
+    std::string text;
+};
+
+/*!
+ * \brief Fixed-size ring buffer between the receiving and logging threads
+ *
+ * If the logging thread falls behind, new records are dropped and counted
+ * instead of blocking the receiver. Blocking would let the kernel's audit
+ * backlog overflow, which loses messages anyway and makes the kernel log
+ * complaints about it.
+ */
+class AuditLogQueue
+{
+public:
+    AuditLogQueue()
+        : _records(AUDIT_QUEUE_SIZE), _head(0), _count(0), _dropped(0),
+        _stopped(false)
+    {
+    }
+
+    void push(int type, const char *text, size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if (_count == _records.size()) {
+                ++_dropped;
+                return;
+            }
+
+            AuditRecord &record = _records[(_head + _count) % _records.size()];
+            record.type = type;
+            record.text.assign(text, size);
+            ++_count;
+        }
+
+        _cv.notify_one();
+    }
+
+    /*!
+     * \brief Wait for records and move all of them to \p out
+     *
+     * The strings in \p out are swapped into the ring so that their buffers
+     * get reused.
+     *
+     * \return False if the queue was stopped and is empty
+     */
+    bool pop_all(std::vector<AuditRecord> &out, unsigned int &dropped)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _cv.wait(lock, [&] {
+            return _count > 0 || _dropped > 0 || _stopped;
+        });
+
+        if (_count == 0 && _dropped == 0) {
+            return false;
+        }
+
+        out.resize(_count);
+        for (size_t i = 0; i < out.size(); ++i) {
+            AuditRecord &record = _records[_head];
+            out[i].type = record.type;
+            out[i].text.swap(record.text);
+            _head = (_head + 1) % _records.size();
+        }
+        _count = 0;
+
+        dropped = _dropped;
+        _dropped = 0;
+
+        return true;
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+
+        _cv.notify_one();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<AuditRecord> _records;
+    size_t _head;
+    size_t _count;
+    unsigned int _dropped;
+    bool _stopped;
+};
+
+static void audit_writer(AuditLogQueue *queue)
+{
+    std::vector<AuditRecord> records;
+    unsigned int dropped = 0;
+
+    while (queue->pop_all(records, dropped)) {
+        if (dropped > 0) {
+            LOGW("Dropped %u audit messages while logging was behind",
+                 dropped);
+        }
+
+        for (const AuditRecord &record : records) {
+            LOGV("type=%d %s", record.type, record.text.c_str());
+        }
+    }
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*!
+ * \brief Rate limiter for repeated AVC denials
+ *
+ * After a ROM switch, the same denial is often hit thousands of times in a
+ * row. The first occurrence is logged as is. Later identical ones within
+ * AUDIT_DEDUP_WINDOW_MS are only counted, and the count is logged when the
+ * window ends.
+ */
+class DenialFilter
+{
+public:
+    /*!
+     * \brief Check whether a message should be logged
+     */
+    bool check(int type, const char *text, size_t size, uint64_t now)
+    {
+        if (type != AUDIT_AVC && type != AUDIT_USER_AVC) {
+            return true;
+        }
+
+        // Skip the "audit(<timestamp>:<serial>): " prefix, which is unique
+        // for every message
+        const char *end = text + size;
+        const char *key = static_cast<const char *>(memchr(text, ')', size));
+        if (key && end - key >= 2 && key[1] == ':') {
+            key += 2;
+            while (key < end && *key == ' ') {
+                ++key;
+            }
+        } else {
+            key = text;
+        }
+
+        _key.assign(key, end);
+
+        auto it = _denials.find(_key);
+        if (it != _denials.end()) {
+            ++it->second.suppressed;
+            return false;
+        } else if (_denials.size() < AUDIT_DEDUP_MAX_ENTRIES) {
+            _denials.emplace(_key, DenialInfo{ type, now, 0 });
+        }
+
+        return true;
+    }
+
+    /*!
+     * \brief Log the counts for denials whose window has ended
+     *
+     * \return Milliseconds until the next window ends or -1 if there are no
+     *         tracked denials
+     */
+    int expire(uint64_t now, AuditLogQueue &queue)
+    {
+        uint64_t next = UINT64_MAX;
+
+        for (auto it = _denials.begin(); it != _denials.end();) {
+            uint64_t deadline = it->second.first_ms + AUDIT_DEDUP_WINDOW_MS;
+
+            if (now >= deadline) {
+                if (it->second.suppressed > 0) {
+                    format(_key, "(repeated %u times) %s",
+                           it->second.suppressed, it->first.c_str());
+                    queue.push(it->second.type, _key.data(), _key.size());
+                }
+                it = _denials.erase(it);
+            } else {
+                next = std::min(next, deadline);
+                ++it;
+            }
+        }
+
+        return next == UINT64_MAX ? -1 : static_cast<int>(next - now);
+    }
+
+private:
+    struct DenialInfo
+    {
+        int type;
+        uint64_t first_ms;
+        unsigned int suppressed;
+    };
+
+    std::unordered_map<std::string, DenialInfo> _denials;
+    // Reused to avoid allocating for every message
+    std::string _key;
+};
+
 static bool audit_mainloop()
 {
     int fd = audit_open();
@@ -48,23 +278,71 @@ static bool audit_mainloop()
         audit_close(fd);
     });
 
+    // Give bursts more room in the kernel before they're dropped
+    int rcvbuf = AUDIT_RCVBUF_SIZE;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &rcvbuf, sizeof(rcvbuf)) < 0) {
+        LOGW("Failed to set audit socket receive buffer size: %s",
+             strerror(errno));
+    }
+
     if (audit_setup(fd, getpid()) < 0) {
         return false;
     }
 
+    AuditLogQueue queue;
+    std::thread writer(&audit_writer, &queue);
+
+    auto stop_writer = util::finally([&]{
+        queue.stop();
+        writer.join();
+    });
+
+    std::vector<struct audit_message> replies(MAX_AUDIT_BATCH);
+    int valid[MAX_AUDIT_BATCH];
+    DenialFilter filter;
+    int timeout = -1;
+
     while (true) {
-        struct audit_message reply;
-        reply.nlh.nlmsg_type = 0;
-        reply.nlh.nlmsg_len = 0;
-        reply.data[0] = '\0';
+        // Wake up when a deduplication window ends, even if nothing arrives
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
 
-        if (audit_get_reply(fd, &reply, GET_REPLY_BLOCKING, 0) < 0) {
-            LOGE("Failed to get reply from audit socket: %s", strerror(errno));
+        int ret = poll(&pfd, 1, timeout);
+        if (ret < 0 && errno != EINTR) {
+            LOGE("Failed to poll audit socket: %s", strerror(errno));
             return false;
         }
 
-        LOGV("type=%d %.*s",
-             reply.nlh.nlmsg_type, reply.nlh.nlmsg_len, reply.data);
+        int n = 0;
+        if (ret > 0) {
+            n = audit_get_replies(fd, replies.data(), replies.size(),
+                                  GET_REPLY_NONBLOCKING, valid);
+            if (n < 0) {
+                LOGE("Failed to get reply from audit socket: %s",
+                     strerror(-n));
+                return false;
+            }
+        }
+
+        uint64_t now = monotonic_ms();
+
+        for (int i = 0; i < n; ++i) {
+            if (!valid[i]) {
+                continue;
+            }
+
+            const struct audit_message &reply = replies[i];
+            size_t size = strnlen(reply.data, std::min<size_t>(
+                    reply.nlh.nlmsg_len, sizeof(reply.data)));
+
+            if (filter.check(reply.nlh.nlmsg_type, reply.data, size, now)) {
+                queue.push(reply.nlh.nlmsg_type, reply.data, size);
+            }
+        }
+
+        timeout = filter.expire(now, queue);
     }
 
     return false;
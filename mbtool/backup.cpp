@@ -20,12 +20,17 @@
 #include "backup.h"
 
 #include <algorithm>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <ctime>
+
 #include <dirent.h>
 #include <getopt.h>
 #include <sys/mount.h>
@@ -49,6 +54,7 @@
 #include "mbutil/string.h"
 #include "mbutil/time.h"
 
+#include "incremental_backup.h"
 #include "installer_util.h"
 #include "image.h"
 #include "multiboot.h"
@@ -57,6 +63,10 @@
 
 #define BACKUP_MNT_DIR          "/mb_mnt"
 
+// Maximum number of partitions that are archived at the same time. The CPUs
+// are divided evenly between the partitions that run concurrently.
+#define BACKUP_MAX_CONCURRENT_TARGETS   2
+
 namespace mb
 {
 
@@ -77,6 +87,11 @@ namespace mb
 #define BACKUP_NAME_BOOT_IMAGE          "boot.img"
 #define BACKUP_NAME_CONFIG              "config.json"
 #define BACKUP_NAME_THUMBNAIL           "thumbnail.webp"
+// Appended to the partition prefix for incremental backups
+#define BACKUP_NAME_SUFFIX_INCREMENTAL  ".inc"
+#define BACKUP_NAME_SUFFIX_MANIFEST     ".manifest"
+// Chunk store for incremental backups (in the backup directory)
+#define BACKUP_CHUNK_STORE_NAME         ".chunks"
 
 enum class Result
 {
@@ -95,26 +110,29 @@ struct compression_map {
     { util::compression_type::LZ4,  "lz4",   ".tar.lz4" },
     { util::compression_type::GZIP, "gzip",  ".tar.gz" },
     { util::compression_type::XZ,   "xz",    ".tar.xz" },
+    { util::compression_type::ZSTD, "zstd",  ".tar.zst" },
     { util::compression_type::NONE, nullptr, nullptr }
 };
 
 static int parse_targets_string(const std::string &targets)
 {
-    std::vector<std::string> targets_list = util::split(targets, ",");
+    StringSplitter splitter(targets.data(), targets.size(), ",", 1);
+    const char *target;
+    size_t len;
     int result = 0;
 
-    for (const std::string &target : targets_list) {
-        if (target == "all") {
+    while (splitter.next(target, len)) {
+        if (equals_n(target, len, "all", 3)) {
             result |= BACKUP_TARGET_ALL;
-        } else if (target == "system") {
+        } else if (equals_n(target, len, "system", 6)) {
             result |= BACKUP_TARGET_SYSTEM;
-        } else if (target == "cache") {
+        } else if (equals_n(target, len, "cache", 5)) {
             result |= BACKUP_TARGET_CACHE;
-        } else if (target == "data") {
+        } else if (equals_n(target, len, "data", 4)) {
             result |= BACKUP_TARGET_DATA;
-        } else if (target == "boot") {
+        } else if (equals_n(target, len, "boot", 4)) {
             result |= BACKUP_TARGET_BOOT;
-        } else if (target == "config") {
+        } else if (equals_n(target, len, "config", 6)) {
             result |= BACKUP_TARGET_CONFIG;
         } else {
             return 0;
@@ -166,10 +184,23 @@ static std::string find_compressed_backup(const std::string &backup_dir,
     return std::string();
 }
 
+struct IncrementalOptions
+{
+    // Chunk store directory
+    std::string chunk_dir;
+    // Manifest to write
+    std::string manifest;
+    // Manifest of a previous backup of the same partition (may be empty)
+    std::string base_manifest;
+};
+
 static bool backup_directory(const std::string &output_file,
                              const std::string &directory,
                              const std::vector<std::string> &exclusions,
-                             util::compression_type compression)
+                             util::compression_type compression,
+                             unsigned int threads = 0,
+                             uint64_t *bytes_out = nullptr,
+                             const IncrementalOptions *incremental = nullptr)
 {
     autoclose::dir dp(autoclose::opendir(directory.c_str()));
     if (!dp) {
@@ -198,50 +229,89 @@ static bool backup_directory(const std::string &output_file,
         return false;
     }
 
+    if (incremental) {
+        return incremental_tar_create(output_file, directory, contents,
+                                      compression, threads,
+                                      incremental->chunk_dir,
+                                      incremental->manifest,
+                                      incremental->base_manifest, bytes_out);
+    }
+
     return util::libarchive_tar_create(output_file, directory, contents,
-                                       compression);
+                                       compression, threads, bytes_out);
 }
 
+/*!
+ * \brief Restore a directory
+ *
+ * \param chunk_dir Chunk store directory if \a input_file is an incremental
+ *                  backup. Otherwise, an empty string.
+ * \param paths If not empty, only restore these paths (relative to
+ *              \a directory) without wiping the rest of the directory. This
+ *              requires a seekable backup.
+ */
 static bool restore_directory(const std::string &input_file,
                               const std::string &directory,
                               const std::vector<std::string> &exclusions,
-                              util::compression_type compression)
+                              util::compression_type compression,
+                              const std::string &chunk_dir,
+                              const std::vector<std::string> &paths)
 {
+    if (!paths.empty()) {
+        if (!chunk_dir.empty()
+                || !util::libarchive_tar_is_seekable(input_file)) {
+            LOGE("%s: Backup does not support restoring individual paths",
+                 input_file.c_str());
+            return false;
+        }
+
+        return util::libarchive_tar_extract_seekable(
+                input_file, directory, paths);
+    }
+
     if (!wipe_directory(directory, exclusions)) {
         return false;
     }
 
+    if (!chunk_dir.empty()) {
+        return incremental_tar_extract(input_file, directory, compression,
+                                       chunk_dir);
+    }
+
     return util::libarchive_tar_extract(input_file, directory, {}, compression);
 }
 
 static bool backup_image(const std::string &output_file,
                          const std::string &image,
+                         const std::string &mount_dir,
                          const std::vector<std::string> &exclusions,
-                         util::compression_type compression)
+                         util::compression_type compression,
+                         unsigned int threads, uint64_t *bytes_out,
+                         const IncrementalOptions *incremental)
 {
-    if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
+    if (!util::mkdir_recursive(mount_dir, 0755) && errno != EEXIST) {
         LOGE("%s: Failed to create directory: %s",
-             BACKUP_MNT_DIR, strerror(errno));
+             mount_dir.c_str(), strerror(errno));
         return false;
     }
 
     fsck_ext4_image(image);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", MS_RDONLY, "")) {
-        LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
+    if (!util::mount(image.c_str(), mount_dir.c_str(), "ext4", MS_RDONLY, "")) {
+        LOGE("Failed to mount %s at %s: %s", image.c_str(), mount_dir.c_str(),
              strerror(errno));
         return false;
     }
 
-    bool ret = backup_directory(output_file, BACKUP_MNT_DIR, exclusions,
-                                compression);
+    bool ret = backup_directory(output_file, mount_dir, exclusions,
+                                compression, threads, bytes_out, incremental);
 
-    if (!util::umount(BACKUP_MNT_DIR)) {
-        LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
+    if (!util::umount(mount_dir.c_str())) {
+        LOGE("Failed to unmount %s: %s", mount_dir.c_str(), strerror(errno));
         return false;
     }
 
-    rmdir(BACKUP_MNT_DIR);
+    rmdir(mount_dir.c_str());
 
     return ret;
 }
@@ -250,7 +320,9 @@ static bool restore_image(const std::string &input_file,
                           const std::string &image,
                           uint64_t size,
                           const std::vector<std::string> &exclusions,
-                          util::compression_type compression)
+                          util::compression_type compression,
+                          const std::string &chunk_dir,
+                          const std::vector<std::string> &paths)
 {
     if (!util::mkdir_parent(image, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
@@ -286,7 +358,7 @@ static bool restore_image(const std::string &input_file,
     }
 
     bool ret = restore_directory(input_file, BACKUP_MNT_DIR, exclusions,
-                                 compression);
+                                 compression, chunk_dir, paths);
 
     if (!util::umount(BACKUP_MNT_DIR)) {
         LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
@@ -474,7 +546,12 @@ static Result restore_configs(const std::shared_ptr<Rom> &rom,
  * \param backup_dir Backup directory
  * \param archive_name Backup archive name
  * \param is_image Whether \a path is an ext4 image
+ * \param mount_dir Temporary mountpoint for \a path if it is an image
  * \param exclusions List of top-level directories to exclude from the backup
+ * \param threads Maximum number of compression threads (0 for all CPUs)
+ * \param bytes_out If not nullptr, set to the uncompressed size of the backup
+ * \param incremental Options for creating an incremental backup or nullptr for
+ *                    a full backup
  *
  * \return Result::SUCCEEDED if the directory/image was successfully backed up
  *         Result::FAILED if an error occured
@@ -484,8 +561,11 @@ static Result backup_partition(const std::string &path,
                                const std::string &backup_dir,
                                const std::string &archive_name,
                                bool is_image,
+                               const std::string &mount_dir,
                                const std::vector<std::string> &exclusions,
-                               util::compression_type compression)
+                               util::compression_type compression,
+                               unsigned int threads, uint64_t *bytes_out,
+                               const IncrementalOptions *incremental)
 {
     std::string archive(backup_dir);
     archive += '/';
@@ -497,9 +577,11 @@ static Result backup_partition(const std::string &path,
     if (stat(path.c_str(), &sb) == 0) {
         LOGI("=== Backing up %s ===", path.c_str());
         if (is_image) {
-            ret = backup_image(archive, path, exclusions, compression);
+            ret = backup_image(archive, path, mount_dir, exclusions,
+                               compression, threads, bytes_out, incremental);
         } else {
-            ret = backup_directory(archive, path, exclusions, compression);
+            ret = backup_directory(archive, path, exclusions, compression,
+                                   threads, bytes_out, incremental);
         }
     } else {
         LOGW("=== %s does not exist ===", path.c_str());
@@ -518,6 +600,8 @@ static Result backup_partition(const std::string &path,
  * \param is_image Whether \a path is an ext4 image
  * \param exclusions List of top-level directories to exclude from the wipe
  *                   process before restoring
+ * \param chunk_dir Chunk store directory if \a archive_name is an incremental
+ *                  backup. Otherwise, an empty string.
  *
  * \return Result::SUCCEEDED if the directory/image was successfully restored
  *         Result::FAILED if an error occured
@@ -530,7 +614,9 @@ static Result restore_partition(const std::string &path,
                                 bool is_image,
                                 uint64_t image_size,
                                 const std::vector<std::string> &exclusions,
-                                util::compression_type compression)
+                                util::compression_type compression,
+                                const std::string &chunk_dir,
+                                const std::vector<std::string> &paths)
 {
     std::string archive(backup_dir);
     archive += '/';
@@ -543,9 +629,10 @@ static Result restore_partition(const std::string &path,
         LOGI("=== Restoring to %s ===", path.c_str());
         if (is_image) {
             ret = restore_image(archive, path, image_size, exclusions,
-                                compression);
+                                compression, chunk_dir, paths);
         } else {
-            ret = restore_directory(archive, path, exclusions, compression);
+            ret = restore_directory(archive, path, exclusions, compression,
+                                    chunk_dir, paths);
         }
     } else {
         LOGW("=== %s does not exist ===", archive.c_str());
@@ -555,9 +642,165 @@ static Result restore_partition(const std::string &path,
     return ret ? Result::SUCCEEDED : Result::FAILED;
 }
 
+struct PartitionBackup
+{
+    std::string path;
+    std::string archive_name;
+    bool is_image;
+    std::string mount_dir;
+    std::vector<std::string> exclusions;
+    bool incremental = false;
+    IncrementalOptions incremental_options;
+
+    Result result = Result::FAILED;
+    // Uncompressed size of the archive
+    uint64_t bytes = 0;
+    // Time spent archiving the partition
+    int64_t time_ms = 0;
+};
+
+static void log_partition_throughput(const PartitionBackup &pb)
+{
+    double mib = pb.bytes / 1024.0 / 1024.0;
+    double secs = pb.time_ms / 1000.0;
+
+    LOGI("%s: Backed up %.1f MiB in %.1f seconds (%.1f MiB/s)",
+         pb.path.c_str(), mib, secs, secs > 0 ? mib / secs : 0.0);
+}
+
+/*!
+ * \brief Back up partitions concurrently
+ *
+ * At most BACKUP_MAX_CONCURRENT_TARGETS partitions are archived at the same
+ * time and they share the CPUs for compression. Partitions are started in the
+ * order they are listed. If a partition fails, the partitions that are already
+ * running are allowed to finish, but no new ones are started.
+ *
+ * \return Whether none of the partitions failed
+ */
+static bool backup_partitions(std::vector<PartitionBackup> &partitions,
+                              const std::string &backup_dir,
+                              util::compression_type compression)
+{
+    if (partitions.empty()) {
+        return true;
+    }
+
+    size_t max_jobs = std::min<size_t>(
+            BACKUP_MAX_CONCURRENT_TARGETS, partitions.size());
+    unsigned int threads = std::max(
+            1u, std::thread::hardware_concurrency() / (unsigned int) max_jobs);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    size_t running = 0;
+    bool failed = false;
+    std::vector<std::thread> workers;
+
+    for (auto &pb : partitions) {
+        {
+            std::unique_lock<std::mutex> l(lock);
+            cv.wait(l, [&]{ return running < max_jobs; });
+            if (failed) {
+                break;
+            }
+            ++running;
+        }
+
+        PartitionBackup *p = &pb;
+
+        workers.emplace_back([&, p, threads]{
+            struct timespec start;
+            struct timespec stop;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            p->result = backup_partition(
+                    p->path, backup_dir, p->archive_name, p->is_image,
+                    p->mount_dir, p->exclusions, compression, threads,
+                    &p->bytes,
+                    p->incremental ? &p->incremental_options : nullptr);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+            p->time_ms = util::timespec_diff_ms(start, stop);
+
+            if (p->result == Result::SUCCEEDED) {
+                log_partition_throughput(*p);
+            }
+
+            std::lock_guard<std::mutex> l(lock);
+            if (p->result == Result::FAILED) {
+                failed = true;
+            }
+            --running;
+            cv.notify_all();
+        });
+    }
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    return !failed;
+}
+
+/*!
+ * \brief Find the newest manifest of a partition in other backups
+ *
+ * \param backup_dir Directory containing all backups
+ * \param exclude_name Backup to ignore (the one being created)
+ * \param prefix Partition prefix (eg. BACKUP_NAME_PREFIX_SYSTEM)
+ *
+ * \return Path to manifest or empty string if none was found
+ */
+static std::string find_base_manifest(const std::string &backup_dir,
+                                      const std::string &exclude_name,
+                                      const char *prefix)
+{
+    autoclose::dir dp(autoclose::opendir(backup_dir.c_str()));
+    if (!dp) {
+        return std::string();
+    }
+
+    std::string result;
+    struct timespec newest = {};
+    dirent *ent;
+
+    while ((ent = readdir(dp.get()))) {
+        if (ent->d_name[0] == '.' || ent->d_name == exclude_name) {
+            continue;
+        }
+
+        std::string path(backup_dir);
+        path += '/';
+        path += ent->d_name;
+        path += '/';
+        path += prefix;
+        path += BACKUP_NAME_SUFFIX_MANIFEST;
+
+        struct stat sb;
+        if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)
+                && (result.empty()
+                        || sb.st_mtim.tv_sec > newest.tv_sec
+                        || (sb.st_mtim.tv_sec == newest.tv_sec
+                                && sb.st_mtim.tv_nsec > newest.tv_nsec))) {
+            result = std::move(path);
+            newest = sb.st_mtim;
+        }
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Backup a ROM
+ *
+ * \param incremental Whether to create an incremental backup
+ * \param base_name Backup to use as the base for an incremental backup. If
+ *                  empty, the newest backup of each partition is used.
+ */
 static bool backup_rom(const std::shared_ptr<Rom> &rom,
                        const std::string &output_dir, int targets,
-                       util::compression_type compression)
+                       util::compression_type compression,
+                       bool incremental, const std::string &base_name)
 {
     if (!targets) {
         LOGE("No backup targets specified");
@@ -591,13 +834,10 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         LOGI("             %s", thumbnail_path.c_str());
     }
     LOGI("- Backup directory: %s", output_dir.c_str());
+    LOGI("- Incremental: %s", incremental ? "yes" : "no");
 
-    std::string output_system = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_SYSTEM, compression);
-    std::string output_cache = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_CACHE, compression);
-    std::string output_data = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_DATA, compression);
+    const std::string backup_dir(util::dir_name(output_dir));
+    const std::string backup_name(util::base_name(output_dir));
 
     // Backup boot image
     if (targets & BACKUP_TARGET_BOOT
@@ -611,41 +851,103 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         return false;
     }
 
-    // Backup system
-    if (targets & BACKUP_TARGET_SYSTEM) {
-        Result ret = backup_partition(
-                system_path, output_dir, output_system,
-                rom->system_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
+    // Backup partitions
+    std::vector<PartitionBackup> partitions;
+
+    auto add_partition = [&](const char *prefix, const std::string &path,
+                             bool is_image,
+                             std::vector<std::string> exclusions) {
+        partitions.emplace_back();
+        PartitionBackup &pb = partitions.back();
+        pb.path = path;
+        pb.is_image = is_image;
+        pb.mount_dir = format(BACKUP_MNT_DIR "/%s", prefix);
+        pb.exclusions = std::move(exclusions);
+        pb.incremental = incremental;
+
+        if (incremental) {
+            IncrementalOptions &opts = pb.incremental_options;
+            opts.chunk_dir = backup_dir + "/" BACKUP_CHUNK_STORE_NAME;
+            opts.manifest = format("%s/%s" BACKUP_NAME_SUFFIX_MANIFEST,
+                                   output_dir.c_str(), prefix);
+
+            if (base_name.empty()) {
+                opts.base_manifest = find_base_manifest(
+                        backup_dir, backup_name, prefix);
+            } else {
+                opts.base_manifest = format(
+                        "%s/%s/%s" BACKUP_NAME_SUFFIX_MANIFEST,
+                        backup_dir.c_str(), base_name.c_str(), prefix);
+            }
+
+            if (opts.base_manifest.empty()) {
+                LOGI("%s: No previous manifest; all files will be read", prefix);
+            } else {
+                LOGI("%s: Using manifest: %s", prefix,
+                     opts.base_manifest.c_str());
+            }
+
+            pb.archive_name = get_compressed_backup_name(
+                    std::string(prefix) + BACKUP_NAME_SUFFIX_INCREMENTAL,
+                    compression);
+        } else {
+            pb.archive_name = get_compressed_backup_name(prefix, compression);
         }
-    }
+    };
 
-    // Backup cache
+    // Data is usually the largest, so it is started first
+    if (targets & BACKUP_TARGET_DATA) {
+        add_partition(BACKUP_NAME_PREFIX_DATA, data_path, rom->data_is_image,
+                      { "media", "multiboot" });
+    }
+    if (targets & BACKUP_TARGET_SYSTEM) {
+        add_partition(BACKUP_NAME_PREFIX_SYSTEM, system_path,
+                      rom->system_is_image, { "multiboot" });
+    }
     if (targets & BACKUP_TARGET_CACHE) {
-        Result ret = backup_partition(
-                cache_path, output_dir, output_cache,
-                rom->cache_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        add_partition(BACKUP_NAME_PREFIX_CACHE, cache_path, rom->cache_is_image,
+                      { "multiboot" });
     }
 
-    // Backup data
-    if (targets & BACKUP_TARGET_DATA) {
-        Result ret = backup_partition(
-                data_path, output_dir, output_data,
-                rom->data_is_image, { "media", "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+    bool ret = backup_partitions(partitions, output_dir, compression);
+
+    // Remove the parent of the per-partition mountpoints
+    rmdir(BACKUP_MNT_DIR);
+
+    return ret;
+}
+
+/*!
+ * \brief Find the backup of a partition
+ *
+ * Incremental backups take precedence over full backups.
+ *
+ * \param chunk_dir_out Set to the chunk store directory if the backup is
+ *                      incremental. Otherwise, set to an empty string.
+ *
+ * \return Backup archive name or empty string if it was not found
+ */
+static std::string find_partition_backup(const std::string &input_dir,
+                                         const char *prefix,
+                                         util::compression_type *compression,
+                                         std::string *chunk_dir_out)
+{
+    std::string path = find_compressed_backup(
+            input_dir, std::string(prefix) + BACKUP_NAME_SUFFIX_INCREMENTAL,
+            compression);
+    if (!path.empty()) {
+        *chunk_dir_out = util::dir_name(input_dir);
+        *chunk_dir_out += "/" BACKUP_CHUNK_STORE_NAME;
+        return path;
     }
 
-    return true;
+    chunk_dir_out->clear();
+    return find_compressed_backup(input_dir, prefix, compression);
 }
 
 static bool restore_rom(const std::shared_ptr<Rom> &rom,
-                        const std::string &input_dir, int targets)
+                        const std::string &input_dir, int targets,
+                        const std::vector<std::string> &paths)
 {
     if (!targets) {
         LOGE("No restore targets specified");
@@ -679,6 +981,12 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
         LOGI("             %s", thumbnail_path.c_str());
     }
     LOGI("- Backup directory: %s", input_dir.c_str());
+    if (!paths.empty()) {
+        LOGI("- Paths:");
+        for (const std::string &path : paths) {
+            LOGI("  - %s", path.c_str());
+        }
+    }
 
     std::string multiboot_dir(MULTIBOOT_DIR);
     multiboot_dir += '/';
@@ -713,8 +1021,9 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
         }
 
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &compression);
+        std::string chunk_dir;
+        std::string path = find_partition_backup(
+                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &compression, &chunk_dir);
         if (path.empty()) {
             LOGE("Backup of /system not found");
             return false;
@@ -722,7 +1031,8 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
         Result ret = restore_partition(
                 system_path, input_dir, path,
-                rom->system_is_image, image_size, {}, compression);
+                rom->system_is_image, image_size, {}, compression, chunk_dir,
+                paths);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -731,8 +1041,9 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
     // Restore cache
     if (targets & BACKUP_TARGET_CACHE) {
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_CACHE, &compression);
+        std::string chunk_dir;
+        std::string path = find_partition_backup(
+                input_dir, BACKUP_NAME_PREFIX_CACHE, &compression, &chunk_dir);
         if (path.empty()) {
             LOGE("Backup of /cache not found");
             return false;
@@ -740,7 +1051,8 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
         Result ret = restore_partition(
                 cache_path, input_dir, path,
-                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, compression);
+                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, compression,
+                chunk_dir, paths);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -749,8 +1061,9 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
     // Restore data
     if (targets & BACKUP_TARGET_DATA) {
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_DATA, &compression);
+        std::string chunk_dir;
+        std::string path = find_partition_backup(
+                input_dir, BACKUP_NAME_PREFIX_DATA, &compression, &chunk_dir);
         if (path.empty()) {
             LOGE("Backup of /data not found");
             return false;
@@ -758,7 +1071,8 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
         Result ret = restore_partition(
                 data_path, input_dir, path,
-                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, compression);
+                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, compression,
+                chunk_dir, paths);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -804,6 +1118,7 @@ static bool is_valid_backup_name(const std::string &name)
 {
     // No empty strings, hidden paths, '..', or directory separators
     return !name.empty()                            // Must be non-empty
+            && name[0] != '.'                       // and not hidden
             && name.find('/') == std::string::npos  // and contain no slashes
             && name != "."                          // and not current directory
             && name != "..";                        // and not parent directory
@@ -838,11 +1153,18 @@ static void backup_usage(FILE *stream)
             "                   Name of backup\n"
             "                   (Default: YYYY.MM.DD-HH.MM.SS)\n"
             "  -c, --compression <compression type>\n"
-            "                   Compression type (none, lz4, gzip, xz)\n"
+            "                   Compression type (none, lz4, gzip, xz, zstd)\n"
             "                   (Default: lz4)\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory to store backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
+            "  -i, --incremental\n"
+            "                   Store file contents in a chunk store shared by\n"
+            "                   all backups in the backup directory and only\n"
+            "                   read files that changed since the last backup\n"
+            "  -b, --base <name>\n"
+            "                   Backup to compare against for -i/--incremental\n"
+            "                   (Default: newest backup of each partition)\n"
             "  -f, --force      Allow overwriting old backup with the same name\n"
             "  -h, --help       Display this help message\n"
             "\n"
@@ -868,6 +1190,11 @@ static void restore_usage(FILE *stream)
             "  -d, --backupdir <directory>\n"
             "                   Directory containing backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
+            "  -p, --path <path>\n"
+            "                   Only restore this path, relative to the root of\n"
+            "                   the target. Can be specified multiple times.\n"
+            "                   Requires a single system, cache, or data target\n"
+            "                   and an lz4 backup.\n"
             "  -h, --help       Display this help message\n"
             "\n"
             "Valid backup targets: 'all' or some combination of the following:\n"
@@ -881,13 +1208,15 @@ int backup_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:c:d:fh";
+    static const char *short_options = "r:t:n:c:d:ib:fh";
     static struct option long_options[] = {
         {"romid",       required_argument, 0, 'r'},
         {"targets",     required_argument, 0, 't'},
         {"name",        required_argument, 0, 'n'},
         {"compression", required_argument, 0, 'c'},
         {"backupdir",   required_argument, 0, 'd'},
+        {"incremental", no_argument,       0, 'i'},
+        {"base",        required_argument, 0, 'b'},
         {"force",       no_argument,       0, 'f'},
         {"help",        no_argument,       0, 'h'},
         {0, 0, 0, 0}
@@ -900,6 +1229,8 @@ int backup_main(int argc, char *argv[])
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
     util::compression_type compression = util::compression_type::LZ4;
+    bool incremental = false;
+    std::string base_name;
     bool force = false;
 
     if (!util::format_time("%Y.%m.%d-%H.%M.%S", &name)) {
@@ -928,6 +1259,12 @@ int backup_main(int argc, char *argv[])
         case 'd':
             backupdir = optarg;
             break;
+        case 'i':
+            incremental = true;
+            break;
+        case 'b':
+            base_name = optarg;
+            break;
         case 'f':
             force = true;
             break;
@@ -962,6 +1299,17 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!base_name.empty()) {
+        if (!incremental) {
+            fprintf(stderr, "-b/--base requires -i/--incremental\n");
+            return EXIT_FAILURE;
+        } else if (!is_valid_backup_name(base_name)) {
+            fprintf(stderr, "Invalid base backup name: %s\n",
+                    base_name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
     warn_selinux_context();
 
     if (!ensure_partitions_mounted()) {
@@ -994,7 +1342,8 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = backup_rom(rom, output_dir, targets, compression);
+    bool ret = backup_rom(rom, output_dir, targets, compression, incremental,
+                          base_name);
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -1008,12 +1357,13 @@ int restore_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:d:h";
+    static const char *short_options = "r:t:n:d:p:h";
     static struct option long_options[] = {
         {"romid",     required_argument, 0, 'r'},
         {"targets",   required_argument, 0, 't'},
         {"name",      required_argument, 0, 'n'},
         {"backupdir", required_argument, 0, 'd'},
+        {"path",      required_argument, 0, 'p'},
         {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -1024,6 +1374,7 @@ int restore_main(int argc, char *argv[])
     std::string targets_str("all");
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
+    std::vector<std::string> paths;
 
     while ((opt = getopt_long(argc, argv, short_options,
             long_options, &long_index)) != -1) {
@@ -1040,6 +1391,9 @@ int restore_main(int argc, char *argv[])
         case 'd':
             backupdir = optarg;
             break;
+        case 'p':
+            paths.push_back(optarg);
+            break;
         case 'h':
             restore_usage(stdout);
             return EXIT_SUCCESS;
@@ -1071,6 +1425,14 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!paths.empty() && targets != BACKUP_TARGET_SYSTEM
+            && targets != BACKUP_TARGET_CACHE
+            && targets != BACKUP_TARGET_DATA) {
+        fprintf(stderr, "Paths can only be restored from a single system, "
+                "cache, or data target\n");
+        return EXIT_FAILURE;
+    }
+
     if (!is_valid_backup_name(name)) {
         fprintf(stderr, "Invalid backup name: %s\n", name.c_str());
         return EXIT_FAILURE;
@@ -1104,7 +1466,7 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = restore_rom(rom, input_dir, targets);
+    bool ret = restore_rom(rom, input_dir, targets, paths);
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
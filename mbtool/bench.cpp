@@ -0,0 +1,1377 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbcommon/file/standard.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
+#include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+#include "mbutil/archive.h"
+#include "mbutil/copy.h"
+#include "mbutil/delete.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/fts.h"
+#include "mbutil/hash.h"
+#include "mbutil/properties.h"
+#include "mbutil/socket.h"
+#include "mbutil/string.h"
+#include "mbutil/time.h"
+
+#include "bootimg_util.h"
+
+#include "protocol/request_generated.h"
+#include "protocol/response_generated.h"
+
+#define DEFAULT_DIR             "/data/local/tmp"
+#define DEFAULT_FILE_SIZE_MIB   64
+#define DEFAULT_ITERATIONS      5
+#define DEFAULT_TREE_FILES      2000
+#define DEFAULT_DAEMON_REQUESTS 1000
+#define DEFAULT_SEED            0x4d42544f4f4cULL
+
+// Files per directory in the generated tree
+#define TREE_FILES_PER_DIR      100
+// Maximum size of a file in the generated tree
+#define TREE_MAX_FILE_SIZE      (64 * 1024)
+// Chunk size used when generating and expanding data
+#define CHUNK_SIZE              (1024 * 1024)
+#define SPARSE_BLOCK_SIZE       4096
+
+#define ALL_BENCHMARKS          "copy,hash,sparse,bootimg,tar,walk,daemon"
+
+namespace v3 = mbtool::daemon::v3;
+namespace fb = flatbuffers;
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
+
+namespace mb
+{
+
+struct BenchOptions
+{
+    std::string dir = DEFAULT_DIR;
+    uint64_t file_size = DEFAULT_FILE_SIZE_MIB * CHUNK_SIZE;
+    unsigned int iterations = DEFAULT_ITERATIONS;
+    unsigned int tree_files = DEFAULT_TREE_FILES;
+    unsigned int daemon_requests = DEFAULT_DAEMON_REQUESTS;
+    uint64_t seed = DEFAULT_SEED;
+    std::string boot_image;
+    bool drop_caches = true;
+    bool keep = false;
+};
+
+struct BenchResult
+{
+    std::string name;
+    // Duration of each timed operation
+    std::vector<uint64_t> samples_ns;
+    // Bytes processed by each timed operation
+    uint64_t bytes = 0;
+    // Files or entries processed by each timed operation
+    uint64_t items = 0;
+    bool ok = true;
+    bool skipped = false;
+    std::string error;
+};
+
+struct BenchContext
+{
+    BenchOptions opts;
+    // Scratch directory for this run
+    std::string work_dir;
+    // Reference file of opts.file_size bytes
+    std::string source_file;
+    // Generated directory tree and its total size
+    std::string tree_dir;
+    uint64_t tree_bytes = 0;
+    bool warned_drop_caches = false;
+    std::vector<BenchResult> results;
+};
+
+/*!
+ * \brief Deterministic pseudo-random generator (xorshift64*)
+ *
+ * The generated data only depends on the seed so that runs on different
+ * devices operate on identical inputs.
+ */
+class BenchRng
+{
+public:
+    explicit BenchRng(uint64_t seed) : _state(seed ? seed : DEFAULT_SEED)
+    {
+    }
+
+    uint64_t next()
+    {
+        _state ^= _state >> 12;
+        _state ^= _state << 25;
+        _state ^= _state >> 27;
+        return _state * 0x2545f4914f6cdd1dULL;
+    }
+
+private:
+    uint64_t _state;
+};
+
+/*!
+ * \brief Fill buffer with random or compressible data
+ *
+ * Compressible data consists of short words from a small vocabulary, which
+ * compresses roughly like text and binaries found on a system partition.
+ */
+static void fill_data(BenchRng &rng, void *buf, size_t size,
+                      bool compressible)
+{
+    unsigned char *ptr = static_cast<unsigned char *>(buf);
+
+    if (!compressible) {
+        while (size > 0) {
+            uint64_t value = rng.next();
+            size_t n = std::min(size, sizeof(value));
+            memcpy(ptr, &value, n);
+            ptr += n;
+            size -= n;
+        }
+        return;
+    }
+
+    static const char *words[] = {
+        "system", "vendor", "lib", "bin", "framework", "android", ".so ",
+        "\x7f" "ELF", "\0\0\0\0", "mbtool ", "data ", "app/", "\n",
+    };
+    static const size_t n_words = sizeof(words) / sizeof(words[0]);
+
+    while (size > 0) {
+        const char *word = words[rng.next() % n_words];
+        size_t len = std::max<size_t>(1, strlen(word));
+        size_t n = std::min(size, len);
+        memcpy(ptr, word, n);
+        ptr += n;
+        size -= n;
+    }
+}
+
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    const char *ptr = static_cast<const char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+static bool fsync_path(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = fsync(fd) == 0;
+    if (!ret) {
+        LOGE("%s: Failed to sync: %s", path.c_str(), strerror(errno));
+    }
+
+    close(fd);
+    return ret;
+}
+
+/*!
+ * \brief Write dirty pages and drop the page cache
+ *
+ * This makes read benchmarks hit the storage instead of memory. If the caches
+ * can't be dropped (eg. not running as root), the results are still reported,
+ * but will mostly measure memory bandwidth.
+ */
+static void prepare_cold_cache(BenchContext &ctx)
+{
+    sync();
+
+    if (!ctx.opts.drop_caches) {
+        return;
+    }
+
+    if (!util::file_write_data("/proc/sys/vm/drop_caches", "3", 1)
+            && !ctx.warned_drop_caches) {
+        LOGW("Failed to drop page cache: %s", strerror(errno));
+        LOGW("Read benchmarks may not reflect storage performance");
+        ctx.warned_drop_caches = true;
+    }
+}
+
+/*!
+ * \brief Run a benchmark for the configured number of iterations
+ *
+ * \param setup Untimed function called before each iteration (may be null)
+ * \param fn Timed function
+ */
+static BenchResult & run_benchmark(BenchContext &ctx, const std::string &name,
+                                   uint64_t bytes, uint64_t items,
+                                   const std::function<bool()> &setup,
+                                   const std::function<bool()> &fn)
+{
+    ctx.results.emplace_back();
+    BenchResult &result = ctx.results.back();
+    result.name = name;
+    result.bytes = bytes;
+    result.items = items;
+
+    LOGI("Running benchmark: %s", name.c_str());
+
+    for (unsigned int i = 0; i < ctx.opts.iterations; ++i) {
+        if (setup && !setup()) {
+            result.ok = false;
+            result.error = "Setup failed";
+            break;
+        }
+
+        struct timespec start;
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ret = fn();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (!ret) {
+            result.ok = false;
+            result.error = "Benchmark failed (see log for details)";
+            break;
+        }
+
+        result.samples_ns.push_back(static_cast<uint64_t>(
+                util::timespec_diff_ns(start, end)));
+    }
+
+    return result;
+}
+
+static BenchResult & fail_benchmark(BenchContext &ctx, const std::string &name,
+                                    const std::string &error)
+{
+    ctx.results.emplace_back();
+    BenchResult &result = ctx.results.back();
+    result.name = name;
+    result.ok = false;
+    result.error = error;
+
+    LOGE("%s: %s", name.c_str(), error.c_str());
+
+    return result;
+}
+
+// Input generation
+
+static bool generate_source_file(BenchContext &ctx)
+{
+    ctx.source_file = ctx.work_dir + "/source.bin";
+
+    int fd = open(ctx.source_file.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s",
+             ctx.source_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    BenchRng rng(ctx.opts.seed);
+    std::vector<unsigned char> buf(CHUNK_SIZE);
+    uint64_t remaining = ctx.opts.file_size;
+
+    for (uint64_t i = 0; remaining > 0; ++i) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(remaining,
+                                                          buf.size()));
+        fill_data(rng, buf.data(), n, i % 2 == 1);
+
+        if (!write_fully(fd, buf.data(), n)) {
+            LOGE("%s: Failed to write: %s",
+                 ctx.source_file.c_str(), strerror(errno));
+            return false;
+        }
+
+        remaining -= n;
+    }
+
+    if (fsync(fd) < 0) {
+        LOGE("%s: Failed to sync: %s",
+             ctx.source_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool generate_tree(BenchContext &ctx)
+{
+    ctx.tree_dir = ctx.work_dir + "/tree";
+    ctx.tree_bytes = 0;
+
+    BenchRng rng(ctx.opts.seed ^ 0x74726565);
+    std::vector<unsigned char> buf(TREE_MAX_FILE_SIZE);
+
+    for (unsigned int i = 0; i < ctx.opts.tree_files; ++i) {
+        std::string dir = format("%s/d%03u", ctx.tree_dir.c_str(),
+                                 i / TREE_FILES_PER_DIR);
+        if (i % TREE_FILES_PER_DIR == 0
+                && !util::mkdir_recursive(dir, 0755)) {
+            LOGE("%s: Failed to create directory: %s",
+                 dir.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Skew towards small files like a real system partition
+        size_t size = static_cast<size_t>(rng.next() % TREE_MAX_FILE_SIZE);
+        if (i % 4 != 0) {
+            size /= 16;
+        }
+        fill_data(rng, buf.data(), size, i % 3 != 0);
+
+        std::string path = format("%s/f%05u", dir.c_str(), i);
+        if (!util::file_write_data(
+                path, reinterpret_cast<const char *>(buf.data()), size)) {
+            LOGE("%s: Failed to write file: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+
+        ctx.tree_bytes += size;
+    }
+
+    sync();
+    return true;
+}
+
+/*!
+ * \brief Create a sparse image from the source file
+ *
+ * The chunks cycle through raw data, fill, and hole chunks.
+ */
+static bool generate_sparse_image(BenchContext &ctx, const std::string &path,
+                                  uint64_t *expanded_size)
+{
+    StandardFile in(ctx.source_file, FileOpenMode::READ_ONLY);
+    StandardFile out(path, FileOpenMode::WRITE_ONLY);
+    if (!in.is_open() || !out.is_open()) {
+        LOGE("Failed to open files for sparse image generation");
+        return false;
+    }
+
+    sparse::SparseWriter writer(&out, SPARSE_BLOCK_SIZE, true);
+    if (!writer.is_open()) {
+        LOGE("%s: Failed to open sparse writer: %s",
+             path.c_str(), writer.error_string().c_str());
+        return false;
+    }
+
+    // The sparse format requires whole blocks
+    uint64_t size = ctx.opts.file_size / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+    std::vector<unsigned char> buf(CHUNK_SIZE);
+
+    for (uint64_t i = 0, offset = 0; offset < size; ++i) {
+        size_t n = static_cast<size_t>(std::min<uint64_t>(size - offset,
+                                                          buf.size()));
+        size_t n_read;
+        size_t n_written;
+        bool ret;
+
+        if (!in.read(buf.data(), n, n_read) || n_read != n) {
+            LOGE("%s: Failed to read: %s",
+                 ctx.source_file.c_str(), in.error_string().c_str());
+            return false;
+        }
+
+        switch (i % 4) {
+        case 1:
+            ret = writer.write_fill(0xdeadbeef, n);
+            break;
+        case 2:
+            ret = writer.write_dont_care(n);
+            break;
+        default:
+            ret = writer.write(buf.data(), n, n_written) && n_written == n;
+            break;
+        }
+
+        if (!ret) {
+            LOGE("%s: Failed to write sparse data: %s",
+                 path.c_str(), writer.error_string().c_str());
+            return false;
+        }
+
+        offset += n;
+    }
+
+    if (!writer.close() || !out.close()) {
+        LOGE("%s: Failed to close sparse image: %s",
+             path.c_str(), writer.error_string().c_str());
+        return false;
+    }
+
+    *expanded_size = size;
+    return true;
+}
+
+static bool generate_boot_image(BenchContext &ctx, const std::string &path)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    size_t n;
+    int ret;
+
+    if (!biw) {
+        LOGE("Failed to allocate boot image writer");
+        return false;
+    }
+
+    if (mb_bi_writer_set_format_android(biw.get()) != MB_BI_OK
+            || mb_bi_writer_open_filename(biw.get(), path.c_str()) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK
+            || mb_bi_header_set_page_size(header, 2048) != MB_BI_OK
+            || mb_bi_header_set_kernel_cmdline(header, "console=null")
+                    != MB_BI_OK
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        LOGE("%s: Failed to write boot image header: %s",
+             path.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    // Typical sizes for a kernel and compressed ramdisk
+    BenchRng rng(ctx.opts.seed ^ 0x626f6f74);
+    std::vector<unsigned char> kernel(12 * 1024 * 1024);
+    std::vector<unsigned char> ramdisk(4 * 1024 * 1024);
+    fill_data(rng, kernel.data(), kernel.size(), false);
+    fill_data(rng, ramdisk.data(), ramdisk.size(), false);
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        const std::vector<unsigned char> *data = nullptr;
+
+        switch (mb_bi_entry_type(entry)) {
+        case MB_BI_ENTRY_KERNEL:
+            data = &kernel;
+            break;
+        case MB_BI_ENTRY_RAMDISK:
+            data = &ramdisk;
+            break;
+        }
+
+        ret = mb_bi_writer_write_entry(biw.get(), entry);
+        if (ret == MB_BI_OK && data) {
+            ret = mb_bi_writer_write_data(biw.get(), data->data(),
+                                          data->size(), &n);
+        }
+        if (ret != MB_BI_OK) {
+            break;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        LOGE("%s: Failed to write boot image: %s",
+             path.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    return true;
+}
+
+// Benchmarks
+
+static void bench_copy(BenchContext &ctx)
+{
+    std::string target = ctx.work_dir + "/copy.bin";
+
+    run_benchmark(ctx, "copy_file", ctx.opts.file_size, 1, [&]{
+        unlink(target.c_str());
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        // Include the time to reach the storage
+        return util::copy_file(ctx.source_file, target, 0)
+                && fsync_path(target);
+    });
+
+    unlink(target.c_str());
+}
+
+static void bench_hash(BenchContext &ctx)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    run_benchmark(ctx, "sha512_hash", ctx.opts.file_size, 1, [&]{
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        return util::sha512_hash(ctx.source_file, digest);
+    });
+}
+
+static bool expand_sparse_file(const std::string &input,
+                               const std::string &output)
+{
+    StandardFile in(input, FileOpenMode::READ_ONLY);
+    if (!in.is_open()) {
+        LOGE("%s: Failed to open: %s",
+             input.c_str(), in.error_string().c_str());
+        return false;
+    }
+
+    sparse::SparseFile sparse(&in);
+    if (!sparse.is_open()) {
+        LOGE("%s: Failed to open sparse file: %s",
+             input.c_str(), sparse.error_string().c_str());
+        return false;
+    }
+
+    int fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", output.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    std::vector<unsigned char> buf(CHUNK_SIZE);
+    size_t n;
+
+    while (true) {
+        if (!sparse.read(buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read sparse file: %s",
+                 input.c_str(), sparse.error_string().c_str());
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!write_fully(fd, buf.data(), n)) {
+            LOGE("%s: Failed to write: %s", output.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (fsync(fd) < 0) {
+        LOGE("%s: Failed to sync: %s", output.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void bench_sparse(BenchContext &ctx)
+{
+    std::string sparse_file = ctx.work_dir + "/sparse.img";
+    std::string target = ctx.work_dir + "/sparse.raw";
+    uint64_t expanded_size;
+
+    if (!generate_sparse_image(ctx, sparse_file, &expanded_size)) {
+        fail_benchmark(ctx, "sparse_expand", "Failed to create sparse image");
+        return;
+    }
+
+    run_benchmark(ctx, "sparse_expand", expanded_size, 1, [&]{
+        unlink(target.c_str());
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        return expand_sparse_file(sparse_file, target);
+    });
+
+    unlink(sparse_file.c_str());
+    unlink(target.c_str());
+}
+
+/*!
+ * \brief Extract all entries of a boot image to `<dir>/<entry type>`
+ */
+static bool unpack_boot_image(const std::string &path, const std::string &dir,
+                              int *format_out, ScopedHeader *header_out,
+                              uint64_t *bytes_out)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!bir) {
+        LOGE("Failed to allocate boot image reader");
+        return false;
+    }
+
+    if (mb_bi_reader_enable_format_all(bir.get()) != MB_BI_OK
+            || mb_bi_reader_open_filename(bir.get(), path.c_str())
+                    != MB_BI_OK
+            || mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+        LOGE("%s: Failed to read boot image: %s",
+             path.c_str(), mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (format_out) {
+        *format_out = mb_bi_reader_format_code(bir.get());
+    }
+    if (header_out) {
+        header_out->reset(mb_bi_header_clone(header));
+    }
+
+    uint64_t total = 0;
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        std::string entry_path = format("%s/%d", dir.c_str(),
+                                        mb_bi_entry_type(entry));
+        if (!bi_copy_data_to_file(bir.get(), entry_path)) {
+            return false;
+        }
+
+        total += mb_bi_entry_size(entry);
+    }
+
+    if (ret != MB_BI_EOF) {
+        LOGE("%s: Failed to read entry: %s",
+             path.c_str(), mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    if (bytes_out) {
+        *bytes_out = total;
+    }
+
+    sync();
+    return true;
+}
+
+static bool repack_boot_image(const std::string &dir, int format_code,
+                              MbBiHeader *header, const std::string &path)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        LOGE("Failed to allocate boot image writer");
+        return false;
+    }
+
+    if (mb_bi_writer_set_format_by_code(biw.get(), format_code)
+                    != MB_BI_OK
+            || mb_bi_writer_open_filename(biw.get(), path.c_str()) != MB_BI_OK
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        LOGE("%s: Failed to write boot image header: %s",
+             path.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        std::string entry_path = format("%s/%d", dir.c_str(),
+                                        mb_bi_entry_type(entry));
+
+        ret = mb_bi_writer_write_entry(biw.get(), entry);
+        if (ret != MB_BI_OK) {
+            break;
+        }
+
+        if (access(entry_path.c_str(), F_OK) == 0
+                && !bi_copy_file_to_data(entry_path, biw.get())) {
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        LOGE("%s: Failed to write boot image: %s",
+             path.c_str(), mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    return fsync_path(path);
+}
+
+static void bench_bootimg(BenchContext &ctx)
+{
+    std::string image = ctx.opts.boot_image;
+    std::string unpack_dir = ctx.work_dir + "/bootimg";
+    std::string output = ctx.work_dir + "/boot-repacked.img";
+
+    if (image.empty()) {
+        image = ctx.work_dir + "/boot.img";
+        if (!generate_boot_image(ctx, image)) {
+            fail_benchmark(ctx, "bootimg_unpack",
+                           "Failed to create boot image");
+            return;
+        }
+    }
+
+    auto cleanup = util::finally([&]{
+        util::delete_recursive(unpack_dir);
+        unlink(output.c_str());
+        if (ctx.opts.boot_image.empty()) {
+            unlink(image.c_str());
+        }
+    });
+
+    // Unpack once untimed to find the entries, format, and header
+    int format_code;
+    ScopedHeader header(nullptr, mb_bi_header_free);
+    uint64_t bytes;
+
+    if (!util::mkdir_recursive(unpack_dir, 0700)
+            || !unpack_boot_image(image, unpack_dir, &format_code, &header,
+                                  &bytes)) {
+        fail_benchmark(ctx, "bootimg_unpack", "Failed to unpack boot image");
+        return;
+    }
+
+    run_benchmark(ctx, "bootimg_unpack", bytes, 1, [&]{
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        return unpack_boot_image(image, unpack_dir, nullptr, nullptr,
+                                 nullptr);
+    });
+
+    run_benchmark(ctx, "bootimg_repack", bytes, 1, [&]{
+        unlink(output.c_str());
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        return repack_boot_image(unpack_dir, format_code, header.get(),
+                                 output);
+    });
+}
+
+static void bench_tar(BenchContext &ctx)
+{
+    static const struct {
+        util::compression_type type;
+        const char *name;
+    } compression_types[] = {
+        { util::compression_type::NONE, "none" },
+        { util::compression_type::LZ4,  "lz4"  },
+        { util::compression_type::GZIP, "gzip" },
+        { util::compression_type::XZ,   "xz"   },
+        { util::compression_type::ZSTD, "zstd" },
+    };
+
+    std::string archive = ctx.work_dir + "/tree.tar";
+    std::string extract_dir = ctx.work_dir + "/extract";
+
+    for (auto const &c : compression_types) {
+        std::string create_name = format("tar_create_%s", c.name);
+        std::string extract_name = format("tar_extract_%s", c.name);
+
+        BenchResult &create = run_benchmark(
+                ctx, create_name, ctx.tree_bytes, ctx.opts.tree_files, [&]{
+            unlink(archive.c_str());
+            prepare_cold_cache(ctx);
+            return true;
+        }, [&]{
+            return util::libarchive_tar_create(archive, ctx.tree_dir, {"."},
+                                               c.type)
+                    && fsync_path(archive);
+        });
+
+        if (!create.ok) {
+            fail_benchmark(ctx, extract_name, "Failed to create archive");
+            continue;
+        }
+
+        run_benchmark(ctx, extract_name, ctx.tree_bytes, ctx.opts.tree_files,
+                      [&]{
+            util::delete_recursive(extract_dir);
+            prepare_cold_cache(ctx);
+            return util::mkdir_recursive(extract_dir, 0700);
+        }, [&]{
+            if (!util::libarchive_tar_extract(archive, extract_dir, {},
+                                              c.type)) {
+                return false;
+            }
+            sync();
+            return true;
+        });
+    }
+
+    unlink(archive.c_str());
+    util::delete_recursive(extract_dir);
+}
+
+class CountingWalker : public util::FTSWrapper
+{
+public:
+    uint64_t count = 0;
+
+    explicit CountingWalker(std::string path)
+        : FTSWrapper(std::move(path), FTS_GroupSpecialFiles)
+    {
+    }
+
+    virtual int on_reached_directory_pre() override
+    {
+        ++count;
+        return FTS_OK;
+    }
+
+    virtual int on_reached_file() override
+    {
+        ++count;
+        return FTS_OK;
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        ++count;
+        return FTS_OK;
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        ++count;
+        return FTS_OK;
+    }
+};
+
+static void bench_walk(BenchContext &ctx)
+{
+    // Number of directories plus the root
+    uint64_t items = ctx.opts.tree_files
+            + (ctx.opts.tree_files + TREE_FILES_PER_DIR - 1)
+                    / TREE_FILES_PER_DIR + 1;
+
+    run_benchmark(ctx, "directory_walk", 0, items, [&]{
+        prepare_cold_cache(ctx);
+        return true;
+    }, [&]{
+        CountingWalker walker(ctx.tree_dir);
+        if (!walker.run()) {
+            LOGE("%s: Failed to walk directory: %s",
+                 ctx.tree_dir.c_str(), walker.error().c_str());
+            return false;
+        }
+        return walker.count == items;
+    });
+}
+
+static int daemon_connect(std::string &error)
+{
+    int fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = format("Failed to create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    char abs_name[] = "\0mbtool.daemon";
+    size_t abs_name_len = sizeof(abs_name) - 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    memcpy(addr.sun_path, abs_name, abs_name_len);
+
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abs_name_len;
+
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), addr_len) < 0) {
+        error = format("Failed to connect to daemon: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    std::string response;
+
+    if (!util::socket_read_string(fd, &response)) {
+        error = "Failed to read authentication response";
+    } else if (response != "ALLOW") {
+        error = "Daemon denied connection";
+    } else if (!util::socket_write_int32(fd, 3)
+            || !util::socket_read_string(fd, &response)) {
+        error = "Failed to negotiate protocol version";
+    } else if (response != "OK") {
+        error = "Daemon does not support protocol version 3";
+    } else {
+        return fd;
+    }
+
+    close(fd);
+    return -1;
+}
+
+static void bench_daemon(BenchContext &ctx)
+{
+    std::string error;
+
+    int fd = daemon_connect(error);
+    if (fd < 0) {
+        // The daemon isn't always running (eg. in recovery)
+        LOGW("Skipping daemon benchmark: %s", error.c_str());
+        ctx.results.emplace_back();
+        ctx.results.back().name = "daemon_round_trip";
+        ctx.results.back().skipped = true;
+        ctx.results.back().error = error;
+        return;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    fb::FlatBufferBuilder builder;
+    auto request = v3::CreateMbGetVersionRequest(builder);
+    builder.Finish(v3::CreateRequest(
+            builder, v3::RequestType_MbGetVersionRequest, request.Union()));
+
+    std::vector<uint8_t> response;
+
+    // Each sample is a single request instead of a whole iteration
+    ctx.results.emplace_back();
+    BenchResult &result = ctx.results.back();
+    result.name = "daemon_round_trip";
+    result.items = 1;
+
+    LOGI("Running benchmark: %s", result.name.c_str());
+
+    unsigned int total = ctx.opts.iterations * ctx.opts.daemon_requests;
+
+    for (unsigned int i = 0; i < total; ++i) {
+        struct timespec start;
+        struct timespec end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ret = util::socket_write_bytes(fd, builder.GetBufferPointer(),
+                                            builder.GetSize())
+                && util::socket_read_bytes(fd, &response);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (!ret) {
+            result.ok = false;
+            result.error = format("Failed to communicate with daemon: %s",
+                                  strerror(errno));
+            return;
+        }
+
+        auto verifier = fb::Verifier(response.data(), response.size());
+        if (!v3::VerifyResponseBuffer(verifier)
+                || v3::GetResponse(response.data())->response_type()
+                        != v3::ResponseType_MbGetVersionResponse) {
+            result.ok = false;
+            result.error = "Received invalid response from daemon";
+            return;
+        }
+
+        result.samples_ns.push_back(static_cast<uint64_t>(
+                util::timespec_diff_ns(start, end)));
+    }
+}
+
+// Output
+
+typedef rapidjson::PrettyWriter<rapidjson::StringBuffer> JsonWriter;
+
+static void write_stats(JsonWriter &writer, const BenchResult &result)
+{
+    std::vector<uint64_t> samples(result.samples_ns);
+    std::sort(samples.begin(), samples.end());
+
+    size_t n = samples.size();
+    uint64_t sum = 0;
+    for (uint64_t s : samples) {
+        sum += s;
+    }
+
+    uint64_t median = n % 2 == 1 ? samples[n / 2]
+            : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    // Nearest-rank percentile
+    uint64_t p99 = samples[(n * 99 + 99) / 100 - 1];
+
+    writer.Key("samples");
+    writer.Uint64(n);
+    writer.Key("min_ns");
+    writer.Uint64(samples.front());
+    writer.Key("median_ns");
+    writer.Uint64(median);
+    writer.Key("mean_ns");
+    writer.Uint64(sum / n);
+    writer.Key("p99_ns");
+    writer.Uint64(p99);
+    writer.Key("max_ns");
+    writer.Uint64(samples.back());
+
+    if (median > 0 && result.bytes > 0) {
+        writer.Key("mib_per_s");
+        writer.Double(static_cast<double>(result.bytes) / (1024 * 1024)
+                / (static_cast<double>(median) / 1e9));
+    }
+    if (median > 0 && result.items > 1) {
+        writer.Key("items_per_s");
+        writer.Double(static_cast<double>(result.items)
+                / (static_cast<double>(median) / 1e9));
+    }
+}
+
+static std::string results_to_json(const BenchContext &ctx)
+{
+    rapidjson::StringBuffer sb;
+    JsonWriter writer(sb);
+
+    writer.StartObject();
+
+    writer.Key("mbtool_version");
+    writer.String(version());
+
+    writer.Key("device");
+    writer.StartObject();
+    for (auto const &prop : { "ro.product.device", "ro.product.model",
+                              "ro.hardware", "ro.build.fingerprint" }) {
+        writer.Key(prop);
+        writer.String(util::property_get_string(prop, ""));
+    }
+    writer.EndObject();
+
+    writer.Key("config");
+    writer.StartObject();
+    writer.Key("dir");
+    writer.String(ctx.opts.dir);
+    writer.Key("file_size");
+    writer.Uint64(ctx.opts.file_size);
+    writer.Key("iterations");
+    writer.Uint(ctx.opts.iterations);
+    writer.Key("tree_files");
+    writer.Uint(ctx.opts.tree_files);
+    writer.Key("tree_bytes");
+    writer.Uint64(ctx.tree_bytes);
+    writer.Key("daemon_requests");
+    writer.Uint(ctx.opts.daemon_requests);
+    writer.Key("seed");
+    writer.Uint64(ctx.opts.seed);
+    writer.Key("boot_image");
+    writer.String(ctx.opts.boot_image);
+    writer.Key("drop_caches");
+    writer.Bool(ctx.opts.drop_caches && !ctx.warned_drop_caches);
+    writer.EndObject();
+
+    writer.Key("results");
+    writer.StartArray();
+    for (auto const &result : ctx.results) {
+        writer.StartObject();
+        writer.Key("name");
+        writer.String(result.name);
+        writer.Key("ok");
+        writer.Bool(result.ok);
+        if (result.skipped) {
+            writer.Key("skipped");
+            writer.Bool(true);
+        }
+        if (!result.error.empty()) {
+            writer.Key("error");
+            writer.String(result.error);
+        }
+        writer.Key("bytes");
+        writer.Uint64(result.bytes);
+        writer.Key("items");
+        writer.Uint64(result.items);
+        if (!result.samples_ns.empty()) {
+            write_stats(writer, result);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    writer.EndObject();
+
+    return std::string(sb.GetString(), sb.GetSize());
+}
+
+static bool parse_uint(const char *str, unsigned int min, unsigned int max,
+                       unsigned int *out)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 10);
+    if (errno != 0 || *str == '\0' || *end != '\0' || value < min
+            || value > max) {
+        return false;
+    }
+    *out = static_cast<unsigned int>(value);
+    return true;
+}
+
+static void bench_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: bench [option...] [benchmark...]\n\n"
+            "Runs storage and mbtool benchmarks on the device and prints the\n"
+            "results as JSON. The inputs are generated from a fixed seed, so\n"
+            "results from different devices are comparable.\n\n"
+            "Benchmarks (default: all):\n"
+            "  copy, hash, sparse, bootimg, tar, walk, daemon\n\n"
+            "Options:\n"
+            "  -d, --dir <dir>        Scratch directory on the storage to test\n"
+            "                         (default: " DEFAULT_DIR ")\n"
+            "  -s, --size <MiB>       Size of the test file (default: %d)\n"
+            "  -n, --iterations <n>   Iterations per benchmark (default: %d)\n"
+            "  -f, --files <n>        Files in the test tree (default: %d)\n"
+            "  -r, --requests <n>     Daemon requests per iteration\n"
+            "                         (default: %d)\n"
+            "  -b, --boot-image <img> Boot image to unpack and repack\n"
+            "                         (default: generated image)\n"
+            "  -o, --output <file>    Write JSON to file instead of stdout\n"
+            "  --seed <n>             Seed for the generated data\n"
+            "  --no-drop-caches       Don't drop the page cache before each\n"
+            "                         iteration\n"
+            "  --keep                 Keep the scratch directory\n"
+            "  -h, --help             Display this help message\n",
+            DEFAULT_FILE_SIZE_MIB, DEFAULT_ITERATIONS, DEFAULT_TREE_FILES,
+            DEFAULT_DAEMON_REQUESTS);
+}
+
+int bench_main(int argc, char *argv[])
+{
+    // Keep stdout clean for the JSON output
+    log::log_set_logger(std::make_shared<log::StdioLogger>(stderr, false));
+
+    enum {
+        OPT_SEED           = CHAR_MAX + 1,
+        OPT_NO_DROP_CACHES = CHAR_MAX + 2,
+        OPT_KEEP           = CHAR_MAX + 3,
+    };
+
+    static struct option long_options[] = {
+        {"dir",            required_argument, 0, 'd'},
+        {"size",           required_argument, 0, 's'},
+        {"iterations",     required_argument, 0, 'n'},
+        {"files",          required_argument, 0, 'f'},
+        {"requests",       required_argument, 0, 'r'},
+        {"boot-image",     required_argument, 0, 'b'},
+        {"output",         required_argument, 0, 'o'},
+        {"seed",           required_argument, 0, OPT_SEED},
+        {"no-drop-caches", no_argument,       0, OPT_NO_DROP_CACHES},
+        {"keep",           no_argument,       0, OPT_KEEP},
+        {"help",           no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    BenchContext ctx;
+    std::string output_file;
+    unsigned int value;
+    int opt;
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "d:s:n:f:r:b:o:h",
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'd':
+            ctx.opts.dir = optarg;
+            break;
+
+        case 's':
+            if (!parse_uint(optarg, 1, 64 * 1024, &value)) {
+                fprintf(stderr, "Invalid size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            ctx.opts.file_size = static_cast<uint64_t>(value) * CHUNK_SIZE;
+            break;
+
+        case 'n':
+            if (!parse_uint(optarg, 1, 10000, &ctx.opts.iterations)) {
+                fprintf(stderr, "Invalid iterations: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'f':
+            if (!parse_uint(optarg, 1, 1000000, &ctx.opts.tree_files)) {
+                fprintf(stderr, "Invalid number of files: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'r':
+            if (!parse_uint(optarg, 1, 1000000, &ctx.opts.daemon_requests)) {
+                fprintf(stderr, "Invalid number of requests: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'b':
+            ctx.opts.boot_image = optarg;
+            break;
+
+        case 'o':
+            output_file = optarg;
+            break;
+
+        case OPT_SEED: {
+            char *end;
+            errno = 0;
+            ctx.opts.seed = strtoull(optarg, &end, 0);
+            if (errno != 0 || *optarg == '\0' || *end != '\0') {
+                fprintf(stderr, "Invalid seed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+
+        case OPT_NO_DROP_CACHES:
+            ctx.opts.drop_caches = false;
+            break;
+
+        case OPT_KEEP:
+            ctx.opts.keep = true;
+            break;
+
+        case 'h':
+            bench_usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            bench_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<std::string> selected;
+    if (optind == argc) {
+        selected = util::split(ALL_BENCHMARKS, ",");
+    } else {
+        selected.assign(argv + optind, argv + argc);
+    }
+
+    static const struct {
+        const char *name;
+        void (*fn)(BenchContext &);
+    } benchmarks[] = {
+        { "copy",    bench_copy    },
+        { "hash",    bench_hash    },
+        { "sparse",  bench_sparse  },
+        { "bootimg", bench_bootimg },
+        { "tar",     bench_tar     },
+        { "walk",    bench_walk    },
+        { "daemon",  bench_daemon  },
+    };
+
+    std::vector<void (*)(BenchContext &)> to_run;
+    bool need_tree = false;
+
+    for (auto const &name : selected) {
+        auto it = std::find_if(std::begin(benchmarks), std::end(benchmarks),
+                               [&](decltype(benchmarks[0]) &b) {
+            return name == b.name;
+        });
+        if (it == std::end(benchmarks)) {
+            fprintf(stderr, "Unknown benchmark: %s\n", name.c_str());
+            return EXIT_FAILURE;
+        }
+
+        to_run.push_back(it->fn);
+        need_tree |= it->fn == bench_tar || it->fn == bench_walk;
+    }
+
+    if (!util::mkdir_recursive(ctx.opts.dir, 0755)) {
+        LOGE("%s: Failed to create directory: %s",
+             ctx.opts.dir.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    ctx.work_dir = ctx.opts.dir + "/mbtool-bench.XXXXXX";
+    if (!mkdtemp(&ctx.work_dir[0])) {
+        LOGE("%s: Failed to create scratch directory: %s",
+             ctx.opts.dir.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    auto delete_work_dir = util::finally([&]{
+        if (!ctx.opts.keep) {
+            util::delete_recursive(ctx.work_dir);
+        }
+    });
+
+    LOGI("Generating test data in %s", ctx.work_dir.c_str());
+
+    if (!generate_source_file(ctx) || (need_tree && !generate_tree(ctx))) {
+        LOGE("Failed to generate test data");
+        return EXIT_FAILURE;
+    }
+
+    for (auto fn : to_run) {
+        fn(ctx);
+    }
+
+    std::string json = results_to_json(ctx);
+    json += '\n';
+
+    if (output_file.empty()) {
+        fputs(json.c_str(), stdout);
+    } else if (!util::file_write_data(output_file, json.data(), json.size())) {
+        LOGE("%s: Failed to write results: %s",
+             output_file.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool ok = std::all_of(ctx.results.begin(), ctx.results.end(),
+                          [](const BenchResult &r) { return r.ok; });
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
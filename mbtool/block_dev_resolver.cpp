@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "block_dev_resolver.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "mbcommon/string.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/path.h"
+
+#define SYSFS_DIR               "/sys"
+#define SYSFS_CLASS_BLOCK_DIR   "/sys/class/block"
+#define DEV_BLOCK_DIR           "/dev/block"
+
+namespace mb
+{
+
+/*!
+ * \brief Read the properties of a block device from its sysfs uevent file
+ */
+static bool read_sysfs_device(const std::string &class_path,
+                              BlockDevInfo &info)
+{
+    std::string uevent_path(class_path);
+    uevent_path += "/uevent";
+
+    autoclose::file fp(autoclose::fopen(uevent_path.c_str(), "re"));
+    if (!fp) {
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+    std::string dev_name;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        if (mb::starts_with(line, "DEVNAME=")) {
+            dev_name = line + 8;
+        } else if (mb::starts_with(line, "PARTNAME=")) {
+            info.partition_name = line + 9;
+        } else if (mb::starts_with(line, "PARTN=")) {
+            info.partition_num = strtol(line + 6, nullptr, 10);
+        } else if (mb::starts_with(line, "MAJOR=")) {
+            info.major = strtol(line + 6, nullptr, 10);
+        } else if (mb::starts_with(line, "MINOR=")) {
+            info.minor = strtol(line + 6, nullptr, 10);
+        }
+    }
+
+    if (dev_name.empty()) {
+        return false;
+    }
+
+    info.path = DEV_BLOCK_DIR "/";
+    info.path += dev_name;
+    return true;
+}
+
+BlockDevResolver::BlockDevResolver()
+    : _indexed(false)
+{
+}
+
+/*!
+ * \brief Add a block device that was reported by a uevent
+ *
+ * \param sysfs_path Path of the device in sysfs without the /sys prefix
+ * \param info Block device information
+ */
+void BlockDevResolver::add_device(const std::string &sysfs_path,
+                                  BlockDevInfo info)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _devices[sysfs_path] = std::move(info);
+    _indexed = false;
+}
+
+/*!
+ * \brief Remove a block device that was reported by a uevent
+ */
+void BlockDevResolver::remove_device(const std::string &sysfs_path)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    if (_devices.erase(sysfs_path) > 0) {
+        _indexed = false;
+    }
+}
+
+/*!
+ * \brief Get all known block devices, keyed by their sysfs paths
+ *
+ * This does not read sysfs, so in init, only devices that have been reported
+ * by uevents are included.
+ */
+std::unordered_map<std::string, BlockDevInfo> BlockDevResolver::devices()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    return _devices;
+}
+
+/*!
+ * \brief Find a block device by its partition name
+ *
+ * \return Block device path or an empty string if no partition has the name
+ */
+std::string BlockDevResolver::find_by_name(const std::string &name)
+{
+    return lookup(DEV_BLOCK_DIR "/by-name/" + name);
+}
+
+/*!
+ * \brief Find a block device by its partition number
+ *
+ * \return Block device path or an empty string if no partition has the number
+ *         or if multiple disks have a partition with the number
+ */
+std::string BlockDevResolver::find_by_num(int num)
+{
+    return lookup(mb::format(DEV_BLOCK_DIR "/by-num/p%d", num));
+}
+
+/*!
+ * \brief Find the first usable path in a list of block device paths
+ *
+ * The paths are typically the ones from the device definition, like
+ * `/dev/block/platform/msm_sdcc.1/by-name/boot`. Paths in a `by-name` or
+ * `by-num` directory and paths directly in `/dev/block` are resolved through
+ * the map. If none of them can be resolved, the paths are checked on the
+ * filesystem like before.
+ *
+ * \return Block device path or an empty string if none of the paths exist
+ */
+std::string BlockDevResolver::resolve(const std::vector<std::string> &paths)
+{
+    for (auto const &path : paths) {
+        std::string result = lookup(path);
+        if (!result.empty()) {
+            return result;
+        }
+    }
+
+    struct stat sb;
+
+    for (auto const &path : paths) {
+        if (stat(path.c_str(), &sb) == 0 && S_ISBLK(sb.st_mode)) {
+            return path;
+        }
+    }
+
+    return {};
+}
+
+/*!
+ * \brief Get the process-wide resolver
+ *
+ * The resolver is never destroyed, so it remains usable while the process is
+ * exiting.
+ */
+BlockDevResolver & BlockDevResolver::global()
+{
+    static BlockDevResolver *resolver = new BlockDevResolver();
+    return *resolver;
+}
+
+void BlockDevResolver::reindex()
+{
+    _by_name.clear();
+    _by_dev_name.clear();
+    _by_num.clear();
+
+    for (auto const &item : _devices) {
+        auto const &info = item.second;
+
+        if (!info.partition_name.empty()) {
+            _by_name.emplace(info.partition_name, item.first);
+        }
+
+        _by_dev_name.emplace(util::base_name(info.path), item.first);
+
+        if (info.partition_num > 0) {
+            // Numbers are only unique within a disk. Ambiguous numbers are
+            // kept with an empty value so that they never resolve.
+            auto result = _by_num.emplace(info.partition_num, item.first);
+            if (!result.second) {
+                result.first->second.clear();
+            }
+        }
+    }
+
+    _indexed = true;
+}
+
+/*!
+ * \brief Add the block devices listed in /sys/class/block
+ *
+ * Devices that are already known from uevents are left untouched.
+ */
+bool BlockDevResolver::scan_sysfs()
+{
+    autoclose::dir dp(autoclose::opendir(SYSFS_CLASS_BLOCK_DIR));
+    if (!dp) {
+        return false;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        std::string class_path(SYSFS_CLASS_BLOCK_DIR "/");
+        class_path += ent->d_name;
+
+        // Use the same keys as the uevents, which are paths under /sys
+        char *real_path = realpath(class_path.c_str(), nullptr);
+        if (!real_path) {
+            continue;
+        }
+        std::string key(real_path);
+        free(real_path);
+
+        if (mb::starts_with(key, SYSFS_DIR "/")) {
+            key.erase(0, strlen(SYSFS_DIR));
+        }
+
+        if (_devices.find(key) != _devices.end()) {
+            continue;
+        }
+
+        BlockDevInfo info;
+        if (read_sysfs_device(class_path, info)) {
+            _devices.emplace(std::move(key), std::move(info));
+        }
+    }
+
+    _indexed = false;
+    return true;
+}
+
+std::string BlockDevResolver::lookup(const std::string &path)
+{
+    std::string dir = util::dir_name(path);
+    std::string name = util::base_name(path);
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    std::string result = lookup_locked(dir, name);
+    if (result.empty() && scan_sysfs()) {
+        result = lookup_locked(dir, name);
+    }
+
+    return result;
+}
+
+std::string BlockDevResolver::lookup_locked(const std::string &dir,
+                                            const std::string &name)
+{
+    if (!_indexed) {
+        reindex();
+    }
+
+    const std::string *key = nullptr;
+
+    if (util::base_name(dir) == "by-name") {
+        auto it = _by_name.find(name);
+        if (it != _by_name.end()) {
+            key = &it->second;
+        }
+    } else if (util::base_name(dir) == "by-num") {
+        char *end;
+        long num;
+        if (name.size() > 1 && name[0] == 'p'
+                && (num = strtol(name.c_str() + 1, &end, 10)) > 0
+                && *end == '\0') {
+            auto it = _by_num.find(static_cast<int>(num));
+            if (it != _by_num.end()) {
+                key = &it->second;
+            }
+        }
+    } else if (dir == DEV_BLOCK_DIR) {
+        auto it = _by_dev_name.find(name);
+        if (it != _by_dev_name.end()) {
+            key = &it->second;
+        }
+    }
+
+    if (!key || key->empty()) {
+        return {};
+    }
+
+    return _devices[*key].path;
+}
+
+}
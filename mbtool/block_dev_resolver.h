@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "initwrapper/devices.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Map of partition names and numbers to block devices
+ *
+ * In init, the map is fed by the uevents handled in initwrapper/devices.cpp.
+ * Other processes (the daemon, the switcher, the installer) fall back to
+ * reading /sys/class/block, which is done at most once per lookup that misses.
+ *
+ * Lookups are hash map lookups and do not touch the filesystem, so resolving
+ * the boot partition does not require probing every directory listed in the
+ * device definition.
+ */
+class BlockDevResolver
+{
+public:
+    BlockDevResolver();
+
+    BlockDevResolver(const BlockDevResolver &) = delete;
+    BlockDevResolver & operator=(const BlockDevResolver &) = delete;
+
+    void add_device(const std::string &sysfs_path, BlockDevInfo info);
+    void remove_device(const std::string &sysfs_path);
+
+    std::unordered_map<std::string, BlockDevInfo> devices();
+
+    std::string find_by_name(const std::string &name);
+    std::string find_by_num(int num);
+    std::string resolve(const std::vector<std::string> &paths);
+
+    static BlockDevResolver & global();
+
+private:
+    std::mutex _lock;
+    // sysfs path (relative to /sys) -> block device
+    std::unordered_map<std::string, BlockDevInfo> _devices;
+    // Indexes into _devices. They are rebuilt lazily after a change.
+    std::unordered_map<std::string, std::string> _by_name;
+    std::unordered_map<std::string, std::string> _by_dev_name;
+    std::unordered_map<int, std::string> _by_num;
+    bool _indexed;
+
+    void reindex();
+    bool scan_sysfs();
+    std::string lookup(const std::string &path);
+    std::string lookup_locked(const std::string &dir, const std::string &name);
+};
+
+}
@@ -34,26 +34,46 @@ typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 namespace mb
 {
 
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    const char *ptr = static_cast<const char *>(buf);
+    ssize_t n_written;
+
+    while (size > 0) {
+        n_written = write(fd, ptr, size);
+        if (n_written <= 0) {
+            LOGE("Failed to write data: %s", strerror(errno));
+            return false;
+        }
+
+        ptr += n_written;
+        size -= n_written;
+    }
+
+    return true;
+}
+
 bool bi_copy_data_to_fd(MbBiReader *bir, int fd)
 {
     int ret;
     char buf[BUF_SIZE];
+    const void *ptr;
     size_t n_read;
-    ssize_t n_written;
-    size_t remain;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
+    // Write straight from the image when the data is already in memory
+    while ((ret = mb_bi_reader_read_data_view(bir, &ptr, &n_read))
             == MB_BI_OK) {
-        remain = n_read;
+        if (!write_fully(fd, ptr, n_read)) {
+            return false;
+        }
+    }
 
-        while (remain > 0) {
-            n_written = write(fd, buf + (n_read - remain), remain);
-            if (n_written <= 0) {
-                LOGE("Failed to write data: %s", strerror(errno));
+    if (ret == MB_BI_UNSUPPORTED) {
+        while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
+                == MB_BI_OK) {
+            if (!write_fully(fd, buf, n_read)) {
                 return false;
             }
-
-            remain -= n_written;
         }
     }
 
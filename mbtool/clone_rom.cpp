@@ -0,0 +1,546 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "clone_rom.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include <rapidjson/document.h>
+#include <rapidjson/prettywriter.h>
+#include <rapidjson/stringbuffer.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/copy.h"
+#include "mbutil/delete.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/hash.h"
+#include "mbutil/path.h"
+#include "mbutil/string.h"
+
+#include "installer_util.h"
+#include "multiboot.h"
+#include "ramdisk_patcher.h"
+#include "rom_inventory.h"
+#include "switcher.h"
+
+#define DATA_SLOT_PREFIX        "data-slot-"
+
+// Files are reflinked where possible and copied otherwise
+#define CLONE_FLAGS             (util::COPY_ATTRIBUTES \
+                                | util::COPY_XATTRS \
+                                | util::COPY_EXCLUDE_TOP_LEVEL \
+                                | util::COPY_PARALLEL)
+
+namespace mb
+{
+
+/*!
+ * \brief Get the ID of the data slot a ROM should be cloned to
+ *
+ * \param id Data slot ID with or without the "data-slot-" prefix
+ *
+ * \return Full ROM ID or an empty string if \p id is not a valid slot name
+ */
+std::string clone_rom_target_id(const std::string &id)
+{
+    std::string name = mb::starts_with(id, DATA_SLOT_PREFIX)
+            ? id.substr(strlen(DATA_SLOT_PREFIX)) : id;
+
+    if (name.empty() || name == "." || name == ".."
+            || name.find('/') != std::string::npos) {
+        return std::string();
+    }
+
+    return DATA_SLOT_PREFIX + name;
+}
+
+/*!
+ * \brief Copy the contents of a directory, skipping some top-level entries
+ *
+ * If the source is the root of a partition (eg. the primary ROM's /data), the
+ * other ROMs and internal storage must not be copied along with it.
+ */
+static bool copy_tree(const std::string &source, const std::string &target,
+                      int flags, const std::vector<std::string> &exclusions)
+{
+    if (exclusions.empty()) {
+        return util::copy_dir(source, target, flags);
+    }
+
+    autoclose::dir dp(autoclose::opendir(source.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             source.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (mkdir(target.c_str(), 0771) < 0 && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!util::copy_stat(source, target)
+            || !util::copy_xattrs(source, target)) {
+        LOGE("%s: Failed to copy attributes: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct dirent *ent;
+    bool ret = true;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                || std::find(exclusions.begin(), exclusions.end(),
+                             ent->d_name) != exclusions.end()) {
+            continue;
+        }
+
+        std::string source_path(source);
+        source_path += '/';
+        source_path += ent->d_name;
+        std::string target_path(target);
+        target_path += '/';
+        target_path += ent->d_name;
+
+        struct stat sb;
+        if (lstat(source_path.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s",
+                 source_path.c_str(), strerror(errno));
+            ret = false;
+        } else if (S_ISDIR(sb.st_mode)) {
+            ret = util::copy_dir(source_path, target_path, flags) && ret;
+        } else {
+            ret = util::copy_file(source_path, target_path,
+                                  flags & ~util::COPY_PARALLEL) && ret;
+        }
+    }
+
+    return ret;
+}
+
+static std::vector<std::string> root_exclusions(const std::string &path,
+                                                Rom::Source source)
+{
+    if (path != Roms::get_mountpoint(source)) {
+        return {};
+    }
+
+    // Other ROMs, internal storage, and fsck leftovers
+    return { "lost+found", "media", "multiboot" };
+}
+
+/*!
+ * \brief Check the source boot image against its stored checksum
+ *
+ * The new boot image gets a checksum of its own, so an image that was
+ * modified behind mbtool's back must not be used as the base.
+ */
+static bool verify_boot_image(const std::shared_ptr<Rom> &rom,
+                              const std::string &path)
+{
+    std::unordered_map<std::string, std::string> props;
+    checksums_read(&props);
+
+    ChecksumAlgorithm algo;
+    std::string expected;
+
+    switch (checksums_get(&props, rom->id, "boot.img", &algo, &expected)) {
+    case ChecksumsGetResult::FOUND:
+        break;
+    case ChecksumsGetResult::NOT_FOUND:
+        LOGE("%s: Boot image has no checksum", rom->id.c_str());
+        return false;
+    case ChecksumsGetResult::MALFORMED:
+        return false;
+    }
+
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    bool ok = algo == ChecksumAlgorithm::SHA512_TREE
+            ? util::sha512_tree_hash(path, digest)
+            : util::sha512_hash(path, digest);
+    if (!ok) {
+        LOGE("%s: Failed to compute checksum: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (util::hex_string(digest, SHA512_DIGEST_LENGTH) != expected) {
+        LOGE("%s: Boot image checksum does not match", rom->id.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write the boot image for the clone and record its checksum
+ *
+ * The boot image is the source ROM's with the ROM ID in the ramdisk replaced.
+ */
+static bool clone_boot_image(const std::shared_ptr<Rom> &source,
+                             const std::shared_ptr<Rom> &target)
+{
+    std::string source_path = source->boot_image_path();
+    std::string target_path = target->boot_image_path();
+
+    std::vector<std::function<RamdiskPatcherFn>> rps;
+    rps.push_back(rp_write_rom_id(target->id));
+
+    if (!InstallerUtil::patch_boot_image(source_path, target_path, rps)) {
+        LOGE("%s: Failed to patch boot image", source_path.c_str());
+        return false;
+    }
+
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    if (!util::sha512_tree_hash(target_path, digest)) {
+        LOGE("%s: Failed to compute checksum: %s",
+             target_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::unordered_map<std::string, std::string> props;
+    checksums_read(&props);
+    checksums_update(&props, target->id, "boot.img",
+                     ChecksumAlgorithm::SHA512_TREE,
+                     util::hex_string(digest, SHA512_DIGEST_LENGTH));
+    return checksums_write(props);
+}
+
+/*!
+ * \brief Write the clone's config.json
+ *
+ * All settings are kept from the source ROM's config. Only the ID and name are
+ * changed.
+ */
+static bool clone_config(const std::shared_ptr<Rom> &source,
+                         const std::shared_ptr<Rom> &target,
+                         const std::string &name)
+{
+    std::vector<unsigned char> contents;
+    rapidjson::Document d;
+
+    if (util::file_read_all(source->config_path(), &contents)) {
+        contents.push_back('\0');
+        if (d.Parse(reinterpret_cast<const char *>(contents.data()))
+                .HasParseError() || !d.IsObject()) {
+            LOGW("%s: Invalid config, not copying it",
+                 source->config_path().c_str());
+            d.SetObject();
+        }
+    } else {
+        d.SetObject();
+    }
+
+    auto &alloc = d.GetAllocator();
+    auto set_string = [&](const char *key, const std::string &value) {
+        auto it = d.FindMember(key);
+        if (it != d.MemberEnd()) {
+            it->value.SetString(value.c_str(), value.size(), alloc);
+        } else {
+            d.AddMember(rapidjson::Value(key, alloc),
+                        rapidjson::Value(value.c_str(), value.size(), alloc),
+                        alloc);
+        }
+    };
+
+    set_string("id", target->id);
+
+    if (!name.empty()) {
+        set_string("name", name);
+    } else {
+        auto it = d.FindMember("name");
+        if (it != d.MemberEnd() && it->value.IsString()) {
+            std::string copy_name(it->value.GetString());
+            copy_name += " (copy)";
+            set_string("name", copy_name);
+        }
+    }
+
+    rapidjson::StringBuffer sb;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+    d.Accept(writer);
+
+    if (!util::file_write_data(target->config_path(), sb.GetString(),
+                               sb.GetSize())) {
+        LOGE("%s: Failed to write config: %s",
+             target->config_path().c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Clone an installed ROM to a new data slot
+ *
+ * Files are reflinked if the filesystem supports it and copied otherwise.
+ * Internal storage and other ROMs are never copied, even when cloning the
+ * primary ROM.
+ *
+ * If \p link_system is true, files in /system that can't be reflinked are hard
+ * linked to the source's instead. This saves space, but a file modified in
+ * place (eg. by a root app or a mod) then changes in both ROMs.
+ *
+ * The source ROM should not be running, otherwise its /data may be copied in
+ * an inconsistent state.
+ *
+ * \param source Installed ROM (without an image-based /system)
+ * \param target Data slot that is not installed yet
+ * \param name Name for the new ROM or empty to derive it from the source's
+ * \param link_system Whether to hard link /system files that can't be
+ *                    reflinked
+ *
+ * \return Whether the ROM was cloned. On failure, everything that was created
+ *         for the new ROM is deleted.
+ */
+bool clone_rom(const std::shared_ptr<Rom> &source,
+               const std::shared_ptr<Rom> &target,
+               const std::string &name, bool link_system)
+{
+    if (source->system_is_image) {
+        LOGE("%s: Cloning ROMs with an image-based /system is not supported",
+             source->id.c_str());
+        return false;
+    }
+
+    std::string target_multiboot(MULTIBOOT_DIR "/");
+    target_multiboot += target->id;
+
+    struct stat sb;
+    std::vector<std::string> target_paths{
+        target->full_system_path(),
+        target->full_cache_path(),
+        target->full_data_path(),
+        get_raw_path(target_multiboot),
+    };
+
+    for (auto const &path : target_paths) {
+        if (path.empty()) {
+            LOGE("%s: Failed to determine target paths", target->id.c_str());
+            return false;
+        } else if (lstat(path.c_str(), &sb) == 0) {
+            LOGE("%s: Target already exists", path.c_str());
+            errno = EEXIST;
+            return false;
+        }
+    }
+
+    std::string source_boot = source->boot_image_path();
+    if (stat(source_boot.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat boot image: %s",
+             source_boot.c_str(), strerror(errno));
+        return false;
+    }
+    if (!verify_boot_image(source, source_boot)) {
+        return false;
+    }
+
+    // Remove everything if any step fails
+    bool success = false;
+    auto cleanup = util::finally([&] {
+        if (!success) {
+            for (auto const &path : target_paths) {
+                util::delete_recursive(path, util::DELETE_PARALLEL);
+            }
+        }
+    });
+
+    for (auto const &path : target_paths) {
+        if (!util::mkdir_parent(path, 0771)) {
+            LOGE("%s: Failed to create parent directory: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    std::string source_system = source->full_system_path();
+    std::string source_cache = source->full_cache_path();
+    std::string source_data = source->full_data_path();
+
+    LOGV("Cloning %s to %s", source_system.c_str(),
+         target_paths[0].c_str());
+    int system_flags = CLONE_FLAGS;
+    if (link_system) {
+        system_flags |= util::COPY_LINK_UNCLONEABLE;
+    }
+
+    if (!copy_tree(source_system, target_paths[0], system_flags,
+                   root_exclusions(source_system, source->system_source))) {
+        LOGE("%s: Failed to clone /system", source->id.c_str());
+        return false;
+    }
+
+    if (lstat(source_cache.c_str(), &sb) == 0) {
+        LOGV("Cloning %s to %s", source_cache.c_str(),
+             target_paths[1].c_str());
+        if (!copy_tree(source_cache, target_paths[1], CLONE_FLAGS,
+                       root_exclusions(source_cache, source->cache_source))) {
+            LOGE("%s: Failed to clone /cache", source->id.c_str());
+            return false;
+        }
+    }
+
+    if (lstat(source_data.c_str(), &sb) == 0) {
+        LOGV("Cloning %s to %s", source_data.c_str(),
+             target_paths[2].c_str());
+        if (!copy_tree(source_data, target_paths[2], CLONE_FLAGS,
+                       root_exclusions(source_data, source->data_source))) {
+            LOGE("%s: Failed to clone /data", source->id.c_str());
+            return false;
+        }
+    }
+
+    if (mkdir(target_paths[3].c_str(), 0775) < 0) {
+        LOGE("%s: Failed to create directory: %s",
+             target_paths[3].c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!clone_boot_image(source, target)
+            || !clone_config(source, target, name)) {
+        return false;
+    }
+
+    std::string thumbnail = source->thumbnail_path();
+    if (stat(thumbnail.c_str(), &sb) == 0
+            && !util::copy_file(thumbnail, target->thumbnail_path(),
+                                util::COPY_ATTRIBUTES)) {
+        LOGW("%s: Failed to copy thumbnail", thumbnail.c_str());
+    }
+
+    fix_multiboot_permissions();
+
+    success = true;
+    return true;
+}
+
+static void clone_rom_usage(bool error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: clone-rom [OPTION...] <source ROM ID> <data slot ID>\n\n"
+            "Clones an installed ROM to a new data slot. The data slot ID may\n"
+            "be given with or without the \"data-slot-\" prefix.\n\n"
+            "Options:\n"
+            "  -n, --name <name>  Name of the new ROM\n"
+            "  --link-system      Hard link /system files that can't be\n"
+            "                     reflinked instead of copying them\n"
+            "  -h, --help         Display this help message\n");
+}
+
+int clone_rom_main(int argc, char *argv[])
+{
+    log::log_set_logger(std::make_shared<log::StdioLogger>(stdout, false));
+
+    std::string name;
+    bool link_system = false;
+
+    int opt;
+
+    enum {
+        OPT_LINK_SYSTEM = 1000,
+    };
+
+    static struct option long_options[] = {
+        {"name",        required_argument, 0, 'n'},
+        {"link-system", no_argument,       0, OPT_LINK_SYSTEM},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "n:h",
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'n':
+            name = optarg;
+            break;
+
+        case OPT_LINK_SYSTEM:
+            link_system = true;
+            break;
+
+        case 'h':
+            clone_rom_usage(false);
+            return EXIT_SUCCESS;
+
+        default:
+            clone_rom_usage(true);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        clone_rom_usage(true);
+        return EXIT_FAILURE;
+    }
+
+    auto source = RomInventory::global().find_by_id(argv[optind]);
+    if (!source) {
+        fprintf(stderr, "%s: ROM is not installed\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    std::string target_id = clone_rom_target_id(argv[optind + 1]);
+    auto target = target_id.empty()
+            ? std::shared_ptr<Rom>() : Roms::create_rom(target_id);
+    if (!target) {
+        fprintf(stderr, "%s: Invalid data slot ID\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+
+    auto current = Roms::get_current_rom();
+    if (current && current->id == source->id) {
+        LOGW("%s: Cloning the running ROM. Its /data may change while it is "
+             "being copied.", source->id.c_str());
+    }
+
+    if (!clone_rom(source, target, name, link_system)) {
+        fprintf(stderr, "Failed to clone %s to %s\n",
+                source->id.c_str(), target->id.c_str());
+        return EXIT_FAILURE;
+    }
+
+    printf("Cloned %s to %s\n", source->id.c_str(), target->id.c_str());
+    return EXIT_SUCCESS;
+}
+
+}
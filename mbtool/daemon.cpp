@@ -20,12 +20,21 @@
 #include "daemon.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <sys/epoll.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -40,6 +49,7 @@
 #include "mbutil/autoclose/file.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/path.h"
 #include "mbutil/process.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
@@ -50,12 +60,20 @@
 #include "roms.h"
 #include "sepolpatch.h"
 #include "validcerts.h"
+#include "wipe.h"
 
 #define RESPONSE_ALLOW "ALLOW"                  // Credentials allowed
 #define RESPONSE_DENY "DENY"                    // Credentials denied
 #define RESPONSE_OK "OK"                        // Generic accepted response
 #define RESPONSE_UNSUPPORTED "UNSUPPORTED"      // Generic unsupported response
 
+// Number of threads handling clients in event loop mode
+#define EVENT_WORKER_THREADS    4
+// Maximum number of events to handle per epoll_wait() call
+#define EVENT_MAX_EVENTS        16
+// Timeout for sending or receiving data once a client's message is ready
+#define EVENT_IO_TIMEOUT_S      30
+
 
 namespace mb
 {
@@ -67,6 +85,7 @@ static bool allow_root_client = false;
 static bool log_to_kmsg = false;
 static bool log_to_stdio = false;
 static bool no_unshare = false;
+static bool fork_per_connection = false;
 
 static autoclose::file log_fp(nullptr, std::fclose);
 
@@ -111,37 +130,70 @@ static bool verify_credentials(uid_t uid)
     return false;
 }
 
-static bool client_connection(int fd)
+/*!
+ * \brief Check the client's credentials and tell it whether it's allowed
+ */
+/*!
+ * \brief Cached version of verify_credentials()
+ *
+ * The results are reused until packages.xml changes.
+ */
+static bool verify_credentials_cached(uid_t uid)
 {
-    LOGD("Accepted connection from %d", fd);
+    static std::mutex lock;
+    static struct stat cached_sb;
+    static std::unordered_map<uid_t, bool> cache;
 
-    struct ucred cred;
+    struct stat sb;
+    bool have_sb = stat(PACKAGES_XML, &sb) == 0;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!have_sb || sb.st_dev != cached_sb.st_dev
+            || sb.st_ino != cached_sb.st_ino
+            || sb.st_size != cached_sb.st_size
+            || sb.st_mtim.tv_sec != cached_sb.st_mtim.tv_sec
+            || sb.st_mtim.tv_nsec != cached_sb.st_mtim.tv_nsec) {
+        cache.clear();
+    }
+
+    auto it = cache.find(uid);
+    if (it != cache.end()) {
+        LOGV("Using cached credentials check for UID %u", uid);
+        return it->second;
+    }
+
+    bool ret = verify_credentials(uid);
+
+    if (have_sb) {
+        cached_sb = sb;
+        cache[uid] = ret;
+    }
+
+    return ret;
+}
+
+static bool client_authenticate(int fd, struct ucred *cred)
+{
     socklen_t cred_len = sizeof(struct ucred);
 
-    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, cred, &cred_len) < 0) {
         LOGE("Failed to get socket credentials: %s", strerror(errno));
         return false;
     }
 
-    util::set_process_title_v(
-            nullptr, "mbtool connection from pid: %u", cred.pid);
-
-    LOGD("Client PID: %u", cred.pid);
-    LOGD("Client UID: %u", cred.uid);
-    LOGD("Client GID: %u", cred.gid);
-
-    auto disconnect_msg = util::finally([&]{
-        LOGD("Disconnecting connection from PID: %u", cred.pid);
-    });
+    LOGD("Client PID: %u", cred->pid);
+    LOGD("Client UID: %u", cred->uid);
+    LOGD("Client GID: %u", cred->gid);
 
-    if (allow_root_client && cred.uid == 0 && cred.gid == 0) {
+    if (allow_root_client && cred->uid == 0 && cred->gid == 0) {
         LOGV("Received connection from client with root UID and GID");
         LOGW("WARNING: Cannot verify signature of root client process");
         if (!util::socket_write_string(fd, RESPONSE_ALLOW)) {
             LOGE("Failed to send credentials allowed message");
             return false;
         }
-    } else if (verify_credentials(cred.uid)) {
+    } else if (verify_credentials_cached(cred->uid)) {
         if (!util::socket_write_string(fd, RESPONSE_ALLOW)) {
             LOGE("Failed to send credentials allowed message");
             return false;
@@ -153,6 +205,17 @@ static bool client_connection(int fd)
         return false;
     }
 
+    return true;
+}
+
+/*!
+ * \brief Read the client's interface version and tell it whether it's
+ *        supported
+ *
+ * \return Whether the client will speak protocol version 3
+ */
+static bool client_negotiate_version(int fd)
+{
     int32_t version;
     if (!util::socket_read_int32(fd, &version)) {
         LOGE("Failed to get interface version");
@@ -164,70 +227,411 @@ static bool client_connection(int fd)
         util::socket_write_string(fd, RESPONSE_UNSUPPORTED);
         return false;
     } else if (version == 3) {
-        if (!util::socket_write_string(fd, RESPONSE_OK)) {
-            return false;
-        }
-
-        connection_version_3(fd);
-        return true;
+        return util::socket_write_string(fd, RESPONSE_OK);
     } else {
         LOGE("Unsupported interface version: %d", version);
         util::socket_write_string(fd, RESPONSE_UNSUPPORTED);
         return false;
     }
+}
+
+static bool client_connection(int fd)
+{
+    LOGD("Accepted connection from %d", fd);
+
+    struct ucred cred;
+
+    if (!client_authenticate(fd, &cred)) {
+        return false;
+    }
+
+    util::set_process_title_v(
+            nullptr, "mbtool connection from pid: %u", cred.pid);
+
+    auto disconnect_msg = util::finally([&]{
+        LOGD("Disconnecting connection from PID: %u", cred.pid);
+    });
+
+    if (!client_negotiate_version(fd)) {
+        return false;
+    }
 
+    connection_version_3(fd);
     return true;
 }
 
-static bool run_daemon()
+/*!
+ * \brief Client connection served by the event loop
+ */
+struct EventClient
 {
+    enum class State
+    {
+        // Credentials have not been checked yet
+        Authenticate,
+        // Waiting for the interface version
+        Version,
+        // Handling protocol version 3 requests
+        Requests,
+    };
+
     int fd;
-    struct sockaddr_un addr;
+    State state = State::Authenticate;
+    struct ucred cred = {};
+    bool registered = false;
+    std::unique_ptr<V3Connection> conn;
 
-    fd = socket(AF_LOCAL, SOCK_STREAM, 0);
-    if (fd < 0) {
-        LOGE("Failed to create socket: %s", strerror(errno));
-        return false;
+    explicit EventClient(int fd) : fd(fd)
+    {
     }
 
-    auto close_fd = util::finally([&] {
+    ~EventClient()
+    {
+        // Close files opened by the client before closing the socket
+        conn.reset();
         close(fd);
-    });
+    }
 
-    char abs_name[] = "\0mbtool.daemon";
-    size_t abs_name_len = sizeof(abs_name) - 1;
+    EventClient(const EventClient &) = delete;
+    EventClient & operator=(const EventClient &) = delete;
+};
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_LOCAL;
-    memcpy(addr.sun_path, abs_name, abs_name_len);
+/*!
+ * \brief Serves all connections from one process
+ *
+ * The main thread waits for sockets to become readable and hands them to a
+ * pool of worker threads, which perform the (blocking) handshake and request
+ * handling. Every client is registered with EPOLLONESHOT, so at most one worker
+ * handles a given client at a time and its V3Connection needs no locking.
+ *
+ * Requests that may take a long time (eg. cloning a ROM) would starve the other
+ * clients if they ran on a worker, so V3Connection handles them on a separate
+ * thread. The client is not re-armed until that thread is done. Destroying a
+ * connection that still has requests running on other threads blocks, so those
+ * connections are destroyed by a separate reaper thread.
+ */
+class EventDaemon
+{
+public:
+    explicit EventDaemon(int listen_fd) : _listen_fd(listen_fd)
+    {
+    }
 
-    // Calculate correct length so the trailing junk is not included in the
-    // abstract socket name
-    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abs_name_len;
+    ~EventDaemon()
+    {
+        stop_workers();
+        if (_epoll_fd >= 0) {
+            close(_epoll_fd);
+        }
+    }
 
-    if (bind(fd, (struct sockaddr *) &addr, addr_len) < 0) {
-        LOGE("Failed to bind socket: %s", strerror(errno));
-        LOGE("Is another instance running?");
-        return false;
+    EventDaemon(const EventDaemon &) = delete;
+    EventDaemon & operator=(const EventDaemon &) = delete;
+
+    bool run()
+    {
+        _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epoll_fd < 0) {
+            LOGE("Failed to create epoll fd: %s", strerror(errno));
+            return false;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _listen_fd, &ev) < 0) {
+            LOGE("Failed to add socket to epoll fd: %s", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < EVENT_WORKER_THREADS; ++i) {
+            _threads.emplace_back(&EventDaemon::worker, this);
+        }
+        _reaper = std::thread(&EventDaemon::reaper, this);
+
+        struct epoll_event events[EVENT_MAX_EVENTS];
+
+        while (true) {
+            int n = epoll_wait(_epoll_fd, events, EVENT_MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("Failed to wait for events: %s", strerror(errno));
+                return false;
+            }
+
+            for (int i = 0; i < n; ++i) {
+                auto *client = static_cast<EventClient *>(events[i].data.ptr);
+
+                if (!client) {
+                    if (!accept_client()) {
+                        return false;
+                    }
+                } else {
+                    enqueue(client);
+                }
+            }
+        }
     }
 
-    if (listen(fd, 3) < 0) {
-        LOGE("Failed to listen on socket: %s", strerror(errno));
-        return false;
+private:
+    int _listen_fd;
+    int _epoll_fd = -1;
+    std::vector<std::thread> _threads;
+    std::thread _reaper;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::deque<EventClient *> _queue;
+    // Clients to be destroyed by the reaper thread
+    std::condition_variable _reap_cv;
+    std::deque<EventClient *> _reap_queue;
+    // Number of clients whose requests are handled on a separate thread
+    std::condition_variable _deferred_cv;
+    unsigned int _deferred_count = 0;
+    bool _stop = false;
+
+    bool accept_client()
+    {
+        int client_fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN) {
+                return true;
+            }
+            LOGE("Failed to accept connection on socket: %s", strerror(errno));
+            return false;
+        }
+
+        LOGD("Accepted connection from %d", client_fd);
+
+        // Don't let a client that stops in the middle of a message hold on to
+        // a worker forever
+        struct timeval tv = {};
+        tv.tv_sec = EVENT_IO_TIMEOUT_S;
+
+        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
+                || setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO,
+                              &tv, sizeof(tv)) < 0) {
+            LOGW("Failed to set socket timeouts: %s", strerror(errno));
+        }
+
+        // The client is registered with epoll once a worker has sent the
+        // credentials response
+        enqueue(new EventClient(client_fd));
+        return true;
     }
 
-    // Let parent process know that we're ready if we're forking the daemon
-    if (send_ok_to_pipe) {
-        ssize_t n = write(pipe_fds[1], "", 1);
-        close(pipe_fds[1]);
-        if (n < 0) {
-            LOGE("Failed to send OK to parent process");
+    void enqueue(EventClient *client)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _queue.push_back(client);
+        }
+        _cv.notify_one();
+    }
+
+    void stop_workers()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _stop = true;
+
+            // Deferred requests use the queues when they are done
+            _deferred_cv.wait(lock, [&] {
+                return _deferred_count == 0;
+            });
+        }
+        _cv.notify_all();
+        _reap_cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+        _threads.clear();
+
+        if (_reaper.joinable()) {
+            _reaper.join();
+        }
+
+        for (EventClient *client : _queue) {
+            delete client;
+        }
+        _queue.clear();
+    }
+
+    void worker()
+    {
+        while (true) {
+            EventClient *client;
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+                _cv.wait(lock, [&] {
+                    return _stop || !_queue.empty();
+                });
+                if (_stop) {
+                    return;
+                }
+                client = _queue.front();
+                _queue.pop_front();
+            }
+
+            switch (handle_client(*client)) {
+            case V3Connection::HandleResult::Ok:
+                if (!rearm(*client)) {
+                    disconnect(client);
+                }
+                break;
+            case V3Connection::HandleResult::Deferred:
+                // resume() takes over once the request is done
+                break;
+            case V3Connection::HandleResult::Failed:
+                disconnect(client);
+                break;
+            }
+        }
+    }
+
+    void reaper()
+    {
+        while (true) {
+            EventClient *client;
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+                _reap_cv.wait(lock, [&] {
+                    return _stop || !_reap_queue.empty();
+                });
+                if (_reap_queue.empty()) {
+                    return;
+                }
+                client = _reap_queue.front();
+                _reap_queue.pop_front();
+            }
+
+            // Joins the threads still handling the client's requests
+            delete client;
+        }
+    }
+
+    V3Connection::HandleResult handle_client(EventClient &client)
+    {
+        switch (client.state) {
+        case EventClient::State::Authenticate:
+            if (!client_authenticate(client.fd, &client.cred)) {
+                return V3Connection::HandleResult::Failed;
+            }
+            client.state = EventClient::State::Version;
+            return V3Connection::HandleResult::Ok;
+
+        case EventClient::State::Version:
+            if (!client_negotiate_version(client.fd)) {
+                return V3Connection::HandleResult::Failed;
+            }
+            client.conn.reset(new V3Connection(client.fd));
+            client.conn->set_deferred_callback([this, &client](bool success) {
+                resume(client, success);
+            });
+            client.state = EventClient::State::Requests;
+            return V3Connection::HandleResult::Ok;
+
+        case EventClient::State::Requests:
+            // The socket won't become readable again for requests that have
+            // already been received
+            do {
+                // Counted beforehand since a deferred request may finish
+                // before handle_request() returns
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    ++_deferred_count;
+                }
+
+                auto result = client.conn->handle_request();
+
+                if (result != V3Connection::HandleResult::Deferred) {
+                    {
+                        std::lock_guard<std::mutex> guard(_lock);
+                        --_deferred_count;
+                    }
+                    _deferred_cv.notify_all();
+                }
+                if (result != V3Connection::HandleResult::Ok) {
+                    return result;
+                }
+            } while (client.conn->has_pending_data());
+            return V3Connection::HandleResult::Ok;
+        }
+
+        return V3Connection::HandleResult::Failed;
+    }
+
+    /*!
+     * \brief Continue serving a client after a deferred request is done
+     *
+     * This is called on the thread that handled the request.
+     */
+    void resume(EventClient &client, bool success)
+    {
+        if (!success) {
+            disconnect(&client);
+        } else if (client.conn->has_pending_data()) {
+            enqueue(&client);
+        } else if (!rearm(client)) {
+            disconnect(&client);
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            --_deferred_count;
+        }
+        _deferred_cv.notify_all();
+    }
+
+    void disconnect(EventClient *client)
+    {
+        if (client->registered) {
+            epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+        }
+        if (client->state != EventClient::State::Authenticate) {
+            LOGD("Disconnecting connection from PID: %u", client->cred.pid);
+        }
+
+        // Don't block a worker while other threads finish the client's
+        // requests
+        if (client->conn && client->conn->has_async_requests()) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _reap_queue.push_back(client);
+            }
+            _reap_cv.notify_one();
+        } else {
+            delete client;
+        }
+    }
+
+    bool rearm(EventClient &client)
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = &client;
+
+        int op = client.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(_epoll_fd, op, client.fd, &ev) < 0) {
+            LOGE("Failed to wait for client events: %s", strerror(errno));
             return false;
         }
-    } else if (sigstop_when_ready) {
-        kill(getpid(), SIGSTOP);
+
+        client.registered = true;
+        return true;
     }
+};
 
+/*!
+ * \brief Serve connections by forking a child process for each one
+ */
+static bool run_fork_per_connection(int fd)
+{
     // Eat zombies!
     // SIG_IGN reaps zombie processes (it's not just a dummy function)
     struct sigaction sa;
@@ -297,6 +701,97 @@ static bool run_daemon()
     return true;
 }
 
+/*!
+ * \brief Serve all connections from this process
+ */
+static bool run_event_loop(int fd)
+{
+    // Connections share this process' mount namespace, so keep their mounts
+    // from propagating back to the namespace that the daemon was started in
+    if (!no_unshare && mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
+        LOGE("Failed to set private mount propagation: %s", strerror(errno));
+        return false;
+    }
+
+    // A client disconnecting during a write must not kill the whole daemon
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGPIPE, &sa, 0) < 0) {
+        LOGE("Failed to set SIGPIPE handler: %s", strerror(errno));
+        return false;
+    }
+
+    LOGD("Socket ready, waiting for connections");
+
+    EventDaemon daemon(fd);
+    return daemon.run();
+}
+
+static bool run_daemon()
+{
+    int fd;
+    struct sockaddr_un addr;
+
+    fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOGE("Failed to create socket: %s", strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        close(fd);
+    });
+
+    char abs_name[] = "\0mbtool.daemon";
+    size_t abs_name_len = sizeof(abs_name) - 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    memcpy(addr.sun_path, abs_name, abs_name_len);
+
+    // Calculate correct length so the trailing junk is not included in the
+    // abstract socket name
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abs_name_len;
+
+    if (bind(fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        LOGE("Failed to bind socket: %s", strerror(errno));
+        LOGE("Is another instance running?");
+        return false;
+    }
+
+    if (listen(fd, 3) < 0) {
+        LOGE("Failed to listen on socket: %s", strerror(errno));
+        return false;
+    }
+
+    // Let parent process know that we're ready if we're forking the daemon
+    if (send_ok_to_pipe) {
+        ssize_t n = write(pipe_fds[1], "", 1);
+        close(pipe_fds[1]);
+        if (n < 0) {
+            LOGE("Failed to send OK to parent process");
+            return false;
+        }
+    } else if (sigstop_when_ready) {
+        kill(getpid(), SIGSTOP);
+    }
+
+    // Finish background wipes that were interrupted (eg. by a reboot)
+    std::vector<std::string> trash;
+    add_leftover_trash(&trash);
+    if (!delete_trash_in_background(trash)) {
+        LOGW("Failed to delete leftover trash");
+    }
+
+    if (fork_per_connection) {
+        return run_fork_per_connection(fd);
+    } else {
+        return run_event_loop(fd);
+    }
+}
+
 static bool redirect_stdio_to_dev_null()
 {
     bool ret = true;
@@ -462,7 +957,10 @@ static void daemon_usage(bool error)
             "                   fully initialized\n"
             "  --log-to-kmsg    Send log output to kernel log instead of file\n"
             "  --log-to-stdio   Send log output to stdout/stderr\n"
-            "  --no-unshare     Don't unshare mount namespace\n");
+            "  --no-unshare     Don't unshare mount namespace\n"
+            "  --fork-per-connection\n"
+            "                   Handle each connection in a separate process\n"
+            "                   instead of serving all of them from one process\n");
 }
 
 int daemon_main(int argc, char *argv[])
@@ -479,6 +977,7 @@ int daemon_main(int argc, char *argv[])
         OPT_LOG_TO_KMSG = 1003,
         OPT_LOG_TO_STDIO = 1004,
         OPT_NO_UNSHARE = 1005,
+        OPT_FORK_PER_CONNECTION = 1006,
     };
 
     static struct option long_options[] = {
@@ -491,6 +990,7 @@ int daemon_main(int argc, char *argv[])
         {"log-to-kmsg",        no_argument, 0, OPT_LOG_TO_KMSG},
         {"log-to-stdio",       no_argument, 0, OPT_LOG_TO_STDIO},
         {"no-unshare",         no_argument, 0, OPT_NO_UNSHARE},
+        {"fork-per-connection", no_argument, 0, OPT_FORK_PER_CONNECTION},
         {0, 0, 0, 0}
     };
 
@@ -534,6 +1034,10 @@ int daemon_main(int argc, char *argv[])
             no_unshare = true;
             break;
 
+        case OPT_FORK_PER_CONNECTION:
+            fork_per_connection = true;
+            break;
+
         default:
             daemon_usage(1);
             return EXIT_FAILURE;
@@ -552,7 +1056,14 @@ int daemon_main(int argc, char *argv[])
     }
 
     if (patch_sepolicy) {
-        patch_loaded_sepolicy(SELinuxPatch::MAIN);
+        // Reuse the policy patched on a previous boot if it hasn't changed
+        std::string cache_dir;
+        auto rom = Roms::get_current_rom();
+        if (rom) {
+            cache_dir = util::dir_name(rom->config_path());
+        }
+
+        patch_loaded_sepolicy(SELinuxPatch::MAIN, cache_dir);
     }
 
     if (!switch_context(MB_EXEC_CONTEXT)) {
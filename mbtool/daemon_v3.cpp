@@ -19,15 +19,24 @@
 
 #include "daemon_v3.h"
 
-#include <unordered_map>
-#include <unordered_set>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <cassert>
+#include <ctime>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "mbcommon/alloc_profiler.h"
+#include "mbcommon/metrics.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
@@ -35,17 +44,21 @@
 #include "mbutil/copy.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
+#include "clone_rom.h"
+#include "directory_size.h"
 #include "init.h"
 #include "packages.h"
 #include "reboot.h"
+#include "rom_inventory.h"
 #include "roms.h"
 #include "signature.h"
 #include "switcher.h"
@@ -61,50 +74,165 @@ namespace mb
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
-static std::unordered_map<int, int> fd_map;
-static int fd_count = 0;
+// The temp directory used for SignedExec is shared by all connections handled
+// by the same process
+static std::mutex signed_exec_lock;
+
+// Maximum number of requests per connection handled out of order at a time
+#define MAX_ASYNC_REQUESTS      4
+
+// Initial size of the reused response builders
+#define RESPONSE_BUILDER_SIZE   (16 * 1024)
+// Builders that grew larger than this for a response (eg. for FileRead) are
+// freed instead of being reused
+#define RESPONSE_BUILDER_MAX_SIZE (1024 * 1024)
+
+/*!
+ * \brief Destination of the responses to the request being handled
+ *
+ * The sink is passed to every handler and all responses are sent to it with
+ * v3_send_response(), so the handlers don't need to know whether they were
+ * called as part of a batch or out of order.
+ */
+struct ResponseSink
+{
+    V3Connection *conn;
+    // ID to tag the responses with (0 if they should not be tagged)
+    uint64_t id;
+    // If non-null, the responses are collected for a BatchResponse instead of
+    // being sent
+    std::vector<std::vector<uint8_t>> *batch;
+    // Response builder owned by the thread handling the request
+    std::unique_ptr<fb::FlatBufferBuilder> *builder;
+};
+
+/*!
+ * \brief Latency of the requests handled by this process (per request type)
+ */
+struct RequestStats
+{
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total_time_ns{0};
+    std::atomic<uint64_t> max_time_ns{0};
+};
+
+static RequestStats request_stats[v3::RequestType_MAX + 1];
+
+static void record_request_time(v3::RequestType type, uint64_t time_ns)
+{
+    // Distribution across all request types
+    static Histogram &histogram =
+            MetricsRegistry::global().histogram("daemon.request_us");
+    histogram.record(time_ns / 1000);
+
+    RequestStats &stats = request_stats[type];
+
+    ++stats.count;
+    stats.total_time_ns += time_ns;
+
+    uint64_t max = stats.max_time_ns;
+    while (time_ns > max
+            && !stats.max_time_ns.compare_exchange_weak(max, time_ns)) {
+        // Retry with the updated value
+    }
+}
+
+/*!
+ * \brief Get the reusable response builder for a sink
+ *
+ * The builder is cleared before it is returned, so it must not be used past
+ * the v3_send_response() call for the response it was used for.
+ */
+static fb::FlatBufferBuilder & v3_builder(ResponseSink &sink)
+{
+    std::unique_ptr<fb::FlatBufferBuilder> &builder = *sink.builder;
+
+    if (!builder || builder->GetSize() > RESPONSE_BUILDER_MAX_SIZE) {
+        builder.reset(new fb::FlatBufferBuilder(RESPONSE_BUILDER_SIZE));
+    } else {
+        builder->Clear();
+    }
+
+    return *builder;
+}
+
+/*!
+ * \brief Whether file descriptors can be sent along with responses to a sink
+ *
+ * Responses collected for a BatchResponse are not sent immediately, so there
+ * is nothing to attach the file descriptors to.
+ */
+static bool v3_can_send_fds(const ResponseSink &sink)
+{
+    return !sink.batch;
+}
 
-static bool v3_send_response(int fd, const fb::FlatBufferBuilder &builder)
+/*!
+ * \brief Send a response
+ *
+ * If \p fds is not null, the file descriptors are sent with socket_send_fds()
+ * directly after the response. The caller must check v3_can_send_fds() first.
+ */
+static bool v3_send_response(ResponseSink &sink,
+                             const fb::FlatBufferBuilder &builder,
+                             const std::vector<int> *fds = nullptr)
 {
-    return util::socket_write_bytes(
-            fd, builder.GetBufferPointer(), builder.GetSize());
+    const uint8_t *data = builder.GetBufferPointer();
+    size_t size = builder.GetSize();
+
+    if (sink.batch) {
+        assert(!fds);
+        sink.batch->emplace_back(data, data + size);
+        return true;
+    } else if (sink.id != 0) {
+        fb::FlatBufferBuilder tagged;
+        auto response = v3::CreateTaggedResponse(
+                tagged, sink.id, tagged.CreateVector(data, size));
+        tagged.Finish(v3::CreateResponse(
+                tagged, v3::ResponseType_TaggedResponse, response.Union()));
+        return sink.conn->send(tagged.GetBufferPointer(), tagged.GetSize(),
+                               fds);
+    } else {
+        return sink.conn->send(data, size, fds);
+    }
 }
 
-static bool v3_send_response_invalid(int fd)
+static bool v3_send_response_invalid(ResponseSink &sink)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Invalid,
                                        v3::CreateInvalid(builder).Union());
     builder.Finish(response);
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_send_response_unsupported(int fd)
+static bool v3_send_response_unsupported(ResponseSink &sink)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Unsupported,
                                        v3::CreateUnsupported(builder).Union());
     builder.Finish(response);
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_chmod(int fd, const v3::Request *msg)
+static bool v3_file_chmod(V3Connection &conn, ResponseSink &sink,
+                          const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileChmodRequest *>(msg->request());
-    if (fd_map.find(request->id()) == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    if (conn.fd_map.find(request->id()) == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
-    int ffd = fd_map[request->id()];
+    int ffd = conn.fd_map[request->id()];
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileChmodError> error;
 
     bool ret = fchmod(ffd, mode) == 0;
@@ -122,22 +250,23 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileChmodResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_close(int fd, const v3::Request *msg)
+static bool v3_file_close(V3Connection &conn, ResponseSink &sink,
+                          const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileCloseRequest *>(msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
     // Remove ID from map
     int ffd = it->second;
-    fd_map.erase(it);
+    conn.fd_map.erase(it);
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileCloseError> error;
 
     bool ret = close(ffd) == 0;
@@ -155,14 +284,15 @@ static bool v3_file_close(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileCloseResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_open(int fd, const v3::Request *msg)
+static bool v3_file_open(V3Connection &conn, ResponseSink &sink,
+                         const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileOpenRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     int flags = O_CLOEXEC;
@@ -187,17 +317,24 @@ static bool v3_file_open(int fd, const v3::Request *msg)
         }
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileOpenError> error;
     int id = -1;
+    bool fd_sent = false;
 
     int ffd = open(request->path()->c_str(), flags, request->perms());
     int saved_errno = errno;
 
     if (ffd >= 0) {
-        // Assign a new ID
-        id = fd_count++;
-        fd_map[id] = ffd;
+        if (request->send_fd() && v3_can_send_fds(sink)) {
+            // The client reads and writes the file directly, so there's no
+            // need to keep track of it here
+            fd_sent = true;
+        } else {
+            // Assign a new ID
+            id = conn.fd_count++;
+            conn.fd_map[id] = ffd;
+        }
     } else {
         error = v3::CreateFileOpenErrorDirect(
                 builder, saved_errno, strerror(saved_errno));
@@ -205,28 +342,36 @@ static bool v3_file_open(int fd, const v3::Request *msg)
 
     auto response = v3::CreateFileOpenResponseDirect(
             builder, ffd >= 0, ffd >= 0 ? nullptr : strerror(saved_errno), id,
-            error);
+            error, fd_sent);
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileOpenResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    if (fd_sent) {
+        std::vector<int> fds{ffd};
+        bool ret = v3_send_response(sink, builder, &fds);
+        close(ffd);
+        return ret;
+    }
+
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_read(int fd, const v3::Request *msg)
+static bool v3_file_read(V3Connection &conn, ResponseSink &sink,
+                         const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileReadRequest *>(msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
 
     std::vector<unsigned char> buf(request->count());
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileReadError> error;
     fb::Offset<fb::Vector<unsigned char>> data;
 
@@ -249,15 +394,16 @@ static bool v3_file_read(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileReadResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_seek(int fd, const v3::Request *msg)
+static bool v3_file_seek(V3Connection &conn, ResponseSink &sink,
+                         const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileSeekRequest *>(msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
@@ -271,10 +417,10 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     } else if (request->whence() == v3::FileSeekWhence_SEEK_END) {
         whence = SEEK_END;
     } else {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileSeekError> error;
 
     // Ahh, posix...
@@ -296,21 +442,22 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileSeekResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
+static bool v3_file_selinux_get_label(V3Connection &conn, ResponseSink &sink,
+                                      const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileSELinuxGetLabelRequest *>(
             msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileSELinuxGetLabelError> error;
     std::string label;
 
@@ -331,21 +478,22 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
+static bool v3_file_selinux_set_label(V3Connection &conn, ResponseSink &sink,
+                                      const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileSELinuxSetLabelRequest *>(
             msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end() || !request->label()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end() || !request->label()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileSELinuxSetLabelError> error;
 
     bool ret = util::selinux_fset_context(ffd, request->label()->c_str());
@@ -364,20 +512,21 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
             builder, v3::ResponseType_FileSELinuxSetLabelResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_stat(int fd, const v3::Request *msg)
+static bool v3_file_stat(V3Connection &conn, ResponseSink &sink,
+                         const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileStatRequest *>(msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileStatError> error;
     fb::Offset<v3::StructStat> statbuf;
     struct stat sb;
@@ -414,20 +563,21 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileStatResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_file_write(int fd, const v3::Request *msg)
+static bool v3_file_write(V3Connection &conn, ResponseSink &sink,
+                          const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileWriteRequest *>(msg->request());
-    auto it = fd_map.find(request->id());
-    if (it == fd_map.end() || !request->data()) {
-        return v3_send_response_invalid(fd);
+    auto it = conn.fd_map.find(request->id());
+    if (it == conn.fd_map.end() || !request->data()) {
+        return v3_send_response_invalid(sink);
     }
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::FileWriteError> error;
 
     ssize_t ret = write(ffd, request->data()->Data(), request->data()->size());
@@ -446,24 +596,27 @@ static bool v3_file_write(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileWriteResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_chmod(int fd, const v3::Request *msg)
+static bool v3_path_chmod(V3Connection &conn, ResponseSink &sink,
+                          const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathChmodRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathChmodError> error;
 
     bool ret = chmod(request->path()->c_str(), mode) == 0;
@@ -481,17 +634,20 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathChmodResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_copy(int fd, const v3::Request *msg)
+static bool v3_path_copy(V3Connection &conn, ResponseSink &sink,
+                         const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathCopyRequest *>(msg->request());
     if (!request->source() || !request->target()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathCopyError> error;
 
     bool ret = util::copy_contents(
@@ -510,14 +666,17 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathCopyResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_delete(int fd, const v3::Request *msg)
+static bool v3_path_delete(V3Connection &conn, ResponseSink &sink,
+                           const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathDeleteRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     bool ret;
@@ -541,10 +700,10 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
         saved_errno = errno;
         break;
     default:
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathDeleteError> error;
 
     if (!ret) {
@@ -559,24 +718,27 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathDeleteResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_mkdir(int fd, const v3::Request *msg)
+static bool v3_path_mkdir(V3Connection &conn, ResponseSink &sink,
+                          const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathMkdirRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathMkdirError> error;
 
     bool ret;
@@ -599,21 +761,24 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathMkdirResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_readlink(int fd, const v3::Request *msg)
+static bool v3_path_readlink(V3Connection &conn, ResponseSink &sink,
+                             const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathReadlinkRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     std::string target;
     bool ret = util::read_link(request->path()->c_str(), &target);
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathReadlinkError> error;
 
     if (!ret) {
@@ -628,15 +793,18 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathReadlinkResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
+static bool v3_path_selinux_get_label(V3Connection &conn, ResponseSink &sink,
+                                      const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathSELinuxGetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     std::string label;
@@ -648,7 +816,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     }
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathSELinuxGetLabelError> error;
 
     if (!ret) {
@@ -665,15 +833,18 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
+static bool v3_path_selinux_set_label(V3Connection &conn, ResponseSink &sink,
+                                      const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathSELinuxSetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     bool ret;
@@ -686,7 +857,7 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     }
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathSELinuxSetLabelError> error;
 
     if (!ret) {
@@ -702,64 +873,18 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
             builder, v3::ResponseType_PathSELinuxSetLabelResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-class DirectorySizeGetter : public util::FTSWrapper {
-public:
-    DirectorySizeGetter(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions)),
-        _total(0)
-    {
-    }
-
-    virtual int on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_file() override
-    {
-        dev_t dev = _curr->fts_statp->st_dev;
-        ino_t ino = _curr->fts_statp->st_ino;
-
-        // If this file has been visited before (hard link), then skip it
-        if (_links.find(dev) != _links.end()
-                && _links[dev].find(ino) != _links[dev].end()) {
-            return Action::FTS_OK;
-        }
-
-        _total += _curr->fts_statp->st_size;
-        _links[dev].emplace(ino);
-
-        return Action::FTS_OK;
-    }
-
-    uint64_t total() const {
-        return _total;
-    }
-
-private:
-    std::vector<std::string> _exclusions;
-    std::unordered_map<dev_t, std::unordered_set<ino_t>> _links;
-    uint64_t _total;
-};
-
-static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
+static bool v3_path_get_directory_size(V3Connection &conn, ResponseSink &sink,
+                                       const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::PathGetDirectorySizeRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     std::vector<std::string> exclusions;
@@ -769,11 +894,11 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
         }
     }
 
-    DirectorySizeGetter dsg(request->path()->c_str(), std::move(exclusions));
-    bool ret = dsg.run();
+    uint64_t size = 0;
+    bool ret = get_directory_size(request->path()->c_str(), exclusions, &size);
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::PathGetDirectorySizeError> error;
 
     if (!ret) {
@@ -782,7 +907,7 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     }
 
     auto response = v3::CreatePathGetDirectorySizeResponseDirect(
-            builder, ret, ret ? nullptr : strerror(saved_errno), dsg.total(),
+            builder, ret, ret ? nullptr : strerror(saved_errno), size,
             error);
 
     // Wrap response
@@ -790,17 +915,17 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
             builder, v3::ResponseType_PathGetDirectorySizeResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
 static void signed_exec_output_cb(const char *line, bool error, void *userdata)
 {
     (void) error;
 
-    int *fd_ptr = (int *) userdata;
+    ResponseSink *sink = static_cast<ResponseSink *>(userdata);
     // TODO: Send line
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(*sink);
     fb::Offset<fb::String> line_id = builder.CreateString(line);
 
     // Create response
@@ -811,21 +936,173 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
             builder, v3::ResponseType_SignedExecOutputResponse,
             response.Union()));
 
-    if (!v3_send_response(*fd_ptr, builder)) {
+    if (!v3_send_response(*sink, builder)) {
         // Can't kill the connection from this callback (yet...)
         LOGE("Failed to send output line: %s", strerror(errno));
     }
 }
 
-static bool v3_signed_exec(int fd, const v3::Request *msg)
+// Not in older kernel headers
+#ifndef MFD_CLOEXEC
+#  define MFD_CLOEXEC           0x0001U
+#endif
+#ifndef MFD_ALLOW_SEALING
+#  define MFD_ALLOW_SEALING     0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#  define F_ADD_SEALS           (1024 + 9)
+#endif
+#ifndef F_SEAL_SEAL
+#  define F_SEAL_SEAL           0x0001
+#  define F_SEAL_SHRINK         0x0002
+#  define F_SEAL_GROW           0x0004
+#  define F_SEAL_WRITE          0x0008
+#endif
+
+static int signed_exec_memfd_create(const char *name, unsigned int flags)
+{
+#ifdef __NR_memfd_create
+    return static_cast<int>(syscall(__NR_memfd_create, name, flags));
+#else
+    (void) name;
+    (void) flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*!
+ * \brief Load and verify a binary in a sealed memfd
+ *
+ * The binary is copied into a memfd, which is sealed against all further
+ * modifications before the signature is checked. The verified bytes are
+ * therefore exactly the bytes that are executed. The contents are verified
+ * through a read-only mapping, so they are not copied again.
+ *
+ * \param[out] fd_out Sealed memfd containing the verified binary
+ * \param[out] unsupported Whether the kernel does not support memfds, in
+ *                         which case the caller should fall back to tmpfs
+ *
+ * \return Whether the binary was loaded and has a valid signature
+ */
+static bool signed_exec_load_memfd(const char *binary_path,
+                                   const char *sig_path, int *fd_out,
+                                   bool *unsupported,
+                                   v3::SignedExecResult &result,
+                                   std::string &error_msg)
+{
+    *unsupported = false;
+    result = v3::SignedExecResult_OTHER_ERROR;
+
+    int memfd = signed_exec_memfd_create("mbtool-signed-exec",
+                                         MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        if (errno == ENOSYS || errno == EINVAL) {
+            *unsupported = true;
+            return false;
+        }
+        mb::format(error_msg, "Failed to create memfd: %s", strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    auto close_memfd = util::finally([&]{
+        if (memfd >= 0) {
+            close(memfd);
+        }
+    });
+
+    int source_fd = open(binary_path, O_RDONLY | O_CLOEXEC);
+    if (source_fd < 0) {
+        mb::format(error_msg, "%s: Failed to open binary: %s",
+                   binary_path, strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    bool copied = util::copy_data_fd(source_fd, memfd);
+    int saved_errno = errno;
+    close(source_fd);
+
+    if (!copied) {
+        mb::format(error_msg, "%s: Failed to copy binary to memfd: %s",
+                   binary_path, strerror(saved_errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+            | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        mb::format(error_msg, "Failed to seal memfd: %s", strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(memfd, &sb) < 0) {
+        mb::format(error_msg, "Failed to stat memfd: %s", strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    } else if (sb.st_size == 0) {
+        result = v3::SignedExecResult_INVALID_SIGNATURE;
+        mb::format(error_msg, "%s: Binary is empty", binary_path);
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> sig;
+    if (!util::file_read_all(sig_path, &sig)) {
+        mb::format(error_msg, "%s: Failed to read signature: %s",
+                   sig_path, strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    void *map = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, memfd, 0);
+    if (map == MAP_FAILED) {
+        mb::format(error_msg, "Failed to map memfd: %s", strerror(errno));
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    SigVerifyResult sig_result = verify_signature_data(
+            map, sb.st_size, sig.data(), sig.size());
+
+    munmap(map, sb.st_size);
+
+    if (sig_result != SigVerifyResult::VALID) {
+        if (sig_result == SigVerifyResult::INVALID) {
+            result = v3::SignedExecResult_INVALID_SIGNATURE;
+            mb::format(error_msg, "%s: Invalid signature", binary_path);
+        } else {
+            mb::format(error_msg, "%s: Failed to verify signature",
+                       binary_path);
+        }
+
+        LOGE("%s", error_msg.c_str());
+        return false;
+    }
+
+    *fd_out = memfd;
+    memfd = -1;
+    return true;
+}
+
+static bool v3_signed_exec(V3Connection &conn, ResponseSink &sink,
+                           const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::SignedExecRequest *>(msg->request());
     if (!request->binary_path() || !request->signature_path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     static const char *temp_dir = "/mbtool_exec_tmp";
 
+    // Only needed for the shared tmpfs directory
+    std::unique_lock<std::mutex> guard(signed_exec_lock, std::defer_lock);
+
     std::string target_binary;
     std::string target_sig;
     size_t nargs;
@@ -833,24 +1110,47 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     int status;
     SigVerifyResult sig_result;
     bool mounted_tmpfs = false;
+    int memfd = -1;
+    bool memfd_unsupported;
     // Variables that are part of the response
     v3::SignedExecResult result = v3::SignedExecResult_OTHER_ERROR;
     std::string error_msg;
     int exit_status = -1;
     int term_sig = -1;
 
-    target_binary = temp_dir;
-    target_binary += "/binary";
-    target_sig = temp_dir;
-    target_sig += "/binary.sig";
-
-    // Unmount tmpfs when we're done
-    auto unmount_tmpfs = util::finally([&]{
+    // Unmount tmpfs or close memfd when we're done
+    auto cleanup = util::finally([&]{
         if (mounted_tmpfs) {
             umount(temp_dir);
         }
+        if (memfd >= 0) {
+            close(memfd);
+        }
     });
 
+    // Try to load the binary into a sealed memfd first. This avoids mounting
+    // a tmpfs for every execution and the verified contents cannot be swapped
+    // out before they are executed.
+    if (signed_exec_load_memfd(request->binary_path()->c_str(),
+                               request->signature_path()->c_str(),
+                               &memfd, &memfd_unsupported, result,
+                               error_msg)) {
+        // Same as fexecve(), which bionic does not have
+        mb::format(target_binary, "/proc/self/fd/%d", memfd);
+        goto build_args;
+    } else if (!memfd_unsupported) {
+        goto done;
+    }
+
+    LOGW("memfd is not supported; using tmpfs for signed exec");
+
+    guard.lock();
+
+    target_binary = temp_dir;
+    target_binary += "/binary";
+    target_sig = temp_dir;
+    target_sig += "/binary.sig";
+
     if (mount("", "/", "", MS_REMOUNT, "") < 0) {
         result = v3::SignedExecResult_OTHER_ERROR;
         mb::format(error_msg, "Failed to remount / as rw: %s", strerror(errno));
@@ -924,6 +1224,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
         goto done;
     }
 
+build_args:
     // Build arguments
     nargs = 2; // argv[0] + NULL-terminator
     if (request->args()) {
@@ -942,6 +1243,8 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
         size_t i = 0;
         if (request->arg0()) {
             argv[i++] = request->arg0()->c_str();
+        } else if (memfd >= 0) {
+            argv[i++] = request->binary_path()->c_str();
         } else {
             argv[i++] = target_binary.c_str();
         }
@@ -958,7 +1261,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     //       Right now, if the connection is broken, the command will continue
     //       executing.
     status = util::run_command(target_binary.c_str(), argv, nullptr, nullptr,
-                               &signed_exec_output_cb, &fd);
+                               &signed_exec_output_cb, &sink);
 
     free(argv);
 
@@ -975,7 +1278,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     }
 
 done:
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<fb::String> error_msg_id = 0;
     fb::Offset<v3::SignedExecError> error;
 
@@ -993,14 +1296,16 @@ done:
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_SignedExecResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
+static bool v3_mb_get_booted_rom_id(V3Connection &conn, ResponseSink &sink,
+                                    const v3::Request *msg)
 {
+    (void) conn;
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<fb::String> id;
     auto rom = Roms::get_current_rom();
     if (rom) {
@@ -1015,51 +1320,32 @@ static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
             builder, v3::ResponseType_MbGetBootedRomIdResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
+static bool v3_mb_get_installed_roms(V3Connection &conn, ResponseSink &sink,
+                                     const v3::Request *msg)
 {
+    (void) conn;
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
-
-    Roms roms;
-    roms.add_installed();
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
 
     std::vector<fb::Offset<v3::MbRom>> fb_roms;
 
-    for (auto r : roms.roms) {
-        std::string system_path = r->full_system_path();
-        std::string cache_path = r->full_cache_path();
-        std::string data_path = r->full_data_path();
-
-        auto fb_id = builder.CreateString(r->id);
-        auto fb_system_path = builder.CreateString(system_path);
-        auto fb_cache_path = builder.CreateString(cache_path);
-        auto fb_data_path = builder.CreateString(data_path);
+    for (auto const &r : RomInventory::global().installed_roms()) {
+        auto fb_id = builder.CreateString(r.rom->id);
+        auto fb_system_path = builder.CreateString(r.system_path);
+        auto fb_cache_path = builder.CreateString(r.cache_path);
+        auto fb_data_path = builder.CreateString(r.data_path);
         fb::Offset<fb::String> fb_version;
         fb::Offset<fb::String> fb_build;
 
-        std::string build_prop;
-        if (r->system_is_image) {
-            build_prop += "/raw/images/";
-            build_prop += r->id;
-        } else {
-            build_prop += system_path;
-        }
-        build_prop += "/build.prop";
-
-        std::unordered_map<std::string, std::string> properties;
-        util::property_file_get_all(build_prop, properties);
-
-        if (properties.find("ro.build.version.release") != properties.end()) {
-            const std::string &version = properties["ro.build.version.release"];
-            fb_version = builder.CreateString(version);
+        if (r.has_version) {
+            fb_version = builder.CreateString(r.version);
         }
-        if (properties.find("ro.build.display.id") != properties.end()) {
-            const std::string &build = properties["ro.build.display.id"];
-            fb_build = builder.CreateString(build);
+        if (r.has_build) {
+            fb_build = builder.CreateString(r.build);
         }
 
         v3::MbRomBuilder mrb(builder);
@@ -1083,14 +1369,58 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
             builder, v3::ResponseType_MbGetInstalledRomsResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_get_version(int fd, const v3::Request *msg)
+static bool v3_mb_get_stats(V3Connection &conn, ResponseSink &sink,
+                            const v3::Request *msg)
 {
+    (void) conn;
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
+    std::vector<fb::Offset<v3::MbRequestStats>> stats;
+
+    for (int type = 0; type <= v3::RequestType_MAX; ++type) {
+        const RequestStats &rs = request_stats[type];
+        uint64_t count = rs.count;
+
+        if (count > 0) {
+            stats.push_back(v3::CreateMbRequestStats(
+                    builder, static_cast<uint8_t>(type), count,
+                    rs.total_time_ns, rs.max_time_ns));
+        }
+    }
+
+    std::vector<fb::Offset<v3::MbMetric>> metrics;
+
+    for (auto const &m : MetricsRegistry::global().snapshot()) {
+        const HistogramSnapshot &h = m.histogram;
+
+        metrics.push_back(v3::CreateMbMetricDirect(
+                builder, m.name.c_str(), static_cast<uint8_t>(m.type),
+                m.value, h.count, h.sum, h.min, h.max, h.percentile(50),
+                h.percentile(90), h.percentile(99)));
+    }
+
+    // Create response
+    auto response = v3::CreateMbGetStatsResponseDirect(
+            builder, &stats, &metrics);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_MbGetStatsResponse, response.Union()));
+
+    return v3_send_response(sink, builder);
+}
+
+static bool v3_mb_get_version(V3Connection &conn, ResponseSink &sink,
+                              const v3::Request *msg)
+{
+    (void) conn;
+    (void) msg;
+
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
 
     // Get version
     auto response = v3::CreateMbGetVersionResponseDirect(
@@ -1100,17 +1430,20 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetVersionResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
+static bool v3_mb_set_kernel(V3Connection &conn, ResponseSink &sink,
+                             const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::MbSetKernelRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::MbSetKernelError> error;
 
     bool ret = set_kernel(request->rom_id()->str(),
@@ -1127,14 +1460,17 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbSetKernelResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
+static bool v3_mb_switch_rom(V3Connection &conn, ResponseSink &sink,
+                             const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::MbSwitchRomRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     std::vector<std::string> block_dev_dirs;
@@ -1147,7 +1483,7 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 
     bool force_update_checksums = request->force_update_checksums();
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::MbSwitchRomError> error;
 
     SwitchRomResult ret = switch_rom(request->rom_id()->str(),
@@ -1184,37 +1520,41 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbSwitchRomResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
+static bool v3_mb_wipe_rom(V3Connection &conn, ResponseSink &sink,
+                           const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::MbWipeRomRequest *>(msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // Find and verify ROM is installed
-    Roms roms;
-    roms.add_installed();
-
-    auto rom = roms.find_by_id(request->rom_id()->c_str());
+    auto rom = RomInventory::global().find_by_id(request->rom_id()->c_str());
     if (!rom) {
         LOGE("Tried to wipe non-installed or invalid ROM ID: %s",
              request->rom_id()->c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // The GUI should check this, but we'll enforce it here
     auto current_rom = Roms::get_current_rom();
     if (current_rom && current_rom->id == rom->id) {
         LOGE("Cannot wipe currently booted ROM: %s", rom->id.c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // Wipe the selected targets
     std::vector<int16_t> succeeded;
     std::vector<int16_t> failed;
+    // Trash directories to delete after responding if wiping in the background
+    std::vector<std::string> trash;
+    std::vector<std::string> *trash_ptr =
+            request->background() ? &trash : nullptr;
 
     if (request->targets()) {
         std::string raw_system = get_raw_path("/system");
@@ -1227,15 +1567,15 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
             bool success = false;
 
             if (target == v3::MbWipeTarget_SYSTEM) {
-                success = wipe_system(rom);
+                success = wipe_system(rom, trash_ptr);
             } else if (target == v3::MbWipeTarget_CACHE) {
-                success = wipe_cache(rom);
+                success = wipe_cache(rom, trash_ptr);
             } else if (target == v3::MbWipeTarget_DATA) {
-                success = wipe_data(rom);
+                success = wipe_data(rom, trash_ptr);
             } else if (target == v3::MbWipeTarget_DALVIK_CACHE) {
-                success = wipe_dalvik_cache(rom);
+                success = wipe_dalvik_cache(rom, trash_ptr);
             } else if (target == v3::MbWipeTarget_MULTIBOOT) {
-                success = wipe_multiboot(rom);
+                success = wipe_multiboot(rom, trash_ptr);
             } else {
                 LOGE("Unknown wipe target %d", target);
             }
@@ -1248,7 +1588,15 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
         }
     }
 
-    fb::FlatBufferBuilder builder;
+    // Also finish background wipes that were interrupted earlier
+    add_leftover_trash(&trash);
+
+    if (!delete_trash_in_background(trash)) {
+        LOGW("Deleting trash in the foreground");
+        delete_trash(trash);
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
 
     // Create response
     auto response = v3::CreateMbWipeRomResponseDirect(
@@ -1258,37 +1606,90 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbWipeRomResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
+}
+
+static bool v3_mb_clone_rom(V3Connection &conn, ResponseSink &sink,
+                            const v3::Request *msg)
+{
+    (void) conn;
+
+    auto request = static_cast<const v3::MbCloneRomRequest *>(msg->request());
+    if (!request->source_rom_id() || !request->target_rom_id()) {
+        return v3_send_response_invalid(sink);
+    }
+
+    // Find and verify source ROM is installed
+    auto source = RomInventory::global().find_by_id(
+            request->source_rom_id()->c_str());
+    if (!source) {
+        LOGE("Tried to clone non-installed or invalid ROM ID: %s",
+             request->source_rom_id()->c_str());
+        return v3_send_response_invalid(sink);
+    }
+
+    // /data of the running ROM changes while it is being copied
+    auto current_rom = Roms::get_current_rom();
+    if (current_rom && current_rom->id == source->id) {
+        LOGE("Cannot clone currently booted ROM: %s", source->id.c_str());
+        return v3_send_response_invalid(sink);
+    }
+
+    std::string target_id =
+            clone_rom_target_id(request->target_rom_id()->c_str());
+    auto target = target_id.empty()
+            ? std::shared_ptr<Rom>() : Roms::create_rom(target_id);
+    if (!target) {
+        LOGE("Invalid clone target ROM ID: %s",
+             request->target_rom_id()->c_str());
+        return v3_send_response_invalid(sink);
+    }
+
+    bool success = clone_rom(source, target,
+                             request->name() ? request->name()->c_str() : "",
+                             request->link_system());
+
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
+
+    // Create response
+    auto response = v3::CreateMbCloneRomResponseDirect(
+            builder, success, success ? target->id.c_str() : nullptr);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_MbCloneRomResponse, response.Union()));
+
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
+static bool v3_mb_get_packages_count(V3Connection &conn, ResponseSink &sink,
+                                     const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::MbGetPackagesCountRequest *>(
             msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     // Find and verify ROM is installed
-    Roms roms;
-    roms.add_installed();
-
-    auto rom = roms.find_by_id(request->rom_id()->c_str());
+    auto rom = RomInventory::global().find_by_id(request->rom_id()->c_str());
     if (!rom) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     std::string packages_xml(rom->full_data_path());
     packages_xml += "/system/packages.xml";
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::MbGetPackagesCountError> error;
     unsigned int system_pkgs = 0;
     unsigned int update_pkgs = 0;
     unsigned int other_pkgs = 0;
 
     Packages pkgs;
-    bool ret = pkgs.load_xml(packages_xml);
+    bool ret = pkgs.load_xml(packages_xml, Packages::LOAD_SUMMARY);
 
     if (ret) {
         for (std::shared_ptr<Package> pkg : pkgs.pkgs) {
@@ -1317,14 +1718,17 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
             builder, v3::ResponseType_MbGetPackagesCountResponse,
             response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_reboot(int fd, const v3::Request *msg)
+static bool v3_reboot(V3Connection &conn, ResponseSink &sink,
+                      const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::RebootRequest *>(msg->request());
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::RebootError> error;
 
     std::string reboot_arg;
@@ -1347,7 +1751,7 @@ static bool v3_reboot(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid reboot type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     if (!ret) {
@@ -1361,14 +1765,17 @@ static bool v3_reboot(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_RebootResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
 }
 
-static bool v3_shutdown(int fd, const v3::Request *msg)
+static bool v3_shutdown(V3Connection &conn, ResponseSink &sink,
+                        const v3::Request *msg)
 {
+    (void) conn;
+
     auto request = static_cast<const v3::ShutdownRequest *>(msg->request());
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
     fb::Offset<v3::ShutdownError> error;
 
     // The client probably won't get the chance to see the success message, but
@@ -1383,7 +1790,7 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid shutdown type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(sink);
     }
 
     if (!ret) {
@@ -1397,100 +1804,407 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_ShutdownResponse, response.Union()));
 
-    return v3_send_response(fd, builder);
+    return v3_send_response(sink, builder);
+}
+
+static bool v3_batch(V3Connection &conn, ResponseSink &sink,
+                     const v3::Request *msg)
+{
+    auto request = static_cast<const v3::BatchRequest *>(msg->request());
+    std::vector<std::vector<uint8_t>> responses;
+
+    if (request->requests()) {
+        responses.reserve(request->requests()->size());
+
+        for (const v3::Request *subrequest : *request->requests()) {
+            if (!conn.handle(subrequest, 0, &responses, *sink.builder)) {
+                return false;
+            }
+        }
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder(sink);
+    std::vector<fb::Offset<v3::ResponseBuffer>> buffers;
+    buffers.reserve(responses.size());
+
+    for (auto const &data : responses) {
+        buffers.push_back(v3::CreateResponseBufferDirect(builder, &data));
+    }
+
+    // Create response
+    auto response = v3::CreateBatchResponseDirect(builder, &buffers);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_BatchResponse, response.Union()));
+
+    return v3_send_response(sink, builder);
 }
 
-typedef bool (*request_handler_fn)(int, const v3::Request *);
+typedef bool (*request_handler_fn)(V3Connection &, ResponseSink &,
+                                   const v3::Request *);
 
 struct RequestMap
 {
     v3::RequestType type;
     request_handler_fn fn;
+    // Whether the handler may run in parallel with other requests from the
+    // same connection (ie. it does not use the connection's state)
+    bool async;
+    // Whether the handler may block for a long time (eg. for file operations
+    // on a whole directory tree)
+    bool slow;
 };
 
 static RequestMap request_map[] = {
-    { v3::RequestType_FileChmodRequest, v3_file_chmod },
-    { v3::RequestType_FileCloseRequest, v3_file_close },
-    { v3::RequestType_FileOpenRequest, v3_file_open },
-    { v3::RequestType_FileReadRequest, v3_file_read },
-    { v3::RequestType_FileSeekRequest, v3_file_seek },
-    { v3::RequestType_FileSELinuxGetLabelRequest, v3_file_selinux_get_label },
-    { v3::RequestType_FileSELinuxSetLabelRequest, v3_file_selinux_set_label },
-    { v3::RequestType_FileStatRequest, v3_file_stat },
-    { v3::RequestType_FileWriteRequest, v3_file_write },
-    { v3::RequestType_PathChmodRequest, v3_path_chmod },
-    { v3::RequestType_PathCopyRequest, v3_path_copy },
-    { v3::RequestType_PathDeleteRequest, v3_path_delete },
-    { v3::RequestType_PathMkdirRequest, v3_path_mkdir },
-    { v3::RequestType_PathReadlinkRequest, v3_path_readlink },
-    { v3::RequestType_PathSELinuxGetLabelRequest, v3_path_selinux_get_label },
-    { v3::RequestType_PathSELinuxSetLabelRequest, v3_path_selinux_set_label },
-    { v3::RequestType_PathGetDirectorySizeRequest, v3_path_get_directory_size },
-    { v3::RequestType_SignedExecRequest, v3_signed_exec },
-    { v3::RequestType_MbGetBootedRomIdRequest, v3_mb_get_booted_rom_id },
-    { v3::RequestType_MbGetInstalledRomsRequest, v3_mb_get_installed_roms },
-    { v3::RequestType_MbGetVersionRequest, v3_mb_get_version },
-    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel },
-    { v3::RequestType_MbSwitchRomRequest, v3_mb_switch_rom },
-    { v3::RequestType_MbWipeRomRequest, v3_mb_wipe_rom },
-    { v3::RequestType_MbGetPackagesCountRequest, v3_mb_get_packages_count },
-    { v3::RequestType_RebootRequest, v3_reboot },
-    { v3::RequestType_ShutdownRequest, v3_shutdown },
-    { v3::RequestType_NONE, nullptr }
+    { v3::RequestType_FileChmodRequest, v3_file_chmod, false, false },
+    { v3::RequestType_FileCloseRequest, v3_file_close, false, false },
+    { v3::RequestType_FileOpenRequest, v3_file_open, false, false },
+    { v3::RequestType_FileReadRequest, v3_file_read, false, false },
+    { v3::RequestType_FileSeekRequest, v3_file_seek, false, false },
+    { v3::RequestType_FileSELinuxGetLabelRequest,
+      v3_file_selinux_get_label, false, false },
+    { v3::RequestType_FileSELinuxSetLabelRequest,
+      v3_file_selinux_set_label, false, false },
+    { v3::RequestType_FileStatRequest, v3_file_stat, false, false },
+    { v3::RequestType_FileWriteRequest, v3_file_write, false, false },
+    { v3::RequestType_PathChmodRequest, v3_path_chmod, true, false },
+    { v3::RequestType_PathCopyRequest, v3_path_copy, true, true },
+    { v3::RequestType_PathDeleteRequest, v3_path_delete, true, true },
+    { v3::RequestType_PathMkdirRequest, v3_path_mkdir, true, false },
+    { v3::RequestType_PathReadlinkRequest, v3_path_readlink, true, false },
+    { v3::RequestType_PathSELinuxGetLabelRequest,
+      v3_path_selinux_get_label, true, false },
+    { v3::RequestType_PathSELinuxSetLabelRequest,
+      v3_path_selinux_set_label, true, false },
+    { v3::RequestType_PathGetDirectorySizeRequest,
+      v3_path_get_directory_size, true, true },
+    { v3::RequestType_SignedExecRequest, v3_signed_exec, true, true },
+    { v3::RequestType_MbGetBootedRomIdRequest,
+      v3_mb_get_booted_rom_id, true, false },
+    { v3::RequestType_MbGetInstalledRomsRequest,
+      v3_mb_get_installed_roms, true, false },
+    { v3::RequestType_MbGetVersionRequest, v3_mb_get_version, true, false },
+    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel, true, true },
+    { v3::RequestType_MbSwitchRomRequest, v3_mb_switch_rom, true, true },
+    { v3::RequestType_MbWipeRomRequest, v3_mb_wipe_rom, true, true },
+    { v3::RequestType_MbCloneRomRequest, v3_mb_clone_rom, true, true },
+    { v3::RequestType_MbGetPackagesCountRequest,
+      v3_mb_get_packages_count, true, false },
+    { v3::RequestType_MbGetStatsRequest, v3_mb_get_stats, true, false },
+    { v3::RequestType_RebootRequest, v3_reboot, true, true },
+    { v3::RequestType_ShutdownRequest, v3_shutdown, true, true },
+    { v3::RequestType_BatchRequest, v3_batch, true, false },
+    { v3::RequestType_NONE, nullptr, false, false }
 };
 
-bool connection_version_3(int fd)
+static const RequestMap * find_handler(v3::RequestType type)
 {
-    std::string command;
-
-    auto close_all_fds = util::finally([&]{
-        // Ensure opened fd's are closed if the connection is lost
-        for (auto &p : fd_map) {
-            close(p.second);
+    // Handlers indexed by request type
+    static const std::vector<const RequestMap *> handlers = [] {
+        std::vector<const RequestMap *> result(v3::RequestType_MAX + 1);
+        for (auto iter = request_map; iter->fn; ++iter) {
+            result[iter->type] = iter;
         }
-        fd_map.clear();
-    });
+        return result;
+    }();
 
-    while (1) {
-        std::vector<uint8_t> data;
-        if (!util::socket_read_bytes(fd, &data)) {
-            return false;
-        }
+    if (static_cast<size_t>(type) >= handlers.size()) {
+        return nullptr;
+    }
+    return handlers[type];
+}
 
-        auto verifier = fb::Verifier(data.data(), data.size());
-        if (!v3::VerifyRequestBuffer(verifier)) {
-            LOGE("Received invalid buffer");
-            return false;
+static bool can_handle_async(const v3::Request *request)
+{
+    const RequestMap *entry = find_handler(request->request_type());
+    if (!entry || !entry->async) {
+        return false;
+    }
+
+    if (request->request_type() == v3::RequestType_BatchRequest) {
+        auto batch = static_cast<const v3::BatchRequest *>(request->request());
+        if (batch->requests()) {
+            for (const v3::Request *subrequest : *batch->requests()) {
+                if (!can_handle_async(subrequest)) {
+                    return false;
+                }
+            }
         }
+    }
 
-        const v3::Request *request = v3::GetRequest(data.data());
-        v3::RequestType type = request->request_type();
-        request_handler_fn fn = nullptr;
+    return true;
+}
 
-        for (auto iter = request_map; iter->fn; ++iter) {
-            if (type == iter->type) {
-                fn = iter->fn;
-                break;
+static bool is_slow_request(const v3::Request *request)
+{
+    const RequestMap *entry = find_handler(request->request_type());
+    if (!entry) {
+        return false;
+    } else if (entry->slow) {
+        return true;
+    }
+
+    if (request->request_type() == v3::RequestType_BatchRequest) {
+        auto batch = static_cast<const v3::BatchRequest *>(request->request());
+        if (batch->requests()) {
+            for (const v3::Request *subrequest : *batch->requests()) {
+                if (is_slow_request(subrequest)) {
+                    return true;
+                }
             }
         }
+    }
+
+    return false;
+}
+
+V3Connection::V3Connection(int fd)
+    : fd(fd)
+    , _reader(fd)
+{
+}
+
+/*!
+ * \brief Destroy the connection
+ *
+ * This joins the threads handling out-of-order and deferred requests, so it
+ * may block for as long as those requests take.
+ */
+V3Connection::~V3Connection()
+{
+    // Out-of-order requests may still be writing responses
+    std::unordered_map<uint64_t, std::thread> threads;
+    {
+        std::lock_guard<std::mutex> guard(_async_lock);
+        threads.swap(_async_threads);
+    }
+    for (auto &p : threads) {
+        p.second.join();
+    }
+
+    // Ensure opened fd's are closed if the connection is lost
+    for (auto &p : fd_map) {
+        close(p.second);
+    }
+}
+
+/*!
+ * \brief Have slow requests handled on a separate thread
+ *
+ * If a callback is set, requests that may take a long time and that can't be
+ * handled out of order (eg. because they have no ID) are handled on a separate
+ * thread. handle_request() returns HandleResult::Deferred for those and no
+ * other request may be read until \p callback has been called on that thread.
+ * The callback receives false if a connection error occurred.
+ */
+void V3Connection::set_deferred_callback(DeferredCallback callback)
+{
+    _deferred_callback = std::move(callback);
+}
+
+/*!
+ * \brief Read and handle a single request
+ *
+ * If the request has a non-zero ID and does not use the connection's state, it
+ * is handled on a separate thread and this returns once it has been started.
+ *
+ * \return HandleResult::Failed if a connection error occurred. A failed command
+ *         is not a connection error.
+ */
+V3Connection::HandleResult V3Connection::handle_request()
+{
+    if (_failed) {
+        return HandleResult::Failed;
+    }
+
+    const uint8_t *data;
+    size_t size;
+    if (!_reader.read_bytes(&data, &size)) {
+        return HandleResult::Failed;
+    }
+
+    auto verifier = fb::Verifier(data, size);
+    if (!v3::VerifyRequestBuffer(verifier)) {
+        LOGE("Received invalid buffer");
+        return HandleResult::Failed;
+    }
+
+    const v3::Request *request = v3::GetRequest(data);
+
+    if (request->id() != 0 && can_handle_async(request)
+            && handle_async(data, size, false)) {
+        return HandleResult::Ok;
+    }
+
+    if (_deferred_callback && is_slow_request(request)) {
+        handle_async(data, size, true);
+        return HandleResult::Deferred;
+    }
+
+    return handle(request, request->id(), nullptr, _builder)
+            ? HandleResult::Ok : HandleResult::Failed;
+}
+
+/*!
+ * \brief Whether part of another request has already been received
+ *
+ * If true, handle_request() should be called again before waiting for the
+ * socket to become readable.
+ */
+bool V3Connection::has_pending_data() const
+{
+    return _reader.buffered() > 0;
+}
+
+/*!
+ * \brief Call the handler for a request
+ *
+ * \param request Verified request
+ * \param id ID to tag the responses with (0 for no tagging)
+ * \param batch If non-null, the responses are appended here instead of being
+ *              sent to the client
+ * \param builder Response builder reused by the calling thread
+ *
+ * \return False if a connection error occurred
+ */
+bool V3Connection::handle(const v3::Request *request, uint64_t id,
+                          std::vector<std::vector<uint8_t>> *batch,
+                          std::unique_ptr<fb::FlatBufferBuilder> &builder)
+{
+    v3::RequestType type = request->request_type();
+    const RequestMap *entry = find_handler(type);
+
+    ResponseSink sink{this, id, batch, &builder};
 
-        // NOTE: A false return value indicates a connection error, not a
-        //       command failure!
-        bool ret = true;
+    // NOTE: A false return value indicates a connection error, not a
+    //       command failure!
+    if (!entry || (batch && type == v3::RequestType_SignedExecRequest)) {
+        // Invalid command (or one that may send more than one response in a
+        // batch); allow further commands
+        return v3_send_response_unsupported(sink);
+    }
+
+    struct timespec start;
+    struct timespec end;
+    struct timespec diff;
+
+    MB_ALLOC_SCOPE("daemon.request");
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool ret = entry->fn(*this, sink, request);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    util::timespec_diff(start, end, &diff);
+    record_request_time(type, static_cast<uint64_t>(diff.tv_sec) * 1000000000
+            + static_cast<uint64_t>(diff.tv_nsec));
+
+    return ret;
+}
+
+/*!
+ * \brief Whether any request is still being handled on a separate thread
+ *
+ * If false, destroying the connection won't block.
+ */
+bool V3Connection::has_async_requests()
+{
+    std::lock_guard<std::mutex> guard(_async_lock);
+    return _async_threads.size() > _async_finished.size();
+}
+
+/*!
+ * \brief Handle a copy of a request on a new thread
+ *
+ * \param deferred Whether the request is handled in order. If true, the
+ *                 deferred callback is called once the request has been handled
+ *                 and the limit on out-of-order requests does not apply.
+ *
+ * \return False if too many requests are already being handled out of order
+ */
+bool V3Connection::handle_async(const uint8_t *data, size_t size,
+                                bool deferred)
+{
+    std::vector<std::thread> finished;
+    bool ret = true;
 
-        if (fn) {
-            ret = fn(fd, request);
+    {
+        std::lock_guard<std::mutex> guard(_async_lock);
+
+        // Threads that are done are joined below, outside of the lock
+        for (uint64_t id : _async_finished) {
+            auto it = _async_threads.find(id);
+            finished.push_back(std::move(it->second));
+            _async_threads.erase(it);
+        }
+        _async_finished.clear();
+
+        if (!deferred && _async_threads.size() >= MAX_ASYNC_REQUESTS) {
+            ret = false;
         } else {
-            // Invalid command; allow further commands
-            ret = v3_send_response_unsupported(fd);
+            uint64_t id = _async_next_id++;
+            std::vector<uint8_t> buf(data, data + size);
+
+            _async_threads.emplace(id, std::thread(
+                    &V3Connection::async_thread, this, id, std::move(buf),
+                    deferred));
         }
+    }
+
+    for (auto &t : finished) {
+        t.join();
+    }
+
+    return ret;
+}
+
+void V3Connection::async_thread(uint64_t id, std::vector<uint8_t> buf,
+                                bool deferred)
+{
+    const v3::Request *request = v3::GetRequest(buf.data());
+    std::unique_ptr<fb::FlatBufferBuilder> builder;
+
+    // Nothing else uses the connection's builder until the request is done
+    bool ret = handle(request, request->id(), nullptr,
+                      deferred ? _builder : builder);
+
+    if (deferred) {
+        // The thread still counts as running, so the connection can't be
+        // destroyed on this thread by the callback
+        _deferred_callback(ret);
+    } else if (!ret) {
+        // Make the next handle_request() call fail
+        _failed = true;
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    std::lock_guard<std::mutex> guard(_async_lock);
+    _async_finished.push_back(id);
+}
+
+/*!
+ * \brief Send a serialized response
+ *
+ * This may be called from multiple threads.
+ */
+bool V3Connection::send(const void *data, size_t size,
+                        const std::vector<int> *fds)
+{
+    std::lock_guard<std::mutex> guard(_write_lock);
+    return util::socket_write_bytes(fd, static_cast<const uint8_t *>(data),
+                                    size)
+            && (!fds || util::socket_send_fds(fd, *fds));
+}
 
-        if (!ret) {
+bool connection_version_3(int fd)
+{
+    V3Connection conn(fd);
+
+    while (true) {
+        if (conn.handle_request() == V3Connection::HandleResult::Failed) {
             return false;
         }
     }
-
-    return true;
 }
 
 }
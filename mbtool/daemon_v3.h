@@ -19,9 +19,106 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/socket.h"
+
+namespace flatbuffers
+{
+class FlatBufferBuilder;
+}
+
+namespace mbtool
+{
+namespace daemon
+{
+namespace v3
+{
+struct Request;
+}
+}
+}
+
 namespace mb
 {
 
+/*!
+ * \brief State of a protocol version 3 connection
+ *
+ * Files opened by the client are tracked per connection and are closed when
+ * the connection is destroyed. The connection does not own the socket.
+ *
+ * Requests with a non-zero ID that don't use the connection's state may be
+ * handled on separate threads, so responses can be sent out of order. Sending
+ * is serialized by send().
+ */
+class V3Connection
+{
+public:
+    enum class HandleResult
+    {
+        // The request was handled or was started on a separate thread
+        Ok,
+        // The request is being handled on a separate thread and the deferred
+        // callback will be called once it is done
+        Deferred,
+        // A connection error occurred
+        Failed,
+    };
+
+    typedef std::function<void(bool)> DeferredCallback;
+
+    explicit V3Connection(int fd);
+    ~V3Connection();
+
+    V3Connection(const V3Connection &) = delete;
+    V3Connection & operator=(const V3Connection &) = delete;
+
+    void set_deferred_callback(DeferredCallback callback);
+
+    HandleResult handle_request();
+    bool has_pending_data() const;
+    bool has_async_requests();
+
+    bool handle(const mbtool::daemon::v3::Request *request, uint64_t id,
+                std::vector<std::vector<uint8_t>> *batch,
+                std::unique_ptr<flatbuffers::FlatBufferBuilder> &builder);
+    bool send(const void *data, size_t size,
+              const std::vector<int> *fds = nullptr);
+
+    // Client socket
+    int fd;
+    // Map of IDs given to the client to opened file descriptors
+    std::unordered_map<int, int> fd_map;
+    int fd_count = 0;
+
+private:
+    util::SocketReader _reader;
+    // Response builder reused for the requests handled by handle_request()
+    std::unique_ptr<flatbuffers::FlatBufferBuilder> _builder;
+    std::mutex _write_lock;
+    DeferredCallback _deferred_callback;
+    std::mutex _async_lock;
+    // Threads handling requests on behalf of this connection
+    std::unordered_map<uint64_t, std::thread> _async_threads;
+    // IDs of the threads in _async_threads that are done and can be joined
+    std::vector<uint64_t> _async_finished;
+    uint64_t _async_next_id = 0;
+    // Set if an out-of-order request hit a connection error
+    std::atomic_bool _failed{false};
+
+    bool handle_async(const uint8_t *data, size_t size, bool deferred);
+    void async_thread(uint64_t id, std::vector<uint8_t> buf, bool deferred);
+};
+
 bool connection_version_3(int fd);
 
 }
\ No newline at end of file
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "directory_size.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbutil/finally.h"
+
+// Number of threads used to walk a tree
+#define DIRECTORY_SIZE_THREADS          4
+
+// The cache is cleared when it grows past this many directories
+#define DIRECTORY_SIZE_CACHE_MAX        100000
+
+namespace mb
+{
+
+struct FileId
+{
+    dev_t dev;
+    ino_t ino;
+
+    bool operator==(const FileId &other) const
+    {
+        return dev == other.dev && ino == other.ino;
+    }
+};
+
+struct FileIdHash
+{
+    size_t operator()(const FileId &id) const
+    {
+        return std::hash<uint64_t>()(static_cast<uint64_t>(id.ino))
+                ^ std::hash<uint64_t>()(static_cast<uint64_t>(id.dev));
+    }
+};
+
+struct LinkedFile
+{
+    FileId id;
+    uint64_t size;
+};
+
+/*!
+ * \brief Names of the entries in a directory
+ *
+ * The mtime and ctime of a directory change whenever an entry is added,
+ * removed, or renamed, so the listing is reused until either changes. Only
+ * the names are cached. Files modified in place don't update their
+ * directory's timestamps, so their sizes are read again on every walk.
+ */
+struct DirectoryListing
+{
+    struct timespec mtime;
+    struct timespec ctime;
+    // Names of the regular files
+    std::vector<std::string> files;
+    // Names of the subdirectories
+    std::vector<std::string> subdirs;
+};
+
+/*!
+ * \brief Sizes of the regular files directly in a directory
+ */
+struct DirectoryFiles
+{
+    // Total size of the regular files with a single link
+    uint64_t files_size = 0;
+    // Regular files with multiple links (counted once per tree)
+    std::vector<LinkedFile> linked_files;
+};
+
+static std::mutex cache_lock;
+static std::unordered_map<FileId, DirectoryListing, FileIdHash> cache;
+
+static bool timespec_equal(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/*!
+ * \brief List the regular files and subdirectories in a directory
+ *
+ * Entries named in \p exclusions (if non-null) are skipped.
+ */
+static bool read_directory(int fd, DirectoryListing &listing,
+                           const std::vector<std::string> *exclusions)
+{
+    int dup_fd = dup(fd);
+    if (dup_fd < 0) {
+        return false;
+    }
+
+    DIR *dp = fdopendir(dup_fd);
+    if (!dp) {
+        int saved_errno = errno;
+        close(dup_fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    auto close_dp = util::finally([&]{
+        closedir(dp);
+    });
+
+    listing.files.clear();
+    listing.subdirs.clear();
+
+    struct dirent *ent;
+    struct stat sb;
+
+    errno = 0;
+    while ((ent = readdir(dp))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (exclusions && std::find(exclusions->begin(), exclusions->end(),
+                                    ent->d_name) != exclusions->end()) {
+            continue;
+        }
+
+        if (ent->d_type == DT_DIR) {
+            listing.subdirs.push_back(ent->d_name);
+        } else if (ent->d_type == DT_REG) {
+            listing.files.push_back(ent->d_name);
+        } else if (ent->d_type == DT_UNKNOWN) {
+            if (fstatat(fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                return false;
+            }
+
+            if (S_ISDIR(sb.st_mode)) {
+                listing.subdirs.push_back(ent->d_name);
+            } else if (S_ISREG(sb.st_mode)) {
+                listing.files.push_back(ent->d_name);
+            }
+        }
+
+        errno = 0;
+    }
+
+    return errno == 0;
+}
+
+/*!
+ * \brief Get the current sizes of the regular files in a listing
+ */
+static bool stat_files(int fd, const DirectoryListing &listing,
+                       DirectoryFiles &files)
+{
+    struct stat sb;
+
+    for (auto const &name : listing.files) {
+        if (fstatat(fd, name.c_str(), &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            return false;
+        }
+
+        if (!S_ISREG(sb.st_mode)) {
+            // Only regular files are counted
+        } else if (sb.st_nlink > 1) {
+            files.linked_files.push_back({ { sb.st_dev, sb.st_ino },
+                                           static_cast<uint64_t>(
+                                                   sb.st_size) });
+        } else {
+            files.files_size += sb.st_size;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Walks a tree with a pool of threads sharing a queue of directories
+ */
+class DirectorySizeWalker
+{
+public:
+    DirectorySizeWalker(dev_t root_dev)
+        : _root_dev(root_dev)
+    {
+    }
+
+    bool run(const std::string &root, const DirectoryListing &root_listing,
+             const DirectoryFiles &root_files, uint64_t *size_out)
+    {
+        add_entry(root, root_listing, root_files);
+
+        std::vector<std::thread> threads;
+        for (int i = 0; i < DIRECTORY_SIZE_THREADS - 1; ++i) {
+            threads.emplace_back(&DirectorySizeWalker::worker, this);
+        }
+        worker();
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        if (_error != 0) {
+            errno = _error;
+            return false;
+        }
+
+        *size_out = _total;
+        return true;
+    }
+
+private:
+    dev_t _root_dev;
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::deque<std::string> _queue;
+    unsigned int _busy = 0;
+    int _error = 0;
+    uint64_t _total = 0;
+    std::unordered_set<FileId, FileIdHash> _links;
+
+    // Must be called with _lock held
+    void add_entry(const std::string &path, const DirectoryListing &listing,
+                   const DirectoryFiles &files)
+    {
+        _total += files.files_size;
+
+        for (auto const &f : files.linked_files) {
+            if (_links.insert(f.id).second) {
+                _total += f.size;
+            }
+        }
+
+        for (auto const &name : listing.subdirs) {
+            std::string subpath(path);
+            if (subpath.empty() || subpath.back() != '/') {
+                subpath += '/';
+            }
+            subpath += name;
+            _queue.push_back(std::move(subpath));
+        }
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+
+        while (true) {
+            _cv.wait(lock, [&]{
+                return !_queue.empty() || _busy == 0 || _error != 0;
+            });
+            if (_error != 0 || _queue.empty()) {
+                break;
+            }
+
+            std::string path = std::move(_queue.front());
+            _queue.pop_front();
+            ++_busy;
+            lock.unlock();
+
+            DirectoryListing listing;
+            DirectoryFiles files;
+            bool skip = false;
+            bool ret = scan(path, listing, files, skip);
+            int saved_errno = errno;
+
+            lock.lock();
+            --_busy;
+            if (!ret) {
+                if (_error == 0) {
+                    _error = saved_errno != 0 ? saved_errno : EIO;
+                }
+            } else if (!skip) {
+                add_entry(path, listing, files);
+            }
+            _cv.notify_all();
+        }
+    }
+
+    bool scan(const std::string &path, DirectoryListing &listing,
+              DirectoryFiles &files, bool &skip)
+    {
+        int fd = open(path.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        auto close_fd = util::finally([&]{
+            close(fd);
+        });
+
+        struct stat sb;
+        if (fstat(fd, &sb) < 0) {
+            return false;
+        }
+
+        // Don't cross mountpoint boundaries
+        if (sb.st_dev != _root_dev) {
+            skip = true;
+            return true;
+        }
+
+        FileId id{sb.st_dev, sb.st_ino};
+        bool cached = false;
+
+        {
+            std::lock_guard<std::mutex> guard(cache_lock);
+            auto it = cache.find(id);
+            if (it != cache.end()
+                    && timespec_equal(it->second.mtime, sb.st_mtim)
+                    && timespec_equal(it->second.ctime, sb.st_ctim)) {
+                listing = it->second;
+                cached = true;
+            }
+        }
+
+        if (!cached) {
+            // The timestamps are taken before reading so that changes made
+            // while reading invalidate the listing
+            listing.mtime = sb.st_mtim;
+            listing.ctime = sb.st_ctim;
+
+            if (!read_directory(fd, listing, nullptr)) {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> guard(cache_lock);
+            if (cache.size() >= DIRECTORY_SIZE_CACHE_MAX) {
+                cache.clear();
+            }
+            cache[id] = listing;
+        }
+
+        return stat_files(fd, listing, files);
+    }
+};
+
+/*!
+ * \brief Get the total size of the regular files in a tree
+ *
+ * Hard links are counted once, mountpoint boundaries are not crossed, and
+ * symlinks are not followed. Entries named in \p exclusions are skipped if
+ * they are directly in \p path.
+ *
+ * The subdirectories are walked in parallel. The listing of each directory is
+ * cached, so later calls only read directories that changed. Every file is
+ * still stat'ed, so files modified in place are always counted correctly.
+ *
+ * \return True if the size was computed. False with errno set if a file or
+ *         directory could not be read.
+ */
+bool get_directory_size(const std::string &path,
+                        const std::vector<std::string> &exclusions,
+                        uint64_t *size_out)
+{
+    struct stat sb;
+
+    if (lstat(path.c_str(), &sb) < 0) {
+        return false;
+    }
+
+    if (S_ISREG(sb.st_mode)) {
+        *size_out = sb.st_size;
+        return true;
+    } else if (!S_ISDIR(sb.st_mode)) {
+        *size_out = 0;
+        return true;
+    }
+
+    // The root directory isn't cached because of the exclusions
+    int fd = open(path.c_str(),
+                  O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    DirectoryListing root_listing;
+    DirectoryFiles root_files;
+    bool ret = read_directory(fd, root_listing, &exclusions)
+            && stat_files(fd, root_listing, root_files);
+    int saved_errno = errno;
+    close(fd);
+
+    if (!ret) {
+        errno = saved_errno;
+        return false;
+    }
+
+    DirectorySizeWalker walker(sb.st_dev);
+    return walker.run(path, root_listing, root_files, size_out);
+}
+
+}
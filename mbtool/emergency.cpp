@@ -91,6 +91,9 @@ private:
 
 static bool dump_kernel_log(const char *file)
 {
+    // Make sure our own pending messages are in the kernel log
+    log::log_flush();
+
     int len = klogctl(KLOG_SIZE_BUFFER, nullptr, 0);
     if (len < 0) {
         LOGE("Failed to get kernel log buffer size: %s", strerror(errno));
@@ -162,12 +165,11 @@ bool emergency_reboot()
     Device device;
     JsonError error;
 
-    std::vector<unsigned char> contents;
-    util::file_read_all(DEVICE_JSON_PATH, &contents);
-    contents.push_back('\0');
+    util::FileView contents;
+    contents.open(DEVICE_JSON_PATH);
 
     bool loaded_json = device_from_json(
-            reinterpret_cast<char *>(contents.data()), device, error);
+            std::string(contents.begin(), contents.end()), device, error);
 
     // /data
     {
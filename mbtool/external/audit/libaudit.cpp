@@ -267,6 +267,92 @@ int audit_get_reply(int fd, struct audit_message *rep, reply_t block, int peek)
     return rc;
 }
 
+int audit_get_replies(int fd, struct audit_message *reps, unsigned int count,
+                      reply_t block, int *valid)
+{
+    static bool have_recvmmsg = true;
+    int rc;
+
+    if (fd < 0) {
+        return -EBADF;
+    }
+
+    if (count > MAX_AUDIT_BATCH) {
+        count = MAX_AUDIT_BATCH;
+    }
+
+    if (!have_recvmmsg || count == 1) {
+        reps[0].nlh.nlmsg_len = 0;
+        rc = audit_get_reply(fd, &reps[0], block, 0);
+        if (rc == 0 && block == GET_REPLY_NONBLOCKING
+                && reps[0].nlh.nlmsg_len == 0) {
+            /* Nothing was available */
+            return 0;
+        } else if (rc == -EINVAL || rc == -EFBIG || rc == -EBADE
+                || rc == -EPROTO) {
+            /* The message was consumed, but is not usable */
+            valid[0] = 0;
+            return 1;
+        } else if (rc < 0) {
+            return rc;
+        }
+        valid[0] = 1;
+        return 1;
+    }
+
+    struct mmsghdr msgs[MAX_AUDIT_BATCH];
+    struct iovec iovs[MAX_AUDIT_BATCH];
+    struct sockaddr_nl addrs[MAX_AUDIT_BATCH];
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        iovs[i].iov_base = &reps[i];
+        iovs[i].iov_len = sizeof(reps[i]);
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /*
+     * MSG_WAITFORONE blocks for the first message only and then returns
+     * whatever else is already queued.
+     */
+    int flags = (block == GET_REPLY_NONBLOCKING) ? MSG_DONTWAIT : MSG_WAITFORONE;
+    int n = TEMP_FAILURE_RETRY(recvmmsg(fd, msgs, count, flags, nullptr));
+    if (n < 0) {
+        rc = -errno;
+        if (rc == -ENOSYS) {
+            have_recvmmsg = false;
+            return audit_get_replies(fd, reps, count, block, valid);
+        } else if (block == GET_REPLY_NONBLOCKING && rc == -EAGAIN) {
+            return 0;
+        }
+        LOGE("Error receiving from netlink socket, error: %s", strerror(-rc));
+        return rc;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        valid[i] = 0;
+
+        if (msgs[i].msg_hdr.msg_namelen != sizeof(addrs[i])) {
+            LOGE("Protocol fault, error: %s", strerror(EPROTO));
+        } else if (addrs[i].nl_pid) {
+            /* Make sure the netlink message was not spoof'd */
+            LOGE("Invalid netlink pid received, expected 0 got: %d",
+                 addrs[i].nl_pid);
+        } else if (!NLMSG_OK(&reps[i].nlh, (size_t) msgs[i].msg_len)) {
+            LOGE("Bad kernel response %s", strerror(
+                    msgs[i].msg_len == sizeof(reps[i]) ? EFBIG : EBADE));
+        } else {
+            valid[i] = 1;
+        }
+    }
+
+    return n;
+}
+
 void audit_close(int fd)
 {
     int rc = close(fd);
@@ -31,6 +31,7 @@
 __BEGIN_DECLS
 
 #define MAX_AUDIT_MESSAGE_LENGTH    8970
+#define MAX_AUDIT_BATCH             16
 
 typedef enum {
     GET_REPLY_BLOCKING=0,
@@ -81,6 +82,28 @@ extern void audit_close(int fd);
 extern int  audit_get_reply(int fd, struct audit_message *rep, reply_t block,
                int peek);
 
+/**
+ * Receives up to count messages with a single recvmmsg() call. Falls back to
+ * audit_get_reply() if the kernel does not support recvmmsg().
+ * @param fd
+ *  The fd returned by a call to audit_open()
+ * @param reps
+ *  Array of count response structs to store the responses in.
+ * @param count
+ *  Maximum number of messages to receive (at most MAX_AUDIT_BATCH)
+ * @param block
+ *  Whether or not to block until at least one message is available
+ * @param valid
+ *  Array of count flags. valid[i] is set to 0 if the i'th message was
+ *  rejected (eg. because it did not come from the kernel).
+ * @return
+ *  This function returns the number of messages received (including rejected
+ *  ones), 0 if no messages are available and block is GET_REPLY_NONBLOCKING,
+ *  else -errno.
+ */
+extern int  audit_get_replies(int fd, struct audit_message *reps,
+               unsigned int count, reply_t block, int *valid);
+
 /**
  * Sets a pid to recieve audit netlink events from the kernel
  * @param fd
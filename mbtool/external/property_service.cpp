@@ -16,6 +16,7 @@
 
 #include <chrono>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include <cerrno>
@@ -346,13 +347,53 @@ static void handle_property_set_fd() {
     }
 }
 
-static void load_properties_from_file(const char *, const char *);
+/*
+ * Properties parsed from one or more files. Each key appears once and later
+ * values replace earlier ones, but keep the position of the first occurrence.
+ */
+struct PropertyStaging {
+    std::vector<std::pair<std::string, std::string>> props;
+    std::unordered_map<std::string, size_t> index;
+};
+
+static void stage_property(PropertyStaging& staging, const char* key,
+                           const char* value) {
+    std::string name(key);
+
+    if (!is_legal_property_name(name)) {
+        LOGE("property_set(\"%s\", \"%s\") failed: bad name", key, value);
+        return;
+    }
+
+    if (strlen(value) >= PROP_VALUE_MAX) {
+        LOGE("property_set(\"%s\", \"%s\") failed: value too long",
+             key, value);
+        return;
+    }
+
+    auto it = staging.index.find(name);
+    if (it != staging.index.end()) {
+        auto& old_value = staging.props[it->second].second;
+        if (mb::starts_with(name, "ro.") && old_value != value) {
+            LOGW("Overriding previous 'ro.' property '%s':'%s' with new "
+                 "value '%s'", key, old_value.c_str(), value);
+        }
+        old_value = value;
+    } else {
+        staging.index.emplace(name, staging.props.size());
+        staging.props.emplace_back(std::move(name), value);
+    }
+}
+
+static void load_properties_from_file(const char *, const char *,
+                                      PropertyStaging&);
 
 /*
  * Filter is used to decide which properties to load: NULL loads all keys,
  * "ro.foo.*" is a prefix match, and "ro.foo.bar" is an exact match.
  */
-static void load_properties(char *data, const char *filter)
+static void load_properties(char *data, const char *filter,
+                            PropertyStaging& staging)
 {
     char *key, *value, *eol, *sol, *tmp, *fn;
     size_t flen = 0;
@@ -383,7 +424,7 @@ static void load_properties(char *data, const char *filter)
                 while (isspace(*key)) key++;
             }
 
-            load_properties_from_file(fn, key);
+            load_properties_from_file(fn, key, staging);
 
         } else {
             value = strchr(key, '=');
@@ -403,14 +444,15 @@ static void load_properties(char *data, const char *filter)
                 }
             }
 
-            property_set(key, value);
+            stage_property(staging, key, value);
         }
     }
 }
 
 // Filter is used to decide which properties to load: NULL loads all keys,
 // "ro.foo.*" is a prefix match, and "ro.foo.bar" is an exact match.
-static void load_properties_from_file(const char* filename, const char* filter) {
+static void load_properties_from_file(const char* filename, const char* filter,
+                                      PropertyStaging& staging) {
     std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
 
     std::vector<unsigned char> data;
@@ -420,7 +462,7 @@ static void load_properties_from_file(const char* filename, const char* filter)
     }
     data.push_back('\n');
     data.push_back('\0');
-    load_properties(reinterpret_cast<char *>(data.data()), filter);
+    load_properties(reinterpret_cast<char *>(data.data()), filter, staging);
 
     std::chrono::system_clock::time_point end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed = end - start;
@@ -428,17 +470,52 @@ static void load_properties_from_file(const char* filename, const char* filter)
     LOGV("(Loading properties from %s took %.2fs.)", filename, elapsed.count());
 }
 
+/*
+ * Write all staged properties to the property area. The names and values were
+ * already validated while staging. Waiters are only woken up once at the end
+ * instead of after every new property.
+ */
+static void apply_properties(const PropertyStaging& staging) {
+    for (auto const& prop : staging.props) {
+        const std::string& name = prop.first;
+        const std::string& value = prop.second;
+
+        prop_info* pi = (prop_info*) mb__system_property_find(name.c_str());
+        if (pi != nullptr) {
+            // ro.* properties are actually "write-once".
+            if (mb::starts_with(name, "ro.")) {
+                LOGE("property_set(\"%s\", \"%s\") failed: property already set",
+                     name.c_str(), value.c_str());
+                continue;
+            }
+
+            mb__system_property_update(pi, value.c_str(), value.size());
+        } else if (mb__system_property_add_deferred(
+                name.c_str(), name.size(), value.c_str(), value.size()) < 0) {
+            LOGE("property_set(\"%s\", \"%s\") failed: "
+                 "mb__system_property_add failed",
+                 name.c_str(), value.c_str());
+        }
+    }
+
+    mb__system_property_notify_deferred();
+}
+
 void property_load_boot_defaults() {
-    load_properties_from_file("/default.prop", NULL);
-    load_properties_from_file("/odm/default.prop", NULL);
-    load_properties_from_file("/vendor/default.prop", NULL);
+    PropertyStaging staging;
+    load_properties_from_file("/default.prop", NULL, staging);
+    load_properties_from_file("/odm/default.prop", NULL, staging);
+    load_properties_from_file("/vendor/default.prop", NULL, staging);
+    apply_properties(staging);
 }
 
 void load_system_props() {
-    load_properties_from_file("/system/build.prop", NULL);
-    load_properties_from_file("/odm/build.prop", NULL);
-    load_properties_from_file("/vendor/build.prop", NULL);
-    load_properties_from_file("/factory/factory.prop", "ro.*");
+    PropertyStaging staging;
+    load_properties_from_file("/system/build.prop", NULL, staging);
+    load_properties_from_file("/odm/build.prop", NULL, staging);
+    load_properties_from_file("/vendor/build.prop", NULL, staging);
+    load_properties_from_file("/factory/factory.prop", "ro.*", staging);
+    apply_properties(staging);
 }
 
 void * property_service_thread(void *)
@@ -19,18 +19,68 @@
 
 #include "image.h"
 
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
+
+#include <linux/fs.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/command.h"
 #include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
 
+// ext4 superblock fields (see e2fsprogs' lib/ext2fs/ext2_fs.h)
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+#define EXT4_SB_BLOCKS_COUNT_LO         0x04
+#define EXT4_SB_FIRST_DATA_BLOCK        0x14
+#define EXT4_SB_LOG_BLOCK_SIZE          0x18
+#define EXT4_SB_BLOCKS_PER_GROUP        0x20
+#define EXT4_SB_MNT_COUNT               0x34
+#define EXT4_SB_MAX_MNT_COUNT           0x36
+#define EXT4_SB_MAGIC                   0x38
+#define EXT4_SB_STATE                   0x3a
+#define EXT4_SB_LASTCHECK               0x40
+#define EXT4_SB_CHECKINTERVAL           0x44
+#define EXT4_SB_FEATURE_INCOMPAT        0x60
+#define EXT4_SB_LAST_ORPHAN             0xe8
+#define EXT4_SB_DESC_SIZE               0xfe
+#define EXT4_SB_BLOCKS_COUNT_HI         0x150
+
+// ext4 group descriptor fields
+#define EXT4_BG_BLOCK_BITMAP_LO         0x00
+#define EXT4_BG_FLAGS                   0x12
+#define EXT4_BG_BLOCK_BITMAP_HI         0x20
+#define EXT4_MIN_DESC_SIZE              32
+#define EXT4_MIN_DESC_SIZE_64BIT        64
+
+#define EXT4_MAGIC                      0xef53
+#define EXT4_VALID_FS                   0x0001
+#define EXT4_ERROR_FS                   0x0002
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG   0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_BG_BLOCK_UNINIT            0x0002
+
+// Maximum size of each read and write when cloning an image
+#define CLONE_MAX_RUN_SIZE              (1024 * 1024)
+
 namespace mb
 {
 
@@ -42,6 +92,56 @@ static void output_cb(const char *line, bool error, void *userdata)
     LOGV("%s: %s", args[0], line);
 }
 
+/*!
+ * \brief Run mke2fs, leaving the inode tables and journal uninitialized
+ *
+ * Only the superblocks, group descriptors and bitmaps are written, so this
+ * takes about the same amount of time regardless of the size of \a path.
+ * Features that older kernels can't mount are disabled. The caller is expected
+ * to have discarded the old contents already.
+ */
+static bool run_mke2fs_lazy(const std::string &path)
+{
+    const char *argv[] = {
+        "mke2fs", "-t", "ext4", "-F", "-q",
+        "-O", "^metadata_csum,^64bit,uninit_bg",
+        "-E", "lazy_itable_init=1,lazy_journal_init=1,nodiscard",
+        path.c_str(), nullptr
+    };
+    int ret = util::run_command(argv[0], argv, nullptr, nullptr,
+                                &output_cb, argv);
+    return ret >= 0 && WIFEXITED(ret) && WEXITSTATUS(ret) == 0;
+}
+
+/*!
+ * \brief Format an image with mke2fs, leaving the inode tables uninitialized
+ *
+ * The file is created sparse.
+ *
+ * \return Whether the image was created. If false, \a path does not exist.
+ */
+static bool create_ext4_image_lazy(const std::string &path, uint64_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGE("%s: Failed to create file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    int ret = ftruncate64(fd, size);
+    if (ret < 0) {
+        LOGE("%s: Failed to set file size: %s", path.c_str(), strerror(errno));
+    }
+    close(fd);
+
+    if (ret == 0 && run_mke2fs_lazy(path)) {
+        return true;
+    }
+
+    unlink(path.c_str());
+    return false;
+}
+
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
 {
     // Ensure we have enough space since we're creating a sparse file that may
@@ -65,6 +165,13 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
 
             LOGD("%s: Creating new %s ext4 image", path.c_str(), size_str);
 
+            if (create_ext4_image_lazy(path, size)) {
+                return CreateImageResult::SUCCEEDED;
+            }
+
+            // mke2fs is not available everywhere, but make_ext4fs is
+            LOGW("%s: Falling back to make_ext4fs", path.c_str());
+
             // Create new image
             const char *argv[] =
                     { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
@@ -82,8 +189,172 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
     return CreateImageResult::IMAGE_EXISTS;
 }
 
+/*!
+ * \brief Release all blocks of an image file or block device
+ *
+ * Image files are truncated so they become sparse again and block devices are
+ * discarded with BLKDISCARD. For loop devices, the kernel punches holes in the
+ * backing file, which has the same effect as recreating the image.
+ *
+ * \param[out] size_out Size of the image or block device
+ */
+static bool discard_image(const std::string &path, uint64_t *size_out)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (S_ISBLK(sb.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, size_out) < 0) {
+            LOGE("%s: Failed to get device size: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+
+        uint64_t range[2] = { 0, *size_out };
+        if (ioctl(fd, BLKDISCARD, range) < 0) {
+            // Not fatal. mkfs will overwrite what it needs to.
+            LOGW("%s: Failed to discard blocks: %s",
+                 path.c_str(), strerror(errno));
+        }
+    } else if (S_ISREG(sb.st_mode)) {
+        *size_out = sb.st_size;
+
+        if (ftruncate64(fd, 0) < 0 || ftruncate64(fd, *size_out) < 0) {
+            LOGE("%s: Failed to truncate: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+    } else {
+        LOGE("%s: Not an image or block device", path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Replace the filesystem in an existing image or block device
+ *
+ * This is much faster than deleting every file in the old filesystem. The old
+ * blocks are released with discard_image() and the new filesystem is created
+ * with mke2fs with lazily initialized inode tables or, if mke2fs is not
+ * available, with make_ext4fs.
+ *
+ * \p path must not be mounted.
+ *
+ * \return Whether the new filesystem was created
+ */
+bool format_ext4_image(const std::string &path)
+{
+    uint64_t size;
+    if (!discard_image(path, &size)) {
+        return false;
+    }
+
+    if (run_mke2fs_lazy(path)) {
+        return true;
+    }
+
+    LOGW("%s: Falling back to make_ext4fs", path.c_str());
+
+    char size_str[64];
+    snprintf(size_str, sizeof(size_str), "%" PRIu64, size);
+
+    const char *argv[] =
+            { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
+    int ret = util::run_command(argv[0], argv, nullptr, nullptr,
+                                &output_cb, argv);
+    if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret) != 0) {
+        LOGE("%s: Failed to format image", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8
+            | static_cast<uint32_t>(p[2]) << 16
+            | static_cast<uint32_t>(p[3]) << 24;
+}
+
+/*!
+ * \brief Check if an ext4 image needs to be checked before it is mounted
+ *
+ * This uses the same criteria as `e2fsck -p`: the filesystem was not cleanly
+ * unmounted, has errors or orphans, needs journal recovery, or reached its
+ * maximum mount count or check interval. If the superblock can't be read or
+ * isn't recognized, the image is always checked.
+ */
+static bool ext4_image_needs_fsck(const std::string &image)
+{
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+    ssize_t n = pread(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET);
+    close(fd);
+
+    if (n != sizeof(sb) || read_le16(sb + EXT4_SB_MAGIC) != EXT4_MAGIC) {
+        return true;
+    }
+
+    uint16_t state = read_le16(sb + EXT4_SB_STATE);
+    if (!(state & EXT4_VALID_FS) || (state & EXT4_ERROR_FS)) {
+        return true;
+    }
+
+    if ((read_le32(sb + EXT4_SB_FEATURE_INCOMPAT)
+            & EXT4_FEATURE_INCOMPAT_RECOVER)
+            || read_le32(sb + EXT4_SB_LAST_ORPHAN) != 0) {
+        return true;
+    }
+
+    auto max_mnt_count =
+            static_cast<int16_t>(read_le16(sb + EXT4_SB_MAX_MNT_COUNT));
+    if (max_mnt_count > 0
+            && read_le16(sb + EXT4_SB_MNT_COUNT) >= max_mnt_count) {
+        return true;
+    }
+
+    uint32_t interval = read_le32(sb + EXT4_SB_CHECKINTERVAL);
+    if (interval != 0 && static_cast<uint64_t>(time(nullptr))
+            >= static_cast<uint64_t>(read_le32(sb + EXT4_SB_LASTCHECK))
+                    + interval) {
+        return true;
+    }
+
+    return false;
+}
+
 bool fsck_ext4_image(const std::string &image)
 {
+    if (!ext4_image_needs_fsck(image)) {
+        LOGD("%s: Filesystem is clean; skipping e2fsck", image.c_str());
+        return true;
+    }
+
     const char *argv[] = { "e2fsck", "-f", "-y", image.c_str(), nullptr };
     int ret = util::run_command(argv[0], argv, nullptr, nullptr,
                                 &output_cb, argv);
@@ -94,4 +365,350 @@ bool fsck_ext4_image(const std::string &image)
     return true;
 }
 
+struct Ext4Layout
+{
+    uint64_t block_size;
+    uint64_t blocks_count;
+    uint64_t first_data_block;
+    uint64_t blocks_per_group;
+    uint64_t groups;
+    // Raw group descriptors
+    std::vector<unsigned char> gdt;
+    size_t desc_size;
+    bool is_64bit;
+};
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool pwrite_fully(int fd, const void *buf, size_t size,
+                         uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pwrite64(fd, static_cast<const char *>(buf) + total,
+                             size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the geometry and group descriptors of a clean ext4 filesystem
+ *
+ * Filesystems that are not cleanly unmounted or that use meta_bg (where the
+ * group descriptors are not contiguous) are rejected.
+ */
+static bool read_ext4_layout(int fd, const std::string &path,
+                             Ext4Layout *layout)
+{
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+    if (!pread_fully(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET)
+            || read_le16(sb + EXT4_SB_MAGIC) != EXT4_MAGIC) {
+        LOGW("%s: Not an ext4 filesystem", path.c_str());
+        return false;
+    }
+
+    uint16_t state = read_le16(sb + EXT4_SB_STATE);
+    uint32_t incompat = read_le32(sb + EXT4_SB_FEATURE_INCOMPAT);
+    uint32_t log_block_size = read_le32(sb + EXT4_SB_LOG_BLOCK_SIZE);
+
+    if (!(state & EXT4_VALID_FS) || (state & EXT4_ERROR_FS)
+            || (incompat & EXT4_FEATURE_INCOMPAT_RECOVER)) {
+        LOGW("%s: Filesystem is not clean", path.c_str());
+        return false;
+    } else if (incompat & EXT4_FEATURE_INCOMPAT_META_BG) {
+        LOGW("%s: meta_bg is not supported", path.c_str());
+        return false;
+    } else if (log_block_size > 6) {
+        LOGW("%s: Invalid block size", path.c_str());
+        return false;
+    }
+
+    layout->is_64bit = incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+    layout->block_size = 1024u << log_block_size;
+    layout->blocks_count = read_le32(sb + EXT4_SB_BLOCKS_COUNT_LO);
+    if (layout->is_64bit) {
+        layout->blocks_count |= static_cast<uint64_t>(
+                read_le32(sb + EXT4_SB_BLOCKS_COUNT_HI)) << 32;
+    }
+    layout->first_data_block = read_le32(sb + EXT4_SB_FIRST_DATA_BLOCK);
+    layout->blocks_per_group = read_le32(sb + EXT4_SB_BLOCKS_PER_GROUP);
+    layout->desc_size = layout->is_64bit
+            ? read_le16(sb + EXT4_SB_DESC_SIZE) : EXT4_MIN_DESC_SIZE;
+
+    if (layout->blocks_per_group == 0
+            || layout->blocks_per_group > layout->block_size * 8
+            || layout->first_data_block >= layout->blocks_count
+            || layout->desc_size < (layout->is_64bit
+                    ? EXT4_MIN_DESC_SIZE_64BIT : EXT4_MIN_DESC_SIZE)) {
+        LOGW("%s: Invalid filesystem geometry", path.c_str());
+        return false;
+    }
+
+    layout->groups = (layout->blocks_count - layout->first_data_block
+            + layout->blocks_per_group - 1) / layout->blocks_per_group;
+
+    // The group descriptors start in the block after the superblock
+    layout->gdt.resize(layout->groups * layout->desc_size);
+    if (!pread_fully(fd, layout->gdt.data(), layout->gdt.size(),
+                     (layout->first_data_block + 1) * layout->block_size)) {
+        LOGW("%s: Failed to read group descriptors: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_zero(const unsigned char *buf, size_t size)
+{
+    return size == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, size - 1) == 0);
+}
+
+/*!
+ * \brief Copy a range of blocks
+ *
+ * If \a skip_zero is true, all-zero chunks are not written (the target must
+ * already read back as zeros there).
+ */
+static bool copy_blocks(int fd_source, int fd_target, uint64_t block_size,
+                        uint64_t start, uint64_t count, bool skip_zero,
+                        std::vector<unsigned char> &buf)
+{
+    uint64_t offset = start * block_size;
+    uint64_t remain = count * block_size;
+
+    while (remain > 0) {
+        size_t n = std::min<uint64_t>(remain, buf.size());
+
+        if (!pread_fully(fd_source, buf.data(), n, offset)) {
+            return false;
+        }
+
+        if (!(skip_zero && is_zero(buf.data(), n))
+                && !pwrite_fully(fd_target, buf.data(), n, offset)) {
+            return false;
+        }
+
+        offset += n;
+        remain -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check whether an ext4 filesystem can be cloned onto a target
+ *
+ * \param source Image or block device containing a clean ext4 filesystem
+ * \param target Image or block device that will be overwritten
+ *
+ * \return Whether the source is supported and the target is large enough. If a
+ *         regular file target does not exist or is too small, it is resized by
+ *         clone_ext4_image(), so the result only depends on the source.
+ */
+bool can_clone_ext4_image(const std::string &source, const std::string &target)
+{
+    int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fd < 0) {
+        return false;
+    }
+
+    Ext4Layout layout;
+    bool ok = read_ext4_layout(fd, source, &layout);
+    close(fd);
+
+    if (!ok) {
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(target.c_str(), &sb) == 0 && S_ISBLK(sb.st_mode)) {
+        uint64_t size;
+        if (!util::get_blockdev_size(target.c_str(), &size)
+                || size < layout.blocks_count * layout.block_size) {
+            LOGW("%s: Block device is smaller than %s",
+                 target.c_str(), source.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy the used blocks of an ext4 filesystem
+ *
+ * Only the blocks marked as in use in the block bitmaps (plus everything
+ * before the first group) are copied. Groups whose bitmaps are not initialized
+ * are copied in full. The result is an identical filesystem, but the free
+ * blocks of a block device target are left as they are.
+ *
+ * \param source Image or block device containing a clean ext4 filesystem
+ * \param target Image or block device to write to. The contents of a regular
+ *               file are replaced and all-zero chunks are left as holes.
+ *
+ * \return Whether the filesystem was cloned. If false, the target is only
+ *         modified if the error happened while copying blocks.
+ */
+bool clone_ext4_image(const std::string &source, const std::string &target)
+{
+    if (!can_clone_ext4_image(source, target)) {
+        return false;
+    }
+
+    int fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    if (fd_source < 0) {
+        LOGE("%s: Failed to open: %s", source.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_source = util::finally([&]{
+        close(fd_source);
+    });
+
+    Ext4Layout layout;
+    if (!read_ext4_layout(fd_source, source, &layout)) {
+        return false;
+    }
+
+    int fd_target = open(target.c_str(),
+                         O_WRONLY | O_CREAT | O_CLOEXEC | O_LARGEFILE, 0644);
+    if (fd_target < 0) {
+        LOGE("%s: Failed to open: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_target = util::finally([&]{
+        close(fd_target);
+    });
+
+    uint64_t fs_size = layout.blocks_count * layout.block_size;
+    struct stat sb;
+
+    if (fstat(fd_target, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    // An existing image keeps its size if it is larger than the filesystem
+    bool sparse = S_ISREG(sb.st_mode);
+    if (sparse && (ftruncate64(fd_target, 0) < 0
+            || ftruncate64(fd_target, std::max<uint64_t>(
+                    fs_size, sb.st_size)) < 0)) {
+        LOGE("%s: Failed to set file size: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<unsigned char> bitmap(layout.block_size);
+    std::vector<unsigned char> buf(std::max<uint64_t>(
+            CLONE_MAX_RUN_SIZE, layout.block_size));
+    uint64_t copied = 0;
+
+    auto fail = [&]{
+        LOGE("Failed to clone %s to %s: %s",
+             source.c_str(), target.c_str(), strerror(errno));
+        return false;
+    };
+
+    // Boot sector and superblock for filesystems with 1 KiB blocks
+    if (!copy_blocks(fd_source, fd_target, layout.block_size, 0,
+                     layout.first_data_block, sparse, buf)) {
+        return fail();
+    }
+    copied += layout.first_data_block;
+
+    for (uint64_t group = 0; group < layout.groups; ++group) {
+        const unsigned char *desc =
+                layout.gdt.data() + group * layout.desc_size;
+        uint64_t start = layout.first_data_block
+                + group * layout.blocks_per_group;
+        uint64_t count = std::min(layout.blocks_per_group,
+                                  layout.blocks_count - start);
+
+        if (read_le16(desc + EXT4_BG_FLAGS) & EXT4_BG_BLOCK_UNINIT) {
+            if (!copy_blocks(fd_source, fd_target, layout.block_size, start,
+                             count, sparse, buf)) {
+                return fail();
+            }
+            copied += count;
+            continue;
+        }
+
+        uint64_t bitmap_block = read_le32(desc + EXT4_BG_BLOCK_BITMAP_LO);
+        if (layout.is_64bit) {
+            bitmap_block |= static_cast<uint64_t>(
+                    read_le32(desc + EXT4_BG_BLOCK_BITMAP_HI)) << 32;
+        }
+
+        if (bitmap_block >= layout.blocks_count) {
+            errno = EINVAL;
+            return fail();
+        } else if (!pread_fully(fd_source, bitmap.data(), bitmap.size(),
+                                bitmap_block * layout.block_size)) {
+            return fail();
+        }
+
+        // Copy runs of used blocks
+        uint64_t i = 0;
+        while (i < count) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+                ++i;
+                continue;
+            }
+
+            uint64_t run = i;
+            while (run < count && (bitmap[run / 8] & (1 << (run % 8)))) {
+                ++run;
+            }
+
+            if (!copy_blocks(fd_source, fd_target, layout.block_size,
+                             start + i, run - i, sparse, buf)) {
+                return fail();
+            }
+            copied += run - i;
+            i = run;
+        }
+    }
+
+    if (fsync(fd_target) < 0) {
+        return fail();
+    }
+
+    LOGD("Cloned %s to %s (%" PRIu64 " of %" PRIu64 " blocks)",
+         source.c_str(), target.c_str(), copied, layout.blocks_count);
+
+    return true;
+}
+
 }
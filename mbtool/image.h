@@ -35,6 +35,9 @@ enum class CreateImageResult
 };
 
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size);
+bool format_ext4_image(const std::string &path);
 bool fsck_ext4_image(const std::string &image);
+bool can_clone_ext4_image(const std::string &source, const std::string &target);
+bool clone_ext4_image(const std::string &source, const std::string &target);
 
 }
\ No newline at end of file
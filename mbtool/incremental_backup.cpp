@@ -0,0 +1,568 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "incremental_backup.h"
+
+#include <atomic>
+#include <unordered_map>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/integer.h"
+#include "mbutil/string.h"
+
+// Files are split into chunks of this size before they are added to the store
+#define CHUNK_SIZE              (1024 * 1024)
+
+// Extended attribute that replaces the data of regular files in the archive.
+// It has no namespace, so it can never be a real xattr on Linux.
+#define CHUNKS_XATTR            "mbtool.chunks"
+
+namespace mb
+{
+
+/*
+ * Incremental backups store the contents of regular files in a content
+ * addressed chunk store that is shared between backups. The archive itself
+ * only contains the metadata (with all of the usual xattrs, ACLs, etc.) and
+ * each regular file has a CHUNKS_XATTR entry of the form:
+ *
+ *     <size>:<sha256 of chunk 1>,<sha256 of chunk 2>,...
+ *
+ * A manifest with the inode, mtime, and chunk list of each file is written
+ * next to the archive. The next incremental backup uses it to avoid reading
+ * files that have not changed.
+ */
+
+struct ManifestEntry
+{
+    uint64_t ino;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    std::string ref;
+};
+
+typedef std::unordered_map<std::string, ManifestEntry> Manifest;
+
+struct CreateContext
+{
+    std::string chunk_dir;
+    Manifest base_manifest;
+    FILE *manifest_fp;
+    std::vector<unsigned char> buf;
+    // Size of all regular files
+    uint64_t total_bytes = 0;
+    // Size of chunks that were not already in the store
+    uint64_t new_bytes = 0;
+};
+
+struct ExtractContext
+{
+    std::string chunk_dir;
+};
+
+static std::atomic_uint temp_counter(0);
+
+static std::string chunk_path(const std::string &chunk_dir,
+                              const std::string &hash)
+{
+    std::string path(chunk_dir);
+    path += '/';
+    path.append(hash, 0, 2);
+    path += '/';
+    path += hash;
+    return path;
+}
+
+static std::string chunk_hash(const unsigned char *data, size_t size)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(data, size, digest);
+    return util::hex_string(digest, sizeof(digest));
+}
+
+static bool parse_ref(const std::string &ref, uint64_t *size_out,
+                      std::vector<std::string> *hashes_out)
+{
+    auto colon = ref.find(':');
+    if (colon == std::string::npos
+            || !util::str_to_unum(ref.substr(0, colon).c_str(), 10, size_out)) {
+        return false;
+    }
+
+    hashes_out->clear();
+
+    size_t pos = colon + 1;
+    while (pos < ref.size()) {
+        size_t end = ref.find(',', pos);
+        if (end == std::string::npos) {
+            end = ref.size();
+        }
+        if (end - pos != 2 * SHA256_DIGEST_LENGTH) {
+            return false;
+        }
+        hashes_out->push_back(ref.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add a chunk to the store if it does not already exist
+ *
+ * The chunk is written to a temporary file and renamed into place, so
+ * concurrent backups may add the same chunk.
+ */
+static bool store_chunk(CreateContext &ctx, const unsigned char *data,
+                        size_t size, const std::string &hash)
+{
+    std::string path = chunk_path(ctx.chunk_dir, hash);
+
+    if (access(path.c_str(), F_OK) == 0) {
+        return true;
+    }
+
+    std::string dir(path, 0, path.size() - hash.size() - 1);
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string temp_path = format("%s.tmp.%d.%u", path.c_str(), getpid(),
+                                   temp_counter++);
+
+    if (!util::file_write_data(temp_path, reinterpret_cast<const char *>(data),
+                               size)) {
+        LOGE("%s: Failed to write chunk: %s",
+             temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    ctx.new_bytes += size;
+    return true;
+}
+
+static bool chunks_exist(const std::string &chunk_dir, const std::string &ref)
+{
+    uint64_t size;
+    std::vector<std::string> hashes;
+
+    if (!parse_ref(ref, &size, &hashes)) {
+        return false;
+    }
+
+    for (auto const &hash : hashes) {
+        if (access(chunk_path(chunk_dir, hash).c_str(), F_OK) < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Split a file into chunks and add them to the store
+ */
+static bool store_file(CreateContext &ctx, const char *path, std::string *ref_out)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path, strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    std::string hashes;
+    uint64_t total = 0;
+
+    ctx.buf.resize(CHUNK_SIZE);
+
+    while (true) {
+        // Fill the entire chunk unless EOF is reached
+        size_t n = 0;
+        while (n < ctx.buf.size()) {
+            ssize_t r = read(fd, ctx.buf.data() + n, ctx.buf.size() - n);
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("%s: Failed to read: %s", path, strerror(errno));
+                return false;
+            } else if (r == 0) {
+                break;
+            }
+            n += r;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        std::string hash = chunk_hash(ctx.buf.data(), n);
+        if (!store_chunk(ctx, ctx.buf.data(), n, hash)) {
+            return false;
+        }
+
+        if (!hashes.empty()) {
+            hashes += ',';
+        }
+        hashes += hash;
+        total += n;
+
+        if (n < ctx.buf.size()) {
+            break;
+        }
+    }
+
+    *ref_out = format("%" PRIu64 ":", total);
+    *ref_out += hashes;
+    return true;
+}
+
+static bool load_manifest(const std::string &path, Manifest &manifest)
+{
+    autoclose::file fp(autoclose::fopen(path.c_str(), "re"));
+    if (!fp) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOGE("%s: Failed to open manifest: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        // <inode>\t<mtime sec>\t<mtime nsec>\t<ref>\t<path>
+        std::vector<std::string> fields = util::split(line, "\t");
+        if (fields.size() < 5) {
+            LOGW("%s: Ignoring invalid manifest line", path.c_str());
+            continue;
+        }
+
+        ManifestEntry entry;
+        if (!util::str_to_unum(fields[0].c_str(), 10, &entry.ino)
+                || !util::str_to_snum(fields[1].c_str(), 10, &entry.mtime_sec)
+                || !util::str_to_snum(fields[2].c_str(), 10, &entry.mtime_nsec)) {
+            LOGW("%s: Ignoring invalid manifest line", path.c_str());
+            continue;
+        }
+        entry.ref = std::move(fields[3]);
+
+        // The path may contain tabs
+        std::string file_path = std::move(fields[4]);
+        for (size_t i = 5; i < fields.size(); ++i) {
+            file_path += '\t';
+            file_path += fields[i];
+        }
+
+        manifest[std::move(file_path)] = std::move(entry);
+    }
+
+    return true;
+}
+
+static bool create_file_cb(archive_entry *entry, bool *store_data,
+                           void *userdata)
+{
+    auto *ctx = static_cast<CreateContext *>(userdata);
+    const char *path = archive_entry_pathname(entry);
+    const char *source = archive_entry_sourcepath(entry);
+    uint64_t ino = archive_entry_ino64(entry);
+    int64_t mtime_sec = archive_entry_mtime(entry);
+    long mtime_nsec = archive_entry_mtime_nsec(entry);
+    uint64_t size = archive_entry_size(entry);
+
+    if (!path || !source) {
+        LOGE("Entry has no path");
+        return false;
+    }
+
+    std::string ref;
+    uint64_t ref_size;
+    std::vector<std::string> hashes;
+
+    // Reuse the chunks from the previous backup if the file appears unchanged
+    auto it = ctx->base_manifest.find(path);
+    if (it != ctx->base_manifest.end()
+            && it->second.ino == ino
+            && it->second.mtime_sec == mtime_sec
+            && it->second.mtime_nsec == mtime_nsec
+            && parse_ref(it->second.ref, &ref_size, &hashes)
+            && ref_size == size
+            && chunks_exist(ctx->chunk_dir, it->second.ref)) {
+        ref = it->second.ref;
+    } else if (!store_file(*ctx, source, &ref)) {
+        return false;
+    }
+
+    archive_entry_xattr_add_entry(entry, CHUNKS_XATTR, ref.data(), ref.size());
+
+    // Paths with newlines can't be stored in the manifest. They will just be
+    // read again next time.
+    if (!strchr(path, '\n')) {
+        fprintf(ctx->manifest_fp, "%" PRIu64 "\t%" PRId64 "\t%ld\t%s\t%s\n",
+                ino, mtime_sec, mtime_nsec, ref.c_str(), path);
+    }
+
+    ctx->total_bytes += size;
+    *store_data = false;
+    return true;
+}
+
+static bool extract_file_cb(archive *out, archive_entry *entry, bool *handled,
+                            void *userdata)
+{
+    auto *ctx = static_cast<ExtractContext *>(userdata);
+    const char *path = archive_entry_pathname(entry);
+
+    std::string ref;
+    bool found = false;
+    std::vector<std::pair<std::string, std::string>> xattrs;
+
+    archive_entry_xattr_reset(entry);
+
+    const char *name;
+    const void *value;
+    size_t size;
+    while (archive_entry_xattr_next(entry, &name, &value, &size)
+            == ARCHIVE_OK) {
+        if (strcmp(name, CHUNKS_XATTR) == 0) {
+            ref.assign(static_cast<const char *>(value), size);
+            found = true;
+        } else {
+            xattrs.emplace_back(name, std::string(
+                    static_cast<const char *>(value), size));
+        }
+    }
+
+    if (!found) {
+        *handled = false;
+        return true;
+    }
+
+    uint64_t file_size;
+    std::vector<std::string> hashes;
+
+    if (!parse_ref(ref, &file_size, &hashes)) {
+        LOGE("%s: Invalid chunk list: %s", path, ref.c_str());
+        return false;
+    }
+
+    // Don't try to restore our own xattr
+    archive_entry_xattr_clear(entry);
+    for (auto const &xattr : xattrs) {
+        archive_entry_xattr_add_entry(entry, xattr.first.c_str(),
+                                      xattr.second.data(),
+                                      xattr.second.size());
+    }
+
+    archive_entry_set_size(entry, file_size);
+
+    if (archive_write_header(out, entry) != ARCHIVE_OK) {
+        LOGE("%s: %s", path, archive_error_string(out));
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    int64_t offset = 0;
+
+    for (auto const &hash : hashes) {
+        std::string chunk = chunk_path(ctx->chunk_dir, hash);
+
+        if (!util::file_read_all(chunk, &data)) {
+            LOGE("%s: Failed to read chunk: %s", chunk.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (chunk_hash(data.data(), data.size()) != hash) {
+            LOGE("%s: Chunk is corrupted", chunk.c_str());
+            return false;
+        }
+
+        if (archive_write_data_block(out, data.data(), data.size(), offset)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to write data: %s",
+                 path, archive_error_string(out));
+            return false;
+        }
+
+        offset += data.size();
+    }
+
+    if ((uint64_t) offset != file_size) {
+        LOGE("%s: Expected %" PRIu64 " bytes, but chunks contain %" PRId64,
+             path, file_size, offset);
+        return false;
+    }
+
+    if (archive_write_finish_entry(out) != ARCHIVE_OK) {
+        LOGE("%s: %s", path, archive_error_string(out));
+        return false;
+    }
+
+    *handled = true;
+    return true;
+}
+
+/*!
+ * \brief Create an incremental pax archive
+ *
+ * \param filename Target archive path
+ * \param base_dir Base directory for \a paths
+ * \param paths List of paths to add to the archive
+ * \param compression Compression type of the archive (the chunks are stored
+ *                    uncompressed)
+ * \param threads Maximum number of compression threads (0 for all CPUs)
+ * \param chunk_dir Chunk store directory
+ * \param manifest_path Path to write the manifest to
+ * \param base_manifest_path Manifest of the previous backup (or empty string)
+ * \param bytes_out If not nullptr, set to the uncompressed size of the archive
+ *                  plus the size of all files
+ *
+ * \return Whether the archive creation was successful
+ */
+bool incremental_tar_create(const std::string &filename,
+                            const std::string &base_dir,
+                            const std::vector<std::string> &paths,
+                            util::compression_type compression,
+                            unsigned int threads,
+                            const std::string &chunk_dir,
+                            const std::string &manifest_path,
+                            const std::string &base_manifest_path,
+                            uint64_t *bytes_out)
+{
+    CreateContext ctx;
+    ctx.chunk_dir = chunk_dir;
+
+    if (mkdir(chunk_dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             chunk_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!base_manifest_path.empty()
+            && !load_manifest(base_manifest_path, ctx.base_manifest)) {
+        return false;
+    }
+
+    std::string temp_manifest(manifest_path);
+    temp_manifest += ".tmp";
+
+    autoclose::file fp(autoclose::fopen(temp_manifest.c_str(), "we"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             temp_manifest.c_str(), strerror(errno));
+        return false;
+    }
+    ctx.manifest_fp = fp.get();
+
+    uint64_t archive_bytes;
+
+    if (!util::libarchive_tar_create(filename, base_dir, paths, compression,
+                                     threads, &archive_bytes,
+                                     &create_file_cb, &ctx)) {
+        unlink(temp_manifest.c_str());
+        return false;
+    }
+
+    if (fclose(fp.release()) < 0) {
+        LOGE("%s: Failed to close file: %s",
+             temp_manifest.c_str(), strerror(errno));
+        unlink(temp_manifest.c_str());
+        return false;
+    }
+
+    if (rename(temp_manifest.c_str(), manifest_path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s", temp_manifest.c_str(),
+             manifest_path.c_str(), strerror(errno));
+        unlink(temp_manifest.c_str());
+        return false;
+    }
+
+    LOGI("%s: %.1f MiB of files, %.1f MiB of new chunks", filename.c_str(),
+         ctx.total_bytes / 1024.0 / 1024.0, ctx.new_bytes / 1024.0 / 1024.0);
+
+    if (bytes_out) {
+        *bytes_out = archive_bytes + ctx.total_bytes;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract an archive created by incremental_tar_create()
+ *
+ * \param filename Source archive path
+ * \param target Target directory
+ * \param compression Compression type of the archive
+ * \param chunk_dir Chunk store directory
+ *
+ * \return Whether the extraction was successful
+ */
+bool incremental_tar_extract(const std::string &filename,
+                             const std::string &target,
+                             util::compression_type compression,
+                             const std::string &chunk_dir)
+{
+    ExtractContext ctx;
+    ctx.chunk_dir = chunk_dir;
+
+    return util::libarchive_tar_extract(filename, target, {}, compression, 0,
+                                        &extract_file_cb, &ctx);
+}
+
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+
+bool incremental_tar_create(const std::string &filename,
+                            const std::string &base_dir,
+                            const std::vector<std::string> &paths,
+                            util::compression_type compression,
+                            unsigned int threads,
+                            const std::string &chunk_dir,
+                            const std::string &manifest_path,
+                            const std::string &base_manifest_path,
+                            uint64_t *bytes_out);
+bool incremental_tar_extract(const std::string &filename,
+                             const std::string &target,
+                             util::compression_type compression,
+                             const std::string &chunk_dir);
+
+}
@@ -20,7 +20,9 @@
 #include "init.h"
 
 #include <algorithm>
+#include <iterator>
 #include <memory>
+#include <thread>
 #include <unordered_set>
 
 #include <cerrno>
@@ -36,10 +38,6 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "minizip/ioandroid.h"
-#include "minizip/ioapi_buf.h"
-#include "minizip/unzip.h"
-
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
@@ -60,6 +58,7 @@
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/zip.h"
 
 #include "external/property_service.h"
 
@@ -72,6 +71,7 @@
 #include "romconfig.h"
 #include "sepolpatch.h"
 #include "signature.h"
+#include "trace.h"
 
 #define RUN_ADB_BEFORE_EXEC_OR_REBOOT 0
 
@@ -602,12 +602,25 @@ static bool strip_manual_mounts()
                     && (strstr(line, "/system")
                     || strstr(line, "/cache")
                     || strstr(line, "/data"))) {
-                std::vector<std::string> tokens = util::tokenize(line, " \t\n");
-                if (tokens.size() >= 4 && tokens[0] == "mount"
-                        && (tokens[3] == "/system"
-                        || tokens[3] == "/cache"
-                        || tokens[3] == "/data")) {
-                    comment_out.insert(count);
+                // Only the first and fourth tokens are needed, so avoid
+                // allocating a vector of strings for every candidate line
+                StringSplitter splitter(line, static_cast<size_t>(read),
+                                        " \t\n", 3, SplitMode::AnyOf);
+                const char *token;
+                size_t token_len;
+                size_t n = 0;
+                bool is_mount = false;
+
+                while (n < 4 && splitter.next(token, token_len)) {
+                    if (n == 0) {
+                        is_mount = equals_n(token, token_len, "mount", 5);
+                    } else if (n == 3 && is_mount
+                            && (equals_n(token, token_len, "/system", 7)
+                            || equals_n(token, token_len, "/cache", 6)
+                            || equals_n(token, token_len, "/data", 5))) {
+                        comment_out.insert(count);
+                    }
+                    ++n;
                 }
             }
 
@@ -922,76 +935,23 @@ static bool disable_spota()
 
 static bool extract_zip(const char *source, const char *target)
 {
-    unzFile uf;
-    zlib_filefunc64_def zFunc;
-    ourbuffer_t iobuf;
-
-    memset(&zFunc, 0, sizeof(zFunc));
-    memset(&iobuf, 0, sizeof(iobuf));
-
-    fill_android_filefunc64(&iobuf.filefunc64);
-    fill_buffer_filefunc64(&zFunc, &iobuf);
-
-    uf = unzOpen2_64(source, &zFunc);
-    if (!uf) {
-        LOGE("%s: Failed to open zip", source);
+    util::ZipReader zip;
+    if (!zip.open(source)) {
         return false;
     }
 
-    auto close_zip = util::finally([&]{
-        unzClose(uf);
-    });
-
-    if (unzLocateFile(uf, "exec", nullptr) != UNZ_OK) {
+    const util::ZipEntry *entry = zip.find("exec");
+    if (!entry) {
         LOGE("%s: Failed to find 'exec' in zip", source);
         return false;
     }
 
-    if (unzOpenCurrentFile(uf) != UNZ_OK) {
-        LOGE("%s: Failed to open file in zip", source);
-        return false;
-    }
-
-    auto close_inner_file = util::finally([&]{
-        unzCloseCurrentFile(uf);
-    });
-
     std::string target_file(target);
     target_file += "/exec";
 
     util::mkdir_recursive(target, 0755);
 
-    FILE *fp = fopen(target_file.c_str(), "wb");
-    if (!fp) {
-        LOGE("%s: Failed to open for writing: %s",
-             target_file.c_str(), strerror(errno));
-        return false;
-    }
-
-    char buf[8192];
-    int bytes_read;
-
-    while ((bytes_read = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0) {
-        size_t bytes_written = fwrite(buf, 1, bytes_read, fp);
-        if (bytes_written == 0) {
-            bool ret = !ferror(fp);
-            fclose(fp);
-            return ret;
-        }
-    }
-    if (bytes_read != 0) {
-        LOGE("%s: Failed before reaching inner file's EOF", source);
-        fclose(fp);
-        return false;
-    }
-
-    if (fclose(fp) < 0) {
-        LOGE("%s: Error when closing file: %s",
-             target_file.c_str(), strerror(errno));
-        return false;
-    }
-
-    return true;
+    return zip.extract(*entry, target_file);
 }
 
 static bool launch_boot_menu()
@@ -1102,6 +1062,141 @@ static void run_adb()
 }
 #endif
 
+// Temporary files for policies that are patched while booting
+#define SEPOLICY_PRE_BOOT_TEMP          "/sepolicy.mbtool_pre_boot"
+#define SEPOLICY_MAIN_TEMP              "/sepolicy.mbtool_main"
+
+// Directories whose page cache contents are recorded for boot readahead
+static const char *readahead_roots[] = {
+    "/system",
+    "/data/app",
+    "/data/dalvik-cache",
+};
+
+static bool load_device_definition(Device &device)
+{
+    util::FileView contents;
+    contents.open(DEVICE_JSON_PATH);
+
+    JsonError error;
+
+    if (!device_from_json(std::string(contents.begin(), contents.end()),
+                          device, error)) {
+        LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
+        return false;
+    } else if (device.validate()) {
+        LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
+        return false;
+    }
+
+    return true;
+}
+
+struct PreparedSepolicy
+{
+    bool pre_boot = false;
+    bool main = false;
+    bool main_failed = false;
+};
+
+/*!
+ * \brief Patch the pre-boot and main SELinux policies ahead of time
+ *
+ * This runs in parallel with the boot menu once /data is mounted. The main
+ * patch depends on the label of the internal storage and the patched policies
+ * are cached in \p cache_dir, so both are only available at that point. The
+ * patched policies are written to temporary files so that loading and
+ * installing them can happen at the same points in the boot process as before.
+ */
+static void prepare_sepolicy(PreparedSepolicy &prepared,
+                             const std::string &cache_dir)
+{
+    struct stat sb;
+    if (stat(SELINUX_DEFAULT_POLICY_FILE, &sb) < 0) {
+        return;
+    }
+
+    prepared.pre_boot = patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE,
+                                              SEPOLICY_PRE_BOOT_TEMP,
+                                              SELinuxPatch::PRE_BOOT,
+                                              cache_dir);
+
+    prepared.main = patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE,
+                                          SEPOLICY_MAIN_TEMP,
+                                          SELinuxPatch::MAIN,
+                                          cache_dir);
+    prepared.main_failed = !prepared.main;
+}
+
+/*!
+ * \brief Load a policy file into the kernel
+ *
+ * The kernel only accepts the policy in a single write.
+ */
+static bool load_sepolicy_file(const char *path)
+{
+    util::FileView data;
+    if (!data.open(path)) {
+        LOGE("%s: Failed to read file: %s", path, strerror(errno));
+        return false;
+    }
+
+    int fd = open(SELINUX_LOAD_FILE, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open file: %s", SELINUX_LOAD_FILE, strerror(errno));
+        return false;
+    }
+
+    ssize_t n = write(fd, data.data(), data.size());
+    int saved_errno = errno;
+    close(fd);
+
+    if (n < 0 || static_cast<size_t>(n) != data.size()) {
+        LOGE("%s: Failed to load policy: %s", path, strerror(saved_errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Start warming the page cache for the ROM in the background
+ *
+ * If the ROM has no readahead list yet, the files under readahead_roots that
+ * are in the page cache a minute into the boot are recorded. Otherwise, the
+ * list is replayed. Either way, the work happens in a separate `readahead`
+ * process that outlives the exec of the real init.
+ */
+static bool start_readahead(const std::string &list_path)
+{
+    bool replay = access(list_path.c_str(), R_OK) == 0;
+
+    std::vector<const char *> argv{
+        "readahead", "--log-to-kmsg", replay ? "replay" : "record",
+        list_path.c_str()
+    };
+    if (!replay) {
+        argv.insert(argv.end(), std::begin(readahead_roots),
+                    std::end(readahead_roots));
+    }
+    argv.push_back(nullptr);
+
+    LOGV("%s readahead list: %s",
+         replay ? "Replaying" : "Recording", list_path.c_str());
+
+    // vfork() so that /proc/self/exe is resolved before /proc is unmounted
+    pid_t pid = vfork();
+    if (pid == 0) {
+        execv("/proc/self/exe", const_cast<char * const *>(argv.data()));
+        _exit(127);
+    } else if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 static bool critical_failure()
 {
 #if RUN_ADB_BEFORE_EXEC_OR_REBOOT
@@ -1142,6 +1237,8 @@ int init_main(int argc, char *argv[])
         }
     }
 
+    boot_trace_step("start");
+
     // Mount base directories
     mkdir("/dev", 0755);
     mkdir("/proc", 0755);
@@ -1173,36 +1270,49 @@ int init_main(int argc, char *argv[])
     LOGV("Booting up with version %s (%s)",
          version(), git_version());
 
-    std::vector<unsigned char> contents;
-    util::file_read_all(DEVICE_JSON_PATH, &contents);
-    contents.push_back('\0');
+    // The device definition and /default.prop edits only touch the ramdisk,
+    // so they run in parallel with the device probing below
+    Device device;
+    bool device_loaded = false;
+    std::thread ramdisk_thread([&] {
+        device_loaded = load_device_definition(device);
+        if (device_loaded) {
+            add_props_to_default_prop(device);
+        }
+    });
+
+    PreparedSepolicy sepolicy;
+    std::thread sepolicy_thread;
+
+    // Make sure the policy thread is joined on every exit path
+    auto join_sepolicy = util::finally([&] {
+        if (sepolicy_thread.joinable()) {
+            sepolicy_thread.join();
+        }
+    });
 
     // Start probing for devices so we have somewhere to write logs for
     // critical_failure()
+    boot_trace_step("device_init");
     device_init(false);
 
-    Device device;
-    JsonError error;
+    boot_trace_step("wait_ramdisk_edits");
+    ramdisk_thread.join();
 
-    if (!device_from_json(
-            reinterpret_cast<char *>(contents.data()), device, error)) {
-        LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
-        critical_failure();
-        return EXIT_FAILURE;
-    } else if (device.validate()) {
-        LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
+    if (!device_loaded) {
         critical_failure();
         return EXIT_FAILURE;
     }
 
     // Symlink by-name directory to /dev/block/by-name (ugh... ASUS)
+    boot_trace_step("symlink_base_dir");
     symlink_base_dir(device);
 
-    add_props_to_default_prop(device);
-
     // initialize properties
+    boot_trace_step("properties_setup");
     properties_setup();
 
+    boot_trace_step("find_fstab");
     std::string fstab(find_fstab());
 
     LOGV("fstab file: %s", fstab.c_str());
@@ -1226,6 +1336,7 @@ int init_main(int argc, char *argv[])
     LOGV("ROM ID is: %s", rom_id.c_str());
 
     // Mount system, cache, and external SD from fstab file
+    boot_trace_step("mount_fstab");
     int flags = MOUNT_FLAG_REWRITE_FSTAB
             | MOUNT_FLAG_MOUNT_SYSTEM
             | MOUNT_FLAG_MOUNT_CACHE
@@ -1239,24 +1350,41 @@ int init_main(int argc, char *argv[])
 
     LOGV("Successfully mounted fstab");
 
+    // Patch the SELinux policy while the boot menu runs. The patched policies
+    // are cached next to the ROM's config.
+    boot_trace_step("start_sepolicy");
+    std::string cache_dir(util::dir_name(rom->config_path()));
+    sepolicy_thread = std::thread([&sepolicy, cache_dir] {
+        prepare_sepolicy(sepolicy, cache_dir);
+    });
+
+    boot_trace_step("launch_boot_menu");
     if (!launch_boot_menu()) {
         LOGE("Failed to run boot menu");
         // Continue anyway since boot menu might not run on every device
     }
 
     // Mount selinuxfs
+    boot_trace_step("wait_sepolicy");
     selinux_mount();
+    sepolicy_thread.join();
+
     // Load pre-boot policy
-    patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE, SELINUX_LOAD_FILE,
-                   SELinuxPatch::PRE_BOOT);
+    boot_trace_step("load_sepolicy_pre_boot");
+    if (sepolicy.pre_boot) {
+        load_sepolicy_file(SEPOLICY_PRE_BOOT_TEMP);
+        unlink(SEPOLICY_PRE_BOOT_TEMP);
+    }
 
     // Mount ROM (bind mount directory or mount images, etc.)
+    boot_trace_step("mount_rom");
     if (!mount_rom(rom)) {
         LOGE("Failed to mount ROM directories and images");
         critical_failure();
         return EXIT_FAILURE;
     }
 
+    boot_trace_step("load_rom_config");
     std::string config_path(rom->config_path());
     RomConfig config;
     if (!config.load_file(config_path)) {
@@ -1265,42 +1393,58 @@ int init_main(int argc, char *argv[])
     }
 
     LOGD("Enable appsync: %d", config.indiv_app_sharing);
+    LOGD("Enable boot readahead: %d", config.boot_readahead);
+
+    if (config.boot_readahead) {
+        boot_trace_step("start_readahead");
+        start_readahead(cache_dir + "/readahead.list");
+    }
 
     // Make runtime ramdisk modifications
+    boot_trace_step("fix_file_contexts");
     if (access(FILE_CONTEXTS, R_OK) == 0) {
         fix_file_contexts(FILE_CONTEXTS);
     }
     if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
         fix_binary_file_contexts(FILE_CONTEXTS_BIN);
     }
+    boot_trace_step("add_mbtool_services");
     write_fstab_hack(fstab.c_str());
     add_mbtool_services(config.indiv_app_sharing);
     strip_manual_mounts();
 
     // Data modifications
+    boot_trace_step("data_modifications");
     create_layout_version();
 
     // Disable spota
     disable_spota();
 
-    // Patch SELinux policy
-    struct stat sb;
-    if (stat(SELINUX_DEFAULT_POLICY_FILE, &sb) == 0) {
-        if (!patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE,
-                            SELINUX_DEFAULT_POLICY_FILE,
-                            SELinuxPatch::MAIN)) {
-            LOGW("Failed to patch " SELINUX_DEFAULT_POLICY_FILE);
-            critical_failure();
-            return EXIT_FAILURE;
-        }
+    // Install patched SELinux policy
+    boot_trace_step("install_sepolicy");
+    if (sepolicy.main_failed) {
+        LOGW("Failed to patch " SELINUX_DEFAULT_POLICY_FILE);
+        critical_failure();
+        return EXIT_FAILURE;
+    } else if (sepolicy.main && rename(SEPOLICY_MAIN_TEMP,
+                                       SELINUX_DEFAULT_POLICY_FILE) < 0) {
+        LOGW("Failed to replace " SELINUX_DEFAULT_POLICY_FILE ": %s",
+             strerror(errno));
+        critical_failure();
+        return EXIT_FAILURE;
     }
 
     // Kill uevent thread and close uevent socket
+    boot_trace_step("cleanup");
     device_close();
 
     // Kill properties service and clean up
     properties_cleanup();
 
+    // /data is still mounted, so save the trace before launching the real
+    // init. The duration of the last step ends when the trace is written.
+    boot_trace_write(MULTIBOOT_LOG_BOOT_TRACE);
+
     // Remove mbtool init symlink and restore original binary
     unlink("/init");
     rename("/init.orig", "/init");
@@ -1324,6 +1468,7 @@ int init_main(int argc, char *argv[])
 
     // Start real init
     LOGD("Launching real init ...");
+    log::log_flush();
     execlp("/init", "/init", nullptr);
     LOGE("Failed to exec real init: %s", strerror(errno));
     critical_failure();
@@ -18,6 +18,8 @@
 #include "initwrapper/cutils/uevent.h"
 
 #include <cerrno>
+#include <cstring>
+
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -47,6 +49,44 @@ ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length
     return uevent_kernel_recv(socket, buffer, length, true, uid);
 }
 
+/**
+ * Check that a received netlink message originates from the kernel.
+ */
+static bool uevent_check_sender(const struct msghdr *hdr, bool require_group,
+                                uid_t *uid)
+{
+    const struct sockaddr_nl *addr =
+            static_cast<const struct sockaddr_nl *>(hdr->msg_name);
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
+
+    *uid = -1;
+
+    cmsg = CMSG_FIRSTHDR(hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        // Ignoring netlink message with no sender credentials
+        return false;
+    }
+
+    cred = (struct ucred *) CMSG_DATA(cmsg);
+    *uid = cred->uid;
+    if (cred->uid != 0) {
+        // Ignoring netlink message from non-root user
+        return false;
+    }
+
+    if (addr->nl_pid != 0) {
+        // Ignore non-kernel
+        return false;
+    }
+    if (require_group && addr->nl_groups == 0) {
+        // Ignore unicast messages when requested
+        return false;
+    }
+
+    return true;
+}
+
 ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid)
 {
     struct iovec iov = { buffer, length };
@@ -68,38 +108,93 @@ ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require
         return n;
     }
 
-    struct cmsghdr *cmsg;
-    struct ucred *cred;
+    if (!uevent_check_sender(&hdr, require_group, uid)) {
+        // Clear residual potentially malicious data
+        bzero(buffer, length);
+        errno = EIO;
+        return -1;
+    }
 
-    cmsg = CMSG_FIRSTHDR(&hdr);
-    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        // Ignoring netlink message with no sender credentials
-        goto out;
+    return n;
+}
+
+/**
+ * Receive up to \p count multicast messages from the kernel with a single
+ * recvmmsg() call.
+ *
+ * \p buffers must have room for \p count messages of \p length bytes each.
+ * The size of the i'th message is stored in \p lengths[i]. Messages that don't
+ * originate from the kernel are cleared and their size is set to -1.
+ *
+ * If the kernel does not support recvmmsg(), this falls back to receiving a
+ * single message with recvmsg().
+ *
+ * \return Number of messages received (including rejected ones) or -1 on error
+ */
+int uevent_kernel_multicast_recv_batch(int socket, char *buffers,
+                                       size_t length, unsigned int count,
+                                       ssize_t *lengths)
+{
+    static bool have_recvmmsg = true;
+
+    if (count > UEVENT_MAX_BATCH) {
+        count = UEVENT_MAX_BATCH;
     }
 
-    cred = (struct ucred *) CMSG_DATA(cmsg);
-    *uid = cred->uid;
-    if (cred->uid != 0) {
-        // Ignoring netlink message from non-root user
-        goto out;
+    if (!have_recvmmsg) {
+        uid_t uid;
+        ssize_t n = uevent_kernel_recv(socket, buffers, length, true, &uid);
+        if (n < 0 && errno == EIO) {
+            lengths[0] = -1;
+            return 1;
+        } else if (n <= 0) {
+            return n;
+        }
+        lengths[0] = n;
+        return 1;
     }
 
-    if (addr.nl_pid != 0) {
-        // Ignore non-kernel
-        goto out;
+    struct mmsghdr msgs[UEVENT_MAX_BATCH];
+    struct iovec iovs[UEVENT_MAX_BATCH];
+    struct sockaddr_nl addrs[UEVENT_MAX_BATCH];
+    char controls[UEVENT_MAX_BATCH][CMSG_SPACE(sizeof(struct ucred))];
+
+    memset(msgs, 0, sizeof(msgs[0]) * count);
+
+    for (unsigned int i = 0; i < count; ++i) {
+        iovs[i].iov_base = buffers + i * length;
+        iovs[i].iov_len = length;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
     }
-    if (require_group && addr.nl_groups == 0) {
-        // Ignore unicast messages when requested
-        goto out;
+
+    int n = recvmmsg(socket, msgs, count, 0, nullptr);
+    if (n < 0) {
+        if (errno == ENOSYS) {
+            have_recvmmsg = false;
+            return uevent_kernel_multicast_recv_batch(
+                    socket, buffers, length, count, lengths);
+        }
+        return -1;
     }
 
-    return n;
+    for (int i = 0; i < n; ++i) {
+        uid_t uid;
 
-out:
-    // Clear residual potentially malicious data
-    bzero(buffer, length);
-    errno = EIO;
-    return -1;
+        if (uevent_check_sender(&msgs[i].msg_hdr, true, &uid)) {
+            lengths[i] = msgs[i].msg_len;
+        } else {
+            // Clear residual potentially malicious data
+            bzero(buffers + i * length, length);
+            lengths[i] = -1;
+        }
+    }
+
+    return n;
 }
 
 int uevent_open_socket(int buf_sz, bool passcred)
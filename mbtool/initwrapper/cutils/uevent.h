@@ -22,4 +22,10 @@
 int uevent_open_socket(int buf_sz, bool passcred);
 ssize_t uevent_kernel_multicast_recv(int socket, void *buffer, size_t length);
 ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length, uid_t *uid);
-ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
\ No newline at end of file
+ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid);
+
+#define UEVENT_MAX_BATCH 32
+
+int uevent_kernel_multicast_recv_batch(int socket, char *buffers,
+                                       size_t length, unsigned int count,
+                                       ssize_t *lengths);
\ No newline at end of file
@@ -17,8 +17,15 @@
 
 #include "initwrapper/devices.h"
 
-#include <mutex>
-
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 
@@ -42,6 +49,8 @@
 #include "initwrapper/cutils/uevent.h"
 #include "initwrapper/util.h"
 
+#include "block_dev_resolver.h"
+
 #define DEVPATH_LEN 96
 
 #define UEVENT_LOGGING 0
@@ -66,15 +75,28 @@ struct uevent {
 };
 
 struct platform_node {
-    char *name;
-    char *path;
+    std::string path;
+    // Points into `path`
+    const char *name;
     int path_len;
+    // Order in which the device was added
+    uint64_t seq;
 };
 
-static std::vector<platform_node> platform_names;
+// Platform devices are stored in a trie keyed by path components, so finding
+// the platform devices that are parents of a path only needs to look at the
+// components of that path
+struct platform_trie_node {
+    std::unordered_map<std::string, std::unique_ptr<platform_trie_node>> children;
+    std::unique_ptr<platform_node> device;
+};
+
+static platform_trie_node platform_root;
+static uint64_t platform_seq;
+
+// Set if the kernel reported that uevents were dropped
+static std::atomic<bool> uevent_overflowed(false);
 
-static std::unordered_map<std::string, BlockDevInfo> block_dev_mappings;
-static std::mutex block_dev_mappings_guard;
 
 static mode_t get_device_perm(const char *path,
                               const std::vector<std::string> &links,
@@ -120,6 +142,43 @@ static void make_device(const char *path,
     }
 }
 
+/*
+ * Call fn(component, is_last) for each component of a sysfs path, stopping if
+ * fn returns false.
+ */
+template<typename Fn>
+static void for_each_path_component(const char *path, Fn fn)
+{
+    std::string component;
+
+    while (*path) {
+        while (*path == '/') {
+            ++path;
+        }
+        const char *end = strchr(path, '/');
+        if (!end) {
+            end = path + strlen(path);
+        } else if (end == path) {
+            break;
+        }
+
+        component.assign(path, end - path);
+        path = end;
+
+        bool is_last = true;
+        for (const char *p = path; *p; ++p) {
+            if (*p != '/') {
+                is_last = false;
+                break;
+            }
+        }
+
+        if (!fn(component, is_last)) {
+            break;
+        }
+    }
+}
+
 static void add_platform_device(const char *path)
 {
     int path_len = strlen(path);
@@ -136,49 +195,77 @@ static void add_platform_device(const char *path)
     LOGI("Adding platform device %s (%s)", name, path);
 #endif
 
-    platform_names.emplace_back();
-    struct platform_node &bus = platform_names.back();
-    bus.path = strdup(path);
+    platform_trie_node *node = &platform_root;
+
+    for_each_path_component(path, [&](const std::string &component, bool) {
+        auto &child = node->children[component];
+        if (!child) {
+            child.reset(new platform_trie_node());
+        }
+        node = child.get();
+        return true;
+    });
+
+    // Re-adding a device (eg. if coldboot had to be repeated) replaces it
+    node->device.reset(new platform_node());
+    platform_node &bus = *node->device;
+    bus.path = path;
     bus.path_len = path_len;
-    bus.name = bus.path + (name - path);
+    bus.name = bus.path.c_str() + (name - path);
+    bus.seq = platform_seq++;
 }
 
 /*
- * Given a path that may start with a platform device, find the length of the
- * platform device prefix.  If it doesn't start with a platform device, return
- * 0.
+ * Given a path that may start with a platform device, find the platform
+ * devices the path is under, most recently added first.
  */
 static std::vector<struct platform_node *> find_platform_devices(const char *path)
 {
     std::vector<struct platform_node *> nodes;
-    int path_len = strlen(path);
+    const platform_trie_node *node = &platform_root;
 
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        struct platform_node &bus = *it;
+    for_each_path_component(path, [&](const std::string &component,
+                                      bool is_last) {
+        auto it = node->children.find(component);
+        if (it == node->children.end()) {
+            return false;
+        }
+        node = it->second.get();
 
-        if ((bus.path_len < path_len) &&
-                (path[bus.path_len] == '/') &&
-                strncmp(path, bus.path, bus.path_len) == 0) {
-            nodes.push_back(&bus);
+        // Only devices that are a proper prefix of the path match
+        if (!is_last && node->device) {
+            nodes.push_back(node->device.get());
         }
-    }
+        return true;
+    });
+
+    std::sort(nodes.begin(), nodes.end(),
+              [](const platform_node *a, const platform_node *b) {
+        return a->seq > b->seq;
+    });
 
     return nodes;
 }
 
 static void remove_platform_device(const char *path)
 {
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        const struct platform_node &bus = *it;
+    platform_trie_node *node = &platform_root;
 
-        if (strcmp(path, bus.path) == 0) {
+    for_each_path_component(path, [&](const std::string &component, bool) {
+        auto it = node->children.find(component);
+        if (it == node->children.end()) {
+            node = nullptr;
+            return false;
+        }
+        node = it->second.get();
+        return true;
+    });
+
+    if (node && node->device && node->device->path == path) {
 #if UEVENT_LOGGING
-            LOGI("Removing platform device %s", bus.name);
+        LOGI("Removing platform device %s", node->device->name);
 #endif
-            free(bus.path);
-            platform_names.erase((it + 1).base());
-            return;
-        }
+        node->device.reset();
     }
 }
 
@@ -591,12 +678,10 @@ static void handle_block_device_event(struct uevent *uevent)
             info.partition_name = uevent->partition_name;
         }
 
-        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.emplace(
-                std::make_pair(uevent->path, std::move(info)));
+        mb::BlockDevResolver::global().add_device(uevent->path,
+                                                  std::move(info));
     } else if (strcmp(uevent->action, "remove") == 0) {
-        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.erase(uevent->path);
+        mb::BlockDevResolver::global().remove_device(uevent->path);
     }
 }
 
@@ -737,28 +822,50 @@ static void handle_device_event(struct uevent *uevent)
 }
 
 #define UEVENT_MSG_LEN  2048
+
+// Messages are received in batches; only one thread handles events at a time
+static char uevent_msgs[UEVENT_MAX_BATCH][UEVENT_MSG_LEN + 2];
+
 void handle_device_fd()
 {
-    char msg[UEVENT_MSG_LEN + 2];
-    int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if (n >= UEVENT_MSG_LEN) {
-            // overflow -- discard
+    ssize_t lengths[UEVENT_MAX_BATCH];
+    int count;
+
+    while (true) {
+        count = uevent_kernel_multicast_recv_batch(
+                device_fd, &uevent_msgs[0][0], UEVENT_MSG_LEN + 2,
+                UEVENT_MAX_BATCH, lengths);
+        if (count < 0 && errno == ENOBUFS) {
+            // The kernel dropped events because the socket buffer was full.
+            // Keep reading what's still queued.
+            uevent_overflowed = true;
             continue;
+        } else if (count <= 0) {
+            break;
         }
 
-        msg[n] = '\0';
-        msg[n + 1] = '\0';
+        for (int i = 0; i < count; ++i) {
+            char *msg = uevent_msgs[i];
+            ssize_t n = lengths[i];
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+            if (n < 0 || n >= UEVENT_MSG_LEN) {
+                // Rejected or overflow -- discard
+                continue;
+            }
 
-        if (uevent.path && strstr(uevent.path, "sec-battery")) {
-            // sec-battery causes boot delays on the Galaxy S4
-            continue;
-        }
+            msg[n] = '\0';
+            msg[n + 1] = '\0';
+
+            struct uevent uevent;
+            parse_event(msg, &uevent);
 
-        handle_device_event(&uevent);
+            if (uevent.path && strstr(uevent.path, "sec-battery")) {
+                // sec-battery causes boot delays on the Galaxy S4
+                continue;
+            }
+
+            handle_device_event(&uevent);
+        }
     }
 }
 
@@ -767,22 +874,30 @@ void handle_device_fd()
  * to cause the kernel to regenerate device add events that happened
  * before init's device manager was started
  *
- * We drain any pending events from the netlink socket every time
- * we poke another uevent file to make sure we don't overrun the
- * socket's buffer.
+ * When walking serially, we drain any pending events from the netlink socket
+ * every time we poke another uevent file to make sure we don't overrun the
+ * socket's buffer. When walking in parallel, a separate thread drains the
+ * socket while the walkers run.
  */
 
-static void do_coldboot(DIR *d)
+static void poke_uevent(int dfd)
+{
+    int fd = openat(dfd, "uevent", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        write(fd, "add\n", 4);
+        close(fd);
+    }
+}
+
+static void do_coldboot(DIR *d, bool drain)
 {
     struct dirent *de;
     int dfd, fd;
 
     dfd = dirfd(d);
 
-    fd = openat(dfd, "uevent", O_WRONLY);
-    if (fd >= 0) {
-        write(fd, "add\n", 4);
-        close(fd);
+    poke_uevent(dfd);
+    if (drain) {
         handle_device_fd();
     }
 
@@ -793,7 +908,7 @@ static void do_coldboot(DIR *d)
             continue;
         }
 
-        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY);
+        fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
         if (fd < 0) {
             continue;
         }
@@ -802,7 +917,7 @@ static void do_coldboot(DIR *d)
         if (d2 == 0) {
             close(fd);
         } else {
-            do_coldboot(d2);
+            do_coldboot(d2, drain);
             closedir(d2);
         }
     }
@@ -812,11 +927,126 @@ static void coldboot(const char *path)
 {
     DIR *d = opendir(path);
     if (d) {
-        do_coldboot(d);
+        do_coldboot(d, true);
         closedir(d);
     }
 }
 
+// Subtrees at this depth below the coldboot roots are walked in parallel
+#define COLDBOOT_SPLIT_DEPTH    2
+#define COLDBOOT_MAX_THREADS    4
+
+/*
+ * Poke the uevent files of the directories above COLDBOOT_SPLIT_DEPTH in
+ * pre-order and collect the subtrees at that depth. Since each subtree is then
+ * walked in pre-order by a single thread, a device's add event is still always
+ * generated before those of the devices below it.
+ */
+static void coldboot_collect(const std::string &path, int depth,
+                             std::vector<std::string> &subtrees)
+{
+    if (depth == COLDBOOT_SPLIT_DEPTH) {
+        subtrees.push_back(path);
+        return;
+    }
+
+    DIR *d = opendir(path.c_str());
+    if (!d) {
+        return;
+    }
+
+    poke_uevent(dirfd(d));
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+            coldboot_collect(path + "/" + de->d_name, depth + 1, subtrees);
+        }
+    }
+
+    closedir(d);
+}
+
+static void coldboot_parallel(const char * const *paths, unsigned int threads)
+{
+    std::atomic<bool> walking(true);
+
+    std::thread handler([&] {
+        struct pollfd fds[1];
+        fds[0].fd = device_fd;
+        fds[0].events = POLLIN;
+
+        while (walking) {
+            fds[0].revents = 0;
+            if (poll(fds, 1, 50) > 0 && (fds[0].revents & POLLIN)) {
+                handle_device_fd();
+            }
+        }
+
+        // Writing to a uevent file generates the event synchronously, so
+        // everything is queued by the time the walkers are done
+        handle_device_fd();
+    });
+
+    std::vector<std::string> subtrees;
+    for (auto it = paths; *it; ++it) {
+        coldboot_collect(*it, 0, subtrees);
+    }
+
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> walkers;
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        walkers.emplace_back([&] {
+            size_t index;
+            while ((index = next++) < subtrees.size()) {
+                DIR *d = opendir(subtrees[index].c_str());
+                if (d) {
+                    do_coldboot(d, false);
+                    closedir(d);
+                }
+            }
+        });
+    }
+
+    for (auto &t : walkers) {
+        t.join();
+    }
+
+    walking = false;
+    handler.join();
+}
+
+static void coldboot_all()
+{
+    static const char * const paths[] = {
+        "/sys/class",
+        "/sys/block",
+        "/sys/devices",
+        nullptr
+    };
+
+    unsigned int threads = std::min<unsigned int>(
+            std::thread::hardware_concurrency(), COLDBOOT_MAX_THREADS);
+
+    if (threads > 1) {
+        coldboot_parallel(paths, threads);
+
+        if (!uevent_overflowed) {
+            return;
+        }
+
+        // Events were lost, so redo everything serially. Adding a device
+        // twice is harmless.
+        LOGW("uevent socket overflowed during parallel coldboot");
+        uevent_overflowed = false;
+    }
+
+    for (auto it = paths; *it; ++it) {
+        coldboot(*it);
+    }
+}
+
 void * device_thread(void *)
 {
     struct pollfd fds[2];
@@ -854,17 +1084,16 @@ void device_init(bool dry_run_)
         strlcpy(bootdevice, value.c_str(), sizeof(bootdevice));
     }
 
-    // Is 256K enough? udev uses 16MB!
-    device_fd = uevent_open_socket(256 * 1024, true);
+    // udev uses 16MB. We drain the socket while coldboot is running, so this
+    // only needs to absorb bursts of events.
+    device_fd = uevent_open_socket(1024 * 1024, true);
     if (device_fd < 0) {
         return;
     }
 
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    coldboot_all();
 
     run_thread = true;
     pipe(pipe_fd);
@@ -891,6 +1120,5 @@ int get_device_fd()
 
 std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings()
 {
-    std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-    return block_dev_mappings;
+    return mb::BlockDevResolver::global().devices();
 }
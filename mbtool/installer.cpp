@@ -27,15 +27,18 @@
 
 // Linux/posix
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
 // Linux
 #include <linux/loop.h>
+#include <linux/magic.h>
 
 // Legacy properties
 #include "external/legacy_property_service.h"
@@ -76,6 +79,7 @@
 #include "multiboot.h"
 #include "signature.h"
 #include "switcher.h"
+#include "trace.h"
 #include "wipe.h"
 
 
@@ -99,6 +103,19 @@
 
 #define HELPER_TOOL             "/update-binary-tool"
 
+// Paths within the chroot template
+#define CHROOT_TEMPLATE_ROOT_DIR        "/root"
+#define CHROOT_TEMPLATE_RW_DIR          "/rw"
+#define CHROOT_TEMPLATE_STAMP           "/stamp"
+
+// Memory that must still be available after staging the zip in RAM. The
+// updater also extracts files to the chroot's /tmp.
+#define ZIP_STAGING_RESERVE             (512 * 1024 * 1024)
+// Read buffer size for each of the updater's pipes
+#define UPDATER_PIPE_BUF_SIZE           65536
+// Size of each readahead() request when prefetching the zip
+#define ZIP_PREFETCH_CHUNK              (4 * 1024 * 1024)
+
 
 using namespace mb::device;
 
@@ -116,7 +133,9 @@ Installer::Installer(std::string zip_file, std::string chroot_dir,
     , _interface(interface)
     , _output_fd(output_fd)
     , _flags(flags)
+    , _chroot_from_template(false)
     , _ran(false)
+    , _zip_prefetch_stop(false)
 {
     _passthrough = _output_fd >= 0;
 
@@ -125,6 +144,17 @@ Installer::Installer(std::string zip_file, std::string chroot_dir,
 
 Installer::~Installer()
 {
+    stop_zip_prefetch();
+}
+
+/*!
+ * \brief Use the chroot template at \p path if it is usable
+ *
+ * \sa create_chroot_template()
+ */
+void Installer::set_chroot_template(std::string path)
+{
+    _chroot_template = std::move(path);
 }
 
 
@@ -255,6 +285,104 @@ std::string Installer::in_chroot(const std::string &path) const
     }
 }
 
+/*!
+ * \brief Create the parts of the chroot that don't depend on the installation
+ *
+ * This creates the top-level directories, copies /sbin, and creates the
+ * special files in /dev. If \p mount_tmpfs is true, tmpfs is mounted at /dev
+ * and /sbin first. Otherwise, everything is created on the filesystem \p root
+ * is on.
+ */
+static bool populate_chroot_base(const std::string &root, bool mount_tmpfs)
+{
+    auto path = [&](const char *p) {
+        return root + p;
+    };
+
+    // Create remaining directories
+    if (log_mkdir(path("/mb").c_str(), 0755) < 0
+            || log_mkdir(path("/dev").c_str(), 0755) < 0
+            || log_mkdir(path("/etc").c_str(), 0755) < 0
+            || log_mkdir(path("/proc").c_str(), 0755) < 0
+            || log_mkdir(path("/sbin").c_str(), 0755) < 0
+            || log_mkdir(path("/sys").c_str(), 0755) < 0
+            || log_mkdir(path("/tmp").c_str(), 0755) < 0
+            || log_mkdir(path("/data").c_str(), 0755) < 0
+            || log_mkdir(path("/cache").c_str(), 0755) < 0
+            || log_mkdir(path("/system").c_str(), 0755) < 0
+            || log_mkdir(path("/firmware").c_str(), 0755) < 0
+            || log_mkdir(path("/efs").c_str(), 0755) < 0) {
+        return false;
+    }
+
+    if (mount_tmpfs
+            && (log_mount("none", path("/dev").c_str(), "tmpfs", 0, "") < 0
+            || log_mount("none", path("/sbin").c_str(), "tmpfs", 0, "") < 0)) {
+        return false;
+    }
+
+    if (log_mkdir(path("/dev/pts").c_str(), 0755) < 0) {
+        return false;
+    }
+
+    // Copy the contents of sbin since we need to mess with some of the binaries
+    // there. Also, for whatever reason, bind mounting /sbin results in EINVAL
+    // no matter if it's done from here or from busybox.
+    if (!log_copy_dir("/sbin", path("/sbin"),
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+
+    // Remove reboot binary
+    remove(path("/sbin/reboot").c_str());
+
+    // Don't create unnecessary special files in /dev to avoid install scripts
+    // from overwriting partitions
+    if (log_mknod(path("/dev/console").c_str(), S_IFCHR | 0644, makedev(5, 1)) < 0
+            || log_mknod(path("/dev/null").c_str(), S_IFCHR | 0644, makedev(1, 3)) < 0
+            || log_mknod(path("/dev/ptmx").c_str(), S_IFCHR | 0644, makedev(5, 2)) < 0
+            || log_mknod(path("/dev/random").c_str(), S_IFCHR | 0644, makedev(1, 8)) < 0
+            || log_mknod(path("/dev/tty").c_str(), S_IFCHR | 0644, makedev(5, 0)) < 0
+            || log_mknod(path("/dev/urandom").c_str(), S_IFCHR | 0644, makedev(1, 9)) < 0
+            || log_mknod(path("/dev/zero").c_str(), S_IFCHR | 0644, makedev(1, 5)) < 0
+            || log_mknod(path("/dev/loop-control").c_str(), S_IFCHR | 0644, makedev(10, 237)) < 0
+            || log_mknod(path("/dev/fuse").c_str(), S_IFCHR | 0644, makedev(10, 229))) {
+        return false;
+    }
+
+    // Create a few loopback devices since some installers expect them to exist,
+    // but don't create them. They are not necessary for mbtool to work.
+    if (log_mkdir(path("/dev/block").c_str(), 0755) < 0
+            || log_mknod(path("/dev/block/loop0").c_str(), S_IFBLK | 0644, makedev(7, 0)) < 0
+            || log_mknod(path("/dev/block/loop1").c_str(), S_IFBLK | 0644, makedev(7, 1)) < 0
+            || log_mknod(path("/dev/block/loop2").c_str(), S_IFBLK | 0644, makedev(7, 2)) < 0
+            || log_mknod(path("/dev/block/loop3").c_str(), S_IFBLK | 0644, makedev(7, 3)) < 0
+            || log_mknod(path("/dev/block/loop4").c_str(), S_IFBLK | 0644, makedev(7, 4)) < 0
+            || log_mknod(path("/dev/block/loop5").c_str(), S_IFBLK | 0644, makedev(7, 5)) < 0
+            || log_mknod(path("/dev/block/loop6").c_str(), S_IFBLK | 0644, makedev(7, 6)) < 0
+            || log_mknod(path("/dev/block/loop7").c_str(), S_IFBLK | 0644, makedev(7, 7)) < 0) {
+        return false;
+    }
+
+    // We need /dev/input/* and /dev/graphics/* for AROMA
+    if (!log_copy_dir("/dev/input", path("/dev/input"),
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+    if (!log_copy_dir("/dev/graphics", path("/dev/graphics"),
+                      util::COPY_ATTRIBUTES
+                    | util::COPY_XATTRS
+                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+        return false;
+    }
+
+    return true;
+}
+
 bool Installer::create_chroot()
 {
     // We'll just call the recovery's mount tools directly to avoid having to
@@ -290,34 +418,20 @@ bool Installer::create_chroot()
         return false;
     }
 
-    // Create chroot and mount tmpfs there
-    if (log_mkdir(_chroot.c_str(), 0700) < 0
-            || log_mount("tmpfs", _chroot.c_str(), "tmpfs", 0, "") < 0) {
-        return false;
-    }
-
-    // Create remaining directories
-    if (log_mkdir(in_chroot("/mb").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/dev").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/etc").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/proc").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/sbin").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/sys").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/tmp").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/data").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/cache").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/system").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/firmware").c_str(), 0755) < 0
-            || log_mkdir(in_chroot("/efs").c_str(), 0755) < 0) {
-        return false;
+    if (!_chroot_template.empty() && create_chroot_from_template()) {
+        _chroot_from_template = true;
+    } else {
+        // Create chroot and mount tmpfs there
+        if (log_mkdir(_chroot.c_str(), 0700) < 0
+                || log_mount("tmpfs", _chroot.c_str(), "tmpfs", 0, "") < 0
+                || !populate_chroot_base(_chroot, true)) {
+            return false;
+        }
     }
 
     // Other mounts
-    if (log_mount("none", in_chroot("/dev").c_str(), "tmpfs", 0, "") < 0
-            || log_mkdir(in_chroot("/dev/pts").c_str(), 0755) < 0
-            || log_mount("none", in_chroot("/dev/pts").c_str(), "devpts", 0, "") < 0
+    if (log_mount("none", in_chroot("/dev/pts").c_str(), "devpts", 0, "") < 0
             || log_mount("none", in_chroot("/proc").c_str(), "proc", 0, "") < 0
-            || log_mount("none", in_chroot("/sbin").c_str(), "tmpfs", 0, "") < 0
             || log_mount("none", in_chroot("/sys").c_str(), "sysfs", 0, "") < 0
             || log_mount("none", in_chroot("/tmp").c_str(), "tmpfs", 0, "") < 0) {
         return false;
@@ -333,61 +447,6 @@ bool Installer::create_chroot()
         return false;
     }
 
-    // Copy the contents of sbin since we need to mess with some of the binaries
-    // there. Also, for whatever reason, bind mounting /sbin results in EINVAL
-    // no matter if it's done from here or from busybox.
-    if (!log_copy_dir("/sbin", in_chroot("/sbin"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-
-    // Remove reboot binary
-    remove(in_chroot("/sbin/reboot").c_str());
-
-    // Don't create unnecessary special files in /dev to avoid install scripts
-    // from overwriting partitions
-    if (log_mknod(in_chroot("/dev/console").c_str(), S_IFCHR | 0644, makedev(5, 1)) < 0
-            || log_mknod(in_chroot("/dev/null").c_str(), S_IFCHR | 0644, makedev(1, 3)) < 0
-            || log_mknod(in_chroot("/dev/ptmx").c_str(), S_IFCHR | 0644, makedev(5, 2)) < 0
-            || log_mknod(in_chroot("/dev/random").c_str(), S_IFCHR | 0644, makedev(1, 8)) < 0
-            || log_mknod(in_chroot("/dev/tty").c_str(), S_IFCHR | 0644, makedev(5, 0)) < 0
-            || log_mknod(in_chroot("/dev/urandom").c_str(), S_IFCHR | 0644, makedev(1, 9)) < 0
-            || log_mknod(in_chroot("/dev/zero").c_str(), S_IFCHR | 0644, makedev(1, 5)) < 0
-            || log_mknod(in_chroot("/dev/loop-control").c_str(), S_IFCHR | 0644, makedev(10, 237)) < 0
-            || log_mknod(in_chroot("/dev/fuse").c_str(), S_IFCHR | 0644, makedev(10, 229))) {
-        return false;
-    }
-
-    // Create a few loopback devices since some installers expect them to exist,
-    // but don't create them. They are not necessary for mbtool to work.
-    if (log_mkdir(in_chroot("/dev/block").c_str(), 0755) < 0
-            || log_mknod(in_chroot("/dev/block/loop0").c_str(), S_IFBLK | 0644, makedev(7, 0)) < 0
-            || log_mknod(in_chroot("/dev/block/loop1").c_str(), S_IFBLK | 0644, makedev(7, 1)) < 0
-            || log_mknod(in_chroot("/dev/block/loop2").c_str(), S_IFBLK | 0644, makedev(7, 2)) < 0
-            || log_mknod(in_chroot("/dev/block/loop3").c_str(), S_IFBLK | 0644, makedev(7, 3)) < 0
-            || log_mknod(in_chroot("/dev/block/loop4").c_str(), S_IFBLK | 0644, makedev(7, 4)) < 0
-            || log_mknod(in_chroot("/dev/block/loop5").c_str(), S_IFBLK | 0644, makedev(7, 5)) < 0
-            || log_mknod(in_chroot("/dev/block/loop6").c_str(), S_IFBLK | 0644, makedev(7, 6)) < 0
-            || log_mknod(in_chroot("/dev/block/loop7").c_str(), S_IFBLK | 0644, makedev(7, 7)) < 0) {
-        return false;
-    }
-
-    // We need /dev/input/* and /dev/graphics/* for AROMA
-    if (!log_copy_dir("/dev/input", in_chroot("/dev/input"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-    if (!log_copy_dir("/dev/graphics", in_chroot("/dev/graphics"),
-                      util::COPY_ATTRIBUTES
-                    | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
-        return false;
-    }
-
     // Mount EFS partition so patched Odin images can properly set up multi-CSC
     if (!mount_efs()) {
         return false;
@@ -422,12 +481,16 @@ bool Installer::destroy_chroot() const
     log_umount(in_chroot("/efs").c_str());
 
     log_umount(in_chroot("/dev/pts").c_str());
-    log_umount(in_chroot("/dev").c_str());
+    if (!_chroot_from_template) {
+        log_umount(in_chroot("/dev").c_str());
+    }
     log_umount(in_chroot("/proc").c_str());
     log_umount(in_chroot("/sys/fs/selinux").c_str());
     log_umount(in_chroot("/sys").c_str());
     log_umount(in_chroot("/tmp").c_str());
-    log_umount(in_chroot("/sbin").c_str());
+    if (!_chroot_from_template) {
+        log_umount(in_chroot("/sbin").c_str());
+    }
 
     log_umount(_chroot.c_str());
 
@@ -439,6 +502,11 @@ bool Installer::destroy_chroot() const
 
     util::delete_recursive(_chroot);
 
+    // Discard the changes made on top of the template
+    if (_chroot_from_template) {
+        log_umount((_chroot_template + CHROOT_TEMPLATE_RW_DIR).c_str());
+    }
+
     if (log_is_mounted("/efs")) {
         log_umount("/efs");
     }
@@ -446,6 +514,120 @@ bool Installer::destroy_chroot() const
     return true;
 }
 
+static bool chroot_template_is_valid(const std::string &path)
+{
+    std::string stamp;
+
+    return util::is_mounted(path)
+            && util::file_first_line(path + CHROOT_TEMPLATE_STAMP, &stamp)
+            && stamp == mb::git_version();
+}
+
+/*!
+ * \brief Create or reuse a chroot template
+ *
+ * The template is a tmpfs containing everything that populate_chroot_base()
+ * creates. It is meant to be created in the global mount namespace so that it
+ * outlives the process and can be shared by sequential installations. An
+ * existing template is reused if it was created by the same version of mbtool.
+ *
+ * \note \p path must not have the chroot directory as a prefix or it will be
+ *       unmounted along with the chroot.
+ *
+ * \param path Template directory
+ *
+ * \return Whether a usable template exists at \p path
+ */
+bool Installer::create_chroot_template(const std::string &path)
+{
+    if (chroot_template_is_valid(path)) {
+        LOGV("Reusing chroot template at %s", path.c_str());
+        return true;
+    }
+
+    if (!destroy_chroot_template(path)) {
+        return false;
+    }
+
+    LOGV("Creating chroot template at %s", path.c_str());
+
+    std::string root(path + CHROOT_TEMPLATE_ROOT_DIR);
+    const char *stamp = mb::git_version();
+
+    if (log_mkdir(path.c_str(), 0700) < 0
+            || log_mount("tmpfs", path.c_str(), "tmpfs", 0, "mode=0700") < 0
+            || log_mkdir(root.c_str(), 0755) < 0
+            || log_mkdir((path + CHROOT_TEMPLATE_RW_DIR).c_str(), 0700) < 0
+            || !populate_chroot_base(root, false)
+            || !util::file_write_data(path + CHROOT_TEMPLATE_STAMP,
+                                      stamp, strlen(stamp))) {
+        destroy_chroot_template(path);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Unmount and remove a chroot template if it exists
+ */
+bool Installer::destroy_chroot_template(const std::string &path)
+{
+    if (!log_unmount_all(path)) {
+        return false;
+    }
+
+    if (!log_delete_recursive(path)) {
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Set up the chroot as an overlay on top of the chroot template
+ *
+ * The upper layer is a tmpfs mounted in this process' mount namespace, so the
+ * template itself is never modified and is reset simply by discarding the
+ * upper layer. This fails if the kernel does not support overlayfs, in which
+ * case the chroot should be created from scratch.
+ */
+bool Installer::create_chroot_from_template()
+{
+    if (!chroot_template_is_valid(_chroot_template)) {
+        LOGW("%s: Chroot template is missing or outdated",
+             _chroot_template.c_str());
+        return false;
+    }
+
+    std::string rw(_chroot_template + CHROOT_TEMPLATE_RW_DIR);
+    std::string upper(rw + "/upper");
+    std::string work(rw + "/work");
+    std::string opts = format("lowerdir=%s%s,upperdir=%s,workdir=%s",
+                              _chroot_template.c_str(),
+                              CHROOT_TEMPLATE_ROOT_DIR,
+                              upper.c_str(), work.c_str());
+
+    if (log_mount("tmpfs", rw.c_str(), "tmpfs", 0, "mode=0700") < 0) {
+        return false;
+    }
+
+    if (log_mkdir(upper.c_str(), 0755) < 0
+            || log_mkdir(work.c_str(), 0755) < 0
+            || log_mkdir(_chroot.c_str(), 0700) < 0
+            || log_mount("overlay", _chroot.c_str(), "overlay", 0,
+                         opts.c_str()) < 0) {
+        LOGW("Failed to create chroot from template; creating it from scratch");
+        rmdir(_chroot.c_str());
+        log_umount(rw.c_str());
+        return false;
+    }
+
+    LOGV("Created chroot from template at %s", _chroot_template.c_str());
+
+    return true;
+}
+
 bool Installer::mount_efs() const
 {
     std::string manufacturer =
@@ -582,7 +764,8 @@ bool Installer::extract_multiboot_files()
         });
     }
 
-    if (!util::extract_files2(_zip_file, files)) {
+    if ((!_zip_index.is_open() && !_zip_index.open(_zip_file))
+            || !util::extract_files2(_zip_index, files)) {
         LOGE("Failed to extract all multiboot files");
         return false;
     }
@@ -596,13 +779,20 @@ bool Installer::extract_multiboot_files()
         _temp + "/binaries/mount.exfat",
     };
 
+    std::vector<std::pair<std::string, std::string>> sig_files;
     for (auto const &item : sigcheck) {
-        SigVerifyResult result =
-                verify_signature(item.c_str(), (item + ".sig").c_str());
-        if (result != SigVerifyResult::VALID) {
-            LOGE("%s: Signature verification failed", item.c_str());
-            return false;
+        sig_files.emplace_back(item, item + ".sig");
+    }
+
+    std::vector<SigVerifyResult> results;
+    if (!verify_signatures(sig_files, &results)) {
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (results[i] != SigVerifyResult::VALID) {
+                LOGE("%s: Signature verification failed",
+                     sigcheck[i].c_str());
+            }
         }
+        return false;
     }
 
     return true;
@@ -667,6 +857,109 @@ bool Installer::create_image(const std::string &path, uint64_t size)
  * \param reverse If non-zero, then the image file is the source and the
  *                directory is the target
  */
+/*!
+ * \brief Find the ext4 block device mounted at a directory
+ *
+ * \return Whether \a dir is the mountpoint of an ext4 block device
+ */
+static bool find_ext4_block_mount(const std::string &dir,
+                                  util::MountEntry *entry_out)
+{
+    autoclose::file fp(std::fopen(PROC_MOUNTS, "r"), std::fclose);
+    if (!fp) {
+        return false;
+    }
+
+    bool found = false;
+    util::MountEntry entry;
+    struct stat sb;
+
+    // The last entry is the one that is visible if mounts are stacked
+    while (util::get_mount_entry(fp.get(), entry)) {
+        if (entry.dir == dir) {
+            found = entry.type == "ext4"
+                    && stat(entry.fsname.c_str(), &sb) == 0
+                    && S_ISBLK(sb.st_mode);
+            if (found) {
+                *entry_out = entry;
+            }
+        }
+    }
+
+    return found;
+}
+
+static bool mount_opts_read_only(const std::string &opts)
+{
+    return opts == "ro" || mb::starts_with(opts, "ro,");
+}
+
+/*!
+ * \brief Clone a system partition to or from an ext4 image at the block level
+ *
+ * This is used instead of a file-level copy when \a source is the mountpoint
+ * of an ext4 block device. Only the blocks in use are copied. The partition is
+ * remounted read-only while it is being read and unmounted while it is being
+ * written.
+ *
+ * \return 1 if the filesystem was cloned, 0 if cloning is not possible and
+ *         nothing was modified, or -1 if cloning failed
+ */
+static int system_image_clone(const std::string &source,
+                              const std::string &image, bool reverse)
+{
+    util::MountEntry entry;
+    if (!find_ext4_block_mount(source, &entry)) {
+        return 0;
+    }
+
+    bool read_only = mount_opts_read_only(entry.opts);
+    const std::string &block_dev = entry.fsname;
+
+    if (reverse) {
+        if (!can_clone_ext4_image(image, block_dev)) {
+            return 0;
+        }
+
+        if (!util::umount(source.c_str())) {
+            LOGW("%s: Failed to unmount: %s", source.c_str(), strerror(errno));
+            return 0;
+        }
+
+        bool ret = clone_ext4_image(image, block_dev);
+
+        if (!util::mount(block_dev.c_str(), source.c_str(), "ext4",
+                         read_only ? MS_RDONLY : 0, "")) {
+            LOGE("Failed to remount %s at %s: %s",
+                 block_dev.c_str(), source.c_str(), strerror(errno));
+            ret = false;
+        }
+
+        return ret ? 1 : -1;
+    } else {
+        // Make sure the filesystem is consistent while it is being read
+        if (!read_only && mount("", source.c_str(), "",
+                                MS_REMOUNT | MS_RDONLY, "") < 0) {
+            LOGW("%s: Failed to remount read-only: %s",
+                 source.c_str(), strerror(errno));
+            return 0;
+        }
+
+        int ret = 0;
+        if (can_clone_ext4_image(block_dev, image)) {
+            ret = clone_ext4_image(block_dev, image) ? 1 : -1;
+        }
+
+        if (!read_only && mount("", source.c_str(), "", MS_REMOUNT, "") < 0) {
+            LOGE("%s: Failed to remount read-write: %s",
+                 source.c_str(), strerror(errno));
+            ret = -1;
+        }
+
+        return ret;
+    }
+}
+
 bool Installer::system_image_copy(const std::string &source,
                                   const std::string &image, bool reverse)
 {
@@ -691,6 +984,17 @@ bool Installer::system_image_copy(const std::string &source,
         return false;
     }
 
+    // Copying the blocks of the system partition is much faster than copying
+    // the files if the partition is mounted to the source directory
+    int ret = system_image_clone(source, image, reverse);
+    if (ret > 0) {
+        return true;
+    } else if (ret < 0) {
+        LOGE("Failed to clone %s to %s", reverse ? image.c_str()
+             : source.c_str(), reverse ? source.c_str() : image.c_str());
+        return false;
+    }
+
     if (!util::mount(image.c_str(), temp_mnt.c_str(), "auto", 0, "")) {
         LOGE("Failed to mount %s: %s", source.c_str(), strerror(errno));
         return false;
@@ -749,14 +1053,10 @@ bool Installer::mount_dir_or_image(const std::string &source,
             }
         }
 
-        std::string loopdev = util::loopdev_find_unused();
-        if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
-        }
-        if (!util::loopdev_set_up_device(loopdev, source, 0, false)) {
-            LOGE("Failed to attach %s to %s: %s",
-                 loopdev.c_str(), source.c_str(), strerror(errno));
+        std::string loopdev;
+        if (!util::loopdev_attach(source, 0, 0, 0, loopdev)) {
+            LOGE("Failed to attach %s to a loop device: %s",
+                 source.c_str(), strerror(errno));
             return false;
         }
         if (!util::copy_file(loopdev, loop_target, 0)) {
@@ -857,69 +1157,335 @@ bool Installer::set_up_legacy_properties()
     return true;
 }
 
-bool Installer::updater_fd_reader(int stdio_fd, int command_fd)
+/*! \cond INTERNAL */
+struct UpdaterPipe
 {
-    int status;
-    pid_t pid = fork();
+    int fd;
+    size_t used;
+    // One extra byte to NULL-terminate a full buffer in place
+    char buf[UPDATER_PIPE_BUF_SIZE + 1];
+};
+/*! \endcond */
 
-    if (pid < 0) {
-        LOGE("Failed to fork updater fd reader process");
-    } else if (pid == 0) {
-        // Don't need command_fd in the child process
-        close(command_fd);
+/*!
+ * \brief Read available data from an updater pipe
+ *
+ * Complete lines are passed to \p fn straight from the read buffer, without
+ * the trailing newline. A line that does not fit in the buffer is passed in
+ * pieces.
+ *
+ * \return 1 if the pipe is still open, 0 if EOF was reached, or -1 if the read
+ *         failed
+ */
+template<typename Fn>
+static int updater_pipe_read(UpdaterPipe &pipe, Fn fn)
+{
+    const size_t cap = sizeof(pipe.buf) - 1;
+
+    ssize_t n;
+    do {
+        n = read(pipe.fd, pipe.buf + pipe.used, cap - pipe.used);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        return -1;
+    } else if (n == 0) {
+        // Pass along the last line if it doesn't end in a newline
+        if (pipe.used > 0) {
+            fn(pipe.buf, pipe.used);
+            pipe.used = 0;
+        }
+        return 0;
+    }
 
-        // Read program output in child process (stdout, stderr)
-        char buf[1024];
+    // Only the new data needs to be searched for newlines
+    char *begin = pipe.buf;
+    char *search = pipe.buf + pipe.used;
+    char *end = search + n;
+    char *newline;
 
-        autoclose::file fp(fdopen(stdio_fd, "rb"), fclose);
+    while ((newline = static_cast<char *>(
+            memchr(search, '\n', end - search)))) {
+        fn(begin, newline - begin);
+        begin = search = newline + 1;
+    }
+
+    size_t remain = end - begin;
+    if (begin == pipe.buf && remain == cap) {
+        // Line is too long to fit in the buffer
+        fn(begin, remain);
+        remain = 0;
+    } else if (begin != pipe.buf) {
+        // Move the partial line to the beginning of the buffer
+        memmove(pipe.buf, begin, remain);
+    }
+    pipe.used = remain;
+
+    return 1;
+}
+
+/*!
+ * \brief Check if the command in \p line (of length \p size) is \p cmd
+ */
+static bool updater_cmd_is(const char *line, size_t size, const char *cmd)
+{
+    size_t cmd_size = strlen(cmd);
+    return size == cmd_size && memcmp(line, cmd, cmd_size) == 0;
+}
 
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            command_output(buf);
+/*!
+ * \brief Process the updater's output and command pipes until both are closed
+ *
+ * Both pipes are read from a single poll() loop. Lines are parsed in place and
+ * the output from each wakeup is batched, so command_output() and
+ * updater_print() are called at most once per read instead of once per line.
+ */
+bool Installer::updater_fd_reader(int stdio_fd, int command_fd)
+{
+    std::unique_ptr<UpdaterPipe> stdio_pipe(new UpdaterPipe());
+    std::unique_ptr<UpdaterPipe> command_pipe(new UpdaterPipe());
+    stdio_pipe->fd = stdio_fd;
+    stdio_pipe->used = 0;
+    command_pipe->fd = command_fd;
+    command_pipe->used = 0;
+
+    std::string output;
+    std::string printed;
+
+    auto on_output = [&](const char *line, size_t size) {
+        output.append(line, size);
+        output += '\n';
+    };
+
+    // Similar parsing to AOSP recovery
+    auto on_command = [&](const char *line, size_t size) {
+        const char *end = line + size;
+
+        while (line != end && *line == ' ') {
+            ++line;
         }
 
-        _exit(EXIT_SUCCESS);
-    } else {
-        // Read special command fd in parent process
+        const char *cmd_end = static_cast<const char *>(
+                memchr(line, ' ', end - line));
+        if (!cmd_end) {
+            cmd_end = end;
+        }
+        size_t cmd_size = cmd_end - line;
+
+        if (cmd_size == 0) {
+            return;
+        } else if (updater_cmd_is(line, cmd_size, "progress")
+                || updater_cmd_is(line, cmd_size, "set_progress")
+                || updater_cmd_is(line, cmd_size, "wipe_cache")
+                || updater_cmd_is(line, cmd_size, "clear_display")
+                || updater_cmd_is(line, cmd_size, "enable_reboot")) {
+            // Ignore
+        } else if (updater_cmd_is(line, cmd_size, "ui_print")) {
+            // The updater follows each message with an empty ui_print to end
+            // the line
+            if (cmd_end != end && cmd_end + 1 != end) {
+                printed.append(cmd_end + 1, end);
+            } else {
+                printed += '\n';
+            }
+        } else {
+            LOGE("Unknown updater command: %s",
+                 std::string(line, cmd_size).c_str());
+        }
+    };
 
-        char buf[1024];
-        char *save_ptr;
+    struct pollfd fds[2];
+    fds[0].fd = stdio_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = command_fd;
+    fds[1].events = POLLIN;
 
-        // Similar parsing to AOSP recovery
-        autoclose::file fp(fdopen(command_fd, "rb"), fclose);
+    bool ret = true;
 
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            char *cmd = strtok_r(buf, " \n", &save_ptr);
-            if (!cmd) {
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
                 continue;
-            } else if (strcmp(cmd, "progress") == 0
-                    || strcmp(cmd, "set_progress") == 0
-                    || strcmp(cmd, "wipe_cache") == 0
-                    || strcmp(cmd, "clear_display") == 0
-                    || strcmp(cmd, "enable_reboot") == 0) {
-                // Ignore
-            } else if (strcmp(cmd, "ui_print") == 0) {
-                char *str = strtok_r(nullptr, "\n", &save_ptr);
-                if (str) {
-                    updater_print(str);
-                } else {
-                    updater_print("\n");
-                }
-            } else {
-                LOGE("Unknown updater command: %s", cmd);
             }
+            LOGE("Failed to poll updater pipes: %s", strerror(errno));
+            ret = false;
+            break;
         }
 
-        do {
-            if (waitpid(pid, &status, 0) < 0) {
-                LOGE("Failed to waitpid(): %s", strerror(errno));
-                return false;
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].fd < 0
+                    || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
             }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
-        return true;
+            int result = i == 0
+                    ? updater_pipe_read(*stdio_pipe, on_output)
+                    : updater_pipe_read(*command_pipe, on_command);
+            if (result < 0) {
+                LOGE("Failed to read updater pipe: %s", strerror(errno));
+                ret = false;
+            }
+            if (result <= 0) {
+                // poll() ignores negative fds
+                fds[i].fd = -1;
+            }
+        }
+
+        if (!output.empty()) {
+            command_output(output);
+            output.clear();
+        }
+        if (!printed.empty()) {
+            updater_print(printed);
+            printed.clear();
+        }
     }
 
-    return false;
+    return ret;
+}
+
+/*!
+ * \brief Get the amount of memory that can be used without swapping
+ *
+ * Kernels older than 3.14 do not report MemAvailable, so MemFree + Cached is
+ * used as an estimate there.
+ */
+static bool get_available_memory(uint64_t *size_out)
+{
+    autoclose::file fp(autoclose::fopen("/proc/meminfo", "re"));
+    if (!fp) {
+        LOGW("%s: Failed to open: %s", "/proc/meminfo", strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    unsigned long long available = 0;
+    unsigned long long mem_free = 0;
+    unsigned long long cached = 0;
+    bool have_available = false;
+
+    while (getline(&line, &len, fp.get()) >= 0) {
+        if (sscanf(line, "MemAvailable: %llu kB", &available) == 1) {
+            have_available = true;
+        } else {
+            sscanf(line, "MemFree: %llu kB", &mem_free);
+            sscanf(line, "Cached: %llu kB", &cached);
+        }
+    }
+
+    *size_out = (have_available ? available : mem_free + cached) * 1024;
+    return true;
+}
+
+/*!
+ * \brief Make the zip file available to the updater at /mb/install.zip
+ *
+ * The zip is normally bind mounted into the chroot. If INSTALLER_STAGE_ZIP is
+ * set and there is enough free RAM, it is copied to the chroot's tmpfs instead
+ * so that the updater's random reads do not go to slow storage (eg. an exFAT
+ * SD card). If it does not fit, the zip is read ahead in order in the
+ * background while the updater runs so that most of its reads are served from
+ * the page cache.
+ */
+bool Installer::set_up_zip_file()
+{
+    std::string target = in_chroot("/mb/install.zip");
+    int prefetch_fd = -1;
+    uint64_t prefetch_size = 0;
+
+    if (_flags & INSTALLER_STAGE_ZIP) {
+        int fd = open(_zip_file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            LOGE("%s: Failed to open: %s", _zip_file.c_str(), strerror(errno));
+            return false;
+        }
+
+        auto close_fd = util::finally([&]{
+            if (fd >= 0) {
+                close(fd);
+            }
+        });
+
+        struct stat sb;
+        struct statfs sfs;
+        uint64_t available = 0;
+
+        if (fstat(fd, &sb) < 0 || fstatfs(fd, &sfs) < 0) {
+            LOGW("%s: Failed to stat: %s", _zip_file.c_str(), strerror(errno));
+        } else if (sfs.f_type == TMPFS_MAGIC || sfs.f_type == RAMFS_MAGIC) {
+            LOGD("%s: Zip is already in RAM", _zip_file.c_str());
+        } else if (!get_available_memory(&available)) {
+            // Not worth guessing
+        } else if (static_cast<uint64_t>(sb.st_size) + ZIP_STAGING_RESERVE
+                <= available) {
+            display_msg("Copying zip file to RAM");
+
+            if (util::copy_file(_zip_file, target,
+                                util::COPY_FOLLOW_SYMLINKS)) {
+                return true;
+            }
+
+            LOGW("%s: Failed to copy to RAM: %s",
+                 target.c_str(), strerror(errno));
+            remove(target.c_str());
+        }
+
+        // Prefetch as much as fits without evicting the start of the zip
+        if (available > ZIP_STAGING_RESERVE) {
+            prefetch_size = std::min<uint64_t>(
+                    sb.st_size, available - ZIP_STAGING_RESERVE);
+            std::swap(prefetch_fd, fd);
+        }
+    }
+
+    util::create_empty_file(target);
+    if (log_mount(_zip_file.c_str(), target.c_str(), "", MS_BIND, "") < 0) {
+        if (prefetch_fd >= 0) {
+            close(prefetch_fd);
+        }
+        return false;
+    }
+
+    if (prefetch_fd >= 0) {
+        LOGD("%s: Prefetching %" PRIu64 " bytes",
+             _zip_file.c_str(), prefetch_size);
+
+        _zip_prefetch_stop = false;
+        _zip_prefetch_thread = std::thread([this, prefetch_fd, prefetch_size]{
+            // readahead() blocks until the data has been read, so this keeps
+            // at most one chunk in flight and stops promptly when asked to
+            for (uint64_t offset = 0; offset < prefetch_size
+                    && !_zip_prefetch_stop; offset += ZIP_PREFETCH_CHUNK) {
+                size_t n = std::min<uint64_t>(
+                        ZIP_PREFETCH_CHUNK, prefetch_size - offset);
+                if (readahead(prefetch_fd, offset, n) < 0) {
+                    LOGW("%s: Failed to read ahead: %s",
+                         _zip_file.c_str(), strerror(errno));
+                    break;
+                }
+            }
+            close(prefetch_fd);
+        });
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Stop prefetching the zip file if it was started
+ */
+void Installer::stop_zip_prefetch()
+{
+    if (_zip_prefetch_thread.joinable()) {
+        _zip_prefetch_stop = true;
+        _zip_prefetch_thread.join();
+    }
 }
 
 /*!
@@ -1177,16 +1743,18 @@ void Installer::display_msg(const std::string &msg)
     printf("%s\n", msg.c_str());
 }
 
-// Note: Only called if we're not passing through the output_fd
+// Note: Only called if we're not passing through the output_fd. May contain
+// several messages.
 void Installer::updater_print(const std::string &msg)
 {
     printf("%s", msg.c_str());
 }
 
-// Note: Only called if we're not passing through the output_fd
-void Installer::command_output(const std::string &line)
+// Note: Only called if we're not passing through the output_fd. Contains one
+// or more newline-terminated lines.
+void Installer::command_output(const std::string &lines)
 {
-    printf("%s\n", line.c_str());
+    printf("%s", lines.c_str());
 }
 
 std::unordered_map<std::string, std::string> Installer::get_properties()
@@ -1262,7 +1830,8 @@ Installer::ProceedState Installer::install_stage_initialize()
         { "system.img", false },
         { "system.img.sparse", false },
     };
-    if (!util::archive_exists(_zip_file, info)) {
+    if ((!_zip_index.is_open() && !_zip_index.open(_zip_file))
+            || !util::archive_exists(_zip_index, info)) {
         LOGE("Failed to read zip file");
     } else {
         _has_block_image = false;
@@ -1329,16 +1898,15 @@ Installer::ProceedState Installer::install_stage_check_device()
 {
     LOGD("[Installer] Device verification stage");
 
-    std::vector<unsigned char> contents;
-    if (!util::file_read_all(_temp + "/device.json", &contents)) {
+    util::FileView contents;
+    if (!contents.open(_temp + "/device.json")) {
         display_msg("Failed to read device.json");
         return ProceedState::Fail;
     }
-    contents.push_back('\0');
 
     JsonError error;
 
-    if (!device_from_json(reinterpret_cast<char *>(contents.data()),
+    if (!device_from_json(std::string(contents.begin(), contents.end()),
                           _device, error)) {
         display_msg("Error when loading device.json");
         return ProceedState::Fail;
@@ -1684,10 +2252,8 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
         return ProceedState::Fail;
     }
 
-    // Bind-mount zip file
-    util::create_empty_file(in_chroot("/mb/install.zip"));
-    if (log_mount(_zip_file.c_str(), in_chroot("/mb/install.zip").c_str(),
-                  "", MS_BIND, "") < 0) {
+    // Bind-mount or stage zip file
+    if (!set_up_zip_file()) {
         return ProceedState::Fail;
     }
 
@@ -1722,6 +2288,8 @@ Installer::ProceedState Installer::install_stage_installation()
         uint64_t start = util::current_time_ms();
         updater_ret = run_real_updater();
         uint64_t stop = util::current_time_ms();
+
+        stop_zip_prefetch();
         uint64_t remainder = stop - start;
 
         uint64_t hours = remainder / (3600 * 1000);
@@ -1896,8 +2464,8 @@ Installer::ProceedState Installer::install_stage_finish()
         // Update checksums
         unsigned char digest[SHA512_DIGEST_LENGTH];
 
-        if (!util::sha512_hash(temp_boot_img, digest)) {
-            display_msg("Failed to compute sha512sum of new boot image");
+        if (!util::sha512_tree_hash(temp_boot_img, digest)) {
+            display_msg("Failed to compute checksum of new boot image");
             return ProceedState::Fail;
         }
 
@@ -1905,7 +2473,8 @@ Installer::ProceedState Installer::install_stage_finish()
 
         std::unordered_map<std::string, std::string> props;
         checksums_read(&props);
-        checksums_update(&props, _rom->id, "boot.img", hash);
+        checksums_update(&props, _rom->id, "boot.img",
+                         ChecksumAlgorithm::SHA512_TREE, hash);
         checksums_write(props);
     }
 
@@ -1924,6 +2493,9 @@ void Installer::install_stage_cleanup(Installer::ProceedState ret)
 
     display_msg("Destroying chroot environment");
 
+    stop_zip_prefetch();
+    _zip_index.close();
+
     remove(_temp_image_path.c_str());
 
     if (ret == ProceedState::Fail && !_boot_block_dev.empty()
@@ -1953,42 +2525,59 @@ bool Installer::start_installation()
 
     ProceedState ret = ProceedState::Fail;
 
+    trace_reset();
+
     auto when_finished = util::finally([&] {
-        install_stage_cleanup(ret);
+        {
+            ScopedTrace trace("cleanup");
+            install_stage_cleanup(ret);
+        }
+
+        LOGI("Install stage summary: %s", trace_summary_json().c_str());
     });
 
+    auto run_stage = [&](const char *name,
+                         ProceedState (Installer::*stage)()) {
+        ScopedTrace trace(name);
+        return (this->*stage)();
+    };
 
-    ret = install_stage_initialize();
+    ret = run_stage("initialize", &Installer::install_stage_initialize);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_create_chroot();
+    ret = run_stage("create_chroot", &Installer::install_stage_create_chroot);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_set_up_environment();
+    ret = run_stage("set_up_environment",
+                    &Installer::install_stage_set_up_environment);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_check_device();
+    ret = run_stage("check_device", &Installer::install_stage_check_device);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_get_install_type();
+    ret = run_stage("get_install_type",
+                    &Installer::install_stage_get_install_type);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_set_up_chroot();
+    ret = run_stage("set_up_chroot", &Installer::install_stage_set_up_chroot);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_mount_filesystems();
+    ret = run_stage("mount_filesystems",
+                    &Installer::install_stage_mount_filesystems);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ProceedState install_ret = install_stage_installation();
+    ProceedState install_ret = run_stage(
+            "installation", &Installer::install_stage_installation);
 
-    ret = install_stage_unmount_filesystems();
+    ret = run_stage("unmount_filesystems",
+                    &Installer::install_stage_unmount_filesystems);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
@@ -1996,7 +2585,7 @@ bool Installer::start_installation()
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
-    ret = install_stage_finish();
+    ret = run_stage("finish", &Installer::install_stage_finish);
     if (ret == ProceedState::Fail) return false;
     else if (ret == ProceedState::Cancel) return true;
 
@@ -19,12 +19,15 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include "mbcommon/common.h"
 #include "mbdevice/device.h"
+#include "mbutil/archive.h"
 #include "mbutil/hash.h"
 
 #include "roms.h"
@@ -35,6 +38,8 @@ namespace mb
 enum InstallerFlags : int
 {
     INSTALLER_SKIP_MOUNTING_VOLUMES = 1 << 0,
+    // Copy the zip to RAM (or prefetch it) before running the updater
+    INSTALLER_STAGE_ZIP             = 1 << 1,
 };
 
 class Installer
@@ -46,6 +51,11 @@ public:
 
     bool start_installation();
 
+    void set_chroot_template(std::string path);
+
+    static bool create_chroot_template(const std::string &path);
+    static bool destroy_chroot_template(const std::string &path);
+
 
 protected:
     static const std::string CANCELLED;
@@ -60,7 +70,7 @@ protected:
     void display_msg(const char *fmt, ...);
     virtual void display_msg(const std::string &msg);
     virtual void updater_print(const std::string &msg);
-    virtual void command_output(const std::string &line);
+    virtual void command_output(const std::string &lines);
     virtual std::string get_install_type() = 0;
     virtual std::unordered_map<std::string, std::string> get_properties();
     virtual ProceedState on_initialize();
@@ -75,6 +85,8 @@ protected:
     virtual void on_cleanup(ProceedState ret);
 
     std::string _zip_file;
+    // Reused for every lookup and extraction from the zip
+    util::ArchiveIndex _zip_index;
     std::string _chroot;
     std::string _temp;
     int _interface;
@@ -110,14 +122,21 @@ protected:
 
 
 private:
+    std::string _chroot_template;
+    bool _chroot_from_template;
     bool _ran;
 
+    // Background readahead of the zip when it could not be staged in RAM
+    std::thread _zip_prefetch_thread;
+    std::atomic<bool> _zip_prefetch_stop;
+
     static void output_cb(const char *line, bool error, void *userdata);
     int run_command(const char * const *argv);
     int run_command_chroot(const char *dir,
                            const char * const *argv);
 
     bool create_chroot();
+    bool create_chroot_from_template();
     bool destroy_chroot() const;
     bool mount_efs() const;
 
@@ -134,6 +153,8 @@ private:
     static bool change_root(const std::string &path);
     bool set_up_legacy_properties();
     bool updater_fd_reader(int stdio_fd, int command_fd);
+    bool set_up_zip_file();
+    void stop_zip_prefetch();
     bool run_real_updater();
     bool run_debug_shell();
 
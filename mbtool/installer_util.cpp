@@ -28,9 +28,6 @@
 
 #include <sys/stat.h>
 
-#include <archive.h>
-#include <archive_entry.h>
-
 #include "mbbootimg/entry.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
@@ -43,6 +40,7 @@
 
 #include "mblog/logging.h"
 
+#include "mbutil/cpio.h"
 #include "mbutil/delete.h"
 #include "mbutil/finally.h"
 #include "mbutil/path.h"
@@ -50,8 +48,6 @@
 #include "bootimg_util.h"
 #include "multiboot.h"
 
-typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
-typedef std::unique_ptr<archive_entry, decltype(archive_entry_free) *> ScopedArchiveEntry;
 typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
@@ -59,232 +55,6 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
 namespace mb
 {
 
-bool InstallerUtil::unpack_ramdisk(const std::string &input_file,
-                                   const std::string &output_dir,
-                                   int &format_out,
-                                   std::vector<int> &filters_out)
-{
-    ScopedArchive ain(archive_read_new(), archive_read_free);
-    ScopedArchive aout(archive_write_disk_new(), archive_write_free);
-    archive_entry *entry;
-    std::string target_path;
-    int ret;
-
-    if (!ain || !aout) {
-        LOGE("Failed to allocate archive reader or writer instance");
-        return false;
-    }
-
-    archive_read_support_filter_gzip(ain.get());
-    archive_read_support_filter_lz4(ain.get());
-    archive_read_support_filter_lzma(ain.get());
-    archive_read_support_filter_xz(ain.get());
-    archive_read_support_format_cpio(ain.get());
-
-    // Set up disk writer parameters
-    archive_write_disk_set_standard_lookup(aout.get());
-    archive_write_disk_set_options(aout.get(),
-                                   ARCHIVE_EXTRACT_TIME
-                                 | ARCHIVE_EXTRACT_SECURE_SYMLINKS
-                                 | ARCHIVE_EXTRACT_SECURE_NODOTDOT
-                                 | ARCHIVE_EXTRACT_OWNER
-                                 | ARCHIVE_EXTRACT_PERM);
-
-    if (archive_read_open_filename(ain.get(), input_file.c_str(), 10240)
-            != ARCHIVE_OK) {
-        LOGE("%s: Failed to open for reading: %s",
-             input_file.c_str(), archive_error_string(ain.get()));
-        return false;
-    }
-
-    while (true) {
-        ret = archive_read_next_header(ain.get(), &entry);
-        if (ret == ARCHIVE_EOF) {
-            break;
-        } else if (ret == ARCHIVE_RETRY) {
-            continue;
-        } else if (ret != ARCHIVE_OK) {
-            LOGE("%s: Failed to read header: %s",
-                 input_file.c_str(), archive_error_string(ain.get()));
-            return false;
-        }
-
-        const char *path = archive_entry_pathname(entry);
-        if (!path || !*path) {
-            LOGE("%s: Header has null or empty filename", input_file.c_str());
-            return false;
-        }
-
-        // Build path
-        target_path = output_dir;
-        if (!target_path.empty() && target_path.back() != '/' && *path != '/') {
-            target_path += '/';
-        }
-        target_path += path;
-
-        archive_entry_set_pathname(entry, target_path.c_str());
-
-        // Extract file
-        ret = archive_read_extract2(ain.get(), entry, aout.get());
-        if (ret != ARCHIVE_OK) {
-            LOGE("%s: %s", archive_entry_pathname(entry),
-                 archive_error_string(ain.get()));
-            return false;
-        }
-    }
-
-    // Save format
-    format_out = archive_format(ain.get());
-    filters_out.clear();
-    for (int i = 0; i < archive_filter_count(ain.get()); ++i) {
-        int code = archive_filter_code(ain.get(), i);
-        if (code != ARCHIVE_FILTER_NONE) {
-            filters_out.push_back(code);
-        }
-    }
-
-    if (archive_read_close(ain.get()) != ARCHIVE_OK) {
-        LOGE("%s: %s", input_file.c_str(), archive_error_string(ain.get()));
-        return false;
-    }
-
-    return true;
-}
-
-static int metadata_filter(archive *a, void *data, archive_entry *entry)
-{
-    (void) data;
-    (void) entry;
-
-    if (archive_read_disk_can_descend(a)) {
-        archive_read_disk_descend(a);
-    }
-    return 1;
-}
-
-bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
-                                 const std::string &output_file,
-                                 int format,
-                                 const std::vector<int> &filters)
-{
-    ScopedArchive ain(archive_read_disk_new(), archive_read_free);
-    ScopedArchive aout(archive_write_new(), archive_write_free);
-    ScopedArchiveEntry entry(archive_entry_new(), archive_entry_free);
-    std::string full_path;
-    int ret;
-
-    if (!ain || !aout || !entry) {
-        LOGE("Failed to allocate archive reader, writer, or entry instance");
-        return false;
-    }
-
-    // Set up disk reader parameters
-    archive_read_disk_set_symlink_physical(ain.get());
-    archive_read_disk_set_metadata_filter_callback(
-            ain.get(), metadata_filter, nullptr);
-    // We don't want to look up usernames and group names on Android
-    //archive_read_disk_set_standard_lookup(in.get());
-
-    if (archive_write_set_format(aout.get(), format) != ARCHIVE_OK) {
-        LOGE("Failed to set output archive format: %s",
-             archive_error_string(aout.get()));
-        return false;
-    }
-    for (const int &filter : filters) {
-        if (archive_write_add_filter(aout.get(), filter) != ARCHIVE_OK) {
-            LOGE("Failed to add output archive filter: %s",
-                 archive_error_string(aout.get()));
-            return false;
-        }
-    }
-
-    archive_write_set_bytes_per_block(aout.get(), 512);
-
-    // Open output file
-    if (archive_write_open_filename(aout.get(), output_file.c_str())
-            != ARCHIVE_OK) {
-        LOGE("%s: Failed to open for writing: %s",
-             output_file.c_str(), archive_error_string(aout.get()));
-        return false;
-    }
-
-    ret = archive_read_disk_open(ain.get(), input_dir.c_str());
-    if (ret != ARCHIVE_OK) {
-        LOGE("%s: %s", input_dir.c_str(), archive_error_string(ain.get()));
-        return false;
-    }
-
-    while (true) {
-        // libarchive doesn't clear the entry automatically
-        archive_entry_clear(entry.get());
-
-        ret = archive_read_next_header2(ain.get(), entry.get());
-        if (ret == ARCHIVE_EOF) {
-            break;
-        } else if (ret != ARCHIVE_OK) {
-            LOGE("%s: Failed to read next header: %s", input_dir.c_str(),
-                 archive_error_string(ain.get()));
-            return false;
-        }
-
-        if (archive_entry_filetype(entry.get()) != AE_IFREG) {
-            archive_entry_set_size(entry.get(), 0);
-        }
-
-        const char *curpath = archive_entry_pathname(entry.get());
-        if (curpath && !input_dir.empty()) {
-            std::string relpath;
-            if (!util::relative_path(curpath, input_dir, &relpath)) {
-                LOGE("Failed to compute relative path of %s starting at %s: %s",
-                     curpath, input_dir.c_str(), strerror(errno));
-                return false;
-            }
-            if (relpath.empty()) {
-                // If the relative path is empty, then the current path is
-                // the root of the directory tree. We don't need that, so
-                // skip it.
-                continue;
-            }
-            archive_entry_set_pathname(entry.get(), relpath.c_str());
-        }
-
-        ret = archive_write_header(aout.get(), entry.get());
-        if (ret != ARCHIVE_OK) {
-            LOGE("%s: %s", output_file.c_str(),
-                 archive_error_string(aout.get()));
-            return false;
-        }
-
-        char buf[10240];
-        la_ssize_t n;
-
-        if (archive_entry_size(entry.get()) > 0) {
-            while ((n = archive_read_data(ain.get(), buf, sizeof(buf))) > 0) {
-                if (archive_write_data(aout.get(), buf, n) != n) {
-                    LOGE("Failed to write archive entry data: %s",
-                         archive_error_string(aout.get()));
-                    return false;
-                }
-            }
-
-            if (n < 0) {
-                LOGE("Failed to read archive entry data: %s",
-                     archive_error_string(ain.get()));
-                return false;
-            }
-        }
-    }
-
-    archive_read_close(ain.get());
-
-    if (archive_write_close(aout.get()) != ARCHIVE_OK) {
-        LOGE("%s: %s", output_file.c_str(), archive_error_string(aout.get()));
-        return false;
-    }
-
-    return true;
-}
-
 bool InstallerUtil::patch_boot_image(const std::string &input_file,
                                      const std::string &output_file,
                                      std::vector<std::function<RamdiskPatcherFn>> &rps)
@@ -453,60 +223,56 @@ bool InstallerUtil::patch_boot_image(const std::string &input_file,
     return true;
 }
 
+/*!
+ * \brief Patch a ramdisk archive without extracting it
+ *
+ * The archive is loaded into memory, patched, and then written out with its
+ * original format and compression filters. If the ramdisk contains a nested
+ * `sbin/ramdisk.cpio`, the patchers are applied to that instead.
+ */
 bool InstallerUtil::patch_ramdisk(const std::string &input_file,
                                   const std::string &output_file,
                                   unsigned int depth,
                                   std::vector<std::function<RamdiskPatcherFn>> &rps)
 {
-    if (depth > 1) {
-        LOGV("Ignoring doubly-nested ramdisk");
-        return true;
-    }
-
-    std::string tmpdir = format("%s.XXXXXX", output_file.c_str());
+    util::CpioArchive cpio;
 
-    if (!mkdtemp(&tmpdir[0])) {
-        LOGE("Failed to create temporary directory: %s", strerror(errno));
+    if (!cpio.load_file(input_file)) {
         return false;
     }
 
-    auto delete_temp_dir = util::finally([&]{
-        util::delete_recursive(tmpdir);
-    });
-
-    int format;
-    std::vector<int> filters;
-
-    // Extract ramdisk
-    if (!unpack_ramdisk(input_file, tmpdir, format, filters)) {
+    if (!patch_ramdisk_cpio(cpio, depth, rps)) {
         return false;
     }
 
-    // Patch ramdisk
-    std::string nested(tmpdir);
-    nested += "/sbin/ramdisk.cpio";
-    struct stat sb;
-    bool ret;
+    return cpio.save_file(output_file);
+}
 
-    if (stat(nested.c_str(), &sb) == 0) {
-        ret = patch_ramdisk(nested, nested, depth + 1, rps);
-    } else {
-        ret = patch_ramdisk_dir(tmpdir, rps);
+bool InstallerUtil::patch_ramdisk_cpio(util::CpioArchive &cpio,
+                                       unsigned int depth,
+                                       std::vector<std::function<RamdiskPatcherFn>> &rps)
+{
+    if (depth > 1) {
+        LOGV("Ignoring doubly-nested ramdisk");
+        return true;
     }
 
-    // Pack ramdisk
-    if (!pack_ramdisk(tmpdir, output_file, format, filters)) {
-        return false;
-    }
+    std::string nested_data;
 
-    return ret;
-}
+    if (cpio.contents("sbin/ramdisk.cpio", nested_data)) {
+        util::CpioArchive nested;
+
+        if (!nested.load_memory(nested_data.data(), nested_data.size())
+                || !patch_ramdisk_cpio(nested, depth + 1, rps)
+                || !nested.save_memory(nested_data)) {
+            return false;
+        }
+
+        return cpio.set_contents("sbin/ramdisk.cpio", std::move(nested_data));
+    }
 
-bool InstallerUtil::patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                      std::vector<std::function<RamdiskPatcherFn>> &rps)
-{
     for (auto const &rp : rps) {
-        if (!rp(ramdisk_dir)) {
+        if (!rp(cpio)) {
             return false;
         }
     }
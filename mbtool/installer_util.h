@@ -35,15 +35,6 @@ class File;
 class InstallerUtil
 {
 public:
-    static bool unpack_ramdisk(const std::string &input_file,
-                               const std::string &output_dir,
-                               int &format_out,
-                               std::vector<int> &filters_out);
-    static bool pack_ramdisk(const std::string &input_dir,
-                             const std::string &output_file,
-                             int format,
-                             const std::vector<int> &filters);
-
     static bool patch_boot_image(const std::string &input_file,
                                  const std::string &output_file,
                                  std::vector<std::function<RamdiskPatcherFn>> &rps);
@@ -51,8 +42,9 @@ public:
                               const std::string &output_file,
                               unsigned int depth,
                               std::vector<std::function<RamdiskPatcherFn>> &rps);
-    static bool patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                  std::vector<std::function<RamdiskPatcherFn>> &rps);
+    static bool patch_ramdisk_cpio(util::CpioArchive &cpio,
+                                   unsigned int depth,
+                                   std::vector<std::function<RamdiskPatcherFn>> &rps);
     static bool patch_kernel_rkp(const std::string &input_file,
                                  const std::string &output_file);
 
@@ -25,8 +25,15 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "clone_rom.h"
+
+#ifdef MB_ALLOC_PROFILING
+#include "alloc_hooks.h"
+#endif
+
 #ifdef RECOVERY
 #include "backup.h"
+#include "bench.h"
 #include "rom_installer.h"
 #include "update_binary.h"
 #include "update_binary_tool.h"
@@ -38,11 +45,13 @@
 #include "init.h"
 #include "miniadbd.h"
 #include "properties.h"
+#include "readahead.h"
 #include "sepolpatch.h"
 #include "signature.h"
 #include "uevent_dump.h"
 #endif
 
+#include "mbcommon/metrics.h"
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
 #include "mbutil/process.h"
@@ -65,8 +74,10 @@ struct tool tools[] = {
     { "mbtool", mbtool_main },
     { "mbtool_recovery", mbtool_main },
     // Tools
+    { "clone-rom", mb::clone_rom_main },
 #ifdef RECOVERY
     { "backup", mb::backup_main },
+    { "bench", mb::bench_main },
     { "restore", mb::restore_main },
     { "rom-installer", mb::rom_installer_main },
     { "updater", mb::update_binary_main }, // TWRP
@@ -81,6 +92,7 @@ struct tool tools[] = {
     { "init", mb::init_main },
     { "miniadbd", mb::miniadbd_main },
     { "properties", mb::properties_main },
+    { "readahead", mb::readahead_main },
     { "sepolpatch", mb::sepolpatch_main },
     { "sigverify", mb::sigverify_main },
     { "uevent_dump", mb::uevent_dump_main },
@@ -189,6 +201,10 @@ int main(int argc, char *argv[])
 
     umask(0);
 
+#ifdef MB_ALLOC_PROFILING
+    mb::alloc_profiler_start_dumper();
+#endif
+
     if (!setlocale(LC_ALL, "C")) {
         fprintf(stderr, "Failed to set default locale\n");
     }
@@ -204,5 +220,15 @@ int main(int argc, char *argv[])
 
     mb::util::free_cstring_list(argv_copy);
 
+    // Tools that exit early (eg. via exec) do not get here, which is fine
+    // since there would be nothing useful to write anyway
+    char *metrics_file = getenv("MBTOOL_METRICS_FILE");
+    if (metrics_file && *metrics_file) {
+        if (!mb::MetricsRegistry::global().write_json_file(metrics_file)) {
+            fprintf(stderr, "%s: Failed to write metrics: %s\n",
+                    metrics_file, strerror(errno));
+        }
+    }
+
     return ret;
 }
@@ -17,6 +17,8 @@
 #include "sysdeps.h"
 #include "adb.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
@@ -58,11 +60,32 @@ void fatal_errno(const char *fmt, ...)
     exit(-1);
 }
 
+// Freed packets are kept on a free list for reuse. Each packet is larger than
+// malloc's mmap threshold, so otherwise every packet would cost an mmap()/
+// munmap() pair plus page faults for the payload. Packets are allocated and
+// freed on different threads, so the list needs a lock, but it is only held
+// for a pointer swap.
+#define APACKET_POOL_MAX 16
+
+static pthread_mutex_t apacket_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static apacket *apacket_pool = nullptr;
+static size_t apacket_pool_count = 0;
+
 apacket* get_apacket(void)
 {
-    apacket* p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+    pthread_mutex_lock(&apacket_pool_lock);
+    apacket* p = apacket_pool;
+    if (p != nullptr) {
+        apacket_pool = p->next;
+        --apacket_pool_count;
+    }
+    pthread_mutex_unlock(&apacket_pool_lock);
+
     if (p == nullptr) {
-      fatal("failed to allocate an apacket");
+        p = reinterpret_cast<apacket*>(malloc(sizeof(apacket)));
+        if (p == nullptr) {
+          fatal("failed to allocate an apacket");
+        }
     }
 
     memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
@@ -71,6 +94,15 @@ apacket* get_apacket(void)
 
 void put_apacket(apacket *p)
 {
+    pthread_mutex_lock(&apacket_pool_lock);
+    if (apacket_pool_count < APACKET_POOL_MAX) {
+        p->next = apacket_pool;
+        apacket_pool = p;
+        ++apacket_pool_count;
+        p = nullptr;
+    }
+    pthread_mutex_unlock(&apacket_pool_lock);
+
     free(p);
 }
 
@@ -265,6 +297,10 @@ void handle_packet(apacket *p, atransport *t)
 
         parse_banner(reinterpret_cast<const char*>(p->data), t);
 
+        // Use the largest packet size that both sides support
+        t->max_payload = std::max<size_t>(
+                std::min<size_t>(p->msg.arg1, MAX_PAYLOAD), MAX_PAYLOAD_V1);
+
         handle_online(t);
         send_connect(t);
         break;
@@ -19,7 +19,11 @@
 
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+// Packets are limited to MAX_PAYLOAD_V1 until the host's CNXN message says
+// it can handle more
+#define MAX_PAYLOAD_V1 (4*1024)
+#define MAX_PAYLOAD_V2 (256*1024)
+#define MAX_PAYLOAD MAX_PAYLOAD_V2
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -173,6 +177,7 @@ struct atransport
     int ref_count;
     unsigned sync_token;
     int connection_state;
+    size_t max_payload;
     int online;
     transport_type type;
 
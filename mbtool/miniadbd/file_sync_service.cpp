@@ -17,10 +17,13 @@
 #include "sysdeps.h"
 #include "file_sync_service.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <sys/sendfile.h>
 #include <utime.h>
 
 #include "adb_io.h"
@@ -347,6 +350,9 @@ static int do_send(int s, char *path, char *buffer)
 static int do_recv(int s, const char *path, char *buffer)
 {
     syncmsg msg;
+    struct stat st;
+    off_t remaining = 0;
+    bool use_sendfile = true;
     int fd, r;
 
     fd = adb_open(path, O_RDONLY | O_CLOEXEC);
@@ -355,7 +361,54 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
+    /*
+     * Regular files are sent with sendfile() so the data doesn't have to be
+     * copied through userspace. Each DATA header includes the chunk size, so
+     * this only covers the size of the file when it was opened. Anything
+     * appended afterwards is sent by the read() loop below.
+     */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        remaining = st.st_size;
+    }
+
     msg.data.id = ID_DATA;
+    while (remaining > 0) {
+        size_t chunk = std::min<off_t>(remaining, SYNC_DATA_MAX);
+        size_t done = 0;
+
+        msg.data.size = htoll(chunk);
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) {
+            close(fd);
+            return -1;
+        }
+
+        while (done < chunk) {
+            if (use_sendfile) {
+                ssize_t n = sendfile(s, fd, NULL, chunk - done);
+                if (n > 0) {
+                    done += n;
+                    continue;
+                } else if (n < 0 && errno == EINTR) {
+                    continue;
+                } else if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    use_sendfile = false;
+                    continue;
+                }
+            } else if (ReadFdExactly(fd, buffer, chunk - done)
+                    && WriteFdExactly(s, buffer, chunk - done)) {
+                done = chunk;
+                continue;
+            }
+
+            // The header already promised the whole chunk, so if the file
+            // shrank or can't be read, the connection has to be dropped
+            close(fd);
+            return -1;
+        }
+
+        remaining -= chunk;
+    }
+
     for (;;) {
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if (r <= 0) {
@@ -23,6 +23,9 @@
 #include "adb_log.h"
 #include "adb_utils.h"
 
+/* Maximum number of packet addresses read from a transport socket at once */
+#define TRANSPORT_READ_BATCH 64
+
 static void transport_unref(atransport *t);
 
 static atransport transport_list = {
@@ -121,35 +124,38 @@ static void dump_packet(const char* name, const char* func, apacket* p) {
 }
 #endif
 
+/* Read all of the packet addresses that are ready, up to max. This drains
+** the queue with one read() instead of one per packet.
+**
+** Returns the number of packets read or -1 on error.
+*/
 static int
-read_packet(int  fd, const char* name, apacket** ppacket)
+read_packets(int fd, const char* name, apacket** packets, int max)
 {
-    char *p = (char*) ppacket;  /* really read a packet address */
+    char *p = (char*) packets;
+    int   n = 0;
     int   r;
-    int   len = sizeof(*ppacket);
     char  buff[8];
     if (!name) {
         snprintf(buff, sizeof buff, "fd=%d", fd);
         name = buff;
     }
-    while (len > 0) {
-        r = adb_read(fd, p, len);
+    for (;;) {
+        r = adb_read(fd, p + n, max * sizeof(*packets) - n);
         if (r > 0) {
-            len -= r;
-            p   += r;
+            n += r;
+            /* Only stop reading at a packet boundary */
+            if (n % sizeof(*packets) == 0) break;
         } else {
             ADB_LOGE(ADB_TSPT,
-                     "%s: read_packet (fd=%d), error ret=%d errno=%d: %s",
+                     "%s: read_packets (fd=%d), error ret=%d errno=%d: %s",
                      name, fd, r, errno, strerror(errno));
             if ((r < 0) && (errno == EINTR)) continue;
             return -1;
         }
     }
 
-#if 0
-    dump_packet(name, "from remote", *ppacket);
-#endif
-    return 0;
+    return n / sizeof(*packets);
 }
 
 static int
@@ -189,13 +195,16 @@ static void transport_socket_events(int fd, unsigned events, void *_t)
     ADB_LOGD(ADB_TSPT, "transport_socket_events(fd=%d, events=%04x,...)",
              fd, events);
     if (events & FDE_READ) {
-        apacket *p = 0;
-        if (read_packet(fd, t->serial, &p)) {
+        apacket *packets[TRANSPORT_READ_BATCH];
+        int n = read_packets(fd, t->serial, packets, TRANSPORT_READ_BATCH);
+        if (n < 0) {
             ADB_LOGE(ADB_TSPT,
                      "%s: failed to read packet from transport socket on fd %d",
                      t->serial, fd);
         } else {
-            handle_packet(p, (atransport *) _t);
+            for (int i = 0; i < n; ++i) {
+                handle_packet(packets[i], (atransport *) _t);
+            }
         }
     }
 }
@@ -306,48 +315,57 @@ oops:
 static void *input_thread(void *_t)
 {
     atransport *t = reinterpret_cast<atransport*>(_t);
+    apacket *packets[TRANSPORT_READ_BATCH];
     apacket *p;
     int active = 0;
+    int offline = 0;
 
     ADB_LOGD(ADB_TSPT,
              "%s: starting transport input thread, reading from fd %d",
              t->serial, t->fd);
 
-    for (;;) {
-        if (read_packet(t->fd, t->serial, &p)) {
+    while (!offline) {
+        int n = read_packets(t->fd, t->serial, packets, TRANSPORT_READ_BATCH);
+        if (n < 0) {
             ADB_LOGE(ADB_TSPT,
                      "%s: failed to read apacket from transport on fd %d",
                      t->serial, t->fd);
             break;
         }
-        if (p->msg.command == A_SYNC) {
-            if (p->msg.arg0 == 0) {
-                ADB_LOGE(ADB_TSPT, "%s: transport SYNC offline", t->serial);
-                put_apacket(p);
-                break;
-            } else {
-                if (p->msg.arg1 == t->sync_token) {
-                    ADB_LOGD(ADB_TSPT, "%s: transport SYNC online", t->serial);
-                    active = 1;
+
+        for (int i = 0; i < n; ++i) {
+            p = packets[i];
+
+            if (offline) {
+                // Drop whatever was queued after SYNC offline
+            } else if (p->msg.command == A_SYNC) {
+                if (p->msg.arg0 == 0) {
+                    ADB_LOGE(ADB_TSPT, "%s: transport SYNC offline", t->serial);
+                    offline = 1;
                 } else {
-                    ADB_LOGD(ADB_TSPT, "%s: transport ignoring SYNC %d != %d",
-                             t->serial, p->msg.arg1, t->sync_token);
+                    if (p->msg.arg1 == t->sync_token) {
+                        ADB_LOGD(ADB_TSPT, "%s: transport SYNC online", t->serial);
+                        active = 1;
+                    } else {
+                        ADB_LOGD(ADB_TSPT, "%s: transport ignoring SYNC %d != %d",
+                                 t->serial, p->msg.arg1, t->sync_token);
+                    }
                 }
-            }
-        } else {
-            if (active) {
-                ADB_LOGD(ADB_TSPT,
-                         "%s: transport got packet, sending to remote",
-                         t->serial);
-                t->write_to_remote(p, t);
             } else {
-                ADB_LOGD(ADB_TSPT,
-                         "%s: transport ignoring packet while offline",
-                         t->serial);
+                if (active) {
+                    ADB_LOGD(ADB_TSPT,
+                             "%s: transport got packet, sending to remote",
+                             t->serial);
+                    t->write_to_remote(p, t);
+                } else {
+                    ADB_LOGD(ADB_TSPT,
+                             "%s: transport ignoring packet while offline",
+                             t->serial);
+                }
             }
-        }
 
-        put_apacket(p);
+            put_apacket(p);
+        }
     }
 
     // this is necessary to avoid a race condition that occured when a transport closes
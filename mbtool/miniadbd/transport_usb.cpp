@@ -83,6 +83,7 @@ void init_usb_transport(atransport *t, usb_handle *h, int state)
     t->write_to_remote = remote_write;
     t->sync_token = 1;
     t->connection_state = state;
+    t->max_payload = MAX_PAYLOAD_V1;
     t->type = kTransportUsb;
     t->usb = h;
 }
@@ -16,11 +16,15 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
+
 #include <cstdlib>
 #include <cstring>
 
 #include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 
@@ -32,6 +36,15 @@
 #define MAX_PACKET_SIZE_HS      512
 #define MAX_PACKET_SIZE_SS      1024
 
+// Largest single read or write that the kernel drivers reliably accept
+#define USB_ADB_MAX_READ        4096
+#define USB_FFS_MAX_READ        16384
+#define USB_FFS_MAX_WRITE       16384
+
+// Number of FunctionFS writes queued at once with AIO. This covers one
+// maximum-sized packet.
+#define USB_FFS_NUM_BUFS        (MAX_PAYLOAD / USB_FFS_MAX_WRITE)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
@@ -51,6 +64,8 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+    // AIO context for writes to bulk_in (0 if AIO is not supported)
+    aio_context_t aio_ctx;
 };
 
 struct func_desc {
@@ -268,14 +283,21 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
 
 static int usb_adb_read(usb_handle *h, void *data, int len)
 {
-    int n;
+    uint8_t *buf = reinterpret_cast<uint8_t*>(data);
 
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if (n != len) {
-        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
-                 h->fd, n, errno, strerror(errno));
-        return -1;
+
+    // f_adb rejects reads larger than its request buffer
+    while (len > 0) {
+        int to_read = std::min(len, USB_ADB_MAX_READ);
+        int n = adb_read(h->fd, buf, to_read);
+        if (n != to_read) {
+            ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
+                     h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
     }
     ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->fd);
     return 0;
@@ -442,7 +464,8 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        ret = adb_write(bulk_in, buf + count,
+                        std::min<size_t>(length - count, USB_FFS_MAX_WRITE));
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -455,10 +478,126 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
     return count;
 }
 
+static int sys_io_setup(unsigned nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                            struct io_event *events, struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+/*
+ * Queue up to USB_FFS_NUM_BUFS writes at once so that the controller always
+ * has the next transfer ready. With blocking writes, the endpoint sits idle
+ * while each completion makes its way back to userspace.
+ */
+static int bulk_write_aio(aio_context_t ctx, int bulk_in, const uint8_t* buf,
+                          size_t length)
+{
+    struct iocb iocbs[USB_FFS_NUM_BUFS];
+    struct iocb *iocb_ptrs[USB_FFS_NUM_BUFS];
+    struct io_event events[USB_FFS_NUM_BUFS];
+    size_t count = 0;
+
+    while (count < length) {
+        int num = 0;
+        size_t queued = count;
+
+        for (; num < USB_FFS_NUM_BUFS && queued < length; ++num) {
+            size_t n = std::min<size_t>(length - queued, USB_FFS_MAX_WRITE);
+
+            memset(&iocbs[num], 0, sizeof(iocbs[num]));
+            iocbs[num].aio_fildes = bulk_in;
+            iocbs[num].aio_lio_opcode = IOCB_CMD_PWRITE;
+            iocbs[num].aio_buf = reinterpret_cast<uintptr_t>(buf + queued);
+            iocbs[num].aio_nbytes = n;
+            iocb_ptrs[num] = &iocbs[num];
+
+            queued += n;
+        }
+
+        int submitted = 0;
+        int saved_errno = 0;
+
+        while (submitted < num) {
+            int ret = sys_io_submit(ctx, num - submitted,
+                                    iocb_ptrs + submitted);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                saved_errno = errno;
+                break;
+            }
+            submitted += ret;
+        }
+
+        if (submitted == 0 && saved_errno == EINVAL) {
+            // FunctionFS only supports AIO since Linux 3.15
+            ADB_LOGD(ADB_USB, "[ AIO not supported fd=%d ]", bulk_in);
+            int ret = bulk_write(bulk_in, buf + count, length - count);
+            return ret < 0 ? ret : static_cast<int>(count) + ret;
+        }
+
+        // Everything that was submitted must be reaped before the buffer can
+        // be released, even on failure
+        int completed = 0;
+
+        while (completed < submitted) {
+            int ret = sys_io_getevents(ctx, submitted - completed,
+                                       submitted - completed, events, nullptr);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ADB_LOGE(ADB_USB, "[ io_getevents failed fd=%d: %s ]",
+                         bulk_in, strerror(errno));
+                return -1;
+            }
+
+            for (int i = 0; i < ret; ++i) {
+                const struct iocb *cb = reinterpret_cast<const struct iocb *>(
+                        static_cast<uintptr_t>(events[i].obj));
+                if (events[i].res < 0) {
+                    saved_errno = -events[i].res;
+                } else if (static_cast<uint64_t>(events[i].res)
+                        != cb->aio_nbytes && saved_errno == 0) {
+                    saved_errno = EIO;
+                }
+            }
+            completed += ret;
+        }
+
+        if (saved_errno != 0) {
+            errno = saved_errno;
+            return -1;
+        }
+
+        count = queued;
+    }
+
+    ADB_LOGD(ADB_USB, "[ bulk_write_aio done fd=%d ]", bulk_in);
+    return count;
+}
+
 static int usb_ffs_write(usb_handle* h, const void* data, int len)
 {
     ADB_LOGD(ADB_USB, "about to write (fd=%d, len=%d)", h->bulk_in, len);
-    int n = bulk_write(h->bulk_in, reinterpret_cast<const uint8_t*>(data), len);
+    const uint8_t *buf = reinterpret_cast<const uint8_t*>(data);
+    int n;
+    if (h->aio_ctx != 0 && len > USB_FFS_MAX_WRITE) {
+        n = bulk_write_aio(h->aio_ctx, h->bulk_in, buf, len);
+    } else {
+        n = bulk_write(h->bulk_in, buf, len);
+    }
     if (n != len) {
         ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
                  h->bulk_in, n, strerror(errno));
@@ -474,7 +613,8 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        ret = adb_read(bulk_out, buf + count,
+                       std::min<size_t>(length - count, USB_FFS_MAX_READ));
         if (ret < 0) {
             if (errno != EINTR) {
                 ADB_LOGE(ADB_USB,
@@ -542,6 +682,14 @@ static void usb_ffs_init()
     h->bulk_out = -1;
     h->bulk_out = -1;
 
+    // The context is not tied to the endpoint files, so it is kept for the
+    // lifetime of the handle instead of being recreated on every reconnect
+    if (sys_io_setup(USB_FFS_NUM_BUFS, &h->aio_ctx) < 0) {
+        ADB_LOGW(ADB_USB, "[ usb_init - AIO not available: %s ]",
+                 strerror(errno));
+        h->aio_ctx = 0;
+    }
+
     pthread_cond_init(&h->notify, 0);
     pthread_mutex_init(&h->lock, 0);
 
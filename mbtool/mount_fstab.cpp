@@ -20,8 +20,11 @@
 #include "mount_fstab.h"
 
 #include <algorithm>
+#include <functional>
+#include <thread>
 
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -35,6 +38,7 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
@@ -48,11 +52,13 @@
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
 #include "multiboot.h"
 #include "reboot.h"
@@ -380,7 +386,9 @@ static bool mount_ext4(const char *source, const char *target)
     }
 }
 
-static bool try_extsd_mount(const char *block_dev, const char *mount_point)
+static bool try_extsd_mount(const char *block_dev,
+                            const util::BlkidInfo &probe,
+                            const char *mount_point)
 {
     // Vold ignores the fstab fstype field and uses blkid to determine the
     // filesystem. We don't link in blkid, so we'll use a trial and error
@@ -402,10 +410,10 @@ static bool try_extsd_mount(const char *block_dev, const char *mount_point)
         }
     }
 
-    const char *fstype;
-    if (!util::blkid_get_fs_type(block_dev, &fstype)) {
+    const char *fstype = probe.type;
+    if (!probe.ok) {
         LOGE("%s: Failed to detect filesystem type: %s",
-             block_dev, strerror(errno));
+             block_dev, strerror(probe.error));
     } else if (!fstype) {
         LOGE("%s: Unknown filesystem", block_dev);
     } else if (strcmp(fstype, "exfat") == 0) {
@@ -491,6 +499,7 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
              i + 1, max_attempts);
 
         auto devices_map = get_block_dev_mappings();
+        std::vector<std::string> candidates;
 
         for (const util::fstab_rec &rec : extsd_recs) {
             std::vector<std::string> patterns =
@@ -516,14 +525,26 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
                             continue;
                         }
 
-                        if (try_extsd_mount(info.path.c_str(), mount_point)) {
-                            return true;
+                        if (std::find(candidates.begin(), candidates.end(),
+                                      info.path) == candidates.end()) {
+                            candidates.push_back(info.path);
                         }
                     }
                 }
             }
         }
 
+        // Read the superblocks of all candidates at once since SD cards can
+        // be slow to respond. Mounting is still done in the order matched.
+        auto probes = util::blkid_probe_all(candidates);
+
+        for (size_t j = 0; j < candidates.size(); ++j) {
+            if (try_extsd_mount(candidates[j].c_str(), probes[j],
+                                mount_point)) {
+                return true;
+            }
+        }
+
         if (i < max_attempts - 1) {
             LOGW("No external SD patterns were matched; waiting 1 second");
             sleep(1);
@@ -582,6 +603,16 @@ static bool mount_all_system_images()
 
     bool failed = false;
 
+    // Create the loop devices up front instead of one at a time while
+    // mounting
+    int image_count = std::count_if(roms.roms.begin(), roms.roms.end(),
+                                    [](const std::shared_ptr<Rom> &rom) {
+        return rom->system_is_image;
+    });
+    if (image_count > 0 && !util::loopdev_pool_init(image_count)) {
+        LOGW("Failed to create loop devices: %s", strerror(errno));
+    }
+
     for (const std::shared_ptr<Rom> &rom : roms.roms) {
         if (rom->system_is_image) {
             std::string mount_point(IMAGES_MOUNT_POINT);
@@ -848,6 +879,59 @@ bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
     return true;
 }
 
+struct MountJob
+{
+    // Mount point (for logging)
+    const char *mount_point;
+    std::function<bool()> func;
+    bool success;
+    int64_t duration_ms;
+};
+
+/*!
+ * \brief Run mount jobs concurrently
+ *
+ * The /raw mounts don't depend on each other, so each job gets its own thread.
+ * This mostly helps when a job has to wait for its block device to appear or,
+ * for the external SD, for the card to be detected.
+ *
+ * \return Whether all of the jobs succeeded
+ */
+static bool run_mount_jobs(std::vector<MountJob> &jobs)
+{
+    std::vector<std::thread> threads;
+    threads.reserve(jobs.size());
+
+    for (MountJob &job : jobs) {
+        threads.emplace_back([&job] {
+            struct timespec start;
+            struct timespec end;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            job.success = job.func();
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            job.duration_ms = util::timespec_diff_ms(start, end);
+        });
+    }
+
+    bool ret = true;
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        threads[i].join();
+
+        LOGD("%s: Mount %s after %" PRId64 " ms", jobs[i].mount_point,
+             jobs[i].success ? "succeeded" : "failed", jobs[i].duration_ms);
+
+        if (!jobs[i].success) {
+            LOGE("Failed to mount %s", jobs[i].mount_point);
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Mount system, cache, and data entries from fstab
  *
@@ -872,41 +956,28 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         return false;
     }
 
-    bool ret = true;
+    std::vector<MountJob> jobs;
 
-    // Mount system
-    if (ret && !recs.system.empty()) {
-        if (create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755)) {
-            successful.push_back(SYSTEM_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " SYSTEM_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.system.empty()) {
+        jobs.push_back({ SYSTEM_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755);
+        }, false, 0 });
     }
-
-    // Mount cache
-    if (ret && !recs.cache.empty()) {
-        if (create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755)) {
-            successful.push_back(CACHE_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " CACHE_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.cache.empty()) {
+        jobs.push_back({ CACHE_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755);
+        }, false, 0 });
     }
-
-    // Mount data
-    if (ret && !recs.data.empty()) {
-        if (create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755)) {
-            successful.push_back(DATA_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " DATA_MOUNT_POINT);
-            ret = false;
-        }
+    if (!recs.data.empty()) {
+        jobs.push_back({ DATA_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755);
+        }, false, 0 });
     }
 
     // Mount external SD only if ROM is installed on the external SD. This is
     // necessary because mount_extsd_fstab_entries() blocks until an SD card is
-    // found or a timeout occurs.
+    // found or a timeout occurs. It is probed while the other partitions are
+    // being mounted.
     bool require_extsd = rom->system_source == Rom::Source::EXTERNAL_SD
             || rom->cache_source == Rom::Source::EXTERNAL_SD
             || rom->data_source == Rom::Source::EXTERNAL_SD;
@@ -914,12 +985,18 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         LOGV("Skipping extsd mount because ROM is not an extsd-slot");
     }
 
-    if (ret && !recs.extsd.empty() && require_extsd) {
-        if (mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT, 0755)) {
-            successful.push_back(EXTSD_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " EXTSD_MOUNT_POINT);
-            ret = false;
+    if (!recs.extsd.empty() && require_extsd) {
+        jobs.push_back({ EXTSD_MOUNT_POINT, [&] {
+            return mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT,
+                                             0755);
+        }, false, 0 });
+    }
+
+    bool ret = run_mount_jobs(jobs);
+
+    for (const MountJob &job : jobs) {
+        if (job.success) {
+            successful.push_back(job.mount_point);
         }
     }
 
@@ -963,6 +1040,16 @@ bool mount_rom(const std::shared_ptr<Rom> &rom)
         return false;
     }
 
+    // The other ROMs' images only need the /raw mounts, so they can be mounted
+    // while this ROM's directories are being set up. Attaching loop devices
+    // is safe to do concurrently.
+    std::thread images_thread(&mount_all_system_images);
+    auto join_images_thread = util::finally([&] {
+        if (images_thread.joinable()) {
+            images_thread.join();
+        }
+    });
+
     if (!mount_target(target_system.c_str(), "/system", !rom->system_is_image)) {
         return false;
     }
@@ -983,7 +1070,7 @@ bool mount_rom(const std::shared_ptr<Rom> &rom)
         return false;
     }
 
-    mount_all_system_images();
+    images_thread.join();
 
     bool require_extsd = rom->system_source == Rom::Source::EXTERNAL_SD
             || rom->cache_source == Rom::Source::EXTERNAL_SD
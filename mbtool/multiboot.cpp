@@ -25,11 +25,11 @@
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/chmod.h"
 #include "mbutil/chown.h"
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
 #include "mbutil/fts.h"
+#include "mbutil/permissions.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
@@ -79,7 +79,8 @@ public:
         // _target is the correct parameter here (or pathbuf and
         // COPY_EXCLUDE_TOP_LEVEL flag)
         if (!util::copy_dir(_curr->fts_accpath, _target,
-                            util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
+                            util::COPY_ATTRIBUTES | util::COPY_XATTRS
+                            | util::COPY_PARALLEL)) {
             mb::format(_error_msg, "%s: Failed to copy directory: %s",
                        _curr->fts_path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
@@ -172,14 +173,20 @@ bool fix_multiboot_permissions(void)
 {
     util::create_empty_file(MULTIBOOT_DIR "/.nomedia");
 
-    if (!util::chown(MULTIBOOT_DIR, "media_rw", "media_rw",
-                     util::CHOWN_RECURSIVE)) {
-        LOGE("Failed to chown %s", MULTIBOOT_DIR);
+    uid_t uid;
+    gid_t gid;
+
+    if (!util::lookup_owner("media_rw", "media_rw", &uid, &gid)) {
+        LOGE("Failed to look up media_rw user and group: %s", strerror(errno));
         return false;
     }
 
-    if (!util::chmod(MULTIBOOT_DIR, 0775, util::CHMOD_RECURSIVE)) {
-        LOGE("Failed to chmod %s", MULTIBOOT_DIR);
+    // Both are done in a single pass and only modify entries that don't
+    // already match
+    if (!util::set_permissions_recursive(
+            MULTIBOOT_DIR, util::PERMS_SET_OWNER | util::PERMS_SET_MODE,
+            0775, uid, gid)) {
+        LOGE("Failed to chown/chmod %s", MULTIBOOT_DIR);
         return false;
     }
 
@@ -19,17 +19,18 @@
 
 #include "packages.h"
 
-#include <algorithm>
-
 #include <cassert>
+#include <cerrno>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 
 #include <pugixml.hpp>
 
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
-
+#include "mbutil/file.h"
 
 namespace mb
 {
@@ -93,8 +94,10 @@ static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
                            std::shared_ptr<Package> pkg);
 static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
                            std::shared_ptr<Package> pkg);
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs);
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs);
+static bool parse_tag_package(pugi::xml_node node, Packages *pkgs,
+                              int flags);
+static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs,
+                               int flags);
 
 
 Package::Package() :
@@ -330,19 +333,340 @@ void Package::dump()
         LOGD(fmt_string, "Installer:", installer.c_str());
 }
 
-bool Packages::load_xml(const std::string &path)
+// Android's binary XML format (ABX), which is used for packages.xml since
+// Android 12. See frameworks/base/core/java/com/android/internal/util/
+// BinaryXmlSerializer.java
+static const unsigned char ABX_MAGIC[] = { 'A', 'B', 'X', 0x00 };
+
+// Commands in the low 4 bits of each token
+#define ABX_START_DOCUMENT              0
+#define ABX_END_DOCUMENT                1
+#define ABX_START_TAG                   2
+#define ABX_END_TAG                     3
+#define ABX_TEXT                        4
+#define ABX_CDSECT                      5
+#define ABX_ENTITY_REF                  6
+#define ABX_IGNORABLE_WHITESPACE        7
+#define ABX_PROCESSING_INSTRUCTION      8
+#define ABX_COMMENT                     9
+#define ABX_DOCDECL                     10
+#define ABX_ATTRIBUTE                   15
+
+// Types in the high 4 bits of each token
+#define ABX_TYPE_NULL                   (1 << 4)
+#define ABX_TYPE_STRING                 (2 << 4)
+#define ABX_TYPE_STRING_INTERNED        (3 << 4)
+#define ABX_TYPE_BYTES_HEX              (4 << 4)
+#define ABX_TYPE_BYTES_BASE64           (5 << 4)
+#define ABX_TYPE_INT                    (6 << 4)
+#define ABX_TYPE_INT_HEX                (7 << 4)
+#define ABX_TYPE_LONG                   (8 << 4)
+#define ABX_TYPE_LONG_HEX               (9 << 4)
+#define ABX_TYPE_FLOAT                  (10 << 4)
+#define ABX_TYPE_DOUBLE                 (11 << 4)
+#define ABX_TYPE_BOOLEAN_TRUE           (12 << 4)
+#define ABX_TYPE_BOOLEAN_FALSE          (13 << 4)
+
+/*!
+ * \brief Reader for the big-endian primitives used in ABX files
+ */
+class AbxReader
+{
+public:
+    AbxReader(const unsigned char *data, size_t size)
+        : _data(data), _size(size), _pos(sizeof(ABX_MAGIC))
+    {
+    }
+
+    bool at_end() const
+    {
+        return _pos == _size;
+    }
+
+    bool read_uint(size_t n, uint64_t &value)
+    {
+        if (_size - _pos < n) {
+            return false;
+        }
+
+        value = 0;
+        for (size_t i = 0; i < n; ++i) {
+            value = (value << 8) | _data[_pos++];
+        }
+        return true;
+    }
+
+    bool read_bytes(size_t n, std::string &value)
+    {
+        if (_size - _pos < n) {
+            return false;
+        }
+
+        value.assign(reinterpret_cast<const char *>(_data + _pos), n);
+        _pos += n;
+        return true;
+    }
+
+    // Strings are in Java's modified UTF-8, which is left as is
+    bool read_utf(std::string &value)
+    {
+        uint64_t length;
+        return read_uint(2, length) && read_bytes(length, value);
+    }
+
+    bool read_interned_utf(std::string &value)
+    {
+        uint64_t index;
+        if (!read_uint(2, index)) {
+            return false;
+        }
+
+        if (index == 0xffff) {
+            if (!read_utf(value)) {
+                return false;
+            }
+            _interned.push_back(value);
+        } else if (index < _interned.size()) {
+            value = _interned[index];
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+private:
+    const unsigned char *_data;
+    size_t _size;
+    size_t _pos;
+    std::vector<std::string> _interned;
+};
+
+static std::string to_base64(const std::string &data)
+{
+    static const char *chars =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+
+    for (size_t i = 0; i < data.size(); i += 3) {
+        uint32_t n = static_cast<unsigned char>(data[i]) << 16;
+        if (i + 1 < data.size()) {
+            n |= static_cast<unsigned char>(data[i + 1]) << 8;
+        }
+        if (i + 2 < data.size()) {
+            n |= static_cast<unsigned char>(data[i + 2]);
+        }
+
+        result += chars[(n >> 18) & 0x3f];
+        result += chars[(n >> 12) & 0x3f];
+        result += i + 1 < data.size() ? chars[(n >> 6) & 0x3f] : '=';
+        result += i + 2 < data.size() ? chars[n & 0x3f] : '=';
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Read an ABX attribute value and convert it to its text XML form
+ */
+static bool read_abx_value(AbxReader &reader, int type, std::string &value)
+{
+    uint64_t n;
+
+    switch (type) {
+    case ABX_TYPE_NULL:
+        value.clear();
+        return true;
+    case ABX_TYPE_STRING:
+        return reader.read_utf(value);
+    case ABX_TYPE_STRING_INTERNED:
+        return reader.read_interned_utf(value);
+    case ABX_TYPE_BYTES_HEX:
+    case ABX_TYPE_BYTES_BASE64: {
+        std::string bytes;
+        if (!reader.read_uint(2, n) || !reader.read_bytes(n, bytes)) {
+            return false;
+        }
+        if (type == ABX_TYPE_BYTES_BASE64) {
+            value = to_base64(bytes);
+        } else {
+            value.clear();
+            for (unsigned char c : bytes) {
+                value += mb::format("%02X", c);
+            }
+        }
+        return true;
+    }
+    case ABX_TYPE_INT:
+        if (!reader.read_uint(4, n)) {
+            return false;
+        }
+        value = mb::format("%" PRId32, static_cast<int32_t>(n));
+        return true;
+    case ABX_TYPE_INT_HEX:
+        if (!reader.read_uint(4, n)) {
+            return false;
+        }
+        value = mb::format("%" PRIx32, static_cast<uint32_t>(n));
+        return true;
+    case ABX_TYPE_LONG:
+        if (!reader.read_uint(8, n)) {
+            return false;
+        }
+        value = mb::format("%" PRId64, static_cast<int64_t>(n));
+        return true;
+    case ABX_TYPE_LONG_HEX:
+        if (!reader.read_uint(8, n)) {
+            return false;
+        }
+        value = mb::format("%" PRIx64, n);
+        return true;
+    case ABX_TYPE_FLOAT: {
+        if (!reader.read_uint(4, n)) {
+            return false;
+        }
+        uint32_t bits = static_cast<uint32_t>(n);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        value = mb::format("%g", f);
+        return true;
+    }
+    case ABX_TYPE_DOUBLE: {
+        if (!reader.read_uint(8, n)) {
+            return false;
+        }
+        double d;
+        memcpy(&d, &n, sizeof(d));
+        value = mb::format("%g", d);
+        return true;
+    }
+    case ABX_TYPE_BOOLEAN_TRUE:
+        value = "true";
+        return true;
+    case ABX_TYPE_BOOLEAN_FALSE:
+        value = "false";
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief Convert an ABX document to a pugixml document
+ *
+ * Only elements and attributes are kept since nothing in packages.xml uses
+ * text content.
+ */
+static bool load_abx(const unsigned char *data, size_t size,
+                     pugi::xml_document &doc)
+{
+    AbxReader reader(data, size);
+    pugi::xml_node cur = doc;
+    std::string name;
+    std::string value;
+
+    while (!reader.at_end()) {
+        uint64_t token;
+        if (!reader.read_uint(1, token)) {
+            return false;
+        }
+
+        int command = token & 0x0f;
+        int type = token & 0xf0;
+
+        switch (command) {
+        case ABX_START_DOCUMENT:
+        case ABX_END_DOCUMENT:
+            break;
+        case ABX_START_TAG:
+            if (!reader.read_interned_utf(name)) {
+                return false;
+            }
+            cur = cur.append_child(name.c_str());
+            break;
+        case ABX_END_TAG:
+            if (!reader.read_interned_utf(name) || cur == doc
+                    || name != cur.name()) {
+                return false;
+            }
+            cur = cur.parent();
+            break;
+        case ABX_ATTRIBUTE:
+            if (!reader.read_interned_utf(name)
+                    || !read_abx_value(reader, type, value)
+                    || cur == doc) {
+                return false;
+            }
+            cur.append_attribute(name.c_str()).set_value(value.c_str());
+            break;
+        case ABX_TEXT:
+        case ABX_CDSECT:
+        case ABX_ENTITY_REF:
+        case ABX_IGNORABLE_WHITESPACE:
+        case ABX_PROCESSING_INSTRUCTION:
+        case ABX_COMMENT:
+        case ABX_DOCDECL:
+            if (type == ABX_TYPE_STRING) {
+                if (!reader.read_utf(value)) {
+                    return false;
+                }
+            } else if (type != ABX_TYPE_NULL) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return cur == doc;
+}
+
+/*!
+ * \brief Load packages.xml
+ *
+ * Both the text and binary (ABX) formats are supported.
+ *
+ * \param path Path to packages.xml
+ * \param flags Bitwise-OR of LoadFlags
+ *
+ * \return Whether the file was loaded successfully
+ */
+bool Packages::load_xml(const std::string &path, int flags)
 {
     pkgs.clear();
     sigs.clear();
+    _by_uid.clear();
+    _by_name.clear();
 
-    pugi::xml_document doc;
-    pugi::xml_parse_result result = doc.load_file(path.c_str());
-    if (!result) {
-        LOGE("Failed to parse XML file: %s: %s",
-             path.c_str(), result.description());
+    std::vector<unsigned char> data;
+    if (!util::file_read_all(path, &data)) {
+        LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
         return false;
     }
 
+    pugi::xml_document doc;
+
+    if (data.size() >= sizeof(ABX_MAGIC)
+            && memcmp(data.data(), ABX_MAGIC, sizeof(ABX_MAGIC)) == 0) {
+        if (!load_abx(data.data(), data.size(), doc)) {
+            LOGE("Failed to parse binary XML file: %s", path.c_str());
+            return false;
+        }
+    } else {
+        // Nothing that the summary needs can contain escaped characters
+        unsigned int options = (flags & LOAD_SUMMARY)
+                ? pugi::parse_minimal : pugi::parse_default;
+
+        pugi::xml_parse_result result = doc.load_buffer_inplace(
+                data.data(), data.size(), options);
+        if (!result) {
+            LOGE("Failed to parse XML file: %s: %s",
+                 path.c_str(), result.description());
+            return false;
+        }
+    }
+
     pugi::xml_node root = doc.root();
 
     for (pugi::xml_node cur_node : root.children()) {
@@ -351,7 +675,7 @@ bool Packages::load_xml(const std::string &path)
         }
 
         if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
-            if (!parse_tag_packages(cur_node, this)) {
+            if (!parse_tag_packages(cur_node, this, flags)) {
                 return false;
             }
         } else {
@@ -359,9 +683,31 @@ bool Packages::load_xml(const std::string &path)
         }
     }
 
+    build_indexes();
+
     return true;
 }
 
+/*!
+ * \brief Build the lookup tables used by find_by_uid() and find_by_pkg()
+ *
+ * Like a linear search, the first package wins if there are duplicates.
+ */
+void Packages::build_indexes()
+{
+    _by_uid.clear();
+    _by_name.clear();
+    _by_uid.reserve(pkgs.size());
+    _by_name.reserve(pkgs.size());
+
+    for (auto const &pkg : pkgs) {
+        if (!pkg->is_shared_user) {
+            _by_uid.emplace(static_cast<uid_t>(pkg->user_id), pkg);
+        }
+        _by_name.emplace(pkg->name, pkg);
+    }
+}
+
 static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
                            std::shared_ptr<Package> pkg)
 {
@@ -430,12 +776,49 @@ static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
     return true;
 }
 
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
+/*!
+ * \brief Parse only the attributes needed for Packages::LOAD_SUMMARY
+ */
+static void parse_package_summary(pugi::xml_node node, Package *pkg)
+{
+    for (pugi::xml_attribute attr : node.attributes()) {
+        const pugi::char_t *name = attr.name();
+        const pugi::char_t *value = attr.value();
+
+        if (strcmp(name, ATTR_NAME) == 0) {
+            pkg->name = value;
+        } else if (strcmp(name, ATTR_FLAGS) == 0) {
+            pkg->pkg_flags = static_cast<Package::Flags>(
+                    strtoll(value, nullptr, 10));
+        } else if (strcmp(name, ATTR_PUBLIC_FLAGS) == 0) {
+            pkg->pkg_public_flags = static_cast<Package::PublicFlags>(
+                    strtoll(value, nullptr, 10));
+        } else if (strcmp(name, ATTR_PRIVATE_FLAGS) == 0) {
+            pkg->pkg_private_flags = static_cast<Package::PrivateFlags>(
+                    strtoll(value, nullptr, 10));
+        } else if (strcmp(name, ATTR_SHARED_USER_ID) == 0) {
+            pkg->shared_user_id = strtol(value, nullptr, 10);
+            pkg->is_shared_user = 1;
+        } else if (strcmp(name, ATTR_USER_ID) == 0) {
+            pkg->user_id = strtol(value, nullptr, 10);
+            pkg->is_shared_user = 0;
+        }
+    }
+}
+
+static bool parse_tag_package(pugi::xml_node node, Packages *pkgs,
+                              int flags)
 {
     assert(strcmp(node.name(), TAG_PACKAGE) == 0);
 
     std::shared_ptr<Package> pkg(new Package());
 
+    if (flags & Packages::LOAD_SUMMARY) {
+        parse_package_summary(node, pkg.get());
+        pkgs->pkgs.push_back(std::move(pkg));
+        return true;
+    }
+
     for (pugi::xml_attribute attr : node.attributes()) {
         const pugi::char_t *name = attr.name();
         const pugi::char_t *value = attr.value();
@@ -525,7 +908,8 @@ static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
     return true;
 }
 
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
+static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs,
+                               int flags)
 {
     assert(strcmp(node.name(), TAG_PACKAGES) == 0);
 
@@ -537,7 +921,7 @@ static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
         if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
             LOGW("Nested <%s> is not allowed", TAG_PACKAGES);
         } else if (strcmp(cur_node.name(), TAG_PACKAGE) == 0) {
-            if (!parse_tag_package(cur_node, pkgs)) {
+            if (!parse_tag_package(cur_node, pkgs, flags)) {
                 return false;
             }
         } else if (strcmp(cur_node.name(), TAG_DATABASE_VERSION) == 0
@@ -560,20 +944,14 @@ static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
 
 std::shared_ptr<Package> Packages::find_by_uid(uid_t uid) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return !pkg->is_shared_user && pkg->user_id == static_cast<int>(uid);
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    auto it = _by_uid.find(uid);
+    return it == _by_uid.end() ? std::shared_ptr<Package>() : it->second;
 }
 
 std::shared_ptr<Package> Packages::find_by_pkg(const std::string &pkg_id) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return pkg->name == pkg_id;
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    auto it = _by_name.find(pkg_id);
+    return it == _by_name.end() ? std::shared_ptr<Package>() : it->second;
 }
 
 }
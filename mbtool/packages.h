@@ -149,13 +149,25 @@ public:
 class Packages
 {
 public:
+    enum LoadFlags : int {
+        // Only load the name, IDs, and flags of each package. Everything else,
+        // including the signatures, is skipped.
+        LOAD_SUMMARY = 0x1,
+    };
+
     std::vector<std::shared_ptr<Package>> pkgs;
     std::unordered_map<std::string, std::string> sigs;
 
-    bool load_xml(const std::string &path);
+    bool load_xml(const std::string &path, int flags = 0);
 
     std::shared_ptr<Package> find_by_uid(uid_t uid) const;
     std::shared_ptr<Package> find_by_pkg(const std::string &pkg_id) const;
+
+private:
+    std::unordered_map<uid_t, std::shared_ptr<Package>> _by_uid;
+    std::unordered_map<std::string, std::shared_ptr<Package>> _by_name;
+
+    void build_indexes();
 };
 
 }
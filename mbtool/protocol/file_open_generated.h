@@ -112,7 +112,8 @@ struct FileOpenRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_PATH = 4,
     VT_FLAGS = 6,
-    VT_PERMS = 8
+    VT_PERMS = 8,
+    VT_SEND_FD = 10
   };
   const flatbuffers::String *path() const {
     return GetPointer<const flatbuffers::String *>(VT_PATH);
@@ -123,6 +124,9 @@ struct FileOpenRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   uint32_t perms() const {
     return GetField<uint32_t>(VT_PERMS, 0);
   }
+  bool send_fd() const {
+    return GetField<uint8_t>(VT_SEND_FD, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
@@ -130,6 +134,7 @@ struct FileOpenRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_FLAGS) &&
            verifier.Verify(flags()) &&
            VerifyField<uint32_t>(verifier, VT_PERMS) &&
+           VerifyField<uint8_t>(verifier, VT_SEND_FD) &&
            verifier.EndTable();
   }
 };
@@ -146,13 +151,16 @@ struct FileOpenRequestBuilder {
   void add_perms(uint32_t perms) {
     fbb_.AddElement<uint32_t>(FileOpenRequest::VT_PERMS, perms, 0);
   }
+  void add_send_fd(bool send_fd) {
+    fbb_.AddElement<uint8_t>(FileOpenRequest::VT_SEND_FD, static_cast<uint8_t>(send_fd), 0);
+  }
   FileOpenRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   FileOpenRequestBuilder &operator=(const FileOpenRequestBuilder &);
   flatbuffers::Offset<FileOpenRequest> Finish() {
-    const auto end = fbb_.EndTable(start_, 3);
+    const auto end = fbb_.EndTable(start_, 4);
     auto o = flatbuffers::Offset<FileOpenRequest>(end);
     return o;
   }
@@ -162,11 +170,13 @@ inline flatbuffers::Offset<FileOpenRequest> CreateFileOpenRequest(
     flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> path = 0,
     flatbuffers::Offset<flatbuffers::Vector<int16_t>> flags = 0,
-    uint32_t perms = 0) {
+    uint32_t perms = 0,
+    bool send_fd = false) {
   FileOpenRequestBuilder builder_(_fbb);
   builder_.add_perms(perms);
   builder_.add_flags(flags);
   builder_.add_path(path);
+  builder_.add_send_fd(send_fd);
   return builder_.Finish();
 }
 
@@ -174,12 +184,14 @@ inline flatbuffers::Offset<FileOpenRequest> CreateFileOpenRequestDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
     const char *path = nullptr,
     const std::vector<int16_t> *flags = nullptr,
-    uint32_t perms = 0) {
+    uint32_t perms = 0,
+    bool send_fd = false) {
   return mbtool::daemon::v3::CreateFileOpenRequest(
       _fbb,
       path ? _fbb.CreateString(path) : 0,
       flags ? _fbb.CreateVector<int16_t>(*flags) : 0,
-      perms);
+      perms,
+      send_fd);
 }
 
 struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -187,7 +199,8 @@ struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_SUCCESS = 4,
     VT_ERROR_MSG = 6,
     VT_ID = 8,
-    VT_ERROR = 10
+    VT_ERROR = 10,
+    VT_FD_SENT = 12
   };
   bool success() const {
     return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
@@ -201,6 +214,9 @@ struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const FileOpenError *error() const {
     return GetPointer<const FileOpenError *>(VT_ERROR);
   }
+  bool fd_sent() const {
+    return GetField<uint8_t>(VT_FD_SENT, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
@@ -209,6 +225,7 @@ struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            VerifyField<int32_t>(verifier, VT_ID) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
            verifier.VerifyTable(error()) &&
+           VerifyField<uint8_t>(verifier, VT_FD_SENT) &&
            verifier.EndTable();
   }
 };
@@ -228,13 +245,16 @@ struct FileOpenResponseBuilder {
   void add_error(flatbuffers::Offset<FileOpenError> error) {
     fbb_.AddOffset(FileOpenResponse::VT_ERROR, error);
   }
+  void add_fd_sent(bool fd_sent) {
+    fbb_.AddElement<uint8_t>(FileOpenResponse::VT_FD_SENT, static_cast<uint8_t>(fd_sent), 0);
+  }
   FileOpenResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   FileOpenResponseBuilder &operator=(const FileOpenResponseBuilder &);
   flatbuffers::Offset<FileOpenResponse> Finish() {
-    const auto end = fbb_.EndTable(start_, 4);
+    const auto end = fbb_.EndTable(start_, 5);
     auto o = flatbuffers::Offset<FileOpenResponse>(end);
     return o;
   }
@@ -245,11 +265,13 @@ inline flatbuffers::Offset<FileOpenResponse> CreateFileOpenResponse(
     bool success = false,
     flatbuffers::Offset<flatbuffers::String> error_msg = 0,
     int32_t id = 0,
-    flatbuffers::Offset<FileOpenError> error = 0) {
+    flatbuffers::Offset<FileOpenError> error = 0,
+    bool fd_sent = false) {
   FileOpenResponseBuilder builder_(_fbb);
   builder_.add_error(error);
   builder_.add_id(id);
   builder_.add_error_msg(error_msg);
+  builder_.add_fd_sent(fd_sent);
   builder_.add_success(success);
   return builder_.Finish();
 }
@@ -259,13 +281,15 @@ inline flatbuffers::Offset<FileOpenResponse> CreateFileOpenResponseDirect(
     bool success = false,
     const char *error_msg = nullptr,
     int32_t id = 0,
-    flatbuffers::Offset<FileOpenError> error = 0) {
+    flatbuffers::Offset<FileOpenError> error = 0,
+    bool fd_sent = false) {
   return mbtool::daemon::v3::CreateFileOpenResponse(
       _fbb,
       success,
       error_msg ? _fbb.CreateString(error_msg) : 0,
       id,
-      error);
+      error,
+      fd_sent);
 }
 
 }  // namespace v3
@@ -0,0 +1,169 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_MBCLONEROM_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_MBCLONEROM_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct MbCloneRomRequest;
+
+struct MbCloneRomResponse;
+
+struct MbCloneRomRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SOURCE_ROM_ID = 4,
+    VT_TARGET_ROM_ID = 6,
+    VT_NAME = 8,
+    VT_LINK_SYSTEM = 10
+  };
+  const flatbuffers::String *source_rom_id() const {
+    return GetPointer<const flatbuffers::String *>(VT_SOURCE_ROM_ID);
+  }
+  const flatbuffers::String *target_rom_id() const {
+    return GetPointer<const flatbuffers::String *>(VT_TARGET_ROM_ID);
+  }
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  bool link_system() const {
+    return GetField<uint8_t>(VT_LINK_SYSTEM, 0) != 0;
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_SOURCE_ROM_ID) &&
+           verifier.Verify(source_rom_id()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_TARGET_ROM_ID) &&
+           verifier.Verify(target_rom_id()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint8_t>(verifier, VT_LINK_SYSTEM) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbCloneRomRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_source_rom_id(flatbuffers::Offset<flatbuffers::String> source_rom_id) {
+    fbb_.AddOffset(MbCloneRomRequest::VT_SOURCE_ROM_ID, source_rom_id);
+  }
+  void add_target_rom_id(flatbuffers::Offset<flatbuffers::String> target_rom_id) {
+    fbb_.AddOffset(MbCloneRomRequest::VT_TARGET_ROM_ID, target_rom_id);
+  }
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(MbCloneRomRequest::VT_NAME, name);
+  }
+  void add_link_system(bool link_system) {
+    fbb_.AddElement<uint8_t>(MbCloneRomRequest::VT_LINK_SYSTEM, static_cast<uint8_t>(link_system), 0);
+  }
+  MbCloneRomRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbCloneRomRequestBuilder &operator=(const MbCloneRomRequestBuilder &);
+  flatbuffers::Offset<MbCloneRomRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<MbCloneRomRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbCloneRomRequest> CreateMbCloneRomRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> source_rom_id = 0,
+    flatbuffers::Offset<flatbuffers::String> target_rom_id = 0,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    bool link_system = false) {
+  MbCloneRomRequestBuilder builder_(_fbb);
+  builder_.add_name(name);
+  builder_.add_target_rom_id(target_rom_id);
+  builder_.add_source_rom_id(source_rom_id);
+  builder_.add_link_system(link_system);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbCloneRomRequest> CreateMbCloneRomRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *source_rom_id = nullptr,
+    const char *target_rom_id = nullptr,
+    const char *name = nullptr,
+    bool link_system = false) {
+  return mbtool::daemon::v3::CreateMbCloneRomRequest(
+      _fbb,
+      source_rom_id ? _fbb.CreateString(source_rom_id) : 0,
+      target_rom_id ? _fbb.CreateString(target_rom_id) : 0,
+      name ? _fbb.CreateString(name) : 0,
+      link_system);
+}
+
+struct MbCloneRomResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_ROM_ID = 6
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  const flatbuffers::String *rom_id() const {
+    return GetPointer<const flatbuffers::String *>(VT_ROM_ID);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ROM_ID) &&
+           verifier.Verify(rom_id()) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbCloneRomResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(MbCloneRomResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_rom_id(flatbuffers::Offset<flatbuffers::String> rom_id) {
+    fbb_.AddOffset(MbCloneRomResponse::VT_ROM_ID, rom_id);
+  }
+  MbCloneRomResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbCloneRomResponseBuilder &operator=(const MbCloneRomResponseBuilder &);
+  flatbuffers::Offset<MbCloneRomResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<MbCloneRomResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbCloneRomResponse> CreateMbCloneRomResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<flatbuffers::String> rom_id = 0) {
+  MbCloneRomResponseBuilder builder_(_fbb);
+  builder_.add_rom_id(rom_id);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbCloneRomResponse> CreateMbCloneRomResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    const char *rom_id = nullptr) {
+  return mbtool::daemon::v3::CreateMbCloneRomResponse(
+      _fbb,
+      success,
+      rom_id ? _fbb.CreateString(rom_id) : 0);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_MBCLONEROM_MBTOOL_DAEMON_V3_H_
@@ -0,0 +1,344 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct MbRequestStats;
+
+struct MbMetric;
+
+struct MbGetStatsRequest;
+
+struct MbGetStatsResponse;
+
+struct MbRequestStats FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUEST_TYPE = 4,
+    VT_COUNT = 6,
+    VT_TOTAL_TIME_NS = 8,
+    VT_MAX_TIME_NS = 10
+  };
+  uint8_t request_type() const {
+    return GetField<uint8_t>(VT_REQUEST_TYPE, 0);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  uint64_t total_time_ns() const {
+    return GetField<uint64_t>(VT_TOTAL_TIME_NS, 0);
+  }
+  uint64_t max_time_ns() const {
+    return GetField<uint64_t>(VT_MAX_TIME_NS, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_REQUEST_TYPE) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           VerifyField<uint64_t>(verifier, VT_TOTAL_TIME_NS) &&
+           VerifyField<uint64_t>(verifier, VT_MAX_TIME_NS) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbRequestStatsBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_request_type(uint8_t request_type) {
+    fbb_.AddElement<uint8_t>(MbRequestStats::VT_REQUEST_TYPE, request_type, 0);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_COUNT, count, 0);
+  }
+  void add_total_time_ns(uint64_t total_time_ns) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_TOTAL_TIME_NS, total_time_ns, 0);
+  }
+  void add_max_time_ns(uint64_t max_time_ns) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_MAX_TIME_NS, max_time_ns, 0);
+  }
+  MbRequestStatsBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbRequestStatsBuilder &operator=(const MbRequestStatsBuilder &);
+  flatbuffers::Offset<MbRequestStats> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<MbRequestStats>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbRequestStats> CreateMbRequestStats(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint8_t request_type = 0,
+    uint64_t count = 0,
+    uint64_t total_time_ns = 0,
+    uint64_t max_time_ns = 0) {
+  MbRequestStatsBuilder builder_(_fbb);
+  builder_.add_max_time_ns(max_time_ns);
+  builder_.add_total_time_ns(total_time_ns);
+  builder_.add_count(count);
+  builder_.add_request_type(request_type);
+  return builder_.Finish();
+}
+
+struct MbMetric FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_NAME = 4,
+    VT_TYPE = 6,
+    VT_VALUE = 8,
+    VT_COUNT = 10,
+    VT_SUM = 12,
+    VT_MIN = 14,
+    VT_MAX = 16,
+    VT_P50 = 18,
+    VT_P90 = 20,
+    VT_P99 = 22
+  };
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  uint8_t type() const {
+    return GetField<uint8_t>(VT_TYPE, 0);
+  }
+  int64_t value() const {
+    return GetField<int64_t>(VT_VALUE, 0);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  uint64_t sum() const {
+    return GetField<uint64_t>(VT_SUM, 0);
+  }
+  uint64_t min() const {
+    return GetField<uint64_t>(VT_MIN, 0);
+  }
+  uint64_t max() const {
+    return GetField<uint64_t>(VT_MAX, 0);
+  }
+  uint64_t p50() const {
+    return GetField<uint64_t>(VT_P50, 0);
+  }
+  uint64_t p90() const {
+    return GetField<uint64_t>(VT_P90, 0);
+  }
+  uint64_t p99() const {
+    return GetField<uint64_t>(VT_P99, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint8_t>(verifier, VT_TYPE) &&
+           VerifyField<int64_t>(verifier, VT_VALUE) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           VerifyField<uint64_t>(verifier, VT_SUM) &&
+           VerifyField<uint64_t>(verifier, VT_MIN) &&
+           VerifyField<uint64_t>(verifier, VT_MAX) &&
+           VerifyField<uint64_t>(verifier, VT_P50) &&
+           VerifyField<uint64_t>(verifier, VT_P90) &&
+           VerifyField<uint64_t>(verifier, VT_P99) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbMetricBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(MbMetric::VT_NAME, name);
+  }
+  void add_type(uint8_t type) {
+    fbb_.AddElement<uint8_t>(MbMetric::VT_TYPE, type, 0);
+  }
+  void add_value(int64_t value) {
+    fbb_.AddElement<int64_t>(MbMetric::VT_VALUE, value, 0);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_COUNT, count, 0);
+  }
+  void add_sum(uint64_t sum) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_SUM, sum, 0);
+  }
+  void add_min(uint64_t min) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_MIN, min, 0);
+  }
+  void add_max(uint64_t max) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_MAX, max, 0);
+  }
+  void add_p50(uint64_t p50) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_P50, p50, 0);
+  }
+  void add_p90(uint64_t p90) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_P90, p90, 0);
+  }
+  void add_p99(uint64_t p99) {
+    fbb_.AddElement<uint64_t>(MbMetric::VT_P99, p99, 0);
+  }
+  MbMetricBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbMetricBuilder &operator=(const MbMetricBuilder &);
+  flatbuffers::Offset<MbMetric> Finish() {
+    const auto end = fbb_.EndTable(start_, 10);
+    auto o = flatbuffers::Offset<MbMetric>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbMetric> CreateMbMetric(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    uint8_t type = 0,
+    int64_t value = 0,
+    uint64_t count = 0,
+    uint64_t sum = 0,
+    uint64_t min = 0,
+    uint64_t max = 0,
+    uint64_t p50 = 0,
+    uint64_t p90 = 0,
+    uint64_t p99 = 0) {
+  MbMetricBuilder builder_(_fbb);
+  builder_.add_p99(p99);
+  builder_.add_p90(p90);
+  builder_.add_p50(p50);
+  builder_.add_max(max);
+  builder_.add_min(min);
+  builder_.add_sum(sum);
+  builder_.add_count(count);
+  builder_.add_value(value);
+  builder_.add_name(name);
+  builder_.add_type(type);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbMetric> CreateMbMetricDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *name = nullptr,
+    uint8_t type = 0,
+    int64_t value = 0,
+    uint64_t count = 0,
+    uint64_t sum = 0,
+    uint64_t min = 0,
+    uint64_t max = 0,
+    uint64_t p50 = 0,
+    uint64_t p90 = 0,
+    uint64_t p99 = 0) {
+  return mbtool::daemon::v3::CreateMbMetric(
+      _fbb,
+      name ? _fbb.CreateString(name) : 0,
+      type,
+      value,
+      count,
+      sum,
+      min,
+      max,
+      p50,
+      p90,
+      p99);
+}
+
+struct MbGetStatsRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetStatsRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  MbGetStatsRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetStatsRequestBuilder &operator=(const MbGetStatsRequestBuilder &);
+  flatbuffers::Offset<MbGetStatsRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 0);
+    auto o = flatbuffers::Offset<MbGetStatsRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetStatsRequest> CreateMbGetStatsRequest(
+    flatbuffers::FlatBufferBuilder &_fbb) {
+  MbGetStatsRequestBuilder builder_(_fbb);
+  return builder_.Finish();
+}
+
+struct MbGetStatsResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUESTS = 4,
+    VT_METRICS = 6
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *requests() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *>(VT_REQUESTS);
+  }
+  const flatbuffers::Vector<flatbuffers::Offset<MbMetric>> *metrics() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<MbMetric>> *>(VT_METRICS);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUESTS) &&
+           verifier.Verify(requests()) &&
+           verifier.VerifyVectorOfTables(requests()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_METRICS) &&
+           verifier.Verify(metrics()) &&
+           verifier.VerifyVectorOfTables(metrics()) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetStatsResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_requests(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> requests) {
+    fbb_.AddOffset(MbGetStatsResponse::VT_REQUESTS, requests);
+  }
+  void add_metrics(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbMetric>>> metrics) {
+    fbb_.AddOffset(MbGetStatsResponse::VT_METRICS, metrics);
+  }
+  MbGetStatsResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetStatsResponseBuilder &operator=(const MbGetStatsResponseBuilder &);
+  flatbuffers::Offset<MbGetStatsResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<MbGetStatsResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetStatsResponse> CreateMbGetStatsResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> requests = 0,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbMetric>>> metrics = 0) {
+  MbGetStatsResponseBuilder builder_(_fbb);
+  builder_.add_metrics(metrics);
+  builder_.add_requests(requests);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbGetStatsResponse> CreateMbGetStatsResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<MbRequestStats>> *requests = nullptr,
+    const std::vector<flatbuffers::Offset<MbMetric>> *metrics = nullptr) {
+  return mbtool::daemon::v3::CreateMbGetStatsResponse(
+      _fbb,
+      requests ? _fbb.CreateVector<flatbuffers::Offset<MbRequestStats>>(*requests) : 0,
+      metrics ? _fbb.CreateVector<flatbuffers::Offset<MbMetric>>(*metrics) : 0);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_MBGETSTATS_MBTOOL_DAEMON_V3_H_
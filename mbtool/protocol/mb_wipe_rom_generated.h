@@ -44,7 +44,8 @@ inline const char *EnumNameMbWipeTarget(MbWipeTarget e) {
 struct MbWipeRomRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_ROM_ID = 4,
-    VT_TARGETS = 6
+    VT_TARGETS = 6,
+    VT_BACKGROUND = 8
   };
   const flatbuffers::String *rom_id() const {
     return GetPointer<const flatbuffers::String *>(VT_ROM_ID);
@@ -52,12 +53,16 @@ struct MbWipeRomRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const flatbuffers::Vector<int16_t> *targets() const {
     return GetPointer<const flatbuffers::Vector<int16_t> *>(VT_TARGETS);
   }
+  bool background() const {
+    return GetField<uint8_t>(VT_BACKGROUND, 0) != 0;
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_ROM_ID) &&
            verifier.Verify(rom_id()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_TARGETS) &&
            verifier.Verify(targets()) &&
+           VerifyField<uint8_t>(verifier, VT_BACKGROUND) &&
            verifier.EndTable();
   }
 };
@@ -71,13 +76,16 @@ struct MbWipeRomRequestBuilder {
   void add_targets(flatbuffers::Offset<flatbuffers::Vector<int16_t>> targets) {
     fbb_.AddOffset(MbWipeRomRequest::VT_TARGETS, targets);
   }
+  void add_background(bool background) {
+    fbb_.AddElement<uint8_t>(MbWipeRomRequest::VT_BACKGROUND, static_cast<uint8_t>(background), 0);
+  }
   MbWipeRomRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   MbWipeRomRequestBuilder &operator=(const MbWipeRomRequestBuilder &);
   flatbuffers::Offset<MbWipeRomRequest> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<MbWipeRomRequest>(end);
     return o;
   }
@@ -86,21 +94,25 @@ struct MbWipeRomRequestBuilder {
 inline flatbuffers::Offset<MbWipeRomRequest> CreateMbWipeRomRequest(
     flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> rom_id = 0,
-    flatbuffers::Offset<flatbuffers::Vector<int16_t>> targets = 0) {
+    flatbuffers::Offset<flatbuffers::Vector<int16_t>> targets = 0,
+    bool background = false) {
   MbWipeRomRequestBuilder builder_(_fbb);
   builder_.add_targets(targets);
   builder_.add_rom_id(rom_id);
+  builder_.add_background(background);
   return builder_.Finish();
 }
 
 inline flatbuffers::Offset<MbWipeRomRequest> CreateMbWipeRomRequestDirect(
     flatbuffers::FlatBufferBuilder &_fbb,
     const char *rom_id = nullptr,
-    const std::vector<int16_t> *targets = nullptr) {
+    const std::vector<int16_t> *targets = nullptr,
+    bool background = false) {
   return mbtool::daemon::v3::CreateMbWipeRomRequest(
       _fbb,
       rom_id ? _fbb.CreateString(rom_id) : 0,
-      targets ? _fbb.CreateVector<int16_t>(*targets) : 0);
+      targets ? _fbb.CreateVector<int16_t>(*targets) : 0,
+      background);
 }
 
 struct MbWipeRomResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -17,9 +17,11 @@
 #include "file_selinux_set_label_generated.h"
 #include "file_stat_generated.h"
 #include "file_write_generated.h"
+#include "mb_clone_rom_generated.h"
 #include "mb_get_booted_rom_id_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
+#include "mb_get_stats_generated.h"
 #include "mb_get_version_generated.h"
 #include "mb_set_kernel_generated.h"
 #include "mb_switch_rom_generated.h"
@@ -42,6 +44,8 @@ namespace v3 {
 
 struct Request;
 
+struct BatchRequest;
+
 enum RequestType {
   RequestType_NONE = 0,
   RequestType_FileChmodRequest = 1,
@@ -73,8 +77,11 @@ enum RequestType {
   RequestType_CryptoDecryptRequest = 27,
   RequestType_CryptoGetPwTypeRequest = 28,
   RequestType_PathReadlinkRequest = 29,
+  RequestType_BatchRequest = 30,
+  RequestType_MbGetStatsRequest = 31,
+  RequestType_MbCloneRomRequest = 32,
   RequestType_MIN = RequestType_NONE,
-  RequestType_MAX = RequestType_PathReadlinkRequest
+  RequestType_MAX = RequestType_MbCloneRomRequest
 };
 
 inline const char **EnumNamesRequestType() {
@@ -109,6 +116,9 @@ inline const char **EnumNamesRequestType() {
     "CryptoDecryptRequest",
     "CryptoGetPwTypeRequest",
     "PathReadlinkRequest",
+    "BatchRequest",
+    "MbGetStatsRequest",
+    "MbCloneRomRequest",
     nullptr
   };
   return names;
@@ -239,13 +249,26 @@ template<> struct RequestTypeTraits<mbtool::daemon::v3::PathReadlinkRequest> {
   static const RequestType enum_value = RequestType_PathReadlinkRequest;
 };
 
+template<> struct RequestTypeTraits<BatchRequest> {
+  static const RequestType enum_value = RequestType_BatchRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::MbGetStatsRequest> {
+  static const RequestType enum_value = RequestType_MbGetStatsRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::MbCloneRomRequest> {
+  static const RequestType enum_value = RequestType_MbCloneRomRequest;
+};
+
 bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj, RequestType type);
 bool VerifyRequestTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
 struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_REQUEST_TYPE = 4,
-    VT_REQUEST = 6
+    VT_REQUEST = 6,
+    VT_ID = 8
   };
   RequestType request_type() const {
     return static_cast<RequestType>(GetField<uint8_t>(VT_REQUEST_TYPE, 0));
@@ -253,11 +276,15 @@ struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const void *request() const {
     return GetPointer<const void *>(VT_REQUEST);
   }
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_REQUEST_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUEST) &&
            VerifyRequestType(verifier, request(), request_type()) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
            verifier.EndTable();
   }
 };
@@ -271,13 +298,16 @@ struct RequestBuilder {
   void add_request(flatbuffers::Offset<void> request) {
     fbb_.AddOffset(Request::VT_REQUEST, request);
   }
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(Request::VT_ID, id, 0);
+  }
   RequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
         : fbb_(_fbb) {
     start_ = fbb_.StartTable();
   }
   RequestBuilder &operator=(const RequestBuilder &);
   flatbuffers::Offset<Request> Finish() {
-    const auto end = fbb_.EndTable(start_, 2);
+    const auto end = fbb_.EndTable(start_, 3);
     auto o = flatbuffers::Offset<Request>(end);
     return o;
   }
@@ -286,13 +316,65 @@ struct RequestBuilder {
 inline flatbuffers::Offset<Request> CreateRequest(
     flatbuffers::FlatBufferBuilder &_fbb,
     RequestType request_type = RequestType_NONE,
-    flatbuffers::Offset<void> request = 0) {
+    flatbuffers::Offset<void> request = 0,
+    uint64_t id = 0) {
   RequestBuilder builder_(_fbb);
+  builder_.add_id(id);
   builder_.add_request(request);
   builder_.add_request_type(request_type);
   return builder_.Finish();
 }
 
+struct BatchRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUESTS = 4
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<Request>> *requests() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<Request>> *>(VT_REQUESTS);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUESTS) &&
+           verifier.Verify(requests()) &&
+           verifier.VerifyVectorOfTables(requests()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_requests(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<Request>>> requests) {
+    fbb_.AddOffset(BatchRequest::VT_REQUESTS, requests);
+  }
+  BatchRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchRequestBuilder &operator=(const BatchRequestBuilder &);
+  flatbuffers::Offset<BatchRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchRequest> CreateBatchRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<Request>>> requests = 0) {
+  BatchRequestBuilder builder_(_fbb);
+  builder_.add_requests(requests);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchRequest> CreateBatchRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<Request>> *requests = nullptr) {
+  return mbtool::daemon::v3::CreateBatchRequest(
+      _fbb,
+      requests ? _fbb.CreateVector<flatbuffers::Offset<Request>>(*requests) : 0);
+}
+
 inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj, RequestType type) {
   switch (type) {
     case RequestType_NONE: {
@@ -414,6 +496,18 @@ inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkRequest *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case RequestType_BatchRequest: {
+      auto ptr = reinterpret_cast<const BatchRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_MbGetStatsRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetStatsRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_MbCloneRomRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbCloneRomRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
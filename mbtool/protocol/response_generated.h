@@ -17,9 +17,11 @@
 #include "file_selinux_set_label_generated.h"
 #include "file_stat_generated.h"
 #include "file_write_generated.h"
+#include "mb_clone_rom_generated.h"
 #include "mb_get_booted_rom_id_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
+#include "mb_get_stats_generated.h"
 #include "mb_get_version_generated.h"
 #include "mb_set_kernel_generated.h"
 #include "mb_switch_rom_generated.h"
@@ -46,6 +48,12 @@ struct Unsupported;
 
 struct Response;
 
+struct ResponseBuffer;
+
+struct BatchResponse;
+
+struct TaggedResponse;
+
 enum ResponseType {
   ResponseType_NONE = 0,
   ResponseType_Invalid = 1,
@@ -80,8 +88,12 @@ enum ResponseType {
   ResponseType_CryptoDecryptResponse = 30,
   ResponseType_CryptoGetPwTypeResponse = 31,
   ResponseType_PathReadlinkResponse = 32,
+  ResponseType_BatchResponse = 33,
+  ResponseType_TaggedResponse = 34,
+  ResponseType_MbGetStatsResponse = 35,
+  ResponseType_MbCloneRomResponse = 36,
   ResponseType_MIN = ResponseType_NONE,
-  ResponseType_MAX = ResponseType_PathReadlinkResponse
+  ResponseType_MAX = ResponseType_MbCloneRomResponse
 };
 
 inline const char **EnumNamesResponseType() {
@@ -119,6 +131,10 @@ inline const char **EnumNamesResponseType() {
     "CryptoDecryptResponse",
     "CryptoGetPwTypeResponse",
     "PathReadlinkResponse",
+    "BatchResponse",
+    "TaggedResponse",
+    "MbGetStatsResponse",
+    "MbCloneRomResponse",
     nullptr
   };
   return names;
@@ -261,6 +277,22 @@ template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathReadlinkResponse> {
   static const ResponseType enum_value = ResponseType_PathReadlinkResponse;
 };
 
+template<> struct ResponseTypeTraits<BatchResponse> {
+  static const ResponseType enum_value = ResponseType_BatchResponse;
+};
+
+template<> struct ResponseTypeTraits<TaggedResponse> {
+  static const ResponseType enum_value = ResponseType_TaggedResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::MbGetStatsResponse> {
+  static const ResponseType enum_value = ResponseType_MbGetStatsResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::MbCloneRomResponse> {
+  static const ResponseType enum_value = ResponseType_MbCloneRomResponse;
+};
+
 bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type);
 bool VerifyResponseTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -371,6 +403,166 @@ inline flatbuffers::Offset<Response> CreateResponse(
   return builder_.Finish();
 }
 
+struct ResponseBuffer FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_DATA = 4
+  };
+  const flatbuffers::Vector<uint8_t> *data() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_DATA);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_DATA) &&
+           verifier.Verify(data()) &&
+           verifier.EndTable();
+  }
+};
+
+struct ResponseBufferBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_data(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> data) {
+    fbb_.AddOffset(ResponseBuffer::VT_DATA, data);
+  }
+  ResponseBufferBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  ResponseBufferBuilder &operator=(const ResponseBufferBuilder &);
+  flatbuffers::Offset<ResponseBuffer> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<ResponseBuffer>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<ResponseBuffer> CreateResponseBuffer(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> data = 0) {
+  ResponseBufferBuilder builder_(_fbb);
+  builder_.add_data(data);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<ResponseBuffer> CreateResponseBufferDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<uint8_t> *data = nullptr) {
+  return mbtool::daemon::v3::CreateResponseBuffer(
+      _fbb,
+      data ? _fbb.CreateVector<uint8_t>(*data) : 0);
+}
+
+struct BatchResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_RESPONSES = 4
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<ResponseBuffer>> *responses() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<ResponseBuffer>> *>(VT_RESPONSES);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSES) &&
+           verifier.Verify(responses()) &&
+           verifier.VerifyVectorOfTables(responses()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_responses(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<ResponseBuffer>>> responses) {
+    fbb_.AddOffset(BatchResponse::VT_RESPONSES, responses);
+  }
+  BatchResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchResponseBuilder &operator=(const BatchResponseBuilder &);
+  flatbuffers::Offset<BatchResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<ResponseBuffer>>> responses = 0) {
+  BatchResponseBuilder builder_(_fbb);
+  builder_.add_responses(responses);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<ResponseBuffer>> *responses = nullptr) {
+  return mbtool::daemon::v3::CreateBatchResponse(
+      _fbb,
+      responses ? _fbb.CreateVector<flatbuffers::Offset<ResponseBuffer>>(*responses) : 0);
+}
+
+struct TaggedResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4,
+    VT_DATA = 6
+  };
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
+  const flatbuffers::Vector<uint8_t> *data() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_DATA);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_DATA) &&
+           verifier.Verify(data()) &&
+           verifier.EndTable();
+  }
+};
+
+struct TaggedResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(TaggedResponse::VT_ID, id, 0);
+  }
+  void add_data(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> data) {
+    fbb_.AddOffset(TaggedResponse::VT_DATA, data);
+  }
+  TaggedResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  TaggedResponseBuilder &operator=(const TaggedResponseBuilder &);
+  flatbuffers::Offset<TaggedResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<TaggedResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<TaggedResponse> CreateTaggedResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t id = 0,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> data = 0) {
+  TaggedResponseBuilder builder_(_fbb);
+  builder_.add_id(id);
+  builder_.add_data(data);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<TaggedResponse> CreateTaggedResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t id = 0,
+    const std::vector<uint8_t> *data = nullptr) {
+  return mbtool::daemon::v3::CreateTaggedResponse(
+      _fbb,
+      id,
+      data ? _fbb.CreateVector<uint8_t>(*data) : 0);
+}
+
 inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type) {
   switch (type) {
     case ResponseType_NONE: {
@@ -504,6 +696,22 @@ inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkResponse *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case ResponseType_BatchResponse: {
+      auto ptr = reinterpret_cast<const BatchResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_TaggedResponse: {
+      auto ptr = reinterpret_cast<const TaggedResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_MbGetStatsResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetStatsResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_MbCloneRomResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbCloneRomResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
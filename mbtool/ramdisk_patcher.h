@@ -26,7 +26,12 @@
 namespace mb
 {
 
-typedef bool (RamdiskPatcherFn)(const std::string &dir);
+namespace util
+{
+class CpioArchive;
+}
+
+typedef bool (RamdiskPatcherFn)(util::CpioArchive &cpio);
 
 std::function<RamdiskPatcherFn>
 rp_write_rom_id(const std::string &rom_id);
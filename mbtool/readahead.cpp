@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "readahead.h"
+
+#include <memory>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/kmsg_logger.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/fts.h"
+#include "mbutil/integer.h"
+#include "mbutil/time.h"
+
+// First line of the list file. Bump the version if the format changes.
+#define READAHEAD_LIST_HEADER       "# mbtool readahead v1"
+
+// Default number of seconds to wait before recording
+#define READAHEAD_DEFAULT_DELAY     60
+
+namespace mb
+{
+
+/*!
+ * Write the page cache resident ranges of every regular file under a directory
+ * to a list file. Each line is `<offset> <length> <path>`. Ranges are in bytes,
+ * but always cover whole pages.
+ */
+class ResidentRangeRecorder : public util::FTSWrapper {
+public:
+    ResidentRangeRecorder(std::string path, FILE *fp)
+        : FTSWrapper(path, FTS_GroupSpecialFiles)
+        , files(0)
+        , ranges(0)
+        , bytes(0)
+        , _fp(fp)
+        , _page_size(static_cast<size_t>(sysconf(_SC_PAGESIZE)))
+    {
+    }
+
+    virtual int on_reached_file() override
+    {
+        if (_curr->fts_statp->st_size > 0) {
+            record_file(_curr->fts_accpath, _curr->fts_path,
+                        static_cast<size_t>(_curr->fts_statp->st_size));
+        }
+        return Action::FTS_OK;
+    }
+
+    uint64_t files;
+    uint64_t ranges;
+    uint64_t bytes;
+
+private:
+    FILE *_fp;
+    size_t _page_size;
+    std::vector<unsigned char> _vec;
+
+    void record_file(const char *accpath, const char *path, size_t size)
+    {
+        int fd = open(accpath, O_RDONLY | O_CLOEXEC | O_NOATIME);
+        if (fd < 0 && errno == EPERM) {
+            // O_NOATIME is only allowed for the file's owner or with
+            // CAP_FOWNER
+            fd = open(accpath, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0) {
+            return;
+        }
+
+        void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) {
+            return;
+        }
+
+        auto unmap = util::finally([&]{
+            munmap(map, size);
+        });
+
+        size_t pages = (size + _page_size - 1) / _page_size;
+        _vec.resize(pages);
+
+        if (mincore(map, size, _vec.data()) < 0) {
+            return;
+        }
+
+        bool found = false;
+        size_t start = 0;
+
+        for (size_t i = 0; i <= pages; ++i) {
+            bool resident = i < pages && (_vec[i] & 1);
+
+            if (resident && !found) {
+                start = i;
+                found = true;
+            } else if (!resident && found) {
+                uint64_t offset = static_cast<uint64_t>(start) * _page_size;
+                uint64_t length = static_cast<uint64_t>(i - start) * _page_size;
+
+                fprintf(_fp, "%" PRIu64 " %" PRIu64 " %s\n",
+                        offset, length, path);
+
+                ++ranges;
+                bytes += length;
+                found = false;
+            }
+        }
+
+        ++files;
+    }
+};
+
+/*!
+ * \brief Record which parts of the files under \p roots are in the page cache
+ *
+ * The list is written to a temporary file and renamed into place, so an
+ * interrupted recording never leaves a partial list behind.
+ *
+ * \param list_path Path to write list to
+ * \param roots Directories to scan. Mount points below each directory are not
+ *              crossed.
+ *
+ * \return Whether the list was written
+ */
+bool readahead_record(const std::string &list_path,
+                      const std::vector<std::string> &roots)
+{
+    uint64_t start = util::current_time_ms();
+
+    std::string temp_path(list_path);
+    temp_path += ".tmp";
+
+    autoclose::file fp(autoclose::fopen(temp_path.c_str(), "we"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    fprintf(fp.get(), READAHEAD_LIST_HEADER "\n");
+
+    uint64_t files = 0;
+    uint64_t ranges = 0;
+    uint64_t bytes = 0;
+
+    for (const std::string &root : roots) {
+        ResidentRangeRecorder recorder(root, fp.get());
+        if (!recorder.run()) {
+            LOGW("%s: Failed to scan directory", root.c_str());
+        }
+
+        files += recorder.files;
+        ranges += recorder.ranges;
+        bytes += recorder.bytes;
+    }
+
+    if (fclose(fp.release()) != 0) {
+        LOGE("%s: Failed to close file: %s",
+             temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), list_path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s", temp_path.c_str(),
+             list_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    LOGI("Recorded %" PRIu64 " ranges (%" PRIu64 " bytes) from %" PRIu64
+         " files in %" PRIu64 "ms", ranges, bytes, files,
+         util::current_time_ms() - start);
+
+    return true;
+}
+
+/*!
+ * \brief Ask the kernel to read every range in a list into the page cache
+ *
+ * Files that no longer exist are skipped.
+ *
+ * \param list_path Path to list created by readahead_record()
+ *
+ * \return Whether the list could be read
+ */
+bool readahead_replay(const std::string &list_path)
+{
+    uint64_t start = util::current_time_ms();
+
+    autoclose::file fp(autoclose::fopen(list_path.c_str(), "re"));
+    if (!fp) {
+        LOGE("%s: Failed to open for reading: %s",
+             list_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    read = getline(&line, &len, fp.get());
+    if (read < 0 || strncmp(line, READAHEAD_LIST_HEADER "\n",
+                            sizeof(READAHEAD_LIST_HEADER)) != 0) {
+        LOGE("%s: Not a readahead list", list_path.c_str());
+        return false;
+    }
+
+    std::string cur_path;
+    int fd = -1;
+
+    auto close_fd = util::finally([&]{
+        if (fd >= 0) {
+            close(fd);
+        }
+    });
+
+    uint64_t ranges = 0;
+    uint64_t bytes = 0;
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        uint64_t offset;
+        uint64_t length;
+        int path_pos;
+
+        if (sscanf(line, "%" SCNu64 " %" SCNu64 " %n",
+                   &offset, &length, &path_pos) != 2) {
+            LOGW("%s: Skipping malformed line: %s", list_path.c_str(), line);
+            continue;
+        }
+
+        const char *path = line + path_pos;
+
+        // Ranges of the same file are next to each other
+        if (cur_path != path) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            cur_path = path;
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+        }
+
+        if (fd < 0) {
+            continue;
+        }
+
+        if (posix_fadvise(fd, static_cast<off_t>(offset),
+                          static_cast<off_t>(length),
+                          POSIX_FADV_WILLNEED) == 0) {
+            ++ranges;
+            bytes += length;
+        }
+    }
+
+    LOGI("Replayed %" PRIu64 " ranges (%" PRIu64 " bytes) in %" PRIu64 "ms",
+         ranges, bytes, util::current_time_ms() - start);
+
+    return true;
+}
+
+static void readahead_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: readahead [OPTION]... record <list file> <directory>...\n"
+            "   or: readahead [OPTION]... replay <list file>\n\n"
+            "Options:\n"
+            "  -d, --delay <seconds>\n"
+            "                   Seconds to wait before recording (default: %d)\n"
+            "  --log-to-kmsg    Send log output to kernel log\n"
+            "  -h, --help       Display this help message\n",
+            READAHEAD_DEFAULT_DELAY);
+}
+
+int readahead_main(int argc, char *argv[])
+{
+    enum Options {
+        OPT_LOG_TO_KMSG = 1000,
+    };
+
+    int opt;
+    unsigned int delay = READAHEAD_DEFAULT_DELAY;
+    bool log_to_kmsg = false;
+
+    static const char short_options[] = "d:h";
+
+    static struct option long_options[] = {
+        {"delay",       required_argument, 0, 'd'},
+        {"log-to-kmsg", no_argument,       0, OPT_LOG_TO_KMSG},
+        {"help",        no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'd':
+            if (!util::str_to_unum(optarg, 10, &delay)) {
+                fprintf(stderr, "Invalid delay: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_LOG_TO_KMSG:
+            log_to_kmsg = true;
+            break;
+
+        case 'h':
+            readahead_usage(stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            readahead_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind < 2) {
+        readahead_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (log_to_kmsg) {
+        log::log_set_logger(std::make_shared<log::KmsgLogger>(false));
+    }
+
+    const char *action = argv[optind];
+    std::string list_path(argv[optind + 1]);
+
+    if (strcmp(action, "record") == 0) {
+        if (argc - optind < 3) {
+            readahead_usage(stderr);
+            return EXIT_FAILURE;
+        }
+
+        std::vector<std::string> roots(argv + optind + 2, argv + argc);
+
+        sleep(delay);
+
+        return readahead_record(list_path, roots)
+                ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else if (strcmp(action, "replay") == 0) {
+        if (argc - optind != 2) {
+            readahead_usage(stderr);
+            return EXIT_FAILURE;
+        }
+
+        return readahead_replay(list_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else {
+        readahead_usage(stderr);
+        return EXIT_FAILURE;
+    }
+}
+
+}
@@ -35,6 +35,9 @@ bool reboot_via_framework(bool confirm)
 
 bool reboot_via_init(const std::string &reboot_arg)
 {
+    // Make sure buffered log messages hit the disk first
+    log::log_flush();
+
     if (!util::reboot_via_init(reboot_arg.c_str())) {
         return false;
     }
@@ -49,6 +52,9 @@ bool reboot_via_init(const std::string &reboot_arg)
 
 bool reboot_directly(const std::string &reboot_arg)
 {
+    // Make sure buffered log messages hit the disk first
+    log::log_flush();
+
     if (!util::reboot_via_syscall(reboot_arg.c_str())) {
         return false;
     }
@@ -63,6 +69,9 @@ bool reboot_directly(const std::string &reboot_arg)
 
 bool shutdown_via_init()
 {
+    // Make sure buffered log messages hit the disk first
+    log::log_flush();
+
     if (!util::shutdown_via_init()) {
         return false;
     }
@@ -77,6 +86,9 @@ bool shutdown_via_init()
 
 bool shutdown_directly()
 {
+    // Make sure buffered log messages hit the disk first
+    log::log_flush();
+
     if (!util::shutdown_via_syscall()) {
         return false;
     }
@@ -25,11 +25,13 @@
 #include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "mbbootimg/entry.h"
 #include "mbbootimg/reader.h"
 #include "mbcommon/string.h"
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
 #include "mblog/stdio_logger.h"
 #include "mbutil/autoclose/archive.h"
@@ -40,6 +42,7 @@
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/mount.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
@@ -53,6 +56,9 @@
 #define DEBUG_LEAVE_STDIN_OPEN 0
 #define DEBUG_ENABLE_PASSTHROUGH 0
 
+// Must not start with the chroot path (see Installer::create_chroot_template())
+#define CHROOT_TEMPLATE_DIR "/mb-chroot-template"
+
 
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
@@ -67,7 +73,7 @@ public:
 
     virtual void display_msg(const std::string& msg) override;
     virtual void updater_print(const std::string &msg) override;
-    virtual void command_output(const std::string &line) override;
+    virtual void command_output(const std::string &lines) override;
     virtual std::string get_install_type() override;
     virtual std::unordered_map<std::string, std::string> get_properties() override;
     virtual ProceedState on_checked_device() override;
@@ -113,14 +119,17 @@ void RomInstaller::display_msg(const std::string &msg)
 
 void RomInstaller::updater_print(const std::string &msg)
 {
+    // Keep the log file in order with messages queued by the async logger
+    log::log_flush();
     fprintf(_log_fp, "%s", msg.c_str());
     fflush(_log_fp);
     printf("%s", msg.c_str());
 }
 
-void RomInstaller::command_output(const std::string &line)
+void RomInstaller::command_output(const std::string &lines)
 {
-    fprintf(_log_fp, "%s", line.c_str());
+    log::log_flush();
+    fprintf(_log_fp, "%s", lines.c_str());
     fflush(_log_fp);
 }
 
@@ -464,22 +473,14 @@ static void rom_installer_usage(bool error)
             "  -r, --romid        ROM install type/ID (primary, dual, etc.)\n"
             "  -h, --help         Display this help message\n"
             "  --skip-mount       Skip filesystem mounting stage\n"
-            "  --allow-overwrite  Allow overwriting current ROM\n");
+            "  --allow-overwrite  Allow overwriting current ROM\n"
+            "  --chroot-template  Keep the chroot template for the next install\n"
+            "  --stage-zip        Copy the zip to RAM (or prefetch it) before\n"
+            "                     running the updater\n");
 }
 
 int rom_installer_main(int argc, char *argv[])
 {
-    if (unshare(CLONE_NEWNS) < 0) {
-        fprintf(stderr, "unshare() failed: %s\n", strerror(errno));
-        return EXIT_FAILURE;
-    }
-
-    if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
-        fprintf(stderr, "Failed to set private mount propagation: %s\n",
-                strerror(errno));
-        return false;
-    }
-
     // Make stdout unbuffered
     setvbuf(stdout, nullptr, _IONBF, 0);
 
@@ -487,12 +488,15 @@ int rom_installer_main(int argc, char *argv[])
     std::string zip_file;
     int flags = 0;
     bool allow_overwrite = false;
+    bool keep_chroot_template = false;
 
     int opt;
 
     enum options : int {
         OPTION_SKIP_MOUNT       = CHAR_MAX + 1,
         OPTION_ALLOW_OVERWRITE  = CHAR_MAX + 2,
+        OPTION_CHROOT_TEMPLATE  = CHAR_MAX + 3,
+        OPTION_STAGE_ZIP        = CHAR_MAX + 4,
     };
 
     static struct option long_options[] = {
@@ -500,6 +504,8 @@ int rom_installer_main(int argc, char *argv[])
         {"help",            no_argument,       0, 'h'},
         {"skip-mount",      no_argument,       0, OPTION_SKIP_MOUNT},
         {"allow-overwrite", no_argument,       0, OPTION_ALLOW_OVERWRITE},
+        {"chroot-template", no_argument,       0, OPTION_CHROOT_TEMPLATE},
+        {"stage-zip",       no_argument,       0, OPTION_STAGE_ZIP},
         {0, 0, 0, 0}
     };
 
@@ -526,6 +532,14 @@ int rom_installer_main(int argc, char *argv[])
             allow_overwrite = true;
             break;
 
+        case OPTION_CHROOT_TEMPLATE:
+            keep_chroot_template = true;
+            break;
+
+        case OPTION_STAGE_ZIP:
+            flags |= InstallerFlags::INSTALLER_STAGE_ZIP;
+            break;
+
         default:
             rom_installer_usage(true);
             return EXIT_FAILURE;
@@ -611,12 +625,75 @@ int rom_installer_main(int argc, char *argv[])
     }
 #endif
 
-    // mbtool logging
-    log::log_set_logger(std::make_shared<log::StdioLogger>(fp.get(), false));
+    // mbtool logging. Messages are written to the log file from a background
+    // thread so that installation isn't stalled by slow storage.
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::StdioLogger>(fp.get(), false, false)));
+
+    // Drain the async logger before the log file is closed
+    auto reset_logger = util::finally([] {
+        log::log_set_logger(std::make_shared<log::StdioLogger>(stderr, false));
+    });
+
+    // The chroot template is created in the global mount namespace so that
+    // sequential installations can share it. If --chroot-template is not
+    // passed, then this is the last installation in the session and an
+    // existing template is used one more time and then destroyed.
+    bool use_chroot_template;
+    if (keep_chroot_template) {
+        use_chroot_template =
+                Installer::create_chroot_template(CHROOT_TEMPLATE_DIR);
+    } else {
+        use_chroot_template = util::is_mounted(CHROOT_TEMPLATE_DIR);
+    }
+
+    int global_ns_fd = -1;
+    if (use_chroot_template) {
+        global_ns_fd = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+        if (global_ns_fd < 0) {
+            LOGW("Failed to open global mount namespace: %s", strerror(errno));
+        }
+    }
+
+    auto close_ns_fd = util::finally([&] {
+        if (global_ns_fd >= 0) {
+            close(global_ns_fd);
+        }
+    });
+
+    if (unshare(CLONE_NEWNS) < 0) {
+        fprintf(stderr, "unshare() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
+        fprintf(stderr, "Failed to set private mount propagation: %s\n",
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
 
     // Start installing!
     RomInstaller ri(zip_file, rom_id, fp.get(), flags);
-    return ri.start_installation() ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (use_chroot_template) {
+        ri.set_chroot_template(CHROOT_TEMPLATE_DIR);
+    }
+    bool ret = ri.start_installation();
+
+    // Installation queues stop at the first failure, so only keep the
+    // template after a success
+    if (use_chroot_template && (!keep_chroot_template || !ret)) {
+        if (global_ns_fd < 0) {
+            LOGW("Cannot destroy chroot template without access to the "
+                 "global mount namespace");
+        } else if (syscall(SYS_setns, global_ns_fd, CLONE_NEWNS) < 0) {
+            LOGW("Failed to enter global mount namespace: %s",
+                 strerror(errno));
+        } else if (!Installer::destroy_chroot_template(CHROOT_TEMPLATE_DIR)) {
+            LOGW("Failed to destroy chroot template");
+        }
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 }
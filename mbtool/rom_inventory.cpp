@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rom_inventory.h"
+
+#include <unordered_map>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/mount.h"
+#include "mbutil/path.h"
+#include "mbutil/properties.h"
+
+#include "multiboot.h"
+
+// Events that may change whether a ROM is installed or what its build.prop
+// contains
+#define WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+            | IN_DELETE_SELF | IN_MOVE_SELF)
+
+namespace mb
+{
+
+/*!
+ * \brief Find the deepest existing directory containing (or equal to) a path
+ *
+ * Watching that directory catches the creation of the missing components.
+ */
+static std::string existing_dir(std::string path)
+{
+    struct stat sb;
+
+    while (!path.empty() && path != "/") {
+        if (stat(path.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            return path;
+        }
+        path = util::dir_name(path);
+    }
+
+    return "/";
+}
+
+RomInventory::RomInventory()
+    : _inotify_fd(-1)
+    , _mounts_fd(-1)
+    , _valid(false)
+    , _have_props(false)
+{
+}
+
+RomInventory::~RomInventory()
+{
+    if (_inotify_fd >= 0) {
+        close(_inotify_fd);
+    }
+    if (_mounts_fd >= 0) {
+        close(_mounts_fd);
+    }
+}
+
+/*!
+ * \brief Get the installed ROMs, rebuilding the list if it may be outdated
+ */
+std::vector<InstalledRom> RomInventory::installed_roms()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+
+    refresh();
+
+    if (!_have_props) {
+        load_properties();
+    }
+
+    return _roms;
+}
+
+/*!
+ * \brief Get the installed ROMs without reading their build.prop files
+ */
+std::vector<std::shared_ptr<Rom>> RomInventory::roms()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+
+    refresh();
+
+    std::vector<std::shared_ptr<Rom>> result;
+    result.reserve(_roms.size());
+
+    for (auto const &ir : _roms) {
+        result.push_back(ir.rom);
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Find an installed ROM by its ID
+ *
+ * \return The ROM or nullptr if no ROM with the ID is installed
+ */
+std::shared_ptr<Rom> RomInventory::find_by_id(const std::string &id)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+
+    refresh();
+
+    auto it = _index.find(id);
+    if (it == _index.end()) {
+        return nullptr;
+    }
+
+    return _roms[it->second].rom;
+}
+
+/*!
+ * \brief Get the config of an installed ROM
+ *
+ * The parsed config is reused as long as the file is unchanged.
+ *
+ * \return Whether the ROM is installed and its config was successfully loaded
+ */
+bool RomInventory::rom_config(const std::string &id, RomConfig &config)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+
+    refresh();
+
+    auto it = _index.find(id);
+    if (it == _index.end()) {
+        return false;
+    }
+
+    auto const &path = _roms[it->second].config_path;
+
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        _configs.erase(id);
+        // Let load_file() report the error
+        return config.load_file(path);
+    }
+
+    auto cached = _configs.find(id);
+    if (cached != _configs.end()
+            && cached->second.dev == sb.st_dev
+            && cached->second.ino == sb.st_ino
+            && cached->second.size == sb.st_size
+            && cached->second.mtime.tv_sec == sb.st_mtim.tv_sec
+            && cached->second.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        if (cached->second.loaded) {
+            config = cached->second.config;
+        }
+        return cached->second.loaded;
+    }
+
+    CachedConfig entry;
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.loaded = entry.config.load_file(path);
+
+    if (entry.loaded) {
+        config = entry.config;
+    }
+
+    bool ret = entry.loaded;
+    _configs[id] = std::move(entry);
+    return ret;
+}
+
+/*!
+ * \brief Get the process-wide inventory
+ *
+ * The inventory is never destroyed, so it remains usable while the process is
+ * exiting.
+ */
+RomInventory & RomInventory::global()
+{
+    static RomInventory *inventory = new RomInventory();
+    return *inventory;
+}
+
+void RomInventory::refresh()
+{
+    if (!is_valid()) {
+        rebuild();
+    }
+}
+
+/*!
+ * \brief Check (without blocking) whether anything changed since rebuild()
+ */
+bool RomInventory::is_valid()
+{
+    if (!_valid) {
+        return false;
+    }
+
+    // Any pending event (including IN_Q_OVERFLOW) invalidates the list
+    char buf[4096];
+    ssize_t n = read(_inotify_fd, buf, sizeof(buf));
+    if (n > 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        _valid = false;
+        return false;
+    }
+
+    // The kernel reports POLLPRI on /proc/mounts after the mount table changes
+    struct pollfd pfd;
+    pfd.fd = _mounts_fd;
+    pfd.events = POLLPRI;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) != 0) {
+        _valid = false;
+        return false;
+    }
+
+    return true;
+}
+
+bool RomInventory::watch_paths(const std::vector<std::string> &paths)
+{
+    for (auto const &path : paths) {
+        std::string dir = existing_dir(path);
+
+        // Adding the same directory multiple times is harmless
+        if (inotify_add_watch(_inotify_fd, dir.c_str(), WATCH_MASK) < 0) {
+            LOGW("%s: Failed to add inotify watch: %s",
+                 dir.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void RomInventory::rebuild()
+{
+    // Drop the old watches. New ones are added before the directories are
+    // scanned so that changes made while scanning are not missed.
+    if (_inotify_fd >= 0) {
+        close(_inotify_fd);
+    }
+    _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify_fd < 0) {
+        LOGW("Failed to initialize inotify: %s", strerror(errno));
+    }
+
+    if (_mounts_fd >= 0) {
+        close(_mounts_fd);
+    }
+    _mounts_fd = open(PROC_MOUNTS, O_RDONLY | O_CLOEXEC);
+    if (_mounts_fd < 0) {
+        LOGW("%s: Failed to open: %s", PROC_MOUNTS, strerror(errno));
+    }
+
+    Roms all_roms;
+    all_roms.add_all();
+
+    std::vector<std::string> paths;
+    paths.push_back(get_raw_path("/data/multiboot"));
+    paths.push_back(get_raw_path(MULTIBOOT_DIR));
+
+    std::string extsd = Roms::get_extsd_partition();
+    if (!extsd.empty()) {
+        paths.push_back(extsd + "/multiboot");
+    }
+
+    for (auto const &rom : all_roms.roms) {
+        std::string system_path = rom->full_system_path();
+
+        paths.push_back(util::dir_name(get_raw_path(rom->boot_image_path())));
+        if (rom->system_is_image) {
+            paths.push_back(util::dir_name(system_path));
+            paths.push_back("/raw/images/" + rom->id);
+        } else {
+            paths.push_back(system_path);
+        }
+    }
+
+    _valid = _inotify_fd >= 0 && _mounts_fd >= 0 && watch_paths(paths);
+
+    _roms.clear();
+    _index.clear();
+    _have_props = false;
+
+    for (auto const &rom : all_roms.roms) {
+        if (!Roms::is_installed(rom)) {
+            continue;
+        }
+
+        InstalledRom ir;
+        ir.rom = rom;
+        ir.system_path = rom->full_system_path();
+        ir.cache_path = rom->full_cache_path();
+        ir.data_path = rom->full_data_path();
+        ir.boot_image_path = rom->boot_image_path();
+        ir.config_path = rom->config_path();
+        ir.thumbnail_path = rom->thumbnail_path();
+        ir.has_version = false;
+        ir.has_build = false;
+
+        // Keep the first ROM with an ID, like Roms::find_by_id()
+        _index.emplace(rom->id, _roms.size());
+        _roms.push_back(std::move(ir));
+    }
+
+    // Drop the configs of ROMs that are no longer installed
+    for (auto it = _configs.begin(); it != _configs.end();) {
+        if (_index.find(it->first) == _index.end()) {
+            it = _configs.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RomInventory::load_properties()
+{
+    for (auto &ir : _roms) {
+        std::string build_prop;
+        if (ir.rom->system_is_image) {
+            build_prop += "/raw/images/";
+            build_prop += ir.rom->id;
+        } else {
+            build_prop += ir.system_path;
+        }
+        build_prop += "/build.prop";
+
+        std::unordered_map<std::string, std::string> properties;
+        util::property_file_get_all(build_prop, properties);
+
+        auto it = properties.find("ro.build.version.release");
+        ir.has_version = it != properties.end();
+        if (ir.has_version) {
+            ir.version = it->second;
+        }
+
+        it = properties.find("ro.build.display.id");
+        ir.has_build = it != properties.end();
+        if (ir.has_build) {
+            ir.build = it->second;
+        }
+    }
+
+    _have_props = true;
+}
+
+}
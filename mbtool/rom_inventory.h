@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "romconfig.h"
+#include "roms.h"
+
+namespace mb
+{
+
+struct InstalledRom
+{
+    std::shared_ptr<Rom> rom;
+    std::string system_path;
+    std::string cache_path;
+    std::string data_path;
+    std::string boot_image_path;
+    std::string config_path;
+    std::string thumbnail_path;
+    // Values from build.prop
+    bool has_version;
+    std::string version;
+    bool has_build;
+    std::string build;
+};
+
+/*!
+ * \brief Cached list of installed ROMs
+ *
+ * Finding the installed ROMs and reading their build.prop files is slow when
+ * there are many ROMs on a slow external SD card. The list is cached and is
+ * rebuilt only after inotify reports a change in one of the directories that
+ * it was built from or after a filesystem is mounted or unmounted.
+ *
+ * If inotify is unavailable, the list is rebuilt on every call.
+ *
+ * The build.prop values are only read when installed_roms() is called. ROM
+ * configs are cached separately and are reloaded when the file's mtime, size,
+ * or inode changes.
+ */
+class RomInventory
+{
+public:
+    RomInventory();
+    ~RomInventory();
+
+    RomInventory(const RomInventory &) = delete;
+    RomInventory & operator=(const RomInventory &) = delete;
+
+    std::vector<InstalledRom> installed_roms();
+    std::vector<std::shared_ptr<Rom>> roms();
+    std::shared_ptr<Rom> find_by_id(const std::string &id);
+    bool rom_config(const std::string &id, RomConfig &config);
+
+    static RomInventory & global();
+
+private:
+    struct CachedConfig
+    {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        struct timespec mtime;
+        bool loaded;
+        RomConfig config;
+    };
+
+    std::mutex _lock;
+    int _inotify_fd;
+    int _mounts_fd;
+    bool _valid;
+    bool _have_props;
+    std::vector<InstalledRom> _roms;
+    // ROM ID -> index in _roms
+    std::unordered_map<std::string, size_t> _index;
+    std::unordered_map<std::string, CachedConfig> _configs;
+
+    bool is_valid();
+    void refresh();
+    void rebuild();
+    void load_properties();
+    bool watch_paths(const std::vector<std::string> &paths);
+};
+
+}
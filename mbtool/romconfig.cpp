@@ -34,6 +34,7 @@
 #define CONFIG_KEY_PACKAGES                "packages"
 #define CONFIG_KEY_PACKAGE_ID              "pkg_id"
 #define CONFIG_KEY_SHARE_DATA              "share_data"
+#define CONFIG_KEY_BOOT_READAHEAD          "boot_readahead"
 
 namespace mb {
 
@@ -54,7 +55,8 @@ namespace mb {
  *                 "share_data":true
  *             }
  *         ]
- *     }
+ *     },
+ *     "boot_readahead": true
  * }
  */
 bool RomConfig::load_file(const std::string &path)
@@ -106,6 +108,16 @@ bool RomConfig::load_file(const std::string &path)
         name = j_name->value.GetString();
     }
 
+    // Boot readahead
+    auto const j_readahead = d.FindMember(CONFIG_KEY_BOOT_READAHEAD);
+    if (j_readahead != d.MemberEnd()) {
+        if (!j_readahead->value.IsBool()) {
+            LOGE("[root]->boot_readahead: Not a boolean");
+            return false;
+        }
+        boot_readahead = j_readahead->value.GetBool();
+    }
+
     // App sharing
     auto const j_app_sharing = d.FindMember(CONFIG_KEY_APP_SHARING);
     if (j_app_sharing != d.MemberEnd()) {
@@ -37,6 +37,8 @@ struct RomConfig
     std::string name;
     bool indiv_app_sharing = false;
     std::vector<SharedPackage> shared_pkgs;
+    // Record and replay the files read while booting
+    bool boot_readahead = false;
 
     bool load_file(const std::string &path);
 };
@@ -36,6 +36,7 @@
 #include "mbutil/string.h"
 
 #include "multiboot.h"
+#include "rom_inventory.h"
 
 #define BUILD_PROP "build.prop"
 
@@ -288,36 +289,38 @@ void Roms::add_extsd_roms()
     std::move(temp_roms.begin(), temp_roms.end(), std::back_inserter(roms));
 }
 
+void Roms::add_all()
+{
+    add_builtin();
+    add_data_roms();
+    add_extsd_roms();
+}
+
 void Roms::add_installed()
 {
-    Roms all_roms;
-    all_roms.add_builtin();
-    all_roms.add_data_roms();
-    all_roms.add_extsd_roms();
+    // The process-wide inventory only rescans when something changed
+    auto installed = RomInventory::global().roms();
+    std::move(installed.begin(), installed.end(), std::back_inserter(roms));
+}
 
+bool Roms::is_installed(const std::shared_ptr<Rom> &rom)
+{
+    std::string boot_path = get_raw_path(rom->boot_image_path());
+    std::string system_path = rom->full_system_path();
     struct stat sb;
 
-    for (auto rom : all_roms.roms) {
-        std::string boot_path = get_raw_path(rom->boot_image_path());
-        std::string system_path = rom->full_system_path();
-
-        if (stat(boot_path.c_str(), &sb) == 0) {
-            // If boot image exists, assume that the ROM is installed
-            roms.push_back(rom);
-        } else if (rom->system_is_image) {
-            // If /system is on an ext4 image, check if the image exists
-            if (stat(system_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
-                roms.push_back(rom);
-            }
-        } else {
-            // If /system is bind-mounted, check if build.prop exists
-            std::string build_prop(system_path);
-            build_prop += "/build.prop";
+    if (stat(boot_path.c_str(), &sb) == 0) {
+        // If boot image exists, assume that the ROM is installed
+        return true;
+    } else if (rom->system_is_image) {
+        // If /system is on an ext4 image, check if the image exists
+        return stat(system_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode);
+    } else {
+        // If /system is bind-mounted, check if build.prop exists
+        std::string build_prop(system_path);
+        build_prop += "/build.prop";
 
-            if (stat(build_prop.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
-                roms.push_back(rom);
-            }
-        }
+        return stat(build_prop.c_str(), &sb) == 0 && S_ISREG(sb.st_mode);
     }
 }
 
@@ -334,8 +337,7 @@ std::shared_ptr<Rom> Roms::find_by_id(const std::string &id) const
 
 std::shared_ptr<Rom> Roms::get_current_rom()
 {
-    Roms roms;
-    roms.add_installed();
+    auto &inventory = RomInventory::global();
 
     // This is set if mbtool is handling the boot process
     std::string prop_id = util::property_get_string(PROP_MULTIBOOT_ROM_ID, {});
@@ -347,7 +349,7 @@ std::shared_ptr<Rom> Roms::get_current_rom()
     }
 
     if (!prop_id.empty()) {
-        auto rom = roms.find_by_id(prop_id);
+        auto rom = inventory.find_by_id(prop_id);
         if (rom) {
             return rom;
         }
@@ -362,13 +364,13 @@ std::shared_ptr<Rom> Roms::get_current_rom()
         // Cache the result
         util::property_set(PROP_MULTIBOOT_ROM_ID, "primary");
 
-        return roms.find_by_id("primary");
+        return inventory.find_by_id("primary");
     }
 
     // Otherwise, iterate through the installed ROMs
 
     if (stat("/system/build.prop", &sb) == 0) {
-        for (auto rom : roms.roms) {
+        for (auto rom : inventory.roms()) {
             // We can't check roms that use images since they aren't mounted
             if (rom->system_is_image) {
                 continue;
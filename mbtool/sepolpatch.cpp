@@ -19,10 +19,13 @@
 
 #include "sepolpatch.h"
 
+#include <map>
 #include <memory>
 
+#include <cinttypes>
 #include <climits>
 #include <cstdio>
+#include <ctime>
 
 #include <fcntl.h>
 #include <getopt.h>
@@ -31,6 +34,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <openssl/sha.h>
+
 // libsepol is not very C++ friendly. 'bool' is a struct field in conditional.h
 #define bool bool2
 #include <sepol/policydb/expand.h>
@@ -39,14 +44,24 @@
 #undef bool
 
 #include "mbcommon/common.h"
+#include "mbcommon/string.h"
+#include "mbcommon/version.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/path.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
 #include "multiboot.h"
 
+// Version of the built-in policy patches. This must be incremented whenever a
+// patch is changed so that cached patched policies are regenerated.
+#define SEPOLICY_CACHE_RULES_VERSION    1
+
 
 extern "C" int policydb_index_decls(policydb_t *p);
 
@@ -54,23 +69,26 @@ namespace mb
 {
 
 /*!
- * Add or remove rule.
+ * \brief Add and remove permissions from an allow rule
+ *
+ * Only one avtab lookup is done regardless of the number of permissions. If a
+ * permission is in both masks, it is removed.
  *
  * \param pdb Policy DB object
  * \param source_type_val Source type for rule
  * \param target_type_val Target type for rule
  * \param class_val Class for rule
- * \param perm_val Permission for rule
- * \param remove Whether to remove the rule
+ * \param add_mask Permission bits to add
+ * \param remove_mask Permission bits to remove
  *
  * \return Whether a change was made
  */
-SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
-                                         uint16_t source_type_val,
-                                         uint16_t target_type_val,
-                                         uint16_t class_val,
-                                         uint32_t perm_val,
-                                         bool remove)
+static SELinuxResult set_avtab_perms(policydb_t *pdb,
+                                     uint16_t source_type_val,
+                                     uint16_t target_type_val,
+                                     uint16_t class_val,
+                                     uint32_t add_mask,
+                                     uint32_t remove_mask)
 {
     avtab_datum_t *av;
     avtab_key_t key;
@@ -82,24 +100,21 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
     av = avtab_search(&pdb->te_avtab, &key);
 
     if (!av) {
-        if (remove) {
+        add_mask &= ~remove_mask;
+        if (!add_mask) {
             return SELinuxResult::UNCHANGED;
-        } else {
-            avtab_datum_t av_new;
-            av_new.data = (1U << (perm_val - 1));
-            if (avtab_insert(&pdb->te_avtab, &key, &av_new) != 0) {
-                return SELinuxResult::ERROR;
-            }
-            return SELinuxResult::CHANGED;
         }
+
+        avtab_datum_t av_new;
+        av_new.data = add_mask;
+        if (avtab_insert(&pdb->te_avtab, &key, &av_new) != 0) {
+            return SELinuxResult::ERROR;
+        }
+        return SELinuxResult::CHANGED;
     } else {
         auto old_data = av->data;
 
-        if (remove) {
-            av->data &= ~(1U << (perm_val - 1));
-        } else {
-            av->data |= (1U << (perm_val - 1));
-        }
+        av->data = (av->data | add_mask) & ~remove_mask;
 
         return (av->data == old_data)
                 ? SELinuxResult::UNCHANGED
@@ -107,6 +122,31 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
     }
 }
 
+/*!
+ * Add or remove rule.
+ *
+ * \param pdb Policy DB object
+ * \param source_type_val Source type for rule
+ * \param target_type_val Target type for rule
+ * \param class_val Class for rule
+ * \param perm_val Permission for rule
+ * \param remove Whether to remove the rule
+ *
+ * \return Whether a change was made
+ */
+SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
+                                         uint16_t source_type_val,
+                                         uint16_t target_type_val,
+                                         uint16_t class_val,
+                                         uint32_t perm_val,
+                                         bool remove)
+{
+    uint32_t mask = 1U << (perm_val - 1);
+
+    return set_avtab_perms(pdb, source_type_val, target_type_val, class_val,
+                           remove ? 0 : mask, remove ? mask : 0);
+}
+
 SELinuxResult selinux_raw_set_type_trans(policydb_t *pdb,
                                          uint16_t source_type_val,
                                          uint16_t target_type_val,
@@ -140,19 +180,13 @@ SELinuxResult selinux_raw_set_type_trans(policydb_t *pdb,
     }
 }
 
-SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
-                                          uint16_t source_type_val,
-                                          uint16_t target_type_val,
-                                          uint16_t class_val)
+/*!
+ * \brief Get mask of all class-specific and common permissions of a class
+ */
+static uint32_t class_all_perms_mask(class_datum_t *clazz)
 {
-    SELinuxResult result(SELinuxResult::UNCHANGED);
+    uint32_t mask = 0;
 
-    auto clazz = pdb->class_val_to_struct[class_val - 1];
-    if (!clazz) {
-        return SELinuxResult::ERROR;
-    }
-
-    // Class-specific permissions
     hashtab_t tables[] = { clazz->permissions.table, nullptr, nullptr };
     if (clazz->comdatum) {
         tables[1] = clazz->comdatum->permissions.table;
@@ -163,26 +197,26 @@ SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
             for (hashtab_ptr_t cur = (*table)->htable[bucket]; cur;
                     cur = cur->next) {
                 perm_datum_t *perm_datum = (perm_datum_t *) cur->datum;
-
-                SELinuxResult ret = selinux_raw_set_avtab_rule(
-                        pdb, source_type_val, target_type_val, class_val,
-                        perm_datum->s.value, false);
-
-                switch (ret) {
-                case SELinuxResult::ERROR:
-                    return ret;
-                case SELinuxResult::CHANGED:
-                    result = ret;
-                    break;
-                case SELinuxResult::UNCHANGED:
-                    // Ignore
-                    break;
-                }
+                mask |= 1U << (perm_datum->s.value - 1);
             }
         }
     }
 
-    return result;
+    return mask;
+}
+
+SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val)
+{
+    auto clazz = pdb->class_val_to_struct[class_val - 1];
+    if (!clazz) {
+        return SELinuxResult::ERROR;
+    }
+
+    return set_avtab_perms(pdb, source_type_val, target_type_val, class_val,
+                           class_all_perms_mask(clazz), 0);
 }
 
 SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
@@ -292,9 +326,14 @@ SELinuxResult selinux_raw_set_attribute(policydb_t *pdb,
     return changed ? SELinuxResult::CHANGED : SELinuxResult::UNCHANGED;
 }
 
-SELinuxResult selinux_raw_add_to_role(policydb_t *pdb,
-                                      uint16_t role_val,
-                                      uint16_t type_val)
+/*!
+ * \brief Add type to role without reindexing the policy
+ *
+ * The caller must call selinux_raw_reindex() if the role was changed.
+ */
+static SELinuxResult add_to_role_no_reindex(policydb_t *pdb,
+                                            uint16_t role_val,
+                                            uint16_t type_val)
 {
     role_datum_t *role = pdb->role_val_to_struct[role_val - 1];
 
@@ -306,6 +345,18 @@ SELinuxResult selinux_raw_add_to_role(policydb_t *pdb,
         return SELinuxResult::ERROR;
     }
 
+    return SELinuxResult::CHANGED;
+}
+
+SELinuxResult selinux_raw_add_to_role(policydb_t *pdb,
+                                      uint16_t role_val,
+                                      uint16_t type_val)
+{
+    SELinuxResult ret = add_to_role_no_reindex(pdb, role_val, type_val);
+    if (ret != SELinuxResult::CHANGED) {
+        return ret;
+    }
+
     // (See policydb_role_cache() in policydb.c)
 #if 0
     ebitmap_destroy(&role->cache);
@@ -593,15 +644,12 @@ bool selinux_grant_all_perms(policydb_t *pdb,
 }
 
 /*!
- * \brief Create type in SELinux binary policy
- *
- * \param pdb Policy object
- * \param name Name of type to add
+ * \brief Create type without reindexing the policy
  *
- * \return Whether the type was created
+ * The caller must call selinux_raw_reindex() if the type was created.
  */
-SELinuxResult selinux_create_type(policydb_t *pdb,
-                                  const char *name)
+static SELinuxResult create_type_no_reindex(policydb_t *pdb,
+                                            const char *name)
 {
     if (find_type(pdb, name)) {
         // Type already exists
@@ -673,6 +721,25 @@ SELinuxResult selinux_create_type(policydb_t *pdb,
         return SELinuxResult::ERROR;
     }
 
+    return SELinuxResult::CHANGED;
+}
+
+/*!
+ * \brief Create type in SELinux binary policy
+ *
+ * \param pdb Policy object
+ * \param name Name of type to add
+ *
+ * \return Whether the type was created
+ */
+SELinuxResult selinux_create_type(policydb_t *pdb,
+                                  const char *name)
+{
+    SELinuxResult ret = create_type_no_reindex(pdb, name);
+    if (ret != SELinuxResult::CHANGED) {
+        return ret;
+    }
+
     if (!selinux_raw_reindex(pdb)) {
         return SELinuxResult::ERROR;
     }
@@ -729,6 +796,120 @@ bool selinux_add_to_role(policydb_t *pdb,
     return ret != SELinuxResult::ERROR;
 }
 
+static inline uint64_t avtab_key_id(uint16_t source_type_val,
+                                    uint16_t target_type_val,
+                                    uint16_t class_val)
+{
+    return (static_cast<uint64_t>(source_type_val) << 32)
+            | (static_cast<uint64_t>(target_type_val) << 16)
+            | class_val;
+}
+
+/*!
+ * \brief Apply a list of rules to the policy
+ *
+ * All names are resolved before the policy is touched, so nothing is changed
+ * if a type, class, or permission does not exist. Permissions for the same
+ * source, target, and class are merged so that each avtab key is only looked
+ * up once. The result is the same as applying the rules one by one in order.
+ *
+ * Only avtab is modified, so the policy does not need to be reindexed.
+ *
+ * \param pdb Policy object
+ * \param rules Rules to apply
+ *
+ * \return Whether all rules were applied
+ */
+bool selinux_apply_rules(policydb_t *pdb,
+                         const std::vector<SELinuxRule> &rules)
+{
+    // Permission bits to add and remove for each allow rule key
+    std::map<uint64_t, std::pair<uint32_t, uint32_t>> perm_masks;
+    // Default type for each type transition key
+    std::map<uint64_t, uint16_t> default_types;
+
+    for (auto const &rule : rules) {
+        type_datum_t *source = find_type(pdb, rule.source);
+        if (!source) {
+            LOGE("Source type %s does not exist", rule.source);
+            return false;
+        }
+
+        type_datum_t *target = find_type(pdb, rule.target);
+        if (!target) {
+            LOGE("Target type %s does not exist", rule.target);
+            return false;
+        }
+
+        class_datum_t *clazz = find_class(pdb, rule.clazz);
+        if (!clazz) {
+            LOGE("Class %s does not exist", rule.clazz);
+            return false;
+        }
+
+        uint64_t id = avtab_key_id(source->s.value, target->s.value,
+                                   clazz->s.value);
+
+        if (rule.action == SELinuxRuleAction::TYPE_TRANS) {
+            type_datum_t *def = find_type(pdb, rule.perms);
+            if (!def) {
+                LOGE("Default type %s does not exist", rule.perms);
+                return false;
+            }
+
+            default_types[id] = def->s.value;
+            continue;
+        }
+
+        auto &masks = perm_masks[id];
+
+        for (auto const &perm_str : util::split(rule.perms, " ")) {
+            if (perm_str.empty()) {
+                continue;
+            }
+
+            perm_datum_t *perm = find_perm(clazz, perm_str.c_str());
+            if (!perm) {
+                LOGE("Perm %s does not exist in class %s",
+                     perm_str.c_str(), rule.clazz);
+                return false;
+            }
+
+            uint32_t bit = 1U << (perm->s.value - 1);
+
+            if (rule.action == SELinuxRuleAction::REMOVE) {
+                masks.first &= ~bit;
+                masks.second |= bit;
+            } else {
+                masks.first |= bit;
+                masks.second &= ~bit;
+            }
+        }
+    }
+
+    for (auto const &item : perm_masks) {
+        SELinuxResult ret = set_avtab_perms(
+                pdb, item.first >> 32, (item.first >> 16) & 0xffff,
+                item.first & 0xffff, item.second.first, item.second.second);
+        if (ret == SELinuxResult::ERROR) {
+            LOGE("Failed to add allow rules to avtab");
+            return false;
+        }
+    }
+
+    for (auto const &item : default_types) {
+        SELinuxResult ret = selinux_raw_set_type_trans(
+                pdb, item.first >> 32, (item.first >> 16) & 0xffff,
+                item.first & 0xffff, item.second);
+        if (ret == SELinuxResult::ERROR) {
+            LOGE("Failed to add type transitions to avtab");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void selinux_strip_no_audit(policydb_t *pdb)
 {
 #if 0
@@ -789,37 +970,6 @@ void selinux_strip_no_audit(policydb_t *pdb)
         if (!(expr)) return false; \
     } while (0)
 
-static inline bool add_rules(policydb_t *pdb,
-                             const char *source,
-                             const char *target,
-                             const char *clazz,
-                             const std::vector<std::string> &perms)
-{
-    for (auto const &perm : perms) {
-        if (!selinux_add_rule(pdb, source, target, clazz, perm.c_str())) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-MB_UNUSED
-static inline bool remove_rules(policydb_t *pdb,
-                                const char *source,
-                                const char *target,
-                                const char *clazz,
-                                const std::vector<std::string> &perms)
-{
-    for (auto const &perm : perms) {
-        if (!selinux_remove_rule(pdb, source, target, clazz, perm.c_str())) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
 static bool apply_pre_boot_patches(policydb_t *pdb)
 {
     // We are going to allow everything. The stage 1 policy is not a security
@@ -973,71 +1123,81 @@ static bool fix_data_media_rules(policydb_t *pdb)
 
 static bool create_mbtool_types(policydb_t *pdb)
 {
-    // Used for running any mbtool commands
-    ff(selinux_create_type(pdb, "mb_exec") != SELinuxResult::ERROR);
-    ff(selinux_add_to_role(pdb, "r", "mb_exec"));
+    // Used for running any mbtool commands. The policy is only reindexed once
+    // after both the type and its role are added.
+    SELinuxResult type_ret = create_type_no_reindex(pdb, "mb_exec");
+    ff(type_ret != SELinuxResult::ERROR);
+
+    type_datum_t *mb_exec = find_type(pdb, "mb_exec");
+    role_datum_t *role_r = find_role(pdb, "r");
+    if (!mb_exec || !role_r) {
+        return false;
+    }
+
+    SELinuxResult role_ret = add_to_role_no_reindex(
+            pdb, role_r->s.value, mb_exec->s.value);
+    ff(role_ret != SELinuxResult::ERROR);
+
+    if (type_ret == SELinuxResult::CHANGED
+            || role_ret == SELinuxResult::CHANGED) {
+        ff(selinux_raw_reindex(pdb));
+    }
+
     ff(selinux_set_attribute(pdb, "mb_exec", "domain"));
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedobject"));
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedsubject"));
 
-    // Allow setting the current process context from init to mb_exec
-    ff(add_rules(pdb, "init", "mb_exec", "process", {
-        "noatsecure", "rlimitinh", "setcurrent", "siginh", "transition",
-        //"dyntransition",
-    }));
+    std::vector<SELinuxRule> rules{
+        // Allow setting the current process context from init to mb_exec
+        { SELinuxRuleAction::ALLOW, "init", "mb_exec", "process",
+          "noatsecure rlimitinh setcurrent siginh transition" },
+
+        // Allow installd to connect to appsync's socket
+        { SELinuxRuleAction::ALLOW, "installd", "mb_exec", "unix_stream_socket",
+          "accept listen read write" },
+
+        // Allow apps to connect to the daemon
+        { SELinuxRuleAction::ALLOW, "untrusted_app", "mb_exec", "unix_stream_socket",
+          "connectto" },
+
+        // Allow zygote to write to our stdout pipe when rebooting
+        { SELinuxRuleAction::ALLOW, "zygote", "init", "fifo_file", "write" },
+
+        // Allow rebooting via the android.intent.action.REBOOT intent
+        { SELinuxRuleAction::ALLOW, "zygote", "init", "unix_stream_socket", "read write" },
+        { SELinuxRuleAction::ALLOW, "zygote", "servicemanager", "binder", "call" },
+
+        { SELinuxRuleAction::ALLOW, "servicemanager", "mb_exec", "binder", "transfer" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "mb_exec", "dir", "search" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "mb_exec", "file", "open read" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "mb_exec", "process", "getattr" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "zygote", "dir", "search" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "zygote", "file", "open read" },
+        { SELinuxRuleAction::ALLOW, "servicemanager", "zygote", "process", "getattr" },
+
+        // For in-app flashing
+        { SELinuxRuleAction::ALLOW, "rootfs", "tmpfs", "filesystem", "associate" },
+        { SELinuxRuleAction::ALLOW, "tmpfs", "rootfs", "filesystem", "associate" },
+        { SELinuxRuleAction::ALLOW, "kernel", "mb_exec", "fd", "use" },
+    };
 
-    // Allow installd to connect to appsync's socket
-    ff(add_rules(pdb, "installd", "mb_exec", "unix_stream_socket", {
-        "accept", "listen", "read", "write",
-    }));
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "system_server", "mb_exec", "unix_stream_socket", {
-            "connectto",
-        }));
+        rules.push_back({ SELinuxRuleAction::ALLOW, "system_server", "mb_exec",
+                          "unix_stream_socket", "connectto" });
+        rules.push_back({ SELinuxRuleAction::ALLOW, "zygote", "system_server",
+                          "binder", "call" });
     } else {
-        ff(add_rules(pdb, "system", "mb_exec", "unix_stream_socket", {
-            "connectto",
-        }));
+        rules.push_back({ SELinuxRuleAction::ALLOW, "system", "mb_exec",
+                          "unix_stream_socket", "connectto" });
     }
-
-    // Allow apps to connect to the daemon
-    ff(add_rules(pdb, "untrusted_app", "mb_exec", "unix_stream_socket", {
-        "connectto",
-    }));
-
-    // Allow zygote to write to our stdout pipe when rebooting
-    ff(add_rules(pdb, "zygote", "init", "fifo_file", { "write" }));
-
-    // Allow rebooting via the android.intent.action.REBOOT intent
     if (find_type(pdb, "activity_service")) {
-        ff(add_rules(pdb, "zygote", "activity_service", "service_manager", { "find" }));
+        rules.push_back({ SELinuxRuleAction::ALLOW, "zygote", "activity_service",
+                          "service_manager", "find" });
     }
-    if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "zygote", "system_server", "binder", { "call" }));
-    }
-
-    ff(add_rules(pdb, "zygote", "init", "unix_stream_socket", { "read", "write" }));
-    ff(add_rules(pdb, "zygote", "servicemanager", "binder", { "call" }));
-
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "binder", { "transfer" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "file", { "open", "read" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "process", { "getattr" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "open" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "read" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "process", { "getattr" }));
 
-    // For in-app flashing
-    ff(add_rules(pdb, "rootfs", "tmpfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "kernel", "mb_exec", "fd", { "use" }));
+    ff(selinux_apply_rules(pdb, rules));
 
     // Give mb_exec <insert diety here> permissions
-    type_datum_t *mb_exec = find_type(pdb, "mb_exec");
-    if (!mb_exec) {
-        return false;
-    }
 
     // For all attributes
     for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim;
@@ -1074,22 +1234,22 @@ static bool apply_main_patches(policydb_t *pdb)
 
 static bool apply_cwm_recovery_patches(policydb_t *pdb)
 {
-    // Debugging rules (for CWM and Philz)
-    ff(add_rules(pdb, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "system_file",     "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "tmpfs",           "file",       { "relabelto" }));
-
-    ff(add_rules(pdb, "rootfs", "tmpfs",          "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
-
-    return true;
+    return selinux_apply_rules(pdb, {
+        // Debugging rules (for CWM and Philz)
+        { SELinuxRuleAction::ALLOW, "adbd", "block_device",    "blk_file", "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "graphics_device", "chr_file", "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "graphics_device", "dir",      "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "input_device",    "chr_file", "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "input_device",    "dir",      "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "rootfs",          "dir",      "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "rootfs",          "file",     "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "rootfs",          "lnk_file", "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "system_file",     "file",     "relabelto" },
+        { SELinuxRuleAction::ALLOW, "adbd", "tmpfs",           "file",     "relabelto" },
+
+        { SELinuxRuleAction::ALLOW, "rootfs", "tmpfs",  "filesystem", "associate" },
+        { SELinuxRuleAction::ALLOW, "tmpfs",  "rootfs", "filesystem", "associate" },
+    });
 }
 
 bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch)
@@ -1139,11 +1299,21 @@ bool patch_sepolicy(const std::string &source,
 
     LOGD("Policy version: %u", pdb.policyvers);
 
+    struct timespec start;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
     if (!selinux_apply_patch(&pdb, patch)) {
         LOGE("%s: Failed to apply policy patch", source.c_str());
         return false;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LOGD("Applied policy patch in %" PRId64 "ms",
+         util::timespec_diff_ms(start, end));
+
     if (!util::selinux_write_policy(target, &pdb)) {
         LOGE("%s: Failed to write SELinux policy", target.c_str());
         return false;
@@ -1152,7 +1322,172 @@ bool patch_sepolicy(const std::string &source,
     return true;
 }
 
-bool patch_loaded_sepolicy(SELinuxPatch patch)
+static const char * patch_cache_name(SELinuxPatch patch)
+{
+    switch (patch) {
+    case SELinuxPatch::PRE_BOOT:
+        return "pre_boot";
+    case SELinuxPatch::MAIN:
+        return "main";
+    case SELinuxPatch::CWM_RECOVERY:
+        return "cwm_recovery";
+    case SELinuxPatch::STRIP_NO_AUDIT:
+        return "strip_no_audit";
+    case SELinuxPatch::NONE:
+    default:
+        return "none";
+    }
+}
+
+/*!
+ * \brief Compute the cache key for patching a policy
+ *
+ * Besides the source policy and the patch, the key includes everything else
+ * that the result depends on. The main patch also depends on the SELinux label
+ * of the internal storage (see fix_data_media_rules()).
+ */
+static std::string sepolicy_cache_key(const std::vector<char> &source_data,
+                                      SELinuxPatch patch)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char *>(source_data.data()),
+           source_data.size(), digest);
+
+    std::string key = mb::format(
+            "source=%s\nrules=%d\nmbtool=%s\npatch=%s\n",
+            util::hex_string(digest, sizeof(digest)).c_str(),
+            SEPOLICY_CACHE_RULES_VERSION, version(),
+            patch_cache_name(patch));
+
+    if (patch == SELinuxPatch::MAIN) {
+        std::string context;
+        if (!util::selinux_lget_context(INTERNAL_STORAGE, &context)) {
+            util::selinux_lget_context("/data/media", &context);
+        }
+        key += "data_media=";
+        key += context;
+        key += '\n';
+    }
+
+    return key;
+}
+
+/*!
+ * \brief Store a patched policy in the cache
+ *
+ * The key file is removed first and written last, so an interrupted update
+ * can never leave a key that matches the wrong policy.
+ */
+static bool store_cached_sepolicy(const std::string &source,
+                                  const std::string &blob_path,
+                                  const std::string &key_path,
+                                  const std::string &key,
+                                  SELinuxPatch patch)
+{
+    std::string blob_temp = blob_path + ".tmp";
+    std::string key_temp = key_path + ".tmp";
+
+    unlink(key_path.c_str());
+
+    if (!patch_sepolicy(source, blob_temp, patch)) {
+        unlink(blob_temp.c_str());
+        return false;
+    }
+
+    if (rename(blob_temp.c_str(), blob_path.c_str()) < 0) {
+        LOGW("%s: Failed to rename file: %s",
+             blob_temp.c_str(), strerror(errno));
+        unlink(blob_temp.c_str());
+        return false;
+    }
+
+    if (!util::file_write_data(key_temp, key.data(), key.size())
+            || rename(key_temp.c_str(), key_path.c_str()) < 0) {
+        LOGW("%s: Failed to write cache key: %s",
+             key_path.c_str(), strerror(errno));
+        unlink(key_temp.c_str());
+        // The policy was still patched successfully
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Patch a policy, reusing a previously patched copy if possible
+ *
+ * Patched policies are stored in \p cache_dir, keyed by the SHA-256 digest of
+ * the source policy, the version of the built-in patches, and the mbtool
+ * version. On a hit, the cached policy is written to \p target as is, without
+ * being parsed by libsepol. On a miss, the policy is patched into the cache
+ * first. If the cache cannot be written, this behaves like patch_sepolicy().
+ *
+ * Each combination of patch and source file name has a single cache slot, so
+ * the cache does not grow over time.
+ *
+ * \param source Source policy file
+ * \param target Target policy file (can be /sys/fs/selinux/load)
+ * \param patch Patch to apply
+ * \param cache_dir Cache directory (if empty, the cache is not used)
+ *
+ * \return Whether the patched policy was written to \p target
+ */
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir)
+{
+    if (cache_dir.empty()) {
+        return patch_sepolicy(source, target, patch);
+    }
+
+    std::vector<char> source_data;
+    if (!util::selinux_read_policy_data(source, &source_data)) {
+        return false;
+    }
+
+    std::string key = sepolicy_cache_key(source_data, patch);
+    std::vector<char>().swap(source_data);
+
+    std::string slot = mb::format("%s/%s_%s", cache_dir.c_str(),
+                                  patch_cache_name(patch),
+                                  util::base_name(source).c_str());
+    std::string blob_path = slot + ".bin";
+    std::string key_path = slot + ".key";
+
+    std::vector<unsigned char> cached_key;
+    bool hit = util::file_read_all(key_path, &cached_key)
+            && cached_key.size() == key.size()
+            && memcmp(cached_key.data(), key.data(), key.size()) == 0;
+
+    if (hit) {
+        LOGD("%s: Using cached patched policy", blob_path.c_str());
+    } else {
+        LOGD("%s: Cached patched policy is missing or stale",
+             blob_path.c_str());
+
+        if (!util::mkdir_recursive(cache_dir, 0755)
+                || !store_cached_sepolicy(source, blob_path, key_path, key,
+                                          patch)) {
+            LOGW("%s: Failed to update policy cache", cache_dir.c_str());
+            return patch_sepolicy(source, target, patch);
+        }
+    }
+
+    std::vector<char> blob;
+    if (!util::selinux_read_policy_data(blob_path, &blob)) {
+        unlink(key_path.c_str());
+        return patch_sepolicy(source, target, patch);
+    }
+
+    if (!util::selinux_write_policy_data(target, blob.data(), blob.size())) {
+        LOGE("%s: Failed to write SELinux policy", target.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool patch_loaded_sepolicy(SELinuxPatch patch, const std::string &cache_dir)
 {
     autoclose::file fp(autoclose::fopen(SELINUX_ENFORCE_FILE, "rbe"));
     if (!fp) {
@@ -1168,7 +1503,8 @@ bool patch_loaded_sepolicy(SELinuxPatch patch)
         }
     }
 
-    return patch_sepolicy(SELINUX_POLICY_FILE, SELINUX_LOAD_FILE, patch);
+    return patch_sepolicy_cached(SELINUX_POLICY_FILE, SELINUX_LOAD_FILE, patch,
+                                 cache_dir);
 }
 
 static void sepolpatch_usage(FILE *stream)
@@ -1309,7 +1645,7 @@ int sepolpatch_main(int argc, char *argv[])
                 return EXIT_FAILURE;
             }
 
-            return patch_loaded_sepolicy(patch_type)
+            return patch_loaded_sepolicy(patch_type, {})
                     ? EXIT_SUCCESS : EXIT_FAILURE;
         } else {
             if (!source_file) {
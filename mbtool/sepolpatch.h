@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <sepol/policydb/policydb.h>
 
@@ -33,6 +34,23 @@ enum class SELinuxResult
     ERROR,
 };
 
+enum class SELinuxRuleAction
+{
+    ALLOW,
+    REMOVE,
+    TYPE_TRANS,
+};
+
+struct SELinuxRule
+{
+    SELinuxRuleAction action;
+    const char *source;
+    const char *target;
+    const char *clazz;
+    // Space-separated permissions or the default type for type transitions
+    const char *perms;
+};
+
 SELinuxResult selinux_raw_set_allow_rule(policydb_t *pdb,
                                          uint16_t source_type_val,
                                          uint16_t target_type_val,
@@ -105,6 +123,8 @@ bool selinux_set_attribute(policydb_t *pdb,
 bool selinux_add_to_role(policydb_t *pdb,
                          const char *role_name,
                          const char *type_name);
+bool selinux_apply_rules(policydb_t *pdb,
+                         const std::vector<SELinuxRule> &rules);
 
 // Patching functions
 
@@ -122,7 +142,11 @@ bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch);
 bool patch_sepolicy(const std::string &source,
                     const std::string &target,
                     SELinuxPatch patch);
-bool patch_loaded_sepolicy(SELinuxPatch patch);
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch,
+                           const std::string &cache_dir);
+bool patch_loaded_sepolicy(SELinuxPatch patch, const std::string &cache_dir);
 
 int sepolpatch_main(int argc, char *argv[]);
 
@@ -19,22 +19,35 @@
 
 #include "signature.h"
 
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/err.h>
+#include <openssl/sha.h>
 #include <openssl/x509.h>
 
 #include <mblog/logging.h>
 #include <mbsign/mbsign.h>
+#include <mbutil/file.h>
 #include <mbutil/finally.h>
 
 #include "validcerts.h"
 
 #define COMPILE_ERROR_STRINGS 0
 
+// Maximum number of cached signature verification results
+#define SIG_CACHE_MAX 32
+
 namespace mb
 {
 
@@ -93,58 +106,45 @@ static void openssl_log_errors()
     ERR_print_errors_cb(&log_callback, nullptr);
 }
 
-static SigVerifyResult verify_signature_with_key(const char *path,
-                                                 const char *sig_path,
-                                                 EVP_PKEY *public_key)
+/*!
+ * \brief Load the public keys of all certificates in valid_certs
+ *
+ * The keys are loaded on the first successful call and kept for the lifetime
+ * of the process.
+ */
+static bool get_public_keys(const std::vector<EVP_PKEY *> **keys_out)
 {
-    bool ret = false;
-    bool valid;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_in = nullptr;
-
-    bio_data_in = BIO_new_file(path, "rb");
-    if (!bio_data_in) {
-        LOGE("%s: Failed to open input file", path);
-        openssl_log_errors();
-        goto error;
-    }
-    bio_sig_in = BIO_new_file(sig_path, "rb");
-    if (!bio_sig_in) {
-        LOGE("%s: Failed to open signature file", sig_path);
-        openssl_log_errors();
-        goto error;
-    }
+    static std::mutex keys_lock;
+    static std::vector<EVP_PKEY *> keys;
+    static bool keys_loaded = false;
 
-    ret = mb::sign::verify_data(bio_data_in, bio_sig_in, public_key, &valid);
+    std::lock_guard<std::mutex> lock(keys_lock);
 
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
+    if (keys_loaded) {
+        *keys_out = &keys;
+        return true;
+    }
 
-    return ret ? (valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID)
-            : SigVerifyResult::FAILURE;
+    std::vector<EVP_PKEY *> result;
 
-error:
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-    return SigVerifyResult::FAILURE;
-}
+    auto free_keys = util::finally([&]{
+        for (EVP_PKEY *key : result) {
+            EVP_PKEY_free(key);
+        }
+    });
 
-SigVerifyResult verify_signature(const char *path, const char *sig_path)
-{
     for (const std::string &hex_der : valid_certs) {
         std::string der;
         if (!hex2bin(hex_der, &der)) {
             LOGE("Failed to convert hex-encoded certificate to binary: %s",
                  hex_der.c_str());
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
-        EVP_PKEY *public_key = nullptr;
         X509 *cert = nullptr;
         BIO *bio_x509_cert = nullptr;
 
-        auto free_openssl = mb::util::finally([&]{
-            EVP_PKEY_free(public_key);
+        auto free_openssl = util::finally([&]{
             X509_free(cert);
             BIO_free(bio_x509_cert);
         });
@@ -156,7 +156,7 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
             LOGE("Failed to create BIO for X509 certificate: %s",
                  hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
         // Load DER-encoded certificate
@@ -164,29 +164,297 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
         if (!cert) {
             LOGE("Failed to load X509 certificate: %s", hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
         // Get public key from certificate
-        public_key = X509_get_pubkey(cert);
+        EVP_PKEY *public_key = X509_get_pubkey(cert);
         if (!public_key) {
             LOGE("Failed to load public key from X509 certificate: %s",
                  hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
-        SigVerifyResult result =
-                verify_signature_with_key(path, sig_path, public_key);
-        if (result == SigVerifyResult::INVALID) {
-            // Keep trying ...
-            continue;
+        result.push_back(public_key);
+    }
+
+    keys.swap(result);
+    keys_loaded = true;
+    *keys_out = &keys;
+    return true;
+}
+
+struct SigCacheEntry
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned char sig_digest[SHA512_DIGEST_LENGTH];
+    SigVerifyResult result;
+};
+
+static std::mutex sig_cache_lock;
+static std::vector<SigCacheEntry> sig_cache;
+
+static inline bool timespec_equal(const struct timespec &a,
+                                  const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool sig_cache_matches(const SigCacheEntry &entry,
+                              const struct stat &sb,
+                              const unsigned char *sig_digest)
+{
+    return entry.dev == sb.st_dev
+            && entry.ino == sb.st_ino
+            && entry.size == sb.st_size
+            && timespec_equal(entry.mtime, sb.st_mtim)
+            && timespec_equal(entry.ctime, sb.st_ctim)
+            && memcmp(entry.sig_digest, sig_digest,
+                      sizeof(entry.sig_digest)) == 0;
+}
+
+static bool sig_cache_find(const struct stat &sb,
+                           const unsigned char *sig_digest,
+                           SigVerifyResult *result_out)
+{
+    std::lock_guard<std::mutex> lock(sig_cache_lock);
+
+    for (auto const &entry : sig_cache) {
+        if (sig_cache_matches(entry, sb, sig_digest)) {
+            *result_out = entry.result;
+            return true;
         }
+    }
+
+    return false;
+}
+
+static void sig_cache_add(const struct stat &sb,
+                          const unsigned char *sig_digest,
+                          SigVerifyResult result)
+{
+    std::lock_guard<std::mutex> lock(sig_cache_lock);
+
+    SigCacheEntry entry;
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.ctime = sb.st_ctim;
+    memcpy(entry.sig_digest, sig_digest, sizeof(entry.sig_digest));
+    entry.result = result;
+
+    for (auto &e : sig_cache) {
+        if (e.dev == entry.dev && e.ino == entry.ino) {
+            e = entry;
+            return;
+        }
+    }
+
+    if (sig_cache.size() >= SIG_CACHE_MAX) {
+        sig_cache.erase(sig_cache.begin());
+    }
+    sig_cache.push_back(entry);
+}
+
+/*!
+ * \brief Verify a file's signature against all certificates in valid_certs
+ *
+ * Results are cached by the file's (device, inode, size, mtime, ctime) and the
+ * SHA512 digest of the signature file, so repeated verification of an
+ * unchanged file does not need to hash it again. Failures are not cached.
+ */
+SigVerifyResult verify_signature(const char *path, const char *sig_path)
+{
+    const std::vector<EVP_PKEY *> *keys;
+    if (!get_public_keys(&keys)) {
+        return SigVerifyResult::FAILURE;
+    }
+    if (keys->empty()) {
+        return SigVerifyResult::INVALID;
+    }
+
+    std::vector<unsigned char> sig;
+    if (!util::file_read_all(sig_path, &sig)) {
+        LOGE("%s: Failed to read signature file: %s",
+             sig_path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+
+    unsigned char sig_digest[SHA512_DIGEST_LENGTH];
+    if (!EVP_Digest(sig.data(), sig.size(), sig_digest, nullptr, EVP_sha512(),
+                    nullptr)) {
+        LOGE("%s: Failed to compute digest of signature", sig_path);
+        openssl_log_errors();
+        return SigVerifyResult::FAILURE;
+    }
 
+    // Stat the same file that is hashed below
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open input file: %s", path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat input file: %s", path, strerror(errno));
+        close(fd);
+        return SigVerifyResult::FAILURE;
+    }
+
+    SigVerifyResult result;
+    if (sig_cache_find(sb, sig_digest, &result)) {
+        close(fd);
         return result;
     }
 
-    return SigVerifyResult::INVALID;
+    BIO *bio_data_in = nullptr;
+    BIO *bio_sig_in = nullptr;
+
+    auto free_openssl = util::finally([&]{
+        BIO_free(bio_data_in);
+        BIO_free(bio_sig_in);
+    });
+
+    bio_data_in = BIO_new_fd(fd, BIO_CLOSE);
+    if (!bio_data_in) {
+        LOGE("%s: Failed to open input file", path);
+        openssl_log_errors();
+        close(fd);
+        return SigVerifyResult::FAILURE;
+    }
+    bio_sig_in = BIO_new_mem_buf((void *) sig.data(), sig.size());
+    if (!bio_sig_in) {
+        LOGE("%s: Failed to open signature file", sig_path);
+        openssl_log_errors();
+        return SigVerifyResult::FAILURE;
+    }
+
+    bool valid;
+    if (!mb::sign::verify_data_with_keys(bio_data_in, bio_sig_in,
+                                         keys->data(), keys->size(), &valid)) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    result = valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID;
+    sig_cache_add(sb, sig_digest, result);
+    return result;
+}
+
+/*!
+ * \brief Verify the signature of data in memory
+ *
+ * This is meant for data that can no longer change, such as the contents of a
+ * sealed memfd, so the result is not cached.
+ *
+ * \param data Data to verify
+ * \param size Size of \p data
+ * \param sig Signature contents
+ * \param sig_size Size of \p sig
+ */
+SigVerifyResult verify_signature_data(const void *data, size_t size,
+                                      const void *sig, size_t sig_size)
+{
+    const std::vector<EVP_PKEY *> *keys;
+    if (!get_public_keys(&keys)) {
+        return SigVerifyResult::FAILURE;
+    }
+    if (keys->empty()) {
+        return SigVerifyResult::INVALID;
+    }
+
+    if (size > INT_MAX || sig_size > INT_MAX) {
+        LOGE("In-memory data is too large");
+        return SigVerifyResult::FAILURE;
+    }
+
+    BIO *bio_data_in = nullptr;
+    BIO *bio_sig_in = nullptr;
+
+    auto free_openssl = util::finally([&]{
+        BIO_free(bio_data_in);
+        BIO_free(bio_sig_in);
+    });
+
+    // Cast to (void *) is okay since BIO_new_mem_buf() creates a read-only
+    // BIO object
+    bio_data_in = BIO_new_mem_buf((void *) data, size);
+    bio_sig_in = BIO_new_mem_buf((void *) sig, sig_size);
+    if (!bio_data_in || !bio_sig_in) {
+        LOGE("Failed to create BIO for in-memory data");
+        openssl_log_errors();
+        return SigVerifyResult::FAILURE;
+    }
+
+    bool valid;
+    if (!mb::sign::verify_data_with_keys(bio_data_in, bio_sig_in,
+                                         keys->data(), keys->size(), &valid)) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    return valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID;
+}
+
+/*!
+ * \brief Verify the signatures of several files concurrently
+ *
+ * The public keys are loaded once and the files are hashed on multiple
+ * threads. Version 2 signatures are split into chunks, so even a single large
+ * file is hashed in parallel. The signature cache is not used.
+ *
+ * \param files List of (path, signature path) pairs
+ * \param results_out Output for one result per file
+ *
+ * \return Whether every signature is valid
+ */
+bool verify_signatures(const std::vector<std::pair<std::string, std::string>> &files,
+                       std::vector<SigVerifyResult> *results_out)
+{
+    std::vector<SigVerifyResult> results(files.size(),
+                                         SigVerifyResult::INVALID);
+    bool all_valid = false;
+
+    auto set_results = util::finally([&]{
+        if (results_out) {
+            results_out->swap(results);
+        }
+    });
+
+    const std::vector<EVP_PKEY *> *keys;
+    if (!get_public_keys(&keys)) {
+        results.assign(files.size(), SigVerifyResult::FAILURE);
+        return false;
+    }
+    if (keys->empty()) {
+        return false;
+    }
+
+    std::vector<mb::sign::VerifyFileInfo> infos(files.size());
+    for (size_t i = 0; i < files.size(); ++i) {
+        infos[i].path = files[i].first.c_str();
+        infos[i].sig_path = files[i].second.c_str();
+    }
+
+    mb::sign::verify_files(infos.data(), infos.size(), keys->data(),
+                           keys->size(), 0);
+
+    all_valid = true;
+    for (size_t i = 0; i < infos.size(); ++i) {
+        if (!infos[i].ok) {
+            results[i] = SigVerifyResult::FAILURE;
+        } else if (infos[i].valid) {
+            results[i] = SigVerifyResult::VALID;
+        }
+        all_valid = all_valid && results[i] == SigVerifyResult::VALID;
+    }
+
+    return all_valid;
 }
 
 static void sigverify_usage(FILE *stream)
@@ -19,6 +19,12 @@
 
 #pragma once
 
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstddef>
+
 namespace mb
 {
 
@@ -30,6 +36,10 @@ enum SigVerifyResult
 };
 
 SigVerifyResult verify_signature(const char *path, const char *sig_path);
+SigVerifyResult verify_signature_data(const void *data, size_t size,
+                                      const void *sig, size_t sig_size);
+bool verify_signatures(const std::vector<std::pair<std::string, std::string>> &files,
+                       std::vector<SigVerifyResult> *results_out);
 
 int sigverify_main(int argc, char *argv[]);
 
@@ -19,13 +19,22 @@
 
 #include "switcher.h"
 
+#include <algorithm>
+#include <memory>
+#include <mutex>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -37,14 +46,29 @@
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 
+#include "block_dev_resolver.h"
 #include "multiboot.h"
+#include "rom_inventory.h"
 #include "roms.h"
 
 #define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+#define STAGING_DIR "/data/multiboot/staging"
+
+#define CHECKSUM_TAG_SHA512             "sha512"
+#define CHECKSUM_TAG_SHA512_TREE        "sha512tree"
+
+// Maximum number of images for which the computed hashes are remembered
+#define IMAGE_HASH_CACHE_MAX            16
+
+// Size of the aligned chunks compared against the block device before writing
+#define FLASH_COMPARE_CHUNK_SIZE        (1024 * 1024)
+// Alignment of the buffers used for O_DIRECT I/O
+#define FLASH_DIRECT_IO_ALIGN           4096
 
 namespace mb
 {
@@ -55,7 +79,8 @@ namespace mb
  * \param props Pointer to properties map
  * \param rom_id ROM ID
  * \param image Image filename (without directory)
- * \param sha512_out SHA512 hex digest output
+ * \param algo_out Hash algorithm output
+ * \param hash_out Hex digest output
  *
  * \return ChecksumsGetResult::FOUND if the hash was successfully retrieved,
  *         ChecksumsGetResult::NOT_FOUND if the hash does not exist in the map,
@@ -64,7 +89,8 @@ namespace mb
 ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *props,
                                  const std::string &rom_id,
                                  const std::string &image,
-                                 std::string *sha512_out)
+                                 ChecksumAlgorithm *algo_out,
+                                 std::string *hash_out)
 {
     std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
 
@@ -82,13 +108,17 @@ ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *p
     if (pos != std::string::npos) {
         std::string algo = value.substr(0, pos);
         std::string hash = value.substr(pos + 1);
-        if (algo != "sha512") {
+        if (algo == CHECKSUM_TAG_SHA512) {
+            *algo_out = ChecksumAlgorithm::SHA512;
+        } else if (algo == CHECKSUM_TAG_SHA512_TREE) {
+            *algo_out = ChecksumAlgorithm::SHA512_TREE;
+        } else {
             LOGE("%s: Invalid hash algorithm: %s",
                  checksums_path.c_str(), algo.c_str());
             return ChecksumsGetResult::MALFORMED;
         }
 
-        *sha512_out = hash;
+        *hash_out = hash;
         return ChecksumsGetResult::FOUND;
     } else {
         LOGE("%s: Invalid checksum property: %s=%s",
@@ -103,19 +133,49 @@ ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *p
  * \param props Pointer to properties map
  * \param rom_id ROM ID
  * \param image Image filename (without directory)
- * \param sha512 SHA512 hex digest
+ * \param algo Hash algorithm
+ * \param hash Hex digest
  */
 void checksums_update(std::unordered_map<std::string, std::string> *props,
                       const std::string &rom_id,
                       const std::string &image,
-                      const std::string &sha512)
+                      ChecksumAlgorithm algo,
+                      const std::string &hash)
 {
     std::string key(rom_id);
     key += "/";
     key += image;
 
-    (*props)[key] = "sha512:";
-    (*props)[key] += sha512;
+    (*props)[key] = algo == ChecksumAlgorithm::SHA512_TREE
+            ? CHECKSUM_TAG_SHA512_TREE ":" : CHECKSUM_TAG_SHA512 ":";
+    (*props)[key] += hash;
+}
+
+/*!
+ * \brief Compute the hex digest of some data
+ *
+ * \param data Data to hash
+ * \param size Size of data
+ * \param algo Hash algorithm
+ * \param hash_out Hex digest output
+ *
+ * \return Whether the hash was successfully computed
+ */
+bool checksums_compute(const void *data, size_t size, ChecksumAlgorithm algo,
+                       std::string *hash_out)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    if (algo == ChecksumAlgorithm::SHA512_TREE) {
+        if (!util::sha512_tree_hash(data, size, digest)) {
+            return false;
+        }
+    } else {
+        SHA512(static_cast<const unsigned char *>(data), size, digest);
+    }
+
+    *hash_out = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    return true;
 }
 
 /*!
@@ -147,29 +207,27 @@ bool checksums_write(const std::unordered_map<std::string, std::string> &props)
 {
     std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
 
-    if (remove(checksums_path.c_str()) < 0 && errno != ENOENT) {
-        LOGW("%s: Failed to remove file: %s",
-             checksums_path.c_str(), strerror(errno));
-    }
-
     util::mkdir_parent(checksums_path, 0755);
-    util::create_empty_file(checksums_path);
 
-    if (!util::chown(checksums_path, 0, 0, 0)) {
-        LOGW("%s: Failed to chown file: %s",
-             checksums_path.c_str(), strerror(errno));
-    }
-    if (chmod(checksums_path.c_str(), 0700) < 0) {
-        LOGW("%s: Failed to chmod file: %s",
-             checksums_path.c_str(), strerror(errno));
+    // Replace the file atomically so that an interrupted write can't leave
+    // behind a truncated list of checksums
+    util::PropertyFile file(checksums_path);
+    file.clear();
+    for (auto const &pair : props) {
+        file.set(pair.first, pair.second);
     }
 
-    if (!util::property_file_write_all(checksums_path, props)) {
+    if (!file.save(0700)) {
         LOGW("%s: Failed to write new properties: %s",
              checksums_path.c_str(), strerror(errno));
         return false;
     }
 
+    if (!util::chown(checksums_path, 0, 0, 0)) {
+        LOGW("%s: Failed to chown file: %s",
+             checksums_path.c_str(), strerror(errno));
+    }
+
     return true;
 }
 
@@ -179,15 +237,499 @@ struct Flashable
     std::string block_dev;
     std::string expected_hash;
     std::string hash;
-    unsigned char *data = nullptr;
-    std::size_t size = 0;
+    // Private copy of the image that is flashed after verification
+    int fd = -1;
+    uint64_t size = 0;
 };
 
+struct ImageHashCacheEntry
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    ChecksumAlgorithm algo;
+    std::string hash;
+};
+
+static std::mutex image_hash_cache_lock;
+static std::vector<ImageHashCacheEntry> image_hash_cache;
+
+static inline bool timespec_equal(const struct timespec &a,
+                                  const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static inline bool same_file_state(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev
+            && a.st_ino == b.st_ino
+            && a.st_size == b.st_size
+            && timespec_equal(a.st_mtim, b.st_mtim)
+            && timespec_equal(a.st_ctim, b.st_ctim);
+}
+
+/*!
+ * \brief Look up the previously computed hash of an unchanged image
+ *
+ * The ctime is part of the key because it cannot be set from userspace, so
+ * restoring the mtime after modifying an image does not produce a false hit.
+ */
+static bool image_hash_cache_find(const struct stat &sb,
+                                  ChecksumAlgorithm algo,
+                                  std::string *hash_out)
+{
+    std::lock_guard<std::mutex> lock(image_hash_cache_lock);
+
+    for (auto const &entry : image_hash_cache) {
+        if (entry.dev == sb.st_dev
+                && entry.ino == sb.st_ino
+                && entry.size == sb.st_size
+                && timespec_equal(entry.mtime, sb.st_mtim)
+                && timespec_equal(entry.ctime, sb.st_ctim)
+                && entry.algo == algo) {
+            *hash_out = entry.hash;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void image_hash_cache_add(const struct stat &sb,
+                                 ChecksumAlgorithm algo,
+                                 const std::string &hash)
+{
+    std::lock_guard<std::mutex> lock(image_hash_cache_lock);
+
+    ImageHashCacheEntry entry;
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.ctime = sb.st_ctim;
+    entry.algo = algo;
+    entry.hash = hash;
+
+    for (auto &e : image_hash_cache) {
+        if (e.dev == entry.dev && e.ino == entry.ino) {
+            e = std::move(entry);
+            return;
+        }
+    }
+
+    if (image_hash_cache.size() >= IMAGE_HASH_CACHE_MAX) {
+        image_hash_cache.erase(image_hash_cache.begin());
+    }
+    image_hash_cache.push_back(std::move(entry));
+}
+
+struct ChecksumCtx
+{
+    ChecksumAlgorithm algo;
+    SHA512_CTX sha512;
+    util::Sha512TreeCtx tree;
+};
+
+static bool checksum_init(ChecksumCtx *ctx, ChecksumAlgorithm algo)
+{
+    ctx->algo = algo;
+
+    if (algo == ChecksumAlgorithm::SHA512_TREE) {
+        return util::sha512_tree_init(&ctx->tree);
+    } else {
+        return SHA512_Init(&ctx->sha512);
+    }
+}
+
+static bool checksum_update(ChecksumCtx *ctx, const void *data, size_t size)
+{
+    if (ctx->algo == ChecksumAlgorithm::SHA512_TREE) {
+        return util::sha512_tree_update(&ctx->tree, data, size);
+    } else {
+        return SHA512_Update(&ctx->sha512, data, size);
+    }
+}
+
+static bool checksum_final(ChecksumCtx *ctx, std::string *hash_out)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    if (ctx->algo == ChecksumAlgorithm::SHA512_TREE) {
+        if (!util::sha512_tree_final(digest, &ctx->tree)) {
+            return false;
+        }
+    } else if (!SHA512_Final(digest, &ctx->sha512)) {
+        return false;
+    }
+
+    *hash_out = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    return true;
+}
+
+static ssize_t read_fully(int fd, void *buf, size_t size)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+static ssize_t pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread(fd, static_cast<char *>(buf) + total, size - total,
+                          offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+static bool pwrite_fully(int fd, const void *buf, size_t size,
+                         uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pwrite(fd, static_cast<const char *>(buf) + total,
+                           size - total, offset + total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            if (n == 0) {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create an anonymous file in the root-only staging directory
+ */
+static int open_staging_file(const std::string &staging_dir)
+{
+    int fd;
+
+#ifdef O_TMPFILE
+    fd = open(staging_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+
+    // Kernel or filesystem doesn't support O_TMPFILE
+    std::string path(staging_dir);
+    path += "/image.XXXXXX";
+
+    fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unlink(path.c_str());
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/*!
+ * \brief Hash the staged copy of an image
+ */
+static bool hash_staged_image(Flashable &f, ChecksumAlgorithm algo,
+                              std::vector<unsigned char> &buf)
+{
+    ChecksumCtx ctx;
+    if (!checksum_init(&ctx, algo)) {
+        return false;
+    }
+
+    for (uint64_t offset = 0; offset < f.size;) {
+        ssize_t n = pread_fully(f.fd, buf.data(), buf.size(), offset);
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+
+        if (!checksum_update(&ctx, buf.data(), n)) {
+            return false;
+        }
+
+        offset += n;
+    }
+
+    return checksum_final(&ctx, &f.hash);
+}
+
+/*!
+ * \brief Copy an image to a private staging file and compute its checksum
+ *
+ * An app can modify the image at any time, so everything after the checksum
+ * verification only uses the staged copy in \a staging_dir, which is only
+ * accessible by root. The image is copied and hashed one chunk at a time, so
+ * the memory usage does not depend on the size of the image.
+ *
+ * The source file is stat'ed before and after copying through the same file
+ * descriptor. If nothing changed in between, a previously computed hash of the
+ * same file is reused and the copy is not hashed.
+ */
+static bool stage_image(Flashable &f, const std::string &staging_dir,
+                        ChecksumAlgorithm algo)
+{
+    int fd = open(f.image.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    } else if (!S_ISREG(sb.st_mode)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    f.fd = open_staging_file(staging_dir);
+    if (f.fd < 0) {
+        return false;
+    }
+
+    std::string cached_hash;
+    bool have_cached = image_hash_cache_find(sb, algo, &cached_hash);
+
+    ChecksumCtx ctx;
+    if (!have_cached && !checksum_init(&ctx, algo)) {
+        return false;
+    }
+
+    std::vector<unsigned char> buf(FLASH_COMPARE_CHUNK_SIZE);
+    f.size = 0;
+
+    while (true) {
+        ssize_t n = read_fully(fd, buf.data(), buf.size());
+        if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!have_cached && !checksum_update(&ctx, buf.data(), n)) {
+            return false;
+        }
+
+        if (!pwrite_fully(f.fd, buf.data(), n, f.size)) {
+            return false;
+        }
+
+        f.size += n;
+    }
+
+    struct stat sb_after;
+    bool stable = fstat(fd, &sb_after) == 0 && same_file_state(sb, sb_after)
+            && static_cast<uint64_t>(sb.st_size) == f.size;
+
+    if (!have_cached) {
+        if (!checksum_final(&ctx, &f.hash)) {
+            return false;
+        }
+    } else if (stable) {
+        LOGD("%s: Using cached checksum", f.image.c_str());
+        f.hash = std::move(cached_hash);
+        return true;
+    } else if (!hash_staged_image(f, algo, buf)) {
+        // The file changed while it was being copied
+        return false;
+    }
+
+    if (stable) {
+        image_hash_cache_add(sb, algo, f.hash);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the size that O_DIRECT I/O on \a fd must be aligned to
+ */
+static std::size_t get_direct_io_alignment(int fd)
+{
+    struct stat sb;
+    int sector_size;
+
+    if (fstat(fd, &sb) == 0 && S_ISBLK(sb.st_mode)
+            && ioctl(fd, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+        return static_cast<std::size_t>(sector_size);
+    }
+
+    // Filesystems can require up to the block size
+    return FLASH_DIRECT_IO_ALIGN;
+}
+
+static unsigned char * alloc_aligned(std::size_t size)
+{
+    void *ptr;
+
+    int ret = posix_memalign(&ptr, FLASH_DIRECT_IO_ALIGN, size);
+    if (ret != 0) {
+        errno = ret;
+        return nullptr;
+    }
+
+    return static_cast<unsigned char *>(ptr);
+}
+
+/*!
+ * \brief Write an image to a block device, skipping chunks that are unchanged
+ *
+ * The current contents of the block device are read in aligned chunks of
+ * FLASH_COMPARE_CHUNK_SIZE bytes and only the chunks that differ from the
+ * staged image are written.
+ *
+ * The block device is opened with O_DIRECT and O_SYNC, so the writes bypass
+ * the page cache and are on disk once pwrite() returns. Each written chunk is
+ * read back and compared in the same pass. If the last chunk does not end on a
+ * sector boundary, it is padded with the existing contents of the device. If
+ * the device does not support O_DIRECT, the image is written through the page
+ * cache and fsync()'d instead.
+ */
+static bool write_image_changed_chunks(const std::string &block_dev,
+                                       int src_fd, uint64_t size)
+{
+    bool direct = true;
+
+    int fd = open(block_dev.c_str(), O_RDWR | O_DIRECT | O_SYNC | O_CLOEXEC);
+    if (fd < 0 && errno == EINVAL) {
+        direct = false;
+        fd = open(block_dev.c_str(), O_RDWR | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    std::size_t align = direct ? get_direct_io_alignment(fd) : 1;
+    // Chunks are a multiple of the alignment, plus room to pad the last one
+    std::size_t buf_size = FLASH_COMPARE_CHUNK_SIZE + align;
+
+    std::unique_ptr<unsigned char, decltype(free) *> src_buf(
+            alloc_aligned(buf_size), free);
+    std::unique_ptr<unsigned char, decltype(free) *> dev_buf(
+            alloc_aligned(buf_size), free);
+    if (!src_buf || !dev_buf) {
+        return false;
+    }
+
+    std::size_t chunks = 0;
+    std::size_t changed = 0;
+
+    for (uint64_t offset = 0; offset < size;
+            offset += FLASH_COMPARE_CHUNK_SIZE) {
+        std::size_t to_check = std::min<uint64_t>(
+                size - offset, FLASH_COMPARE_CHUNK_SIZE);
+        std::size_t to_write = (to_check + align - 1) / align * align;
+
+        ++chunks;
+
+        ssize_t n = pread_fully(src_fd, src_buf.get(), to_check, offset);
+        if (n < 0) {
+            return false;
+        } else if (static_cast<std::size_t>(n) != to_check) {
+            errno = EIO;
+            return false;
+        }
+
+        // If the chunk can't be fully read, just try writing it
+        n = pread_fully(fd, dev_buf.get(), to_write, offset);
+        bool have_dev = n >= 0 && static_cast<std::size_t>(n) >= to_check;
+        if (have_dev
+                && memcmp(dev_buf.get(), src_buf.get(), to_check) == 0) {
+            continue;
+        }
+
+        if (to_write > to_check) {
+            // Keep whatever follows the image in the last sector
+            if (n < 0 || static_cast<std::size_t>(n) != to_write) {
+                errno = EIO;
+                return false;
+            }
+            memcpy(src_buf.get() + to_check, dev_buf.get() + to_check,
+                   to_write - to_check);
+        }
+
+        ++changed;
+
+        if (!pwrite_fully(fd, src_buf.get(), to_write, offset)) {
+            return false;
+        }
+
+        // The read can't be served from the page cache, so this verifies what
+        // the device actually stored
+        if (direct) {
+            n = pread_fully(fd, dev_buf.get(), to_write, offset);
+            if (n < 0) {
+                return false;
+            } else if (static_cast<std::size_t>(n) != to_write
+                    || memcmp(dev_buf.get(), src_buf.get(), to_write) != 0) {
+                LOGE("%s: Verification failed at offset %" PRIu64,
+                     block_dev.c_str(), offset);
+                errno = EIO;
+                return false;
+            }
+        }
+    }
+
+    if (!direct && changed > 0 && fsync(fd) < 0) {
+        return false;
+    }
+
+    LOGD("%s: Wrote %zu of %zu chunks%s", block_dev.c_str(), changed, chunks,
+         direct ? " (direct I/O)" : "");
+
+    return true;
+}
+
 /*!
- * \brief Perform non-recursive search for a block device
+ * \brief Find the block device for a partition
  *
- * This function will non-recursively search \a search_dirs for a block device
- * named \a partition. \a /dev/block/ is implicitly added to the search paths.
+ * The partition is first looked up by name in the block device resolver. If
+ * that fails, this function will non-recursively search \a search_dirs for a
+ * block device named \a partition. \a /dev/block/ is implicitly added to the
+ * search paths.
  *
  * \param search_dirs Search paths
  * \param partition Block device name
@@ -199,13 +741,12 @@ static std::string find_block_dev(const std::vector<std::string> &search_dirs,
 {
     struct stat sb;
 
-    if (mb::starts_with(partition, "mmcblk")) {
-        std::string path("/dev/block/");
-        path += partition;
-
-        if (stat(path.c_str(), &sb) == 0) {
-            return path;
-        }
+    auto &resolver = BlockDevResolver::global();
+    std::string block_dev = mb::starts_with(partition, "mmcblk")
+            ? resolver.resolve({ "/dev/block/" + partition })
+            : resolver.find_by_name(partition);
+    if (!block_dev.empty()) {
+        return block_dev;
     }
 
     for (auto const &path : search_dirs) {
@@ -317,10 +858,7 @@ SwitchRomResult switch_rom(const std::string &id,
     bootimg_path += "/boot.img";
 
     // Verify ROM ID
-    Roms roms;
-    roms.add_installed();
-
-    auto r = roms.find_by_id(id);
+    auto r = RomInventory::global().find_by_id(id);
     if (!r) {
         LOGE("Invalid ROM ID: %s", id.c_str());
         return SwitchRomResult::FAILED;
@@ -332,14 +870,24 @@ SwitchRomResult switch_rom(const std::string &id,
         return SwitchRomResult::FAILED;
     }
 
-    // We'll read the files we want to flash into memory so a malicious app
-    // can't change the file between the hash verification step and flashing
-    // step.
+    // We'll copy the files we want to flash to a root-only staging directory
+    // so a malicious app can't change the file between the hash verification
+    // step and flashing step.
+    std::string staging_dir(get_raw_path(STAGING_DIR));
+
+    if (!util::mkdir_recursive(staging_dir, 0700)
+            || chmod(staging_dir.c_str(), 0700) < 0) {
+        LOGE("%s: Failed to create directory: %s",
+             staging_dir.c_str(), strerror(errno));
+        return SwitchRomResult::FAILED;
+    }
 
     std::vector<Flashable> flashables;
-    auto free_flashables = util::finally([&]{
+    auto close_flashables = util::finally([&]{
         for (Flashable &f : flashables) {
-            free(f.data);
+            if (f.fd >= 0) {
+                close(f.fd);
+            }
         }
     });
 
@@ -355,29 +903,33 @@ SwitchRomResult switch_rom(const std::string &id,
     checksums_read(&props);
 
     for (Flashable &f : flashables) {
-        // If memory becomes an issue, an alternative method is to create a
-        // temporary directory in /data/multiboot/ that's only writable by root
-        // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
-            LOGE("%s: Failed to read image: %s",
+        // Get expected checksum. New checksums use the tree hash.
+        ChecksumAlgorithm algo = ChecksumAlgorithm::SHA512_TREE;
+        ChecksumsGetResult ret = ChecksumsGetResult::NOT_FOUND;
+
+        if (!force_update_checksums) {
+            ret = checksums_get(&props, id, util::base_name(f.image), &algo,
+                                &f.expected_hash);
+            if (ret == ChecksumsGetResult::MALFORMED) {
+                return SwitchRomResult::CHECKSUM_INVALID;
+            }
+        }
+
+        // Get actual checksum with the same algorithm while staging the
+        // image. Switching back and forth between ROMs usually flashes the
+        // same images again, so this reuses the hash if the file is unchanged
+        // since it was last computed.
+        if (!stage_image(f, staging_dir, algo)) {
+            LOGE("%s: Failed to stage image: %s",
                  f.image.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
 
-        // Get actual sha512sum
-        unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(f.data, f.size, digest);
-        f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
-
         if (force_update_checksums) {
-            checksums_update(&props, id, util::base_name(f.image), f.hash);
-        }
-
-        // Get expected sha512sum
-        ChecksumsGetResult ret = checksums_get(
-                &props, id, util::base_name(f.image), &f.expected_hash);
-        if (ret == ChecksumsGetResult::MALFORMED) {
-            return SwitchRomResult::CHECKSUM_INVALID;
+            checksums_update(&props, id, util::base_name(f.image), algo,
+                             f.hash);
+            f.expected_hash = f.hash;
+            ret = ChecksumsGetResult::FOUND;
         }
 
         // Verify hashes if we have an expected hash
@@ -400,9 +952,7 @@ SwitchRomResult switch_rom(const std::string &id,
 
     // Now we can flash the images
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
+        if (!write_image_changed_chunks(f.block_dev, f.fd, f.size)) {
             LOGE("%s: Failed to write image: %s",
                  f.block_dev.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
@@ -445,10 +995,7 @@ bool set_kernel(const std::string &id, const std::string &boot_blockdev)
     bootimg_path += "/boot.img";
 
     // Verify ROM ID
-    Roms roms;
-    roms.add_installed();
-
-    auto r = roms.find_by_id(id);
+    auto r = RomInventory::global().find_by_id(id);
     if (!r) {
         LOGE("Invalid ROM ID: %s", id.c_str());
         return false;
@@ -460,35 +1007,37 @@ bool set_kernel(const std::string &id, const std::string &boot_blockdev)
         return false;
     }
 
-    unsigned char *data;
-    std::size_t size;
+    // The block device is mapped, so the image is not copied to the heap
+    util::FileView image;
 
-    if (!util::file_read_all(boot_blockdev, &data, &size)) {
+    if (!image.open(boot_blockdev)) {
         LOGE("%s: Failed to read block device: %s",
              boot_blockdev.c_str(), strerror(errno));
         return false;
     }
 
-    auto free_data = util::finally([&]{
-        free(data);
-    });
-
-    // Get actual sha512sum
-    unsigned char digest[SHA512_DIGEST_LENGTH];
-    SHA512(data, size, digest);
-    std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    // Get actual checksum
+    std::string hash;
+    if (!checksums_compute(image.data(), image.size(),
+                           ChecksumAlgorithm::SHA512_TREE, &hash)) {
+        LOGE("%s: Failed to compute checksum", bootimg_path.c_str());
+        return false;
+    }
 
     // Add to checksums.prop
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
-    checksums_update(&props, id, "boot.img", hash);
+    checksums_update(&props, id, "boot.img", ChecksumAlgorithm::SHA512_TREE,
+                     hash);
 
     // NOTE: This function isn't responsible for updating the checksums for
     //       any extra images. We don't want to mask any malicious changes.
 
     // Cast is okay. The data is just passed to fwrite (ie. no signed
     // extension issues)
-    if (!util::file_write_data(bootimg_path, (char *) data, size)) {
+    if (!util::file_write_data(
+            bootimg_path, reinterpret_cast<const char *>(image.data()),
+            image.size())) {
         LOGE("%s: Failed to write image: %s",
              bootimg_path.c_str(), strerror(errno));
         return false;
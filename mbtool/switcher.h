@@ -23,6 +23,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include <cstddef>
+
 namespace mb
 {
 
@@ -33,14 +35,26 @@ enum class ChecksumsGetResult
     MALFORMED
 };
 
+enum class ChecksumAlgorithm
+{
+    // "sha512:<hex digest>"
+    SHA512,
+    // "sha512tree:<hex digest>" (see util::sha512_tree_hash())
+    SHA512_TREE
+};
+
 ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *props,
                                  const std::string &rom_id,
                                  const std::string &image,
-                                 std::string *sha512_out);
+                                 ChecksumAlgorithm *algo_out,
+                                 std::string *hash_out);
 void checksums_update(std::unordered_map<std::string, std::string> *props,
                       const std::string &rom_id,
                       const std::string &image,
-                      const std::string &sha512);
+                      ChecksumAlgorithm algo,
+                      const std::string &hash);
+bool checksums_compute(const void *data, size_t size, ChecksumAlgorithm algo,
+                       std::string *hash_out);
 bool checksums_read(std::unordered_map<std::string, std::string> *props);
 bool checksums_write(const std::unordered_map<std::string, std::string> &props);
 
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <sys/resource.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/directory.h"
+
+#define PROC_SELF_IO            "/proc/self/io"
+
+#define BOOT_TRACE_MAX_STEPS    64
+
+#ifndef CLOCK_BOOTTIME
+#define CLOCK_BOOTTIME          7
+#endif
+
+namespace mb
+{
+
+struct TraceStage
+{
+    std::string name;
+    TraceCounters delta;
+};
+
+struct BootTraceStep
+{
+    const char *name;
+    uint64_t start_us;
+};
+
+static std::mutex g_stages_lock;
+static std::vector<TraceStage> g_stages;
+
+static BootTraceStep g_boot_steps[BOOT_TRACE_MAX_STEPS];
+// Total number of steps recorded (including those that were overwritten)
+static size_t g_boot_steps_count;
+
+static uint64_t timeval_to_us(const struct timeval &tv)
+{
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static bool read_proc_io(TraceCounters *out)
+{
+    autoclose::file fp(std::fopen(PROC_SELF_IO, "re"), std::fclose);
+    if (!fp) {
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        char key[32];
+        uint64_t value;
+
+        if (sscanf(line, "%31[^:]: %" SCNu64, key, &value) != 2) {
+            continue;
+        }
+
+        if (strcmp(key, "rchar") == 0) {
+            out->rchar = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            out->wchar = value;
+        } else if (strcmp(key, "syscr") == 0) {
+            out->syscr = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            out->syscw = value;
+        } else if (strcmp(key, "read_bytes") == 0) {
+            out->read_bytes = value;
+        } else if (strcmp(key, "write_bytes") == 0) {
+            out->write_bytes = value;
+        }
+    }
+
+    free(line);
+    return true;
+}
+
+/*!
+ * \brief Sample the current time, CPU usage, and I/O counters
+ *
+ * Counters that are not available (eg. if the kernel was built without task
+ * I/O accounting) are left as 0.
+ *
+ * \return False if the time could not be read
+ */
+bool trace_sample(TraceCounters *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return false;
+    }
+    out->time_us = static_cast<uint64_t>(ts.tv_sec) * 1000000
+            + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+
+    struct rusage self;
+    struct rusage children;
+    if (getrusage(RUSAGE_SELF, &self) == 0
+            && getrusage(RUSAGE_CHILDREN, &children) == 0) {
+        out->user_us = timeval_to_us(self.ru_utime)
+                + timeval_to_us(children.ru_utime);
+        out->sys_us = timeval_to_us(self.ru_stime)
+                + timeval_to_us(children.ru_stime);
+    }
+
+    read_proc_io(out);
+
+    return true;
+}
+
+/*!
+ * \brief Clear the recorded stages
+ */
+void trace_reset()
+{
+    std::lock_guard<std::mutex> lock(g_stages_lock);
+    g_stages.clear();
+}
+
+static void append_counters(std::string &out, const TraceCounters &c)
+{
+    out += format("\"time_ms\":%" PRIu64 ".%03" PRIu64,
+                  c.time_us / 1000, c.time_us % 1000);
+    out += format(",\"user_ms\":%" PRIu64 ",\"sys_ms\":%" PRIu64,
+                  c.user_us / 1000, c.sys_us / 1000);
+    out += format(",\"syscr\":%" PRIu64 ",\"syscw\":%" PRIu64,
+                  c.syscr, c.syscw);
+    out += format(",\"rchar\":%" PRIu64 ",\"wchar\":%" PRIu64,
+                  c.rchar, c.wchar);
+    out += format(",\"read_bytes\":%" PRIu64 ",\"write_bytes\":%" PRIu64,
+                  c.read_bytes, c.write_bytes);
+}
+
+/*!
+ * \brief Get a JSON object describing all recorded stages
+ *
+ * The result is a single line of the form
+ * `{"stages":[{"name":"...","time_ms":1.234,...},...],"total":{...}}`.
+ * Stage names are expected to be plain identifiers and are not escaped.
+ */
+std::string trace_summary_json()
+{
+    std::lock_guard<std::mutex> lock(g_stages_lock);
+
+    TraceCounters total;
+    memset(&total, 0, sizeof(total));
+
+    std::string out("{\"stages\":[");
+
+    for (auto it = g_stages.begin(); it != g_stages.end(); ++it) {
+        const TraceCounters &d = it->delta;
+
+        if (it != g_stages.begin()) {
+            out += ',';
+        }
+        out += "{\"name\":\"";
+        out += it->name;
+        out += "\",";
+        append_counters(out, d);
+        out += '}';
+
+        total.time_us += d.time_us;
+        total.user_us += d.user_us;
+        total.sys_us += d.sys_us;
+        total.syscr += d.syscr;
+        total.syscw += d.syscw;
+        total.rchar += d.rchar;
+        total.wchar += d.wchar;
+        total.read_bytes += d.read_bytes;
+        total.write_bytes += d.write_bytes;
+    }
+
+    out += "],\"total\":{";
+    append_counters(out, total);
+    out += "}}";
+
+    return out;
+}
+
+ScopedTrace::ScopedTrace(std::string name)
+    : _name(std::move(name))
+{
+    trace_sample(&_start);
+}
+
+ScopedTrace::~ScopedTrace()
+{
+    TraceCounters end;
+    trace_sample(&end);
+
+    // Counters are monotonic, but guard against missing samples
+    auto diff = [](uint64_t a, uint64_t b) {
+        return a > b ? a - b : 0;
+    };
+
+    TraceCounters d;
+    d.time_us = diff(end.time_us, _start.time_us);
+    d.user_us = diff(end.user_us, _start.user_us);
+    d.sys_us = diff(end.sys_us, _start.sys_us);
+    d.syscr = diff(end.syscr, _start.syscr);
+    d.syscw = diff(end.syscw, _start.syscw);
+    d.rchar = diff(end.rchar, _start.rchar);
+    d.wchar = diff(end.wchar, _start.wchar);
+    d.read_bytes = diff(end.read_bytes, _start.read_bytes);
+    d.write_bytes = diff(end.write_bytes, _start.write_bytes);
+
+    LOGD("[Trace] %s: %" PRIu64 " ms (user %" PRIu64 " ms, sys %" PRIu64
+         " ms), %" PRIu64 " read/%" PRIu64 " write syscalls, %" PRIu64
+         "/%" PRIu64 " bytes read/written",
+         _name.c_str(), d.time_us / 1000, d.user_us / 1000, d.sys_us / 1000,
+         d.syscr, d.syscw, d.rchar, d.wchar);
+
+    std::lock_guard<std::mutex> lock(g_stages_lock);
+    g_stages.push_back({ std::move(_name), d });
+}
+
+static uint64_t boottime_us()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_BOOTTIME, &ts) < 0
+            && clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000
+            + static_cast<uint64_t>(ts.tv_nsec) / 1000;
+}
+
+void boot_trace_step(const char *name)
+{
+    BootTraceStep &step =
+            g_boot_steps[g_boot_steps_count % BOOT_TRACE_MAX_STEPS];
+    step.name = name;
+    step.start_us = boottime_us();
+    ++g_boot_steps_count;
+}
+
+/*!
+ * \brief Get a JSON object describing the recorded boot steps
+ *
+ * Each step's duration lasts until the start of the next step. The duration of
+ * the last step is measured until this function is called. If more than
+ * BOOT_TRACE_MAX_STEPS steps were recorded, only the most recent ones are
+ * included and `dropped` is the number of steps that were overwritten.
+ */
+std::string boot_trace_json()
+{
+    uint64_t now = boottime_us();
+    size_t count = g_boot_steps_count;
+    size_t first = count > BOOT_TRACE_MAX_STEPS
+            ? count - BOOT_TRACE_MAX_STEPS : 0;
+
+    std::string out = format("{\"clock\":\"boottime\",\"dropped\":%zu,"
+                             "\"steps\":[", first);
+
+    for (size_t i = first; i < count; ++i) {
+        const BootTraceStep &step = g_boot_steps[i % BOOT_TRACE_MAX_STEPS];
+        uint64_t end = i + 1 < count
+                ? g_boot_steps[(i + 1) % BOOT_TRACE_MAX_STEPS].start_us : now;
+        uint64_t duration = end > step.start_us ? end - step.start_us : 0;
+
+        if (i != first) {
+            out += ',';
+        }
+        out += format("{\"name\":\"%s\",\"start_ms\":%" PRIu64 ".%03" PRIu64
+                      ",\"duration_ms\":%" PRIu64 ".%03" PRIu64 "}",
+                      step.name,
+                      step.start_us / 1000, step.start_us % 1000,
+                      duration / 1000, duration % 1000);
+    }
+
+    out += "]}";
+
+    return out;
+}
+
+/*!
+ * \brief Write boot_trace_json() to a file
+ *
+ * The parent directory is created if it doesn't exist.
+ */
+bool boot_trace_write(const std::string &path)
+{
+    if (!util::mkdir_parent(path, 0775)) {
+        LOGW("%s: Failed to create parent directory: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    autoclose::file fp(std::fopen(path.c_str(), "we"), std::fclose);
+    if (!fp) {
+        LOGW("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string json = boot_trace_json();
+    json += '\n';
+
+    if (std::fwrite(json.data(), 1, json.size(), fp.get()) != json.size()
+            || std::fclose(fp.release()) != 0) {
+        LOGW("%s: Failed to write boot trace: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+
+namespace mb
+{
+
+struct TraceCounters
+{
+    // Monotonic time in microseconds
+    uint64_t time_us;
+    // CPU time of this process and its reaped children in microseconds
+    uint64_t user_us;
+    uint64_t sys_us;
+    // Number of read and write syscalls (from /proc/self/io)
+    uint64_t syscr;
+    uint64_t syscw;
+    // Bytes passed to read and write syscalls
+    uint64_t rchar;
+    uint64_t wchar;
+    // Bytes actually fetched from or sent to the storage layer
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+};
+
+/*!
+ * \brief RAII timer for one named stage
+ *
+ * Samples the process' counters when constructed and again when destroyed. The
+ * difference is logged and recorded so that trace_summary_json() can report
+ * all stages at once. The I/O counters include children that have been waited
+ * for, so time spent in external programs is attributed to the stage that ran
+ * them.
+ */
+class ScopedTrace
+{
+public:
+    explicit ScopedTrace(std::string name);
+    ~ScopedTrace();
+
+    ScopedTrace(const ScopedTrace &) = delete;
+    ScopedTrace & operator=(const ScopedTrace &) = delete;
+
+private:
+    std::string _name;
+    TraceCounters _start;
+};
+
+bool trace_sample(TraceCounters *out);
+void trace_reset();
+std::string trace_summary_json();
+
+/*!
+ * Boot tracing
+ *
+ * boot_trace_step() marks the end of the previous step and the start of a new
+ * one with a CLOCK_BOOTTIME timestamp. The steps are stored in a fixed-size
+ * ring buffer, so this never allocates and can be used before anything is
+ * mounted. \p name must be a string literal (or otherwise outlive the trace).
+ * These functions are not thread safe.
+ */
+void boot_trace_step(const char *name);
+std::string boot_trace_json();
+bool boot_trace_write(const std::string &path);
+
+}
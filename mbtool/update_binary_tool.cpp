@@ -32,6 +32,7 @@
 #include "mbutil/file.h"
 #include "mbutil/mount.h"
 
+#include "image.h"
 #include "multiboot.h"
 #include "wipe.h"
 
@@ -132,13 +133,56 @@ static bool do_unmount(const char *mountpoint)
     return true;
 }
 
+/*!
+ * \brief Format an image-backed mountpoint by recreating its filesystem
+ *
+ * If the mountpoint is mounted, it is unmounted first and mounted again
+ * afterwards. /data is never handled here because /data/media must be kept.
+ *
+ * \return Whether the filesystem was recreated. If false, the mountpoint is in
+ *         the same mount state as before and can still be wiped the slow way.
+ */
+static bool do_fast_format(const char *mountpoint, const char *source_path)
+{
+    bool mounted = util::is_mounted(mountpoint);
+
+    if (mounted && umount(mountpoint) < 0) {
+        LOGW(TAG "%s: Failed to unmount for formatting: %s",
+             mountpoint, strerror(errno));
+        return false;
+    }
+
+    bool ret = format_ext4_image(source_path);
+    if (!ret) {
+        LOGW(TAG "%s: Failed to recreate filesystem", source_path);
+    }
+
+    // If formatting failed early, the old filesystem is still intact
+    if (mounted && !do_mount(mountpoint)) {
+        return false;
+    }
+
+    return ret;
+}
+
 static bool do_format(const char *mountpoint)
 {
-    if (!get_paths(mountpoint, nullptr, nullptr)) {
+    const char *source_path;
+    bool is_image;
+
+    if (!get_paths(mountpoint, &source_path, &is_image)) {
         LOGE(TAG "%s: Invalid mountpoint", mountpoint);
         return false;
     }
 
+    if (is_image && strcmp(mountpoint, DATA) != 0) {
+        if (do_fast_format(mountpoint, source_path)) {
+            LOGD(TAG "Successfully formatted %s", mountpoint);
+            return true;
+        }
+        LOGW(TAG "%s: Falling back to deleting files", mountpoint);
+    }
+
     bool needs_mount = !util::is_mounted(mountpoint);
 
     if (needs_mount && !do_mount(mountpoint)) {
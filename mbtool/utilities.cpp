@@ -21,6 +21,7 @@
 
 #include <algorithm>
 
+#include <cstdint>
 #include <cstring>
 
 #include <fcntl.h>
@@ -45,7 +46,9 @@
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 
+#include "block_dev_resolver.h"
 #include "multiboot.h"
+#include "rom_inventory.h"
 #include "romconfig.h"
 #include "roms.h"
 #include "switcher.h"
@@ -68,25 +71,44 @@ static bool get_device(const char *path, Device &device)
     LOGD("ro.product.device = %s", prop_product_device.c_str());
     LOGD("ro.build.product = %s", prop_build_product.c_str());
 
-    std::vector<unsigned char> contents;
-    if (!util::file_read_all(path, &contents)) {
+    // The binary database is used directly from the mapping, so this must
+    // outlive db
+    util::FileView contents;
+    if (!contents.open(path)) {
         LOGE("%s: Failed to read file: %s", path, strerror(errno));
         return false;
     }
-    contents.push_back('\0');
 
-    std::vector<Device> devices;
+    DeviceDatabase db;
     JsonError error;
+    bool loaded;
 
-    if (!device_list_from_json(reinterpret_cast<const char *>(contents.data()),
-                               devices, error)) {
+    // Binary databases from devicesgen are used in place
+    if (DeviceDatabase::is_binary(contents.data(), contents.size())) {
+        loaded = db.load_binary(contents.data(), contents.size(), error);
+    } else {
+        loaded = db.load(std::string(contents.begin(), contents.end()), true,
+                         error);
+    }
+
+    if (!loaded) {
         LOGE("%s: Failed to load devices", path);
         return false;
     }
 
-    for (auto &d : devices) {
-        if (d.validate()) {
-            LOGW("Skipping invalid device");
+    // Only the first matching device is parsed. No earlier device can match.
+    size_t index = SIZE_MAX;
+    size_t build_product_index;
+    db.find_codename(prop_product_device, index);
+    if (db.find_codename(prop_build_product, build_product_index)
+            && build_product_index < index) {
+        index = build_product_index;
+    }
+
+    // If it is invalid, keep looking for a later match
+    for (size_t i = index; index != SIZE_MAX && i < db.size(); ++i) {
+        Device d;
+        if (!db.get(i, d)) {
             continue;
         }
 
@@ -96,10 +118,15 @@ static bool get_device(const char *path, Device &device)
             return item == prop_product_device || item == prop_build_product;
         });
 
-        if (it != codenames.end()) {
-            device = std::move(d);
-            return true;
+        if (it == codenames.end()) {
+            continue;
+        } else if (d.validate()) {
+            LOGW("Skipping invalid device");
+            continue;
         }
+
+        device = std::move(d);
+        return true;
     }
 
     LOGE("Unknown device: %s", prop_product_device.c_str());
@@ -120,20 +147,15 @@ static bool utilities_switch_rom(const char *rom_id, bool force)
         return false;
     }
 
-    auto const &boot_devs = device.boot_block_devs();
-    auto it = std::find_if(boot_devs.begin(), boot_devs.end(),
-                           [&](const std::string &path) {
-        struct stat sb;
-        return stat(path.c_str(), &sb) == 0 && S_ISBLK(sb.st_mode);
-    });
-
-    if (it == boot_devs.end()) {
+    std::string boot_dev = BlockDevResolver::global().resolve(
+            device.boot_block_devs());
+    if (boot_dev.empty()) {
         LOGE("All specified boot partition paths could not be found");
         return false;
     }
 
     SwitchRomResult ret = switch_rom(
-            rom_id, *it, device.block_dev_base_dirs(), force);
+            rom_id, boot_dev, device.block_dev_base_dirs(), force);
     switch (ret) {
     case SwitchRomResult::SUCCEEDED:
         LOGD("SUCCEEDED");
@@ -215,11 +237,11 @@ static void generate_aroma_config(std::vector<unsigned char> *data)
     for (std::size_t i = 0; i < roms.roms.size(); ++i) {
         const std::shared_ptr<Rom> &rom = roms.roms[i];
 
-        std::string config_path = rom->config_path();
         std::string name = rom->id;
 
         RomConfig config;
-        if (config.load_file(config_path) && !config.name.empty()) {
+        if (RomInventory::global().rom_config(rom->id, config)
+                && !config.name.empty()) {
             name = config.name;
         }
 
@@ -454,6 +476,7 @@ static void utilities_usage(bool error)
             "   OR: utilities [opt...] wipe-data [ROM ID]\n"
             "   OR: utilities [opt...] wipe-dalvik-cache [ROM ID]\n"
             "   OR: utilities [opt...] wipe-multiboot [ROM ID]\n"
+            "   OR: utilities [opt...] delete-trash [trash dir...]\n"
             "\n"
             "Options:\n"
             "  -f, --force      Force (only for 'switch' action)\n"
@@ -508,7 +531,9 @@ int utilities_main(int argc, char *argv[])
 
     const std::string action = argv[optind];
     if ((action == "generate" && argc - optind != 3)
-            || (action != "generate" && argc - optind != 2)) {
+            || (action == "delete-trash" && argc - optind < 2)
+            || (action != "generate" && action != "delete-trash"
+                    && argc - optind != 2)) {
         utilities_usage(true);
         return EXIT_FAILURE;
     }
@@ -535,6 +560,9 @@ int utilities_main(int argc, char *argv[])
         ret = utilities_wipe_dalvik_cache(argv[optind + 1]);
     } else if (action == "wipe-multiboot") {
         ret = utilities_wipe_multiboot(argv[optind + 1]);
+    } else if (action == "delete-trash") {
+        ret = delete_trash(std::vector<std::string>(
+                argv + optind + 1, argv + argc));
     } else {
         LOGE("Unknown action: %s", action.c_str());
     }
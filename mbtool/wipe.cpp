@@ -22,16 +22,19 @@
 #include <algorithm>
 
 #include <cerrno>
+#include <cstdlib>
 #include <cstring>
 
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
 #include "mbutil/delete.h"
-#include "mbutil/fts.h"
 #include "mbutil/mount.h"
+#include "mbutil/path.h"
 #include "mbutil/string.h"
 
 #include "multiboot.h"
@@ -39,84 +42,322 @@
 namespace mb
 {
 
-class WipeDirectory : public util::FTSWrapper {
-public:
-    WipeDirectory(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions))
-    {
-    }
-
-    virtual int on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
+// Name of the directory that paths are moved to for background wipes. It is
+// created next to the path being wiped so that rename() works.
+#define TRASH_DIR_NAME          ".mbtool-trash"
 
-        return Action::FTS_OK;
+static bool list_directory(const std::string &directory,
+                           const std::vector<std::string> &exclusions,
+                           std::vector<std::string> &names)
+{
+    autoclose::dir dp(autoclose::opendir(directory.c_str()));
+    if (!dp) {
+        LOGW("%s: Failed to open directory: %s",
+             directory.c_str(), strerror(errno));
+        return false;
     }
 
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted
-        // in FTS_DP
-        return Action::FTS_OK;
-    }
+    dirent *ent;
+    errno = 0;
 
-    virtual int on_reached_directory_post() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0
+                || strcmp(ent->d_name, "..") == 0
+                || std::find(exclusions.begin(), exclusions.end(), ent->d_name)
+                        != exclusions.end()) {
+            continue;
+        }
+        names.push_back(ent->d_name);
     }
 
-    virtual int on_reached_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    if (errno) {
+        LOGW("%s: Failed to read directory contents: %s",
+             directory.c_str(), strerror(errno));
+        return false;
     }
 
-    virtual int on_reached_symlink() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    return true;
+}
+
+/*!
+ * \brief Delete the contents of a directory, except the excluded first-level
+ *        entries and "multiboot"
+ *
+ * Each first-level subdirectory is deleted with multiple threads. Mountpoints
+ * are not traversed.
+ */
+bool wipe_directory(const std::string &directory,
+                    const std::vector<std::string> &exclusions)
+{
+    struct stat sb;
+    if (stat(directory.c_str(), &sb) < 0) {
+        if (errno == ENOENT) {
+            // Don't fail if directory does not exist
+            return true;
+        }
+        LOGW("%s: Failed to stat: %s", directory.c_str(), strerror(errno));
+        return false;
     }
 
-    virtual int on_reached_special_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+    std::vector<std::string> new_exclusions{ "multiboot" };
+    new_exclusions.insert(new_exclusions.end(),
+                          exclusions.begin(), exclusions.end());
+
+    std::vector<std::string> names;
+    if (!list_directory(directory, new_exclusions, names)) {
+        return false;
     }
 
-private:
-    std::vector<std::string> _exclusions;
+    bool ret = true;
 
-    bool delete_path()
-    {
-        if (_curr->fts_level >= 1 && remove(_curr->fts_accpath) < 0) {
-            mb::format(_error_msg, "%s: Failed to remove: %s",
-                       _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
+    for (auto const &name : names) {
+        std::string path(directory);
+        path += '/';
+        path += name;
+
+        struct stat sb_child;
+        if (lstat(path.c_str(), &sb_child) < 0) {
+            if (errno != ENOENT) {
+                LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+                ret = false;
+            }
+            continue;
+        }
+
+        if (S_ISDIR(sb_child.st_mode) && sb_child.st_dev != sb.st_dev) {
+            LOGW("%s: Failed to remove: %s", path.c_str(), strerror(EBUSY));
+            ret = false;
+            continue;
+        }
+
+        if (!util::delete_recursive(path, util::DELETE_PARALLEL)) {
+            ret = false;
         }
-        return true;
     }
-};
 
-bool wipe_directory(const std::string &directory,
-                    const std::vector<std::string> &exclusions)
+    return ret;
+}
+
+/*!
+ * \brief Move a path to a unique location in \p trash_parent/.mbtool-trash
+ *
+ * \param path Path to move
+ * \param trash_parent Directory on the same filesystem as \p path
+ * \param trash Trash directory is added to this list if it is not in it yet
+ *
+ * \return True if the path was moved or doesn't exist. False, otherwise.
+ */
+static bool move_to_trash(const std::string &path,
+                          const std::string &trash_parent,
+                          std::vector<std::string> *trash)
 {
     struct stat sb;
-    if (stat(directory.c_str(), &sb) < 0 && errno == ENOENT) {
-        // Don't fail if directory does not exist
+    if (lstat(path.c_str(), &sb) < 0 && errno == ENOENT) {
         return true;
     }
 
+    std::string trash_dir(trash_parent);
+    trash_dir += "/" TRASH_DIR_NAME;
+
+    if (mkdir(trash_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s",
+             trash_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string target(trash_dir);
+    target += "/XXXXXX";
+
+    if (!mkdtemp(&target[0])) {
+        LOGW("%s: Failed to create temporary directory: %s",
+             trash_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string temp_dir(target);
+    target += '/';
+    target += util::base_name(path);
+
+    if (rename(path.c_str(), target.c_str()) < 0) {
+        int saved_errno = errno;
+        rmdir(temp_dir.c_str());
+        // Only succeeds if nothing else is in the trash
+        rmdir(trash_dir.c_str());
+
+        if (saved_errno == ENOENT) {
+            return true;
+        }
+
+        LOGW("%s: Failed to move to %s: %s", path.c_str(),
+             trash_dir.c_str(), strerror(saved_errno));
+        return false;
+    }
+
+    if (std::find(trash->begin(), trash->end(), trash_dir) == trash->end()) {
+        trash->push_back(trash_dir);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Move the contents of a directory to the trash
+ *
+ * The exclusions are handled the same way as in wipe_directory(). If this
+ * fails, some entries may have been moved already.
+ */
+static bool trash_directory(const std::string &directory,
+                            const std::vector<std::string> &exclusions,
+                            std::vector<std::string> *trash)
+{
     std::vector<std::string> new_exclusions{ "multiboot" };
     new_exclusions.insert(new_exclusions.end(),
                           exclusions.begin(), exclusions.end());
 
-    WipeDirectory wd(directory, std::move(new_exclusions));
-    return wd.run();
+    std::vector<std::string> names;
+    if (!list_directory(directory, new_exclusions, names)) {
+        return false;
+    }
+
+    std::string trash_parent = util::dir_name(directory);
+
+    for (auto const &name : names) {
+        std::string path(directory);
+        path += '/';
+        path += name;
+
+        if (!move_to_trash(path, trash_parent, trash)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Delete trash directories from a detached process
+ *
+ * The process runs `utilities delete-trash`. The daemon is multithreaded, so
+ * the forked children only call async-signal-safe functions before exec'ing.
+ *
+ * \return Whether the process was started
+ */
+bool delete_trash_in_background(const std::vector<std::string> &trash)
+{
+    if (trash.empty()) {
+        return true;
+    }
+
+    // Build the arguments before forking since the children can't allocate
+    std::vector<const char *> argv{ "utilities", "delete-trash" };
+    for (auto const &path : trash) {
+        argv.push_back(path.c_str());
+    }
+    argv.push_back(nullptr);
+
+    for (auto const &path : trash) {
+        LOGV("Deleting %s in the background", path.c_str());
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        return false;
+    } else if (pid == 0) {
+        // Fork again so the worker is reparented to init and nobody has to
+        // wait for it
+        pid_t worker = fork();
+        if (worker == 0) {
+            execv("/proc/self/exe", const_cast<char * const *>(argv.data()));
+            _exit(127);
+        }
+        _exit(worker < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        LOGE("Failed to wait for process: %s", strerror(errno));
+        return false;
+    }
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+/*!
+ * \brief Delete trash directories
+ *
+ * Only paths named .mbtool-trash are deleted.
+ *
+ * \return True if all of the trash directories were deleted or don't exist
+ */
+bool delete_trash(const std::vector<std::string> &trash)
+{
+    bool ret = true;
+
+    for (auto const &path : trash) {
+        if (util::base_name(path) != TRASH_DIR_NAME) {
+            LOGE("%s: Not a trash directory", path.c_str());
+            ret = false;
+            continue;
+        }
+
+        LOGV("Deleting %s", path.c_str());
+        bool deleted = util::delete_recursive(path, util::DELETE_PARALLEL);
+        LOGV("-> %s", deleted ? "Succeeded" : "Failed");
+
+        ret = deleted && ret;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Find trash directories left behind by earlier background wipes
+ *
+ * The background deletion is not resumed if it gets interrupted (eg. by a
+ * reboot), so this looks for trash directories next to every path that may be
+ * wiped for any ROM. The ones that are found and aren't in \p trash yet are
+ * added to it.
+ */
+void add_leftover_trash(std::vector<std::string> *trash)
+{
+    Roms roms;
+    roms.add_all();
+
+    // Used by wipe_multiboot()
+    std::vector<std::string> parents{ MULTIBOOT_DIR };
+
+    for (auto const &rom : roms.roms) {
+        std::string paths[] = {
+            rom->full_system_path(),
+            rom->full_cache_path(),
+            rom->full_data_path(),
+        };
+
+        for (auto const &path : paths) {
+            if (path.empty()) {
+                continue;
+            }
+
+            // Used by trash_directory() and for dalvik-cache, respectively
+            parents.push_back(util::dir_name(path));
+            parents.push_back(path);
+        }
+    }
+
+    struct stat sb;
+
+    for (auto const &parent : parents) {
+        std::string trash_dir(parent);
+        trash_dir += "/" TRASH_DIR_NAME;
+
+        if (lstat(trash_dir.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)
+                && std::find(trash->begin(), trash->end(), trash_dir)
+                        == trash->end()) {
+            LOGV("%s: Found leftover trash", trash_dir.c_str());
+            trash->push_back(trash_dir);
+        }
+    }
 }
 
 /*!
@@ -159,12 +400,15 @@ static bool log_wipe_file(const std::string &path)
  *       deletion does not follow symlinks.
  *
  * \param mountpoint Mountpoint root to wipe
- * \param wipe_media Whether the first-level "media" path should be deleted
+ * \param exclusions First-level paths that should not be deleted
+ * \param trash If not NULL, try moving the contents to the trash instead of
+ *              deleting them
  *
  * \return True if the path was wiped or doesn't exist. False, otherwise
  */
 static bool log_wipe_directory(const std::string &mountpoint,
-                               const std::vector<std::string> &exclusions)
+                               const std::vector<std::string> &exclusions,
+                               std::vector<std::string> *trash)
 {
     if (exclusions.empty()) {
         LOGV("Wiping directory %s", mountpoint.c_str());
@@ -188,20 +432,34 @@ static bool log_wipe_directory(const std::string &mountpoint,
         return false;
     }
 
+    // Anything that could not be moved is deleted normally
+    if (trash && trash_directory(mountpoint, exclusions, trash)) {
+        LOGV("-> Moved to trash");
+        return true;
+    }
+
     bool ret = wipe_directory(mountpoint, exclusions);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-static bool log_delete_recursive(const std::string &path)
+static bool log_delete_recursive(const std::string &path,
+                                 std::vector<std::string> *trash)
 {
     LOGV("Recursively deleting %s", path.c_str());
-    bool ret = util::delete_recursive(path);
+
+    if (trash && move_to_trash(path, util::dir_name(path), trash)) {
+        LOGV("-> Moved to trash");
+        return true;
+    }
+
+    bool ret = util::delete_recursive(path, util::DELETE_PARALLEL);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-bool wipe_system(const std::shared_ptr<Rom> &rom)
+bool wipe_system(const std::shared_ptr<Rom> &rom,
+                 std::vector<std::string> *trash)
 {
     std::string path = rom->full_system_path();
     if (path.empty()) {
@@ -218,14 +476,15 @@ bool wipe_system(const std::shared_ptr<Rom> &rom)
 
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, {});
+        ret = log_wipe_directory(path, {}, trash);
         // Try removing ROM's /system if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_cache(const std::shared_ptr<Rom> &rom,
+                std::vector<std::string> *trash)
 {
     std::string path = rom->full_cache_path();
     if (path.empty()) {
@@ -237,14 +496,15 @@ bool wipe_cache(const std::shared_ptr<Rom> &rom)
     if (rom->cache_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, {});
+        ret = log_wipe_directory(path, {}, trash);
         // Try removing ROM's /cache if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_data(const std::shared_ptr<Rom> &rom)
+bool wipe_data(const std::shared_ptr<Rom> &rom,
+               std::vector<std::string> *trash)
 {
     std::string path = rom->full_data_path();
     if (path.empty()) {
@@ -256,7 +516,7 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     if (rom->data_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, { "media" });
+        ret = log_wipe_directory(path, { "media" }, trash);
         // Try removing ROM's /data/media and /data if they're empty
         remove((path + "/media").c_str());
         remove(path.c_str());
@@ -264,7 +524,8 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     return ret;
 }
 
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom,
+                       std::vector<std::string> *trash)
 {
     if (rom->data_is_image || rom->cache_is_image) {
         LOGE("Wiping dalvik-cache for ROMs that use data or cache images is "
@@ -291,17 +552,18 @@ bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
     // util::delete_recursive() returns true if the path does not
     // exist (ie. returns false only on errors), which is exactly
     // what we want
-    return log_delete_recursive(data_path)
-            && log_delete_recursive(cache_path);
+    return log_delete_recursive(data_path, trash)
+            && log_delete_recursive(cache_path, trash);
 }
 
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom,
+                    std::vector<std::string> *trash)
 {
     // Delete /data/media/0/MultiBoot/[ROM ID]
     std::string multiboot_path(MULTIBOOT_DIR);
     multiboot_path += '/';
     multiboot_path += rom->id;
-    return log_delete_recursive(multiboot_path);
+    return log_delete_recursive(multiboot_path, trash);
 }
 
 }
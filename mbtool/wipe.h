@@ -26,10 +26,23 @@ namespace mb
 
 bool wipe_directory(const std::string &directory,
                     const std::vector<std::string> &exclusions);
-bool wipe_system(const std::shared_ptr<Rom> &rom);
-bool wipe_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_data(const std::shared_ptr<Rom> &rom);
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom);
+
+// If trash is not NULL, the paths are moved to trash directories on the same
+// filesystem where possible. The trash directories are added to the list and
+// should be passed to delete_trash_in_background() afterwards.
+bool wipe_system(const std::shared_ptr<Rom> &rom,
+                 std::vector<std::string> *trash = nullptr);
+bool wipe_cache(const std::shared_ptr<Rom> &rom,
+                std::vector<std::string> *trash = nullptr);
+bool wipe_data(const std::shared_ptr<Rom> &rom,
+               std::vector<std::string> *trash = nullptr);
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom,
+                       std::vector<std::string> *trash = nullptr);
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom,
+                    std::vector<std::string> *trash = nullptr);
+
+bool delete_trash_in_background(const std::vector<std::string> &trash);
+bool delete_trash(const std::vector<std::string> &trash);
+void add_leftover_trash(std::vector<std::string> *trash);
 
 }
@@ -18,7 +18,14 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <cerrno>
@@ -28,16 +35,20 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 // libmbcommon
 #include "mbcommon/file/callbacks.h"
-#include "mbcommon/file/standard.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file_util.h"
 
 // libmbsparse
-#include "mbsparse/sparse.h"
+#include "mbsparse/flash.h"
 
 // libmbdevice
 #include "mbdevice/json.h"
@@ -48,6 +59,7 @@
 #include "mbutil/finally.h"
 #include "mbutil/mount.h"
 #include "mbutil/properties.h"
+#include "mbutil/zip.h"
 
 // minizip
 #include <archive.h>
@@ -57,6 +69,14 @@
 #define DEBUG_SKIP_FLASH_CSC    0
 #define DEBUG_SKIP_FLASH_BOOT   0
 
+// Compare each buffer with the block device's contents and only write it if
+// they differ. This makes re-flashing the same firmware mostly read-only.
+#define SKIP_IDENTICAL_BLOCKS   1
+// Discard the "don't care" regions of the system image with BLKDISCARD.
+// Disabled by default because the eMMC firmware on some Samsung devices is
+// known to corrupt itself when erase commands are issued.
+#define DISCARD_DONT_CARE       0
+
 #define SYSTEM_SPARSE_FILE      "system.img.sparse"
 #define CACHE_SPARSE_FILE       "cache.img.sparse"
 #define BOOT_IMAGE_FILE         "boot.img"
@@ -71,6 +91,17 @@
 
 #define EFS_SALES_CODE_FILE     "/efs/imei/mps_code.dat"
 
+// Flush written data to storage after this many bytes
+#define SYNC_INTERVAL           (64 * 1024 * 1024)
+
+// Size and number of the buffers between the zip reader and the writer thread
+// for raw files
+#define RAW_BUFFER_SIZE         static_cast<size_t>(1024 * 1024)
+#define RAW_BUFFER_COUNT        4
+
+// Read size for the CSC zip (it is read through fuse-sparse)
+#define CSC_ZIP_BLOCK_SIZE      (1024 * 1024)
+
 #define PROP_SYSTEM_DEV         "system"
 #define PROP_BOOT_DEV           "boot"
 
@@ -88,6 +119,7 @@ enum class ExtractResult
 static int interface;
 static int output_fd;
 static const char *zip_file;
+static mb::util::ZipReader zip;
 
 static char sales_code[10];
 static std::string system_block_dev;
@@ -175,45 +207,28 @@ static bool umount_system()
     return WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
 
-static bool la_open_zip(archive *a, const char *filename)
+static bool open_zip()
 {
-    if (archive_read_support_format_zip(a) != ARCHIVE_OK) {
-        error("libarchive: Failed to enable zip support: %s",
-              archive_error_string(a));
-        return false;
-    }
-
-    if (archive_read_open_filename(a, zip_file, 10240) != ARCHIVE_OK) {
-        error("libarchive: %s: Failed to open zip: %s",
-              filename, archive_error_string(a));
+    // The central directory is read once and every file is then read directly
+    // from its local header
+    if (!zip.open(zip_file)) {
+        error("%s: Failed to open zip", zip_file);
         return false;
     }
 
     return true;
 }
 
-static ExtractResult la_skip_to(archive *a, const char *filename,
-                                archive_entry **entry)
+static ExtractResult find_zip_entry(const char *filename,
+                                    const mb::util::ZipEntry **entry)
 {
-    int ret;
-    while ((ret = archive_read_next_header(a, entry)) == ARCHIVE_OK) {
-        const char *name = archive_entry_pathname(*entry);
-        if (!name) {
-            error("libarchive: Failed to get filename");
-            return ExtractResult::ERROR;
-        }
-
-        if (strcmp(filename, name) == 0) {
-            return ExtractResult::OK;
-        }
-    }
-    if (ret != ARCHIVE_EOF) {
-        error("libarchive: Failed to read header: %s", archive_error_string(a));
-        return ExtractResult::ERROR;
+    *entry = zip.find(filename);
+    if (!*entry) {
+        error("%s: Failed to find %s in zip", zip_file, filename);
+        return ExtractResult::MISSING;
     }
 
-    error("libarchive: Failed to find %s in zip", filename);
-    return ExtractResult::MISSING;
+    return ExtractResult::OK;
 }
 
 static bool load_sales_code()
@@ -256,45 +271,23 @@ static bool load_block_devs()
     Device device;
 
     {
-        archive *a = archive_read_new();
-        if (!a) {
-            error("Out of memory");
-            return false;
-        }
-
-        auto close_archive = mb::util::finally([&]{
-            archive_read_free(a);
-        });
-
-        if (!la_open_zip(a, zip_file)) {
-            return false;
-        }
-
-        archive_entry *entry;
-        if (la_skip_to(a, DEVICE_JSON_FILE, &entry) != ExtractResult::OK) {
+        const mb::util::ZipEntry *entry;
+        if (find_zip_entry(DEVICE_JSON_FILE, &entry) != ExtractResult::OK) {
             return false;
         }
 
         static const size_t max_size = 10240;
 
-        if (archive_entry_size(entry) >= max_size) {
-            error("%s is too large", DEVICE_JSON_FILE);
-            return false;
-        }
-
-        std::vector<char> buf(max_size);
-        la_ssize_t n;
-
-        n = archive_read_data(a, buf.data(), buf.size() - 1);
-        if (n < 0) {
-            error("libarchive: %s: Failed to read %s: %s",
-                  zip_file, DEVICE_JSON_FILE, archive_error_string(a));
+        std::vector<unsigned char> buf;
+        if (!zip.read_to_memory(*entry, &buf, max_size - 1)) {
+            error("%s: Failed to read %s", zip_file, DEVICE_JSON_FILE);
             return false;
         }
+        buf.push_back('\0');
 
-        // Buffer is already NULL-terminated
         JsonError ret;
-        if (!device_from_json(buf.data(), device, ret)) {
+        if (!device_from_json(reinterpret_cast<char *>(buf.data()), device,
+                              ret)) {
             error("Failed to load %s", DEVICE_JSON_FILE);
             return false;
         }
@@ -342,32 +335,163 @@ static bool load_block_devs()
     return true;
 }
 
-static bool cb_zip_read(mb::File &file, void *userdata,
-                        void *buf, size_t size, size_t &bytes_read)
+/*!
+ * \brief Byte counters for the progress bar
+ *
+ * Progress is measured in uncompressed bytes read from the zip, so the jobs
+ * that run at the same time can all report to one progress bar.
+ */
+struct ProgressState
 {
-    (void) file;
+    std::atomic<uint64_t> bytes;
+    uint64_t max_bytes;
+    std::mutex mutex;
+    uint64_t reported_bytes;
+};
 
-    archive *a = static_cast<archive *>(userdata);
-    uint64_t total = 0;
+static ProgressState progress;
 
-    while (size > 0) {
-        la_ssize_t n = archive_read_data(a, buf, size);
-        if (n < 0) {
-            error("libarchive: Failed to read data: %s",
-                  archive_error_string(a));
+static void progress_begin(uint64_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(progress.mutex);
+    progress.bytes = 0;
+    progress.max_bytes = max_bytes;
+    progress.reported_bytes = 0;
+    set_progress(0);
+}
+
+static void progress_add(uint64_t bytes)
+{
+    uint64_t cur_bytes = progress.bytes += bytes;
+
+    // Rate limit: update progress only after difference exceeds 0.1%. Only one
+    // thread needs to report an update.
+    std::unique_lock<std::mutex> lock(progress.mutex, std::try_to_lock);
+    if (!lock.owns_lock() || progress.max_bytes == 0) {
+        return;
+    }
+
+    double old_ratio = static_cast<double>(progress.reported_bytes)
+            / progress.max_bytes;
+    double new_ratio = static_cast<double>(cur_bytes) / progress.max_bytes;
+    if (new_ratio - old_ratio >= 0.001) {
+        set_progress(std::min(new_ratio, 1.0));
+        progress.reported_bytes = cur_bytes;
+    }
+}
+
+static uint64_t zip_entry_size(const char *filename)
+{
+    const mb::util::ZipEntry *entry = zip.find(filename);
+    return entry ? entry->uncompressed_size : 0;
+}
+
+/*!
+ * \brief Output file that flushes written data with `fdatasync()` every
+ *        SYNC_INTERVAL bytes and when it is closed
+ *
+ * With a single flush at the end, the kernel can accumulate hundreds of MiB
+ * of dirty pages and the final close blocks for a long time without any
+ * progress being shown.
+ */
+class SyncedFdFile : public mb::FdFile
+{
+public:
+    SyncedFdFile() : _fd(-1), _unsynced(0)
+    {
+    }
+
+    virtual ~SyncedFdFile()
+    {
+        close();
+    }
+
+    bool open_path(const char *path, int flags)
+    {
+        close();
+
+        _fd = open64(path, flags | O_CLOEXEC | O_LARGEFILE, 0600);
+        if (_fd < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to open file");
             return false;
-        } else if (n == 0) {
-            break;
         }
 
-        total += n;
-        size -= n;
-        buf = (char *) buf + n;
+        _unsynced = 0;
+        return open(_fd, true);
+    }
+
+    int fd() const
+    {
+        return _fd;
+    }
+
+protected:
+    virtual bool on_close() override
+    {
+        bool ret = sync();
+        _fd = -1;
+        return FdFile::on_close() && ret;
+    }
+
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override
+    {
+        if (!FdFile::on_write(buf, size, bytes_written)) {
+            return false;
+        }
+
+        _unsynced += bytes_written;
+        return _unsynced < SYNC_INTERVAL || sync();
+    }
+
+private:
+    int _fd;
+    uint64_t _unsynced;
+
+    bool sync()
+    {
+        if (_unsynced > 0 && fdatasync(_fd) < 0 && errno != EINVAL) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to sync file");
+            return false;
+        }
+
+        _unsynced = 0;
+        return true;
+    }
+};
+
+static bool cb_zip_read_block(mb::File &file, void *userdata,
+                              const void *&buf, size_t &size)
+{
+    (void) file;
+
+    // Lend the zip reader's decompression buffer to the sparse file reader
+    auto *reader = static_cast<mb::util::ZipEntryReader *>(userdata);
+    if (!reader->read_block(buf, size)) {
+        return false;
+    }
+
+    progress_add(size);
+    return true;
+}
+
+#if DISCARD_DONT_CARE
+static bool cb_sparse_discard(uint64_t offset, uint64_t size, void *userdata)
+{
+    auto *file = static_cast<SyncedFdFile *>(userdata);
+    uint64_t range[2] = { offset, size };
+
+    if (ioctl(file->fd(), BLKDISCARD, &range) < 0) {
+        // Not fatal since the region's contents don't matter
+        error("WARNING: Failed to discard %" PRIu64 " bytes at %" PRIu64
+              ": %s", size, offset, strerror(errno));
     }
 
-    bytes_read = total;
     return true;
 }
+#endif
 
 #if DEBUG_SKIP_FLASH_SYSTEM
 MB_UNUSED
@@ -375,165 +499,359 @@ MB_UNUSED
 static ExtractResult extract_sparse_file(const char *zip_filename,
                                          const char *out_filename)
 {
-    ScopedArchive a{archive_read_new(), &archive_read_free};
     mb::CallbackFile file;
-    mb::sparse::SparseFile sparse_file;
-    mb::StandardFile out_file;
-
-    if (!a) {
-        error("Out of memory");
-        return ExtractResult::ERROR;
-    }
+    SyncedFdFile out_file;
 
-    if (!la_open_zip(a.get(), zip_file)) {
-        return ExtractResult::ERROR;
-    }
-
-    archive_entry *entry;
-    auto result = la_skip_to(a.get(), zip_filename, &entry);
+    const mb::util::ZipEntry *entry;
+    auto result = find_zip_entry(zip_filename, &entry);
     if (result != ExtractResult::OK) {
         return result;
     }
 
-    if (!file.open(nullptr, nullptr, &cb_zip_read, nullptr, nullptr, nullptr,
-                   a.get())) {
+    // Lend the zip reader's decompression buffers to the sparse file reader
+    // so that small sparse header reads do not call into zlib and raw chunks
+    // are copied only once
+    mb::util::ZipEntryReader zip_reader(zip, *entry);
+
+    if (!file.set_read_block_cb(&cb_zip_read_block)
+            || !file.open(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+                          &zip_reader)) {
         error("Failed to open sparse file in zip: %s",
               file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    if (!sparse_file.open(&file)) {
-        error("Failed to open sparse file: %s",
-              sparse_file.error_string().c_str());
+    if (!out_file.open_path(out_filename,
+                            SKIP_IDENTICAL_BLOCKS ? O_RDWR : O_WRONLY)) {
+        error("%s: Failed to open for writing: %s",
+              out_filename, out_file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    if (!out_file.open(out_filename, mb::FileOpenMode::WRITE_ONLY)) {
-        error("%s: Failed to open for writing: %s",
+    // Decompression, sparse expansion, and writing each run on their own
+    // thread with 1 MiB buffers in between
+    mb::sparse::FlashOptions options;
+    options.skip_identical = SKIP_IDENTICAL_BLOCKS;
+#if DISCARD_DONT_CARE
+    options.discard_cb = &cb_sparse_discard;
+    options.userdata = &out_file;
+#endif
+
+    mb::sparse::FlashStats stats;
+    std::string flash_error;
+    if (!mb::sparse::flash(file, out_file, options, stats, flash_error)) {
+        error("Failed to flash sparse file %s to %s: %s",
+              zip_filename, out_filename, flash_error.c_str());
+        return ExtractResult::ERROR;
+    }
+
+    info("%s: Wrote %" PRIu64 " bytes, skipped %" PRIu64 " unchanged bytes,"
+         " discarded %" PRIu64 " bytes", out_filename, stats.written_bytes,
+         stats.skipped_bytes, stats.discarded_bytes);
+
+    if (!out_file.close()) {
+        error("%s: Failed to close file: %s",
               out_filename, out_file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    char buf[10240];
-    size_t n;
-    bool ret;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = sparse_file.size();
-    uint64_t old_bytes = 0;
+    return ExtractResult::OK;
+}
 
-    set_progress(0);
+/*!
+ * \brief Bounded queue of aligned buffers between the zip reader and a writer
+ *        thread
+ */
+class WriteQueue
+{
+public:
+    WriteQueue() : _finished(false), _aborted(false)
+    {
+        for (size_t i = 0; i < RAW_BUFFER_COUNT; ++i) {
+            void *ptr;
+            if (posix_memalign(&ptr, mb::sparse::FLASH_BUFFER_ALIGNMENT,
+                               RAW_BUFFER_SIZE) != 0) {
+                break;
+            }
+            _storage.push_back(static_cast<unsigned char *>(ptr));
+            _free.push_back(static_cast<unsigned char *>(ptr));
+        }
+    }
 
-    while ((ret = sparse_file.read(buf, sizeof(buf), n)) && n > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        double old_ratio = static_cast<double>(old_bytes) / max_bytes;
-        double new_ratio = static_cast<double>(cur_bytes) / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
+    ~WriteQueue()
+    {
+        for (auto *ptr : _storage) {
+            free(ptr);
         }
+    }
 
-        char *out_ptr = buf;
-        size_t nwritten;
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(WriteQueue)
 
-        while (n > 0) {
-            if (!out_file.write(buf, n, nwritten)) {
-                error("%s: Failed to write file: %s",
-                      out_filename, out_file.error_string().c_str());
-                return ExtractResult::ERROR;
-            }
+    bool allocated() const
+    {
+        return _storage.size() == RAW_BUFFER_COUNT;
+    }
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
+    unsigned char * acquire()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _aborted || !_free.empty(); });
+
+        if (_aborted) {
+            return nullptr;
         }
+
+        unsigned char *buf = _free.front();
+        _free.pop_front();
+        return buf;
     }
-    if (!ret) {
-        error("Failed to read sparse file %s: %s",
-              zip_filename, sparse_file.error_string().c_str());
-        return ExtractResult::ERROR;
+
+    void submit(unsigned char *buf, size_t size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _filled.emplace_back(buf, size);
+        }
+        _cv.notify_all();
     }
 
-    if (!out_file.close()) {
-        error("%s: Failed to close file: %s",
-              out_filename, out_file.error_string().c_str());
-        return ExtractResult::ERROR;
+    void finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _finished = true;
+        }
+        _cv.notify_all();
     }
 
-    return ExtractResult::OK;
+    // Returns false once the queue is finished and drained or was aborted
+    bool receive(unsigned char *&buf, size_t &size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return _aborted || _finished || !_filled.empty();
+        });
+
+        if (_aborted || _filled.empty()) {
+            return false;
+        }
+
+        buf = _filled.front().first;
+        size = _filled.front().second;
+        _filled.pop_front();
+        return true;
+    }
+
+    void release(unsigned char *buf)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _free.push_back(buf);
+        }
+        _cv.notify_all();
+    }
+
+    void abort()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _aborted = true;
+        }
+        _cv.notify_all();
+    }
+
+private:
+    std::vector<unsigned char *> _storage;
+    std::deque<unsigned char *> _free;
+    std::deque<std::pair<unsigned char *, size_t>> _filled;
+    bool _finished;
+    bool _aborted;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+};
+
+struct RawWriteState
+{
+    const char *out_filename;
+    // Only write buffers that differ from the target's current contents
+    bool skip_identical;
+    bool ret;
+    uint64_t skipped_bytes;
+};
+
+static bool raw_target_matches(SyncedFdFile &file, uint64_t offset,
+                               const unsigned char *buf, size_t size,
+                               unsigned char *scratch)
+{
+    size_t n;
+    return mb::file_read_fully_at(file, offset, scratch, size, n)
+            && n == size
+            && memcmp(scratch, buf, size) == 0;
 }
 
-static ExtractResult extract_raw_file(const char *zip_filename,
-                                      const char *out_filename)
+static void raw_write_stage(WriteQueue &queue, SyncedFdFile &file,
+                            RawWriteState &state)
 {
-    ScopedArchive a{archive_read_new(), &archive_read_free};
-    char buf[10240];
-    la_ssize_t n;
-    int fd;
-    uint64_t cur_bytes = 0;
-    uint64_t max_bytes = 0;
-    uint64_t old_bytes = 0;
-    double old_ratio;
-    double new_ratio;
+    const char *out_filename = state.out_filename;
+    std::vector<unsigned char> scratch;
+    uint64_t offset = 0;
+    unsigned char *buf;
+    size_t size;
+    size_t n;
 
-    if (!a) {
-        error("Out of memory");
-        return ExtractResult::ERROR;
+    if (state.skip_identical) {
+        scratch.resize(RAW_BUFFER_SIZE);
     }
 
-    if (!la_open_zip(a.get(), zip_file)) {
-        return ExtractResult::ERROR;
+    while (queue.receive(buf, size)) {
+        if (state.skip_identical && raw_target_matches(
+                file, offset, buf, size, scratch.data())) {
+            if (!file.seek(static_cast<int64_t>(size), SEEK_CUR, nullptr)) {
+                error("%s: Failed to seek: %s",
+                      out_filename, file.error_string().c_str());
+                queue.release(buf);
+                queue.abort();
+                state.ret = false;
+                return;
+            }
+
+            offset += size;
+            state.skipped_bytes += size;
+            queue.release(buf);
+            continue;
+        }
+
+        if (!mb::file_write_fully(file, buf, size, n) || n != size) {
+            error("%s: Failed to write: %s",
+                  out_filename, file.error_string().c_str());
+            queue.release(buf);
+            queue.abort();
+            state.ret = false;
+            return;
+        }
+
+        offset += size;
+        queue.release(buf);
     }
+}
 
-    archive_entry *entry;
-    auto result = la_skip_to(a.get(), zip_filename, &entry);
+/*!
+ * \brief Extract a file from the zip
+ *
+ * The calling thread decompresses the data into RAW_BUFFER_SIZE aligned
+ * buffers and a writer thread writes each full buffer with a single write.
+ *
+ * \param zip_filename Path in zip
+ * \param out_filename Output path
+ * \param block_dev Whether \p out_filename is a block device. Block devices
+ *                  are not truncated and buffers that match the existing
+ *                  contents are not rewritten if SKIP_IDENTICAL_BLOCKS is
+ *                  enabled.
+ */
+static ExtractResult extract_raw_file(const char *zip_filename,
+                                      const char *out_filename,
+                                      bool block_dev)
+{
+    const mb::util::ZipEntry *entry;
+    auto result = find_zip_entry(zip_filename, &entry);
     if (result != ExtractResult::OK) {
         return result;
     }
 
-    max_bytes = archive_entry_size(entry);
+    RawWriteState state{out_filename, block_dev && SKIP_IDENTICAL_BLOCKS,
+                        true, 0};
 
-    fd = open64(out_filename,
-                O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
-    if (fd < 0) {
-        error("%s: Failed to open: %s", out_filename, strerror(errno));
+    SyncedFdFile file;
+    if (!file.open_path(out_filename, state.skip_identical ? O_RDWR
+                        : block_dev ? O_WRONLY
+                        : O_CREAT | O_TRUNC | O_WRONLY)) {
+        error("%s: Failed to open: %s",
+              out_filename, file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    auto close_fd = mb::util::finally([fd]{
-        close(fd);
-    });
+    WriteQueue queue;
+    if (!queue.allocated()) {
+        error("Failed to allocate buffers");
+        return ExtractResult::ERROR;
+    }
 
-    set_progress(0);
+    std::thread writer(&raw_write_stage, std::ref(queue), std::ref(file),
+                       std::ref(state));
+
+    mb::util::ZipEntryReader reader(zip, *entry);
+    unsigned char *out_buf = nullptr;
+    size_t out_size = 0;
+    bool read_ret = true;
 
-    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
-        // Rate limit: update progress only after difference exceeds 0.1%
-        old_ratio = (double) old_bytes / max_bytes;
-        new_ratio = (double) cur_bytes / max_bytes;
-        if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
-            old_bytes = cur_bytes;
+    while (true) {
+        const void *buf;
+        size_t n;
+
+        if (!reader.read_block(buf, n)) {
+            error("%s: Failed to read %s", zip_file, zip_filename);
+            read_ret = false;
+            break;
+        } else if (n == 0) {
+            break;
         }
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
+        progress_add(n);
 
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
-                return ExtractResult::ERROR;
+        auto *ptr = static_cast<const unsigned char *>(buf);
+
+        while (n > 0) {
+            if (!out_buf && !(out_buf = queue.acquire())) {
+                // Writer failed and already reported the error
+                break;
             }
 
-            n -= nwritten;
-            out_ptr += nwritten;
-        } while (n > 0);
+            size_t to_copy = std::min(n, RAW_BUFFER_SIZE - out_size);
+            memcpy(out_buf + out_size, ptr, to_copy);
+            out_size += to_copy;
+            ptr += to_copy;
+            n -= to_copy;
+
+            if (out_size == RAW_BUFFER_SIZE) {
+                queue.submit(out_buf, out_size);
+                out_buf = nullptr;
+                out_size = 0;
+            }
+        }
+
+        if (n > 0) {
+            break;
+        }
     }
-    if (n != 0) {
-        error("libarchive: %s: Failed to read %s: %s",
-              zip_file, zip_filename, archive_error_string(a.get()));
+
+    if (read_ret && out_buf && out_size > 0) {
+        queue.submit(out_buf, out_size);
+    } else if (out_buf) {
+        queue.release(out_buf);
+    }
+
+    if (read_ret) {
+        queue.finish();
+    } else {
+        queue.abort();
+    }
+    writer.join();
+
+    if (!read_ret || !state.ret) {
+        return ExtractResult::ERROR;
+    }
+
+    if (!file.close()) {
+        error("%s: Failed to close file: %s",
+              out_filename, file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
+    if (state.skip_identical) {
+        info("%s: Skipped %" PRIu64 " unchanged bytes",
+             out_filename, state.skipped_bytes);
+    }
+
     return ExtractResult::OK;
 }
 
@@ -672,7 +990,8 @@ static bool flash_csc_zip()
                                  | ARCHIVE_EXTRACT_MAC_METADATA
                                  | ARCHIVE_EXTRACT_SPARSE);
 
-    if (archive_read_open_filename(in.get(), TEMP_CSC_ZIP_FILE, 10240)
+    if (archive_read_open_filename(in.get(), TEMP_CSC_ZIP_FILE,
+                                   CSC_ZIP_BLOCK_SIZE)
             != ARCHIVE_OK) {
         error("libarchive: %s: Failed to open file: %s",
               zip_file, archive_error_string(in.get()));
@@ -727,17 +1046,26 @@ static bool flash_csc_zip()
     return true;
 }
 
-static ExtractResult flash_csc()
+/*!
+ * \brief Extract the cache image and fuse-sparse to /tmp
+ *
+ * This does not touch /system, so it can run while the system image is being
+ * flashed.
+ */
+#if DEBUG_SKIP_FLASH_CSC
+MB_UNUSED
+#endif
+static ExtractResult extract_csc_files()
 {
-    int status;
     ExtractResult result;
 
-    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE);
+    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE,
+                              false);
     if (result != ExtractResult::OK) {
         return result;
     }
 
-    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE);
+    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE, false);
     if (result != ExtractResult::OK) {
         return ExtractResult::ERROR;
     }
@@ -748,6 +1076,19 @@ static ExtractResult flash_csc()
         return ExtractResult::ERROR;
     }
 
+    return ExtractResult::OK;
+}
+
+/*!
+ * \brief Mount the extracted cache image and copy the CSC files to /system
+ */
+#if DEBUG_SKIP_FLASH_CSC
+MB_UNUSED
+#endif
+static ExtractResult flash_csc()
+{
+    int status;
+
     // Create temporary file for fuse
     close(open(TEMP_CACHE_MOUNT_FILE, O_CREAT | O_WRONLY | O_CLOEXEC, 0600));
 
@@ -832,6 +1173,10 @@ static bool flash_zip()
 
     ui_print("Patched Odin image flasher");
 
+    if (!open_zip()) {
+        return false;
+    }
+
     // Load sales code from EFS partition
     if (!load_sales_code()) {
         return false;
@@ -848,17 +1193,45 @@ static bool flash_zip()
         return false;
     }
 
-#if !DEBUG_SKIP_FLASH_SYSTEM || !DEBUG_SKIP_FLASH_CSC || !DEBUG_SKIP_FLASH_BOOT
+#if !DEBUG_SKIP_FLASH_CSC || !DEBUG_SKIP_FLASH_BOOT
     ExtractResult result;
 #endif
+    uint64_t max_bytes = 0;
+
+    // The system image is flashed on its own thread while the cache image
+    // and fuse-sparse are extracted to /tmp. The zip reader supports
+    // concurrent readers and the two jobs write to different targets.
+#if !DEBUG_SKIP_FLASH_SYSTEM
+    max_bytes += zip_entry_size(SYSTEM_SPARSE_FILE);
+#endif
+#if !DEBUG_SKIP_FLASH_CSC
+    max_bytes += zip_entry_size(CACHE_SPARSE_FILE);
+    max_bytes += zip_entry_size(FUSE_SPARSE_FILE);
+#endif
+    progress_begin(max_bytes);
 
     // Flash system.img.ext4
 #if DEBUG_SKIP_FLASH_SYSTEM
     ui_print("[DEBUG] Skipping flashing of system image");
 #else
     ui_print("Flashing system image");
-    result = extract_sparse_file(SYSTEM_SPARSE_FILE, system_block_dev.c_str());
-    switch (result) {
+    ExtractResult system_result;
+    std::thread system_thread([&]{
+        system_result = extract_sparse_file(SYSTEM_SPARSE_FILE,
+                                            system_block_dev.c_str());
+    });
+#endif
+
+#if DEBUG_SKIP_FLASH_CSC
+    ui_print("[DEBUG] Skipping flashing of CSC");
+#else
+    ExtractResult csc_result = extract_csc_files();
+#endif
+
+#if !DEBUG_SKIP_FLASH_SYSTEM
+    system_thread.join();
+
+    switch (system_result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash system image");
         return false;
@@ -872,11 +1245,9 @@ static bool flash_zip()
 #endif
 
     // Flash CSC from cache.img.ext4
-#if DEBUG_SKIP_FLASH_CSC
-    ui_print("[DEBUG] Skipping flashing of CSC");
-#else
+#if !DEBUG_SKIP_FLASH_CSC
     ui_print("Flashing CSC from cache image");
-    result = flash_csc();
+    result = csc_result == ExtractResult::OK ? flash_csc() : csc_result;
     switch (result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash CSC");
@@ -895,7 +1266,8 @@ static bool flash_zip()
     ui_print("[DEBUG] Skipping flashing of boot image");
 #else
     ui_print("Flashing boot image");
-    result = extract_raw_file(BOOT_IMAGE_FILE, boot_block_dev.c_str());
+    progress_begin(zip_entry_size(BOOT_IMAGE_FILE));
+    result = extract_raw_file(BOOT_IMAGE_FILE, boot_block_dev.c_str(), true);
     if (result != ExtractResult::OK) {
         ui_print("Failed to flash boot image");
         return false;
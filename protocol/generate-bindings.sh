@@ -14,9 +14,11 @@ files=(
     v3/file_selinux_set_label.fbs
     v3/file_stat.fbs
     v3/file_write.fbs
+    v3/mb_clone_rom.fbs
     v3/mb_get_booted_rom_id.fbs
     v3/mb_get_installed_roms.fbs
     v3/mb_get_packages_count.fbs
+    v3/mb_get_stats.fbs
     v3/mb_get_version.fbs
     v3/mb_set_kernel.fbs
     v3/mb_switch_rom.fbs
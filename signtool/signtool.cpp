@@ -17,6 +17,14 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -26,6 +34,12 @@
 // libmbsign
 #include "mbsign/mbsign.h"
 
+struct SignJob
+{
+    std::string input;
+    std::string output;
+};
+
 static void openssl_log_errors()
 {
     ERR_print_errors_fp(stderr);
@@ -34,63 +48,116 @@ static void openssl_log_errors()
 static void usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: signtool <PKCS12 file> <input file> <output signature file>\n\n"
+            "Usage: signtool [option...] <PKCS12 file> <input file> <output signature file>\n"
+            "                [<input file> <output signature file> ...]\n"
+            "   or: signtool [option...] -m <manifest> <PKCS12 file>\n\n"
+            "Options:\n"
+            "  -2       Create version 2 (chunked) signatures. These can be verified\n"
+            "           in parallel, but are not supported by older versions of mbtool.\n"
+            "  -m FILE  Read the files to sign from FILE. Each line contains an input\n"
+            "           path, optionally followed by a tab and the output path\n"
+            "           (default: <input>.sig). Empty lines and lines starting with\n"
+            "           '#' are ignored.\n"
+            "  -j N     Sign up to N files at the same time (default: number of CPUs)\n"
+            "  -f       Always sign. By default, files whose existing signature is\n"
+            "           still valid for the key are left untouched.\n\n"
             "NOTE: This is not a general purpose tool for signing files!\n"
             "It is only meant for use with mbtool.\n");
 }
 
-int main(int argc, char *argv[])
+static bool read_manifest(const char *path, std::vector<SignJob> &jobs)
 {
-    const char *file_pkcs12;
-    const char *file_input;
-    const char *file_output;
-    EVP_PKEY *private_key = nullptr;
-    const char *pass;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_out = nullptr;
-    bool ret;
+    std::ifstream stream(path);
+    if (!stream) {
+        fprintf(stderr, "%s: Failed to open manifest\n", path);
+        return false;
+    }
 
-    ERR_load_crypto_strings();
-    OpenSSL_add_all_algorithms();
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
 
-    if (argc != 4) {
-        usage(stderr);
-        return EXIT_FAILURE;
+        SignJob job;
+        auto tab = line.find('\t');
+        if (tab == std::string::npos) {
+            job.input = line;
+            job.output = line + ".sig";
+        } else {
+            job.input = line.substr(0, tab);
+            job.output = line.substr(tab + 1);
+        }
+        jobs.push_back(std::move(job));
     }
 
-    file_pkcs12 = argv[1];
-    file_input = argv[2];
-    file_output = argv[3];
+    if (stream.bad()) {
+        fprintf(stderr, "%s: Failed to read manifest\n", path);
+        return false;
+    }
 
-    pass = getenv("MBSIGN_PASSPHRASE");
-    if (!pass) {
-        fprintf(stderr,
-                "The MBSIGN_PASSPHRASE environment variable is not set\n");
-        goto error;
+    return true;
+}
+
+/*!
+ * \brief Check if an existing signature file is valid for the input file
+ *
+ * The signature embeds the digest of the data it was created for, so this
+ * acts as a digest-keyed cache: unchanged files keep their signatures (and
+ * timestamps) across incremental builds.
+ */
+static bool is_signature_current(const SignJob &job, EVP_PKEY *key)
+{
+    BIO *bio_data_in = nullptr;
+    BIO *bio_sig_in = nullptr;
+    bool valid = false;
+
+    bio_sig_in = BIO_new_file(job.output.c_str(), "rb");
+    if (!bio_sig_in) {
+        // Does not exist yet
+        ERR_clear_error();
+        return false;
     }
 
-    private_key = mb::sign::load_private_key_from_file(
-            file_pkcs12, mb::sign::KEY_FORMAT_PKCS12, pass);
-    if (!private_key) {
-        goto error;
+    bio_data_in = BIO_new_file(job.input.c_str(), "rb");
+    if (!bio_data_in
+            || !mb::sign::verify_data(bio_data_in, bio_sig_in, key, &valid)) {
+        valid = false;
     }
 
+    BIO_free(bio_data_in);
+    BIO_free(bio_sig_in);
+    ERR_clear_error();
+
+    return valid;
+}
+
+static bool sign_file(const char *file_input, const char *file_output,
+                      EVP_PKEY *private_key, int version)
+{
+    BIO *bio_data_in = nullptr;
+    BIO *bio_sig_out = nullptr;
+    bool ret;
+
     bio_data_in = BIO_new_file(file_input, "rb");
     if (!bio_data_in) {
         fprintf(stderr, "%s: Failed to open input file\n", file_input);
         openssl_log_errors();
-        goto error;
+        return false;
     }
     bio_sig_out = BIO_new_file(file_output, "wb");
     if (!bio_sig_out) {
         fprintf(stderr, "%s: Failed to open output file\n", file_output);
         openssl_log_errors();
-        goto error;
+        BIO_free(bio_data_in);
+        return false;
     }
 
-    ret = mb::sign::sign_data(bio_data_in, bio_sig_out, private_key);
-
-    EVP_PKEY_free(private_key);
+    ret = mb::sign::sign_data_with_version(bio_data_in, bio_sig_out,
+                                           private_key, version);
 
     if (!BIO_free(bio_data_in)) {
         fprintf(stderr, "%s: Failed to close input file\n", file_input);
@@ -103,11 +170,147 @@ int main(int argc, char *argv[])
         ret = false;
     }
 
-    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (!ret) {
+        // Don't leave a truncated signature behind
+        remove(file_output);
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Sign all jobs on a pool of worker threads
+ *
+ * Every job is attempted, even after a failure, so that all errors are
+ * reported in one run.
+ */
+static bool run_jobs(const std::vector<SignJob> &jobs, EVP_PKEY *private_key,
+                     int version, bool force, unsigned int threads)
+{
+    std::atomic<size_t> next_job(0);
+    std::atomic<size_t> signed_count(0);
+    std::atomic<size_t> failed_count(0);
+
+    auto worker = [&]{
+        size_t i;
+
+        while ((i = next_job++) < jobs.size()) {
+            const SignJob &job = jobs[i];
+
+            if (!force && is_signature_current(job, private_key)) {
+                continue;
+            }
+
+            if (sign_file(job.input.c_str(), job.output.c_str(), private_key,
+                          version)) {
+                ++signed_count;
+            } else {
+                fprintf(stderr, "%s: Failed to sign\n", job.input.c_str());
+                ++failed_count;
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = static_cast<unsigned int>(
+            std::max<size_t>(1, std::min<size_t>(threads, jobs.size())));
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    size_t n_signed = signed_count;
+    size_t n_failed = failed_count;
+
+    printf("Signed %zu file(s), %zu unchanged, %zu failed\n",
+           n_signed, jobs.size() - n_signed - n_failed, n_failed);
+
+    return n_failed == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *file_pkcs12;
+    const char *file_manifest = nullptr;
+    EVP_PKEY *private_key = nullptr;
+    const char *pass;
+    int version = mb::sign::SIGNATURE_VERSION_1;
+    bool force = false;
+    unsigned int threads = 0;
+    std::vector<SignJob> jobs;
+    int i = 1;
+    bool ret;
+
+    ERR_load_crypto_strings();
+    OpenSSL_add_all_algorithms();
+
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; ++i) {
+        if (strcmp(argv[i], "-2") == 0) {
+            version = mb::sign::SIGNATURE_VERSION_2;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            force = true;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            file_manifest = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long n = strtoul(argv[++i], &end, 10);
+            if (*argv[i] == '\0' || *end != '\0' || n > 1024) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            threads = static_cast<unsigned int>(n);
+        } else {
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (file_manifest) {
+        // Only the key file
+        if (argc - i != 1) {
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+        if (!read_manifest(file_manifest, jobs)) {
+            return EXIT_FAILURE;
+        }
+    } else {
+        // Key file followed by one or more (input, output) pairs
+        if (argc - i < 3 || (argc - i) % 2 != 1) {
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+        for (int j = i + 1; j < argc; j += 2) {
+            jobs.push_back({ argv[j], argv[j + 1] });
+        }
+    }
+
+    file_pkcs12 = argv[i];
+
+    pass = getenv("MBSIGN_PASSPHRASE");
+    if (!pass) {
+        fprintf(stderr,
+                "The MBSIGN_PASSPHRASE environment variable is not set\n");
+        return EXIT_FAILURE;
+    }
+
+    // The key is only decrypted once for all files
+    private_key = mb::sign::load_private_key_from_file(
+            file_pkcs12, mb::sign::KEY_FORMAT_PKCS12, pass);
+    if (!private_key) {
+        return EXIT_FAILURE;
+    }
+
+    ret = run_jobs(jobs, private_key, version, force, threads);
 
-error:
     EVP_PKEY_free(private_key);
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_out);
-    return EXIT_FAILURE;
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }